@@ -391,8 +391,9 @@ This plugin provides an experimental M3UA/SCCP/TCAP/MAP stack for the FreeRADIUS
 Summary: YubiCloud support for FreeRADIUS
 Group: System Environment/Daemons
 Requires: %{name}%{?_isa} = %{version}-%{release}
-Requires: ykclient >= 2.10
-BuildRequires: ykclient-devel >= 2.10
+Requires: freeradius-libfreeradius-curl = %{version}
+Requires: libyubikey
+BuildRequires: libyubikey-devel
 
 %description yubikey
 This plugin provides YubiCloud support for the FreeRADIUS server project.
@@ -1,9 +1,12 @@
 SUBMAKEFILES := \
     radclient.mk \
+    radperf.mk \
+    radtrace.mk \
     radict.mk \
     radiusd.mk \
     radsniff.mk \
     radwho.mk \
+    raddetail.mk \
     radsnmp.mk \
     radlast.mk \
     radtest.mk \
@@ -41,4 +44,10 @@ endef
 PROTOCOLS = radius dhcpv4 dhcpv6
 
 $(foreach X,${PROTOCOLS},$(eval $(call FUZZ_PROTOCOL,${X})))
+else
+#
+#  libFuzzer provides its own main(), so the replay tool can only be
+#  built when we're not fuzzing.
+#
+SUBMAKEFILES += fuzzer_replay.mk
 endif
@@ -264,6 +264,13 @@ rs_stats_tmpl_t *rs_stats_collectd_init_latency(TALLOC_CTX *ctx, rs_stats_tmpl_t
 		{ NULL, 0, NULL, NULL }
 	};
 
+	rs_stats_value_tmpl_t const _latency_pct[] = {
+		{ &stats->interval.latency_p50, LCC_TYPE_GAUGE, _copy_double_to_double, NULL },
+		{ &stats->interval.latency_p90, LCC_TYPE_GAUGE, _copy_double_to_double, NULL },
+		{ &stats->interval.latency_p99, LCC_TYPE_GAUGE, _copy_double_to_double, NULL },
+		{ NULL, 0, NULL, NULL }
+	};
+
 #define INIT_STATS(_ti, _v) do {\
 		strlcpy(buffer, fr_packet_codes[code], sizeof(buffer)); \
 		for (p = buffer; *p; ++p) *p = tolower(*p);\
@@ -279,6 +286,7 @@ rs_stats_tmpl_t *rs_stats_collectd_init_latency(TALLOC_CTX *ctx, rs_stats_tmpl_t
 
 	INIT_STATS("radius_count", _packet_count);
 	INIT_STATS("radius_latency", _latency);
+	INIT_STATS("radius_latency_pct", _latency_pct);
 
 	for (i = 0; i < (RS_RETRANSMIT_MAX + 1); i++) {
 		rtx[i].src = &stats->interval.rt[i];
@@ -39,6 +39,15 @@ static void *decode_ctx = NULL;
 static fr_test_point_proto_decode_t *tp = NULL;
 static fr_dict_t *dict = NULL;
 
+/*
+ *	Limits on the cost of decoding one input.  When either is
+ *	exceeded, the fuzzer aborts, so that libFuzzer saves the input
+ *	and can minimise it with -minimize_crash=1.
+ */
+static size_t max_allocs = 0;
+static fr_time_delta_t max_time = 0;
+static bool verbose = false;
+
 int LLVMFuzzerInitialize(int *argc, char ***argv);
 int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len);
 
@@ -86,6 +95,19 @@ int LLVMFuzzerInitialize(int *argc, char ***argv)
 
 	if (!dict_dir) dict_dir = DICTDIR;
 
+	/*
+	 *	Allocation counts are repeatable, times aren't, so
+	 *	the time limit should be generous.
+	 */
+	if (getenv("FR_FUZZ_MAX_ALLOCS")) max_allocs = strtoul(getenv("FR_FUZZ_MAX_ALLOCS"), NULL, 10);
+	if (getenv("FR_FUZZ_MAX_USEC")) max_time = fr_time_delta_from_usec(strtoul(getenv("FR_FUZZ_MAX_USEC"), NULL, 10));
+	verbose = (getenv("FR_FUZZ_VERBOSE") != NULL);
+
+	if (fr_time_start() < 0) {
+		fr_perror("fuzzer");
+		fr_exit_now(1);
+	}
+
 	if (!fr_dict_global_ctx_init(NULL, dict_dir)) {
 		fr_perror("dict_global");
 		return 0;
@@ -142,11 +164,35 @@ int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len)
 {
 	TALLOC_CTX *ctx = talloc_init_const("fuzzer");
 	VALUE_PAIR *vp = NULL;
+	fr_time_t start;
+	fr_time_delta_t elapsed;
+	size_t allocs;
 
 	if (!init) LLVMFuzzerInitialize(NULL, NULL);
 
+	start = fr_time();
 	tp->func(ctx, &vp, buf, len, decode_ctx);
+	elapsed = fr_time() - start;
+
+	/*
+	 *	Everything the decoder returns is parented by ctx,
+	 *	so the number of blocks under it is a repeatable
+	 *	measure of how much work the decoder did.
+	 */
+	allocs = talloc_total_blocks(ctx) - 1;
 	talloc_free(ctx);
 
+	if (verbose) {
+		fprintf(stderr, "fuzzer: %zu bytes, %zu allocations, %" PRId64 "us\n",
+			len, allocs, fr_time_delta_to_usec(elapsed));
+	}
+
+	if ((max_allocs && (allocs > max_allocs)) || (max_time && (elapsed > max_time))) {
+		fprintf(stderr, "fuzzer: Input of %zu bytes is too expensive to decode, "
+			"%zu allocations (limit %zu), %" PRId64 "us (limit %" PRId64 "us)\n",
+			len, allocs, max_allocs, fr_time_delta_to_usec(elapsed), fr_time_delta_to_usec(max_time));
+		abort();
+	}
+
 	return 0;
 }
@@ -9,6 +9,17 @@
 #
 #  ./build/make/jlibtool --mode=execute ./build/bin/local/fuzzer_radius -max_len=256 -D ./share/dictionary/ path/to/corpus/directory/
 #
+#  To look for inputs which are slow to decode, rather than ones which
+#  crash the decoder, set FR_FUZZ_MAX_ALLOCS and/or FR_FUZZ_MAX_USEC.
+#  Any input which leaves more allocations, or takes longer to decode,
+#  is treated as a crash.  It can then be minimised with:
+#
+#  FR_FUZZ_MAX_ALLOCS=1000 ./build/make/jlibtool --mode=execute ./build/bin/local/fuzzer_radius \
+#	-D ./share/dictionary/ -minimize_crash=1 -runs=10000 crash-<hash>
+#
+#  The minimised input should be added to src/tests/fuzzer/<protocol>/,
+#  where "make test.fuzzer" checks that it stays within the limits.
+#
 
 #
 #  The libraries to be fuzzed MUST be explicitly linked to the protocol libraries.
@@ -0,0 +1,170 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/bin/fuzzer_replay.c
+ * @brief Run a fuzzer corpus through a protocol decoder, without libFuzzer.
+ *
+ * This lets "make test" check that the inputs in the slow corpus can
+ * still be decoded within their limits, on builds which aren't
+ * instrumented for fuzzing.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/base.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len);
+
+static bool verbose = false;
+
+static NEVER_RETURNS void usage(void)
+{
+	fprintf(stderr, "Usage: fuzzer_replay [options] (file|directory) ...\n");
+	fprintf(stderr, "  -a <allocs>     Fail if an input leaves more than this many allocations.\n");
+	fprintf(stderr, "  -D <dictdir>    Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -h              Print this help message.\n");
+	fprintf(stderr, "  -p <protocol>   The protocol to decode.\n");
+	fprintf(stderr, "  -t <usec>       Fail if an input takes longer than this to decode.\n");
+	fprintf(stderr, "  -v              Print the cost of decoding each input.\n");
+
+	fr_exit_now(EXIT_FAILURE);
+}
+
+static int replay_file(char const *filename)
+{
+	FILE	*fp;
+	uint8_t	*buffer;
+	size_t	len;
+	struct stat st;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "fuzzer_replay: Failed opening %s: %s\n", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fileno(fp), &st) < 0) {
+		fprintf(stderr, "fuzzer_replay: Failed reading %s: %s\n", filename, fr_syserror(errno));
+		fclose(fp);
+		return -1;
+	}
+
+	MEM(buffer = talloc_array(NULL, uint8_t, st.st_size ? st.st_size : 1));
+	len = fread(buffer, 1, st.st_size, fp);
+	fclose(fp);
+
+	if (verbose) fprintf(stderr, "fuzzer_replay: %s\n", filename);
+
+	(void) LLVMFuzzerTestOneInput(buffer, len);
+	talloc_free(buffer);
+
+	return 0;
+}
+
+static int replay(char const *path)
+{
+	DIR		*dir;
+	struct dirent	*dp;
+	struct stat	st;
+	char		buffer[PATH_MAX];
+
+	if (stat(path, &st) < 0) {
+		fprintf(stderr, "fuzzer_replay: Failed reading %s: %s\n", path, fr_syserror(errno));
+		return -1;
+	}
+
+	if (!S_ISDIR(st.st_mode)) return replay_file(path);
+
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "fuzzer_replay: Failed opening %s: %s\n", path, fr_syserror(errno));
+		return -1;
+	}
+
+	while ((dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] == '.') continue;
+
+		snprintf(buffer, sizeof(buffer), "%s/%s", path, dp->d_name);
+		if (replay_file(buffer) < 0) {
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int	c, i;
+	int	fuzz_argc = 1;
+
+	while ((c = getopt(argc, argv, "a:D:hp:t:v")) != -1) switch (c) {
+		case 'a':
+			setenv("FR_FUZZ_MAX_ALLOCS", optarg, 1);
+			break;
+
+		case 'D':
+			setenv("FR_DICTIONARY_DIR", optarg, 1);
+			break;
+
+		case 'p':
+			setenv("FR_LIBRARY_FUZZ_PROTOCOL", optarg, 1);
+			break;
+
+		case 't':
+			setenv("FR_FUZZ_MAX_USEC", optarg, 1);
+			break;
+
+		case 'v':
+			setenv("FR_FUZZ_VERBOSE", "yes", 1);
+			verbose = true;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (!getenv("FR_LIBRARY_FUZZ_PROTOCOL")) usage();
+	if (optind >= argc) usage();
+
+	/*
+	 *	Everything has been passed through the environment,
+	 *	so the fuzzer doesn't need to see any arguments.
+	 */
+	if (!LLVMFuzzerInitialize(&fuzz_argc, &argv)) fr_exit_now(EXIT_FAILURE);
+
+	for (i = optind; i < argc; i++) {
+		if (replay(argv[i]) < 0) fr_exit_now(EXIT_FAILURE);
+	}
+
+	return EXIT_SUCCESS;
+}
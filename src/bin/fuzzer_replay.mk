@@ -0,0 +1,10 @@
+#
+#  Runs the protocol decoders over a corpus, in the same way as the
+#  fuzzer, but without needing libFuzzer.  The protocol libraries are
+#  loaded dynamically, as with unit_test_attribute.
+#
+TARGET		:= fuzzer_replay
+SOURCES		:= fuzzer_replay.c fuzzer.c
+
+TGT_PREREQS	:= libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
@@ -105,6 +105,7 @@ static fr_dict_attr_t const *attr_packet_src_port;
 static fr_dict_attr_t const *attr_radclient_test_name;
 static fr_dict_attr_t const *attr_request_authenticator;
 
+static fr_dict_attr_t const *attr_chap_challenge;
 static fr_dict_attr_t const *attr_chap_password;
 static fr_dict_attr_t const *attr_packet_type;
 static fr_dict_attr_t const *attr_user_password;
@@ -125,6 +126,7 @@ fr_dict_attr_autoload_t radclient_dict_attr[] = {
 	{ .out = &attr_radclient_test_name, .name = "Radclient-Test-Name", .type = FR_TYPE_STRING, .dict = &dict_freeradius },
 	{ .out = &attr_request_authenticator, .name = "Request-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_freeradius },
 
+	{ .out = &attr_chap_challenge, .name = "CHAP-Challenge", .type = FR_TYPE_OCTETS, .dict = &dict_radius },
 	{ .out = &attr_chap_password, .name = "CHAP-Password", .type = FR_TYPE_OCTETS, .dict = &dict_radius },
 	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ .out = &attr_user_password, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius },
@@ -147,6 +149,7 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -F                     Print the file name, packet number and reply code.\n");
 	fprintf(stderr, "  -h                     Print usage help information.\n");
 	fprintf(stderr, "  -i <id>                Set request id to 'id'.  Values may be 0..255\n");
+	fprintf(stderr, "  -k <sockets>           Number of sockets each load thread uses (defaults to 1).\n");
 	fprintf(stderr, "  -n <num>               Send N requests/s\n");
 	fprintf(stderr, "  -p <num>               Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -P <proto>             Use proto (tcp or udp) for transport.\n");
@@ -154,6 +157,8 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -s                     Print out summary information of auth results.\n");
 	fprintf(stderr, "  -S <file>              read secret from file, not command line.\n");
 	fprintf(stderr, "  -t <timeout>           Wait 'timeout' seconds before retrying (may be a floating point number).\n");
+	fprintf(stderr, "  -T <threads>           Load mode.  Send packets from <threads> threads, as fast as possible\n");
+	fprintf(stderr, "                         or at the rate given by -n, and print a latency report.\n");
 	fprintf(stderr, "  -v                     Show program version information.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
@@ -1097,6 +1102,558 @@ packet_done:
 	return 0;
 }
 
+/*
+ *	Load mode.
+ *
+ *	Each thread runs its own event loop, with its own sockets
+ *	and ID spaces.  Packets are encoded directly from the
+ *	requests we read in, queued, and written with one
+ *	sendmmsg() per socket per tick.  Responses are read with
+ *	recvmmsg().
+ */
+static int load_threads = 0;
+static int load_sockets = 1;
+
+static inline unsigned int rc_hist_index(uint64_t usec)
+{
+	unsigned int shift;
+
+	if (usec < (1 << RC_HIST_SUB_BITS)) return usec;
+	if (usec >= (UINT64_C(1) << RC_HIST_MAX_BITS)) return RC_HIST_BUCKETS - 1;
+
+	shift = (63 - __builtin_clzll(usec)) - (RC_HIST_SUB_BITS - 1);
+
+	return (shift * RC_HIST_HALF) + (usec >> shift);
+}
+
+static inline uint64_t rc_hist_value(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < (1 << RC_HIST_SUB_BITS)) return idx;
+
+	shift = (idx / RC_HIST_HALF) - 1;
+
+	return ((uint64_t)(idx - (shift * RC_HIST_HALF) + 1) << shift) - 1;
+}
+
+static uint64_t rc_hist_quantile(uint64_t const hist[], uint64_t count, double q)
+{
+	uint64_t	want, seen = 0;
+	unsigned int	i;
+
+	want = q * count;
+	if ((want < (q * count)) || (want == 0)) want++;
+
+	for (i = 0; i < RC_HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= want) break;
+	}
+	if (i == RC_HIST_BUCKETS) i--;
+
+	return rc_hist_value(i);
+}
+
+/** Do the per-packet password handling once, so packets can be encoded straight from the request
+ *
+ * CHAP-Password is normally calculated from the Request Authenticator,
+ * which changes for every packet.  Add a CHAP-Challenge so it doesn't.
+ */
+static int rc_load_prepare(rc_request_t *request)
+{
+	VALUE_PAIR *vp;
+
+	if (request->packet->dst_ipaddr.af == AF_UNSPEC) {
+		request->packet->dst_ipaddr = server_ipaddr;
+		request->packet->dst_port = server_port;
+	}
+
+	if (!request->password) return 0;
+
+	if ((vp = fr_pair_find_by_da(request->packet->vps, attr_user_password, TAG_ANY)) != NULL) {
+		fr_pair_value_strdup(vp, request->password->vp_strvalue);
+
+	} else if ((vp = fr_pair_find_by_da(request->packet->vps, attr_chap_password, TAG_ANY)) != NULL) {
+		uint8_t		buffer[17];
+		uint8_t		challenge[RADIUS_AUTH_VECTOR_LENGTH];
+		VALUE_PAIR	*chap;
+		size_t		i;
+
+		if (!fr_pair_find_by_da(request->packet->vps, attr_chap_challenge, TAG_ANY)) {
+			for (i = 0; i < sizeof(challenge); i++) challenge[i] = fr_rand();
+
+			MEM(chap = fr_pair_afrom_da(request->packet, attr_chap_challenge));
+			fr_pair_value_memdup(chap, challenge, sizeof(challenge), false);
+			fr_pair_add(&request->packet->vps, chap);
+		}
+
+		fr_radius_encode_chap_password(buffer, request->packet, fr_rand() & 0xff,
+					       request->password->vp_strvalue,
+					       request->password->vp_length);
+		fr_pair_value_memdup(vp, buffer, sizeof(buffer), false);
+
+	} else if (fr_pair_find_by_da(request->packet->vps, attr_ms_chap_password, TAG_ANY) != NULL) {
+		mschapv1_encode(request->packet, &request->packet->vps, request->password->vp_strvalue);
+	}
+
+	return 0;
+}
+
+/** Allocate an ID, trying each of the thread's sockets in turn
+ *
+ */
+static rc_load_slot_t *rc_load_slot_alloc(rc_load_thread_t *t)
+{
+	int i, j;
+
+	for (i = 0; i < t->num_socks; i++) {
+		rc_load_sock_t *sock = &t->socks[(t->next_sock + i) % t->num_socks];
+
+		if (!sock->free_ids) continue;
+
+		for (j = 0; j < 256; j++) {
+			rc_load_slot_t *slot = &sock->slot[(uint8_t)(sock->next_id + j)];
+
+			if (slot->in_use) continue;
+
+			sock->next_id += j + 1;
+			sock->free_ids--;
+			t->next_sock = (t->next_sock + i + 1) % t->num_socks;
+
+			slot->in_use = true;
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+static void rc_load_slot_free(rc_load_thread_t *t, rc_load_slot_t *slot)
+{
+	fr_dlist_remove(&t->outstanding, slot);
+	slot->in_use = false;
+	slot->request = NULL;
+	slot->sock->free_ids++;
+	t->in_flight--;
+}
+
+/** Queue a packet, which is written when the socket's batch is flushed
+ *
+ */
+static int rc_load_queue(rc_load_slot_t *slot)
+{
+	RADIUS_PACKET *packet = slot->request->packet;
+
+	if (udp_send_batch_add(slot->sock->send, slot->sock->fd, slot->data, slot->data_len, 0,
+			       &packet->src_ipaddr, packet->src_port, -1,
+			       &packet->dst_ipaddr, packet->dst_port) < 0) {
+		ERROR("Failed queueing packet: %s", fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Encode and queue the next request
+ *
+ */
+static int rc_load_send(rc_load_thread_t *t, rc_load_slot_t *slot, fr_time_t now)
+{
+	rc_request_t	*request = t->next;
+	uint8_t		id = slot - slot->sock->slot;
+	ssize_t		slen;
+	size_t		i;
+
+	t->next = request->next ? request->next : request_head;
+
+	/*
+	 *	The encoder uses whatever's in the buffer as the
+	 *	Request Authenticator for Access-Requests.
+	 */
+	for (i = 0; i < RADIUS_AUTH_VECTOR_LENGTH; i += sizeof(uint32_t)) {
+		uint32_t r = fr_rand();
+
+		memcpy(slot->data + 4 + i, &r, sizeof(r));
+	}
+
+	slen = fr_radius_encode(slot->data, RADIUS_MAX_PACKET_SIZE, NULL, secret, talloc_array_length(secret) - 1,
+				request->packet->code, id, request->packet->vps);
+	if ((slen < 0) ||
+	    (fr_radius_sign(slot->data, NULL, (uint8_t const *) secret, talloc_array_length(secret) - 1) < 0)) {
+		ERROR("Failed encoding packet: %s", fr_strerror());
+		slot->in_use = false;
+		slot->sock->free_ids++;
+		return -1;
+	}
+
+	slot->request = request;
+	slot->data_len = slen;
+	slot->sent = slot->last = now;
+	slot->tries = 1;
+
+	fr_dlist_insert_tail(&t->outstanding, slot);
+	t->in_flight++;
+	t->sent++;
+
+	return rc_load_queue(slot);
+}
+
+/** Record a response
+ *
+ */
+static void rc_load_response(rc_load_thread_t *t, rc_load_slot_t *slot, uint8_t const *data, size_t data_len,
+			     fr_time_t when)
+{
+	rc_request_t	*request = slot->request;
+	uint64_t	usec;
+	unsigned int	code = data[0];
+
+	usec = fr_time_delta_to_usec(when - slot->sent);
+	if (!t->latency_min || (usec < t->latency_min)) t->latency_min = usec;
+	if (usec > t->latency_max) t->latency_max = usec;
+	t->latency_sum += usec;
+	t->hist[rc_hist_index(usec)]++;
+
+	switch (code) {
+	case FR_CODE_ACCESS_ACCEPT:
+	case FR_CODE_ACCOUNTING_RESPONSE:
+	case FR_CODE_COA_ACK:
+	case FR_CODE_DISCONNECT_ACK:
+		t->stats.accepted++;
+		break;
+
+	case FR_CODE_ACCESS_CHALLENGE:
+		break;
+
+	default:
+		t->stats.rejected++;
+	}
+
+	if ((request->filter_code != FR_CODE_UNDEFINED) && (code != request->filter_code)) {
+		t->stats.failed++;
+
+	} else if (!request->filter) {
+		t->stats.passed++;
+
+	} else {
+		VALUE_PAIR		*vps = NULL;
+		VALUE_PAIR const	*failed[2];
+
+		/*
+		 *	Only decode if we have to.
+		 */
+		if (fr_radius_decode(t, data, data_len, slot->data, secret, talloc_array_length(secret) - 1,
+				     &vps) < 0) {
+			t->stats.failed++;
+		} else {
+			fr_pair_list_sort(&vps, fr_pair_cmp_by_da_tag);
+			if (fr_pair_validate(failed, request->filter, vps)) {
+				t->stats.passed++;
+			} else {
+				t->stats.failed++;
+			}
+		}
+		fr_pair_list_free(&vps);
+	}
+
+	rc_load_slot_free(t, slot);
+}
+
+static void rc_load_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rc_load_sock_t		*sock = uctx;
+	rc_load_thread_t	*t = sock->thread;
+	uint8_t			buffer[RADIUS_MAX_PACKET_SIZE];
+	fr_ipaddr_t		src_ipaddr;
+	uint16_t		src_port;
+	fr_time_t		when;
+	ssize_t			slen;
+
+	while ((slen = udp_recv_batch(sock->recv, fd, buffer, sizeof(buffer), 0,
+				      &src_ipaddr, &src_port, NULL, NULL, NULL, &when)) > 0) {
+		rc_load_slot_t	*slot;
+		size_t		packet_len = slen;
+
+		if (!fr_radius_ok(buffer, &packet_len, RADIUS_MAX_ATTRIBUTES, false, NULL)) {
+			t->unexpected++;
+			continue;
+		}
+
+		slot = &sock->slot[buffer[1]];
+		if (!slot->in_use ||
+		    (fr_radius_verify(buffer, slot->data,
+				      (uint8_t const *) secret, talloc_array_length(secret) - 1) < 0)) {
+			t->unexpected++;
+			continue;
+		}
+
+		rc_load_response(t, slot, buffer, packet_len, when ? when : fr_time());
+	}
+}
+
+static void rc_load_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	rc_load_sock_t *sock = uctx;
+
+	ERROR("Load thread %i socket error: %s", sock->thread->id, fr_syserror(fd_errno));
+	fr_event_loop_exit(sock->thread->el, 1);
+}
+
+/** Send packets we have tokens for, and deal with packets which have timed out
+ *
+ */
+static void rc_load_tick(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	rc_load_thread_t	*t = uctx;
+	rc_load_slot_t		*slot;
+	int			i;
+
+	if (t->rate) {
+		t->tokens += t->rate * ((double) (now - t->last_tick) / NSEC);
+
+		/*
+		 *	Don't burst for more than 10ms if we
+		 *	fell behind.
+		 */
+		if (t->tokens > ((t->rate / 100) + 1)) t->tokens = (t->rate / 100) + 1;
+	}
+	t->last_tick = now;
+
+	while ((slot = fr_dlist_head(&t->outstanding)) && ((now - slot->last) >= timeout)) {
+		if (slot->tries >= retries) {
+			t->stats.lost++;
+			rc_load_slot_free(t, slot);
+			continue;
+		}
+
+		fr_dlist_remove(&t->outstanding, slot);
+		slot->tries++;
+		slot->last = now;
+		fr_dlist_insert_tail(&t->outstanding, slot);
+		t->retransmits++;
+
+		if (rc_load_queue(slot) < 0) goto error;
+	}
+
+	while ((t->sent < t->to_send) && (t->in_flight < t->max_in_flight) &&
+	       (!t->rate || (t->tokens >= 1))) {
+		slot = rc_load_slot_alloc(t);
+		if (!slot) break;
+
+		if (rc_load_send(t, slot, now) < 0) goto error;
+		if (t->rate) t->tokens--;
+	}
+
+	for (i = 0; i < t->num_socks; i++) (void) udp_send_batch_flush(t->socks[i].send, t->socks[i].fd);
+
+	if ((t->sent == t->to_send) && !t->in_flight) {
+		fr_event_loop_exit(el, 0);
+		return;
+	}
+
+	if (fr_event_timer_in(t, el, &t->tick, fr_time_delta_from_msec(RC_LOAD_TICK), rc_load_tick, t) < 0) {
+		ERROR("Failed inserting load tick event: %s", fr_strerror());
+	error:
+		fr_event_loop_exit(el, 1);
+	}
+}
+
+static void *rc_load_thread(void *arg)
+{
+	rc_load_thread_t	*t = arg;
+	int			i;
+
+	t->el = fr_event_list_alloc(t, NULL, NULL);
+	if (!t->el) {
+		ERROR("Load thread %i failed allocating event list: %s", t->id, fr_strerror());
+		return NULL;
+	}
+
+	for (i = 0; i < t->num_socks; i++) {
+		if (fr_event_fd_insert(t, t->el, t->socks[i].fd, rc_load_read, NULL, rc_load_error,
+				       &t->socks[i]) < 0) {
+			ERROR("Load thread %i failed inserting socket: %s", t->id, fr_strerror());
+			return NULL;
+		}
+	}
+
+	t->last_tick = fr_time();
+	rc_load_tick(t->el, t->last_tick, t);
+
+	if (fr_event_loop(t->el) != 0) ERROR("Load thread %i exited with an error", t->id);
+
+	for (i = 0; i < t->num_socks; i++) (void) fr_event_fd_delete(t->el, t->socks[i].fd, FR_EVENT_FILTER_IO);
+
+	return NULL;
+}
+
+/** Open the sockets for a load thread
+ *
+ */
+static int rc_load_thread_init(rc_load_thread_t *t)
+{
+	int i, j;
+
+	fr_dlist_init(&t->outstanding, rc_load_slot_t, entry);
+	t->next = request_head;
+
+	MEM(t->socks = talloc_zero_array(t, rc_load_sock_t, t->num_socks));
+	for (i = 0; i < t->num_socks; i++) {
+		rc_load_sock_t	*sock = &t->socks[i];
+		uint16_t	port = 0;
+
+		sock->thread = t;
+		sock->free_ids = 256;
+
+		sock->fd = fr_socket_server_udp(&client_ipaddr, &port, NULL, true);
+		if (sock->fd < 0) {
+			fr_perror("Error opening socket");
+			return -1;
+		}
+
+		if (fr_socket_bind(sock->fd, &client_ipaddr, &port, NULL) < 0) {
+			fr_perror("Error binding socket");
+			return -1;
+		}
+
+		MEM(sock->send = udp_send_batch_alloc(t, RC_LOAD_BATCH, RADIUS_MAX_PACKET_SIZE));
+		MEM(sock->recv = udp_recv_batch_alloc(t, RC_LOAD_BATCH, RADIUS_MAX_PACKET_SIZE));
+
+		for (j = 0; j < 256; j++) {
+			sock->slot[j].sock = sock;
+			MEM(sock->slot[j].data = talloc_zero_array(t, uint8_t, RADIUS_MAX_PACKET_SIZE));
+		}
+	}
+
+	return 0;
+}
+
+/** Send every request "resend_count" times, spread over a number of threads
+ *
+ * @param[in] persec	total packets per second, 0 for as fast as possible.
+ * @param[in] parallel	maximum outstanding packets per thread, 0 to use every ID on every socket.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rc_load_run(int persec, int parallel)
+{
+	rc_load_thread_t	**threads;
+	rc_request_t		*this;
+	uint64_t		num = 0, total, count = 0, latency_sum = 0, latency_min = 0, latency_max = 0;
+	uint64_t		sent = 0, retransmits = 0, unexpected = 0;
+	uint64_t		hist[RC_HIST_BUCKETS] = { 0 };
+	fr_time_t		start;
+	double			elapsed;
+	int			i, rcode = 0;
+	unsigned int		j;
+
+	for (this = request_head; this != NULL; this = this->next) {
+		if (rc_load_prepare(this) < 0) return -1;
+		num++;
+	}
+	total = num * resend_count;
+
+	/*
+	 *	Each thread allocates under its own context.
+	 */
+	MEM(threads = talloc_zero_array(NULL, rc_load_thread_t *, load_threads));
+	for (i = 0; i < load_threads; i++) {
+		rc_load_thread_t *t;
+
+		MEM(t = threads[i] = talloc_zero(threads, rc_load_thread_t));
+
+		t->id = i;
+		t->num_socks = load_sockets;
+		t->to_send = (total / load_threads) + (((uint64_t) i < (total % load_threads)) ? 1 : 0);
+		t->max_in_flight = parallel ? (uint64_t) parallel : (uint64_t) load_sockets * 256;
+		t->rate = (double) persec / load_threads;
+
+		if (rc_load_thread_init(t) < 0) {
+			rcode = -1;
+			goto finish;
+		}
+	}
+
+	start = fr_time();
+	for (i = 0; i < load_threads; i++) {
+		if (pthread_create(&threads[i]->thread, NULL, rc_load_thread, threads[i]) != 0) {
+			ERROR("Failed creating load thread: %s", fr_syserror(errno));
+			rcode = -1;
+			break;
+		}
+		threads[i]->running = true;
+	}
+
+	for (i = 0; i < load_threads; i++) {
+		if (threads[i]->running) pthread_join(threads[i]->thread, NULL);
+	}
+	elapsed = (double) (fr_time() - start) / NSEC;
+
+	for (i = 0; i < load_threads; i++) {
+		rc_load_thread_t *t = threads[i];
+
+		stats.accepted += t->stats.accepted;
+		stats.rejected += t->stats.rejected;
+		stats.lost += t->stats.lost;
+		stats.passed += t->stats.passed;
+		stats.failed += t->stats.failed;
+
+		sent += t->sent;
+		retransmits += t->retransmits;
+		unexpected += t->unexpected;
+		latency_sum += t->latency_sum;
+		if (t->latency_min && (!latency_min || (t->latency_min < latency_min))) latency_min = t->latency_min;
+		if (t->latency_max > latency_max) latency_max = t->latency_max;
+
+		for (j = 0; j < RC_HIST_BUCKETS; j++) {
+			hist[j] += t->hist[j];
+			count += t->hist[j];
+		}
+	}
+
+	fprintf(fr_log_fp, "Load summary:\n"
+		"\tThreads       : %i (%i sockets each)\n"
+		"\tDuration      : %.3fs\n"
+		"\tSent          : %" PRIu64 " (%.1f/s)\n"
+		"\tReceived      : %" PRIu64 " (%.1f/s)\n"
+		"\tRetransmits   : %" PRIu64 "\n"
+		"\tLost          : %" PRIu64 "\n"
+		"\tUnexpected    : %" PRIu64 "\n",
+		load_threads, load_sockets, elapsed,
+		sent, elapsed ? sent / elapsed : 0, count, elapsed ? count / elapsed : 0,
+		retransmits, stats.lost, unexpected);
+
+	if (count) {
+		fprintf(fr_log_fp, "Latency:\n"
+			"\tMin           : %.3fms\n"
+			"\tAverage       : %.3fms\n"
+			"\tMax           : %.3fms\n"
+			"\tP50           : %.3fms\n"
+			"\tP90           : %.3fms\n"
+			"\tP99           : %.3fms\n"
+			"\tP99.9         : %.3fms\n",
+			latency_min / 1000.0, ((double) latency_sum / count) / 1000.0, latency_max / 1000.0,
+			rc_hist_quantile(hist, count, 0.5) / 1000.0,
+			rc_hist_quantile(hist, count, 0.9) / 1000.0,
+			rc_hist_quantile(hist, count, 0.99) / 1000.0,
+			rc_hist_quantile(hist, count, 0.999) / 1000.0);
+	}
+
+finish:
+	for (i = 0; i < load_threads; i++) {
+		int k;
+
+		if (!threads[i] || !threads[i]->socks) continue;
+		for (k = 0; k < threads[i]->num_socks; k++) {
+			if (threads[i]->socks[k].fd > 0) close(threads[i]->socks[k].fd);
+		}
+	}
+	talloc_free(threads);
+
+	return rcode;
+}
+
 int main(int argc, char **argv)
 {
 	int		c;
@@ -1149,7 +1706,7 @@ int main(int argc, char **argv)
 	default_log.fd = STDOUT_FILENO;
 	default_log.print_level = false;
 
-	while ((c = getopt(argc, argv, "46c:C:d:D:f:Fhi:n:p:P:r:sS:t:vx")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "46c:C:d:D:f:Fhi:k:n:p:P:r:sS:t:T:vx")) != -1) switch (c) {
 		case '4':
 			force_af = AF_INET;
 			break;
@@ -1219,6 +1776,11 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'k':
+			load_sockets = atoi(optarg);
+			if ((load_sockets <= 0) || (load_sockets > RC_LOAD_SOCKETS_MAX)) usage();
+			break;
+
 		case 'n':
 			persec = atoi(optarg);
 			if (persec <= 0) usage();
@@ -1293,6 +1855,11 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'T':
+			load_threads = atoi(optarg);
+			if ((load_threads <= 0) || (load_threads > RC_LOAD_THREADS_MAX)) usage();
+			break;
+
 		case 'v':
 			fr_debug_lvl = 1;
 			DEBUG("%s", radclient_version);
@@ -1314,6 +1881,11 @@ int main(int argc, char **argv)
 		ERROR("Insufficient arguments");
 		usage();
 	}
+
+	if (load_threads && (ipproto == IPPROTO_TCP)) {
+		ERROR("Load mode (-T) only supports UDP");
+		usage();
+	}
 	/*
 	 *	Mismatch between the binary and the libraries it depends on
 	 */
@@ -1466,6 +2038,15 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 *	Load mode replaces the loop below.  -p limits the
+	 *	number of packets each thread has outstanding.
+	 */
+	if (load_threads) {
+		if (rc_load_run(persec, (parallel > 1) ? parallel : 0) < 0) fr_exit_now(1);
+		goto finish;
+	}
+
 	/*
 	 *	Walk over the packets to send, until
 	 *	we're all done.
@@ -1599,6 +2180,7 @@ int main(int argc, char **argv)
 		}
 	} while (!done);
 
+finish:
 	talloc_free(filename_tree);
 
 	fr_packet_list_free(packet_list);
@@ -26,6 +26,8 @@
 RCSIDH(radclient_h, "$Id$")
 
 #include <freeradius-devel/util/base.h>
+#include <freeradius-devel/util/event.h>
+#include <pthread.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -89,6 +91,94 @@ struct rc_request {
 	char const	*name;		//!< Test name (as specified in the request).
 };
 
+/*
+ *	Load mode
+ */
+#define RC_LOAD_TICK		1		//!< How often (ms) load threads send packets and check for
+						//!< timeouts.
+#define RC_LOAD_BATCH		64		//!< Maximum packets sent or read per system call.
+#define RC_LOAD_THREADS_MAX	64		//!< Maximum number of load threads.
+#define RC_LOAD_SOCKETS_MAX	64		//!< Maximum number of sockets per load thread.
+#define RC_HIST_SUB_BITS	5		//!< As radsniff, 16 latency buckets per power of two.
+#define RC_HIST_MAX_BITS	27		//!< Latencies of 2^27us (~134s) or more go in the last bucket.
+#define RC_HIST_HALF		(1 << (RC_HIST_SUB_BITS - 1))
+#define RC_HIST_BUCKETS		((RC_HIST_MAX_BITS - RC_HIST_SUB_BITS + 2) * RC_HIST_HALF)
+
+typedef struct rc_load_thread_s rc_load_thread_t;
+typedef struct rc_load_sock_s rc_load_sock_t;
+
+/** A packet we've sent in load mode, and are waiting for a response to
+ *
+ */
+typedef struct {
+	rc_request_t		*request;	//!< The request the packet was created from.
+	rc_load_sock_t		*sock;		//!< Socket the packet was sent on.
+
+	fr_dlist_t		entry;		//!< Entry in the thread's list of outstanding packets,
+						//!< ordered by when they were last sent.
+	bool			in_use;		//!< Whether the ID is allocated.
+
+	fr_time_t		sent;		//!< When the packet was first sent.
+	fr_time_t		last;		//!< When the packet was last sent.
+	int			tries;		//!< Number of times the packet has been sent.
+
+	uint8_t			*data;		//!< Encoded packet.
+	size_t			data_len;	//!< Length of the encoded packet.
+} rc_load_slot_t;
+
+/** A socket used by a load thread, with its own ID space
+ *
+ */
+struct rc_load_sock_s {
+	int			fd;		//!< UDP socket.
+	rc_load_thread_t	*thread;	//!< Thread which owns the socket.
+
+	rc_load_slot_t		slot[256];	//!< Packets indexed by ID.
+	int			free_ids;	//!< Number of IDs which aren't in use.
+	uint8_t			next_id;	//!< Where we start looking for a free ID.
+
+	udp_send_batch_t	*send;		//!< Packets waiting for sendmmsg().
+	udp_recv_batch_t	*recv;		//!< Packets read with recvmmsg().
+};
+
+/** A thread sending packets in load mode
+ *
+ * Each thread has its own event loop, sockets and stats, and only
+ * reads the requests, so threads don't share anything which changes.
+ */
+struct rc_load_thread_s {
+	int			id;		//!< Thread number, for logging.
+	pthread_t		thread;		//!< Thread handle.
+	bool			running;	//!< Whether the thread was started.
+
+	fr_event_list_t		*el;		//!< Event list for the thread.
+	fr_event_timer_t const	*tick;		//!< Sends packets, and handles timeouts.
+
+	rc_load_sock_t		*socks;		//!< Sockets, with their ID spaces.
+	int			num_socks;	//!< Number of sockets.
+	int			next_sock;	//!< Socket we try to allocate an ID from first.
+
+	fr_dlist_head_t		outstanding;	//!< Packets waiting for a response, oldest first.
+	rc_request_t		*next;		//!< Next request to send.
+
+	uint64_t		to_send;	//!< Number of packets this thread sends.
+	uint64_t		sent;		//!< Number of packets sent, excluding retransmissions.
+	uint64_t		in_flight;	//!< Number of packets waiting for a response.
+	uint64_t		max_in_flight;	//!< Maximum number of packets waiting for a response.
+
+	double			rate;		//!< Packets per second, 0 for as fast as possible.
+	double			tokens;		//!< Packets we may send now.
+	fr_time_t		last_tick;	//!< When we last added tokens.
+
+	rc_stats_t		stats;		//!< Results for this thread.
+	uint64_t		retransmits;	//!< Number of retransmissions.
+	uint64_t		unexpected;	//!< Responses which didn't match a request.
+	uint64_t		latency_sum;	//!< Sum of latencies (us).
+	uint64_t		latency_min;	//!< Lowest latency (us).
+	uint64_t		latency_max;	//!< Highest latency (us).
+	uint64_t		hist[RC_HIST_BUCKETS];	//!< Latency histogram.
+};
+
 #ifdef __cplusplus
 }
 #endif
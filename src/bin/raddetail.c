@@ -0,0 +1,561 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/bin/raddetail.c
+ * @brief Convert text detail files to the binary format, and list binary detail files.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
+
+#include <freeradius-devel/util/conf.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static char const *progname = "raddetail";
+
+static fr_dict_t const *dict_freeradius;
+static fr_dict_t const *dict_radius;
+
+extern fr_dict_autoload_t raddetail_dict[];
+fr_dict_autoload_t raddetail_dict[] = {
+	{ .out = &dict_freeradius, .proto = "freeradius" },
+	{ .out = &dict_radius, .proto = "radius" },
+	{ NULL }
+};
+
+/** State for writing a binary detail file
+ *
+ */
+typedef struct {
+	int			fd;			//!< Of the output file.
+	char const		*filename;		//!< Of the output file.
+	off_t			offset;			//!< Where the next block will be written.
+
+	fr_detail_compress_t	compress;		//!< How blocks are stored.
+	int			level;			//!< zstd compression level.
+
+	uint8_t			*records;		//!< Records for the current block.
+	size_t			records_len;		//!< Length of the records.
+	size_t			block_size;		//!< Write a block once records_len reaches this.
+	uint32_t		num_records;		//!< Records in the current block.
+
+	fr_detail_index_t	*index;			//!< One entry for each block written.
+	uint32_t		num_blocks;		//!< Number of blocks written.
+
+	uint64_t		total_records;		//!< For the summary.
+	uint64_t		skipped;		//!< Records which had already been replayed.
+} raddetail_out_t;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "Usage: %s [options] <text-detail-file> <binary-detail-file>\n", progname);
+	fprintf(stderr, "       %s -t [options] <binary-detail-file>\n", progname);
+	fprintf(stderr, "  -b <size>              Records per block, in bytes before compression (defaults to 65536).\n");
+	fprintf(stderr, "  -c <compression>       One of none, or zstd (defaults to none).\n");
+	fprintf(stderr, "  -d <raddb>             Set user dictionary directory (defaults to " RADDBDIR ").\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -h                     Print usage help information.\n");
+	fprintf(stderr, "  -l <level>             zstd compression level, 1 to 19 (defaults to 3).\n");
+	fprintf(stderr, "  -t                     List the blocks of a binary detail file.\n");
+	fprintf(stderr, "  -x                     Increase debug level.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+/** Write out the records gathered so far as one block
+ *
+ */
+static int block_flush(raddetail_out_t *out)
+{
+	uint8_t	*block;
+	ssize_t	slen;
+
+	if (!out->num_records) return 0;
+
+	block = talloc_array(out, uint8_t, fr_detail_block_bound(out->records_len, out->compress));
+	if (!block) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	slen = fr_detail_block_encode(block, talloc_array_length(block), out->records, out->records_len,
+				      out->num_records, out->compress, out->level);
+	if (slen < 0) {
+		talloc_free(block);
+		return -1;
+	}
+
+	if (write(out->fd, block, slen) != slen) {
+		fr_strerror_printf("Failed writing to %s: %s", out->filename, fr_syserror(errno));
+		talloc_free(block);
+		return -1;
+	}
+	talloc_free(block);
+
+	out->index = talloc_realloc(out, out->index, fr_detail_index_t, out->num_blocks + 1);
+	if (!out->index) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	out->index[out->num_blocks].offset = out->offset;
+	out->index[out->num_blocks].num_records = out->num_records;
+	out->num_blocks++;
+
+	DEBUG("Wrote block %u at offset %zu, %u records, %zu bytes of records stored in %zd bytes",
+	      out->num_blocks, (size_t) out->offset, out->num_records, out->records_len, slen);
+
+	out->offset += slen;
+	out->records_len = 0;
+	out->num_records = 0;
+
+	return 0;
+}
+
+/** Encode one text entry, and add it to the current block
+ *
+ */
+static int record_add(raddetail_out_t *out, fr_unix_time_t timestamp, VALUE_PAIR *vps)
+{
+	fr_detail_record_t	rec = {
+					.protocol = fr_dict_root(dict_radius)->attr,
+					.timestamp = timestamp
+				};
+	ssize_t			slen;
+	size_t			room;
+
+	for (;;) {
+		room = talloc_array_length(out->records) - out->records_len;
+
+		slen = fr_detail_record_encode(out->records + out->records_len, room, &rec,
+					       dict_radius, vps, NULL, NULL, NULL);
+		if (slen > 0) break;
+
+		/*
+		 *	Make room, and try again.
+		 */
+		if ((talloc_array_length(out->records) * 2) > FR_DETAIL_BLOCK_MAX) return -1;
+
+		out->records = talloc_realloc(out, out->records, uint8_t, talloc_array_length(out->records) * 2);
+		if (!out->records) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+	}
+
+	out->records_len += slen;
+	out->num_records++;
+	out->total_records++;
+
+	if (out->records_len >= out->block_size) return block_flush(out);
+
+	return 0;
+}
+
+/** Convert a text detail file to a binary one
+ *
+ * Each entry is a header line (the date), followed by tab-indented
+ * "Attribute = value" lines, and ends with a blank line.  Entries
+ * which have already been replayed are skipped.
+ */
+static int detail_convert(raddetail_out_t *out, char const *filename)
+{
+	FILE			*fp;
+	char			buffer[8192];
+	char			*p;
+	VALUE_PAIR		*vps = NULL;
+	fr_unix_time_t		timestamp = 0;
+	bool			in_entry = false, done = false;
+	int			lineno = 0, ret = -1;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		lineno++;
+
+		p = strchr(buffer, '\n');
+		if (!p) {
+			if (!feof(fp)) {
+				fr_strerror_printf("%s[%d]: Line is too long", filename, lineno);
+				goto finish;
+			}
+		} else {
+			*p = '\0';
+		}
+
+		/*
+		 *	A blank line ends the entry.
+		 */
+		if (!buffer[0]) {
+		entry_end:
+			if (in_entry) {
+				if (done) {
+					out->skipped++;
+				} else if (record_add(out, timestamp, vps) < 0) {
+					fr_strerror_printf_push("%s[%d]: Failed encoding entry", filename, lineno);
+					goto finish;
+				}
+			}
+
+			fr_pair_list_free(&vps);
+			timestamp = 0;
+			done = false;
+
+			/*
+			 *	A header line with no blank line before
+			 *	it also starts the next entry.
+			 */
+			in_entry = (buffer[0] != '\0');
+			continue;
+		}
+
+		/*
+		 *	The header line starts an entry.
+		 */
+		if (buffer[0] != '\t') {
+			if (in_entry) goto entry_end;
+			in_entry = true;
+			continue;
+		}
+
+		if (!in_entry || done) continue;
+
+		p = buffer + 1;
+
+		if (strncasecmp(p, "Request-Authenticator", 21) == 0) continue;
+
+		if (strncasecmp(p, "Donestamp", 9) == 0) {
+			done = true;
+			continue;
+		}
+
+		if (strncasecmp(p, "Timestamp = ", 12) == 0) {
+			timestamp = fr_unix_time_from_sec(strtoull(p + 12, NULL, 10));
+			continue;
+		}
+
+		if (fr_pair_list_afrom_str(out, dict_radius, p, &vps) == T_INVALID) {
+			fr_perror("%s: %s[%d]: Ignoring line", progname, filename, lineno);
+		}
+	}
+
+	if (ferror(fp)) {
+		fr_strerror_printf("Failed reading %s: %s", filename, fr_syserror(errno));
+		goto finish;
+	}
+
+	/*
+	 *	The last entry may not have a trailing blank line.
+	 */
+	if (in_entry && !done && (record_add(out, timestamp, vps) < 0)) {
+		fr_strerror_printf_push("%s[%d]: Failed encoding entry", filename, lineno);
+		goto finish;
+	}
+	ret = 0;
+
+finish:
+	fr_pair_list_free(&vps);
+	fclose(fp);
+
+	return ret;
+}
+
+/** Write the block index, and the trailer which points to it
+ *
+ */
+static int index_write(raddetail_out_t *out)
+{
+	uint8_t	*data;
+	size_t	len;
+	ssize_t	slen;
+
+	len = FR_DETAIL_BLOCK_HDR_LEN + (out->num_blocks * FR_DETAIL_INDEX_ENTRY_LEN) + FR_DETAIL_TRAILER_LEN;
+
+	data = talloc_array(out, uint8_t, len);
+	if (!data) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	slen = fr_detail_index_encode(data, len, out->index, out->num_blocks, out->offset);
+	if (slen < 0) {
+		talloc_free(data);
+		return -1;
+	}
+
+	if (write(out->fd, data, slen) != slen) {
+		fr_strerror_printf("Failed writing to %s: %s", out->filename, fr_syserror(errno));
+		talloc_free(data);
+		return -1;
+	}
+	talloc_free(data);
+
+	return 0;
+}
+
+/** Print the blocks of a binary detail file
+ *
+ */
+static int detail_list(TALLOC_CTX *ctx, char const *filename)
+{
+	int			fd, ret = -1;
+	struct stat		buf;
+	uint8_t			hdr[FR_DETAIL_BLOCK_HDR_LEN];
+	fr_detail_block_t	block;
+	fr_detail_index_t	*index = NULL;
+	uint32_t		num_index = 0, num_blocks = 0;
+	uint64_t		index_offset = 0, total = 0, done = 0;
+	off_t			offset, data_end;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &buf) < 0) {
+		fr_strerror_printf("Failed examining %s: %s", filename, fr_syserror(errno));
+		goto finish;
+	}
+
+	if ((pread(fd, hdr, FR_DETAIL_MAGIC_LEN, 0) != FR_DETAIL_MAGIC_LEN) ||
+	    !fr_detail_is_binary(hdr, FR_DETAIL_MAGIC_LEN)) {
+		fr_strerror_printf("%s is not a binary detail file", filename);
+		goto finish;
+	}
+
+	data_end = buf.st_size;
+	switch (fr_detail_index_read(ctx, &index, &num_index, &index_offset, fd, buf.st_size)) {
+	case 1:
+		data_end = index_offset;
+		printf("Index at offset %" PRIu64 " with %u entries\n", index_offset, num_index);
+		break;
+
+	case 0:
+		printf("No index\n");
+		break;
+
+	default:
+		goto finish;
+	}
+
+	printf("%-12s %-6s %-6s %10s %10s %10s\n", "Offset", "Comp", "Flags", "Records", "Raw", "Stored");
+
+	for (offset = 0; offset < data_end; offset += FR_DETAIL_BLOCK_HDR_LEN + block.stored_len) {
+		if ((pread(fd, hdr, sizeof(hdr), offset) != sizeof(hdr)) ||
+		    (fr_detail_block_header_decode(&block, hdr, sizeof(hdr)) <= 0)) {
+			fr_strerror_printf_push("Malformed block at offset %zu", (size_t) offset);
+			goto finish;
+		}
+		if (block.flags & FR_DETAIL_FLAG_INDEX) break;
+
+		printf("%-12zu %-6s %-6s %10u %10u %10u\n", (size_t) offset,
+		       fr_table_str_by_value(fr_detail_compress_table, block.compress, "?"),
+		       (block.flags & FR_DETAIL_FLAG_DONE) ? "done" : "-",
+		       block.num_records, block.raw_len, block.stored_len);
+
+		if ((num_blocks < num_index) &&
+		    ((index[num_blocks].offset != (uint64_t) offset) ||
+		     (index[num_blocks].num_records != block.num_records))) {
+			fprintf(stderr, "%s: Index entry %u does not match the block at offset %zu\n",
+				progname, num_blocks, (size_t) offset);
+		}
+
+		num_blocks++;
+		total += block.num_records;
+		if (block.flags & FR_DETAIL_FLAG_DONE) done += block.num_records;
+	}
+
+	printf("%u blocks, %" PRIu64 " records, %" PRIu64 " in blocks marked done\n", num_blocks, total, done);
+	ret = 0;
+
+finish:
+	talloc_free(index);
+	close(fd);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int			c;
+	char const		*raddb_dir = RADDBDIR;
+	char const		*dict_dir = DICTDIR;
+	bool			list = false;
+	int			ret = EXIT_SUCCESS;
+	TALLOC_CTX		*autofree;
+	raddetail_out_t		*out;
+
+	/*
+	 *	Must be called first, so the handler is called last
+	 */
+	fr_thread_local_atexit_setup();
+
+	autofree = talloc_autofree_context();
+
+#ifndef NDEBUG
+	if (fr_fault_setup(autofree, getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror("%s", progname);
+		fr_exit_now(EXIT_FAILURE);
+	}
+#endif
+
+	talloc_set_log_stderr();
+
+	out = talloc_zero(autofree, raddetail_out_t);
+	out->fd = -1;
+	out->compress = FR_DETAIL_COMPRESS_NONE;
+	out->level = 3;
+	out->block_size = 65536;
+
+	while ((c = getopt(argc, argv, "b:c:d:D:hl:tx")) != -1) switch (c) {
+		case 'b':
+			out->block_size = strtoul(optarg, NULL, 10);
+			if ((out->block_size < 1024) || (out->block_size > (FR_DETAIL_BLOCK_MAX / 2))) {
+				fprintf(stderr, "%s: Block size must be between 1024 and %u\n",
+					progname, FR_DETAIL_BLOCK_MAX / 2);
+				fr_exit_now(EXIT_FAILURE);
+			}
+			break;
+
+		case 'c':
+		{
+			int compress;
+
+			compress = fr_table_value_by_str(fr_detail_compress_table, optarg, -1);
+			if (compress < 0) {
+				fprintf(stderr, "%s: Unknown compression \"%s\"\n", progname, optarg);
+				usage();
+			}
+#ifndef HAVE_ZSTD_H
+			if (compress == FR_DETAIL_COMPRESS_ZSTD) {
+				fprintf(stderr, "%s: zstd compression needs the server to be built with libzstd\n",
+					progname);
+				fr_exit_now(EXIT_FAILURE);
+			}
+#endif
+			out->compress = compress;
+		}
+			break;
+
+		case 'd':
+			raddb_dir = optarg;
+			break;
+
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'l':
+			out->level = atoi(optarg);
+			if ((out->level < 1) || (out->level > 19)) {
+				fprintf(stderr, "%s: Compression level must be between 1 and 19\n", progname);
+				fr_exit_now(EXIT_FAILURE);
+			}
+			break;
+
+		case 't':
+			list = true;
+			break;
+
+		case 'x':
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != (list ? 1 : 2)) usage();
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("%s", progname);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (list) {
+		if (detail_list(autofree, argv[0]) < 0) {
+			fr_perror("%s", progname);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (!fr_dict_global_ctx_init(autofree, dict_dir)) {
+		fr_perror("%s", progname);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (fr_dict_autoload(raddetail_dict) < 0) {
+		fr_perror("%s", progname);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (fr_dict_read(fr_dict_unconst(dict_freeradius), raddb_dir, FR_DICTIONARY_FILE) == -1) {
+		fr_perror("%s", progname);
+		ret = EXIT_FAILURE;
+		goto done;
+	}
+	fr_strerror();	/* Clear the error buffer */
+
+	out->records = talloc_array(out, uint8_t, out->block_size * 2);
+	out->filename = argv[1];
+	out->fd = open(out->filename, O_WRONLY | O_CREAT | O_EXCL, 0640);
+	if (out->fd < 0) {
+		fprintf(stderr, "%s: Failed creating %s: %s\n", progname, out->filename, fr_syserror(errno));
+		ret = EXIT_FAILURE;
+		goto done;
+	}
+
+	if ((detail_convert(out, argv[0]) < 0) || (block_flush(out) < 0) || (index_write(out) < 0) ||
+	    (fsync(out->fd) < 0)) {
+		fr_perror("%s", progname);
+		close(out->fd);
+		unlink(out->filename);
+		ret = EXIT_FAILURE;
+		goto done;
+	}
+	close(out->fd);
+
+	printf("Wrote %" PRIu64 " records in %u blocks, skipped %" PRIu64 " already replayed\n",
+	       out->total_records, out->num_blocks, out->skipped);
+
+done:
+	fr_dict_autofree(raddetail_dict);
+
+	return ret;
+}
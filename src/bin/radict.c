@@ -51,8 +51,10 @@ DIAG_ON(unused-macros)
 static void usage(void)
 {
 	fprintf(stderr, "usage: radict [OPTS] <attribute> [attribute...]\n");
+	fprintf(stderr, "  -C               Write pre-tokenized caches for the dictionaries, then exit.\n");
 	fprintf(stderr, "  -E               Export dictionary definitions.\n");
 	fprintf(stderr, "  -D <dictdir>     Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -p <protocol>    Only load the dictionary for this protocol.  May be repeated.\n");
 	fprintf(stderr, "  -x               Debugging mode.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Very simple interface to extract attribute definitions from FreeRADIUS dictionaries\n");
@@ -196,6 +198,9 @@ int main(int argc, char *argv[])
 	int		ret = 0;
 	bool		found = false;
 	bool		export = false;
+	bool		write_cache = false;
+	char const	*protocols[32];
+	size_t		num_protocols = 0;
 
 	TALLOC_CTX	*autofree;
 
@@ -217,7 +222,11 @@ int main(int argc, char *argv[])
 
 	fr_debug_lvl = 1;
 
-	while ((c = getopt(argc, argv, "ED:xh")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "CED:p:xh")) != -1) switch (c) {
+		case 'C':
+			write_cache = true;
+			break;
+
 		case 'E':
 			export = true;
 			break;
@@ -226,6 +235,15 @@ int main(int argc, char *argv[])
 			dict_dir = optarg;
 			break;
 
+		case 'p':
+			if (num_protocols >= NUM_ELEMENTS(protocols)) {
+				fprintf(stderr, "radict: Too many protocols\n");
+				ret = 1;
+				goto finish;
+			}
+			protocols[num_protocols++] = optarg;
+			break;
+
 		case 'x':
 			fr_log_fp = stdout;
 			fr_debug_lvl++;
@@ -255,6 +273,12 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	/*
+	 *	Re-tokenize everything, and write the results out,
+	 *	so that the next load can skip the text parsing.
+	 */
+	if (write_cache) fr_dict_global_cache_mode_set(FR_DICT_CACHE_WRITE);
+
 	INFO("Loading dictionary: %s/%s", dict_dir, FR_DICTIONARY_FILE);
 
 	if (fr_dict_internal_afrom_file(dict_end++, FR_DICTIONARY_INTERNAL_DIR) < 0) {
@@ -263,7 +287,22 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
-	if (load_dicts(dict_dir) < 0) {
+	/*
+	 *	Reading every protocol is most of the work, so
+	 *	only read the ones we were asked for.
+	 */
+	if (num_protocols > 0) {
+		size_t i;
+
+		for (i = 0; i < num_protocols; i++) {
+			INFO("Loading dictionary: %s/%s/%s", dict_dir, protocols[i], FR_DICTIONARY_FILE);
+			if (fr_dict_protocol_afrom_file(dict_end++, protocols[i], NULL) < 0) {
+				fr_perror("radict");
+				ret = 1;
+				goto finish;
+			}
+		}
+	} else if (load_dicts(dict_dir) < 0) {
 		fr_perror("radict");
 		ret = 1;
 		goto finish;
@@ -275,6 +314,11 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	if (write_cache) {
+		found = true;
+		goto finish;
+	}
+
 	if (export) {
 		fr_dict_t	**dict_p = dicts;
 
@@ -169,6 +169,30 @@ static void fr_time_sync_event(fr_event_list_t *el, UNUSED fr_time_t now, UNUSED
 	(void) fr_time_sync();
 }
 
+#define LOG_ASYNC_DROPPED_INTERVAL	(10)
+
+static fr_event_timer_t const *log_async_dropped_ev = NULL;
+static uint64_t log_async_dropped_reported = 0;
+
+/** Warn if messages have been dropped because the asynchronous log buffer was full
+ *
+ * The warning goes through the same buffer, so it may be dropped too.
+ * If it is, it's counted in the next warning.
+ */
+static void log_async_dropped_event(fr_event_list_t *el, UNUSED fr_time_t now, UNUSED void *uctx)
+{
+	uint64_t dropped = fr_log_async_dropped(&default_log);
+
+	(void) fr_event_timer_in(el, el, &log_async_dropped_ev, fr_time_delta_from_sec(LOG_ASYNC_DROPPED_INTERVAL),
+				 log_async_dropped_event, NULL);
+
+	if (dropped == log_async_dropped_reported) return;
+
+	WARN("Dropped %" PRIu64 " log messages in the last %u seconds, as the log buffer was full",
+	     dropped - log_async_dropped_reported, LOG_ASYNC_DROPPED_INTERVAL);
+	log_async_dropped_reported = dropped;
+}
+
 #ifndef NDEBUG
 /** Encourage the server to exit after a period of time
  *
@@ -460,6 +484,16 @@ int main(int argc, char *argv[])
 		if (raddb_dir) main_config_raddb_dir_set(config, raddb_dir);
 	}
 
+	/*
+	 *	Cache the configuration items, so that restarts with
+	 *	an unchanged configuration don't parse it again.
+	 */
+	{
+		char const *config_cache = getenv("FREERADIUS_CONFIG_CACHE");
+
+		if (config_cache) config->config_cache = talloc_typed_strdup(global_ctx, config_cache);
+	}
+
 	config->debug_level = fr_debug_lvl;
 
 	/*
@@ -766,6 +800,22 @@ int main(int argc, char *argv[])
 	 */
 	if (log_global_init(&default_log, config->daemonize) < 0) EXIT_WITH_FAILURE;
 
+	/*
+	 *	Only once we've forked, as the log thread wouldn't
+	 *	survive it.  In debug mode the output should appear
+	 *	as soon as it's produced.
+	 */
+	if (config->log_async && !config->debug_level &&
+	    (fr_log_async_start(&default_log, config->log_async_buffer_size, config->log_async_block) < 0)) {
+		PERROR("Failed starting asynchronous logging");
+		EXIT_WITH_FAILURE;
+	}
+
+	if (fr_trace_open(config->trace_file, config->trace_rate, config->trace_buffer_size) < 0) {
+		PERROR("Failed starting request tracing");
+		EXIT_WITH_FAILURE;
+	}
+
 	/*
 	 *	Start the network / worker threads.
 	 */
@@ -774,8 +824,23 @@ int main(int argc, char *argv[])
 		fr_schedule_config_t *schedule;
 
 		schedule = talloc_zero(global_ctx, fr_schedule_config_t);
-		schedule->max_workers = config->max_networks;
-		schedule->max_networks = config->max_workers;
+		schedule->max_workers = config->max_workers;
+		schedule->min_workers = config->min_workers;
+		schedule->scale_interval = config->scale_interval;
+		schedule->max_networks = config->max_networks;
+		schedule->dispatch = config->dispatch;
+		schedule->steal_delay = config->steal_delay;
+		schedule->spin_time = config->spin_time;
+		schedule->max_queue_time = config->max_queue_time;
+		schedule->give_up_time = config->give_up_time;
+		schedule->talloc_pool_size = config->talloc_pool_size;
+		schedule->huge_pages = config->huge_pages;
+		schedule->prefault = config->prefault;
+		schedule->io_uring = config->io_uring;
+		schedule->tsc_clock = config->tsc_clock;
+		schedule->timer_resolution = config->timer_resolution;
+		schedule->network_cpus = config->network_cpus;
+		schedule->worker_cpus = config->worker_cpus;
 		schedule->stats_interval = config->stats_interval;
 
 		/*
@@ -798,6 +863,14 @@ int main(int argc, char *argv[])
 		 *	Tell the virtual servers to open their sockets.
 		 */
 		if (virtual_servers_open(sc) < 0) EXIT_WITH_FAILURE;
+
+		/*
+		 *	Add and remove workers as the load changes.
+		 */
+		if (!el && (fr_schedule_scale_start(sc, main_loop_event_list()) < 0)) {
+			PERROR("Failed starting worker scaling");
+			EXIT_WITH_FAILURE;
+		}
 	}
 
 #ifndef NDEBUG
@@ -917,6 +990,7 @@ int main(int argc, char *argv[])
 	}
 
 	fr_time_sync_event(main_loop_event_list(), fr_time(), NULL);
+	if (default_log.async) log_async_dropped_event(main_loop_event_list(), fr_time(), NULL);
 #ifndef NDEBUG
 	if (exit_after > 0) fr_exit_after(main_loop_event_list(), 0, &exit_after);
 #endif
@@ -1017,6 +1091,8 @@ cleanup:
 	 *  Frees request specific logging resources which is OK
 	 *  because all the requests will have been stopped.
 	 */
+	fr_log_async_stop(&default_log);
+	fr_trace_close();
 	log_global_free();
 
 	fr_snmp_free();
@@ -778,36 +778,37 @@ static int cmd_show_config_item(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd
 	return 0;
 }
 
-static int cmd_show_client(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+static RADCLIENT *radmin_client_find(FILE *fp_err, fr_cmd_info_t const *info)
 {
 	RADCLIENT *client;
+	int proto = IPPROTO_IP; /* hack */
 
 	if (info->argc >= 2) {
-		int proto;
-
 		if (strcmp(info->argv[1], "tcp") == 0) {
 			proto = IPPROTO_TCP;
 
 		} else if (strcmp(info->argv[1], "udp") == 0) {
-			proto = IPPROTO_TCP;
+			proto = IPPROTO_UDP;
 
 		} else {
 			fprintf(fp_err, "Unknown proto '%s'.\n", info->argv[1]);
-			return -1;
+			return NULL;
 		}
+	}
 
-		client = client_find(NULL, &info->box[0]->vb_ip, proto);
-		if (client) goto found;
+	client = client_find(NULL, &info->box[0]->vb_ip, proto);
+	if (!client) fprintf(fp_err, "No such client.\n");
 
-	not_found:
-		fprintf(fp_err, "No such client.\n");
-		return -1;
-	} else {
-		client = client_find(NULL, &info->box[0]->vb_ip, IPPROTO_IP); /* hack */
-		if (!client) goto not_found;
-	}
+	return client;
+}
+
+static int cmd_show_client(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	RADCLIENT *client;
+
+	client = radmin_client_find(fp_err, info);
+	if (!client) return -1;
 
-found:
 	fprintf(fp, "shortname\t%s\n", client->shortname);
 	fprintf(fp, "secret\t\t%s\n", client->secret);
 
@@ -823,6 +824,26 @@ found:
 	return 0;
 }
 
+static int cmd_stats_client(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	RADCLIENT *client;
+
+	client = radmin_client_find(fp_err, info);
+	if (!client) return -1;
+
+	fprintf(fp, "rate_limit\t%u\n", client->rate_limit);
+	fprintf(fp, "rate_burst\t%u\n", client->rate_burst);
+
+	if (!client->rate_stats) return 0;
+
+	fprintf(fp, "count.rate_dropped\t%" PRIu64 "\n",
+		(uint64_t) atomic_load_explicit(&client->rate_stats->dropped, memory_order_relaxed));
+	fprintf(fp, "count.rate_deferred\t%" PRIu64 "\n",
+		(uint64_t) atomic_load_explicit(&client->rate_stats->deferred, memory_order_relaxed));
+
+	return 0;
+}
+
 //#define CMD_TEST (1)
 
 #ifdef CMD_TEST
@@ -984,6 +1005,15 @@ static fr_cmd_table_t cmd_table[] = {
 		.read_only = true
 	},
 
+	{
+		.parent = "stats",
+		.name = "client",
+		.syntax = "IPADDR [(udp|tcp)]",
+		.func = cmd_stats_client,
+		.help = "Show rate limit statistics for a given client.",
+		.read_only = true
+	},
+
 	{
 		.parent = "stats",
 		.name = "memory",
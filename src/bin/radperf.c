@@ -0,0 +1,1035 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/bin/radperf.c
+ * @brief Open-loop RADIUS load generator.
+ *
+ * Each thread sends packets at a schedule which is fixed before the
+ * test starts, no matter how quickly the server replies.  Latency is
+ * measured from when a packet *should* have been sent, so that a
+ * stall in the server (or in radperf) shows up in the results,
+ * instead of silently reducing the offered load.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/base.h>
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/net.h>
+#include <freeradius-devel/util/pcap.h>
+#include <freeradius-devel/util/socket.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/radius/radius.h>
+
+#include <ctype.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+/*
+ *	Logging macros
+ */
+#undef DEBUG
+#define DEBUG(fmt, ...)		if (fr_debug_lvl > 0) fprintf(fr_log_fp, fmt "\n", ## __VA_ARGS__)
+#undef ERROR
+#define ERROR(fmt, ...)		fr_perror("radperf: " fmt, ## __VA_ARGS__)
+
+#define RP_MAX_THREADS		(64)
+#define RP_MAX_SOCKETS		(64)	//!< per thread, each of which has 256 IDs.
+
+/** A packet which radperf sends
+ *
+ */
+typedef struct {
+	FR_CODE			code;		//!< of the request.
+	VALUE_PAIR		*vps;		//!< attributes to encode.
+
+	VALUE_PAIR		**vary;		//!< string attributes which contain "%n".
+	char const		**vary_fmt;	//!< the original value of each of those attributes.
+	int			num_vary;
+} rp_template_t;
+
+typedef struct rp_socket_s rp_socket_t;
+
+/** A request which is waiting for a reply
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< in the list of outstanding packets, oldest first.
+	rp_socket_t		*sock;		//!< the packet was sent on.
+	bool			active;		//!< waiting for a reply.
+	fr_time_t		intended;	//!< when the schedule said the packet should be sent.
+	fr_time_t		sent;		//!< when the packet was actually sent.
+	uint8_t			original[RADIUS_HEADER_LENGTH];	//!< header of the request, to verify the reply.
+} rp_packet_t;
+
+struct rp_socket_s {
+	int			fd;		//!< connected UDP socket.
+	int			in_use;		//!< number of IDs outstanding.
+	uint8_t			next_id;	//!< where to start looking for a free ID.
+	rp_packet_t		packet[256];	//!< indexed by ID.
+};
+
+/** Per-thread state
+ *
+ */
+typedef struct {
+	pthread_t		pthread_id;
+	unsigned int		num;		//!< of this thread.
+	TALLOC_CTX		*ctx;		//!< for everything this thread allocates.
+
+	double			rate;		//!< packets/s which this thread sends.
+	uint64_t		count;		//!< how many packets to send, 0 for no limit.
+	fr_time_t		start;		//!< when the first packet is due.
+
+	rp_template_t		*templates;	//!< this thread's copy of the packets.
+
+	rp_socket_t		*sockets[RP_MAX_SOCKETS];
+	struct pollfd		fds[RP_MAX_SOCKETS];
+	int			num_sockets;
+	int			sock_idx;	//!< socket to try first, for the next packet.
+
+	fr_dlist_head_t		outstanding;	//!< packets waiting for replies, oldest first.
+
+	uint8_t			buffer[RADIUS_MAX_PACKET_SIZE];
+
+	uint64_t		sent;		//!< packets sent.
+	uint64_t		received;	//!< valid replies.
+	uint64_t		lost;		//!< no reply within the timeout.
+	uint64_t		invalid;	//!< replies which failed verification.
+	uint64_t		unexpected;	//!< replies which didn't match an outstanding request.
+	uint64_t		stalled;	//!< times sending waited for a free ID.
+	uint64_t		codes[FR_RADIUS_MAX_PACKET_CODE];	//!< count of each reply code.
+	fr_time_t		last_send;	//!< when the last packet was sent.
+	fr_time_delta_t		max_lag;	//!< largest delay between "intended" and "sent".
+
+	fr_time_histogram_t	latency;	//!< reply time, from when the packet should have been sent.
+	fr_time_histogram_t	service;	//!< reply time, from when the packet was sent.
+} rp_thread_t;
+
+static char const *radperf_version = RADIUSD_VERSION_STRING_BUILD("radperf");
+
+static fr_ipaddr_t	server_ipaddr;
+static uint16_t		server_port = 0;
+static char		*secret = NULL;
+static size_t		secret_len = 0;
+static FR_CODE		packet_code = FR_CODE_UNDEFINED;
+
+static double		rate = 0;
+static bool		poisson = false;
+static fr_time_delta_t	duration = ((fr_time_delta_t) 10) * NSEC;
+static uint64_t		count = 0;
+static fr_time_delta_t	timeout = ((fr_time_delta_t) 5) * NSEC;
+static unsigned int	num_threads = 1;
+static int		max_sockets = RP_MAX_SOCKETS;
+
+static rp_template_t	*templates = NULL;
+static int		num_templates = 0;
+
+static fr_dict_t const *dict_freeradius;
+static fr_dict_t const *dict_radius;
+
+extern fr_dict_autoload_t radperf_dict[];
+fr_dict_autoload_t radperf_dict[] = {
+	{ .out = &dict_freeradius, .proto = "freeradius" },
+	{ .out = &dict_radius, .proto = "radius" },
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_packet_type;
+
+extern fr_dict_attr_autoload_t radperf_dict_attr[];
+fr_dict_attr_autoload_t radperf_dict_attr[] = {
+	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ NULL }
+};
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "Usage: radperf [options] server[:port] <command> <secret>\n");
+
+	fprintf(stderr, "  <command>              One of auth, acct, status, coa, or disconnect.\n");
+	fprintf(stderr, "  -4                     Use IPv4 address of server\n");
+	fprintf(stderr, "  -6                     Use IPv6 address of server.\n");
+	fprintf(stderr, "  -c <count>             Stop after sending 'count' packets.\n");
+	fprintf(stderr, "  -d <raddb>             Set user dictionary directory (defaults to " RADDBDIR ").\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -e                     Send packets at exponentially distributed intervals (Poisson\n");
+	fprintf(stderr, "                         arrivals), instead of at a fixed rate.\n");
+	fprintf(stderr, "  -f <file>              Read packets from file, not stdin.  Any string attribute\n");
+	fprintf(stderr, "                         containing %%n has it replaced with the packet number.\n");
+	fprintf(stderr, "  -h                     Print usage help information.\n");
+#ifdef HAVE_LIBPCAP
+	fprintf(stderr, "  -I <pcap>              Replay the requests contained in a pcap file.\n");
+#endif
+	fprintf(stderr, "  -l <time>              Stop sending after 'time' seconds (default 10).\n");
+	fprintf(stderr, "  -n <num>               Send N requests/s in total.\n");
+	fprintf(stderr, "  -s <num>               Maximum number of sockets per thread (default %d).\n", RP_MAX_SOCKETS);
+	fprintf(stderr, "  -t <timeout>           Count a packet as lost after 'timeout' seconds (default 5).\n");
+	fprintf(stderr, "  -T <num>               Number of sending threads (default 1).\n");
+	fprintf(stderr, "  -v                     Show program version information.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+static int getport(char const *name)
+{
+	struct servent *svp;
+
+	svp = getservbyname(name, "udp");
+	if (!svp) return 0;
+
+	return ntohs(svp->s_port);
+}
+
+/*
+ *	Set a port from the request type if we don't already have one
+ */
+static void radperf_get_port(FR_CODE type, uint16_t *port)
+{
+	if (*port != 0) return;
+
+	switch (type) {
+	default:
+	case FR_CODE_ACCESS_REQUEST:
+	case FR_CODE_STATUS_SERVER:
+		*port = getport("radius");
+		if (*port == 0) *port = FR_AUTH_UDP_PORT;
+		return;
+
+	case FR_CODE_ACCOUNTING_REQUEST:
+		*port = getport("radacct");
+		if (*port == 0) *port = FR_ACCT_UDP_PORT;
+		return;
+
+	case FR_CODE_DISCONNECT_REQUEST:
+		*port = FR_POD_UDP_PORT;
+		return;
+
+	case FR_CODE_COA_REQUEST:
+		*port = FR_COA_UDP_PORT;
+		return;
+	}
+}
+
+/** Find the attributes in a template which vary per packet
+ *
+ */
+static int template_init(TALLOC_CTX *ctx, rp_template_t *t)
+{
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	t->num_vary = 0;
+	t->vary = NULL;
+	t->vary_fmt = NULL;
+
+	for (vp = fr_cursor_init(&cursor, &t->vps); vp; vp = fr_cursor_next(&cursor)) {
+		if ((vp->vp_type != FR_TYPE_STRING) || !strstr(vp->vp_strvalue, "%n")) continue;
+
+		t->vary = talloc_realloc(ctx, t->vary, VALUE_PAIR *, t->num_vary + 1);
+		t->vary_fmt = talloc_realloc(ctx, t->vary_fmt, char const *, t->num_vary + 1);
+		if (!t->vary || !t->vary_fmt) return -1;
+
+		t->vary[t->num_vary] = vp;
+		t->vary_fmt[t->num_vary] = talloc_strdup(t->vary_fmt, vp->vp_strvalue);
+		if (!t->vary_fmt[t->num_vary]) return -1;
+		t->num_vary++;
+	}
+
+	return 0;
+}
+
+static int template_add(VALUE_PAIR *vps, FR_CODE code)
+{
+	rp_template_t	*t;
+	VALUE_PAIR	*vp;
+
+	vp = fr_pair_find_by_da(vps, attr_packet_type, TAG_ANY);
+	if (vp) code = vp->vp_uint32;
+
+	if (!fr_request_packets[code]) {
+		fr_strerror_printf("Can't send packets of type %s", fr_packet_codes[code]);
+		return -1;
+	}
+
+	templates = talloc_realloc(NULL, templates, rp_template_t, num_templates + 1);
+	if (!templates) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	t = &templates[num_templates++];
+	t->code = code;
+	t->vps = vps;
+
+	return 0;
+}
+
+/** Read packet templates in the same format as radclient
+ *
+ */
+static int templates_from_file(TALLOC_CTX *ctx, char const *filename)
+{
+	FILE	*fp;
+	bool	done = false;
+
+	if (strcmp(filename, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen(filename, "r");
+		if (!fp) {
+			fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	while (!done) {
+		VALUE_PAIR *vps = NULL;
+
+		if (fr_pair_list_afrom_file(ctx, dict_radius, &vps, fp, &done) < 0) {
+			fr_strerror_printf_push("Failed parsing %s", filename);
+		error:
+			if (fp != stdin) fclose(fp);
+			return -1;
+		}
+
+		if (!vps) continue;
+
+		if (template_add(vps, packet_code) < 0) goto error;
+	}
+
+	if (fp != stdin) fclose(fp);
+
+	return 0;
+}
+
+#ifdef HAVE_LIBPCAP
+/** Read the requests from a pcap file
+ *
+ * The packets are decoded with the shared secret, and then sent by the
+ * normal path.  This gives them new IDs and authenticators, and allows
+ * %n substitution in them, too.
+ */
+static int templates_from_pcap(TALLOC_CTX *ctx, char const *filename)
+{
+	fr_pcap_t		*in;
+	struct pcap_pkthdr	*header;
+	uint8_t const		*data;
+	int			ret;
+	int			found = 0;
+
+	in = fr_pcap_init(ctx, filename, PCAP_FILE_IN);
+	if (!in) return -1;
+
+	if (fr_pcap_open(in) < 0) {
+		fr_strerror_printf_push("Failed opening %s", filename);
+		return -1;
+	}
+
+	while ((ret = pcap_next_ex(in->handle, &header, &data)) == 1) {
+		uint8_t const		*p = data;
+		ssize_t			len;
+		size_t			packet_len;
+		ip_header_t const	*ip = NULL;
+		VALUE_PAIR		*vps = NULL;
+		decode_fail_t		reason;
+
+		len = fr_pcap_link_layer_offset(data, header->caplen, in->link_layer);
+		if (len < 0) continue;
+		p += len;
+
+		switch ((p[0] & 0xf0) >> 4) {
+		case 4:
+			ip = (ip_header_t const *) p;
+			p += (0x0f & ip->ip_vhl) * 4;
+			if (ip->ip_p != IPPROTO_UDP) continue;
+			break;
+
+		case 6:
+			if (((ip_header6_t const *) p)->ip_next != IPPROTO_UDP) continue;
+			p += sizeof(ip_header6_t);
+			break;
+
+		default:
+			continue;
+		}
+
+		p += sizeof(udp_header_t);
+		if ((p + RADIUS_HEADER_LENGTH) > (data + header->caplen)) continue;
+
+		packet_len = (data + header->caplen) - p;
+		if (!fr_radius_ok(p, &packet_len, 0, false, &reason)) continue;
+		if (!fr_request_packets[p[0]]) continue;
+
+		if (fr_radius_decode(ctx, p, packet_len, NULL, secret, secret_len, &vps) < 0) {
+			fr_strerror_printf_push("Failed decoding packet %d in %s", found + 1, filename);
+			return -1;
+		}
+
+		if (template_add(vps, (FR_CODE) p[0]) < 0) return -1;
+		found++;
+	}
+
+	if (ret == -1) {
+		fr_strerror_printf("Failed reading %s: %s", filename, pcap_geterr(in->handle));
+		return -1;
+	}
+
+	if (!found) {
+		fr_strerror_printf("No RADIUS requests found in %s", filename);
+		return -1;
+	}
+
+	talloc_free(in);
+
+	return 0;
+}
+#endif
+
+/** Time until the next packet is due
+ *
+ */
+static inline fr_time_delta_t rp_gap(rp_thread_t *t)
+{
+	double u;
+
+	if (!poisson) return (fr_time_delta_t) (NSEC / t->rate);
+
+	/*
+	 *	Exponentially distributed, with a mean of 1/rate.
+	 *	u is in (0, 1], so log(u) is finite.
+	 */
+	u = ((double) fr_rand() + 1.0) / 4294967296.0;
+
+	return (fr_time_delta_t) (-log(u) * NSEC / t->rate);
+}
+
+/** Find a socket with a free ID, opening a new one if necessary
+ *
+ */
+static rp_socket_t *rp_socket_get(rp_thread_t *t)
+{
+	rp_socket_t	*sock;
+	int		i;
+	uint16_t	port = 0;
+	int		fd;
+
+	for (i = 0; i < t->num_sockets; i++) {
+		sock = t->sockets[(t->sock_idx + i) % t->num_sockets];
+		if (sock->in_use < 256) return sock;
+	}
+
+	if (t->num_sockets >= max_sockets) return NULL;
+
+	fd = fr_socket_client_udp(NULL, &port, &server_ipaddr, server_port, true);
+	if (fd < 0) {
+		ERROR("Thread %u - Failed opening socket", t->num);
+		return NULL;
+	}
+
+	sock = talloc_zero(t->ctx, rp_socket_t);
+	if (!sock) {
+		close(fd);
+		return NULL;
+	}
+	sock->fd = fd;
+
+	t->fds[t->num_sockets].fd = fd;
+	t->fds[t->num_sockets].events = POLLIN;
+	t->sock_idx = t->num_sockets;
+	t->sockets[t->num_sockets++] = sock;
+
+	return sock;
+}
+
+/** Replace %n in the varying attributes with the packet number
+ *
+ */
+static void rp_template_vary(rp_template_t *tmpl, uint64_t seq)
+{
+	int i;
+
+	for (i = 0; i < tmpl->num_vary; i++) {
+		char		buffer[1024];
+		char const	*p = tmpl->vary_fmt[i];
+		char		*out = buffer, *end = buffer + sizeof(buffer) - 1;
+
+		while (*p && (out < end)) {
+			if ((p[0] == '%') && (p[1] == 'n')) {
+				out += snprintf(out, end - out, "%" PRIu64, seq);
+				if (out > end) out = end;
+				p += 2;
+				continue;
+			}
+
+			*out++ = *p++;
+		}
+		*out = '\0';
+
+		fr_pair_value_bstrndup(tmpl->vary[i], buffer, out - buffer, false);
+	}
+}
+
+/** Encode and send the next packet
+ *
+ * @return
+ *	- 1 if the packet was sent.
+ *	- 0 if there are no free IDs.
+ *	- -1 on error.
+ */
+static int rp_send(rp_thread_t *t, fr_time_t intended)
+{
+	rp_template_t	*tmpl;
+	rp_socket_t	*sock;
+	rp_packet_t	*packet;
+	ssize_t		len;
+	int		id;
+	uint64_t	seq = (t->sent * num_threads) + t->num;
+
+	sock = rp_socket_get(t);
+	if (!sock) return 0;
+
+	for (id = sock->next_id; sock->packet[id & 0xff].active; id++);
+	id &= 0xff;
+	sock->next_id = id + 1;
+
+	tmpl = &t->templates[seq % num_templates];
+	if (tmpl->num_vary) rp_template_vary(tmpl, seq);
+
+	/*
+	 *	Requests which aren't signed by the Request
+	 *	Authenticator need a random one.
+	 */
+	if ((tmpl->code == FR_CODE_ACCESS_REQUEST) || (tmpl->code == FR_CODE_STATUS_SERVER)) {
+		fr_rand_buffer(t->buffer + 4, RADIUS_AUTH_VECTOR_LENGTH);
+	}
+
+	len = fr_radius_encode(t->buffer, sizeof(t->buffer), NULL, secret, secret_len, tmpl->code, id, tmpl->vps);
+	if (len <= 0) {
+		ERROR("Thread %u - Failed encoding packet", t->num);
+		return -1;
+	}
+
+	if (fr_radius_sign(t->buffer, NULL, (uint8_t const *) secret, secret_len) < 0) {
+		ERROR("Thread %u - Failed signing packet", t->num);
+		return -1;
+	}
+
+	packet = &sock->packet[id];
+	packet->sent = fr_time();
+
+	if (send(sock->fd, t->buffer, len, 0) < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS)) return 0;
+
+		ERROR("Thread %u - Failed sending packet: %s", t->num, fr_syserror(errno));
+		return -1;
+	}
+
+	memcpy(packet->original, t->buffer, sizeof(packet->original));
+	packet->sock = sock;
+	packet->intended = intended;
+	packet->active = true;
+	fr_dlist_insert_tail(&t->outstanding, packet);
+	sock->in_use++;
+
+	if ((packet->sent - intended) > t->max_lag) t->max_lag = packet->sent - intended;
+	t->last_send = packet->sent;
+	t->sent++;
+
+	return 1;
+}
+
+static void rp_packet_done(rp_thread_t *t, rp_packet_t *packet)
+{
+	fr_dlist_remove(&t->outstanding, packet);
+	packet->active = false;
+	packet->sock->in_use--;
+}
+
+/** Read all of the replies which are waiting on one socket
+ *
+ */
+static void rp_recv(rp_thread_t *t, rp_socket_t *sock)
+{
+	for (;;) {
+		ssize_t		len;
+		size_t		packet_len;
+		rp_packet_t	*packet;
+		decode_fail_t	reason;
+		fr_time_t	now;
+
+		len = recv(sock->fd, t->buffer, sizeof(t->buffer), 0);
+		if (len < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+				ERROR("Thread %u - Failed reading reply: %s", t->num, fr_syserror(errno));
+			}
+			return;
+		}
+		now = fr_time();
+
+		packet_len = len;
+		if (!fr_radius_ok(t->buffer, &packet_len, 0, false, &reason)) {
+			t->invalid++;
+			continue;
+		}
+
+		packet = &sock->packet[t->buffer[1]];
+		if (!packet->active) {
+			t->unexpected++;
+			continue;
+		}
+
+		if (fr_radius_verify(t->buffer, packet->original, (uint8_t const *) secret, secret_len) < 0) {
+			DEBUG("Thread %u - Invalid reply: %s", t->num, fr_strerror());
+			t->invalid++;
+			continue;
+		}
+
+		fr_time_histogram_add(&t->latency, now - packet->intended);
+		fr_time_histogram_add(&t->service, now - packet->sent);
+		if (is_radius_code(t->buffer[0])) t->codes[t->buffer[0]]++;
+		t->received++;
+
+		rp_packet_done(t, packet);
+	}
+}
+
+/** Give up on packets which have not received a reply
+ *
+ * Lost packets are recorded in the latency histogram as having taken
+ * the full timeout.  Leaving them out would make the percentiles look
+ * better as the server gets worse.
+ */
+static void rp_expire(rp_thread_t *t, fr_time_t now)
+{
+	rp_packet_t *packet;
+
+	while ((packet = fr_dlist_head(&t->outstanding)) != NULL) {
+		if ((now - packet->sent) < timeout) break;
+
+		fr_time_histogram_add(&t->latency, now - packet->intended);
+		t->lost++;
+
+		rp_packet_done(t, packet);
+	}
+}
+
+static void *rp_thread(void *arg)
+{
+	rp_thread_t	*t = arg;
+	fr_time_t	next = t->start;
+	fr_time_t	end = duration ? t->start + duration : 0;
+	int		i;
+
+	fr_dlist_talloc_init(&t->outstanding, rp_packet_t, entry);
+
+	for (;;) {
+		fr_time_t	now = fr_time();
+		fr_time_t	wake;
+		rp_packet_t	*oldest;
+		bool		sending;
+		int		ms, ret;
+
+		/*
+		 *	Send everything which is due.  If there are no
+		 *	free IDs, the packet stays due, and its
+		 *	latency includes the time it spent waiting.
+		 */
+		while ((!t->count || (t->sent < t->count)) && (!end || (next < end)) && (next <= now)) {
+			ret = rp_send(t, next);
+			if (ret < 0) goto done;
+			if (ret == 0) {
+				t->stalled++;
+				break;
+			}
+
+			next += rp_gap(t);
+		}
+
+		rp_expire(t, now);
+
+		sending = (!t->count || (t->sent < t->count)) && (!end || (next < end));
+		oldest = fr_dlist_head(&t->outstanding);
+
+		if (!sending && !oldest) break;
+
+		/*
+		 *	Sleep until the next packet is due, or the
+		 *	oldest packet times out.
+		 */
+		wake = sending ? next : 0;
+		if (oldest && (!wake || ((oldest->sent + timeout) < wake))) wake = oldest->sent + timeout;
+
+		/*
+		 *	With less than a millisecond to wait, we spin.
+		 */
+		ms = 0;
+		if (wake > now) ms = (wake - now) / 1000000;
+
+		ret = poll(t->fds, t->num_sockets, ms);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+
+			ERROR("Thread %u - Failed waiting for replies: %s", t->num, fr_syserror(errno));
+			break;
+		}
+
+		for (i = 0; (i < t->num_sockets) && (ret > 0); i++) {
+			if (!(t->fds[i].revents & POLLIN)) continue;
+
+			rp_recv(t, t->sockets[i]);
+			ret--;
+		}
+	}
+
+done:
+	for (i = 0; i < t->num_sockets; i++) close(t->sockets[i]->fd);
+
+	return NULL;
+}
+
+static void rp_print_results(rp_thread_t *threads, fr_time_t start)
+{
+	rp_thread_t		total;
+	fr_time_t		last_send = start;
+	fr_time_delta_t		elapsed;
+	unsigned int		i;
+	int			j;
+
+	memset(&total, 0, sizeof(total));
+
+	for (i = 0; i < num_threads; i++) {
+		rp_thread_t *t = &threads[i];
+
+		total.sent += t->sent;
+		total.received += t->received;
+		total.lost += t->lost;
+		total.invalid += t->invalid;
+		total.unexpected += t->unexpected;
+		total.stalled += t->stalled;
+		for (j = 0; j < FR_RADIUS_MAX_PACKET_CODE; j++) total.codes[j] += t->codes[j];
+		if (t->max_lag > total.max_lag) total.max_lag = t->max_lag;
+		if (t->last_send > last_send) last_send = t->last_send;
+
+		fr_time_histogram_merge(&total.latency, &t->latency);
+		fr_time_histogram_merge(&total.service, &t->service);
+	}
+
+	elapsed = last_send - start;
+
+	printf("offered.rate\t%.0f/s\n", rate);
+	printf("sent\t%" PRIu64 "\n", total.sent);
+	if (elapsed > 0) {
+		printf("sent.rate\t%.0f/s\n", (double) total.sent * NSEC / elapsed);
+	}
+	printf("received\t%" PRIu64 "\n", total.received);
+	for (j = 0; j < FR_RADIUS_MAX_PACKET_CODE; j++) {
+		if (!total.codes[j]) continue;
+
+		printf("received.%s\t%" PRIu64 "\n", fr_packet_codes[j], total.codes[j]);
+	}
+	printf("lost\t%" PRIu64 "\n", total.lost);
+	printf("invalid\t%" PRIu64 "\n", total.invalid);
+	printf("unexpected\t%" PRIu64 "\n", total.unexpected);
+	printf("stalled\t%" PRIu64 "\n", total.stalled);
+	printf("max_send_lag\t%" PRIu64 "us\n", (uint64_t) total.max_lag / 1000);
+
+	/*
+	 *	"latency" is what a client sending at the offered
+	 *	rate would see.  "service" is the time the server
+	 *	took, which hides any queueing in front of it.
+	 */
+	fr_time_histogram_fprint(stdout, &total.latency, "latency");
+	fr_time_histogram_fprint(stdout, &total.service, "service");
+
+	if (total.max_lag > (NSEC / 100)) {
+		printf("\nWARNING: radperf fell behind its schedule by up to %" PRIu64 "ms.\n"
+		       "WARNING: Use more threads (-T), or sockets (-s) to reach the offered rate.\n",
+		       (uint64_t) total.max_lag / 1000000);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int		c;
+	char		const *raddb_dir = RADDBDIR;
+	char		const *dict_dir = DICTDIR;
+	char		const *filename = NULL;
+#ifdef HAVE_LIBPCAP
+	char		const *pcap_filename = NULL;
+#endif
+	int		force_af = AF_UNSPEC;
+	TALLOC_CTX	*autofree;
+	rp_thread_t	*threads;
+	fr_time_t	start;
+	unsigned int	i;
+	int		j;
+
+	fr_debug_lvl = 0;
+	fr_log_fp = stdout;
+
+	/*
+	 *	Must be called first, so the handler is called last
+	 */
+	fr_thread_local_atexit_setup();
+
+	autofree = talloc_autofree_context();
+
+#ifndef NDEBUG
+	if (fr_fault_setup(autofree, getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror("radperf");
+		fr_exit_now(EXIT_FAILURE);
+	}
+#endif
+
+	talloc_set_log_stderr();
+
+	default_log.dst = L_DST_STDOUT;
+	default_log.fd = STDOUT_FILENO;
+	default_log.print_level = false;
+
+	while ((c = getopt(argc, argv, "46c:d:D:ef:hI:l:n:s:t:T:vx")) != -1) switch (c) {
+		case '4':
+			force_af = AF_INET;
+			break;
+
+		case '6':
+			force_af = AF_INET6;
+			break;
+
+		case 'c':
+			if (!isdigit((int) *optarg)) usage();
+			count = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'd':
+			raddb_dir = optarg;
+			break;
+
+		case 'e':
+			poisson = true;
+			break;
+
+		case 'f':
+			filename = optarg;
+			break;
+
+#ifdef HAVE_LIBPCAP
+		case 'I':
+			pcap_filename = optarg;
+			break;
+#endif
+
+		case 'l':
+			if (fr_time_delta_from_str(&duration, optarg, FR_TIME_RES_SEC) < 0) {
+				fr_perror("Failed parsing duration");
+				fr_exit_now(EXIT_FAILURE);
+			}
+			break;
+
+		case 'n':
+			rate = strtod(optarg, NULL);
+			if (rate <= 0) usage();
+			break;
+
+		case 's':
+			max_sockets = atoi(optarg);
+			if ((max_sockets < 1) || (max_sockets > RP_MAX_SOCKETS)) usage();
+			break;
+
+		case 't':
+			if (fr_time_delta_from_str(&timeout, optarg, FR_TIME_RES_SEC) < 0) {
+				fr_perror("Failed parsing timeout value");
+				fr_exit_now(EXIT_FAILURE);
+			}
+			break;
+
+		case 'T':
+			num_threads = atoi(optarg);
+			if ((num_threads < 1) || (num_threads > RP_MAX_THREADS)) usage();
+			break;
+
+		case 'v':
+			fr_debug_lvl = 1;
+			DEBUG("%s", radperf_version);
+			fr_exit_now(0);
+
+		case 'x':
+			fr_debug_lvl++;
+			if (fr_debug_lvl > 1) default_log.print_level = true;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+	argc -= (optind - 1);
+	argv += (optind - 1);
+
+	if ((argc < 4) || (rate <= 0)) {
+		ERROR("Insufficient arguments");
+		usage();
+	}
+
+	if (!duration && !count) {
+		ERROR("One of -c or -l must be used to limit the test");
+		usage();
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("radperf");
+		return 1;
+	}
+
+	if (!fr_dict_global_ctx_init(autofree, dict_dir)) {
+		fr_perror("radperf");
+		return 1;
+	}
+
+	if (fr_radius_init() < 0) {
+		fr_perror("radperf");
+		return 1;
+	}
+
+	if (fr_dict_autoload(radperf_dict) < 0) {
+		fr_perror("radperf");
+		return 1;
+	}
+
+	if (fr_dict_attr_autoload(radperf_dict_attr) < 0) {
+		fr_perror("radperf");
+		return 1;
+	}
+
+	if (fr_dict_read(fr_dict_unconst(dict_freeradius), raddb_dir, FR_DICTIONARY_FILE) == -1) {
+		fr_log_perror(&default_log, L_ERR, __FILE__, __LINE__, "Failed to initialize the dictionaries");
+		return 1;
+	}
+	fr_strerror();	/* Clear the error buffer */
+
+	if (!isdigit((int) argv[2][0])) {
+		packet_code = fr_table_value_by_str(fr_request_types, argv[2], FR_CODE_UNDEFINED);
+		if (packet_code == FR_CODE_UNDEFINED) {
+			ERROR("Unrecognised request type \"%s\"", argv[2]);
+			usage();
+		}
+	} else {
+		packet_code = atoi(argv[2]);
+	}
+	if (!is_radius_code(packet_code)) usage();
+
+	if (fr_inet_pton_port(&server_ipaddr, &server_port, argv[1], -1, force_af, true, true) < 0) {
+		fr_perror("radperf");
+		fr_exit_now(1);
+	}
+	radperf_get_port(packet_code, &server_port);
+
+	secret = talloc_strdup(autofree, argv[3]);
+	secret_len = talloc_array_length(secret) - 1;
+
+#ifdef HAVE_LIBPCAP
+	if (pcap_filename) {
+		if (templates_from_pcap(autofree, pcap_filename) < 0) {
+			fr_perror("radperf");
+			fr_exit_now(1);
+		}
+	} else
+#endif
+	if (templates_from_file(autofree, filename ? filename : "-") < 0) {
+		fr_perror("radperf");
+		fr_exit_now(1);
+	}
+
+	if (!num_templates) {
+		ERROR("No packets to send");
+		fr_exit_now(1);
+	}
+
+	/*
+	 *	Each thread gets its own copy of the packets, as %n
+	 *	substitution changes them.
+	 */
+	threads = talloc_zero_array(autofree, rp_thread_t, num_threads);
+	if (!threads) {
+	oom:
+		ERROR("Out of memory");
+		fr_exit_now(1);
+	}
+
+	start = fr_time() + (NSEC / 10);
+
+	for (i = 0; i < num_threads; i++) {
+		rp_thread_t *t = &threads[i];
+
+		t->num = i;
+		t->ctx = talloc_new(NULL);
+		if (!t->ctx) goto oom;
+
+		t->rate = rate / num_threads;
+		if (count) t->count = (count / num_threads) + (i < (count % num_threads));
+
+		/*
+		 *	Spread the threads out, so that they don't
+		 *	all send at the same instant.
+		 */
+		t->start = start + (fr_time_delta_t) ((NSEC / rate) * i);
+
+		t->templates = talloc_array(t->ctx, rp_template_t, num_templates);
+		if (!t->templates) goto oom;
+
+		for (j = 0; j < num_templates; j++) {
+			t->templates[j].code = templates[j].code;
+			t->templates[j].vps = NULL;
+			if ((fr_pair_list_copy(t->ctx, &t->templates[j].vps, templates[j].vps) < 0) ||
+			    (template_init(t->ctx, &t->templates[j]) < 0)) goto oom;
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i].pthread_id, NULL, rp_thread, &threads[i]) != 0) {
+			ERROR("Failed creating thread %u: %s", i, fr_syserror(errno));
+			fr_exit_now(1);
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) pthread_join(threads[i].pthread_id, NULL);
+
+	rp_print_results(threads, start);
+
+	for (i = 0; i < num_threads; i++) talloc_free(threads[i].ctx);
+
+	fr_dict_autofree(radperf_dict);
+
+	return 0;
+}
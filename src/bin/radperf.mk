@@ -0,0 +1,6 @@
+TARGET		:= radperf
+SOURCES		:= radperf.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS) $(PCAP_LIBS) -lm
+TGT_LDFLAGS     := $(LDFLAGS) $(PCAP_LDFLAGS)
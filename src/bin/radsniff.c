@@ -34,6 +34,7 @@ RCSID("$Id$")
 #include <freeradius-devel/autoconf.h>
 #include <freeradius-devel/util/conf.h>
 #include <freeradius-devel/util/pcap.h>
+#include <freeradius-devel/util/thread_local.h>
 #include <freeradius-devel/util/timeval.h>
 #include <freeradius-devel/radius/list.h>
 
@@ -47,13 +48,20 @@ RCSID("$Id$")
 
 static rs_t *conf;
 static struct timeval start_pcap = {0, 0};
-static char timestr[50];
-
-static rbtree_t *request_tree = NULL;
-static rbtree_t *link_tree = NULL;
-static fr_event_list_t *events;
+static atomic_uint_fast64_t captured;		//!< Packets which passed the filters.
 static bool cleanup;
 
+/*
+ *	When decoding in separate threads, each thread has its own
+ *	trees and event list.
+ */
+static _Thread_local char timestr[50];
+static _Thread_local TALLOC_CTX *thread_ctx;	//!< Parent for requests and packets.
+static _Thread_local rbtree_t *request_tree;
+static _Thread_local rbtree_t *link_tree;
+static _Thread_local fr_event_list_t *events;
+static _Thread_local uint64_t packets_seen;
+
 static int self_pipe[2] = {-1, -1};		//!< Signals from sig handlers
 
 typedef int (*rbcmp)(void const *, void const *);
@@ -106,6 +114,7 @@ fr_dict_attr_autoload_t radsniff_dict_attr[] = {
 };
 
 static void NEVER_RETURNS usage(int status);
+static void rs_signal_self(int sig);
 
 /** Fork and kill the parent process, writing out our PID
  *
@@ -621,6 +630,11 @@ static void rs_stats_print_code_fancy(rs_latency_t *stats, FR_CODE code)
 		INFO("\tLow       : %.3lfms", stats->interval.latency_low);
 		INFO("\tAverage   : %.3lfms", stats->interval.latency_average);
 		INFO("\tMA        : %.3lfms", stats->latency_smoothed);
+		if (!isnan(stats->interval.latency_p50)) {
+			INFO("\tP50       : %.3lfms", stats->interval.latency_p50);
+			INFO("\tP90       : %.3lfms", stats->interval.latency_p90);
+			INFO("\tP99       : %.3lfms", stats->interval.latency_p99);
+		}
 	}
 
 	if (have_rt || stats->interval.lost || stats->interval.reused) {
@@ -803,6 +817,368 @@ static void rs_stats_print_csv(rs_update_t *this, rs_stats_t *stats, UNUSED stru
 	fprintf(stdout , "%s\n", buffer);
 }
 
+/** Map a latency to a histogram bucket
+ *
+ */
+static inline unsigned int rs_hist_index(uint64_t usec)
+{
+	unsigned int shift;
+
+	if (usec < (1 << RS_HIST_SUB_BITS)) return usec;
+	if (usec >= (UINT64_C(1) << RS_HIST_MAX_BITS)) return RS_HIST_BUCKETS - 1;
+
+	shift = (63 - __builtin_clzll(usec)) - (RS_HIST_SUB_BITS - 1);
+
+	return (shift * RS_HIST_HALF) + (usec >> shift);
+}
+
+/** Return the highest latency which maps to a histogram bucket
+ *
+ */
+static inline uint64_t rs_hist_value(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < (1 << RS_HIST_SUB_BITS)) return idx;
+
+	shift = (idx / RS_HIST_HALF) - 1;
+
+	return ((uint64_t)(idx - (shift * RS_HIST_HALF) + 1) << shift) - 1;
+}
+
+/** Find the latency (us) at or below which a given fraction of this interval's latencies fall
+ *
+ */
+static uint64_t rs_hist_quantile(rs_series_t const *series, double q)
+{
+	uint64_t	want, seen = 0;
+	unsigned int	i;
+
+	want = ceil(q * series->count);
+	if (want == 0) want = 1;
+
+	for (i = 0; i < RS_HIST_BUCKETS; i++) {
+		seen += series->hist[i];
+		if (seen >= want) break;
+	}
+	if (i == RS_HIST_BUCKETS) i--;
+
+	return rs_hist_value(i);
+}
+
+static uint32_t rs_series_hash(void const *data)
+{
+	rs_series_key_t const	*key = data;
+	uint32_t		hash;
+
+	hash = fr_hash(&key->code, sizeof(key->code));
+	if (key->client.af == AF_UNSPEC) return hash;
+
+#define HASH_IPADDR(_ip) \
+	(((_ip)->af == AF_INET) ? fr_hash_update(&(_ip)->addr.v4, sizeof((_ip)->addr.v4), hash) : \
+				  fr_hash_update(&(_ip)->addr.v6, sizeof((_ip)->addr.v6), hash))
+	hash = HASH_IPADDR(&key->client);
+	hash = HASH_IPADDR(&key->server);
+#undef HASH_IPADDR
+
+	return fr_hash_update(&key->server_port, sizeof(key->server_port), hash);
+}
+
+static int rs_series_cmp(void const *one, void const *two)
+{
+	rs_series_key_t const	*a = one, *b = two;
+	int			ret;
+
+	ret = (a->code > b->code) - (a->code < b->code);
+	if (ret != 0) return ret;
+
+	if ((a->client.af == AF_UNSPEC) || (b->client.af == AF_UNSPEC)) {
+		return (a->client.af > b->client.af) - (a->client.af < b->client.af);
+	}
+
+	ret = fr_ipaddr_cmp(&a->client, &b->client);
+	if (ret != 0) return ret;
+
+	ret = fr_ipaddr_cmp(&a->server, &b->server);
+	if (ret != 0) return ret;
+
+	return (a->server_port > b->server_port) - (a->server_port < b->server_port);
+}
+
+/** Allocate the table of latency histograms for a set of stats
+ *
+ */
+static void rs_series_init(TALLOC_CTX *ctx, rs_stats_t *stats)
+{
+	MEM(stats->series = fr_hash_table_create(ctx, rs_series_hash, rs_series_cmp, NULL));
+}
+
+/** Find or create the latency histogram for a packet type, or a NAS and server pair
+ *
+ * @param[in] stats	to find the histogram in.
+ * @param[in] key	packet code and addresses of the series.  If client.af is AF_UNSPEC, the
+ *			series covers all packets of that type.
+ * @return
+ *	- The series.
+ *	- NULL if we're already tracking RS_SERIES_MAX pairs.
+ */
+static rs_series_t *rs_series_find(rs_stats_t *stats, rs_series_key_t const *key)
+{
+	rs_series_t	*series;
+
+	series = fr_hash_table_finddata(stats->series, key);
+	if (series) return series;
+
+	if ((key->client.af != AF_UNSPEC) && (fr_hash_table_num_elements(stats->series) >= RS_SERIES_MAX)) {
+		if (!stats->series_full) {
+			ERROR("Tracking latency for too many NAS/server pairs (%i), ignoring new pairs",
+			      RS_SERIES_MAX);
+			stats->series_full = true;
+		}
+		return NULL;
+	}
+
+	MEM(series = talloc_zero(stats->series, rs_series_t));
+	series->key = *key;
+
+	if (!fr_hash_table_insert(stats->series, series)) {
+		talloc_free(series);
+		return NULL;
+	}
+
+	return series;
+}
+
+/** Record a latency for a packet type, and optionally for the NAS and server the request was sent between
+ *
+ */
+static void rs_series_update(rs_stats_t *stats, FR_CODE code, RADIUS_PACKET const *request, uint64_t usec)
+{
+	rs_series_key_t	key = { .code = code, .client = { .af = AF_UNSPEC } };
+	rs_series_t	*series;
+	unsigned int	idx = rs_hist_index(usec);
+
+	if (request) {
+		key.client = request->src_ipaddr;
+		key.server = request->dst_ipaddr;
+		key.server_port = request->dst_port;
+	}
+
+	series = rs_series_find(stats, &key);
+	if (!series) return;
+
+	series->count++;
+	series->sum += usec;
+	series->hist[idx]++;
+}
+
+static int _rs_series_merge(void *ctx, void *data)
+{
+	rs_stats_t	*stats = ctx;
+	rs_series_t	*in = data;
+	rs_series_t	*to;
+	unsigned int	i;
+
+	if (!in->count) return 0;
+
+	to = rs_series_find(stats, &in->key);
+	if (to) {
+		to->count += in->count;
+		to->sum += in->sum;
+		for (i = 0; i < RS_HIST_BUCKETS; i++) to->hist[i] += in->hist[i];
+	}
+
+	in->count = 0;
+	in->sum = 0;
+	memset(in->hist, 0, sizeof(in->hist));
+
+	return 0;
+}
+
+static int _rs_series_clear(UNUSED void *ctx, void *data)
+{
+	rs_series_t	*series = data;
+
+	if (!series->count) return 0;
+
+	series->total_count += series->count;
+	series->total_sum += series->sum;
+	series->count = 0;
+	series->sum = 0;
+	memset(series->hist, 0, sizeof(series->hist));
+
+	return 0;
+}
+
+/** Set the percentile latencies (ms) for a packet type from its histogram
+ *
+ */
+static void rs_stats_process_quantiles(rs_stats_t *stats, FR_CODE code)
+{
+	rs_latency_t	*latency = &stats->exchange[code];
+	rs_series_key_t	key = { .code = code, .client = { .af = AF_UNSPEC } };
+	rs_series_t	*series;
+
+	series = fr_hash_table_finddata(stats->series, &key);
+	if (!series || !series->count) {
+		double unk = strtod("NAN()", (char **) NULL);
+
+		latency->interval.latency_p50 = unk;
+		latency->interval.latency_p90 = unk;
+		latency->interval.latency_p99 = unk;
+		return;
+	}
+
+	latency->interval.latency_p50 = rs_hist_quantile(series, 0.5) / 1000.0;
+	latency->interval.latency_p90 = rs_hist_quantile(series, 0.9) / 1000.0;
+	latency->interval.latency_p99 = rs_hist_quantile(series, 0.99) / 1000.0;
+}
+
+static int _rs_series_write(void *ctx, void *data)
+{
+	FILE		*fp = ctx;
+	rs_series_t	*series = data;
+	char		labels[256];
+	size_t		len;
+	size_t		i;
+
+	static double const quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+	if (!series->count && !series->total_count) return 0;
+
+	if ((series->key.code < FR_RADIUS_MAX_PACKET_CODE) && fr_packet_codes[series->key.code]) {
+		len = snprintf(labels, sizeof(labels), "code=\"%s\"", fr_packet_codes[series->key.code]);
+	} else {
+		len = snprintf(labels, sizeof(labels), "code=\"%u\"", series->key.code);
+	}
+
+	if (series->key.client.af != AF_UNSPEC) {
+		char client[FR_IPADDR_STRLEN], server[FR_IPADDR_STRLEN];
+
+		fr_inet_ntop(client, sizeof(client), &series->key.client);
+		fr_inet_ntop(server, sizeof(server), &series->key.server);
+		snprintf(labels + len, sizeof(labels) - len, ",client=\"%s\",server=\"%s\",port=\"%u\"",
+			 client, server, series->key.server_port);
+	}
+
+	for (i = 0; i < NUM_ELEMENTS(quantiles); i++) {
+		if (!series->count) {
+			fprintf(fp, "radsniff_latency_seconds{%s,quantile=\"%g\"} NaN\n", labels, quantiles[i]);
+			continue;
+		}
+		fprintf(fp, "radsniff_latency_seconds{%s,quantile=\"%g\"} %.6f\n", labels, quantiles[i],
+			rs_hist_quantile(series, quantiles[i]) / 1000000.0);
+	}
+	fprintf(fp, "radsniff_latency_seconds_count{%s} %" PRIu64 "\n", labels,
+		series->total_count + series->count);
+	fprintf(fp, "radsniff_latency_seconds_sum{%s} %.6f\n", labels,
+		(series->total_sum + series->sum) / 1000000.0);
+
+	return 0;
+}
+
+/** Write latency quantiles for the last interval, and running totals, in OpenMetrics text format
+ *
+ * The file is written under a temporary name, and renamed, so scrapers never see a partial file.
+ */
+static void rs_stats_write_metrics(rs_stats_t *stats)
+{
+	char	path[PATH_MAX];
+	FILE	*fp;
+
+	snprintf(path, sizeof(path), "%s.tmp", conf->stats.metrics);
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		ERROR("Failed opening metrics file \"%s\": %s", path, fr_syserror(errno));
+		return;
+	}
+
+	fprintf(fp, "# TYPE radsniff_latency_seconds summary\n");
+	fprintf(fp, "# UNIT radsniff_latency_seconds seconds\n");
+	fprintf(fp, "# HELP radsniff_latency_seconds Time between a request and its response.\n");
+	(void) fr_hash_table_walk(stats->series, _rs_series_write, fp);
+	fprintf(fp, "# EOF\n");
+
+	if (fclose(fp) < 0) {
+		ERROR("Failed writing metrics file \"%s\": %s", path, fr_syserror(errno));
+		unlink(path);
+		return;
+	}
+
+	if (rename(path, conf->stats.metrics) < 0) {
+		ERROR("Failed renaming \"%s\" to \"%s\": %s", path, conf->stats.metrics, fr_syserror(errno));
+		unlink(path);
+	}
+}
+
+/** Add the counters from one interval of a decoding thread to the main stats, and clear them
+ *
+ */
+static void rs_stats_merge(rs_stats_t *stats, rs_stats_t *from)
+{
+	size_t	i, j;
+
+	for (i = 0; i < NUM_ELEMENTS(rs_useful_codes); i++) {
+		rs_latency_t *to = &stats->exchange[rs_useful_codes[i]];
+		rs_latency_t *in = &from->exchange[rs_useful_codes[i]];
+
+		to->interval.received_total += in->interval.received_total;
+		to->interval.linked_total += in->interval.linked_total;
+		to->interval.unlinked_total += in->interval.unlinked_total;
+		to->interval.reused_total += in->interval.reused_total;
+		to->interval.lost_total += in->interval.lost_total;
+		for (j = 0; j < NUM_ELEMENTS(in->interval.rt_total); j++) {
+			to->interval.rt_total[j] += in->interval.rt_total[j];
+		}
+
+		to->interval.latency_total += in->interval.latency_total;
+		if (in->interval.latency_high > to->interval.latency_high) {
+			to->interval.latency_high = in->interval.latency_high;
+		}
+		if (in->interval.latency_low &&
+		    (!to->interval.latency_low || (in->interval.latency_low < to->interval.latency_low))) {
+			to->interval.latency_low = in->interval.latency_low;
+		}
+
+		memset(&in->interval, 0, sizeof(in->interval));
+	}
+
+	/*
+	 *	Entries are never removed from the thread's table,
+	 *	so it's only ever written to by the thread.
+	 */
+	(void) fr_hash_table_walk(from->series, _rs_series_merge, stats);
+
+	if (timercmp(&from->quiet, &stats->quiet, >)) stats->quiet = from->quiet;
+}
+
+/** Move decoding threads on to the next interval, and merge their stats for the last one
+ *
+ * @return
+ *	- true if the stats for the last interval have been merged.
+ *	- false if some threads are still writing to them.
+ */
+static bool rs_workers_merge(rs_stats_t *stats)
+{
+	uint32_t	epoch = atomic_load_explicit(&conf->epoch, memory_order_relaxed);
+	int		i;
+
+	if (!conf->merge_pending) {
+		atomic_store_explicit(&conf->epoch, ++epoch, memory_order_release);
+		conf->merge_pending = true;
+	}
+
+	for (i = 0; i < conf->threads; i++) {
+		if (atomic_load_explicit(&conf->workers[i].seen, memory_order_acquire) != epoch) return false;
+	}
+
+	for (i = 0; i < conf->threads; i++) rs_stats_merge(stats, &conf->workers[i].stats[(epoch - 1) & 1]);
+	conf->merge_pending = false;
+
+	return true;
+}
+
 /** Process stats for a single interval
  *
  */
@@ -815,6 +1191,20 @@ static void rs_stats_process(fr_event_list_t *el, fr_time_t now_t, void *ctx)
 	rs_stats_t	*stats = this->stats;
 	struct timeval	now;
 
+	/*
+	 *	Threads acknowledge the new interval within
+	 *	RS_WORKER_POLL ms, check again shortly.
+	 */
+	if (conf->workers && !rs_workers_merge(stats)) {
+		static fr_event_timer_t const *retry;
+
+		if (fr_event_timer_in(NULL, el, &retry, fr_time_delta_from_msec(RS_MERGE_RETRY),
+				      rs_stats_process, ctx) < 0) {
+			ERROR("Failed inserting stats merge event");
+		}
+		return;
+	}
+
 	now = fr_time_to_timeval(now_t);
 
 	if (!this->done_header) {
@@ -844,10 +1234,13 @@ static void rs_stats_process(fr_event_list_t *el, fr_time_t now_t, void *ctx)
 	for (i = 0; i < rs_codes_len; i++) {
 		rs_stats_process_latency(&stats->exchange[rs_useful_codes[i]]);
 		rs_stats_process_counters(&stats->exchange[rs_useful_codes[i]]);
+		rs_stats_process_quantiles(stats, rs_useful_codes[i]);
 	}
 
 	if (this->body) this->body(this, stats, &now);
 
+	if (conf->stats.metrics) rs_stats_write_metrics(stats);
+
 #ifdef HAVE_COLLECTDC_H
 	/*
 	 *	Update stats in collectd using the complex structures we
@@ -866,6 +1259,7 @@ clear:
 		memset(&stats->exchange[rs_useful_codes[i]].interval, 0,
 		       sizeof(stats->exchange[rs_useful_codes[i]].interval));
 	}
+	(void) fr_hash_table_walk(stats->series, _rs_series_clear, NULL);
 
 	{
 		static fr_event_timer_t const *event;
@@ -1029,6 +1423,7 @@ static void rs_packet_cleanup(rs_request_t *request)
 {
 
 	RADIUS_PACKET *packet = request->packet;
+	rs_stats_t *stats = request->source->stats;
 	uint64_t count = request->id;
 
 	RS_ASSERT(request->stats_req);
@@ -1057,7 +1452,7 @@ static void rs_packet_cleanup(rs_request_t *request)
 		if (!request->linked) {
 			if (!request->stats_req) return;
 
-			request->stats_req->interval.lost_total++;
+			stats->exchange[request->stats_req].interval.lost_total++;
 
 			if (conf->event_flags & RS_LOST) {
 				/* @fixme We should use flags in the request to indicate whether it's been dumped
@@ -1077,17 +1472,17 @@ static void rs_packet_cleanup(rs_request_t *request)
 	 */
 	if (request->rt_req) {
 		if (request->rt_req > RS_RETRANSMIT_MAX) {
-			request->stats_req->interval.rt_total[RS_RETRANSMIT_MAX]++;
+			stats->exchange[request->stats_req].interval.rt_total[RS_RETRANSMIT_MAX]++;
 		} else {
-			request->stats_req->interval.rt_total[request->rt_req]++;
+			stats->exchange[request->stats_req].interval.rt_total[request->rt_req]++;
 		}
 	}
 
 	if (request->rt_rsp) {
 		if (request->rt_rsp > RS_RETRANSMIT_MAX) {
-			request->stats_rsp->interval.rt_total[RS_RETRANSMIT_MAX]++;
+			stats->exchange[request->stats_rsp].interval.rt_total[RS_RETRANSMIT_MAX]++;
 		} else {
-			request->stats_rsp->interval.rt_total[request->rt_rsp]++;
+			stats->exchange[request->stats_rsp].interval.rt_total[request->rt_rsp]++;
 		}
 	}
 
@@ -1196,6 +1591,53 @@ static inline int rs_request_to_pcap(rs_event_t *event, rs_request_t *request, s
 	return 0;
 }
 
+/** Check the RADIUS header of a packet, without walking its attributes
+ *
+ * Used instead of fr_radius_packet_ok() when we're only producing stats, and
+ * nothing needs the attributes.  Packets with malformed attributes are counted
+ * as normal packets.
+ */
+static bool rs_packet_header_ok(RADIUS_PACKET *packet, decode_fail_t *reason)
+{
+	size_t len;
+
+	if (packet->data_len < RADIUS_HEADER_LENGTH) {
+		fr_strerror_printf("packet is too short (received %zu < minimum 20)", packet->data_len);
+		*reason = DECODE_FAIL_MIN_LENGTH_PACKET;
+		return false;
+	}
+
+	if (!is_radius_code(packet->data[0])) {
+		fr_strerror_printf("unknown packet code %d", packet->data[0]);
+		*reason = DECODE_FAIL_UNKNOWN_PACKET_CODE;
+		return false;
+	}
+
+	len = (packet->data[2] << 8) | packet->data[3];
+	if (len < RADIUS_HEADER_LENGTH) {
+		fr_strerror_printf("length in header is too small (length %zu < minimum 20)", len);
+		*reason = DECODE_FAIL_MIN_LENGTH_FIELD;
+		return false;
+	}
+
+	if (packet->data_len < len) {
+		fr_strerror_printf("packet is truncated (received %zu <  packet header length of %zu)",
+				   packet->data_len, len);
+		*reason = DECODE_FAIL_MIN_LENGTH_MISMATCH;
+		return false;
+	}
+
+	/*
+	 *	Anything after the length is padding.
+	 */
+	packet->data_len = len;
+	packet->code = packet->data[0];
+	packet->id = packet->data[1];
+	memcpy(packet->vector, packet->data + 4, sizeof(packet->vector));
+
+	return true;
+}
+
 /* This is the same as immediately scheduling the cleanup event */
 #define RS_CLEANUP_NOW(_x, _s)\
 	{\
@@ -1224,7 +1666,6 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	bool			response;		/* Was it a response code */
 
 	decode_fail_t		reason;			/* Why we failed decoding the packet */
-	static uint64_t		captured = 0;
 
 	rs_status_t		status = RS_NORMAL;	/* Any special conditions (RTX, Unlinked, ID-Reused) */
 	RADIUS_PACKET		*packet;		/* Current packet were processing */
@@ -1329,7 +1770,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	 *	recover once some requests timeout, so make an effort to deal
 	 *	with allocation failures gracefully.
 	 */
-	packet = fr_radius_alloc(conf, false);
+	packet = fr_radius_alloc(thread_ctx, false);
 	if (!packet) {
 		REDEBUG("Failed allocating memory to hold decoded packet");
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &stats->quiet);
@@ -1362,7 +1803,8 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	packet->src_port = ntohs(udp->src);
 	packet->dst_port = ntohs(udp->dst);
 
-	if (!fr_radius_packet_ok(packet, RADIUS_MAX_ATTRIBUTES, false, &reason)) {
+	if (!(conf->decode_attrs ? fr_radius_packet_ok(packet, RADIUS_MAX_ATTRIBUTES, false, &reason) :
+				   rs_packet_header_ok(packet, &reason))) {
 		fr_perror("radsniff");
 		if (conf->event_flags & RS_ERROR) {
 			rs_packet_print(NULL, count, RS_ERROR, event->in, packet, &elapsed, NULL, false, false);
@@ -1462,7 +1904,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			 *	...nope it's the first response to a request.
 			 */
 			} else {
-				original->stats_rsp = &stats->exchange[packet->code];
+				original->stats_rsp = packet->code;
 			}
 
 			/*
@@ -1673,12 +2115,13 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	...nope it's a new request.
 		 */
 		} else {
-			original = talloc_zero(conf, rs_request_t);
+			original = talloc_zero(thread_ctx, rs_request_t);
 			talloc_set_destructor(original, _request_free);
 
 			original->id = count;
 			original->in = event->in;
-			original->stats_req = &stats->exchange[packet->code];
+			original->source = event;
+			original->stats_req = packet->code;
 
 			/* Set the packet pointer to the start of the buffer*/
 			original->capture_p = original->capture;
@@ -1773,6 +2216,16 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		rs_stats_update_latency(&stats->exchange[packet->code], &latency);
 		rs_stats_update_latency(&stats->exchange[original->expect->code], &latency);
 
+		if (conf->stats.interval) {
+			uint64_t usec = fr_time_delta_to_usec(packet->timestamp - original->packet->timestamp);
+
+			rs_series_update(stats, packet->code, NULL, usec);
+			if (original->expect->code != packet->code) {
+				rs_series_update(stats, original->expect->code, NULL, usec);
+			}
+			if (conf->stats.metrics) rs_series_update(stats, original->packet->code, original->packet, usec);
+		}
+
 		/*
 		 *	We're filtering on response, now print out the full data from the request
 		 */
@@ -1803,7 +2256,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 				packet, &elapsed, NULL, response, true);
 	}
 
-	fflush(fr_log_fp);
+	if (conf->logger) fflush(fr_log_fp);
 
 	/*
 	 *	If it's an unlinked response, we need to free it explicitly, as it will
@@ -1813,25 +2266,41 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		fr_radius_packet_free(&packet);
 	}
 
-	captured++;
 	/*
 	 *	We've hit our capture limit, break out of the event loop
 	 */
-	if ((conf->limit > 0) && (captured >= conf->limit)) {
-		INFO("Captured %" PRIu64 " packets, exiting...", captured);
-		fr_event_loop_exit(events, 1);
+	if ((atomic_fetch_add_explicit(&captured, 1, memory_order_relaxed) + 1 == conf->limit) && (conf->limit > 0)) {
+		INFO("Captured %" PRIu64 " packets, exiting...", conf->limit);
+
+		/*
+		 *	Decoding threads can't stop the main event loop
+		 *	directly, so go through the signal pipe.
+		 */
+		if (conf->workers) {
+			rs_signal_self(SIGTERM);
+		} else {
+			fr_event_loop_exit(events, 1);
+		}
 	}
 }
 
+/** Process one packet from a batch read by pcap_dispatch()
+ *
+ */
+static void rs_got_packet_batch(u_char *uctx, struct pcap_pkthdr const *header, u_char const *data)
+{
+	rs_event_t *event = (rs_event_t *)uctx;
+
+	rs_packet_process(++packets_seen, event, header, data);
+}
+
 static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *ctx)
 {
-	static uint64_t		count = 0;	/* Packets seen */
 	static fr_time_t	last_sync = 0;
 	fr_time_t		now_real;
 	rs_event_t		*event = talloc_get_type(ctx, rs_event_t);
 	pcap_t			*handle = event->in->handle;
 
-	int			i;
 	int			ret;
 	const			uint8_t *data;
 	struct			pcap_pkthdr *header;
@@ -1841,11 +2310,15 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 	 *	pcap file time, we need to implement our own time
 	 *	tracking here, and run the monotonic/wallclock sync
 	 *	event ourselves.
+	 *
+	 *	Decoding threads leave this to the first thread.
 	 */
-	now_real = fr_time();
-	if ((now_real - last_sync) > fr_time_delta_from_sec(1)) {
-		fr_time_sync();
-		last_sync = now_real;
+	if (!conf->workers) {
+		now_real = fr_time();
+		if ((now_real - last_sync) > fr_time_delta_from_sec(1)) {
+			fr_time_sync();
+			last_sync = now_real;
+		}
 	}
 
 	/*
@@ -1889,9 +2362,8 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 			do {
 				now = fr_time_from_timeval(&header->ts);
 			} while (fr_event_timer_run(el, &now) == 1);
-			count++;
 
-			rs_packet_process(count, event, header, data);
+			rs_packet_process(++packets_seen, event, header, data);
 		}
 		return;
 	}
@@ -1899,20 +2371,14 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 	/*
 	 *	Consume multiple packets from the capture buffer.
 	 *	We occasionally need to yield to allow events to run.
+	 *
+	 *	With memory mapped capture, pcap_dispatch() walks
+	 *	whole blocks of the ring, without a system call per
+	 *	packet.
 	 */
-	for (i = 0; i < RS_FORCE_YIELD; i++) {
-		ret = pcap_next_ex(handle, &header, &data);
-		if (ret == 0) {
-			/* No more packets available at this time */
-			return;
-		}
-		if (ret < 0) {
-			ERROR("Error requesting next packet, got (%i): %s", ret, pcap_geterr(handle));
-			return;
-		}
-
-		count++;
-		rs_packet_process(count, event, header, data);
+	ret = pcap_dispatch(handle, RS_FORCE_YIELD, rs_got_packet_batch, (u_char *)event);
+	if (ret < 0) {
+		ERROR("Error requesting next packet, got (%i): %s", ret, pcap_geterr(handle));
 	}
 }
 
@@ -2161,6 +2627,244 @@ fr_event_list_t *list, int fd, int UNUSED flags, UNUSED void *ctx)
 	}
 }
 
+/** Apply the capture filter to a newly opened handle
+ *
+ */
+static int rs_pcap_filter(fr_pcap_t *in)
+{
+	if (!conf->pcap_filter) return 0;
+
+	/*
+	 *	Not all link layers support VLAN tags
+	 *	and this is the easiest way to discover
+	 *	which do and which don't.
+	 */
+	if ((!conf->pcap_filter_vlan ||
+	     (fr_pcap_apply_filter(in, conf->pcap_filter_vlan) < 0)) &&
+	     (fr_pcap_apply_filter(in, conf->pcap_filter) < 0)) {
+		fr_perror("Failed applying filter");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Start writing stats for a new interval, if the main thread has moved on to one
+ *
+ */
+static void rs_worker_sync(rs_worker_t *worker)
+{
+	uint32_t	epoch = atomic_load_explicit(&conf->epoch, memory_order_acquire);
+	rs_stats_t	*stats;
+	fr_pcap_t	*in_p;
+	size_t		i;
+
+	if (epoch == worker->epoch) return;
+
+	/*
+	 *	Drops are checked here, as the capture handles
+	 *	belong to this thread.  Mute the interval which
+	 *	is ending, and the main thread mutes the rest.
+	 */
+	for (in_p = worker->in;
+	     in_p;
+	     in_p = in_p->next) {
+		if (rs_check_pcap_drop(in_p) < 0) {
+			struct timeval now = fr_time_to_timeval(fr_time());
+
+			ERROR("Muting stats for the next %i milliseconds", conf->stats.timeout);
+			rs_tv_add_ms(&now, conf->stats.timeout, &worker->stats[worker->epoch & 1].quiet);
+		}
+	}
+
+	worker->epoch = epoch;
+	stats = &worker->stats[epoch & 1];
+	for (i = 0; i < talloc_array_length(worker->events); i++) worker->events[i]->stats = stats;
+
+	/*
+	 *	Everything we wrote to the old stats is
+	 *	visible to the main thread after this.
+	 */
+	atomic_store_explicit(&worker->seen, epoch, memory_order_release);
+}
+
+/** Check whether we need to exit, or move on to a new stats interval
+ *
+ */
+static void rs_worker_poll(fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rs_worker_t	*worker = uctx;
+	static _Thread_local int polls;
+
+	if (atomic_load_explicit(&conf->stop, memory_order_acquire)) {
+		fr_event_loop_exit(el, 1);
+		return;
+	}
+
+	rs_worker_sync(worker);
+
+	if ((worker->id == 0) && ((++polls % (1000 / RS_WORKER_POLL)) == 0)) fr_time_sync();
+
+	if (fr_event_timer_in(NULL, el, &worker->poll, fr_time_delta_from_msec(RS_WORKER_POLL),
+			      rs_worker_poll, worker) < 0) {
+		ERROR("Failed inserting decoding thread %i poll event", worker->id);
+		rs_signal_self(SIGTERM);
+	}
+}
+
+/** Read and decode packets from this thread's capture handles
+ *
+ */
+static void *rs_worker_thread(void *arg)
+{
+	rs_worker_t	*worker = arg;
+	fr_pcap_t	*in_p;
+	size_t		i, num = 0;
+
+	thread_ctx = talloc_init_const("radsniff decoding thread");
+
+	events = fr_event_list_alloc(thread_ctx, NULL, NULL);
+	if (!events) {
+		fr_perror("Failed allocating event list for decoding thread %i", worker->id);
+		goto error;
+	}
+
+	MEM(request_tree = rbtree_talloc_alloc(thread_ctx, (rbcmp) rs_packet_cmp, rs_request_t, _unmark_request, 0));
+
+	for (in_p = worker->in; in_p; in_p = in_p->next) num++;
+	MEM(worker->events = talloc_array(thread_ctx, rs_event_t *, num));
+
+	for (in_p = worker->in, i = 0;
+	     in_p;
+	     in_p = in_p->next, i++) {
+		rs_event_t *event;
+
+		MEM(event = talloc_zero(events, rs_event_t));
+		event->list = events;
+		event->in = in_p;
+		event->stats = &worker->stats[0];
+		worker->events[i] = event;
+
+		if (fr_event_fd_insert(NULL, events, in_p->fd, rs_got_packet, NULL, NULL, event) < 0) {
+			fr_perror("Failed inserting file descriptor for decoding thread %i", worker->id);
+			goto error;
+		}
+	}
+
+	if (fr_event_timer_in(NULL, events, &worker->poll, fr_time_delta_from_msec(RS_WORKER_POLL),
+			      rs_worker_poll, worker) < 0) {
+		fr_perror("Failed inserting decoding thread %i poll event", worker->id);
+		goto error;
+	}
+
+	DEBUG2("Decoding thread %i started", worker->id);
+
+	fr_event_loop(events);
+
+	DEBUG2("Decoding thread %i exiting", worker->id);
+
+	/*
+	 *	Requests are freed before the trees and
+	 *	event list they're in.
+	 */
+	talloc_free(thread_ctx);
+
+	return NULL;
+
+error:
+	rs_signal_self(SIGTERM);
+	talloc_free(thread_ctx);
+
+	return NULL;
+}
+
+/** Open a capture handle for each decoding thread on each interface
+ *
+ * The first thread uses the handles we've already opened.  Each interface gets its
+ * own fanout group, which all the thread's handles for that interface join.
+ */
+static int rs_workers_open(fr_pcap_t *in)
+{
+	fr_pcap_t	*in_p;
+	uint16_t	group = (getpid() & 0xff) << 8;
+	int		i;
+
+	MEM(conf->workers = talloc_zero_array(conf, rs_worker_t, conf->threads));
+	for (i = 0; i < conf->threads; i++) {
+		conf->workers[i].id = i;
+		atomic_init(&conf->workers[i].seen, 0);
+		rs_series_init(conf->workers, &conf->workers[i].stats[0]);
+		rs_series_init(conf->workers, &conf->workers[i].stats[1]);
+	}
+	conf->workers[0].in = in;
+
+	for (in_p = in;
+	     in_p;
+	     in_p = in_p->next, group++) {
+		if (fr_pcap_fanout(in_p, group) < 0) {
+		fanout_error:
+			fr_perror("Failed setting up decoding threads for %s", in_p->name);
+			return -1;
+		}
+
+		for (i = 1; i < conf->threads; i++) {
+			rs_worker_t	*worker = &conf->workers[i];
+			fr_pcap_t	*handle;
+
+			handle = fr_pcap_init(conf, in_p->name, PCAP_INTERFACE_IN);
+			if (!handle) goto fanout_error;
+
+			handle->promiscuous = conf->promiscuous;
+			handle->buffer_pkts = conf->buffer_pkts;
+			if ((fr_pcap_open(handle) < 0) || (rs_pcap_filter(handle) < 0) ||
+			    (fr_pcap_fanout(handle, group) < 0)) goto fanout_error;
+
+			handle->next = worker->in;
+			worker->in = handle;
+		}
+	}
+
+	return 0;
+}
+
+/** Start the decoding threads
+ *
+ */
+static int rs_workers_start(void)
+{
+	int i, ret;
+
+	for (i = 0; i < conf->threads; i++) {
+		rs_worker_t *worker = &conf->workers[i];
+
+		ret = pthread_create(&worker->thread, NULL, rs_worker_thread, worker);
+		if (ret != 0) {
+			ERROR("Failed creating decoding thread %i: %s", i, fr_syserror(ret));
+			return -1;
+		}
+		worker->running = true;
+	}
+
+	return 0;
+}
+
+/** Tell the decoding threads to exit, and wait for them
+ *
+ */
+static void rs_workers_stop(void)
+{
+	int i;
+
+	atomic_store_explicit(&conf->stop, true, memory_order_release);
+
+	for (i = 0; i < conf->threads; i++) {
+		if (!conf->workers[i].running) continue;
+
+		pthread_join(conf->workers[i].thread, NULL);
+		conf->workers[i].running = false;
+	}
+}
+
 static void NEVER_RETURNS usage(int status)
 {
 	FILE *output = status ? stderr : stdout;
@@ -2195,12 +2899,15 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -R <filter>           RADIUS attribute response filter.\n");
 	fprintf(output, "  -s <secret>           RADIUS secret.\n");
 	fprintf(output, "  -S                    Write PCAP data to stdout.\n");
+	fprintf(output, "  -t <threads>          Decode packets from live interfaces in <threads> threads.\n");
 	fprintf(output, "  -v                    Show program version information and exit.\n");
 	fprintf(output, "  -w <file>             Write output packets to file.\n");
 	fprintf(output, "  -x                    Print more debugging information.\n");
 	fprintf(output, "stats options:\n");
 	fprintf(output, "  -W <interval>         Periodically write out statistics every <interval> seconds.\n");
 	fprintf(output, "  -E                    Print stats in CSV format.\n");
+	fprintf(output, "  -M <file>             Write latency histograms for each packet type and NAS/server\n");
+	fprintf(output, "                        pair to <file> in OpenMetrics format.\n");
 	fprintf(output, "  -T <timeout>          How many milliseconds before the request is counted as lost "
 		"(defaults to %i).\n", RS_DEFAULT_TIMEOUT);
 #ifdef HAVE_COLLECTDC_H
@@ -2252,8 +2959,10 @@ int main(int argc, char *argv[])
 
 	conf = talloc_zero(autofree, rs_t);
 	RS_ASSERT(conf);
+	thread_ctx = conf;
 
 	stats = talloc_zero(conf, rs_stats_t);
+	rs_series_init(stats, stats);
 
 	/*
 	 *  We don't really want probes taking down machines
@@ -2284,7 +2993,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != -1) {
+	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:l:L:mM:p:P:qr:R:s:St:vw:xXW:T:P:N:O:")) != -1) {
 		switch (c) {
 		case 'a':
 		{
@@ -2390,6 +3099,10 @@ int main(int argc, char *argv[])
 			conf->promiscuous = false;
 			break;
 
+		case 'M':
+			conf->stats.metrics = optarg;
+			break;
+
 		case 'p':
 			port = atoi(optarg);
 			break;
@@ -2422,6 +3135,14 @@ int main(int argc, char *argv[])
 			conf->to_stdout = true;
 			break;
 
+		case 't':
+			conf->threads = atoi(optarg);
+			if ((conf->threads <= 0) || (conf->threads > RS_THREADS_MAX)) {
+				ERROR("Number of decoding threads must be between 1 and %i", RS_THREADS_MAX);
+				usage(64);
+			}
+			break;
+
 		case 'v':
 #ifdef HAVE_COLLECTDC_H
 			INFO("%s, %s, collectdclient version %s", radsniff_version, pcap_lib_version(),
@@ -2516,6 +3237,11 @@ int main(int argc, char *argv[])
 		usage(64);
 	}
 
+	if (conf->stats.metrics && !conf->stats.interval) {
+		ERROR("Writing latency metrics (-M) requires a stats interval (-W)");
+		usage(64);
+	}
+
 	/* Reading from file overrides stdin */
 	if (conf->from_stdin && (conf->from_file || conf->from_dev)) {
 		conf->from_stdin = false;
@@ -2526,6 +3252,28 @@ int main(int argc, char *argv[])
 		conf->to_stdout = false;
 	}
 
+	/*
+	 *	Packets are spread between threads by the kernel, which
+	 *	only works for live capture.  Neither the pcap dumper,
+	 *	nor linking requests with attributes, work across threads.
+	 */
+	if (conf->threads) {
+		if (conf->from_file || conf->from_stdin) {
+			ERROR("Decoding threads (-t) can only be used with live capture");
+			usage(64);
+		}
+
+		if (conf->to_file || conf->to_stdout) {
+			ERROR("Decoding threads (-t) can't be used when writing packets (-w, -S)");
+			usage(64);
+		}
+
+		if (conf->link_attributes) {
+			ERROR("Decoding threads (-t) can't be used when linking requests with attributes (-L)");
+			usage(64);
+		}
+	}
+
 	if (conf->to_stdout) {
 		out = fr_pcap_init(conf, "stdout", PCAP_STDIO_OUT);
 		if (!out) {
@@ -2630,7 +3378,7 @@ int main(int argc, char *argv[])
 			usage(64);
 		}
 
-		link_tree = rbtree_talloc_alloc(conf, (rbcmp) rs_rtx_cmp, rs_request_t, _unmark_link, 0);
+		link_tree = rbtree_talloc_alloc(thread_ctx, (rbcmp) rs_rtx_cmp, rs_request_t, _unmark_link, 0);
 		if (!link_tree) {
 			ERROR("Failed creating RTX tree");
 			goto finish;
@@ -2688,7 +3436,7 @@ int main(int argc, char *argv[])
 	/*
 	 *	Setup the request tree
 	 */
-	request_tree = rbtree_talloc_alloc(conf, (rbcmp) rs_packet_cmp, rs_request_t, _unmark_request, 0);
+	request_tree = rbtree_talloc_alloc(thread_ctx, (rbcmp) rs_packet_cmp, rs_request_t, _unmark_request, 0);
 	if (!request_tree) {
 		ERROR("Failed creating request tree");
 		goto finish;
@@ -2838,19 +3586,7 @@ int main(int argc, char *argv[])
 				goto finish;
 			}
 
-			if (conf->pcap_filter) {
-				/*
-				 *	Not all link layers support VLAN tags
-				 *	and this is the easiest way to discover
-				 *	which do and which don't.
-				 */
-				if ((!conf->pcap_filter_vlan ||
-				     (fr_pcap_apply_filter(in_p, conf->pcap_filter_vlan) < 0)) &&
-				     (fr_pcap_apply_filter(in_p, conf->pcap_filter) < 0)) {
-					fr_perror("Failed applying filter");
-					goto finish;
-				}
-			}
+			if (rs_pcap_filter(in_p) < 0) goto finish;
 
 			*tmp_p = in_p;
 			tmp_p = &(in_p->next);
@@ -2935,18 +3671,27 @@ int main(int argc, char *argv[])
 		buff = fr_pcap_device_names(conf, in, ' ');
 		DEBUG("Sniffing on (%s)", buff);
 
+		/*
+		 *  Open a handle per thread on each interface.  The
+		 *  threads check for drops on their own handles.
+		 */
+		if (conf->threads) {
+			DEBUG("Decoding packets in %i threads", conf->threads);
+			if (rs_workers_open(in) < 0) goto finish;
+		}
+
 		/*
 		 *  Insert our stats processor
 		 */
 		if (conf->stats.interval && conf->from_dev) {
 			now = fr_time_to_timeval(fr_time());
-			rs_install_stats_processor(stats, events, in, &now, false);
+			rs_install_stats_processor(stats, events, conf->threads ? NULL : in, &now, false);
 		}
 
 		/*
 		 *  Now add fd's for each of the pcap sessions we opened
 		 */
-		for (in_p = in;
+		for (in_p = conf->threads ? NULL : in;
 		     in_p;
 		     in_p = in_p->next) {
 			rs_event_t *event;
@@ -2984,7 +3729,7 @@ int main(int argc, char *argv[])
 	/*
 	 *	If we just have the pipe, then exit.
 	 */
-	if (fr_event_list_num_fds(events) == 1) goto finish;
+	if (!conf->threads && (fr_event_list_num_fds(events) == 1)) goto finish;
 
 
 	/*
@@ -3004,6 +3749,15 @@ int main(int argc, char *argv[])
 #ifdef SIGQUIT
 	fr_set_signal(SIGQUIT, rs_signal_self);
 #endif
+	/*
+	 *	Threads don't survive daemonizing, so start them
+	 *	afterwards.
+	 */
+	if (conf->threads) {
+		gettimeofday(&start_pcap, NULL);
+		if (rs_workers_start() < 0) goto finish;
+	}
+
 	DEBUG2("Entering event loop");
 
 	fr_event_loop(events);	/* Enter the main event loop */
@@ -3012,6 +3766,7 @@ int main(int argc, char *argv[])
 
 finish:
 	cleanup = true;
+	if (conf->workers) rs_workers_stop();
 
 	if (conf->daemonize) unlink(conf->pidfile);
 
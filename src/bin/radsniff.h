@@ -28,11 +28,18 @@
 RCSIDH(radsniff_h, "$Id$")
 
 #include <sys/types.h>
+#include <pthread.h>
 
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/util/pcap.h>
 #include <freeradius-devel/util/event.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #ifdef HAVE_COLLECTDC_H
 #  include <collectd/client.h>
 #endif
@@ -44,6 +51,17 @@ RCSIDH(radsniff_h, "$Id$")
 #define RS_RETRANSMIT_MAX	5		//!< Maximum number of times we expect to see a packet retransmitted
 #define RS_MAX_ATTRS		50		//!< Maximum number of attributes we can filter on.
 #define RS_SOCKET_REOPEN_DELAY  5000		//!< How long we delay re-opening a collectd socket.
+#define RS_WORKER_POLL		100		//!< How often (ms) decoding threads check for a new stats
+						//!< interval, or a request to exit.
+#define RS_MERGE_RETRY		10		//!< How often (ms) we check whether all decoding threads
+						//!< have finished writing stats for an interval.
+#define RS_THREADS_MAX		64		//!< Maximum number of decoding threads.
+#define RS_HIST_SUB_BITS	5		//!< Each power of two in the latency histograms is split
+						//!< into 2^(RS_HIST_SUB_BITS - 1) buckets, for ~6% precision.
+#define RS_HIST_MAX_BITS	27		//!< Latencies of 2^27us (~134s) or more go in the last bucket.
+#define RS_HIST_HALF		(1 << (RS_HIST_SUB_BITS - 1))
+#define RS_HIST_BUCKETS		((RS_HIST_MAX_BITS - RS_HIST_SUB_BITS + 2) * RS_HIST_HALF)
+#define RS_SERIES_MAX		1024		//!< Maximum number of NAS/server pairs we track latency for.
 
 /*
  *	Logging macros
@@ -138,9 +156,38 @@ typedef struct {
 
 		double			latency_high;		//!< Latency high water mark.
 		double			latency_low;		//!< Latency low water mark.
+
+		double			latency_p50;		//!< Median latency, from the histogram.
+		double			latency_p90;		//!< 90th percentile latency.
+		double			latency_p99;		//!< 99th percentile latency.
 	} interval;
 } rs_latency_t;
 
+/** Latency histogram for a packet type, or for a NAS and server pair
+ *
+ * Latencies are recorded in microseconds.  Values below 2^RS_HIST_SUB_BITS get a bucket
+ * each, after that each power of two is split into RS_HIST_HALF equal buckets, so like
+ * HdrHistogram the relative error is the same across the whole range.
+ */
+typedef struct {
+	FR_CODE			code;			//!< Packet code.
+	fr_ipaddr_t		client;			//!< Where the request came from.  AF_UNSPEC for
+							//!< the series covering all packets of this type.
+	fr_ipaddr_t		server;			//!< Where the request was sent.
+	uint16_t		server_port;		//!< Port the request was sent to.
+} rs_series_key_t;
+
+typedef struct {
+	rs_series_key_t		key;			//!< Must be first, lookups are done with just the key.
+
+	uint64_t		count;			//!< Latencies recorded this interval.
+	uint64_t		sum;			//!< Sum of latencies this interval (us).
+	uint64_t		total_count;		//!< Latencies recorded in previous intervals.
+	uint64_t		total_sum;		//!< Sum of latencies in previous intervals (us).
+
+	uint32_t		hist[RS_HIST_BUCKETS];	//!< Number of latencies in each bucket this interval.
+} rs_series_t;
+
 typedef struct {
 	uint64_t		min_length_packet;
 	uint64_t		min_length_field;
@@ -168,6 +215,9 @@ typedef struct {
 
 	struct timeval		quiet;			//!< We may need to 'mute' the stats if libpcap starts
 							//!< dropping packets, or we run out of memory.
+
+	fr_hash_table_t		*series;		//!< Latency histograms (rs_series_t).
+	bool			series_full;		//!< Whether we've warned about hitting RS_SERIES_MAX.
 } rs_stats_t;
 
 typedef struct {
@@ -175,6 +225,19 @@ typedef struct {
 	uint8_t			*data;			//!< PCAP packet data.
 } rs_capture_t;
 
+/** Statistic write/print event
+ *
+ */
+typedef struct {
+	fr_event_list_t		*list;			//!< The event list.
+
+	fr_pcap_t		*in;			//!< PCAP handle event occurred on.
+	fr_pcap_t		*out;			//!< Where to write output.
+
+	rs_stats_t		*stats;			//!< Where to write stats.  Changes at the start of each
+							//!< interval when decoding in separate threads.
+} rs_event_t;
+
 /** Wrapper for RADIUS_PACKET
  *
  * Allows an event to be associated with a request packet.  This is required because we need to disarm
@@ -202,8 +265,10 @@ typedef struct {
 	uint64_t		rt_req;			//!< Number of times we saw the same request packet.
 	uint64_t		rt_rsp;			//!< Number of times we saw a retransmitted response
 							//!< packet.
-	rs_latency_t		*stats_req;		//!< Latency entry for the request type.
-	rs_latency_t		*stats_rsp;		//!< Latency entry for the request type.
+	rs_event_t		*source;		//!< Event the original request was received on.
+	FR_CODE			stats_req;		//!< Latency entry for the request type.
+	FR_CODE			stats_rsp;		//!< Latency entry for the response type, 0 if we've
+							//!< not seen a response.
 
 	bool			silent_cleanup;		//!< Cleanup was forced before normal expiry period,
 							//!< ignore stats about packet loss.
@@ -214,18 +279,6 @@ typedef struct {
 	bool			in_link_tree;		//!< Whether the request is currently in the linked tree.
 } rs_request_t;
 
-/** Statistic write/print event
- *
- */
-typedef struct {
-	fr_event_list_t		*list;			//!< The event list.
-
-	fr_pcap_t		*in;			//!< PCAP handle event occurred on.
-	fr_pcap_t		*out;			//!< Where to write output.
-
-	rs_stats_t		*stats;			//!< Where to write stats.
-} rs_event_t;
-
 typedef struct rs_update rs_update_t;
 
 /** Callback for printing stats header.
@@ -252,6 +305,30 @@ struct rs_update {
 	rs_stats_print_cb_t		body;			//!< Print body.
 };
 
+/** A decoding thread
+ *
+ * Each thread reads from its own capture handle on every interface.  The handles for an
+ * interface are members of the same fanout group, so the kernel spreads packets between
+ * threads by flow, and requests and responses are seen by the same thread.
+ *
+ * Stats are written without locks.  The thread writes to stats[epoch & 1], the main
+ * thread moves everyone on to the next epoch at the end of each interval, and merges the
+ * previous set once every thread has acknowledged the change.
+ */
+typedef struct {
+	int			id;			//!< Thread number, for logging.
+	pthread_t		thread;			//!< Thread handle.
+	bool			running;		//!< Whether the thread was started.
+
+	fr_pcap_t		*in;			//!< Capture handles this thread reads, one per interface.
+	rs_event_t		**events;		//!< One per capture handle, owned by the thread.
+	fr_event_timer_t const	*poll;			//!< Checks for interval changes and exit.
+
+	rs_stats_t		stats[2];		//!< Stats for alternate intervals.
+	uint32_t		epoch;			//!< Interval the thread is writing stats for.
+	atomic_uint_fast32_t	seen;			//!< Last interval the thread switched to.
+} rs_worker_t;
+
 struct rs {
 	bool			from_file;		//!< Were reading pcap data from files.
 	bool			from_dev;		//!< Were reading pcap data from devices.
@@ -298,10 +375,19 @@ struct rs {
 	int			buffer_pkts;		//!< Size of the ring buffer to setup for live capture.
 	uint64_t		limit;			//!< Maximum number of packets to capture
 
+	int			threads;		//!< Number of decoding threads, 0 to decode packets
+							//!< in the main thread.
+	rs_worker_t		*workers;		//!< Decoding threads.
+	atomic_uint_fast32_t	epoch;			//!< Current stats interval, written by the main thread.
+	bool			merge_pending;		//!< Waiting for threads to finish the last interval.
+	atomic_bool		stop;			//!< Tell decoding threads to exit.
+
 	struct {
 		int			interval;		//!< Time between stats updates in seconds.
 		stats_out_t		out;			//!< Where to write stats.
 		int			timeout;		//!< Maximum length of time we wait for a response.
+		char const		*metrics;		//!< Write latency histograms to this file in
+								//!< OpenMetrics format.
 
 #ifdef HAVE_COLLECTDC_H
 		char const		*collectd;		//!< Collectd server/port/unixsocket
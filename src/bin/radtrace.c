@@ -0,0 +1,362 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/bin/radtrace.c
+ * @brief Print the request traces written by radiusd.
+ *
+ * The trace file holds the records from all threads, interleaved.
+ * They're grouped back together by thread and request number, and
+ * each traced request is printed with its events in order.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/base.h>
+#include <freeradius-devel/server/trace.h>
+
+#include <ctype.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+#undef ERROR
+#define ERROR(fmt, ...)		fr_perror("radtrace: " fmt, ## __VA_ARGS__)
+
+/** One record, with the block it came from
+ *
+ */
+typedef struct {
+	fr_trace_record_t	record;		//!< Copied out, as the file isn't aligned.
+	uint8_t const		*data;		//!< Strings following the record.
+	uint32_t		thread;		//!< From the block header.
+	int64_t			wallclock;	//!< From the block header.
+	size_t			order;		//!< Position in the file.
+} rt_event_t;
+
+static char const *rcode_names[] = {
+	"reject", "fail", "ok", "handled", "invalid", "disallow", "notfound", "noop", "updated",
+	"numcodes", "yield", "unknown"
+};
+
+static char const *action_names[] = {
+	"", "calculate-result", "execute-next", "pushed-child", "unwind", "yield", "stop"
+};
+
+static uint64_t		filter_number;
+static bool		filter_number_set;
+static uint32_t		filter_thread;
+static bool		filter_thread_set;
+static fr_time_delta_t	filter_slow;
+
+static NEVER_RETURNS void usage(void)
+{
+	fprintf(stderr, "Usage: radtrace [options] file ...\n");
+	fprintf(stderr, "  -h              Print this help message.\n");
+	fprintf(stderr, "  -n <number>     Only print the request with this number.\n");
+	fprintf(stderr, "  -s <msec>       Only print requests which took at least this long.\n");
+	fprintf(stderr, "  -T <thread>     Only print requests processed by this thread.\n");
+
+	fr_exit_now(EXIT_FAILURE);
+}
+
+static char const *rcode_name(unsigned int rcode)
+{
+	if (rcode >= NUM_ELEMENTS(rcode_names)) return "?";
+
+	return rcode_names[rcode];
+}
+
+/** Get the n'th string from the data after a record
+ *
+ */
+static int event_string(char const **out, size_t *len, rt_event_t const *ev, int n)
+{
+	uint8_t const *p = ev->data, *end = ev->data + ev->record.length;
+
+	while (p < end) {
+		size_t slen = *p++;
+
+		if ((size_t) (end - p) < slen) break;
+		if (n-- == 0) {
+			*out = (char const *) p;
+			*len = slen;
+			return 0;
+		}
+		p += slen;
+	}
+
+	*out = "";
+	*len = 0;
+	return -1;
+}
+
+static int event_cmp(void const *one, void const *two)
+{
+	rt_event_t const *a = one, *b = two;
+
+	if (a->thread != b->thread) return (a->thread > b->thread) - (a->thread < b->thread);
+	if (a->record.number != b->record.number) return (a->record.number > b->record.number) -
+							 (a->record.number < b->record.number);
+
+	return (a->order > b->order) - (a->order < b->order);
+}
+
+/** Read a trace file, and append its records to the list of events
+ *
+ */
+static int trace_read(TALLOC_CTX *ctx, rt_event_t **events, size_t *num, size_t *alloced, char const *filename)
+{
+	FILE		*fp;
+	uint8_t		*buffer;
+	size_t		len = 0, size = 65536, offset;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	MEM(buffer = talloc_array(ctx, uint8_t, size));
+	for (;;) {
+		size_t got;
+
+		if (len == size) {
+			size *= 2;
+			MEM(buffer = talloc_realloc(ctx, buffer, uint8_t, size));
+		}
+
+		got = fread(buffer + len, 1, size - len, fp);
+		if (!got) break;
+		len += got;
+	}
+	fclose(fp);
+
+	offset = 0;
+	while ((len - offset) >= sizeof(fr_trace_block_t)) {
+		fr_trace_block_t	block;
+		uint8_t const		*p, *end;
+
+		memcpy(&block, buffer + offset, sizeof(block));
+		if (block.magic != FR_TRACE_MAGIC) {
+			fr_strerror_printf("%s: Invalid block at offset %zu", filename, offset);
+			return -1;
+		}
+		if (block.version != 1) {
+			fr_strerror_printf("%s: Unknown trace version %u", filename, block.version);
+			return -1;
+		}
+
+		p = buffer + offset + sizeof(block);
+		if ((size_t) ((buffer + len) - p) < block.length) {
+			fr_strerror_printf("%s: Truncated block at offset %zu", filename, offset);
+			return -1;
+		}
+		end = p + block.length;
+
+		while ((end - p) >= (ssize_t) sizeof(fr_trace_record_t)) {
+			rt_event_t *ev;
+
+			if (*num == *alloced) {
+				*alloced = *alloced ? *alloced * 2 : 1024;
+				MEM(*events = talloc_realloc(ctx, *events, rt_event_t, *alloced));
+			}
+			ev = &(*events)[*num];
+
+			memcpy(&ev->record, p, sizeof(ev->record));
+			p += sizeof(ev->record);
+			if ((end - p) < ev->record.length) {
+				fr_strerror_printf("%s: Truncated record at offset %zu", filename,
+						   (size_t) (p - buffer));
+				return -1;
+			}
+
+			ev->data = p;
+			ev->thread = block.thread;
+			ev->wallclock = block.wallclock;
+			ev->order = *num;
+			p += ev->record.length;
+
+			(*num)++;
+		}
+
+		offset += sizeof(block) + block.length;
+	}
+
+	return 0;
+}
+
+static void print_time(int64_t when)
+{
+	time_t		t = when / NSEC;
+	struct tm	tm;
+	char		buffer[64];
+
+	localtime_r(&t, &tm);
+	strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%06u", buffer, (unsigned int) ((when % NSEC) / 1000));
+}
+
+static inline double msec(int64_t delta)
+{
+	return ((double) delta) / 1000000;
+}
+
+/** Print the events for one request
+ *
+ */
+static void request_print(rt_event_t const *events, size_t num)
+{
+	size_t		i;
+	rt_event_t const *start = NULL, *done = NULL;
+	int64_t		base;
+	char const	*a, *b;
+	size_t		a_len, b_len;
+
+	for (i = 0; i < num; i++) {
+		if (events[i].record.type == FR_TRACE_REQUEST_START) start = &events[i];
+		if (events[i].record.type == FR_TRACE_REQUEST_DONE) done = &events[i];
+	}
+
+	if (filter_slow && (!done || (done->record.duration < filter_slow))) return;
+
+	base = start ? start->record.when : events[0].record.when - events[0].record.duration;
+
+	printf("Request %" PRIu64 " thread %u at ", events[0].record.number, events[0].thread);
+	print_time(events[0].wallclock + base);
+	printf("\n");
+
+	if (start) {
+		(void) event_string(&a, &a_len, start, 0);
+		(void) event_string(&b, &b_len, start, 1);
+		printf("\tserver %.*s client %.*s code %u\n", (int) a_len, a, (int) b_len, b, start->record.code);
+	}
+
+	for (i = 0; i < num; i++) {
+		rt_event_t const	*ev = &events[i];
+		fr_trace_record_t const	*r = &ev->record;
+
+		printf("\t+%9.3fms ", msec(r->when - base));
+
+		switch (r->type) {
+		case FR_TRACE_REQUEST_START:
+			printf("start\n");
+			break;
+
+		case FR_TRACE_REQUEST_DONE:
+			printf("done, reply code %u, took %.3fms\n", r->code, msec(r->duration));
+			break;
+
+		case FR_TRACE_INSTRUCTION:
+			(void) event_string(&a, &a_len, ev, 0);
+			printf("%*s%.*s (%s) %s %.3fms\n", r->depth * 2, "", (int) a_len, a, rcode_name(r->code),
+			       (r->flags < NUM_ELEMENTS(action_names)) ? action_names[r->flags] : "?",
+			       msec(r->duration));
+			break;
+
+		case FR_TRACE_MODULE:
+			(void) event_string(&a, &a_len, ev, 0);
+			printf("module %.*s (%s) %.3fms\n", (int) a_len, a, rcode_name(r->code), msec(r->duration));
+			break;
+
+		case FR_TRACE_ATTR:
+			(void) event_string(&a, &a_len, ev, 0);
+			(void) event_string(&b, &b_len, ev, 1);
+			printf("%.*s %s %.*s\n", (int) a_len, a,
+			       (r->code < T_TOKEN_LAST) ? fr_tokens[r->code] : "?", (int) b_len, b);
+			break;
+
+		default:
+			printf("unknown record type %u\n", r->type);
+			break;
+		}
+	}
+
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	int		c;
+	TALLOC_CTX	*autofree;
+	rt_event_t	*events = NULL;
+	size_t		num = 0, alloced = 0, i, j;
+
+	autofree = talloc_autofree_context();
+
+	while ((c = getopt(argc, argv, "hn:s:T:")) != -1) switch (c) {
+		case 'n':
+			if (!isdigit((int) *optarg)) usage();
+			filter_number = strtoull(optarg, NULL, 10);
+			filter_number_set = true;
+			break;
+
+		case 's':
+			if (!isdigit((int) *optarg)) usage();
+			filter_slow = (fr_time_delta_t) (strtod(optarg, NULL) * 1000000);
+			break;
+
+		case 'T':
+			if (!isdigit((int) *optarg)) usage();
+			filter_thread = strtoul(optarg, NULL, 10);
+			filter_thread_set = true;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) usage();
+
+	for (i = 0; i < (size_t) argc; i++) {
+		if (trace_read(autofree, &events, &num, &alloced, argv[i]) < 0) {
+			ERROR("");
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	if (!num) return EXIT_SUCCESS;
+
+	qsort(events, num, sizeof(events[0]), event_cmp);
+
+	/*
+	 *	Request numbers start again when the server is
+	 *	restarted, so a new start record also begins a new
+	 *	request.
+	 */
+	for (i = 0; i < num; i = j) {
+		for (j = i + 1; j < num; j++) {
+			if ((events[j].thread != events[i].thread) ||
+			    (events[j].record.number != events[i].record.number) ||
+			    (events[j].record.type == FR_TRACE_REQUEST_START)) break;
+		}
+
+		if (filter_number_set && (events[i].record.number != filter_number)) continue;
+		if (filter_thread_set && (events[i].thread != filter_thread)) continue;
+
+		request_print(&events[i], j - i);
+	}
+
+	return EXIT_SUCCESS;
+}
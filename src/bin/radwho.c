@@ -146,13 +146,40 @@ static char const *hostname(char *buf, size_t buflen, uint32_t ipaddr)
 /*
  *	Print usage message and exit.
  */
+/*
+ *	Read the next record, either from the whole file, or from
+ *	the records the index says may match.
+ */
+static bool radwho_read(FILE *fp, struct radutmp *rt, fr_radutmp_index_t const *index, uint32_t *cursor,
+			char const *user, uint32_t nas_ip_address, uint32_t nas_port)
+{
+	off_t offset;
+
+	if (!index) return (fread(rt, sizeof(*rt), 1, fp) == 1);
+
+	if (user) {
+		offset = fr_radutmp_index_user_next(index, cursor, user);
+	} else {
+		if (*cursor) return false;
+		*cursor = 1;
+		offset = fr_radutmp_index_port_find(index, nas_ip_address, nas_port);
+	}
+	if (offset < 0) return false;
+
+	if (fseeko(fp, offset, SEEK_SET) < 0) return false;
+
+	return (fread(rt, sizeof(*rt), 1, fp) == 1);
+}
+
 static void NEVER_RETURNS usage(int status)
 {
 	FILE *output = status?stderr:stdout;
 
-	fprintf(output, "Usage: radwho [-d raddb] [-cfihnprRsSZ] [-N nas] [-P nas_port] [-u user] [-U user]\n");
+	fprintf(output, "Usage: radwho [-d raddb] [-cefihnprRsSZ] [-N nas] [-P nas_port] [-u user] [-U user]\n");
 	fprintf(output, "  -c                   Show caller ID, if available.\n");
 	fprintf(output, "  -d                   Set the raddb directory (default is %s).\n", RADIUS_DIR);
+	fprintf(output, "  -e                   Usernames given with -u and -U must match exactly.\n");
+	fprintf(output, "                       This lets the session index be used.\n");
 	fprintf(output, "  -F <file>            Use radutmp <file>.\n");
 	fprintf(output, "  -i                   Show session ID.\n");
 	fprintf(output, "  -n                   No full name.\n");
@@ -196,6 +223,9 @@ int main(int argc, char **argv)
 	uint32_t		nas_port = ~0;
 	uint32_t		nas_ip_address = INADDR_NONE;
 	int			zap = 0;
+	int			exact = 0;
+	fr_radutmp_index_t	*index = NULL;
+	uint32_t		cursor = 0;
 	fr_dict_t		*dict = NULL;
 	TALLOC_CTX		*autofree;
 
@@ -235,13 +265,16 @@ int main(int argc, char **argv)
 		main_config_name_set_default(config, p + 1, false);
 	}
 
-	while((c = getopt(argc, argv, "d:D:fF:hnN:sSipP:crRu:U:Z")) != -1) switch (c) {
+	while((c = getopt(argc, argv, "d:D:efF:hnN:sSipP:crRu:U:Z")) != -1) switch (c) {
 		case 'd':
 			main_config_raddb_dir_set(config, optarg);
 			break;
 		case 'D':
 			main_config_dict_dir_set(config, optarg);
 			break;
+		case 'e':
+			exact = 1;
+			break;
 		case 'F':
 			radutmp_file = optarg;
 			break;
@@ -386,6 +419,16 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
+	/*
+	 *	Lookups by NAS port, or by an exact username, can go
+	 *	straight to the records through the index.  If there's
+	 *	no index, read the whole file.
+	 */
+	if ((user && exact) || ((nas_ip_address != INADDR_NONE) && (~nas_port != 0))) {
+		index = fr_radutmp_index_open(autofree, radutmp_file);
+		fr_strerror();	/* Clear the error buffer */
+	}
+
 	/*
 	 *	Don't print the headers if raw or RADIUS
 	 */
@@ -397,7 +440,7 @@ int main(int argc, char **argv)
 	/*
 	 *	Read the file, printing out active entries.
 	 */
-	while (fread(&rt, sizeof(rt), 1, fp) == 1) {
+	while (radwho_read(fp, &rt, index, &cursor, exact ? user : NULL, nas_ip_address, nas_port)) {
 		char name[sizeof(rt.login) + 1];
 
 		if (rt.type != P_LOGIN) continue; /* hide logout sessions */
@@ -413,10 +456,12 @@ int main(int argc, char **argv)
 		 *	Print out sessions only for the given user.
 		 */
 		if (user) {	/* only for a particular user */
+			size_t len = exact ? sizeof(rt.login) : strlen(user);
+
 			if (((user_cmp == 0) &&
-			     (strncasecmp(rt.login, user, strlen(user)) != 0)) ||
+			     (strncasecmp(rt.login, user, len) != 0)) ||
 			    ((user_cmp == 1) &&
-			     (strncmp(rt.login, user, strlen(user)) != 0))) {
+			     (strncmp(rt.login, user, len) != 0))) {
 				continue;
 			}
 		}
@@ -559,6 +604,7 @@ int main(int argc, char **argv)
 		}
 	}
 	fclose(fp);
+	talloc_free(index);
 
 	main_config_free(&config);
 
@@ -1020,6 +1020,194 @@ static size_t command_normalise_attribute(command_result_t *result, command_file
 	RETURN_OK(len);
 }
 
+/** Parse the iteration count for a benchmark command
+ *
+ */
+static ssize_t bench_iterations(uint64_t *out, char *in)
+{
+	char	*p = in, *q;
+
+	*out = strtoull(p, &q, 10);
+	if ((q == p) || (*out == 0)) {
+		fr_strerror_printf("Expected number of iterations, got \"%s\"", p);
+		return -1;
+	}
+	p = q;
+	fr_skip_whitespace(p);
+
+	return p - in;
+}
+
+/** Write benchmark results to the data buffer and stdout
+ *
+ * One line of space separated key=value fields, so that results from
+ * different runs can be compared by scripts.
+ */
+static size_t bench_print(char *data, char const *op, uint64_t iterations, fr_time_delta_t elapsed,
+			  size_t blocks, size_t bytes)
+{
+	size_t len;
+
+	len = snprintf(data, COMMAND_OUTPUT_MAX,
+		       "proto=%s op=%s iterations=%" PRIu64 " ns/packet=%" PRIu64 " allocs/packet=%zu bytes/packet=%zu",
+		       proto_name_prev, op, iterations, (uint64_t)elapsed / iterations, blocks, bytes);
+	printf("%s\n", data);
+
+	return len;
+}
+
+/** Time decoding a packet, and count the memory left allocated by each decode
+ *
+ */
+static size_t command_bench_decode_proto(command_result_t *result, command_file_ctx_t *cc,
+					 char *data, size_t data_used, char *in, UNUSED size_t inlen)
+{
+	fr_test_point_proto_decode_t	*tp = NULL;
+	void		*decoder_ctx = NULL;
+	char		*p = in;
+	uint8_t		*packet;
+	ssize_t		slen, packet_len;
+	uint64_t	iterations, i;
+	size_t		blocks, bytes;
+	TALLOC_CTX	*ctx;
+	VALUE_PAIR	*head = NULL;
+	fr_time_t	start;
+
+	slen = load_test_point_by_command((void **)&tp, p, "tp_decode_proto");
+	if (!tp) {
+		fr_strerror_printf_push("Failed locating decoder testpoint");
+		RETURN_COMMAND_ERROR();
+	}
+	p += slen;
+	fr_skip_whitespace(p);
+
+	slen = bench_iterations(&iterations, p);
+	if (slen < 0) RETURN_PARSE_ERROR(p - in);
+	p += slen;
+
+	if (tp->test_ctx && (tp->test_ctx(&decoder_ctx, cc->tmp_ctx) < 0)) {
+		fr_strerror_printf_push("Failed initialising decoder testpoint");
+		CLEAR_TEST_POINT(cc);
+		RETURN_COMMAND_ERROR();
+	}
+
+	if (*p == '-') p = data;
+
+	packet = talloc_array(cc->tmp_ctx, uint8_t, COMMAND_OUTPUT_MAX);
+	packet_len = hex_to_bin(packet, COMMAND_OUTPUT_MAX, p, (p == data) ? data_used : strlen(p));
+	if (packet_len <= 0) {
+		CLEAR_TEST_POINT(cc);
+		RETURN_PARSE_ERROR(-(packet_len));
+	}
+
+	/*
+	 *	Decode once, to check the packet is valid,
+	 *	and to count what the decoder allocates.
+	 */
+	ctx = talloc_new(cc->tmp_ctx);
+	slen = tp->func(ctx, &head, packet, packet_len, decoder_ctx);
+	cc->last_ret = slen;
+	if (slen <= 0) {
+		talloc_free(ctx);
+		CLEAR_TEST_POINT(cc);
+		RETURN_OK_WITH_ERROR();
+	}
+	blocks = talloc_total_blocks(ctx) - 1;
+	bytes = talloc_total_size(ctx);
+	talloc_free(ctx);
+
+	start = fr_time();
+	for (i = 0; i < iterations; i++) {
+		head = NULL;
+		ctx = talloc_new(cc->tmp_ctx);
+		(void) tp->func(ctx, &head, packet, packet_len, decoder_ctx);
+		talloc_free(ctx);
+	}
+
+	/*
+	 *	Clear any spurious errors
+	 */
+	fr_strerror();
+
+	slen = bench_print(data, "decode", iterations, fr_time() - start, blocks, bytes);
+
+	CLEAR_TEST_POINT(cc);
+	RETURN_OK(slen);
+}
+
+/** Time encoding a list of attributes, and count the memory left allocated by each encode
+ *
+ */
+static size_t command_bench_encode_proto(command_result_t *result, command_file_ctx_t *cc,
+					 char *data, UNUSED size_t data_used, char *in, UNUSED size_t inlen)
+{
+	fr_test_point_proto_encode_t	*tp = NULL;
+	void		*encoder_ctx = NULL;
+	char		*p = in;
+	ssize_t		slen;
+	uint64_t	iterations, i;
+	size_t		blocks, bytes;
+	TALLOC_CTX	*ctx;
+	VALUE_PAIR	*head = NULL;
+	fr_time_t	start;
+
+	slen = load_test_point_by_command((void **)&tp, p, "tp_encode_proto");
+	if (!tp) {
+		fr_strerror_printf_push("Failed locating encode testpoint");
+		RETURN_COMMAND_ERROR();
+	}
+	p += slen;
+	fr_skip_whitespace(p);
+
+	slen = bench_iterations(&iterations, p);
+	if (slen < 0) RETURN_PARSE_ERROR(p - in);
+	p += slen;
+
+	if (tp->test_ctx && (tp->test_ctx(&encoder_ctx, cc->tmp_ctx) < 0)) {
+		fr_strerror_printf_push("Failed initialising encoder testpoint");
+		CLEAR_TEST_POINT(cc);
+		RETURN_COMMAND_ERROR();
+	}
+
+	if (fr_pair_list_afrom_str(cc->tmp_ctx, cc->active_dict ? cc->active_dict : cc->config->dict, p, &head) != T_EOL) {
+		CLEAR_TEST_POINT(cc);
+		RETURN_OK_WITH_ERROR();
+	}
+
+	/*
+	 *	Encode once, to check the attributes can be
+	 *	encoded, and to count what the encoder allocates.
+	 */
+	ctx = talloc_new(cc->tmp_ctx);
+	slen = tp->func(ctx, head, cc->buffer_start, cc->buffer_end - cc->buffer_start, encoder_ctx);
+	cc->last_ret = slen;
+	if (slen < 0) {
+		talloc_free(ctx);
+		CLEAR_TEST_POINT(cc);
+		RETURN_OK_WITH_ERROR();
+	}
+	blocks = talloc_total_blocks(ctx) - 1;
+	bytes = talloc_total_size(ctx);
+	talloc_free(ctx);
+
+	start = fr_time();
+	for (i = 0; i < iterations; i++) {
+		ctx = talloc_new(cc->tmp_ctx);
+		(void) tp->func(ctx, head, cc->buffer_start, cc->buffer_end - cc->buffer_start, encoder_ctx);
+		talloc_free(ctx);
+	}
+
+	/*
+	 *	Clear any spurious errors
+	 */
+	fr_strerror();
+
+	slen = bench_print(data, "encode", iterations, fr_time() - start, blocks, bytes);
+
+	CLEAR_TEST_POINT(cc);
+	RETURN_OK(slen);
+}
+
 /** Change the working directory
  *
  */
@@ -2229,6 +2417,16 @@ static fr_table_ptr_sorted_t	commands[] = {
 					.usage = "attribute <attr> = <value>",
 					.description = "Parse and reprint an attribute value pair, writing \"ok\" to the data buffer on success"
 				}},
+	{ "bench-decode-proto",	&(command_entry_t){
+					.func = command_bench_decode_proto,
+					.usage = "bench-decode-proto[.<testpoint_symbol>] <iterations> (-|<hex string>)",
+					.description = "Decode a packet <iterations> times, writing the time and memory used per packet to the data buffer and stdout.  Protocol must be loaded with \"load <protocol>\" first",
+				}},
+	{ "bench-encode-proto",	&(command_entry_t){
+					.func = command_bench_encode_proto,
+					.usage = "bench-encode-proto[.<testpoint_symbol>] <iterations> (-|<attribute> = <value>[,<attribute = <value>])",
+					.description = "Encode attributes as a packet <iterations> times, writing the time and memory used per packet to the data buffer and stdout.  Protocol must be loaded with \"load <protocol>\" first",
+				}},
 	{ "cd ",		&(command_entry_t){
 					.func = command_cd,
 					.usage = "cd <path>",
@@ -32,6 +32,15 @@ extern "C" {
 #define CURL_NO_OLDIES 1
 
 #include <curl/curl.h>
+
+/*
+ *	We have to use this as curl uses lots of enums
+ */
+#ifndef CURL_AT_LEAST_VERSION
+#  define CURL_VERSION_BITS(x, y, z) ((x) << 16 | (y) << 8 | z)
+#  define CURL_AT_LEAST_VERSION(x, y, z) (LIBCURL_VERSION_NUM >= CURL_VERSION_BITS(x, y, z))
+#endif
+
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/util/event.h>
 #include <freeradius-devel/server/module.h>
@@ -72,6 +81,30 @@ do {\
 } while (0)
 
 
+/** Connection handling for a multi handle
+ *
+ */
+typedef struct {
+	bool			multiplex;		//!< Run multiple requests over the same connection
+							///< simultaneously.  HTTP/2 only.
+	uint32_t		max_concurrent_streams;	//!< Maximum number of requests multiplexed over
+							///< a single connection.  0 for libcurl's default.
+	uint32_t		max_host_connections;	//!< Maximum number of connections to a single host.
+							///< 0 for no limit.
+	uint32_t		max_total_connections;	//!< Maximum number of connections to all hosts.
+							///< 0 for no limit.
+} fr_curl_conn_config_t;
+
+/** Counters for a multi handle
+ *
+ */
+typedef struct {
+	uint64_t		requests;		//!< Transfers completed.
+	uint64_t		connects;		//!< New connections opened.
+	uint64_t		reused;			//!< Transfers which used an existing connection.
+	uint64_t		tls_handshakes;		//!< TLS handshakes performed.
+} fr_curl_io_stats_t;
+
 /** Uctx data for timer and I/O functions
  *
  * Seems like overkill for a single field, but I'm sure we'll need to
@@ -82,17 +115,38 @@ typedef struct {
 	fr_event_timer_t const	*ev;			//!< Multi-Handle timer.
 	uint64_t		transfers;		//!< How many transfers are current in progress.
 	CURLM			*mandle;		//!< The multi handle.
+	CURLSH			*share;			//!< Shares TLS sessions and DNS results between
+							///< the transfers on this multi handle.
+	bool			multiplex;		//!< Whether new transfers should wait for an existing
+							///< connection to multiplex over.
+	fr_curl_io_stats_t	stats;			//!< Connection use counters.
 } fr_curl_handle_t;
 
+typedef struct fr_curl_io_request_s fr_curl_io_request_t;
+
+/** Called when a transfer completes
+ *
+ * Allows a module to run several transfers for one request, and
+ * decide when the request should be resumed.
+ *
+ * @param[in] randle	which completed.  randle->result is set.
+ */
+typedef void (*fr_curl_io_done_t)(fr_curl_io_request_t *randle);
+
 /** Structure representing an individual request being passed to curl for processing
  *
  */
-typedef struct {
+struct fr_curl_io_request_s {
 	CURL			*candle;		//!< Request specific handle.
 	CURLcode		result;			//!< Result of executing the request.
 	REQUEST		        *request;		//!< Current request.
 	void			*uctx;			//!< Private data for the module using the API.
-} fr_curl_io_request_t;
+
+	fr_curl_io_done_t	done;			//!< Called on completion instead of resuming the
+							///< request.  May be NULL.
+	fr_curl_handle_t	*mhandle;		//!< Multi handle the transfer is running on.
+							///< NULL if it's not running.
+};
 
 typedef struct {
 	char const		*certificate_file;
@@ -115,7 +169,7 @@ int			fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle,
 
 fr_curl_io_request_t	*fr_curl_io_request_alloc(TALLOC_CTX *ctx);
 
-fr_curl_handle_t	*fr_curl_io_init(TALLOC_CTX *ctx, fr_event_list_t *el, bool multiplex);
+fr_curl_handle_t	*fr_curl_io_init(TALLOC_CTX *ctx, fr_event_list_t *el, fr_curl_conn_config_t const *conf);
 
 int			fr_curl_init(void);
 
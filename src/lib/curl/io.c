@@ -47,6 +47,44 @@ do {\
 	}\
 } while (0)
 
+/** Record whether a completed transfer opened a connection, or reused one
+ *
+ * @param[in] mhandle	containing the counters.
+ * @param[in] candle	of the completed transfer.
+ */
+static inline void _fr_curl_io_stats_update(fr_curl_handle_t *mhandle, CURL *candle)
+{
+	long		connects = 0;
+#if CURL_AT_LEAST_VERSION(7,61,0)
+	curl_off_t	appconnect = 0;
+#else
+	double		appconnect = 0;
+#endif
+
+	mhandle->stats.requests++;
+
+	if (curl_easy_getinfo(candle, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK) {
+		if (connects > 0) {
+			mhandle->stats.connects += connects;
+		} else {
+			mhandle->stats.reused++;
+		}
+	}
+
+	/*
+	 *	Zero if no TLS handshake was needed, either
+	 *	because the connection was reused, or isn't
+	 *	encrypted.
+	 */
+#if CURL_AT_LEAST_VERSION(7,61,0)
+	if ((curl_easy_getinfo(candle, CURLINFO_APPCONNECT_TIME_T, &appconnect) == CURLE_OK) && (appconnect > 0)) {
+#else
+	if ((curl_easy_getinfo(candle, CURLINFO_APPCONNECT_TIME, &appconnect) == CURLE_OK) && (appconnect > 0)) {
+#endif
+		mhandle->stats.tls_handshakes++;
+	}
+}
+
 /** De-queue curl requests and wake up the requests that initiated them
  *
  * @param[in] mhandle	containing the event loop and request counter.
@@ -89,11 +127,19 @@ static inline void _fr_curl_io_demux(fr_curl_handle_t *mhandle, CURLM *mandle)
 			}
 			randle->result = m->data.result;
 
+			_fr_curl_io_stats_update(mhandle, candle);
+
 			/*
 			 *	Looks like this needs to be done last,
 			 *	else m->data.result ends up being junk.
 			 */
 			curl_multi_remove_handle(mandle, candle);
+			randle->mhandle = NULL;
+
+			if (randle->done) {
+				randle->done(randle);
+				break;
+			}
 
 			unlang_interpret_resumable(request);
 		}
@@ -484,6 +530,22 @@ int fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle, REQUEST *request, fr_c
 		return -1;
 	}
 
+	/*
+	 *	Lets new connections resume TLS sessions
+	 *	from earlier transfers.
+	 */
+	if (mhandle->share) FR_CURL_REQUEST_SET_OPTION(CURLOPT_SHARE, mhandle->share);
+
+#ifdef CURLPIPE_MULTIPLEX
+	/*
+	 *	Wait for a connection that's still being
+	 *	established to find out if it supports
+	 *	multiplexing, instead of opening another
+	 *	one, and paying for another TLS handshake.
+	 */
+	if (mhandle->multiplex) FR_CURL_REQUEST_SET_OPTION(CURLOPT_PIPEWAIT, 1L);
+#endif
+
 	/*
 	 *	Increment here, else the debug output looks
 	 *	messed up is curl_multi_add_handle triggers
@@ -496,6 +558,7 @@ int fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle, REQUEST *request, fr_c
 		REDEBUG("Request failed: %i - %s", mret, curl_multi_strerror(mret));
 		return -1;
 	}
+	randle->mhandle = mhandle;
 
 	return 0;
 
@@ -505,6 +568,15 @@ error:
 
 static int _fr_curl_io_request_free(fr_curl_io_request_t *randle)
 {
+	/*
+	 *	Transfer was abandoned, i.e. the request was
+	 *	cancelled, or another transfer made this one
+	 *	unnecessary.
+	 */
+	if (randle->mhandle) {
+		curl_multi_remove_handle(randle->mhandle->mandle, randle->candle);
+		randle->mhandle->transfers--;
+	}
 	curl_easy_cleanup(randle->candle);
 
 	return 0;
@@ -537,6 +609,7 @@ fr_curl_io_request_t *fr_curl_io_request_alloc(TALLOC_CTX *ctx)
 static int _mhandle_free(fr_curl_handle_t *mhandle)
 {
 	curl_multi_cleanup(mhandle->mandle);
+	if (mhandle->share) curl_share_cleanup(mhandle->share);
 
 	return 0;
 }
@@ -545,18 +618,14 @@ static int _mhandle_free(fr_curl_handle_t *mhandle)
  *
  * @param[in] ctx		to alloc handle in.
  * @param[in] el		to initial.
- * @param[in] multiplex		Run multiple requests over the same connection simultaneously.
- *				HTTP/2 only.
+ * @param[in] conf		Multiplexing and connection limits.  May be NULL,
+ *				in which case libcurl's defaults are used, and
+ *				requests aren't multiplexed.
  * @return
  *	- 0 on success.
  *	- -1 on error.
  */
-fr_curl_handle_t *fr_curl_io_init(TALLOC_CTX *ctx,
-				   fr_event_list_t *el,
-#ifndef CURLPIPE_MULTIPLEX
-				   UNUSED
-#endif
-				   bool multiplex)
+fr_curl_handle_t *fr_curl_io_init(TALLOC_CTX *ctx, fr_event_list_t *el, fr_curl_conn_config_t const *conf)
 {
 	CURLMcode		ret;
 	CURLM			*mandle;
@@ -587,10 +656,38 @@ fr_curl_handle_t *fr_curl_io_init(TALLOC_CTX *ctx,
 	SET_MOPTION(mandle, CURLMOPT_SOCKETFUNCTION, _fr_curl_io_event_modify);
 	SET_MOPTION(mandle, CURLMOPT_SOCKETDATA, mhandle);
 
+	/*
+	 *	The multi handle, and so the share, is only ever
+	 *	used by one thread, so no locking callbacks are
+	 *	needed.
+	 */
+	mhandle->share = curl_share_init();
+	if (mhandle->share) {
+		curl_share_setopt(mhandle->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		curl_share_setopt(mhandle->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	} else {
+		WARN("Curl share handle instantiation failed, TLS sessions will not be resumed");
+	}
+
+	if (!conf) return mhandle;
+
 #ifdef CURLPIPE_MULTIPLEX
-	SET_MOPTION(mandle, CURLMOPT_PIPELINING, multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+	mhandle->multiplex = conf->multiplex;
+	SET_MOPTION(mandle, CURLMOPT_PIPELINING, conf->multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
 #endif
 
+#if CURL_AT_LEAST_VERSION(7,67,0)
+	if (conf->max_concurrent_streams) {
+		SET_MOPTION(mandle, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)conf->max_concurrent_streams);
+	}
+#endif
+	if (conf->max_host_connections) {
+		SET_MOPTION(mandle, CURLMOPT_MAX_HOST_CONNECTIONS, (long)conf->max_host_connections);
+	}
+	if (conf->max_total_connections) {
+		SET_MOPTION(mandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)conf->max_total_connections);
+	}
+
 	return mhandle;
 
 error:
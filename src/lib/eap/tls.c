@@ -71,6 +71,8 @@
 RCSID("$Id$")
 USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
+#include <freeradius-devel/unlang/base.h>
+
 #include "tls.h"
 #include "attrs.h"
 
@@ -79,6 +81,7 @@ fr_table_num_ordered_t const eap_tls_status_table[] = {
 	{ "established",		EAP_TLS_ESTABLISHED		},
 	{ "fail",			EAP_TLS_FAIL			},
 	{ "handled",			EAP_TLS_HANDLED			},
+	{ "yield",			EAP_TLS_YIELD			},
 
 	{ "start",			EAP_TLS_START_SEND		},
 	{ "request",			EAP_TLS_RECORD_SEND		},
@@ -827,20 +830,24 @@ ignore_length:
  *	- EAP_TLS_HANDLED if we need to send an additional request to the peer.
  *	- EAP_TLS_ESTABLISHED if the handshake completed successfully, and there's
  *	  no more data to send.
+ *	- EAP_TLS_YIELD if the handshake is waiting for an asynchronous crypto operation.
  */
 static eap_tls_status_t eap_tls_handshake(REQUEST *request, eap_session_t *eap_session)
 {
 	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(eap_session->opaque, eap_tls_session_t);
 	fr_tls_session_t		*tls_session = eap_tls_session->tls_session;
+	int			ret;
 
 	/*
 	 *	Continue the TLS handshake
 	 */
-	if (fr_tls_session_handshake(request, tls_session) < 0) {
+	ret = fr_tls_session_handshake(request, tls_session);
+	if (ret < 0) {
 		REDEBUG("TLS receive handshake failed during operation");
 		fr_tls_cache_deny(tls_session);
 		return EAP_TLS_FAIL;
 	}
+	if (ret == 2) return EAP_TLS_YIELD;
 
 	/*
 	 *	FIXME: return success/fail.
@@ -917,6 +924,14 @@ eap_tls_status_t eap_tls_process(REQUEST *request, eap_session_t *eap_session)
 
 	RDEBUG2("Continuing EAP-TLS");
 
+	/*
+	 *	The handshake was paused, waiting for an
+	 *	asynchronous crypto operation.  The record
+	 *	has already been given to OpenSSL, so pick
+	 *	up where we left off.
+	 */
+	if (fr_tls_session_async_pending(tls_session)) return eap_tls_handshake(request, eap_session);
+
 	/*
 	 *	Call eap_tls_verify to sanity check the incoming EAP data.
 	 */
@@ -951,8 +966,8 @@ eap_tls_status_t eap_tls_process(REQUEST *request, eap_session_t *eap_session)
 	 *	If the length included flag is set, we need to skip over the 4 byte
 	 *	message length field.
 	 *
-	 *	Next - Copy the fragment data into OpenSSL's dirty in buffer so that it
-	 *	can process it in a later call.
+	 *	Next - Write the fragment data straight into OpenSSL's input BIO, so
+	 *	that it can process it in a later call.
 	 */
 	case EAP_TLS_RECORD_RECV_FIRST:
 	case EAP_TLS_RECORD_RECV_MORE:
@@ -966,13 +981,17 @@ eap_tls_status_t eap_tls_process(REQUEST *request, eap_session_t *eap_session)
 		}
 
 		/*
-		 *	Update the dirty_in buffer (data for reading by OpenSSL)
+		 *	The memory BIO is the reassembly buffer.  It'll contain
+		 *	partial data when the M bit is set, but OpenSSL isn't
+		 *	asked to read from it until the record is complete.
 		 *
-		 *	This buffer will contain partial data when M bit is set, and should
-		 * 	should only be reinitialized when M bit is not set.
+		 *	eap_tls_verify() has already checked the fragments
+		 *	don't add up to more than the indicated TLS record
+		 *	length, so there's no need to stage them in dirty_in.
 		 */
-		if ((tls_session->record_from_buff)(&tls_session->dirty_in, data, data_len) != data_len) {
-			REDEBUG("Exceeded maximum record size");
+		if ((data_len > FR_TLS_MAX_RECORD_SIZE) ||
+		    (BIO_write(tls_session->into_ssl, data, data_len) != (int)data_len)) {
+			REDEBUG("Failed writing %zu bytes to TLS BIO", data_len);
 			status = EAP_TLS_FAIL;
 			goto done;
 		}
@@ -1051,6 +1070,102 @@ eap_tls_status_t eap_tls_process(REQUEST *request, eap_session_t *eap_session)
 	return status;
 }
 
+/** How often to retry a handshake if OpenSSL has no fd for us to wait on
+ *
+ */
+#define EAP_TLS_ASYNC_POLL	fr_time_delta_from_msec(1)
+
+/** Tracks an EAP-TLS session waiting for an asynchronous TLS operation
+ *
+ */
+typedef struct {
+	module_method_t		process;	//!< Module method to call once the operation completes.
+	int			fd;		//!< fd the engine signals completion on, -1 if we're polling.
+} eap_tls_async_t;
+
+static void eap_tls_async_events_delete(REQUEST *request, eap_tls_async_t *actx)
+{
+	if (actx->fd >= 0) (void) unlang_module_fd_delete(request, actx, actx->fd);
+	(void) unlang_module_timeout_delete(request, actx);
+}
+
+static void eap_tls_async_readable(UNUSED module_ctx_t const *mctx, REQUEST *request,
+				   UNUSED void *rctx, UNUSED int fd)
+{
+	unlang_interpret_resumable(request);
+}
+
+static void eap_tls_async_poll(UNUSED module_ctx_t const *mctx, REQUEST *request,
+			       UNUSED void *rctx, UNUSED fr_time_t fired)
+{
+	unlang_interpret_resumable(request);
+}
+
+/** Continue processing the EAP-TLS session once the operation has completed
+ *
+ */
+static rlm_rcode_t eap_tls_async_resume(module_ctx_t const *mctx, REQUEST *request, void *rctx)
+{
+	eap_tls_async_t		*actx = talloc_get_type_abort(rctx, eap_tls_async_t);
+	module_method_t		process = actx->process;
+
+	eap_tls_async_events_delete(request, actx);
+	talloc_free(actx);
+
+	return process(mctx, request);
+}
+
+static void eap_tls_async_signal(UNUSED module_ctx_t const *mctx, REQUEST *request,
+				 void *rctx, fr_state_signal_t action)
+{
+	eap_tls_async_t		*actx = talloc_get_type_abort(rctx, eap_tls_async_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	eap_tls_async_events_delete(request, actx);
+	talloc_free(actx);
+}
+
+/** Yield until an asynchronous TLS operation has completed
+ *
+ * Should be called by EAP-TLS based methods when #eap_tls_process returns
+ * #EAP_TLS_YIELD.  Once the engine signals that the operation has completed,
+ * process is called again, and the handshake continues from where it left off.
+ *
+ * @param[in] request		the current subrequest.
+ * @param[in] eap_session	with a paused handshake.
+ * @param[in] process		Module method to call when the operation completes.
+ *				Usually the method that called eap_tls_process.
+ * @return
+ *	- RLM_MODULE_YIELD on success.
+ *	- RLM_MODULE_FAIL if we couldn't wait for the operation.
+ */
+rlm_rcode_t eap_tls_yield(REQUEST *request, eap_session_t *eap_session, module_method_t process)
+{
+	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(eap_session->opaque, eap_tls_session_t);
+	eap_tls_async_t		*actx;
+
+	MEM(actx = talloc_zero(request, eap_tls_async_t));
+	actx->process = process;
+	actx->fd = fr_tls_session_async_fd(eap_tls_session->tls_session);
+
+	if (actx->fd >= 0) {
+		if (unlang_module_fd_add(request, eap_tls_async_readable, NULL,
+					 eap_tls_async_readable, actx, actx->fd) < 0) {
+			RPEDEBUG("Failed watching asynchronous TLS operation");
+		error:
+			talloc_free(actx);
+			return RLM_MODULE_FAIL;
+		}
+	} else if (unlang_module_timeout_add(request, eap_tls_async_poll, actx,
+					     fr_time() + EAP_TLS_ASYNC_POLL) < 0) {
+		RPEDEBUG("Failed scheduling asynchronous TLS operation retry");
+		goto error;
+	}
+
+	return unlang_module_yield(request, eap_tls_async_resume, eap_tls_async_signal, actx);
+}
+
 /** Create a new fr_tls_session_t associated with an #eap_session_t
  *
  * Creates a new server fr_tls_session_t and associates it with an #eap_session_t
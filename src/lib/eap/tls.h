@@ -92,6 +92,8 @@ typedef enum {
 	EAP_TLS_ESTABLISHED,       			//!< Session established, send success (or start phase2).
 	EAP_TLS_FAIL,       				//!< Fail, send fail.
 	EAP_TLS_HANDLED,	  			//!< TLS code has handled it.
+	EAP_TLS_YIELD,					//!< Waiting for an asynchronous TLS operation,
+							///< call #eap_tls_yield.
 
 	/*
 	 *	Composition states, we need to
@@ -156,6 +158,9 @@ extern size_t eap_tls_status_table_len;
  */
 eap_tls_status_t	eap_tls_process(REQUEST *request, eap_session_t *eap_session) CC_HINT(nonnull);
 
+rlm_rcode_t		eap_tls_yield(REQUEST *request, eap_session_t *eap_session,
+				      module_method_t process) CC_HINT(nonnull);
+
 int			eap_tls_start(REQUEST *request, eap_session_t *eap_session) CC_HINT(nonnull);
 
 int			eap_tls_success(REQUEST *request, eap_session_t *eap_session,
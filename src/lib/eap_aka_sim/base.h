@@ -312,6 +312,10 @@ int		fr_aka_sim_vector_gsm_from_attrs(REQUEST *request, VALUE_PAIR *vps,
 						 fr_aka_sim_keys_t *keys,
 						 fr_aka_sim_vector_src_t *src);
 
+int		fr_aka_sim_vector_gsm_all_from_attrs(REQUEST *request, VALUE_PAIR *vps,
+						     fr_aka_sim_keys_t *keys,
+						     fr_aka_sim_vector_src_t *src);
+
 int		fr_aka_sim_vector_umts_from_attrs(REQUEST *request, VALUE_PAIR *vps,
 						  fr_aka_sim_keys_t *keys,
 						  fr_aka_sim_vector_src_t *src);
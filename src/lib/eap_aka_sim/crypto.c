@@ -867,8 +867,6 @@ int fr_aka_sim_crypto_umts_kdf_1(fr_aka_sim_keys_t *keys)
 void fr_aka_sim_crypto_keys_init_kdf_0_reauth(fr_aka_sim_keys_t *keys,
 					      uint8_t const mk[static AKA_SIM_MK_SIZE], uint16_t counter)
 {
-	uint32_t nonce_s[4];
-
 	/*
 	 *	Copy in master key
 	 */
@@ -876,11 +874,7 @@ void fr_aka_sim_crypto_keys_init_kdf_0_reauth(fr_aka_sim_keys_t *keys,
 
 	keys->reauth.counter = counter;
 
-	nonce_s[0] = fr_rand();
-	nonce_s[1] = fr_rand();
-	nonce_s[2] = fr_rand();
-	nonce_s[3] = fr_rand();
-	memcpy(keys->reauth.nonce_s, (uint8_t *)&nonce_s, sizeof(keys->reauth.nonce_s));
+	fr_rand_buffer(keys->reauth.nonce_s, sizeof(keys->reauth.nonce_s));
 }
 
 /** Initialise fr_aka_sim_keys_t with EAP-AKA['] reauthentication data
@@ -894,8 +888,6 @@ void fr_aka_sim_crypto_keys_init_kdf_0_reauth(fr_aka_sim_keys_t *keys,
 void fr_aka_sim_crypto_keys_init_umts_kdf_1_reauth(fr_aka_sim_keys_t *keys,
 						   uint8_t const k_re[static AKA_SIM_K_RE_SIZE], uint16_t counter)
 {
-	uint32_t nonce_s[4];
-
 	/*
 	 *	Copy in master key
 	 */
@@ -903,11 +895,7 @@ void fr_aka_sim_crypto_keys_init_umts_kdf_1_reauth(fr_aka_sim_keys_t *keys,
 
 	keys->reauth.counter = counter;
 
-	nonce_s[0] = fr_rand();
-	nonce_s[1] = fr_rand();
-	nonce_s[2] = fr_rand();
-	nonce_s[3] = fr_rand();
-	memcpy(keys->reauth.nonce_s, (uint8_t *)&nonce_s, sizeof(keys->reauth.nonce_s));
+	fr_rand_buffer(keys->reauth.nonce_s, sizeof(keys->reauth.nonce_s));
 }
 
 /** Key Derivation Function (Fast-Reauthentication) as described in RFC4186/7 (EAP-SIM/AKA) section 7
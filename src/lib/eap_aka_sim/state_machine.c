@@ -1533,12 +1533,8 @@ static rlm_rcode_t sim_challenge_request_compose(module_ctx_t const *mctx,
 	}
 
 	RDEBUG2("Acquiring GSM vector(s)");
-	if ((fr_aka_sim_vector_gsm_from_attrs(request, request->control, 0,
-					      &eap_aka_sim_session->keys, &src) != 0) ||
-	    (fr_aka_sim_vector_gsm_from_attrs(request, request->control, 1,
-	    				      &eap_aka_sim_session->keys, &src) != 0) ||
-	    (fr_aka_sim_vector_gsm_from_attrs(request, request->control, 2,
-	    				      &eap_aka_sim_session->keys, &src) != 0)) {
+	if (fr_aka_sim_vector_gsm_all_from_attrs(request, request->control,
+						 &eap_aka_sim_session->keys, &src) != 0) {
 	    	REDEBUG("Failed retrieving SIM vectors");
 		return RLM_MODULE_FAIL;
 	}
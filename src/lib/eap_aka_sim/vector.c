@@ -75,16 +75,32 @@ static int vector_opc_from_op(REQUEST *request, uint8_t const **out, uint8_t opc
 	return 1;
 }
 
-static int vector_gsm_from_ki(REQUEST *request, VALUE_PAIR *vps, int idx, fr_aka_sim_keys_t *keys)
+/** Generate one or more GSM triplets from Ki
+ *
+ * When multiple triplets are requested, Ki, OP/OPc and the algorithm
+ * version are only looked up once, and Milenage (COMP128-4) triplets
+ * are generated in a single batch.
+ *
+ * @param[in] request	The current subrequest.
+ * @param[in] vps	List to find Ki etc... in.
+ * @param[in] idx	Of the first triplet to write.
+ * @param[in] num	Number of triplets to generate.
+ * @param[in] keys	EAP session keys.
+ * @return
+ *	- 1	No Ki available.
+ *	- 0	Triplets were generated.
+ *	- -1	Error generating triplets.
+ */
+static int vector_gsm_from_ki(REQUEST *request, VALUE_PAIR *vps, int idx, int num, fr_aka_sim_keys_t *keys)
 {
 	VALUE_PAIR	*ki_vp, *version_vp;
 	uint8_t		opc_buff[MILENAGE_OPC_SIZE];
 	uint8_t	const	*opc_p;
 	uint32_t	version;
-	int		i;
+	int		j;
 
 	/*
-	 *	Generate a new RAND value, and derive Kc and SRES from Ki
+	 *	Generate new RAND values, and derive Kc and SRES from Ki
 	 */
 	ki_vp = fr_pair_find_by_da(vps, attr_sim_ki, TAG_ANY);
 	if (!ki_vp) {
@@ -120,42 +136,58 @@ static int vector_gsm_from_ki(REQUEST *request, VALUE_PAIR *vps, int idx, fr_aka
 		}
 	}
 
-	for (i = 0; i < AKA_SIM_VECTOR_GSM_RAND_SIZE; i += sizeof(uint32_t)) {
-		uint32_t rand = fr_rand();
-		memcpy(&keys->gsm.vector[idx].rand[i], &rand, sizeof(rand));
+	fr_assert((idx >= 0) && (num > 0) && ((size_t)(idx + num) <= NUM_ELEMENTS(keys->gsm.vector)));
+
+	for (j = idx; j < (idx + num); j++) {
+		fr_rand_buffer(keys->gsm.vector[j].rand, sizeof(keys->gsm.vector[j].rand));
 	}
 
 	switch (version) {
 	case FR_SIM_ALGO_VERSION_VALUE_COMP128_1:
-		comp128v1(keys->gsm.vector[idx].sres,
-			  keys->gsm.vector[idx].kc,
-			  ki_vp->vp_octets,
-			  keys->gsm.vector[idx].rand);
+		for (j = idx; j < (idx + num); j++) {
+			comp128v1(keys->gsm.vector[j].sres,
+				  keys->gsm.vector[j].kc,
+				  ki_vp->vp_octets,
+				  keys->gsm.vector[j].rand);
+		}
 		break;
 
 	case FR_SIM_ALGO_VERSION_VALUE_COMP128_2:
-		comp128v23(keys->gsm.vector[idx].sres,
-			   keys->gsm.vector[idx].kc,
-			   ki_vp->vp_octets,
-			   keys->gsm.vector[idx].rand, true);
+		for (j = idx; j < (idx + num); j++) {
+			comp128v23(keys->gsm.vector[j].sres,
+				   keys->gsm.vector[j].kc,
+				   ki_vp->vp_octets,
+				   keys->gsm.vector[j].rand, true);
+		}
 		break;
 
 	case FR_SIM_ALGO_VERSION_VALUE_COMP128_3:
-		comp128v23(keys->gsm.vector[idx].sres,
-			   keys->gsm.vector[idx].kc,
-			   ki_vp->vp_octets,
-			   keys->gsm.vector[idx].rand, false);
+		for (j = idx; j < (idx + num); j++) {
+			comp128v23(keys->gsm.vector[j].sres,
+				   keys->gsm.vector[j].kc,
+				   ki_vp->vp_octets,
+				   keys->gsm.vector[j].rand, false);
+		}
 		break;
 
 	case FR_SIM_ALGO_VERSION_VALUE_COMP128_4:
-		if (milenage_gsm_generate(keys->gsm.vector[idx].sres,
-					  keys->gsm.vector[idx].kc,
-					  opc_p,
-					  ki_vp->vp_octets,
-					  keys->gsm.vector[idx].rand) < 0) {
+	{
+		milenage_gsm_vector_t	vectors[NUM_ELEMENTS(keys->gsm.vector)];
+
+		for (j = 0; j < num; j++) {
+			memcpy(vectors[j].rand, keys->gsm.vector[idx + j].rand, sizeof(vectors[j].rand));
+		}
+
+		if (milenage_gsm_generate_multi(vectors, num, opc_p, ki_vp->vp_octets) < 0) {
 			RPEDEBUG2("Failed deriving GSM triplet");
 			return -1;
 		}
+
+		for (j = 0; j < num; j++) {
+			memcpy(keys->gsm.vector[idx + j].sres, vectors[j].sres, sizeof(vectors[j].sres));
+			memcpy(keys->gsm.vector[idx + j].kc, vectors[j].kc, sizeof(vectors[j].kc));
+		}
+	}
 		break;
 
 	default:
@@ -310,6 +342,25 @@ static int vector_gsm_from_quintuplets(REQUEST *request, VALUE_PAIR *vps,
 	return 0;
 }
 
+static void vector_gsm_debug(REQUEST *request, int idx, fr_aka_sim_keys_t *keys)
+{
+	if (!RDEBUG_ENABLED2) return;
+
+	RDEBUG2("GSM vector[%i]", idx);
+
+	RINDENT();
+	/*
+	 *	Don't change colon indent, matches other messages later...
+	 */
+	RHEXDUMP_INLINE2(keys->gsm.vector[idx].kc, AKA_SIM_VECTOR_GSM_KC_SIZE,
+			 "KC           :");
+	RHEXDUMP_INLINE2(keys->gsm.vector[idx].rand, AKA_SIM_VECTOR_GSM_RAND_SIZE,
+			 "RAND         :");
+	RHEXDUMP_INLINE2(keys->gsm.vector[idx].sres, AKA_SIM_VECTOR_GSM_SRES_SIZE,
+			 "SRES         :");
+	REXDENT();
+}
+
 /** Retrieve GSM triplets from sets of attributes.
  *
  * Hunt for a source of SIM triplets
@@ -337,7 +388,7 @@ int fr_aka_sim_vector_gsm_from_attrs(REQUEST *request, VALUE_PAIR *vps,
 	switch (*src) {
 	default:
 	case AKA_SIM_VECTOR_SRC_KI:
-		ret = vector_gsm_from_ki(request, vps, idx, keys);
+		ret = vector_gsm_from_ki(request, vps, idx, 1, keys);
 		if (ret == 0) {
 			*src = AKA_SIM_VECTOR_SRC_KI;
 			break;
@@ -371,23 +422,56 @@ int fr_aka_sim_vector_gsm_from_attrs(REQUEST *request, VALUE_PAIR *vps,
 		return 1;
 	}
 
-	if (RDEBUG_ENABLED2) {
-		RDEBUG2("GSM vector[%i]", idx);
+	vector_gsm_debug(request, idx, keys);
 
-		RINDENT();
-		/*
-		 *	Don't change colon indent, matches other messages later...
-		 */
-		RHEXDUMP_INLINE2(keys->gsm.vector[idx].kc, AKA_SIM_VECTOR_GSM_KC_SIZE,
-				 "KC           :");
-		RHEXDUMP_INLINE2(keys->gsm.vector[idx].rand, AKA_SIM_VECTOR_GSM_RAND_SIZE,
-				 "RAND         :");
-		RHEXDUMP_INLINE2(keys->gsm.vector[idx].sres, AKA_SIM_VECTOR_GSM_SRES_SIZE,
-				 "SRES         :");
-		REXDENT();
+	keys->vector_type = AKA_SIM_VECTOR_GSM;
+
+	return 0;
+}
+
+/** Retrieve all the GSM triplets needed for an EAP-SIM session
+ *
+ * If the triplets are being derived from Ki, they're generated together,
+ * which is considerably faster than generating them one at a time.
+ * Otherwise each triplet is retrieved with #fr_aka_sim_vector_gsm_from_attrs.
+ *
+ * @param[in] request		The current subrequest.
+ * @param[in] vps		List to hunt for triplets in.
+ * @param[in] keys		EAP session keys.
+ * @param[in] src		Forces triplets to be retrieved from a particular src
+ *				and ensures that they all come from the same src.
+ * @return
+ *	- 1	Vectors could not be retrieved from the specified src.
+ *	- 0	Vectors were retrieved OK.
+ *	- -1	Error retrieving vectors from the specified src.
+ */
+int fr_aka_sim_vector_gsm_all_from_attrs(REQUEST *request, VALUE_PAIR *vps,
+					 fr_aka_sim_keys_t *keys, fr_aka_sim_vector_src_t *src)
+{
+	int	ret;
+	size_t	i;
+
+	fr_assert((keys->vector_type == AKA_SIM_VECTOR_NONE) || (keys->vector_type == AKA_SIM_VECTOR_GSM));
+
+	if ((*src == AKA_SIM_VECTOR_SRC_AUTO) || (*src == AKA_SIM_VECTOR_SRC_KI)) {
+		ret = vector_gsm_from_ki(request, vps, 0, NUM_ELEMENTS(keys->gsm.vector), keys);
+		if (ret < 0) return -1;
+		if (ret == 0) {
+			*src = AKA_SIM_VECTOR_SRC_KI;
+			for (i = 0; i < NUM_ELEMENTS(keys->gsm.vector); i++) vector_gsm_debug(request, i, keys);
+			keys->vector_type = AKA_SIM_VECTOR_GSM;
+			return 0;
+		}
+		if (*src != AKA_SIM_VECTOR_SRC_AUTO) {
+			RWDEBUG("Could not find or derive data for GSM vectors");
+			return 1;
+		}
 	}
 
-	keys->vector_type = AKA_SIM_VECTOR_GSM;
+	for (i = 0; i < NUM_ELEMENTS(keys->gsm.vector); i++) {
+		ret = fr_aka_sim_vector_gsm_from_attrs(request, vps, i, keys, src);
+		if (ret != 0) return ret;
+	}
 
 	return 0;
 }
@@ -398,7 +482,6 @@ static int vector_umts_from_ki(REQUEST *request, VALUE_PAIR *vps, fr_aka_sim_key
 
 	size_t		ki_size, amf_size;
 	uint32_t	version = FR_SIM_ALGO_VERSION_VALUE_MILENAGE;
-	int		i;
 
 	/*
 	 *	Select the algorithm (default to Milenage)
@@ -469,10 +552,7 @@ static int vector_umts_from_ki(REQUEST *request, VALUE_PAIR *vps, fr_aka_sim_key
 	/*
 	 *	Generate rand
 	 */
-	for (i = 0; i < AKA_SIM_VECTOR_UMTS_RAND_SIZE; i += sizeof(uint32_t)) {
-		uint32_t rand = fr_rand();
-		memcpy(&keys->umts.vector.rand[i], &rand, sizeof(rand));
-	}
+	fr_rand_buffer(keys->umts.vector.rand, sizeof(keys->umts.vector.rand));
 
 	switch (version) {
 	case FR_SIM_ALGO_VERSION_VALUE_MILENAGE:
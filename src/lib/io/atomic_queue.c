@@ -260,6 +260,146 @@ bool fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data)
 	return true;
 }
 
+/** Push multiple pointers into the atomic queue
+ *
+ * All of the entries are reserved with one update of the head, so
+ * pushing N pointers costs one CAS instead of N.  If there is only
+ * room for some of the pointers, then only those are pushed.
+ *
+ * @param[in] aq	The atomic queue to add data to.
+ * @param[in] data	to push.  None of the pointers may be NULL.
+ * @param[in] num	the number of pointers in data.
+ * @return
+ *	- the number of pointers pushed.
+ *	- 0 on queue full.
+ */
+size_t fr_atomic_queue_push_n(fr_atomic_queue_t *aq, void * const *data, size_t num)
+{
+	int64_t			head;
+	size_t			i, avail;
+	fr_atomic_queue_entry_t	*entry;
+
+	if (!num) return 0;
+
+	head = load(aq->head);
+
+	for (;;) {
+		int64_t diff = 0;
+
+		/*
+		 *	Count the free entries starting at head.  The
+		 *	entry for position "head + i" is free when its
+		 *	sequence number is exactly that.
+		 */
+		for (avail = 0; avail < num; avail++) {
+			entry = &aq->entry[ (head + avail) % aq->size ];
+			diff = aquire(entry->seq) - (int64_t) (head + avail);
+			if (diff != 0) break;
+		}
+
+		/*
+		 *	Someone else has already written to one of the
+		 *	entries.  Get the new head pointer, and continue.
+		 */
+		if (diff > 0) {
+			head = load(aq->head);
+			continue;
+		}
+
+		/*
+		 *	The entry at head hasn't been popped yet, the
+		 *	queue is full.
+		 */
+		if (!avail) return 0;
+
+		/*
+		 *	Reserve all of the free entries at once.  If
+		 *	the CAS fails, "head" is updated to the current
+		 *	value, and we try again.
+		 */
+		if (atomic_compare_exchange_strong_explicit(&aq->head, &head, head + avail,
+							    memory_order_release, memory_order_relaxed)) {
+			break;
+		}
+	}
+
+	/*
+	 *	The entries are now ours.  Store the data in each one,
+	 *	and make the write visible to other CPUs.
+	 */
+	for (i = 0; i < avail; i++) {
+		entry = &aq->entry[ (head + i) % aq->size ];
+		entry->data = data[i];
+		store(entry->seq, head + i + 1);
+	}
+
+	return avail;
+}
+
+/** Pop multiple pointers from the atomic queue
+ *
+ * All of the entries are claimed with one update of the tail.
+ *
+ * @param[in] aq	the atomic queue to retrieve data from.
+ * @param[out] data	where to write the pointers.
+ * @param[in] num	the maximum number of pointers to pop.
+ * @return
+ *	- the number of pointers popped.
+ *	- 0 on queue empty.
+ */
+size_t fr_atomic_queue_pop_n(fr_atomic_queue_t *aq, void **data, size_t num)
+{
+	int64_t			tail;
+	size_t			i, avail;
+	fr_atomic_queue_entry_t	*entry;
+
+	if (!num) return 0;
+
+	tail = load(aq->tail);
+
+	for (;;) {
+		int64_t diff = 0;
+
+		/*
+		 *	Count the entries starting at tail which have
+		 *	been written to.
+		 */
+		for (avail = 0; avail < num; avail++) {
+			entry = &aq->entry[ (tail + avail) % aq->size ];
+			diff = aquire(entry->seq) - (int64_t) (tail + avail + 1);
+			if (diff != 0) break;
+		}
+
+		/*
+		 *	Someone else has already popped one of the
+		 *	entries.  Get the new tail pointer, and continue.
+		 */
+		if (diff > 0) {
+			tail = load(aq->tail);
+			continue;
+		}
+
+		if (!avail) return 0;
+
+		if (atomic_compare_exchange_strong_explicit(&aq->tail, &tail, tail + avail,
+							    memory_order_release, memory_order_relaxed)) {
+			break;
+		}
+	}
+
+	/*
+	 *	Copy the pointers to the caller BEFORE updating the
+	 *	queue entries, and then mark each entry as unused.
+	 */
+	for (i = 0; i < avail; i++) {
+		entry = &aq->entry[ (tail + i) % aq->size ];
+		data[i] = entry->data;
+		store(entry->seq, tail + i + aq->size);
+	}
+
+	return avail;
+}
+
 size_t fr_atomic_queue_size(fr_atomic_queue_t *aq)
 {
 	return aq->size;
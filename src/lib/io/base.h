@@ -298,6 +298,32 @@ typedef void *(*fr_io_track_create_t)(TALLOC_CTX *ctx, uint8_t const *packet, si
  */
 typedef int (*fr_io_track_cmp_t)(void const *instance, void *thread_instance, RADCLIENT *client, void const *one, void const *two);
 
+/** Hash a tracking structure
+ *
+ * Tracking structures which are identical according to
+ * fr_io_track_cmp_t MUST have the same hash.  The hash should not
+ * include fields which are expensive to compare, such as the RADIUS
+ * authenticator.  Those are checked by fr_io_track_cmp_t, which is
+ * only called when the hashes match.
+ *
+ * @param[in] instance		the context for this function
+ * @param[in] track		packet tracking structure
+ * @return the hash of the tracking structure.
+ */
+typedef uint32_t (*fr_io_track_hash_t)(void const *instance, void const *track);
+
+/** Return a key which is used to pick a worker for a packet
+ *
+ * Packets which return the same key are sent to the same worker,
+ * so that per-thread module state (caches, connections, etc.) is
+ * re-used for related packets.
+ *
+ * @param[in] li		the listener for this socket
+ * @param[in] packet_ctx	as returned by the read() function.
+ * @return the affinity key for this packet.
+ */
+typedef uint32_t (*fr_io_affinity_t)(fr_listen_t const *li, void const *packet_ctx);
+
 /**  Handle an error on the socket.
  *
  *  In general, the only thing to do on errors is to close the
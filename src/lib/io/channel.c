@@ -49,6 +49,12 @@ RCSID("$Id$")
  */
 #define ENABLE_SKIPS (0)
 
+/*
+ *	The maximum number of requests the responder takes from the
+ *	queue at once.
+ */
+#define CHANNEL_RECV_BATCH (16)
+
 typedef enum {
 	TO_RESPONDER = 0,
 	TO_REQUESTOR = 1
@@ -132,6 +138,8 @@ typedef struct {
 	atomic_bool		active;		//!< Whether the channel is active.
 
 	fr_channel_stats_t	stats;		//!< channel statistics
+
+	fr_message_set_stats_t const *ms_stats;	//!< GC statistics for the messages this end sends.
 } fr_channel_end_t;
 
 typedef struct fr_channel_s fr_channel_t;
@@ -148,6 +156,9 @@ struct fr_channel_s {
 	bool			same_thread;	//!< are both ends in the same thread?
 
 	fr_channel_end_t	end[2];		//!< Two ends of the channel.
+
+	atomic_bool		responder_spinning;	//!< The responder is polling the queue, and
+							///< doesn't need to be signalled.
 };
 
 fr_table_num_sorted_t const channel_signals[] = {
@@ -244,6 +255,7 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *requestor, fr_con
 	ch->end[TO_REQUESTOR].stats.last_read_other = now;
 	ch->end[TO_REQUESTOR].stats.last_sent_signal = now;
 	atomic_store(&ch->end[TO_REQUESTOR].active, true);
+	atomic_store(&ch->responder_spinning, false);
 
 	return ch;
 }
@@ -304,10 +316,33 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
  *	- 0 on success
  */
 int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
+{
+	if (fr_channel_send_request_batch(ch, &cd, 1) < 1) return -1;
+
+	return 0;
+}
+
+/** Send multiple request messages into the channel
+ *
+ * The messages should be initialized, other than "sequence" and "ack".
+ * They are pushed to the responder with one atomic queue operation,
+ * and the responder is signalled once for the whole batch.
+ *
+ * @param[in] ch	the channel to send the requests on.
+ * @param[in] cd	the messages to send, in order.
+ * @param[in] num	the number of messages.
+ * @return
+ *	- <0 on error
+ *	- the number of messages sent.  If this is less than
+ *	  num, the queue is full and the caller should send the
+ *	  rest on another channel.
+ */
+int fr_channel_send_request_batch(fr_channel_t *ch, fr_channel_data_t **cd, int num)
 {
 	uint64_t sequence;
-	fr_time_t when, message_interval;
+	fr_time_t when = 0, message_interval;
 	fr_channel_end_t *requestor;
+	int i, sent;
 
 	if (!fr_cond_assert_msg(atomic_load(&ch->end[TO_RESPONDER].active), "Channel not active")) return -1;
 
@@ -315,58 +350,65 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
 	 *	Same thread?  Just call the "recv" function directly.
 	 */
 	if (ch->same_thread) {
-		ch->end[TO_REQUESTOR].recv(ch->end[TO_REQUESTOR].recv_uctx, ch, cd);
-		return 0;
+		for (i = 0; i < num; i++) ch->end[TO_REQUESTOR].recv(ch->end[TO_REQUESTOR].recv_uctx, ch, cd[i]);
+		return num;
 	}
 
 	requestor = &(ch->end[TO_RESPONDER]);
-	when = cd->m.when;
 
-	sequence = requestor->sequence + 1;
-	cd->live.sequence = sequence;
-	cd->live.ack = requestor->ack;
+	sequence = requestor->sequence;
+	for (i = 0; i < num; i++) {
+		cd[i]->live.sequence = ++sequence;
+		cd[i]->live.ack = requestor->ack;
+	}
 
 	/*
-	 *	Push the message onto the queue for the other end.  If
-	 *	the push fails, the caller should try another queue.
+	 *	Push the messages onto the queue for the other end.
+	 *	If the queue fills up, the caller should send the
+	 *	remainder to another queue.
 	 */
-	if (!fr_atomic_queue_push(requestor->aq, cd)) {
+	sent = fr_atomic_queue_push_n(requestor->aq, (void * const *) cd, num);
+	if (sent == 0) {
 		fr_strerror_printf("Failed pushing to atomic queue - full.  Queue contains %zu items",
 				   fr_atomic_queue_size(requestor->aq));
 		while (fr_channel_recv_reply(ch));
-		return -1;
+		return 0;
 	}
 
-	requestor->sequence = sequence;
-	message_interval = when - requestor->stats.last_write;
+	for (i = 0; i < sent; i++) {
+		when = cd[i]->m.when;
 
-	if (!requestor->stats.message_interval) {
-		requestor->stats.message_interval = message_interval;
-	} else {
-		requestor->stats.message_interval = RTT(requestor->stats.message_interval, message_interval);
-	}
+		requestor->sequence = cd[i]->live.sequence;
+		message_interval = when - requestor->stats.last_write;
 
-	fr_assert_msg(requestor->stats.last_write <= when,
-		      "Channel data timestamp (%" PRId64") older than last channel data sent (%" PRId64 ")",
-		      when, requestor->stats.last_write);
-	requestor->stats.last_write = when;
+		if (!requestor->stats.message_interval) {
+			requestor->stats.message_interval = message_interval;
+		} else {
+			requestor->stats.message_interval = RTT(requestor->stats.message_interval, message_interval);
+		}
+
+		fr_assert_msg(requestor->stats.last_write <= when,
+			      "Channel data timestamp (%" PRId64") older than last channel data sent (%" PRId64 ")",
+			      when, requestor->stats.last_write);
+		requestor->stats.last_write = when;
 
-	requestor->stats.outstanding++;
-	requestor->stats.packets++;
+		requestor->stats.outstanding++;
+		requestor->stats.packets++;
+	}
 
 	MPRINT("REQUESTOR requests %"PRIu64", num_outstanding %"PRIu64"\n", requestor->stats.packets, requestor->stats.outstanding);
 
 #if ENABLE_SKIPS
 	/*
-	 *	We just sent the first packet.  There can't possibly be a reply, so don't bother looking.
+	 *	We just sent the first packets.  There can't possibly be a reply, so don't bother looking.
 	 */
-	if (requestor->stats.outstanding == 1) {
+	if (requestor->stats.outstanding == (uint64_t) sent) {
 
 		/*
 		 *	There is at least one old packet which is
 		 *	outstanding, look for a reply.
 		 */
-	} else if (requestor->stats.outstanding > 1) {
+	} else if (requestor->stats.outstanding > (uint64_t) sent) {
 		bool has_reply;
 
 		has_reply = fr_channel_recv_reply(ch);
@@ -380,21 +422,36 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
 		 */
 		if (!requestor->must_signal && (!has_reply || (has_reply && (requestor->stats.outstanding > 1)))) {
 			MPRINT("REQUESTOR SKIPS signal\n");
-			return 0;
+			return sent;
 		}
 	}
 #endif
 
+	/*
+	 *	The responder is polling the queue, so it will see
+	 *	the new messages without being woken up.
+	 *
+	 *	The fence orders our queue writes before the load of
+	 *	the flag.  The responder clears the flag, and then
+	 *	checks the queue again, so one of us always sees the
+	 *	other.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ch->responder_spinning, memory_order_relaxed)) {
+		requestor->stats.suppressed++;
+		return sent;
+	}
+
 	/*
 	 *	Tell the other end that there is new data ready.
 	 *
 	 *	Ignore errors on signalling.  The responder already has
-	 *	the packet in its inbound queue, so at some point, it
-	 *	will pick up the message.
+	 *	the packets in its inbound queue, so at some point, it
+	 *	will pick up the messages.
 	 */
 	MPRINT("REQUESTOR SIGNALS\n");
 	(void) fr_channel_data_ready(ch, when, requestor, FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER);
-	return 0;
+	return sent;
 }
 
 /** Receive a reply message from the channel
@@ -440,16 +497,32 @@ bool fr_channel_recv_reply(fr_channel_t *ch)
 	ch->cpu_time = cd->reply.cpu_time;
 
 	/*
-	 *	Update the outbound channel with the knowledge that
-	 *	we've received one more reply, and with the responders
-	 *	ACK.
+	 *	The request was sent on a different channel, but
+	 *	another worker took it.  That channel now has one
+	 *	fewer request outstanding.  This one is unchanged.
+	 *
+	 *	Both channels are owned by us, so we can update the
+	 *	other one here.
 	 */
-	fr_assert(requestor->stats.outstanding > 0);
-	fr_assert(cd->live.sequence > requestor->ack);
-	fr_assert(cd->live.sequence <= requestor->sequence); /* must have fewer replies than requests */
+	if (cd->reply.stolen_from) {
+		fr_channel_end_t *original = &(cd->reply.stolen_from->end[TO_RESPONDER]);
+
+		fr_assert(original->stats.outstanding > 0);
+		original->stats.outstanding--;
 
-	requestor->stats.outstanding--;
-	requestor->ack = cd->live.sequence;
+	} else {
+		/*
+		 *	Update the outbound channel with the knowledge that
+		 *	we've received one more reply, and with the responders
+		 *	ACK.
+		 */
+		fr_assert(requestor->stats.outstanding > 0);
+		fr_assert(cd->live.sequence > requestor->ack);
+		fr_assert(cd->live.sequence <= requestor->sequence); /* must have fewer replies than requests */
+
+		requestor->stats.outstanding--;
+		requestor->ack = cd->live.sequence;
+	}
 	requestor->their_view_of_my_sequence = cd->live.ack;
 
 	fr_assert(requestor->stats.last_read_other <= cd->m.when);
@@ -461,7 +534,10 @@ bool fr_channel_recv_reply(fr_channel_t *ch)
 }
 
 
-/** Receive a request message from the channel
+/** Receive request messages from the channel
+ *
+ * Up to #CHANNEL_RECV_BATCH messages are taken from the queue with one
+ * atomic operation, and each is passed to the recv_request callback.
  *
  * @param[in] ch the channel
  * @return
@@ -470,9 +546,10 @@ bool fr_channel_recv_reply(fr_channel_t *ch)
  */
 bool fr_channel_recv_request(fr_channel_t *ch)
 {
-	fr_channel_data_t *cd;
+	fr_channel_data_t *cd[CHANNEL_RECV_BATCH];
 	fr_channel_end_t *responder;
 	fr_atomic_queue_t *aq;
+	size_t i, num;
 
 	aq = ch->end[TO_RESPONDER].aq;
 	responder = &(ch->end[TO_REQUESTOR]);
@@ -480,19 +557,24 @@ bool fr_channel_recv_request(fr_channel_t *ch)
 	/*
 	 *	It's OK for the queue to be empty.
 	 */
-	if (!fr_atomic_queue_pop(aq, (void **) &cd)) return false;
+	num = fr_atomic_queue_pop_n(aq, (void **) cd, CHANNEL_RECV_BATCH);
+	if (!num) return false;
 
-	fr_assert(cd->live.sequence > responder->ack);
-	fr_assert(cd->live.sequence >= responder->sequence); /* must have more requests than replies */
+	if (atomic_load_explicit(&ch->responder_spinning, memory_order_relaxed)) responder->stats.spin_hits++;
 
-	responder->stats.outstanding++;
-	responder->ack = cd->live.sequence;
-	responder->their_view_of_my_sequence = cd->live.ack;
+	for (i = 0; i < num; i++) {
+		fr_assert(cd[i]->live.sequence > responder->ack);
+		fr_assert(cd[i]->live.sequence >= responder->sequence); /* must have more requests than replies */
 
-	fr_assert(responder->stats.last_read_other <= cd->m.when);
-	responder->stats.last_read_other = cd->m.when;
+		responder->stats.outstanding++;
+		responder->ack = cd[i]->live.sequence;
+		responder->their_view_of_my_sequence = cd[i]->live.ack;
 
-	ch->end[TO_REQUESTOR].recv(ch->end[TO_REQUESTOR].recv_uctx, ch, cd);
+		fr_assert(responder->stats.last_read_other <= cd[i]->m.when);
+		responder->stats.last_read_other = cd[i]->m.when;
+
+		ch->end[TO_REQUESTOR].recv(ch->end[TO_REQUESTOR].recv_uctx, ch, cd[i]);
+	}
 
 	return true;
 }
@@ -527,7 +609,17 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 
 	when = cd->m.when;
 
-	sequence = responder->sequence + 1;
+	/*
+	 *	Replies to stolen requests don't consume a sequence
+	 *	number on this channel, as the request was never
+	 *	sent on it.  The requestor fixes up the accounting
+	 *	for the original channel.
+	 */
+	if (!cd->reply.stolen_from) {
+		sequence = responder->sequence + 1;
+	} else {
+		sequence = responder->sequence;
+	}
 	cd->live.sequence = sequence;
 	cd->live.ack = responder->ack;
 
@@ -538,8 +630,10 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 		return -1;
 	}
 
-	fr_assert(responder->stats.outstanding > 0);
-	responder->stats.outstanding--;
+	if (!cd->reply.stolen_from) {
+		fr_assert(responder->stats.outstanding > 0);
+		responder->stats.outstanding--;
+	}
 	responder->stats.packets++;
 
 	MPRINT("\tRESPONDER replies %"PRIu64", num_outstanding %"PRIu64"\n", responder->stats.packets, responder->stats.outstanding);
@@ -610,26 +704,43 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 }
 
 
-/** Don't send a reply message into the channel
+/** Take a request from a channel, on behalf of another responder
  *
- * The message should be the one we received from the network.
+ * This function may be called from any thread.  It removes the
+ * oldest request from the channel, without updating the state of
+ * the responder which owns the channel.  The caller is then
+ * responsible for processing the request, and for sending the
+ * reply on one of its own channels to the same requestor, with
+ * cd->reply.stolen_from set to this channel.
  *
- * @param[in] ch		the channel on which we're dropping a packet
+ * @param[in] ch	the channel to take the request from.
  * @return
- *	- <0 on error
- *	- 0 on success
+ *	- NULL if there are no requests in the channel.
+ *	- the request.
  */
-int fr_channel_null_reply(fr_channel_t *ch)
+fr_channel_data_t *fr_channel_steal_request(fr_channel_t *ch)
 {
-	fr_channel_end_t *responder;
+	fr_channel_data_t *cd;
 
-	responder = &(ch->end[TO_REQUESTOR]);
+	if (ch->same_thread || !fr_channel_active(ch)) return NULL;
 
-	responder->sequence++;
-	return 0;
-}
+	if (!fr_atomic_queue_pop(ch->end[TO_RESPONDER].aq, (void **) &cd)) return NULL;
 
+	return cd;
+}
 
+/** Check if two channels have the same requestor
+ *
+ * @param[in] a		the first channel.
+ * @param[in] b		the second channel.
+ * @return
+ *	- true if replies sent on either channel go to the same requestor.
+ *	- false otherwise.
+ */
+bool fr_channel_same_requestor(fr_channel_t const *a, fr_channel_t const *b)
+{
+	return (a->end[TO_REQUESTOR].control == b->end[TO_REQUESTOR].control);
+}
 
 /** Signal a channel that the responder is sleeping
  *
@@ -667,6 +778,23 @@ int fr_channel_responder_sleeping(fr_channel_t *ch)
 }
 
 
+/** Tell the requestor whether the responder is polling the queue
+ *
+ * While the responder is spinning, the requestor doesn't signal it
+ * when new messages arrive.  After clearing the flag, the responder
+ * MUST check the queue again before going to sleep, as messages may
+ * have been added just before the flag was cleared.
+ *
+ * @param[in] ch	the channel.
+ * @param[in] spinning	whether the responder is polling the queue.
+ */
+void fr_channel_responder_spinning(fr_channel_t *ch, bool spinning)
+{
+	if (spinning) ch->end[TO_REQUESTOR].stats.spins++;
+
+	atomic_store_explicit(&ch->responder_spinning, spinning, memory_order_seq_cst);
+}
+
 /** Service a control-plane message
  *
  * @param[in] when		The current time.
@@ -900,6 +1028,32 @@ void *fr_channel_responder_uctx_get(fr_channel_t *ch)
 }
 
 
+/** Add the responder's message set statistics to a channel
+ *
+ * @param[in] ch	The channel.
+ * @param[in] stats	The statistics of the message set used for replies, or NULL.
+ */
+void fr_channel_responder_ms_stats_add(fr_channel_t *ch, fr_message_set_stats_t const *stats)
+{
+	(void) talloc_get_type_abort(ch, fr_channel_t);
+
+	ch->end[TO_REQUESTOR].ms_stats = stats;
+}
+
+
+/** Add the requestor's message set statistics to a channel
+ *
+ * @param[in] ch	The channel.
+ * @param[in] stats	The statistics of the message sets used for requests, or NULL.
+ */
+void fr_channel_requestor_ms_stats_add(fr_channel_t *ch, fr_message_set_stats_t const *stats)
+{
+	(void) talloc_get_type_abort(ch, fr_channel_t);
+
+	ch->end[TO_RESPONDER].ms_stats = stats;
+}
+
+
 /** Add network-specific data to a channel
  *
  * @param[in] ch	The channel.
@@ -958,11 +1112,25 @@ int fr_channel_signal_open(fr_channel_t *ch)
 	return fr_control_message_send(ch->end[TO_RESPONDER].control, ch->end[TO_RESPONDER].rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
 }
 
+static void channel_ms_stats_log(fr_message_set_stats_t const *stats, fr_log_t const *log, char const *file, int line)
+{
+	if (!stats) return;
+
+	fr_log(log, L_INFO, file, line, "\tgc steps = %" PRIu64 "\n", stats->gc_steps);
+	fr_log(log, L_INFO, file, line, "\tgc runs = %" PRIu64 "\n", stats->gc_runs);
+	fr_log(log, L_INFO, file, line, "\tgc messages cleaned = %" PRIu64 "\n", stats->gc_cleaned);
+	fr_log(log, L_INFO, file, line, "\tgc time = %" PRIu64 "\n", stats->gc_time);
+	fr_log(log, L_INFO, file, line, "\tgc time max = %" PRIu64 "\n", stats->gc_time_max);
+	fr_log(log, L_INFO, file, line, "\tmessage rings grown = %" PRIu64 "\n", stats->grown);
+	fr_log(log, L_INFO, file, line, "\tmessage rings shrunk = %" PRIu64 "\n", stats->shrunk);
+}
+
 void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char const *file, int line)
 {
 	fr_log(log, L_INFO, file, line, "requestor\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.signals);
 	fr_log(log, L_INFO, file, line, "\tsignals re-sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.resignals);
+	fr_log(log, L_INFO, file, line, "\tsignals suppressed = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.suppressed);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.kevents);
 	fr_log(log, L_INFO, file, line, "\toutstanding = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.outstanding);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.packets);
@@ -970,13 +1138,17 @@ void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char cons
 	fr_log(log, L_INFO, file, line, "\tlast write = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.last_read_other);
 	fr_log(log, L_INFO, file, line, "\tlast read other end = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.last_read_other);
 	fr_log(log, L_INFO, file, line, "\tlast signal other = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.last_sent_signal);
+	channel_ms_stats_log(ch->end[TO_RESPONDER].ms_stats, log, file, line);
 
 	fr_log(log, L_INFO, file, line, "responder\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64"\n", ch->end[TO_REQUESTOR].stats.signals);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.kevents);
+	fr_log(log, L_INFO, file, line, "\tspins = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.spins);
+	fr_log(log, L_INFO, file, line, "\tspins with data = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.spin_hits);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.packets);
 	fr_log(log, L_INFO, file, line, "\tmessage interval (RTT) = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.message_interval);
 	fr_log(log, L_INFO, file, line, "\tlast write = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.last_read_other);
 	fr_log(log, L_INFO, file, line, "\tlast read other end = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.last_read_other);
 	fr_log(log, L_INFO, file, line, "\tlast signal other = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.last_sent_signal);
+	channel_ms_stats_log(ch->end[TO_REQUESTOR].ms_stats, log, file, line);
 }
@@ -85,6 +85,11 @@ typedef struct {
 
 	uint64_t		kevents;	//!< Number of times we've looked at kevents.
 
+	uint64_t		suppressed;	//!< Number of signals we didn't send, because the
+						///< other end was polling the queue.
+	uint64_t		spins;		//!< Number of times we polled the queue instead of sleeping.
+	uint64_t		spin_hits;	//!< Number of times polling found a message.
+
 	fr_time_t		last_write;	//!< Last write to the channel.
 	fr_time_t		last_read_other; //!< Last time we successfully read a message from the other the channel
 	fr_time_delta_t		message_interval; //!< Interval between messages.
@@ -133,6 +138,8 @@ typedef struct {
 			fr_time_delta_t		cpu_time;	//!<  total CPU time, including predicted work, (only worker -> network)
 			fr_time_delta_t		processing_time;  //!< actual processing time for this packet (only worker -> network)
 			fr_time_t		request_time;	//!< timestamp of the request packet
+			fr_channel_t		*stolen_from;	//!< channel the request was originally sent on,
+								//!< if another worker took it (worker -> network)
 	        } reply;
 	};
 
@@ -158,10 +165,10 @@ extern size_t channel_packet_priority_len;
 fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *frontend, fr_control_t *worker, bool same) CC_HINT(nonnull);
 
 int	fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cm) CC_HINT(nonnull);
+int	fr_channel_send_request_batch(fr_channel_t *ch, fr_channel_data_t **cd, int num) CC_HINT(nonnull);
 bool	fr_channel_recv_request(fr_channel_t *ch) CC_HINT(nonnull);
 
 int	fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd) CC_HINT(nonnull);
-int	fr_channel_null_reply(fr_channel_t *ch) CC_HINT(nonnull);
 
 bool	fr_channel_recv_reply(fr_channel_t *ch) CC_HINT(nonnull);
 
@@ -170,6 +177,10 @@ int	fr_channel_set_recv_reply(fr_channel_t *ch, void *ctx, fr_channel_recv_callb
 int	fr_channel_set_recv_request(fr_channel_t *ch, void *ctx, fr_channel_recv_callback_t recv_reply) CC_HINT(nonnull(1,3));
 
 int	fr_channel_responder_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
+void	fr_channel_responder_spinning(fr_channel_t *ch, bool spinning) CC_HINT(nonnull);
+
+fr_channel_data_t *fr_channel_steal_request(fr_channel_t *ch) CC_HINT(nonnull);
+bool	fr_channel_same_requestor(fr_channel_t const *a, fr_channel_t const *b) CC_HINT(nonnull);
 
 int	fr_channel_service_kevent(fr_channel_t *ch, fr_control_t *c, struct kevent const *kev) CC_HINT(nonnull);
 fr_channel_event_t	fr_channel_service_message(fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size) CC_HINT(nonnull);
@@ -185,6 +196,8 @@ void	fr_channel_responder_uctx_add(fr_channel_t *ch, void *ctx) CC_HINT(nonnull)
 void	*fr_channel_responder_uctx_get(fr_channel_t *ch) CC_HINT(nonnull);
 void	fr_channel_requestor_uctx_add(fr_channel_t *ch, void *ctx) CC_HINT(nonnull);
 void	*fr_channel_requestor_uctx_get(fr_channel_t *ch) CC_HINT(nonnull);
+void	fr_channel_responder_ms_stats_add(fr_channel_t *ch, fr_message_set_stats_t const *stats) CC_HINT(nonnull(1));
+void	fr_channel_requestor_ms_stats_add(fr_channel_t *ch, fr_message_set_stats_t const *stats) CC_HINT(nonnull(1));
 
 
 void	fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char const *file, int line);
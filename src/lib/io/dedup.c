@@ -0,0 +1,211 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Open addressed table for tracking duplicate packets
+ * @file io/dedup.c
+ *
+ *  Every packet received on an unconnected socket is looked up in
+ *  the tracking table for its client, and most lookups are misses.
+ *  An rbtree costs a chain of pointer chasing comparisons for each
+ *  one.  Here, entries are kept in one array with linear probing.
+ *  Each slot holds the full hash of its entry, so a lookup only calls
+ *  the comparison function when the hashes match.
+ *
+ *  Deletes use backward shifting, so there are no tombstones, and
+ *  lookups don't get slower as entries come and go.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <string.h>
+
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/io/dedup.h>
+
+#define DEDUP_MIN_SIZE	(64)
+
+typedef struct {
+	uint32_t		hash;		//!< of the entry
+	void			*data;		//!< the entry, or NULL if the slot is empty
+} fr_dedup_slot_t;
+
+struct fr_dedup_s {
+	fr_dedup_cmp_t		cmp;		//!< for entries with the same hash
+
+	uint32_t		num;		//!< number of entries in the table
+	uint32_t		mask;		//!< size of the table - 1
+
+	fr_dedup_slot_t		*slots;		//!< the table
+};
+
+/** Allocate a tracking table
+ *
+ * @param[in] ctx	to allocate the table in.
+ * @param[in] cmp	to check whether entries with the same hash are the same.
+ * @return
+ *	- A new table on success.
+ *	- NULL on error.
+ */
+fr_dedup_t *fr_dedup_alloc(TALLOC_CTX *ctx, fr_dedup_cmp_t cmp)
+{
+	fr_dedup_t *dd;
+
+	dd = talloc_zero(ctx, fr_dedup_t);
+	if (!dd) return NULL;
+
+	dd->slots = talloc_zero_array(dd, fr_dedup_slot_t, DEDUP_MIN_SIZE);
+	if (!dd->slots) {
+		talloc_free(dd);
+		return NULL;
+	}
+
+	dd->cmp = cmp;
+	dd->mask = DEDUP_MIN_SIZE - 1;
+
+	return dd;
+}
+
+/** Double the size of the table
+ *
+ */
+static int dedup_grow(fr_dedup_t *dd)
+{
+	fr_dedup_slot_t	*slots;
+	uint32_t	i, j, mask;
+
+	mask = (dd->mask << 1) | 1;
+
+	slots = talloc_zero_array(dd, fr_dedup_slot_t, mask + 1);
+	if (!slots) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i <= dd->mask; i++) {
+		if (!dd->slots[i].data) continue;
+
+		for (j = dd->slots[i].hash & mask; slots[j].data; j = (j + 1) & mask);
+		slots[j] = dd->slots[i];
+	}
+
+	talloc_free(dd->slots);
+	dd->slots = slots;
+	dd->mask = mask;
+
+	return 0;
+}
+
+/** Find an entry which is the same packet as "data"
+ *
+ * @param[in] dd	to search.
+ * @param[in] hash	of data.
+ * @param[in] data	to compare entries against.
+ * @return
+ *	- The matching entry.
+ *	- NULL if there is no matching entry.
+ */
+void *fr_dedup_find(fr_dedup_t *dd, uint32_t hash, void const *data)
+{
+	uint32_t i;
+
+	for (i = hash & dd->mask; dd->slots[i].data; i = (i + 1) & dd->mask) {
+		if (dd->slots[i].hash != hash) continue;
+
+		if (dd->cmp(dd->slots[i].data, data) == 0) return dd->slots[i].data;
+	}
+
+	return NULL;
+}
+
+/** Insert an entry
+ *
+ * The caller is responsible for checking there's no matching entry
+ * already in the table.
+ *
+ * @param[in] dd	to insert into.
+ * @param[in] hash	of data.
+ * @param[in] data	to insert.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dedup_insert(fr_dedup_t *dd, uint32_t hash, void *data)
+{
+	uint32_t i;
+
+	/*
+	 *	Keep the table no more than 3/4 full, so that
+	 *	probe sequences stay short.
+	 */
+	if (((dd->num + 1) * 4) > ((dd->mask + 1) * 3)) {
+		if (dedup_grow(dd) < 0) return -1;
+	}
+
+	for (i = hash & dd->mask; dd->slots[i].data; i = (i + 1) & dd->mask);
+
+	dd->slots[i].hash = hash;
+	dd->slots[i].data = data;
+	dd->num++;
+
+	return 0;
+}
+
+/** Delete an entry
+ *
+ * @param[in] dd	to delete from.
+ * @param[in] hash	of data.
+ * @param[in] data	the entry to delete.  This is compared by pointer,
+ *			not with the comparison function.
+ * @return
+ *	- true if the entry was deleted.
+ *	- false if it wasn't in the table.
+ */
+bool fr_dedup_delete(fr_dedup_t *dd, uint32_t hash, void const *data)
+{
+	uint32_t i, j;
+
+	for (i = hash & dd->mask; dd->slots[i].data != data; i = (i + 1) & dd->mask) {
+		if (!dd->slots[i].data) return false;
+	}
+
+	/*
+	 *	Move later entries in the probe sequence back into
+	 *	the hole, unless that would put them before the slot
+	 *	they hash to.
+	 */
+	for (j = (i + 1) & dd->mask; dd->slots[j].data; j = (j + 1) & dd->mask) {
+		uint32_t home = dd->slots[j].hash & dd->mask;
+
+		if (i <= j) {
+			if ((i < home) && (home <= j)) continue;
+		} else {
+			if ((i < home) || (home <= j)) continue;
+		}
+
+		dd->slots[i] = dd->slots[j];
+		i = j;
+	}
+
+	dd->slots[i].data = NULL;
+	dd->num--;
+
+	return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file io/dedup.h
+ * @brief Open addressed table for tracking duplicate packets.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(dedup_h, "$Id$")
+
+#include <talloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_dedup_s fr_dedup_t;
+
+/** Compare two entries which have the same hash
+ *
+ * @return 0 if the entries are the same packet, non-zero otherwise.
+ */
+typedef int (*fr_dedup_cmp_t)(void const *one, void const *two);
+
+fr_dedup_t	*fr_dedup_alloc(TALLOC_CTX *ctx, fr_dedup_cmp_t cmp);
+
+void		*fr_dedup_find(fr_dedup_t *dd, uint32_t hash, void const *data) CC_HINT(nonnull);
+int		fr_dedup_insert(fr_dedup_t *dd, uint32_t hash, void *data) CC_HINT(nonnull);
+bool		fr_dedup_delete(fr_dedup_t *dd, uint32_t hash, void const *data) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -40,7 +40,18 @@ struct fr_listen {
 	bool			connected;		//!< is this for a connected socket?
 	bool			track_duplicates;	//!< do we track duplicate packets?
 	size_t			default_message_size;	//!< copied from app_io, but may be changed
+	size_t			read_size;		//!< for stream sockets, how much we read at a time,
+							///< so that many packets can be framed from one read.
+							///< 0 means default_message_size.
 	size_t			num_messages;		//!< for the message ring buffer
+
+	uint32_t		recv_pending;		//!< packets which have been read from the kernel,
+							///< but not yet returned by read().
+
+	bool			sharded;		//!< open one SO_REUSEPORT socket per network thread
+							///< - set by open
+	bool			steer_by_src;		//!< pin each source IP to one shard - set by open
+	uint32_t		shard;			//!< which shard this listener is.
 };
 
 /**
@@ -51,16 +62,21 @@ struct fr_async_s {
 	void			*process_inst;		//!< Instance data for the current state machine.
 
 	fr_time_t		recv_time;
+	fr_time_t		last_seen;	//!< When the client last sent a copy of the packet.
 	fr_event_list_t		*el;
 
 	fr_time_tracking_t	tracking;
 	fr_channel_t		*channel;
+	fr_channel_t		*stolen_from;	//!< Channel the request was taken from, if it was
+						///< taken from another worker.
 
 	void			*packet_ctx;
 	fr_listen_t		*listen;	//!< How we received this request,
 						//!< and how we'll send the reply.
 	uint32_t		priority;	//!< higher == higher priority
 	bool			fake;		//!< is it a fake request
+
+	REQUEST			*dedup_next;	//!< Next request in the same worker dedup bucket.
 };
 
 int fr_io_listen_free(fr_listen_t *li);
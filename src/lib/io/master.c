@@ -21,6 +21,7 @@
  *
  * @copyright 2018 Alan DeKok (aland@freeradius.org)
  */
+#include <freeradius-devel/io/dedup.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/master.h>
 
@@ -31,6 +32,7 @@
 #include <freeradius-devel/unlang/base.h>
 
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/socket.h>
 #include <freeradius-devel/util/syserror.h>
 
 typedef struct {
@@ -42,14 +44,19 @@ typedef struct {
 	fr_heap_t			*alive_clients;			//!< heap of active clients
 
 	fr_dlist_head_t			track_list;			//!< list of free fr_io_track_t
+	fr_dlist_head_t			nak_list;			//!< negative cache entries, oldest first
 
 	fr_listen_t			*listen;			//!< The master IO path
 	fr_listen_t			*child;				//!< The child (app_io) IO path
 	fr_schedule_t			*sc;				//!< the scheduler
 
-	// @todo - count num_nak_clients, and num_nak_connections, too
 	uint32_t			num_connections;		//!< number of dynamic connections
 	uint32_t			num_pending_packets;   		//!< number of pending packets
+
+	uint64_t			nak_hits;			//!< packets discarded by the negative cache
+	uint64_t			nak_evicted;			//!< negative cache entries removed early, as the cache was full
+	uint64_t			dynamic_lookups;		//!< dynamic client definitions started
+	uint64_t			dynamic_coalesced;		//!< packets queued behind a definition in progress
 } fr_io_thread_t;
 
 /** A saved packet
@@ -92,6 +99,7 @@ struct fr_io_client_s {
 	int				packets;	//!< number of packets using this client
 	int				pending_id;	//!< for pending clients
 	int				alive_id;	//!< for all clients
+	fr_dlist_t			nak_entry;	//!< in the thread's list of NAKed clients
 
 	bool				use_connected;	//!< does this client allow connected sub-sockets?
 	bool				ready_to_delete; //!< are we ready to delete this client?
@@ -101,6 +109,9 @@ struct fr_io_client_s {
 	fr_io_thread_t			*thread;
 	fr_event_timer_t const		*ev;		//!< when we clean up the client
 	rbtree_t			*table;		//!< tracking table for packets
+	fr_dedup_t			*dedup;		//!< tracking table for packets, if app_io can hash them
+
+	fr_time_t			rate_tat;	//!< when the rate limit bucket will be full again
 
 	fr_heap_t			*pending;	//!< pending packets for this client
 	fr_hash_table_t			*addresses;	//!< list of src/dst addresses used by this client
@@ -135,6 +146,7 @@ struct fr_io_connection_s {
 	bool				dead;		//!< roundabout way to get the network side to close a socket
 	bool				paused;		//!< event filter doesn't like resuming something that isn't paused
 	fr_event_list_t			*el;		//!< event list for this connection
+	fr_event_timer_t const		*rate_ev;	//!< for resuming reads after hitting the rate limit
 	fr_network_t			*nr;		//!< network for this connection
 };
 
@@ -291,6 +303,127 @@ static int track_cmp(void const *one, void const *two)
 }
 
 
+/** Hash the fields which track_cmp() compares
+ *
+ *  Unconnected sockets include the source address, as one client
+ *  definition may cover many NASes.
+ */
+static uint32_t track_hash(fr_io_track_t const *track)
+{
+	fr_io_client_t const	*client = track->client;
+	uint32_t		hash;
+
+	hash = client->inst->app_io->hash(client->inst->app_io_instance, track->packet);
+	if (client->connection) return hash;
+
+	hash = fr_hash_update(&track->address->src_port, sizeof(track->address->src_port), hash);
+	if (track->address->src_ipaddr.af == AF_INET) {
+		return fr_hash_update(&track->address->src_ipaddr.addr.v4,
+				      sizeof(track->address->src_ipaddr.addr.v4), hash);
+	}
+
+	return fr_hash_update(&track->address->src_ipaddr.addr.v6, sizeof(track->address->src_ipaddr.addr.v6), hash);
+}
+
+/** Create the packet tracking table for a client
+ *
+ *  If the app_io can hash its tracking structures, we use an open
+ *  addressed table.  Otherwise, we fall back to an rbtree.
+ */
+static void track_table_alloc(fr_io_client_t *client, TALLOC_CTX *ctx)
+{
+	fr_assert(client->inst->app_io->compare != NULL);
+
+	if (client->inst->app_io->hash) {
+		MEM(client->dedup = fr_dedup_alloc(ctx, track_cmp));
+		return;
+	}
+
+	MEM(client->table = rbtree_talloc_alloc(ctx, track_cmp, fr_io_track_t, NULL, RBTREE_FLAG_NONE));
+}
+
+static fr_io_track_t *track_table_find(fr_io_client_t *client, fr_io_track_t *track)
+{
+	if (client->dedup) return fr_dedup_find(client->dedup, track->hash, track);
+
+	return rbtree_finddata(client->table, track);
+}
+
+static void track_table_insert(fr_io_client_t *client, fr_io_track_t *track)
+{
+	if (client->dedup) {
+		MEM(fr_dedup_insert(client->dedup, track->hash, track) == 0);
+		return;
+	}
+
+	rbtree_insert(client->table, track);
+}
+
+static void track_table_delete(fr_io_client_t *client, fr_io_track_t *track)
+{
+	if (client->dedup) {
+		(void) fr_dedup_delete(client->dedup, track->hash, track);
+		return;
+	}
+
+	(void) rbtree_deletebydata(client->table, track);
+}
+
+/** Take a token from the client's rate limit bucket
+ *
+ *  The bucket is stored as the time at which it will be full again,
+ *  so it never needs to be refilled.  Each packet pushes that time
+ *  forward by one packet interval, and the packet is over the limit
+ *  if the bucket would then be more than "burst" packets from full.
+ *
+ * @param[in] client	to charge the packet to.
+ * @param[in] now	when the packet was received.
+ * @param[out] when	the bucket will have a token again.  Only set on failure.
+ * @return
+ *	- true if the packet is within the client's rate limit.
+ *	- false if the packet is over the limit.
+ */
+static bool client_rate_take(fr_io_client_t *client, fr_time_t now, fr_time_t *when)
+{
+	RADCLIENT const		*radclient = client->radclient;
+	fr_time_delta_t		interval, tolerance;
+	uint32_t		burst;
+
+	if (!radclient->rate_limit) return true;
+
+	burst = radclient->rate_burst ? radclient->rate_burst : radclient->rate_limit;
+	interval = NSEC / radclient->rate_limit;
+	tolerance = interval * (burst - 1);
+
+	if (client->rate_tat < now) client->rate_tat = now;
+
+	if ((client->rate_tat - now) > tolerance) {
+		*when = client->rate_tat - tolerance;
+		return false;
+	}
+
+	client->rate_tat += interval;
+	return true;
+}
+
+/** Resume reading from a connection which was paused by the rate limit
+ *
+ */
+static void client_rate_resume(fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_io_connection_t *connection = talloc_get_type_abort(uctx, fr_io_connection_t);
+
+	/*
+	 *	Pending clients are resumed by mod_write(), once
+	 *	they've been defined.
+	 */
+	if (!connection->paused || (connection->client->state == PR_CLIENT_PENDING)) return;
+
+	connection->paused = false;
+	(void) fr_event_filter_update(el, connection->child->fd, FR_EVENT_FILTER_IO, resume_read);
+}
+
+
 static fr_io_pending_packet_t *pending_packet_pop(fr_io_thread_t *thread)
 {
 	fr_io_client_t *client;
@@ -358,6 +491,10 @@ static RADCLIENT *radclient_clone(TALLOC_CTX *ctx, RADCLIENT const *parent)
 
 	COPY_FIELD(use_connected);
 
+	COPY_FIELD(rate_limit);
+	COPY_FIELD(rate_burst);
+	COPY_FIELD(rate_stats);
+
 #ifdef WITH_TLS
 	COPY_FIELD(tls_required);
 #endif
@@ -501,10 +638,7 @@ static fr_io_connection_t *fr_io_connection_alloc(fr_io_instance_t const *inst,
 	 *
 	 *	#todo - unify the code with static clients?
 	 */
-	if (inst->app_io->track_duplicates) {
-		MEM(connection->client->table = rbtree_talloc_alloc(client, track_cmp, fr_io_track_t,
-								     NULL, RBTREE_FLAG_NONE));
-	}
+	if (inst->app_io->track_duplicates) track_table_alloc(connection->client, client);
 
 	/*
 	 *	Set this radclient to be dynamic, and active.
@@ -863,10 +997,12 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 		return NULL;
 	}
 
+	if (client->dedup) track->hash = track_hash(track);
+
 	/*
 	 *	No existing duplicate.  Return the new tracking entry.
 	 */
-	old = rbtree_finddata(client->table, track);
+	old = track_table_find(client, track);
 	if (!old) goto do_insert;
 
 	fr_assert(old != track);
@@ -914,12 +1050,12 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 		track_free(old);
 
 	} else {
-		(void) rbtree_deletebydata(client->table, old);
+		track_table_delete(client, old);
 		old->in_dedup_tree = false;
 	}
 
 do_insert:
-	rbtree_insert(client->table, track);
+	track_table_insert(client, track);
 	track->in_dedup_tree = true;
 	return track;
 }
@@ -930,8 +1066,8 @@ static void track_free(fr_io_track_t *track)
 	fr_io_thread_t *thread = track->client->thread;
 
 	if (track->in_dedup_tree) {
-		fr_assert(track->client->table != NULL);
-		(void) rbtree_deletebydata(track->client->table, track);
+		fr_assert((track->client->table != NULL) || (track->client->dedup != NULL));
+		track_table_delete(track->client, track);
 	}
 	track->in_dedup_tree = false;
 	
@@ -1043,6 +1179,8 @@ static int _client_live_free(fr_io_client_t *client)
 
 	if (client->pending) TALLOC_FREE(client->pending);
 
+	if (client->state == PR_CLIENT_NAK) fr_dlist_remove(&client->thread->nak_list, client);
+
 	(void) fr_trie_remove(client->thread->trie, &client->src_ipaddr.addr, client->src_ipaddr.prefix);
 	(void) fr_heap_extract(client->thread->alive_clients, client);
 
@@ -1230,6 +1368,12 @@ do_read:
 		 */
 		packet_len = inst->app_io->read(child, (void **) &local_address, &recv_time,
 					  buffer, buffer_len, leftover, priority, is_dup);
+
+		/*
+		 *	Tell the network side that the child has more
+		 *	packets buffered, so that it keeps reading.
+		 */
+		li->recv_pending = child->recv_pending;
 		if (packet_len <= 0) {
 			return packet_len;
 		}
@@ -1290,9 +1434,11 @@ do_read:
 	}
 
 	/*
-	 *	Negative cache entry.  Drop the packet.
+	 *	Negative cache entry.  Drop the packet before we
+	 *	allocate anything for it.
 	 */
 	if (client && client->state == PR_CLIENT_NAK) {
+		if (!connection) thread->nak_hits++;
 		if (accept_fd >= 0) close(accept_fd);
 		return 0;
 	}
@@ -1323,7 +1469,14 @@ do_read:
 			radclient->active = true;
 
 		} else if (inst->dynamic_clients) {
-			if (inst->max_clients && (fr_heap_num_elements(thread->alive_clients) >= inst->max_clients)) {
+			/*
+			 *	Negative cache entries don't count
+			 *	against the limit.  Otherwise a scan
+			 *	from random addresses would lock out
+			 *	real clients until the NAKs expired.
+			 */
+			if (inst->max_clients &&
+			    ((fr_heap_num_elements(thread->alive_clients) - fr_dlist_num_elements(&thread->nak_list)) >= inst->max_clients)) {
 				if (accept_fd < 0) {
 					DEBUG("proto_%s - ignoring packet from client IP address %pV - "
 					      "too many dynamic clients are defined",
@@ -1412,11 +1565,7 @@ do_read:
 		/*
 		 *	Create the packet tracking table for this client.
 		 */
-		if (inst->app_io->track_duplicates) {
-			fr_assert(inst->app_io->compare != NULL);
-			MEM(client->table = rbtree_talloc_alloc(client, track_cmp, fr_io_track_t,
-								 NULL, RBTREE_FLAG_NONE));
-		}
+		if (inst->app_io->track_duplicates) track_table_alloc(client, client);
 
 		/*
 		 *	Allow connected sockets to be set on a
@@ -1475,6 +1624,51 @@ have_client:
 		return 0;
 	}
 
+	/*
+	 *	Enforce the client's rate limit before the packet
+	 *	takes up any resources.  Packets which were pending
+	 *	have already been charged to the client.
+	 */
+	if (!track) {
+		fr_time_t when;
+
+		if (!client_rate_take(client, recv_time ? recv_time : fr_time(), &when)) {
+			fr_client_rate_stats_t *stats = client->radclient->rate_stats;
+
+			/*
+			 *	We can't drop part of a stream.  Instead,
+			 *	process this packet, and stop reading
+			 *	from the socket until the client is back
+			 *	under its limit.  That puts backpressure
+			 *	on the client.
+			 */
+			if (connection) {
+				client->rate_tat += NSEC / client->radclient->rate_limit;
+				if (stats) atomic_fetch_add_explicit(&stats->deferred, 1, memory_order_relaxed);
+
+				if (!connection->paused) {
+					connection->paused = true;
+					(void) fr_event_filter_update(connection->el, child->fd,
+								      FR_EVENT_FILTER_IO, pause_read);
+
+					if (fr_event_timer_at(connection, connection->el, &connection->rate_ev,
+							      when, client_rate_resume, connection) < 0) {
+						connection->paused = false;
+						(void) fr_event_filter_update(connection->el, child->fd,
+									      FR_EVENT_FILTER_IO, resume_read);
+					}
+				}
+
+			} else {
+				if (stats) atomic_fetch_add_explicit(&stats->dropped, 1, memory_order_relaxed);
+
+				DEBUG2("proto_%s - discarding packet from client %s - over its rate limit",
+				       inst->app_io->name, client->radclient->shortname);
+				return 0;
+			}
+		}
+	}
+
 	/*
 	 *	No connected sockets, OR we are the connected socket.
 	 *
@@ -1564,7 +1758,13 @@ have_client:
 				return 0;
 			}
 
+			/*
+			 *	Only the first packet runs the dynamic
+			 *	client definition.  The rest wait for
+			 *	it to finish.
+			 */
 			if (fr_heap_num_elements(client->pending) > 1) {
+				if (!connection) thread->dynamic_coalesced++;
 				DEBUG("Client %pV is still being dynamically defined.  "
 				      "Caching this packet until the client has been defined",
 				      fr_box_ipaddr(client->src_ipaddr));
@@ -1576,6 +1776,7 @@ have_client:
 			 *	dynamic client.
 			 */
 			track->dynamic = recv_time;
+			if (!connection) thread->dynamic_lookups++;
 
 		} else {
 			/*
@@ -1738,6 +1939,7 @@ static int mod_open(fr_listen_t *li)
 	if (inst->app_io->open(thread->child) < 0) return -1;
 
 	li->fd = thread->child->fd;	/* copy this back up */
+	li->read_size = thread->child->read_size;
 
 	/*
 	 *	Set the name of the socket.
@@ -2184,11 +2386,42 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 	 *	tracking table.
 	 */
 	if (buffer_len == 1) {
-		client->state = PR_CLIENT_NAK;
 		TALLOC_FREE(client->pending);
 		if (client->table) TALLOC_FREE(client->table);
+		if (client->dedup) TALLOC_FREE(client->dedup);
 		fr_assert(client->packets == 0);
 
+		client->state = PR_CLIENT_NAK;
+
+		/*
+		 *	Add the client to the negative cache for the
+		 *	master socket.  If the cache is full, delete
+		 *	the oldest entry.  NAKed clients have no
+		 *	packets, so it's safe to free them here.
+		 */
+		if (!connection) {
+			if (inst->max_nak_clients &&
+			    (fr_dlist_num_elements(&thread->nak_list) >= inst->max_nak_clients)) {
+				fr_io_client_t *oldest = fr_dlist_head(&thread->nak_list);
+
+				fr_assert(oldest->state == PR_CLIENT_NAK);
+				fr_assert(oldest->packets == 0);
+
+				DEBUG("proto_%s - too many blocked clients - unblocking oldest client %pV",
+				      inst->app_io->name, fr_box_ipaddr(oldest->src_ipaddr));
+				thread->nak_evicted++;
+				talloc_free(oldest);
+			}
+
+			fr_dlist_insert_tail(&thread->nak_list, client);
+
+			DEBUG2("proto_%s - blocking client %pV (%zu blocked, %" PRIu64 " packets discarded, "
+			       "%" PRIu64 " unblocked early, %" PRIu64 " lookups, %" PRIu64 " packets coalesced)",
+			       inst->app_io->name, fr_box_ipaddr(client->src_ipaddr),
+			       fr_dlist_num_elements(&thread->nak_list), thread->nak_hits, thread->nak_evicted,
+			       thread->dynamic_lookups, thread->dynamic_coalesced);
+		}
+
 		/*
 		 *	If we're a connected UDP socket, allocate a
 		 *	new connection which is the place-holder for
@@ -2305,6 +2538,12 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 	COPY_FIELD(ipaddr);
 	COPY_FIELD(message_authenticator);
 	COPY_FIELD(use_connected);
+	COPY_FIELD(rate_limit);
+	COPY_FIELD(rate_burst);
+
+	if (client->radclient->rate_limit && !client->radclient->rate_stats) {
+		MEM(client->radclient->rate_stats = talloc_zero(client->radclient, fr_client_rate_stats_t));
+	}
 
 	// @todo - fill in other fields?
 
@@ -2541,6 +2780,41 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 }
 
 
+/** Return the worker affinity key for a packet
+ *
+ *  All packets from one client source IP get the same key, so that
+ *  the network thread can send them to the same worker.
+ */
+static uint32_t mod_affinity(UNUSED fr_listen_t const *li, void const *packet_ctx)
+{
+	fr_io_track_t const *track = packet_ctx;
+	fr_ipaddr_t const *ipaddr;
+
+	if (!track || !track->address) return 0;
+
+	ipaddr = &track->address->src_ipaddr;
+	if (ipaddr->af == AF_INET) return fr_hash(&ipaddr->addr.v4, sizeof(ipaddr->addr.v4));
+
+	return fr_hash(&ipaddr->addr.v6, sizeof(ipaddr->addr.v6));
+}
+
+/** Flush any replies which the child has queued
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	fr_io_instance_t const *inst;
+	fr_io_connection_t *connection;
+	fr_listen_t *child;
+
+	get_inst(li, &inst, NULL, &connection, &child);
+
+	if (!inst->app_io->flush) return 0;
+
+	return inst->app_io->flush(child);
+}
+
+
 static char const *mod_name(fr_listen_t *li)
 {
 	fr_io_thread_t *thread;
@@ -2798,25 +3072,26 @@ int fr_io_listen_free(fr_listen_t *li)
 	return 0;
 }
 
-int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
-			size_t default_message_size, size_t num_messages)
+/** Create one listener, open it, and add it to the scheduler
+ *
+ * @param[in] ctx			to allocate the listener in.
+ * @param[in] inst			of the master IO handler.
+ * @param[in] sc			to add the listener to.
+ * @param[in] default_message_size	for the message ring buffer.
+ * @param[in] num_messages		for the message ring buffer.
+ * @param[in] shard			which shard this is.  Shard 0 is the
+ *					primary listener, and is the only one
+ *					recorded in the global listener list.
+ * @return
+ *	- the new listener on success.
+ *	- NULL on failure.
+ */
+static fr_listen_t *master_io_listen_shard(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+					   size_t default_message_size, size_t num_messages, uint32_t shard)
 {
 	fr_listen_t	*li, *child;
 	fr_io_thread_t	*thread;
 
-	/*
-	 *	No IO paths, so we don't initialize them.
-	 */
-	if (!inst->app_io) {
-		fr_assert(!inst->dynamic_clients);
-		return 0;
-	}
-
-	if (!inst->app_io->thread_inst_size) {
-		fr_strerror_printf("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
-		return -1;
-	}
-
 	/*
 	 *	Build the #fr_listen_t.  This describes the complete
 	 *	path data takes from the socket to the decoder and
@@ -2846,6 +3121,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	 */
 	li->default_message_size = default_message_size;
 	li->num_messages = num_messages;
+	li->shard = shard;
 
 	/*
 	 *	Per-socket data lives here.
@@ -2854,6 +3130,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	thread->listen = li;
 	thread->sc = sc;
 	fr_dlist_init(&thread->track_list, fr_io_track_t, entry);
+	fr_dlist_init(&thread->nak_list, fr_io_client_t, nak_entry);
 
 	talloc_set_destructor(thread, _thread_io_free);
 
@@ -2919,7 +3196,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	if (inst->app_io->open(child) < 0) {
 		cf_log_err(inst->app_io_conf, "Failed opening %s interface", inst->app_io->name);
 		talloc_free(li);
-		return -1;
+		return NULL;
 	}
 
 	li->fd = child->fd;	/* copy this back up */
@@ -2932,9 +3209,10 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	li->name = child->name;
 
 	/*
-	 *	Record which socket we opened.
+	 *	Record which socket we opened.  The other shards
+	 *	share the same address as the primary listener.
 	 */
-	if (child->app_io_addr) {
+	if (child->app_io_addr && !shard) {
 		fr_listen_t *other;
 
 		other = listen_find_any(thread->child);
@@ -2945,7 +3223,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 			ERROR("got socket %d %d\n", child->app_io_addr->port, other->app_io_addr->port);
 
 			talloc_free(li);
-			return -1;
+			return NULL;
 		}
 
 		(void) listen_record(child);
@@ -2953,13 +3231,69 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 
 	/*
 	 *	Add the socket to the scheduler, where it might end up
-	 *	in a different thread.
+	 *	in a different thread.  Sharded listeners get one
+	 *	socket per network thread.
 	 */
-	if (!fr_schedule_listen_add(sc, li)) {
+	if (!child->sharded) {
+		if (!fr_schedule_listen_add(sc, li)) {
+			talloc_free(li);
+			return NULL;
+		}
+	} else if (!fr_schedule_listen_add_shard(sc, li, shard)) {
 		talloc_free(li);
+		return NULL;
+	}
+
+	return li;
+}
+
+int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+			size_t default_message_size, size_t num_messages)
+{
+	fr_listen_t	*li, *child;
+	uint32_t	i, num_shards;
+
+	/*
+	 *	No IO paths, so we don't initialize them.
+	 */
+	if (!inst->app_io) {
+		fr_assert(!inst->dynamic_clients);
+		return 0;
+	}
+
+	if (!inst->app_io->thread_inst_size) {
+		fr_strerror_printf("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
 		return -1;
 	}
 
+	li = master_io_listen_shard(ctx, inst, sc, default_message_size, num_messages, 0);
+	if (!li) return -1;
+
+	child = ((fr_io_thread_t *) li->thread_instance)->child;
+	if (!child->sharded) return 0;
+
+	/*
+	 *	The remaining shards bind to the same address and
+	 *	port via SO_REUSEPORT.  The kernel then spreads the
+	 *	packets across all of the sockets, and each network
+	 *	thread does its own decoding and duplicate detection.
+	 */
+	num_shards = fr_schedule_num_networks(sc);
+	for (i = 1; i < num_shards; i++) {
+		if (!master_io_listen_shard(ctx, inst, sc, default_message_size, num_messages, i)) return -1;
+	}
+
+	/*
+	 *	Without steering, the kernel hashes on the full
+	 *	4-tuple.  A client which changes its source port
+	 *	could then have its retransmissions land on a shard
+	 *	which doesn't know about the original packet.
+	 */
+	if ((num_shards > 1) && child->steer_by_src && child->app_io_addr &&
+	    (fr_socket_reuseport_steer(li->fd, child->app_io_addr->ipaddr.af, num_shards) < 0)) {
+		PWARN("%s - Packets will be distributed without regard to source IP address", li->name);
+	}
+
 	return 0;
 }
 
@@ -2976,7 +3310,9 @@ fr_app_io_t fr_master_app_io = {
 
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.inject			= mod_inject,
+	.affinity		= mod_affinity,
 
 	.open			= mod_open,
 	.close			= mod_close,
@@ -46,6 +46,7 @@ typedef struct {
 	size_t				reply_len;	//!< length of reply, or 1 for "do not reply"
 
 	bool				in_dedup_tree;	//!< like it says
+	uint32_t			hash;		//!< of the packet, for the dedup table
 
 	/*
 	 *	We can't set the "process" function here, because a
@@ -83,6 +84,7 @@ typedef struct {
 	uint32_t			max_connections;		//!< maximum number of connections to allow
 	uint32_t			max_clients;			//!< maximum number of dynamic clients to allow
 	uint32_t			max_pending_packets;		//!< maximum number of pending packets
+	uint32_t			max_nak_clients;		//!< maximum number of NAKed clients to cache
 
 	fr_time_delta_t			cleanup_delay;			//!< for Access-Request packets
 	fr_time_delta_t			idle_timeout;			//!< for dynamic clients
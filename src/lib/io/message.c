@@ -40,6 +40,20 @@ RCSID("$Id$")
 
 #define MSG_ARRAY_SIZE (16)
 
+/*
+ *	How many "done" messages we clean up on each allocation.  This
+ *	has to be more than one, so that the collector keeps ahead of
+ *	the allocator.
+ */
+#define MSG_GC_STEP (4)
+
+/*
+ *	How often (in allocations) we sample the message ring
+ *	occupancy, and how many samples we take before resizing.
+ */
+#define MSG_ADAPT_INTERVAL (128)
+#define MSG_ADAPT_SAMPLES (8)
+
 /** A Message set, composed of message headers and ring buffer data.
  *
  *  A message set is intended to send short-lived messages.  The
@@ -61,13 +75,14 @@ RCSID("$Id$")
  *  marks it as FR_MESSAGE_DONE.  The originator then asynchronously
  *  cleans up the message.
  *
- *  This asynchronous cleanup is done via self-clocking.  If there is
- *  no need to clean up the messages, it isn't done.  Only when we run
- *  out of space to store messages (or packets) is the cleanup done.
+ *  This asynchronous cleanup is done incrementally.  Each allocation
+ *  cleans up at most MSG_GC_STEP of the oldest messages, and only
+ *  if they have been marked done.  Only when we run out of space to
+ *  store messages (or packets) is a larger cleanup done.
  *
- *  This cleanup latency ensures that we don't have cache line
- *  bouncing, where the originator sends the message, and then while
- *  the recipieent is reading it... thrashes the cache line with
+ *  Because only the oldest messages are checked, we don't have cache
+ *  line bouncing, where the originator sends the message, and then
+ *  while the recipieent is reading it... thrashes the cache line with
  *  checks for "are you done?  Are you done?"
  *
  *  If there are more than one used entry in either array, we then try
@@ -106,12 +121,45 @@ struct fr_message_set_s {
 	int			allocated;
 	int			freed;
 
+	size_t			mr_initial_size; //!< size of the first message ring.
+	int			adapt_countdown; //!< allocations until we next sample occupancy.
+	int			adapt_samples;	//!< samples taken since we last resized.
+	size_t			used_max;	//!< largest number of messages in use over the samples.
+	bool			shrink;		//!< shrink the message ring when it's next empty.
+
+	fr_message_set_stats_t	*stats;		//!< where we record GC statistics.
+	fr_message_set_stats_t	own_stats;	//!< used when our caller doesn't provide any.
+
 	fr_ring_buffer_t	*mr_array[MSG_ARRAY_SIZE]; //!< array of message arrays
 
 	fr_ring_buffer_t	*rb_array[MSG_ARRAY_SIZE]; //!< array of ring buffers
 };
 
 
+static bool message_huge_pages = false;	//!< back message sets with huge pages
+static bool message_prefault = false;	//!< touch message set memory when it's allocated
+
+/** Use huge pages for the storage of new message sets
+ *
+ * This MUST be called before any threads are started.
+ *
+ * @param[in] huge_pages	back the ring buffers with huge pages.
+ * @param[in] prefault		touch the memory when it's allocated, so that
+ *				the first packets don't take page faults.
+ */
+void fr_message_set_huge_pages(bool huge_pages, bool prefault)
+{
+	message_huge_pages = huge_pages;
+	message_prefault = prefault;
+}
+
+static inline fr_ring_buffer_t *message_ring_buffer_create(fr_message_set_t *ms, size_t size)
+{
+	if (message_huge_pages) return fr_ring_buffer_create_huge(ms, size, message_prefault);
+
+	return fr_ring_buffer_create(ms, size);
+}
+
 /** Create a message set
  *
  * @param[in] ctx the context for talloc
@@ -156,24 +204,52 @@ fr_message_set_t *fr_message_set_create(TALLOC_CTX *ctx, int num_messages, size_
 	message_size &= ~(size_t) 15;
 	ms->message_size = message_size;
 
-	ms->rb_array[0] = fr_ring_buffer_create(ms, ring_buffer_size);
+	ms->rb_array[0] = message_ring_buffer_create(ms, ring_buffer_size);
 	if (!ms->rb_array[0]) {
 		talloc_free(ms);
 		return NULL;
 	}
 	ms->rb_max = 0;
 
-	ms->mr_array[0] = fr_ring_buffer_create(ms, num_messages * message_size);
+	ms->mr_array[0] = message_ring_buffer_create(ms, num_messages * message_size);
 	if (!ms->mr_array[0]) {
 		talloc_free(ms);
 		return NULL;
 	}
 
+	ms->mr_initial_size = fr_ring_buffer_size(ms->mr_array[0]);
+	ms->adapt_countdown = MSG_ADAPT_INTERVAL;
+	ms->stats = &ms->own_stats;
+
 	ms->max_allocation = ring_buffer_size / 2;
 
 	return ms;
 }
 
+/** Record the GC statistics of a message set somewhere else
+ *
+ *  This lets a thread with many message sets aggregate their
+ *  statistics in one place.  The statistics MUST be owned by the
+ *  same thread which owns the message set.
+ *
+ * @param[in] ms	the message set
+ * @param[in] stats	where the statistics are recorded.
+ */
+void fr_message_set_stats_set(fr_message_set_t *ms, fr_message_set_stats_t *stats)
+{
+	ms->stats = stats ? stats : &ms->own_stats;
+}
+
+/** Return the GC statistics of a message set
+ *
+ * @param[in] ms	the message set
+ * @return the statistics.
+ */
+fr_message_set_stats_t const *fr_message_set_stats(fr_message_set_t const *ms)
+{
+	return ms->stats;
+}
+
 
 /** Mark a message as done
  *
@@ -340,49 +416,17 @@ static int fr_message_ring_gc(fr_message_set_t *ms, fr_ring_buffer_t *mr, int ma
 }
 
 
-/** Garbage collect "done" messages.
- *
- *  Called only from the originating thread.  We also clean a limited
- *  number of messages at a time, so that we don't have sudden latency
- *  spikes when cleaning 1M messages.
+/** Free empty message arrays and ring buffers, and pack the remainder
  *
  * @param[in] ms the message set
- * @param[in] max_to_clean the maximum number of messages to clean
  */
-static void fr_message_gc(fr_message_set_t *ms, int max_to_clean)
+static void fr_message_set_compact(fr_message_set_t *ms)
 {
 	int i;
 	int arrays_freed, arrays_used, empty_slot;
 	int largest_free_slot;
-	int total_cleaned;
 	size_t largest_free_size;
 
-	/*
-	 *	Clean up "done" messages.
-	 */
-	total_cleaned = 0;
-
-	/*
-	 *	Garbage collect the smaller buffers first.
-	 */
-	for (i = 0; i <= ms->mr_max; i++) {
-		int cleaned;
-
-		cleaned = fr_message_ring_gc(ms, ms->mr_array[i], max_to_clean - total_cleaned);
-		total_cleaned += cleaned;
-		fr_assert(total_cleaned <= max_to_clean);
-
-		/*
-		 *	Stop when we've reached our GC limit.
-		 */
-		if (total_cleaned == max_to_clean) break;
-	}
-
-	/*
-	 *	Couldn't GC anything.  Don't do more work.
-	 */
-	if (total_cleaned == 0) return;
-
 	arrays_freed = 0;
 	arrays_used = 0;
 
@@ -470,6 +514,7 @@ static void fr_message_gc(fr_message_set_t *ms, int max_to_clean)
 		 */
 		ms->mr_max -= arrays_freed;
 		ms->mr_current = ms->mr_max;
+		ms->mr_cleaned = 0;
 
 #ifndef NDEBUG
 		MPRINT("NUM RB ARRAYS NOW %d\n", ms->mr_max + 1);
@@ -609,6 +654,194 @@ static void fr_message_gc(fr_message_set_t *ms, int max_to_clean)
 	fr_assert(ms->rb_current <= ms->rb_max);
 }
 
+/** Record how long a GC pass took
+ *
+ */
+static inline void fr_message_gc_stats(fr_message_set_t *ms, fr_time_t start, int cleaned)
+{
+	fr_time_delta_t	elapsed = fr_time() - start;
+
+	ms->stats->gc_runs++;
+	ms->stats->gc_cleaned += cleaned;
+	ms->stats->gc_time += elapsed;
+	if (elapsed > ms->stats->gc_time_max) ms->stats->gc_time_max = elapsed;
+}
+
+/** Garbage collect "done" messages.
+ *
+ *  Called only from the originating thread when an allocation fails.
+ *  We also clean a limited number of messages at a time, so that we
+ *  don't have sudden latency spikes when cleaning 1M messages.
+ *
+ * @param[in] ms the message set
+ * @param[in] max_to_clean the maximum number of messages to clean
+ */
+static void fr_message_gc(fr_message_set_t *ms, int max_to_clean)
+{
+	int i;
+	int total_cleaned;
+	fr_time_t start = fr_time();
+
+	/*
+	 *	Clean up "done" messages.
+	 */
+	total_cleaned = 0;
+
+	/*
+	 *	Garbage collect the smaller buffers first.
+	 */
+	for (i = 0; i <= ms->mr_max; i++) {
+		int cleaned;
+
+		cleaned = fr_message_ring_gc(ms, ms->mr_array[i], max_to_clean - total_cleaned);
+		total_cleaned += cleaned;
+		fr_assert(total_cleaned <= max_to_clean);
+
+		/*
+		 *	Stop when we've reached our GC limit.
+		 */
+		if (total_cleaned == max_to_clean) break;
+	}
+
+	/*
+	 *	Only compact the arrays if we cleaned something.
+	 */
+	if (total_cleaned > 0) fr_message_set_compact(ms);
+
+	fr_message_gc_stats(ms, start, total_cleaned);
+}
+
+/** Do a small, bounded, amount of garbage collection
+ *
+ *  Called on every allocation.  We clean at most MSG_GC_STEP of the
+ *  oldest messages in one message ring, and move to the next ring on
+ *  the next call.  Messages are cleaned in the order they were
+ *  allocated, so this only checks messages which are old, and which
+ *  the recipient is likely done with.
+ *
+ *  When the smallest message ring or ring buffer has drained, the
+ *  arrays are compacted, which is O(MSG_ARRAY_SIZE).
+ *
+ * @param[in] ms the message set
+ */
+static void fr_message_gc_step(fr_message_set_t *ms)
+{
+	int cleaned;
+
+	if (ms->mr_cleaned > ms->mr_max) ms->mr_cleaned = 0;
+
+	cleaned = fr_message_ring_gc(ms, ms->mr_array[ms->mr_cleaned], MSG_GC_STEP);
+	ms->mr_cleaned++;
+
+	if (!cleaned) return;
+
+	ms->stats->gc_steps++;
+	ms->stats->gc_cleaned += cleaned;
+
+	/*
+	 *	The two largest arrays are always kept, so there's
+	 *	only work to do if there are more than two, and the
+	 *	smallest one is empty.
+	 */
+	if (((ms->mr_max >= 2) && (fr_ring_buffer_used(ms->mr_array[0]) == 0)) ||
+	    ((ms->rb_max >= 2) && (fr_ring_buffer_used(ms->rb_array[0]) == 0))) {
+		fr_time_t start = fr_time();
+
+		fr_message_set_compact(ms);
+		fr_message_gc_stats(ms, start, 0);
+	}
+}
+
+/** Resize the message rings based on how many messages are in use
+ *
+ *  We sample the number of messages in use every MSG_ADAPT_INTERVAL
+ *  allocations.  After MSG_ADAPT_SAMPLES samples, if the peak is
+ *  close to the size of the largest message ring, we add a larger
+ *  one before it fills up.  If the peak is much smaller than the
+ *  largest message ring, we start shrinking the message rings.
+ *
+ * @param[in] ms the message set
+ */
+static void fr_message_set_adapt(fr_message_set_t *ms)
+{
+	size_t used, capacity;
+	fr_ring_buffer_t *mr;
+
+	ms->adapt_countdown = MSG_ADAPT_INTERVAL;
+
+	used = fr_message_set_messages_used(ms);
+	if (used > ms->used_max) ms->used_max = used;
+
+	if (++ms->adapt_samples < MSG_ADAPT_SAMPLES) return;
+
+	capacity = fr_ring_buffer_size(ms->mr_array[ms->mr_max]) / ms->message_size;
+	ms->shrink = false;
+
+	if ((ms->used_max > ((capacity * 3) / 4)) && ((ms->mr_max + 1) < MSG_ARRAY_SIZE)) {
+		mr = message_ring_buffer_create(ms, fr_ring_buffer_size(ms->mr_array[ms->mr_max]) * 2);
+		if (mr) {
+			ms->mr_max++;
+			ms->mr_current = ms->mr_max;
+			ms->mr_array[ms->mr_max] = mr;
+			ms->stats->grown++;
+			MPRINT("SET MR to grown %d\n", ms->mr_current);
+		}
+
+	} else if ((ms->used_max < (capacity / 8)) &&
+		   ((ms->mr_max > 0) || (fr_ring_buffer_size(ms->mr_array[0]) > ms->mr_initial_size))) {
+		ms->shrink = true;
+	}
+
+	ms->adapt_samples = 0;
+	ms->used_max = used;
+}
+
+/** Shrink the message rings, one step at a time
+ *
+ *  If there are multiple message rings, we allocate from the next
+ *  largest one, and free the largest one once it has drained.  When
+ *  only one message ring is left, we replace it with one half the
+ *  size the next time it's empty.
+ *
+ * @param[in] ms the message set
+ */
+static void fr_message_set_shrink(fr_message_set_t *ms)
+{
+	fr_ring_buffer_t *mr;
+
+	if (ms->mr_max > 0) {
+		if (ms->mr_current == ms->mr_max) ms->mr_current = ms->mr_max - 1;
+
+		if (fr_ring_buffer_used(ms->mr_array[ms->mr_max]) != 0) return;
+
+		TALLOC_FREE(ms->mr_array[ms->mr_max]);
+		ms->mr_max--;
+		ms->mr_current = ms->mr_max;
+		ms->mr_cleaned = 0;
+		ms->stats->shrunk++;
+		MPRINT("SET MR to shrunk %d\n", ms->mr_current);
+		return;
+	}
+
+	if (fr_ring_buffer_size(ms->mr_array[0]) <= ms->mr_initial_size) {
+		ms->shrink = false;
+		return;
+	}
+
+	if (fr_ring_buffer_used(ms->mr_array[0]) != 0) return;
+
+	ms->shrink = false;
+
+	mr = message_ring_buffer_create(ms, fr_ring_buffer_size(ms->mr_array[0]) / 2);
+	if (!mr) return;
+
+	talloc_free(ms->mr_array[0]);
+	ms->mr_array[0] = mr;
+	ms->mr_current = 0;
+	ms->stats->shrunk++;
+	MPRINT("SET MR to halved\n");
+}
+
 /** Allocate a message from a message ring.
  *
  * The newly allocated message is zeroed.
@@ -680,6 +913,17 @@ static fr_message_t *fr_message_get_message(fr_message_set_t *ms, bool *p_cleane
 	ms->allocated++;
 	*p_cleaned = false;
 
+	/*
+	 *	Keep the collector ahead of the allocator, and
+	 *	periodically check if the message rings are the
+	 *	right size.
+	 */
+	fr_message_gc_step(ms);
+
+	if (--ms->adapt_countdown == 0) fr_message_set_adapt(ms);
+
+	if (ms->shrink) fr_message_set_shrink(ms);
+
 	/*
 	 *	Grab the current message array.  In the general case,
 	 *	there's room, so we grab a message and go find a ring
@@ -752,7 +996,7 @@ static fr_message_t *fr_message_get_message(fr_message_set_t *ms, bool *p_cleane
 	 *	Allocate another message ring, double the size
 	 *	of the previous maximum.
 	 */
-	mr = fr_ring_buffer_create(ms, fr_ring_buffer_size(ms->mr_array[ms->mr_max]) * 2);
+	mr = message_ring_buffer_create(ms, fr_ring_buffer_size(ms->mr_array[ms->mr_max]) * 2);
 	if (!mr) {
 		fr_strerror_printf_push("Failed allocating ring buffer");
 		return NULL;
@@ -875,7 +1119,7 @@ alloc_rb:
 	 *	Allocate another message ring, double the size
 	 *	of the previous maximum.
 	 */
-	rb = fr_ring_buffer_create(ms, fr_ring_buffer_size(ms->rb_array[ms->rb_max]) * 2);
+	rb = message_ring_buffer_create(ms, fr_ring_buffer_size(ms->rb_array[ms->rb_max]) * 2);
 	if (!rb) {
 		fr_strerror_printf_push("Failed allocating ring buffer");
 		goto cleanup;
@@ -1119,18 +1363,12 @@ fr_message_t *fr_message_alloc_reserve(fr_message_set_t *ms, fr_message_t *m, si
 
 	/*
 	 *	Try to extend the reservation.  If we can do it,
-	 *	return.
+	 *	return.  The leftover data stays where it is, unless
+	 *	the reservation wrapped around to the start of the
+	 *	ring buffer, in which case it's copied there.
 	 */
-	m2->data = fr_ring_buffer_reserve(m2->rb, m2->rb_size);
-	if (m2->data) {
-		/*
-		 *	We've wrapped around in the reservation.  Copy the data over.
-		 */
-		if (m2->data != (m->data + actual_packet_size)) {
-			memcpy(m2->data, m->data + actual_packet_size, leftover);
-		}
-		return m2;
-	}
+	m2->data = fr_ring_buffer_reserve_split(m2->rb, m2->rb_size, m->rb, leftover);
+	if (m2->data) return m2;
 
 	/*
 	 *	Reserve data from a new ring buffer.  If it doesn't
@@ -1321,6 +1559,12 @@ void fr_message_set_debug(fr_message_set_t *ms, FILE *fp)
 
 	fprintf(fp, "message arrays = %d\t(current %d)\n", ms->mr_max + 1, ms->mr_current);
 	fprintf(fp, "ring buffers   = %d\t(current %d)\n", ms->rb_max + 1, ms->rb_current);
+	fprintf(fp, "gc             = %" PRIu64 " steps, %" PRIu64 " runs, %" PRIu64 " cleaned, "
+		"%" PRIu64 " ns total, %" PRIu64 " ns max\n",
+		ms->stats->gc_steps, ms->stats->gc_runs, ms->stats->gc_cleaned,
+		ms->stats->gc_time, ms->stats->gc_time_max);
+	fprintf(fp, "resized        = %" PRIu64 " grown, %" PRIu64 " shrunk\n",
+		ms->stats->grown, ms->stats->shrunk);
 
 	for (i = 0; i <= ms->mr_max; i++) {
 		fr_ring_buffer_t *mr = ms->mr_array[i];
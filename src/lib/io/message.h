@@ -51,6 +51,22 @@ typedef struct {
 	size_t			rb_size;	//!< cache-aligned size in the ring buffer
 } fr_message_t;
 
+/** Garbage collection statistics for a message set
+ *
+ */
+typedef struct {
+	uint64_t		gc_steps;	//!< Incremental collections which freed messages.
+	uint64_t		gc_runs;	//!< Full collections, and compactions of the arrays.
+	uint64_t		gc_cleaned;	//!< Total number of messages freed.
+	fr_time_delta_t		gc_time;	//!< Total time spent in full collections.
+	fr_time_delta_t		gc_time_max;	//!< Longest full collection.
+
+	uint64_t		grown;		//!< Number of times we added a message ring because of occupancy.
+	uint64_t		shrunk;		//!< Number of times we shrank the message ring.
+} fr_message_set_stats_t;
+
+void fr_message_set_huge_pages(bool huge_pages, bool prefault);
+
 fr_message_set_t *fr_message_set_create(TALLOC_CTX *ctx, int num_messages, size_t message_size, size_t ring_buffer_size) CC_HINT(nonnull);
 
 fr_message_t *fr_message_reserve(fr_message_set_t *ms, size_t reserve_size) CC_HINT(nonnull);
@@ -63,6 +79,8 @@ int fr_message_done(fr_message_t *m) CC_HINT(nonnull);
 fr_message_t *fr_message_localize(TALLOC_CTX *ctx, fr_message_t *m, size_t message_size) CC_HINT(nonnull);
 
 int fr_message_set_messages_used(fr_message_set_t *ms) CC_HINT(nonnull);
+void fr_message_set_stats_set(fr_message_set_t *ms, fr_message_set_stats_t *stats) CC_HINT(nonnull(1));
+fr_message_set_stats_t const *fr_message_set_stats(fr_message_set_t const *ms) CC_HINT(nonnull);
 void fr_message_set_gc(fr_message_set_t *ms) CC_HINT(nonnull);
 
 void fr_message_set_debug(fr_message_set_t *ms, FILE *fp) CC_HINT(nonnull);
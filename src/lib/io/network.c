@@ -48,6 +48,12 @@ RCSID("$Id$")
 
 #define MAX_WORKERS 64
 
+/*
+ *	The maximum number of requests we read from a socket before
+ *	sending them to the workers.
+ */
+#define NETWORK_SEND_BATCH (32)
+
 static _Thread_local fr_ring_buffer_t *fr_network_rb;
 
 typedef struct {
@@ -66,6 +72,9 @@ typedef struct {
 	fr_time_t		predicted;		//!< predicted processing time for one packet
 
 	bool			blocked;		//!< is this worker blocked?
+	bool			retiring;		//!< is this worker being removed?
+	bool			closing;		//!< have we asked the worker to close our channel?
+	fr_dlist_t		retiring_entry;		//!< in the list of workers being removed.
 
 	fr_channel_t		*channel;		//!< channel to the worker
 	fr_worker_t		*worker;		//!< worker pointer
@@ -91,6 +100,8 @@ typedef struct {
 
 	fr_channel_data_t	*pending;		//!< the currently pending partial packet
 	fr_heap_t		*waiting;		//!< packets waiting to be written
+	fr_dlist_t		flush_entry;		//!< in the list of sockets needing a flush
+	fr_dlist_t		paused_entry;		//!< in the list of sockets we've stopped reading from
 	fr_io_stats_t		stats;
 } fr_network_socket_t;
 
@@ -111,7 +122,6 @@ struct fr_network_s {
 	char const		*name;			//!< Network ID for logging.
 
 	bool			started;		//!< Set to true when the first worker is added.
-	bool			suspended;		//!< whether or not we're suspended.
 
 	fr_log_t const		*log;			//!< log destination
 	fr_log_lvl_t		lvl;			//!< debug log level
@@ -126,7 +136,20 @@ struct fr_network_s {
 
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
 
+	fr_dlist_head_t		flush;			//!< sockets which have written replies, and
+							///< whose app_io has a flush() function.
+
+	fr_dlist_head_t		paused;			//!< sockets which we've stopped reading from,
+							///< because no worker could accept their requests.
+
+	fr_dlist_head_t		retiring;		//!< workers which are finishing their outstanding
+							///< requests before we close their channel.
+
+	fr_network_dispatch_t	dispatch;		//!< how we pick a worker for each request.
+	fr_fast_rand_t		rand_ctx;		//!< for picking random workers.
+
 	fr_io_stats_t		stats;
+	fr_message_set_stats_t	ms_stats;		//!< GC statistics for all of our sockets' message sets.
 
 	rbtree_t		*sockets;		//!< list of sockets we're managing, ordered by the listener
 	rbtree_t		*sockets_by_num;       	//!< ordered by number;
@@ -141,6 +164,10 @@ struct fr_network_s {
 							///< This is more deterministic than using async signals.
 
 	fr_network_worker_t	*workers[MAX_WORKERS]; 	//!< each worker
+
+	fr_channel_data_t	*batch[NETWORK_SEND_BATCH];	//!< requests read from a socket, waiting
+								///< to be sent to the workers.
+	int			num_batch;		//!< number of requests in the batch.
 };
 
 static void fr_network_post_event(fr_event_list_t *el, fr_time_t now, void *uctx);
@@ -280,6 +307,29 @@ int fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker)
 	return fr_control_message_send(nr->control, rb, FR_CONTROL_ID_WORKER, &worker, sizeof(worker));
 }
 
+/** Remove a worker from a network
+ *
+ * The network stops sending new requests to the worker immediately.
+ * When the worker has replied to all of the requests it was sent,
+ * the network closes its channel to the worker.  The worker exits
+ * once all of the networks have closed their channels.
+ *
+ * @param nr the network
+ * @param worker the worker
+ */
+int fr_network_worker_remove(fr_network_t *nr, fr_worker_t *worker)
+{
+	fr_ring_buffer_t *rb;
+
+	rb = fr_network_rb_init();
+	if (!rb) return -1;
+
+	(void) talloc_get_type_abort(nr, fr_network_t);
+	(void) talloc_get_type_abort(worker, fr_worker_t);
+
+	return fr_control_message_send(nr->control, rb, FR_CONTROL_ID_WORKER_REMOVE, &worker, sizeof(worker));
+}
+
 /** Signal the network to read from a listener
  *
  * @param nr the network
@@ -381,41 +431,68 @@ int fr_network_listen_inject(fr_network_t *nr, fr_listen_t *li, uint8_t const *p
 	return fr_control_message_send(nr->control, rb, FR_CONTROL_ID_INJECT, &my_inject, sizeof(my_inject));
 }
 
-static int apply(void *data, void *uctx)
-{
-	fr_network_socket_t *socket = data;
-
-	fr_event_update_t *update = uctx;
-
-	fr_event_filter_update(socket->nr->el, socket->listen->fd, FR_EVENT_FILTER_IO, update);
-
-	return 0;
-}
-
-static void fr_network_suspend(fr_network_t *nr)
+/** Stop reading from a socket whose requests couldn't be sent to a worker
+ *
+ * Only the sockets which have traffic for the workers are paused.
+ * Sockets which are idle, or which are handled entirely by the
+ * network thread, continue to be read.  Requests left in the
+ * kernel's socket buffer are read when the socket is resumed.
+ *
+ * @param nr the network
+ * @param s the socket to pause.
+ */
+static void fr_network_socket_pause(fr_network_t *nr, fr_network_socket_t *s)
 {
 	static fr_event_update_t pause_read[] = {
 		FR_EVENT_SUSPEND(fr_event_io_func_t, read),
 		{ 0 }
 	};
 
-	if (nr->suspended) return;
+	if (s->dead || (s->filter != FR_EVENT_FILTER_IO)) return;
+	if (fr_dlist_entry_in_list(&s->paused_entry)) return;
+
+	if (fr_event_filter_update(nr->el, s->listen->fd, FR_EVENT_FILTER_IO, pause_read) < 0) return;
 
-	(void) rbtree_walk(nr->sockets, RBTREE_IN_ORDER, apply, pause_read);
-	nr->suspended = true;
+	fr_dlist_insert_tail(&nr->paused, s);
 }
 
-static void fr_network_unsuspend(fr_network_t *nr)
+/** Resume reading from all of the sockets we paused
+ *
+ * @param nr the network
+ */
+static void fr_network_socket_unpause(fr_network_t *nr)
 {
 	static fr_event_update_t resume_read[] = {
 		FR_EVENT_RESUME(fr_event_io_func_t, read),
 		{ 0 }
 	};
+	fr_network_socket_t *s;
 
-	if (!nr->suspended) return;
+	while ((s = fr_dlist_head(&nr->paused))) {
+		fr_dlist_remove(&nr->paused, s);
 
-	(void) rbtree_walk(nr->sockets, RBTREE_IN_ORDER, apply, resume_read);
-	nr->suspended = false;
+		(void) fr_event_filter_update(nr->el, s->listen->fd, FR_EVENT_FILTER_IO, resume_read);
+	}
+}
+
+/** Close the channel to a retiring worker, once it has no outstanding requests
+ *
+ * The worker replies to every request we send it, even ones which it
+ * discards as duplicates.  So the stats balance once it's done.
+ *
+ * @param nr the network
+ * @param w the worker which is being removed.
+ */
+static void fr_network_worker_drain(fr_network_t *nr, fr_network_worker_t *w)
+{
+	if (!w->retiring || w->closing) return;
+
+	if (w->stats.in != w->stats.out) return;
+
+	DEBUG2("Worker has finished its outstanding requests, closing channel");
+
+	w->closing = true;
+	fr_channel_signal_responder_close(w->channel);
 }
 
 #define IALPHA (8)
@@ -438,12 +515,33 @@ static void fr_network_recv_reply(void *ctx, fr_channel_t *ch, fr_channel_data_t
 	 *	Update stats for the worker.
 	 */
 	worker = fr_channel_requestor_uctx_get(ch);
-	worker->stats.out++;
-	worker->cpu_time = cd->reply.cpu_time;
-	if (!worker->predicted) {
-		worker->predicted = cd->reply.processing_time;
+	if (!cd->reply.stolen_from) {
+		worker->stats.out++;
+		fr_network_worker_drain(nr, worker);
 	} else {
-		worker->predicted = RTT(worker->predicted, cd->reply.processing_time);
+		fr_network_worker_t *original = fr_channel_requestor_uctx_get(cd->reply.stolen_from);
+
+		/*
+		 *	The request was sent to a different worker,
+		 *	which is the one that now has one fewer
+		 *	outstanding request.
+		 */
+		original->stats.out++;
+		fr_network_worker_drain(nr, original);
+	}
+	worker->cpu_time = cd->reply.cpu_time;
+
+	/*
+	 *	Discarded requests are answered with an empty reply,
+	 *	and no processing time.  Don't let them skew the
+	 *	prediction.
+	 */
+	if (cd->reply.processing_time) {
+		if (!worker->predicted) {
+			worker->predicted = cd->reply.processing_time;
+		} else {
+			worker->predicted = RTT(worker->predicted, cd->reply.processing_time);
+		}
 	}
 
 	/*
@@ -452,7 +550,7 @@ static void fr_network_recv_reply(void *ctx, fr_channel_t *ch, fr_channel_data_t
 	if (worker->blocked) {
 		worker->blocked = false;
 		nr->num_blocked--;
-		fr_network_unsuspend(nr);
+		fr_network_socket_unpause(nr);
 	}
 
 	/*
@@ -513,20 +611,30 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 								   fr_network_worker_t);
 		int			i;
 
+		DEBUG3("Worker acked our close request");
+
+		/*
+		 *	A retired worker has already been removed
+		 *	from the array, and nothing else refers to
+		 *	its channel.
+		 */
+		if (w->retiring) {
+			fr_dlist_remove(&nr->retiring, w);
+			talloc_free(w);
+			break;
+		}
+
 		/*
 		 *	Remove this worker from the array
 		 */
 		for (i = 0; i < nr->num_workers; i++) {
-			DEBUG3("Worker acked our close request");
 			if (nr->workers[i] == w) {
-				nr->workers[i] = NULL;
-
-				if (i == (nr->num_workers - 1)) break;
-
 				/*
 				 *	Close the hole...
 				 */
-				memcpy(&nr->workers[i], &nr->workers[i + 1], ((nr->num_workers - i) - 1));
+				memmove(&nr->workers[i], &nr->workers[i + 1],
+					sizeof(nr->workers[0]) * ((nr->num_workers - i) - 1));
+				nr->workers[nr->num_workers - 1] = NULL;
 				break;
 			}
 		}
@@ -536,87 +644,186 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 	}
 }
 
-/** Send a message on the "best" channel.
+/** Pick the active worker with the fewest outstanding requests
+ *
+ * Ties are broken by picking the worker with the lowest CPU time.
+ *
+ * @param nr the network
+ * @return
+ *	- the least loaded worker.
+ *	- NULL if all workers are blocked.
+ */
+static fr_network_worker_t *fr_network_worker_least_loaded(fr_network_t *nr)
+{
+	int i;
+	uint64_t outstanding = UINT64_MAX;
+	fr_network_worker_t *found = NULL;
+
+	for (i = 0; i < nr->num_workers; i++) {
+		fr_network_worker_t *worker = nr->workers[i];
+		uint64_t this;
+
+		if (worker->blocked) continue;
+
+		this = worker->stats.in - worker->stats.out;
+		if ((this < outstanding) ||
+		    (found && (this == outstanding) && (worker->cpu_time < found->cpu_time))) {
+			outstanding = this;
+			found = worker;
+		}
+	}
+
+	return found;
+}
+
+/** Pick a worker by consistent hashing on the affinity key of the request
+ *
+ * This uses the "jump" consistent hash from Lamping and Veach,
+ * "A Fast, Minimal Memory, Consistent Hash Algorithm".  When the
+ * number of workers changes, only the minimum number of keys move
+ * to a different worker.
  *
  * @param nr the network
  * @param cd the message we've received
+ * @return
+ *	- the worker for this request.
+ *	- NULL if the listener has no affinity key, or the worker is blocked.
  */
-static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
+static fr_network_worker_t *fr_network_worker_by_affinity(fr_network_t *nr, fr_channel_data_t *cd)
 {
+	fr_app_io_t const *app_io = cd->listen->app_io;
 	fr_network_worker_t *worker;
+	uint64_t key;
+	int64_t b = -1, j = 0;
 
-	(void) talloc_get_type_abort(nr, fr_network_t);
+	if (!app_io->affinity) return NULL;
+
+	key = app_io->affinity(cd->listen, cd->packet_ctx);
+
+	while (j < nr->num_workers) {
+		b = j;
+		key = (key * 2862933555777941757ULL) + 1;
+		j = (b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1));
+	}
+
+	worker = nr->workers[b];
+	if (worker->blocked) return NULL;
+
+	return worker;
+}
+
+/** Pick the "best" worker for a message
+ *
+ * @param nr the network
+ * @param cd the message we've received
+ * @return
+ *	- the worker to send the message to.
+ *	- NULL if there are no active workers.
+ */
+static fr_network_worker_t *fr_network_worker_pick(fr_network_t *nr, fr_channel_data_t *cd)
+{
+	fr_network_worker_t *worker;
 
-retry:
 	if (nr->num_workers == 1) {
 		worker = nr->workers[0];
 		if (worker->blocked) {
 			 RATE_LIMIT_GLOBAL(ERROR, "Failed sending packet to worker - "
 			 		   "In single-threaded mode and worker is blocked");
-			return -1;
+			return NULL;
 		}
 
-	} else if (nr->num_blocked == 0) {
-		uint32_t one, two;
+		return worker;
+	}
 
-		one = fr_rand() % nr->num_workers;
-		do {
-			two = fr_rand() % nr->num_workers;
-		} while (two == one);
+	worker = NULL;
 
-		if (nr->workers[one]->cpu_time < nr->workers[two]->cpu_time) {
-			worker = nr->workers[one];
-		} else {
-			worker = nr->workers[two];
-		}
-	} else {
-		int i;
-		fr_time_t cpu_time = ~((fr_time_t) 0);
-		fr_network_worker_t *found = NULL;
+	switch (nr->dispatch) {
+	case FR_NETWORK_DISPATCH_CLIENT:
+		worker = fr_network_worker_by_affinity(nr, cd);
+		break;
 
-		/*
-		 *	Some workers are blocked.  Pick an active
-		 *	worker with low CPU time.
-		 */
-		for (i = 0; i < nr->num_workers; i++) {
-			worker = nr->workers[i];
-			if (worker->blocked) continue;
+	case FR_NETWORK_DISPATCH_LEAST_LOADED:
+		break;
+
+	case FR_NETWORK_DISPATCH_RANDOM:
+		if (nr->num_blocked == 0) {
+			uint32_t one, two;
 
-			if (worker->cpu_time < cpu_time) {
-				found = worker;
+			one = fr_fast_rand(&nr->rand_ctx) % nr->num_workers;
+			do {
+				two = fr_fast_rand(&nr->rand_ctx) % nr->num_workers;
+			} while (two == one);
+
+			if (nr->workers[one]->cpu_time < nr->workers[two]->cpu_time) {
+				worker = nr->workers[one];
+			} else {
+				worker = nr->workers[two];
 			}
 		}
+		break;
+	}
 
-		if (!found) {
+	/*
+	 *	Some workers are blocked, or the policy didn't
+	 *	pick one.  Pick the least loaded active worker.
+	 */
+	if (!worker) {
+		worker = fr_network_worker_least_loaded(nr);
+		if (!worker) {
 			 RATE_LIMIT_GLOBAL(ERROR, "Failed sending packet to worker - Couldn't find active worker, "
 			 		   "%u/%u workers are blocked", nr->num_blocked, nr->num_workers);
-			return -1;
+			return NULL;
 		}
-
-		worker = found;
 	}
 
-	(void) talloc_get_type_abort(worker, fr_network_worker_t);
+	return talloc_get_type_abort(worker, fr_network_worker_t);
+}
+
+/** Mark a worker as blocked
+ *
+ * The only reason for failing to send to a worker is that the worker
+ * isn't servicing it's input queue.  When that happens, we have no
+ * idea what to do, and the whole thing falls over.
+ *
+ * @param nr the network
+ * @param worker which couldn't accept a message
+ * @return
+ *	- true if all of the workers are now blocked.
+ *	- false if there are other workers to try.
+ */
+static bool fr_network_worker_block(fr_network_t *nr, fr_network_worker_t *worker)
+{
+	worker->stats.dropped++;
+	worker->blocked = true;
+	nr->num_blocked++;
+
+	RATE_LIMIT_GLOBAL(PERROR, "Failed sending packet to worker - %u/%u workers are blocked",
+			  nr->num_blocked, nr->num_workers);
+
+	return (nr->num_blocked == nr->num_workers);
+}
+
+/** Send a message on the "best" channel.
+ *
+ * @param nr the network
+ * @param cd the message we've received
+ */
+static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
+{
+	fr_network_worker_t *worker;
+
+	(void) talloc_get_type_abort(nr, fr_network_t);
+
+retry:
+	worker = fr_network_worker_pick(nr, cd);
+	if (!worker) return -1;
 
 	/*
-	 *	Send the message to the channel.  If we fail, drop the
-	 *	packet.  The only reason for failure is that the
-	 *	worker isn't servicing it's input queue.  When that
-	 *	happens, we have no idea what to do, and the whole
-	 *	thing falls over.
+	 *	Send the message to the channel.  If we fail, try
+	 *	another worker.
 	 */
 	if (fr_channel_send_request(worker->channel, cd) < 0) {
-		worker->stats.dropped++;
-		worker->blocked = true;
-		nr->num_blocked++;
-
-		RATE_LIMIT_GLOBAL(PERROR, "Failed sending packet to worker - %u/%u workers are blocked",
-				  nr->num_blocked, nr->num_workers);
-
-		if (nr->num_blocked == nr->num_workers) {
-			fr_network_suspend(nr);
-			return -1;
-		}
+		if (fr_network_worker_block(nr, worker)) return -1;
 		goto retry;
 	}
 
@@ -633,6 +840,122 @@ retry:
 	return 0;
 }
 
+/** Drop a request which couldn't be sent to any worker
+ *
+ * @param nr the network
+ * @param s the socket the request was read from
+ * @param cd the request
+ */
+static void fr_network_request_drop(fr_network_t *nr, fr_network_socket_t *s, fr_channel_data_t *cd)
+{
+	fr_message_done(&cd->m);
+	nr->stats.dropped++;
+	s->stats.dropped++;
+
+	fr_assert(s->outstanding > 0);
+	s->outstanding--;
+}
+
+/** Send the requests read from a socket to the workers
+ *
+ * A worker is picked for each request, and then each worker is sent
+ * all of its requests at once.  This makes one pass over the
+ * channel's atomic queue, and signals the worker once, no matter how
+ * many requests there are.
+ *
+ * The requests have already been counted as outstanding for the
+ * socket, so that it isn't freed while they're still in the batch.
+ *
+ * @param nr the network
+ * @param s the socket the requests were read from
+ */
+static void fr_network_send_batch(fr_network_t *nr, fr_network_socket_t *s)
+{
+	int			i, j, num, sent;
+	int			num_batch = nr->num_batch;
+	fr_channel_data_t	*out[NETWORK_SEND_BATCH];
+	fr_network_worker_t	*picked[NETWORK_SEND_BATCH];
+
+	nr->num_batch = 0;
+
+	/*
+	 *	The socket died while we were reading from it.  Don't
+	 *	bother the workers with these requests.
+	 */
+	if (s->dead) {
+		for (i = 0; i < num_batch; i++) fr_network_request_drop(nr, s, nr->batch[i]);
+		if (!s->outstanding) talloc_free(s);
+		return;
+	}
+
+	/*
+	 *	Pick a worker for each request.  The prediction is
+	 *	updated as we go, so that the requests are spread
+	 *	across the workers the same as if they were sent one
+	 *	at a time.
+	 */
+	for (i = 0; i < num_batch; i++) {
+		fr_network_worker_t *worker;
+
+		worker = picked[i] = fr_network_worker_pick(nr, nr->batch[i]);
+		if (!worker) continue;
+
+		worker->stats.in++;
+		worker->cpu_time += worker->predicted;
+	}
+
+	for (i = 0; i < num_batch; i++) {
+		fr_network_worker_t *worker = picked[i];
+
+		if (!worker) {
+			if (nr->batch[i]) {
+				fr_network_request_drop(nr, s, nr->batch[i]);
+				fr_network_socket_pause(nr, s);
+			}
+			continue;
+		}
+
+		/*
+		 *	Gather all of the requests for this worker.
+		 */
+		num = 0;
+		for (j = i; j < num_batch; j++) {
+			if (picked[j] != worker) continue;
+
+			out[num++] = nr->batch[j];
+			picked[j] = NULL;
+			nr->batch[j] = NULL;
+		}
+
+		sent = fr_channel_send_request_batch(worker->channel, out, num);
+		if (sent == num) continue;
+
+		if (sent < 0) sent = 0;
+
+		/*
+		 *	The worker's queue is full.  Undo the
+		 *	prediction for the requests it didn't take,
+		 *	and send them one at a time to the other
+		 *	workers.
+		 */
+		worker->stats.in -= (num - sent);
+		worker->cpu_time -= (num - sent) * worker->predicted;
+
+		if (fr_network_worker_block(nr, worker)) {
+			for (j = sent; j < num; j++) fr_network_request_drop(nr, s, out[j]);
+			fr_network_socket_pause(nr, s);
+			continue;
+		}
+
+		for (j = sent; j < num; j++) {
+			if (fr_network_send_request(nr, out[j]) < 0) {
+				fr_network_request_drop(nr, s, out[j]);
+				fr_network_socket_pause(nr, s);
+			}
+		}
+	}
+}
+
 /*
  *	Mark it as dead, but DON'T free it until all of the replies
  *	have come in.
@@ -643,6 +966,8 @@ static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s)
 
 	s->dead = true;
 
+	if (fr_dlist_entry_in_list(&s->paused_entry)) fr_dlist_remove(&nr->paused, s);
+
 	fr_event_fd_delete(nr->el, s->listen->fd, s->filter);
 
 	/*
@@ -662,17 +987,26 @@ static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s)
 	 */
 }
 
-/** Read a packet from the network.
+/** How much room to reserve for each read from a socket
+ *
+ *  Stream sockets can read many packets at once, and frame them
+ *  in place in the message set.
+ */
+static inline size_t network_read_size(fr_listen_t const *li)
+{
+	if (li->read_size > li->default_message_size) return li->read_size;
+
+	return li->default_message_size;
+}
+
+/** Read packets from the network into the batch.
  *
- * @param[in] el	the event list.
  * @param[in] sockfd	the socket which is ready to read.
- * @param[in] flags	from kevent.
- * @param[in] ctx	the network socket context.
+ * @param[in] s		the network socket context.
  */
-static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int flags, void *ctx)
+static void fr_network_read_packets(int sockfd, fr_network_socket_t *s)
 {
 	int			num_messages = 0;
-	fr_network_socket_t	*s = ctx;
 	fr_network_t		*nr = s->nr;
 	ssize_t			data_size;
 	fr_channel_data_t	*cd, *next;
@@ -686,10 +1020,10 @@ static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int f
 	DEBUG3("Reading data from FD %u", sockfd);
 
 	if (!s->cd) {
-		cd = (fr_channel_data_t *) fr_message_reserve(s->ms, s->listen->default_message_size);
+		cd = (fr_channel_data_t *) fr_message_reserve(s->ms, network_read_size(s->listen));
 		if (!cd) {
 			ERROR("Failed allocating message size %zd! - Closing socket",
-			      s->listen->default_message_size);
+			      network_read_size(s->listen));
 			fr_network_socket_dead(nr, s);
 			return;
 		}
@@ -703,8 +1037,13 @@ next_message:
 	/*
 	 *	Poll this socket, but not too often.  We have to go
 	 *	service other sockets, too.
+	 *
+	 *	Packets which the listener has already read from the
+	 *	kernel are always processed.  There may be no more
+	 *	"readable" events for the socket, and there are at
+	 *	most "recv_batch" of them.
 	 */
-	if (num_messages > 16) {
+	if ((num_messages > 16) && !s->listen->recv_pending) {
 		s->cd = cd;
 		return;
 	}
@@ -725,6 +1064,16 @@ next_message:
 	data_size = s->listen->app_io->read(s->listen, &cd->packet_ctx, &cd->request.recv_time,
 					    cd->m.data, cd->m.rb_size, &s->leftover, &cd->priority, &cd->request.is_dup);
 	if (data_size == 0) {
+		/*
+		 *	The packet was ignored, but the listener has
+		 *	more packets buffered.  Re-use the same
+		 *	message for the next one.
+		 */
+		if (s->listen->recv_pending) {
+			num_messages++;
+			goto next_message;
+		}
+
 		/*
 		 *	Cache the message for later.  This is
 		 *	important for stream sockets, which can do
@@ -787,7 +1136,7 @@ next_message:
 		 *	them to the next round of reading.
 		 */
 		next = (fr_channel_data_t *) fr_message_alloc_reserve(s->ms, &cd->m, data_size, s->leftover,
-								      s->listen->default_message_size);
+								      network_read_size(s->listen));
 		if (!next) {
 			PERROR("Failed reserving partial packet.");
 			// @todo - probably close the socket...
@@ -801,16 +1150,27 @@ next_message:
 	 */
 	fr_assert(cd->m.when == now);
 
-	if (fr_network_send_request(nr, cd) < 0) {
-		fr_message_done(&cd->m);
-		nr->stats.dropped++;
-		s->stats.dropped++;
+	/*
+	 *	Queue the packet for the workers.  It's counted as
+	 *	outstanding now, so that the socket isn't freed while
+	 *	the packet is still in the batch.
+	 */
+	s->outstanding++;
+	nr->batch[nr->num_batch++] = cd;
+	if (nr->num_batch == NETWORK_SEND_BATCH) fr_network_send_batch(nr, s);
 
-	} else {
-		/*
-		 *	One more packet sent to a worker.
-		 */
-		s->outstanding++;
+	/*
+	 *	Datagram listeners which read packets in batches
+	 *	tell us how many more packets they have buffered.
+	 *	Allocate room for the next one, and go get it.
+	 */
+	if (!next && s->listen->recv_pending) {
+		next = (fr_channel_data_t *) fr_message_reserve(s->ms, network_read_size(s->listen));
+		if (!next) {
+			RATE_LIMIT_GLOBAL(ERROR, "Failed allocating message size %zd for %u pending packets",
+					  s->listen->default_message_size, s->listen->recv_pending);
+			return;
+		}
 	}
 
 	/*
@@ -829,6 +1189,23 @@ next_message:
 }
 
 
+/** Read packets from the network, and send them to the workers.
+ *
+ * @param[in] el	the event list.
+ * @param[in] sockfd	the socket which is ready to read.
+ * @param[in] flags	from kevent.
+ * @param[in] ctx	the network socket context.
+ */
+static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int flags, void *ctx)
+{
+	fr_network_socket_t	*s = ctx;
+	fr_network_t		*nr = s->nr;
+
+	fr_network_read_packets(sockfd, s);
+
+	if (nr->num_batch) fr_network_send_batch(nr, s);
+}
+
 /** Get a notification that a vnode changed
  *
  * @param[in] el	the event list.
@@ -975,6 +1352,13 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		cd = fr_heap_pop(s->waiting);
 	}
 
+	/*
+	 *	Write anything the listener has queued.
+	 */
+	if (li->app_io->flush && (li->app_io->flush(li) < 0)) {
+		RATE_LIMIT_GLOBAL(PERROR, "Failed flushing replies on socket %d", li->fd);
+	}
+
 	/*
 	 *	We've successfully written all of the packets.  Remove
 	 *	the write callback.
@@ -997,6 +1381,9 @@ static int _network_socket_free(fr_network_socket_t *s)
 	rbtree_deletebydata(nr->sockets, s);
 	rbtree_deletebydata(nr->sockets_by_num, s);
 
+	if (fr_dlist_entry_in_list(&s->flush_entry)) fr_dlist_remove(&nr->flush, s);
+	if (fr_dlist_entry_in_list(&s->paused_entry)) fr_dlist_remove(&nr->paused, s);
+
 	fr_event_fd_delete(nr->el, s->listen->fd, s->filter);
 
 	if (s->listen->app_io->close) {
@@ -1064,6 +1451,11 @@ static void fr_network_listen_callback(void *ctx, void const *data, size_t data_
 	if (size < (1 << 17)) size = (1 << 17);
 	if (size > (100 * 1024 * 1024)) size = (100 * 1024 * 1024);
 
+	/*
+	 *	Reservations can be at most half of the ring buffer.
+	 */
+	while (size < (2 * network_read_size(s->listen))) size <<= 1;
+
 	/*
 	 *	Allocate the ring buffer for messages and packets.
 	 */
@@ -1075,6 +1467,7 @@ static void fr_network_listen_callback(void *ctx, void const *data, size_t data_
 		talloc_free(s);
 		return;
 	}
+	fr_message_set_stats_set(s->ms, &nr->ms_stats);
 
 	app_io = s->listen->app_io;
 	s->filter = FR_EVENT_FILTER_IO;
@@ -1147,6 +1540,7 @@ static void fr_network_directory_callback(void *ctx, void const *data, size_t da
 		talloc_free(s);
 		return;
 	}
+	fr_message_set_stats_set(s->ms, &nr->ms_stats);
 
 	app_io = s->listen->app_io;
 
@@ -1195,6 +1589,7 @@ static void fr_network_worker_started_callback(void *ctx, void const *data, size
 	fr_fatal_assert_msg(w->channel, "Failed creating new channel");
 
 	fr_channel_requestor_uctx_add(w->channel, w);
+	fr_channel_requestor_ms_stats_add(w->channel, &nr->ms_stats);
 	fr_channel_set_recv_reply(w->channel, nr, fr_network_recv_reply);
 
 	nr->num_workers++;
@@ -1207,6 +1602,12 @@ static void fr_network_worker_started_callback(void *ctx, void const *data, size
 		if (nr->workers[i]) continue;
 
 		nr->workers[i] = w;
+
+		/*
+		 *	There's a new worker which can take the
+		 *	requests that we couldn't send.
+		 */
+		fr_network_socket_unpause(nr);
 		return;
 	}
 
@@ -1216,6 +1617,46 @@ static void fr_network_worker_started_callback(void *ctx, void const *data, size
 	fr_assert(0 == 1);
 }
 
+/** Handle a network control message callback for removing a worker
+ *
+ * @param[in] ctx the network
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_network_worker_remove_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+{
+	int			i;
+	fr_network_t		*nr = ctx;
+	fr_worker_t		*worker;
+	fr_network_worker_t	*w = NULL;
+
+	fr_assert(data_size == sizeof(worker));
+
+	memcpy(&worker, data, data_size);
+
+	for (i = 0; i < nr->num_workers; i++) {
+		if (nr->workers[i]->worker != worker) continue;
+
+		w = nr->workers[i];
+		memmove(&nr->workers[i], &nr->workers[i + 1], sizeof(nr->workers[0]) * ((nr->num_workers - i) - 1));
+		nr->workers[nr->num_workers - 1] = NULL;
+		nr->num_workers--;
+		break;
+	}
+	if (!w) return;
+
+	if (w->blocked) {
+		w->blocked = false;
+		nr->num_blocked--;
+	}
+
+	w->retiring = true;
+	fr_dlist_insert_tail(&nr->retiring, w);
+
+	fr_network_worker_drain(nr, w);
+}
+
 /** Handle a network control message callback for a packet sent to a socket
  *
  * @param[in] ctx the network
@@ -1269,6 +1710,26 @@ static int fr_network_pre_event(void *ctx, UNUSED fr_time_t wake)
 	return 0;
 }
 
+/** Flush any packets which listeners have queued for writing
+ *
+ * @param[in] nr	the network
+ */
+static void fr_network_flush(fr_network_t *nr)
+{
+	fr_network_socket_t *s;
+
+	while ((s = fr_dlist_head(&nr->flush)) != NULL) {
+		fr_listen_t *li = s->listen;
+
+		(void) fr_dlist_remove(&nr->flush, s);
+		if (s->dead) continue;
+
+		if (li->app_io->flush(li) < 0) {
+			RATE_LIMIT_GLOBAL(PERROR, "Failed flushing replies on socket %d", li->fd);
+		}
+	}
+}
+
 /** Handle replies after all FD and timer events have been serviced
  *
  * @param el	the event loop
@@ -1419,8 +1880,26 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 		 *	As a special case, allow write() to return
 		 *	"0", which means "close the socket".
 		 */
-		if (rcode == 0) fr_network_socket_dead(nr, s);
+		if (rcode == 0) {
+			fr_network_socket_dead(nr, s);
+			continue;
+		}
+
+		/*
+		 *	The listener may have queued the packet
+		 *	instead of writing it.  Remember to flush it
+		 *	once all of the replies have been processed.
+		 */
+		if (li->app_io->flush && !fr_dlist_entry_in_list(&s->flush_entry)) {
+			fr_dlist_insert_tail(&nr->flush, s);
+		}
 	}
+
+	/*
+	 *	Write all of the queued packets, one system call per
+	 *	socket.
+	 */
+	fr_network_flush(nr);
 }
 
 /** Stop a network thread in an orderly way
@@ -1483,11 +1962,25 @@ int fr_network_destroy(fr_network_t *nr)
 	{
 		int i;
 
+		fr_network_worker_t *w = NULL;
+
 		for (i = 0; i < nr->num_workers; i++) {
 			fr_network_worker_t *worker = nr->workers[i];
 
 			fr_channel_signal_responder_close(worker->channel);
 		}
+
+		/*
+		 *	Workers which are being removed may still
+		 *	have requests, but we're not waiting for
+		 *	the replies any more.
+		 */
+		while ((w = fr_dlist_next(&nr->retiring, w))) {
+			if (w->closing) continue;
+
+			w->closing = true;
+			fr_channel_signal_responder_close(w->channel);
+		}
 	}
 
 	(void) fr_event_pre_delete(nr->el, fr_network_pre_event, nr);
@@ -1532,7 +2025,7 @@ static void _signal_pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int fla
  */
 void fr_network(fr_network_t *nr)
 {
-	while (likely(((nr->num_workers > 0) || !nr->started))) {
+	while (likely(((nr->num_workers > 0) || (fr_dlist_num_elements(&nr->retiring) > 0) || !nr->started))) {
 		bool wait_for_event;
 		int num_events;
 
@@ -1592,6 +2085,18 @@ static int _fr_network_free(fr_network_t *nr)
 	return 0;
 }
 
+/** Set the policy used to pick a worker for each request
+ *
+ * @param nr		the network
+ * @param dispatch	the policy to use.
+ */
+void fr_network_dispatch_set(fr_network_t *nr, fr_network_dispatch_t dispatch)
+{
+	(void) talloc_get_type_abort(nr, fr_network_t);
+
+	nr->dispatch = dispatch;
+}
+
 /** Create a network
  *
  * @param[in] ctx 	The talloc ctx
@@ -1623,6 +2128,12 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 	nr->num_workers = 0;
 	nr->signal_pipe[0] = -1;
 	nr->signal_pipe[1] = -1;
+	nr->rand_ctx.a = fr_rand();
+	nr->rand_ctx.b = fr_rand();
+
+	fr_dlist_init(&nr->flush, fr_network_socket_t, flush_entry);
+	fr_dlist_init(&nr->paused, fr_network_socket_t, paused_entry);
+	fr_dlist_init(&nr->retiring, fr_network_worker_t, retiring_entry);
 
 	nr->aq_control = fr_atomic_queue_alloc(nr, 1024);
 	if (!nr->aq_control) {
@@ -1672,6 +2183,11 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 		goto fail2;
 	}
 
+	if (fr_control_callback_add(nr->control, FR_CONTROL_ID_WORKER_REMOVE, nr, fr_network_worker_remove_callback) < 0) {
+		fr_strerror_printf_push("Failed adding worker remove callback");
+		goto fail2;
+	}
+
 	if (fr_control_callback_add(nr->control, FR_CONTROL_ID_INJECT, nr, fr_network_inject_callback) < 0) {
 		fr_strerror_printf_push("Failed adding packet injection callback");
 		goto fail2;
@@ -1755,7 +2271,10 @@ void fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log)
 
 static int cmd_stats_self(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
 {
-	fr_network_t const *nr = ctx;
+	fr_network_t const	*nr = ctx;
+	int			i;
+	uint64_t		outstanding = 0;
+	unsigned int		blocked = 0;
 
 	fprintf(fp, "count.in\t%" PRIu64 "\n", nr->stats.in);
 	fprintf(fp, "count.out\t%" PRIu64 "\n", nr->stats.out);
@@ -1763,6 +2282,22 @@ static int cmd_stats_self(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cm
 	fprintf(fp, "count.dropped\t%" PRIu64 "\n", nr->stats.dropped);
 	fprintf(fp, "count.sockets\t%u\n", rbtree_num_elements(nr->sockets));
 
+	/*
+	 *	Requests sent to a worker which haven't had a reply
+	 *	yet.  If this keeps growing, the workers are the
+	 *	bottleneck, and not this thread.
+	 */
+	for (i = 0; i < nr->max_workers; i++) {
+		if (!nr->workers[i]) continue;
+
+		outstanding += nr->workers[i]->stats.in - nr->workers[i]->stats.out;
+		if (nr->workers[i]->blocked) blocked++;
+	}
+
+	fr_event_list_stats_fprint(fp, nr->el, "loop");
+	fprintf(fp, "loop.outstanding\t%" PRIu64 "\n", outstanding);
+	fprintf(fp, "loop.blocked_workers\t%u\n", blocked);
+
 	return 0;
 }
 
@@ -42,6 +42,15 @@ typedef struct fr_network_s fr_network_t;
 extern "C" {
 #endif
 
+/** How the network thread picks a worker for each request
+ *
+ */
+typedef enum {
+	FR_NETWORK_DISPATCH_RANDOM = 0,		//!< Power of two choices, on CPU time.
+	FR_NETWORK_DISPATCH_CLIENT,		//!< Consistent hash on the client address.
+	FR_NETWORK_DISPATCH_LEAST_LOADED	//!< Worker with the fewest outstanding requests.
+} fr_network_dispatch_t;
+
 int		fr_network_listen_add(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
 
 int		fr_network_socket_delete(fr_network_t *nr, fr_listen_t *li);
@@ -49,6 +58,7 @@ int		fr_network_socket_delete(fr_network_t *nr, fr_listen_t *li);
 int		fr_network_directory_add(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
 
 int		fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker) CC_HINT(nonnull);
+int		fr_network_worker_remove(fr_network_t *nr, fr_worker_t *worker) CC_HINT(nonnull);
 
 void		fr_network_listen_read(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
 
@@ -60,6 +70,8 @@ int		fr_network_listen_inject(fr_network_t *nr, fr_listen_t *li, uint8_t const *
 fr_network_t	*fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 				   char const *nr, fr_log_t const *logger, fr_log_lvl_t lvl) CC_HINT(nonnull(2,4));
 
+void		fr_network_dispatch_set(fr_network_t *nr, fr_network_dispatch_t dispatch) CC_HINT(nonnull);
+
 int		fr_network_exit(fr_network_t *nr) CC_HINT(nonnull);
 
 int		fr_network_destroy(fr_network_t *nr) CC_HINT(nonnull);
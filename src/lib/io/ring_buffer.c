@@ -28,6 +28,14 @@ RCSID("$Id$")
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/debug.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ *	The huge page size we ask for.  This is the usual size on
+ *	x86_64 and aarch64.
+ */
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
 
 /*
  *	Ring buffers are allocated in a block.
@@ -43,8 +51,52 @@ struct fr_ring_buffer_s {
 	size_t		reserved;	//!< amount of reserved data at write_offset
 
 	bool		closed;		//!< whether allocations are closed
+
+	size_t		mapped;		//!< size of the mmap()ed region, or 0 if the buffer was talloc'd
 };
 
+/** Allocate the ring buffer header, and check the size
+ *
+ * @param[in] ctx	a talloc context
+ * @param[in,out] size	of the raw ring buffer array.  Rounded up to the next power of 2.
+ * @return
+ *	- A new ring buffer with no storage on success.
+ *	- NULL on failure.
+ */
+static fr_ring_buffer_t *ring_buffer_alloc(TALLOC_CTX *ctx, size_t *size)
+{
+	fr_ring_buffer_t	*rb;
+	size_t			sz = *size;
+
+	rb = talloc_zero(ctx, fr_ring_buffer_t);
+	if (!rb) {
+		fr_strerror_printf("Failed allocating memory.");
+		return NULL;
+	}
+
+	if (sz < 1024) sz = 1024;
+
+	if (sz > (1 << 30)) {
+		fr_strerror_printf("Ring buffer size must be no more than (1 << 30)");
+		talloc_free(rb);
+		return NULL;
+	}
+
+	/*
+	 *	Round up to the nearest power of 2.
+	 */
+	sz--;
+	sz |= sz >> 1;
+	sz |= sz >> 2;
+	sz |= sz >> 4;
+	sz |= sz >> 8;
+	sz |= sz >> 16;
+	sz++;
+
+	*size = sz;
+	return rb;
+}
+
 /** Create a ring buffer.
  *
  *  The size provided will be rounded up to the next highest power of
@@ -65,39 +117,116 @@ fr_ring_buffer_t *fr_ring_buffer_create(TALLOC_CTX *ctx, size_t size)
 {
 	fr_ring_buffer_t	*rb;
 
-	rb = talloc_zero(ctx, fr_ring_buffer_t);
-	if (!rb) {
-	fail:
+	rb = ring_buffer_alloc(ctx, &size);
+	if (!rb) return NULL;
+
+	rb->buffer = talloc_array(rb, uint8_t, size);
+	if (!rb->buffer) {
+		talloc_free(rb);
 		fr_strerror_printf("Failed allocating memory.");
 		return NULL;
 	}
+	rb->size = size;
 
-	if (size < 1024) size = 1024;
+	return rb;
+}
 
-	if (size > (1 << 30)) {
-		fr_strerror_printf("Ring buffer size must be no more than (1 << 30)");
-		talloc_free(rb);
-		return NULL;
+static int _ring_buffer_free(fr_ring_buffer_t *rb)
+{
+	if (rb->mapped) (void) munmap(rb->buffer, rb->mapped);
+
+	return 0;
+}
+
+/** Create a ring buffer backed by huge pages
+ *
+ *  The buffer is mmap()ed with MAP_HUGETLB.  If no huge pages have
+ *  been reserved, we fall back to normal pages which are aligned to a
+ *  huge page boundary, and ask the kernel to use transparent huge
+ *  pages for them.  If neither works, the buffer is allocated as for
+ *  #fr_ring_buffer_create.
+ *
+ *  Huge pages are 2MB, so the size is rounded up to at least that.
+ *
+ * @param[in] ctx	a talloc context
+ * @param[in] size	of the raw ring buffer array to allocate.
+ * @param[in] prefault	touch all of the memory now, so that we don't
+ *			take page faults when the buffer is first used.
+ * @return
+ *	- A new ring buffer on success.
+ *	- NULL on failure.
+ */
+fr_ring_buffer_t *fr_ring_buffer_create_huge(TALLOC_CTX *ctx, size_t size, bool prefault)
+{
+	fr_ring_buffer_t	*rb;
+#if defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE)
+	uint8_t			*p;
+#endif
+
+	if (size < HUGE_PAGE_SIZE) size = HUGE_PAGE_SIZE;
+
+	rb = ring_buffer_alloc(ctx, &size);
+	if (!rb) return NULL;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB
+#  ifdef MAP_POPULATE
+		 | (prefault ? MAP_POPULATE : 0)
+#  endif
+		 , -1, 0);
+	if (p != MAP_FAILED) {
+		rb->buffer = p;
+		rb->size = rb->mapped = size;
+		talloc_set_destructor(rb, _ring_buffer_free);
+		return rb;
 	}
+#endif
 
+#ifdef MADV_HUGEPAGE
 	/*
-	 *	Round up to the nearest power of 2.
+	 *	Transparent huge pages have to be aligned to the huge
+	 *	page size.  Map a bit more than we need, and trim the
+	 *	ends.
 	 */
-	size--;
-	size |= size >> 1;
-	size |= size >> 2;
-	size |= size >> 4;
-	size |= size >> 8;
-	size |= size >> 16;
-	size++;
+	p = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED) {
+		uint8_t *start;
+		size_t	head, tail;
+
+		start = (uint8_t *) (((uintptr_t) p + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+		head = start - p;
+		tail = HUGE_PAGE_SIZE - head;
+
+		if (head) (void) munmap(p, head);
+		if (tail) (void) munmap(start + size, tail);
+
+		(void) madvise(start, size, MADV_HUGEPAGE);
+
+		rb->buffer = start;
+		rb->size = rb->mapped = size;
+		talloc_set_destructor(rb, _ring_buffer_free);
+
+		if (prefault) {
+			size_t i, page = sysconf(_SC_PAGESIZE);
+
+			for (i = 0; i < size; i += page) rb->buffer[i] = 0;
+		}
+
+		return rb;
+	}
+#endif
 
 	rb->buffer = talloc_array(rb, uint8_t, size);
 	if (!rb->buffer) {
 		talloc_free(rb);
-		goto fail;
+		fr_strerror_printf("Failed allocating memory.");
+		return NULL;
 	}
 	rb->size = size;
 
+	if (prefault) memset(rb->buffer, 0, size);
+
 	return rb;
 }
 
@@ -356,7 +485,7 @@ uint8_t *fr_ring_buffer_reserve_split(fr_ring_buffer_t *dst, size_t reserve_size
 	 *	there's no need to memcpy() the data?
 	 */
 	if ((src == dst) && (p == (src->buffer + src->write_offset))) {
-		return 0;
+		return p;
 	}
 
 	/*
@@ -366,9 +495,10 @@ uint8_t *fr_ring_buffer_reserve_split(fr_ring_buffer_t *dst, size_t reserve_size
 
 	/*
 	 *	We now have no data reserved here.  All bets are
-	 *	off...
+	 *	off...  Unless the new reservation is in the same
+	 *	ring buffer, in which case it's the one we just made.
 	 */
-	src->reserved = 0;
+	if (src != dst) src->reserved = 0;
 
 	return p;
 }
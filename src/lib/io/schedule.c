@@ -36,6 +36,18 @@ RCSID("$Id$")
 
 #include <pthread.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#else
+#define CPU_SETSIZE (1024)
+#endif
+
 /*
  *	Other OS's have sem_init, OS X doesn't.
  */
@@ -64,6 +76,16 @@ RCSID("$Id$")
 
 #define SEM_WAIT_INTR(_x) do {if (sem_wait(_x) == 0) break;} while (errno == EINTR)
 
+/*
+ *	Thresholds for automatic scaling of the worker pool.  Load is
+ *	the fraction of the last interval which the workers spent
+ *	running requests.  Queue is the average number of requests
+ *	each worker is holding.
+ */
+#define SCALE_UP_LOAD		(0.75)
+#define SCALE_UP_QUEUE		(16)
+#define SCALE_DOWN_LOAD		(0.25)
+
 /**
  *  Track the child thread status.
  */
@@ -95,6 +117,9 @@ typedef struct {
 
 	fr_schedule_child_status_t status;	//!< status of the worker
 	fr_worker_t	*worker;		//!< the worker data structure
+
+	bool		retiring;		//!< is being removed from the pool.
+	atomic_bool	exited;			//!< thread has finished, and can be joined.
 } fr_schedule_worker_t;
 
 /** Scheduler specific information for network threads
@@ -144,8 +169,23 @@ struct fr_schedule_s {
 	fr_dlist_head_t	workers;		//!< list of workers
 	fr_dlist_head_t	networks;		//!< list of networks
 
+	fr_worker_group_t *group;		//!< workers which can take requests from each other
+
+	int		*network_cpus;		//!< CPUs which network threads are pinned to
+	unsigned int	num_network_cpus;	//!< number of entries in network_cpus
+	int		*worker_cpus;		//!< CPUs which worker threads are pinned to
+	unsigned int	num_worker_cpus;	//!< number of entries in worker_cpus
+
 	fr_network_t	*single_network;	//!< for single-threaded mode
 	fr_worker_t	*single_worker;		//!< for single-threaded mode
+
+	pthread_mutex_t	mutex;			//!< serialises adding and removing workers.
+	unsigned int	num_workers;		//!< workers which are running, and not being removed.
+	unsigned int	num_permanent;		//!< workers started with the scheduler, which are
+						///< never removed.
+
+	fr_event_timer_t const *ev_scale;	//!< timer for scale_interval.
+	fr_time_t	scale_last;		//!< when we last checked the worker load.
 };
 
 static _Thread_local int worker_id;		//!< Internal ID of the current worker thread.
@@ -159,6 +199,107 @@ int fr_schedule_worker_id(void)
 	return worker_id;
 }
 
+/** Parse a list of CPUs, e.g. "0-3,8,10-11"
+ *
+ * @param[in] ctx	to allocate the array in.
+ * @param[out] out	array of CPU numbers.
+ * @param[in] str	to parse.
+ * @return
+ *	- >0 the number of CPUs in the list.
+ *	- -1 on error.
+ */
+static int schedule_cpus_parse(TALLOC_CTX *ctx, int **out, char const *str)
+{
+	char const	*p = str;
+	int		*cpus = NULL;
+	int		num = 0;
+
+	while (*p) {
+		char		*end;
+		unsigned long	first, last, i;
+
+		first = last = strtoul(p, &end, 10);
+		if (end == p) goto invalid;
+		p = end;
+
+		if (*p == '-') {
+			p++;
+			last = strtoul(p, &end, 10);
+			if ((end == p) || (last < first)) goto invalid;
+			p = end;
+		}
+
+		if (last >= CPU_SETSIZE) {
+			fr_strerror_printf("CPU %lu in \"%s\" is larger than the maximum of %u",
+					   last, str, CPU_SETSIZE - 1);
+			talloc_free(cpus);
+			return -1;
+		}
+
+		MEM(cpus = talloc_realloc(ctx, cpus, int, num + (last - first) + 1));
+		for (i = first; i <= last; i++) cpus[num++] = i;
+
+		if (*p == ',') {
+			p++;
+			continue;
+		}
+		if (*p) goto invalid;
+	}
+
+	if (!num) {
+	invalid:
+		fr_strerror_printf("Invalid CPU list \"%s\"", str);
+		talloc_free(cpus);
+		return -1;
+	}
+
+	*out = cpus;
+	return num;
+}
+
+/** Pin the calling thread to one CPU from a list
+ *
+ * Threads are pinned from inside their entry point, before they
+ * allocate anything.  The kernel places pages on the NUMA node of the
+ * CPU which first touches them, so the event list, message sets, and
+ * channel ring buffers a thread creates end up local to that thread.
+ *
+ * @param[in] sc	the scheduler.
+ * @param[in] name	of the thread, for logging.
+ * @param[in] cpus	to choose from.  May be NULL, in which case the thread isn't pinned.
+ * @param[in] num_cpus	number of entries in cpus.
+ * @param[in] id	of the thread.  Threads are assigned CPUs round-robin.
+ */
+static void schedule_thread_pin(fr_schedule_t *sc, char const *name, int const *cpus, unsigned int num_cpus,
+				unsigned int id)
+{
+	int		cpu;
+
+	if (!cpus) return;
+
+	cpu = cpus[id % num_cpus];
+
+#ifdef __linux__
+	{
+		cpu_set_t	set;
+		int		ret;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret != 0) {
+			WARN("%s - Failed pinning to CPU %d: %s", name, cpu, fr_syserror(ret));
+			return;
+		}
+	}
+
+	DEBUG("%s - Pinned to CPU %d", name, cpu);
+#else
+	WARN("%s - Not pinning to CPU %d, thread affinity is not supported on this platform", name, cpu);
+#endif
+}
+
 /** Entry point for worker threads
  *
  * @param[in] arg	the fr_schedule_worker_t
@@ -177,6 +318,8 @@ static void *fr_schedule_worker_thread(void *arg)
 
 	snprintf(worker_name, sizeof(worker_name), "Worker %d", sw->id);
 
+	schedule_thread_pin(sc, worker_name, sc->worker_cpus, sc->num_worker_cpus, sw->id);
+
 	sw->ctx = ctx = talloc_init("%s", worker_name);
 	if (!ctx) {
 		ERROR("%s - Failed allocating memory", worker_name);
@@ -185,19 +328,30 @@ static void *fr_schedule_worker_thread(void *arg)
 
 	INFO("%s - Starting", worker_name);
 
-	sw->el = fr_event_list_alloc(ctx, NULL, NULL);
+	sw->el = fr_event_list_alloc_wheel(ctx, NULL, NULL, sc->config->timer_resolution);
 	if (!sw->el) {
 		PERROR("%s - Failed creating event list", worker_name);
 		goto fail;
 	}
 
 
-	sw->worker = fr_worker_create(ctx, sw->el, worker_name, sc->log, sc->lvl, NULL);
+	sw->worker = fr_worker_create(ctx, sw->el, worker_name, sc->log, sc->lvl,
+				       &(fr_worker_config_t){
+						.spin_time = sc->config->spin_time,
+						.max_queue_time = sc->config->max_queue_time,
+						.give_up_time = sc->config->give_up_time,
+						.talloc_pool_size = sc->config->talloc_pool_size
+				       });
 	if (!sw->worker) {
 		PERROR("%s - Failed creating worker", worker_name);
 		goto fail;
 	}
 
+	if (sc->group && (fr_worker_group_join(sc->group, sw->worker, sw->id) < 0)) {
+		PERROR("%s - Failed joining worker group", worker_name);
+		goto fail;
+	}
+
 	/*
 	 *	@todo make this a registry
 	 */
@@ -218,8 +372,14 @@ static void *fr_schedule_worker_thread(void *arg)
 
 	sw->status = FR_CHILD_RUNNING;
 
-	sn = fr_dlist_head(&sc->networks);
-	(void) fr_network_worker_add(sn->nr, sw->worker);
+	/*
+	 *	Every network can send requests to every worker.
+	 */
+	for (sn = fr_dlist_head(&sc->networks);
+	     sn != NULL;
+	     sn = fr_dlist_next(&sc->networks, sn)) {
+		(void) fr_network_worker_add(sn->nr, sw->worker);
+	}
 
 	DEBUG3("%s - Started", worker_name);
 
@@ -257,9 +417,11 @@ fail:
 	if (sw->el) fr_event_loop_exit(sw->el, 1);
 
 	/*
-	 *	Tell the scheduler we're done.
+	 *	Tell the scheduler we're done.  Workers which are
+	 *	removed at run-time are reaped without waiting.
 	 */
-	sem_post(&sc->worker_sem);
+	if (!sw->retiring) sem_post(&sc->worker_sem);
+	atomic_store(&sw->exited, true);
 
 	return NULL;
 }
@@ -292,13 +454,15 @@ static void *fr_schedule_network_thread(void *arg)
 
 	INFO("%s - Starting", network_name);
 
+	schedule_thread_pin(sc, network_name, sc->network_cpus, sc->num_network_cpus, sn->id);
+
 	sn->ctx = ctx = talloc_init("%s", network_name);
 	if (!ctx) {
 		ERROR("%s - Failed allocating memory", network_name);
 		goto fail;
 	}
 
-	el = fr_event_list_alloc(ctx, NULL, NULL);
+	el = fr_event_list_alloc_wheel(ctx, NULL, NULL, sc->config->timer_resolution);
 	if (!el) {
 		PERROR("%s - Failed creating event list", network_name);
 		goto fail;
@@ -309,6 +473,7 @@ static void *fr_schedule_network_thread(void *arg)
 		PERROR("%s - Failed creating network", network_name);
 		goto fail;
 	}
+	fr_network_dispatch_set(sn->nr, sc->config->dispatch);
 
 	sn->status = FR_CHILD_RUNNING;
 
@@ -383,6 +548,145 @@ int fr_schedule_pthread_create(pthread_t *thread, void *(*func)(void *), void *a
 	return 0;
 }
 
+/** Allocate the structure for a worker, and start its thread
+ *
+ * The thread signals worker_sem when it has either started, or failed.
+ *
+ * @param[in] sc	the scheduler.
+ * @param[in] id	of the worker.
+ * @return
+ *	- the new worker.
+ *	- NULL on error.
+ */
+static fr_schedule_worker_t *schedule_worker_spawn(fr_schedule_t *sc, unsigned int id)
+{
+	fr_schedule_worker_t *sw;
+
+	sw = talloc_zero(sc, fr_schedule_worker_t);
+	if (!sw) {
+		ERROR("Worker %u - Failed allocating memory", id);
+		return NULL;
+	}
+
+	sw->id = id;
+	sw->sc = sc;
+	sw->status = FR_CHILD_INITIALIZING;
+	atomic_init(&sw->exited, false);
+	fr_dlist_insert_head(&sc->workers, sw);
+
+	if (fr_schedule_pthread_create(&sw->pthread_id, fr_schedule_worker_thread, sw) < 0) {
+		PERROR("Failed creating worker %u", id);
+		fr_dlist_remove(&sc->workers, sw);
+		talloc_free(sw);
+		return NULL;
+	}
+
+	return sw;
+}
+
+/** Join and free a worker thread which has exited
+ *
+ */
+static void schedule_worker_free(fr_schedule_t *sc, fr_schedule_worker_t *sw)
+{
+	fr_dlist_remove(&sc->workers, sw);
+
+	/*
+	 *	Ensure that the thread has exited before
+	 *	cleaning up the context.
+	 *
+	 *	This also ensures that the child threads have
+	 *	exited before the main thread cleans up the
+	 *	module instances.
+	 */
+	if (pthread_join(sw->pthread_id, NULL) != 0) {
+		ERROR("Failed joining worker %i: %s", sw->id, fr_syserror(errno));
+	} else {
+		DEBUG2("Worker %i joined (cleaned up)", sw->id);
+	}
+	talloc_free(sw->ctx);
+	talloc_free(sw);
+}
+
+/** Clean up workers which were removed at run-time, and have since exited
+ *
+ * @note Must be called with sc->mutex held.
+ */
+static void schedule_workers_reap(fr_schedule_t *sc)
+{
+	fr_schedule_worker_t *sw, *next;
+
+	for (sw = fr_dlist_head(&sc->workers); sw != NULL; sw = next) {
+		next = fr_dlist_next(&sc->workers, sw);
+
+		if (!sw->retiring || !atomic_load(&sw->exited)) continue;
+
+		schedule_worker_free(sc, sw);
+	}
+}
+
+static int cmd_show_workers(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_schedule_t const *sc = ctx;
+
+	fprintf(fp, "running\t%u\n", fr_schedule_num_workers(sc));
+	fprintf(fp, "min\t%u\n", sc->num_permanent);
+	fprintf(fp, "max\t%u\n", sc->config->max_workers);
+
+	return 0;
+}
+
+static int cmd_set_workers(FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
+{
+	fr_schedule_t	*sc = ctx;
+	unsigned long	num;
+	char		*end;
+
+	num = strtoul(info->argv[0], &end, 10);
+	if (*end || (num < sc->num_permanent) || (num > sc->config->max_workers)) {
+		fprintf(fp_err, "Number of workers must be between %u and %u\n",
+			sc->num_permanent, sc->config->max_workers);
+		return -1;
+	}
+
+	while (fr_schedule_num_workers(sc) < num) {
+		if (fr_schedule_worker_add(sc) < 0) {
+		error:
+			fprintf(fp_err, "%s\n", fr_strerror());
+			return -1;
+		}
+	}
+
+	while (fr_schedule_num_workers(sc) > num) {
+		if (fr_schedule_worker_remove(sc) < 0) goto error;
+	}
+
+	fprintf(fp, "running\t%u\n", fr_schedule_num_workers(sc));
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_schedule_table[] = {
+	{
+		.parent = "show",
+		.name = "workers",
+		.func = cmd_show_workers,
+		.help = "Show how many worker threads are running.",
+		.read_only = true
+	},
+
+	{
+		.parent = "set",
+		.name = "workers",
+		.syntax = "INTEGER",
+		.func = cmd_set_workers,
+		.help = "Add or remove worker threads, between min_workers and max_workers.",
+		.read_only = false
+	},
+
+	CMD_TABLE_END
+};
+
 /** Create a scheduler and spawn the child threads.
  *
  * @param[in] ctx				talloc context.
@@ -428,6 +732,8 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 	sc->worker_thread_detach = worker_thread_detach;
 	sc->running = true;
 
+	pthread_mutex_init(&sc->mutex, NULL);
+
 	/*
 	 *	If we're single-threaded, create network / worker, and insert them into the event loop.
 	 */
@@ -510,6 +816,69 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		if (sc->config->max_networks > 64) sc->config->max_networks = 64;
 		if (sc->config->max_workers < 1) sc->config->max_workers = 1;
 		if (sc->config->max_workers > 64) sc->config->max_workers = 64;
+		if (sc->config->min_workers > sc->config->max_workers) sc->config->min_workers = sc->config->max_workers;
+	}
+
+	/*
+	 *	Without a minimum, all of the workers are started
+	 *	now, and never removed.
+	 */
+	sc->num_permanent = sc->config->min_workers ? sc->config->min_workers : sc->config->max_workers;
+
+	/*
+	 *	This has to be done before the threads start, as the
+	 *	message sets are created by the threads themselves.
+	 */
+	fr_message_set_huge_pages(sc->config->huge_pages, sc->config->prefault);
+
+	/*
+	 *	Likewise for the event lists.
+	 */
+	if (!fr_event_list_use_io_uring(sc->config->io_uring)) {
+		WARN("io_uring is not supported on this platform, using kqueue");
+	}
+
+	/*
+	 *	The server resyncs the clock once a second, which
+	 *	keeps the TSC calibrated.
+	 */
+	if (sc->config->tsc_clock && !fr_time_use_tsc(true)) {
+		WARN("The CPU does not have an invariant TSC, using clock_gettime()");
+	}
+
+	/*
+	 *	Any coarser, and timers will fire noticeably late.
+	 */
+	if (sc->config->timer_resolution > fr_time_delta_from_sec(1)) {
+		sc->config->timer_resolution = fr_time_delta_from_sec(1);
+	}
+
+	/*
+	 *	Parse the CPU lists.  Network threads and the workers
+	 *	they feed should be given CPUs on the same NUMA node.
+	 */
+	if (sc->config->network_cpus) {
+		int num;
+
+		num = schedule_cpus_parse(sc, &sc->network_cpus, sc->config->network_cpus);
+		if (num < 0) {
+			PERROR("Failed parsing network_cpus");
+			talloc_free(sc);
+			return NULL;
+		}
+		sc->num_network_cpus = num;
+	}
+
+	if (sc->config->worker_cpus) {
+		int num;
+
+		num = schedule_cpus_parse(sc, &sc->worker_cpus, sc->config->worker_cpus);
+		if (num < 0) {
+			PERROR("Failed parsing worker_cpus");
+			talloc_free(sc);
+			return NULL;
+		}
+		sc->num_worker_cpus = num;
 	}
 
 	/*
@@ -592,29 +961,24 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 	}
 
 	/*
-	 *	Create all of the workers.
+	 *	Idle workers can take requests from stuck ones.
 	 */
-	for (i = 0; i < sc->config->max_workers; i++) {
-		DEBUG3("Creating %u/%u workers", i, sc->config->max_workers);
-
-		/*
-		 *	Create a worker "glue" structure
-		 */
-		sw = talloc_zero(sc, fr_schedule_worker_t);
-		if (!sw) {
-			ERROR("Worker %u - Failed allocating memory", i);
-			break;
+	if (sc->config->steal_delay > 0) {
+		sc->group = fr_worker_group_alloc(sc, sc->config->max_workers, sc->config->steal_delay);
+		if (!sc->group) {
+			PERROR("Failed creating worker group");
+			fr_schedule_destroy(&sc);
+			return NULL;
 		}
+	}
 
-		sw->id = i;
-		sw->sc = sc;
-		sw->status = FR_CHILD_INITIALIZING;
-		fr_dlist_insert_head(&sc->workers, sw);
+	/*
+	 *	Create the initial workers.
+	 */
+	for (i = 0; i < sc->num_permanent; i++) {
+		DEBUG3("Creating %u/%u workers", i, sc->num_permanent);
 
-		if (fr_schedule_pthread_create(&sw->pthread_id, fr_schedule_worker_thread, sw) < 0) {
-			PERROR("Failed creating worker %u", i);
-			break;
-		}
+		if (!schedule_worker_spawn(sc, i)) break;
 	}
 
 	/*
@@ -646,10 +1010,11 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 	/*
 	 *	Failed to start some workers, refuse to do anything!
 	 */
-	if ((unsigned int)fr_dlist_num_elements(&sc->workers) < sc->config->max_workers) {
+	if ((unsigned int)fr_dlist_num_elements(&sc->workers) < sc->num_permanent) {
 		fr_schedule_destroy(&sc);
 		return NULL;
 	}
+	sc->num_workers = sc->num_permanent;
 
 	for (sw = fr_dlist_head(&sc->workers), i = 0;
 	     sw != NULL;
@@ -679,6 +1044,11 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		}
 	}
 
+	if (fr_command_register_hook(NULL, NULL, sc, cmd_schedule_table) < 0) {
+		PERROR("Failed adding scheduler commands");
+		goto st_fail;
+	}
+
 	if (sc) INFO("Scheduler created successfully with %u networks and %u workers",
 		     sc->config->max_networks, (unsigned int)fr_dlist_num_elements(&sc->workers));
 
@@ -701,7 +1071,14 @@ int fr_schedule_destroy(fr_schedule_t **sc_to_free)
 
 	if (!sc) return 0;
 
+	/*
+	 *	Wait for any worker which is being added or removed.
+	 */
+	pthread_mutex_lock(&sc->mutex);
 	sc->running = false;
+	pthread_mutex_unlock(&sc->mutex);
+
+	if (sc->ev_scale) fr_event_timer_delete(&sc->ev_scale);
 
 	/*
 	 *	Single threaded mode: kill the only network / worker we have.
@@ -764,39 +1141,34 @@ int fr_schedule_destroy(fr_schedule_t **sc_to_free)
 	 *	Wait for all worker threads to finish.  THEN clean up
 	 *	modules.  Otherwise, the modules will be removed from
 	 *	underneath the workers!
+	 *
+	 *	Workers which were being removed don't signal the
+	 *	semaphore.  pthread_join() below waits for them.
 	 */
-	for (i = 0; i < (unsigned int)fr_dlist_num_elements(&sc->workers); i++) {
-		DEBUG2("Scheduler - Waiting for semaphore indicating worker exit %u/%u", i,
-		       (unsigned int)fr_dlist_num_elements(&sc->workers));
-		SEM_WAIT_INTR(&sc->worker_sem);
+	{
+		unsigned int num = 0;
+
+		for (sw = fr_dlist_head(&sc->workers); sw != NULL; sw = fr_dlist_next(&sc->workers, sw)) {
+			if (!sw->retiring) num++;
+		}
+
+		for (i = 0; i < num; i++) {
+			DEBUG2("Scheduler - Waiting for semaphore indicating worker exit %u/%u", i, num);
+			SEM_WAIT_INTR(&sc->worker_sem);
+		}
 	}
 	DEBUG2("Scheduler - All workers indicated exit complete");
 
 	/*
 	 *	Clean up the exited workers.
 	 */
-	while ((sw = fr_dlist_head(&sc->workers)) != NULL) {
-		fr_dlist_remove(&sc->workers, sw);
-
-		/*
-		 *	Ensure that the thread has exited before
-		 *	cleaning up the context.
-		 *
-		 *	This also ensures that the child threads have
-		 *	exited before the main thread cleans up the
-		 *	module instances.
-		 */
-		if (pthread_join(sw->pthread_id, NULL) != 0) {
-			ERROR("Failed joining worker %i: %s", sw->id, fr_syserror(errno));
-		} else {
-			DEBUG2("Worker %i joined (cleaned up)", sw->id);
-		}
-		talloc_free(sw->ctx);
-	}
+	while ((sw = fr_dlist_head(&sc->workers)) != NULL) schedule_worker_free(sc, sw);
 
 	sem_destroy(&sc->network_sem);
 	sem_destroy(&sc->worker_sem);
 done:
+	pthread_mutex_destroy(&sc->mutex);
+
 	/*
 	 *	Now that all of the workers are done, we can return to
 	 *	the caller, and have it dlclose() the modules.
@@ -807,6 +1179,18 @@ done:
 	return 0;
 }
 
+/** Return the number of network threads in a scheduler
+ *
+ * @param[in] sc the scheduler
+ * @return the number of networks which listeners can be added to.
+ */
+uint32_t fr_schedule_num_networks(fr_schedule_t const *sc)
+{
+	if (sc->el) return 1;
+
+	return fr_dlist_num_elements(&sc->networks);
+}
+
 /** Add a fr_listen_t to a scheduler.
  *
  * @param[in] sc the scheduler
@@ -839,6 +1223,44 @@ fr_network_t *fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li)
 	return nr;
 }
 
+/** Add one shard of a sharded fr_listen_t to a scheduler.
+ *
+ * Each shard of a listener is placed on a different network
+ * thread, so that the shards can be serviced in parallel.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] li the ctx and callbacks for the transport.
+ * @param[in] shard the shard number, from 0 to fr_schedule_num_networks() - 1.
+ * @return
+ *	- NULL on error
+ *	- the fr_network_t that the socket was added to.
+ */
+fr_network_t *fr_schedule_listen_add_shard(fr_schedule_t *sc, fr_listen_t *li, uint32_t shard)
+{
+	fr_network_t *nr;
+
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) {
+		nr = sc->single_network;
+	} else {
+		fr_schedule_network_t *sn = NULL;
+
+		shard %= fr_dlist_num_elements(&sc->networks);
+
+		while ((sn = fr_dlist_next(&sc->networks, sn)) != NULL) {
+			if (sn->id == shard) break;
+		}
+		if (!sn) sn = fr_dlist_head(&sc->networks);
+
+		nr = sn->nr;
+	}
+
+	if (fr_network_listen_add(nr, li) < 0) return NULL;
+
+	return nr;
+}
+
 /** Add a directory NOTE_EXTEND to a scheduler.
  *
  * @param[in] sc the scheduler
@@ -870,3 +1292,218 @@ fr_network_t *fr_schedule_directory_add(fr_schedule_t *sc, fr_listen_t *li)
 
 	return nr;
 }
+
+/** Return the number of worker threads which are processing requests
+ *
+ * @param[in] sc the scheduler
+ * @return the number of workers, not including ones which are being removed.
+ */
+uint32_t fr_schedule_num_workers(fr_schedule_t const *sc)
+{
+	if (sc->el) return 1;
+
+	return sc->num_workers;
+}
+
+/** Start a new worker thread, and add it to all of the networks
+ *
+ * @param[in] sc the scheduler
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_schedule_worker_add(fr_schedule_t *sc)
+{
+	fr_schedule_worker_t	*sw;
+	unsigned int		id;
+
+	if (sc->el) {
+		fr_strerror_printf("Workers can't be added in single-threaded mode");
+		return -1;
+	}
+
+	pthread_mutex_lock(&sc->mutex);
+	if (!sc->running) {
+		fr_strerror_printf("The scheduler is exiting");
+	fail:
+		pthread_mutex_unlock(&sc->mutex);
+		return -1;
+	}
+
+	schedule_workers_reap(sc);
+
+	if (sc->num_workers >= sc->config->max_workers) {
+		fr_strerror_printf("Already running the maximum of %u workers", sc->config->max_workers);
+		goto fail;
+	}
+
+	/*
+	 *	Use the lowest free ID.  Workers which are being
+	 *	removed still own their ID, as it's their slot in the
+	 *	worker group, and their CPU.
+	 */
+	for (id = 0; id < sc->config->max_workers; id++) {
+		for (sw = fr_dlist_head(&sc->workers); sw != NULL; sw = fr_dlist_next(&sc->workers, sw)) {
+			if (sw->id == id) break;
+		}
+		if (!sw) break;
+	}
+	if (id == sc->config->max_workers) {
+		fr_strerror_printf("All worker IDs are in use, wait for removed workers to exit");
+		goto fail;
+	}
+
+	sw = schedule_worker_spawn(sc, id);
+	if (!sw) goto fail;
+
+	/*
+	 *	The mutex ensures that this is the only worker
+	 *	which is starting.
+	 */
+	SEM_WAIT_INTR(&sc->worker_sem);
+
+	if (sw->status != FR_CHILD_RUNNING) {
+		schedule_worker_free(sc, sw);
+		fr_strerror_printf("Failed starting worker %u", id);
+		goto fail;
+	}
+
+	sc->num_workers++;
+	pthread_mutex_unlock(&sc->mutex);
+
+	INFO("Scheduler - Added worker %u, now running %u workers", id, sc->num_workers);
+
+	return 0;
+}
+
+/** Remove a worker which was added with #fr_schedule_worker_add
+ *
+ * The worker stops receiving new requests immediately.  It exits,
+ * and is cleaned up, once it has replied to all of its outstanding
+ * requests.
+ *
+ * @param[in] sc the scheduler
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_schedule_worker_remove(fr_schedule_t *sc)
+{
+	fr_schedule_worker_t	*sw, *found = NULL;
+	fr_schedule_network_t	*sn;
+
+	if (sc->el) {
+		fr_strerror_printf("Workers can't be removed in single-threaded mode");
+		return -1;
+	}
+
+	pthread_mutex_lock(&sc->mutex);
+	if (!sc->running) {
+		fr_strerror_printf("The scheduler is exiting");
+	fail:
+		pthread_mutex_unlock(&sc->mutex);
+		return -1;
+	}
+
+	schedule_workers_reap(sc);
+
+	/*
+	 *	Remove the most recently added worker.
+	 */
+	for (sw = fr_dlist_head(&sc->workers); sw != NULL; sw = fr_dlist_next(&sc->workers, sw)) {
+		if (sw->retiring || (sw->status != FR_CHILD_RUNNING) || (sw->id < sc->num_permanent)) continue;
+
+		if (!found || (sw->id > found->id)) found = sw;
+	}
+	if (!found) {
+		fr_strerror_printf("Only the %u workers started with the server are running", sc->num_permanent);
+		goto fail;
+	}
+
+	found->retiring = true;
+	sc->num_workers--;
+
+	for (sn = fr_dlist_head(&sc->networks); sn != NULL; sn = fr_dlist_next(&sc->networks, sn)) {
+		(void) fr_network_worker_remove(sn->nr, found->worker);
+	}
+	pthread_mutex_unlock(&sc->mutex);
+
+	INFO("Scheduler - Removing worker %u, now running %u workers", found->id, sc->num_workers);
+
+	return 0;
+}
+
+/** Add or remove workers, depending on how busy they are
+ *
+ */
+static void schedule_scale_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_schedule_t		*sc = talloc_get_type_abort(uctx, fr_schedule_t);
+	fr_schedule_worker_t	*sw;
+	unsigned int		num = 0;
+	uint64_t		active = 0;
+	fr_time_delta_t		cpu = 0, elapsed;
+
+	pthread_mutex_lock(&sc->mutex);
+	schedule_workers_reap(sc);
+
+	for (sw = fr_dlist_head(&sc->workers); sw != NULL; sw = fr_dlist_next(&sc->workers, sw)) {
+		uint64_t stats[8];
+
+		if (sw->retiring || (sw->status != FR_CHILD_RUNNING)) continue;
+
+		if (fr_worker_stats(sw->worker, 8, stats) < 8) continue;
+
+		active += stats[5];
+		cpu += (fr_time_t) stats[7] - sw->cpu_time;
+		sw->cpu_time = (fr_time_t) stats[7];
+		num++;
+	}
+	pthread_mutex_unlock(&sc->mutex);
+
+	elapsed = now - sc->scale_last;
+	sc->scale_last = now;
+
+	if (num && (elapsed > 0)) {
+		double load = (double) cpu / ((double) elapsed * num);
+
+		DEBUG3("Scheduler - %u workers, load %.2f, %" PRIu64 " active requests", num, load, active);
+
+		if (((load > SCALE_UP_LOAD) || ((active / num) >= SCALE_UP_QUEUE)) &&
+		    (num < sc->config->max_workers)) {
+			if (fr_schedule_worker_add(sc) < 0) PWARN("Scheduler - Failed adding worker");
+
+		} else if ((load < SCALE_DOWN_LOAD) && (active < num) && (num > sc->num_permanent)) {
+			if (fr_schedule_worker_remove(sc) < 0) PWARN("Scheduler - Failed removing worker");
+		}
+	}
+
+	if (fr_event_timer_at(sc, el, &sc->ev_scale, now + sc->config->scale_interval,
+			      schedule_scale_timer, sc) < 0) {
+		PERROR("Scheduler - Failed re-inserting scaling timer, workers will no longer be scaled");
+	}
+}
+
+/** Start scaling the worker pool automatically
+ *
+ * Does nothing unless min_workers is set, and is less than max_workers.
+ *
+ * @param[in] sc	the scheduler
+ * @param[in] el	to run the scaling timer in, usually the main event loop.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_schedule_scale_start(fr_schedule_t *sc, fr_event_list_t *el)
+{
+	if (sc->el || !sc->config->scale_interval || (sc->num_permanent >= sc->config->max_workers)) return 0;
+
+	sc->scale_last = fr_time();
+
+	if (fr_event_timer_in(sc, el, &sc->ev_scale, sc->config->scale_interval, schedule_scale_timer, sc) < 0) {
+		fr_strerror_printf_push("Failed inserting scaling timer");
+		return -1;
+	}
+
+	return 0;
+}
@@ -62,7 +62,30 @@ typedef void (*fr_schedule_thread_detach_t)(void *uctx);
 
 typedef struct {
 	uint32_t	max_networks;		//!< number of network threads
-	uint32_t	max_workers;		//!< number of network threads
+	uint32_t	max_workers;		//!< number of worker threads
+	uint32_t	min_workers;		//!< start this many workers, and add more up to
+						///< max_workers under load.  0 disables scaling.
+	fr_time_delta_t	scale_interval;		//!< how often to check if workers should be added or removed.
+
+	fr_network_dispatch_t dispatch;		//!< how networks pick a worker for each request
+	fr_time_delta_t	steal_delay;		//!< idle workers take requests from workers which
+						///< have been stuck for this long.  0 disables.
+	fr_time_delta_t	spin_time;		//!< idle workers poll their channels for this long
+						///< before sleeping.  0 disables.
+	fr_time_delta_t	max_queue_time;		//!< workers discard requests which have waited
+						///< this long without being decoded.  0 disables.
+	fr_time_delta_t	give_up_time;		//!< workers stop requests which the client hasn't
+						///< retransmitted for this long.  0 disables.
+	size_t		talloc_pool_size;	//!< memory each request reserves for its own data.
+
+	bool		huge_pages;		//!< back message sets with huge pages.
+	bool		prefault;		//!< touch message set memory when it's allocated.
+	bool		io_uring;		//!< poll sockets with io_uring instead of kqueue.
+	bool		tsc_clock;		//!< read the time from the TSC instead of clock_gettime().
+	fr_time_delta_t	timer_resolution;	//!< use timer wheels with this resolution, 0 for heaps.
+
+	char const	*network_cpus;		//!< CPUs to pin network threads to, e.g. "0-3,8".
+	char const	*worker_cpus;		//!< CPUs to pin worker threads to.
 
 	fr_time_delta_t	stats_interval;		//!< print channel statistics
 } fr_schedule_config_t;
@@ -77,8 +100,15 @@ fr_schedule_t		*fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_
 /* schedulers are async, so there's no fr_schedule_run() */
 int			fr_schedule_destroy(fr_schedule_t **sc);
 
+uint32_t		fr_schedule_num_networks(fr_schedule_t const *sc) CC_HINT(nonnull);
 fr_network_t		*fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
+fr_network_t		*fr_schedule_listen_add_shard(fr_schedule_t *sc, fr_listen_t *li, uint32_t shard) CC_HINT(nonnull);
 fr_network_t		*fr_schedule_directory_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
+
+int			fr_schedule_scale_start(fr_schedule_t *sc, fr_event_list_t *el) CC_HINT(nonnull);
+uint32_t		fr_schedule_num_workers(fr_schedule_t const *sc) CC_HINT(nonnull);
+int			fr_schedule_worker_add(fr_schedule_t *sc) CC_HINT(nonnull);
+int			fr_schedule_worker_remove(fr_schedule_t *sc) CC_HINT(nonnull);
 #ifdef __cplusplus
 }
 #endif
@@ -59,8 +59,12 @@ RCSID("$Id$")
 #include <freeradius-devel/io/channel.h>
 #include <freeradius-devel/io/message.h>
 #include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/server/trace.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/syserror.h>
 
 #ifdef WITH_VERIFY_PTR
 static void worker_verify(fr_worker_t *worker);
@@ -71,6 +75,56 @@ static void worker_verify(fr_worker_t *worker);
 
 static _Thread_local fr_worker_t *thread_local_worker;
 
+/** Maximum number of requests an idle worker takes from its siblings at once
+ *
+ */
+#define STEAL_BATCH (16)
+
+#define POOL_CLASSES		(16)		//!< Distinct listener / virtual server pairs we size pools for.
+#define POOL_BUCKET_SIZE	(1024)		//!< Granularity of the pool size histogram.
+#define POOL_BUCKETS		(64)		//!< Largest pool is POOL_BUCKETS * POOL_BUCKET_SIZE.
+#define POOL_PERCENTILE		(95)		//!< Size pools so this many requests in 100 fit.
+#define POOL_RESIZE_SAMPLES	(64)		//!< Re-estimate the pool size this often.
+#define POOL_DECAY_SAMPLES	(4096)		//!< Halve the histogram this often, so old traffic ages out.
+
+/** Pool sizing for one class of requests
+ *
+ * A class is the requests from listeners of one application (protocol),
+ * for one virtual server.  Each finished request records how much memory
+ * it used, and new requests of the class get a pool big enough for
+ * POOL_PERCENTILE of them.
+ */
+typedef struct {
+	fr_app_t const		*app;		//!< Protocol of the listener.
+	CONF_SECTION const	*server_cs;	//!< Virtual server of the listener.
+
+	size_t			pool_size;	//!< For new requests in this class.
+
+	uint64_t		requests;	//!< Number of requests measured.
+	uint64_t		overflowed;	//!< Number which used more than their pool.
+	size_t			peak;		//!< Most memory used by one request.
+
+	uint32_t		samples;	//!< Since pool_size was last estimated.
+	uint32_t		total;		//!< Sum of the histogram.
+	uint32_t		histogram[POOL_BUCKETS];	//!< Decaying counts of memory used.
+} worker_pool_class_t;
+
+/**
+ *  Workers which may take requests from each other.
+ */
+struct fr_worker_group_s {
+	pthread_rwlock_t	lock;		//!< held for writing when a member changes its channels
+	fr_time_delta_t		steal_delay;	//!< how long a worker must be stuck before we take its requests
+	unsigned int		max_workers;	//!< size of the workers array
+	fr_worker_t		**workers;	//!< members of the group
+};
+
+static int _worker_group_free(fr_worker_group_t *group)
+{
+	pthread_rwlock_destroy(&group->lock);
+	return 0;
+}
+
 /**
  *  A worker which takes packets from a master, and processes them.
  */
@@ -95,14 +149,22 @@ struct fr_worker_s {
 
 	fr_heap_t      		*runnable;	//!< current runnable requests which we've spent time processing
 	fr_heap_t		*time_order;	//!< time ordered heap of requests
-	rbtree_t		*dedup;		//!< de-dup tree
+	fr_dlist_head_t		seen_order;	//!< requests from clients which retransmit, ordered
+						///< by when the client last sent a copy.
+	REQUEST			**dedup;	//!< de-dup hash buckets
+	uint32_t		dedup_mask;	//!< number of buckets - 1
 
 	fr_io_stats_t		stats;		//!< input / output stats
+	request_alloc_stats_t	alloc_stats;	//!< request allocations done by this thread
+	worker_pool_class_t	pool_class[POOL_CLASSES];	//!< per-class request pool sizing
+	unsigned int		num_pool_classes;	//!< number of pool_class entries in use
 	fr_time_elapsed_t	cpu_time;	//!< histogram of total CPU time per request
 	fr_time_elapsed_t	wall_clock;	//!< histogram of wall clock time per request
 
 	uint64_t    		num_naks;	//!< number of messages which were nak'd
 	uint64_t    		num_active;	//!< number of active requests
+	uint64_t		num_stale;	//!< number of requests discarded by max_queue_time
+	uint64_t		num_abandoned;	//!< number of requests stopped by give_up_time
 
 	fr_time_delta_t		predicted;	//!< How long we predict a request will take to execute.
 	fr_time_tracking_t	tracking;	//!< how much time the worker has spent doing things.
@@ -115,9 +177,152 @@ struct fr_worker_s {
 	fr_event_timer_t const	*ev_cleanup;	//!< timer for max_request_time
 
 	fr_channel_t		**channel;	//!< list of channels
+
+	fr_worker_group_t	*group;		//!< workers we can take requests from
+	unsigned int		group_id;	//!< our entry in the group
+	fr_event_timer_t const	*ev_steal;	//!< timer to check for stuck siblings
+	atomic_int64_t		heartbeat;	//!< when we last went around the main loop, from
+						///< fr_time_coarse(), or zero if we're asleep waiting
+						///< for events.
+	uint64_t		num_stolen;	//!< number of requests we took from other workers
 };
 
-static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now);
+static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
+				     fr_channel_t *stolen_from, fr_time_t now);
+
+/** Find the pool sizing for requests from a listener
+ *
+ * There are only ever a handful of classes, so a linear search is
+ * fine.  Past POOL_CLASSES, requests use the configured size.
+ */
+static worker_pool_class_t *worker_pool_class(fr_worker_t *worker, fr_listen_t const *listen)
+{
+	worker_pool_class_t	*pc;
+	unsigned int		i;
+
+	for (i = 0; i < worker->num_pool_classes; i++) {
+		pc = &worker->pool_class[i];
+		if ((pc->app == listen->app) && (pc->server_cs == listen->server_cs)) return pc;
+	}
+
+	if (!listen->app || (worker->num_pool_classes == POOL_CLASSES)) return NULL;
+
+	pc = &worker->pool_class[worker->num_pool_classes++];
+	pc->app = listen->app;
+	pc->server_cs = listen->server_cs;
+	pc->pool_size = worker->config.talloc_pool_size;
+
+	return pc;
+}
+
+/** Record how much memory a finished request used, and re-estimate the pool size for its class
+ *
+ */
+static void worker_pool_sample(fr_worker_t *worker, REQUEST *request)
+{
+	worker_pool_class_t	*pc;
+	size_t			used;
+	uint32_t		want, sum;
+	unsigned int		i;
+
+	if (!request->async->listen) return;
+
+	pc = worker_pool_class(worker, request->async->listen);
+	if (!pc) return;
+
+	used = request_alloc_pool_used(request);
+
+	pc->requests++;
+	if (used > request->pool_size) pc->overflowed++;
+	if (used > pc->peak) pc->peak = used;
+
+	i = used / POOL_BUCKET_SIZE;
+	if (i >= POOL_BUCKETS) i = POOL_BUCKETS - 1;
+	pc->histogram[i]++;
+	pc->total++;
+
+	if (pc->total >= POOL_DECAY_SAMPLES) {
+		pc->total = 0;
+		for (i = 0; i < POOL_BUCKETS; i++) {
+			pc->histogram[i] /= 2;
+			pc->total += pc->histogram[i];
+		}
+	}
+
+	if (++pc->samples < POOL_RESIZE_SAMPLES) return;
+	pc->samples = 0;
+
+	/*
+	 *	Find the smallest bucket which holds the
+	 *	percentile, and size the pool to its top.
+	 */
+	want = ((uint64_t) pc->total * POOL_PERCENTILE + 99) / 100;
+	for (i = 0, sum = 0; i < (POOL_BUCKETS - 1); i++) {
+		sum += pc->histogram[i];
+		if (sum >= want) break;
+	}
+
+	pc->pool_size = (size_t) (i + 1) * POOL_BUCKET_SIZE;
+}
+
+/** Find the "dedup" bucket for a REQUEST
+ *
+ * Requests are keyed on the listener and the packet identity, and are
+ * chained through request->async->dedup_next, so tracking them
+ * doesn't allocate.
+ */
+static inline REQUEST **worker_dedup_bucket(fr_worker_t *worker, REQUEST const *request)
+{
+	uint32_t hash;
+
+	hash = fr_hash(&request->async->listen, sizeof(request->async->listen));
+	hash = fr_hash_update(&request->async->packet_ctx, sizeof(request->async->packet_ctx), hash);
+
+	return &worker->dedup[hash & worker->dedup_mask];
+}
+
+/** Find a tracked REQUEST with the same listener and packet identity
+ *
+ */
+static REQUEST *worker_dedup_find(fr_worker_t *worker, REQUEST const *request)
+{
+	REQUEST *old;
+
+	for (old = *worker_dedup_bucket(worker, request); old; old = old->async->dedup_next) {
+		if ((old->async->listen == request->async->listen) &&
+		    (old->async->packet_ctx == request->async->packet_ctx)) return old;
+	}
+
+	return NULL;
+}
+
+/** Track a REQUEST in the "dedup" hash
+ *
+ */
+static void worker_dedup_insert(fr_worker_t *worker, REQUEST *request)
+{
+	REQUEST **bucket = worker_dedup_bucket(worker, request);
+
+	request->async->dedup_next = *bucket;
+	*bucket = request;
+}
+
+/** Stop tracking a REQUEST in the "dedup" hash
+ *
+ * It's fine to call this for requests which aren't being tracked.
+ */
+static void worker_dedup_remove(fr_worker_t *worker, REQUEST *request)
+{
+	REQUEST **last;
+
+	for (last = worker_dedup_bucket(worker, request); *last; last = &(*last)->async->dedup_next) {
+		if (*last != request) continue;
+
+		*last = request->async->dedup_next;
+		request->async->dedup_next = NULL;
+		return;
+	}
+}
 
 /** Callback which handles a message being received on the worker side.
  *
@@ -132,7 +337,7 @@ static void worker_recv_request(void *ctx, fr_channel_t *ch, fr_channel_data_t *
 	worker->stats.in++;
 	DEBUG3("Received request %" PRIu64 "", worker->stats.in);
 	cd->channel.ch = ch;
-	worker_request_bootstrap(worker, cd, fr_time());
+	worker_request_bootstrap(worker, cd, NULL, fr_time());
 }
 
 static void worker_exit(fr_worker_t *worker)
@@ -202,6 +407,8 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 	case FR_CHANNEL_OPEN:
 		fr_assert(ch != NULL);
 
+		if (worker->group) pthread_rwlock_wrlock(&worker->group->lock);
+
 		ok = false;
 		for (i = 0; i < worker->config.max_channels; i++) {
 			fr_assert(worker->channel[i] != ch);
@@ -216,12 +423,15 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 						   worker->config.ring_buffer_size);
 			fr_assert(ms != NULL);
 			fr_channel_responder_uctx_add(ch, ms);
+			fr_channel_responder_ms_stats_add(ch, fr_message_set_stats(ms));
 
 			worker->num_channels++;
 			ok = true;
 			break;
 		}
 
+		if (worker->group) pthread_rwlock_unlock(&worker->group->lock);
+
 		fr_cond_assert(ok);
 		break;
 
@@ -230,6 +440,12 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 
 		ok = false;
 
+		/*
+		 *	Other workers may be looking at our channels.
+		 *	Wait for them to finish before we close it.
+		 */
+		if (worker->group) pthread_rwlock_wrlock(&worker->group->lock);
+
 		/*
 		 *	Locate the signalling channel in the list
 		 *	of channels.
@@ -241,6 +457,7 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 
 			ms = fr_channel_responder_uctx_get(ch);
 
+			fr_channel_responder_ms_stats_add(ch, NULL);
 			fr_channel_responder_ack_close(ch);
 			fr_assert(ms != NULL);
 			fr_message_set_gc(ms);
@@ -253,6 +470,8 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 			break;
 		}
 
+		if (worker->group) pthread_rwlock_unlock(&worker->group->lock);
+
 		fr_cond_assert(ok);
 
 		/*
@@ -271,11 +490,12 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
  * We typically NAK requests when they've been hanging around in the worker's backlog too long,
  * or there was an error executing the request.
  *
- * @param[in] worker	the worker
- * @param[in] cd	the message to NAK
- * @param[in] now	when the message is NAKd
+ * @param[in] worker		the worker
+ * @param[in] cd		the message to NAK
+ * @param[in] stolen_from	the channel the message was taken from, if any.
+ * @param[in] now		when the message is NAKd
  */
-static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now)
+static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_channel_t *stolen_from, fr_time_t now)
 {
 	size_t			size;
 	fr_channel_data_t	*reply;
@@ -334,6 +554,7 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 	reply->reply.cpu_time = worker->tracking.running_total;
 	reply->reply.processing_time = 10; /* @todo - set to something better? */
 	reply->reply.request_time = cd->request.recv_time;
+	reply->reply.stolen_from = stolen_from;
 
 	reply->listen = cd->listen;
 	reply->packet_ctx = cd->packet_ctx;
@@ -353,6 +574,52 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 	worker->stats.out++;
 }
 
+/** Tell the network side that we've discarded a request
+ *
+ * The network thread counts a request as outstanding until it sees a
+ * reply for it.  When we drop a request without running it, we send
+ * an empty reply, which the network thread doesn't write to the
+ * socket.
+ *
+ * @param[in] worker		the worker
+ * @param[in] request		which is being discarded.  The caller frees it.
+ * @param[in] now		the current time
+ */
+static void worker_send_done(fr_worker_t *worker, REQUEST *request, fr_time_t now)
+{
+	fr_channel_data_t	*reply;
+	fr_channel_t		*ch;
+	fr_message_set_t	*ms;
+
+	ch = request->async->channel;
+	fr_assert(ch != NULL);
+
+	if (!fr_cond_assert_msg(fr_channel_active(ch), "Wanted to send reply but channel has been closed")) {
+		return;
+	}
+
+	ms = fr_channel_responder_uctx_get(ch);
+	fr_assert(ms != NULL);
+
+	reply = (fr_channel_data_t *) fr_message_reserve(ms, 0);
+	fr_assert(reply != NULL);
+
+	reply->m.when = now;
+	reply->reply.cpu_time = worker->tracking.running_total;
+	reply->reply.processing_time = 0;
+	reply->reply.request_time = request->async->recv_time;
+	reply->reply.stolen_from = request->async->stolen_from;
+
+	reply->listen = request->async->listen;
+	reply->packet_ctx = request->async->packet_ctx;
+
+	if (fr_channel_send_reply(ch, reply) < 0) {
+		DEBUG2("Failed sending reply to channel");
+	}
+
+	worker->stats.out++;
+}
+
 static void worker_max_request_timer(fr_worker_t *worker);
 
 
@@ -453,6 +720,7 @@ static void worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t size
 	reply->reply.cpu_time = worker->tracking.running_total;
 	reply->reply.processing_time = request->async->tracking.running_total;
 	reply->reply.request_time = request->async->recv_time;
+	reply->reply.stolen_from = request->async->stolen_from;
 
 	reply->listen = request->async->listen;
 	reply->packet_ctx = request->async->packet_ctx;
@@ -486,8 +754,13 @@ static void worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t size
 	 *	and insert it back into a slab allocator.
 	 */
 finished:
+	if (unlikely(request->traced)) fr_trace_request_done(request, now);
+
+	worker_pool_sample(worker, request);
+
 	if (request->time_order_id >= 0) (void) fr_heap_extract(worker->time_order, request);
 	if (request->runnable_id >= 0) (void) fr_heap_extract(worker->runnable, request);
+	(void) fr_dlist_remove(&worker->seen_order, request);
 
 	fr_assert(request->time_order_id < 0);
 	fr_assert(request->runnable_id < 0);
@@ -539,18 +812,20 @@ static void worker_stop_request(fr_worker_t *worker, REQUEST *request, fr_time_t
 	 */
 	if (request->time_order_id >= 0) (void) fr_heap_extract(worker->time_order, request);
 	if (request->runnable_id >= 0) (void) fr_heap_extract(worker->runnable, request);
-	if (request->async->listen && request->async->listen->track_duplicates) rbtree_deletebydata(worker->dedup, request);
+	(void) fr_dlist_remove(&worker->seen_order, request);
+	if (request->async->listen && request->async->listen->track_duplicates) worker_dedup_remove(worker, request);
 
 #ifndef NDEBUG
 	request->async->process = NULL;
 #endif
 }
 
-/** Enforce max_request_time
+/** Enforce max_request_time and give_up_time
  *
  * Run periodically, and tries to clean up requests which were received by the network
- * thread more than max_request_time seconds ago.  In the interest of not adding a
- * timer for every packet, the requests are given a 1 second leeway.
+ * thread more than max_request_time seconds ago, or which the client has stopped
+ * retransmitting.  In the interest of not adding a timer for every packet, the
+ * requests are given a 1 second leeway.
  *
  * @param[in] el	the worker's event list
  * @param[in] when	the current time
@@ -589,6 +864,23 @@ static void worker_max_request_time(UNUSED fr_event_list_t *el, UNUSED fr_time_t
 		worker_send_reply(worker, request, 1, now);
 	}
 
+	/*
+	 *	The client has stopped retransmitting, so it's no
+	 *	longer waiting for a reply.  Stop the request, so that
+	 *	whatever it has outstanding on trunks is cancelled.
+	 */
+	while ((request = fr_dlist_head(&worker->seen_order)) != NULL) {
+		REQUEST_VERIFY(request);
+
+		if ((request->async->last_seen + worker->config.give_up_time) > now) break;
+
+		REDEBUG("Client has stopped retransmitting - signalling request to stop");
+		worker_stop_request(worker, request, now);
+		worker->num_abandoned++;
+
+		worker_send_reply(worker, request, 1, now);
+	}
+
 	/*
 	 *	Reset the max request timer.
 	 */
@@ -614,6 +906,11 @@ static void worker_max_request_timer(fr_worker_t *worker)
 	cleanup = request->async->recv_time;
 	cleanup += worker->config.max_request_time;
 
+	request = fr_dlist_head(&worker->seen_order);
+	if (request && ((request->async->last_seen + worker->config.give_up_time) < cleanup)) {
+		cleanup = request->async->last_seen + worker->config.give_up_time;
+	}
+
 	DEBUG2("Resetting cleanup timer to +%pV", fr_box_time_delta(worker->config.max_request_time));
 	if (fr_event_timer_at(worker, worker->el, &worker->ev_cleanup,
 			      cleanup, worker_max_request_time, worker) < 0) {
@@ -659,6 +956,7 @@ static void worker_request_init(fr_worker_t *worker, REQUEST *request, fr_time_t
 
 	request->number = worker->number++;
 	request->name = itoa_internal(request, request->number);
+	request->traced = fr_trace_sample();
 
 	request->async = talloc_zero(request, fr_async_t);
 	request->async->recv_time = now;
@@ -689,10 +987,27 @@ static void worker_request_time_tracking_start(fr_worker_t *worker, REQUEST *req
 	fr_assert(request->runnable_id < 0);
 	(void) fr_heap_insert(worker->runnable, request);
 
+	/*
+	 *	Only clients which retransmit can tell us that
+	 *	they've given up.  New requests go at the tail, as
+	 *	they were seen most recently.  If this is the only
+	 *	one, it may need the timer to fire sooner.
+	 */
+	if (worker->config.give_up_time && request->async->listen && request->async->listen->track_duplicates) {
+		request->async->last_seen = now;
+		fr_dlist_insert_tail(&worker->seen_order, request);
+
+		if (fr_dlist_num_elements(&worker->seen_order) == 1) {
+			worker_max_request_timer(worker);
+			return;
+		}
+	}
+
 	if (!worker->ev_cleanup) worker_max_request_timer(worker);
 }
 
-static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now)
+static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
+				     fr_channel_t *stolen_from, fr_time_t now)
 {
 	bool			is_dup;
 	int			ret = -1;
@@ -702,7 +1017,22 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 
 	if (fr_heap_num_elements(worker->time_order) >= (uint32_t) worker->config.max_requests) goto nak;
 
-	ctx = request = request_alloc(NULL);
+	/*
+	 *	If we're so far behind that the client has probably
+	 *	given up on this packet, don't bother decoding it.
+	 *	Leave the CPU for requests which can still get a useful
+	 *	reply.
+	 */
+	if (worker->config.max_queue_time && ((now - cd->request.recv_time) > worker->config.max_queue_time)) {
+		worker->num_stale++;
+		goto nak;
+	}
+
+	{
+		worker_pool_class_t *pc = worker_pool_class(worker, cd->listen);
+
+		ctx = request = request_alloc_pooled(NULL, pc ? pc->pool_size : worker->config.talloc_pool_size);
+	}
 	if (!request) goto nak;
 
 	worker_request_init(worker, request, now);
@@ -720,6 +1050,7 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 	 *	Update the transport-specific fields.
 	 */
 	request->async->channel = cd->channel.ch;
+	request->async->stolen_from = stolen_from;
 
 	request->async->recv_time = cd->request.recv_time;
 
@@ -742,7 +1073,7 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 	if (ret < 0) {
 		talloc_free(ctx);
 nak:
-		worker_nak(worker, cd, now);
+		worker_nak(worker, cd, stolen_from, now);
 		return;
 	}
 
@@ -754,10 +1085,12 @@ nak:
 
 	if (!request->async->process) {
 		RERROR("Protocol failed to set 'process' function");
-		worker_nak(worker, cd, now);
+		worker_nak(worker, cd, stolen_from, now);
 		return;
 	}
 
+	if (unlikely(request->traced)) fr_trace_request_start(request);
+
 	/*
 	 *	We're done with this message.
 	 */
@@ -771,7 +1104,7 @@ nak:
 	if (request->async->listen->track_duplicates) {
 		REQUEST *old;
 
-		old = rbtree_finddata(worker->dedup, request);
+		old = worker_dedup_find(worker, request);
 		if (!old) {
 			/*
 			 *	Ignore duplicate packets where we've
@@ -779,7 +1112,7 @@ nak:
 			 */
 			if (is_dup) {
 				RDEBUG("Got duplicate packet notice after we had sent a reply - ignoring");
-				fr_channel_null_reply(request->async->channel);
+				worker_send_done(worker, request, now);
 				talloc_free(request);
 				return;
 			}
@@ -799,17 +1132,14 @@ nak:
 		 *
 		 *	If the new packet is a duplicate of the old
 		 *	one, then we can just discard the new one.  We
-		 *	have to tell the channel that we've "eaten"
-		 *	this reply, so the sequence number should
-		 *	increase.
-		 *
-		 *	@todo - fix the channel code to do queue
-		 *	depth, and not sequence / ack.
+		 *	have to tell the network that we've "eaten"
+		 *	this packet, so that it doesn't think the
+		 *	packet is still outstanding.
 		 */
 		if (old->async->recv_time == request->async->recv_time) {
 			RWARN("Discarding duplicate of request (%"PRIu64")", old->number);
 
-			fr_channel_null_reply(request->async->channel);
+			worker_send_done(worker, request, now);
 			talloc_free(request);
 
 			/*
@@ -825,6 +1155,16 @@ nak:
 			 */
 			unlang_interpret_signal(old, FR_SIGNAL_DUP);
 			worker->stats.dup++;
+
+			/*
+			 *	The client is still waiting, so move
+			 *	the request to the back of the list.
+			 */
+			if (fr_dlist_entry_in_list(&old->seen_entry)) {
+				(void) fr_dlist_remove(&worker->seen_order, old);
+				old->async->last_seen = now;
+				fr_dlist_insert_tail(&worker->seen_order, old);
+			}
 			return;
 		}
 
@@ -835,19 +1175,126 @@ nak:
 		RWARN("Got conflicting packet for request (%" PRIu64 "), telling old request to stop", old->number);
 
 		worker_stop_request(worker, old, now);
-		fr_assert(worker->num_active > 0);
-		worker->num_active--;
 		worker->stats.dropped++;
-		talloc_free(old);
+
+		/*
+		 *	The network is still waiting for a reply to
+		 *	the old packet.  Send an empty one, which
+		 *	also frees the old request.
+		 */
+		worker_send_reply(worker, old, 0, now);
 
 	insert_new:
-		(void) rbtree_insert(worker->dedup, request);
+		worker_dedup_insert(worker, request);
 	}
 
 	worker_request_time_tracking_start(worker, request, now);
 }
 
 
+/** Find our channel to the same requestor as another workers channel
+ *
+ */
+static fr_channel_t *worker_channel_find(fr_worker_t *worker, fr_channel_t *other)
+{
+	int i;
+
+	for (i = 0; i < worker->config.max_channels; i++) {
+		fr_channel_t *ch = worker->channel[i];
+
+		if (!ch || !fr_channel_active(ch)) continue;
+
+		if (fr_channel_same_requestor(ch, other)) return ch;
+	}
+
+	return NULL;
+}
+
+/** Take requests which are waiting for a stuck sibling
+ *
+ *  A sibling is stuck when it hasn't gone around its main loop for
+ *  more than steal_delay, i.e. it's executing a slow synchronous
+ *  module call.  A sibling which is asleep waiting for events has a
+ *  zero heartbeat, and is left alone.  Requests which are still
+ *  sitting in its channels haven't been decoded yet, so we can decode
+ *  and run them here.  The reply goes back to the same network thread
+ *  via our own channel.
+ *
+ *  This is called from the steal timer, so the group lock is taken at
+ *  most once per steal_delay.
+ *
+ * @param[in] worker	the idle worker.
+ * @param[in] now	the current time.
+ */
+static void worker_steal(fr_worker_t *worker, fr_time_t now)
+{
+	fr_worker_group_t	*group = worker->group;
+	unsigned int		i;
+	int			j, stolen = 0;
+	fr_time_t		coarse_now;
+
+	if (!group || worker->exiting) return;
+
+	if (fr_heap_num_elements(worker->runnable) > 0) return;
+
+	/*
+	 *	Heartbeats are coarse, so they have to be
+	 *	compared with a coarse time.
+	 */
+	coarse_now = fr_time_coarse();
+
+	pthread_rwlock_rdlock(&group->lock);
+
+	for (i = 0; (i < group->max_workers) && (stolen < STEAL_BATCH); i++) {
+		fr_worker_t	*sibling = group->workers[i];
+		fr_time_t	heartbeat;
+
+		if (!sibling || (sibling == worker) || sibling->exiting) continue;
+
+		heartbeat = atomic_load_explicit(&sibling->heartbeat, memory_order_relaxed);
+		if (!heartbeat || ((coarse_now - heartbeat) < group->steal_delay)) continue;
+
+		for (j = 0; (j < sibling->config.max_channels) && (stolen < STEAL_BATCH); j++) {
+			fr_channel_t		*theirs = sibling->channel[j];
+			fr_channel_t		*mine;
+			fr_channel_data_t	*cd;
+
+			if (!theirs) continue;
+
+			mine = worker_channel_find(worker, theirs);
+			if (!mine) continue;
+
+			while ((stolen < STEAL_BATCH) && ((cd = fr_channel_steal_request(theirs)) != NULL)) {
+				worker->stats.in++;
+				worker->num_stolen++;
+				stolen++;
+
+				cd->channel.ch = mine;
+				worker_request_bootstrap(worker, cd, theirs, now);
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&group->lock);
+
+	if (stolen) DEBUG3("Took %d request(s) from stuck workers", stolen);
+}
+
+/** Periodically check for stuck siblings
+ *
+ */
+static void worker_steal_timer(UNUSED fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_worker_t *worker = talloc_get_type_abort(uctx, fr_worker_t);
+
+	worker_steal(worker, now);
+
+	if (fr_event_timer_in(worker, worker->el, &worker->ev_steal,
+			      worker->group->steal_delay, worker_steal_timer, worker) < 0) {
+		ERROR("Failed inserting work stealing timer");
+	}
+}
+
 /** Run a request
  *
  *  Until it either yields, or is done.
@@ -939,7 +1386,7 @@ redo:
 	 *	then, only some of the time.
 	 */
 	if (!request->async->fake && request->async->listen->track_duplicates) {
-		(void) rbtree_deletebydata(worker->dedup, request);
+		worker_dedup_remove(worker, request);
 	}
 
 	now = fr_time();
@@ -985,20 +1432,6 @@ static int8_t worker_time_order_cmp(void const *one, void const *two)
 	return (a->async->recv_time > b->async->recv_time) - (a->async->recv_time < b->async->recv_time);
 }
 
-/**
- *  Track a REQUEST in the "dedup" tree
- */
-static int worker_dedup_cmp(void const *one, void const *two)
-{
-	int ret;
-	REQUEST const *a = one, *b = two;
-
-	ret = (a->async->listen > b->async->listen) - (a->async->listen < b->async->listen);
-	if (ret) return ret;
-
-	return (a->async->packet_ctx > b->async->packet_ctx) - (a->async->packet_ctx < b->async->packet_ctx);
-}
-
 /** Destroy a worker
  *
  * The input channels are signaled, and local messages are cleaned up.
@@ -1035,6 +1468,16 @@ void fr_worker_destroy(fr_worker_t *worker)
 	}
 	fr_assert(fr_heap_num_elements(worker->runnable) == 0);
 
+	/*
+	 *	Stop other workers from looking at our channels.
+	 */
+	if (worker->group) {
+		pthread_rwlock_wrlock(&worker->group->lock);
+		worker->group->workers[worker->group_id] = NULL;
+		pthread_rwlock_unlock(&worker->group->lock);
+		worker->group = NULL;
+	}
+
 	/*
 	 *	Signal the channels that we're closing.
 	 *
@@ -1051,6 +1494,7 @@ void fr_worker_destroy(fr_worker_t *worker)
 	}
 
 	thread_local_worker = NULL;
+	request_alloc_stats_set(NULL);
 	talloc_free(worker);
 }
 
@@ -1096,6 +1540,23 @@ nomem:
 	CHECK_CONFIG(ring_buffer_size, (1 << 17), (1 << 20));
 	CHECK_CONFIG(max_request_time, fr_time_delta_from_sec(30), fr_time_delta_from_sec(60));
 
+	/*
+	 *	Spinning is off unless configured.  Past a few
+	 *	milliseconds it's just burning CPU.
+	 */
+	if (worker->config.spin_time > fr_time_delta_from_msec(10)) worker->config.spin_time = fr_time_delta_from_msec(10);
+
+	/*
+	 *	Anything waiting longer than max_request_time would be
+	 *	stopped as soon as it started, anyway.
+	 */
+	if (worker->config.max_queue_time > worker->config.max_request_time) {
+		worker->config.max_queue_time = worker->config.max_request_time;
+	}
+	if (worker->config.give_up_time > worker->config.max_request_time) {
+		worker->config.give_up_time = worker->config.max_request_time;
+	}
+
 	worker->channel = talloc_zero_array(worker, fr_channel_t *, worker->config.max_channels);
 	if (!worker->channel) {
 		talloc_free(worker);
@@ -1144,19 +1605,166 @@ nomem:
 		fr_strerror_printf("Failed creating time_order heap");
 		goto fail;
 	}
+	fr_dlist_talloc_init(&worker->seen_order, REQUEST, seen_entry);
 
-	worker->dedup = rbtree_talloc_alloc(worker, worker_dedup_cmp, REQUEST, NULL, RBTREE_FLAG_NONE);
+	/*
+	 *	Size the dedup hash so that the chains average no
+	 *	more than four requests, even with max_requests in
+	 *	flight.
+	 */
+	worker->dedup_mask = 255;
+	while ((worker->dedup_mask + 1) < (uint32_t) (worker->config.max_requests / 4)) {
+		worker->dedup_mask = (worker->dedup_mask << 1) | 1;
+	}
+
+	worker->dedup = talloc_zero_array(worker, REQUEST *, worker->dedup_mask + 1);
 	if (!worker->dedup) {
-		fr_strerror_printf("Failed creating de_dup tree");
+		fr_strerror_printf("Failed creating de_dup hash");
 		goto fail;
 	}
 
+	/*
+	 *	Requests are allocated by this thread, so the
+	 *	allocator settings are thread local, too.
+	 */
+	request_alloc_pool_size_set(worker->config.talloc_pool_size);
+	request_alloc_stats_set(&worker->alloc_stats);
+
 	thread_local_worker = worker;
 
 	return worker;
 }
 
 
+/** Allocate a group of workers which can take requests from each other
+ *
+ * @param[in] ctx		to allocate the group in.
+ * @param[in] max_workers	maximum number of workers in the group.
+ * @param[in] steal_delay	how long a worker must be stuck before
+ *				its siblings take its requests.
+ * @return
+ *	- NULL on error.
+ *	- the new group.
+ */
+fr_worker_group_t *fr_worker_group_alloc(TALLOC_CTX *ctx, unsigned int max_workers, fr_time_delta_t steal_delay)
+{
+	fr_worker_group_t *group;
+
+	group = talloc_zero(ctx, fr_worker_group_t);
+	if (!group) {
+	nomem:
+		fr_strerror_printf("Failed allocating memory");
+		return NULL;
+	}
+
+	group->workers = talloc_zero_array(group, fr_worker_t *, max_workers);
+	if (!group->workers) {
+		talloc_free(group);
+		goto nomem;
+	}
+
+	if (pthread_rwlock_init(&group->lock, NULL) != 0) {
+		fr_strerror_printf("Failed initialising lock: %s", fr_syserror(errno));
+		talloc_free(group);
+		return NULL;
+	}
+	talloc_set_destructor(group, _worker_group_free);
+
+	group->max_workers = max_workers;
+	group->steal_delay = steal_delay;
+
+	return group;
+}
+
+/** Add a worker to a group
+ *
+ * Must be called from the worker's own thread, before fr_worker().
+ *
+ * @param[in] group	to add the worker to.
+ * @param[in] worker	to add.
+ * @param[in] id	unique ID of the worker, less than the group's max_workers.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_worker_group_join(fr_worker_group_t *group, fr_worker_t *worker, unsigned int id)
+{
+	if (id >= group->max_workers) {
+		fr_strerror_printf("Worker ID %u is too large for group of %u workers", id, group->max_workers);
+		return -1;
+	}
+
+	atomic_store(&worker->heartbeat, fr_time_coarse());
+
+	pthread_rwlock_wrlock(&group->lock);
+	group->workers[id] = worker;
+	pthread_rwlock_unlock(&group->lock);
+
+	worker->group = group;
+	worker->group_id = id;
+
+	if (fr_event_timer_in(worker, worker->el, &worker->ev_steal,
+			      group->steal_delay, worker_steal_timer, worker) < 0) {
+		fr_strerror_printf_push("Failed inserting work stealing timer");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Poll the channels for new requests, instead of going to sleep
+ *
+ * Going to sleep means that the network thread has to wake us up
+ * with a kevent for the next request, which costs a system call on
+ * each side, and a context switch.  At moderate load, the next
+ * request often arrives shortly after we run out of work, so we
+ * poll the channels for spin_time first.  While we're polling, the
+ * network thread doesn't signal us.
+ *
+ * @param[in] worker	the worker.
+ * @return
+ *	- true if we received any requests.
+ *	- false if there's nothing to do, and we should sleep.
+ */
+static bool worker_spin(fr_worker_t *worker)
+{
+	int		i;
+	bool		found = false;
+	fr_time_t	end;
+
+	for (i = 0; i < worker->config.max_channels; i++) {
+		if (worker->channel[i]) fr_channel_responder_spinning(worker->channel[i], true);
+	}
+
+	end = fr_time() + worker->config.spin_time;
+	do {
+		for (i = 0; i < worker->config.max_channels; i++) {
+			if (!worker->channel[i]) continue;
+
+			while (fr_channel_recv_request(worker->channel[i])) found = true;
+		}
+		if (found) break;
+
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	} while (fr_time() < end);
+
+	/*
+	 *	The network thread may have pushed a request just
+	 *	before we cleared the flag, and not signalled us.
+	 *	Check the queues once more.
+	 */
+	for (i = 0; i < worker->config.max_channels; i++) {
+		if (!worker->channel[i]) continue;
+
+		fr_channel_responder_spinning(worker->channel[i], false);
+		while (fr_channel_recv_request(worker->channel[i])) found = true;
+	}
+
+	return found;
+}
+
 /** The main loop and entry point of the worker thread.
  *
  * @param[in] worker the worker data structure to manage
@@ -1171,13 +1779,25 @@ void fr_worker(fr_worker_t *worker)
 
 		WORKER_VERIFY;
 
+		atomic_store_explicit(&worker->heartbeat, fr_time_coarse(), memory_order_relaxed);
+
 		/*
 		 *	There are runnable requests.  We still service
 		 *	the event loop, but we don't wait for events.
 		 */
 		wait_for_event = (fr_heap_num_elements(worker->runnable) == 0);
+		if (wait_for_event && worker->config.spin_time && worker->num_channels) {
+			wait_for_event = !worker_spin(worker);
+		}
 		if (wait_for_event) {
 			DEBUG4("Ready to process requests");
+
+			/*
+			 *	We're about to sleep, which isn't the
+			 *	same as being stuck.  Anything queued
+			 *	for us will wake us up.
+			 */
+			atomic_store_explicit(&worker->heartbeat, 0, memory_order_relaxed);
 		}
 
 		/*
@@ -1186,6 +1806,7 @@ void fr_worker(fr_worker_t *worker)
 		 */
 		DEBUG3("Gathering events - %s", wait_for_event ? "will wait" : "Will not wait");
 		num_events = fr_event_corral(worker->el, fr_time(), wait_for_event);
+		atomic_store_explicit(&worker->heartbeat, fr_time_coarse(), memory_order_relaxed);
 		if (num_events < 0) {
 			PERROR("Failed retrieving events");
 			break;
@@ -1353,7 +1974,7 @@ static void worker_verify(fr_worker_t *worker)
 	(void) talloc_get_type_abort(worker->runnable, fr_heap_t);
 
 	fr_assert(worker->dedup != NULL);
-	(void) talloc_get_type_abort(worker->dedup, rbtree_t);
+	(void) talloc_get_type_abort(worker->dedup, REQUEST *);
 
 	for (i = 0; i < worker->config.max_channels; i++) {
 		if (!worker->channel[i]) continue;
@@ -1374,16 +1995,22 @@ int fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats)
 	if (num >= 4) stats[3] = worker->stats.dropped;
 	if (num >= 5) stats[4] = worker->num_naks;
 	if (num >= 6) stats[5] = worker->num_active;
+	if (num >= 7) stats[6] = worker->num_stale;
+	if (num >= 8) stats[7] = worker->tracking.running_total;
+	if (num >= 9) stats[8] = worker->alloc_stats.alloced;
+	if (num >= 10) stats[9] = worker->alloc_stats.reused;
+	if (num >= 11) stats[10] = worker->alloc_stats.freed;
 
-	if (num <= 6) return num;
+	if (num <= 11) return num;
 
-	return 6;
+	return 11;
 }
 
 static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
 {
 	fr_worker_t const *worker = ctx;
 	fr_time_t when;
+	unsigned int i;
 
 	if ((info->argc == 0) || (strcmp(info->argv[0], "count") == 0)) {
 		fprintf(fp, "count.in\t\t\t%" PRIu64 "\n", worker->stats.in);
@@ -1391,10 +2018,32 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fprintf(fp, "count.dup\t\t\t%" PRIu64 "\n", worker->stats.dup);
 		fprintf(fp, "count.dropped\t\t\t%" PRIu64 "\n", worker->stats.dropped);
 		fprintf(fp, "count.naks\t\t\t%" PRIu64 "\n", worker->num_naks);
+		fprintf(fp, "count.stale\t\t\t%" PRIu64 "\n", worker->num_stale);
+		fprintf(fp, "count.abandoned\t\t\t%" PRIu64 "\n", worker->num_abandoned);
+		fprintf(fp, "count.stolen\t\t\t%" PRIu64 "\n", worker->num_stolen);
 		fprintf(fp, "count.active\t\t\t%" PRIu64 "\n", worker->num_active);
 		fprintf(fp, "count.runnable\t\t\t%u\n", fr_heap_num_elements(worker->runnable));
 	}
 
+	if ((info->argc == 0) || (strcmp(info->argv[0], "alloc") == 0)) {
+		fprintf(fp, "alloc.requests\t\t\t%" PRIu64 "\n", worker->alloc_stats.alloced);
+		fprintf(fp, "alloc.reused\t\t\t%" PRIu64 "\n", worker->alloc_stats.reused);
+		fprintf(fp, "alloc.freed\t\t\t%" PRIu64 "\n", worker->alloc_stats.freed);
+		fprintf(fp, "alloc.mismatched\t\t%" PRIu64 "\n", worker->alloc_stats.mismatched);
+
+		for (i = 0; i < worker->num_pool_classes; i++) {
+			worker_pool_class_t const *pc = &worker->pool_class[i];
+			char const *server = pc->server_cs ? cf_section_name2(pc->server_cs) : NULL;
+
+			if (!server) server = "-";
+
+			fprintf(fp, "alloc.pool.%s.%s.size\t%zu\n", pc->app->name, server, pc->pool_size);
+			fprintf(fp, "alloc.pool.%s.%s.peak\t%zu\n", pc->app->name, server, pc->peak);
+			fprintf(fp, "alloc.pool.%s.%s.requests\t%" PRIu64 "\n", pc->app->name, server, pc->requests);
+			fprintf(fp, "alloc.pool.%s.%s.overflowed\t%" PRIu64 "\n", pc->app->name, server, pc->overflowed);
+		}
+	}
+
 	if ((info->argc == 0) || (strcmp(info->argv[0], "cpu") == 0)) {
 		when = worker->predicted;
 		fprintf(fp, "cpu.request_time_rtt\t\t%u.%09" PRIu64 "\n", (unsigned int) (when / NSEC), when % NSEC);
@@ -1413,6 +2062,12 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fr_time_elapsed_fprint(fp, &worker->wall_clock, "time.requests", 4);
 	}
 
+	if ((info->argc == 0) || (strcmp(info->argv[0], "loop") == 0)) {
+		fr_event_list_stats_fprint(fp, worker->el, "loop");
+		fprintf(fp, "loop.runnable\t\t%u\n", fr_heap_num_elements(worker->runnable));
+		fprintf(fp, "loop.active\t\t\t%" PRIu64 "\n", worker->num_active);
+	}
+
 	return 0;
 }
 
@@ -1428,7 +2083,7 @@ fr_cmd_table_t cmd_worker_table[] = {
 		.parent = "stats worker",
 		.add_name = true,
 		.name = "self",
-		.syntax = "[(count|cpu)]",
+		.syntax = "[(count|cpu|alloc|loop)]",
 		.func = cmd_stats_worker,
 		.help = "Show statistics for a specific worker thread.",
 		.read_only = true
@@ -37,6 +37,11 @@ extern "C" {
  */
 typedef struct fr_worker_s fr_worker_t;
 
+/**
+ *  A group of workers which can take requests from each other.
+ */
+typedef struct fr_worker_group_s fr_worker_group_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -66,7 +71,16 @@ typedef struct {
 
 	fr_time_delta_t	max_request_time;	//!< maximum time a request can be processed
 
-	size_t		talloc_pool_size;	//!< for each request
+	fr_time_delta_t	spin_time;		//!< how long to poll the channels before sleeping.
+
+	fr_time_delta_t	max_queue_time;		//!< discard requests which waited longer than this
+						///< before reaching the worker.  0 disables.
+
+	fr_time_delta_t	give_up_time;		//!< stop requests when the client hasn't retransmitted
+						///< for this long.  0 disables.
+
+	size_t		talloc_pool_size;	//!< for each request, until the worker has measured
+						///< what requests from the listener need.
 } fr_worker_config_t;
 
 fr_worker_t	*fr_worker_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const *name,
@@ -88,6 +102,11 @@ int		fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats) CC_HIN
 
 int		fr_worker_request_add(REQUEST *request, module_method_t process, void *ctx);
 
+fr_worker_group_t *fr_worker_group_alloc(TALLOC_CTX *ctx, unsigned int max_workers,
+					 fr_time_delta_t steal_delay);
+
+int		fr_worker_group_join(fr_worker_group_t *group, fr_worker_t *worker, unsigned int id) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
@@ -231,6 +231,7 @@ extern CONF_PARSER const fr_json_format_config[];
 
 /* jpath .c */
 typedef struct fr_jpath_node fr_jpath_node_t;
+typedef struct fr_jpath_batch_s fr_jpath_batch_t;
 
 size_t		fr_jpath_escape_func(UNUSED REQUEST *request, char *out, size_t outlen,
 				     char const *in, UNUSED void *arg);
@@ -239,6 +240,16 @@ int		fr_jpath_evaluate_leaf(TALLOC_CTX *ctx, fr_value_box_t **out,
 				       fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
 				       json_object *root, fr_jpath_node_t const *jpath);
 
+fr_jpath_batch_t	*fr_jpath_batch_alloc(TALLOC_CTX *ctx);
+
+int		fr_jpath_batch_add(fr_jpath_batch_t *batch, fr_jpath_node_t const *jpath,
+				   fr_type_t dst_type, fr_dict_attr_t const *dst_enumv);
+
+unsigned int	fr_jpath_batch_count(fr_jpath_batch_t const *batch);
+
+int		fr_jpath_batch_evaluate(TALLOC_CTX *ctx, fr_value_box_t **out,
+					fr_jpath_batch_t const *batch, json_object *root);
+
 char		*fr_jpath_asprint(TALLOC_CTX *ctx, fr_jpath_node_t const *head);
 
 ssize_t		fr_jpath_parse(TALLOC_CTX *ctx, fr_jpath_node_t **head, char const *in, size_t inlen);
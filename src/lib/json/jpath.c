@@ -404,6 +404,193 @@ int fr_jpath_evaluate_leaf(TALLOC_CTX *ctx, fr_value_box_t **out,
 	return jpath_evaluate(ctx, &tail, dst_type, dst_enumv, root, jpath->next);
 }
 
+/** A path registered with a batch
+ *
+ */
+typedef struct jpath_batch_entry_s jpath_batch_entry_t;
+struct jpath_batch_entry_s {
+	unsigned int		idx;		//!< Where the results for this path are written.
+	fr_jpath_node_t const	*remainder;	//!< What's left of the path after its leading fields.
+	fr_type_t		dst_type;	//!< FreeRADIUS type to convert to.
+	fr_dict_attr_t const	*dst_enumv;	//!< Enumeration values for string to integer conversions.
+	jpath_batch_entry_t	*next;		//!< Next path ending at the same trie node.
+};
+
+/** Node in the trie of leading field selectors
+ *
+ * Every path added to a batch is split into its leading run of field
+ * selectors, and whatever follows.  The leading fields are merged into
+ * a trie so that each distinct object member is only looked up once
+ * per document, no matter how many paths descend through it.
+ */
+typedef struct jpath_batch_node_s jpath_batch_node_t;
+struct jpath_batch_node_s {
+	char const		*field;		//!< Object member this node descends into, NULL for the root.
+	jpath_batch_node_t	*children;	//!< Members below this one.
+	jpath_batch_node_t	*next;		//!< Next sibling.
+	jpath_batch_entry_t	*entries;	//!< Paths whose leading fields end here.
+	jpath_batch_entry_t	**entries_tail;	//!< Where to append the next entry.
+};
+
+/** A set of jpaths evaluated together in a single pass over a document
+ *
+ */
+struct fr_jpath_batch_s {
+	jpath_batch_node_t	root;		//!< Root of the field trie.
+	unsigned int		count;		//!< Number of paths in the batch.
+};
+
+/** Allocate a new, empty, jpath batch
+ *
+ * @param[in] ctx	to allocate the batch in.
+ * @return
+ *	- A new batch.
+ *	- NULL on error.
+ */
+fr_jpath_batch_t *fr_jpath_batch_alloc(TALLOC_CTX *ctx)
+{
+	fr_jpath_batch_t *batch;
+
+	batch = talloc_zero(ctx, fr_jpath_batch_t);
+	if (!batch) return NULL;
+
+	batch->root.entries_tail = &batch->root.entries;
+
+	return batch;
+}
+
+/** Compile a jpath into a batch
+ *
+ * The leading field selectors are merged into the batch's trie, the remainder
+ * of the path is referenced, not copied, so the jpath must remain valid for
+ * the lifetime of the batch.
+ *
+ * @param[in] batch	to add the path to.
+ * @param[in] jpath	to add.  Must start with a root or current selector.
+ * @param[in] dst_type	FreeRADIUS type to convert the results to.
+ * @param[in] dst_enumv	Enumeration values to allow string to integer conversions.
+ * @return
+ *	- >= 0 the index the path's results will be written to by #fr_jpath_batch_evaluate.
+ *	- -1 on error.
+ */
+int fr_jpath_batch_add(fr_jpath_batch_t *batch, fr_jpath_node_t const *jpath,
+		       fr_type_t dst_type, fr_dict_attr_t const *dst_enumv)
+{
+	jpath_batch_node_t	*parent = &batch->root, *child;
+	jpath_batch_entry_t	*entry;
+	fr_jpath_node_t const	*node;
+
+	switch (jpath->selector->type) {
+	case JPATH_SELECTOR_ROOT:
+	case JPATH_SELECTOR_CURRENT:
+		break;
+
+	default:
+		fr_strerror_printf("jpath must start with '$' or '@'");
+		return -1;
+	}
+
+	for (node = jpath->next; node && (node->selector->type == JPATH_SELECTOR_FIELD); node = node->next) {
+		for (child = parent->children; child; child = child->next) {
+			if (strcmp(child->field, node->selector->field) == 0) break;
+		}
+
+		if (!child) {
+			child = talloc_zero(batch, jpath_batch_node_t);
+			if (!child) {
+			oom:
+				fr_strerror_printf("Out of memory");
+				return -1;
+			}
+			child->field = node->selector->field;
+			child->entries_tail = &child->entries;
+			child->next = parent->children;
+			parent->children = child;
+		}
+		parent = child;
+	}
+
+	entry = talloc_zero(batch, jpath_batch_entry_t);
+	if (!entry) goto oom;
+	entry->idx = batch->count;
+	entry->remainder = node;
+	entry->dst_type = dst_type;
+	entry->dst_enumv = dst_enumv;
+
+	*parent->entries_tail = entry;
+	parent->entries_tail = &entry->next;
+
+	return batch->count++;
+}
+
+/** Return the number of paths in a batch
+ *
+ * @param[in] batch	to return the count for.
+ * @return the number of paths, which is also the minimum size of the output
+ *	array passed to #fr_jpath_batch_evaluate.
+ */
+unsigned int fr_jpath_batch_count(fr_jpath_batch_t const *batch)
+{
+	return batch->count;
+}
+
+/** Recursive function for fr_jpath_batch_evaluate
+ *
+ */
+static int jpath_batch_evaluate(TALLOC_CTX *ctx, fr_value_box_t **out,
+				jpath_batch_node_t const *parent, json_object *object)
+{
+	jpath_batch_node_t const	*child;
+	jpath_batch_entry_t const	*entry;
+	json_object			*member;
+	int				ret, matched = 0;
+
+	for (entry = parent->entries; entry; entry = entry->next) {
+		fr_value_box_t **tail = &out[entry->idx];
+
+		ret = jpath_evaluate(ctx, &tail, entry->dst_type, entry->dst_enumv, object, entry->remainder);
+		if (ret < 0) return -1;
+		matched += ret;
+	}
+
+	if (!parent->children || !fr_json_object_is_type(object, json_type_object)) return matched;
+
+	for (child = parent->children; child; child = child->next) {
+		if (!json_object_object_get_ex(object, child->field, &member)) continue;
+
+		ret = jpath_batch_evaluate(ctx, out, child, member);
+		if (ret < 0) return -1;
+		matched += ret;
+	}
+
+	return matched;
+}
+
+/** Evaluate every path in a batch against a document
+ *
+ * Produces the same values as calling #fr_jpath_evaluate_leaf for each path
+ * individually, but shared leading fields are only resolved once.
+ *
+ * @param[in] ctx	to allocate fr_value_box_t in.
+ * @param[out] out	Array of at least #fr_jpath_batch_count entries.  The results
+ *			for each path are written as a list, to the index returned
+ *			by #fr_jpath_batch_add.  Paths which don't match are set to NULL.
+ * @param[in] batch	of paths to evaluate.
+ * @param[in] root	of the JSON document.
+ * @return
+ *	- >= 0 the number of paths which matched.
+ *	- -1 on error.
+ */
+int fr_jpath_batch_evaluate(TALLOC_CTX *ctx, fr_value_box_t **out,
+			    fr_jpath_batch_t const *batch, json_object *root)
+{
+	memset(out, 0, sizeof(*out) * batch->count);
+
+	if (!root) return -1;
+
+	return jpath_batch_evaluate(ctx, out, &batch->root, root);
+}
+
 /** Print a node list to a string for debugging
  *
  * Will not be identical to the original parsed string, but should be sufficient
@@ -972,6 +972,8 @@ void fr_ldap_free(void)
 {
 	if (--instance_count > 0) return;
 
+	fr_ldap_replica_free_all();
+
 	/*
 	 *	Keeping the dummy ld around for the lifetime
 	 *	of the module should always work,
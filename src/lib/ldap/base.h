@@ -12,6 +12,8 @@
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/map.h>
+#include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/util/rbtree.h>
 
 #define LDAP_DEPRECATED 0	/* Quiet warnings about LDAP_DEPRECATED not being defined */
 
@@ -300,6 +302,8 @@ typedef struct {
 
 	fr_ldap_state_t		state;			//!< LDAP connection state machine.
 
+	rbtree_t		*queries;		//!< Outstanding queries sent over a trunk, by msgid.
+
 	void			*uctx;			//!< User data associated with the handle.
 } fr_ldap_connection_t;
 
@@ -352,6 +356,49 @@ typedef enum {
 							//!< exit, and retry the operation with a NULL cookie.
 } fr_ldap_rcode_t;
 
+/** A search sent over a trunk connection
+ *
+ * Allocated with #fr_ldap_trunk_search, and freed by the caller.  Freeing
+ * a query which is still in progress cancels it.
+ */
+typedef struct {
+	REQUEST			*request;		//!< The request the search is being performed for.
+	fr_trunk_request_t	*treq;			//!< Trunk request, NULL once the search has completed.
+	fr_ldap_connection_t	*ldap_conn;		//!< Connection the search was sent on.
+
+	char const		*dn;			//!< Base DN of the search.
+	int			scope;			//!< of the search.
+	char const		*filter;		//!< of the search, may be NULL.
+	char const * const	*attrs;			//!< Attributes to retrieve.  Must remain valid until
+							//!< the search completes.
+	LDAPControl		*serverctrls[LDAP_MAX_CONTROLS];	//!< Controls to pass to the server.
+	LDAPControl		*clientctrls[LDAP_MAX_CONTROLS];	//!< Controls to pass to libldap.
+
+	int			msgid;			//!< Assigned by libldap when the search was sent.
+	LDAPMessage		*result;		//!< Result chain, once the search has completed.
+	fr_ldap_rcode_t		ret;			//!< Result of the search.
+} fr_ldap_query_t;
+
+typedef struct fr_ldap_replica_s fr_ldap_replica_t;
+
+/** An attribute and its values, as held in a replica
+ *
+ */
+typedef struct {
+	char const		*name;			//!< Of the attribute.
+	struct berval		**values;		//!< NULL terminated array of values.
+	int			count;			//!< Number of values.
+} fr_ldap_replica_attr_t;
+
+/** A copy of an entry from a replica
+ *
+ * Returned by #fr_ldap_replica_find, and freed by the caller.
+ */
+typedef struct {
+	char const		*dn;			//!< Of the entry.
+	fr_ldap_replica_attr_t	*attrs;			//!< Array of attributes.
+} fr_ldap_replica_entry_t;
+
 /*
  *	Tables for resolving strings to LDAP constants
  */
@@ -495,7 +542,7 @@ fr_ldap_rcode_t	 fr_ldap_sasl_interactive(REQUEST *request,
 fr_ldap_connection_t *fr_ldap_connection_alloc(TALLOC_CTX *ctx);
 
 fr_connection_t	*fr_ldap_connection_state_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
-					        fr_ldap_config_t const *config, char *log_prefix);
+					        fr_ldap_config_t const *config, char const *log_prefix);
 
 int		fr_ldap_connection_configure(fr_ldap_connection_t *c, fr_ldap_config_t const *config);
 
@@ -503,6 +550,40 @@ int		fr_ldap_connection_timeout_set(fr_ldap_connection_t const *conn, fr_time_de
 
 int		fr_ldap_connection_timeout_reset(fr_ldap_connection_t const *conn);
 
+/*
+ *	trunk.c - Multiplexing searches over many connections
+ */
+fr_trunk_t	*fr_ldap_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+				     fr_ldap_config_t const *config, fr_trunk_conf_t const *tconf,
+				     char const *log_prefix);
+
+fr_trunk_enqueue_t fr_ldap_trunk_search(fr_ldap_query_t **out, TALLOC_CTX *ctx, fr_trunk_t *trunk,
+					REQUEST *request,
+					char const *dn, int scope, char const *filter, char const * const *attrs,
+					LDAPControl **serverctrls, LDAPControl **clientctrls);
+
+/*
+ *	replica.c - In memory copies of directory entries, maintained by syncrepl
+ */
+fr_ldap_replica_t *fr_ldap_replica_get(char const *name, char const *index_attr);
+
+int		fr_ldap_replica_update(fr_ldap_replica_t *replica, uint8_t const *uuid, size_t uuid_len,
+				       LDAP *handle, LDAPMessage *msg);
+
+void		fr_ldap_replica_delete(fr_ldap_replica_t *replica, uint8_t const *uuid, size_t uuid_len);
+
+void		fr_ldap_replica_synced(fr_ldap_replica_t *replica, bool synced, bool clear);
+
+int		fr_ldap_replica_find(TALLOC_CTX *ctx, fr_ldap_replica_entry_t **out, fr_ldap_replica_t *replica,
+				     char const *key, fr_time_delta_t max_age);
+
+fr_ldap_replica_attr_t const *fr_ldap_replica_attr(fr_ldap_replica_entry_t const *entry, char const *name);
+
+int		fr_ldap_replica_map_do(REQUEST *request, fr_ldap_map_exp_t const *expanded,
+				       fr_ldap_replica_entry_t const *entry);
+
+void		fr_ldap_replica_free_all(void);
+
 /*
  *	state.c - Connection state machine
  */
@@ -551,4 +632,4 @@ char		*fr_ldap_berval_to_string(TALLOC_CTX *ctx, struct berval const *in);
 uint8_t		*fr_ldap_berval_to_bin(TALLOC_CTX *ctx, struct berval const *in);
 
 int		fr_ldap_parse_url_extensions(LDAPControl **sss, REQUEST *request,
-					     fr_ldap_connection_t *conn, char **extensions);
+					     LDAP *handle, char **extensions);
@@ -379,6 +379,16 @@ fr_ldap_connection_t *fr_ldap_connection_alloc(TALLOC_CTX *ctx)
 	return c;
 }
 
+/** Order queries by message ID
+ *
+ */
+static int _ldap_query_cmp(void const *one, void const *two)
+{
+	fr_ldap_query_t const *a = one, *b = two;
+
+	return (a->msgid > b->msgid) - (a->msgid < b->msgid);
+}
+
 /** (Re-)Initialises the libldap side of the connection handle
  *
  *  The first ldap state transition is either:
@@ -425,11 +435,18 @@ fr_ldap_connection_t *fr_ldap_connection_alloc(TALLOC_CTX *ctx)
  */
 static fr_connection_state_t _ldap_connection_init(void **h, fr_connection_t *conn, void *uctx)
 {
-	fr_ldap_config_t const	*config = talloc_get_type_abort(uctx, fr_ldap_config_t);
+	fr_ldap_config_t const	*config = uctx;		/* Embedded in the module instance */
 	fr_ldap_connection_t	*c;
 	fr_ldap_state_t		state;
 
 	c = fr_ldap_connection_alloc(conn);
+	c->conn = conn;
+
+	/*
+	 *	Matches results to the searches sent by the trunk
+	 */
+	c->queries = rbtree_alloc(c, _ldap_query_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!c->queries) goto error;
 
 	/*
 	 *	Configure/allocate the libldap handle
@@ -460,7 +477,7 @@ static fr_connection_state_t _ldap_connection_init(void **h, fr_connection_t *co
  * @param[in] log_prefix	to prepend to connection state messages.
  */
 fr_connection_t	*fr_ldap_connection_state_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
-					        fr_ldap_config_t const *config, char *log_prefix)
+					        fr_ldap_config_t const *config, char const *log_prefix)
 {
 	fr_connection_t *conn;
 
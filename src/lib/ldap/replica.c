@@ -0,0 +1,473 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lib/ldap/replica.c
+ * @brief In memory copies of directory entries, maintained by syncrepl.
+ *
+ * A replica is written to by the sync listener as it receives changes, and
+ * read by modules on any worker thread.  Replicas are identified by name,
+ * so the two sides only need to agree on that.
+ *
+ * Entries are keyed by their entryUUID, as that's all the server sends
+ * when an entry is deleted, and indexed by the first value of a single
+ * attribute, which is what lookups are performed on.
+ *
+ * @copyright 2020 The FreeRADIUS Server Project.
+ */
+RCSID("$Id$")
+
+USES_APPLE_DEPRECATED_API
+
+#include <freeradius-devel/ldap/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <pthread.h>
+
+struct fr_ldap_replica_s {
+	char const		*name;			//!< Of the replica.
+	char const		*index_attr;		//!< Attribute entries are indexed by.
+
+	rbtree_t		*by_uuid;		//!< Entries, keyed by entryUUID.  Owns the entries.
+	rbtree_t		*by_key;		//!< Entries, keyed by the value of index_attr.
+
+	bool			synced;			//!< Whether the refresh phase has completed,
+							//!< and the sync is still running.
+	fr_time_t		updated;		//!< When we last heard from the sync.
+
+	pthread_rwlock_t	lock;			//!< Readers are workers, the writer is the listener.
+};
+
+/** An entry in a replica
+ *
+ */
+typedef struct {
+	uint8_t const		*uuid;			//!< entryUUID of the entry.
+	size_t			uuid_len;		//!< Length of the entryUUID.
+	char			*key;			//!< Value of the index attribute, may be NULL.
+	fr_ldap_replica_entry_t	entry;			//!< DN and attributes.
+} ldap_replica_node_t;
+
+static rbtree_t		*replicas;
+static pthread_mutex_t	replicas_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int ldap_replica_name_cmp(void const *one, void const *two)
+{
+	fr_ldap_replica_t const *a = one, *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+static int ldap_replica_uuid_cmp(void const *one, void const *two)
+{
+	ldap_replica_node_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->uuid_len > b->uuid_len) - (a->uuid_len < b->uuid_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->uuid, b->uuid, a->uuid_len);
+}
+
+static int ldap_replica_key_cmp(void const *one, void const *two)
+{
+	ldap_replica_node_t const *a = one, *b = two;
+
+	return strcasecmp(a->key, b->key);
+}
+
+static int _ldap_replica_free(fr_ldap_replica_t *replica)
+{
+	pthread_rwlock_destroy(&replica->lock);
+
+	return 0;
+}
+
+/** (Re-)Allocate the trees holding a replica's entries
+ *
+ */
+static int ldap_replica_trees_alloc(fr_ldap_replica_t *replica)
+{
+	replica->by_uuid = rbtree_alloc(replica, ldap_replica_uuid_cmp, rbtree_node_talloc_free, RBTREE_FLAG_NONE);
+	replica->by_key = rbtree_alloc(replica, ldap_replica_key_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!replica->by_uuid || !replica->by_key) {
+		fr_strerror_printf("Failed allocating trees for replica \"%s\"", replica->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Find or create a replica
+ *
+ * @param[in] name		of the replica.
+ * @param[in] index_attr	Attribute to index entries by.  Must be provided by the
+ *				writer, readers may pass NULL.
+ * @return
+ *	- The replica.
+ *	- NULL on error.
+ */
+fr_ldap_replica_t *fr_ldap_replica_get(char const *name, char const *index_attr)
+{
+	fr_ldap_replica_t	*replica, find = { .name = name };
+
+	pthread_mutex_lock(&replicas_mutex);
+	if (!replicas) {
+		replicas = rbtree_alloc(NULL, ldap_replica_name_cmp, rbtree_node_talloc_free, RBTREE_FLAG_NONE);
+		if (!replicas) {
+			fr_strerror_printf("Failed allocating replica tree");
+		error:
+			pthread_mutex_unlock(&replicas_mutex);
+			return NULL;
+		}
+	}
+
+	replica = rbtree_finddata(replicas, &find);
+	if (replica) {
+		if (index_attr) {
+			if (replica->index_attr && (strcasecmp(replica->index_attr, index_attr) != 0)) {
+				fr_strerror_printf("Replica \"%s\" is already indexed by \"%s\"",
+						   name, replica->index_attr);
+				goto error;
+			}
+			if (!replica->index_attr) replica->index_attr = talloc_typed_strdup(replica, index_attr);
+		}
+		pthread_mutex_unlock(&replicas_mutex);
+		return replica;
+	}
+
+	MEM(replica = talloc_zero(NULL, fr_ldap_replica_t));
+	replica->name = talloc_typed_strdup(replica, name);
+	if (index_attr) replica->index_attr = talloc_typed_strdup(replica, index_attr);
+	if (ldap_replica_trees_alloc(replica) < 0) {
+		talloc_free(replica);
+		goto error;
+	}
+
+	if (pthread_rwlock_init(&replica->lock, NULL) != 0) {
+		fr_strerror_printf("Failed initialising lock for replica \"%s\"", name);
+		talloc_free(replica);
+		goto error;
+	}
+	talloc_set_destructor(replica, _ldap_replica_free);
+
+	if (!rbtree_insert(replicas, replica)) {
+		fr_strerror_printf("Failed inserting replica \"%s\"", name);
+		talloc_free(replica);
+		goto error;
+	}
+	pthread_mutex_unlock(&replicas_mutex);
+
+	return replica;
+}
+
+/** Copy libldap's values for an attribute
+ *
+ */
+static void ldap_replica_values_copy(TALLOC_CTX *ctx, fr_ldap_replica_attr_t *attr, struct berval **values)
+{
+	int i;
+
+	attr->count = ldap_count_values_len(values);
+	MEM(attr->values = talloc_zero_array(ctx, struct berval *, attr->count + 1));
+	for (i = 0; i < attr->count; i++) {
+		MEM(attr->values[i] = talloc_zero(attr->values, struct berval));
+		MEM(attr->values[i]->bv_val = talloc_bstrndup(attr->values[i], values[i]->bv_val, values[i]->bv_len));
+		attr->values[i]->bv_len = values[i]->bv_len;
+	}
+}
+
+/** Copy an entry from a replica, so it can be used outside of the lock
+ *
+ */
+static fr_ldap_replica_entry_t *ldap_replica_entry_copy(TALLOC_CTX *ctx, fr_ldap_replica_entry_t const *in)
+{
+	fr_ldap_replica_entry_t	*out;
+	size_t			i, j, num = talloc_array_length(in->attrs);
+
+	MEM(out = talloc_zero(ctx, fr_ldap_replica_entry_t));
+	MEM(out->dn = talloc_typed_strdup(out, in->dn));
+	MEM(out->attrs = talloc_zero_array(out, fr_ldap_replica_attr_t, num));
+
+	for (i = 0; i < num; i++) {
+		fr_ldap_replica_attr_t const	*a = &in->attrs[i];
+		fr_ldap_replica_attr_t		*b = &out->attrs[i];
+
+		MEM(b->name = talloc_typed_strdup(out->attrs, a->name));
+		b->count = a->count;
+		MEM(b->values = talloc_zero_array(out->attrs, struct berval *, a->count + 1));
+		for (j = 0; j < (size_t)a->count; j++) {
+			MEM(b->values[j] = talloc_zero(b->values, struct berval));
+			MEM(b->values[j]->bv_val = talloc_memdup(b->values[j], a->values[j]->bv_val,
+								 a->values[j]->bv_len + 1));
+			b->values[j]->bv_len = a->values[j]->bv_len;
+		}
+	}
+
+	return out;
+}
+
+/** Remove an entry from the replica, freeing it
+ *
+ * @note Must be called with the write lock held.
+ */
+static void ldap_replica_node_remove(fr_ldap_replica_t *replica, ldap_replica_node_t *node)
+{
+	/*
+	 *	Another entry may have taken over the key.
+	 */
+	if (node->key && (rbtree_finddata(replica->by_key, node) == node)) {
+		rbtree_deletebydata(replica->by_key, node);
+	}
+	rbtree_deletebydata(replica->by_uuid, node);
+}
+
+/** Add an entry to the replica, or replace the existing copy
+ *
+ * @param[in] replica	to update.
+ * @param[in] uuid	entryUUID of the entry.
+ * @param[in] uuid_len	Length of the entryUUID.
+ * @param[in] handle	the entry was received on.
+ * @param[in] msg	containing the entry.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_ldap_replica_update(fr_ldap_replica_t *replica, uint8_t const *uuid, size_t uuid_len,
+			   LDAP *handle, LDAPMessage *msg)
+{
+	ldap_replica_node_t	*node, *old;
+	char			*dn, *name;
+	BerElement		*ber = NULL;
+	size_t			num = 0;
+
+	/*
+	 *	Build the new copy outside of the lock
+	 */
+	MEM(node = talloc_zero(NULL, ldap_replica_node_t));
+	MEM(node->uuid = talloc_memdup(node, uuid, uuid_len));
+	node->uuid_len = uuid_len;
+
+	dn = ldap_get_dn(handle, msg);
+	if (!dn) {
+		fr_strerror_printf("Entry has no DN");
+		talloc_free(node);
+		return -1;
+	}
+	MEM(node->entry.dn = talloc_typed_strdup(node, dn));
+	ldap_memfree(dn);
+
+	MEM(node->entry.attrs = talloc_zero_array(node, fr_ldap_replica_attr_t, 0));
+	for (name = ldap_first_attribute(handle, msg, &ber);
+	     name;
+	     name = ldap_next_attribute(handle, msg, ber)) {
+		struct berval		**values;
+		fr_ldap_replica_attr_t	*attr;
+
+		values = ldap_get_values_len(handle, msg, name);
+		if (!values) {
+			ldap_memfree(name);
+			continue;
+		}
+
+		MEM(node->entry.attrs = talloc_realloc(node, node->entry.attrs, fr_ldap_replica_attr_t, num + 1));
+		attr = &node->entry.attrs[num++];
+		MEM(attr->name = talloc_typed_strdup(node->entry.attrs, name));
+		ldap_replica_values_copy(node->entry.attrs, attr, values);
+
+		if (replica->index_attr && !node->key && attr->count && (strcasecmp(name, replica->index_attr) == 0)) {
+			MEM(node->key = talloc_bstrndup(node, values[0]->bv_val, values[0]->bv_len));
+		}
+
+		ldap_value_free_len(values);
+		ldap_memfree(name);
+	}
+	if (ber) ber_free(ber, 0);
+
+	pthread_rwlock_wrlock(&replica->lock);
+	old = rbtree_finddata(replica->by_uuid, node);
+	if (old) ldap_replica_node_remove(replica, old);
+
+	if (!rbtree_insert(replica->by_uuid, node)) {
+		pthread_rwlock_unlock(&replica->lock);
+		fr_strerror_printf("Failed inserting entry \"%s\"", node->entry.dn);
+		talloc_free(node);
+		return -1;
+	}
+
+	if (node->key) {
+		old = rbtree_finddata(replica->by_key, node);
+		if (old) rbtree_deletebydata(replica->by_key, old);
+		rbtree_insert(replica->by_key, node);
+	}
+	replica->updated = fr_time();
+	pthread_rwlock_unlock(&replica->lock);
+
+	return 0;
+}
+
+/** Remove an entry from the replica
+ *
+ * @param[in] replica	to update.
+ * @param[in] uuid	entryUUID of the entry.
+ * @param[in] uuid_len	Length of the entryUUID.
+ */
+void fr_ldap_replica_delete(fr_ldap_replica_t *replica, uint8_t const *uuid, size_t uuid_len)
+{
+	ldap_replica_node_t	find = { .uuid = uuid, .uuid_len = uuid_len }, *node;
+
+	pthread_rwlock_wrlock(&replica->lock);
+	node = rbtree_finddata(replica->by_uuid, &find);
+	if (node) ldap_replica_node_remove(replica, node);
+	replica->updated = fr_time();
+	pthread_rwlock_unlock(&replica->lock);
+}
+
+/** Record whether the replica is in sync with the directory
+ *
+ * @param[in] replica	to update.
+ * @param[in] synced	true once the refresh phase has completed, false if the sync
+ *			has been lost.
+ * @param[in] clear	Discard all entries, as the directory is about to send
+ *			its full content again.
+ */
+void fr_ldap_replica_synced(fr_ldap_replica_t *replica, bool synced, bool clear)
+{
+	pthread_rwlock_wrlock(&replica->lock);
+	replica->synced = synced;
+	replica->updated = fr_time();
+
+	if (clear) {
+		talloc_free(replica->by_key);
+		talloc_free(replica->by_uuid);
+		if (ldap_replica_trees_alloc(replica) < 0) {
+			PERROR("ldap - Replica \"%s\" unusable", replica->name);
+			replica->synced = false;
+		}
+	}
+	pthread_rwlock_unlock(&replica->lock);
+}
+
+/** Find an entry by the value of the index attribute
+ *
+ * @param[in] ctx	to allocate the copy of the entry in.
+ * @param[out] out	Where to write the copy of the entry.
+ * @param[in] replica	to search.
+ * @param[in] key	Value of the index attribute.
+ * @param[in] max_age	If non-zero, the replica is treated as stale if nothing has been
+ *			heard from the sync for longer than this.
+ * @return
+ *	- 1 if the entry was found.
+ *	- 0 if there's no such entry.
+ *	- -1 if the replica is stale, and the directory should be searched instead.
+ */
+int fr_ldap_replica_find(TALLOC_CTX *ctx, fr_ldap_replica_entry_t **out, fr_ldap_replica_t *replica,
+			 char const *key, fr_time_delta_t max_age)
+{
+	ldap_replica_node_t	find, *node;
+
+	*out = NULL;
+
+	memcpy(&find.key, &key, sizeof(find.key));
+
+	pthread_rwlock_rdlock(&replica->lock);
+	if (!replica->synced || !replica->by_key || (max_age && ((fr_time() - replica->updated) > max_age))) {
+		pthread_rwlock_unlock(&replica->lock);
+		return -1;
+	}
+
+	node = rbtree_finddata(replica->by_key, &find);
+	if (!node) {
+		pthread_rwlock_unlock(&replica->lock);
+		return 0;
+	}
+	*out = ldap_replica_entry_copy(ctx, &node->entry);
+	pthread_rwlock_unlock(&replica->lock);
+
+	return 1;
+}
+
+/** Find an attribute in a copy of an entry
+ *
+ * @param[in] entry	returned by #fr_ldap_replica_find.
+ * @param[in] name	of the attribute.
+ * @return
+ *	- The attribute.
+ *	- NULL if the entry doesn't contain the attribute.
+ */
+fr_ldap_replica_attr_t const *fr_ldap_replica_attr(fr_ldap_replica_entry_t const *entry, char const *name)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(entry->attrs); i++) {
+		if (strcasecmp(entry->attrs[i].name, name) == 0) return &entry->attrs[i];
+	}
+
+	return NULL;
+}
+
+/** Convert attributes from a replica entry to VALUE_PAIRs
+ *
+ * The equivalent of #fr_ldap_map_do for entries retrieved from a replica.
+ *
+ * @param[in] request	Current request.
+ * @param[in] expanded	attributes (rhs of map).
+ * @param[in] entry	to retrieve attributes from.
+ * @return
+ *	- Number of maps successfully applied.
+ *	- -1 on failure.
+ */
+int fr_ldap_replica_map_do(REQUEST *request, fr_ldap_map_exp_t const *expanded,
+			   fr_ldap_replica_entry_t const *entry)
+{
+	vp_map_t const		*map;
+	unsigned int		total = 0;
+	int			applied = 0;
+
+	for (map = expanded->maps; map != NULL; map = map->next) {
+		fr_ldap_replica_attr_t const	*attr;
+		fr_ldap_result_t		result;
+		char const			*name;
+
+		name = expanded->attrs[total++];
+
+		attr = fr_ldap_replica_attr(entry, name);
+		if (!attr) {
+			RDEBUG3("Attribute \"%s\" not found in replica entry", name);
+			continue;
+		}
+
+		result.values = attr->values;
+		result.count = attr->count;
+
+		if (map_to_request(request, map, fr_ldap_map_getvalue, &result) == -1) return -1;
+
+		applied++;
+	}
+
+	return applied;
+}
+
+/** Free all replicas
+ *
+ * Called when the last user of the LDAP library goes away.
+ */
+void fr_ldap_replica_free_all(void)
+{
+	pthread_mutex_lock(&replicas_mutex);
+	TALLOC_FREE(replicas);
+	pthread_mutex_unlock(&replicas_mutex);
+}
@@ -0,0 +1,442 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lib/ldap/trunk.c
+ * @brief Multiplex searches from many requests over trunked LDAP connections.
+ *
+ * Searches are sent as soon as a connection is writable, and matched with
+ * their results using the message ID libldap assigns to each operation, so
+ * many searches may be outstanding on a single connection.
+ *
+ * @copyright 2020 The FreeRADIUS Server Project.
+ */
+RCSID("$Id$")
+
+USES_APPLE_DEPRECATED_API
+
+#include <freeradius-devel/ldap/base.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+
+/** Cancel the search if it's still in progress, and free any results
+ *
+ */
+static int _ldap_query_free(fr_ldap_query_t *query)
+{
+	if (query->treq) fr_trunk_request_signal_cancel(query->treq);
+	if (query->result) ldap_msgfree(query->result);
+
+	return 0;
+}
+
+/** Stop tracking a search which has been sent
+ *
+ * @param[in] query	to stop tracking.
+ * @param[in] abandon	Tell the server we're no longer interested in the result.
+ */
+static void ldap_query_untrack(fr_ldap_query_t *query, bool abandon)
+{
+	fr_ldap_connection_t *ldap_conn = query->ldap_conn;
+
+	if (!ldap_conn) return;
+
+	rbtree_deletebydata(ldap_conn->queries, query);
+	if (abandon && ldap_conn->handle) (void) ldap_abandon_ext(ldap_conn->handle, query->msgid, NULL, NULL);
+
+	query->ldap_conn = NULL;
+	query->msgid = 0;
+}
+
+/** Allocate a new LDAP connection for the trunk
+ *
+ */
+static fr_connection_t *_ldap_trunk_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+						     UNUSED fr_connection_conf_t const *conf,
+						     char const *log_prefix, void *uctx)
+{
+	fr_ldap_config_t const *config = uctx;
+
+	return fr_ldap_connection_state_alloc(tconn, el, config, log_prefix);
+}
+
+/** The connection's file descriptor is readable
+ *
+ */
+static void _ldap_trunk_conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t *tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+/** The connection's file descriptor is writable
+ *
+ */
+static void _ldap_trunk_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t *tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_writable(tconn);
+}
+
+/** The connection's file descriptor errored
+ *
+ */
+static void _ldap_trunk_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				   int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t *tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	ERROR("Connection failed: %s", fr_syserror(fd_errno));
+	fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+}
+
+/** Install the I/O handlers the trunk asks for
+ *
+ */
+static void _ldap_trunk_connection_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+					  fr_event_list_t *el,
+					  fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*ldap_conn = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+	fr_event_fd_cb_t	read_fn = NULL;
+	fr_event_fd_cb_t	write_fn = NULL;
+	int			fd = -1;
+
+	if ((ldap_get_option(ldap_conn->handle, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS) || (fd < 0)) {
+		ERROR("Failed retrieving file descriptor from libldap handle");
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	switch (notify_on) {
+	case FR_TRUNK_CONN_EVENT_NONE:
+		fr_event_fd_delete(el, fd, FR_EVENT_FILTER_IO);
+		return;
+
+	case FR_TRUNK_CONN_EVENT_READ:
+		read_fn = _ldap_trunk_conn_readable;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_WRITE:
+		write_fn = _ldap_trunk_conn_writable;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_BOTH:
+		read_fn = _ldap_trunk_conn_readable;
+		write_fn = _ldap_trunk_conn_writable;
+		break;
+	}
+
+	if (fr_event_fd_insert(ldap_conn, el, fd,
+			       read_fn,
+			       write_fn,
+			       _ldap_trunk_conn_error,
+			       tconn) < 0) {
+		PERROR("Failed inserting FD event");
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Send pending searches
+ *
+ * libldap buffers the encoded operation, and gives us back a message ID
+ * we use to match the result when it arrives.
+ */
+static void _ldap_trunk_request_mux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn,
+				    fr_connection_t *conn, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*ldap_conn = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+	fr_trunk_request_t	*treq;
+
+	for (;;) {
+		fr_ldap_query_t	*query;
+		REQUEST		*request;
+		LDAPControl	*our_serverctrls[LDAP_MAX_CONTROLS];
+		LDAPControl	*our_clientctrls[LDAP_MAX_CONTROLS];
+		char		**search_attrs;
+		int		ret;
+
+		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+		if (!treq) break;
+
+		query = talloc_get_type_abort(treq->preq, fr_ldap_query_t);
+		request = query->request;
+
+		fr_ldap_control_merge(our_serverctrls, our_clientctrls,
+				      NUM_ELEMENTS(our_serverctrls),
+				      NUM_ELEMENTS(our_clientctrls),
+				      ldap_conn, query->serverctrls, query->clientctrls);
+
+		/*
+		 *	OpenLDAP library doesn't declare attrs array as const, but
+		 *	it really should be *sigh*.
+		 */
+		memcpy(&search_attrs, &query->attrs, sizeof(search_attrs));
+
+		if (query->filter) {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Performing search in \"%s\" with filter \"%s\", scope \"%s\"",
+				  query->dn, query->filter,
+				  fr_table_str_by_value(fr_ldap_scope, query->scope, "<INVALID>"));
+		} else {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Performing unfiltered search in \"%s\", scope \"%s\"", query->dn,
+				  fr_table_str_by_value(fr_ldap_scope, query->scope, "<INVALID>"));
+		}
+
+		ret = ldap_search_ext(ldap_conn->handle, query->dn, query->scope, query->filter, search_attrs,
+				      0, our_serverctrls, our_clientctrls, NULL, 0, &query->msgid);
+		switch (ret) {
+		case LDAP_SUCCESS:
+			break;
+
+		/*
+		 *	The connection is no longer usable, the search
+		 *	will be requeued on another connection.
+		 */
+		case LDAP_SERVER_DOWN:
+		case LDAP_CONNECT_ERROR:
+			ROPTIONAL(RERROR, ERROR, "Failed sending search: %s", ldap_err2string(ret));
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+
+		default:
+			ROPTIONAL(RERROR, ERROR, "Failed sending search: %s", ldap_err2string(ret));
+			query->ret = LDAP_PROC_ERROR;
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		query->ldap_conn = ldap_conn;
+		if (!rbtree_insert(ldap_conn->queries, query)) {
+			ROPTIONAL(RERROR, ERROR, "Duplicate message ID %i", query->msgid);
+			(void) ldap_abandon_ext(ldap_conn->handle, query->msgid, NULL, NULL);
+			query->ldap_conn = NULL;
+			query->ret = LDAP_PROC_ERROR;
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		fr_trunk_request_signal_sent(treq);
+	}
+}
+
+/** Read any complete results, and match them with their searches
+ *
+ */
+static void _ldap_trunk_request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*ldap_conn = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+
+	for (;;) {
+		fr_ldap_query_t	*query;
+		LDAPMessage	*result = NULL, *msg;
+		REQUEST		*request;
+		int		ret, count;
+
+		/*
+		 *	Zero timeout means poll, we only want results
+		 *	libldap has already received all of.
+		 */
+		ret = ldap_result(ldap_conn->handle, LDAP_RES_ANY, LDAP_MSG_ALL, &(struct timeval){ 0 }, &result);
+		if (ret == 0) return;
+		if (ret < 0) {
+			ERROR("Failed reading results: %s", fr_ldap_error_str(ldap_conn));
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		query = rbtree_finddata(ldap_conn->queries, &(fr_ldap_query_t){ .msgid = ldap_msgid(result) });
+		if (!query) {
+			DEBUG3("Ignoring result for abandoned message ID %i", ldap_msgid(result));
+			ldap_msgfree(result);
+			continue;
+		}
+		request = query->request;
+		ldap_query_untrack(query, false);
+
+		query->ret = LDAP_PROC_SUCCESS;
+		for (msg = ldap_first_message(ldap_conn->handle, result);
+		     msg;
+		     msg = ldap_next_message(ldap_conn->handle, msg)) {
+			query->ret = fr_ldap_error_check(NULL, ldap_conn, msg, query->dn);
+			if (query->ret != LDAP_PROC_SUCCESS) break;
+		}
+
+		switch (query->ret) {
+		case LDAP_PROC_SUCCESS:
+			count = ldap_count_entries(ldap_conn->handle, result);
+			if (count < 0) {
+				ROPTIONAL(REDEBUG, ERROR, "Error counting results: %s",
+					  fr_ldap_error_str(ldap_conn));
+				query->ret = LDAP_PROC_ERROR;
+			} else if (count == 0) {
+				ROPTIONAL(RDEBUG2, DEBUG2, "Search returned no results");
+				query->ret = LDAP_PROC_NO_RESULT;
+			}
+			break;
+
+		case LDAP_PROC_BAD_DN:
+			ROPTIONAL(RDEBUG2, DEBUG2, "DN %s does not exist", query->dn);
+			break;
+
+		default:
+			ROPTIONAL(RPEDEBUG, PERROR, "Failed performing search");
+			break;
+		}
+
+		if (query->ret == LDAP_PROC_SUCCESS) {
+			query->result = result;
+		} else {
+			ldap_msgfree(result);
+		}
+
+		fr_trunk_request_signal_complete(query->treq);
+	}
+}
+
+/** Stop tracking a search which has been sent
+ *
+ * Unless the search is being moved to another connection, the server is
+ * told to abandon it, so we won't receive its results.
+ */
+static void _ldap_trunk_request_cancel(UNUSED fr_connection_t *conn, void *preq,
+				       fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
+{
+	fr_ldap_query_t	*query = talloc_get_type_abort(preq, fr_ldap_query_t);
+
+	ldap_query_untrack(query, (reason != FR_TRUNK_CANCEL_REASON_MOVE));
+}
+
+/** Tell the caller the search has completed
+ *
+ */
+static void _ldap_trunk_request_complete(REQUEST *request, void *preq, UNUSED void *rctx, UNUSED void *uctx)
+{
+	fr_ldap_query_t	*query = talloc_get_type_abort(preq, fr_ldap_query_t);
+
+	query->treq = NULL;
+	if (request) unlang_interpret_resumable(request);
+}
+
+/** Tell the caller the search couldn't be performed
+ *
+ */
+static void _ldap_trunk_request_fail(REQUEST *request, void *preq, UNUSED void *rctx,
+				     UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	fr_ldap_query_t	*query = talloc_get_type_abort(preq, fr_ldap_query_t);
+
+	query->treq = NULL;
+	if (query->ret == LDAP_PROC_SUCCESS) query->ret = LDAP_PROC_ERROR;
+	if (request) unlang_interpret_resumable(request);
+}
+
+/** Allocate a trunk of connections to an LDAP server
+ *
+ * Connections are bound as the admin user, so searches sent over the
+ * trunk are performed as the admin user.
+ *
+ * @param[in] ctx		to allocate the trunk in.
+ * @param[in] el		to run the trunk's I/O in.
+ * @param[in] config		of the connections.  Must remain valid for the
+ *				lifetime of the trunk.
+ * @param[in] tconf		Trunk configuration.
+ * @param[in] log_prefix	to prepend to messages from the trunk.
+ * @return
+ *	- A new trunk on success.
+ *	- NULL on failure.
+ */
+fr_trunk_t *fr_ldap_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+				fr_ldap_config_t const *config, fr_trunk_conf_t const *tconf,
+				char const *log_prefix)
+{
+	fr_trunk_io_funcs_t	io_funcs = {
+					.connection_alloc	= _ldap_trunk_connection_alloc,
+					.connection_notify	= _ldap_trunk_connection_notify,
+					.request_mux		= _ldap_trunk_request_mux,
+					.request_demux		= _ldap_trunk_request_demux,
+					.request_cancel		= _ldap_trunk_request_cancel,
+					.request_complete	= _ldap_trunk_request_complete,
+					.request_fail		= _ldap_trunk_request_fail
+				};
+
+	return fr_trunk_alloc(ctx, el, &io_funcs, tconf, log_prefix, config, false);
+}
+
+/** Enqueue a search on a trunk
+ *
+ * The request should yield after this returns FR_TRUNK_ENQUEUE_OK or
+ * FR_TRUNK_ENQUEUE_IN_BACKLOG.  It will be marked as resumable when the
+ * search completes, at which point query->ret contains the result of the
+ * search, and query->result any entries it returned.
+ *
+ * @param[out] out		Where to write the new query.
+ * @param[in] ctx		to allocate the query in.
+ * @param[in] trunk		to send the search on.
+ * @param[in] request		Current request.
+ * @param[in] dn		to use as base for the search.
+ * @param[in] scope		to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter		to use, should be pre-escaped.  May be NULL.
+ * @param[in] attrs		to retrieve.  Must remain valid until the search completes.
+ * @param[in] serverctrls	Search controls to pass to the server.  May be NULL.
+ * @param[in] clientctrls	Search controls for ldap_search.  May be NULL.
+ * @return One of the FR_TRUNK_ENQUEUE_* values.
+ */
+fr_trunk_enqueue_t fr_ldap_trunk_search(fr_ldap_query_t **out, TALLOC_CTX *ctx, fr_trunk_t *trunk,
+					REQUEST *request,
+					char const *dn, int scope, char const *filter, char const * const *attrs,
+					LDAPControl **serverctrls, LDAPControl **clientctrls)
+{
+	fr_ldap_query_t		*query;
+	fr_trunk_request_t	*treq;
+	fr_trunk_enqueue_t	ret;
+	size_t			i;
+
+	*out = NULL;
+
+	MEM(query = talloc_zero(ctx, fr_ldap_query_t));
+	query->request = request;
+	MEM(query->dn = talloc_typed_strdup(query, dn ? dn : ""));
+	query->scope = scope;
+	if (filter) MEM(query->filter = talloc_typed_strdup(query, filter));
+	query->attrs = attrs;
+
+	for (i = 0; serverctrls && serverctrls[i] && (i < (NUM_ELEMENTS(query->serverctrls) - 1)); i++) {
+		query->serverctrls[i] = serverctrls[i];
+	}
+	for (i = 0; clientctrls && clientctrls[i] && (i < (NUM_ELEMENTS(query->clientctrls) - 1)); i++) {
+		query->clientctrls[i] = clientctrls[i];
+	}
+
+	ret = fr_trunk_request_enqueue(&treq, trunk, request, query, NULL);
+	switch (ret) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		talloc_free(query);
+		return ret;
+	}
+
+	query->treq = treq;
+	talloc_set_destructor(query, _ldap_query_free);
+	*out = query;
+
+	return ret;
+}
@@ -263,13 +263,13 @@ bool fr_ldap_util_is_dn(char const *in, size_t inlen)
  * @param[out] sss		Where to write a pointer to the server side sort control
  *				we created.
  * @param[in] request		The current request.
- * @param[in] conn		Handle to allocate controls under.
+ * @param[in] handle		to allocate controls under.
  * @param[in] extensions	A NULL terminated array of extensions.
  * @return
  *	- 0 on success.
  *	- -1 on failure.
  */
-int fr_ldap_parse_url_extensions(LDAPControl **sss, REQUEST *request, fr_ldap_connection_t *conn, char **extensions)
+int fr_ldap_parse_url_extensions(LDAPControl **sss, REQUEST *request, LDAP *handle, char **extensions)
 {
 	int i;
 
@@ -314,7 +314,7 @@ int fr_ldap_parse_url_extensions(LDAPControl **sss, REQUEST *request, fr_ldap_co
 
 			if (*sss) ldap_control_free(*sss);
 
-			ret = ldap_create_sort_control(conn->handle, keys, is_critical ? 1 : 0, sss);
+			ret = ldap_create_sort_control(handle, keys, is_critical ? 1 : 0, sss);
 			ldap_free_sort_keylist(keys);
 			if (ret != LDAP_SUCCESS) {
 				ERROR("Failed creating server sort control: %s", ldap_err2string(ret));
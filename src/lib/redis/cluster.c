@@ -85,9 +85,13 @@
  *   indexes in the fr_redis_cluster_t.node array.  We use 8bit unsigned integers instead of
  *   pointers to save space.  Using pointers, the node[] array would need 784K, using IDs
  *   it uses 112K.  Still not light on memory, but a bit more acceptable.
- *   Currently the key_slot array is shadowed by key_slot_pending, used to stage new key_slot
- *   mappings.  This doubles the memory used.  We may want to consider allocating key_slot_pending
- *   only during remappings and freeing it after.
+ *   There are two key_slot tables.  The one pointed to by key_slot is published, and read
+ *   by workers without holding the mutex.  The other, key_slot_pending, is used to stage new
+ *   mappings.  Once a map has been applied to key_slot_pending the two pointers are swapped,
+ *   so workers see either the old map or the new one, never a mixture of the two.
+ *   The old table isn't written to again until the next remap, which can't occur within
+ *   a second of the last one, so a worker's key_slot pointer has plenty of time to go out
+ *   of scope before the memory it points to is reused.  Nodes and pools are never freed.
  *
  * Mapping/Remapping the cluster
  * -----------------------------
@@ -122,6 +126,11 @@
  *   Remaps are limited to one per second.  If any operation sets the remap_needed flag, or
  *   attempts a remap directly, the remap may be skipped if one occurred recently.
  *
+ *   Only one remap may be in progress at a time, across all threads.  The thread which
+ *   starts a remap claims it before issuing 'cluster slots', and any other thread which
+ *   wants a remap while it's running skips it, rather than waiting for the mutex.
+ *   Those threads continue to follow redirects using the old map.
+ *
  *
  * Processing '-ASK' and '-MOVE' redirects
  * ---------------------------------------
@@ -131,7 +140,8 @@
  *   is not known, a new pool is established, and a connection reserved.
  *
  *   The difference between '-ASK' and '-MOVE' is that '-MOVE' attempts a cluster remap before
- *   following the redirect.
+ *   following the redirect.  If another thread is already remapping, the '-MOVE' is followed
+ *   immediately, as if it were an '-ASK'.
  *
  *   The data from '-MOVE' responses, is not used to alter the cluster map.  That is only done
  *   on successful remap.
@@ -153,6 +163,12 @@
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #include "base.h"
 #include "cluster.h"
 #include "crc16.h"
@@ -256,8 +272,16 @@ struct fr_redis_cluster {
 	fr_fifo_t		*free_nodes;		//!< Queue of free nodes (or nodes waiting to be reused).
 	rbtree_t		*used_nodes;		//!< Tree of used nodes.
 
-	fr_redis_cluster_key_slot_t	key_slot[KEY_SLOTS];		//!< Lookup table of slots to pools.
-	fr_redis_cluster_key_slot_t	key_slot_pending[KEY_SLOTS];	//!< Pending key slot table.
+	_Atomic(fr_redis_cluster_key_slot_t *)	key_slot;	//!< Published lookup table of slots to pools.
+	fr_redis_cluster_key_slot_t	*key_slot_pending;		//!< Pending key slot table.
+	fr_redis_cluster_key_slot_t	key_slot_table[2][KEY_SLOTS];	//!< Storage for key_slot and key_slot_pending.
+
+	atomic_uint_fast64_t	moved;			//!< -MOVED redirects received.
+	atomic_uint_fast64_t	ask;			//!< -ASK redirects received.
+	atomic_uint_fast64_t	remaps;			//!< Successful remaps.
+	atomic_uint_fast64_t	remaps_failed;		//!< Remaps which didn't produce a usable map.
+	atomic_uint_fast64_t	remaps_skipped;		//!< Remaps skipped because one was in progress,
+							//!< or had happened too recently.
 
 	pthread_mutex_t		mutex;			//!< Mutex to synchronise cluster operations.
 };
@@ -568,12 +592,10 @@ do { \
 	memset(active, 0, sizeof(active));
 	memset(master, 0, sizeof(master));
 
-	cluster->remapping = true;
-
 	/*
 	 *	Must be cleared with the mutex held
 	 */
-	memset(&cluster->key_slot_pending, 0, sizeof(cluster->key_slot_pending));
+	memset(cluster->key_slot_pending, 0, sizeof(cluster->key_slot_table[0]));
 
 	/*
 	 *	Insert new nodes and markup the keyslot indexes
@@ -616,7 +638,6 @@ do { \
 			fr_strerror_printf("Reached maximum connected nodes");
 			rcode = FR_REDIS_CLUSTER_RCODE_FAILED;
 		error:
-			cluster->remapping = false;
 			cluster->last_updated = time(NULL);
 			/* Re-insert new nodes back into the free_nodes queue */
 			for (i = 0; i < r; i++) SET_INACTIVE(&cluster->node[rollback[i]]);
@@ -703,14 +724,16 @@ do { \
 
 	/*
 	 *	We have connections/pools for all the nodes in
-	 *	the new map, apply it to the live cluster.
+	 *	the new map, publish it.
 	 *
-	 *	Other workers may be using the key slot table,
-	 *	but that's ok. Nodes and pools are never freed,
-	 *	so the worst that will happen, is they'll hit
-	 *	the wrong node for the key, and get redirected.
+	 *	Other workers may still be using the old key slot
+	 *	table, but that's ok. It's not written to until
+	 *	the next remap, and nodes and pools are never freed,
+	 *	so the worst that will happen, is they'll hit the
+	 *	wrong node for the key, and get redirected.
 	 */
-	memcpy(&cluster->key_slot, &cluster->key_slot_pending, sizeof(cluster->key_slot));
+	cluster->key_slot_pending = atomic_exchange_explicit(&cluster->key_slot, cluster->key_slot_pending,
+							     memory_order_acq_rel);
 
 	/*
 	 *	Anything not in the active set of nodes gets
@@ -743,7 +766,6 @@ do { \
 		}
 	}
 
-	cluster->remapping = false;
 	cluster->last_updated = time(NULL);
 
 	/*
@@ -976,6 +998,10 @@ static fr_redis_cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_
 }
 
 /** Perform a runtime remap of the cluster
+ *
+ * Only one remap is performed at a time.  If another thread is remapping
+ * the cluster, or the cluster was remapped within the last second, this
+ * returns immediately and the caller continues with the current map.
  *
  * @note Errors may be retrieved with fr_strerror().
  * @note Must be called with the cluster mutex free.
@@ -984,7 +1010,8 @@ static fr_redis_cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_
  * @param[in,out] cluster to remap.
  * @param[in] conn to use to query the cluster.
  * @return
- *	- FR_REDIS_CLUSTER_RCODE_IGNORED if 'cluster slots' returned an error (indicating clustering not supported).
+ *	- FR_REDIS_CLUSTER_RCODE_IGNORED if 'cluster slots' returned an error (indicating clustering not supported),
+ *	  or if the remap was skipped.
  *	- FR_REDIS_CLUSTER_RCODE_SUCCESS on success.
  *	- FR_REDIS_CLUSTER_RCODE_FAILED if issuing the 'cluster slots' command resulted in a protocol error.
  *	- FR_REDIS_CLUSTER_RCODE_NO_CONNECTION connection failure.
@@ -1000,9 +1027,15 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(REQUEST *request, fr_redis_clust
 	/*
 	 *	If the cluster was remapped very recently, or is being
 	 *	remapped it's unlikely that it needs remapping again.
+	 *
+	 *	These are checked without the mutex first, so
+	 *	threads don't queue up behind the thread doing
+	 *	the remap, then checked again when we claim
+	 *	the remap.
 	 */
 	if (cluster->remapping) {
 	in_progress:
+		atomic_fetch_add_explicit(&cluster->remaps_skipped, 1, memory_order_relaxed);
 		RDEBUG2("Cluster remapping in progress, ignoring remap request");
 		return FR_REDIS_CLUSTER_RCODE_IGNORED;
 	}
@@ -1010,10 +1043,23 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(REQUEST *request, fr_redis_clust
 	now = time(NULL);
 	if (now == cluster->last_updated) {
 	too_soon:
+		atomic_fetch_add_explicit(&cluster->remaps_skipped, 1, memory_order_relaxed);
 		RWARN("Cluster was updated less than a second ago, ignoring remap request");
 		return FR_REDIS_CLUSTER_RCODE_IGNORED;
 	}
 
+	pthread_mutex_lock(&cluster->mutex);
+	if (cluster->remapping) {
+		pthread_mutex_unlock(&cluster->mutex);
+		goto in_progress;
+	}
+	if (now == cluster->last_updated) {
+		pthread_mutex_unlock(&cluster->mutex);
+		goto too_soon;
+	}
+	cluster->remapping = true;
+	pthread_mutex_unlock(&cluster->mutex);
+
 	RINFO("Initiating cluster remap");
 
 	/*
@@ -1024,10 +1070,17 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(REQUEST *request, fr_redis_clust
 	case FR_REDIS_CLUSTER_RCODE_BAD_INPUT:		/* Validation error */
 	case FR_REDIS_CLUSTER_RCODE_NO_CONNECTION:		/* Connection error */
 	case FR_REDIS_CLUSTER_RCODE_FAILED:			/* Error issuing command */
+		atomic_fetch_add_explicit(&cluster->remaps_failed, 1, memory_order_relaxed);
+		pthread_mutex_lock(&cluster->mutex);
+		cluster->remapping = false;
+		pthread_mutex_unlock(&cluster->mutex);
 		return ret;
 
 	case FR_REDIS_CLUSTER_RCODE_IGNORED:		/* Clustering not enabled, or not supported */
+		pthread_mutex_lock(&cluster->mutex);
 		cluster->remap_needed = false;
+		cluster->remapping = false;
+		pthread_mutex_unlock(&cluster->mutex);
 		return FR_REDIS_CLUSTER_RCODE_IGNORED;
 
 	case FR_REDIS_CLUSTER_RCODE_SUCCESS:		/* Success */
@@ -1057,29 +1110,18 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(REQUEST *request, fr_redis_clust
 		REXDENT();
 	}
 
-	/*
-	 *	Check again that the cluster isn't being
-	 *	remapped, or was remapped too recently,
-	 *	now we hold the mutex and the state of
-	 *	those variables is synchronized.
-	 */
 	pthread_mutex_lock(&cluster->mutex);
-	if (cluster->remapping) {
-		pthread_mutex_unlock(&cluster->mutex);
-		fr_redis_reply_free(&map);	/* Free the map */
-		goto in_progress;
-	}
-	if (now == cluster->last_updated) {
-		pthread_mutex_unlock(&cluster->mutex);
-		fr_redis_reply_free(&map);	/* Free the map */
-		goto too_soon;
-	}
 	ret = cluster_map_apply(cluster, map);
 	if (ret == FR_REDIS_CLUSTER_RCODE_SUCCESS) cluster->remap_needed = false;	/* Change on successful remap */
+	cluster->remapping = false;
 	pthread_mutex_unlock(&cluster->mutex);
 
 	fr_redis_reply_free(&map);	/* Free the map */
-	if (ret < 0) return FR_REDIS_CLUSTER_RCODE_FAILED;
+	if (ret < 0) {
+		atomic_fetch_add_explicit(&cluster->remaps_failed, 1, memory_order_relaxed);
+		return FR_REDIS_CLUSTER_RCODE_FAILED;
+	}
+	atomic_fetch_add_explicit(&cluster->remaps, 1, memory_order_relaxed);
 
 	return FR_REDIS_CLUSTER_RCODE_SUCCESS;
 }
@@ -1567,10 +1609,11 @@ fr_redis_cluster_key_slot_t const *fr_redis_cluster_slot_by_key(fr_redis_cluster
 								uint8_t const *key, size_t key_len)
 {
 	fr_redis_cluster_key_slot_t *key_slot;
+	fr_redis_cluster_key_slot_t *table = atomic_load_explicit(&cluster->key_slot, memory_order_acquire);
 
 	if (!key || (key_len == 0)) {
-		key_slot = &cluster->key_slot[(uint16_t)(fr_rand() & (KEY_SLOTS - 1))];
-		RDEBUG2("Key rand() -> slot %zu", key_slot - cluster->key_slot);
+		key_slot = &table[(uint16_t)(fr_rand() & (KEY_SLOTS - 1))];
+		RDEBUG2("Key rand() -> slot %zu", key_slot - table);
 
 		return key_slot;
 	}
@@ -1580,15 +1623,15 @@ fr_redis_cluster_key_slot_t const *fr_redis_cluster_slot_by_key(fr_redis_cluster
 	 *	without clustering.
 	 */
 	if (rbtree_num_elements(cluster->used_nodes) > 1) {
-		key_slot = &cluster->key_slot[cluster_key_hash(key, key_len)];
+		key_slot = &table[cluster_key_hash(key, key_len)];
 		RDEBUG2("Key \"%pV\" -> slot %zu",
-			fr_box_strvalue_len((char const *)key, key_len), key_slot - cluster->key_slot);
+			fr_box_strvalue_len((char const *)key, key_len), key_slot - table);
 
 		return key_slot;
 	}
 	RDEBUG3("Single node available, skipping key selection");
 
-	return &cluster->key_slot[0];
+	return &table[0];
 }
 
 /** Return the master node that would be used for a particular key
@@ -1945,6 +1988,7 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 	case REDIS_RCODE_MOVE:
 		fr_assert(*reply);
 
+		atomic_fetch_add_explicit(&cluster->moved, 1, memory_order_relaxed);
 		if (*conn && (fr_redis_cluster_remap(request, cluster, *conn) != FR_REDIS_CLUSTER_RCODE_SUCCESS)) {
 			RPDEBUG2("");
 		}
@@ -1957,6 +2001,8 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 	{
 		fr_redis_cluster_node_t *new;
 
+		if (status == REDIS_RCODE_ASK) atomic_fetch_add_explicit(&cluster->ask, 1, memory_order_relaxed);
+
 		fr_pool_connection_release(state->node->pool, request, *conn);	/* Always release the old connection */
 
 		if (!fr_cond_assert(*reply)) return REDIS_RCODE_ERROR;
@@ -2226,6 +2272,20 @@ bool fr_redis_cluster_min_version(fr_redis_cluster_t *cluster, char const *min_v
 	return ret < 0 ? false : true;
 }
 
+/** Retrieve redirect and remap counters for a cluster
+ *
+ * @param[out] out	Where to write the counters.
+ * @param[in] cluster	to retrieve counters for.
+ */
+void fr_redis_cluster_stats(fr_redis_cluster_stats_t *out, fr_redis_cluster_t *cluster)
+{
+	out->moved = atomic_load_explicit(&cluster->moved, memory_order_relaxed);
+	out->ask = atomic_load_explicit(&cluster->ask, memory_order_relaxed);
+	out->remaps = atomic_load_explicit(&cluster->remaps, memory_order_relaxed);
+	out->remaps_failed = atomic_load_explicit(&cluster->remaps_failed, memory_order_relaxed);
+	out->remaps_skipped = atomic_load_explicit(&cluster->remaps_skipped, memory_order_relaxed);
+}
+
 /** Allocate and initialise a new cluster structure
  *
  * This holds all the data necessary to manage a pool of pools for a specific redis cluster.
@@ -2264,6 +2324,7 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 
 	int			num_nodes;
 	fr_redis_cluster_t	*cluster;
+	fr_redis_cluster_key_slot_t	*key_slot;
 
 	fr_assert(triggers_enabled || !trigger_prefix);
 	fr_assert(triggers_enabled || !trigger_args);
@@ -2361,6 +2422,14 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 	cluster->conf = conf;
 
 	pthread_mutex_init(&cluster->mutex, NULL);
+
+	atomic_init(&cluster->key_slot, cluster->key_slot_table[0]);
+	cluster->key_slot_pending = cluster->key_slot_table[1];
+	atomic_init(&cluster->moved, 0);
+	atomic_init(&cluster->ask, 0);
+	atomic_init(&cluster->remaps, 0);
+	atomic_init(&cluster->remaps_failed, 0);
+	atomic_init(&cluster->remaps_skipped, 0);
 	talloc_set_destructor(cluster, _fr_redis_cluster_free);
 
 	/*
@@ -2520,7 +2589,8 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 	 *	hopefully we'll get one when we start processing
 	 *	requests.
 	 */
-	for (s = 0; s < KEY_SLOTS; s++) cluster->key_slot[s].master = (s % (uint16_t) num_nodes) + 1;
+	key_slot = atomic_load_explicit(&cluster->key_slot, memory_order_relaxed);
+	for (s = 0; s < KEY_SLOTS; s++) key_slot[s].master = (s % (uint16_t) num_nodes) + 1;
 
 	return cluster;
 }
@@ -73,6 +73,17 @@ typedef enum {
 	FR_REDIS_CLUSTER_RCODE_BAD_INPUT	= -3	//!< Validation error.
 } fr_redis_cluster_rcode_t;
 
+/** Redirect and remap counters
+ */
+typedef struct {
+	uint64_t		moved;		//!< -MOVED redirects received.
+	uint64_t		ask;		//!< -ASK redirects received.
+	uint64_t		remaps;		//!< Successful remaps.
+	uint64_t		remaps_failed;	//!< Remaps which didn't produce a usable map.
+	uint64_t		remaps_skipped;	//!< Remaps skipped because one was in progress,
+						//!< or had happened too recently.
+} fr_redis_cluster_stats_t;
+
 extern fr_table_num_sorted_t const fr_redis_cluster_rcodes_table[];
 extern size_t fr_redis_cluster_rcodes_table_len;
 
@@ -128,6 +139,8 @@ ssize_t fr_redis_cluster_node_addr_by_role(TALLOC_CTX *ctx, fr_socket_addr_t *ou
  */
 bool fr_redis_cluster_min_version(fr_redis_cluster_t *cluster, char const *min_version);
 
+void fr_redis_cluster_stats(fr_redis_cluster_stats_t *out, fr_redis_cluster_t *cluster);
+
 fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 					   CONF_SECTION *module,
 					   fr_redis_conf_t *conf,
@@ -66,6 +66,26 @@ static void _redis_connected(redisAsyncContext const *ac, UNUSED int status)
 	fr_connection_signal_connected(conn);
 }
 
+/** Called by hiredis with the response to AUTH or SELECT
+ *
+ */
+static void _redis_io_setup_reply(redisAsyncContext *ac, void *vreply, UNUSED void *privdata)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(ac->data, fr_connection_t);
+	redisReply		*reply = vreply;
+
+	if (!reply) return;	/* Connection is being torn down */
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		ERROR("Failed setting up connection: %.*s", (int)reply->len, reply->str);
+		fr_redis_async_reply_free(&reply);
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	fr_redis_async_reply_free(&reply);
+}
+
 /** Redis FD became readable
  *
  */
@@ -380,6 +400,29 @@ static fr_connection_state_t _redis_io_connection_init(void **h_out, fr_connecti
 
 	fr_dlist_talloc_init(&h->ignore, fr_redis_sqn_ignore_t, entry);
 
+#ifdef REDIS_NO_AUTO_FREE_REPLIES
+	/*
+	 *	Command sets hold on to replies until every
+	 *	command in the set has been answered, and
+	 *	free them themselves.
+	 */
+	h->ac->c.flags |= REDIS_NO_AUTO_FREE_REPLIES;
+#endif
+
+	/*
+	 *	hiredis buffers these until the connection is
+	 *	open, so they're always the first commands sent.
+	 *
+	 *	Their replies don't go through the pipeline
+	 *	demuxer, so they don't take a sequence number.
+	 */
+	if (conf->password) {
+		redisAsyncCommand(h->ac, _redis_io_setup_reply, NULL, "AUTH %s", conf->password);
+	}
+	if (conf->database) {
+		redisAsyncCommand(h->ac, _redis_io_setup_reply, NULL, "SELECT %u", conf->database);
+	}
+
 	return FR_CONNECTION_STATE_CONNECTING;
 }
 
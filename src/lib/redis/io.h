@@ -138,6 +138,22 @@ static inline bool fr_redis_connection_process_response(fr_redis_handle_t *h)
 	return false;
 }
 
+/** Free a reply passed to an async callback
+ *
+ * Unless hiredis has been told not to, it frees replies itself once the
+ * callback returns.
+ *
+ * @param[in] reply	to free.  Will be set to NULL.
+ */
+static inline void fr_redis_async_reply_free(redisReply **reply)
+{
+#ifdef REDIS_NO_AUTO_FREE_REPLIES
+	fr_redis_reply_free(reply);
+#else
+	*reply = NULL;
+#endif
+}
+
 fr_connection_t		*fr_redis_connection_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 						   fr_connection_conf_t const *conn_conf,
 						   fr_redis_io_conf_t const *io_conf,
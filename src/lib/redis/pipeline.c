@@ -73,6 +73,11 @@ struct fr_redis_command_s {
 	char const			*str;		//!< The command string.
 	size_t				len;		//!< Length of the command string.
 
+	int				argc;		//!< Number of arguments, if the command was
+							///< added as an argument vector.
+	char const			**argv;		//!< Command arguments.
+	size_t const			*argv_len;	//!< Length of each argument.
+
 	uint64_t			sqn;		//!< The sequence number of the command.  This is only
 							///< valid for a specific handle, and is unique within
 							///< the handle.
@@ -262,7 +267,7 @@ fr_redis_command_set_t *fr_redis_command_set_alloc(TALLOC_CTX *ctx,
  */
 static int _redis_command_free(fr_redis_command_t *cmd)
 {
-	//if (cmd->result) fr_redis_reply_free(&cmd->result);
+	if (cmd->result) fr_redis_async_reply_free(&cmd->result);
 
 	return 0;
 }
@@ -272,25 +277,12 @@ redisReply *fr_redis_command_get_result(fr_redis_command_t *cmd)
 	return cmd->result;
 }
 
-/** Add a preformatted/expanded command to the command set
- *
- * The command must either be entirely static, or parented by the command set.
- *
- * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
- * 	 As subscribing to a stream where we're not expecting it would break
- * 	 things, badly.
+/** Check a command and add it to the command set
  *
- * @param[in] cmds	Command set to add command to.
- * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
- *			Must be static, or have the same lifetime as the
- *			command set (allocated with the command set as the parent).
- * @param[in] cmd_len	Length of the command.
- * @return
- *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
- *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
  */
-fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
-							     char const *cmd_str, size_t cmd_len)
+static fr_redis_pipeline_status_t redis_command_add(fr_redis_command_set_t *cmds,
+						    char const *cmd_str, size_t cmd_len,
+						    int argc, char const **argv, size_t const *argv_len)
 {
 	REQUEST			*request = cmds->request;
 	fr_redis_command_t	*cmd;
@@ -372,11 +364,62 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 	cmd->type = type;
 	cmd->str = cmd_str;
 	cmd->len = cmd_len;
+	cmd->argc = argc;
+	cmd->argv = argv;
+	cmd->argv_len = argv_len;
 	fr_dlist_insert_tail(&cmds->pending, cmd);
 
 	return FR_REDIS_PIPELINE_OK;
 }
 
+/** Add a preformatted/expanded command to the command set
+ *
+ * The command must either be entirely static, or parented by the command set.
+ *
+ * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
+ * 	 As subscribing to a stream where we're not expecting it would break
+ * 	 things, badly.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
+ *			Must be static, or have the same lifetime as the
+ *			command set (allocated with the command set as the parent).
+ * @param[in] cmd_len	Length of the command.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
+							     char const *cmd_str, size_t cmd_len)
+{
+	return redis_command_add(cmds, cmd_str, cmd_len, 0, NULL, NULL);
+}
+
+/** Add a command, split into arguments, to the command set
+ *
+ * Unlike #fr_redis_command_preformatted_add, arguments may contain spaces
+ * or binary data, as each is sent to redis as a separate bulk string.
+ *
+ * The argument vector and its contents must either be entirely static,
+ * or parented by the command set.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] argc	Number of arguments.  Must be at least one.
+ * @param[in] argv	The command followed by its arguments.
+ *			argv[0] must be \0 terminated.
+ * @param[in] argv_len	Length of each argument.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_argv_add(fr_redis_command_set_t *cmds,
+						     int argc, char const **argv, size_t const *argv_len)
+{
+	if (!fr_cond_assert(argc > 0)) return FR_REDIS_PIPELINE_BAD_CMDS;
+
+	return redis_command_add(cmds, argv[0], argv_len[0], argc, argv, argv_len);
+}
+
 /** Enqueue a command set on a specific trunk
  *
  * The command set may be passed around several trunks before it is complete.
@@ -409,6 +452,22 @@ fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, f
 	}
 }
 
+/** Signal that the creator of the command set is no longer interested in the results
+ *
+ * Neither the complete nor the fail callbacks will be called, and the
+ * command set will be freed by the trunk.  Any responses to commands
+ * that have already been sent are discarded.
+ *
+ * @param[in] cmds	to cancel.  Must have been enqueued successfully,
+ *			and not yet completed or failed.
+ */
+void fr_redis_command_set_signal_cancel(fr_redis_command_set_t *cmds)
+{
+	if (!cmds->treq) return;
+
+	fr_trunk_request_signal_cancel(cmds->treq);
+}
+
 /** Callback for for receiving Redis replies
  *
  * This is called by hiredis for each response is receives.  privData is set to the
@@ -436,7 +495,7 @@ static void _redis_pipeline_demux(struct redisAsyncContext *ac, void *vreply, vo
 	 */
 	if (!fr_redis_connection_process_response(h)) {
 		DEBUG4("Ignoring response with SQN %"PRIu64, (h->rsp_sqn - 1));	/* Already incremented */
-		fr_redis_reply_free((redisReply **)&reply);
+		fr_redis_async_reply_free(&reply);
 		return;
 	}
 
@@ -470,47 +529,81 @@ static fr_connection_t *_redis_pipeline_connection_alloc(fr_trunk_connection_t *
 	return fr_redis_connection_alloc(tconn, el, conf, rtrunk->io_conf, log_prefix);
 }
 
-/** Enqueue one or more command sets onto a redis handle
- *
- * Because the trunk is in always writable mode, _redis_pipeline_mux
- * will be called any time fr_trunk_request_enqueue is called, so there'll only
- * ever be one command to dequeue.
+/** Write all the pending commands in a command set to a redis handle
  *
- * @param[in] tconn		Trunk connection holding the commands to enqueue.
- * @param[in] conn		Connection handle containing the fr_redis_handle_t.
- * @param[in] uctx		fr_redis_cluster_t.  Unused.
+ * @return
+ *	- true if all the commands were queued with hiredis.
+ *	- false if hiredis refused a command.  All the commands
+ *	  are moved back to the pending list.
  */
-static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+static bool redis_command_set_mux(fr_redis_handle_t *h, fr_redis_command_set_t *cmds)
 {
-	fr_trunk_request_t	*treq;
-	fr_redis_command_set_t 	*cmds;
 	fr_redis_command_t	*cmd;
-	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
-	REQUEST			*request;
 
-	treq = fr_trunk_connection_pop_request(&request, (void *)&cmds, NULL, tconn);
 	while ((cmd = fr_dlist_head(&cmds->pending))) {
+		int ret;
+
+		if (cmd->argc) {
+			ret = redisAsyncCommandArgv(h->ac, _redis_pipeline_demux, cmd,
+						    cmd->argc, cmd->argv, cmd->argv_len);
+		} else {
+			ret = redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str);
+		}
+
 		/*
 		 *	If this fails it probably means the connection
 		 *	is disconnecting, but if that's happening then
 		 *	we shouldn't be enqueueing new requests?
 		 */
-		if (unlikely(redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str) != REDIS_OK)) {
-			ROPTIONAL(ERROR, REDEBUG, "Unexpected error queueing REDIS command");
-
-			while ((cmd = fr_dlist_head(&cmds->sent))) {
+		if (unlikely(ret != REDIS_OK)) {
+			while ((cmd = fr_dlist_tail(&cmds->sent))) {
 				fr_redis_connection_ignore_response(h, cmd->sqn);
 				fr_dlist_remove(&cmds->sent, cmd);
-				fr_dlist_insert_tail(&cmds->pending, cmd);
+				fr_dlist_insert_head(&cmds->pending, cmd);
 			}
-			fr_trunk_request_signal_fail(treq);
-			return;
+			return false;
 		}
 		cmd->sqn = fr_redis_connection_sent_request(h);
 		fr_dlist_remove(&cmds->pending, cmd);
 		fr_dlist_insert_tail(&cmds->sent, cmd);
 	}
-	fr_trunk_request_signal_sent(treq);
+
+	return true;
+}
+
+/** Enqueue one or more command sets onto a redis handle
+ *
+ * Because the trunk is in always writable mode, _redis_pipeline_mux
+ * will be called any time fr_trunk_request_enqueue is called, so there'll
+ * usually only be one command set to dequeue.
+ *
+ * @param[in] el		UNUSED.
+ * @param[in] tconn		Trunk connection holding the commands to enqueue.
+ * @param[in] conn		Connection handle containing the fr_redis_handle_t.
+ * @param[in] uctx		fr_redis_cluster_t.  Unused.
+ */
+static void _redis_pipeline_mux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn,
+				fr_connection_t *conn, UNUSED void *uctx)
+{
+	fr_trunk_request_t	*treq;
+	fr_redis_command_set_t 	*cmds;
+	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
+	REQUEST			*request;
+
+	for (;;) {
+		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+		if (!treq) break;
+
+		request = treq->request;
+		cmds = talloc_get_type_abort(treq->preq, fr_redis_command_set_t);
+
+		if (unlikely(!redis_command_set_mux(h, cmds))) {
+			ROPTIONAL(ERROR, REDEBUG, "Unexpected error queueing REDIS command");
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+		fr_trunk_request_signal_sent(treq);
+	}
 }
 
 /** Deal with cancellation of sent requests
@@ -519,7 +612,7 @@ static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *c
  * on why the commands were cancelled, we either tell the handle to ignore
  * them, or move them back into the pending list.
  */
-static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_trunk_request_t *treq, void *preq,
+static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, void *preq,
 					       fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
@@ -544,6 +637,24 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 		fr_dlist_move(&cmds->pending, &cmds->sent);
 		return;
 
+	/*
+	 *	The connection is still usable, so responses
+	 *	to the commands we sent will still arrive.
+	 *	Ignore them, and send the commands again.
+	 */
+	case FR_TRUNK_CANCEL_REASON_REQUEUE:
+	{
+		fr_redis_command_t	*cmd;
+
+		for (cmd = fr_dlist_head(&cmds->sent);
+		     cmd;
+		     cmd = fr_dlist_next(&cmds->sent, cmd)) {
+			fr_redis_connection_ignore_response(h, cmd->sqn);
+		}
+		fr_dlist_move(&cmds->pending, &cmds->sent);
+	}
+		return;
+
 	/*
 	 *	If the request was cancelled due to a signal
 	 *	we'll have a response coming back for a
@@ -564,6 +675,7 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 			fr_redis_connection_ignore_response(h, cmd->sqn);
 		}
 	}
+		return;
 
 	case FR_TRUNK_CANCEL_REASON_NONE:
 		fr_assert(0);
@@ -586,7 +698,8 @@ static void _redis_pipeline_command_set_complete(UNUSED REQUEST *request, void *
  *
  */
 static void _redis_pipeline_command_set_fail(UNUSED REQUEST *request, void *preq,
-					     UNUSED void *rctx, UNUSED void *uctx)
+					     UNUSED void *rctx, UNUSED fr_trunk_request_state_t state,
+					     UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
@@ -643,8 +756,13 @@ fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread
  * This structure represents all the connections for a given thread for a given cluster.
  * The structures holds the trunk connections to talk to each cluster member.
  *
+ * @param[in] ctx		to allocate the cluster thread in.
+ * @param[in] el		to run the trunks' I/O in.
+ * @param[in] tconf		Configuration for each trunk.
+ * @param[in] log_prefix	to prepend to messages from the trunks.  May be NULL.
  */
-fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, fr_trunk_conf_t const *tconf)
+fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, fr_trunk_conf_t const *tconf,
+							 char const *log_prefix)
 {
 	fr_redis_cluster_thread_t *cluster_thread;
 	fr_trunk_conf_t *our_tconf;
@@ -655,6 +773,7 @@ fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_eve
 
 	cluster_thread->el = el;
 	cluster_thread->tconf = our_tconf;
+	if (log_prefix) MEM(cluster_thread->log_prefix = talloc_typed_strdup(cluster_thread, log_prefix));
 
 	return cluster_thread;
 }
@@ -1,3 +1,4 @@
 SUBMAKEFILES := \
 	libfreeradius-server.mk \
+	detail_tests.mk \
 	trunk_tests.mk
@@ -64,6 +64,7 @@ RCSIDH(base_h, "$Id$")
 #include <freeradius-devel/server/sysutmp.h>
 #include <freeradius-devel/server/tcp.h>
 #include <freeradius-devel/server/tmpl.h>
+#include <freeradius-devel/server/trace.h>
 #include <freeradius-devel/server/trigger.h>
 #include <freeradius-devel/server/users_file.h>
 #include <freeradius-devel/server/util.h>
@@ -0,0 +1,300 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/breaker.c
+ * @brief Stop sending work to a backend which is failing.
+ *
+ * When a backend dies, every request sent to it waits for a timeout
+ * before failing, and ties up a worker while it does.  A circuit
+ * breaker counts the results of recent requests.  When too many of
+ * them are errors, the breaker opens, and new requests fail
+ * immediately, so that redundant sections move on to the next module
+ * straight away.
+ *
+ * After open_time, a few probe requests are let through.  If they all
+ * succeed the breaker closes again, and if any fails, it reopens.
+ *
+ * A breaker may be shared between threads.  Results are counted with
+ * atomics, and the mutex is only taken to change state, or to start
+ * a new window.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/breaker.h>
+#include <freeradius-devel/util/debug.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct fr_breaker_s {
+	fr_breaker_conf_t const	*conf;			//!< How the breaker behaves.
+
+	atomic_uint_fast32_t	state;			//!< One of #fr_breaker_state_t.
+
+	atomic_int_fast64_t	window_start;		//!< When the current window started.
+	atomic_uint_fast32_t	results;		//!< In the current window.
+	atomic_uint_fast32_t	errors;			//!< In the current window.
+
+	atomic_int_fast64_t	changed;		//!< When the breaker last opened, or half opened.
+	atomic_uint_fast32_t	probes;			//!< Probes let through while half open.
+	atomic_uint_fast32_t	probes_ok;		//!< Probes which succeeded.
+
+	atomic_uint_fast64_t	trips;			//!< How many times the breaker has opened.
+	atomic_uint_fast64_t	rejected;		//!< Requests failed because the breaker was open.
+
+	pthread_mutex_t		mutex;			//!< Serialises state changes.
+
+	fr_breaker_notify_t	notify;			//!< Called on state changes.
+	void			*uctx;			//!< Passed to notify.
+};
+
+CONF_PARSER const fr_breaker_config[] = {
+	{ FR_CONF_OFFSET("error_rate", FR_TYPE_UINT32, fr_breaker_conf_t, error_rate), .dflt = "0" },
+	{ FR_CONF_OFFSET("latency", FR_TYPE_TIME_DELTA, fr_breaker_conf_t, latency), .dflt = "0" },
+	{ FR_CONF_OFFSET("min_results", FR_TYPE_UINT32, fr_breaker_conf_t, min_results), .dflt = "10" },
+	{ FR_CONF_OFFSET("window", FR_TYPE_TIME_DELTA, fr_breaker_conf_t, window), .dflt = "10" },
+	{ FR_CONF_OFFSET("open_time", FR_TYPE_TIME_DELTA, fr_breaker_conf_t, open_time), .dflt = "5" },
+	{ FR_CONF_OFFSET("probes", FR_TYPE_UINT32, fr_breaker_conf_t, probes), .dflt = "1" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+fr_table_num_ordered_t const fr_breaker_states[] = {
+	{ "closed",		FR_BREAKER_CLOSED	},
+	{ "open",		FR_BREAKER_OPEN		},
+	{ "half-open",		FR_BREAKER_HALF_OPEN	}
+};
+size_t fr_breaker_states_len = NUM_ELEMENTS(fr_breaker_states);
+
+static int _breaker_free(fr_breaker_t *breaker)
+{
+	pthread_mutex_destroy(&breaker->mutex);
+
+	return 0;
+}
+
+/** Allocate a circuit breaker
+ *
+ * @param[in] ctx	to allocate the breaker in.
+ * @param[in] conf	for the breaker.  Must remain valid for the
+ *			lifetime of the breaker.
+ * @param[in] notify	called when the breaker changes state.  May be NULL.
+ * @param[in] uctx	passed to notify.
+ * @return
+ *	- A new breaker.
+ *	- NULL if conf->error_rate is 0, i.e. the breaker is disabled.
+ */
+fr_breaker_t *fr_breaker_alloc(TALLOC_CTX *ctx, fr_breaker_conf_t const *conf,
+			       fr_breaker_notify_t notify, void *uctx)
+{
+	fr_breaker_t *breaker;
+
+	if (!conf->error_rate) return NULL;
+
+	MEM(breaker = talloc_zero(ctx, fr_breaker_t));
+	breaker->conf = conf;
+	breaker->notify = notify;
+	breaker->uctx = uctx;
+
+	atomic_init(&breaker->state, FR_BREAKER_CLOSED);
+	atomic_init(&breaker->window_start, fr_time());
+	atomic_init(&breaker->results, 0);
+	atomic_init(&breaker->errors, 0);
+	atomic_init(&breaker->changed, 0);
+	atomic_init(&breaker->probes, 0);
+	atomic_init(&breaker->probes_ok, 0);
+	atomic_init(&breaker->trips, 0);
+	atomic_init(&breaker->rejected, 0);
+
+	pthread_mutex_init(&breaker->mutex, NULL);
+	talloc_set_destructor(breaker, _breaker_free);
+
+	return breaker;
+}
+
+/** Change state, if nobody else got there first
+ *
+ * @param[in] breaker	to change.
+ * @param[in] from	the state we expect the breaker to be in.
+ * @param[in] to	the new state.
+ * @param[in] now	the current time.
+ */
+static void breaker_transition(fr_breaker_t *breaker, fr_breaker_state_t from, fr_breaker_state_t to,
+			       fr_time_t now)
+{
+	pthread_mutex_lock(&breaker->mutex);
+	if (atomic_load_explicit(&breaker->state, memory_order_relaxed) != from) {
+		pthread_mutex_unlock(&breaker->mutex);
+		return;
+	}
+
+	switch (to) {
+	case FR_BREAKER_OPEN:
+		atomic_fetch_add_explicit(&breaker->trips, 1, memory_order_relaxed);
+		FALL_THROUGH;
+
+	case FR_BREAKER_HALF_OPEN:
+		atomic_store_explicit(&breaker->changed, now, memory_order_relaxed);
+		atomic_store_explicit(&breaker->probes, 0, memory_order_relaxed);
+		atomic_store_explicit(&breaker->probes_ok, 0, memory_order_relaxed);
+		break;
+
+	case FR_BREAKER_CLOSED:
+		atomic_store_explicit(&breaker->window_start, now, memory_order_relaxed);
+		atomic_store_explicit(&breaker->results, 0, memory_order_relaxed);
+		atomic_store_explicit(&breaker->errors, 0, memory_order_relaxed);
+		break;
+	}
+	atomic_store_explicit(&breaker->state, to, memory_order_release);
+	pthread_mutex_unlock(&breaker->mutex);
+
+	if (breaker->notify) breaker->notify(breaker, to, breaker->uctx);
+}
+
+/** Check whether a request may be sent
+ *
+ * @param[in] breaker	to check.
+ * @param[in] now	the current time.
+ * @return
+ *	- true if the request should be sent.
+ *	- false if it should fail immediately.
+ */
+bool fr_breaker_allow(fr_breaker_t *breaker, fr_time_t now)
+{
+	fr_time_t changed;
+
+	switch (atomic_load_explicit(&breaker->state, memory_order_acquire)) {
+	case FR_BREAKER_CLOSED:
+		return true;
+
+	case FR_BREAKER_OPEN:
+		changed = atomic_load_explicit(&breaker->changed, memory_order_relaxed);
+		if ((changed + breaker->conf->open_time) > now) break;
+
+		breaker_transition(breaker, FR_BREAKER_OPEN, FR_BREAKER_HALF_OPEN, now);
+		FALL_THROUGH;
+
+	case FR_BREAKER_HALF_OPEN:
+		/*
+		 *	Probes which never report back (e.g. they
+		 *	were cancelled) mustn't leave the breaker
+		 *	half open forever.
+		 */
+		changed = atomic_load_explicit(&breaker->changed, memory_order_relaxed);
+		if ((changed + breaker->conf->open_time) <= now) {
+			pthread_mutex_lock(&breaker->mutex);
+			if (atomic_load_explicit(&breaker->changed, memory_order_relaxed) == changed) {
+				atomic_store_explicit(&breaker->changed, now, memory_order_relaxed);
+				atomic_store_explicit(&breaker->probes, 0, memory_order_relaxed);
+				atomic_store_explicit(&breaker->probes_ok, 0, memory_order_relaxed);
+			}
+			pthread_mutex_unlock(&breaker->mutex);
+		}
+
+		if (atomic_fetch_add_explicit(&breaker->probes, 1, memory_order_relaxed) < breaker->conf->probes) {
+			return true;
+		}
+		break;
+	}
+
+	atomic_fetch_add_explicit(&breaker->rejected, 1, memory_order_relaxed);
+
+	return false;
+}
+
+/** Record the result of a request
+ *
+ * @param[in] breaker	to update.
+ * @param[in] now	the current time.
+ * @param[in] ok	whether the request succeeded.
+ * @param[in] latency	how long the request took, if it succeeded.
+ */
+void fr_breaker_result(fr_breaker_t *breaker, fr_time_t now, bool ok, fr_time_delta_t latency)
+{
+	fr_breaker_conf_t const	*conf = breaker->conf;
+	uint32_t		results, errors;
+	bool			error = !ok || (conf->latency && (latency > conf->latency));
+
+	switch (atomic_load_explicit(&breaker->state, memory_order_acquire)) {
+	/*
+	 *	Results for requests which were sent before
+	 *	the breaker opened.
+	 */
+	case FR_BREAKER_OPEN:
+		return;
+
+	case FR_BREAKER_HALF_OPEN:
+		if (error) {
+			breaker_transition(breaker, FR_BREAKER_HALF_OPEN, FR_BREAKER_OPEN, now);
+			return;
+		}
+
+		if ((atomic_fetch_add_explicit(&breaker->probes_ok, 1, memory_order_relaxed) + 1) >= conf->probes) {
+			breaker_transition(breaker, FR_BREAKER_HALF_OPEN, FR_BREAKER_CLOSED, now);
+		}
+		return;
+
+	case FR_BREAKER_CLOSED:
+		break;
+	}
+
+	/*
+	 *	Start a new window.
+	 */
+	if ((atomic_load_explicit(&breaker->window_start, memory_order_relaxed) + conf->window) <= now) {
+		pthread_mutex_lock(&breaker->mutex);
+		if ((atomic_load_explicit(&breaker->window_start, memory_order_relaxed) + conf->window) <= now) {
+			atomic_store_explicit(&breaker->window_start, now, memory_order_relaxed);
+			atomic_store_explicit(&breaker->results, 0, memory_order_relaxed);
+			atomic_store_explicit(&breaker->errors, 0, memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&breaker->mutex);
+	}
+
+	results = atomic_fetch_add_explicit(&breaker->results, 1, memory_order_relaxed) + 1;
+	if (!error) return;
+
+	errors = atomic_fetch_add_explicit(&breaker->errors, 1, memory_order_relaxed) + 1;
+	if ((results < conf->min_results) || (((uint64_t) errors * 100) < ((uint64_t) conf->error_rate * results))) return;
+
+	breaker_transition(breaker, FR_BREAKER_CLOSED, FR_BREAKER_OPEN, now);
+}
+
+/** Return the current state of the breaker
+ *
+ */
+fr_breaker_state_t fr_breaker_state(fr_breaker_t const *breaker)
+{
+	return atomic_load_explicit(&breaker->state, memory_order_relaxed);
+}
+
+/** Print the state and counters of a breaker, for radmin
+ *
+ */
+void fr_breaker_show(FILE *fp, fr_breaker_t const *breaker)
+{
+	fprintf(fp, "state\t\t\t%s\n", fr_table_str_by_value(fr_breaker_states, fr_breaker_state(breaker), "<INVALID>"));
+	fprintf(fp, "results\t\t\t%u\n", (unsigned int)atomic_load_explicit(&breaker->results, memory_order_relaxed));
+	fprintf(fp, "errors\t\t\t%u\n", (unsigned int)atomic_load_explicit(&breaker->errors, memory_order_relaxed));
+	fprintf(fp, "trips\t\t\t%" PRIu64 "\n", (uint64_t)atomic_load_explicit(&breaker->trips, memory_order_relaxed));
+	fprintf(fp, "rejected\t\t%" PRIu64 "\n", (uint64_t)atomic_load_explicit(&breaker->rejected, memory_order_relaxed));
+}
@@ -0,0 +1,100 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/breaker.h
+ * @brief Stop sending work to a backend which is failing.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(breaker_h, "$Id$")
+
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/util/table.h>
+#include <freeradius-devel/util/time.h>
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_breaker_s fr_breaker_t;
+
+/** States of a circuit breaker
+ *
+ */
+typedef enum {
+	FR_BREAKER_CLOSED = 0,				//!< Requests are sent as normal.
+	FR_BREAKER_OPEN,				//!< Requests fail immediately.
+	FR_BREAKER_HALF_OPEN				//!< A few probe requests are let through, to
+							///< see if the backend has recovered.
+} fr_breaker_state_t;
+
+/** Configuration for a circuit breaker
+ *
+ */
+typedef struct {
+	uint32_t		error_rate;		//!< Open when this percentage of results in a window
+							///< are errors.  0 disables the breaker.
+
+	fr_time_delta_t		latency;		//!< Results which took longer than this count as
+							///< errors.  0 disables.
+
+	uint32_t		min_results;		//!< Don't open until a window has at least this
+							///< many results.
+
+	fr_time_delta_t		window;			//!< How long error rates are measured over.
+
+	fr_time_delta_t		open_time;		//!< How long to fail requests for, before sending
+							///< probes.
+
+	uint32_t		probes;			//!< How many probes must succeed before closing.
+} fr_breaker_conf_t;
+
+/** Called when the breaker changes state
+ *
+ * May be called from any thread using the breaker.
+ *
+ * @param[in] breaker	which changed state.
+ * @param[in] state	the breaker is now in.
+ * @param[in] uctx	passed to #fr_breaker_alloc.
+ */
+typedef void (*fr_breaker_notify_t)(fr_breaker_t *breaker, fr_breaker_state_t state, void *uctx);
+
+extern CONF_PARSER const fr_breaker_config[];
+
+extern fr_table_num_ordered_t const fr_breaker_states[];
+extern size_t fr_breaker_states_len;
+
+fr_breaker_t		*fr_breaker_alloc(TALLOC_CTX *ctx, fr_breaker_conf_t const *conf,
+					  fr_breaker_notify_t notify, void *uctx) CC_HINT(nonnull(2));
+
+bool			fr_breaker_allow(fr_breaker_t *breaker, fr_time_t now) CC_HINT(nonnull);
+
+void			fr_breaker_result(fr_breaker_t *breaker, fr_time_t now,
+					  bool ok, fr_time_delta_t latency) CC_HINT(nonnull);
+
+fr_breaker_state_t	fr_breaker_state(fr_breaker_t const *breaker) CC_HINT(nonnull);
+
+void			fr_breaker_show(FILE *fp, fr_breaker_t const *breaker) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1435,12 +1435,29 @@ alloc_section:
 }
 
 
+/** Call any ON_READ rule for a pair which has just been added
+ *
+ */
+static int cf_pair_on_read(CONF_SECTION *parent, CONF_PAIR *cp)
+{
+	CONF_DATA const *cd;
+	CONF_PARSER *rule;
+
+	cd = cf_data_find(CF_TO_ITEM(parent), CONF_PARSER, cp->attr);
+	if (!cd) return 0;
+
+	rule = cf_data_value(cd);
+	if ((rule->type & FR_TYPE_ON_READ) == 0) {
+		return 0;
+	}
+
+	return rule->func(parent, NULL, NULL, cf_pair_to_item(cp), rule);
+}
+
 static int add_pair(CONF_SECTION *parent, char const *attr, char const *value,
 		    fr_token_t name1_token, fr_token_t op_token, fr_token_t value_token,
 		    char *buff, char const *filename, int lineno)
 {
-	CONF_DATA const *cd;
-	CONF_PARSER *rule;
 	CONF_PAIR *cp;
 	bool pass2 = false;
 
@@ -1479,15 +1496,7 @@ static int add_pair(CONF_SECTION *parent, char const *attr, char const *value,
 	cp->pass2 = pass2;
 	cf_item_add(parent, &(cp->item));
 
-	cd = cf_data_find(CF_TO_ITEM(parent), CONF_PARSER, attr);
-	if (!cd) return 0;
-
-	rule = cf_data_value(cd);
-	if ((rule->type & FR_TYPE_ON_READ) == 0) {
-		return 0;
-	}
-
-	return rule->func(parent, NULL, NULL, cf_pair_to_item(cp), rule);
+	return cf_pair_on_read(parent, cp);
 }
 
 static fr_table_ptr_sorted_t unlang_keywords[] = {
@@ -2187,14 +2196,11 @@ static void cf_stack_cleanup(cf_stack_t *stack)
 /*
  *	Bootstrap a config file.
  */
-int cf_file_read(CONF_SECTION *cs, char const *filename)
+static int cf_file_read_init(CONF_SECTION *cs, char const *filename)
 {
-	int		i;
 	char		*p;
 	CONF_PAIR	*cp;
 	rbtree_t	*tree;
-	cf_stack_t	stack;
-	cf_stack_frame_t	*frame;
 
 	cp = cf_pair_alloc(cs, "confdir", filename, T_OP_EQ, T_BARE_WORD, T_SINGLE_QUOTED_STRING);
 	if (!cp) return -1;
@@ -2208,6 +2214,15 @@ int cf_file_read(CONF_SECTION *cs, char const *filename)
 
 	cf_data_add(cs, tree, "filename", false);
 
+	return 0;
+}
+
+static int cf_file_read_items(CONF_SECTION *cs, char const *filename)
+{
+	int		i;
+	cf_stack_t	stack;
+	cf_stack_frame_t	*frame;
+
 #ifndef NDEBUG
 	memset(&stack, 0, sizeof(stack));
 #endif
@@ -2236,6 +2251,15 @@ int cf_file_read(CONF_SECTION *cs, char const *filename)
 
 	talloc_free(stack.buff);
 
+	return 0;
+}
+
+int cf_file_read(CONF_SECTION *cs, char const *filename)
+{
+	if (cf_file_read_init(cs, filename) < 0) return -1;
+
+	if (cf_file_read_items(cs, filename) < 0) return -1;
+
 	/*
 	 *	Now that we've read the file, go back through it and
 	 *	expand the variables.
@@ -2248,6 +2272,523 @@ int cf_file_read(CONF_SECTION *cs, char const *filename)
 	return 0;
 }
 
+/*
+ *	Cache of the items read by cf_file_read().
+ *
+ *	The cache starts with a header line, then has one line for
+ *	each file which was read.  If any of those files, or the
+ *	directories containing them, have changed, the cache is
+ *	ignored.
+ *
+ *	The items follow in the order they were read.  Each line
+ *	starts with 'S' (section), 'P' (pair) or 'E' (end of the
+ *	current section).  Numbers are written in decimal, and
+ *	strings as <length>:<data>, or '-' for no string.
+ */
+#define CF_CACHE_HEADER "FreeRADIUS-config-cache 1\n"
+
+static void cf_cache_str_write(FILE *fp, char const *str)
+{
+	size_t len;
+
+	if (!str) {
+		fputs(" -", fp);
+		return;
+	}
+
+	len = strlen(str);
+	fprintf(fp, " %zu:", len);
+	fwrite(str, len, 1, fp);
+}
+
+static int _cf_cache_file_write(void *data, void *uctx)
+{
+	cf_file_t	*file = data;
+	FILE		*fp = uctx;
+	char		*dir, *p;
+	struct stat	buf;
+
+	MEM(dir = talloc_strdup(NULL, file->filename));
+	p = strrchr(dir, FR_DIR_SEP);
+	if (p) *p = '\0';
+
+	if (stat(p ? dir : ".", &buf) < 0) {
+		talloc_free(dir);
+		return 1;
+	}
+	talloc_free(dir);
+
+	fprintf(fp, "F %" PRId64 " %" PRId64 " %" PRIu64 " %" PRId64,
+		(int64_t) file->buf.st_mtime, (int64_t) file->buf.st_size,
+		(uint64_t) file->buf.st_ino, (int64_t) buf.st_mtime);
+	cf_cache_str_write(fp, file->filename);
+	fputc('\n', fp);
+
+	return 0;
+}
+
+static void cf_cache_section_write(FILE *fp, CONF_ITEM *ci)
+{
+	for (; ci; ci = ci->next) {
+		switch (ci->type) {
+		case CONF_ITEM_SECTION:
+		{
+			CONF_SECTION	*cs = cf_item_to_section(ci);
+			int		i;
+
+			fprintf(fp, "S %d %d %d", ci->lineno, cs->name2_quote, cs->argc);
+			cf_cache_str_write(fp, ci->filename);
+			cf_cache_str_write(fp, cs->name1);
+			cf_cache_str_write(fp, cs->name2);
+			for (i = 0; i < cs->argc; i++) {
+				fprintf(fp, " %d", cs->argv_quote[i]);
+				cf_cache_str_write(fp, cs->argv[i]);
+			}
+			fputc('\n', fp);
+
+			cf_cache_section_write(fp, ci->child);
+
+			fputs("E\n", fp);
+		}
+			break;
+
+		case CONF_ITEM_PAIR:
+		{
+			CONF_PAIR *cp = cf_item_to_pair(ci);
+
+			fprintf(fp, "P %d %d %d %d %d", ci->lineno, cp->op, cp->lhs_quote, cp->rhs_quote, cp->pass2);
+			cf_cache_str_write(fp, ci->filename);
+			cf_cache_str_write(fp, cp->attr);
+			cf_cache_str_write(fp, cp->value);
+			fputc('\n', fp);
+		}
+			break;
+
+		/*
+		 *	Data is recreated when the cache is read.
+		 */
+		default:
+			break;
+		}
+	}
+}
+
+/** Write the items after "last" to a cache file
+ *
+ * The file is written under a temporary name, and renamed, so readers
+ * never see a partial cache.
+ */
+static int cf_cache_write(CONF_SECTION *cs, CONF_ITEM *last, char const *cache_file)
+{
+	rbtree_t	*tree;
+	char		*tmp;
+	FILE		*fp;
+	int		ret = -1;
+
+	tree = cf_data_value(cf_data_find(cs, rbtree_t, "filename"));
+	if (!tree) return -1;
+
+	MEM(tmp = talloc_asprintf(NULL, "%s.tmp", cache_file));
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		fr_strerror_printf("Failed opening %s: %s", tmp, fr_syserror(errno));
+		talloc_free(tmp);
+		return -1;
+	}
+
+	fputs(CF_CACHE_HEADER, fp);
+	if (rbtree_walk(tree, RBTREE_IN_ORDER, _cf_cache_file_write, fp) != 0) {
+		fr_strerror_printf("Failed checking configuration files");
+		goto done;
+	}
+
+	cf_cache_section_write(fp, last ? last->next : cs->item.child);
+
+	if (ferror(fp)) {
+		fr_strerror_printf("Failed writing %s", tmp);
+		goto done;
+	}
+
+	ret = 0;
+
+done:
+	if ((fclose(fp) < 0) && (ret == 0)) {
+		fr_strerror_printf("Failed writing %s: %s", tmp, fr_syserror(errno));
+		ret = -1;
+	}
+
+	if ((ret == 0) && (rename(tmp, cache_file) < 0)) {
+		fr_strerror_printf("Failed renaming %s: %s", tmp, fr_syserror(errno));
+		ret = -1;
+	}
+
+	if (ret < 0) unlink(tmp);
+	talloc_free(tmp);
+
+	return ret;
+}
+
+static int cf_cache_num(char **p, char const *end, int64_t *out)
+{
+	char *q;
+
+	if (*p >= end) return -1;
+	(*p)++;		/* separator */
+
+	*out = strtoll(*p, &q, 10);
+	if (q == *p) return -1;
+	*p = q;
+
+	return 0;
+}
+
+static int cf_cache_str(char **p, char const *end, char const **out)
+{
+	char		*q;
+	uint64_t	len;
+
+	if (*p >= end) return -1;
+	(*p)++;		/* separator */
+
+	if (**p == '-') {
+		(*p)++;
+		*out = NULL;
+		return 0;
+	}
+
+	len = strtoull(*p, &q, 10);
+	if ((q == *p) || (*q != ':')) return -1;
+	q++;
+
+	/*
+	 *	The byte after the string is a separator, which we
+	 *	overwrite to terminate the string.
+	 */
+	if (len >= (uint64_t) (end - q)) return -1;
+	q[len] = '\0';
+
+	*out = q;
+	*p = q + len;
+
+	return 0;
+}
+
+/** Check that none of the files the cache was built from have changed
+ *
+ * @return
+ *	- 1 if the cache is valid.
+ *	- 0 if it isn't.
+ */
+static int cf_cache_files_check(CONF_SECTION *cs, char **p, char const *end)
+{
+	rbtree_t	*tree;
+	char const	**filenames;
+	size_t		i, num = 0;
+
+	tree = cf_data_value(cf_data_find(cs, rbtree_t, "filename"));
+	fr_assert(tree);
+
+	MEM(filenames = talloc_array(NULL, char const *, 16));
+
+	while ((*p < end) && (**p == 'F')) {
+		int64_t		mtime, size, ino, dir_mtime;
+		char const	*filename;
+		char		*dir, *sep;
+		struct stat	buf;
+
+		if ((cf_cache_num(p, end, &mtime) < 0) ||
+		    (cf_cache_num(p, end, &size) < 0) ||
+		    (cf_cache_num(p, end, &ino) < 0) ||
+		    (cf_cache_num(p, end, &dir_mtime) < 0) ||
+		    (cf_cache_str(p, end, &filename) < 0) || !filename) goto invalid;
+		(*p)++;		/* end of line */
+
+		if ((stat(filename, &buf) < 0) ||
+		    ((int64_t) buf.st_mtime != mtime) || ((int64_t) buf.st_size != size) ||
+		    ((uint64_t) buf.st_ino != (uint64_t) ino)) {
+			DEBUG2("Configuration file %s has changed", filename);
+			goto invalid;
+		}
+
+		/*
+		 *	Files which are added to, or removed from,
+		 *	an included directory change its mtime.
+		 */
+		MEM(dir = talloc_strdup(NULL, filename));
+		sep = strrchr(dir, FR_DIR_SEP);
+		if (sep) *sep = '\0';
+
+		if ((stat(sep ? dir : ".", &buf) < 0) || ((int64_t) buf.st_mtime != dir_mtime)) {
+			DEBUG2("Configuration directory %s has changed", dir);
+			talloc_free(dir);
+			goto invalid;
+		}
+		talloc_free(dir);
+
+		if (num == talloc_array_length(filenames)) {
+			MEM(filenames = talloc_realloc(NULL, filenames, char const *, num * 2));
+		}
+		filenames[num++] = filename;
+	}
+
+	/*
+	 *	So that cf_file_changed() still works.  We don't know
+	 *	which section included each file, so any change is
+	 *	treated as a change to the main configuration.
+	 */
+	for (i = 0; i < num; i++) {
+		cf_file_t *file;
+
+		MEM(file = talloc_zero(tree, cf_file_t));
+		file->filename = talloc_strdup(file, filenames[i]);
+		file->cs = cs;
+		if (stat(file->filename, &file->buf) < 0) {
+			talloc_free(file);
+			continue;
+		}
+		if (!rbtree_insert(tree, file)) talloc_free(file);
+	}
+	talloc_free(filenames);
+
+	return 1;
+
+invalid:
+	talloc_free(filenames);
+	return 0;
+}
+
+/** Recreate the items from a cache
+ *
+ */
+static int cf_cache_items_read(CONF_SECTION *cs, char **p, char const *end)
+{
+	CONF_SECTION	*current = cs;
+
+	while (*p < end) {
+		int64_t		lineno;
+		char const	*filename;
+
+		switch (**p) {
+		case 'S':
+		{
+			int64_t		name2_quote, argc, i;
+			char const	*name1, *name2;
+			CONF_SECTION	*css;
+			bool		is_if;
+
+			if ((cf_cache_num(p, end, &lineno) < 0) ||
+			    (cf_cache_num(p, end, &name2_quote) < 0) ||
+			    (cf_cache_num(p, end, &argc) < 0) || (argc < 0) ||
+			    (cf_cache_str(p, end, &filename) < 0) ||
+			    (cf_cache_str(p, end, &name1) < 0) || !name1 ||
+			    (cf_cache_str(p, end, &name2) < 0)) goto error;
+
+			/*
+			 *	Conditions are stored as name2, but must
+			 *	not be expanded again.
+			 */
+			is_if = name2 && ((strcmp(name1, "if") == 0) || (strcmp(name1, "elsif") == 0));
+
+			css = cf_section_alloc(current, current, name1, is_if ? NULL : name2);
+			if (!css) goto error;
+
+			if (filename) cf_filename_set(css, filename);
+			cf_lineno_set(css, lineno);
+			css->name2_quote = name2_quote;
+
+			if (argc > 0) {
+				css->argv = talloc_array(css, char const *, argc);
+				css->argv_quote = talloc_array(css, fr_token_t, argc);
+
+				for (i = 0; i < argc; i++) {
+					int64_t		quote;
+					char const	*arg;
+
+					if ((cf_cache_num(p, end, &quote) < 0) ||
+					    (cf_cache_str(p, end, &arg) < 0) || !arg) goto error;
+
+					css->argv_quote[i] = quote;
+					css->argv[i] = talloc_typed_strdup(css->argv, arg);
+				}
+				css->argc = argc;
+			}
+
+			if (is_if) {
+				CONF_DATA const	*cd;
+				fr_dict_t const	*dict;
+				fr_cond_t	*cond;
+				char const	*error = NULL;
+
+				cd = cf_data_find_in_parent(current, fr_dict_t **, "dictionary");
+				if (!cd) {
+					dict = fr_dict_internal();	/* HACK - To fix policy sections */
+				} else {
+					dict = *((fr_dict_t **)cf_data_value(cd));
+				}
+
+				if (fr_cond_tokenize(css, &cond, &error, dict, name2, strlen(name2)) <= 0) {
+					cf_log_err(css, "Failed parsing cached condition: %s", error);
+					return -1;
+				}
+
+				MEM(css->name2 = talloc_typed_strdup(css, name2));
+				css->name2_quote = T_BARE_WORD;
+				cf_data_add(css, cond, NULL, false);
+			}
+
+			current = css;
+		}
+			break;
+
+		case 'P':
+		{
+			int64_t		op, lhs_quote, rhs_quote, pass2;
+			char const	*attr, *value;
+			CONF_PAIR	*cp;
+
+			if ((cf_cache_num(p, end, &lineno) < 0) ||
+			    (cf_cache_num(p, end, &op) < 0) ||
+			    (cf_cache_num(p, end, &lhs_quote) < 0) ||
+			    (cf_cache_num(p, end, &rhs_quote) < 0) ||
+			    (cf_cache_num(p, end, &pass2) < 0) ||
+			    (cf_cache_str(p, end, &filename) < 0) ||
+			    (cf_cache_str(p, end, &attr) < 0) || !attr ||
+			    (cf_cache_str(p, end, &value) < 0)) goto error;
+
+			cp = cf_pair_alloc(current, attr, value, op, lhs_quote, rhs_quote);
+			if (!cp) goto error;
+
+			if (filename) cf_filename_set(cp, filename);
+			cf_lineno_set(cp, lineno);
+			cp->pass2 = (pass2 != 0);
+			cf_item_add(current, &(cp->item));
+
+			if (cf_pair_on_read(current, cp) < 0) return -1;
+		}
+			break;
+
+		case 'E':
+			if (current == cs) goto error;
+
+			/*
+			 *	Sections are closed the same way as
+			 *	in cf_file_include(), except that any
+			 *	templates have already been merged.
+			 */
+			current = cf_item_to_section(current->item.parent);
+			(*p)++;
+			break;
+
+		default:
+			goto error;
+		}
+
+		(*p)++;		/* end of line */
+	}
+
+	if (current == cs) return 0;
+
+error:
+	ERROR("Configuration cache is corrupt, please delete it");
+	return -1;
+}
+
+/** Read a configuration file, using a cache of the result where possible
+ *
+ * If none of the configuration files or the directories containing
+ * them have changed since the cache was written, the items are read
+ * from the cache instead of being parsed again.  Otherwise the
+ * configuration is read as with #cf_file_read, and a new cache is
+ * written.
+ *
+ * @note Changes to environment variables referenced by the configuration
+ *	 are not detected.
+ *
+ * @param[in] cs		to read items into.
+ * @param[in] filename		of the main configuration file.
+ * @param[in] cache_file	to read or write the cache from.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cf_file_read_cached(CONF_SECTION *cs, char const *filename, char const *cache_file)
+{
+	CONF_ITEM	*last = NULL, *ci;
+	FILE		*fp;
+	char		*buffer = NULL, *p, *end;
+	struct stat	buf;
+
+	if (cf_file_read_init(cs, filename) < 0) return -1;
+
+	/*
+	 *	Items before this one were added by the caller, or
+	 *	by us, and aren't part of the cache.
+	 */
+	for (ci = cs->item.child; ci; ci = ci->next) last = ci;
+
+	fp = fopen(cache_file, "r");
+	if (!fp) {
+		if (errno != ENOENT) WARN("Failed opening configuration cache %s: %s",
+					  cache_file, fr_syserror(errno));
+		goto read;
+	}
+
+	if ((fstat(fileno(fp), &buf) < 0) || (buf.st_size <= 0)) {
+		fclose(fp);
+		goto read;
+	}
+
+	MEM(buffer = talloc_array(NULL, char, buf.st_size + 1));
+	if (fread(buffer, buf.st_size, 1, fp) != 1) {
+		fclose(fp);
+		talloc_free(buffer);
+		goto read;
+	}
+	fclose(fp);
+
+	buffer[buf.st_size] = '\0';
+	p = buffer;
+	end = buffer + buf.st_size;
+
+	if (strncmp(p, CF_CACHE_HEADER, sizeof(CF_CACHE_HEADER) - 1) != 0) {
+	invalid:
+		talloc_free(buffer);
+		goto read;
+	}
+	p += sizeof(CF_CACHE_HEADER) - 1;
+
+	if (!cf_cache_files_check(cs, &p, end)) goto invalid;
+
+	DEBUG2("Reading configuration from cache %s", cache_file);
+
+	cs->item.filename = talloc_strdup(cs, filename);
+
+	if (cf_cache_items_read(cs, &p, end) < 0) {
+		talloc_free(buffer);
+		return -1;
+	}
+	talloc_free(buffer);
+
+	goto pass2;
+
+read:
+	if (cf_file_read_items(cs, filename) < 0) return -1;
+
+	if (cf_cache_write(cs, last, cache_file) < 0) {
+		PWARN("Failed writing configuration cache");
+	} else {
+		DEBUG2("Wrote configuration cache %s", cache_file);
+	}
+
+pass2:
+	if (cf_section_pass2(cs) < 0) {
+		cf_log_err(cs, "Parsing config items failed");
+		return -1;
+	}
+
+	return 0;
+}
+
 void cf_file_free(CONF_SECTION *cs)
 {
 	talloc_free(cs);
@@ -48,6 +48,7 @@ extern "C" {
  *	Config file parsing
  */
 int		cf_file_read(CONF_SECTION *cs, char const *file);
+int		cf_file_read_cached(CONF_SECTION *cs, char const *file, char const *cache_file);
 int		cf_section_pass2(CONF_SECTION *cs);
 void		cf_file_free(CONF_SECTION *cs);
 
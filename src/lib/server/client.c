@@ -41,45 +41,22 @@ RCSID("$Id$")
 #include <fcntl.h>
 #include <sys/stat.h>
 
-//#define WITH_TRIE (1)
-
 /** Group of clients
  *
+ * Clients are kept in path-compressed tries, one per address family and
+ * transport, so finding the client for a packet is a single longest
+ * prefix match, however many networks are configured.
  */
 struct rad_client_list {
 	char const	*name;			//!< Name of the client list.
-#ifdef WITH_TRIE
 	fr_trie_t	*v4_udp;
 	fr_trie_t	*v6_udp;
 	fr_trie_t	*v4_tcp;
 	fr_trie_t	*v6_tcp;
-#else
-	rbtree_t	*tree[129];
-#endif
 };
 
 static RADCLIENT_LIST	*root_clients = NULL;	//!< Global client list.
 
-#ifndef WITH_TRIE
-static int client_cmp(void const *one, void const *two)
-{
-	int rcode;
-	RADCLIENT const *a = one;
-	RADCLIENT const *b = two;
-
-	rcode = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
-	if (rcode != 0) return rcode;
-
-	/*
-	 *	0 is "wildcard", or "both" protocols
-	 */
-	if ((a->proto == IPPROTO_IP) || (b->proto == IPPROTO_IP)) return 0;
-
-	return a->proto - b->proto;
-}
-
-#endif
-
 void client_list_free(void)
 {
 	TALLOC_FREE(root_clients);
@@ -112,7 +89,6 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
 
 	clients->name = talloc_strdup(clients, cs ? cf_section_name1(cs) : "root");
 
-#ifdef WITH_TRIE
 	clients->v4_udp = fr_trie_alloc(clients);
 	if (!clients->v4_udp) {
 		talloc_free(clients);
@@ -136,22 +112,15 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
 		talloc_free(clients);
 		return NULL;
 	}
-#endif	/* WITH_TRIE */
 
 	return clients;
 }
 
-#ifdef WITH_TRIE
 /*
- *	@todo - either support client definitions where "proto = *",
- *	or udpate this code to allow for that.  i.e. we create yet
- *	another set of v4/v6 tries, for "proto = *" clients.  And then
- *	do lookups there, too.  Or, just unify the udp/tcp tries, and
- *	instead do post-processing?  Though those two clients can have
- *	different secrets... and the trie code doesn't allow 2
- *	fr_trie_user_t nodes in a row.  So we would have to instead
- *	handle that ourselves, with a wrapper around the RADCLIENT
- *	structure that does udp/tcp/wildcard demultiplexing
+ *	A trie can only hold one client per network, so clients with
+ *	"proto = *" are inserted into both the UDP and the TCP tries.
+ *	That also makes them conflict with any other client for the
+ *	same network, whatever its protocol.
  */
 static fr_trie_t *clients_trie(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr,
 			       int proto)
@@ -168,7 +137,6 @@ static fr_trie_t *clients_trie(RADCLIENT_LIST const *clients, fr_ipaddr_t const
 
 	return clients->v6_udp;
 }
-#endif	/* WITH_TRIE */
 
 /** Add a client to a RADCLIENT_LIST
  *
@@ -180,11 +148,8 @@ static fr_trie_t *clients_trie(RADCLIENT_LIST const *clients, fr_ipaddr_t const
  */
 bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
-#ifdef WITH_TRIE
-	fr_trie_t *trie;
-#else
-#endif
-	RADCLIENT *old;
+	fr_trie_t *udp = NULL, *tcp = NULL;
+	RADCLIENT *old = NULL;
 	char buffer[FR_IPADDR_PREFIX_STRLEN];
 
 	if (!client) return false;
@@ -211,7 +176,7 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	}
 
 	fr_inet_ntop_prefix(buffer, sizeof(buffer), &client->ipaddr);
-	DEBUG3("Adding client %s (%s) to prefix tree %i", buffer, client->longname, client->ipaddr.prefix);
+	DEBUG3("Adding client %s (%s)", buffer, client->longname);
 
 	/*
 	 *	If "clients" is NULL, it means add to the global list,
@@ -222,15 +187,23 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 			CONF_SECTION *cs;
 			CONF_SECTION *subcs;
 
-			if (!client->cs) {
-				ERROR("Failed to find configuration section in client.  Ignoring 'virtual_server' directive");
-				return false;
-			}
-
-			cs = cf_section_find(cf_root(client->cs), "server", client->server);
+			/*
+			 *	Clients loaded in bulk have no
+			 *	CONF_SECTION, but have already found
+			 *	their virtual server.
+			 */
+			cs = client->server_cs;
 			if (!cs) {
-				ERROR("Failed to find virtual server %s", client->server);
-				return false;
+				if (!client->cs) {
+					ERROR("Failed to find configuration section in client.  Ignoring 'virtual_server' directive");
+					return false;
+				}
+
+				cs = cf_section_find(cf_root(client->cs), "server", client->server);
+				if (!cs) {
+					ERROR("Failed to find virtual server %s", client->server);
+					return false;
+				}
 			}
 
 			/*
@@ -274,26 +247,15 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 
 #define namecmp(a) ((!old->a && !client->a) || (old->a && client->a && (strcmp(old->a, client->a) == 0)))
 
-#ifdef WITH_TRIE
-	trie = clients_trie(clients, &client->ipaddr, client->proto);
+	if (client->proto != IPPROTO_TCP) udp = clients_trie(clients, &client->ipaddr, IPPROTO_UDP);
+	if (client->proto != IPPROTO_UDP) tcp = clients_trie(clients, &client->ipaddr, IPPROTO_TCP);
 
 	/*
 	 *	Cannot insert the same client twice.
 	 */
-	old = fr_trie_match(trie, &client->ipaddr.addr, client->ipaddr.prefix);
-
-#else  /* WITH_TRIE */
-
-	if (!clients->tree[client->ipaddr.prefix]) {
-		clients->tree[client->ipaddr.prefix] = rbtree_talloc_alloc(clients, client_cmp, RADCLIENT,
-									    NULL, RBTREE_FLAG_NONE);
-		if (!clients->tree[client->ipaddr.prefix]) {
-			return false;
-		}
-	}
+	if (udp) old = fr_trie_match(udp, &client->ipaddr.addr, client->ipaddr.prefix);
+	if (!old && tcp) old = fr_trie_match(tcp, &client->ipaddr.addr, client->ipaddr.prefix);
 
-	old = rbtree_finddata(clients->tree[client->ipaddr.prefix], client);
-#endif
 	if (old) {
 		/*
 		 *	If it's a complete duplicate, then free the new
@@ -314,20 +276,19 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	}
 #undef namecmp
 
-#ifdef WITH_TRIE
 	/*
 	 *	Other error adding client: likely is fatal.
 	 */
-	if (fr_trie_insert(trie, &client->ipaddr.addr, client->ipaddr.prefix, client) < 0) {
+	if (udp && (fr_trie_insert(udp, &client->ipaddr.addr, client->ipaddr.prefix, client) < 0)) {
 		client_free(client);
 		return false;
 	}
-#else
-	if (!rbtree_insert(clients->tree[client->ipaddr.prefix], client)) {
+
+	if (tcp && (fr_trie_insert(tcp, &client->ipaddr.addr, client->ipaddr.prefix, client) < 0)) {
+		if (udp) (void) fr_trie_remove(udp, &client->ipaddr.addr, client->ipaddr.prefix);
 		client_free(client);
 		return false;
 	}
-#endif
 
 	/*
 	 *	@todo - do we want to do this for dynamic clients?
@@ -341,29 +302,31 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 #ifdef WITH_DYNAMIC_CLIENTS
 void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
-#ifdef WITH_TRIE
 	fr_trie_t *trie;
-#endif
 
 	if (!client) return;
 
 	if (!clients) clients = root_clients;
 
-	fr_assert(client->ipaddr.prefix <= 128);
+	if (!clients) return;
 
-#ifdef WITH_TRIE
-	trie = clients_trie(clients, &client->ipaddr, client->proto);
+	fr_assert(client->ipaddr.prefix <= 128);
 
 	/*
 	 *	Don't free the client.  The caller is responsible for that.
+	 *
+	 *	Only remove entries which are this client, another
+	 *	client may have the same network on the other transport.
 	 */
-	(void) fr_trie_remove(trie, &client->ipaddr.addr, client->ipaddr.prefix);
-#else
-
-	if (!clients->tree[client->ipaddr.prefix]) return;
+	trie = clients_trie(clients, &client->ipaddr, IPPROTO_UDP);
+	if (fr_trie_match(trie, &client->ipaddr.addr, client->ipaddr.prefix) == client) {
+		(void) fr_trie_remove(trie, &client->ipaddr.addr, client->ipaddr.prefix);
+	}
 
-	(void) rbtree_deletebydata(clients->tree[client->ipaddr.prefix], client);
-#endif
+	trie = clients_trie(clients, &client->ipaddr, IPPROTO_TCP);
+	if (fr_trie_match(trie, &client->ipaddr.addr, client->ipaddr.prefix) == client) {
+		(void) fr_trie_remove(trie, &client->ipaddr.addr, client->ipaddr.prefix);
+	}
 }
 #endif
 
@@ -378,45 +341,28 @@ RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int
  */
 RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
 {
-#ifdef WITH_TRIE
-	fr_trie_t *trie;
-#else
-	int i, max;
-	RADCLIENT my_client, *client;
-#endif
+	RADCLIENT *udp, *tcp;
 
 	if (!clients) clients = root_clients;
 
 	if (!clients || !ipaddr) return NULL;
 
-#ifdef WITH_TRIE
-	trie = clients_trie(clients, ipaddr, proto);
+	if ((ipaddr->af != AF_INET) && (ipaddr->af != AF_INET6)) return NULL;
 
-	return fr_trie_lookup(trie, &ipaddr->addr, ipaddr->prefix);
-#else
-
-	if (proto == AF_INET) {
-		max = 32;
-	} else {
-		max = 128;
+	if (proto != IPPROTO_IP) {
+		return fr_trie_lookup(clients_trie(clients, ipaddr, proto), &ipaddr->addr, ipaddr->prefix);
 	}
 
-	if (max > ipaddr->prefix) max = ipaddr->prefix;
-
-	my_client.proto = proto;
-	for (i = max; i >= 0; i--) {
-		if (!clients->tree[i]) continue;
-
-		my_client.ipaddr = *ipaddr;
-		fr_ipaddr_mask(&my_client.ipaddr, i);
-		client = rbtree_finddata(clients->tree[i], &my_client);
-		if (client) {
-			return client;
-		}
-	}
+	/*
+	 *	Any protocol will do, so take whichever client
+	 *	has the longer prefix.
+	 */
+	udp = fr_trie_lookup(clients_trie(clients, ipaddr, IPPROTO_UDP), &ipaddr->addr, ipaddr->prefix);
+	tcp = fr_trie_lookup(clients_trie(clients, ipaddr, IPPROTO_TCP), &ipaddr->addr, ipaddr->prefix);
+	if (!udp) return tcp;
+	if (!tcp) return udp;
 
-	return NULL;
-#endif
+	return (tcp->ipaddr.prefix > udp->ipaddr.prefix) ? tcp : udp;
 }
 
 static fr_ipaddr_t cl_ipaddr;
@@ -429,6 +375,10 @@ static CONF_PARSER limit_config[] = {
 	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, RADCLIENT, limit.lifetime), .dflt = "0" },
 
 	{ FR_CONF_OFFSET("idle_timeout", FR_TYPE_UINT32, RADCLIENT, limit.idle_timeout), .dflt = "30" },
+
+	{ FR_CONF_OFFSET("max_packet_rate", FR_TYPE_UINT32, RADCLIENT, rate_limit), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("max_packet_burst", FR_TYPE_UINT32, RADCLIENT, rate_burst), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -888,12 +838,23 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *serv
 			c->limit.idle_timeout = 0;
 	}
 
+	/*
+	 *	A burst of zero means "one second's worth of packets".
+	 */
+	if (c->rate_limit) {
+		if (!c->rate_burst) c->rate_burst = c->rate_limit;
+
+		MEM(c->rate_stats = talloc_zero(c, fr_client_rate_stats_t));
+	}
+
 	return c;
 }
 
-/** Add a client from a result set (SQL)
+/** Allocate a client from a row of a result set (SQL)
  *
- * @todo This function should die. SQL should use client_afrom_cs.
+ * This is the bulk loading path.  It fills in the RADCLIENT directly,
+ * without building a CONF_SECTION for each client, which matters when
+ * loading tens of thousands of clients at startup.
  *
  * @param ctx Talloc context.
  * @param identifier Client IP Address / IPv4 subnet / IPv6 subnet / FQDN.
@@ -928,10 +889,24 @@ RADCLIENT *client_afrom_query(TALLOC_CTX *ctx, char const *identifier, char cons
 	 *	Other values (secret, shortname, nas_type, virtual_server)
 	 */
 	c->secret = talloc_typed_strdup(c, secret);
-	if (shortname) c->shortname = talloc_typed_strdup(c, shortname);
-	if (type) c->nas_type = talloc_typed_strdup(c, type);
-	if (server) c->server = talloc_typed_strdup(c, server);
+	c->shortname = talloc_typed_strdup(c, (shortname && *shortname) ? shortname : identifier);
+	if (type && *type) c->nas_type = talloc_typed_strdup(c, type);
 	c->message_authenticator = require_ma;
+	c->proto = IPPROTO_UDP;
+
+	/*
+	 *	There's no CONF_SECTION for client_add() to look
+	 *	the virtual server up with, so do it here.
+	 */
+	if (server && *server) {
+		c->server = talloc_typed_strdup(c, server);
+		c->server_cs = virtual_server_find(c->server);
+		if (!c->server_cs) {
+			ERROR("Failed to find virtual server %s for client %s", c->server, c->shortname);
+			talloc_free(c);
+			return NULL;
+		}
+	}
 
 	return c;
 }
@@ -71,6 +71,22 @@ typedef int (*client_value_cb_t)(char **out, CONF_PAIR const *cp, void *data);
 #include <freeradius-devel/server/stats.h>
 #include <freeradius-devel/util/inet.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** Counters for packets which exceeded a client's rate limit
+ *
+ *  These are updated by every network thread which reads packets
+ *  for the client, so they're atomic.
+ */
+typedef struct {
+	atomic_uint_fast64_t	dropped;		//!< Packets discarded because the client was over its limit.
+	atomic_uint_fast64_t	deferred;		//!< Times reading from a connected socket was delayed.
+} fr_client_rate_stats_t;
+
 /** Describes a host allowed to send packets to the server
  *
  */
@@ -117,6 +133,12 @@ struct rad_client {
 
 	int			proto;			//!< Protocol number.
 	fr_socket_limit_t	limit;			//!< Connections per client (TCP clients only).
+
+	uint32_t		rate_limit;		//!< Maximum packets per second, or 0 for no limit.
+	uint32_t		rate_burst;		//!< Packets which can be received at once
+							//!< before rate_limit applies.
+	fr_client_rate_stats_t	*rate_stats;		//!< Rate limit counters, shared with copies of
+							//!< this client.
 };
 
 RADCLIENT_LIST	*client_list_init(CONF_SECTION *cs);
@@ -221,7 +221,7 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 	uint32_t	subcaptures;
 	int		ret;
 
-	regex_t		*preg, *rreg = NULL;
+	regex_t		*preg;
 	fr_regmatch_t	*regmatch;
 
 	if (!fr_cond_assert(lhs != NULL)) return -1;
@@ -237,15 +237,14 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 	default:
 		if (!fr_cond_assert(rhs && rhs->type == FR_TYPE_STRING)) return -1;
 		if (!fr_cond_assert(rhs && rhs->vb_strvalue)) return -1;
-		slen = regex_compile(request, &rreg, rhs->vb_strvalue, rhs->datum.length,
-				     &tmpl_regex_flags(map->rhs), true, true);
+		slen = regex_compile_cached(request, &preg, rhs->vb_strvalue, rhs->datum.length,
+					    &tmpl_regex_flags(map->rhs), true);
 		if (slen <= 0) {
 			REMARKER(rhs->vb_strvalue, -slen, "%s", fr_strerror());
 			EVAL_DEBUG("FAIL %d", __LINE__);
 
 			return -1;
 		}
-		preg = rreg;
 		break;
 	}
 
@@ -278,7 +277,6 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 	}
 
 	talloc_free(regmatch);	/* free if not consumed */
-	if (preg) talloc_free(rreg);
 
 	return ret;
 }
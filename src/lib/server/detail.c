@@ -0,0 +1,591 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/detail.c
+ * @brief Binary detail file format.
+ *
+ * A binary detail file is a sequence of blocks.  Each block is a
+ * header, followed by one or more records, which may be compressed
+ * as a single zstd frame.  Writers only ever append whole blocks, so
+ * there is no file header, and many writers can share a file opened
+ * with O_APPEND.
+ *
+ * Block header, 20 bytes:
+ *   magic[4] version[1] compression[1] flags[1] reserved[1]
+ *   num_records[4] raw_len[4] stored_len[4]
+ *
+ * Record, inside the (decompressed) block:
+ *   magic[1] flags[1] reserved[2] length[4] protocol[4] timestamp[8]
+ *   protocol_len[4] protocol pairs[protocol_len] internal pairs[...]
+ *
+ * Both lists of pairs use the versioned internal encoding.  Pairs
+ * from the protocol dictionary are decoded with the dictionary named
+ * by "protocol", and the rest with the internal dictionary.
+ *
+ * A file which has been closed can end with an index block, listing
+ * the offset of every other block, followed by a 16 byte trailer:
+ *   magic[4] num_entries[4] index_offset[8]
+ *
+ * All integers are in network byte order.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/detail.h>
+#include <freeradius-devel/internal/internal.h>
+#include <freeradius-devel/util/net.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <unistd.h>
+
+#ifdef HAVE_ZSTD_H
+#  include <zstd.h>
+#endif
+
+fr_table_num_sorted_t const fr_detail_compress_table[] = {
+	{ "none",	FR_DETAIL_COMPRESS_NONE },
+	{ "zstd",	FR_DETAIL_COMPRESS_ZSTD }
+};
+size_t fr_detail_compress_table_len = NUM_ELEMENTS(fr_detail_compress_table);
+
+/** Write a block header
+ *
+ * @param[out] out	Where to write the header.
+ * @param[in] block	to encode.
+ */
+void fr_detail_block_header_encode(uint8_t out[static FR_DETAIL_BLOCK_HDR_LEN], fr_detail_block_t const *block)
+{
+	memcpy(out, FR_DETAIL_BLOCK_MAGIC, FR_DETAIL_MAGIC_LEN);
+	out[4] = FR_DETAIL_VERSION;
+	out[5] = block->compress;
+	out[FR_DETAIL_BLOCK_FLAGS_OFFSET] = block->flags;
+	out[7] = 0;
+	fr_net_from_uint32(out + 8, block->num_records);
+	fr_net_from_uint32(out + 12, block->raw_len);
+	fr_net_from_uint32(out + 16, block->stored_len);
+}
+
+/** Read a block header
+ *
+ * @param[out] block	The decoded header.
+ * @param[in] data	to decode.
+ * @param[in] data_len	Length of data.
+ * @return
+ *	- FR_DETAIL_BLOCK_HDR_LEN on success.
+ *	- 0 if there isn't a whole header.
+ *	- <0 if the header is malformed.
+ */
+ssize_t fr_detail_block_header_decode(fr_detail_block_t *block, uint8_t const *data, size_t data_len)
+{
+	if (data_len < FR_DETAIL_BLOCK_HDR_LEN) return 0;
+
+	if (!fr_detail_is_binary(data, data_len)) {
+		fr_strerror_printf("Invalid block magic");
+		return -1;
+	}
+
+	if (data[4] != FR_DETAIL_VERSION) {
+		fr_strerror_printf("Unsupported block version %u, expected %u", data[4], FR_DETAIL_VERSION);
+		return -1;
+	}
+
+	if (data[5] > FR_DETAIL_COMPRESS_ZSTD) {
+		fr_strerror_printf("Unknown block compression %u", data[5]);
+		return -1;
+	}
+
+	block->compress = data[5];
+	block->flags = data[FR_DETAIL_BLOCK_FLAGS_OFFSET];
+	block->num_records = fr_net_to_uint32(data + 8);
+	block->raw_len = fr_net_to_uint32(data + 12);
+	block->stored_len = fr_net_to_uint32(data + 16);
+
+	if ((block->raw_len > FR_DETAIL_BLOCK_MAX) || (block->stored_len > FR_DETAIL_BLOCK_MAX)) {
+		fr_strerror_printf("Block is too large (%u bytes)", block->raw_len);
+		return -1;
+	}
+
+	if ((block->compress == FR_DETAIL_COMPRESS_NONE) && (block->raw_len != block->stored_len)) {
+		fr_strerror_printf("Uncompressed block has stored length %u, expected %u",
+				   block->stored_len, block->raw_len);
+		return -1;
+	}
+
+	return FR_DETAIL_BLOCK_HDR_LEN;
+}
+
+/** The largest a block holding records_len bytes of records can be
+ *
+ */
+size_t fr_detail_block_bound(size_t records_len, fr_detail_compress_t compress)
+{
+#ifdef HAVE_ZSTD_H
+	if (compress == FR_DETAIL_COMPRESS_ZSTD) {
+		size_t bound = ZSTD_compressBound(records_len);
+
+		if (bound > records_len) return FR_DETAIL_BLOCK_HDR_LEN + bound;
+	}
+#endif
+
+	return FR_DETAIL_BLOCK_HDR_LEN + records_len;
+}
+
+/** Wrap a run of records in a block, compressing them if asked
+ *
+ * If the records don't get any smaller, they're stored uncompressed.
+ *
+ * @param[out] out		Where to write the block, of at least
+ *				fr_detail_block_bound() bytes.
+ * @param[in] outlen		Length of out.
+ * @param[in] records		Encoded records.
+ * @param[in] records_len	Length of records.
+ * @param[in] num_records	The number of records.
+ * @param[in] compress		How to store the records.
+ * @param[in] level		zstd compression level.
+ * @return
+ *	- The length of the block.
+ *	- <0 on error.
+ */
+ssize_t fr_detail_block_encode(uint8_t *out, size_t outlen, uint8_t const *records, size_t records_len,
+			       uint32_t num_records, fr_detail_compress_t compress, int level)
+{
+	fr_detail_block_t	block = {
+					.compress = FR_DETAIL_COMPRESS_NONE,
+					.num_records = num_records,
+					.raw_len = records_len,
+					.stored_len = records_len
+				};
+
+	if (records_len > FR_DETAIL_BLOCK_MAX) {
+		fr_strerror_printf("Too many records for one block (%zu bytes)", records_len);
+		return -1;
+	}
+
+	if (outlen < FR_DETAIL_BLOCK_HDR_LEN) {
+	too_small:
+		fr_strerror_printf("Insufficient buffer space");
+		return -1;
+	}
+
+	switch (compress) {
+	case FR_DETAIL_COMPRESS_NONE:
+		break;
+
+	case FR_DETAIL_COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD_H
+	{
+		size_t	slen;
+
+		slen = ZSTD_compress(out + FR_DETAIL_BLOCK_HDR_LEN, outlen - FR_DETAIL_BLOCK_HDR_LEN,
+				     records, records_len, level);
+		if (ZSTD_isError(slen)) {
+			if (outlen < (FR_DETAIL_BLOCK_HDR_LEN + records_len)) {
+				fr_strerror_printf("Failed compressing block: %s", ZSTD_getErrorName(slen));
+				return -1;
+			}
+			break;
+		}
+
+		if (slen >= records_len) break;
+
+		block.compress = FR_DETAIL_COMPRESS_ZSTD;
+		block.stored_len = slen;
+	}
+		break;
+#else
+		fr_strerror_printf("Can't compress block, zstd support is not available");
+		return -1;
+#endif
+	}
+
+	if (block.compress == FR_DETAIL_COMPRESS_NONE) {
+		if (outlen < (FR_DETAIL_BLOCK_HDR_LEN + records_len)) goto too_small;
+		memcpy(out + FR_DETAIL_BLOCK_HDR_LEN, records, records_len);
+	}
+
+	fr_detail_block_header_encode(out, &block);
+
+	return FR_DETAIL_BLOCK_HDR_LEN + block.stored_len;
+}
+
+/** Get the records from a block
+ *
+ * @param[out] out	Where to write the records, of at least
+ *			block->raw_len bytes.
+ * @param[in] outlen	Length of out.
+ * @param[in] block	Header of the block.
+ * @param[in] data	Data following the header, of block->stored_len bytes.
+ * @return
+ *	- The length of the records.
+ *	- <0 on error.
+ */
+ssize_t fr_detail_block_decompress(uint8_t *out, size_t outlen, fr_detail_block_t const *block, uint8_t const *data)
+{
+	if (outlen < block->raw_len) {
+		fr_strerror_printf("Insufficient buffer space");
+		return -1;
+	}
+
+	switch (block->compress) {
+	case FR_DETAIL_COMPRESS_NONE:
+		memcpy(out, data, block->raw_len);
+		break;
+
+	case FR_DETAIL_COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD_H
+	{
+		size_t	slen;
+
+		slen = ZSTD_decompress(out, outlen, data, block->stored_len);
+		if (ZSTD_isError(slen)) {
+			fr_strerror_printf("Failed decompressing block: %s", ZSTD_getErrorName(slen));
+			return -1;
+		}
+
+		if (slen != block->raw_len) {
+			fr_strerror_printf("Block decompressed to %zu bytes, expected %u", slen, block->raw_len);
+			return -1;
+		}
+	}
+		break;
+#else
+		fr_strerror_printf("Block is compressed with zstd, which is not supported by this build");
+		return -1;
+#endif
+	}
+
+	return block->raw_len;
+}
+
+/** Encode the pairs from one dictionary
+ *
+ */
+static ssize_t detail_encode_pairs(uint8_t *out, size_t outlen, fr_dict_t const *dict,
+				   VALUE_PAIR *vps, VALUE_PAIR *extra, fr_detail_skip_t skip, void *uctx)
+{
+	uint8_t		*p = out, *end = out + outlen;
+	VALUE_PAIR	*lists[] = { vps, extra };
+	size_t		i;
+
+	if (outlen < 1) {
+		fr_strerror_printf("Insufficient buffer space");
+		return -1;
+	}
+	*p++ = FR_INTERNAL_VERSION;
+
+	for (i = 0; i < NUM_ELEMENTS(lists); i++) {
+		fr_cursor_t	cursor;
+		VALUE_PAIR	*vp;
+
+		vp = fr_cursor_init(&cursor, &lists[i]);
+		while (vp) {
+			ssize_t	slen;
+
+			if ((fr_dict_by_da(vp->da) != dict) || (skip && skip(vp, uctx))) {
+				vp = fr_cursor_next(&cursor);
+				continue;
+			}
+
+			slen = fr_internal_encode_pair(p, end - p, &cursor, NULL);
+			if (slen < 0) {
+				fr_strerror_printf("Insufficient buffer space");
+				return -1;
+			}
+
+			/*
+			 *	Nothing encoded, don't loop forever.
+			 */
+			if (slen == 0) {
+				vp = fr_cursor_next(&cursor);
+				continue;
+			}
+
+			p += slen;
+			vp = fr_cursor_current(&cursor);
+		}
+	}
+
+	return p - out;
+}
+
+/** Encode a record
+ *
+ * @param[out] out	Where to write the record.
+ * @param[in] outlen	Length of out.
+ * @param[in] rec	Fixed fields of the record.  The flags are ignored.
+ * @param[in] dict	Protocol dictionary.  Pairs which are neither from
+ *			this dictionary, nor the internal one, are skipped.
+ * @param[in] vps	Pairs to encode.
+ * @param[in] extra	More pairs to encode, may be NULL.
+ * @param[in] skip	Called for each pair, may be NULL.
+ * @param[in] uctx	Passed to skip.
+ * @return
+ *	- The length of the record.
+ *	- <0 on error.
+ */
+ssize_t fr_detail_record_encode(uint8_t *out, size_t outlen, fr_detail_record_t const *rec,
+				fr_dict_t const *dict, VALUE_PAIR *vps, VALUE_PAIR *extra,
+				fr_detail_skip_t skip, void *uctx)
+{
+	uint8_t		*p = out + FR_DETAIL_RECORD_HDR_LEN, *end = out + outlen;
+	ssize_t		slen;
+
+	if (outlen < FR_DETAIL_RECORD_HDR_LEN) {
+		fr_strerror_printf("Insufficient buffer space");
+		return -1;
+	}
+
+	slen = detail_encode_pairs(p, end - p, dict, vps, extra, skip, uctx);
+	if (slen < 0) return -1;
+	fr_net_from_uint32(out + 20, slen);
+	p += slen;
+
+	slen = detail_encode_pairs(p, end - p, fr_dict_internal(), vps, extra, skip, uctx);
+	if (slen < 0) return -1;
+	p += slen;
+
+	if ((p - out) > FR_DETAIL_BLOCK_MAX) {
+		fr_strerror_printf("Record is too large (%zu bytes)", (size_t) (p - out));
+		return -1;
+	}
+
+	out[0] = FR_DETAIL_RECORD_MAGIC;
+	out[FR_DETAIL_RECORD_FLAGS_OFFSET] = 0;
+	out[2] = out[3] = 0;
+	fr_net_from_uint32(out + 4, p - out);
+	fr_net_from_uint32(out + 8, rec->protocol);
+	fr_net_from_uint64(out + 12, rec->timestamp);
+
+	return p - out;
+}
+
+/** Find the length of the next record in a block
+ *
+ * @param[in] data	Start of the record.
+ * @param[in] data_len	Bytes left in the block.
+ * @return
+ *	- The length of the record.
+ *	- 0 if the data doesn't contain the whole record.
+ *	- <0 if the record is malformed.
+ */
+ssize_t fr_detail_record_len(uint8_t const *data, size_t data_len)
+{
+	uint32_t	len;
+
+	if (data_len < FR_DETAIL_RECORD_HDR_LEN) return 0;
+
+	if (data[0] != FR_DETAIL_RECORD_MAGIC) {
+		fr_strerror_printf("Invalid record magic");
+		return -1;
+	}
+
+	len = fr_net_to_uint32(data + 4);
+	if ((len < FR_DETAIL_RECORD_HDR_LEN) || (len > FR_DETAIL_BLOCK_MAX) ||
+	    (fr_net_to_uint32(data + 20) > (len - FR_DETAIL_RECORD_HDR_LEN))) {
+		fr_strerror_printf("Invalid record length %u", len);
+		return -1;
+	}
+
+	if (len > data_len) return 0;
+
+	return len;
+}
+
+/** Decode a record
+ *
+ * @param[in] ctx	to allocate the pairs in.
+ * @param[out] out	List to append the pairs to.  Unmodified on error.
+ * @param[out] dict	Protocol dictionary of the record.
+ * @param[out] rec	Fixed fields of the record.
+ * @param[in] data	The record.
+ * @param[in] data_len	Length of data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_detail_record_decode(TALLOC_CTX *ctx, VALUE_PAIR **out, fr_dict_t const **dict,
+			    fr_detail_record_t *rec, uint8_t const *data, size_t data_len)
+{
+	ssize_t		len;
+	size_t		protocol_len;
+	VALUE_PAIR	*head = NULL;
+
+	len = fr_detail_record_len(data, data_len);
+	if (len <= 0) {
+		if (len == 0) fr_strerror_printf("Truncated record");
+		return -1;
+	}
+
+	rec->flags = data[FR_DETAIL_RECORD_FLAGS_OFFSET];
+	rec->protocol = fr_net_to_uint32(data + 8);
+	rec->timestamp = fr_net_to_uint64(data + 12);
+	protocol_len = fr_net_to_uint32(data + 20);
+
+	*dict = fr_dict_by_protocol_num(rec->protocol);
+	if (!*dict) {
+		fr_strerror_printf("Unknown protocol %u", rec->protocol);
+		return -1;
+	}
+
+	data += FR_DETAIL_RECORD_HDR_LEN;
+	len -= FR_DETAIL_RECORD_HDR_LEN;
+
+	if ((protocol_len > 0) &&
+	    (fr_internal_decode_list(ctx, &head, *dict, data, protocol_len, NULL) < 0)) return -1;
+
+	if (((size_t) len > protocol_len) &&
+	    (fr_internal_decode_list(ctx, &head, fr_dict_internal(), data + protocol_len,
+				     len - protocol_len, NULL) < 0)) {
+		fr_pair_list_free(&head);
+		return -1;
+	}
+
+	fr_pair_add(out, head);
+
+	return 0;
+}
+
+/** Encode the block index, and the trailer which points to it
+ *
+ * @param[out] out	Where to write the index.
+ * @param[in] outlen	Length of out.
+ * @param[in] index	One entry for each block in the file.
+ * @param[in] num	Number of entries.
+ * @param[in] offset	Where the index will be written in the file.
+ * @return
+ *	- The length of the index and trailer.
+ *	- <0 on error.
+ */
+ssize_t fr_detail_index_encode(uint8_t *out, size_t outlen,
+			       fr_detail_index_t const *index, uint32_t num, uint64_t offset)
+{
+	fr_detail_block_t	block = {
+					.compress = FR_DETAIL_COMPRESS_NONE,
+					.flags = FR_DETAIL_FLAG_INDEX,
+					.num_records = num,
+					.raw_len = num * FR_DETAIL_INDEX_ENTRY_LEN,
+					.stored_len = num * FR_DETAIL_INDEX_ENTRY_LEN
+				};
+	uint8_t			*p;
+	uint32_t		i;
+
+	if ((block.raw_len > FR_DETAIL_BLOCK_MAX) || (num > (FR_DETAIL_BLOCK_MAX / FR_DETAIL_INDEX_ENTRY_LEN))) {
+		fr_strerror_printf("Too many blocks to index");
+		return -1;
+	}
+
+	if (outlen < (FR_DETAIL_BLOCK_HDR_LEN + block.raw_len + FR_DETAIL_TRAILER_LEN)) {
+		fr_strerror_printf("Insufficient buffer space");
+		return -1;
+	}
+
+	fr_detail_block_header_encode(out, &block);
+	p = out + FR_DETAIL_BLOCK_HDR_LEN;
+
+	for (i = 0; i < num; i++) {
+		fr_net_from_uint64(p, index[i].offset);
+		fr_net_from_uint32(p + 8, index[i].num_records);
+		p += FR_DETAIL_INDEX_ENTRY_LEN;
+	}
+
+	memcpy(p, FR_DETAIL_INDEX_MAGIC, FR_DETAIL_MAGIC_LEN);
+	fr_net_from_uint32(p + 4, num);
+	fr_net_from_uint64(p + 8, offset);
+	p += FR_DETAIL_TRAILER_LEN;
+
+	return p - out;
+}
+
+/** Read the block index of a file, if it has one
+ *
+ * @param[in] ctx	to allocate the index in.
+ * @param[out] out	The index entries.
+ * @param[out] num	Number of entries.
+ * @param[out] offset	Of the index block.  Block data ends here.
+ * @param[in] fd	To read from.
+ * @param[in] file_size	Size of the file.
+ * @return
+ *	- 1 if the file has an index.
+ *	- 0 if it doesn't.
+ *	- -1 on error.
+ */
+int fr_detail_index_read(TALLOC_CTX *ctx, fr_detail_index_t **out, uint32_t *num,
+			 uint64_t *offset, int fd, off_t file_size)
+{
+	uint8_t			trailer[FR_DETAIL_TRAILER_LEN];
+	uint8_t			*data, *p;
+	fr_detail_block_t	block;
+	fr_detail_index_t	*index;
+	uint32_t		i;
+	size_t			len;
+
+	if (file_size < (FR_DETAIL_BLOCK_HDR_LEN + FR_DETAIL_TRAILER_LEN)) return 0;
+
+	if (pread(fd, trailer, sizeof(trailer), file_size - sizeof(trailer)) != sizeof(trailer)) {
+		fr_strerror_printf("Failed reading index trailer: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (memcmp(trailer, FR_DETAIL_INDEX_MAGIC, FR_DETAIL_MAGIC_LEN) != 0) return 0;
+
+	*num = fr_net_to_uint32(trailer + 4);
+	*offset = fr_net_to_uint64(trailer + 8);
+
+	if (*num > (FR_DETAIL_BLOCK_MAX / FR_DETAIL_INDEX_ENTRY_LEN)) {
+	bad_index:
+		fr_strerror_printf("Malformed index");
+		return -1;
+	}
+
+	len = FR_DETAIL_BLOCK_HDR_LEN + (*num * FR_DETAIL_INDEX_ENTRY_LEN);
+	if ((*offset + len + FR_DETAIL_TRAILER_LEN) != (uint64_t) file_size) goto bad_index;
+
+	data = talloc_array(ctx, uint8_t, len);
+	if (!data) return -1;
+
+	if (pread(fd, data, len, *offset) != (ssize_t) len) {
+		fr_strerror_printf("Failed reading index: %s", fr_syserror(errno));
+		talloc_free(data);
+		return -1;
+	}
+
+	if ((fr_detail_block_header_decode(&block, data, len) <= 0) ||
+	    !(block.flags & FR_DETAIL_FLAG_INDEX) || (block.num_records != *num)) {
+		talloc_free(data);
+		goto bad_index;
+	}
+
+	index = talloc_array(ctx, fr_detail_index_t, *num);
+	if (!index) {
+		talloc_free(data);
+		return -1;
+	}
+
+	p = data + FR_DETAIL_BLOCK_HDR_LEN;
+	for (i = 0; i < *num; i++) {
+		index[i].offset = fr_net_to_uint64(p);
+		index[i].num_records = fr_net_to_uint32(p + 8);
+		p += FR_DETAIL_INDEX_ENTRY_LEN;
+	}
+	talloc_free(data);
+
+	*out = index;
+	return 1;
+}
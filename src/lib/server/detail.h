@@ -0,0 +1,148 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/detail.h
+ * @brief Binary detail file format.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(server_detail_h, "$Id$")
+
+#include <freeradius-devel/util/dict.h>
+#include <freeradius-devel/util/pair.h>
+#include <freeradius-devel/util/table.h>
+#include <freeradius-devel/util/time.h>
+
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_DETAIL_VERSION		(1)
+
+#define FR_DETAIL_MAGIC_LEN		(4)
+#define FR_DETAIL_BLOCK_MAGIC		"\xfd" "DTB"	//!< Starts every block.
+#define FR_DETAIL_INDEX_MAGIC		"\xfd" "DTI"	//!< Starts the trailer after the index block.
+#define FR_DETAIL_RECORD_MAGIC		(0xfd)		//!< Never the first byte of a text entry.
+
+#define FR_DETAIL_BLOCK_HDR_LEN		(20)
+#define FR_DETAIL_BLOCK_FLAGS_OFFSET	(6)		//!< Where the flags live in a block header.
+#define FR_DETAIL_RECORD_HDR_LEN	(24)
+#define FR_DETAIL_RECORD_FLAGS_OFFSET	(1)		//!< Where the flags live in a record header.
+#define FR_DETAIL_INDEX_ENTRY_LEN	(12)
+#define FR_DETAIL_TRAILER_LEN		(16)
+
+#define FR_DETAIL_BLOCK_MAX		(1 << 24)	//!< Largest decompressed block we accept.
+
+#define FR_DETAIL_FLAG_DONE		(0x01)		//!< Record, or every record in the block, was replayed.
+#define FR_DETAIL_FLAG_INDEX		(0x02)		//!< Block holds the index, not records.
+
+/** How the records in a block are stored
+ *
+ */
+typedef enum {
+	FR_DETAIL_COMPRESS_NONE = 0,			//!< Records follow the header as-is.
+	FR_DETAIL_COMPRESS_ZSTD				//!< Records are one zstd frame.
+} fr_detail_compress_t;
+
+extern fr_table_num_sorted_t const fr_detail_compress_table[];
+extern size_t fr_detail_compress_table_len;
+
+/** A decoded block header
+ *
+ */
+typedef struct {
+	fr_detail_compress_t	compress;		//!< How the records are stored.
+	uint8_t			flags;			//!< FR_DETAIL_FLAG_* values.
+	uint32_t		num_records;		//!< Records in the block, or entries in the index.
+	uint32_t		raw_len;		//!< Length of the records once decompressed.
+	uint32_t		stored_len;		//!< Length of the data following the header.
+} fr_detail_block_t;
+
+/** The fixed fields of a record
+ *
+ */
+typedef struct {
+	uint8_t			flags;			//!< FR_DETAIL_FLAG_* values.
+	uint32_t		protocol;		//!< Number of the dictionary the pairs came from.
+	fr_unix_time_t		timestamp;		//!< When the original packet was received.
+} fr_detail_record_t;
+
+/** One entry in the block index
+ *
+ */
+typedef struct {
+	uint64_t		offset;			//!< Of the block header in the file.
+	uint32_t		num_records;		//!< Records in the block.
+} fr_detail_index_t;
+
+/** Return true if a pair should not be written to a record
+ *
+ */
+typedef bool (*fr_detail_skip_t)(VALUE_PAIR const *vp, void *uctx);
+
+/** Whether a buffer starts with a binary detail block, or is a text detail file
+ *
+ */
+static inline bool fr_detail_is_binary(uint8_t const *data, size_t data_len)
+{
+	return (data_len >= FR_DETAIL_MAGIC_LEN) && (memcmp(data, FR_DETAIL_BLOCK_MAGIC, FR_DETAIL_MAGIC_LEN) == 0);
+}
+
+/** Whether an entry handed to the detail decoder is a binary record
+ *
+ */
+static inline bool fr_detail_record_is_binary(uint8_t const *data, size_t data_len)
+{
+	return (data_len >= FR_DETAIL_RECORD_HDR_LEN) && (data[0] == FR_DETAIL_RECORD_MAGIC);
+}
+
+void		fr_detail_block_header_encode(uint8_t out[static FR_DETAIL_BLOCK_HDR_LEN], fr_detail_block_t const *block);
+
+ssize_t		fr_detail_block_header_decode(fr_detail_block_t *block, uint8_t const *data, size_t data_len);
+
+size_t		fr_detail_block_bound(size_t records_len, fr_detail_compress_t compress);
+
+ssize_t		fr_detail_block_encode(uint8_t *out, size_t outlen, uint8_t const *records, size_t records_len,
+				       uint32_t num_records, fr_detail_compress_t compress, int level);
+
+ssize_t		fr_detail_block_decompress(uint8_t *out, size_t outlen,
+					   fr_detail_block_t const *block, uint8_t const *data);
+
+ssize_t		fr_detail_record_encode(uint8_t *out, size_t outlen, fr_detail_record_t const *rec,
+					fr_dict_t const *dict, VALUE_PAIR *vps, VALUE_PAIR *extra,
+					fr_detail_skip_t skip, void *uctx);
+
+ssize_t		fr_detail_record_len(uint8_t const *data, size_t data_len);
+
+int		fr_detail_record_decode(TALLOC_CTX *ctx, VALUE_PAIR **out, fr_dict_t const **dict,
+					fr_detail_record_t *rec, uint8_t const *data, size_t data_len);
+
+ssize_t		fr_detail_index_encode(uint8_t *out, size_t outlen,
+				       fr_detail_index_t const *index, uint32_t num, uint64_t offset);
+
+int		fr_detail_index_read(TALLOC_CTX *ctx, fr_detail_index_t **out, uint32_t *num,
+				     uint64_t *offset, int fd, off_t file_size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,155 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "detail.c"
+
+#define DETAIL_TEST_RECORDS	(16)
+
+/** Build a run of records, with no pairs in them
+ *
+ */
+static size_t detail_test_records(uint8_t *out, unsigned int num)
+{
+	uint8_t		*p = out;
+	unsigned int	i;
+
+	for (i = 0; i < num; i++) {
+		size_t len = FR_DETAIL_RECORD_HDR_LEN + i;
+
+		memset(p, 0, len);
+		p[0] = FR_DETAIL_RECORD_MAGIC;
+		fr_net_from_uint32(p + 4, len);
+		fr_net_from_uint32(p + 8, i);
+		p += len;
+	}
+
+	return p - out;
+}
+
+static void detail_test_block_header(void)
+{
+	uint8_t			hdr[FR_DETAIL_BLOCK_HDR_LEN];
+	fr_detail_block_t	in = { .flags = FR_DETAIL_FLAG_DONE, .num_records = 3, .raw_len = 100, .stored_len = 100 };
+	fr_detail_block_t	out;
+
+	fr_detail_block_header_encode(hdr, &in);
+	TEST_CHECK(fr_detail_is_binary(hdr, sizeof(hdr)));
+
+	TEST_CHECK(fr_detail_block_header_decode(&out, hdr, sizeof(hdr) - 1) == 0);
+	TEST_CHECK(fr_detail_block_header_decode(&out, hdr, sizeof(hdr)) == FR_DETAIL_BLOCK_HDR_LEN);
+	TEST_CHECK(out.compress == FR_DETAIL_COMPRESS_NONE);
+	TEST_CHECK(out.flags == FR_DETAIL_FLAG_DONE);
+	TEST_CHECK(out.num_records == 3);
+	TEST_CHECK(out.raw_len == 100);
+
+	/*
+	 *	Uncompressed blocks must store what they hold.
+	 */
+	fr_net_from_uint32(hdr + 16, 99);
+	TEST_CHECK(fr_detail_block_header_decode(&out, hdr, sizeof(hdr)) < 0);
+
+	hdr[4] = FR_DETAIL_VERSION + 1;
+	TEST_CHECK(fr_detail_block_header_decode(&out, hdr, sizeof(hdr)) < 0);
+
+	TEST_CHECK(!fr_detail_is_binary((uint8_t const *) "Wed Oct 14", 10));
+}
+
+static void detail_test_block_records(fr_detail_compress_t compress)
+{
+	uint8_t			records[DETAIL_TEST_RECORDS * (FR_DETAIL_RECORD_HDR_LEN + DETAIL_TEST_RECORDS)];
+	uint8_t			raw[sizeof(records)];
+	uint8_t			*block;
+	size_t			records_len, bound, pos;
+	ssize_t			slen;
+	fr_detail_block_t	hdr;
+	unsigned int		i;
+
+	records_len = detail_test_records(records, DETAIL_TEST_RECORDS);
+	bound = fr_detail_block_bound(records_len, compress);
+	block = talloc_array(NULL, uint8_t, bound);
+
+	slen = fr_detail_block_encode(block, bound, records, records_len, DETAIL_TEST_RECORDS, compress, 3);
+	TEST_CHECK(slen > 0);
+	TEST_CHECK(fr_detail_block_header_decode(&hdr, block, slen) == FR_DETAIL_BLOCK_HDR_LEN);
+	TEST_CHECK((size_t) slen == (FR_DETAIL_BLOCK_HDR_LEN + (size_t) hdr.stored_len));
+	TEST_CHECK(hdr.raw_len == records_len);
+	TEST_CHECK(hdr.num_records == DETAIL_TEST_RECORDS);
+
+	TEST_CHECK(fr_detail_block_decompress(raw, sizeof(raw), &hdr, block + FR_DETAIL_BLOCK_HDR_LEN) ==
+		   (ssize_t) records_len);
+	TEST_CHECK(memcmp(raw, records, records_len) == 0);
+
+	for (i = 0, pos = 0; pos < records_len; i++) {
+		slen = fr_detail_record_len(raw + pos, records_len - pos);
+		TEST_CHECK(slen == (ssize_t) (FR_DETAIL_RECORD_HDR_LEN + i));
+		TEST_MSG("record %u has length %zd", i, slen);
+		if (slen <= 0) break;
+
+		TEST_CHECK(fr_detail_record_len(raw + pos, slen - 1) == 0);
+		pos += slen;
+	}
+	TEST_CHECK(i == DETAIL_TEST_RECORDS);
+
+	talloc_free(block);
+}
+
+static void detail_test_block_none(void)
+{
+	detail_test_block_records(FR_DETAIL_COMPRESS_NONE);
+}
+
+#ifdef HAVE_ZSTD_H
+static void detail_test_block_zstd(void)
+{
+	detail_test_block_records(FR_DETAIL_COMPRESS_ZSTD);
+}
+#endif
+
+static void detail_test_index(void)
+{
+	fr_detail_index_t	in[3] = { { 0, 10 }, { 4096, 20 }, { 8192, 5 } };
+	fr_detail_index_t	*out = NULL;
+	uint8_t			data[FR_DETAIL_BLOCK_HDR_LEN + (3 * FR_DETAIL_INDEX_ENTRY_LEN) + FR_DETAIL_TRAILER_LEN];
+	uint8_t			filler[64] = { 0 };
+	char			filename[] = "/tmp/detail_tests.XXXXXX";
+	uint32_t		num = 0;
+	uint64_t		offset = 0;
+	ssize_t			slen;
+	int			fd;
+
+	slen = fr_detail_index_encode(data, sizeof(data), in, 3, sizeof(filler));
+	TEST_CHECK(slen == sizeof(data));
+
+	fd = mkstemp(filename);
+	TEST_ASSERT(fd >= 0);
+	unlink(filename);
+
+	/*
+	 *	No trailer, no index.
+	 */
+	TEST_CHECK(write(fd, filler, sizeof(filler)) == sizeof(filler));
+	TEST_CHECK(fr_detail_index_read(NULL, &out, &num, &offset, fd, sizeof(filler)) == 0);
+
+	TEST_CHECK(write(fd, data, slen) == slen);
+	TEST_CHECK(fr_detail_index_read(NULL, &out, &num, &offset, fd, sizeof(filler) + slen) == 1);
+	TEST_CHECK(num == 3);
+	TEST_CHECK(offset == sizeof(filler));
+	TEST_CHECK(out && (out[1].offset == 4096) && (out[2].num_records == 5));
+
+	/*
+	 *	A trailer pointing somewhere else is rejected.
+	 */
+	TEST_CHECK(fr_detail_index_read(NULL, &out, &num, &offset, fd, sizeof(filler) + slen + 1) != 1);
+
+	talloc_free(out);
+	close(fd);
+}
+
+TEST_LIST = {
+	{ "detail_test_block_header",	detail_test_block_header	},
+	{ "detail_test_block_none",	detail_test_block_none		},
+#ifdef HAVE_ZSTD_H
+	{ "detail_test_block_zstd",	detail_test_block_zstd		},
+#endif
+	{ "detail_test_index",		detail_test_index		},
+	{ NULL }
+};
@@ -52,6 +52,24 @@ RCSID("$Id$")
 #	define WIFEXITED(stat_val) (((stat_val) & 255) == 0)
 #endif
 
+/*
+ *	posix_spawn() doesn't copy the page tables of the parent, which
+ *	for a large server is much cheaper than fork().  We can only use
+ *	it where the child's descriptors can be closed, as fr_exec_child()
+ *	does with closefrom().
+ */
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#  if __GLIBC_PREREQ(2, 34)
+#    define HAVE_POSIX_SPAWN_CLOSEFROM
+#  endif
+#elif defined(__FreeBSD__) && (__FreeBSD_version >= 1300000)
+#  define HAVE_POSIX_SPAWN_CLOSEFROM
+#endif
+
+#ifdef HAVE_POSIX_SPAWN_CLOSEFROM
+#	include <spawn.h>
+#endif
+
 #define MAX_ARGV (256)
 
 typedef struct {
@@ -162,6 +180,7 @@ static void fr_exec_pair_to_env(REQUEST *request, VALUE_PAIR *input_pairs, char
 	}
 }
 
+#ifndef HAVE_POSIX_SPAWN_CLOSEFROM
 /*
  *	Child process.
  *
@@ -251,6 +270,83 @@ static NEVER_RETURNS void fr_exec_child(REQUEST *request, char **argv, char **en
 	 */
 	exit(2);
 }
+#endif
+
+/** Create a child process running argv[0]
+ *
+ * Where possible this uses posix_spawn(), which avoids duplicating the
+ * address space of the server for a child which immediately calls execve().
+ * Otherwise we fork, and the child calls #fr_exec_child.
+ *
+ * The descriptors given to the child are the same in either case.
+ *
+ * @return
+ *	- >0 the PID of the child.
+ *	- -1 on error, with errno set.
+ */
+static pid_t fr_exec_spawn(REQUEST *request, char **argv, char **envp,
+			   bool exec_wait, int *input_fd, int *output_fd,
+			   int to_child[static 2], int from_child[static 2])
+{
+	pid_t				pid;
+#ifdef HAVE_POSIX_SPAWN_CLOSEFROM
+	posix_spawn_file_actions_t	actions;
+	int				ret;
+
+	ret = posix_spawn_file_actions_init(&actions);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+
+	if (exec_wait && input_fd) {
+		ret = posix_spawn_file_actions_adddup2(&actions, to_child[0], STDIN_FILENO);
+	} else {
+		ret = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDWR, 0);
+	}
+	if (ret != 0) goto error;
+
+	if (exec_wait && output_fd) {
+		ret = posix_spawn_file_actions_adddup2(&actions, from_child[1], STDOUT_FILENO);
+	} else {
+		ret = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_RDWR, 0);
+	}
+	if (ret != 0) goto error;
+
+	/*
+	 *	As with fr_exec_child(), STDERR only goes to the
+	 *	server's STDERR if we're debugging.
+	 */
+	if (!request || !RDEBUG_ENABLED) {
+		ret = posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_RDWR, 0);
+		if (ret != 0) goto error;
+	}
+
+	/*
+	 *	This also closes the parent's ends of the pipes.
+	 */
+	ret = posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+	if (ret != 0) goto error;
+
+	ret = posix_spawn(&pid, argv[0], &actions, NULL, argv, envp);
+
+error:
+	posix_spawn_file_actions_destroy(&actions);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+#else
+	pid = fork();
+
+	/*
+	 *	The child never returns from calling fr_exec_child();
+	 */
+	if (pid == 0) fr_exec_child(request, argv, envp, exec_wait, input_fd, output_fd, to_child, from_child);
+#endif
+
+	return pid;
+}
 
 /** Start a process
  *
@@ -328,10 +424,7 @@ pid_t radius_start_program(char const *cmd, REQUEST *request, bool exec_wait,
 	envp[0] = NULL;
 	if (input_pairs) fr_exec_pair_to_env(request, input_pairs, envp, MAX_ENVP, shell_escape);
 
-	pid = fork();
-	if (pid == 0) {
-		fr_exec_child(request, argv, envp, exec_wait, input_fd, output_fd, to_child, from_child);
-	}
+	pid = fr_exec_spawn(request, argv, envp, exec_wait, input_fd, output_fd, to_child, from_child);
 
 	/*
 	 *	Free child environment variables
@@ -705,15 +798,10 @@ int fr_exec_nowait(REQUEST *request, fr_value_box_t *vb, VALUE_PAIR *env_pairs)
 		for (i = 0; i < argc; i++) RDEBUG3("arg[%d] %s", i, argv[i]);
 	}
 
-	pid = fork();
-
-	/*
-	 *	The child never returns from calling fr_exec_child();
-	 */
-	if (pid == 0) {
-		int unused[2];
+	{
+		int unused[2] = { -1, -1 };
 
-		fr_exec_child(request, argv, envp, false, NULL, NULL, unused, unused);
+		pid = fr_exec_spawn(request, argv, envp, false, NULL, NULL, unused, unused);
 	}
 
 	/*
@@ -827,14 +915,7 @@ int fr_exec_wait_start(REQUEST *request, fr_value_box_t *vb, VALUE_PAIR *env_pai
 		}
 	}
 
-	pid = fork();
-
-	/*
-	 *	The child never returns from calling fr_exec_child();
-	 */
-	if (pid == 0) {
-		fr_exec_child(request, argv, envp, true, input_fd, output_fd, to_child, from_child);
-	}
+	pid = fr_exec_spawn(request, argv, envp, true, input_fd, output_fd, to_child, from_child);
 
 	/*
 	 *	Parent process.  Do all necessary cleanups.
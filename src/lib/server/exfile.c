@@ -28,6 +28,13 @@
 #include <freeradius-devel/server/exfile.h>
 
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
 
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -42,12 +49,42 @@ typedef struct {
 } exfile_entry_t;
 
 
+/** A descriptor opened by one thread, in append-only mode
+ *
+ */
+typedef struct {
+	uint64_t		id;			//!< Of the exfile_t the handle was opened for.
+	uint32_t		hash;			//!< Hash for cheap comparison.
+	int			fd;			//!< File descriptor, opened with O_APPEND.
+	time_t			last_used;		//!< Last time the handle was used.
+	time_t			last_checked;		//!< Last time we checked the file hadn't been rotated.
+	uint32_t		max_idle;		//!< Copied from the exfile_t, which may be freed first.
+	dev_t			st_dev;			//!< device inode
+	ino_t			st_ino;			//!< inode number
+	char			*filename;		//!< Filename.
+	fr_dlist_t		entry;			//!< Entry in the thread's list of handles.
+} exfile_handle_t;
+
+/** Append-only handles belonging to one thread
+ *
+ */
+typedef struct {
+	fr_dlist_head_t		handles;		//!< Most recently used at the head.
+	time_t			last_cleaned;		//!< Last time idle handles were closed.
+} exfile_thread_t;
+
+static _Thread_local exfile_thread_t *exfile_thread;
+
+static atomic_uint_fast64_t exfile_counter = ATOMIC_VAR_INIT(1);
+
 struct exfile_s {
+	uint64_t		id;			//!< Identifies the handles opened for this exfile_t.
 	uint32_t		max_entries;		//!< How many file descriptors we keep track of.
 	uint32_t		max_idle;		//!< Maximum idle time for a descriptor.
 	time_t			last_cleaned;
 	pthread_mutex_t		mutex;
 	exfile_entry_t		*entries;
+	exfile_mode_t		mode;			//!< How files are shared between threads.
 	bool			locking;
 	CONF_SECTION		*conf;			//!< Conf section to search for triggers.
 	char const		*trigger_prefix;	//!< Trigger path in the global trigger section.
@@ -61,10 +98,10 @@ struct exfile_s {
  *
  * @param[in] ef to send trigger for.
  * @param[in] request The current request.
- * @param[in] entry for the file that the event occurred on.
+ * @param[in] filename of the file that the event occurred on.
  * @param[in] name_suffix trigger name suffix.
  */
-static inline void exfile_trigger_exec(exfile_t *ef, REQUEST *request, exfile_entry_t *entry, char const *name_suffix)
+static inline void exfile_trigger_exec(exfile_t *ef, REQUEST *request, char const *filename, char const *name_suffix)
 {
 	char			name[128];
 	VALUE_PAIR		*vp, *args;
@@ -86,7 +123,7 @@ static inline void exfile_trigger_exec(exfile_t *ef, REQUEST *request, exfile_en
 	fr_cursor_init(&cursor, &args);
 
 	MEM(vp = fr_pair_afrom_da(NULL, da));
-	fr_pair_value_strdup(vp, entry->filename);
+	fr_pair_value_strdup(vp, filename);
 
 	fr_cursor_prepend(&cursor, vp);
 
@@ -107,7 +144,7 @@ static void exfile_cleanup_entry(exfile_t *ef, REQUEST *request, exfile_entry_t
 	/*
 	 *	Issue close trigger *after* we've closed the fd
 	 */
-	exfile_trigger_exec(ef, request, entry, "close");
+	exfile_trigger_exec(ef, request, entry->filename, "close");
 
 	/*
 	 *	Trigger still needs access to filename to populate Exfile-Name
@@ -139,12 +176,13 @@ static int _exfile_free(exfile_t *ef)
  * @param ctx The talloc context
  * @param max_entries Max file descriptors to cache, and manage locks for.
  * @param max_idle Maximum time a file descriptor can be idle before it's closed.
- * @param locking whether or not to lock the files.
+ * @param mode how files are shared between threads.  With #EXFILE_APPEND
+ *	max_entries is the number of descriptors cached by each thread.
  * @return
  *	- new context.
  *	- NULL on error.
  */
-exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle, bool locking)
+exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle, exfile_mode_t mode)
 {
 	exfile_t *ef;
 
@@ -153,9 +191,11 @@ exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle,
 
 	talloc_link_ctx(ctx, ef);
 
+	ef->id = atomic_fetch_add_explicit(&exfile_counter, 1, memory_order_relaxed);
 	ef->max_entries = max_entries;
 	ef->max_idle = max_idle;
-	ef->locking = locking;
+	ef->mode = mode;
+	ef->locking = (mode == EXFILE_LOCKED);
 
 	/*
 	 *	If we're not locking the files, just return the
@@ -210,11 +250,11 @@ void exfile_enable_triggers(exfile_t *ef, CONF_SECTION *conf, char const *trigge
  *	Try to open the file. It it doesn't exist, try to
  *	create it's parent directories.
  */
-static int exfile_open_mkdir(exfile_t *ef, char const *filename, mode_t permissions)
+static int exfile_open_mkdir(exfile_t *ef, char const *filename, int flags, mode_t permissions)
 {
 	int fd;
 
-	fd = open(filename, O_RDWR | O_CREAT, permissions);
+	fd = open(filename, flags | O_CREAT, permissions);
 	if (fd < 0) {
 		mode_t dirperm;
 		char *p, *dir;
@@ -249,7 +289,7 @@ static int exfile_open_mkdir(exfile_t *ef, char const *filename, mode_t permissi
 		}
 		talloc_free(dir);
 
-		fd = open(filename, O_RDWR | O_CREAT, permissions);
+		fd = open(filename, flags | O_CREAT, permissions);
 		if (fd < 0) {
 			fr_strerror_printf("Failed to open file %s: %s", filename, fr_syserror(errno));
 			return -1;
@@ -260,6 +300,169 @@ static int exfile_open_mkdir(exfile_t *ef, char const *filename, mode_t permissi
 }
 
 
+static int _exfile_handle_free(exfile_handle_t *h)
+{
+	if (h->fd >= 0) close(h->fd);
+
+	return 0;
+}
+
+static void _exfile_thread_free_on_exit(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Close a handle, and remove it from the thread's list
+ *
+ * @param[in] ef	the handle belongs to, or NULL if the exfile_t
+ *			may already have been freed.
+ * @param[in] request	The current request.
+ * @param[in] t		the handle belongs to.
+ * @param[in] h		to close.
+ */
+static void exfile_handle_close(exfile_t *ef, REQUEST *request, exfile_thread_t *t, exfile_handle_t *h)
+{
+	fr_dlist_remove(&t->handles, h);
+
+	if (h->fd >= 0) close(h->fd);
+	h->fd = -1;
+
+	if (ef) exfile_trigger_exec(ef, request, h->filename, "close");
+
+	talloc_free(h);
+}
+
+/** (Re-)open the file for a handle, and remember which inode it refers to
+ *
+ */
+static int exfile_handle_open(exfile_t *ef, REQUEST *request, exfile_handle_t *h, mode_t permissions)
+{
+	struct stat st;
+
+	h->fd = exfile_open_mkdir(ef, h->filename, O_WRONLY | O_APPEND, permissions);
+	if (h->fd < 0) return -1;
+
+	if (fstat(h->fd, &st) < 0) {
+		fr_strerror_printf("Failed to stat file %s: %s", h->filename, fr_syserror(errno));
+		close(h->fd);
+		h->fd = -1;
+		return -1;
+	}
+	h->st_dev = st.st_dev;
+	h->st_ino = st.st_ino;
+
+	exfile_trigger_exec(ef, request, h->filename, "open");
+
+	return 0;
+}
+
+/** Return this thread's descriptor for a file, opening it if needed
+ *
+ * Nothing is shared between threads, so there's nothing to lock.
+ * The descriptors are opened with O_APPEND, so the kernel positions
+ * each write at the end of the file, and writes no larger than
+ * PIPE_BUF are never interleaved with writes from other threads.
+ *
+ * Rotation (the file being renamed or deleted) is detected lazily,
+ * by comparing the inode of the filename with the inode of the
+ * descriptor at most once a second.
+ */
+static int exfile_open_append(exfile_t *ef, REQUEST *request, char const *filename, mode_t permissions)
+{
+	exfile_thread_t	*t = exfile_thread;
+	exfile_handle_t	*h, *next, *found = NULL, *oldest = NULL;
+	uint32_t	hash, num = 0;
+	time_t		now;
+	struct stat	st;
+
+	if (unlikely(!t)) {
+		MEM(t = talloc_zero(NULL, exfile_thread_t));
+		fr_dlist_init(&t->handles, exfile_handle_t, entry);
+		fr_thread_local_set_destructor(exfile_thread, _exfile_thread_free_on_exit, t);
+	}
+
+	hash = fr_hash_string(filename);
+	now = time(NULL);
+
+	/*
+	 *	Close idle handles.  Handles for an exfile_t which
+	 *	has been freed stop being used, and are closed here.
+	 */
+	if (now > (t->last_cleaned + 1)) {
+		for (h = fr_dlist_head(&t->handles); h; h = next) {
+			next = fr_dlist_next(&t->handles, h);
+
+			if ((h->last_used + h->max_idle) >= now) continue;
+
+			exfile_handle_close((h->id == ef->id) ? ef : NULL, request, t, h);
+		}
+		t->last_cleaned = now;
+	}
+
+	for (h = fr_dlist_head(&t->handles); h; h = fr_dlist_next(&t->handles, h)) {
+		if (h->id != ef->id) continue;
+
+		if (!found && (h->hash == hash) && (strcmp(h->filename, filename) == 0)) found = h;
+
+		oldest = h;	/* List is in order of use */
+		num++;
+	}
+
+	if (found) {
+		h = found;
+
+		if (h->last_checked != now) {
+			h->last_checked = now;
+
+			/*
+			 *	Stat the *filename*, not the file we opened.
+			 *	If that's not the file we opened, then go back
+			 *	and re-open the file.
+			 */
+			if ((stat(h->filename, &st) < 0) ||
+			    (st.st_dev != h->st_dev) || (st.st_ino != h->st_ino)) {
+				close(h->fd);
+				h->fd = -1;
+				exfile_trigger_exec(ef, request, h->filename, "close");
+
+				if (exfile_handle_open(ef, request, h, permissions) < 0) {
+					exfile_handle_close(NULL, request, t, h);
+					return -1;
+				}
+			}
+		}
+	} else {
+		/*
+		 *	Too many files open for this exfile_t, free
+		 *	the least recently used one.
+		 */
+		if (oldest && (num >= ef->max_entries)) exfile_handle_close(ef, request, t, oldest);
+
+		MEM(h = talloc_zero(t, exfile_handle_t));
+		h->id = ef->id;
+		h->hash = hash;
+		h->max_idle = ef->max_idle;
+		h->last_checked = now;
+		MEM(h->filename = talloc_typed_strdup(h, filename));
+		talloc_set_destructor(h, _exfile_handle_free);
+
+		if (exfile_handle_open(ef, request, h, permissions) < 0) {
+			talloc_free(h);
+			return -1;
+		}
+		fr_dlist_insert_head(&t->handles, h);
+	}
+
+	h->last_used = now;
+	if (fr_dlist_head(&t->handles) != h) {
+		fr_dlist_remove(&t->handles, h);
+		fr_dlist_insert_head(&t->handles, h);
+	}
+
+	return h->fd;
+}
+
+
 /** Open a new log file, or maybe an existing one.
  *
  * When multithreaded, the FD is locked via a mutex.  This way we're
@@ -283,11 +486,13 @@ int exfile_open(exfile_t *ef, REQUEST *request, char const *filename, mode_t per
 
 	if (!ef || !filename) return -1;
 
+	if (ef->mode == EXFILE_APPEND) return exfile_open_append(ef, request, filename, permissions);
+
 	/*
 	 *	No locking: just return a new FD.
 	 */
 	if (!ef->locking) {
-		found = exfile_open_mkdir(ef, filename, permissions);
+		found = exfile_open_mkdir(ef, filename, O_RDWR, permissions);
 		if (found < 0) return -1;
 
 		(void) lseek(found, 0, SEEK_END);
@@ -398,10 +603,10 @@ int exfile_open(exfile_t *ef, REQUEST *request, char const *filename, mode_t per
 	ef->entries[i].fd = -1;
 
 reopen:
-	ef->entries[i].fd = exfile_open_mkdir(ef, filename, permissions);
+	ef->entries[i].fd = exfile_open_mkdir(ef, filename, O_RDWR, permissions);
 	if (ef->entries[i].fd < 0) goto error;
 
-	exfile_trigger_exec(ef, request, &ef->entries[i], "open");
+	exfile_trigger_exec(ef, request, ef->entries[i].filename, "open");
 
 try_lock:
 	/*
@@ -502,7 +707,7 @@ try_lock:
 	 */
 	ef->entries[i].last_used = now;
 
-	exfile_trigger_exec(ef, request, &ef->entries[i], "reserve");
+	exfile_trigger_exec(ef, request, ef->entries[i].filename, "reserve");
 
 	/* coverity[missing_unlock] */
 	return ef->entries[i].fd;
@@ -525,6 +730,12 @@ int exfile_close(exfile_t *ef, REQUEST *request, int fd)
 {
 	uint32_t i;
 
+	/*
+	 *	Append-only: the descriptor stays open for the
+	 *	next write from this thread.
+	 */
+	if (ef->mode == EXFILE_APPEND) return 0;
+
 	/*
 	 *	No locking: just close the file.
 	 */
@@ -543,7 +754,7 @@ int exfile_close(exfile_t *ef, REQUEST *request, int fd)
 		(void) rad_unlockfd(ef->entries[i].fd, 0);
 		pthread_mutex_unlock(&(ef->mutex));
 
-		exfile_trigger_exec(ef, request, &ef->entries[i], "release");
+		exfile_trigger_exec(ef, request, ef->entries[i].filename, "release");
 		return 0;
 	}
 
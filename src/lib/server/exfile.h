@@ -35,7 +35,18 @@ extern "C" {
  */
 typedef struct exfile_s exfile_t;
 
-exfile_t	*exfile_init(TALLOC_CTX *ctx, uint32_t entries, uint32_t idle, bool locking);
+/** How files are shared between threads
+ *
+ */
+typedef enum {
+	EXFILE_UNLOCKED = 0,				//!< Open a new descriptor for each write.
+	EXFILE_LOCKED,					//!< Share cached descriptors, locking the file
+							///< while it's being written to.
+	EXFILE_APPEND					//!< Cache a descriptor per thread, opened with O_APPEND.
+							///< No locks are taken.
+} exfile_mode_t;
+
+exfile_t	*exfile_init(TALLOC_CTX *ctx, uint32_t entries, uint32_t idle, exfile_mode_t mode);
 
 void		exfile_enable_triggers(exfile_t *ef, CONF_SECTION *cs, char const *trigger_prefix,
 				       VALUE_PAIR *trigger_args);
@@ -3,6 +3,7 @@ TARGET		:= libfreeradius-server.a
 SOURCES	:= \
 	base.c \
 	auth.c \
+	breaker.c \
 	cf_file.c \
 	cf_parse.c \
 	cf_util.c \
@@ -13,6 +14,7 @@ SOURCES	:= \
 	connection.c \
 	crypt.c \
 	dependency.c \
+	detail.c \
 	dl_module.c \
 	exec.c \
 	exfile.c \
@@ -23,10 +25,12 @@ SOURCES	:= \
 	map_proc.c \
 	map.c \
 	module.c \
+	offload.c \
 	paircmp.c \
 	pairmove.c \
 	password.c \
 	pool.c \
+	radutmp.c \
 	rcode.c \
 	regex.c \
 	request_data.c \
@@ -35,6 +39,7 @@ SOURCES	:= \
 	state.c \
 	stats.c \
 	tmpl.c \
+	trace.c \
 	trigger.c \
 	trunk.c \
 	users_file.c \
@@ -44,14 +49,14 @@ SOURCES	:= \
 HEADERS		:= $(subst src/lib/,,$(wildcard src/lib/server/*.h))
 
 # This lets the linker determine which version of the SSLeay functions to use.
-TGT_LDLIBS	:= $(LIBS) $(SYSTEMD_LIBS) $(GPERFTOOLS_LIBS) $(LCRYPT)
-TGT_LDFLAGS	:= $(LDFLAGS) $(SYSTEMD_LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+TGT_LDLIBS	:= $(LIBS) $(SYSTEMD_LIBS) $(GPERFTOOLS_LIBS) $(ZSTD_LIBS) $(LCRYPT)
+TGT_LDFLAGS	:= $(LDFLAGS) $(SYSTEMD_LDFLAGS) $(GPERFTOOLS_LDFLAGS) $(ZSTD_LDFLAGS)
 
 ifneq ($(OPENSSL_LIBS),)
 TGT_PREREQS	:= libfreeradius-tls.a
 endif
 
-TGT_PREREQS	+= libfreeradius-util.a
+TGT_PREREQS	+= libfreeradius-util.a libfreeradius-internal.a
 
 ifneq ($(MAKECMDGOALS),scan)
 SRC_CFLAGS	+= -DBUILT_WITH_CPPFLAGS=\"$(CPPFLAGS)\" -DBUILT_WITH_CFLAGS=\"$(CFLAGS)\" -DBUILT_WITH_LDFLAGS=\"$(LDFLAGS)\" -DBUILT_WITH_LIBS=\"$(LIBS)\"
@@ -37,6 +37,8 @@ RCSID("$Id$")
 #include <freeradius-devel/server/util.h>
 #include <freeradius-devel/server/virtual_servers.h>
 
+#include <freeradius-devel/io/network.h>
+
 #include <freeradius-devel/util/conf.h>
 #include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/util/file.h>
@@ -142,6 +144,12 @@ static const CONF_PARSER log_config[] = {
 	{ FR_CONF_OFFSET("line_number", FR_TYPE_BOOL, main_config_t, log_line_number) },
 	{ FR_CONF_OFFSET("timestamp", FR_TYPE_BOOL, main_config_t, log_timestamp) },
 	{ FR_CONF_OFFSET("use_utc", FR_TYPE_BOOL, main_config_t, log_dates_utc) },
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, main_config_t, log_async), .dflt = "no" },
+	{ FR_CONF_OFFSET("async_buffer_size", FR_TYPE_SIZE, main_config_t, log_async_buffer_size), .dflt = "1M" },
+	{ FR_CONF_OFFSET("async_block", FR_TYPE_BOOL, main_config_t, log_async_block), .dflt = "no" },
+	{ FR_CONF_OFFSET("trace_rate", FR_TYPE_UINT32, main_config_t, trace_rate), .dflt = "0" },
+	{ FR_CONF_OFFSET("trace_file", FR_TYPE_FILE_OUTPUT, main_config_t, trace_file), .dflt = "${logdir}/radiusd.trace" },
+	{ FR_CONF_OFFSET("trace_buffer_size", FR_TYPE_SIZE, main_config_t, trace_buffer_size), .dflt = "64k" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -158,11 +166,34 @@ static const CONF_PARSER resources[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static fr_table_num_sorted_t const network_dispatch_table[] = {
+	{ "client",		FR_NETWORK_DISPATCH_CLIENT		},
+	{ "least-loaded",	FR_NETWORK_DISPATCH_LEAST_LOADED	},
+	{ "random",		FR_NETWORK_DISPATCH_RANDOM		}
+};
+static size_t network_dispatch_table_len = NUM_ELEMENTS(network_dispatch_table);
+
 static const CONF_PARSER thread_config[] = {
 	{ FR_CONF_OFFSET("num_networks", FR_TYPE_UINT32, main_config_t, max_networks), .dflt = STRINGIFY(1),
 	  .func = num_networks_parse },
 	{ FR_CONF_OFFSET("num_workers", FR_TYPE_UINT32, main_config_t, max_workers), .dflt = STRINGIFY(4),
 	  .func = num_workers_parse },
+	{ FR_CONF_OFFSET("min_workers", FR_TYPE_UINT32, main_config_t, min_workers), .dflt = "0" },
+	{ FR_CONF_OFFSET("scale_interval", FR_TYPE_TIME_DELTA, main_config_t, scale_interval), .dflt = "10" },
+	{ FR_CONF_OFFSET("dispatch", FR_TYPE_UINT32, main_config_t, dispatch), .dflt = "random",
+	  .func = cf_table_parse_uint32,
+	  .uctx = &(cf_table_parse_ctx_t){ .table = network_dispatch_table, .len = &network_dispatch_table_len } },
+	{ FR_CONF_OFFSET("steal_delay", FR_TYPE_TIME_DELTA, main_config_t, steal_delay), .dflt = "0" },
+	{ FR_CONF_OFFSET("spin_time", FR_TYPE_TIME_DELTA, main_config_t, spin_time), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_queue_time", FR_TYPE_TIME_DELTA, main_config_t, max_queue_time), .dflt = "0" },
+	{ FR_CONF_OFFSET("give_up_time", FR_TYPE_TIME_DELTA, main_config_t, give_up_time), .dflt = "0" },
+	{ FR_CONF_OFFSET("huge_pages", FR_TYPE_BOOL, main_config_t, huge_pages), .dflt = "no" },
+	{ FR_CONF_OFFSET("prefault", FR_TYPE_BOOL, main_config_t, prefault), .dflt = "no" },
+	{ FR_CONF_OFFSET("io_uring", FR_TYPE_BOOL, main_config_t, io_uring), .dflt = "no" },
+	{ FR_CONF_OFFSET("tsc_clock", FR_TYPE_BOOL, main_config_t, tsc_clock), .dflt = "no" },
+	{ FR_CONF_OFFSET("timer_resolution", FR_TYPE_TIME_DELTA, main_config_t, timer_resolution), .dflt = "0" },
+	{ FR_CONF_OFFSET("network_cpus", FR_TYPE_STRING, main_config_t, network_cpus) },
+	{ FR_CONF_OFFSET("worker_cpus", FR_TYPE_STRING, main_config_t, worker_cpus) },
 
 	{ FR_CONF_OFFSET("stats_interval | FR_TYPE_HIDDEN", FR_TYPE_TIME_DELTA, main_config_t, stats_interval), },
 
@@ -435,7 +466,8 @@ static int num_networks_parse(TALLOC_CTX *ctx, void *out, void *parent,
 
 	memcpy(&value, out, sizeof(value));
 
-	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, ==, 1);
+	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, >=, 1);
+	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, <=, 64);
 
 	memcpy(out, &value, sizeof(value));
 
@@ -1018,7 +1050,8 @@ do {\
 
 	/* Read the configuration file */
 	snprintf(buffer, sizeof(buffer), "%.200s/%.50s.conf", config->raddb_dir, config->name);
-	if (cf_file_read(cs, buffer) < 0) {
+	if ((config->config_cache ? cf_file_read_cached(cs, buffer, config->config_cache) :
+				    cf_file_read(cs, buffer)) < 0) {
 		ERROR("Error reading or parsing %s", buffer);
 		goto failure;
 	}
@@ -1280,8 +1313,41 @@ void hup_logfile(main_config_t *config)
 	}
 }
 
+/** Log which module a changed configuration file belongs to
+ *
+ * @param[in] ctx	The "modules" section.
+ * @param[in] data	The section the changed file was read into.
+ * @return
+ *	- 1 if the file is part of a module's configuration.
+ *	- 0 otherwise.
+ */
+static int hup_callback(void *ctx, void *data)
+{
+	CONF_SECTION	*modules = ctx;
+	CONF_SECTION	*cs = data;
+	CONF_SECTION	*parent;
+
+	if (!modules || !cs) return 0;
+
+	/*
+	 *	Files may be included from sub-sections of a module
+	 *	config.  Walk up the sections until we find the section
+	 *	which is the module.
+	 */
+	while ((parent = cf_item_to_section(cf_parent(cs))) != NULL) {
+		if (parent == modules) break;
+		cs = parent;
+	}
+	if (!parent) return 0;
+
+	INFO("HUP - Configuration for module \"%s\" changed", cf_section_name(cs));
+
+	return 1;
+}
+
 void main_config_hup(main_config_t *config)
 {
+	int		rcode;
 	time_t		when;
 
 	static time_t	last_hup = 0;
@@ -1305,8 +1371,7 @@ void main_config_hup(main_config_t *config)
 	}
 	last_hup = when;
 
-#if 0
-	rcode = cf_file_changed(cs_cache->cs, hup_callback);
+	rcode = cf_file_changed(config->root_cs, hup_callback);
 	if (rcode == CF_FILE_NONE) {
 		INFO("HUP - No files changed.  Ignoring");
 		return;
@@ -1316,7 +1381,14 @@ void main_config_hup(main_config_t *config)
 		INFO("HUP - Cannot read configuration files.  Ignoring");
 		return;
 	}
-#endif
 
-	INFO("HUP - NYI in version 4");	/* Not yet implemented in v4 */
+	/*
+	 *	Compiled policies, clients and modules are referenced
+	 *	directly by running requests and by the listeners, so
+	 *	swapping them out from underneath the workers isn't
+	 *	safe.  Say what changed, so the administrator knows a
+	 *	restart is needed for the changes to take effect.
+	 */
+	if (rcode & CF_FILE_CONFIG) INFO("HUP - Configuration files changed.  Restart the server to apply them");
+	if (rcode & CF_FILE_MODULE) INFO("HUP - Module configuration files changed.  Restart the server to apply them");
 }
@@ -75,6 +75,9 @@ struct main_config_s {
 	char const	*sbin_dir;
 	char const	*run_dir;
 	char const	*raddb_dir;			//!< Path to raddb directory
+	char const	*config_cache;			//!< Where to cache the configuration items read
+							///< from raddb_dir, so unchanged files aren't
+							///< parsed again.
 
 	char const	*prefix;
 
@@ -88,6 +91,15 @@ struct main_config_s {
 	bool		log_timestamp;
 	bool		log_timestamp_is_set;
 
+	bool		log_async;			//!< Write log messages from a separate thread.
+	size_t		log_async_buffer_size;		//!< Space for messages waiting to be written.
+	bool		log_async_block;		//!< Wait for space in the buffer, rather than
+							///< dropping messages.
+
+	uint32_t	trace_rate;			//!< Trace one in every N requests.  0 disables tracing.
+	char const	*trace_file;			//!< Where traces are written.
+	size_t		trace_buffer_size;		//!< Per-thread buffer for trace records.
+
 	int32_t		syslog_facility;
 
 	char const	*dict_dir;			//!< Where to load dictionaries from.
@@ -136,6 +148,20 @@ struct main_config_s {
 							//!< Only applicable in single threaded mode.
 	uint32_t	max_networks;			//!< for the scheduler
 	uint32_t	max_workers;			//!< for the scheduler
+	uint32_t	min_workers;			//!< for the scheduler, start this many workers and scale up
+	fr_time_delta_t	scale_interval;			//!< for the scheduler, how often to add or remove workers
+	uint32_t	dispatch;			//!< for the scheduler, how networks pick workers
+	fr_time_delta_t	steal_delay;			//!< for the scheduler, when to take requests from stuck workers
+	fr_time_delta_t	spin_time;			//!< for the scheduler, how long idle workers poll before sleeping
+	fr_time_delta_t	max_queue_time;			//!< for the scheduler, when workers discard stale requests
+	fr_time_delta_t	give_up_time;			//!< for the scheduler, when workers stop abandoned requests
+	bool		huge_pages;			//!< for the scheduler, back message sets with huge pages
+	bool		prefault;			//!< for the scheduler, touch message set memory up front
+	bool		io_uring;			//!< for the scheduler, poll sockets with io_uring
+	bool		tsc_clock;			//!< for the scheduler, read the time from the TSC
+	fr_time_delta_t	timer_resolution;		//!< for the scheduler, tick size of the thread timer wheels
+	char const	*network_cpus;			//!< for the scheduler, CPUs to pin network threads to
+	char const	*worker_cpus;			//!< for the scheduler, CPUs to pin worker threads to
 	fr_time_delta_t	stats_interval;			//!< for the scheduler
 
 };
@@ -123,6 +123,8 @@ int		map_to_vp(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request,
 
 int		map_list_mod_apply(REQUEST *request, vp_list_mod_t const *vlm);
 
+int		map_list_mod_apply_all(REQUEST *request, vp_list_mod_t const *vlm_head);
+
 int		map_to_list_mod(TALLOC_CTX *ctx, vp_list_mod_t **out,
 				REQUEST *request, vp_map_t const *map,
 				fr_value_box_t **lhs_result, fr_value_box_t **rhs_result);
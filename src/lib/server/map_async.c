@@ -29,6 +29,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/server/exec.h>
+#include <freeradius-devel/server/trace.h>
 #include <freeradius-devel/server/map.h>
 #include <freeradius-devel/server/paircmp.h>
 #include <freeradius-devel/util/debug.h>
@@ -913,28 +914,13 @@ static inline void map_list_mod_debug(REQUEST *request,
 	talloc_free(rhs);
 }
 
-/** Apply the output of #map_to_list_mod to a request
+/** Print debug and trace records for the mods being applied
  *
- * @param request	to modify.
- * @param vlm		VP List Modification to apply.
  */
-int map_list_mod_apply(REQUEST *request, vp_list_mod_t const *vlm)
+static void map_list_mod_apply_debug(REQUEST *request, vp_list_mod_t const *vlm)
 {
-	int			rcode = 0;
+	vp_map_t const *map = vlm->map, *mod;
 
-	vp_map_t const		*map = vlm->map, *mod;
-	VALUE_PAIR		**vp_list, *found;
-	REQUEST			*context;
-	TALLOC_CTX		*parent;
-
-	fr_cursor_t		list;
-
-	MAP_VERIFY(map);
-	fr_assert(vlm->mod);
-
-	/*
-	 *	Print debug information for the mods being applied
-	 */
 	for (mod = vlm->mod;
 	     mod;
 	     mod = mod->next) {
@@ -959,8 +945,38 @@ int map_list_mod_apply(REQUEST *request, vp_list_mod_t const *vlm)
 				map_list_mod_debug(request, map, mod, vb->type != FR_TYPE_INVALID ? vb : NULL);
 			}
 		}
+
+		if (unlikely(request->traced)) {
+			for (vb = tmpl_value(mod->rhs);
+			     vb;
+			     vb = vb->next) {
+				fr_trace_attr(request, mod->lhs->name, mod->op, vb->type != FR_TYPE_INVALID ? vb : NULL);
+			}
+		}
 	}
-	mod = vlm->mod;	/* Reset */
+}
+
+/** Apply the output of #map_to_list_mod to a request
+ *
+ * @param request	to modify.
+ * @param vlm		VP List Modification to apply.
+ */
+int map_list_mod_apply(REQUEST *request, vp_list_mod_t const *vlm)
+{
+	int			rcode = 0;
+
+	vp_map_t const		*map = vlm->map, *mod;
+	VALUE_PAIR		**vp_list, *found;
+	REQUEST			*context;
+	TALLOC_CTX		*parent;
+
+	fr_cursor_t		list;
+
+	MAP_VERIFY(map);
+	fr_assert(vlm->mod);
+
+	map_list_mod_apply_debug(request, vlm);
+	mod = vlm->mod;
 
 	/*
 	 *	All this has been checked by #map_to_list_mod
@@ -1251,3 +1267,86 @@ int map_list_mod_apply(REQUEST *request, vp_list_mod_t const *vlm)
 finish:
 	return rcode;
 }
+
+/** Whether a list modification only appends attributes to a list
+ *
+ */
+static inline bool map_list_mod_is_append(vp_list_mod_t const *vlm)
+{
+	return vlm->mod && !vlm->mod->next && (vlm->mod->op == T_OP_ADD) &&
+	       tmpl_is_attr(vlm->map->lhs) && tmpl_is_attr(vlm->mod->lhs);
+}
+
+/** Apply a list of modifications produced by #map_to_list_mod
+ *
+ * Equivalent to calling #map_list_mod_apply for each modification in turn.
+ * Consecutive += modifications of the same list are applied together, so
+ * that the list is resolved, and walked to find its tail, once per run
+ * instead of once per attribute.  This matters for update sections, and
+ * LDAP or REST responses, which add many attributes to the reply.
+ *
+ * @param request	to modify.
+ * @param vlm_head	First modification to apply.
+ * @return
+ *	- 0 on success.
+ *	- -1 if a modification could not be applied.
+ */
+int map_list_mod_apply_all(REQUEST *request, vp_list_mod_t const *vlm_head)
+{
+	vp_list_mod_t const	*vlm = vlm_head;
+
+	while (vlm) {
+		vp_list_mod_t const	*end;
+		vp_tmpl_t const		*lhs;
+		VALUE_PAIR		**vp_list, *head = NULL, **tail = &head;
+		REQUEST			*context = request;
+		TALLOC_CTX		*parent;
+		fr_cursor_t		to, from;
+
+		/*
+		 *	Find the end of a run of appends to the same list.
+		 */
+		end = vlm->next;
+		if (map_list_mod_is_append(vlm)) {
+			lhs = vlm->mod->lhs;
+
+			while (end && map_list_mod_is_append(end) &&
+			       (tmpl_request(end->mod->lhs) == tmpl_request(lhs)) &&
+			       (tmpl_list(end->mod->lhs) == tmpl_list(lhs))) end = end->next;
+		}
+
+		if (end == vlm->next) {
+			if (map_list_mod_apply(request, vlm) < 0) return -1;
+			vlm = end;
+			continue;
+		}
+
+		/*
+		 *	All this has been checked by #map_to_list_mod
+		 */
+		if (!fr_cond_assert(radius_request(&context, tmpl_request(lhs)) == 0)) return -1;
+
+		vp_list = radius_list(context, tmpl_list(lhs));
+		if (!fr_cond_assert(vp_list)) return -1;
+
+		parent = radius_list_ctx(context, tmpl_list(lhs));
+		fr_assert(parent);
+
+		for (; vlm != end; vlm = vlm->next) {
+			MAP_VERIFY(vlm->map);
+			map_list_mod_apply_debug(request, vlm);
+
+			*tail = map_list_mod_to_vps(parent, vlm);
+			while (*tail) tail = &(*tail)->next;
+		}
+		if (!head) continue;
+
+		fr_cursor_init(&to, vp_list);
+		fr_cursor_tail(&to);		/* Insert after the last instance */
+
+		fr_cursor_init(&from, &head);
+		fr_cursor_merge(&to, &from);
+	}
+
+	return 0;
+}
@@ -46,6 +46,18 @@ static size_t instance_num = 0;
  */
 static _Thread_local module_thread_instance_t **module_thread_inst_array;
 
+/** Tracks the module_thread_inst_array of every thread
+ *
+ * So that per-thread statistics can be merged on demand.
+ */
+typedef struct {
+	fr_dlist_t			entry;		//!< Entry in module_thread_inst_list.
+	module_thread_instance_t	**array;	//!< Thread specific module instances.
+} module_thread_inst_list_entry_t;
+
+static fr_dlist_head_t module_thread_inst_list;
+static pthread_mutex_t module_thread_inst_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /** Lookup module instances by name and lineage
  */
 static rbtree_t *module_instance_name_tree;
@@ -161,6 +173,72 @@ static int cmd_show_module_status(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUS
 	return 0;
 }
 
+static int cmd_show_module_latency(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	module_instance_t	*mi = ctx;
+	fr_time_histogram_t	latency;
+
+	module_latency(&latency, mi);
+	fr_time_histogram_fprint(fp, &latency, "latency");
+
+	return 0;
+}
+
+static int cmd_show_module_startup(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	module_instance_t		*mi = ctx;
+	module_thread_inst_list_entry_t	*entry = NULL;
+	fr_time_delta_t			thread_max = 0, thread_total = 0;
+	unsigned int			threads = 0;
+
+	pthread_mutex_lock(&module_thread_inst_list_mutex);
+	while ((entry = fr_dlist_next(&module_thread_inst_list, entry))) {
+		module_thread_instance_t *ti;
+
+		if (mi->number >= talloc_array_length(entry->array)) continue;
+
+		ti = entry->array[mi->number];
+		if (!ti) continue;
+
+		if (ti->instantiate_time > thread_max) thread_max = ti->instantiate_time;
+		thread_total += ti->instantiate_time;
+		threads++;
+	}
+	pthread_mutex_unlock(&module_thread_inst_list_mutex);
+
+	fprintf(fp, "bootstrap\t%pVs\n", fr_box_time_delta(mi->bootstrap_time));
+	fprintf(fp, "instantiate\t%pVs\n", fr_box_time_delta(mi->instantiate_time));
+	fprintf(fp, "thread_instantiate_max\t%pVs\n", fr_box_time_delta(thread_max));
+	fprintf(fp, "thread_instantiate_total\t%pVs (%u threads)\n", fr_box_time_delta(thread_total), threads);
+
+	return 0;
+}
+
+static int _module_latency_list(void *instance, void *uctx)
+{
+	module_instance_t	*mi = talloc_get_type_abort(instance, module_instance_t);
+	FILE			*fp = uctx;
+	fr_time_histogram_t	latency;
+
+	module_latency(&latency, mi);
+	if (!latency.count) return 0;
+
+	fprintf(fp, "%-24s count %-10" PRIu64 " p50 %" PRIu64 "us p99 %" PRIu64 "us max %" PRIu64 "us\n",
+		mi->name, latency.count,
+		(uint64_t) fr_time_histogram_percentile(&latency, 50) / 1000,
+		(uint64_t) fr_time_histogram_percentile(&latency, 99) / 1000,
+		(uint64_t) latency.max / 1000);
+
+	return 0;
+}
+
+static int cmd_show_module_latency_list(FILE *fp, UNUSED FILE *fp_err, UNUSED void *uctx, UNUSED fr_cmd_info_t const *info)
+{
+	(void) rbtree_walk(module_instance_name_tree, RBTREE_IN_ORDER, _module_latency_list, fp);
+
+	return 0;
+}
+
 static int cmd_set_module_status(UNUSED FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
 {
 	module_instance_t *mi = ctx;
@@ -204,6 +282,24 @@ static fr_cmd_table_t cmd_module_table[] = {
 		.read_only = true,
 	},
 
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "latency",
+		.func = cmd_show_module_latency,
+		.help = "Show call latency percentiles for a module, over all threads.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "startup",
+		.func = cmd_show_module_startup,
+		.help = "Show how long a module took to bootstrap and instantiate.",
+		.read_only = true,
+	},
+
 	{
 		.parent = "set module",
 		.add_name = true,
@@ -236,6 +332,14 @@ static fr_cmd_table_t cmd_table[] = {
 		.read_only = true,
 	},
 
+	{
+		.parent = "show module",
+		.name = "latency",
+		.func = cmd_show_module_latency_list,
+		.help = "Show call latency percentiles for all modules which have been called.",
+		.read_only = true,
+	},
+
 	{
 		.parent = "set",
 		.name = "module",
@@ -305,7 +409,7 @@ static int module_instance_data_cmp(void const *one, void const *two)
  * @param[in] module		section.
  * @param[in] max_entries	Max file descriptors to cache, and manage locks for.
  * @param[in] max_idle		Maximum time a file descriptor can be idle before it's closed.
- * @param[in] locking		Whether	or not to lock the files.
+ * @param[in] mode		How files are shared between threads.
  * @param[in] trigger_prefix	if NULL will be set automatically from the module CONF_SECTION.
  * @param[in] trigger_args	to make available in any triggers executed by the connection pool.
  * @return
@@ -316,7 +420,7 @@ exfile_t *module_exfile_init(TALLOC_CTX *ctx,
 			     CONF_SECTION *module,
 			     uint32_t max_entries,
 			     uint32_t max_idle,
-			     bool locking,
+			     exfile_mode_t mode,
 			     char const *trigger_prefix,
 			     VALUE_PAIR *trigger_args)
 {
@@ -328,7 +432,7 @@ exfile_t *module_exfile_init(TALLOC_CTX *ctx,
 		trigger_prefix = trigger_prefix_buff;
 	}
 
-	handle = exfile_init(ctx, max_entries, max_idle, locking);
+	handle = exfile_init(ctx, max_entries, max_idle, mode);
 	if (!handle) return NULL;
 
 	exfile_enable_triggers(handle, cf_section_find(module, "file", NULL), trigger_prefix, trigger_args);
@@ -1116,6 +1220,34 @@ module_thread_instance_t *module_thread(module_instance_t *mi)
 	return array[mi->number];
 }
 
+/** Merge the call latency histograms for a module from all threads
+ *
+ * The histograms are updated by each thread without locking, so the
+ * result is a snapshot which may be missing calls that are in progress.
+ *
+ * @param[out] out	Where to write the merged histogram.
+ * @param[in] mi	Module instance to retrieve latency for.
+ */
+void module_latency(fr_time_histogram_t *out, module_instance_t const *mi)
+{
+	module_thread_inst_list_entry_t *entry = NULL;
+
+	memset(out, 0, sizeof(*out));
+
+	pthread_mutex_lock(&module_thread_inst_list_mutex);
+	while ((entry = fr_dlist_next(&module_thread_inst_list, entry))) {
+		module_thread_instance_t *ti;
+
+		if (mi->number >= talloc_array_length(entry->array)) continue;
+
+		ti = entry->array[mi->number];
+		if (!ti) continue;
+
+		fr_time_histogram_merge(out, &ti->latency);
+	}
+	pthread_mutex_unlock(&module_thread_inst_list_mutex);
+}
+
 /** Retrieve module/thread specific instance data for a module
  *
  * @param[in] data	Private instance data of the module.
@@ -1175,6 +1307,7 @@ int modules_init(void)
 	MEM(module_instance_name_tree = rbtree_alloc(NULL, module_instance_name_cmp, NULL, RBTREE_FLAG_NONE));
 	MEM(module_instance_data_tree = rbtree_alloc(NULL, module_instance_data_cmp, NULL, RBTREE_FLAG_NONE));
 	instance_ctx = talloc_init("module instance context");
+	fr_dlist_init(&module_thread_inst_list, module_thread_inst_list_entry_t, entry);
 
 	return 0;
 }
@@ -1183,7 +1316,21 @@ int modules_init(void)
  */
 static int _module_thread_inst_array_free(module_thread_instance_t **array)
 {
-	size_t i, len;
+	size_t				i, len;
+	module_thread_inst_list_entry_t	*entry = NULL;
+
+	/*
+	 *	Stop other threads reading our statistics
+	 *	before the thread instances are freed.
+	 */
+	pthread_mutex_lock(&module_thread_inst_list_mutex);
+	while ((entry = fr_dlist_next(&module_thread_inst_list, entry))) {
+		if (entry->array != array) continue;
+
+		fr_dlist_remove(&module_thread_inst_list, entry);
+		break;
+	}
+	pthread_mutex_unlock(&module_thread_inst_list_mutex);
 
 	len = talloc_array_length(array);
 	for (i = 0; i < len; i++) {
@@ -1243,12 +1390,17 @@ static int _module_thread_instantiate(void *instance, void *uctx)
 
 	DEBUG4("Worker alloced %s thread instance data (%p/%p)", ti->module->name, ti, ti->data);
 	if (mi->module->thread_instantiate) {
+		fr_time_t start = fr_time();
+
 		ret = mi->module->thread_instantiate(mi->dl_inst->conf, mi->dl_inst->data,
 						     thread_inst_ctx->el, ti->data);
 		if (ret < 0) {
 			PERROR("Thread instantiation failed for module \"%s\"", mi->name);
 			return -1;
 		}
+
+		ti->instantiate_time = fr_time() - start;
+		DEBUG3("Thread instantiated module \"%s\" in %pVs", mi->name, fr_box_time_delta(ti->instantiate_time));
 	}
 
 	fr_assert(mi->number < talloc_array_length(thread_inst_ctx->array));
@@ -1274,8 +1426,17 @@ int modules_thread_instantiate(TALLOC_CTX *ctx, fr_event_list_t *el)
 	 *	Initialise the thread specific tree if this is the first time through
 	 */
 	if (!module_thread_inst_array) {
+		module_thread_inst_list_entry_t *entry;
+
 		MEM(module_thread_inst_array = talloc_zero_array(ctx, module_thread_instance_t *, instance_num + 1));
 		talloc_set_destructor(module_thread_inst_array, _module_thread_inst_array_free);
+
+		MEM(entry = talloc_zero(module_thread_inst_array, module_thread_inst_list_entry_t));
+		entry->array = module_thread_inst_array;
+
+		pthread_mutex_lock(&module_thread_inst_list_mutex);
+		fr_dlist_insert_tail(&module_thread_inst_list, entry);
+		pthread_mutex_unlock(&module_thread_inst_list_mutex);
 	}
 
 	if (rbtree_walk(module_instance_name_tree, RBTREE_IN_ORDER, _module_thread_instantiate,
@@ -1298,6 +1459,23 @@ void modules_thread_detach(void)
 	TALLOC_FREE(module_thread_inst_array);
 }
 
+/** Log how long a module took to start
+ *
+ * Modules which are slow enough to noticeably delay startup are
+ * logged without needing debugging to be enabled.
+ */
+static void module_startup_time_log(module_instance_t const *mi, char const *phase, fr_time_delta_t elapsed)
+{
+	if (elapsed >= fr_time_delta_from_sec(1)) {
+		cf_log_info(mi->dl_inst->conf, "Module \"%s\" took %pVs to %s", mi->name,
+			    fr_box_time_delta(elapsed), phase);
+		return;
+	}
+
+	cf_log_debug(mi->dl_inst->conf, "Module \"%s\" took %pVs to %s", mi->name,
+		     fr_box_time_delta(elapsed), phase);
+}
+
 /** Complete module setup by calling its instantiate function
  *
  * @param[in] instance	of module to complete instantiation for.
@@ -1328,6 +1506,8 @@ static int _module_instantiate(void *instance, UNUSED void *ctx)
 	 *	Call the instantiate method, if any.
 	 */
 	if (mi->module->instantiate) {
+		fr_time_t start = fr_time();
+
 		cf_log_debug(mi->dl_inst->conf, "Instantiating module \"%s\"", mi->name);
 
 		/*
@@ -1339,6 +1519,9 @@ static int _module_instantiate(void *instance, UNUSED void *ctx)
 
 			return -1;
 		}
+
+		mi->instantiate_time = fr_time() - start;
+		module_startup_time_log(mi, "instantiate", mi->instantiate_time);
 	}
 
 	/*
@@ -1375,10 +1558,14 @@ static int _module_instantiate(void *instance, UNUSED void *ctx)
  */
 int modules_instantiate(void)
 {
+	fr_time_t start = fr_time();
+
 	DEBUG2("#### Instantiating modules ####");
 
 	if (rbtree_walk(module_instance_name_tree, RBTREE_IN_ORDER, _module_instantiate, NULL) < 0) return -1;
 
+	DEBUG2("Instantiated all modules in %pVs", fr_box_time_delta(fr_time() - start));
+
 #ifndef NDEBUG
 	{
 		size_t size;
@@ -1599,6 +1786,8 @@ module_instance_t *module_bootstrap(module_instance_t const *parent, CONF_SECTIO
 	 *	submodules.
 	 */
 	if (mi->module->bootstrap) {
+		fr_time_t start = fr_time();
+
 		cf_log_debug(mi->dl_inst->conf, "Bootstrapping module \"%s\"", mi->name);
 
 	    	if ((mi->module->bootstrap)(mi->dl_inst->data, cs) < 0) {
@@ -1606,6 +1795,9 @@ module_instance_t *module_bootstrap(module_instance_t const *parent, CONF_SECTIO
 			talloc_free(mi);
 			return NULL;
 		}
+
+		mi->bootstrap_time = fr_time() - start;
+		module_startup_time_log(mi, "bootstrap", mi->bootstrap_time);
 	}
 
 	return mi;
@@ -99,6 +99,30 @@ typedef int (*module_thread_instantiate_t)(CONF_SECTION const *mod_cs, void *ins
  */
 typedef int (*module_thread_detach_t)(fr_event_list_t *el, void *thread);
 
+/** Live health of a module instance, as seen by load-balance sections
+ *
+ */
+typedef struct {
+	fr_time_delta_t		latency;		//!< Moving average of the response time.
+	uint32_t		loss;			//!< Moving average of the loss rate, 0 to 1024.
+	uint32_t		outstanding;		//!< Requests currently in progress.
+	uint32_t		weight;			//!< Share of traffic the instance should get,
+							///< 0 (unavailable) to 1024 (full share).
+} module_health_t;
+
+/** Module health callback
+ *
+ * Called by load-balance sections when picking a child.  This may be
+ * called from any thread, so it must only read shared data.
+ *
+ * @param[in] instance		data.
+ * @param[out] health		to fill in.
+ * @return
+ *	- 0 on success.
+ *	- -1 if no health information is available.
+ */
+typedef int (*module_health_func_t)(void const *instance, module_health_t *health);
+
 #define FR_MODULE_COMMON \
 	struct { \
 		module_instantiate_t		bootstrap;		\
@@ -176,6 +200,8 @@ struct module_s {
 	module_method_t	methods[MOD_COUNT];		//!< Pointers to the various section callbacks.
 	module_method_names_t const	*method_names;	//!< named methods
 	fr_dict_t const	 **dict;			//!< pointer to local fr_dict_t*
+
+	module_health_func_t	health;			//!< Report live health for load-balancing.
 };
 
 /** Per instance data
@@ -205,6 +231,9 @@ struct module_instance_s {
 							//!< has been set to true.
 	bool				in_name_tree;	//!< Whether this is in the name lookup tree.
 	bool				in_data_tree;	//!< Whether this is in the data lookup tree.
+
+	fr_time_delta_t			bootstrap_time;		//!< How long the bootstrap method took.
+	fr_time_delta_t			instantiate_time;	//!< How long the instantiate method took.
 };
 
 /** Per thread per instance data
@@ -225,6 +254,11 @@ struct module_thread_instance_s {
 
 	uint64_t			total_calls;	//! total number of times we've been called
 	uint64_t			active_callers; //! number of active callers.  i.e. number of current yields
+
+	fr_time_histogram_t		latency;	//!< Time from calling the module, to it returning a
+							///< final rcode, including any time spent yielded.
+
+	fr_time_delta_t			instantiate_time;	//!< How long the thread_instantiate method took.
 };
 
 /** Map string values to module state method
@@ -258,7 +292,7 @@ exfile_t	*module_exfile_init(TALLOC_CTX *ctx,
 			     	    CONF_SECTION *module,
 				    uint32_t max_entries,
 				    uint32_t max_idle,
-				    bool locking,
+				    exfile_mode_t mode,
 				    char const *trigger_prefix,
 				    VALUE_PAIR *trigger_args);
 /** @} */
@@ -294,6 +328,8 @@ module_instance_t	*module_by_data(void const *data);
 module_thread_instance_t *module_thread(module_instance_t *mi);
 
 module_thread_instance_t *module_thread_by_data(void const *data);
+
+void			module_latency(fr_time_histogram_t *out, module_instance_t const *mi) CC_HINT(nonnull);
 /** @} */
 
 /** @name Module and module thread initialisation and instantiation
@@ -0,0 +1,419 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/offload.c
+ * @brief Run blocking or CPU intensive module work in a pool of threads.
+ *
+ * Some module operations (password hashing, private key operations,
+ * calls into blocking libraries) take long enough that a worker doing
+ * them can't process any other requests.
+ *
+ * An offload pool is a set of threads, shared by all workers, which
+ * take jobs from a queue.  A worker submits a job, and yields the
+ * request.  When the job is complete, the offload thread writes the
+ * job pointer to a pipe belonging to the worker which submitted it,
+ * and the worker marks the request as resumable.
+ *
+ * If the queue is full, #fr_offload_submit fails, and the worker should
+ * run the job itself.  Under overload, that's better than delaying the
+ * request further.
+ *
+ * Each worker's pipe must be able to hold every job it can have
+ * outstanding, so that offload threads never block writing to it.
+ * That's why the queue length is bounded.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/offload.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <pthread.h>
+
+#define OFFLOAD_MAX_BATCH	256
+
+/** An offload thread
+ *
+ */
+typedef struct {
+	fr_offload_t		*pool;			//!< Pool the thread belongs to.
+	void			*ctx;			//!< Private state for the run callback.
+	pthread_t		thread;			//!< Thread handle.
+} offload_runner_t;
+
+struct fr_offload_s {
+	fr_offload_conf_t const	*conf;			//!< How the pool behaves.
+
+	fr_offload_run_t	run;			//!< Performs the work for a job.
+	void			*uctx;			//!< Passed to the run callback.
+
+	pthread_mutex_t		mutex;			//!< Protects the queue.
+	pthread_cond_t		cond;			//!< Signalled when jobs are queued, or on exit.
+	fr_dlist_head_t		queue;			//!< Jobs waiting for an offload thread.
+	uint32_t		num_queued;		//!< How many jobs are in the queue.
+
+	offload_runner_t	*runners;		//!< Offload threads.
+	uint32_t		num_runners;		//!< How many offload threads were started.
+	bool			stop;			//!< Tell the offload threads to exit.
+};
+
+/** Per-worker state
+ *
+ */
+struct fr_offload_thread_s {
+	fr_offload_t		*pool;			//!< Pool jobs are submitted to.
+	fr_event_list_t		*el;			//!< Worker's event list.
+	int			pipe[2];		//!< Completed jobs, read side is non-blocking.
+	uint32_t		outstanding;		//!< Jobs submitted and not yet returned.
+};
+
+CONF_PARSER const fr_offload_config[] = {
+	{ FR_CONF_OFFSET("threads", FR_TYPE_UINT32, fr_offload_conf_t, threads), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_queued", FR_TYPE_UINT32, fr_offload_conf_t, max_queued), .dflt = "1024" },
+	{ FR_CONF_OFFSET("batch_size", FR_TYPE_UINT32, fr_offload_conf_t, batch_size), .dflt = "1" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Main loop of an offload thread
+ *
+ * Takes up to batch_size jobs from the queue at a time, so that the
+ * queue lock is taken once per batch, and workers with several
+ * completed jobs in the batch are woken with a single write.
+ */
+static void *offload_runner(void *arg)
+{
+	offload_runner_t	*runner = arg;
+	fr_offload_t		*pool = runner->pool;
+	fr_offload_job_t	*batch[OFFLOAD_MAX_BATCH], *done[OFFLOAD_MAX_BATCH];
+	uint32_t		num, i, j;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->mutex);
+		while (!pool->stop && !fr_dlist_head(&pool->queue)) pthread_cond_wait(&pool->cond, &pool->mutex);
+		if (pool->stop) {
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+
+		for (num = 0; num < pool->conf->batch_size; num++) {
+			fr_offload_job_t *job = fr_dlist_head(&pool->queue);
+
+			if (!job) break;
+
+			fr_dlist_remove(&pool->queue, job);
+			job->queued = false;
+			pool->num_queued--;
+			batch[num] = job;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+
+		for (i = 0; i < num; i++) pool->run(batch[i], runner->ctx, pool->uctx);
+
+		/*
+		 *	Return the jobs to the workers which submitted
+		 *	them.  The write side of the pipe is blocking,
+		 *	and the number of outstanding jobs is bounded
+		 *	by max_queued, so this can't fail short of the
+		 *	worker having gone away.
+		 */
+		for (i = 0; i < num; i++) {
+			fr_offload_thread_t	*thread;
+			size_t			n = 0;
+
+			if (!batch[i]) continue;
+
+			thread = batch[i]->thread;
+			for (j = i; j < num; j++) {
+				if (!batch[j] || (batch[j]->thread != thread)) continue;
+
+				done[n++] = batch[j];
+				batch[j] = NULL;
+			}
+
+			if (write(thread->pipe[1], done, n * sizeof(done[0])) != (ssize_t)(n * sizeof(done[0]))) {
+				ERROR("Failed notifying worker of completed jobs: %s", fr_syserror(errno));
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static int _offload_free(fr_offload_t *pool)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_runners; i++) pthread_join(pool->runners[i].thread, NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+
+	return 0;
+}
+
+/** Start an offload pool
+ *
+ * Should be called from a module's instantiate callback, if conf->threads
+ * is non-zero.  Freeing the pool stops its threads, so it must be freed
+ * before anything the run callback uses.
+ *
+ * @param[in] ctx		to allocate the pool in.
+ * @param[in] cs		the pool's configuration was parsed from, for error messages.
+ * @param[in] conf		for the pool.  Out of range values are clamped.  Must
+ *				remain valid for the lifetime of the pool.
+ * @param[in] run		performs the work for a job.
+ * @param[in] thread_ctx_alloc	allocates private state for each offload thread.
+ *				May be NULL.
+ * @param[in] uctx		passed to run and thread_ctx_alloc.
+ * @return
+ *	- A new offload pool.
+ *	- NULL on error.
+ */
+fr_offload_t *fr_offload_alloc(TALLOC_CTX *ctx, CONF_SECTION const *cs, fr_offload_conf_t *conf,
+			       fr_offload_run_t run, fr_offload_thread_ctx_alloc_t thread_ctx_alloc, void *uctx)
+{
+	fr_offload_t	*pool;
+	uint32_t	i;
+
+	FR_INTEGER_BOUND_CHECK("offload.threads", conf->threads, <=, 256);
+	FR_INTEGER_BOUND_CHECK("offload.max_queued", conf->max_queued, >=, 1);
+	FR_INTEGER_BOUND_CHECK("offload.max_queued", conf->max_queued, <=, 4096);
+	FR_INTEGER_BOUND_CHECK("offload.batch_size", conf->batch_size, >=, 1);
+	FR_INTEGER_BOUND_CHECK("offload.batch_size", conf->batch_size, <=, OFFLOAD_MAX_BATCH);
+
+	MEM(pool = talloc_zero(ctx, fr_offload_t));
+	pool->conf = conf;
+	pool->run = run;
+	pool->uctx = uctx;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	fr_dlist_init(&pool->queue, fr_offload_job_t, entry);
+	MEM(pool->runners = talloc_zero_array(pool, offload_runner_t, conf->threads));
+	talloc_set_destructor(pool, _offload_free);
+
+	for (i = 0; i < conf->threads; i++) {
+		offload_runner_t	*runner = &pool->runners[i];
+		int			ret;
+
+		runner->pool = pool;
+		if (thread_ctx_alloc) {
+			runner->ctx = thread_ctx_alloc(pool->runners, uctx);
+			if (!runner->ctx) {
+				cf_log_err(cs, "Failed initialising offload thread");
+				talloc_free(pool);
+				return NULL;
+			}
+		}
+
+		ret = pthread_create(&runner->thread, NULL, offload_runner, runner);
+		if (ret != 0) {
+			cf_log_err(cs, "Failed creating offload thread: %s", fr_syserror(ret));
+			talloc_free(pool);
+			return NULL;
+		}
+		pool->num_runners++;
+	}
+
+	return pool;
+}
+
+/** Resume requests whose jobs have completed
+ *
+ */
+static void offload_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, UNUSED void *uctx)
+{
+	fr_offload_job_t	*job;
+
+	while (read(fd, &job, sizeof(job)) == sizeof(job)) {
+		job->thread->outstanding--;
+
+		if (!job->request) {
+			talloc_free(job);
+			continue;
+		}
+		unlang_interpret_resumable(job->request);
+	}
+}
+
+/** Stop accepting completed jobs, and wait for the outstanding ones
+ *
+ * Jobs still in the queue are pulled out, and the rest are waited for,
+ * so that nothing is written to a closed pipe.
+ */
+static int _offload_thread_free(fr_offload_thread_t *thread)
+{
+	fr_offload_t		*pool = thread->pool;
+	fr_offload_job_t	*job, *next;
+
+	if (thread->pipe[0] < 0) return 0;
+
+	fr_event_fd_delete(thread->el, thread->pipe[0], FR_EVENT_FILTER_IO);
+
+	pthread_mutex_lock(&pool->mutex);
+	for (job = fr_dlist_head(&pool->queue); job; job = next) {
+		next = fr_dlist_next(&pool->queue, job);
+		if (job->thread != thread) continue;
+
+		fr_dlist_remove(&pool->queue, job);
+		pool->num_queued--;
+		thread->outstanding--;
+		talloc_free(job);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	fr_blocking(thread->pipe[0]);
+	while ((thread->outstanding > 0) && (read(thread->pipe[0], &job, sizeof(job)) == sizeof(job))) {
+		thread->outstanding--;
+		talloc_free(job);
+	}
+
+	close(thread->pipe[0]);
+	close(thread->pipe[1]);
+
+	return 0;
+}
+
+/** Create the pipe which offload threads use to return jobs to a worker
+ *
+ * Should be called from a module's thread_instantiate callback.  The
+ * result must be freed in the module's thread_detach callback, while
+ * the event list is still valid.
+ *
+ * @param[in] ctx	to allocate the per-worker state in.
+ * @param[in] pool	jobs will be submitted to.
+ * @param[in] el	of the worker.
+ * @return
+ *	- Per-worker state to pass to #fr_offload_submit.
+ *	- NULL on error.
+ */
+fr_offload_thread_t *fr_offload_thread_alloc(TALLOC_CTX *ctx, fr_offload_t *pool, fr_event_list_t *el)
+{
+	fr_offload_thread_t	*thread;
+
+	MEM(thread = talloc_zero(ctx, fr_offload_thread_t));
+	thread->pool = pool;
+	thread->el = el;
+	thread->pipe[0] = thread->pipe[1] = -1;
+
+	if (pipe(thread->pipe) < 0) {
+		ERROR("Failed creating offload pipe: %s", fr_syserror(errno));
+	error:
+		talloc_free(thread);
+		return NULL;
+	}
+
+	if (fr_nonblock(thread->pipe[0]) < 0) {
+		PERROR("Failed setting offload pipe non-blocking");
+	error_close:
+		close(thread->pipe[0]);
+		close(thread->pipe[1]);
+		thread->pipe[0] = thread->pipe[1] = -1;
+		goto error;
+	}
+
+	if (fr_event_fd_insert(thread, el, thread->pipe[0], offload_read, NULL, NULL, thread) < 0) {
+		PERROR("Failed inserting offload pipe into event loop");
+		goto error_close;
+	}
+	talloc_set_destructor(thread, _offload_thread_free);
+
+	return thread;
+}
+
+/** Queue a job for an offload thread
+ *
+ * On success, the caller should yield the request, with a signal
+ * callback which calls #fr_offload_cancel.  The job is owned by the
+ * pool until the request is resumed.
+ *
+ * @param[in] thread	State of the worker submitting the job.
+ * @param[in] request	to resume when the job is complete.
+ * @param[in] job	to queue.  Must start with a #fr_offload_job_t.
+ * @return
+ *	- 0 if the job was queued.
+ *	- -1 if the queue is full.  The caller should run the job itself.
+ */
+int fr_offload_submit(fr_offload_thread_t *thread, REQUEST *request, void *job)
+{
+	fr_offload_t		*pool = thread->pool;
+	fr_offload_job_t	*oj = job;
+
+	oj->request = request;
+	oj->thread = thread;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->num_queued >= pool->conf->max_queued) {
+		pthread_mutex_unlock(&pool->mutex);
+		RDEBUG3("Offload queue full, running job in worker");
+		return -1;
+	}
+
+	fr_dlist_insert_tail(&pool->queue, oj);
+	oj->queued = true;
+	pool->num_queued++;
+	thread->outstanding++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	RDEBUG3("Running job in offload thread");
+
+	return 0;
+}
+
+/** Cancel a job whose request is being cancelled
+ *
+ * If the job is still queued it's freed immediately.  If an offload
+ * thread has it, it's freed when it's returned to the worker.
+ *
+ * @param[in] job	to cancel.
+ */
+void fr_offload_cancel(void *job)
+{
+	fr_offload_job_t	*oj = job;
+	fr_offload_thread_t	*thread = oj->thread;
+	fr_offload_t		*pool = thread->pool;
+	bool			queued;
+
+	pthread_mutex_lock(&pool->mutex);
+	queued = oj->queued;
+	if (queued) {
+		fr_dlist_remove(&pool->queue, oj);
+		oj->queued = false;
+		pool->num_queued--;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (queued) {
+		thread->outstanding--;
+		talloc_free(job);
+		return;
+	}
+	oj->request = NULL;
+}
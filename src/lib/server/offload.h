@@ -0,0 +1,106 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/offload.h
+ * @brief Run blocking or CPU intensive module work in a pool of threads.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(offload_h, "$Id$")
+
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_offload_s fr_offload_t;
+typedef struct fr_offload_thread_s fr_offload_thread_t;
+
+/** Configuration for an offload pool
+ *
+ */
+typedef struct {
+	uint32_t		threads;		//!< Number of offload threads.  0 disables the pool.
+
+	uint32_t		max_queued;		//!< Jobs are run by the worker beyond this
+							///< many queued jobs.
+
+	uint32_t		batch_size;		//!< Maximum jobs an offload thread takes
+							///< from the queue at once.
+} fr_offload_conf_t;
+
+/** Header of a job
+ *
+ * Must be the first member of the structure the module allocates for
+ * each job.  Jobs must be talloced, and parented by the NULL ctx, as
+ * they may outlive the request which submitted them.
+ */
+typedef struct {
+	REQUEST			*request;		//!< To resume, NULL if the request was cancelled.
+	fr_offload_thread_t	*thread;		//!< Worker to notify when the job is complete.
+	fr_dlist_t		entry;			//!< Entry in the pool's queue.
+	bool			queued;			//!< Job is waiting in the queue.
+} fr_offload_job_t;
+
+/** Perform the work for a job
+ *
+ * Called from an offload thread.  Must not touch the request, log
+ * against it, or allocate memory from any ctx shared with a worker.
+ *
+ * @param[in] job		to run.
+ * @param[in] thread_ctx	belonging to the calling offload thread, as returned
+ *				by the #fr_offload_thread_ctx_alloc_t callback.
+ * @param[in] uctx		passed to #fr_offload_alloc.
+ */
+typedef void (*fr_offload_run_t)(void *job, void *thread_ctx, void *uctx);
+
+/** Allocate private state for an offload thread
+ *
+ * Called from the main thread, once for each offload thread, before
+ * the thread is started.
+ *
+ * @param[in] ctx		to allocate the state in.
+ * @param[in] uctx		passed to #fr_offload_alloc.
+ * @return
+ *	- The state.
+ *	- NULL on error.
+ */
+typedef void *(*fr_offload_thread_ctx_alloc_t)(TALLOC_CTX *ctx, void *uctx);
+
+extern CONF_PARSER const fr_offload_config[];
+
+fr_offload_t		*fr_offload_alloc(TALLOC_CTX *ctx, CONF_SECTION const *cs, fr_offload_conf_t *conf,
+					  fr_offload_run_t run, fr_offload_thread_ctx_alloc_t thread_ctx_alloc,
+					  void *uctx) CC_HINT(nonnull(2,3,4));
+
+fr_offload_thread_t	*fr_offload_thread_alloc(TALLOC_CTX *ctx, fr_offload_t *pool,
+						 fr_event_list_t *el) CC_HINT(nonnull);
+
+int			fr_offload_submit(fr_offload_thread_t *thread, REQUEST *request, void *job) CC_HINT(nonnull);
+
+void			fr_offload_cancel(void *job) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -546,21 +546,23 @@ static int paircmp_func(REQUEST *request,
 	return paircmp_pairs(request, check, request_list);
 }
 
-/** Compare two pair lists except for the password information.
+/** Compare two pair lists except for the password information, using an index of the request list
  *
  * For every element in "check" at least one matching copy must be present
  * in "reply".
  *
  * @param[in] request		Current request.
  * @param[in] request_list	request valuepairs.
+ * @param[in] request_idx	index of request_list, or NULL to search it linearly.
  * @param[in] check		Check/control valuepairs.
  * @param[in,out] reply_list	Reply value pairs.
  * @return 0 on match.
  */
-int paircmp(REQUEST *request,
-	    VALUE_PAIR *request_list,
-	    VALUE_PAIR *check,
-	    VALUE_PAIR **reply_list)
+int paircmp_index(REQUEST *request,
+		  VALUE_PAIR *request_list,
+		  fr_pair_index_t *request_idx,
+		  VALUE_PAIR *check,
+		  VALUE_PAIR **reply_list)
 {
 	fr_cursor_t		cursor;
 	VALUE_PAIR		*check_item;
@@ -570,6 +572,7 @@ int paircmp(REQUEST *request,
 	int			result = 0;
 	int			compare;
 	bool			first_only;
+	bool			indexed;
 
 	for (check_item = fr_cursor_init(&cursor, &check);
 	     check_item;
@@ -617,10 +620,19 @@ int paircmp(REQUEST *request,
 		 */
 		first_only = other_attr(check_item->da, &from);
 
-		auth_item = request_list;
+		/*
+		 *	Any attribute matches if there's no "from",
+		 *	so only look up specific attributes in the index.
+		 */
+		indexed = request_idx && from && !first_only;
+		if (indexed) {
+			auth_item = fr_pair_index_find_by_da(request_idx, from, TAG_ANY);
+		} else {
+			auth_item = request_list;
+		}
 
 	try_again:
-		if (!first_only) {
+		if (!first_only && !indexed) {
 			while (auth_item != NULL) {
 				if ((auth_item->da == from) || (!from)) break;
 
@@ -704,7 +716,7 @@ int paircmp(REQUEST *request,
 		 *	another of the same attribute, which DOES match.
 		 */
 		if ((result != 0) && (!first_only)) {
-			auth_item = auth_item->next;
+			auth_item = indexed ? fr_pair_index_next_by_da(request_idx, auth_item, TAG_ANY) : auth_item->next;
 			result = 0;
 			goto try_again;
 		}
@@ -714,6 +726,25 @@ int paircmp(REQUEST *request,
 	return result;
 }
 
+/** Compare two pair lists except for the password information.
+ *
+ * For every element in "check" at least one matching copy must be present
+ * in "reply".
+ *
+ * @param[in] request		Current request.
+ * @param[in] request_list	request valuepairs.
+ * @param[in] check		Check/control valuepairs.
+ * @param[in,out] reply_list	Reply value pairs.
+ * @return 0 on match.
+ */
+int paircmp(REQUEST *request,
+	    VALUE_PAIR *request_list,
+	    VALUE_PAIR *check,
+	    VALUE_PAIR **reply_list)
+{
+	return paircmp_index(request, request_list, NULL, check, reply_list);
+}
+
 /** Find a comparison function for two attributes.
  *
  * @param[in] da	to find comparison function for.
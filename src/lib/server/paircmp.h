@@ -33,6 +33,7 @@ extern "C" {
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/util/pair.h>
+#include <freeradius-devel/util/pair_index.h>
 
 /* for paircmp_register */
 typedef int (*RAD_COMPARE_FUNC)(void *instance, REQUEST *,VALUE_PAIR *, VALUE_PAIR *, VALUE_PAIR *, VALUE_PAIR **);
@@ -41,6 +42,9 @@ int		paircmp_pairs(REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp);
 
 int		paircmp(REQUEST *request, VALUE_PAIR *req_list, VALUE_PAIR *check, VALUE_PAIR **rep_list);
 
+int		paircmp_index(REQUEST *request, VALUE_PAIR *req_list, fr_pair_index_t *req_idx,
+			      VALUE_PAIR *check, VALUE_PAIR **rep_list);
+
 int		paircmp_find(fr_dict_attr_t const *da);
 
 int		paircmp_register_by_name(char const *name, fr_dict_attr_t const *from,
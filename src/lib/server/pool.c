@@ -29,6 +29,7 @@ RCSID("$Id$")
 #define LOG_PREFIX_ARGS pool->log_prefix
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/breaker.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/util/debug.h>
 
@@ -145,6 +146,10 @@ struct fr_pool_s {
 
 	fr_pool_reconnect_t	reconnect;	//!< Called during connection pool reconnect.
 
+	fr_breaker_conf_t	breaker_conf;	//!< When to stop handing out connections to a
+						//!< failing server.
+	fr_breaker_t		*breaker;	//!< Fails requests quickly while the server is down.
+
 	fr_pool_state_t	state;			//!< Stats and state of the connection pool.
 };
 
@@ -163,6 +168,7 @@ static const CONF_PARSER pool_config[] = {
 	{ FR_CONF_OFFSET("held_trigger_max", FR_TYPE_TIME_DELTA, fr_pool_t, held_trigger_max), .dflt = "0.5" },
 	{ FR_CONF_OFFSET("retry_delay", FR_TYPE_TIME_DELTA, fr_pool_t, retry_delay), .dflt = "1" },
 	{ FR_CONF_OFFSET("spread", FR_TYPE_BOOL, fr_pool_t, spread), .dflt = "no" },
+	{ FR_CONF_OFFSET("breaker", FR_TYPE_SUBSECTION, fr_pool_t, breaker_conf), .subcs = (void const *) fr_breaker_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -259,6 +265,32 @@ static inline void fr_pool_trigger_exec(fr_pool_t *pool, REQUEST *request, char
 	trigger_exec(request, pool->cs, name, true, pool->trigger_args);
 }
 
+/** Log circuit breaker state changes, and fire the breaker_* triggers
+ *
+ */
+static void _pool_breaker_notify(UNUSED fr_breaker_t *breaker, fr_breaker_state_t state, void *uctx)
+{
+	fr_pool_t *pool = talloc_get_type_abort(uctx, fr_pool_t);
+
+	switch (state) {
+	case FR_BREAKER_OPEN:
+		ERROR("Circuit breaker opened, failing requests for %pVs",
+		      fr_box_time_delta(pool->breaker_conf.open_time));
+		fr_pool_trigger_exec(pool, NULL, "breaker_open");
+		break;
+
+	case FR_BREAKER_HALF_OPEN:
+		INFO("Circuit breaker half open, sending probe requests");
+		fr_pool_trigger_exec(pool, NULL, "breaker_half_open");
+		break;
+
+	case FR_BREAKER_CLOSED:
+		INFO("Circuit breaker closed");
+		fr_pool_trigger_exec(pool, NULL, "breaker_closed");
+		break;
+	}
+}
+
 /** Find a connection handle in the connection list
  *
  * Walks over the list of connections searching for a specified connection
@@ -443,6 +475,7 @@ static fr_pool_connection_t *connection_spawn(fr_pool_t *pool, REQUEST *request,
 		 *	may modify args.
 		 */
 		fr_pool_trigger_exec(pool, request, "fail");
+		if (pool->breaker) fr_breaker_result(pool->breaker, now, false, 0);
 		pthread_cond_broadcast(&pool->done_spawn);
 		pthread_mutex_unlock(&pool->mutex);
 
@@ -813,6 +846,26 @@ static void *connection_get_internal(fr_pool_t *pool, REQUEST *request, bool spa
 
 	now = fr_time();
 
+	/*
+	 *	Fail immediately if the server has been failing,
+	 *	so that the caller can move on to another one.
+	 */
+	if (pool->breaker && !fr_breaker_allow(pool->breaker, now)) {
+		bool complain = false;
+
+		if ((now - pool->state.last_breaker_log) > NSEC) {
+			complain = true;
+			pool->state.last_breaker_log = now;
+		}
+
+		pthread_mutex_unlock(&pool->mutex);
+		if (!fr_rate_limit_enabled() || complain) {
+			ROPTIONAL(RERROR, ERROR, "No connections available - Circuit breaker is open");
+		}
+
+		return NULL;
+	}
+
 	/*
 	 *	Grab the link with the lowest latency, and check it
 	 *	for limits.  If "connection manage" says the link is
@@ -1071,6 +1124,11 @@ fr_pool_t *fr_pool_init(TALLOC_CTX *ctx,
 	 */
 	FR_TIME_DELTA_BOUND_CHECK("connect_timeout", pool->connect_timeout, >=, fr_time_delta_from_msec(100));
 
+	if (pool->breaker_conf.error_rate) {
+		FR_INTEGER_BOUND_CHECK("breaker.error_rate", pool->breaker_conf.error_rate, <=, 100);
+		pool->breaker = fr_breaker_alloc(pool, &pool->breaker_conf, _pool_breaker_notify, pool);
+	}
+
 	/*
 	 *	Don't open any connections.  Instead, force the limits
 	 *	to only 1 connection.
@@ -1385,6 +1443,12 @@ void fr_pool_connection_release(fr_pool_t *pool, REQUEST *request, void *conn)
 
 	this->in_use = false;
 
+	if (pool->breaker) {
+		fr_time_t now = fr_time();
+
+		fr_breaker_result(pool->breaker, now, true, now - this->last_reserved);
+	}
+
 	/*
 	 *	Record when the connection was last released
 	 */
@@ -1483,6 +1547,8 @@ void *fr_pool_connection_reconnect(fr_pool_t *pool, REQUEST *request, void *conn
 
 	ROPTIONAL(RINFO, INFO, "Deleting inviable connection (%" PRIu64 ")", this->number);
 
+	if (pool->breaker) fr_breaker_result(pool->breaker, fr_time(), false, 0);
+
 	connection_close_internal(pool, request, this);
 	connection_check(pool, request);			/* Whilst we still have the lock (will release the lock) */
 
@@ -1520,6 +1586,8 @@ int fr_pool_connection_close(fr_pool_t *pool, REQUEST *request, void *conn)
 
 	ROPTIONAL(RINFO, INFO, "Deleting connection (%" PRIu64 ")", this->number);
 
+	if (pool->breaker) fr_breaker_result(pool->breaker, pool->state.last_closed, false, 0);
+
 	connection_close_internal(pool, request, this);
 	connection_check(pool, request);
 	return 1;
@@ -55,6 +55,8 @@ struct fr_pool_state_s {
 						//!< connections.
 	fr_time_t	last_released;		//!< Last time a connection was released.
 	fr_time_t	last_closed;		//!< Last time a connection was closed.
+	fr_time_t	last_breaker_log;	//!< Last time we complained about the circuit breaker
+						//!< being open.
 
 #ifdef WITH_STATS
 	fr_stats_t	held_stats;		//!< How long connections were held for.
@@ -0,0 +1,446 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/radutmp.c
+ * @brief An index of the records in a radutmp file.
+ *
+ * The radutmp file is a flat array of records, one per NAS port which
+ * has ever been seen.  Finding the record for a port, or the sessions
+ * for a user, means reading the whole file.
+ *
+ * The index is two open addressed hash tables in a file, which is
+ * mmap'd by the writer and by any readers.  The first maps NAS and
+ * port to a record.  A port keeps the same record forever, so entries
+ * are only ever added.  The second maps the case folded username to
+ * the records that user is logged in on.  Entries are removed when
+ * the user logs out, and leave a tombstone behind.
+ *
+ * Each slot is written keys first, and record last, with release
+ * semantics.  Readers load the record with acquire semantics.  They
+ * may still see a slot which is being reused, so everything returned
+ * is a candidate, to be checked against the record itself.
+ *
+ * The index is rebuilt from the radutmp file when the server starts,
+ * which also clears out the tombstones.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/radutmp.h>
+#include <freeradius-devel/util/hash.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RADUTMP_INDEX_MAGIC	(0x52555458)		//!< "RUTX"
+#define RADUTMP_INDEX_VERSION	(1)
+
+#define RADUTMP_INDEX_EMPTY	(0)			//!< Slot has never been used.
+#define RADUTMP_INDEX_DELETED	(UINT32_MAX)		//!< Slot was used, and can be reused.
+
+/** Start of the index file
+ *
+ */
+typedef struct {
+	uint32_t		magic;			//!< Written last, when the index is complete.
+	uint32_t		version;
+	uint32_t		size;			//!< Number of slots in each table.  A power of 2.
+	uint32_t		record_size;		//!< sizeof(struct radutmp) of the writer.
+} radutmp_index_hdr_t;
+
+/** Maps NAS and port to a record
+ *
+ */
+typedef struct {
+	_Atomic uint32_t	nas_address;
+	_Atomic uint32_t	nas_port;
+	_Atomic uint32_t	record;			//!< Record number + 1, or #RADUTMP_INDEX_EMPTY.
+} radutmp_index_port_t;
+
+/** Maps a username to a record
+ *
+ */
+typedef struct {
+	_Atomic uint32_t	hash;			//!< Of the case folded username.
+	_Atomic uint32_t	record;			//!< Record number + 1, #RADUTMP_INDEX_EMPTY,
+							///< or #RADUTMP_INDEX_DELETED.
+} radutmp_index_user_t;
+
+struct fr_radutmp_index_s {
+	uint8_t			*map;			//!< The whole index file.
+	size_t			len;			//!< Of the mapping.
+
+	uint32_t		mask;			//!< size - 1.
+	radutmp_index_port_t	*ports;
+	radutmp_index_user_t	*users;
+};
+
+static int _radutmp_index_free(fr_radutmp_index_t *idx)
+{
+	if (idx->map) munmap(idx->map, idx->len);
+
+	return 0;
+}
+
+static size_t radutmp_index_len(uint32_t size)
+{
+	return sizeof(radutmp_index_hdr_t) + (size * sizeof(radutmp_index_port_t)) +
+	       (size * sizeof(radutmp_index_user_t));
+}
+
+static void radutmp_index_tables(fr_radutmp_index_t *idx, uint32_t size)
+{
+	idx->mask = size - 1;
+	idx->ports = (radutmp_index_port_t *) (idx->map + sizeof(radutmp_index_hdr_t));
+	idx->users = (radutmp_index_user_t *) (idx->ports + size);
+}
+
+static inline uint32_t radutmp_index_port_hash(uint32_t nas_address, uint32_t nas_port)
+{
+	return fr_hash_update(&nas_port, sizeof(nas_port), fr_hash(&nas_address, sizeof(nas_address)));
+}
+
+/** Hash a username the way radwho -u compares it, ignoring case
+ *
+ * radutmp logins aren't always \0 terminated.
+ */
+static uint32_t radutmp_index_user_hash(char const *login)
+{
+	char	buffer[RUT_NAMESIZE];
+	size_t	i;
+
+	for (i = 0; (i < sizeof(buffer)) && login[i]; i++) buffer[i] = tolower((uint8_t) login[i]);
+
+	return fr_hash(buffer, i);
+}
+
+static inline uint32_t radutmp_index_record(off_t offset)
+{
+	return (offset / sizeof(struct radutmp)) + 1;
+}
+
+static inline off_t radutmp_index_offset(uint32_t record)
+{
+	return (off_t) (record - 1) * sizeof(struct radutmp);
+}
+
+/** Map an existing index, read only
+ *
+ * @param[in] ctx	to allocate the index in.
+ * @param[in] filename	of the radutmp file, not the index.
+ * @return
+ *	- The index.
+ *	- NULL if there is no index, or it's unusable.
+ */
+fr_radutmp_index_t *fr_radutmp_index_open(TALLOC_CTX *ctx, char const *filename)
+{
+	fr_radutmp_index_t	*idx;
+	radutmp_index_hdr_t	const *hdr;
+	char			buffer[PATH_MAX];
+	struct stat		st;
+	int			fd;
+
+	snprintf(buffer, sizeof(buffer), "%s.idx", filename);
+
+	fd = open(buffer, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", buffer, fr_syserror(errno));
+		return NULL;
+	}
+
+	if ((fstat(fd, &st) < 0) || ((size_t) st.st_size < sizeof(radutmp_index_hdr_t))) {
+		fr_strerror_printf("Index %s is truncated", buffer);
+		close(fd);
+		return NULL;
+	}
+
+	MEM(idx = talloc_zero(ctx, fr_radutmp_index_t));
+	idx->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (idx->map == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping %s: %s", buffer, fr_syserror(errno));
+		idx->map = NULL;
+		talloc_free(idx);
+		return NULL;
+	}
+	idx->len = st.st_size;
+	talloc_set_destructor(idx, _radutmp_index_free);
+
+	hdr = (radutmp_index_hdr_t const *) idx->map;
+	if ((hdr->magic != RADUTMP_INDEX_MAGIC) || (hdr->version != RADUTMP_INDEX_VERSION) ||
+	    (hdr->record_size != sizeof(struct radutmp)) ||
+	    !hdr->size || (hdr->size & (hdr->size - 1)) || (radutmp_index_len(hdr->size) != idx->len)) {
+		fr_strerror_printf("Index %s was not written by this version of the server", buffer);
+		talloc_free(idx);
+		return NULL;
+	}
+	radutmp_index_tables(idx, hdr->size);
+
+	return idx;
+}
+
+/** Write a new index from the contents of a radutmp file
+ *
+ * The caller should hold the lock on the radutmp file.  The new index
+ * is written to a temporary file, and renamed over the old one, so
+ * readers never see a partial index.
+ *
+ * @param[in] ctx		to allocate the index in.
+ * @param[in] filename		of the radutmp file.
+ * @param[in] fd		the radutmp file, open for reading.
+ * @param[in] size		Maximum number of NAS ports which will be seen.
+ * @param[in] permission	to create the index file with.
+ * @return
+ *	- The index, mapped read/write.
+ *	- NULL on error.
+ */
+fr_radutmp_index_t *fr_radutmp_index_rebuild(TALLOC_CTX *ctx, char const *filename, int fd,
+					     uint32_t size, uint32_t permission)
+{
+	fr_radutmp_index_t	*idx;
+	radutmp_index_hdr_t	*hdr;
+	char			buffer[PATH_MAX], tmp[PATH_MAX];
+	struct radutmp		u;
+	off_t			offset;
+	int			ifd;
+	uint32_t		slots;
+
+	/*
+	 *	Keep the tables under half full, so probe
+	 *	sequences stay short.
+	 */
+	slots = 16;
+	while ((slots < (1U << 30)) && (slots < ((uint64_t) size * 2))) slots <<= 1;
+
+	snprintf(buffer, sizeof(buffer), "%s.idx", filename);
+	snprintf(tmp, sizeof(tmp), "%s.idx.tmp", filename);
+
+	ifd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, permission);
+	if (ifd < 0) {
+		fr_strerror_printf("Failed creating %s: %s", tmp, fr_syserror(errno));
+		return NULL;
+	}
+
+	MEM(idx = talloc_zero(ctx, fr_radutmp_index_t));
+	idx->len = radutmp_index_len(slots);
+
+	if (ftruncate(ifd, idx->len) < 0) {
+		fr_strerror_printf("Failed sizing %s: %s", tmp, fr_syserror(errno));
+	error:
+		close(ifd);
+		unlink(tmp);
+		talloc_free(idx);
+		return NULL;
+	}
+
+	idx->map = mmap(NULL, idx->len, PROT_READ | PROT_WRITE, MAP_SHARED, ifd, 0);
+	if (idx->map == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping %s: %s", tmp, fr_syserror(errno));
+		idx->map = NULL;
+		goto error;
+	}
+	talloc_set_destructor(idx, _radutmp_index_free);
+	radutmp_index_tables(idx, slots);
+
+	for (offset = 0;
+	     pread(fd, &u, sizeof(u), offset) == sizeof(u);
+	     offset += sizeof(u)) {
+		if (fr_radutmp_index_port_add(idx, u.nas_address, u.nas_port, offset) < 0) {
+			fr_strerror_printf("Index %s is full, increase the index size", tmp);
+			goto error;
+		}
+
+		if (u.type != P_LOGIN) continue;
+
+		if (fr_radutmp_index_user_add(idx, u.login, offset) < 0) {
+			fr_strerror_printf("Index %s is full, increase the index size", tmp);
+			goto error;
+		}
+	}
+
+	hdr = (radutmp_index_hdr_t *) idx->map;
+	hdr->version = RADUTMP_INDEX_VERSION;
+	hdr->size = slots;
+	hdr->record_size = sizeof(struct radutmp);
+	hdr->magic = RADUTMP_INDEX_MAGIC;
+
+	if (rename(tmp, buffer) < 0) {
+		fr_strerror_printf("Failed renaming %s to %s: %s", tmp, buffer, fr_syserror(errno));
+		goto error;
+	}
+	close(ifd);
+
+	return idx;
+}
+
+/** Find the record for a NAS port
+ *
+ * @return
+ *	- The offset of the record in the radutmp file.
+ *	- -1 if the port has no record.
+ */
+off_t fr_radutmp_index_port_find(fr_radutmp_index_t const *idx, uint32_t nas_address, uint32_t nas_port)
+{
+	uint32_t	hash = radutmp_index_port_hash(nas_address, nas_port);
+	uint32_t	i;
+
+	for (i = 0; i <= idx->mask; i++) {
+		radutmp_index_port_t	*slot = &idx->ports[(hash + i) & idx->mask];
+		uint32_t		record;
+
+		record = atomic_load_explicit(&slot->record, memory_order_acquire);
+		if (record == RADUTMP_INDEX_EMPTY) break;
+
+		if ((atomic_load_explicit(&slot->nas_address, memory_order_relaxed) == nas_address) &&
+		    (atomic_load_explicit(&slot->nas_port, memory_order_relaxed) == nas_port)) {
+			return radutmp_index_offset(record);
+		}
+	}
+
+	return -1;
+}
+
+/** Record where the record for a NAS port is
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the index is full.
+ */
+int fr_radutmp_index_port_add(fr_radutmp_index_t *idx, uint32_t nas_address, uint32_t nas_port, off_t offset)
+{
+	uint32_t	hash = radutmp_index_port_hash(nas_address, nas_port);
+	uint32_t	i;
+
+	for (i = 0; i <= idx->mask; i++) {
+		radutmp_index_port_t	*slot = &idx->ports[(hash + i) & idx->mask];
+
+		if (atomic_load_explicit(&slot->record, memory_order_relaxed) == RADUTMP_INDEX_EMPTY) {
+			atomic_store_explicit(&slot->nas_address, nas_address, memory_order_relaxed);
+			atomic_store_explicit(&slot->nas_port, nas_port, memory_order_relaxed);
+			atomic_store_explicit(&slot->record, radutmp_index_record(offset), memory_order_release);
+			return 0;
+		}
+
+		if ((atomic_load_explicit(&slot->nas_address, memory_order_relaxed) == nas_address) &&
+		    (atomic_load_explicit(&slot->nas_port, memory_order_relaxed) == nas_port)) {
+			atomic_store_explicit(&slot->record, radutmp_index_record(offset), memory_order_release);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/** Return the next record a user may be logged in on
+ *
+ * @param[in] idx	to search.
+ * @param[in,out] cursor	Set to 0 before the first call.
+ * @param[in] login	to look for.  Case is ignored.
+ * @return
+ *	- The offset of a candidate record in the radutmp file.
+ *	- -1 if there are no more candidates.
+ */
+off_t fr_radutmp_index_user_next(fr_radutmp_index_t const *idx, uint32_t *cursor, char const *login)
+{
+	uint32_t	hash = radutmp_index_user_hash(login);
+
+	while (*cursor <= idx->mask) {
+		radutmp_index_user_t	*slot = &idx->users[(hash + *cursor) & idx->mask];
+		uint32_t		record;
+
+		(*cursor)++;
+
+		record = atomic_load_explicit(&slot->record, memory_order_acquire);
+		if (record == RADUTMP_INDEX_EMPTY) break;
+		if (record == RADUTMP_INDEX_DELETED) continue;
+
+		if (atomic_load_explicit(&slot->hash, memory_order_relaxed) == hash) return radutmp_index_offset(record);
+	}
+
+	*cursor = idx->mask + 1;
+
+	return -1;
+}
+
+/** Record that a user is logged in on a record
+ *
+ * @return
+ *	- 0 on success, or if the entry already exists.
+ *	- -1 if the index is full.
+ */
+int fr_radutmp_index_user_add(fr_radutmp_index_t *idx, char const *login, off_t offset)
+{
+	uint32_t		hash = radutmp_index_user_hash(login);
+	uint32_t		want = radutmp_index_record(offset);
+	radutmp_index_user_t	*free_slot = NULL;
+	uint32_t		i;
+
+	for (i = 0; i <= idx->mask; i++) {
+		radutmp_index_user_t	*slot = &idx->users[(hash + i) & idx->mask];
+		uint32_t		record;
+
+		record = atomic_load_explicit(&slot->record, memory_order_relaxed);
+		if (record == RADUTMP_INDEX_EMPTY) {
+			if (!free_slot) free_slot = slot;
+			break;
+		}
+
+		if (record == RADUTMP_INDEX_DELETED) {
+			if (!free_slot) free_slot = slot;
+			continue;
+		}
+
+		if ((record == want) && (atomic_load_explicit(&slot->hash, memory_order_relaxed) == hash)) return 0;
+	}
+
+	if (!free_slot) return -1;
+
+	atomic_store_explicit(&free_slot->hash, hash, memory_order_relaxed);
+	atomic_store_explicit(&free_slot->record, want, memory_order_release);
+
+	return 0;
+}
+
+/** Record that a user has logged out of a record
+ *
+ */
+void fr_radutmp_index_user_del(fr_radutmp_index_t *idx, char const *login, off_t offset)
+{
+	uint32_t	hash = radutmp_index_user_hash(login);
+	uint32_t	want = radutmp_index_record(offset);
+	uint32_t	i;
+
+	for (i = 0; i <= idx->mask; i++) {
+		radutmp_index_user_t	*slot = &idx->users[(hash + i) & idx->mask];
+		uint32_t		record;
+
+		record = atomic_load_explicit(&slot->record, memory_order_relaxed);
+		if (record == RADUTMP_INDEX_EMPTY) return;
+
+		if ((record == want) && (atomic_load_explicit(&slot->hash, memory_order_relaxed) == hash)) {
+			atomic_store_explicit(&slot->record, RADUTMP_INDEX_DELETED, memory_order_release);
+			return;
+		}
+	}
+}
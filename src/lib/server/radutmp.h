@@ -25,6 +25,10 @@
  */
 RCSIDH(radutmp_h, "$Id$")
 
+#include <freeradius-devel/util/talloc.h>
+
+#include <sys/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -74,6 +78,36 @@ struct radutmp {
 #define RUT_NAMESIZE sizeof(((struct radutmp *) NULL)->login)
 #define RUT_SESSSIZE sizeof(((struct radutmp *) NULL)->session_id)
 
+/** An mmap'd index of the records in a radutmp file
+ *
+ * Lives beside the radutmp file, in "<filename>.idx".  It maps NAS
+ * and port to the offset of the record for that port, and username
+ * to the offsets of the records that user is logged in on.
+ *
+ * Only the module which owns the radutmp file writes the index.
+ * Readers don't take locks, so the index only gives candidates.
+ * They must read the record at the offset, and check it matches.
+ */
+typedef struct fr_radutmp_index_s fr_radutmp_index_t;
+
+fr_radutmp_index_t	*fr_radutmp_index_open(TALLOC_CTX *ctx, char const *filename);
+
+fr_radutmp_index_t	*fr_radutmp_index_rebuild(TALLOC_CTX *ctx, char const *filename, int fd,
+						  uint32_t size, uint32_t permission);
+
+off_t			fr_radutmp_index_port_find(fr_radutmp_index_t const *idx,
+						   uint32_t nas_address, uint32_t nas_port);
+
+int			fr_radutmp_index_port_add(fr_radutmp_index_t *idx,
+						  uint32_t nas_address, uint32_t nas_port, off_t offset);
+
+off_t			fr_radutmp_index_user_next(fr_radutmp_index_t const *idx, uint32_t *cursor,
+						   char const *login);
+
+int			fr_radutmp_index_user_add(fr_radutmp_index_t *idx, char const *login, off_t offset);
+
+void			fr_radutmp_index_user_del(fr_radutmp_index_t *idx, char const *login, off_t offset);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,11 +28,21 @@ RCSID("$Id$")
 #include <freeradius-devel/server/regex.h>
 #include <freeradius-devel/server/request_data.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/rbtree.h>
+#include <freeradius-devel/util/thread_local.h>
 
 #ifdef HAVE_REGEX
 
 #define REQUEST_DATA_REGEX (0xadbeef00)
 
+/** Maximum number of dynamically compiled expressions kept per thread
+ *
+ */
+#ifndef REGEX_CACHE_MAX
+#  define REGEX_CACHE_MAX	(256)
+#endif
+
 typedef struct {
 #if defined(HAVE_REGEX_PCRE) || defined(HAVE_REGEX_PCRE2)
 	regex_t		*preg;		//!< Compiled pattern.
@@ -40,6 +50,153 @@ typedef struct {
 	fr_regmatch_t	*regmatch;	//!< Match vectors.
 } fr_regcapture_t;
 
+/** A dynamically compiled expression
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< In the LRU list.
+	char const		*pattern;	//!< As expanded.
+	size_t			len;		//!< Of the pattern.
+	fr_regex_flags_t	flags;		//!< The expression was compiled with.
+	bool			subcaptures;	//!< Whether subcapture data is available.
+	regex_t			*preg;		//!< The compiled expression.
+} regex_cache_entry_t;
+
+/** Per-thread cache of dynamically compiled expressions
+ *
+ */
+typedef struct {
+	rbtree_t		*tree;		//!< Entries indexed by pattern and flags.
+	fr_dlist_head_t		lru;		//!< Most recently used at the head.
+} regex_cache_t;
+
+static _Thread_local regex_cache_t *regex_cache;
+
+static int regex_cache_cmp(void const *one, void const *two)
+{
+	regex_cache_entry_t const	*a = one, *b = two;
+	int				ret;
+
+	if (a->len != b->len) return (a->len > b->len) - (a->len < b->len);
+	if (a->subcaptures != b->subcaptures) return a->subcaptures - b->subcaptures;
+
+	ret = memcmp(&a->flags, &b->flags, sizeof(a->flags));
+	if (ret != 0) return (ret > 0) - (ret < 0);
+
+	ret = memcmp(a->pattern, b->pattern, a->len);
+	return (ret > 0) - (ret < 0);
+}
+
+static void _regex_cache_free_on_exit(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Remove an entry from the cache
+ *
+ * The expression itself is only freed once no request holds a
+ * reference to it.
+ */
+static void regex_cache_evict(regex_cache_t *cache, regex_cache_entry_t *entry)
+{
+	fr_dlist_remove(&cache->lru, entry);
+	rbtree_deletebydata(cache->tree, entry);
+	talloc_unlink(entry, entry->preg);
+	talloc_free(entry);
+}
+
+/** Compile a dynamic expression, re-using the result of a previous compilation if possible
+ *
+ * Expressions built from expansions are usually the same from one
+ * request to the next, so compiling them again each time is wasted
+ * work.  Each thread keeps the most recently used expressions.
+ *
+ * The expression is owned by the cache, and MUST NOT be freed by the
+ * caller.  It remains valid until the request is freed.
+ *
+ * @param[in] request		The expression is being used for.
+ * @param[out] out		Where to write the compiled expression.
+ * @param[in] pattern		to compile.
+ * @param[in] len		of pattern.
+ * @param[in] flags		controlling matching. May be NULL.
+ * @param[in] subcaptures	Whether to compile the regular expression to store subcapture
+ *				data.
+ * @return
+ *	- >= 1 on success.
+ *	- <= 0 on error. Negative value is offset of parse error.
+ */
+ssize_t regex_compile_cached(REQUEST *request, regex_t **out, char const *pattern, size_t len,
+			     fr_regex_flags_t const *flags, bool subcaptures)
+{
+	regex_cache_t		*cache = regex_cache;
+	regex_cache_entry_t	find, *entry;
+	regex_t			*preg;
+	ssize_t			slen;
+
+	*out = NULL;
+
+	if (unlikely(!cache)) {
+		MEM(cache = talloc_zero(NULL, regex_cache_t));
+		MEM(cache->tree = rbtree_talloc_alloc(cache, regex_cache_cmp, regex_cache_entry_t,
+						      NULL, RBTREE_FLAG_NONE));
+		fr_dlist_init(&cache->lru, regex_cache_entry_t, entry);
+		fr_thread_local_set_destructor(regex_cache, _regex_cache_free_on_exit, cache);
+	}
+
+	memset(&find, 0, sizeof(find));
+	find.pattern = pattern;
+	find.len = len;
+	if (flags) find.flags = *flags;
+	find.subcaptures = subcaptures;
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (entry) {
+		fr_dlist_remove(&cache->lru, entry);
+		fr_dlist_insert_head(&cache->lru, entry);
+		preg = entry->preg;
+		goto done;
+	}
+
+	slen = regex_compile(NULL, &preg, pattern, len, flags, subcaptures, true);
+	if (slen <= 0) return slen;
+
+	/*
+	 *	Don't let regex_sub_to_request() steal it from the
+	 *	cache.
+	 */
+#if defined(HAVE_REGEX_PCRE) || defined(HAVE_REGEX_PCRE2)
+	preg->precompiled = true;
+#endif
+
+	if (fr_dlist_num_elements(&cache->lru) >= REGEX_CACHE_MAX) {
+		regex_cache_evict(cache, fr_dlist_tail(&cache->lru));
+	}
+
+	MEM(entry = talloc_zero(cache, regex_cache_entry_t));
+	entry->pattern = talloc_memdup(entry, pattern, len);
+	entry->len = len;
+	entry->flags = find.flags;
+	entry->subcaptures = subcaptures;
+	entry->preg = talloc_steal(entry, preg);
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		talloc_free(entry);
+		return -1;
+	}
+	fr_dlist_insert_head(&cache->lru, entry);
+
+done:
+	/*
+	 *	Keep the expression alive, even if it's evicted,
+	 *	because subcaptures may refer to it.
+	 */
+	if (!talloc_reference(request, preg)) return -1;
+
+	*out = preg;
+
+	return len;
+}
+
 /** Adds subcapture values to request data
  *
  * Allows use of %{n} expansions.
@@ -41,6 +41,9 @@ extern "C" {
  */
 #  define REQUEST_MAX_REGEX 32
 
+ssize_t	regex_compile_cached(REQUEST *request, regex_t **out, char const *pattern, size_t len,
+			     fr_regex_flags_t const *flags, bool subcaptures);
+
 void	regex_sub_to_request(REQUEST *request, regex_t **preg, fr_regmatch_t **regmatch);
 
 int	regex_request_to_sub(TALLOC_CTX *ctx, char **out, REQUEST *request, uint32_t num);
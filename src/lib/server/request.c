@@ -34,6 +34,16 @@ RCSID("$Id$")
  */
 static _Thread_local fr_dlist_head_t *request_free_list; /* macro */
 
+/** Extra memory reserved in each new request for the data allocated during processing
+ *
+ */
+static _Thread_local size_t request_pool_size;
+
+/** Where to record allocator statistics for this thread, if anywhere
+ *
+ */
+static _Thread_local request_alloc_stats_t *request_alloc_stats;
+
 #ifndef NDEBUG
 static int _state_ctx_free(TALLOC_CTX *state)
 {
@@ -96,6 +106,7 @@ static void request_init(char const *file, int line, REQUEST *request)
 	request->seq_start = 0;
 	request->runnable_id = -1;
 	request->time_order_id = -1;
+	fr_dlist_entry_init(&request->seen_entry);
 
 	/*
 	 *	Where the request was allocated
@@ -135,6 +146,7 @@ static int _request_free(REQUEST *request)
 	if (fr_dlist_num_elements(request_free_list) <= 256) {
 		TALLOC_CTX		*state_ctx;
 		fr_dlist_head_t		*free_list;
+		size_t			pool_size;
 
 		/*
 		 *	Ensure any data associated
@@ -146,6 +158,7 @@ static int _request_free(REQUEST *request)
 			talloc_free_children(request->state_ctx);
 		}
 		free_list = request_free_list;
+		pool_size = request->pool_size;
 
 		/*
 		 *	Reinitialise the request
@@ -154,6 +167,7 @@ static int _request_free(REQUEST *request)
 		memset(request, 0, sizeof(*request));
 		request->component = "free_list";
 		request->state_ctx = state_ctx;		/* Use the old, now cleared, state_ctx */
+		request->pool_size = pool_size;		/* The pool is still there */
 
 		/*
 		 *	Reinsert into the free list
@@ -171,6 +185,8 @@ static int _request_free(REQUEST *request)
 	talloc_free_children(request);
 
 really_free:
+	if (request_alloc_stats) request_alloc_stats->freed++;
+
 	/*
 	 *	state_ctx is parented separately.
 	 *
@@ -222,13 +238,67 @@ static void _request_free_list_free_on_exit(void *arg)
 	talloc_free(list);
 }
 
+/** Set how much memory new requests allocated by this thread reserve for their own data
+ *
+ * Attributes, packet data and module data allocated in the context of the request
+ * are carved out of this memory, and all of it is reset in one go when the
+ * request is returned to the free list.  Anything which doesn't fit is allocated
+ * from the heap as normal.
+ *
+ * @param[in] size	in bytes.  Only affects requests allocated after the call.
+ */
+void request_alloc_pool_size_set(size_t size)
+{
+	request_pool_size = size;
+}
+
+/** Record request allocator statistics for this thread
+ *
+ * @param[in] stats	to update, or NULL to stop recording.  Must remain valid
+ *			until this function is called again with NULL.
+ */
+void request_alloc_stats_set(request_alloc_stats_t *stats)
+{
+	request_alloc_stats = stats;
+}
+
+/** How many free requests to look through for one with a suitable pool
+ *
+ */
+#define REQUEST_FREE_LIST_SEARCH	(8)
+
+/** Bytes reserved in a request for everything other than request data
+ *
+ */
+#define REQUEST_POOL_FIXED	((UNLANG_FRAME_PRE_ALLOC * UNLANG_STACK_MAX) + (sizeof(RADIUS_PACKET) * 2) + 128)
+
 /** Create a new REQUEST data structure
  *
+ * Uses the pool size set with request_alloc_pool_size_set().
  */
 REQUEST *_request_alloc(char const *file, int line, TALLOC_CTX *ctx)
+{
+	return _request_alloc_pooled(file, line, ctx, request_pool_size);
+}
+
+/** Create a new REQUEST data structure, reserving a given amount of memory for request data
+ *
+ * Free requests are reused if their pool holds at least size bytes, and
+ * not more than four times that.  Otherwise a new request is allocated,
+ * so that small requests don't permanently tie up large pools, and large
+ * requests don't overflow small ones.
+ *
+ * @param[in] file	the request was allocated in.
+ * @param[in] line	the request was allocated on.
+ * @param[in] ctx	to bind the lifetime of the request to.
+ * @param[in] size	of the memory to reserve for request data.
+ * @return the new request.
+ */
+REQUEST *_request_alloc_pooled(char const *file, int line, TALLOC_CTX *ctx, size_t size)
 {
 	REQUEST			*request;
 	fr_dlist_head_t		*free_list;
+	unsigned int		i;
 
 	/*
 	 *	Setup the free list, or return the free
@@ -242,7 +312,15 @@ REQUEST *_request_alloc(char const *file, int line, TALLOC_CTX *ctx)
 		free_list = request_free_list;
 	}
 
-	request = fr_dlist_head(free_list);
+	for (request = fr_dlist_head(free_list), i = 0;
+	     request && (i < REQUEST_FREE_LIST_SEARCH);
+	     request = fr_dlist_next(free_list, request), i++) {
+		if ((request->pool_size >= size) && (request->pool_size <= (size * 4))) break;
+
+		if (request_alloc_stats) request_alloc_stats->mismatched++;
+	}
+	if (i == REQUEST_FREE_LIST_SEARCH) request = NULL;
+
 	if (!request) {
 		/*
 		 *	Only allocate requests in the NULL
@@ -257,18 +335,21 @@ REQUEST *_request_alloc(char const *file, int line, TALLOC_CTX *ctx)
 							1 + 				/* Stack pool */
 							UNLANG_STACK_MAX + 		/* Stack Frames */
 							2 + 				/* packets */
-							10,				/* extra */
-							(UNLANG_FRAME_PRE_ALLOC * UNLANG_STACK_MAX) +	/* Stack memory */
-							(sizeof(RADIUS_PACKET) * 2) +	/* packets */
-							128				/* extra */
+							10 +				/* extra */
+							(size / 128),			/* request data */
+							REQUEST_POOL_FIXED +		/* stack memory, packets and extra */
+							size				/* request data */
 							));
 		talloc_set_destructor(request, _request_free);
+		request->pool_size = size;
+		if (request_alloc_stats) request_alloc_stats->alloced++;
 	} else {
 		/*
 		 *	Remove from the free list, as we're
 		 *	about to use it!
 		 */
 		fr_dlist_remove(free_list, request);
+		if (request_alloc_stats) request_alloc_stats->reused++;
 	}
 
 	request_init(file, line, request);
@@ -285,6 +366,26 @@ REQUEST *_request_alloc(char const *file, int line, TALLOC_CTX *ctx)
 	return request;
 }
 
+/** How much request data is allocated in the context of a request
+ *
+ * Excludes the memory reserved for the interpreter stack and the packets.
+ * If this is greater than request->pool_size, the request data didn't fit
+ * in the pool, and some of it was allocated from the heap.
+ *
+ * @note Walks every chunk allocated in the request, so it's not free.
+ *
+ * @param[in] request	to check.
+ * @return the number of bytes.
+ */
+size_t request_alloc_pool_used(REQUEST *request)
+{
+	size_t used = talloc_total_size(request);
+
+	if (used <= (sizeof(*request) + REQUEST_POOL_FIXED)) return 0;
+
+	return used - (sizeof(*request) + REQUEST_POOL_FIXED);
+}
+
 /** Allocate a request that's not in the free list
  *
  * This can be useful if modules need a persistent request for their own purposes
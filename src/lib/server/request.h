@@ -134,6 +134,8 @@ struct fr_request_s {
 
 	int32_t			runnable_id;	//!< entry in the queue / heap of runnable packets
 	int32_t			time_order_id;	//!< entry in the queue / heap of time ordered packets
+	fr_dlist_t		seen_entry;	//!< entry in the list of requests ordered by when the
+						//!< client last sent a copy of the packet.
 
 	main_config_t const	*config;	//!< Pointer to the main config hack to try and deal with hup.
 
@@ -149,6 +151,8 @@ struct fr_request_s {
 
 	uint32_t		options;	//!< mainly for proxying EAP-MSCHAPv2.
 
+	bool			traced;		//!< Record trace events for this request, see trace.h.
+
 	fr_async_t		*async;		//!< for new async listeners
 
 	char const		*alloc_file;	//!< File the request was allocated in.
@@ -156,6 +160,9 @@ struct fr_request_s {
 	int			alloc_line;	//!< Line the request was allocated on.
 
 	fr_dlist_t		free_entry;	//!< Request's entry in the free list.
+
+	size_t			pool_size;	//!< Memory reserved for request data when the
+						///< request was allocated.  Kept across reuse.
 };				/* REQUEST typedef */
 
 #ifdef WITH_VERIFY_PTR
@@ -179,9 +186,29 @@ struct fr_request_s {
 #define RAD_REQUEST_OPTION_CTX	(1 << 1)
 #define RAD_REQUEST_OPTION_DETAIL (1 << 2)
 
+/** Counters for the thread local request allocator
+ *
+ */
+typedef struct {
+	uint64_t		alloced;	//!< Requests allocated from the heap.
+	uint64_t		reused;		//!< Requests taken from the free list.
+	uint64_t		freed;		//!< Requests returned to the heap.
+	uint64_t		mismatched;	//!< Free requests passed over because their pool
+						///< was the wrong size.
+} request_alloc_stats_t;
+
+void		request_alloc_pool_size_set(size_t size);
+
+void		request_alloc_stats_set(request_alloc_stats_t *stats);
+
 #define		request_alloc(_ctx) _request_alloc( __FILE__, __LINE__, _ctx)
 REQUEST		*_request_alloc(char const *file, int line, TALLOC_CTX *ctx);
 
+#define		request_alloc_pooled(_ctx, _size) _request_alloc_pooled( __FILE__, __LINE__, _ctx, _size)
+REQUEST		*_request_alloc_pooled(char const *file, int line, TALLOC_CTX *ctx, size_t size);
+
+size_t		request_alloc_pool_used(REQUEST *request);
+
 #define		request_local_alloc(_ctx) _request_local_alloc(__FILE__, __LINE__, _ctx)
 REQUEST		*_request_local_alloc(char const *file, int line, TALLOC_CTX *ctx);
 
@@ -50,11 +50,20 @@ RCSID("$Id$")
 #include <freeradius-devel/server/state.h>
 #include <freeradius-devel/util/debug.h>
 
+#include <freeradius-devel/internal/internal.h>
+#include <freeradius-devel/io/pair.h>
 #include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/net.h>
 #include <freeradius-devel/util/rand.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 /** Holds a state value, and associated VALUE_PAIRs and data
  *
  */
@@ -109,31 +118,66 @@ typedef struct {
 
 	fr_dlist_head_t		data;				//!< Persistable request data, also parented by ctx.
 
+	uint8_t			*packed;			//!< session-state VALUE_PAIRs in their internal
+								///< encoding, used instead of vps when the tree
+								///< compacts entries.  Parented by ctx.
+	size_t			packed_len;			//!< Length of the packed data.
+
+	size_t			size;				//!< Memory used by the entry while it's parked.
+
 	REQUEST			*thawed;			//!< The request that thawed this entry.
 } fr_state_entry_t;
 
-struct fr_state_tree_s {
-	uint64_t		id;				//!< Next ID to assign.
+/** A portion of the state tree, with its own lock
+ *
+ * Entries are spread across the shards by a hash of their state value,
+ * so requests belonging to different sessions rarely contend for the
+ * same mutex.
+ */
+typedef struct {
+	rbtree_t		*tree;				//!< rbtree used to lookup state value.
+	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
 	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+} fr_state_shard_t;
+
+/** Number of shards in a state tree
+ *
+ * Must be a power of 2.
+ */
+#define STATE_TREE_SHARDS	(16)
+
+struct fr_state_tree_s {
+	atomic_uint_fast64_t	id;				//!< Next ID to assign.
+	atomic_uint_fast32_t	tracked;			//!< Number of entries in all the shards.
 	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
-	rbtree_t		*tree;				//!< rbtree used to lookup state value.
-	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
 
 	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
 
-	bool			thread_safe;			//!< Whether we lock the tree whilst modifying it.
-	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	bool			thread_safe;			//!< Whether we lock the shards whilst modifying them.
+
+	bool			compact;			//!< Encode session-state while entries are parked.
+	atomic_uint_fast64_t	size;				//!< Memory used by all parked entries.
+	atomic_uint_fast32_t	packed;				//!< Number of parked entries which are compacted.
 
 	uint8_t			server_id;			//!< ID to use for load balancing.
 
 	fr_dict_attr_t const	*da;				//!< State attribute used.
+
+	unsigned int		num_shards;			//!< Number of shards which have been initialised.
+	fr_state_shard_t	shard[STATE_TREE_SHARDS];	//!< Entries, split by the hash of their state value.
 };
 
+/** Maximum length of compacted session-state
+ *
+ */
+#define STATE_PACKED_MAX_LEN	(65536)
+
 #define PTHREAD_MUTEX_LOCK if (state->thread_safe) pthread_mutex_lock
 #define PTHREAD_MUTEX_UNLOCK if (state->thread_safe) pthread_mutex_unlock
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry);
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -145,27 +189,41 @@ static int state_entry_cmp(void const *one, void const *two)
 	return memcmp(a->state, b->state, sizeof(a->state));
 }
 
+/** Return the shard an entry belongs in
+ *
+ * @note The server hash must already have been applied to the state value.
+ */
+static inline fr_state_shard_t *state_shard(fr_state_tree_t *state, fr_state_entry_t const *entry)
+{
+	return &state->shard[fr_hash(entry->state, sizeof(entry->state)) & (STATE_TREE_SHARDS - 1)];
+}
+
 /** Free the state tree
  *
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
-	fr_state_entry_t *entry;
-
-	if (state->thread_safe) pthread_mutex_destroy(&state->mutex);
+	fr_state_entry_t	*entry;
+	unsigned int		i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while ((entry = fr_dlist_head(&state->to_expire))) {
-		DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
-		state_entry_unlink(state, entry);
-		talloc_free(entry);
-	}
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shard[i];
 
-	/*
-	 *	Free the rbtree
-	 */
-	talloc_free(state->tree);
+		if (state->thread_safe) pthread_mutex_destroy(&shard->mutex);
+
+		while ((entry = fr_dlist_head(&shard->to_expire))) {
+			DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
+			state_entry_unlink(state, shard, entry);
+			talloc_free(entry);
+		}
+
+		/*
+		 *	Free the rbtree
+		 */
+		talloc_free(shard->tree);
+	}
 
 	return 0;
 }
@@ -192,6 +250,11 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 
 	state->max_sessions = max_sessions;
 	state->timeout = timeout;
+	state->thread_safe = thread_safe;
+	atomic_init(&state->id, 0);
+	atomic_init(&state->tracked, 0);
+	atomic_init(&state->size, 0);
+	atomic_init(&state->packed, 0);
 
 	/*
 	 *	Create a break in the contexts.
@@ -201,47 +264,250 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 	 *	tree.
 	 */
 	talloc_link_ctx(ctx, state);
+	talloc_set_destructor(state, _state_tree_free);
 
-	if (thread_safe && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
-		talloc_free(state);
-		return NULL;
-	}
+	for (state->num_shards = 0; state->num_shards < STATE_TREE_SHARDS; state->num_shards++) {
+		fr_state_shard_t *shard = &state->shard[state->num_shards];
 
-	fr_dlist_talloc_init(&state->to_expire, fr_state_entry_t, list);
+		fr_dlist_talloc_init(&shard->to_expire, fr_state_entry_t, list);
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = rbtree_talloc_alloc(NULL, state_entry_cmp, fr_state_entry_t, NULL, 0);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+		/*
+		 *	We need to do controlled freeing of the
+		 *	rbtree, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->tree = rbtree_talloc_alloc(NULL, state_entry_cmp, fr_state_entry_t, NULL, 0);
+		if (!shard->tree) {
+		error:
+			talloc_free(state);
+			return NULL;
+		}
+
+		if (thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(shard->tree);
+			goto error;
+		}
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	state->da = da;		/* Remember which attribute we use to load/store state */
 	state->server_id = server_id;
-	state->thread_safe = thread_safe;
 
 	return state;
 }
 
+/** Compact entries while they're waiting for the next round
+ *
+ * The session-state list is encoded with the internal encoder when the
+ * entry is parked, and decoded again when it's restored to a request,
+ * which is much smaller than keeping a list of VALUE_PAIRs for every
+ * ongoing session.  Persistable request data is still held as-is.
+ *
+ * @param[in] state		to change.
+ * @param[in] compact		whether entries should be compacted.
+ */
+void fr_state_tree_compact_set(fr_state_tree_t *state, bool compact)
+{
+	state->compact = compact;
+}
+
+/** Encode the pairs from one dictionary in a versioned internal list
+ *
+ * Attribute numbers in the internal encoding are relative to the
+ * dictionary root, so pairs from different dictionaries are kept in
+ * separate lists.
+ */
+static ssize_t state_encode_list(uint8_t *out, size_t outlen, VALUE_PAIR *vps, fr_dict_t const *dict)
+{
+	uint8_t		*p = out, *end = out + outlen;
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	ssize_t		slen;
+
+	FR_PAIR_ENCODE_HAVE_SPACE(p, end, 1);
+	*p++ = FR_INTERNAL_VERSION;
+
+	for (vp = fr_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_cursor_current(&cursor)) {
+		if (fr_dict_by_da(vp->da) != dict) {
+			fr_cursor_next(&cursor);
+			continue;
+		}
+
+		slen = fr_internal_encode_pair(p, end - p, &cursor, NULL);
+		if (slen == PAIR_ENCODE_SKIPPED) continue;
+		if (slen < 0) return slen;
+		if (slen == 0) {
+			fr_cursor_next(&cursor);
+			continue;
+		}
+		p += slen;
+	}
+
+	return p - out;
+}
+
+/** Encode the session-state of a request, so it can be compacted
+ *
+ * The format is the sequence start as a uint64, the length of the
+ * protocol attributes as a uint32, the protocol attributes, then the
+ * internal attributes.  Both lists are written by the internal encoder.
+ *
+ * @param[in] ctx		to allocate the encoded data in.
+ * @param[out] out		Where to write a pointer to the encoded data.
+ * @param[in] request		whose session-state we're encoding.
+ * @return
+ *	- >0 the length of the encoded data.
+ *	- <0 on failure.
+ */
+static ssize_t state_encode(TALLOC_CTX *ctx, uint8_t **out, REQUEST *request)
+{
+	uint8_t		*buff, *p, *end;
+	size_t		len = 1024;
+	ssize_t		slen;
+
+	for (;;) {
+		MEM(buff = talloc_array(ctx, uint8_t, len));
+		p = buff;
+		end = buff + len;
+
+		fr_net_from_uint64(p, request->seq_start);
+		p += sizeof(uint64_t) + sizeof(uint32_t);
+
+		slen = state_encode_list(p, end - p, request->state, request->dict);
+		if (slen > 0) {
+			fr_net_from_uint32(p - sizeof(uint32_t), (uint32_t)slen);
+			p += slen;
+
+			slen = state_encode_list(p, end - p, request->state, fr_dict_internal());
+			if (slen > 0) {
+				*out = buff;
+				return (p + slen) - buff;
+			}
+		}
+		talloc_free(buff);
+
+		if (fr_pair_encode_is_error(slen)) {
+			fr_strerror_printf("Failed encoding session-state");
+			return -1;
+		}
+
+		/*
+		 *	Out of space, double the buffer and
+		 *	try again.
+		 */
+		if ((len * 2) > STATE_PACKED_MAX_LEN) {
+			fr_strerror_printf("Encoded session-state too long.  Must be < %u bytes",
+					   STATE_PACKED_MAX_LEN);
+			return -1;
+		}
+		len *= 2;
+	}
+}
+
+/** Decode session-state written by #state_encode into a request
+ *
+ */
+static int state_decode(REQUEST *request, uint8_t const *data, size_t data_len)
+{
+	uint8_t const	*p = data, *end = data + data_len;
+	VALUE_PAIR	*vps = NULL, *internal = NULL;
+	uint32_t	len;
+
+	if (data_len < (sizeof(uint64_t) + sizeof(uint32_t))) {
+	too_short:
+		fr_strerror_printf("Encoded session-state too short");
+		return -1;
+	}
+	p += sizeof(uint64_t);
+
+	len = fr_net_to_uint32(p);
+	p += sizeof(uint32_t);
+	if (len > (size_t)(end - p)) goto too_short;
+
+	if (!request->state_ctx) MEM(request->state_ctx = talloc_init_const("session-state"));
+
+	if ((fr_internal_decode_list(request->state_ctx, &vps, request->dict, p, len, NULL) < 0) ||
+	    (fr_internal_decode_list(request->state_ctx, &internal, fr_dict_internal(),
+				     p + len, end - (p + len), NULL) < 0)) {
+		fr_pair_list_free(&vps);
+		fr_pair_list_free(&internal);
+		return -1;
+	}
+	fr_pair_add(&vps, internal);
+
+	request->seq_start = fr_net_to_uint64(data);
+	request->state = vps;
+
+	return 0;
+}
+
+/** Check whether every pair in the session-state survives the internal encoding
+ *
+ * The encoding only holds pairs from the request's dictionary and the
+ * internal dictionary, and it doesn't carry tags.
+ */
+static bool state_compactable(REQUEST *request)
+{
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	for (vp = fr_cursor_init(&cursor, &request->state);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		fr_dict_t const *dict = fr_dict_by_da(vp->da);
+
+		if ((dict != request->dict) && (dict != fr_dict_internal())) return false;
+		if (vp->da->flags.has_tag) return false;
+	}
+
+	return true;
+}
+
+/** Account for the memory held by a parked entry
+ *
+ * @note Called with the shard's mutex held.
+ */
+static inline void state_entry_size_set(fr_state_tree_t *state, fr_state_entry_t *entry)
+{
+	entry->size = talloc_total_size(entry);
+	if (entry->ctx) entry->size += talloc_total_size(entry->ctx);
+
+	atomic_fetch_add_explicit(&state->size, entry->size, memory_order_relaxed);
+	if (entry->packed) atomic_fetch_add_explicit(&state->packed, 1, memory_order_relaxed);
+}
+
+/** Stop accounting for an entry, because it's been thawed or unlinked
+ *
+ * @note Called with the shard's mutex held.
+ */
+static inline void state_entry_size_clear(fr_state_tree_t *state, fr_state_entry_t *entry)
+{
+	if (!entry->size) return;
+
+	atomic_fetch_sub_explicit(&state->size, entry->size, memory_order_relaxed);
+	if (entry->packed) atomic_fetch_sub_explicit(&state->packed, 1, memory_order_relaxed);
+	entry->size = 0;
+}
+
 /** Unlink an entry and remove if from the tree
  *
+ * @note Called with the shard's mutex held.
  */
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry)
 {
 	/*
 	 *	Check the memory is still valid
 	 */
 	(void) talloc_get_type_abort(entry, fr_state_entry_t);
 
-	fr_dlist_remove(&state->to_expire, entry);
+	fr_dlist_remove(&shard->to_expire, entry);
+
+	rbtree_deletebydata(shard->tree, entry);
 
-	rbtree_deletebydata(state->tree, entry);
+	state_entry_size_clear(state, entry);
+	atomic_fetch_sub_explicit(&state->tracked, 1, memory_order_relaxed);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
@@ -284,76 +550,37 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	return 0;
 }
 
-/** Create a new state entry
+/** Free the entries in a shard which have timed out
  *
- * @note Called with the mutex held.
+ * @note Called with the mutex free.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request,
-					    RADIUS_PACKET *packet, fr_state_entry_t *old)
+static void state_shard_expire(fr_state_tree_t *state, fr_state_shard_t *shard, REQUEST *request, time_t now)
 {
-	size_t			i;
-	uint32_t		x;
-	time_t			now = time(NULL);
-	VALUE_PAIR		*vp;
 	fr_state_entry_t	*entry, *next;
-
-	uint8_t			old_state[sizeof(old->state)];
-	int			old_tries = 0;
 	uint64_t		timed_out = 0;
-	bool			too_many = false;
 	fr_dlist_head_t		to_free;
 
 	fr_dlist_init(&to_free, fr_state_entry_t, list);
 
-	/*
-	 *	Clean up old entries.
-	 */
-	for (entry = fr_dlist_head(&state->to_expire);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	for (entry = fr_dlist_head(&shard->to_expire);
 	     entry != NULL;
 	     entry = next) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
-		next = fr_dlist_next(&state->to_expire, entry);		/* Advance *before* potential unlinking */
-
-		if (entry == old) continue;
+		next = fr_dlist_next(&shard->to_expire, entry);		/* Advance *before* potential unlinking */
 
 		/*
-		 *	Too old, we can delete it.
+		 *	The list is ordered by cleanup time, so
+		 *	everything after this is still live.
 		 */
-		if (entry->cleanup < now) {
-			state_entry_unlink(state, entry);
-			fr_dlist_insert_tail(&to_free, entry);
-			timed_out++;
-			continue;
-		}
-
-		break;
-	}
-
-	state->timed_out += timed_out;
-
-	if (!old && (rbtree_num_elements(state->tree) >= (uint32_t) state->max_sessions)) too_many = true;
-
-	/*
-	 *	Record the information from the old state, we may base the
-	 *	new state off the old one.
-	 *
-	 *	Once we release the mutex, the state of old becomes indeterminate
-	 *	so we have to grab the values now.
-	 */
-	if (old) {
-		old_tries = old->tries;
-
-		memcpy(old_state, old->state, sizeof(old_state));
+		if (entry->cleanup >= now) break;
 
-		/*
-		 *	The old one isn't used any more, so we can free it.
-		 */
-		if (fr_dlist_empty(&old->data)) {
-			state_entry_unlink(state, old);
-			fr_dlist_insert_tail(&to_free, old);
-		}
+		state_entry_unlink(state, shard, entry);
+		fr_dlist_insert_tail(&to_free, entry);
+		timed_out++;
 	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	shard->timed_out += timed_out;
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
 	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
 
@@ -371,17 +598,50 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		fr_dlist_remove(&to_free, entry);
 		talloc_free(entry);
 	}
+}
+
+/** Create a new state entry
+ *
+ * @param[out] shard_p		The shard the entry was inserted into.
+ * @param[in] state		tree to insert the entry into.
+ * @param[in] request		The current request.
+ * @param[in] packet		containing the State attribute.
+ * @param[in] old_state		State value of the previous entry in this sequence.
+ *				NULL if this is a new sequence.
+ * @param[in] old_tries		Number of rounds of the previous entry.
+ * @return
+ *	- The new entry, with the mutex of *shard_p held.
+ *	- NULL on failure.
+ *
+ * @note Called with the mutex free.
+ */
+static fr_state_entry_t *state_entry_create(fr_state_shard_t **shard_p, fr_state_tree_t *state, REQUEST *request,
+					    RADIUS_PACKET *packet, uint8_t const *old_state, int old_tries)
+{
+	size_t			i;
+	uint32_t		x;
+	time_t			now = time(NULL);
+	VALUE_PAIR		*vp;
+	fr_state_entry_t	*entry;
+	fr_state_shard_t	*shard;
 
 	/*
-	 *	Have to do this post-cleanup, else we end up returning with
-	 *	a list full of entries to free with none of them being
-	 *	freed which is bad...
+	 *	Entries are only expired from the shard they're
+	 *	inserted into, so at the limit, check whether any
+	 *	of the others have space to give back.
+	 *
+	 *	The count isn't protected by any of the shard
+	 *	mutexes, so concurrent creations may go over the
+	 *	limit by a few entries.
 	 */
-	if (too_many) {
-		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
-		       state->max_sessions);
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
+	if (!old_state && (atomic_load_explicit(&state->tracked, memory_order_relaxed) >= state->max_sessions)) {
+		for (i = 0; i < STATE_TREE_SHARDS; i++) state_shard_expire(state, &state->shard[i], request, now);
+
+		if (atomic_load_explicit(&state->tracked, memory_order_relaxed) >= state->max_sessions) {
+			RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
+			       state->max_sessions);
+			return NULL;
+		}
 	}
 
 	/*
@@ -389,14 +649,11 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 *	and would add significantly to contention.
 	 */
 	entry = talloc_zero(NULL, fr_state_entry_t);
-	if (!entry) {
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+	if (!entry) return NULL;
 
 	request_data_list_init(&entry->data);
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
+	entry->id = atomic_fetch_add_explicit(&state->id, 1, memory_order_relaxed);
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -445,7 +702,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		 *	16 octets of randomness should be enough to
 		 *	have a globally unique state.
 		 */
-		if (old) {
+		if (old_state) {
 			memcpy(entry->state, old_state, sizeof(entry->state));
 			entry->tries = old_tries + 1;
 		/*
@@ -483,8 +740,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	DEBUG4("State ID %" PRIu64 " created, value 0x%pH, expires %" PRIu64 "s",
 	       entry->id, fr_box_octets(entry->state, sizeof(entry->state)), (uint64_t)entry->cleanup - now);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -493,7 +748,16 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 */
 	*((uint32_t *)(&entry->state_comp.server_hash)) ^= fr_hash_string(cf_section_name2(request->server_cs));
 
-	if (!rbtree_insert(state->tree, entry)) {
+	/*
+	 *	Clean up old entries in the shard we're about to
+	 *	insert into.
+	 */
+	shard = state_shard(state, entry);
+	state_shard_expire(state, shard, request, now);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	if (!rbtree_insert(shard->tree, entry)) {
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		RERROR("Failed inserting state entry - Insertion into state tree failed");
 		fr_pair_delete_by_da(&packet->vps, state->da);
 		talloc_free(entry);
@@ -504,46 +768,64 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 *	Link it to the end of the list, which is implicitely
 	 *	ordered by cleanup time.
 	 */
-	fr_dlist_insert_tail(&state->to_expire, entry);
+	fr_dlist_insert_tail(&shard->to_expire, entry);
+	atomic_fetch_add_explicit(&state->tracked, 1, memory_order_relaxed);
+
+	*shard_p = shard;
 
 	return entry;
 }
 
-/** Find the entry, based on the State attribute
+/** Build the lookup key for a State value, and return the shard it belongs in
  *
+ * @param[out] key		Entry to write the normalised state value to.
+ * @param[in] state		tree to search.
+ * @param[in] request		The current request.
+ * @param[in] vb		The State value.
+ * @return The shard which would hold the entry.
  */
-static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *request, fr_value_box_t const *vb)
+static fr_state_shard_t *state_entry_key(fr_state_entry_t *key, fr_state_tree_t *state,
+					 REQUEST *request, fr_value_box_t const *vb)
 {
-	fr_state_entry_t *entry, my_entry;
-
 	/*
 	 *	Assume our own State first.
 	 */
-	if (vb->vb_length == sizeof(my_entry.state)) {
-		memcpy(my_entry.state, vb->vb_octets, sizeof(my_entry.state));
+	if (vb->vb_length == sizeof(key->state)) {
+		memcpy(key->state, vb->vb_octets, sizeof(key->state));
 
 		/*
 		 *	Too big?  Get the MD5 hash, in order
 		 *	to depend on the entire contents of State.
 		 */
-	} else if (vb->vb_length > sizeof(my_entry.state)) {
-		fr_md5_calc(my_entry.state, vb->vb_octets, vb->vb_length);
+	} else if (vb->vb_length > sizeof(key->state)) {
+		fr_md5_calc(key->state, vb->vb_octets, vb->vb_length);
 
 		/*
 		 *	Too small?  Use the whole thing, and
-		 *	set the rest of my_entry.state to zero.
+		 *	set the rest of key->state to zero.
 		 */
 	} else {
-		memcpy(my_entry.state, vb->vb_octets, vb->vb_length);
-		memset(&my_entry.state[vb->vb_length], 0, sizeof(my_entry.state) - vb->vb_length);
+		memcpy(key->state, vb->vb_octets, vb->vb_length);
+		memset(&key->state[vb->vb_length], 0, sizeof(key->state) - vb->vb_length);
 	}
 
 	/*
 	 *	Make it unique for different virtual servers handling the same request
 	 */
-	my_entry.state_comp.server_hash ^= fr_hash_string(cf_section_name2(request->server_cs));
+	key->state_comp.server_hash ^= fr_hash_string(cf_section_name2(request->server_cs));
+
+	return state_shard(state, key);
+}
+
+/** Find the entry, based on the State attribute
+ *
+ * @note Called with the shard's mutex held.
+ */
+static fr_state_entry_t *state_entry_find(fr_state_shard_t *shard, fr_state_entry_t const *key)
+{
+	fr_state_entry_t *entry;
 
-	entry = rbtree_finddata(state->tree, &my_entry);
+	entry = rbtree_finddata(shard->tree, key);
 
 	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
 
@@ -555,20 +837,23 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *reque
  */
 void fr_state_discard(fr_state_tree_t *state, REQUEST *request)
 {
-	fr_state_entry_t	*entry;
+	fr_state_entry_t	*entry, my_entry;
+	fr_state_shard_t	*shard;
 	VALUE_PAIR		*vp;
 
 	vp = fr_pair_find_by_da(request->packet->vps, state->da, TAG_ANY);
 	if (!vp) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, &vp->data);
+	shard = state_entry_key(&my_entry, state, request, &vp->data);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = state_entry_find(shard, &my_entry);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		return;
 	}
-	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_entry_unlink(state, shard, entry);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
 	/*
 	 *	If fr_state_to_request was never called, this ensures
@@ -605,9 +890,12 @@ void fr_state_discard(fr_state_tree_t *state, REQUEST *request)
  */
 void fr_state_to_request(fr_state_tree_t *state, REQUEST *request)
 {
-	fr_state_entry_t	*entry;
+	fr_state_entry_t	*entry, my_entry;
+	fr_state_shard_t	*shard;
 	TALLOC_CTX		*old_ctx = NULL;
 	VALUE_PAIR		*vp;
+	uint8_t			*packed = NULL;
+	size_t			packed_len = 0;
 
 	fr_assert(request->state == NULL);
 
@@ -621,29 +909,49 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request)
 		return;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, &vp->data);
+	shard = state_entry_key(&my_entry, state, request, &vp->data);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = state_entry_find(shard, &my_entry);
 	if (entry) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);
 		if (entry->thawed) {
 			REDEBUG("State entry has already been thawed by a request %"PRIu64, entry->thawed->number);
-			PTHREAD_MUTEX_UNLOCK(&state->mutex);
+			PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 			return;
 		}
 		if (request->state_ctx) old_ctx = request->state_ctx;	/* Store for later freeing */
 
 		fr_assert(entry->ctx);
 
+		state_entry_size_clear(state, entry);
+
 		request->seq_start = entry->seq_start;
 		request->state_ctx = entry->ctx;
 		request->state = entry->vps;
 		request_data_restore(request, &entry->data);
 
+		packed = entry->packed;
+		packed_len = entry->packed_len;
+
 		entry->ctx = NULL;
 		entry->vps = NULL;
+		entry->packed = NULL;
+		entry->packed_len = 0;
 		entry->thawed = request;
 	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	/*
+	 *	Decoded outside of the mutex.  The packed data is
+	 *	parented by the state_ctx we now own.
+	 */
+	if (packed) {
+		if (state_decode(request, packed, packed_len) < 0) {
+			RPERROR("Failed decoding compacted &session-state");
+		}
+		talloc_free(packed);
+	}
 
 	if (request->state) {
 		RDEBUG2("Restored &session-state");
@@ -668,13 +976,26 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request)
  * into the vps list.  Delete the original entry, if it exists
  *
  * Also creates a new state entry.
+ *
+ * The new entry's state value differs from the old one, so it will usually
+ * be in a different shard.  The old entry is dealt with first, and its
+ * shard unlocked before the new one is locked, so we never hold two shard
+ * mutexes at once.
  */
 int fr_request_to_state(fr_state_tree_t *state, REQUEST *request)
 {
-	fr_state_entry_t	*entry, *old = NULL;
+	fr_state_entry_t	*entry, *old = NULL, my_entry;
+	fr_state_shard_t	*shard;
 	fr_dlist_head_t		data;
 	VALUE_PAIR		*vp;
 
+	uint8_t			old_state[sizeof(my_entry.state)];
+	int			old_tries = 0;
+	bool			have_old = false;
+
+	uint8_t			*packed = NULL;
+	ssize_t			packed_len = 0;
+
 	request_data_list_init(&data);
 	request_data_by_persistance(&data, request, true);
 
@@ -686,15 +1007,66 @@ int fr_request_to_state(fr_state_tree_t *state, REQUEST *request)
 	}
 
 	vp = fr_pair_find_by_da(request->packet->vps, state->da, TAG_ANY);
+	if (vp) {
+		shard = state_entry_key(&my_entry, state, request, &vp->data);
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		old = state_entry_find(shard, &my_entry);
+		if (old) {
+			/*
+			 *	Record the information from the old state, we may
+			 *	base the new state off the old one.
+			 *
+			 *	Once we release the mutex, the state of old becomes
+			 *	indeterminate so we have to grab the values now.
+			 */
+			have_old = true;
+			old_tries = old->tries;
+			memcpy(old_state, old->state, sizeof(old_state));
+
+			/*
+			 *	The old one isn't used any more, so we can free it.
+			 */
+			if (fr_dlist_empty(&old->data)) {
+				state_entry_unlink(state, shard, old);
+			} else {
+				old = NULL;
+			}
+		}
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	if (vp) old = state_entry_find(state, request, &vp->data);
+		/*
+		 *	Free this outside of the mutex for less contention.
+		 */
+		talloc_free(old);
+	}
 
-	entry = state_entry_create(state, request, request->reply, old);
+	/*
+	 *	Swap the list for its encoded form, so the entry
+	 *	holds one allocation instead of a VALUE_PAIR (and
+	 *	often a buffer) for every attribute.
+	 */
+	if (state->compact && request->state && state_compactable(request)) {
+		packed_len = state_encode(request->state_ctx, &packed, request);
+		if (packed_len > 0) {
+			fr_pair_list_free(&request->state);
+		} else {
+			RPWARN("Not compacting &session-state");
+			packed = NULL;
+			packed_len = 0;
+		}
+	}
+
+	entry = state_entry_create(&shard, state, request, request->reply, have_old ? old_state : NULL, old_tries);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
 		RERROR("Creating state entry failed");
 		request_data_restore(request, &data);	/* Put it back again */
+		if (packed) {
+			if (state_decode(request, packed, packed_len) < 0) {
+				RPERROR("Failed decoding compacted &session-state");
+			}
+			talloc_free(packed);
+		}
 		return -1;
 	}
 
@@ -704,12 +1076,16 @@ int fr_request_to_state(fr_state_tree_t *state, REQUEST *request)
 	entry->seq_start = request->seq_start;
 	entry->ctx = request->state_ctx;
 	entry->vps = request->state;
+	entry->packed = packed;
+	entry->packed_len = packed_len;
 	fr_dlist_move(&entry->data, &data);
 
 	request->state_ctx = NULL;
 	request->state = NULL;
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_entry_size_set(state, entry);
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
 	RDEBUG3("RADIUS State - saved");
 	REQUEST_VERIFY(request);
@@ -849,7 +1225,7 @@ void fr_state_detach(REQUEST *request, bool will_free)
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	return atomic_load_explicit(&state->id, memory_order_relaxed);
 }
 
 /** Return number of entries that timed out
@@ -857,7 +1233,16 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	uint64_t	timed_out = 0;
+	unsigned int	i;
+
+	for (i = 0; i < STATE_TREE_SHARDS; i++) {
+		PTHREAD_MUTEX_LOCK(&state->shard[i].mutex);
+		timed_out += state->shard[i].timed_out;
+		PTHREAD_MUTEX_UNLOCK(&state->shard[i].mutex);
+	}
+
+	return timed_out;
 }
 
 /** Return number of entries we're currently tracking
@@ -865,5 +1250,65 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return (uint32_t)rbtree_num_elements(state->tree);
+	return (uint32_t)atomic_load_explicit(&state->tracked, memory_order_relaxed);
+}
+
+/** Return the memory used by parked entries, and how many of them are compacted
+ *
+ * @param[in] state	to return stats for.
+ * @param[out] packed	Number of parked entries holding encoded session-state.
+ *			May be NULL.
+ * @return the number of bytes used by parked entries.
+ */
+uint64_t fr_state_entries_size(fr_state_tree_t *state, uint32_t *packed)
+{
+	if (packed) *packed = (uint32_t)atomic_load_explicit(&state->packed, memory_order_relaxed);
+
+	return atomic_load_explicit(&state->size, memory_order_relaxed);
+}
+
+static int cmd_show_state(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_state_tree_t	*state = talloc_get_type_abort(ctx, fr_state_tree_t);
+	uint32_t	tracked, packed;
+	uint64_t	size;
+
+	tracked = fr_state_entries_tracked(state);
+	size = fr_state_entries_size(state, &packed);
+
+	fprintf(fp, "tracked\t\t\t%u\n", tracked);
+	fprintf(fp, "max\t\t\t%u\n", state->max_sessions);
+	fprintf(fp, "created\t\t\t%" PRIu64 "\n", fr_state_entries_created(state));
+	fprintf(fp, "timed_out\t\t%" PRIu64 "\n", fr_state_entries_timeout(state));
+	fprintf(fp, "compacted\t\t%u\n", packed);
+	fprintf(fp, "memory\t\t\t%" PRIu64 "\n", size);
+	fprintf(fp, "memory_per_session\t%" PRIu64 "\n", tracked ? (size / tracked) : 0);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_state_table[] = {
+	{
+		.parent = "show state",
+		.add_name = true,
+		.name = "stats",
+		.func = cmd_show_state,
+		.help = "Show how many sessions are parked, and how much memory they're using.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
+/** Register radmin commands for a state tree
+ *
+ * @param[in] state	to register commands for.
+ * @param[in] name	to register the commands under, as "show state <name> stats".
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_state_tree_command_register(fr_state_tree_t *state, char const *name)
+{
+	return fr_command_register_hook(NULL, name, state, cmd_state_table);
 }
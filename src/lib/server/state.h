@@ -38,6 +38,10 @@ typedef struct fr_state_tree_s fr_state_tree_t;
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, bool thread_safe,
 				    uint32_t max_sessions, uint32_t timeout, uint8_t server_id);
 
+void	fr_state_tree_compact_set(fr_state_tree_t *state, bool compact);
+
+int	fr_state_tree_command_register(fr_state_tree_t *state, char const *name);
+
 void	fr_state_discard(fr_state_tree_t *state, REQUEST *request);
 
 void	fr_state_to_request(fr_state_tree_t *state, REQUEST *request);
@@ -52,6 +56,7 @@ void	fr_state_detach(REQUEST *request, bool will_free);
 uint64_t fr_state_entries_created(fr_state_tree_t *state);
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state);
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state);
+uint64_t fr_state_entries_size(fr_state_tree_t *state, uint32_t *packed);
 
 #ifdef __cplusplus
 }
@@ -2828,19 +2828,34 @@ finish:
 	return (out_p - out);
 }
 
-#define TMPL_TAG_MATCH(_a, _t) ((_a->da == tmpl_da(_t)) && ATTR_TAG_MATCH(_a, tmpl_tag(_t)))
+/*
+ *	The attribute and tag are resolved when the tmpl is compiled, and
+ *	whether the attribute has tags is a property of the dictionary, so
+ *	matching a pair needs one comparison for untagged attributes.
+ */
+#define TMPL_AR_MATCH(_a, _ar, _has_tag) (((_a)->da == (_ar)->ar_da) && (!(_has_tag) || TAG_EQ((_ar)->ar_tag, (_a)->tag)))
 
 static void *_tmpl_cursor_next(void **prev, void *curr, void *ctx)
 {
-	VALUE_PAIR	*c, *p, *fc = NULL, *fp = NULL;
-	vp_tmpl_t const	*vpt = ctx;
-	int		num;
+	VALUE_PAIR		*c, *p, *fc = NULL, *fp = NULL;
+	vp_tmpl_t const		*vpt = ctx;
+	vp_tmpl_attr_t const	*ar;
+	bool			has_tag;
+	int			num;
 
 	if (!curr) return NULL;
 
+	/*
+	 *	Look up the leaf reference once, rather than
+	 *	once per pair.
+	 */
+	ar = fr_dlist_tail(&vpt->data.attribute.ar);
+
 	switch (vpt->type) {
 	case TMPL_TYPE_ATTR:
-		switch (tmpl_num(vpt)) {
+		has_tag = ar->ar_da->flags.has_tag;
+
+		switch (ar->ar_num) {
 		case NUM_ANY:				/* Bare attribute ref */
 			if (*prev) {
 			null_result:
@@ -2853,7 +2868,7 @@ static void *_tmpl_cursor_next(void **prev, void *curr, void *ctx)
 		case NUM_COUNT:				/* Iterator is called multiple time to get the count */
 			for (c = curr, p = *prev; c; p = c, c = c->next) {
 			     	VP_VERIFY(c);
-				if (TMPL_TAG_MATCH(c, vpt)) {
+				if (TMPL_AR_MATCH(c, ar, has_tag)) {
 					*prev = p;
 					return c;
 				}
@@ -2863,7 +2878,7 @@ static void *_tmpl_cursor_next(void **prev, void *curr, void *ctx)
 		case NUM_LAST:				/* Get the last instance of a VALUE_PAIR */
 			for (c = curr, p = *prev; c; p = c, c = c->next) {
 			     	VP_VERIFY(c);
-				if (TMPL_TAG_MATCH(c, vpt)) {
+				if (TMPL_AR_MATCH(c, ar, has_tag)) {
 				    	fp = p;
 					fc = c;
 				}
@@ -2873,11 +2888,11 @@ static void *_tmpl_cursor_next(void **prev, void *curr, void *ctx)
 
 		default:				/* Get the specified index*/
 			if (*prev) goto null_result;
-			for (c = curr, p = *prev, num = tmpl_num(vpt);
+			for (c = curr, p = *prev, num = ar->ar_num;
 			     c && (num >= 0);
 			     p = c, c = c->next) {
 			     	VP_VERIFY(c);
-				if (TMPL_TAG_MATCH(c, vpt)) {
+				if (TMPL_AR_MATCH(c, ar, has_tag)) {
 					fp = p;
 					fc = c;
 					num--;
@@ -2889,7 +2904,7 @@ static void *_tmpl_cursor_next(void **prev, void *curr, void *ctx)
 		}
 
 	case TMPL_TYPE_LIST:
-		switch (tmpl_num(vpt)) {
+		switch (ar->ar_num) {
 		case NUM_ANY:				/* Bare attribute ref */
 			if (*prev) goto null_result;
 			FALL_THROUGH;
@@ -2910,7 +2925,7 @@ static void *_tmpl_cursor_next(void **prev, void *curr, void *ctx)
 
 		default:				/* Get the specified index*/
 			if (*prev) goto null_result;	/* Subsequent call */
-			for (c = curr, p = *prev, num = tmpl_num(vpt);
+			for (c = curr, p = *prev, num = ar->ar_num;
 			     c && (num >= 0);
 			     p = c, c = c->next) {
 			     	VP_VERIFY(c);
@@ -2960,7 +2975,10 @@ VALUE_PAIR *tmpl_cursor_init(int *err, fr_cursor_t *cursor, REQUEST *request, vp
 
 	if (err) *err = 0;
 
-	if (radius_request(&request, tmpl_request(vpt)) < 0) {
+	/*
+	 *	Almost all references are to the current request.
+	 */
+	if ((tmpl_request(vpt) != REQUEST_CURRENT) && (radius_request(&request, tmpl_request(vpt)) < 0)) {
 		if (err) {
 			*err = -3;
 			fr_strerror_printf("Request context \"%s\" not available",
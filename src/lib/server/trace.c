@@ -0,0 +1,335 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/trace.c
+ * @brief Compact binary traces of sampled requests.
+ *
+ * Debug logging formats every message as text, for every request.
+ * Tracing instead records fixed size binary records, for a sample
+ * of requests, and leaves it to radtrace to format them later.
+ *
+ * Each thread appends records to its own buffer, without locking.
+ * When the buffer is full, or a traced request finishes and the
+ * buffer hasn't been written out for a second, the whole buffer is
+ * written to the trace file with one write().  The file is opened
+ * with O_APPEND, so blocks from different threads don't overlap.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/trace.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#include <fcntl.h>
+#include <stdatomic.h>
+
+/** Per-thread buffer of trace records
+ *
+ */
+typedef struct {
+	uint8_t			*buffer;	//!< Block header, followed by records.
+	size_t			used;		//!< Including the block header.
+	size_t			size;		//!< Of the buffer.
+	uint32_t		thread;		//!< Number written in the block header.
+	uint32_t		countdown;	//!< Requests to skip before tracing the next one.
+	fr_time_t		flushed;	//!< When the buffer was last written out.
+} fr_trace_thread_t;
+
+uint32_t			fr_trace_rate;
+
+static int			trace_fd = -1;
+static size_t			trace_buffer_size;
+static atomic_uint_fast32_t	trace_thread_num;
+
+static _Thread_local fr_trace_thread_t *trace_thread;
+
+/** Write out a thread's buffered records
+ *
+ */
+static void trace_thread_flush(fr_trace_thread_t *tt)
+{
+	fr_trace_block_t	block;
+	uint8_t const		*p;
+	size_t			left;
+
+	if (tt->used <= sizeof(block)) return;
+
+	tt->flushed = fr_time();
+	if (trace_fd < 0) goto done;
+
+	block = (fr_trace_block_t) {
+		.magic = FR_TRACE_MAGIC,
+		.length = tt->used - sizeof(block),
+		.thread = tt->thread,
+		.version = 1,
+		.wallclock = fr_time_wallclock_at_last_sync()
+	};
+	memcpy(tt->buffer, &block, sizeof(block));
+
+	/*
+	 *	Tracing mustn't stop the server, so errors
+	 *	just lose the records.
+	 */
+	p = tt->buffer;
+	left = tt->used;
+	while (left > 0) {
+		ssize_t slen;
+
+		slen = write(trace_fd, p, left);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		p += slen;
+		left -= slen;
+	}
+
+done:
+	tt->used = sizeof(block);
+}
+
+static void _trace_thread_free(void *arg)
+{
+	fr_trace_thread_t *tt = talloc_get_type_abort(arg, fr_trace_thread_t);
+
+	trace_thread_flush(tt);
+	talloc_free(tt);
+}
+
+static fr_trace_thread_t *trace_thread_get(void)
+{
+	fr_trace_thread_t *tt = trace_thread;
+
+	if (likely(tt != NULL)) return tt;
+
+	MEM(tt = talloc_zero(NULL, fr_trace_thread_t));
+	MEM(tt->buffer = talloc_array(tt, uint8_t, trace_buffer_size));
+	tt->size = trace_buffer_size;
+	tt->used = sizeof(fr_trace_block_t);
+	tt->thread = atomic_fetch_add_explicit(&trace_thread_num, 1, memory_order_relaxed);
+	tt->flushed = fr_time();
+
+	/*
+	 *	Start at a random point, so that threads don't
+	 *	all trace the same request in a burst.
+	 */
+	tt->countdown = fr_rand() % fr_trace_rate;
+
+	fr_thread_local_set_destructor(trace_thread, _trace_thread_free, tt);
+
+	return tt;
+}
+
+/** Append a record to this thread's buffer
+ *
+ * @param[in] request	the record is for.
+ * @param[in] type	of the record.
+ * @param[in] code	meaning depends on the type.
+ * @param[in] depth	interpreter stack depth.
+ * @param[in] flags	meaning depends on the type.
+ * @param[in] duration	of the event.
+ * @param[in] a		first string, may be NULL.
+ * @param[in] b		second string, may be NULL.
+ */
+static void trace_record(REQUEST *request, fr_trace_type_t type, uint8_t code, int depth, uint8_t flags,
+			 fr_time_delta_t duration, char const *a, char const *b)
+{
+	fr_trace_thread_t	*tt = trace_thread_get();
+	fr_trace_record_t	record;
+	size_t			a_len = 0, b_len = 0, need;
+	uint8_t			*p;
+
+	if (a) {
+		a_len = strlen(a);
+		if (a_len > FR_TRACE_STRING_MAX) a_len = FR_TRACE_STRING_MAX;
+	}
+	if (b) {
+		b_len = strlen(b);
+		if (b_len > FR_TRACE_STRING_MAX) b_len = FR_TRACE_STRING_MAX;
+	}
+
+	record = (fr_trace_record_t) {
+		.type = type,
+		.code = code,
+		.depth = (depth > UINT8_MAX) ? UINT8_MAX : depth,
+		.flags = flags,
+		.length = (a ? 1 + a_len : 0) + (b ? 1 + b_len : 0),
+		.number = request->number,
+		.when = fr_time(),
+		.duration = duration
+	};
+
+	need = sizeof(record) + record.length;
+	if ((tt->used + need) > tt->size) trace_thread_flush(tt);
+
+	p = tt->buffer + tt->used;
+	memcpy(p, &record, sizeof(record));
+	p += sizeof(record);
+
+	if (a) {
+		*p++ = a_len;
+		memcpy(p, a, a_len);
+		p += a_len;
+	}
+	if (b) {
+		*p++ = b_len;
+		memcpy(p, b, b_len);
+	}
+
+	tt->used += need;
+}
+
+/** Open the trace file
+ *
+ * Must be called before any threads which process requests are started.
+ *
+ * @param[in] filename		to append traces to.
+ * @param[in] rate		trace one in every rate requests.  0 disables tracing.
+ * @param[in] buffer_size	of each thread's buffer.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_trace_open(char const *filename, uint32_t rate, size_t buffer_size)
+{
+	size_t min = sizeof(fr_trace_block_t) + sizeof(fr_trace_record_t) + (2 * (FR_TRACE_STRING_MAX + 1));
+
+	if (!rate) return 0;
+
+	if (buffer_size < min) {
+		fr_strerror_printf("Trace buffer size must be at least %zu bytes", min);
+		return -1;
+	}
+
+	trace_fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (trace_fd < 0) {
+		fr_strerror_printf("Failed opening trace file \"%s\": %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	trace_buffer_size = buffer_size;
+	fr_trace_rate = rate;
+
+	return 0;
+}
+
+/** Stop tracing, and close the trace file
+ *
+ * Must be called after the threads which process requests have exited.
+ */
+void fr_trace_close(void)
+{
+	if (trace_fd < 0) return;
+
+	fr_trace_flush();
+	fr_trace_rate = 0;
+
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+/** Write out the records buffered by this thread
+ *
+ */
+void fr_trace_flush(void)
+{
+	if (trace_thread) trace_thread_flush(trace_thread);
+}
+
+/** Decide whether a new request should be traced
+ *
+ */
+bool fr_trace_sample(void)
+{
+	fr_trace_thread_t *tt;
+
+	if (likely(!fr_trace_rate)) return false;
+
+	tt = trace_thread_get();
+	if (tt->countdown > 0) {
+		tt->countdown--;
+		return false;
+	}
+	tt->countdown = fr_trace_rate - 1;
+
+	return true;
+}
+
+/** Record the start of a traced request
+ *
+ */
+void fr_trace_request_start(REQUEST *request)
+{
+	trace_record(request, FR_TRACE_REQUEST_START, request->packet ? request->packet->code : 0, 0, 0, 0,
+		     request->server_cs ? cf_section_name2(request->server_cs) : "",
+		     request->client ? request->client->shortname : "");
+}
+
+/** Record the end of a traced request
+ *
+ */
+void fr_trace_request_done(REQUEST *request, fr_time_t now)
+{
+	fr_trace_thread_t *tt;
+
+	trace_record(request, FR_TRACE_REQUEST_DONE, request->reply ? request->reply->code : 0, 0, 0,
+		     request->async ? now - request->async->recv_time : 0, NULL, NULL);
+
+	/*
+	 *	Don't leave records sitting in the buffer when
+	 *	the server is quiet.
+	 */
+	tt = trace_thread_get();
+	if ((now - tt->flushed) > NSEC) trace_thread_flush(tt);
+}
+
+/** Record one call into an unlang instruction
+ *
+ */
+void fr_trace_instruction(REQUEST *request, char const *name, int depth, int action,
+			  rlm_rcode_t rcode, fr_time_delta_t duration)
+{
+	trace_record(request, FR_TRACE_INSTRUCTION, rcode, depth, action, duration, name, NULL);
+}
+
+/** Record a module returning its final rcode
+ *
+ */
+void fr_trace_module(REQUEST *request, char const *name, rlm_rcode_t rcode, fr_time_delta_t duration)
+{
+	trace_record(request, FR_TRACE_MODULE, rcode, 0, 0, duration, name, NULL);
+}
+
+/** Record an attribute being changed by a map
+ *
+ */
+void fr_trace_attr(REQUEST *request, char const *name, fr_token_t op, fr_value_box_t const *vb)
+{
+	char buffer[FR_TRACE_STRING_MAX + 1];
+
+	buffer[0] = '\0';
+	if (vb) fr_value_box_snprint(buffer, sizeof(buffer), vb, '"');
+
+	trace_record(request, FR_TRACE_ATTR, op, 0, 0, 0, name, buffer);
+}
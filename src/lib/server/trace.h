@@ -0,0 +1,126 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/trace.h
+ * @brief Compact binary traces of sampled requests.
+ *
+ * A trace file is a sequence of blocks.  Each block is written by one
+ * thread with a single write(), and holds the trace records which
+ * that thread had buffered.  Records from different requests are
+ * interleaved, and are put back together by request number when the
+ * file is decoded with radtrace.
+ *
+ * All values are in host byte order.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(trace_h, "$Id$")
+
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/server/rcode.h>
+#include <freeradius-devel/util/token.h>
+#include <freeradius-devel/util/value.h>
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_TRACE_MAGIC		(0x46525452)	//!< "FRTR"
+#define FR_TRACE_STRING_MAX	(255)		//!< Strings are truncated to this length.
+
+/** Types of trace record
+ *
+ */
+typedef enum {
+	FR_TRACE_INVALID = 0,
+	FR_TRACE_REQUEST_START,			//!< Data is the virtual server name, then client name.
+						///< code is the packet code.
+	FR_TRACE_REQUEST_DONE,			//!< code is the reply packet code.  duration is
+						///< the time since the packet was received.
+	FR_TRACE_INSTRUCTION,			//!< Data is the instruction name.  code is the rcode,
+						///< depth is the stack depth, and flags is the
+						///< unlang action.
+	FR_TRACE_MODULE,			//!< Data is the module name.  code is the final rcode,
+						///< duration includes time spent yielded.
+	FR_TRACE_ATTR,				//!< Data is the attribute, then the value.  code is
+						///< the operator.
+	FR_TRACE_MAX
+} fr_trace_type_t;
+
+/** Header for a block of trace records
+ *
+ */
+typedef struct CC_HINT(packed) {
+	uint32_t		magic;		//!< #FR_TRACE_MAGIC.
+	uint32_t		length;		//!< Of the records which follow.
+	uint32_t		thread;		//!< Which thread wrote the block.
+	uint32_t		version;	//!< Of the record format, currently 1.
+	int64_t			wallclock;	//!< Add to record times to get nanoseconds since the epoch.
+} fr_trace_block_t;
+
+/** Header for a trace record
+ *
+ * Followed by length bytes of data.  Strings in the data are each
+ * preceded by a one byte length.
+ */
+typedef struct CC_HINT(packed) {
+	uint8_t			type;		//!< #fr_trace_type_t.
+	uint8_t			code;		//!< Meaning depends on the type.
+	uint8_t			depth;		//!< Interpreter stack depth.
+	uint8_t			flags;		//!< Meaning depends on the type.
+	uint16_t		length;		//!< Of the data which follows.
+	uint16_t		pad;
+	uint64_t		number;		//!< Request number.
+	int64_t			when;		//!< When the event finished.
+	int64_t			duration;	//!< How long the event took, or 0.
+} fr_trace_record_t;
+
+/** Whether traces are being written, and how often to sample requests
+ *
+ * One in every fr_trace_rate requests is traced.  0 disables tracing.
+ */
+extern uint32_t	fr_trace_rate;
+
+int		fr_trace_open(char const *filename, uint32_t rate, size_t buffer_size);
+
+void		fr_trace_close(void);
+
+bool		fr_trace_sample(void);
+
+void		fr_trace_request_start(REQUEST *request) CC_HINT(nonnull);
+
+void		fr_trace_request_done(REQUEST *request, fr_time_t now) CC_HINT(nonnull);
+
+void		fr_trace_instruction(REQUEST *request, char const *name, int depth, int action,
+				     rlm_rcode_t rcode, fr_time_delta_t duration) CC_HINT(nonnull);
+
+void		fr_trace_module(REQUEST *request, char const *name, rlm_rcode_t rcode,
+				fr_time_delta_t duration) CC_HINT(nonnull);
+
+void		fr_trace_attr(REQUEST *request, char const *name, fr_token_t op,
+			      fr_value_box_t const *vb) CC_HINT(nonnull(1,2));
+
+void		fr_trace_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -41,20 +41,35 @@ fr_trigger_worker_t trigger_worker_request_add = NULL;
  */
 static bool			triggers_init;
 static CONF_SECTION const	*trigger_exec_main, *trigger_exec_subcs;
-static rbtree_t			*trigger_last_fired_tree;
-static pthread_mutex_t		*trigger_mutex;
 
 #define REQUEST_INDEX_TRIGGER_NAME	1
 #define REQUEST_INDEX_TRIGGER_ARGS	2
 
+/** How many independently locked trees the rate limiting entries are spread over
+ *
+ * Must be a power of 2.
+ */
+#define TRIGGER_LAST_FIRED_SHARDS	16
+
 /** Describes a rate limiting entry for a trigger
  *
  */
 typedef struct {
 	CONF_ITEM	*ci;		//!< Config item this rate limit counter is associated with.
+	uint32_t	args_hash;	//!< Hash of the trigger arguments, or 0 if they're ignored.
 	time_t		last_fired;	//!< When this trigger last fired.
 } trigger_last_fired_t;
 
+/** One shard of the rate limiting entries
+ *
+ */
+typedef struct {
+	pthread_mutex_t	mutex;		//!< Protects the tree, and the entries in it.
+	rbtree_t	*tree;		//!< Of trigger_last_fired_t.
+} trigger_last_fired_shard_t;
+
+static trigger_last_fired_shard_t	*trigger_last_fired;
+
 /** Retrieve attributes from a special trigger list
  *
  */
@@ -99,9 +114,14 @@ ssize_t trigger_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t outlen,
 	return talloc_array_length(*out) - 1;
 }
 
-static int _mutex_free(pthread_mutex_t *mutex)
+static int _trigger_last_fired_shards_free(trigger_last_fired_shard_t *shards)
 {
-	pthread_mutex_destroy(mutex);
+	size_t i;
+
+	for (i = 0; i < TRIGGER_LAST_FIRED_SHARDS; i++) {
+		pthread_mutex_destroy(&shards[i].mutex);
+		talloc_free(shards[i].tree);
+	}
 	return 0;
 }
 
@@ -122,8 +142,82 @@ static void _trigger_last_fired_free(void *data)
 static int _trigger_last_fired_cmp(void const *a, void const *b)
 {
 	trigger_last_fired_t const *lf_a = a, *lf_b = b;
+	int ret;
+
+	ret = (lf_a->ci < lf_b->ci) - (lf_a->ci > lf_b->ci);
+	if (ret != 0) return ret;
+
+	return (lf_a->args_hash < lf_b->args_hash) - (lf_a->args_hash > lf_b->args_hash);
+}
 
-	return (lf_a->ci < lf_b->ci) - (lf_a->ci > lf_b->ci);
+/** Hash the trigger arguments, so that identical triggers can be coalesced
+ *
+ */
+static uint32_t trigger_args_hash(VALUE_PAIR *args)
+{
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	uint32_t	hash = fr_hash(NULL, 0);
+	char		buffer[256];
+
+	for (vp = fr_cursor_init(&cursor, &args);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		size_t len;
+
+		hash = fr_hash_update(&vp->da, sizeof(vp->da), hash);
+
+		len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, '\0');
+		if (len >= sizeof(buffer)) len = sizeof(buffer) - 1;
+		hash = fr_hash_update(buffer, len, hash);
+	}
+
+	/*
+	 *	0 is reserved for rate limited triggers.
+	 */
+	return hash ? hash : 1;
+}
+
+/** Check whether a trigger has already fired this second
+ *
+ * Rate limited triggers fire at most once per second, no matter what
+ * their arguments are.  Other triggers which fire more than once in
+ * the same second, with the same arguments, are coalesced into one.
+ *
+ * @return
+ *	- true if the trigger should be suppressed.
+ *	- false if it should fire.
+ */
+static bool trigger_last_fired_check(CONF_ITEM *ci, bool rate_limit, VALUE_PAIR *args)
+{
+	trigger_last_fired_shard_t	*shard;
+	trigger_last_fired_t		find, *found;
+	time_t				now = time(NULL);
+	bool				suppress;
+
+	find.ci = ci;
+	find.args_hash = rate_limit ? 0 : trigger_args_hash(args);
+
+	shard = &trigger_last_fired[fr_hash_update(&find.args_hash, sizeof(find.args_hash),
+						   fr_hash(&ci, sizeof(ci))) & (TRIGGER_LAST_FIRED_SHARDS - 1)];
+
+	pthread_mutex_lock(&shard->mutex);
+
+	found = rbtree_finddata(shard->tree, &find);
+	if (!found) {
+		MEM(found = talloc(NULL, trigger_last_fired_t));
+		*found = find;
+		found->last_fired = 0;
+
+		rbtree_insert(shard->tree, found);
+	}
+
+	suppress = (found->last_fired == now);
+	found->last_fired = now;
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	return suppress;
 }
 
 /** Set the global trigger section trigger_exec will search in, and register xlats
@@ -142,6 +236,8 @@ static int _trigger_last_fired_cmp(void const *a, void const *b)
  */
 int trigger_exec_init(CONF_SECTION const *cs)
 {
+	size_t i;
+
 	if (!cs) {
 		ERROR("%s - Pointer to main_config was NULL", __FUNCTION__);
 		return -1;
@@ -155,13 +251,15 @@ int trigger_exec_init(CONF_SECTION const *cs)
 		return 0;
 	}
 
-	MEM(trigger_last_fired_tree = rbtree_talloc_alloc(talloc_null_ctx(),
-							   _trigger_last_fired_cmp, trigger_last_fired_t,
-							   _trigger_last_fired_free, 0));
-
-	trigger_mutex = talloc(talloc_null_ctx(), pthread_mutex_t);
-	pthread_mutex_init(trigger_mutex, 0);
-	talloc_set_destructor(trigger_mutex, _mutex_free);
+	MEM(trigger_last_fired = talloc_zero_array(talloc_null_ctx(), trigger_last_fired_shard_t,
+						   TRIGGER_LAST_FIRED_SHARDS));
+	for (i = 0; i < TRIGGER_LAST_FIRED_SHARDS; i++) {
+		MEM(trigger_last_fired[i].tree = rbtree_talloc_alloc(NULL,
+								     _trigger_last_fired_cmp, trigger_last_fired_t,
+								     _trigger_last_fired_free, 0));
+		pthread_mutex_init(&trigger_last_fired[i].mutex, 0);
+	}
+	talloc_set_destructor(trigger_last_fired, _trigger_last_fired_shards_free);
 
 	triggers_init = true;
 
@@ -173,8 +271,7 @@ int trigger_exec_init(CONF_SECTION const *cs)
  */
 void trigger_exec_free(void)
 {
-	TALLOC_FREE(trigger_last_fired_tree);
-	TALLOC_FREE(trigger_mutex);
+	TALLOC_FREE(trigger_last_fired);
 }
 
 /** Return whether triggers are enabled
@@ -335,32 +432,13 @@ int trigger_exec(REQUEST *request, CONF_SECTION const *cs, char const *name, boo
 	if (check_config) return 0;
 
 	/*
-	 *	Perform periodic rate_limiting.
+	 *	Perform periodic rate_limiting, and coalesce
+	 *	identical triggers.  During an outage many
+	 *	connections may fire the same trigger at once.
 	 */
-	if (rate_limit) {
-		trigger_last_fired_t	find, *found;
-		time_t			now = time(NULL);
-
-		find.ci = ci;
-
-		pthread_mutex_lock(trigger_mutex);
-
-		found = rbtree_finddata(trigger_last_fired_tree, &find);
-		if (!found) {
-			MEM(found = talloc(NULL, trigger_last_fired_t));
-			found->ci = ci;
-			found->last_fired = 0;
-
-			rbtree_insert(trigger_last_fired_tree, found);
-		}
-
-		pthread_mutex_unlock(trigger_mutex);
-
-		/*
-		 *	Send the rate_limited traps at most once per second.
-		 */
-		if (found->last_fired == now) return -1;
-		found->last_fired = now;
+	if (trigger_last_fired_check(ci, rate_limit, args)) {
+		ROPTIONAL(RDEBUG3, DEBUG3, "Trigger %s already fired this second", attr);
+		return rate_limit ? -1 : 0;
 	}
 
 	/*
@@ -38,6 +38,7 @@ typedef struct fr_trunk_s fr_trunk_t;
 #include <freeradius-devel/server/trunk.h>
 
 #include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/server/radmin.h>
 #include <freeradius-devel/server/trigger.h>
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/misc.h>
@@ -52,6 +53,16 @@ typedef struct fr_trunk_s fr_trunk_t;
 
 static atomic_uint_fast64_t request_counter = ATOMIC_VAR_INIT(1);
 
+/** How many recent response times the hedge delay is calculated from
+ *
+ */
+#define FR_TRUNK_HEDGE_SAMPLES	64
+
+/** How many duplicates may be sent in a burst, if credit has built up
+ *
+ */
+#define FR_TRUNK_HEDGE_BURST	10
+
 #ifdef TESTING_TRUNK
 static fr_time_t test_time_base = 1;
 
@@ -111,9 +122,22 @@ struct fr_trunk_request_s {
 
 	fr_time_t		last_freed;		//!< Last time this request was freed.
 
+	fr_time_t		last_sent;		//!< Last time this request was sent.  Used to
+							///< measure the latency of the connection.
+
 	bool			bound_to_conn;		//!< Fail the request if there's an attempt to
 							///< re-enqueue it.
 
+	/** @name Hedging
+	 * @{
+ 	 */
+	fr_trunk_request_t	*hedge;			//!< The other request of a hedged pair.
+
+	bool			is_hedge;		//!< This is the duplicate, not the original.
+
+	fr_event_timer_t const	*hedge_ev;		//!< Fires when the request should be duplicated.
+	/** @} */
+
 #ifndef NDEBUG
 	fr_dlist_head_t		log;			//!< State change log.
 #endif
@@ -155,6 +179,9 @@ struct fr_trunk_connection_s {
 	fr_trunk_request_t	*cancel_partial;	//!< Partially written cancellation request.
 
 	fr_dlist_head_t		cancel_sent;		//!< Sent cancellation request.
+
+	fr_trunk_request_t	**batch;		//!< Requests passed to the batch mux callback.
+							///< Kept between calls to avoid reallocing.
 	/** @} */
 
 	/** @name Statistics
@@ -168,7 +195,19 @@ struct fr_trunk_connection_s {
 	 * @{
  	 */
   	fr_event_timer_t const	*lifetime_ev;		//!< Maximum time this connection can be open.
+
+	fr_event_timer_t const	*batch_ev;		//!< Fires when pending requests have waited
+							///< max_batch_delay for a full batch.
   	/** @} */
+
+	/** @name Batching
+	 * @{
+ 	 */
+	uint64_t		batch_start;		//!< sent_count when the current mux call started.
+
+	bool			batch_due;		//!< The batch delay has passed, write whatever is
+							///< pending.
+	/** @} */
 };
 
 /** Main trunk management handle
@@ -254,6 +293,8 @@ struct fr_trunk_s {
 	fr_rate_limit_t		limit_max_requests_alloc_log;	//!< Rate limit on "Refusing to alloc requests - Limit of * requests reached"
 
 	fr_rate_limit_t		limit_last_failure_log;	//!< Rate limit on "Refusing to enqueue requests - No active conns"
+
+	fr_rate_limit_t		limit_breaker_log;	//!< Rate limit on "Refusing to enqueue requests - Circuit breaker open"
  	/** @} */
 
 	/** @name State
@@ -268,13 +309,52 @@ struct fr_trunk_s {
 							///< (open/close) connections.
 
 	uint64_t		last_req_per_conn;	//!< The last request to connection ratio we calculated.
+
+	bool			budget_waiting;		//!< We were refused a slot from the global connection
+							///< budget, and are counted in its waiting total.
+	/** @} */
+
+	/** @name Hedging
+	 * @{
+ 	 */
+	fr_time_delta_t		hedge_samples[FR_TRUNK_HEDGE_SAMPLES];	//!< Recent response times.
+
+	uint64_t		hedge_sample_count;	//!< How many response times have been recorded.
+
+	uint64_t		hedge_credit;		//!< Duplicates we may send, in hundredths.  Each
+							///< request sent adds hedge_budget.
 	/** @} */
 };
 
+/** Connection slots shared between trunks in different threads
+ *
+ * Every connection in a trunk using the budget holds a slot.  A trunk
+ * can always open its first connection, so that every thread can
+ * service requests, but further connections are only opened if there
+ * are free slots.
+ */
+struct fr_trunk_budget_s {
+	uint32_t		max;			//!< Maximum number of slots.
+
+	atomic_uint_fast32_t	used;			//!< Slots held by connections.
+
+	atomic_uint_fast32_t	trunks;			//!< Number of trunks sharing the budget.
+
+	atomic_uint_fast32_t	waiting;		//!< Trunks which were refused a slot, and still
+							///< want one.
+
+	atomic_uint_fast64_t	refused;		//!< How many times a slot has been refused.
+};
+
 static CONF_PARSER const fr_trunk_config_request[] = {
 	{ FR_CONF_OFFSET("per_connection_max", FR_TYPE_UINT32, fr_trunk_conf_t, max_req_per_conn), .dflt = "2000" },
 	{ FR_CONF_OFFSET("per_connection_target", FR_TYPE_UINT32, fr_trunk_conf_t, target_req_per_conn), .dflt = "1000" },
 	{ FR_CONF_OFFSET("free_delay", FR_TYPE_TIME_DELTA, fr_trunk_conf_t, req_cleanup_delay), .dflt = "10.0" },
+	{ FR_CONF_OFFSET("max_batch", FR_TYPE_UINT32, fr_trunk_conf_t, max_batch), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_batch_delay", FR_TYPE_TIME_DELTA, fr_trunk_conf_t, max_batch_delay), .dflt = "0" },
+	{ FR_CONF_OFFSET("hedge_percentile", FR_TYPE_UINT32, fr_trunk_conf_t, hedge_percentile), .dflt = "0" },
+	{ FR_CONF_OFFSET("hedge_budget", FR_TYPE_UINT32, fr_trunk_conf_t, hedge_budget), .dflt = "5" },
+	{ FR_CONF_OFFSET("hedge_min_delay", FR_TYPE_TIME_DELTA, fr_trunk_conf_t, hedge_min_delay), .dflt = "0.01" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -299,8 +379,14 @@ CONF_PARSER const fr_trunk_config[] = {
 
 	{ FR_CONF_OFFSET("manage_interval", FR_TYPE_TIME_DELTA, fr_trunk_conf_t, manage_interval), .dflt = "0.2" },
 
+	{ FR_CONF_OFFSET("latency_aware", FR_TYPE_BOOL, fr_trunk_conf_t, latency_aware), .dflt = "no" },
+	{ FR_CONF_OFFSET("latency_drain_factor", FR_TYPE_UINT32, fr_trunk_conf_t, latency_drain_factor), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("global_max", FR_TYPE_UINT32, fr_trunk_conf_t, global_max), .dflt = "0" },
+
 	{ FR_CONF_OFFSET("connection", FR_TYPE_SUBSECTION, fr_trunk_conf_t, conn_conf), .subcs = (void const *) fr_trunk_config_connection, .subcs_size = sizeof(fr_trunk_config_connection) },
 	{ FR_CONF_POINTER("request", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) fr_trunk_config_request },
+	{ FR_CONF_OFFSET("breaker", FR_TYPE_SUBSECTION, fr_trunk_conf_t, breaker_conf), .subcs = (void const *) fr_breaker_config },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -553,6 +639,19 @@ do { \
 	(_tconn)->pub.trunk->in_handler = _prev; \
 } while(0)
 
+/** Write a batch of requests to a connection
+ *
+ */
+#define DO_REQUEST_MUX_BATCH(_tconn, _treqs, _num) \
+do { \
+	void *_prev = (_tconn)->pub.trunk->in_handler; \
+	DEBUG3("[%" PRIu64 "] Calling request_mux_batch(el=%p, tconn=%p, conn=%p, treqs=%p, num=%zu, uctx=%p)", \
+	       (_tconn)->pub.conn->id, (_tconn)->pub.trunk->el, (_tconn), (_tconn)->pub.conn, (_treqs), (_num), (_tconn)->pub.trunk->uctx); \
+	(_tconn)->pub.trunk->in_handler = (void *)(_tconn)->pub.trunk->funcs.request_mux_batch; \
+	(_tconn)->pub.trunk->funcs.request_mux_batch((_tconn)->pub.trunk->el, (_tconn), (_tconn)->pub.conn, (_treqs), (_num), (_tconn)->pub.trunk->uctx); \
+	(_tconn)->pub.trunk->in_handler = _prev; \
+} while(0)
+
 /** Read one or more requests from a connection
  *
  */
@@ -581,6 +680,73 @@ do { \
 	} \
 } while(0)
 
+/** Take a slot from the global connection budget
+ *
+ * @param[in] trunk	to take the slot for.
+ * @param[in] force	take a slot even if none are free.
+ * @return
+ *	- true if a slot was taken, or the trunk doesn't have a budget.
+ *	- false if there are no free slots.
+ */
+static bool trunk_budget_acquire(fr_trunk_t *trunk, bool force)
+{
+	fr_trunk_budget_t	*budget = trunk->conf.budget;
+	uint_fast32_t		used;
+
+	if (!budget) return true;
+
+	used = atomic_load_explicit(&budget->used, memory_order_relaxed);
+	do {
+		if (!force && (used >= budget->max)) {
+			atomic_fetch_add_explicit(&budget->refused, 1, memory_order_relaxed);
+			if (!trunk->budget_waiting) {
+				atomic_fetch_add_explicit(&budget->waiting, 1, memory_order_relaxed);
+				trunk->budget_waiting = true;
+			}
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&budget->used, &used, used + 1,
+							memory_order_relaxed, memory_order_relaxed));
+
+	if (trunk->budget_waiting) {
+		atomic_fetch_sub_explicit(&budget->waiting, 1, memory_order_relaxed);
+		trunk->budget_waiting = false;
+	}
+
+	return true;
+}
+
+/** Return a slot to the global connection budget
+ *
+ */
+static inline void trunk_budget_release(fr_trunk_t *trunk)
+{
+	if (!trunk->conf.budget) return;
+
+	atomic_fetch_sub_explicit(&trunk->conf.budget->used, 1, memory_order_relaxed);
+}
+
+/** Stop waiting for a slot from the global connection budget
+ *
+ */
+static inline void trunk_budget_unwait(fr_trunk_t *trunk)
+{
+	if (!trunk->budget_waiting) return;
+
+	atomic_fetch_sub_explicit(&trunk->conf.budget->waiting, 1, memory_order_relaxed);
+	trunk->budget_waiting = false;
+}
+
+/** Whether other trunks are waiting for slots we could give up
+ *
+ */
+static inline bool trunk_budget_contended(fr_trunk_t *trunk)
+{
+	if (!trunk->conf.budget || trunk->budget_waiting) return false;
+
+	return atomic_load_explicit(&trunk->conf.budget->waiting, memory_order_relaxed) > 0;
+}
+
 /** Allocate a new connection
  *
  */
@@ -594,6 +760,7 @@ do { \
 	(_tconn)->pub.trunk->in_handler = _prev; \
 	if (!(_tconn)->pub.conn) { \
 		ERROR("Failed creating new connection"); \
+		trunk_budget_release(trunk); \
 		talloc_free(tconn); \
 		return -1; \
 	} \
@@ -616,7 +783,8 @@ do { \
 } while(0)
 
 #define IN_HANDLER(_trunk)		(((_trunk)->in_handler) != NULL)
-#define IN_REQUEST_MUX(_trunk)		(((_trunk)->funcs.request_mux) && ((_trunk)->in_handler == (void *)(_trunk)->funcs.request_mux))
+#define IN_REQUEST_MUX(_trunk)		((((_trunk)->funcs.request_mux) && ((_trunk)->in_handler == (void *)(_trunk)->funcs.request_mux)) || \
+					 (((_trunk)->funcs.request_mux_batch) && ((_trunk)->in_handler == (void *)(_trunk)->funcs.request_mux_batch)))
 #define IN_REQUEST_DEMUX(_trunk)	(((_trunk)->funcs.request_demux) && ((_trunk)->in_handler == (void *)(_trunk)->funcs.request_demux))
 #define IN_REQUEST_CANCEL_MUX(_trunk)	(((_trunk)->funcs.request_cancel_mux) && ((_trunk)->in_handler == (void *)(_trunk)->funcs.request_cancel_mux))
 
@@ -698,6 +866,7 @@ static void trunk_request_enter_complete(fr_trunk_request_t *treq);
 static void trunk_request_enter_cancel(fr_trunk_request_t *treq, fr_trunk_cancel_reason_t reason);
 static void trunk_request_enter_cancel_sent(fr_trunk_request_t *treq);
 static void trunk_request_enter_cancel_complete(fr_trunk_request_t *treq);
+static void trunk_request_cancel(fr_trunk_request_t *treq);
 
 static uint64_t trunk_requests_per_connection(uint16_t *conn_count_out, uint32_t *req_conn_out,
 					      fr_trunk_t *trunk, fr_time_t now, NDEBUG_UNUSED bool verify);
@@ -743,6 +912,156 @@ static int8_t _trunk_request_prioritise(void const *a, void const *b)
 	return treq_a->pub.trunk->funcs.request_prioritise(treq_a->pub.preq, treq_b->pub.preq);
 }
 
+/** Split a hedged pair
+ *
+ * @param[in] treq	either half of the pair.
+ * @return the other half.
+ */
+static inline fr_trunk_request_t *trunk_request_unhedge(fr_trunk_request_t *treq)
+{
+	fr_trunk_request_t *other = treq->hedge;
+
+	treq->hedge = NULL;
+	other->hedge = NULL;
+
+	return other;
+}
+
+static int _trunk_hedge_sample_cmp(void const *a, void const *b)
+{
+	fr_time_delta_t one = *((fr_time_delta_t const *) a);
+	fr_time_delta_t two = *((fr_time_delta_t const *) b);
+
+	return (one > two) - (one < two);
+}
+
+/** Record a response time, and periodically recalculate the hedge delay
+ *
+ * The delay is left at 0 (no hedging) until there are enough samples
+ * for the percentile to mean something.
+ *
+ * @param[in] trunk	the request completed on.
+ * @param[in] sample	time between the request being sent and completing.
+ */
+static void trunk_hedge_sample(fr_trunk_t *trunk, fr_time_delta_t sample)
+{
+	fr_time_delta_t	sorted[FR_TRUNK_HEDGE_SAMPLES];
+	fr_time_delta_t	delay;
+
+	trunk->hedge_samples[trunk->hedge_sample_count++ % FR_TRUNK_HEDGE_SAMPLES] = sample;
+
+	if ((trunk->hedge_sample_count < FR_TRUNK_HEDGE_SAMPLES) ||
+	    (trunk->hedge_sample_count % (FR_TRUNK_HEDGE_SAMPLES / 4))) return;
+
+	memcpy(sorted, trunk->hedge_samples, sizeof(sorted));
+	qsort(sorted, FR_TRUNK_HEDGE_SAMPLES, sizeof(sorted[0]), _trunk_hedge_sample_cmp);
+
+	delay = sorted[(FR_TRUNK_HEDGE_SAMPLES * trunk->conf.hedge_percentile) / 100];
+	if (delay < trunk->conf.hedge_min_delay) delay = trunk->conf.hedge_min_delay;
+
+	trunk->pub.hedge_delay = delay;
+}
+
+/** Send a duplicate of a request which has been outstanding for too long
+ *
+ * The duplicate goes to the least loaded active connection, other than
+ * the one the original was sent on.  If there isn't one, or we've used
+ * up the budget, the original is left to complete on its own.
+ */
+static void _trunk_request_hedge(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_trunk_request_t	*treq = talloc_get_type_abort(uctx, fr_trunk_request_t);
+	fr_trunk_t		*trunk = treq->pub.trunk;
+	fr_trunk_connection_t	*tconn = NULL, *candidate;
+	fr_trunk_request_t	*hedge;
+	fr_heap_iter_t		iter;
+	uint32_t		lowest = UINT32_MAX;
+	void			*preq, *prev;
+
+	if ((treq->pub.state != FR_TRUNK_REQUEST_STATE_SENT) || treq->hedge) return;
+
+	if (trunk->hedge_credit < 100) {
+		DEBUG3("Not duplicating request %" PRIu64 " - Hedge budget exhausted", treq->id);
+		return;
+	}
+
+	for (candidate = fr_heap_iter_init(trunk->active, &iter);
+	     candidate;
+	     candidate = fr_heap_iter_next(trunk->active, &iter)) {
+		uint32_t count;
+
+		if (candidate == treq->pub.tconn) continue;
+
+		count = fr_trunk_request_count_by_connection(candidate, FR_TRUNK_REQUEST_STATE_ALL);
+		if (trunk->conf.max_req_per_conn && (count >= trunk->conf.max_req_per_conn)) continue;
+
+		if (count < lowest) {
+			tconn = candidate;
+			lowest = count;
+		}
+	}
+	if (!tconn) return;
+
+	hedge = fr_trunk_request_alloc(trunk, treq->pub.request);
+	if (!hedge) return;
+
+	prev = trunk->in_handler;
+	trunk->in_handler = (void *)trunk->funcs.request_hedge;
+	preq = trunk->funcs.request_hedge(hedge, treq->pub.request, treq->pub.preq, trunk->uctx);
+	trunk->in_handler = prev;
+	if (!preq) {
+		fr_trunk_request_free(&hedge);
+		return;
+	}
+	hedge->pub.preq = preq;
+
+	DEBUG2("Request %" PRIu64 " outstanding for more than %pVs, sending duplicate request %" PRIu64
+	       " on connection %" PRIu64, treq->id, fr_box_time_delta(trunk->pub.hedge_delay),
+	       hedge->id, tconn->pub.conn->id);
+
+	hedge->is_hedge = true;
+	hedge->hedge = treq;
+	treq->hedge = hedge;
+
+	trunk->hedge_credit -= 100;
+	trunk->pub.hedge_sent++;
+
+	/*
+	 *	hedge may have been sent, and even completed
+	 *	or failed by the time this returns, so it
+	 *	mustn't be used afterwards.
+	 */
+	if (fr_trunk_request_enqueue_on_conn(&hedge, tconn, treq->pub.request, preq,
+					     treq->pub.rctx, false) != FR_TRUNK_ENQUEUE_OK) {
+		(void) trunk_request_unhedge(treq);
+		fr_trunk_request_free(&hedge);
+	}
+}
+
+/** Arrange for a duplicate of a request to be sent, if it takes too long
+ *
+ * Each request sent also adds to the budget for duplicates.  Unused
+ * budget builds up to allow a small burst of duplicates, but no more.
+ *
+ * @param[in] treq	which has just been sent.
+ */
+static void trunk_request_hedge_start(fr_trunk_request_t *treq)
+{
+	fr_trunk_t *trunk = treq->pub.trunk;
+
+	if (!trunk->funcs.request_hedge || treq->bound_to_conn || !treq->pub.request) return;
+
+	trunk->hedge_credit += trunk->conf.hedge_budget;
+	if (trunk->hedge_credit > (FR_TRUNK_HEDGE_BURST * 100)) trunk->hedge_credit = FR_TRUNK_HEDGE_BURST * 100;
+
+	if (!trunk->pub.hedge_delay || treq->hedge || treq->hedge_ev) return;
+
+	if (fr_event_timer_in(treq, trunk->el, &treq->hedge_ev, trunk->pub.hedge_delay,
+			      _trunk_request_hedge, treq) < 0) {
+		PERROR("Failed inserting hedge timer");
+	}
+}
+
 /** Remove a request from all connection lists
  *
  * A common function used by init, fail, complete state functions to disassociate
@@ -764,6 +1083,8 @@ static void trunk_request_remove_from_conn(fr_trunk_request_t *treq)
 
 	if (!fr_cond_assert(!tconn || (tconn->pub.trunk == trunk))) return;
 
+	if (treq->hedge_ev) fr_event_timer_delete(&treq->hedge_ev);
+
 	switch (treq->pub.state) {
 	case FR_TRUNK_REQUEST_STATE_UNASSIGNED:
 		return;	/* Not associated with connection */
@@ -1055,6 +1376,9 @@ static void trunk_request_enter_sent(fr_trunk_request_t *treq)
 	 *	Update the connection's sent stats
 	 */
 	tconn->sent_count++;
+	treq->last_sent = fr_time();
+
+	if (trunk->conf.hedge_percentile && !treq->is_hedge) trunk_request_hedge_start(treq);
 
 	/*
 	 *	Enforces max_uses
@@ -1122,6 +1446,8 @@ static void trunk_request_enter_cancel(fr_trunk_request_t *treq, fr_trunk_cancel
 	fr_dlist_insert_tail(&tconn->cancel, treq);
 	treq->cancel_reason = reason;
 
+	if (treq->hedge_ev) fr_event_timer_delete(&treq->hedge_ev);
+
 	DO_REQUEST_CANCEL(treq, reason);
 
 	/*
@@ -1248,6 +1574,28 @@ static void trunk_request_enter_cancel_complete(fr_trunk_request_t *treq)
 	fr_trunk_request_free(&treq);	/* Free the request */
 }
 
+/** Add a latency sample to a connection
+ *
+ * This is a peak EWMA.  Samples above the current estimate replace it
+ * immediately, so a connection which slows down is avoided straight away.
+ * Samples below it only pull it down by 1/8th of the difference, so a
+ * single fast response doesn't make a slow connection look fast again.
+ *
+ * @param[in] tconn	the request completed on.
+ * @param[in] sample	time between the request being sent and completing.
+ */
+static inline void trunk_connection_latency_update(fr_trunk_connection_t *tconn, fr_time_delta_t sample)
+{
+	if (sample <= 0) sample = 1;	/* 0 means "no samples" */
+
+	if (sample >= tconn->pub.latency) {
+		tconn->pub.latency = sample;
+		return;
+	}
+
+	tconn->pub.latency -= (tconn->pub.latency - sample) / 8;
+}
+
 /** Request completed successfully, inform the API client and free the request
  *
  * @note treq will be inviable after a call to this function.
@@ -1260,11 +1608,41 @@ static void trunk_request_enter_complete(fr_trunk_request_t *treq)
 {
 	fr_trunk_connection_t	*tconn = treq->pub.tconn;
 	fr_trunk_t		*trunk = treq->pub.trunk;
+	fr_time_t		sent = treq->last_sent;
 
 	if (!fr_cond_assert(!tconn || (tconn->pub.trunk == trunk))) return;
 
+	/*
+	 *	The first of a hedged pair to complete wins,
+	 *	and the other one is no longer needed.
+	 */
+	if (treq->hedge) {
+		fr_trunk_request_t *other = trunk_request_unhedge(treq);
+
+		if (treq->is_hedge) {
+			trunk->pub.hedge_won++;
+			sent = other->last_sent;
+		}
+		trunk_request_cancel(other);
+	}
+
 	switch (treq->pub.state) {
 	case FR_TRUNK_REQUEST_STATE_SENT:
+	{
+		fr_time_t now = fr_time();
+
+		/*
+		 *	Must be done before the request is
+		 *	removed, so that the connection is
+		 *	re-ordered using the new latency.
+		 */
+		if (tconn) trunk_connection_latency_update(tconn, now - treq->last_sent);
+		if (trunk->conf.hedge_percentile) trunk_hedge_sample(trunk, now - sent);
+		if (trunk->conf.breaker) fr_breaker_result(trunk->conf.breaker, now, true, now - sent);
+		trunk_request_remove_from_conn(treq);
+	}
+		break;
+
 	case FR_TRUNK_REQUEST_STATE_PENDING:
 		trunk_request_remove_from_conn(treq);
 		break;
@@ -1291,9 +1669,25 @@ static void trunk_request_enter_failed(fr_trunk_request_t *treq)
 	fr_trunk_connection_t		*tconn = treq->pub.tconn;
 	fr_trunk_t			*trunk = treq->pub.trunk;
 	fr_trunk_request_state_t	prev = treq->pub.state;
+	bool				silent = false;
 
 	if (!fr_cond_assert(!tconn || (tconn->pub.trunk == trunk))) return;
 
+	/*
+	 *	If the duplicate fails, the original carries on,
+	 *	and the API client doesn't need to know.  If the
+	 *	original fails, the duplicate is cancelled.
+	 */
+	if (treq->hedge) {
+		fr_trunk_request_t *other = trunk_request_unhedge(treq);
+
+		if (treq->is_hedge) {
+			silent = true;
+		} else {
+			trunk_request_cancel(other);
+		}
+	}
+
 	switch (treq->pub.state) {
 	case FR_TRUNK_REQUEST_STATE_BACKLOG:
 		REQUEST_EXTRACT_BACKLOG(treq);
@@ -1304,8 +1698,10 @@ static void trunk_request_enter_failed(fr_trunk_request_t *treq)
 		break;
 	}
 
+	if (!silent && trunk->conf.breaker) fr_breaker_result(trunk->conf.breaker, fr_time(), false, 0);
+
 	REQUEST_STATE_TRANSITION(FR_TRUNK_REQUEST_STATE_FAILED);
-	DO_REQUEST_FAIL(treq, prev);
+	if (!silent) DO_REQUEST_FAIL(treq, prev);
 	fr_trunk_request_free(&treq);	/* Free the request */
 }
 
@@ -1830,34 +2226,16 @@ void fr_trunk_request_signal_fail(fr_trunk_request_t *treq)
 	trunk_request_enter_failed(treq);
 }
 
-/** Cancel a trunk request
+/** Cancel a trunk request, without checking whether we're in a handler
  *
- * treq can be in any state, but requests to cancel if the treq is not in
- * the FR_TRUNK_REQUEST_STATE_PARTIAL or FR_TRUNK_REQUEST_STATE_SENT state will be ignored.
+ * Used to cancel the other half of a hedged pair, which may happen
+ * when the first half completes or fails.
  *
- * The complete or failed callbacks will not be called here, as it's assumed the REQUEST *
- * is now inviable as it's being cancelled.
- *
- * The free function however, is called, and that should be used to perform necessary
- * cleanup.
- *
- * @param[in] treq	to signal state change for.
+ * @param[in] treq	to cancel.
  */
-void fr_trunk_request_signal_cancel(fr_trunk_request_t *treq)
+static void trunk_request_cancel(fr_trunk_request_t *treq)
 {
-	fr_trunk_t	*trunk;
-
-	/*
-	 *	Ensure treq hasn't been freed
-	 */
-	(void)talloc_get_type_abort(treq, fr_trunk_request_t);
-
-	if (!fr_cond_assert_msg(treq->pub.trunk, "treq not associated with trunk")) return;
-
-	if (!fr_cond_assert_msg(!IN_HANDLER(treq->pub.trunk),
-				"%s cannot be called within a handler", __FUNCTION__)) return;
-
- 	trunk = treq->pub.trunk;
+	fr_trunk_t	*trunk = treq->pub.trunk;
 
 	switch (treq->pub.state) {
 	/*
@@ -1921,6 +2299,39 @@ void fr_trunk_request_signal_cancel(fr_trunk_request_t *treq)
 	}
 }
 
+/** Cancel a trunk request
+ *
+ * treq can be in any state, but requests to cancel if the treq is not in
+ * the FR_TRUNK_REQUEST_STATE_PARTIAL or FR_TRUNK_REQUEST_STATE_SENT state will be ignored.
+ *
+ * The complete or failed callbacks will not be called here, as it's assumed the REQUEST *
+ * is now inviable as it's being cancelled.
+ *
+ * The free function however, is called, and that should be used to perform necessary
+ * cleanup.
+ *
+ * @param[in] treq	to signal state change for.
+ */
+void fr_trunk_request_signal_cancel(fr_trunk_request_t *treq)
+{
+	/*
+	 *	Ensure treq hasn't been freed
+	 */
+	(void)talloc_get_type_abort(treq, fr_trunk_request_t);
+
+	if (!fr_cond_assert_msg(treq->pub.trunk, "treq not associated with trunk")) return;
+
+	if (!fr_cond_assert_msg(!IN_HANDLER(treq->pub.trunk),
+				"%s cannot be called within a handler", __FUNCTION__)) return;
+
+	/*
+	 *	The duplicate shares the rctx, so must go too.
+	 */
+	if (treq->hedge) trunk_request_cancel(trunk_request_unhedge(treq));
+
+	trunk_request_cancel(treq);
+}
+
 /** Signal a partial cancel write
  *
  * Where there's high load, and the outbound write buffer is full
@@ -2028,11 +2439,16 @@ void fr_trunk_request_free(fr_trunk_request_t **treq_to_free)
 	 */
 	*treq_to_free = NULL;
 
+	if (treq->hedge_ev) fr_event_timer_delete(&treq->hedge_ev);
+	if (treq->hedge) trunk_request_cancel(trunk_request_unhedge(treq));
+
 	/*
 	 *	Call the API client callback to free
-	 *	any associated memory.
+	 *	any associated memory.  A duplicate
+	 *	which the API client declined to
+	 *	create has nothing to free.
 	 */
-	DO_REQUEST_FREE(treq);
+	if (treq->pub.preq) DO_REQUEST_FREE(treq);
 
 	/*
 	 *	Update the last above/below target stats
@@ -2285,7 +2701,18 @@ fr_trunk_enqueue_t fr_trunk_request_enqueue(fr_trunk_request_t **treq_out, fr_tr
 		if (fr_trunk_start(trunk) < 0) return FR_TRUNK_ENQUEUE_FAIL;
 	}
 
-	rcode = trunk_request_check_enqueue(&tconn, trunk, request);
+	/*
+	 *	Fail immediately if the destination has been
+	 *	failing, so that the caller can move on to
+	 *	another one.
+	 */
+	if (trunk->conf.breaker && !fr_breaker_allow(trunk->conf.breaker, fr_time())) {
+		RATE_LIMIT_LOCAL_ROPTIONAL(&trunk->limit_breaker_log,
+					   RWARN, WARN, "Refusing to enqueue requests - Circuit breaker is open");
+		rcode = FR_TRUNK_ENQUEUE_DST_UNAVAILABLE;
+	} else {
+		rcode = trunk_request_check_enqueue(&tconn, trunk, request);
+	}
 	switch (rcode) {
 	case FR_TRUNK_ENQUEUE_OK:
 		if (*treq_out) {
@@ -2629,6 +3056,131 @@ static inline void trunk_connection_readable(fr_trunk_connection_t *tconn)
 	DO_REQUEST_DEMUX(tconn);
 }
 
+/** The batch delay has passed, write whatever is pending
+ *
+ */
+static void _trunk_connection_batch_expire(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	tconn->batch_due = true;
+
+	if (tconn->pub.trunk->conf.always_writable) {
+		trunk_connection_writable(tconn);
+		return;
+	}
+
+	/*
+	 *	Register for write events, the
+	 *	requests will be written when the
+	 *	connection is next writable.
+	 */
+	trunk_connection_event_update(tconn);
+}
+
+/** Whether pending requests should wait for more to arrive before they're written
+ *
+ * Starts the batch timer if it isn't already running.
+ *
+ * @param[in] tconn	to check.
+ * @return
+ *	- true if the requests should wait.
+ *	- false if they should be written now.
+ */
+static bool trunk_connection_batch_wait(fr_trunk_connection_t *tconn)
+{
+	fr_trunk_t *trunk = tconn->pub.trunk;
+
+	if (!trunk->conf.max_batch_delay || tconn->batch_due) return false;
+
+	/*
+	 *	Finish writing what we started.
+	 */
+	if (tconn->partial) return false;
+
+	if (trunk->conf.max_batch &&
+	    (fr_trunk_request_count_by_connection(tconn, FR_TRUNK_REQUEST_STATE_PENDING) >= trunk->conf.max_batch)) {
+		return false;
+	}
+
+	if (tconn->batch_ev) return true;
+
+	/*
+	 *	If we can't wait, don't.
+	 */
+	if (fr_event_timer_in(tconn, trunk->el, &tconn->batch_ev,
+			      trunk->conf.max_batch_delay, _trunk_connection_batch_expire, tconn) < 0) {
+		PERROR("Failed inserting batch timer event, writing requests now");
+		return false;
+	}
+
+	return true;
+}
+
+/** Write pending requests from the pending heap in a single call to the batch mux function
+ *
+ * The requests are popped from the heap to put them in priority order,
+ * then inserted again, as they remain pending until they're signalled.
+ */
+static void trunk_connection_mux_batch(fr_trunk_connection_t *tconn)
+{
+	fr_trunk_t		*trunk = tconn->pub.trunk;
+	size_t			num = 0, max, popped;
+
+	max = fr_heap_num_elements(tconn->pending) + (tconn->partial ? 1 : 0);
+	if (trunk->conf.max_batch && (max > trunk->conf.max_batch)) max = trunk->conf.max_batch;
+
+	if (talloc_array_length(tconn->batch) < max) {
+		MEM(tconn->batch = talloc_realloc(tconn, tconn->batch, fr_trunk_request_t *, max));
+	}
+
+	if (tconn->partial) tconn->batch[num++] = tconn->partial;
+
+	/*
+	 *	Can't fail, the heap array is already large
+	 *	enough to hold the requests we popped.
+	 */
+	popped = fr_heap_pop_n(tconn->pending, (void **)&tconn->batch[num], max - num);
+	(void) fr_heap_insert_n(tconn->pending, (void **)&tconn->batch[num], popped);
+	num += popped;
+
+	DO_REQUEST_MUX_BATCH(tconn, tconn->batch, num);
+}
+
+/** Call the mux function for a connection, and record how many requests it wrote
+ *
+ * @return The number of requests sent.
+ */
+static uint64_t trunk_connection_mux(fr_trunk_connection_t *tconn)
+{
+	fr_trunk_t	*trunk = tconn->pub.trunk;
+	uint64_t	sent;
+	uint8_t		bucket;
+
+	if (tconn->batch_ev) fr_event_timer_delete(&tconn->batch_ev);
+	tconn->batch_due = false;
+	tconn->batch_start = tconn->sent_count;
+
+	if (trunk->funcs.request_mux_batch) {
+		trunk_connection_mux_batch(tconn);
+	} else {
+		DO_REQUEST_MUX(tconn);
+	}
+
+	/*
+	 *	sent_count is reset if the connection
+	 *	was closed during the mux call.
+	 */
+	if (tconn->sent_count <= tconn->batch_start) return 0;
+	sent = tconn->sent_count - tconn->batch_start;
+
+	bucket = fr_high_bit_pos(sent) - 1;
+	if (bucket >= FR_TRUNK_BATCH_HISTOGRAM_SIZE) bucket = FR_TRUNK_BATCH_HISTOGRAM_SIZE - 1;
+	trunk->pub.batch_size[bucket]++;
+
+	return sent;
+}
+
 /** A connection is writable.  Call the request_mux function to write pending requests
  *
  */
@@ -2649,7 +3201,17 @@ static inline void trunk_connection_writable(fr_trunk_connection_t *tconn)
 	if (!fr_trunk_request_count_by_connection(tconn,
 						  FR_TRUNK_REQUEST_STATE_PENDING |
 						  FR_TRUNK_REQUEST_STATE_PARTIAL)) return;
-	DO_REQUEST_MUX(tconn);
+
+	/*
+	 *	If the connection is always writable there won't
+	 *	be another write event, so keep writing full
+	 *	batches whilst there are enough pending.
+	 */
+	do {
+		if (trunk_connection_batch_wait(tconn)) return;
+	} while ((trunk_connection_mux(tconn) >= trunk->conf.max_batch) &&
+		 trunk->conf.max_batch && trunk->conf.always_writable &&
+		 fr_trunk_request_count_by_connection(tconn, FR_TRUNK_REQUEST_STATE_PENDING));
 }
 
 /** Update the registrations for I/O events we're interested in
@@ -2677,15 +3239,24 @@ static void trunk_connection_event_update(fr_trunk_connection_t *tconn)
 		/*
 		 *	If the connection is always writable,
 		 *	then we don't care about write events.
+		 *
+		 *	If pending requests are waiting for a
+		 *	full batch, we don't care about write
+		 *	events until the batch is full, or the
+		 *	batch timer fires.
 		 */
-		if (!trunk->conf.always_writable &&
-		    fr_trunk_request_count_by_connection(tconn,
-							 FR_TRUNK_REQUEST_STATE_PARTIAL |
-						       	 FR_TRUNK_REQUEST_STATE_PENDING |
-							 (trunk->funcs.request_cancel_mux ?
-							 FR_TRUNK_REQUEST_STATE_CANCEL |
-							 FR_TRUNK_REQUEST_STATE_CANCEL_PARTIAL : 0)) > 0) {
-			events |= FR_TRUNK_CONN_EVENT_WRITE;
+		if (!trunk->conf.always_writable) {
+			if (trunk->funcs.request_cancel_mux &&
+			    (fr_trunk_request_count_by_connection(tconn,
+								  FR_TRUNK_REQUEST_STATE_CANCEL |
+								  FR_TRUNK_REQUEST_STATE_CANCEL_PARTIAL) > 0)) {
+				events |= FR_TRUNK_CONN_EVENT_WRITE;
+			} else if ((fr_trunk_request_count_by_connection(tconn,
+									 FR_TRUNK_REQUEST_STATE_PARTIAL |
+									 FR_TRUNK_REQUEST_STATE_PENDING) > 0) &&
+				   !trunk_connection_batch_wait(tconn)) {
+				events |= FR_TRUNK_CONN_EVENT_WRITE;
+			}
 		}
 
 		if (fr_trunk_request_count_by_connection(tconn,
@@ -3218,12 +3789,19 @@ static void _trunk_connection_on_closed(UNUSED fr_connection_t *conn,
 	 *	Clear statistics and flags
 	 */
 	tconn->sent_count = 0;
+	tconn->pub.latency = 0;
 
 	/*
 	 *	Remove the reconnect event
 	 */
 	if (trunk->conf.lifetime > 0) fr_event_timer_delete(&tconn->lifetime_ev);
 
+	/*
+	 *	Remove the batch event
+	 */
+	if (tconn->batch_ev) fr_event_timer_delete(&tconn->batch_ev);
+	tconn->batch_due = false;
+
 	/*
 	 *	Remove the I/O events
 	 */
@@ -3394,6 +3972,8 @@ static int _trunk_connection_free(fr_trunk_connection_t *tconn)
 	(void)talloc_free(tconn->pub.conn);
 	tconn->pub.conn = NULL;
 
+	trunk_budget_release(tconn->pub.trunk);
+
 	return 0;
 }
 
@@ -3404,11 +3984,25 @@ static int _trunk_connection_free(fr_trunk_connection_t *tconn)
  *
  * @param[in] trunk	to spawn connection in.
  * @param[in] now	The current time.
+ * @return
+ *	- 0 on success.
+ *	- 1 if the global connection budget is exhausted.
+ *	- -1 on failure.
  */
 static int trunk_connection_spawn(fr_trunk_t *trunk, fr_time_t now)
 {
 	fr_trunk_connection_t	*tconn;
 
+	/*
+	 *	The first connection doesn't need a
+	 *	free slot, otherwise this trunk
+	 *	couldn't service any requests.
+	 */
+	if (!trunk_budget_acquire(trunk, fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_ALL) == 0)) {
+		DEBUG3("Not opening connection - Global limit of %u connections reached",
+		       trunk->conf.budget->max);
+		return 1;
+	}
 
 	/*
 	 *	Call the API client's callback to create
@@ -3535,7 +4129,8 @@ int fr_trunk_connection_pop_cancellation(fr_trunk_request_t **treq_out, fr_trunk
  * @param[out] treq_out	to process
  * @param[in] tconn	to pop a request from.
  * @return
- *	- 1 if no more requests.
+ *	- 1 if no more requests, or if conf->max_batch requests have already been
+ *	  sent by this call to the muxer.
  *	- 0 if a new request was written to treq_out.
  *	- -1 if the connection was previously freed.  Caller *MUST NOT* touch any
  *	  memory or requests associated with the connection.
@@ -3549,6 +4144,15 @@ int fr_trunk_connection_pop_request(fr_trunk_request_t **treq_out, fr_trunk_conn
 				"%s can only be called from within request_mux handler",
 				__FUNCTION__)) return -2;
 
+	/*
+	 *	Enforces max_batch
+	 */
+	if (tconn->pub.trunk->conf.max_batch &&
+	    ((tconn->sent_count - tconn->batch_start) >= tconn->pub.trunk->conf.max_batch)) {
+		*treq_out = NULL;
+		return 1;
+	}
+
 	*treq_out = tconn->partial ? tconn->partial : fr_heap_peek(tconn->pending);
 	if (!*treq_out) return 1;
 
@@ -3786,6 +4390,44 @@ static void trunk_rebalance(fr_trunk_t *trunk)
  * - Return if we last closed a connection within 'closed_delay'.
  * - Otherwise we move a connection to draining state.
  */
+/** Drain the active connection with the highest latency, if it's much slower than the fastest
+ *
+ * The connection is freed once its outstanding requests complete, and
+ * the normal management logic opens a replacement if one is needed.
+ * At most one connection is drained every close_delay.
+ *
+ * @param[in] trunk	to check.
+ * @param[in] now	the current time.
+ */
+static void trunk_connection_drain_slowest(fr_trunk_t *trunk, fr_time_t now)
+{
+	fr_trunk_connection_t	*tconn, *slowest = NULL;
+	fr_heap_iter_t		iter;
+	fr_time_delta_t		fastest = 0;
+
+	if (fr_heap_num_elements(trunk->active) < 2) return;
+
+	if ((trunk->pub.last_closed + trunk->conf.close_delay) > now) return;
+
+	for (tconn = fr_heap_iter_init(trunk->active, &iter);
+	     tconn;
+	     tconn = fr_heap_iter_next(trunk->active, &iter)) {
+		if (!tconn->pub.latency) continue;
+
+		if (!fastest || (tconn->pub.latency < fastest)) fastest = tconn->pub.latency;
+		if (!slowest || (tconn->pub.latency > slowest->pub.latency)) slowest = tconn;
+	}
+
+	if (!slowest || (slowest->pub.latency <= (fastest * trunk->conf.latency_drain_factor))) return;
+
+	DEBUG2("[%" PRIu64 "] Draining connection - Latency %pVs is more than %u times the fastest (%pVs)",
+	       slowest->pub.conn->id, fr_box_time_delta(slowest->pub.latency),
+	       trunk->conf.latency_drain_factor, fr_box_time_delta(fastest));
+
+	trunk_connection_enter_draining_to_free(slowest);
+	trunk->pub.last_closed = now;
+}
+
 static void trunk_manage(fr_trunk_t *trunk, fr_time_t now)
 {
 	fr_trunk_connection_t	*tconn = NULL;
@@ -3812,6 +4454,14 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now)
 	trunk_connection_close_if_empty(trunk, &trunk->draining);
 	trunk_connection_close_if_empty(trunk, &trunk->draining_to_free);
 
+	/*
+	 *	Requests in the backlog would otherwise wait
+	 *	for a connection which probably isn't coming.
+	 */
+	if (trunk->conf.breaker && (fr_breaker_state(trunk->conf.breaker) == FR_BREAKER_OPEN)) {
+		while ((treq = fr_heap_peek(trunk->backlog))) trunk_request_enter_failed(treq);
+	}
+
 	/*
 	 *	Process deferred connection freeing
 	 */
@@ -3831,6 +4481,12 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now)
 	 */
 	if (!trunk->managing_connections) return;
 
+	/*
+	 *	Replace connections which are much slower
+	 *	than the others.
+	 */
+	if (trunk->conf.latency_drain_factor > 0) trunk_connection_drain_slowest(trunk, now);
+
 	/*
 	 *	We're above the target requests per connection
 	 *	spawn more connections!
@@ -3945,6 +4601,10 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now)
 	 *	Free some connections...
 	 */
 	else if (trunk->pub.last_below_target > trunk->pub.last_above_target) {
+		uint16_t min = trunk->conf.min;
+
+		trunk_budget_unwait(trunk);
+
 		if ((trunk->pub.last_below_target + trunk->conf.close_delay) > now) {
 			DEBUG3("Not closing connection - Need to be below target for %pVs. It's been %pVs",
 			       fr_box_time_delta(trunk->conf.close_delay),
@@ -3959,9 +4619,16 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now)
 			return;
 		}
 
-		if ((trunk->conf.min > 0) && ((conn_count - 1) < trunk->conf.min)) {
+		/*
+		 *	Lend connection slots to trunks which
+		 *	need them more, by only keeping the
+		 *	connections we need.
+		 */
+		if ((min > 1) && trunk_budget_contended(trunk)) min = 1;
+
+		if ((min > 0) && ((conn_count - 1) < min)) {
 			DEBUG3("Not closing connection - Have %u connections, need %u or above",
-			       conn_count, trunk->conf.min);
+			       conn_count, min);
 			return;
 		}
 
@@ -4337,8 +5004,12 @@ int fr_trunk_start(fr_trunk_t *trunk)
 	 *	Spawn the initial set of connections
 	 */
 	for (i = 0; i < trunk->conf.start; i++) {
+		int ret;
+
 		DEBUG("[%i] Starting initial connection", i);
-		if (trunk_connection_spawn(trunk, fr_time()) != 0) return -1;
+		ret = trunk_connection_spawn(trunk, fr_time());
+		if (ret < 0) return -1;
+		if (ret > 0) break;	/* Global connection budget exhausted */
 	}
 
 	if (trunk->conf.manage_interval > 0) {
@@ -4410,6 +5081,29 @@ static int8_t _trunk_connection_order_by_shortest_queue(void const *one, void co
 	return 0;
 }
 
+/** Order connections by latency multiplied by queue depth
+ *
+ * This approximates the time a new request would take to complete on
+ * each connection.  Connections which haven't completed any requests
+ * yet are compared by queue depth alone.
+ */
+static int8_t _trunk_connection_order_by_latency(void const *one, void const *two)
+{
+	fr_trunk_connection_t	const *a = talloc_get_type_abort_const(one, fr_trunk_connection_t);
+	fr_trunk_connection_t	const *b = talloc_get_type_abort_const(two, fr_trunk_connection_t);
+	uint64_t		a_cost, b_cost;
+
+	if (!a->pub.latency || !b->pub.latency) return _trunk_connection_order_by_shortest_queue(one, two);
+
+	a_cost = (uint64_t)a->pub.latency * (fr_trunk_request_count_by_connection(a, FR_TRUNK_REQUEST_STATE_ALL) + 1);
+	b_cost = (uint64_t)b->pub.latency * (fr_trunk_request_count_by_connection(b, FR_TRUNK_REQUEST_STATE_ALL) + 1);
+
+	if (a_cost > b_cost) return +1;
+	if (a_cost < b_cost) return -1;
+
+	return 0;
+}
+
 /** Free a trunk, gracefully closing all connections.
  *
  */
@@ -4459,6 +5153,11 @@ static int _trunk_free(fr_trunk_t *trunk)
 	 */
 	while ((treq = fr_dlist_head(&trunk->free_requests))) talloc_free(treq);
 
+	if (trunk->conf.budget) {
+		trunk_budget_unwait(trunk);
+		atomic_fetch_sub_explicit(&trunk->conf.budget->trunks, 1, memory_order_relaxed);
+	}
+
 	return 0;
 }
 
@@ -4505,11 +5204,15 @@ fr_trunk_t *fr_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 
 	memcpy(&trunk->funcs, funcs, sizeof(trunk->funcs));
 	if (!trunk->funcs.connection_prioritise) {
-		trunk->funcs.connection_prioritise = _trunk_connection_order_by_shortest_queue;
+		trunk->funcs.connection_prioritise = conf->latency_aware ?
+						     _trunk_connection_order_by_latency :
+						     _trunk_connection_order_by_shortest_queue;
 	}
 	if (!trunk->funcs.request_prioritise) trunk->funcs.request_prioritise = fr_pointer_cmp;
 
 	memcpy(&trunk->conf, conf, sizeof(trunk->conf));
+	if (trunk->conf.budget) atomic_fetch_add_explicit(&trunk->conf.budget->trunks, 1, memory_order_relaxed);
+	if (trunk->conf.hedge_percentile > 99) trunk->conf.hedge_percentile = 99;
 
 	memcpy(&trunk->uctx, &uctx, sizeof(trunk->uctx));
 	talloc_set_destructor(trunk, _trunk_free);
@@ -4551,3 +5254,174 @@ fr_trunk_t *fr_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 
 	return trunk;
 }
+
+static int cmd_show_trunk_budget(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_trunk_budget_t *budget = talloc_get_type_abort(ctx, fr_trunk_budget_t);
+
+	fprintf(fp, "max\t\t\t%u\n", budget->max);
+	fprintf(fp, "used\t\t\t%u\n", (unsigned int)atomic_load_explicit(&budget->used, memory_order_relaxed));
+	fprintf(fp, "trunks\t\t\t%u\n", (unsigned int)atomic_load_explicit(&budget->trunks, memory_order_relaxed));
+	fprintf(fp, "waiting\t\t\t%u\n", (unsigned int)atomic_load_explicit(&budget->waiting, memory_order_relaxed));
+	fprintf(fp, "refused\t\t\t%" PRIu64 "\n", (uint64_t)atomic_load_explicit(&budget->refused, memory_order_relaxed));
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_trunk_budget_table[] = {
+	{
+		.parent = "show trunk",
+		.add_name = true,
+		.name = "budget",
+		.func = cmd_show_trunk_budget,
+		.help = "Show how many connections all threads have open, and the global limit.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
+/** Allocate a connection budget to share between trunks in different threads
+ *
+ * Must be called before any trunks are allocated with the configuration,
+ * usually from a module's instantiate callback.  Does nothing if global_max
+ * isn't set.
+ *
+ * @param[in] ctx	to allocate the budget in.  Must outlive all trunks using it.
+ * @param[in] conf	to share between the trunks.  conf->budget will be set.
+ * @param[in] name	to register radmin commands under, as "show trunk <name> budget".
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_trunk_budget_alloc(TALLOC_CTX *ctx, fr_trunk_conf_t *conf, char const *name)
+{
+	fr_trunk_budget_t	*budget;
+
+	if (!conf->global_max) return 0;
+
+	if (conf->min > conf->global_max) {
+		fr_strerror_printf("\"global_max\" (%u) must be greater than or equal to \"min\" (%u)",
+				   conf->global_max, conf->min);
+		return -1;
+	}
+
+	MEM(budget = talloc_zero(ctx, fr_trunk_budget_t));
+	budget->max = conf->global_max;
+
+	if (fr_command_register_hook(NULL, name, budget, cmd_trunk_budget_table) < 0) {
+		talloc_free(budget);
+		return -1;
+	}
+
+	conf->budget = budget;
+
+	return 0;
+}
+
+/** Shared between all trunks using a breaker, for notifications and radmin
+ *
+ */
+typedef struct {
+	fr_breaker_t		*breaker;		//!< Shared by the trunks.
+	fr_trunk_conf_t const	*conf;			//!< The breaker was allocated for.
+	char const		*name;			//!< Used in log messages.
+	char const		*trigger_prefix;	//!< Prepended to the names of triggers.
+} fr_trunk_breaker_t;
+
+static fr_table_num_ordered_t const fr_trunk_breaker_trigger_names[] = {
+	{ "breaker_closed",	FR_BREAKER_CLOSED	},
+	{ "breaker_open",	FR_BREAKER_OPEN		},
+	{ "breaker_half_open",	FR_BREAKER_HALF_OPEN	}
+};
+static size_t fr_trunk_breaker_trigger_names_len = NUM_ELEMENTS(fr_trunk_breaker_trigger_names);
+
+static void _trunk_breaker_notify(UNUSED fr_breaker_t *breaker, fr_breaker_state_t state, void *uctx)
+{
+	fr_trunk_breaker_t	*tb = talloc_get_type_abort(uctx, fr_trunk_breaker_t);
+	char			trigger[128];
+
+	/*
+	 *	Shared between trunks, so there's no trunk
+	 *	to take the log prefix from.
+	 */
+	if (state == FR_BREAKER_OPEN) {
+		fr_log(&default_log, L_ERR, __FILE__, __LINE__, "%s - Circuit breaker opened, failing requests for %pVs",
+		       tb->name, fr_box_time_delta(tb->conf->breaker_conf.open_time));
+	} else {
+		fr_log(&default_log, L_INFO, __FILE__, __LINE__, "%s - Circuit breaker is now %s", tb->name,
+		       fr_table_str_by_value(fr_breaker_states, state, "<INVALID>"));
+	}
+
+	snprintf(trigger, sizeof(trigger), "%s.%s", tb->trigger_prefix,
+		 fr_table_str_by_value(fr_trunk_breaker_trigger_names, state, "<INVALID>"));
+	trigger_exec(NULL, NULL, trigger, true, NULL);
+}
+
+static int cmd_show_trunk_breaker(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_trunk_breaker_t *tb = talloc_get_type_abort(ctx, fr_trunk_breaker_t);
+
+	fr_breaker_show(fp, tb->breaker);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_trunk_breaker_table[] = {
+	{
+		.parent = "show trunk",
+		.add_name = true,
+		.name = "breaker",
+		.func = cmd_show_trunk_breaker,
+		.help = "Show whether requests are being failed because the destination is failing.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
+/** Allocate a circuit breaker to share between trunks in different threads
+ *
+ * Must be called before any trunks are allocated with the configuration,
+ * usually from a module's instantiate callback.  Does nothing if
+ * breaker.error_rate isn't set.
+ *
+ * While the breaker is open, #fr_trunk_request_enqueue returns
+ * FR_TRUNK_ENQUEUE_DST_UNAVAILABLE immediately, and requests in the
+ * backlog are failed.
+ *
+ * @param[in] ctx		to allocate the breaker in.  Must outlive all trunks using it.
+ * @param[in] conf		to share between the trunks.  conf->breaker will be set.
+ * @param[in] name		to register radmin commands under, as "show trunk <name> breaker".
+ * @param[in] trigger_prefix	for the breaker_open, breaker_half_open and breaker_closed triggers.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_trunk_breaker_alloc(TALLOC_CTX *ctx, fr_trunk_conf_t *conf, char const *name, char const *trigger_prefix)
+{
+	fr_trunk_breaker_t	*tb;
+
+	if (!conf->breaker_conf.error_rate) return 0;
+
+	if (conf->breaker_conf.error_rate > 100) {
+		fr_strerror_printf("\"error_rate\" (%u) must be a percentage, between 0 and 100",
+				   conf->breaker_conf.error_rate);
+		return -1;
+	}
+
+	MEM(tb = talloc_zero(ctx, fr_trunk_breaker_t));
+	tb->conf = conf;
+	MEM(tb->name = talloc_strdup(tb, name));
+	MEM(tb->trigger_prefix = talloc_strdup(tb, trigger_prefix));
+	tb->breaker = fr_breaker_alloc(tb, &conf->breaker_conf, _trunk_breaker_notify, tb);
+
+	if (fr_command_register_hook(NULL, name, tb, cmd_trunk_breaker_table) < 0) {
+		talloc_free(tb);
+		return -1;
+	}
+
+	conf->breaker = tb->breaker;
+
+	return 0;
+}
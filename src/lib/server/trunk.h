@@ -29,6 +29,7 @@ RCSIDH(server_trunk_h, "$Id$")
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/server/breaker.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -187,6 +188,11 @@ typedef enum {
 	FR_TRUNK_REQUEST_STATE_CANCEL_COMPLETE \
 )
 
+/** Connection slots shared between trunks in different threads
+ *
+ */
+typedef struct fr_trunk_budget_s fr_trunk_budget_t;
+
 /** Common configuration parameters for a trunk
  *
  */
@@ -246,8 +252,51 @@ typedef struct {
 	bool			backlog_on_failed_conn;	//!< Assign requests to the backlog when there are no
 							//!< available connections and the last connection event
 							//!< was a failure, instead of failing them immediately.
+
+	uint32_t		max_batch;		//!< Maximum number of requests written by one call
+							///< to the mux callback.  0 means no limit.
+
+	fr_time_delta_t		max_batch_delay;	//!< How long pending requests may wait for a full
+							///< batch before they're written anyway.
+							///< 0 means they're written as soon as the
+							///< connection is writable.
+
+	bool			latency_aware;		//!< Assign requests to the connection with the lowest
+							///< product of response latency and outstanding
+							///< requests, instead of the shortest queue.
+							///< Ignored if connection_prioritise is provided.
+
+	uint32_t		latency_drain_factor;	//!< Drain connections whose latency is more than
+							///< this many times that of the fastest active
+							///< connection.  0 disables draining on latency.
+
+	uint32_t		global_max;		//!< Maximum number of connections across all trunks
+							///< using this configuration.  0 means no limit.
+
+	fr_trunk_budget_t	*budget;		//!< Enforces global_max.  Allocated with
+							///< #fr_trunk_budget_alloc.
+
+	uint32_t		hedge_percentile;	//!< Send a duplicate of a request which has been
+							///< outstanding for longer than this percentile of
+							///< recent response times.  0 disables hedging.
+
+	uint32_t		hedge_budget;		//!< Maximum number of duplicates, as a percentage
+							///< of the requests sent.
+
+	fr_time_delta_t		hedge_min_delay;	//!< Never send a duplicate sooner than this.
+
+	fr_breaker_conf_t	breaker_conf;		//!< When to stop sending requests to a failing
+							///< destination.
+
+	fr_breaker_t		*breaker;		//!< Shared by all trunks using this configuration.
+							///< Allocated with #fr_trunk_breaker_alloc.
 } fr_trunk_conf_t;
 
+/** Number of buckets in the batch size histogram
+ *
+ */
+#define FR_TRUNK_BATCH_HISTOGRAM_SIZE	16
+
 /** Public fields for the trunk
  *
  * This saves the overhead of using accessors for commonly used fields in
@@ -289,6 +338,20 @@ struct fr_trunk_pub_s {
 	uint64_t _CONST		req_alloc_new;		//!< How many requests we've allocated.
 
 	uint64_t _CONST		req_alloc_reused;	//!< How many requests were reused.
+
+	uint64_t _CONST		batch_size[FR_TRUNK_BATCH_HISTOGRAM_SIZE];	//!< How many requests each call
+							///< to the mux callback wrote.  Bucket n counts
+							///< batches of 2^n to 2^(n+1) - 1 requests, the
+							///< last bucket counts everything larger.
+
+	uint64_t _CONST		hedge_sent;		//!< How many duplicate requests were sent.
+
+	uint64_t _CONST		hedge_won;		//!< How many duplicates completed before the
+							///< original request.
+
+	fr_time_delta_t _CONST	hedge_delay;		//!< How long a request must be outstanding before
+							///< it's duplicated.  0 until enough requests have
+							///< completed to estimate it.
 	/** @} */
 
 	bool _CONST		triggers;		//!< do we run the triggers?
@@ -330,6 +393,10 @@ struct fr_trunk_connection_pub_s {
 	fr_connection_t		* _CONST conn;		//!< The underlying connection.
 
 	fr_trunk_t		* _CONST trunk;		//!< Trunk this connection belongs to.
+
+	fr_time_delta_t _CONST	latency;		//!< Peak EWMA of the time between sending requests
+							///< and receiving their responses.  0 if no requests
+							///< have completed yet.
 };
 
 /** Config parser definitions to populate a fr_trunk_conf_t
@@ -463,6 +530,32 @@ typedef void (*fr_trunk_connection_notify_t)(fr_trunk_connection_t *tconn, fr_co
 typedef void (*fr_trunk_request_mux_t)(fr_event_list_t *el,
 				       fr_trunk_connection_t *tconn, fr_connection_t *conn, void *uctx);
 
+/** Multiplex a batch of requests, writing them to a connection in one operation
+ *
+ * An alternative to #fr_trunk_request_mux_t for APIs which can write many
+ * requests at once, i.e. with a bulk insert, a pipeline, or a single
+ * vectored write.
+ *
+ * The treqs are in the order they should be written, with any partially
+ * written request first.  There are at most conf->max_batch of them.
+ *
+ * The state of each treq must be signalled in the same way as it would be
+ * from #fr_trunk_request_mux_t.  Any treq which isn't signalled remains
+ * pending, and will be passed in again on the next call.
+ *
+ * @param[in] el		For timer management.
+ * @param[in] tconn		The trunk connection the requests are pending on.
+ * @param[in] conn		Connection to write the requests to.
+ *				Use conn->h to access the
+ *				connection handle or file descriptor.
+ * @param[in] treqs		To write.
+ * @param[in] num		Number of treqs.
+ * @param[in] uctx		User context data passed to #fr_trunk_alloc.
+ */
+typedef void (*fr_trunk_request_mux_batch_t)(fr_event_list_t *el,
+					     fr_trunk_connection_t *tconn, fr_connection_t *conn,
+					     fr_trunk_request_t *treqs[], size_t num, void *uctx);
+
 /** Demultiplex on or more responses, reading them from a connection, decoding them, and matching them with their requests
  *
  * This callback should either:
@@ -665,6 +758,32 @@ typedef void (*fr_trunk_request_fail_t)(REQUEST *request, void *preq, void *rctx
  */
 typedef void (*fr_trunk_request_free_t)(REQUEST *request, void *preq_to_free, void *uctx);
 
+/** Create a duplicate of a protocol request, so it can be sent on another connection
+ *
+ * Called when a request has been outstanding for longer than
+ * conf->hedge_percentile of recent response times.  The duplicate is
+ * sent on a different connection, with the same rctx.  Whichever
+ * completes first calls #fr_trunk_request_complete_t, and the other is
+ * cancelled, as if #fr_trunk_request_signal_cancel had been called for
+ * it.  The request_complete callback must therefore release anything
+ * in the rctx which refers to the original treq.
+ *
+ * If the duplicate fails, the failure is ignored, and the original
+ * carries on.  If the original fails, the duplicate is cancelled.
+ *
+ * Only requests which are safe to process twice should be duplicated.
+ *
+ * @param[in] treq		the duplicate will be sent with.  Should be used
+ *				as the talloc ctx for the new preq.
+ * @param[in] request		the requests are for.
+ * @param[in] preq		of the original request.
+ * @param[in] uctx		User context data passed to #fr_trunk_alloc.
+ * @return
+ *	- A new preq.
+ *	- NULL if this request shouldn't be duplicated.
+ */
+typedef void *(*fr_trunk_request_hedge_t)(fr_trunk_request_t *treq, REQUEST *request, void const *preq, void *uctx);
+
 /** I/O functions to pass to fr_trunk_alloc
  *
  */
@@ -680,6 +799,9 @@ typedef struct {
 
 	fr_trunk_request_mux_t		request_mux;		///!< Write one or more requests to a connection.
 
+	fr_trunk_request_mux_batch_t	request_mux_batch;	//!< Write a batch of requests to a connection.
+								///< Used instead of request_mux if set.
+
 	fr_trunk_request_demux_t	request_demux;		///!< Read one or more requests from a connection.
 
 	fr_trunk_request_cancel_mux_t	request_cancel_mux;	//!< Inform an external resource that we no longer
@@ -700,6 +822,10 @@ typedef struct {
 
 	fr_trunk_request_free_t		request_free;		//!< Free the preq and any resources it holds and
 								///< provide a chance to mark the request as runnable.
+
+	fr_trunk_request_hedge_t	request_hedge;		//!< Duplicate a slow request, so it can be sent
+								///< on another connection.  Hedging is disabled
+								///< if this isn't set.
 } fr_trunk_io_funcs_t;
 
 /** @name Statistics
@@ -839,6 +965,11 @@ int		fr_trunk_connection_manage_schedule(fr_trunk_t *trunk) CC_HINT(nonnull);
 fr_trunk_t	*fr_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 				fr_trunk_io_funcs_t const *funcs, fr_trunk_conf_t const *conf,
 				char const *log_prefix, void const *uctx, bool delay_start) CC_HINT(nonnull(2, 3, 4));
+
+int		fr_trunk_budget_alloc(TALLOC_CTX *ctx, fr_trunk_conf_t *conf, char const *name) CC_HINT(nonnull);
+
+int		fr_trunk_breaker_alloc(TALLOC_CTX *ctx, fr_trunk_conf_t *conf,
+				       char const *name, char const *trigger_prefix) CC_HINT(nonnull);
 /** @} */
 
 #undef _CONST
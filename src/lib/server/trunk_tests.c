@@ -56,6 +56,30 @@ static void test_mux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn, f
 	TEST_CHECK(count > 0);
 }
 
+static void test_mux_batch(UNUSED fr_event_list_t *el, UNUSED fr_trunk_connection_t *tconn, fr_connection_t *conn,
+			   fr_trunk_request_t *treqs[], size_t num, UNUSED void *uctx)
+{
+	int			fd = *(talloc_get_type_abort(conn->h, int));
+	test_proto_request_t	*preqs[16];
+	ssize_t			slen;
+	size_t			i;
+
+	TEST_CHECK(num > 0);
+	TEST_CHECK(num <= NUM_ELEMENTS(preqs));
+
+	for (i = 0; i < num; i++) preqs[i] = treqs[i]->pub.preq;
+
+	/*
+	 *	One write for the whole batch
+	 */
+	slen = write(fd, preqs, sizeof(preqs[0]) * num);
+	if (slen < (ssize_t)(sizeof(preqs[0]) * num)) abort();
+
+	if (test_verbose_level__ >= 3) printf("%s - Wrote %zu requests\n", __FUNCTION__, num);
+
+	for (i = 0; i < num; i++) fr_trunk_request_signal_sent(treqs[i]);
+}
+
 static void test_cancel_mux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
 {
 	fr_trunk_request_t	*treq;
@@ -1053,6 +1077,99 @@ static void test_partial_to_complete_states(void)
 	talloc_free(ctx);
 }
 
+static void test_enqueue_batch(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_trunk_t		*trunk;
+	fr_event_list_t		*el;
+	fr_trunk_conf_t		conf = {
+					.start = 1,
+					.min = 1,
+					.manage_interval = NSEC * 0.5,
+					.max_batch = 4,
+					.max_batch_delay = NSEC * 1
+				};
+	fr_trunk_io_funcs_t	io_funcs = {
+					.connection_alloc = test_setup_socket_pair_connection_alloc,
+					.connection_notify = _conn_notify,
+					.request_prioritise = fr_pointer_cmp,
+					.request_mux_batch = test_mux_batch,
+					.request_demux = test_demux,
+					.request_complete = test_request_complete,
+					.request_fail = test_request_fail,
+					.request_free = test_request_free
+				};
+	test_proto_request_t	*preq[7];
+	fr_trunk_request_t	*treq;
+	size_t			i;
+
+	DEBUG_LVL_SET;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_event_list_set_time_func(el, test_time);
+
+	trunk = fr_trunk_alloc(ctx, el, &io_funcs, &conf, "test_socket_pair", NULL, false);
+
+	fr_event_corral(el, test_time_base, false);	/* Connect the connection */
+	fr_event_service(el);
+
+	TEST_CHECK(fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_ACTIVE) == 1);
+
+	TEST_CASE("Partial batch waits for max_batch_delay");
+
+	for (i = 0; i < 3; i++) {
+		preq[i] = talloc_zero(NULL, test_proto_request_t);
+		treq = NULL;
+		fr_trunk_request_enqueue(&treq, trunk, NULL, preq[i], NULL);
+		preq[i]->treq = treq;
+	}
+
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+
+	TEST_CHECK(fr_trunk_request_count_by_state(trunk, FR_TRUNK_CONN_ALL, FR_TRUNK_REQUEST_STATE_PENDING) == 3);
+
+	test_time_base += NSEC * 1.5;
+
+	fr_event_corral(el, test_time_base, false);	/* Batch timer fires */
+	fr_event_service(el);
+
+	fr_event_corral(el, test_time_base, false);	/* Send the batch */
+	fr_event_service(el);
+
+	TEST_CHECK(fr_trunk_request_count_by_state(trunk, FR_TRUNK_CONN_ALL, FR_TRUNK_REQUEST_STATE_PENDING) == 0);
+	TEST_CHECK(trunk->pub.batch_size[1] == 1);
+
+	TEST_CASE("Full batch is written immediately");
+
+	for (i = 3; i < NUM_ELEMENTS(preq); i++) {
+		preq[i] = talloc_zero(NULL, test_proto_request_t);
+		treq = NULL;
+		fr_trunk_request_enqueue(&treq, trunk, NULL, preq[i], NULL);
+		preq[i]->treq = treq;
+	}
+
+	fr_event_corral(el, test_time_base, false);	/* Send the batch */
+	fr_event_service(el);
+
+	TEST_CHECK(fr_trunk_request_count_by_state(trunk, FR_TRUNK_CONN_ALL, FR_TRUNK_REQUEST_STATE_PENDING) == 0);
+	TEST_CHECK(trunk->pub.batch_size[2] == 1);
+
+	for (i = 0; i < 4; i++) {
+		fr_event_corral(el, test_time_base, false);	/* Loop the requests back */
+		fr_event_service(el);
+	}
+
+	for (i = 0; i < NUM_ELEMENTS(preq); i++) {
+		TEST_CHECK(preq[i]->completed == true);
+		TEST_CHECK(preq[i]->freed == true);
+		talloc_free(preq[i]);
+	}
+
+	talloc_free(trunk);
+	talloc_free(ctx);
+}
+
 /*
  *	Test calling reconnect with requests in each different state
  */
@@ -1850,6 +1967,7 @@ TEST_LIST = {
 	{ "Enqueue - Basic",				test_enqueue_basic },
 	{ "Enqueue - Cancellation points",		test_enqueue_cancellation_points },
 	{ "Enqueue - Partial state transitions",	test_partial_to_complete_states },
+	{ "Enqueue - Batch",				test_enqueue_batch },
 	{ "Requeue - On reconnect",			test_requeue_on_reconnect },
 
 	/*
@@ -39,6 +39,7 @@ RCSID("$Id$")
 #include <freeradius-devel/io/listen.h>
 
 #include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/unlang/profile.h>
 
 typedef struct {
 	char const		*namespace;		//!< Namespace function is registered to.
@@ -376,6 +377,33 @@ static int cmd_show_server_list(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx,
 	return 0;
 }
 
+static int cmd_show_server_latency(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	size_t i, server_cnt = virtual_servers ? talloc_array_length(virtual_servers) : 0;
+
+	for (i = 0; i < server_cnt; i++) {
+		CONF_SECTION		*subcs = NULL;
+		fr_time_histogram_t	latency;
+
+		while ((subcs = cf_section_next(virtual_servers[i]->server_cs, subcs))) {
+			char const *name2;
+
+			unlang_interpret_section_latency(&latency, subcs);
+			if (!latency.count) continue;
+
+			name2 = cf_section_name2(subcs);
+			fprintf(fp, "%s %s%s%s count %" PRIu64 " p50 %" PRIu64 "us p99 %" PRIu64 "us max %" PRIu64 "us\n",
+				cf_section_name2(virtual_servers[i]->server_cs), cf_section_name1(subcs),
+				name2 ? " " : "", name2 ? name2 : "", latency.count,
+				(uint64_t) fr_time_histogram_percentile(&latency, 50) / 1000,
+				(uint64_t) fr_time_histogram_percentile(&latency, 99) / 1000,
+				(uint64_t) latency.max / 1000);
+		}
+	}
+
+	return 0;
+}
+
 static fr_cmd_table_t cmd_table[] = {
 	{
 		.parent = "show",
@@ -392,6 +420,14 @@ static fr_cmd_table_t cmd_table[] = {
 		.read_only = true,
 	},
 
+	{
+		.parent = "show server",
+		.name = "latency",
+		.func = cmd_show_server_latency,
+		.help = "Show processing latency percentiles for each section of each virtual server.",
+		.read_only = true,
+	},
+
 	CMD_TABLE_END
 
 };
@@ -512,6 +548,11 @@ int virtual_servers_instantiate(void)
 		return -1;
 	}
 
+	if (fr_command_register_hook(NULL, NULL, NULL, cmd_unlang_profile_table) < 0) {
+		PERROR("Failed registering radmin commands for profiling");
+		return -1;
+	}
+
 	for (i = 0; i < server_cnt; i++) {
 		fr_virtual_listen_t	**listener;
 		size_t			j, listen_cnt;
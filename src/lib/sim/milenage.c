@@ -21,6 +21,7 @@
 #include <string.h>
 
 #include <freeradius-devel/tls/log.h>
+#include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/proto.h>
 #include <openssl/evp.h>
 #include "common.h"
@@ -29,14 +30,58 @@
 #define MILENAGE_MAC_A_SIZE	8
 #define MILENAGE_MAC_S_SIZE	8
 
-static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
-					uint8_t const key[16], uint8_t const in[16], uint8_t out[16])
+/** Maximum number of RANDs passed to milenage_kernel() in one call
+ *
+ * Bounds the amount of stack used for intermediary blocks.
+ */
+#define MILENAGE_BATCH_MAX	16
+
+/** Which outputs milenage_kernel() should produce
+ *
+ */
+enum {
+	MILENAGE_OUT1		= 0x01,		//!< f1 || f1*
+	MILENAGE_OUT2		= 0x02,		//!< f5 || f2
+	MILENAGE_OUT3		= 0x04,		//!< f3
+	MILENAGE_OUT4		= 0x08,		//!< f4
+	MILENAGE_OUT5		= 0x10		//!< f5*
+};
+
+/** Outputs of the Milenage kernel for a single RAND
+ *
+ */
+typedef struct {
+	uint8_t		out1[16];		//!< MAC-A || MAC-S.
+	uint8_t		out2[16];		//!< AK || RES.
+	uint8_t		out3[16];		//!< CK.
+	uint8_t		out4[16];		//!< IK.
+	uint8_t		out5[16];		//!< AK (resync) || unused.
+} milenage_out_t;
+
+/** Allocate an AES-128-ECB context, and expand the subscriber key
+ *
+ * The key schedule is only calculated once, and is shared by all the
+ * blocks encrypted with the context.
+ *
+ * @param[in] key	to use for all blocks encrypted with the context.
+ * @return
+ *	- A new EVP_CIPHER_CTX, which must be freed with EVP_CIPHER_CTX_free().
+ *	- NULL on error.
+ */
+static EVP_CIPHER_CTX *aes_128_ecb_ctx_alloc(uint8_t const key[16])
 {
-	size_t len;
+	EVP_CIPHER_CTX	*evp_ctx;
+
+	evp_ctx = EVP_CIPHER_CTX_new();
+	if (!evp_ctx) {
+		tls_strerror_printf("Failed allocating EVP context");
+		return NULL;
+	}
 
 	if (unlikely(EVP_EncryptInit_ex(evp_ctx, EVP_aes_128_ecb(), NULL, key, NULL) != 1)) {
 		tls_strerror_printf("Failed initialising AES-128-ECB context");
-		return -1;
+		EVP_CIPHER_CTX_free(evp_ctx);
+		return NULL;
 	}
 
 	/*
@@ -50,8 +95,30 @@ static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
 	 *	when decrypting.
 	 */
 	EVP_CIPHER_CTX_set_padding(evp_ctx, 0);
-	if (unlikely(EVP_EncryptUpdate(evp_ctx, out, (int *)&len, in, 16) != 1) ||
-	    unlikely(EVP_EncryptFinal_ex(evp_ctx, out + len, (int *)&len) != 1)) {
+
+	return evp_ctx;
+}
+
+/** Encrypt one or more independent 16 byte blocks
+ *
+ * All blocks are passed to OpenSSL in a single call, so that its AES-NI
+ * and VAES implementations can pipeline them, instead of waiting for
+ * each block to complete all its rounds before starting the next.
+ *
+ * @param[in] evp_ctx	from aes_128_ecb_ctx_alloc().
+ * @param[in] in	Plaintext blocks.
+ * @param[out] out	Where to write the ciphertext blocks.  May be the same as in.
+ * @param[in] blocks	How many blocks to encrypt.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static inline int aes_128_ecb_encrypt(EVP_CIPHER_CTX *evp_ctx, uint8_t const *in, uint8_t *out, size_t blocks)
+{
+	int len;
+
+	if (unlikely(EVP_EncryptUpdate(evp_ctx, out, &len, in, blocks * 16) != 1) ||
+	    unlikely((size_t)len != (blocks * 16))) {
 		tls_strerror_printf("Failed encrypting data");
 		return -1;
 	}
@@ -59,6 +126,114 @@ static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
 	return 0;
 }
 
+/** out = rot(in XOR OP_c, r)
+ *
+ */
+static inline void milenage_rot_xor(uint8_t out[16], uint8_t const in[16], uint8_t const opc[16], unsigned int r)
+{
+	unsigned int i;
+
+	for (i = 0; i < 16; i++) out[(i + 16 - r) % 16] = in[i] ^ opc[i];
+}
+
+/** out = in XOR OP_c
+ *
+ */
+static inline void milenage_xor(uint8_t out[16], uint8_t const in[16], uint8_t const opc[16])
+{
+	unsigned int i;
+
+	for (i = 0; i < 16; i++) out[i] = in[i] ^ opc[i];
+}
+
+/** Calculate Milenage OUT1-OUT5 for multiple RANDs using the same subscriber key
+ *
+ * Encrypting TEMP for every RAND, then every requested OUTx block, in two
+ * calls to the cipher, means there are never fewer blocks in flight than
+ * there are RANDs.
+ *
+ * @param[out] out	One entry per RAND.  Only the requested outputs are written.
+ * @param[in] evp_ctx	from aes_128_ecb_ctx_alloc(), keyed with the subscriber key.
+ * @param[in] outputs	Which OUTx values to calculate (MILENAGE_OUT* flags).
+ * @param[in] opc	128-bit value derived from OP and K.
+ * @param[in] rand	128-bit random challenges.
+ * @param[in] in1	SQN || AMF || SQN || AMF for each RAND.  Only used for OUT1.
+ * @param[in] num	Number of RANDs, must not exceed #MILENAGE_BATCH_MAX.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int milenage_kernel(milenage_out_t out[], EVP_CIPHER_CTX *evp_ctx, unsigned int outputs,
+			   uint8_t const opc[MILENAGE_OPC_SIZE],
+			   uint8_t const *rand[], uint8_t const *in1[], size_t num)
+{
+	uint8_t		temp[MILENAGE_BATCH_MAX][16];
+	uint8_t		in[MILENAGE_BATCH_MAX * 5][16], enc[MILENAGE_BATCH_MAX * 5][16];
+	size_t		i, b;
+
+	fr_assert(num <= MILENAGE_BATCH_MAX);
+
+	/* TEMP = E_K(RAND XOR OP_C) */
+	for (i = 0; i < num; i++) milenage_xor(temp[i], rand[i], opc);
+	if (aes_128_ecb_encrypt(evp_ctx, temp[0], temp[0], num) < 0) return -1;
+
+	/* OUT1 = E_K(TEMP XOR rot(IN1 XOR OP_C, r1) XOR c1) XOR OP_C */
+	/* OUT2 = E_K(rot(TEMP XOR OP_C, r2) XOR c2) XOR OP_C */
+	/* OUT3 = E_K(rot(TEMP XOR OP_C, r3) XOR c3) XOR OP_C */
+	/* OUT4 = E_K(rot(TEMP XOR OP_C, r4) XOR c4) XOR OP_C */
+	/* OUT5 = E_K(rot(TEMP XOR OP_C, r5) XOR c5) XOR OP_C */
+	for (i = 0, b = 0; i < num; i++) {
+		if (outputs & MILENAGE_OUT1) {
+			/* rotate by r1 (= 0x40 = 8 bytes), XOR with c1 (= ..00, i.e., NOP) */
+			milenage_rot_xor(in[b], in1[i], opc, 8);
+			milenage_xor(in[b], in[b], temp[i]);
+			b++;
+		}
+		if (outputs & MILENAGE_OUT2) {
+			/* rotate by r2 (= 0, i.e., NOP) */
+			milenage_rot_xor(in[b], temp[i], opc, 0);
+			in[b++][15] ^= 1;	/* XOR c2 (= ..01) */
+		}
+		if (outputs & MILENAGE_OUT3) {
+			/* rotate by r3 = 0x20 = 4 bytes */
+			milenage_rot_xor(in[b], temp[i], opc, 4);
+			in[b++][15] ^= 2;	/* XOR c3 (= ..02) */
+		}
+		if (outputs & MILENAGE_OUT4) {
+			/* rotate by r4 = 0x40 = 8 bytes */
+			milenage_rot_xor(in[b], temp[i], opc, 8);
+			in[b++][15] ^= 4;	/* XOR c4 (= ..04) */
+		}
+		if (outputs & MILENAGE_OUT5) {
+			/* rotate by r5 = 0x60 = 12 bytes */
+			milenage_rot_xor(in[b], temp[i], opc, 12);
+			in[b++][15] ^= 8;	/* XOR c5 (= ..08) */
+		}
+	}
+	if (aes_128_ecb_encrypt(evp_ctx, in[0], enc[0], b) < 0) return -1;
+
+	for (i = 0, b = 0; i < num; i++) {
+		if (outputs & MILENAGE_OUT1) milenage_xor(out[i].out1, enc[b++], opc);
+		if (outputs & MILENAGE_OUT2) milenage_xor(out[i].out2, enc[b++], opc);
+		if (outputs & MILENAGE_OUT3) milenage_xor(out[i].out3, enc[b++], opc);
+		if (outputs & MILENAGE_OUT4) milenage_xor(out[i].out4, enc[b++], opc);
+		if (outputs & MILENAGE_OUT5) milenage_xor(out[i].out5, enc[b++], opc);
+	}
+
+	return 0;
+}
+
+/** IN1 = SQN || AMF || SQN || AMF
+ *
+ */
+static inline void milenage_in1(uint8_t in1[16],
+				uint8_t const sqn[MILENAGE_SQN_SIZE], uint8_t const amf[MILENAGE_AMF_SIZE])
+{
+	memcpy(in1, sqn, 6);
+	memcpy(in1 + 6, amf, 2);
+	memcpy(in1 + 8, in1, 8);
+}
+
 /** milenage_f1 - Milenage f1 and f1* algorithms
  *
  * @param[in] opc	128-bit value derived from OP and K.
@@ -80,54 +255,22 @@ static int milenage_f1(uint8_t mac_a[MILENAGE_MAC_A_SIZE],
 		       uint8_t const sqn[MILENAGE_SQN_SIZE],
 		       uint8_t const amf[MILENAGE_AMF_SIZE])
 {
-	uint8_t		tmp1[16], tmp2[16], tmp3[16];
-	int		i;
+	milenage_out_t	out;
+	uint8_t		in1[16];
+	uint8_t const	*in1_p = in1;
 	EVP_CIPHER_CTX	*evp_ctx;
+	int		ret;
 
-	/* tmp1 = TEMP = E_K(RAND XOR OP_C) */
-	for (i = 0; i < 16; i++) tmp1[i] = rand[i] ^ opc[i];
-
-	evp_ctx = EVP_CIPHER_CTX_new();
-	if (!evp_ctx) {
-		tls_strerror_printf("Failed allocating EVP context");
-		return -1;
-	}
-
- 	if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp1) < 0) {
- 	error:
-		EVP_CIPHER_CTX_free(evp_ctx);
-		return -1;
- 	}
-
-	/* tmp2 = IN1 = SQN || AMF || SQN || AMF */
-	memcpy(tmp2, sqn, 6);
-	memcpy(tmp2 + 6, amf, 2);
-	memcpy(tmp2 + 8, tmp2, 8);
-
-	/* OUT1 = E_K(TEMP XOR rot(IN1 XOR OP_C, r1) XOR c1) XOR OP_C */
-
-	/*
-	 *  rotate (tmp2 XOR OP_C) by r1 (= 0x40 = 8 bytes)
-	 */
-	for (i = 0; i < 16; i++) tmp3[(i + 8) % 16] = tmp2[i] ^ opc[i];
-
-	/*
-	 *  XOR with TEMP = E_K(RAND XOR OP_C)
-	 */
-	for (i = 0; i < 16; i++) tmp3[i] ^= tmp1[i];
-	/* XOR with c1 (= ..00, i.e., NOP) */
-
-	/*
-	 *	f1 || f1* = E_K(tmp3) XOR OP_c
-	 */
- 	if (aes_128_encrypt_block(evp_ctx, k, tmp3, tmp1) < 0) goto error; /* Reuses existing key */
-
-	for (i = 0; i < 16; i++) tmp1[i] ^= opc[i];
-
-	if (mac_a) memcpy(mac_a, tmp1, 8);	/* f1 */
-	if (mac_s) memcpy(mac_s, tmp1 + 8, 8);	/* f1* */
+	milenage_in1(in1, sqn, amf);
 
+	evp_ctx = aes_128_ecb_ctx_alloc(k);
+	if (!evp_ctx) return -1;
+	ret = milenage_kernel(&out, evp_ctx, MILENAGE_OUT1, opc, &rand, &in1_p, 1);
 	EVP_CIPHER_CTX_free(evp_ctx);
+	if (ret < 0) return -1;
+
+	if (mac_a) memcpy(mac_a, out.out1, 8);		/* f1 */
+	if (mac_s) memcpy(mac_s, out.out1 + 8, 8);	/* f1* */
 
 	return 0;
 }
@@ -155,75 +298,27 @@ static int milenage_f2345(uint8_t res[MILENAGE_RES_SIZE],
 			  uint8_t const k[MILENAGE_KI_SIZE],
 			  uint8_t const rand[MILENAGE_RAND_SIZE])
 {
-	uint8_t			tmp1[16], tmp2[16], tmp3[16];
-	int			i;
-	EVP_CIPHER_CTX		*evp_ctx;
-
-	/* tmp2 = TEMP = E_K(RAND XOR OP_C) */
-	for (i = 0; i < 16; i++) tmp1[i] = rand[i] ^ opc[i];
-
-	evp_ctx = EVP_CIPHER_CTX_new();
-	if (!evp_ctx) {
-		tls_strerror_printf("Failed allocating EVP context");
-		return -1;
-	}
-
-	if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp2) < 0) {
-	error:
-		EVP_CIPHER_CTX_free(evp_ctx);
-		return -1;
-	}
-
-	/* OUT2 = E_K(rot(TEMP XOR OP_C, r2) XOR c2) XOR OP_C */
-	/* OUT3 = E_K(rot(TEMP XOR OP_C, r3) XOR c3) XOR OP_C */
-	/* OUT4 = E_K(rot(TEMP XOR OP_C, r4) XOR c4) XOR OP_C */
-	/* OUT5 = E_K(rot(TEMP XOR OP_C, r5) XOR c5) XOR OP_C */
-
-	/* f2 and f5 */
-	/* rotate by r2 (= 0, i.e., NOP) */
-	for (i = 0; i < 16; i++) tmp1[i] = tmp2[i] ^ opc[i];
-	tmp1[15] ^= 1; /* XOR c2 (= ..01) */
-	/* f5 || f2 = E_K(tmp1) XOR OP_c */
-
-	if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp3) < 0) goto error;
-
-	for (i = 0; i < 16; i++) tmp3[i] ^= opc[i];
-	if (res) memcpy(res, tmp3 + 8, 8); /* f2 */
-	if (ak) memcpy(ak, tmp3, 6); /* f5 */
-
-	/* f3 */
-	if (ck) {
-		/* rotate by r3 = 0x20 = 4 bytes */
-		for (i = 0; i < 16; i++) tmp1[(i + 12) % 16] = tmp2[i] ^ opc[i];
-		tmp1[15] ^= 2; /* XOR c3 (= ..02) */
-
-		if (aes_128_encrypt_block(evp_ctx, k, tmp1, ck) < 0) goto error;
-
-		for (i = 0; i < 16; i++) ck[i] ^= opc[i];
-	}
-
-	/* f4 */
-	if (ik) {
-		/* rotate by r4 = 0x40 = 8 bytes */
-		for (i = 0; i < 16; i++) tmp1[(i + 8) % 16] = tmp2[i] ^ opc[i];
-		tmp1[15] ^= 4; /* XOR c4 (= ..04) */
-
-		if (aes_128_encrypt_block(evp_ctx, k, tmp1, ik) < 0) goto error;
-
-		for (i = 0; i < 16; i++) ik[i] ^= opc[i];
-	}
-
-	/* f5* */
-	if (ak_resync) {
-		/* rotate by r5 = 0x60 = 12 bytes */
-		for (i = 0; i < 16; i++) tmp1[(i + 4) % 16] = tmp2[i] ^ opc[i];
-		tmp1[15] ^= 8; /* XOR c5 (= ..08) */
+	milenage_out_t	out;
+	unsigned int	outputs = 0;
+	EVP_CIPHER_CTX	*evp_ctx;
+	int		ret;
 
-		if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp1) < 0) goto error;
+	if (res || ak) outputs |= MILENAGE_OUT2;
+	if (ck) outputs |= MILENAGE_OUT3;
+	if (ik) outputs |= MILENAGE_OUT4;
+	if (ak_resync) outputs |= MILENAGE_OUT5;
 
-		for (i = 0; i < 6; i++) ak_resync[i] = tmp1[i] ^ opc[i];
-	}
+	evp_ctx = aes_128_ecb_ctx_alloc(k);
+	if (!evp_ctx) return -1;
+	ret = milenage_kernel(&out, evp_ctx, outputs, opc, &rand, NULL, 1);
 	EVP_CIPHER_CTX_free(evp_ctx);
+	if (ret < 0) return -1;
+
+	if (res) memcpy(res, out.out2 + 8, 8);			/* f2 */
+	if (ak) memcpy(ak, out.out2, 6);			/* f5 */
+	if (ck) memcpy(ck, out.out3, 16);			/* f3 */
+	if (ik) memcpy(ik, out.out4, 16);			/* f4 */
+	if (ak_resync) memcpy(ak_resync, out.out5, 6);		/* f5* */
 
 	return 0;
 }
@@ -247,12 +342,9 @@ int milenage_opc_generate(uint8_t opc[MILENAGE_OPC_SIZE],
 	EVP_CIPHER_CTX	*evp_ctx;
 	size_t		i;
 
-	evp_ctx = EVP_CIPHER_CTX_new();
-	if (!evp_ctx) {
-		tls_strerror_printf("Failed allocating EVP context");
-		return -1;
-	}
- 	ret = aes_128_encrypt_block(evp_ctx, ki, op, tmp);
+	evp_ctx = aes_128_ecb_ctx_alloc(ki);
+	if (!evp_ctx) return -1;
+ 	ret = aes_128_ecb_encrypt(evp_ctx, op, tmp, 1);
  	EVP_CIPHER_CTX_free(evp_ctx);
 	if (ret < 0) return ret;
 
@@ -261,6 +353,77 @@ int milenage_opc_generate(uint8_t opc[MILENAGE_OPC_SIZE],
  	return 0;
 }
 
+/** Generate multiple AKA AUTN, IK, CK, AK, RES vectors for the same subscriber
+ *
+ * The key schedule is calculated once, and the AES blocks for up to
+ * #MILENAGE_BATCH_MAX vectors are encrypted together, which is much faster
+ * than calling milenage_umts_generate() for each vector.
+ *
+ * @param[in,out] vectors	rand and sqn must be set for each vector, all other
+ *				fields are written.
+ * @param[in] num		Number of vectors to generate.
+ * @param[in] opc		128-bit operator variant algorithm configuration field (encr.).
+ * @param[in] amf		16-bit authentication management field.
+ * @param[in] ki		128-bit subscriber key.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int milenage_umts_generate_multi(milenage_umts_vector_t vectors[], size_t num,
+				 uint8_t const opc[MILENAGE_OPC_SIZE],
+				 uint8_t const amf[MILENAGE_AMF_SIZE],
+				 uint8_t const ki[MILENAGE_KI_SIZE])
+{
+	milenage_out_t	out[MILENAGE_BATCH_MAX];
+	uint8_t		in1[MILENAGE_BATCH_MAX][16];
+	uint8_t const	*rand_p[MILENAGE_BATCH_MAX], *in1_p[MILENAGE_BATCH_MAX];
+	EVP_CIPHER_CTX	*evp_ctx;
+	size_t		base, n, i, j;
+
+	evp_ctx = aes_128_ecb_ctx_alloc(ki);
+	if (!evp_ctx) return -1;
+
+	for (base = 0; base < num; base += n) {
+		n = num - base;
+		if (n > MILENAGE_BATCH_MAX) n = MILENAGE_BATCH_MAX;
+
+		for (i = 0; i < n; i++) {
+			uint8_t sqn_buff[MILENAGE_SQN_SIZE];
+
+			milenage_in1(in1[i], uint48_to_buff(sqn_buff, vectors[base + i].sqn), amf);
+			rand_p[i] = vectors[base + i].rand;
+			in1_p[i] = in1[i];
+		}
+
+		if (milenage_kernel(out, evp_ctx, MILENAGE_OUT1 | MILENAGE_OUT2 | MILENAGE_OUT3 | MILENAGE_OUT4,
+				    opc, rand_p, in1_p, n) < 0) {
+			EVP_CIPHER_CTX_free(evp_ctx);
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			milenage_umts_vector_t	*v = &vectors[base + i];
+			uint8_t			*p = v->autn;
+
+			memcpy(v->res, out[i].out2 + 8, sizeof(v->res));	/* f2 */
+			memcpy(v->ck, out[i].out3, sizeof(v->ck));		/* f3 */
+			memcpy(v->ik, out[i].out4, sizeof(v->ik));		/* f4 */
+			memcpy(v->ak, out[i].out2, sizeof(v->ak));		/* f5 */
+
+			/*
+			 *	AUTN = (SQN ^ AK) || AMF || MAC_A
+			 */
+			for (j = 0; j < MILENAGE_SQN_SIZE; j++) *p++ = in1[i][j] ^ v->ak[j];
+			memcpy(p, amf, MILENAGE_AMF_SIZE);
+			p += MILENAGE_AMF_SIZE;
+			memcpy(p, out[i].out1, MILENAGE_MAC_A_SIZE);		/* f1 */
+		}
+	}
+	EVP_CIPHER_CTX_free(evp_ctx);
+
+	return 0;
+}
+
 /** Generate AKA AUTN, IK, CK, RES
  *
  * @param[out] autn	Buffer for AUTN = 128-bit authentication token.
@@ -288,27 +451,17 @@ int milenage_umts_generate(uint8_t autn[MILENAGE_AUTN_SIZE],
 			   uint64_t sqn,
 			   uint8_t const rand[MILENAGE_RAND_SIZE])
 {
-	uint8_t		mac_a[8], ak_buff[MILENAGE_AK_SIZE];
-	uint8_t		sqn_buff[MILENAGE_SQN_SIZE];
-	uint8_t		*p = autn;
-	size_t		i;
+	milenage_umts_vector_t	vector = { .sqn = sqn };
 
-	if ((milenage_f1(mac_a, NULL, opc, ki, rand,
-			 uint48_to_buff(sqn_buff, sqn), amf) < 0) ||
-	    (milenage_f2345(res, ik, ck, ak_buff, NULL, opc, ki, rand) < 0)) return -1;
+	memcpy(vector.rand, rand, sizeof(vector.rand));
 
-	/*
-	 *	AUTN = (SQN ^ AK) || AMF || MAC_A
-	 */
-	for (i = 0; i < sizeof(sqn_buff); i++) *p++ = sqn_buff[i] ^ ak_buff[i];
-	memcpy(p, amf, MILENAGE_AMF_SIZE);
-	p += MILENAGE_AMF_SIZE;
-	memcpy(p, mac_a, sizeof(mac_a));
+	if (milenage_umts_generate_multi(&vector, 1, opc, amf, ki) < 0) return -1;
 
-	/*
-	 *	Output the anonymity key if required
-	 */
-	if (ak) memcpy(ak, ak_buff, sizeof(ak_buff));
+	memcpy(autn, vector.autn, sizeof(vector.autn));
+	if (ik) memcpy(ik, vector.ik, sizeof(vector.ik));
+	if (ck) memcpy(ck, vector.ck, sizeof(vector.ck));
+	if (ak) memcpy(ak, vector.ak, sizeof(vector.ak));
+	if (res) memcpy(res, vector.res, sizeof(vector.res));
 
 	return 0;
 }
@@ -370,6 +523,50 @@ void milenage_gsm_from_umts(uint8_t sres[MILENAGE_SRES_SIZE],
 #endif	/* GSM_MILENAGE_ALT_SRES */
 }
 
+/** Generate multiple GSM-Milenage (3GPP TS 55.205) authentication triplets for the same subscriber
+ *
+ * @param[in,out] vectors	rand must be set for each vector, sres and kc are written.
+ * @param[in] num		Number of vectors to generate.
+ * @param[in] opc		128-bit operator variant algorithm configuration field (encr.).
+ * @param[in] ki		128-bit subscriber key.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int milenage_gsm_generate_multi(milenage_gsm_vector_t vectors[], size_t num,
+				uint8_t const opc[MILENAGE_OPC_SIZE],
+				uint8_t const ki[MILENAGE_KI_SIZE])
+{
+	milenage_out_t	out[MILENAGE_BATCH_MAX];
+	uint8_t const	*rand_p[MILENAGE_BATCH_MAX];
+	EVP_CIPHER_CTX	*evp_ctx;
+	size_t		base, n, i;
+
+	evp_ctx = aes_128_ecb_ctx_alloc(ki);
+	if (!evp_ctx) return -1;
+
+	for (base = 0; base < num; base += n) {
+		n = num - base;
+		if (n > MILENAGE_BATCH_MAX) n = MILENAGE_BATCH_MAX;
+
+		for (i = 0; i < n; i++) rand_p[i] = vectors[base + i].rand;
+
+		if (milenage_kernel(out, evp_ctx, MILENAGE_OUT2 | MILENAGE_OUT3 | MILENAGE_OUT4,
+				    opc, rand_p, NULL, n) < 0) {
+			EVP_CIPHER_CTX_free(evp_ctx);
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			milenage_gsm_from_umts(vectors[base + i].sres, vectors[base + i].kc,
+					       out[i].out4, out[i].out3, out[i].out2 + 8);
+		}
+	}
+	EVP_CIPHER_CTX_free(evp_ctx);
+
+	return 0;
+}
+
 /** Generate GSM-Milenage (3GPP TS 55.205) authentication triplet
  *
  * @param[out] sres	Buffer for SRES = 32-bit SRES.
@@ -387,11 +584,14 @@ int milenage_gsm_generate(uint8_t sres[MILENAGE_SRES_SIZE],
 			  uint8_t const ki[MILENAGE_KI_SIZE],
 			  uint8_t const rand[MILENAGE_RAND_SIZE])
 {
-	uint8_t		res[MILENAGE_RES_SIZE], ck[MILENAGE_CK_SIZE], ik[MILENAGE_IK_SIZE];
+	milenage_gsm_vector_t	vector;
+
+	memcpy(vector.rand, rand, sizeof(vector.rand));
 
-	if (milenage_f2345(res, ik, ck, NULL, NULL, opc, ki, rand)) return -1;
+	if (milenage_gsm_generate_multi(&vector, 1, opc, ki) < 0) return -1;
 
-	milenage_gsm_from_umts(sres, kc, ik, ck, res);
+	memcpy(sres, vector.sres, sizeof(vector.sres));
+	memcpy(kc, vector.kc, sizeof(vector.kc));
 
 	return 0;
 }
@@ -477,6 +677,7 @@ int milenage_check(uint8_t ik[MILENAGE_IK_SIZE],
  *  cc milenage.c -g3 -Wall -DHAVE_DLFCN_H -DTESTING_MILENAGE -DWITH_TLS -I../../../../ -I../../../ -I ../base/ -I /usr/local/opt/openssl/include/ -include ../include/build.h -L /usr/local/opt/openssl/lib/ -l ssl -l crypto -l talloc -L ../../../../../build/lib/local/.libs/ -lfreeradius-server -lfreeradius-tls -lfreeradius-util -o test_milenage && ./test_milenage
  */
 #include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/time.h>
 
 void test_set_1(void)
 {
@@ -635,9 +836,92 @@ void test_set_19(void)
 	TEST_CHECK(memcmp(ak_resync, ak_resync, sizeof(ak_resync_out)) == 0);
 }
 
+void test_multi(void)
+{
+	uint8_t ki[]		= { 0x46, 0x5b, 0x5c, 0xe8, 0xb1, 0x99, 0xb4, 0x9f,
+				    0xaa, 0x5f, 0x0a, 0x2e, 0xe2, 0x38, 0xa6, 0xbc };
+	uint8_t amf[]		= { 0xb9, 0xb9 };
+	uint8_t opc[]		= { 0xcd, 0x63, 0xcb, 0x71, 0x95, 0x4a, 0x9f, 0x4e,
+				    0x48, 0xa5, 0x99, 0x4e, 0x37, 0xa0, 0x2b, 0xaf };
+
+	milenage_umts_vector_t	umts[MILENAGE_BATCH_MAX * 2 + 3];
+	milenage_gsm_vector_t	gsm[NUM_ELEMENTS(umts)];
+	size_t			i, j;
+
+	/*
+	 *	Vectors generated in batches must match
+	 *	the ones generated individually.
+	 */
+	for (i = 0; i < NUM_ELEMENTS(umts); i++) {
+		for (j = 0; j < MILENAGE_RAND_SIZE; j++) umts[i].rand[j] = gsm[i].rand[j] = (i * 31) + j;
+		umts[i].sqn = 0xff9bb4d0b607 + i;
+	}
+
+	TEST_CHECK(milenage_umts_generate_multi(umts, NUM_ELEMENTS(umts), opc, amf, ki) == 0);
+	TEST_CHECK(milenage_gsm_generate_multi(gsm, NUM_ELEMENTS(gsm), opc, ki) == 0);
+
+	for (i = 0; i < NUM_ELEMENTS(umts); i++) {
+		uint8_t autn[MILENAGE_AUTN_SIZE], ik[MILENAGE_IK_SIZE], ck[MILENAGE_CK_SIZE];
+		uint8_t ak[MILENAGE_AK_SIZE], res[MILENAGE_RES_SIZE];
+		uint8_t sres[MILENAGE_SRES_SIZE], kc[MILENAGE_KC_SIZE];
+
+		TEST_CHECK(milenage_umts_generate(autn, ik, ck, ak, res, opc, amf, ki, umts[i].sqn, umts[i].rand) == 0);
+		TEST_CHECK(memcmp(autn, umts[i].autn, sizeof(autn)) == 0);
+		TEST_CHECK(memcmp(ik, umts[i].ik, sizeof(ik)) == 0);
+		TEST_CHECK(memcmp(ck, umts[i].ck, sizeof(ck)) == 0);
+		TEST_CHECK(memcmp(ak, umts[i].ak, sizeof(ak)) == 0);
+		TEST_CHECK(memcmp(res, umts[i].res, sizeof(res)) == 0);
+
+		TEST_CHECK(milenage_gsm_generate(sres, kc, opc, ki, gsm[i].rand) == 0);
+		TEST_CHECK(memcmp(sres, gsm[i].sres, sizeof(sres)) == 0);
+		TEST_CHECK(memcmp(kc, gsm[i].kc, sizeof(kc)) == 0);
+	}
+}
+
+void test_speed(void)
+{
+	uint8_t ki[]		= { 0x46, 0x5b, 0x5c, 0xe8, 0xb1, 0x99, 0xb4, 0x9f,
+				    0xaa, 0x5f, 0x0a, 0x2e, 0xe2, 0x38, 0xa6, 0xbc };
+	uint8_t amf[]		= { 0xb9, 0xb9 };
+	uint8_t opc[]		= { 0xcd, 0x63, 0xcb, 0x71, 0x95, 0x4a, 0x9f, 0x4e,
+				    0x48, 0xa5, 0x99, 0x4e, 0x37, 0xa0, 0x2b, 0xaf };
+
+	milenage_umts_vector_t	umts[MILENAGE_BATCH_MAX];
+	fr_time_t		start, single, multi;
+	size_t			i, j;
+	int			rounds = 10000;
+
+	for (i = 0; i < NUM_ELEMENTS(umts); i++) {
+		for (j = 0; j < MILENAGE_RAND_SIZE; j++) umts[i].rand[j] = (i * 31) + j;
+		umts[i].sqn = i;
+	}
+
+	start = fr_time();
+	for (j = 0; j < (size_t)rounds; j++) {
+		for (i = 0; i < NUM_ELEMENTS(umts); i++) {
+			TEST_CHECK(milenage_umts_generate(umts[i].autn, umts[i].ik, umts[i].ck, umts[i].ak, umts[i].res,
+							  opc, amf, ki, umts[i].sqn, umts[i].rand) == 0);
+		}
+	}
+	single = fr_time() - start;
+
+	start = fr_time();
+	for (j = 0; j < (size_t)rounds; j++) {
+		TEST_CHECK(milenage_umts_generate_multi(umts, NUM_ELEMENTS(umts), opc, amf, ki) == 0);
+	}
+	multi = fr_time() - start;
+
+	printf("\nmilenage_umts_generate       : %" PRIu64 " ns/vector\n",
+	       (uint64_t)(single / (rounds * NUM_ELEMENTS(umts))));
+	printf("milenage_umts_generate_multi : %" PRIu64 " ns/vector\n",
+	       (uint64_t)(multi / (rounds * NUM_ELEMENTS(umts))));
+}
+
 TEST_LIST = {
 	{ "test_set_1",		test_set_1 },
 	{ "test_set_19",	test_set_19 },
+	{ "test_multi",		test_multi },
+	{ "test_speed",		test_speed },
 	{ NULL }
 };
 #endif
@@ -46,6 +46,30 @@
 #define MILENAGE_SRES_SIZE	4
 #define MILENAGE_KC_SIZE	8
 
+/** Inputs and outputs for one UMTS authentication vector
+ *
+ */
+typedef struct {
+	uint8_t		rand[MILENAGE_RAND_SIZE];	//!< Random challenge (input).
+	uint64_t	sqn;				//!< Sequence number, host byte order (input).
+
+	uint8_t		autn[MILENAGE_AUTN_SIZE];	//!< Network authentication token.
+	uint8_t		ik[MILENAGE_IK_SIZE];		//!< Integrity key (f4).
+	uint8_t		ck[MILENAGE_CK_SIZE];		//!< Confidentiality key (f3).
+	uint8_t		ak[MILENAGE_AK_SIZE];		//!< Anonymity key (f5).
+	uint8_t		res[MILENAGE_RES_SIZE];		//!< Signed response (f2).
+} milenage_umts_vector_t;
+
+/** Inputs and outputs for one GSM-Milenage (COMP128-4) triplet
+ *
+ */
+typedef struct {
+	uint8_t		rand[MILENAGE_RAND_SIZE];	//!< Random challenge (input).
+
+	uint8_t		sres[MILENAGE_SRES_SIZE];	//!< Signed response.
+	uint8_t		kc[MILENAGE_KC_SIZE];		//!< Ciphering key.
+} milenage_gsm_vector_t;
+
 int	milenage_opc_generate(uint8_t opc[MILENAGE_OPC_SIZE],
 			      uint8_t const op[MILENAGE_OP_SIZE],
 			      uint8_t const ki[MILENAGE_KI_SIZE]);
@@ -61,6 +85,11 @@ int	milenage_umts_generate(uint8_t autn[MILENAGE_AUTN_SIZE],
 			       uint64_t sqn,
 			       uint8_t const rand[MILENAGE_RAND_SIZE]);
 
+int	milenage_umts_generate_multi(milenage_umts_vector_t vectors[], size_t num,
+				     uint8_t const opc[MILENAGE_OPC_SIZE],
+				     uint8_t const amf[MILENAGE_AMF_SIZE],
+				     uint8_t const ki[MILENAGE_KI_SIZE]);
+
 int	milenage_auts(uint64_t *sqn,
 		      uint8_t const opc[MILENAGE_OPC_SIZE],
 		      uint8_t const ki[MILENAGE_KI_SIZE],
@@ -78,6 +107,10 @@ int	milenage_gsm_generate(uint8_t sres[MILENAGE_SRES_SIZE], uint8_t kc[MILENAGE_
 			      uint8_t const ki[MILENAGE_KI_SIZE],
 			      uint8_t const rand[MILENAGE_RAND_SIZE]);
 
+int	milenage_gsm_generate_multi(milenage_gsm_vector_t vectors[], size_t num,
+				    uint8_t const opc[MILENAGE_OPC_SIZE],
+				    uint8_t const ki[MILENAGE_KI_SIZE]);
+
 int	milenage_check(uint8_t ik[MILENAGE_IK_SIZE],
 		       uint8_t ck[MILENAGE_CK_SIZE],
 		       uint8_t res[MILENAGE_RES_SIZE],
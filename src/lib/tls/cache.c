@@ -31,8 +31,16 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/unlang/base.h>
 
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#endif
+#include <pthread.h>
+
 #include "base.h"
 #include "missing.h"
 #include "attrs.h"
@@ -166,6 +174,389 @@ inline static ssize_t fr_tls_cache_id(uint8_t const **out, SSL_SESSION *sess)
 	return len;
 }
 
+/** Number of shards in the in-memory session cache
+ *
+ * Must be a power of two.  Each shard has its own lock, so threads
+ * resuming unrelated sessions rarely contend.
+ */
+#define TLS_CACHE_SHARDS	16
+
+/** A serialised session in the in-memory cache
+ *
+ */
+typedef struct {
+	uint8_t			*id;		//!< Session ID.
+	size_t			id_len;		//!< Length of the session ID.
+	uint8_t			*data;		//!< ASN.1 encoded session.
+	fr_time_t		expires;	//!< When the session can no longer be resumed.
+	fr_dlist_t		entry;		//!< Entry in the shard's LRU list.
+} tls_cache_entry_t;
+
+/** One independently locked slice of the in-memory cache
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+	TALLOC_CTX		*ctx;		//!< Entries are allocated here.
+	fr_hash_table_t		*ht;		//!< Entries indexed by session ID.
+	fr_dlist_head_t		lru;		//!< Entries, most recently used first.
+} tls_cache_shard_t;
+
+/** Key used to encrypt and authenticate stateless session tickets
+ *
+ */
+typedef struct {
+	uint8_t			name[16];	//!< Identifies the key in the tickets it produces.
+	uint8_t			aes_key[32];	//!< AES-256-CBC key.
+	uint8_t			hmac_key[32];	//!< HMAC-SHA256 key.
+	fr_time_t		created;	//!< When the key was generated.
+} tls_ticket_key_t;
+
+/** Session cache shared by every thread using a TLS configuration
+ *
+ */
+struct fr_tls_cache_store_s {
+	tls_cache_shard_t	shard[TLS_CACHE_SHARDS];
+
+	uint32_t		max_entries;	//!< Maximum number of entries in each shard.
+	fr_time_delta_t		lifetime;	//!< How long sessions may be resumed for.
+
+	pthread_mutex_t		ticket_mutex;	//!< Protects the ticket keys.
+	tls_ticket_key_t	ticket_key[2];	//!< Current, and previous, ticket keys.
+	fr_time_delta_t		ticket_key_rotation;	//!< How often the ticket key is replaced.
+};
+
+static uint32_t tls_cache_entry_hash(void const *data)
+{
+	tls_cache_entry_t const *a = data;
+
+	return fr_hash(a->id, a->id_len);
+}
+
+static int tls_cache_entry_cmp(void const *one, void const *two)
+{
+	tls_cache_entry_t const *a = one, *b = two;
+
+	if (a->id_len != b->id_len) return (a->id_len > b->id_len) - (a->id_len < b->id_len);
+
+	return memcmp(a->id, b->id, a->id_len);
+}
+
+static int _tls_cache_store_free(fr_tls_cache_store_t *store)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(store->shard); i++) pthread_mutex_destroy(&store->shard[i].mutex);
+	pthread_mutex_destroy(&store->ticket_mutex);
+
+	memset(store->ticket_key, 0, sizeof(store->ticket_key));
+
+	return 0;
+}
+
+/** Generate a new random ticket key
+ *
+ * @param[out] key	to populate.
+ * @param[in] now	the current time.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int tls_ticket_key_generate(tls_ticket_key_t *key, fr_time_t now)
+{
+	if ((RAND_bytes(key->name, sizeof(key->name)) != 1) ||
+	    (RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1) ||
+	    (RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1)) return -1;
+
+	key->created = now;
+
+	return 0;
+}
+
+/** Allocate the in-memory session cache
+ *
+ * @param[in] ctx			to allocate the cache in.
+ * @param[in] max_entries		The maximum number of sessions to hold.
+ * @param[in] lifetime			The maximum period, in seconds, a session can be resumed after.
+ * @param[in] ticket_key_rotation	How often, in seconds, to replace the key used to protect
+ *					stateless session tickets.  0 if tickets are not used.
+ * @return
+ *	- A new cache on success.
+ *	- NULL on failure.
+ */
+fr_tls_cache_store_t *fr_tls_cache_store_alloc(TALLOC_CTX *ctx, uint32_t max_entries,
+					       uint32_t lifetime, uint32_t ticket_key_rotation)
+{
+	fr_tls_cache_store_t	*store;
+	size_t			i;
+
+	store = talloc_zero(ctx, fr_tls_cache_store_t);
+	if (!store) return NULL;
+
+	store->max_entries = max_entries / TLS_CACHE_SHARDS;
+	if (store->max_entries == 0) store->max_entries = 1;
+	store->lifetime = fr_time_delta_from_sec(lifetime);
+	store->ticket_key_rotation = fr_time_delta_from_sec(ticket_key_rotation);
+
+	for (i = 0; i < NUM_ELEMENTS(store->shard); i++) {
+		tls_cache_shard_t *shard = &store->shard[i];
+
+		shard->ctx = talloc_new(store);
+		shard->ht = fr_hash_table_create(shard->ctx, tls_cache_entry_hash, tls_cache_entry_cmp, NULL);
+		if (!shard->ctx || !shard->ht) {
+			fr_strerror_printf("Failed allocating session cache");
+			talloc_free(store);
+			return NULL;
+		}
+		fr_dlist_init(&shard->lru, tls_cache_entry_t, entry);
+		pthread_mutex_init(&shard->mutex, NULL);
+	}
+	pthread_mutex_init(&store->ticket_mutex, NULL);
+	talloc_set_destructor(store, _tls_cache_store_free);
+
+	if (ticket_key_rotation && (tls_ticket_key_generate(&store->ticket_key[0], fr_time()) < 0)) {
+		fr_strerror_printf("Failed generating session ticket key: %s",
+				   ERR_error_string(ERR_get_error(), NULL));
+		talloc_free(store);
+		return NULL;
+	}
+
+	return store;
+}
+
+static inline tls_cache_shard_t *tls_cache_shard(fr_tls_cache_store_t *store, uint8_t const *id, size_t id_len)
+{
+	return &store->shard[fr_hash(id, id_len) & (TLS_CACHE_SHARDS - 1)];
+}
+
+/** Remove an entry from a shard, the shard must be locked
+ *
+ */
+static void tls_cache_shard_remove(tls_cache_shard_t *shard, tls_cache_entry_t *entry)
+{
+	fr_hash_table_delete(shard->ht, entry);
+	fr_dlist_remove(&shard->lru, entry);
+	talloc_free(entry);
+}
+
+/** Add a serialised session to the in-memory cache
+ *
+ * Replaces any existing entry with the same session ID.  If the shard is
+ * full, the least recently used entry is evicted.
+ *
+ * @param[in] store	to add the session to.
+ * @param[in] id	of the session.
+ * @param[in] id_len	Length of the session ID.
+ * @param[in] data	ASN.1 encoded session.
+ * @param[in] data_len	Length of the encoded session.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int tls_cache_store_insert(fr_tls_cache_store_t *store, uint8_t const *id, size_t id_len,
+				  uint8_t const *data, size_t data_len)
+{
+	tls_cache_shard_t	*shard = tls_cache_shard(store, id, id_len);
+	tls_cache_entry_t	*entry, find = { .id_len = id_len };
+	int			ret = -1;
+
+	memcpy(&find.id, &id, sizeof(find.id));	/* const issues */
+
+	pthread_mutex_lock(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->ht, &find);
+	if (entry) tls_cache_shard_remove(shard, entry);
+
+	entry = talloc_zero(shard->ctx, tls_cache_entry_t);
+	if (!entry) goto done;
+	entry->id = talloc_memdup(entry, id, id_len);
+	entry->id_len = id_len;
+	entry->data = talloc_memdup(entry, data, data_len);
+	entry->expires = fr_time() + store->lifetime;
+	if (!entry->id || !entry->data || (fr_hash_table_insert(shard->ht, entry) < 0)) {
+		talloc_free(entry);
+		goto done;
+	}
+	fr_dlist_insert_head(&shard->lru, entry);
+
+	while (fr_dlist_num_elements(&shard->lru) > store->max_entries) {
+		tls_cache_shard_remove(shard, fr_dlist_tail(&shard->lru));
+	}
+	ret = 0;
+
+done:
+	pthread_mutex_unlock(&shard->mutex);
+
+	return ret;
+}
+
+/** Retrieve and deserialise a session from the in-memory cache
+ *
+ * @param[in] store	to search.
+ * @param[in] id	of the session.
+ * @param[in] id_len	Length of the session ID.
+ * @return
+ *	- A new SSL_SESSION on success.
+ *	- NULL if the session wasn't found, had expired, or couldn't be decoded.
+ */
+static SSL_SESSION *tls_cache_store_find(fr_tls_cache_store_t *store, uint8_t const *id, size_t id_len)
+{
+	tls_cache_shard_t	*shard = tls_cache_shard(store, id, id_len);
+	tls_cache_entry_t	*entry, find = { .id_len = id_len };
+	SSL_SESSION		*sess = NULL;
+	unsigned char const	*p;
+
+	memcpy(&find.id, &id, sizeof(find.id));	/* const issues */
+
+	pthread_mutex_lock(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->ht, &find);
+	if (!entry) goto done;
+
+	if (entry->expires <= fr_time()) {
+		tls_cache_shard_remove(shard, entry);
+		goto done;
+	}
+
+	fr_dlist_remove(&shard->lru, entry);
+	fr_dlist_insert_head(&shard->lru, entry);
+
+	p = entry->data;	/* openssl will mutate p */
+	sess = d2i_SSL_SESSION(NULL, &p, talloc_array_length(entry->data));
+
+done:
+	pthread_mutex_unlock(&shard->mutex);
+
+	return sess;
+}
+
+/** Remove a session from the in-memory cache
+ *
+ * @param[in] store	to remove the session from.
+ * @param[in] id	of the session.
+ * @param[in] id_len	Length of the session ID.
+ */
+static void tls_cache_store_remove(fr_tls_cache_store_t *store, uint8_t const *id, size_t id_len)
+{
+	tls_cache_shard_t	*shard = tls_cache_shard(store, id, id_len);
+	tls_cache_entry_t	*entry, find = { .id_len = id_len };
+
+	memcpy(&find.id, &id, sizeof(find.id));	/* const issues */
+
+	pthread_mutex_lock(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->ht, &find);
+	if (entry) tls_cache_shard_remove(shard, entry);
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/** Copy out the ticket key matching a name, or the current key
+ *
+ * Rotates the current key if it's older than the rotation interval.  The
+ * previous key is retained so tickets issued shortly before the rotation
+ * can still be decrypted.
+ *
+ * @param[out] out	Where to copy the key.
+ * @param[in] store	holding the ticket keys.
+ * @param[in] name	of the key to find, or NULL for the current key.
+ * @return
+ *	- 2 if the previous key was found, the ticket should be renewed.
+ *	- 1 if the current key was found.
+ *	- 0 if no key matched.
+ */
+static int tls_ticket_key_get(tls_ticket_key_t *out, fr_tls_cache_store_t *store, uint8_t const *name)
+{
+	fr_time_t	now = fr_time();
+	int		ret = 0;
+
+	pthread_mutex_lock(&store->ticket_mutex);
+	if ((now - store->ticket_key[0].created) >= store->ticket_key_rotation) {
+		tls_ticket_key_t key;
+
+		if (tls_ticket_key_generate(&key, now) < 0) {
+			fr_tls_log_error(NULL, "Failed rotating session ticket key");
+		} else {
+			store->ticket_key[1] = store->ticket_key[0];
+			store->ticket_key[0] = key;
+		}
+	}
+
+	if (!name || (memcmp(name, store->ticket_key[0].name, sizeof(store->ticket_key[0].name)) == 0)) {
+		*out = store->ticket_key[0];
+		ret = 1;
+	} else if (store->ticket_key[1].created &&
+		   (memcmp(name, store->ticket_key[1].name, sizeof(store->ticket_key[1].name)) == 0)) {
+		*out = store->ticket_key[1];
+		ret = 2;
+	}
+	pthread_mutex_unlock(&store->ticket_mutex);
+
+	return ret;
+}
+
+/** Encrypt or decrypt session tickets with keys shared between all threads
+ *
+ * Every thread has its own SSL_CTX, and so by default its own ticket key.  Using
+ * the keys held in the shared cache means a ticket issued by one thread can be
+ * used to resume the session on any other.
+ *
+ * @param[in] ssl		session state.
+ * @param[in,out] key_name	Written when encrypting, read when decrypting.
+ * @param[in,out] iv		Written when encrypting, read when decrypting.
+ * @param[in] cipher_ctx	to initialise.
+ * @param[in] hmac_ctx		to initialise.
+ * @param[in] enc		1 if a ticket is being encrypted, 0 if it's being decrypted.
+ * @return
+ *	- 2 ticket decrypted, but should be renewed.
+ *	- 1 success.
+ *	- 0 no key matched the ticket, a full handshake should be performed.
+ *	- -1 on error.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int tls_cache_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+				   EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *hmac_ctx, int enc)
+#else
+static int tls_cache_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+				   EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, int enc)
+#endif
+{
+	fr_tls_conf_t		*conf = talloc_get_type_abort(SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF), fr_tls_conf_t);
+	tls_ticket_key_t	key;
+	int			ret;
+
+	if (enc) {
+		ret = tls_ticket_key_get(&key, conf->session_cache_store, NULL);
+		memcpy(key_name, key.name, sizeof(key.name));
+
+		if ((RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) ||
+		    (EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1)) {
+		error:
+			memset(&key, 0, sizeof(key));
+			return -1;
+		}
+	} else {
+		ret = tls_ticket_key_get(&key, conf->session_cache_store, key_name);
+		if (ret == 0) return 0;
+
+		if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1) goto error;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	{
+		char		digest[] = "SHA256";
+		OSSL_PARAM	params[] = {
+			OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key)),
+			OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+			OSSL_PARAM_construct_end()
+		};
+
+		if (EVP_MAC_CTX_set_params(hmac_ctx, params) != 1) goto error;
+	}
+#else
+	if (HMAC_Init_ex(hmac_ctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL) != 1) goto error;
+#endif
+	memset(&key, 0, sizeof(key));
+
+	return ret;
+}
+
 /** Write a newly created session data to the tls_session structure
  *
  * @note If you hit an assert in this function, it was likely called twice, which shouldn't happen
@@ -273,6 +664,25 @@ int fr_tls_cache_write(REQUEST *request, fr_tls_session_t *tls_session)
 		return 1;
 	}
 
+	if (conf->session_cache_store) {
+		if (tls_cache_store_insert(conf->session_cache_store,
+					   tls_session->session_id, talloc_array_length(tls_session->session_id),
+					   tls_session->session_blob,
+					   talloc_array_length(tls_session->session_blob)) < 0) {
+			RWDEBUG("Failed storing session data in memory");
+			ret = -1;
+		} else {
+			RDEBUG2("Stored session data in memory");
+		}
+
+		/*
+		 *	The virtual server is only needed as a
+		 *	second tier, e.g. to share sessions
+		 *	between servers.
+		 */
+		if (!conf->session_cache.store) return ret;
+	}
+
 	if (fr_tls_cache_session_id_to_vp(request, tls_session->session_id,
 				       talloc_array_length(tls_session->session_id)) < 0) {
 		RWDEBUG("Failed adding session key to the request");
@@ -341,13 +751,30 @@ static SSL_SESSION *fr_tls_cache_read(SSL *ssl,
 	request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
 	conf = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
 
+	*copy = 0;
+
+	/*
+	 *	Try the in-memory cache first, this doesn't
+	 *	need any policy to be run.
+	 */
+	if (conf->session_cache_store) {
+		sess = tls_cache_store_find(conf->session_cache_store, key, key_len);
+		if (sess) {
+			RDEBUG3("Session found in memory");
+			goto resume;
+		}
+
+		if (!conf->session_cache.load) {
+			RWDEBUG("No cached session found");
+			return NULL;
+		}
+	}
+
 	if (fr_tls_cache_session_id_to_vp(request, key, key_len) < 0) {
 		RWDEBUG("Failed adding session key to the request");
 		return NULL;
 	}
 
-	*copy = 0;
-
 	/*
 	 *	Call the virtual server to read the session
 	 */
@@ -377,6 +804,22 @@ static SSL_SESSION *fr_tls_cache_read(SSL *ssl,
 	}
 	RDEBUG3("Read %zu bytes of session data.  Session deserialized successfully", vp->vp_length);
 
+	/*
+	 *	Promote the session to the in-memory cache, so
+	 *	resuming it again doesn't need the virtual server.
+	 */
+	if (conf->session_cache_store &&
+	    (tls_cache_store_insert(conf->session_cache_store, key, key_len,
+				    vp->vp_octets, vp->vp_length) < 0)) {
+		RWDEBUG("Failed storing session data in memory");
+	}
+
+	/*
+	 *	Ensure that the session data can't be used by anyone else.
+	 */
+	fr_pair_delete_by_da(&request->state, attr_tls_session_data);
+
+resume:
 	/*
 	 *	OpenSSL's API is very inconsistent.
 	 *
@@ -404,11 +847,6 @@ static SSL_SESSION *fr_tls_cache_read(SSL *ssl,
 		SSL_SESSION_set_timeout(sess, 0);
 	}
 
-	/*
-	 *	Ensure that the session data can't be used by anyone else.
-	 */
-	fr_pair_delete_by_da(&request->state, attr_tls_session_data);
-
 	return sess;
 }
 
@@ -443,6 +881,11 @@ static void fr_tls_cache_delete(SSL_CTX *ctx, SSL_SESSION *sess)
 		return;
 	}
 
+	if (conf->session_cache_store) {
+		tls_cache_store_remove(conf->session_cache_store, key, (size_t)key_len);
+		if (!conf->session_cache.clear) return;
+	}
+
 	if (fr_tls_cache_session_id_to_vp(request, key, (size_t)key_len) < 0) {
 		RWDEBUG("Failed adding session key to the request");
 		goto error;
@@ -550,15 +993,16 @@ int fr_tls_cache_disable_cb(SSL *ssl,
 }
 
 /** Sets callbacks on a SSL_CTX to enable/disable session resumption
+ *
+ * Session resumption is enabled if either the in-memory cache, or a cache
+ * virtual server is configured.
  *
  * @param ctx			to modify.
- * @param enabled		Whether session caching should be enabled.
- * @param lifetime		The maximum period a cached session remains
- *				valid for.
+ * @param conf			the TLS configuration the ctx was created from.
  */
-void fr_tls_cache_init(SSL_CTX *ctx, bool enabled, uint32_t lifetime)
+void fr_tls_cache_init(SSL_CTX *ctx, fr_tls_conf_t const *conf)
 {
-	if (!enabled) {
+	if (!conf->session_cache_server && !conf->session_cache_store) {
 #if OPENSSL_VERSION_NUMBER >= 0x10101000L
 		/*
 		 *	This controls the number of stateful or stateless tickets
@@ -578,7 +1022,21 @@ void fr_tls_cache_init(SSL_CTX *ctx, bool enabled, uint32_t lifetime)
 	SSL_CTX_set_quiet_shutdown(ctx, 1);
 
 	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
-	SSL_CTX_set_timeout(ctx, lifetime);
+	SSL_CTX_set_timeout(ctx, conf->session_cache_lifetime);
+
+	/*
+	 *	Stateless session tickets are only issued if
+	 *	we can share the keys used to protect them
+	 *	between threads.
+	 */
+	if (conf->session_cache_store && conf->session_ticket_key_rotation) {
+		SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_cache_ticket_key_cb);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_cache_ticket_key_cb);
+#endif
+	}
 
 #if OPENSSL_VERSION_NUMBER >= 0x10101000L
 	SSL_CTX_set_num_tickets(ctx, 1);
@@ -71,6 +71,9 @@ static CONF_PARSER cache_config[] = {
 			 .dflt = "%{EAP-Type}%{Virtual-Server}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, fr_tls_conf_t, session_cache_lifetime), .dflt = "86400" },
 	{ FR_CONF_OFFSET("verify", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_verify), .dflt = "no" },
+	{ FR_CONF_OFFSET("memory", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_memory), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_tls_conf_t, session_cache_max_entries), .dflt = "16384" },
+	{ FR_CONF_OFFSET("session_ticket_key_rotation", FR_TYPE_UINT32, fr_tls_conf_t, session_ticket_key_rotation), .dflt = "0" },
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	{ FR_CONF_OFFSET("require_extended_master_secret", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_require_extms), .dflt = "yes" },
@@ -78,7 +81,6 @@ static CONF_PARSER cache_config[] = {
 #endif
 
 	{ FR_CONF_DEPRECATED("enable", FR_TYPE_BOOL, fr_tls_conf_t, NULL) },
-	{ FR_CONF_DEPRECATED("max_entries", FR_TYPE_UINT32, fr_tls_conf_t, NULL) },
 	{ FR_CONF_DEPRECATED("persist_dir", FR_TYPE_STRING, fr_tls_conf_t, NULL) },
 
 	CONF_PARSER_TERMINATOR
@@ -91,6 +93,14 @@ static CONF_PARSER verify_config[] = {
 };
 
 #ifdef HAVE_OPENSSL_OCSP_H
+static CONF_PARSER ocsp_cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_age", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, cache_max_age), .dflt = "3600" },
+	{ FR_CONF_OFFSET("prefetch", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, cache_prefetch), .dflt = "300" },
+	{ FR_CONF_OFFSET("prefetch_hits", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, cache_prefetch_hits), .dflt = "2" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER ocsp_config[] = {
 	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, enable), .dflt = "no" },
 
@@ -102,6 +112,8 @@ static CONF_PARSER ocsp_config[] = {
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, timeout), .dflt = "yes" },
 	{ FR_CONF_OFFSET("softfail", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, softfail), .dflt = "no" },
 
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) ocsp_cache_config },
+
 	CONF_PARSER_TERMINATOR
 };
 #endif
@@ -151,6 +163,7 @@ CONF_PARSER fr_tls_server_config[] = {
 	{ FR_CONF_OFFSET("check_cert_cn", FR_TYPE_STRING, fr_tls_conf_t, check_cert_cn) },
 	{ FR_CONF_OFFSET("cipher_list", FR_TYPE_STRING, fr_tls_conf_t, cipher_list) },
 	{ FR_CONF_OFFSET("cipher_server_preference", FR_TYPE_BOOL, fr_tls_conf_t, cipher_server_preference), .dflt = "yes" },
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, fr_tls_conf_t, async), .dflt = "no" },
 #ifdef SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS
 	{ FR_CONF_OFFSET("allow_renegotiation", FR_TYPE_BOOL, fr_tls_conf_t, allow_renegotiation), .dflt = "no" },
 #endif
@@ -464,6 +477,9 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 		conf->staple.store = conf_ocsp_revocation_store(conf);
 		if (conf->staple.store == NULL) goto error;
 	}
+
+	if ((fr_tls_ocsp_cache_init(conf, &conf->ocsp) < 0) ||
+	    (fr_tls_ocsp_cache_init(conf, &conf->staple) < 0)) goto error;
 #endif /*HAVE_OPENSSL_OCSP_H*/
 
 	if (conf->verify_tmp_dir) {
@@ -491,6 +507,26 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 		if (fr_tls_cache_compile(&conf->session_cache, server_cs) < 0) goto error;
 	}
 
+	if (conf->session_ticket_key_rotation && !conf->session_cache_memory) {
+		ERROR("Session tickets require the in-memory session cache, set 'cache { memory = yes }'");
+		goto error;
+	}
+
+	if (conf->session_cache_memory) {
+		if (conf->session_cache_max_entries == 0) {
+			ERROR("Session cache 'max_entries' must be greater than 0");
+			goto error;
+		}
+
+		conf->session_cache_store = fr_tls_cache_store_alloc(conf, conf->session_cache_max_entries,
+								     conf->session_cache_lifetime,
+								     conf->session_ticket_key_rotation);
+		if (!conf->session_cache_store) {
+			PERROR("Failed allocating session cache");
+			goto error;
+		}
+	}
+
 	if (conf->ocsp.cache_server) {
 		CONF_SECTION *server_cs;
 
@@ -420,6 +420,15 @@ SSL_CTX *fr_tls_ctx_alloc(fr_tls_conf_t const *conf, bool client)
 		 */
 		if (!conf->auto_chain) mode |= SSL_MODE_NO_AUTO_CHAIN;
 
+#ifdef SSL_MODE_RELEASE_BUFFERS
+		/*
+		 *	EAP sessions sit idle between rounds, waiting for
+		 *	the supplicant.  Don't hold on to OpenSSL's read
+		 *	and write buffers while they do.
+		 */
+		mode |= SSL_MODE_RELEASE_BUFFERS;
+#endif
+
 		if (client) {
 			mode |= SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER;
 			mode |= SSL_MODE_AUTO_RETRY;
@@ -711,6 +720,20 @@ post_ca:
 
 	SSL_CTX_set_options(ctx, ctx_options);
 
+	/*
+	 *	Let OpenSSL run handshakes as ASYNC jobs, so that
+	 *	an engine (such as QAT) can perform the expensive
+	 *	crypto operations, whilst the worker gets on with
+	 *	other requests.
+	 */
+	if (conf->async) {
+#ifdef SSL_MODE_ASYNC
+		SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+#else
+		WARN("async is enabled, but this version of OpenSSL does not support it");
+#endif
+	}
+
 	/*
 	 *	TODO: Set the RSA & DH
 	 *	SSL_CTX_set_tmp_rsa_callback(ctx, cbtls_rsa);
@@ -844,7 +867,7 @@ post_ca:
 	/*
 	 *	Setup session caching
 	 */
-	fr_tls_cache_init(ctx, conf->session_cache_server ? true : false, conf->session_cache_lifetime);
+	fr_tls_cache_init(ctx, conf);
 
 	return ctx;
 }
@@ -326,6 +326,10 @@ int fr_tls_log_io_error(REQUEST *request, fr_tls_session_t *session, int ret, ch
 	case SSL_ERROR_WANT_WRITE:
 	case SSL_ERROR_WANT_X509_LOOKUP:
 	case SSL_ERROR_ZERO_RETURN:
+#ifdef SSL_ERROR_WANT_ASYNC
+	case SSL_ERROR_WANT_ASYNC:
+	case SSL_ERROR_WANT_ASYNC_JOB:
+#endif
 		break;
 
 	/*
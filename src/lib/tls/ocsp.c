@@ -32,12 +32,16 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/pair.h>
 #include <freeradius-devel/util/debug.h>
-
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/syserror.h>
 
 #include <freeradius-devel/unlang/compile.h>
 
 #include <openssl/ocsp.h>
+#include <pthread.h>
 
 #include "attrs.h"
 #include "base.h"
@@ -326,6 +330,496 @@ int fr_tls_ocsp_staple_cb(SSL *ssl, void *data)
 	return ret;
 }
 
+/** Determine which responder to send an OCSP request to
+ *
+ * @param[in] request		The current request.
+ * @param[out] host		Host portion of the URL (must be freed with OPENSSL_free()).
+ * @param[out] port		Port portion of the URL (must be freed with OPENSSL_free()).
+ * @param[out] path		Path portion of the URL (must be freed with OPENSSL_free()).
+ * @param[out] use_ssl		Whether the responder should be contacted using https.
+ * @param[in] conf		OCSP configuration.
+ * @param[in] cert		to check.
+ * @return
+ *	- 0 on success.
+ *	- -1 if no usable URL was found, and OCSP should be skipped.
+ */
+static int ocsp_responder_url(REQUEST *request, char **host, char **port, char **path, int *use_ssl,
+			      fr_tls_ocsp_conf_t const *conf, X509 *cert)
+{
+	char *url;
+
+	if (!conf->override_url) switch (ocsp_cert_url_parse(cert, host, port, path, use_ssl)) {
+	case 1:
+		fr_assert(*host && *port && *path);
+		return 0;
+
+	case 0:
+		if (!conf->url) {
+			RWDEBUG("No OCSP URL in certificate.  Not doing OCSP");
+			return -1;
+		}
+		RWDEBUG("No OCSP URL in certificate, falling back to configured URL");
+		break;
+
+	default:
+		RWDEBUG("Invalid URL in certificate.  Not doing OCSP");
+		return -1;
+	}
+
+	memcpy(&url, &conf->url, sizeof(url));
+	/* Reading the libssl src, they do a strdup on the URL, so it could of been const *sigh* */
+	OCSP_parse_url(url, host, port, path, use_ssl);
+	if (!*host || !*port || !*path) {
+		RWDEBUG("Host or port or path missing from configured URL \"%s\".  Not doing OCSP", url);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** A cached OCSP response
+ *
+ */
+typedef struct {
+	uint8_t			*key;		//!< DER encoded OCSP_CERTID, i.e. the hashes of
+						///< the issuer's name and key, and the serial.
+	size_t			key_len;	//!< Length of the key.
+	uint8_t			*resp;		//!< DER encoded OCSP response.
+	time_t			expires;	//!< nextUpdate, or now + max_age, whichever is sooner.
+	uint32_t		hits;		//!< How many times the response has been used.
+	bool			refreshing;	//!< Whether a prefetch is in progress.
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+} ocsp_cache_entry_t;
+
+/** OCSP responses shared by all threads using a TLS configuration
+ *
+ */
+struct fr_tls_ocsp_cache_s {
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+	TALLOC_CTX		*ctx;		//!< Entries are allocated here.
+	fr_hash_table_t		*ht;		//!< Entries indexed by certificate ID.
+	fr_dlist_head_t		lru;		//!< Entries, most recently used first.
+
+	uint32_t		max_entries;	//!< Maximum number of responses to hold.
+	time_t			max_age;	//!< Longest period to cache a response for.
+	time_t			prefetch;	//!< Refresh responses this long before they expire.
+	uint32_t		prefetch_hits;	//!< Only refresh responses used at least this many times.
+};
+
+/** An OCSP request being sent in the background to refresh a cached response
+ *
+ */
+typedef struct {
+	fr_tls_ocsp_cache_t	*cache;		//!< To update with the new response.
+	X509_STORE		*store;		//!< To verify the new response with.
+	uint8_t			*key;		//!< Of the entry being refreshed.
+	OCSP_CERTID		*certid;	//!< Of the certificate being checked.
+
+	fr_event_list_t		*el;		//!< Event list the request is running in.
+	fr_event_timer_t const	*ev;		//!< Timeout for the request.
+	int			fd;		//!< Of the connection to the responder.
+
+	OCSP_REQUEST		*req;
+	BIO			*conn;
+	OCSP_REQ_CTX		*req_ctx;
+} ocsp_refresh_t;
+
+static uint32_t ocsp_cache_entry_hash(void const *data)
+{
+	ocsp_cache_entry_t const *a = data;
+
+	return fr_hash(a->key, a->key_len);
+}
+
+static int ocsp_cache_entry_cmp(void const *one, void const *two)
+{
+	ocsp_cache_entry_t const *a = one, *b = two;
+
+	if (a->key_len != b->key_len) return (a->key_len > b->key_len) - (a->key_len < b->key_len);
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+static int _ocsp_cache_free(fr_tls_ocsp_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate the OCSP response cache, if it's enabled
+ *
+ * @param[in] ctx	to allocate the cache in.
+ * @param[in] conf	OCSP configuration to allocate the cache for.
+ * @return
+ *	- 0 on success, or if the cache is disabled.
+ *	- -1 on failure.
+ */
+int fr_tls_ocsp_cache_init(TALLOC_CTX *ctx, fr_tls_ocsp_conf_t *conf)
+{
+	fr_tls_ocsp_cache_t	*cache;
+
+	if (!conf->enable || !conf->cache_max_entries) return 0;
+
+	/*
+	 *	A cached response can never contain the nonce
+	 *	from a new request.
+	 */
+	if (conf->use_nonce) {
+		ERROR("OCSP response caching requires 'use_nonce = no'");
+		return -1;
+	}
+
+	MEM(cache = talloc_zero(ctx, fr_tls_ocsp_cache_t));
+	MEM(cache->ctx = talloc_new(cache));
+	MEM(cache->ht = fr_hash_table_create(cache->ctx, ocsp_cache_entry_hash, ocsp_cache_entry_cmp, NULL));
+	fr_dlist_init(&cache->lru, ocsp_cache_entry_t, entry);
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _ocsp_cache_free);
+
+	cache->max_entries = conf->cache_max_entries;
+	cache->max_age = conf->cache_max_age;
+	cache->prefetch = conf->cache_prefetch;
+	cache->prefetch_hits = conf->cache_prefetch_hits;
+
+	conf->cache_store = cache;
+
+	return 0;
+}
+
+/** Encode a certificate ID for use as a cache key
+ *
+ * @param[in] ctx	to allocate the key in.
+ * @param[in] certid	to encode.
+ * @return
+ *	- The DER encoded certificate ID.
+ *	- NULL on error.
+ */
+static uint8_t *ocsp_cache_key(TALLOC_CTX *ctx, OCSP_CERTID *certid)
+{
+	uint8_t		*key, *p;
+	int		len;
+
+	len = i2d_OCSP_CERTID(certid, NULL);
+	if (len <= 0) return NULL;
+
+	key = p = talloc_array(ctx, uint8_t, len);
+	if (!key) return NULL;
+
+	if (i2d_OCSP_CERTID(certid, &p) != len) {
+		talloc_free(key);
+		return NULL;
+	}
+
+	return key;
+}
+
+/** Remove an entry from the cache, the cache must be locked
+ *
+ */
+static void ocsp_cache_remove(fr_tls_ocsp_cache_t *cache, ocsp_cache_entry_t *entry)
+{
+	fr_hash_table_delete(cache->ht, entry);
+	fr_dlist_remove(&cache->lru, entry);
+	talloc_free(entry);
+}
+
+/** Find a cached OCSP response
+ *
+ * @param[out] refresh	Set to true if the caller should prefetch a new response.
+ * @param[in] cache	to search.
+ * @param[in] key	DER encoded certificate ID.
+ * @return
+ *	- The cached response.
+ *	- NULL if no response was found, or it had expired.
+ */
+static OCSP_RESPONSE *ocsp_cache_find(bool *refresh, fr_tls_ocsp_cache_t *cache, uint8_t const *key)
+{
+	ocsp_cache_entry_t	*entry, find = { .key_len = talloc_array_length(key) };
+	OCSP_RESPONSE		*resp = NULL;
+	unsigned char const	*p;
+	time_t			now = time(NULL);
+
+	*refresh = false;
+
+	memcpy(&find.key, &key, sizeof(find.key));	/* const issues */
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = fr_hash_table_finddata(cache->ht, &find);
+	if (!entry) goto done;
+
+	if (entry->expires <= now) {
+		if (!entry->refreshing) ocsp_cache_remove(cache, entry);
+		goto done;
+	}
+
+	fr_dlist_remove(&cache->lru, entry);
+	fr_dlist_insert_head(&cache->lru, entry);
+	entry->hits++;
+
+	/*
+	 *	Popular certificates get a new response before
+	 *	the old one expires, so that handshakes don't
+	 *	have to wait for the responder.
+	 */
+	if (!entry->refreshing && (entry->hits >= cache->prefetch_hits) &&
+	    ((entry->expires - now) <= cache->prefetch)) {
+		entry->refreshing = true;
+		*refresh = true;
+	}
+
+	p = entry->resp;	/* openssl will mutate p */
+	resp = d2i_OCSP_RESPONSE(NULL, &p, talloc_array_length(entry->resp));
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+
+	return resp;
+}
+
+/** Add a verified OCSP response to the cache
+ *
+ * @param[in] cache		to add the response to.
+ * @param[in] key		DER encoded certificate ID.
+ * @param[in] resp		to add.
+ * @param[in] next_update	from the response, may be NULL.
+ */
+static void ocsp_cache_insert(fr_tls_ocsp_cache_t *cache, uint8_t const *key,
+			      OCSP_RESPONSE *resp, ASN1_GENERALIZEDTIME *next_update)
+{
+	ocsp_cache_entry_t	*entry, find = { .key_len = talloc_array_length(key) };
+	time_t			now = time(NULL), expires = now + cache->max_age, next;
+	uint8_t			*p;
+	int			len;
+
+	if (next_update && (fr_tls_utils_asn1time_to_epoch(&next, next_update) == 0) && (next < expires)) {
+		expires = next;
+	}
+	if (expires <= now) return;
+
+	len = i2d_OCSP_RESPONSE(resp, NULL);
+	if (len <= 0) return;
+
+	memcpy(&find.key, &key, sizeof(find.key));	/* const issues */
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = fr_hash_table_finddata(cache->ht, &find);
+	if (entry) ocsp_cache_remove(cache, entry);
+
+	entry = talloc_zero(cache->ctx, ocsp_cache_entry_t);
+	if (!entry) goto done;
+	entry->key = talloc_memdup(entry, key, find.key_len);
+	entry->key_len = find.key_len;
+	entry->resp = p = talloc_array(entry, uint8_t, len);
+	entry->expires = expires;
+	if (!entry->key || !entry->resp || (i2d_OCSP_RESPONSE(resp, &p) != len) ||
+	    (fr_hash_table_insert(cache->ht, entry) < 0)) {
+		talloc_free(entry);
+		goto done;
+	}
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	while (fr_dlist_num_elements(&cache->lru) > cache->max_entries) {
+		ocsp_cache_remove(cache, fr_dlist_tail(&cache->lru));
+	}
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+static int _ocsp_refresh_free(ocsp_refresh_t *refresh)
+{
+	ocsp_cache_entry_t	*entry, find = { .key = refresh->key, .key_len = talloc_array_length(refresh->key) };
+
+	/*
+	 *	Whatever happened, let a future lookup
+	 *	try again.
+	 */
+	pthread_mutex_lock(&refresh->cache->mutex);
+	entry = fr_hash_table_finddata(refresh->cache->ht, &find);
+	if (entry) entry->refreshing = false;
+	pthread_mutex_unlock(&refresh->cache->mutex);
+
+	if (refresh->fd >= 0) fr_event_fd_delete(refresh->el, refresh->fd, FR_EVENT_FILTER_IO);
+	if (refresh->req_ctx) OCSP_REQ_CTX_free(refresh->req_ctx);
+	if (refresh->conn) BIO_free_all(refresh->conn);
+	if (refresh->req) OCSP_REQUEST_free(refresh->req);
+	if (refresh->certid) OCSP_CERTID_free(refresh->certid);
+	if (refresh->store) X509_STORE_free(refresh->store);
+
+	return 0;
+}
+
+/** Verify a prefetched response, and add it to the cache
+ *
+ */
+static void ocsp_refresh_store(ocsp_refresh_t *refresh, OCSP_RESPONSE *resp)
+{
+	OCSP_BASICRESP		*bresp;
+	ASN1_GENERALIZEDTIME	*rev, *this_update, *next_update;
+	int			status, reason;
+
+	if (OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+		WARN("Prefetched OCSP response status: %s", OCSP_response_status_str(OCSP_response_status(resp)));
+		return;
+	}
+
+	bresp = OCSP_response_get1_basic(resp);
+	if (!bresp) return;
+
+	if ((OCSP_basic_verify(bresp, NULL, refresh->store, 0) == 1) &&
+	    OCSP_resp_find_status(bresp, refresh->certid, &status, &reason, &rev, &this_update, &next_update) &&
+	    OCSP_check_validity(this_update, next_update, OCSP_MAX_VALIDITY_PERIOD, -1)) {
+		DEBUG2("Prefetched OCSP response, cert status: %s", OCSP_cert_status_str(status));
+		ocsp_cache_insert(refresh->cache, refresh->key, resp, next_update);
+	} else {
+		WARN("Failed verifying prefetched OCSP response");
+	}
+	OCSP_BASICRESP_free(bresp);
+
+	while (ERR_get_error());	/* Don't leave errors for the next handshake */
+}
+
+static void ocsp_refresh_io(fr_event_list_t *el, int fd, UNUSED int flags, void *uctx);
+
+static void ocsp_refresh_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+			       int fd_errno, void *uctx)
+{
+	ocsp_refresh_t *refresh = talloc_get_type_abort(uctx, ocsp_refresh_t);
+
+	WARN("OCSP prefetch failed: %s", fr_syserror(fd_errno));
+	talloc_free(refresh);
+}
+
+static void ocsp_refresh_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	ocsp_refresh_t *refresh = talloc_get_type_abort(uctx, ocsp_refresh_t);
+
+	refresh->ev = NULL;
+	WARN("OCSP prefetch timed out");
+	talloc_free(refresh);
+}
+
+/** Wait until the connection to the responder is ready for whatever OpenSSL wants to do next
+ *
+ */
+static int ocsp_refresh_watch(ocsp_refresh_t *refresh)
+{
+	bool want_write = BIO_should_write(refresh->conn);
+
+	return fr_event_fd_insert(refresh, refresh->el, refresh->fd,
+				  want_write ? NULL : ocsp_refresh_io,
+				  want_write ? ocsp_refresh_io : NULL,
+				  ocsp_refresh_error, refresh);
+}
+
+static void ocsp_refresh_io(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	ocsp_refresh_t	*refresh = talloc_get_type_abort(uctx, ocsp_refresh_t);
+	OCSP_RESPONSE	*resp = NULL;
+	int		rc;
+
+	rc = OCSP_sendreq_nbio(&resp, refresh->req_ctx);
+	if ((rc == -1) && BIO_should_retry(refresh->conn)) {
+		if (ocsp_refresh_watch(refresh) == 0) return;
+		PWARN("Failed watching OCSP prefetch connection");
+	} else if (rc == 1) {
+		ocsp_refresh_store(refresh, resp);
+	} else {
+		WARN("OCSP prefetch failed, couldn't get response");
+		while (ERR_get_error());
+	}
+
+	OCSP_RESPONSE_free(resp);
+	talloc_free(refresh);
+}
+
+/** Fetch a new response for a cached entry, without blocking the current request
+ *
+ * The request is sent on the worker's event list, and the cache is updated
+ * once a response has been received and verified.
+ *
+ * @param[in] request		The current request.
+ * @param[in] conf		OCSP configuration.
+ * @param[in] store		to verify the response with.
+ * @param[in] client_cert	being checked.
+ * @param[in] certid		of client_cert.
+ * @param[in] key		of the cache entry.
+ */
+static void ocsp_refresh_start(REQUEST *request, fr_tls_ocsp_conf_t const *conf, X509_STORE *store,
+			       X509 *client_cert, OCSP_CERTID *certid, uint8_t const *key)
+{
+	ocsp_refresh_t	*refresh;
+	char		*host = NULL, *port = NULL, *path = NULL;
+	char		host_header[1024];
+	int		use_ssl = -1;
+	int		rc;
+
+	MEM(refresh = talloc_zero(request->el, ocsp_refresh_t));
+	refresh->cache = conf->cache_store;
+	refresh->el = request->el;
+	refresh->fd = -1;
+	talloc_set_destructor(refresh, _ocsp_refresh_free);
+
+	MEM(refresh->key = talloc_memdup(refresh, key, talloc_array_length(key)));
+
+	/*
+	 *	The store used for stapling is freed as soon as
+	 *	the check completes.
+	 */
+	if (!X509_STORE_up_ref(store)) goto error;
+	refresh->store = store;
+
+	if (ocsp_responder_url(request, &host, &port, &path, &use_ssl, conf, client_cert) < 0) goto error;
+	if ((size_t)snprintf(host_header, sizeof(host_header), "%s:%s", host, port) >= sizeof(host_header)) goto error;
+
+	refresh->certid = OCSP_CERTID_dup(certid);
+	refresh->req = OCSP_REQUEST_new();
+	if (!refresh->certid || !refresh->req ||
+	    !OCSP_request_add0_id(refresh->req, OCSP_CERTID_dup(certid))) goto error;
+
+	refresh->conn = BIO_new_connect(host);
+	if (!refresh->conn) goto error;
+	BIO_set_conn_port(refresh->conn, port);
+	BIO_set_nbio(refresh->conn, 1);
+
+	rc = BIO_do_connect(refresh->conn);
+	if ((rc <= 0) && !BIO_should_retry(refresh->conn)) goto error;
+
+	refresh->req_ctx = OCSP_sendreq_new(refresh->conn, path, NULL, -1);
+	if (!refresh->req_ctx ||
+	    !OCSP_REQ_CTX_add1_header(refresh->req_ctx, "Host", host_header) ||
+	    !OCSP_REQ_CTX_set1_req(refresh->req_ctx, refresh->req)) goto error;
+
+	refresh->fd = BIO_get_fd(refresh->conn, NULL);
+	if (refresh->fd < 0) goto error;
+
+	if ((fr_event_fd_insert(refresh, refresh->el, refresh->fd, NULL, ocsp_refresh_io,
+				ocsp_refresh_error, refresh) < 0) ||
+	    (fr_event_timer_in(refresh, refresh->el, &refresh->ev,
+			       fr_time_delta_from_sec(conf->timeout ? conf->timeout : 10),
+			       ocsp_refresh_timeout, refresh) < 0)) {
+		refresh->fd = -1;
+		goto error;
+	}
+
+	RDEBUG2("Prefetching OCSP response from \"http://%s:%s%s\"", host, port, path);
+
+	OPENSSL_free(host);
+	OPENSSL_free(port);
+	OPENSSL_free(path);
+	return;
+
+error:
+	RWDEBUG("Failed starting OCSP prefetch");
+	while (ERR_get_error());
+
+	OPENSSL_free(host);
+	OPENSSL_free(port);
+	OPENSSL_free(path);
+	talloc_free(refresh);
+}
+
 /** Sends a OCSP request to a defined OCSP responder
  *
  */
@@ -350,6 +844,8 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 	int		reason;
 	OCSP_REQ_CTX	*ctx;
 	int		rc;
+	uint8_t		*cache_key = NULL;
+	bool		cached = false;
 
 	fr_time_t	start;
 	VALUE_PAIR	*vp;
@@ -437,44 +933,30 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 	if (conf->use_nonce) OCSP_request_add1_nonce(req, NULL, 8);
 
 	/*
-	 *	Send OCSP Request and get OCSP Response
+	 *	Use a cached response if we have one, refreshing
+	 *	it in the background if it's about to expire.
 	 */
+	if (conf->cache_store) {
+		bool refresh = false;
 
-	/* Get OCSP responder URL */
-	if (conf->override_url) {
-		char *url;
-
-	use_url:
-		memcpy(&url, &conf->url, sizeof(url));
-		/* Reading the libssl src, they do a strdup on the URL, so it could of been const *sigh* */
-		OCSP_parse_url(url, &host, &port, &path, &use_ssl);
-		if (!host || !port || !path) {
-			RWDEBUG("Host or port or path missing from configured URL \"%s\".  Not doing OCSP", url);
-			goto skipped;
-		}
-	} else {
-		int ret;
-
-		ret = ocsp_cert_url_parse(client_cert, &host, &port, &path, &use_ssl);
-		switch (ret) {
-		case -1:
-			RWDEBUG("Invalid URL in certificate.  Not doing OCSP");
-			break;
+		cache_key = ocsp_cache_key(request, certid);
+		if (cache_key) resp = ocsp_cache_find(&refresh, conf->cache_store, cache_key);
+		if (resp) {
+			RDEBUG2("Using cached OCSP response");
+			cached = true;
 
-		case 0:
-			if (conf->url) {
-				RWDEBUG("No OCSP URL in certificate, falling back to configured URL");
-				goto use_url;
-			}
-			RWDEBUG("No OCSP URL in certificate.  Not doing OCSP");
-			goto skipped;
-
-		case 1:
-			fr_assert(host && port && path);
-			break;
+			if (refresh) ocsp_refresh_start(request, conf, store, client_cert, certid, cache_key);
+			goto verify;
 		}
 	}
 
+	/*
+	 *	Send OCSP Request and get OCSP Response
+	 */
+
+	/* Get OCSP responder URL */
+	if (ocsp_responder_url(request, &host, &port, &path, &use_ssl, conf, client_cert) < 0) goto skipped;
+
 	RDEBUG2("Using responder URL \"http://%s:%s%s\"", host, port, path);
 
 	/* Check host and port length are sane, then create Host: HTTP header */
@@ -519,9 +1001,7 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 	start = fr_time();
 	do {
 		rc = OCSP_sendreq_nbio(&resp, ctx);
-		if (conf->timeout) {
-			if (conf->timeout > (fr_time() - start)) break;
-		}
+		if (conf->timeout && ((fr_time() - start) > fr_time_delta_from_sec(conf->timeout))) break;
 	} while ((rc == -1) && BIO_should_retry(conn));
 
 	if (conf->timeout && (rc == -1) && BIO_should_retry(conn)) {
@@ -539,6 +1019,7 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 		goto finish;
 	}
 
+verify:
 	/* Verify OCSP response status */
 	status = OCSP_response_status(resp);
 	if (status != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
@@ -582,6 +1063,8 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 		goto finish;
 	}
 
+	if (cache_key && !cached) ocsp_cache_insert(conf->cache_store, cache_key, resp, next_update);
+
 	/*
 	 *	Print any messages we may have accumulated
 	 */
@@ -735,6 +1218,7 @@ finish:
 	OPENSSL_free(path);
 	BIO_free_all(conn);
 	BIO_free(ssl_log);
+	talloc_free(cache_key);
 
 	return ocsp_status;
 }
@@ -202,6 +202,7 @@ static char const *tls_handshake_type_str[] = {
  */
 inline static void record_init(fr_tls_record_t *record)
 {
+	record->start = 0;
 	record->used = 0;
 }
 
@@ -211,6 +212,7 @@ inline static void record_init(fr_tls_record_t *record)
  */
 inline static void record_close(fr_tls_record_t *record)
 {
+	record->start = 0;
 	record->used = 0;
 }
 
@@ -223,12 +225,22 @@ inline static void record_close(fr_tls_record_t *record)
  */
 inline static unsigned int record_from_buff(fr_tls_record_t *record, void const *in, unsigned int inlen)
 {
-	unsigned int added = FR_TLS_MAX_RECORD_SIZE - record->used;
+	unsigned int added;
 
+	/*
+	 *	Only compact a partially drained record if
+	 *	we'd otherwise run off the end.
+	 */
+	if ((record->start > 0) && ((FR_TLS_MAX_RECORD_SIZE - (record->start + record->used)) < inlen)) {
+		memmove(record->data, record->data + record->start, record->used);
+		record->start = 0;
+	}
+
+	added = FR_TLS_MAX_RECORD_SIZE - (record->start + record->used);
 	if (added > inlen) added = inlen;
 	if (added == 0) return 0;
 
-	memcpy(record->data + record->used, in, added);
+	memcpy(record->data + record->start + record->used, in, added);
 	record->used += added;
 
 	return added;
@@ -247,14 +259,14 @@ inline static unsigned int record_to_buff(fr_tls_record_t *record, void *out, un
 
 	if (taken > outlen) taken = outlen;
 	if (taken == 0) return 0;
-	if (out) memcpy(out, record->data, taken);
-
-	record->used -= taken;
+	if (out) memcpy(out, record->data + record->start, taken);
 
 	/*
-	 *	This is pretty bad...
+	 *	Fragments are slices of the record, so the
+	 *	remaining data stays where it is.
 	 */
-	if (record->used > 0) memmove(record->data, record->data + taken, record->used);
+	record->used -= taken;
+	record->start = (record->used > 0) ? record->start + taken : 0;
 
 	return taken;
 }
@@ -1131,7 +1143,8 @@ int fr_tls_session_recv(REQUEST *request, fr_tls_session_t *session)
 	 *	Decrypt the complete record.
 	 */
 	if (session->dirty_in.used) {
-		ret = BIO_write(session->into_ssl, session->dirty_in.data, session->dirty_in.used);
+		ret = BIO_write(session->into_ssl, session->dirty_in.data + session->dirty_in.start,
+				session->dirty_in.used);
 		if (ret != (int) session->dirty_in.used) {
 			record_init(&session->dirty_in);
 			REDEBUG("Failed writing %zd bytes to SSL BIO: %d", session->dirty_in.used, ret);
@@ -1241,10 +1254,12 @@ int fr_tls_session_send(REQUEST *request, fr_tls_session_t *session)
 			RDEBUG2("TLS application data to encrypt (%zu bytes)", session->clean_in.used);
 		}
 
-		ret = SSL_write(session->ssl, session->clean_in.data, session->clean_in.used);
+		ret = SSL_write(session->ssl, session->clean_in.data + session->clean_in.start,
+				session->clean_in.used);
 		record_to_buff(&session->clean_in, NULL, ret);
 
 		/* Get the dirty data from Bio to send it */
+		record_init(&session->dirty_out);
 		ret = BIO_read(session->from_ssl, session->dirty_out.data,
 			       sizeof(session->dirty_out.data));
 		if (ret > 0) {
@@ -1261,6 +1276,43 @@ finish:
 	return ret;
 }
 
+/** Whether the handshake is paused waiting for an asynchronous operation
+ *
+ * If this returns true, #fr_tls_session_handshake must be called again,
+ * without any new data, once the operation has completed.
+ *
+ * @param[in] session	to check.
+ * @return
+ *	- true if the handshake is paused.
+ *	- false otherwise.
+ */
+bool fr_tls_session_async_pending(fr_tls_session_t const *session)
+{
+	return session->async_pending;
+}
+
+/** Return the fd an asynchronous engine signals completion on
+ *
+ * @param[in] session	with a paused handshake.
+ * @return
+ *	- The fd to wait on.
+ *	- -1 if there's no single fd, and the caller should poll.
+ */
+int fr_tls_session_async_fd(fr_tls_session_t const *session)
+{
+#ifdef SSL_MODE_ASYNC
+	OSSL_ASYNC_FD	fd;
+	size_t		num = 0;
+
+	if ((SSL_get_all_async_fds(session->ssl, NULL, &num) != 1) || (num != 1)) return -1;
+	if (SSL_get_all_async_fds(session->ssl, &fd, &num) != 1) return -1;
+
+	return fd;
+#else
+	return -1;
+#endif
+}
+
 /** Instruct fr_tls_session_handshake to create a synthesised TLS alert record and send it to the peer
  *
  */
@@ -1290,6 +1342,7 @@ static void fr_tls_session_alert_send(REQUEST *request, fr_tls_session_t *sessio
 	session->info.alert_level = session->pending_alert_level;
 	session->info.alert_description = session->pending_alert_description;
 
+	record_init(&session->dirty_out);
 	session->dirty_out.data[0] = session->info.content_type;
 	session->dirty_out.data[1] = 3;
 	session->dirty_out.data[2] = 1;
@@ -1318,6 +1371,8 @@ static void fr_tls_session_alert_send(REQUEST *request, fr_tls_session_t *sessio
  * @return
  *	- -1 on error.
  *	- 0 on success.
+ *	- 2 if the handshake is waiting for an asynchronous crypto operation.
+ *	  Call again, once the operation has completed.
  */
 int fr_tls_session_handshake(REQUEST *request, fr_tls_session_t *session)
 {
@@ -1343,13 +1398,16 @@ int fr_tls_session_handshake(REQUEST *request, fr_tls_session_t *session)
 		goto error;
 	}
 
+	session->async_pending = false;
+
 	/*
 	 *	Feed dirty data into OpenSSL, so that is can either
 	 *	process it as Application data (decrypting it)
 	 *	or continue the TLS handshake.
 	 */
 	if (session->dirty_in.used) {
-		ret = BIO_write(session->into_ssl, session->dirty_in.data, session->dirty_in.used);
+		ret = BIO_write(session->into_ssl, session->dirty_in.data + session->dirty_in.start,
+				session->dirty_in.used);
 		if (ret != (int)session->dirty_in.used) {
 			REDEBUG("Failed writing %zd bytes to TLS BIO: %d", session->dirty_in.used, ret);
 			record_init(&session->dirty_in);
@@ -1393,6 +1451,26 @@ int fr_tls_session_handshake(REQUEST *request, fr_tls_session_t *session)
 	 */
 	if (fr_tls_log_io_error(request, session, ret, "Failed in SSL_read") < 0) goto error;
 
+#ifdef SSL_ERROR_WANT_ASYNC
+	/*
+	 *	An engine is performing a crypto operation for
+	 *	the handshake, or all the ASYNC jobs are in use.
+	 *	dirty_in has already been consumed, so the
+	 *	caller just needs to call us again later.
+	 */
+	switch (SSL_get_error(session->ssl, ret)) {
+	case SSL_ERROR_WANT_ASYNC:
+	case SSL_ERROR_WANT_ASYNC_JOB:
+		RDEBUG2("Handshake paused, waiting for asynchronous crypto operation");
+		session->async_pending = true;
+		ret = 2;
+		goto finish;
+
+	default:
+		break;
+	}
+#endif
+
 	/*
 	 *	This only occurs once per session, where calling
 	 *	SSL_read updates the state of the SSL session, setting
@@ -1498,6 +1576,7 @@ int fr_tls_session_handshake(REQUEST *request, fr_tls_session_t *session)
 	 */
 	ret = BIO_ctrl_pending(session->from_ssl);
 	if (ret > 0) {
+		record_init(&session->dirty_out);
 		ret = BIO_read(session->from_ssl, session->dirty_out.data,
 			       sizeof(session->dirty_out.data));
 		if (ret > 0) {
@@ -1839,7 +1918,7 @@ fr_tls_session_t *fr_tls_session_init_server(TALLOC_CTX *ctx, fr_tls_conf_t *con
 		session->mtu = vp->vp_uint32;
 	}
 
-	if (conf->session_cache_server) session->allow_session_resumption = true; /* otherwise it's false */
+	if (conf->session_cache_server || conf->session_cache_store) session->allow_session_resumption = true; /* otherwise it's false */
 
 	fr_tls_session_request_unbind(session->ssl);
 
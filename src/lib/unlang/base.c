@@ -86,6 +86,7 @@ int unlang_init(void)
 	unlang_map_init();
 	unlang_module_init();
 	unlang_parallel_init();
+	unlang_profile_init();
 	unlang_return_init();
 	if (unlang_subrequest_op_init() < 0) return -1;
 	unlang_switch_init();
@@ -1956,6 +1956,26 @@ static bool compile_action_subsection(unlang_t *c, CONF_SECTION *cs, CONF_SECTIO
 }
 
 
+/** Record where each "if" and "elsif" continues when its condition matches
+ *
+ * So that the interpreter doesn't have to walk over the following
+ * "else" and "elsif" blocks at run time.
+ */
+static void compile_chain_next(unlang_group_t *g)
+{
+	unlang_t *c, *next;
+
+	for (c = g->children; c; c = c->next) {
+		if ((c->type != UNLANG_TYPE_IF) && (c->type != UNLANG_TYPE_ELSIF)) continue;
+
+		for (next = c->next;
+		     next && ((next->type == UNLANG_TYPE_ELSE) || (next->type == UNLANG_TYPE_ELSIF));
+		     next = next->next);
+
+		unlang_generic_to_group(c)->chain_next = next;
+	}
+}
+
 static unlang_t *compile_children(unlang_group_t *g, unlang_t *parent, unlang_compile_t *unlang_ctx)
 {
 	CONF_ITEM *ci = NULL;
@@ -2081,6 +2101,8 @@ static unlang_t *compile_children(unlang_group_t *g, unlang_t *parent, unlang_co
 		}
 	}
 
+	compile_chain_next(g);
+
 	return compile_action_defaults(c, unlang_ctx);
 }
 
@@ -2129,6 +2151,57 @@ static unlang_t *compile_group(unlang_t *parent, unlang_compile_t *unlang_ctx, C
 	return compile_section(parent, unlang_ctx, cs, UNLANG_TYPE_GROUP);
 }
 
+static int switch_case_cmp(void const *one, void const *two)
+{
+	unlang_switch_case_t const *a = one, *b = two;
+
+	return fr_value_box_cmp(a->value, b->value);
+}
+
+/** Index the constant cases of a switch over an attribute
+ *
+ * So that the interpreter can find the matching case without comparing
+ * the attribute against each case in turn.
+ */
+static void compile_switch_cases(unlang_group_t *g)
+{
+	unlang_t		*this;
+	int			i = 0;
+
+	if (!tmpl_is_attr(g->vpt)) return;
+
+	MEM(g->case_tree = rbtree_talloc_alloc(g, switch_case_cmp, unlang_switch_case_t, NULL, RBTREE_FLAG_NONE));
+
+	for (this = g->children; this; this = this->next, i++) {
+		unlang_group_t		*h = unlang_generic_to_group(this);
+		unlang_switch_case_t	*sc;
+
+		if (!h->vpt) {
+			g->default_case = this;
+			continue;
+		}
+
+		if (!unlang_switch_case_is_constant(g, h)) {
+			g->dynamic_cases = true;
+			continue;
+		}
+
+		MEM(sc = talloc(g->case_tree, unlang_switch_case_t));
+		sc->value = tmpl_value(h->vpt);
+		sc->child = this;
+		sc->index = i;
+
+		/*
+		 *	Duplicate values can never match, as the
+		 *	earlier case always wins.
+		 */
+		if (!rbtree_insert(g->case_tree, sc)) {
+			cf_log_warn(h->cs, "Ignoring duplicate 'case' statement");
+			talloc_free(sc);
+		}
+	}
+}
+
 static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs)
 {
 	CONF_ITEM *ci;
@@ -2238,7 +2311,12 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		return NULL;
 	}
 
-	return compile_children(g, parent, unlang_ctx);
+	c = compile_children(g, parent, unlang_ctx);
+	if (!c) return NULL;
+
+	compile_switch_cases(g);
+
+	return c;
 }
 
 static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs)
@@ -2367,6 +2445,104 @@ static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CO
 	return c;
 }
 
+/** Whether expanding a tmpl could add or remove attributes
+ *
+ * Only the %{map:...} xlat edits lists as a side effect.
+ */
+static bool foreach_tmpl_may_edit(vp_tmpl_t const *vpt)
+{
+	if (!vpt) return false;
+
+	switch (vpt->type) {
+	case TMPL_TYPE_XLAT:
+	case TMPL_TYPE_XLAT_UNPARSED:
+	case TMPL_TYPE_UNPARSED:
+		return (strstr(vpt->name, "%{map:") != NULL);
+
+	default:
+		return false;
+	}
+}
+
+static bool foreach_cond_read_only(fr_cond_t *c, UNUSED void *uctx)
+{
+	switch (c->type) {
+	case COND_TYPE_EXISTS:
+		return !foreach_tmpl_may_edit(c->data.vpt);
+
+	case COND_TYPE_MAP:
+		return !foreach_tmpl_may_edit(c->data.map->lhs) && !foreach_tmpl_may_edit(c->data.map->rhs);
+
+	default:
+		return true;
+	}
+}
+
+/** Check that nothing in the body of a foreach loop can edit the list being iterated over
+ *
+ * Anything we don't know about (modules, subrequests, calls etc.) is
+ * assumed to edit the list.  Update sections are only allowed if they
+ * write to a different list.
+ *
+ * @param[in] c		first instruction in the body.
+ * @param[in] vpt	the foreach loop is iterating over.
+ * @return
+ *	- true if the list can be iterated over in place.
+ *	- false if it has to be copied.
+ */
+static bool foreach_body_read_only(unlang_t *c, vp_tmpl_t const *vpt)
+{
+	for (; c; c = c->next) {
+		unlang_group_t	*g;
+		vp_map_t	*map;
+
+		switch (c->type) {
+		case UNLANG_TYPE_BREAK:
+		case UNLANG_TYPE_RETURN:
+			continue;
+
+		case UNLANG_TYPE_IF:
+		case UNLANG_TYPE_ELSIF:
+			g = unlang_generic_to_group(c);
+			if (g->cond && !fr_cond_walk(g->cond, foreach_cond_read_only, NULL)) return false;
+			break;
+
+		case UNLANG_TYPE_SWITCH:
+		case UNLANG_TYPE_CASE:
+		case UNLANG_TYPE_FOREACH:
+			g = unlang_generic_to_group(c);
+			if (foreach_tmpl_may_edit(g->vpt)) return false;
+			break;
+
+		case UNLANG_TYPE_GROUP:
+		case UNLANG_TYPE_ELSE:
+		case UNLANG_TYPE_POLICY:
+			g = unlang_generic_to_group(c);
+			break;
+
+		case UNLANG_TYPE_UPDATE:
+		case UNLANG_TYPE_FILTER:
+			g = unlang_generic_to_group(c);
+			for (map = g->map; map; map = map->next) {
+				if (!tmpl_is_attr(map->lhs) && !tmpl_is_attr_unparsed(map->lhs) &&
+				    !tmpl_is_list(map->lhs)) return false;
+
+				if (tmpl_list(map->lhs) == tmpl_list(vpt)) return false;
+
+				if (foreach_tmpl_may_edit(map->rhs)) return false;
+			}
+			continue;
+
+		default:
+			return false;
+		}
+
+		if (!foreach_body_read_only(g->children, vpt)) return false;
+	}
+
+	return true;
+}
+
 static unlang_t *compile_foreach(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs)
 {
 	fr_token_t		type;
@@ -2453,6 +2629,7 @@ static unlang_t *compile_foreach(unlang_t *parent, unlang_compile_t *unlang_ctx,
 
 	g = unlang_generic_to_group(c);
 	g->vpt = vpt;
+	g->live = foreach_body_read_only(g->children, vpt);
 
 	return c;
 }
@@ -2871,6 +3048,20 @@ static unlang_t *compile_load_balance_subsection(unlang_t *parent, unlang_compil
 		case TMPL_TYPE_EXEC:
 			break;
 		}
+
+	/*
+	 *	Un-keyed sections pick children using their recent
+	 *	latency, load, and error rate.
+	 */
+	} else {
+		int i;
+
+		MEM(g->lb_stats = talloc_zero_array(g, unlang_load_balance_stats_t, g->num_children));
+		for (i = 0; i < g->num_children; i++) {
+			atomic_init(&g->lb_stats[i].outstanding, 0);
+			atomic_init(&g->lb_stats[i].latency, 0);
+			atomic_init(&g->lb_stats[i].errors, 0);
+		}
 	}
 
 	return c;
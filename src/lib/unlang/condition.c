@@ -65,11 +65,14 @@ static unlang_action_t unlang_if(REQUEST *request, rlm_rcode_t *presult)
 	/*
 	 *	Tell the main interpreter to skip over the else /
 	 *	elsif blocks, as this "if" condition was taken.
+	 *
+	 *	The compiler has already found the end of the chain.
+	 *	If we were pushed without our siblings, there's
+	 *	nothing to skip.
 	 */
-	while (frame->next &&
-	       ((frame->next->type == UNLANG_TYPE_ELSE) ||
-		(frame->next->type == UNLANG_TYPE_ELSIF))) {
-		frame->next = frame->next->next;
+	if (frame->next) {
+		fr_assert(frame->next == instruction->next);
+		frame->next = g->chain_next;
 	}
 
 	/*
@@ -49,7 +49,8 @@ typedef struct {
 	fr_cursor_t		cursor;				//!< Used to track our place in the list
 								///< we're iterating over.
 	VALUE_PAIR 		*vps;				//!< List containing the attribute(s) we're
-								///< iterating over.
+								///< iterating over.  NULL if we're iterating
+								///< over the request's list in place.
 	VALUE_PAIR		*variable;			//!< Attribute we update the value of.
 	int			depth;				//!< Level of nesting of this foreach loop.
 #ifndef NDEBUG
@@ -157,22 +158,36 @@ static unlang_action_t unlang_foreach(REQUEST *request, rlm_rcode_t *presult)
 
 	MEM(frame->state = foreach = talloc_zero(stack, unlang_frame_state_foreach_t));
 
+	/*
+	 *	Nothing in the body can add or remove VPs in the set
+	 *	we're iterating over, so walk over the request's list
+	 *	directly.  The cursor stays valid for the whole loop.
+	 */
+	if (g->live) {
+		if (!tmpl_cursor_init(NULL, &foreach->cursor, request, g->vpt)) {	/* nothing to loop over */
+			*presult = RLM_MODULE_NOOP;
+			return UNLANG_ACTION_CALCULATE_RESULT;
+		}
+
 	/*
 	 *	Copy the VPs from the original request, this ensures deterministic
 	 *	behaviour if someone decides to add or remove VPs in the set we're
 	 *	iterating over.
 	 */
-	if (tmpl_copy_vps(frame->state, &vps, request, g->vpt) < 0) {	/* nothing to loop over */
-		*presult = RLM_MODULE_NOOP;
-		return UNLANG_ACTION_CALCULATE_RESULT;
-	}
+	} else {
+		if (tmpl_copy_vps(frame->state, &vps, request, g->vpt) < 0) {	/* nothing to loop over */
+			*presult = RLM_MODULE_NOOP;
+			return UNLANG_ACTION_CALCULATE_RESULT;
+		}
 
-	fr_assert(vps != NULL);
+		fr_assert(vps != NULL);
+
+		foreach->vps = vps;
+		fr_cursor_talloc_init(&foreach->cursor, &foreach->vps, VALUE_PAIR);
+	}
 
 	foreach->request = request;
 	foreach->depth = foreach_depth;
-	foreach->vps = vps;
-	fr_cursor_talloc_init(&foreach->cursor, &foreach->vps, VALUE_PAIR);
 #ifndef NDEBUG
 	foreach->indent = request->log.unlang_indent;
 #endif
@@ -28,10 +28,14 @@ RCSID("$Id$")
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/cond.h>
 #include <freeradius-devel/unlang/xlat.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#include <pthread.h>
 
 #include "unlang_priv.h"
 #include "parallel_priv.h"
 #include "module_priv.h"
+#include "profile_priv.h"
 
 static fr_table_num_ordered_t const unlang_action_table[] = {
 	{ "unwind", 		UNLANG_ACTION_UNWIND },
@@ -50,6 +54,32 @@ static fr_table_num_ordered_t const unlang_frame_action_table[] = {
 };
 static size_t unlang_frame_action_table_len = NUM_ELEMENTS(unlang_frame_action_table);
 
+/** Latency histogram for one section, in one thread
+ *
+ */
+typedef struct {
+	unlang_t const		*instruction;	//!< The section this histogram is for.
+	fr_time_histogram_t	latency;	//!< Time from pushing the section, to popping it.
+} unlang_section_latency_t;
+
+/** All of the section latency histograms for one thread
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in section_latency_list.
+	rbtree_t		*tree;		//!< Of #unlang_section_latency_t, keyed by instruction.
+} unlang_section_latency_thread_t;
+
+static _Thread_local unlang_section_latency_thread_t *section_latency;
+
+/** Every thread's section latency trees
+ *
+ * The mutex is only taken when a thread first runs a section, and when
+ * the histograms are merged.  Recording a value needs no locks.
+ */
+static fr_dlist_head_t section_latency_list;
+static pthread_mutex_t section_latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 #ifndef NDEBUG
 static void instruction_dump(REQUEST *request, unlang_t const *instruction)
 {
@@ -374,6 +404,83 @@ static inline void frame_next(unlang_stack_t *stack, unlang_stack_frame_t *frame
  *
  * @param[in] stack	frame to pop.
  */
+static int section_latency_cmp(void const *one, void const *two)
+{
+	unlang_section_latency_t const *a = one, *b = two;
+
+	return (a->instruction > b->instruction) - (a->instruction < b->instruction);
+}
+
+static void _section_latency_free_on_exit(void *arg)
+{
+	unlang_section_latency_thread_t *slt = talloc_get_type_abort(arg, unlang_section_latency_thread_t);
+
+	pthread_mutex_lock(&section_latency_mutex);
+	fr_dlist_remove(&section_latency_list, slt);
+	pthread_mutex_unlock(&section_latency_mutex);
+
+	talloc_free(slt);
+}
+
+/** Record how long a section took to run in this thread's histogram for it
+ *
+ */
+static void section_latency_add(unlang_t const *instruction, fr_time_delta_t delta)
+{
+	unlang_section_latency_thread_t	*slt = section_latency;
+	unlang_section_latency_t	*sl;
+
+	if (unlikely(!slt)) {
+		MEM(slt = talloc_zero(NULL, unlang_section_latency_thread_t));
+		MEM(slt->tree = rbtree_talloc_alloc(slt, section_latency_cmp, unlang_section_latency_t,
+						    NULL, RBTREE_FLAG_NONE));
+
+		pthread_mutex_lock(&section_latency_mutex);
+		fr_dlist_insert_tail(&section_latency_list, slt);
+		pthread_mutex_unlock(&section_latency_mutex);
+
+		fr_thread_local_set_destructor(section_latency, _section_latency_free_on_exit, slt);
+	}
+
+	sl = rbtree_finddata(slt->tree, &(unlang_section_latency_t){ .instruction = instruction });
+	if (unlikely(!sl)) {
+		MEM(sl = talloc_zero(slt->tree, unlang_section_latency_t));
+		sl->instruction = instruction;
+
+		pthread_mutex_lock(&section_latency_mutex);
+		rbtree_insert(slt->tree, sl);
+		pthread_mutex_unlock(&section_latency_mutex);
+	}
+
+	fr_time_histogram_add(&sl->latency, delta);
+}
+
+/** Merge the latency histograms for a section from all threads
+ *
+ * @param[out] out	Where to write the merged histogram.
+ * @param[in] cs	Section which was compiled, and run with
+ *			#unlang_interpret_push_section.
+ */
+void unlang_interpret_section_latency(fr_time_histogram_t *out, CONF_SECTION const *cs)
+{
+	unlang_section_latency_thread_t	*slt = NULL;
+	unlang_section_latency_t	find;
+
+	memset(out, 0, sizeof(*out));
+
+	find.instruction = cf_data_value(cf_data_find(cs, unlang_group_t, NULL));
+	if (!find.instruction) return;
+
+	pthread_mutex_lock(&section_latency_mutex);
+	while ((slt = fr_dlist_next(&section_latency_list, slt))) {
+		unlang_section_latency_t *sl;
+
+		sl = rbtree_finddata(slt->tree, &find);
+		if (sl) fr_time_histogram_merge(out, &sl->latency);
+	}
+	pthread_mutex_unlock(&section_latency_mutex);
+}
+
 static inline void frame_pop(unlang_stack_t *stack)
 {
 	unlang_stack_frame_t *frame;
@@ -382,6 +489,8 @@ static inline void frame_pop(unlang_stack_t *stack)
 
 	frame = &stack->frame[stack->depth];
 
+	if (frame->section) section_latency_add(frame->section, fr_time() - frame->section_start);
+
 	frame_cleanup(frame);
 
 	frame = &stack->frame[--stack->depth];
@@ -425,7 +534,9 @@ static inline unlang_frame_action_t frame_eval(REQUEST *request, unlang_stack_fr
 	 */
 	while (frame->instruction) {
 		unlang_t const		*instruction = frame->instruction;
+		unlang_op_t const	*op = &unlang_ops[instruction->type];
 		unlang_action_t		action = UNLANG_ACTION_UNWIND;
+		unlang_profile_sample_t	sample;
 
 		DUMP_STACK;
 
@@ -460,7 +571,7 @@ static inline unlang_frame_action_t frame_eval(REQUEST *request, unlang_stack_fr
 			return UNLANG_FRAME_ACTION_POP;
 		}
 
-		if (!is_repeatable(frame) && (unlang_ops[instruction->type].debug_braces)) {
+		if (!is_repeatable(frame) && (op->debug_braces)) {
 			RDEBUG2("%s {", instruction->debug_name);
 			RINDENT();
 		}
@@ -469,10 +580,21 @@ static inline unlang_frame_action_t frame_eval(REQUEST *request, unlang_stack_fr
 		 *	Execute an operation
 		 */
 		RDEBUG4("** [%i] %s >> %s", stack->depth, __FUNCTION__,
-			unlang_ops[instruction->type].name);
+			op->name);
 
 		fr_assert(frame->interpret != NULL);
-		action = frame->interpret(request, result);
+		if (unlikely(request->traced)) {
+			fr_time_t started = fr_time();
+
+			action = frame->interpret(request, result);
+			fr_trace_instruction(request, instruction->debug_name, stack->depth, action,
+					     *result, fr_time() - started);
+		} else if (unlikely(unlang_profile_start(&sample))) {
+			action = frame->interpret(request, result);
+			unlang_profile_instruction(instruction, &sample);
+		} else {
+			action = frame->interpret(request, result);
+		}
 
 		RDEBUG4("** [%i] %s << %s (%d)", stack->depth, __FUNCTION__,
 			fr_table_str_by_value(unlang_action_table, action, "<INVALID>"), *priority);
@@ -565,7 +687,7 @@ static inline unlang_frame_action_t frame_eval(REQUEST *request, unlang_stack_fr
 
 			repeatable_clear(frame);
 
-			if (unlang_ops[instruction->type].debug_braces) {
+			if (op->debug_braces) {
 				REXDENT();
 
 				/*
@@ -592,7 +714,7 @@ static inline unlang_frame_action_t frame_eval(REQUEST *request, unlang_stack_fr
 		 *	Execute the next instruction in this frame
 		 */
 		case UNLANG_ACTION_EXECUTE_NEXT:
-			if ((action == UNLANG_ACTION_EXECUTE_NEXT) && unlang_ops[instruction->type].debug_braces) {
+			if ((action == UNLANG_ACTION_EXECUTE_NEXT) && op->debug_braces) {
 				REXDENT();
 				RDEBUG2("}");
 			}
@@ -817,6 +939,20 @@ void unlang_interpret_push_section(REQUEST *request, CONF_SECTION *cs, rlm_rcode
 
 
 	unlang_interpret_push_instruction(request, instruction, default_rcode, top_frame);
+
+	/*
+	 *	Time the section, so we can see which parts
+	 *	of a virtual server are slow.
+	 */
+	if (instruction) {
+		unlang_stack_t		*stack = request->stack;
+		unlang_stack_frame_t	*frame = &stack->frame[stack->depth];
+
+		if (frame->instruction == instruction) {
+			frame->section = instruction;
+			frame->section_start = fr_time();
+		}
+	}
 }
 
 /** Push an instruction onto the request stack for later interpretation.
@@ -1328,5 +1464,7 @@ static ssize_t unlang_interpret_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t
 
 void unlang_interpret_init(void)
 {
+	fr_dlist_init(&section_latency_list, unlang_section_latency_thread_t, entry);
+
 	(void) xlat_register(NULL, "interpreter", unlang_interpret_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, true);
 }
@@ -121,6 +121,8 @@ rlm_rcode_t	unlang_interpret_stack_result(REQUEST *request);
 
 TALLOC_CTX	*unlang_interpret_frame_talloc_ctx(REQUEST *request);
 
+void		unlang_interpret_section_latency(fr_time_histogram_t *out, CONF_SECTION const *cs) CC_HINT(nonnull);
+
 void		unlang_interpret_init(void);
 #ifdef __cplusplus
 }
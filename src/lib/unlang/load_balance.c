@@ -24,11 +24,164 @@
  */
 #include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/rand.h>
+#include <float.h>
 #include "unlang_priv.h"
 #include "module_priv.h"
 
 #define unlang_redundant_load_balance unlang_load_balance
 
+/** How quickly the moving averages follow new samples, as a power of two
+ *
+ * Each sample contributes 1/8th of the new value.
+ */
+#define LB_EWMA_SHIFT		(3)
+
+/** Scale of the error rate moving average
+ */
+#define LB_ERROR_SCALE		(1024)
+
+/** Find the statistics for a child of a load-balance section
+ *
+ */
+static unlang_load_balance_stats_t *lb_stats_find(unlang_group_t *g, unlang_t *child)
+{
+	unlang_t	*this;
+	int		i = 0;
+
+	if (!g->lb_stats) return NULL;
+
+	for (this = g->children; this; this = this->next, i++) {
+		if (this == child) return &g->lb_stats[i];
+	}
+
+	return NULL;
+}
+
+/** Stop tracking a child which didn't finish, e.g. because the request was cancelled
+ *
+ */
+static int _lb_state_free(unlang_frame_state_redundant_t *redundant)
+{
+	if (redundant->stats) atomic_fetch_sub_explicit(&redundant->stats->outstanding, 1, memory_order_relaxed);
+
+	return 0;
+}
+
+/** Record that a child is about to be run
+ *
+ */
+static void lb_stats_start(unlang_group_t *g, unlang_frame_state_redundant_t *redundant, unlang_t *child)
+{
+	redundant->stats = lb_stats_find(g, child);
+	if (!redundant->stats) return;
+
+	talloc_set_destructor(redundant, _lb_state_free);
+	redundant->started = fr_time();
+	atomic_fetch_add_explicit(&redundant->stats->outstanding, 1, memory_order_relaxed);
+}
+
+/** Update the moving averages for the child which just finished
+ *
+ */
+static void lb_stats_done(unlang_frame_state_redundant_t *redundant, rlm_rcode_t rcode)
+{
+	unlang_load_balance_stats_t	*stats = redundant->stats;
+	int64_t				latency, errors;
+
+	if (!stats) return;
+	redundant->stats = NULL;
+
+	atomic_fetch_sub_explicit(&stats->outstanding, 1, memory_order_relaxed);
+
+	/*
+	 *	Racing updates from other threads may lose a sample,
+	 *	which doesn't matter for an average.
+	 */
+	latency = atomic_load_explicit(&stats->latency, memory_order_relaxed);
+	latency += ((int64_t)(fr_time() - redundant->started) - latency) >> LB_EWMA_SHIFT;
+	atomic_store_explicit(&stats->latency, latency, memory_order_relaxed);
+
+	errors = atomic_load_explicit(&stats->errors, memory_order_relaxed);
+	errors += (((rcode == RLM_MODULE_FAIL) ? LB_ERROR_SCALE : 0) - errors) >> LB_EWMA_SHIFT;
+	atomic_store_explicit(&stats->errors, errors, memory_order_relaxed);
+}
+
+/** How expensive it would be to send a request to a child
+ *
+ * Lower is better.  Each request already in progress adds another
+ * average latency, and a child which always fails costs five times
+ * as much as one which never does.
+ */
+static double lb_stats_cost(unlang_load_balance_stats_t *stats)
+{
+	double	outstanding, latency, errors;
+
+	outstanding = atomic_load_explicit(&stats->outstanding, memory_order_relaxed);
+	latency = atomic_load_explicit(&stats->latency, memory_order_relaxed);
+	errors = atomic_load_explicit(&stats->errors, memory_order_relaxed);
+
+	return (outstanding + 1) * (latency + 1) * (1 + ((4 * errors) / LB_ERROR_SCALE));
+}
+
+/** How expensive it would be to send a request to a child
+ *
+ * If the child is a call to a module which reports its own health,
+ * e.g. rlm_radius, that is used instead of what we measured.  The
+ * module can see things we can't, such as lost packets and failed
+ * Status-Server checks.  Its weight also lets it ramp traffic up
+ * slowly after recovering.
+ */
+static double lb_child_cost(unlang_load_balance_stats_t *stats, unlang_t *child)
+{
+	unlang_module_t		*single;
+	module_instance_t	*mi;
+	module_health_t		health;
+	double			cost;
+
+	if (child->type != UNLANG_TYPE_MODULE) return lb_stats_cost(stats);
+
+	single = unlang_generic_to_module(child);
+	mi = single->module_instance;
+
+	if (!mi->module->health || (mi->module->health(mi->dl_inst->data, &health) < 0)) return lb_stats_cost(stats);
+
+	if (!health.weight) return DBL_MAX;
+
+	cost = ((double) health.outstanding + 1) * ((double) health.latency + 1) *
+	       (1 + ((4 * (double) health.loss) / LB_ERROR_SCALE));
+
+	return (cost * LB_ERROR_SCALE) / health.weight;
+}
+
+/** Pick a child using "power of two choices"
+ *
+ * Two different children are chosen at random, and the one with the
+ * lower cost is used.  This avoids sending everything to whichever
+ * child looks best right now, while still steering load away from
+ * children which are slow, busy, or failing.
+ */
+static unlang_t *lb_choose(unlang_group_t *g)
+{
+	uint32_t	a, b, i;
+	unlang_t	*this, *first = NULL, *second = NULL;
+
+	if (g->num_children == 1) return g->children;
+
+	a = fr_rand() % g->num_children;
+	b = fr_rand() % (g->num_children - 1);
+	if (b >= a) b++;
+
+	for (this = g->children, i = 0; this; this = this->next, i++) {
+		if (i == a) first = this;
+		if (i == b) second = this;
+	}
+	fr_assert(first && second);
+
+	if (lb_child_cost(&g->lb_stats[b], second) < lb_child_cost(&g->lb_stats[a], first)) return second;
+
+	return first;
+}
+
 static unlang_action_t unlang_load_balance_next(REQUEST *request, rlm_rcode_t *presult)
 {
 	unlang_stack_t			*stack = request->stack;
@@ -59,12 +212,16 @@ static unlang_action_t unlang_load_balance_next(REQUEST *request, rlm_rcode_t *p
 		 *	back to the found one, then we're done.
 		 */
 		if (redundant->child == redundant->found) {
+			lb_stats_done(redundant, *presult);
+
 			/* DON'T change presult, as it is taken from the child */
 			return UNLANG_ACTION_CALCULATE_RESULT;
 		}
 
 		RDEBUG4("%s resuming", frame->instruction->debug_name);
 
+		lb_stats_done(redundant, *presult);
+
 		/*
 		 *	We are in a resumed frame.  The module we
 		 *	chose failed, so we have to go through the
@@ -86,6 +243,7 @@ static unlang_action_t unlang_load_balance_next(REQUEST *request, rlm_rcode_t *p
 	/*
 	 *	Push the child, and yield for a later return.
 	 */
+	lb_stats_start(g, redundant, redundant->child);
 	unlang_interpret_push(request, redundant->child, frame->result, UNLANG_NEXT_STOP, UNLANG_SUB_FRAME);
 
 	/*
@@ -106,6 +264,23 @@ static unlang_action_t unlang_load_balance_next(REQUEST *request, rlm_rcode_t *p
 	return UNLANG_ACTION_PUSHED_CHILD;
 }
 
+/** Record how the child of a plain "load-balance" section did
+ *
+ */
+static unlang_action_t unlang_load_balance_done(REQUEST *request, rlm_rcode_t *presult)
+{
+	unlang_stack_t			*stack = request->stack;
+	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_frame_state_redundant_t	*redundant;
+
+	redundant = talloc_get_type_abort(frame->state, unlang_frame_state_redundant_t);
+
+	lb_stats_done(redundant, *presult);
+
+	/* DON'T change presult, as it is taken from the child */
+	return UNLANG_ACTION_CALCULATE_RESULT;
+}
+
 static unlang_action_t unlang_load_balance(REQUEST *request, rlm_rcode_t *presult)
 {
 	unlang_stack_t			*stack = request->stack;
@@ -199,23 +374,19 @@ static unlang_action_t unlang_load_balance(REQUEST *request, rlm_rcode_t *presul
 	randomly_choose:
 		count = 0;
 
+		/*
+		 *	Sections without a key pick a child using the
+		 *	statistics gathered from previous requests.
+		 */
+		if (g->lb_stats) {
+			redundant->found = lb_choose(g);
+
 		/*
 		 *	Choose a child at random.
-		 *
-		 *	@todo - leverage the "power of 2", as per
-		 *      lib/io/network.c.  This is good enough for
-		 *      most purposes.  However, in order to do this,
-		 *      we need to track active callers across
-		 *      *either* multiple modules in one thread, *or*
-		 *      across multiple threads.
-		 *
-		 *	We don't have thread-specific instance data
-		 *	for this load-balance section.  So for now,
-		 *	just pick a random child.
 		 */
-		for (redundant->child = redundant->found = g->children;
-		     redundant->child != NULL;
-		     redundant->child = redundant->child->next) {
+		} else for (redundant->child = redundant->found = g->children;
+			    redundant->child != NULL;
+			    redundant->child = redundant->child->next) {
 			count++;
 
 			if ((count * (fr_rand() & 0xffffff)) < (uint32_t) 0x1000000) {
@@ -228,8 +399,18 @@ static unlang_action_t unlang_load_balance(REQUEST *request, rlm_rcode_t *presul
 	 *	Plain "load-balance".  Just do one child.
 	 */
 	if (instruction->type == UNLANG_TYPE_LOAD_BALANCE) {
+		lb_stats_start(g, redundant, redundant->found);
 		unlang_interpret_push(request, redundant->found,
 				      frame->result, UNLANG_NEXT_STOP, UNLANG_SUB_FRAME);
+
+		/*
+		 *	Come back when the child is done, so we
+		 *	know how long it took.
+		 */
+		if (redundant->stats) {
+			frame->interpret = unlang_load_balance_done;
+			repeatable_set(frame);
+		}
 		return UNLANG_ACTION_PUSHED_CHILD;
 	}
 
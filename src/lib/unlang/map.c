@@ -78,7 +78,6 @@ static unlang_action_t list_mod_apply(REQUEST *request, rlm_rcode_t *presult)
 	unlang_stack_t			*stack = request->stack;
 	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
 	unlang_frame_state_update_t	*update_state = frame->state;
-	vp_list_mod_t const		*vlm;
 
 	/*
 	 *	No modifications...
@@ -92,18 +91,11 @@ static unlang_action_t list_mod_apply(REQUEST *request, rlm_rcode_t *presult)
 	 *	Apply the list of modifications.  This should not fail
 	 *	except on memory allocation error.
 	 */
-	for (vlm = update_state->vlm_head;
-	     vlm;
-	     vlm = vlm->next) {
-		int ret;
+	if (!fr_cond_assert(map_list_mod_apply_all(request, update_state->vlm_head) == 0)) {
+		TALLOC_FREE(frame->state);
 
-		ret = map_list_mod_apply(request, vlm);
-		if (!fr_cond_assert(ret == 0)) {
-			TALLOC_FREE(frame->state);
-
-			*presult = RLM_MODULE_FAIL;
-			return UNLANG_ACTION_CALCULATE_RESULT;
-		}
+		*presult = RLM_MODULE_FAIL;
+		return UNLANG_ACTION_CALCULATE_RESULT;
 	}
 
 done:
@@ -30,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/request_data.h>
+#include <freeradius-devel/server/trace.h>
 #include <freeradius-devel/unlang/base.h>
 #include "unlang_priv.h"
 #include "module_priv.h"
@@ -684,6 +685,10 @@ static unlang_action_t unlang_module_resume(REQUEST *request, rlm_rcode_t *presu
 	}
 
 	state->thread->active_callers--;
+	fr_time_histogram_add(&state->thread->latency, fr_time() - state->started);
+	if (unlikely(request->traced)) {
+		fr_trace_module(request, sp->module_instance->name, rcode, fr_time() - state->started);
+	}
 
 	/*
 	 *	The module is done.  But, running it pushed one or
@@ -795,6 +800,7 @@ static unlang_action_t unlang_module(REQUEST *request, rlm_rcode_t *presult)
 	 *	For logging unresponsive children.
 	 */
 	state->thread->total_calls++;
+	state->started = fr_time();
 
 	caller = request->module;
 	request->module = sp->module_instance->name;
@@ -834,6 +840,11 @@ static unlang_action_t unlang_module(REQUEST *request, rlm_rcode_t *presult)
 		return UNLANG_ACTION_YIELD;
 	}
 
+	fr_time_histogram_add(&state->thread->latency, fr_time() - state->started);
+	if (unlikely(request->traced)) {
+		fr_trace_module(request, sp->module_instance->name, rcode, fr_time() - state->started);
+	}
+
 done:
 	fr_assert(unlang_indent == request->log.unlang_indent);
 	fr_assert(rcode >= RLM_MODULE_REJECT);
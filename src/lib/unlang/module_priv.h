@@ -49,6 +49,7 @@ typedef struct {
 	void				*rctx;			//!< for resume / signal
 	fr_unlang_module_resume_t	resume;			//!< resumption handler
 	fr_unlang_module_signal_t	signal;			//!< for signal handlers
+	fr_time_t			started;		//!< When the module was called, for latency tracking.
 } unlang_frame_state_module_t;
 
 static inline unlang_module_t *unlang_generic_to_module(unlang_t *p)
@@ -0,0 +1,522 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file unlang/profile.c
+ * @brief Sampling profiler for unlang instructions, modules and xlats.
+ *
+ * When enabled, one in every N calls into an instruction or xlat
+ * function is timed, using both the wall clock, and the CPU time of
+ * the calling thread.  Time spent yielded isn't included, as each
+ * resumption is a separate call.  Times are inclusive, so an instruction
+ * which expands an xlat includes the time taken by the xlat.
+ *
+ * Samples are recorded in a per-thread tree without locks.  The trees
+ * are merged when the results are requested from radmin.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/unlang/profile.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#include <pthread.h>
+#include <time.h>
+
+#include "profile_priv.h"
+#include "module_priv.h"
+#include "xlat_priv.h"
+
+/** Default sampling rate for "set profile on"
+ */
+#define PROFILE_RATE_DEFAULT	(100)
+
+/** Default number of entries shown by "show profile ..."
+ */
+#define PROFILE_TOP_DEFAULT	(20)
+
+typedef enum {
+	PROFILE_INSTRUCTION = 0,			//!< Key is an #unlang_t.
+	PROFILE_XLAT,					//!< Key is an #xlat_t.
+	PROFILE_MODULE					//!< Key is a #module_instance_t, only used
+							///< when merging.
+} unlang_profile_type_t;
+
+/** Samples for one instruction or xlat function
+ *
+ */
+typedef struct {
+	void const		*key;			//!< What was called.
+	unlang_profile_type_t	type;			//!< What type of thing the key is.
+
+	uint64_t		samples;		//!< Number of calls sampled.
+	fr_time_delta_t		wall;			//!< Total wall clock time of the sampled calls.
+	fr_time_delta_t		cpu;			//!< Total CPU time of the sampled calls.
+} unlang_profile_entry_t;
+
+/** All of the samples for one thread
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in profile_list.
+	uint32_t		generation;		//!< Which profile the samples belong to.
+	rbtree_t		*tree;			//!< Of #unlang_profile_entry_t.
+} unlang_profile_thread_t;
+
+/** One in this many calls are sampled, or 0 if sampling is disabled
+ */
+atomic_uint_fast32_t		unlang_profile_rate;
+
+/** Calls left before this thread takes its next sample
+ */
+_Thread_local uint32_t		unlang_profile_countdown;
+
+/** Incremented to discard all existing samples
+ *
+ * Each thread discards its own samples when it notices the change, so
+ * that no other thread has to write to its tree.
+ */
+static atomic_uint_fast32_t	profile_generation;
+
+static _Thread_local unlang_profile_thread_t *profile_thread;
+
+/** Every thread's samples
+ *
+ * The mutex is only taken when a thread records its first sample for
+ * something, and when the samples are merged.
+ */
+static fr_dlist_head_t		profile_list;
+static pthread_mutex_t		profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int profile_entry_cmp(void const *one, void const *two)
+{
+	unlang_profile_entry_t const *a = one, *b = two;
+
+	if (a->type != b->type) return (a->type > b->type) - (a->type < b->type);
+
+	return (a->key > b->key) - (a->key < b->key);
+}
+
+static inline fr_time_delta_t profile_cpu_time(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0) return 0;
+
+	return fr_time_delta_from_timespec(&ts);
+}
+
+/** Record the start times of a sampled call
+ *
+ * @param[out] sample	to write the start times to.
+ */
+void unlang_profile_sample_start(unlang_profile_sample_t *sample)
+{
+	sample->wall = fr_time();
+	sample->cpu = profile_cpu_time();
+}
+
+static void _profile_thread_free_on_exit(void *arg)
+{
+	unlang_profile_thread_t *pt = talloc_get_type_abort(arg, unlang_profile_thread_t);
+
+	pthread_mutex_lock(&profile_mutex);
+	fr_dlist_remove(&profile_list, pt);
+	pthread_mutex_unlock(&profile_mutex);
+
+	talloc_free(pt);
+}
+
+/** Add a sample to this thread's entry for an instruction or xlat
+ *
+ */
+static void profile_record(unlang_profile_type_t type, void const *key, unlang_profile_sample_t const *sample)
+{
+	unlang_profile_thread_t	*pt = profile_thread;
+	unlang_profile_entry_t	*pe;
+	fr_time_delta_t		wall, cpu;
+	uint32_t		generation;
+
+	wall = fr_time() - sample->wall;
+	cpu = profile_cpu_time() - sample->cpu;
+
+	if (unlikely(!pt)) {
+		MEM(pt = talloc_zero(NULL, unlang_profile_thread_t));
+
+		pthread_mutex_lock(&profile_mutex);
+		fr_dlist_insert_tail(&profile_list, pt);
+		pthread_mutex_unlock(&profile_mutex);
+
+		fr_thread_local_set_destructor(profile_thread, _profile_thread_free_on_exit, pt);
+	}
+
+	/*
+	 *	The samples have been cleared, or this is the
+	 *	first one.  Start a new tree.
+	 */
+	generation = atomic_load_explicit(&profile_generation, memory_order_relaxed);
+	if (unlikely(!pt->tree || (pt->generation != generation))) {
+		rbtree_t *tree;
+
+		MEM(tree = rbtree_talloc_alloc(pt, profile_entry_cmp, unlang_profile_entry_t,
+					       NULL, RBTREE_FLAG_NONE));
+
+		pthread_mutex_lock(&profile_mutex);
+		talloc_free(pt->tree);
+		pt->tree = tree;
+		pt->generation = generation;
+		pthread_mutex_unlock(&profile_mutex);
+	}
+
+	pe = rbtree_finddata(pt->tree, &(unlang_profile_entry_t){ .type = type, .key = key });
+	if (unlikely(!pe)) {
+		MEM(pe = talloc_zero(pt->tree, unlang_profile_entry_t));
+		pe->type = type;
+		pe->key = key;
+
+		pthread_mutex_lock(&profile_mutex);
+		rbtree_insert(pt->tree, pe);
+		pthread_mutex_unlock(&profile_mutex);
+	}
+
+	pe->samples++;
+	pe->wall += wall;
+	pe->cpu += cpu;
+}
+
+/** Record a sampled call into an instruction
+ *
+ * @param[in] instruction	which was called.
+ * @param[in] sample		start times from #unlang_profile_start.
+ */
+void unlang_profile_instruction(unlang_t const *instruction, unlang_profile_sample_t const *sample)
+{
+	profile_record(PROFILE_INSTRUCTION, instruction, sample);
+}
+
+/** Record a sampled call into an xlat function
+ *
+ * @param[in] xlat		which was called.
+ * @param[in] sample		start times from #unlang_profile_start.
+ */
+void unlang_profile_xlat(xlat_t const *xlat, unlang_profile_sample_t const *sample)
+{
+	profile_record(PROFILE_XLAT, xlat, sample);
+}
+
+/** Arguments for merging per-thread entries
+ *
+ */
+typedef struct {
+	unlang_profile_type_t	type;			//!< What we're reporting on.
+	rbtree_t		*merged;		//!< Of #unlang_profile_entry_t.
+} unlang_profile_merge_t;
+
+static int _profile_merge(void *data, void *uctx)
+{
+	unlang_profile_entry_t const	*pe = data;
+	unlang_profile_merge_t		*pm = uctx;
+	unlang_profile_entry_t		find, *out;
+
+	find = (unlang_profile_entry_t){ .type = pm->type, .key = pe->key };
+
+	/*
+	 *	Modules are reported by adding up all of
+	 *	the instructions which call them.
+	 */
+	if (pm->type == PROFILE_MODULE) {
+		unlang_t *instruction;
+
+		if (pe->type != PROFILE_INSTRUCTION) return 0;
+
+		memcpy(&instruction, &pe->key, sizeof(instruction)); /* const issues */
+		if (instruction->type != UNLANG_TYPE_MODULE) return 0;
+
+		find.key = unlang_generic_to_module(instruction)->module_instance;
+
+	} else if (pe->type != pm->type) {
+		return 0;
+	}
+
+	out = rbtree_finddata(pm->merged, &find);
+	if (!out) {
+		MEM(out = talloc_zero(pm->merged, unlang_profile_entry_t));
+		*out = find;
+		rbtree_insert(pm->merged, out);
+	}
+
+	out->samples += pe->samples;
+	out->wall += pe->wall;
+	out->cpu += pe->cpu;
+
+	return 0;
+}
+
+static int _profile_flatten(void *data, void *uctx)
+{
+	unlang_profile_entry_t	***p = uctx;
+
+	**p = data;
+	(*p)++;
+
+	return 0;
+}
+
+static int profile_cpu_cmp(void const *one, void const *two)
+{
+	unlang_profile_entry_t const *a = *(unlang_profile_entry_t const * const *) one;
+	unlang_profile_entry_t const *b = *(unlang_profile_entry_t const * const *) two;
+
+	return (a->cpu < b->cpu) - (a->cpu > b->cpu);
+}
+
+/** Print the name of an instruction, with the names of the sections it's in
+ *
+ */
+static void profile_instruction_fprint(FILE *fp, unlang_t const *instruction)
+{
+	unlang_t const	*path[8];
+	int		i, depth = 0;
+
+	while (instruction && (depth < (int) NUM_ELEMENTS(path))) {
+		path[depth++] = instruction;
+		instruction = instruction->parent;
+	}
+
+	if (instruction) fprintf(fp, "... > ");
+	for (i = depth - 1; i >= 0; i--) {
+		fprintf(fp, "%s%s", path[i]->debug_name, i ? " > " : "");
+	}
+}
+
+/** Merge all the threads' samples, and print the hottest entries
+ *
+ */
+static int profile_show(FILE *fp, FILE *fp_err, unlang_profile_type_t type, fr_cmd_info_t const *info)
+{
+	unlang_profile_thread_t	*pt = NULL;
+	unlang_profile_merge_t	pm = { .type = type };
+	unlang_profile_entry_t	**sorted, **p;
+	uint32_t		generation, rate;
+	unsigned long		top = PROFILE_TOP_DEFAULT;
+	size_t			i, num;
+	TALLOC_CTX		*ctx;
+
+	if (info->argc > 0) {
+		char *end;
+
+		top = strtoul(info->argv[0], &end, 10);
+		if (*end || !top) {
+			fprintf(fp_err, "Number of entries must be a positive integer\n");
+			return -1;
+		}
+	}
+
+	rate = atomic_load_explicit(&unlang_profile_rate, memory_order_relaxed);
+	if (rate) {
+		fprintf(fp, "sampling 1 in %u calls\n", rate);
+	} else {
+		fprintf(fp, "sampling is off\n");
+	}
+
+	MEM(ctx = talloc_init("profile"));
+	MEM(pm.merged = rbtree_talloc_alloc(ctx, profile_entry_cmp, unlang_profile_entry_t, NULL, RBTREE_FLAG_NONE));
+
+	generation = atomic_load_explicit(&profile_generation, memory_order_relaxed);
+
+	pthread_mutex_lock(&profile_mutex);
+	while ((pt = fr_dlist_next(&profile_list, pt))) {
+		if (!pt->tree || (pt->generation != generation)) continue;
+
+		(void) rbtree_walk(pt->tree, RBTREE_IN_ORDER, _profile_merge, &pm);
+	}
+	pthread_mutex_unlock(&profile_mutex);
+
+	num = rbtree_num_elements(pm.merged);
+	if (!num) goto done;
+
+	MEM(sorted = talloc_array(ctx, unlang_profile_entry_t *, num));
+	p = sorted;
+	(void) rbtree_walk(pm.merged, RBTREE_IN_ORDER, _profile_flatten, &p);
+	qsort(sorted, num, sizeof(sorted[0]), profile_cpu_cmp);
+
+	fprintf(fp, "%-10s %-12s %-12s %-12s %-12s %s\n",
+		"samples", "wall(us)", "cpu(us)", "wall/call(ns)", "cpu/call(ns)", "name");
+
+	for (i = 0; (i < num) && (i < top); i++) {
+		unlang_profile_entry_t const *pe = sorted[i];
+
+		fprintf(fp, "%-10" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-13" PRIu64 " %-12" PRIu64 " ",
+			pe->samples, (uint64_t) pe->wall / 1000, (uint64_t) pe->cpu / 1000,
+			(uint64_t) (pe->wall / pe->samples), (uint64_t) (pe->cpu / pe->samples));
+
+		switch (pe->type) {
+		case PROFILE_INSTRUCTION:
+			profile_instruction_fprint(fp, pe->key);
+			break;
+
+		case PROFILE_XLAT:
+			fprintf(fp, "%%{%s:}", ((xlat_t const *) pe->key)->name);
+			break;
+
+		case PROFILE_MODULE:
+			fprintf(fp, "%s", ((module_instance_t const *) pe->key)->name);
+			break;
+		}
+		fprintf(fp, "\n");
+	}
+
+done:
+	talloc_free(ctx);
+
+	return 0;
+}
+
+static int cmd_show_profile_instruction(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	return profile_show(fp, fp_err, PROFILE_INSTRUCTION, info);
+}
+
+static int cmd_show_profile_module(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	return profile_show(fp, fp_err, PROFILE_MODULE, info);
+}
+
+static int cmd_show_profile_xlat(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	return profile_show(fp, fp_err, PROFILE_XLAT, info);
+}
+
+static int cmd_set_profile_on(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	unsigned long	rate = PROFILE_RATE_DEFAULT;
+
+	if (info->argc > 0) {
+		char *end;
+
+		rate = strtoul(info->argv[0], &end, 10);
+		if (*end || !rate || (rate > UINT32_MAX)) {
+			fprintf(fp_err, "Sampling rate must be between 1 and %u\n", UINT32_MAX);
+			return -1;
+		}
+	}
+
+	/*
+	 *	Start a new profile, so that the results
+	 *	all use the same rate.
+	 */
+	atomic_fetch_add_explicit(&profile_generation, 1, memory_order_relaxed);
+	atomic_store_explicit(&unlang_profile_rate, rate, memory_order_relaxed);
+
+	fprintf(fp, "sampling 1 in %lu calls\n", rate);
+
+	return 0;
+}
+
+static int cmd_set_profile_off(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	atomic_store_explicit(&unlang_profile_rate, 0, memory_order_relaxed);
+
+	fprintf(fp, "sampling is off\n");
+
+	return 0;
+}
+
+static int cmd_set_profile_clear(UNUSED FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	atomic_fetch_add_explicit(&profile_generation, 1, memory_order_relaxed);
+
+	return 0;
+}
+
+void unlang_profile_init(void)
+{
+	fr_dlist_init(&profile_list, unlang_profile_thread_t, entry);
+}
+
+fr_cmd_table_t cmd_unlang_profile_table[] = {
+	{
+		.parent = "show",
+		.name = "profile",
+		.help = "Show the results of sampling request processing.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "show profile",
+		.name = "instruction",
+		.syntax = "[INTEGER]",
+		.func = cmd_show_profile_instruction,
+		.help = "Show the unlang instructions which used the most CPU time.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "show profile",
+		.name = "module",
+		.syntax = "[INTEGER]",
+		.func = cmd_show_profile_module,
+		.help = "Show the modules which used the most CPU time.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "show profile",
+		.name = "xlat",
+		.syntax = "[INTEGER]",
+		.func = cmd_show_profile_xlat,
+		.help = "Show the xlat functions which used the most CPU time.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "set",
+		.name = "profile",
+		.help = "Control sampling of request processing.",
+		.read_only = false,
+	},
+
+	{
+		.parent = "set profile",
+		.name = "on",
+		.syntax = "[INTEGER]",
+		.func = cmd_set_profile_on,
+		.help = "Sample one in every N calls (default 100), discarding any previous samples.",
+		.read_only = false,
+	},
+
+	{
+		.parent = "set profile",
+		.name = "off",
+		.func = cmd_set_profile_off,
+		.help = "Stop sampling.  The samples taken so far can still be shown.",
+		.read_only = false,
+	},
+
+	{
+		.parent = "set profile",
+		.name = "clear",
+		.func = cmd_set_profile_clear,
+		.help = "Discard all samples.",
+		.read_only = false,
+	},
+
+	CMD_TABLE_END
+};
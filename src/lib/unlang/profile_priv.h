@@ -0,0 +1,84 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * $Id$
+ *
+ * @file unlang/profile_priv.h
+ * @brief Sampling hooks for the interpreter and xlat evaluator.
+ *
+ * Sampling is off unless it has been enabled with "set profile on"
+ * from radmin.  When it's off, the cost of a hook is one relaxed
+ * atomic load.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+#include <freeradius-devel/unlang/xlat.h>
+#include <freeradius-devel/util/time.h>
+#include <stdatomic.h>
+
+#include "unlang_priv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Start times for one sampled call
+ *
+ */
+typedef struct {
+	fr_time_t		wall;		//!< Wall clock time at the start of the call.
+	fr_time_delta_t		cpu;		//!< Thread CPU time at the start of the call.
+} unlang_profile_sample_t;
+
+extern atomic_uint_fast32_t	unlang_profile_rate;
+extern _Thread_local uint32_t	unlang_profile_countdown;
+
+void	unlang_profile_sample_start(unlang_profile_sample_t *sample);
+
+void	unlang_profile_instruction(unlang_t const *instruction, unlang_profile_sample_t const *sample);
+
+void	unlang_profile_xlat(xlat_t const *xlat, unlang_profile_sample_t const *sample);
+
+/** Decide whether this call should be sampled, and if so, record the time
+ *
+ * One in every #unlang_profile_rate calls made by a thread is sampled.
+ *
+ * @param[out] sample	Start times, if the call is sampled.
+ * @return
+ *	- true if the call should be sampled.
+ *	- false if it shouldn't be.
+ */
+static inline bool unlang_profile_start(unlang_profile_sample_t *sample)
+{
+	uint32_t rate = atomic_load_explicit(&unlang_profile_rate, memory_order_relaxed);
+
+	if (likely(!rate)) return false;
+
+	if (unlang_profile_countdown > 1) {
+		unlang_profile_countdown--;
+		return false;
+	}
+	unlang_profile_countdown = rate;
+
+	unlang_profile_sample_start(sample);
+	return true;
+}
+
+#ifdef __cplusplus
+}
+#endif
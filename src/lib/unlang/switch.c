@@ -35,6 +35,7 @@ static unlang_action_t unlang_switch(REQUEST *request, UNUSED rlm_rcode_t *presu
 	unlang_t		*instruction = frame->instruction;
 	unlang_t		*this, *found, *null_case;
 	unlang_group_t		*g, *h;
+	unlang_switch_case_t	*match = NULL;
 	fr_cond_t		cond;
 	fr_value_box_t		data;
 	vp_map_t		map;
@@ -75,6 +76,33 @@ static unlang_action_t unlang_switch(REQUEST *request, UNUSED rlm_rcode_t *presu
 		goto do_null_case;
 	}
 
+	/*
+	 *	The compiler put the constant cases into a tree.  Look
+	 *	up each instance of the attribute, and pick whichever
+	 *	matching case was written first.
+	 */
+	if (g->case_tree) {
+		VALUE_PAIR		*vp;
+		fr_cursor_t		cursor;
+		int			err;
+		unlang_switch_case_t	*sc;
+
+		for (vp = tmpl_cursor_init(&err, &cursor, request, g->vpt);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			sc = rbtree_finddata(g->case_tree, &(unlang_switch_case_t){ .value = &vp->data });
+			if (sc && (!match || (sc->index < match->index))) match = sc;
+		}
+
+		/*
+		 *	No need to look at the cases one by one.
+		 */
+		if (!g->dynamic_cases) {
+			found = match ? match->child : g->default_case;
+			goto do_null_case;
+		}
+	}
+
 	/*
 	 *	Expand the template if necessary, so that it
 	 *	is evaluated once instead of for each 'case'
@@ -109,6 +137,19 @@ static unlang_action_t unlang_switch(REQUEST *request, UNUSED rlm_rcode_t *presu
 			continue;
 		}
 
+		/*
+		 *	Constant cases were checked above, we only
+		 *	need to know if this is the match, so that
+		 *	earlier dynamic cases take precedence.
+		 */
+		if (g->case_tree && unlang_switch_case_is_constant(g, h)) {
+			if (match && (match->child == this)) {
+				found = this;
+				break;
+			}
+			continue;
+		}
+
 		/*
 		 *	If we're switching over an attribute
 		 *	AND we haven't pre-parsed the data for
@@ -33,6 +33,12 @@
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/io/listen.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -123,6 +129,16 @@ struct unlang_s {
 	int			actions[RLM_MODULE_NUMCODES];	//!< Priorities for the various return codes.
 };
 
+/** Live statistics for one child of a load-balance section
+ *
+ * Shared between all threads, so the averages are approximate.
+ */
+typedef struct {
+	atomic_uint_fast32_t	outstanding;	//!< Requests currently being processed by the child.
+	atomic_uint_fast64_t	latency;	//!< Moving average of how long the child takes, in nanoseconds.
+	atomic_uint_fast32_t	errors;		//!< Moving average of the failure rate, 0 to 1024.
+} unlang_load_balance_stats_t;
+
 /** Generic representation of a grouping
  *
  * Can represent IF statements, maps, update sections etc...
@@ -141,7 +157,7 @@ typedef struct {
 	 */
 	union {
 		struct {
-			vp_tmpl_t		*vpt;		//!< #UNLANG_TYPE_SWITCH, #UNLANG_TYPE_MAP
+			vp_tmpl_t		*vpt;		//!< #UNLANG_TYPE_SWITCH, #UNLANG_TYPE_MAP, #UNLANG_TYPE_FOREACH
 
 			union {
 				struct {
@@ -151,6 +167,23 @@ typedef struct {
 				struct {
 					CONF_SECTION		*server_cs;	//!< #UNLANG_TYPE_CALL
 				};
+				struct {
+					unlang_load_balance_stats_t *lb_stats;	//!< #UNLANG_TYPE_LOAD_BALANCE,
+										///< #UNLANG_TYPE_REDUNDANT_LOAD_BALANCE,
+										///< one per child.
+				};
+				struct {
+					rbtree_t		*case_tree;	//!< #UNLANG_TYPE_SWITCH, constant cases
+										///< indexed by value.
+					unlang_t		*default_case;	//!< #UNLANG_TYPE_SWITCH
+					bool			dynamic_cases;	//!< #UNLANG_TYPE_SWITCH, some cases must
+										///< still be evaluated one by one.
+				};
+				struct {
+					bool			live;		//!< #UNLANG_TYPE_FOREACH, the body can't
+										///< edit the list, so it's iterated over
+										///< in place instead of being copied.
+				};
 				struct {
 					fr_dict_t const		*dict;		//!< #UNLANG_TYPE_SUBREQUEST
 					fr_dict_attr_t const	*attr_packet_type;
@@ -158,7 +191,12 @@ typedef struct {
 				};
 			};
 		};
-		fr_cond_t		*cond;		//!< #UNLANG_TYPE_IF, #UNLANG_TYPE_ELSIF.
+		struct {
+			fr_cond_t		*cond;		//!< #UNLANG_TYPE_IF, #UNLANG_TYPE_ELSIF.
+			unlang_t		*chain_next;	//!< First instruction after the else / elsif
+								///< blocks following this one.  Where execution
+								///< continues if the condition matches.
+		};
 
 		struct {				//!< #UNLANG_TYPE_PARALLEL
 			bool			clone;
@@ -167,6 +205,28 @@ typedef struct {
 	};
 } unlang_group_t;
 
+/** A constant "case" in a switch statement's case tree
+ *
+ */
+typedef struct {
+	fr_value_box_t const	*value;		//!< To match against.
+	unlang_t		*child;		//!< The "case" to execute.
+	int			index;		//!< Position of the "case" in the "switch".
+						///< So the first match wins if the attribute
+						///< has multiple instances.
+} unlang_switch_case_t;
+
+/** Whether a "case" can be found in the switch's case tree
+ *
+ * @param[in] sw	The "switch".
+ * @param[in] c		The "case".
+ */
+static inline bool unlang_switch_case_is_constant(unlang_group_t const *sw, unlang_group_t const *c)
+{
+	return tmpl_is_attr(sw->vpt) && c->vpt && tmpl_is_data(c->vpt) &&
+	       (tmpl_value(c->vpt)->type == tmpl_da(sw->vpt)->type);
+}
+
 /** A naked xlat
  *
  * @note These are vestigial and may be removed in future.
@@ -183,6 +243,9 @@ typedef struct {
 typedef struct {
 	unlang_t 		*child;
 	unlang_t		*found;
+
+	unlang_load_balance_stats_t *stats;	//!< Of the child currently being run.
+	fr_time_t		started;	//!< When the current child was pushed.
 } unlang_frame_state_redundant_t;
 
 /** Our interpreter stack, as distinct from the C stack
@@ -222,6 +285,10 @@ typedef struct {
 								///< result stored in the lower stack frame should
 								///< be replaced.
 	uint8_t			uflags;				//!< Unwind markers
+
+	unlang_t const		*section;			//!< Section pushed with #unlang_interpret_push_section,
+								///< that we're recording latency for.
+	fr_time_t		section_start;			//!< When the section was pushed.
 } unlang_stack_frame_t;
 
 /** An unlang stack associated with a request
@@ -375,6 +442,8 @@ void		unlang_return_init(void);
 
 void		unlang_parallel_init(void);
 
+void		unlang_profile_init(void);
+
 int		unlang_subrequest_op_init(void);
 
 void		unlang_subrequest_op_free(void);
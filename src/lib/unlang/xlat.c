@@ -32,6 +32,20 @@ RCSID("$Id$")
 #include <freeradius-devel/unlang/xlat_priv.h>
 #include "unlang_priv.h"	/* Fixme - Should create a proper semi-public interface for the interpret */
 
+/** One sibling in a list of xlat nodes which is being evaluated concurrently
+ *
+ */
+typedef struct {
+	xlat_exp_t const	*node;				//!< Sibling to evaluate.
+	fr_value_box_t		*args;				//!< Arguments to pass to the function.
+	fr_value_box_t		*result;			//!< Output of this sibling.
+	REQUEST			*child;				//!< Making the function call.
+	bool			expanded;			//!< Arguments have been expanded.
+	bool			started;			//!< Function call has been started.
+	bool			yielded;			//!< Function call is waiting for I/O.
+	bool			done;				//!< Result is complete.
+} unlang_xlat_call_t;
+
 /** State of an xlat expansion
  *
  * State of one level of nesting within an xlat expansion.
@@ -52,6 +66,9 @@ typedef struct {
 	xlat_func_resume_t	resume;				//!< called on resume
 	xlat_func_signal_t	signal;				//!< called on signal
 	void			*rctx;				//!< for resume / signal
+
+	unlang_xlat_call_t	*calls;				//!< Siblings being evaluated
+								///< concurrently, one per node.
 } unlang_frame_state_xlat_t;
 
 /** Wrap an #fr_event_timer_t providing data needed for unlang events
@@ -214,6 +231,260 @@ void unlang_xlat_push(TALLOC_CTX *ctx, fr_value_box_t **out,
 	state->ctx = ctx;
 }
 
+static inline bool xlat_node_yields(xlat_exp_t const *node)
+{
+	return (node->type == XLAT_FUNC) && (node->xlat->type == XLAT_FUNC_ASYNC) && node->xlat->yields;
+}
+
+/** Check whether a list of sibling nodes should be evaluated concurrently
+ *
+ * This is only worth it if two or more of the siblings are calls to
+ * functions which wait for I/O.  Every other sibling must be something
+ * we can evaluate without pushing another frame.
+ */
+static bool xlat_concurrent_eligible(xlat_exp_t const *head)
+{
+	xlat_exp_t const	*node;
+	int			yields = 0;
+
+	for (node = head; node; node = node->next) {
+		switch (node->type) {
+		case XLAT_LITERAL:
+		case XLAT_ONE_LETTER:
+		case XLAT_ATTRIBUTE:
+		case XLAT_VIRTUAL:
+#ifdef HAVE_REGEX
+		case XLAT_REGEX:
+#endif
+			continue;
+
+		case XLAT_FUNC:
+			if (!xlat_node_yields(node)) return false;
+			yields++;
+			continue;
+
+		default:
+			return false;
+		}
+	}
+
+	return (yields > 1);
+}
+
+/** Make a function call in a child request
+ *
+ * The child only makes the call, its arguments have already been
+ * expanded in the parent.  While it runs, it sees the parent's packets,
+ * so any attributes the function reads or adds are the parent's.
+ */
+static rlm_rcode_t xlat_call_run(REQUEST *request, unlang_xlat_call_t *call)
+{
+	REQUEST		*child = call->child;
+	RADIUS_PACKET	*packet = child->packet, *reply = child->reply;
+	rlm_rcode_t	rcode;
+
+	child->packet = request->packet;
+	child->reply = request->reply;
+
+	rcode = unlang_interpret(child);
+
+	child->packet = packet;
+	child->reply = reply;
+
+	return rcode;
+}
+
+/** Start a function call in a child request
+ *
+ */
+static int xlat_call_start(TALLOC_CTX *ctx, REQUEST *request, unlang_xlat_call_t *call)
+{
+	unlang_stack_t			*stack;
+	unlang_stack_frame_t		*frame;
+	unlang_frame_state_xlat_t	*state;
+	xlat_exp_t			*node;
+
+	call->child = unlang_io_subrequest_alloc(request, request->dict, false);
+	if (!call->child) return -1;
+
+	/*
+	 *	A copy of the node with no siblings and no
+	 *	arguments, so the child stops after making the
+	 *	call.  It's marked as ephemeral so that the thread
+	 *	instance data comes from the copy, and not from
+	 *	the tree (where it's indexed by the original node).
+	 */
+	MEM(node = talloc_memdup(call->child, call->node, sizeof(*node)));
+	talloc_set_type(node, xlat_exp_t);
+	node->next = NULL;
+	node->child = NULL;
+	node->thread_inst = xlat_thread_instance_find(call->node);
+	node->ephemeral = true;
+
+	unlang_interpret_push(call->child, NULL, RLM_MODULE_NOOP, UNLANG_NEXT_STOP, UNLANG_TOP_FRAME);
+	unlang_xlat_push(ctx, &call->result, call->child, node, UNLANG_SUB_FRAME);
+
+	/*
+	 *	Enter the frame as if the arguments had just been
+	 *	expanded, which calls the function.
+	 */
+	stack = call->child->stack;
+	frame = &stack->frame[stack->depth];
+	state = frame->state;
+	state->rhead = call->args;
+	call->args = NULL;
+	repeatable_set(frame);
+
+	call->started = true;
+
+	return 0;
+}
+
+/** Free the children of a concurrent evaluation
+ *
+ */
+static void xlat_calls_free(unlang_frame_state_xlat_t *state)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(state->calls); i++) {
+		unlang_xlat_call_t *call = &state->calls[i];
+
+		if (!call->child) continue;
+
+		if (call->yielded) unlang_interpret_signal(call->child, FR_SIGNAL_CANCEL);
+		TALLOC_FREE(call->child);
+	}
+
+	TALLOC_FREE(state->calls);
+}
+
+/** Evaluate sibling nodes, making all of the function calls at the same time
+ *
+ * The arguments of each call are expanded first, one at a time, in this
+ * request.  Then every call is started in its own child request, and we
+ * yield until all of them have completed.  The results are assembled
+ * in the order of the nodes, so the output is the same as a normal
+ * evaluation.
+ */
+static unlang_action_t unlang_xlat_concurrent(REQUEST *request, rlm_rcode_t *presult)
+{
+	unlang_stack_t			*stack = request->stack;
+	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_frame_state_xlat_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_xlat_t);
+	size_t				i, num = talloc_array_length(state->calls);
+	bool				yielded = false;
+
+	/*
+	 *	Expand the arguments of each call, and evaluate
+	 *	anything which isn't a call.
+	 */
+	for (i = 0; i < num; i++) {
+		unlang_xlat_call_t	*call = &state->calls[i];
+		xlat_exp_t		node;
+		xlat_exp_t const	*in, *child;
+		fr_cursor_t		cursor;
+
+		if (call->expanded) continue;
+		call->expanded = true;
+
+		if (xlat_node_yields(call->node)) {
+			if (!call->node->child) continue;
+
+			repeatable_set(frame);
+			unlang_xlat_push(state->ctx, &call->args, request, call->node->child, UNLANG_SUB_FRAME);
+			return UNLANG_ACTION_PUSHED_CHILD;
+		}
+
+		node = *call->node;
+		node.next = NULL;
+		in = &node;
+
+		fr_cursor_talloc_init(&cursor, &call->result, fr_value_box_t);
+		if (xlat_frame_eval(state->ctx, &cursor, &child, request, &in) != XLAT_ACTION_DONE) goto fail;
+		call->done = true;
+	}
+
+	/*
+	 *	Start every call before waiting on any of them.
+	 */
+	for (i = 0; i < num; i++) {
+		unlang_xlat_call_t	*call = &state->calls[i];
+		rlm_rcode_t		rcode;
+
+		if (call->done) continue;
+
+		if (!call->started) {
+			if (xlat_call_start(state->ctx, request, call) < 0) goto fail;
+
+		} else if (call->yielded) {
+			if (call->child->runnable_id != -2) {	/* see unlang_interpret_resumable() */
+				yielded = true;
+				continue;
+			}
+			call->child->runnable_id = -1;
+		}
+
+		rcode = xlat_call_run(request, call);
+		if (rcode == RLM_MODULE_YIELD) {
+			call->yielded = true;
+			yielded = true;
+			continue;
+		}
+
+		call->yielded = false;
+		call->done = true;
+		TALLOC_FREE(call->child);
+
+		if (rcode != RLM_MODULE_OK) goto fail;
+	}
+
+	if (yielded) return UNLANG_ACTION_YIELD;
+
+	RDEBUG3("Completed %zu concurrent expansions", num);
+
+	for (i = 0; i < num; i++) {
+		fr_cursor_t from;
+
+		fr_cursor_init(&from, &state->calls[i].result);
+		fr_cursor_merge(&state->values, &from);
+	}
+	TALLOC_FREE(state->calls);
+
+	*presult = RLM_MODULE_OK;
+	return UNLANG_ACTION_CALCULATE_RESULT;
+
+fail:
+	xlat_calls_free(state);
+
+	*presult = RLM_MODULE_FAIL;
+	return UNLANG_ACTION_CALCULATE_RESULT;
+}
+
+/** Push a list of sibling nodes, to be evaluated concurrently
+ *
+ */
+static void unlang_xlat_concurrent_push(TALLOC_CTX *ctx, fr_value_box_t **out,
+					REQUEST *request, xlat_exp_t const *exp)
+{
+	unlang_stack_t			*stack = request->stack;
+	unlang_stack_frame_t		*frame;
+	unlang_frame_state_xlat_t	*state;
+	xlat_exp_t const		*node;
+	size_t				i, num = 0;
+
+	unlang_xlat_push(ctx, out, request, exp, UNLANG_SUB_FRAME);
+	frame = &stack->frame[stack->depth];
+	state = frame->state;
+
+	for (node = exp; node; node = node->next) num++;
+
+	MEM(state->calls = talloc_zero_array(state, unlang_xlat_call_t, num));
+	for (i = 0, node = exp; node; i++, node = node->next) state->calls[i].node = node;
+
+	frame->interpret = unlang_xlat_concurrent;
+}
+
 /** Stub function for calling the xlat interpreter
  *
  * Calls the xlat interpreter and translates its wants and needs into
@@ -246,7 +517,11 @@ static unlang_action_t unlang_xlat(REQUEST *request, rlm_rcode_t *presult)
 		 *	multiple sibling nodes.
 		 */
 		talloc_list_free(&state->rhead);
-		unlang_xlat_push(state->ctx, &state->rhead, request, child, false);
+		if (xlat_concurrent_eligible(child)) {
+			unlang_xlat_concurrent_push(state->ctx, &state->rhead, request, child);
+		} else {
+			unlang_xlat_push(state->ctx, &state->rhead, request, child, false);
+		}
 		return UNLANG_ACTION_PUSHED_CHILD;
 
 	case XLAT_ACTION_YIELD:
@@ -287,6 +562,23 @@ static void unlang_xlat_signal(REQUEST *request, fr_state_signal_t action)
 	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
 	unlang_frame_state_xlat_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_xlat_t);
 
+	/*
+	 *	Pass the signal to any calls which are in progress.
+	 */
+	if (state->calls) {
+		size_t i;
+
+		if (action == FR_SIGNAL_CANCEL) {
+			xlat_calls_free(state);
+			return;
+		}
+
+		for (i = 0; i < talloc_array_length(state->calls); i++) {
+			if (state->calls[i].yielded) unlang_interpret_signal(state->calls[i].child, action);
+		}
+		return;
+	}
+
 	/*
 	 *	Delete timers, etc. when the xlat is cancelled.
 	 */
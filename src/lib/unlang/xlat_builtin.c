@@ -419,6 +419,46 @@ int xlat_internal(char const *name)
 	return 0;
 }
 
+/** Mark an xlat function as pure
+ *
+ * Pure functions have no side effects, and produce the same output
+ * for the same input.  They must not yield, or use the request for
+ * anything other than logging.
+ *
+ * @param[in] name of function to find.
+ * @return
+ *	- -1 on failure (function doesn't exist).
+ *	- 0 on success.
+ */
+int xlat_pure(char const *name)
+{
+	xlat_t *c;
+
+	c = xlat_func_find(name, -1);
+	if (!c) return -1;
+
+	c->pure = true;
+
+	return 0;
+}
+
+
+/** Mark an async xlat as one which waits for I/O
+ *
+ * When several of these are arguments to the same function, the
+ * calls are made at the same time, so their latencies overlap.
+ *
+ * @param[in] xlat	to mark.
+ */
+void xlat_async_yields_set(xlat_t const *xlat)
+{
+	xlat_t *c;
+
+	memcpy(&c, &xlat, sizeof(c));
+
+	c->yields = true;
+}
+
 
 /** Set global instantiation/detach callbacks
  *
@@ -1284,6 +1324,61 @@ static ssize_t parse_pad(vp_tmpl_t **vpt_p, size_t *pad_len_p, char *pad_char_p,
 }
 
 
+/** Return a call latency percentile for a module, in microseconds
+ *
+@verbatim
+%{latency:<module> [<percentile>]}
+@endverbatim
+ *
+ * The percentile defaults to 99.  It is calculated from the calls
+ * made to the module by all threads.
+ *
+ * Example:
+@verbatim
+"%{latency:ldap 99.9}" == "1250"
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static ssize_t xlat_func_latency(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+				 UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
+				 REQUEST *request, char const *fmt)
+{
+	char			name[256];
+	char const		*p = fmt;
+	char			*q;
+	double			pct = 99;
+	module_instance_t	*mi;
+	fr_time_histogram_t	latency;
+
+	while (*p && !isspace((int) *p)) p++;
+	if ((p == fmt) || ((size_t) (p - fmt) >= sizeof(name))) {
+		REDEBUG("latency: Invalid module name");
+		return -1;
+	}
+	memcpy(name, fmt, p - fmt);
+	name[p - fmt] = '\0';
+
+	fr_skip_whitespace(p);
+	if (*p) {
+		pct = strtod(p, &q);
+		if ((q == p) || (*q != '\0') || (pct < 0) || (pct > 100)) {
+			REDEBUG("latency: Percentile must be a number between 0 and 100");
+			return -1;
+		}
+	}
+
+	mi = module_by_name(NULL, name);
+	if (!mi) {
+		REDEBUG("latency: Unknown module '%s'", name);
+		return -1;
+	}
+
+	module_latency(&latency, mi);
+
+	return snprintf(*out, outlen, "%" PRIu64, (uint64_t) fr_time_histogram_percentile(&latency, pct) / 1000);
+}
+
 /** Left pad a string
  *
 @verbatim
@@ -2865,7 +2960,7 @@ static xlat_action_t xlat_func_sub_regex(TALLOC_CTX *ctx, fr_cursor_t *out,
 	/*
 	 *	Process the substitution
 	 */
-	if (regex_compile(NULL, &pattern, regex, regex_len, &flags, false, true) <= 0) {
+	if (regex_compile_cached(request, &pattern, regex, regex_len, &flags, false) <= 0) {
 		RPEDEBUG("Failed compiling regex");
 		return XLAT_ACTION_FAIL;
 	}
@@ -2875,15 +2970,12 @@ static xlat_action_t xlat_func_sub_regex(TALLOC_CTX *ctx, fr_cursor_t *out,
 			     subject, subject_len, rep, rep_len, NULL) < 0) {
 		RPEDEBUG("Failed performing substitution");
 		talloc_free(vb);
-		talloc_free(pattern);
 		return XLAT_ACTION_FAIL;
 	}
 	fr_value_box_bstrdup_buffer_shallow(NULL, vb, NULL, buff, (*in)->tainted);
 
 	fr_cursor_append(out, vb);
 
-	talloc_free(pattern);
-
 	return XLAT_ACTION_DONE;
 }
 #endif
@@ -3344,6 +3436,7 @@ int xlat_init(void)
 	XLAT_REGISTER(debug_attr);
 	xlat_register(NULL, "explode", xlat_func_explode, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, true);
 	XLAT_REGISTER(integer);
+	XLAT_REGISTER(latency);
 	xlat_register(NULL, "lpad", xlat_func_lpad, NULL, NULL, 0, 0, true);
 	XLAT_REGISTER(map);
 	xlat_register(NULL, "nexttime", xlat_func_next_time, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, true);
@@ -3352,53 +3445,56 @@ int xlat_init(void)
 	XLAT_REGISTER(xlat);
 
 
-	xlat_async_register(NULL, "base64", xlat_func_base64_encode);
-	xlat_async_register(NULL, "base64decode", xlat_func_base64_decode);
-	xlat_async_register(NULL, "bin", xlat_func_bin);
-	xlat_async_register(NULL, "concat", xlat_func_concat);
-	xlat_async_register(NULL, "hex", xlat_func_hex);
-	xlat_async_register(NULL, "hmacmd5", xlat_func_hmac_md5);
-	xlat_async_register(NULL, "hmacsha1", xlat_func_hmac_sha1);
-	xlat_async_register(NULL, "length", xlat_func_length);
-	xlat_async_register(NULL, "md4", xlat_func_md4);
-	xlat_async_register(NULL, "md5", xlat_func_md5);
+#define XLAT_REGISTER_PURE(_name, _func) xlat_async_register(NULL, _name, _func); \
+	xlat_pure(_name)
+
+	XLAT_REGISTER_PURE("base64", xlat_func_base64_encode);
+	XLAT_REGISTER_PURE("base64decode", xlat_func_base64_decode);
+	XLAT_REGISTER_PURE("bin", xlat_func_bin);
+	XLAT_REGISTER_PURE("concat", xlat_func_concat);
+	XLAT_REGISTER_PURE("hex", xlat_func_hex);
+	XLAT_REGISTER_PURE("hmacmd5", xlat_func_hmac_md5);
+	XLAT_REGISTER_PURE("hmacsha1", xlat_func_hmac_sha1);
+	XLAT_REGISTER_PURE("length", xlat_func_length);
+	XLAT_REGISTER_PURE("md4", xlat_func_md4);
+	XLAT_REGISTER_PURE("md5", xlat_func_md5);
 	xlat_async_register(NULL, "module", xlat_func_module);
-	xlat_async_register(NULL, "pack", xlat_func_pack);
+	XLAT_REGISTER_PURE("pack", xlat_func_pack);
 	xlat_async_register(NULL, "pairs", xlat_func_pairs);
 	xlat_async_register(NULL, "rand", xlat_func_rand);
 	xlat_async_register(NULL, "randstr", xlat_func_randstr);
 #if defined(HAVE_REGEX_PCRE) || defined(HAVE_REGEX_PCRE2)
 	xlat_async_register(NULL, "regex", xlat_func_regex);
 #endif
-	xlat_async_register(NULL, "sha1", xlat_func_sha1);
+	XLAT_REGISTER_PURE("sha1", xlat_func_sha1);
 
 #ifdef HAVE_OPENSSL_EVP_H
-	xlat_async_register(NULL, "sha2_224", xlat_func_sha2_224);
-	xlat_async_register(NULL, "sha2_256", xlat_func_sha2_256);
-	xlat_async_register(NULL, "sha2_384", xlat_func_sha2_384);
-	xlat_async_register(NULL, "sha2_512", xlat_func_sha2_512);
+	XLAT_REGISTER_PURE("sha2_224", xlat_func_sha2_224);
+	XLAT_REGISTER_PURE("sha2_256", xlat_func_sha2_256);
+	XLAT_REGISTER_PURE("sha2_384", xlat_func_sha2_384);
+	XLAT_REGISTER_PURE("sha2_512", xlat_func_sha2_512);
 
 #  if OPENSSL_VERSION_NUMBER >= 0x10100000L
-	xlat_async_register(NULL, "blake2s_256", xlat_func_blake2s_256);
-	xlat_async_register(NULL, "blake2b_512", xlat_func_blake2b_512);
+	XLAT_REGISTER_PURE("blake2s_256", xlat_func_blake2s_256);
+	XLAT_REGISTER_PURE("blake2b_512", xlat_func_blake2b_512);
 #  endif
 
 #  if OPENSSL_VERSION_NUMBER >= 0x10101000L
-	xlat_async_register(NULL, "sha3_224", xlat_func_sha3_224);
-	xlat_async_register(NULL, "sha3_256", xlat_func_sha3_256);
-	xlat_async_register(NULL, "sha3_384", xlat_func_sha3_384);
-	xlat_async_register(NULL, "sha3_512", xlat_func_sha3_512);
+	XLAT_REGISTER_PURE("sha3_224", xlat_func_sha3_224);
+	XLAT_REGISTER_PURE("sha3_256", xlat_func_sha3_256);
+	XLAT_REGISTER_PURE("sha3_384", xlat_func_sha3_384);
+	XLAT_REGISTER_PURE("sha3_512", xlat_func_sha3_512);
 #  endif
 #endif
 
-	xlat_async_register(NULL, "string", xlat_func_string);
-	xlat_async_register(NULL, "strlen", xlat_func_strlen);
+	XLAT_REGISTER_PURE("string", xlat_func_string);
+	XLAT_REGISTER_PURE("strlen", xlat_func_strlen);
 	xlat_async_register(NULL, "sub", xlat_func_sub);
 	xlat_async_register(NULL, "tag", xlat_func_tag);
-	xlat_async_register(NULL, "tolower", xlat_func_tolower);
-	xlat_async_register(NULL, "toupper", xlat_func_toupper);
-	xlat_async_register(NULL, "urlquote", xlat_func_urlquote);
-	xlat_async_register(NULL, "urlunquote", xlat_func_urlunquote);
+	XLAT_REGISTER_PURE("tolower", xlat_func_tolower);
+	XLAT_REGISTER_PURE("toupper", xlat_func_toupper);
+	XLAT_REGISTER_PURE("urlquote", xlat_func_urlquote);
+	XLAT_REGISTER_PURE("urlunquote", xlat_func_urlunquote);
 
 	return 0;
 }
@@ -36,6 +36,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/unlang/unlang_priv.h>	/* Remove when everything uses new xlat API */
+#include <freeradius-devel/unlang/profile_priv.h>
 
 #include <ctype.h>
 
@@ -738,6 +739,159 @@ xlat_action_t xlat_frame_eval_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
 
 	return xa;
 }
+/** Maximum number of results memoised per request
+ *
+ * Limits how much memory a policy which calls a pure function with
+ * many different inputs can consume.
+ */
+#define XLAT_MEMO_MAX	(64)
+
+/** A memoised call to a pure xlat function
+ *
+ */
+typedef struct {
+	xlat_t const	*xlat;		//!< Function which was called.
+	uint8_t		*key;		//!< Serialised arguments.
+	fr_value_box_t	*result;	//!< What the function produced.
+} xlat_memo_t;
+
+/** Identifies the memo tree in request data
+ */
+static int const xlat_memo_id = 0;
+
+static int xlat_memo_cmp(void const *one, void const *two)
+{
+	xlat_memo_t const	*a = one, *b = two;
+	size_t			a_len, b_len;
+	int			ret;
+
+	if (a->xlat != b->xlat) return (a->xlat > b->xlat) - (a->xlat < b->xlat);
+
+	a_len = talloc_array_length(a->key);
+	b_len = talloc_array_length(b->key);
+	if (a_len != b_len) return (a_len > b_len) - (a_len < b_len);
+
+	ret = memcmp(a->key, b->key, a_len);
+	return (ret > 0) - (ret < 0);
+}
+
+/** Serialise the arguments of a call to a pure function
+ *
+ * Each argument is written as its type, its length, and its value, so
+ * arguments which print the same but have different types don't collide.
+ *
+ * @param[in] ctx	to allocate the key in.
+ * @param[in] in	arguments to the function.
+ * @return
+ *	- The key.
+ *	- NULL if the arguments can't be serialised.
+ */
+static uint8_t *xlat_memo_key(TALLOC_CTX *ctx, fr_value_box_t const *in)
+{
+	uint8_t			*key;
+	fr_value_box_t const	*vb;
+
+	MEM(key = talloc_array(ctx, uint8_t, 0));
+
+	for (vb = in; vb; vb = vb->next) {
+		uint8_t const	*p;
+		char		*str = NULL;
+		size_t		len, used;
+
+		switch (vb->type) {
+		case FR_TYPE_STRING:
+			p = (uint8_t const *)vb->vb_strvalue;
+			len = vb->vb_length;
+			break;
+
+		case FR_TYPE_OCTETS:
+			p = vb->vb_octets;
+			len = vb->vb_length;
+			break;
+
+		case FR_TYPE_NON_VALUES:
+			talloc_free(key);
+			return NULL;
+
+		default:
+			str = fr_value_box_asprint(NULL, vb, '\0');
+			if (!str) {
+				talloc_free(key);
+				return NULL;
+			}
+			p = (uint8_t const *)str;
+			len = talloc_array_length(str) - 1;
+			break;
+		}
+
+		used = talloc_array_length(key);
+		MEM(key = talloc_realloc(ctx, key, uint8_t, used + 1 + sizeof(len) + len));
+		key[used] = vb->type;
+		memcpy(key + used + 1, &len, sizeof(len));
+		memcpy(key + used + 1 + sizeof(len), p, len);
+		talloc_free(str);
+	}
+
+	return key;
+}
+
+/** Find a memoised result for a call to a pure function
+ *
+ * @param[in] request	the current request.
+ * @param[in] xlat	being called.
+ * @param[in] key	serialised arguments.
+ * @return
+ *	- The memoised result.
+ *	- NULL if the function hasn't been called with these arguments.
+ */
+static xlat_memo_t *xlat_memo_find(REQUEST *request, xlat_t const *xlat, uint8_t *key)
+{
+	rbtree_t	*tree;
+
+	tree = request_data_reference(request, &xlat_memo_id, 0);
+	if (!tree) return NULL;
+
+	return rbtree_finddata(tree, &(xlat_memo_t){ .xlat = xlat, .key = key });
+}
+
+/** Remember the result of a call to a pure function
+ *
+ * @param[in] request	the current request.
+ * @param[in] xlat	which was called.
+ * @param[in] key	serialised arguments.  Ownership passes to the memo.
+ * @param[in] result	list of boxes produced by the function.
+ */
+static void xlat_memo_add(REQUEST *request, xlat_t const *xlat, uint8_t *key, fr_value_box_t const *result)
+{
+	rbtree_t	*tree;
+	xlat_memo_t	*memo;
+
+	tree = request_data_reference(request, &xlat_memo_id, 0);
+	if (!tree) {
+		MEM(tree = rbtree_talloc_alloc(NULL, xlat_memo_cmp, xlat_memo_t, NULL, RBTREE_FLAG_NONE));
+		if (request_data_talloc_add(request, &xlat_memo_id, 0, rbtree_t, tree, true, true, false) < 0) {
+			talloc_free(tree);
+			talloc_free(key);
+			return;
+		}
+	}
+
+	if (rbtree_num_elements(tree) >= XLAT_MEMO_MAX) {
+		talloc_free(key);
+		return;
+	}
+
+	MEM(memo = talloc_zero(tree, xlat_memo_t));
+	memo->xlat = xlat;
+	memo->key = talloc_steal(memo, key);
+	if (result && (fr_value_box_list_acopy(memo, &memo->result, result) < 0)) {
+		talloc_free(memo);
+		return;
+	}
+
+	if (!rbtree_insert(tree, memo)) talloc_free(memo);
+}
+
 /** Process the result of a previous nested expansion
  *
  * @param[in] ctx		to allocate value boxes in.
@@ -761,6 +915,7 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_cursor_t *out,
 				     fr_value_box_t **result)
 {
 	xlat_exp_t const	*node = *in;
+	unlang_profile_sample_t	sample;
 
 	fr_cursor_tail(out);	/* Needed for reentrant behaviour and debugging */
 
@@ -791,8 +946,14 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_cursor_t *out,
 				   node->fmt,
 				   fr_box_strvalue_len(result_str, talloc_array_length(result_str) - 1));
 
-			slen = node->xlat->func.sync(value, &str, node->xlat->buf_len,
-						     node->xlat->mod_inst, NULL, request, result_str);
+			if (unlikely(unlang_profile_start(&sample))) {
+				slen = node->xlat->func.sync(value, &str, node->xlat->buf_len,
+							     node->xlat->mod_inst, NULL, request, result_str);
+				unlang_profile_xlat(node->xlat, &sample);
+			} else {
+				slen = node->xlat->func.sync(value, &str, node->xlat->buf_len,
+							     node->xlat->mod_inst, NULL, request, result_str);
+			}
 			xlat_debug_log_expansion(request, *in, *result);
 			if (slen < 0) {
 				talloc_free(value);
@@ -827,11 +988,46 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_cursor_t *out,
 			xlat_thread_inst_t	*thread_inst;
 			fr_value_box_t		*result_copy = NULL;
 
+			uint8_t			*memo_key = NULL;
+			fr_value_box_t		*prev;
+
 			thread_inst = xlat_thread_instance_find(node);
 
 			XLAT_DEBUG("** [%i] %s(func-async) - %%{%s:%pM}", unlang_interpret_stack_depth(request), __FUNCTION__,
 				   node->fmt, result);
 
+			/*
+			 *	Pure functions produce the same output
+			 *	for the same input, so if we've already
+			 *	done this call for the request, copy the
+			 *	previous result.
+			 */
+			if (node->xlat->pure) {
+				xlat_memo_t	*memo;
+
+				memo_key = xlat_memo_key(request, *result);
+				if (memo_key && (memo = xlat_memo_find(request, node->xlat, memo_key))) {
+					fr_value_box_t	*copy = NULL, *next;
+
+					talloc_free(memo_key);
+
+					xlat_debug_log_expansion(request, *in, *result);
+					if (memo->result && (fr_value_box_list_acopy(ctx, &copy, memo->result) < 0)) {
+						return XLAT_ACTION_FAIL;
+					}
+					xlat_debug_log_result(request, copy);
+
+					while (copy) {
+						next = copy->next;
+						copy->next = NULL;
+						fr_cursor_append(out, copy);
+						copy = next;
+					}
+					break;
+				}
+			}
+			prev = fr_cursor_current(out);
+
 			/*
 			 *	Need to copy the input list in case
 			 *	the async function mucks with it.
@@ -839,13 +1035,20 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_cursor_t *out,
 			if (RDEBUG_ENABLED2) fr_value_box_list_acopy(NULL, &result_copy, *result);
 
 			if (*result) (void) talloc_list_get_type_abort(*result, fr_value_box_t);
-			xa = node->xlat->func.async(ctx, out, request, node->inst->data, thread_inst->data, result);
+			if (unlikely(unlang_profile_start(&sample))) {
+				xa = node->xlat->func.async(ctx, out, request, node->inst->data, thread_inst->data, result);
+				unlang_profile_xlat(node->xlat, &sample);
+			} else {
+				xa = node->xlat->func.async(ctx, out, request, node->inst->data, thread_inst->data, result);
+			}
 			if (*result) (void) talloc_list_get_type_abort(*result, fr_value_box_t);
 
 			if (RDEBUG_ENABLED2) {
 				xlat_debug_log_expansion(request, *in, result_copy);
 				talloc_list_free(&result_copy);
 			}
+			if ((xa != XLAT_ACTION_DONE) && memo_key) talloc_free(memo_key);
+
 			switch (xa) {
 			case XLAT_ACTION_FAIL:
 				return xa;
@@ -859,6 +1062,8 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_cursor_t *out,
 				return xa;
 
 			case XLAT_ACTION_DONE:				/* Process the result */
+				if (memo_key) xlat_memo_add(request, node->xlat, memo_key,
+							    prev ? prev->next : *out->head);
 				fr_cursor_next(out);
 				xlat_debug_log_result(request, fr_cursor_current(out));
 				break;
@@ -453,6 +453,97 @@ static int _xlat_bootstrap_walker(xlat_exp_t *node, UNUSED void *uctx)
 	return 0;
 }
 
+/** Evaluate a call to a pure function with literal arguments, replacing it with the result
+ *
+ * A literal node can only represent a string, so any other result is
+ * left to be produced at runtime.
+ *
+ * @param[in] node	to fold.
+ */
+static void xlat_fold_node(xlat_exp_t *node)
+{
+	xlat_exp_t	*child;
+	TALLOC_CTX	*pool;
+	REQUEST		*request;
+	fr_value_box_t	*in = NULL, *result = NULL;
+	fr_cursor_t	in_cursor, out;
+	xlat_action_t	xa;
+
+	if ((node->type != XLAT_FUNC) || !node->xlat->pure || (node->xlat->type != XLAT_FUNC_ASYNC) ||
+	    node->xlat->inst_size || node->xlat->thread_inst_size) return;
+
+	for (child = node->child; child; child = child->next) if (child->type != XLAT_LITERAL) return;
+
+	MEM(pool = talloc_new(NULL));
+
+	/*
+	 *	Build the same input list the evaluator would.
+	 */
+	fr_cursor_init(&in_cursor, &in);
+	for (child = node->child; child; child = child->next) {
+		fr_value_box_t *vb;
+
+		MEM(vb = fr_value_box_alloc_null(pool));
+		if (fr_value_box_bstrdup_buffer(vb, vb, NULL, child->fmt, false) < 0) goto finish;
+		fr_cursor_append(&in_cursor, vb);
+	}
+
+	request = request_alloc(NULL);
+	fr_cursor_init(&out, &result);
+	xa = node->xlat->func.async(pool, &out, request, NULL, NULL, &in);
+	talloc_free(request);
+
+	if ((xa != XLAT_ACTION_DONE) || !result || result->next || (result->type != FR_TYPE_STRING)) goto finish;
+
+	DEBUG3("Folding xlat \"%s\" node %p into its result", node->xlat->name, node);
+
+	/*
+	 *	The old children are freed with the node.
+	 */
+	node->type = XLAT_LITERAL;
+	node->child = NULL;
+	node->xlat = NULL;
+	node->len = result->vb_length;
+	node->fmt = talloc_bstrndup(node, result->vb_strvalue, result->vb_length);
+	node->async_safe = true;
+
+finish:
+	talloc_free(pool);
+}
+
+/** Fold constant subtrees of an xlat expansion
+ *
+ * Children are folded first, so nested calls to pure functions
+ * collapse from the innermost outwards.
+ *
+ * @param[in] head	of the expansion list.
+ */
+static void xlat_fold(xlat_exp_t *head)
+{
+	xlat_exp_t *node;
+
+	for (node = head; node; node = node->next) {
+		switch (node->type) {
+		case XLAT_FUNC:
+			if (node->child) xlat_fold(node->child);
+			xlat_fold_node(node);
+			break;
+
+		case XLAT_ALTERNATE:
+			if (node->child) xlat_fold(node->child);
+			if (node->alternate) xlat_fold(node->alternate);
+			break;
+
+		case XLAT_CHILD:
+			if (node->child) xlat_fold(node->child);
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
 /** Create instance data for "permanent" xlats
  *
  * @note This must only be used for xlats created during startup.
@@ -471,6 +562,8 @@ int xlat_bootstrap(xlat_exp_t *root)
 
 	if (!xlat_inst_tree) xlat_instantiate_init();
 
+	xlat_fold(root);
+
 	return xlat_eval_walk(root, _xlat_bootstrap_walker, XLAT_FUNC, NULL);
 }
 
@@ -71,6 +71,13 @@ typedef struct xlat_s {
 	void			*thread_uctx;			//!< uctx to pass to instantiation functions.
 
 	bool			async_safe;			//!< If true, is async safe
+	bool			pure;				//!< If true, the output depends only on the input.
+								///< Calls with constant arguments are folded
+								///< at startup, and results are memoised per
+								///< request.
+	bool			yields;				//!< If true, usually yields waiting for I/O.
+								///< Calls with independent arguments are
+								///< made concurrently.
 
 	size_t			buf_len;			//!< Length of output buffer to pre-allocate.
 	void			*mod_inst;			//!< Module instance passed to xlat
@@ -1,6 +1,12 @@
 SUBMAKEFILES := \
+	base64_tests.mk \
+	btree_tests.mk \
 	dbuff_tests.mk \
+	event_tests.mk \
 	heap_tests.mk \
+	inet_tests.mk \
 	libfreeradius-util.mk \
+	md5_tests.mk \
+	pair_index_tests.mk \
 	sbuff_tests.mk
 
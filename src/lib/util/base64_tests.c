@@ -0,0 +1,143 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/util/base64.h>
+
+#define BASE64_TEST_MAX_LEN	(300)
+
+static uint8_t	base64_test_data[BASE64_TEST_MAX_LEN];
+
+static void base64_test_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(base64_test_data); i++) base64_test_data[i] = (i * 151) + 7;
+}
+
+/** One group at a time, as a reference for the vector code
+ *
+ */
+static size_t base64_test_encode(char *out, uint8_t const *in, size_t inlen)
+{
+	char	*p = out;
+	size_t	i;
+
+	for (i = 0; (i + 3) <= inlen; i += 3) {
+		uint32_t group = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+
+		*p++ = fr_base64_str[(group >> 18) & 0x3f];
+		*p++ = fr_base64_str[(group >> 12) & 0x3f];
+		*p++ = fr_base64_str[(group >> 6) & 0x3f];
+		*p++ = fr_base64_str[group & 0x3f];
+	}
+
+	switch (inlen - i) {
+	case 1:
+		*p++ = fr_base64_str[in[i] >> 2];
+		*p++ = fr_base64_str[(in[i] << 4) & 0x3f];
+		*p++ = '=';
+		*p++ = '=';
+		break;
+
+	case 2:
+		*p++ = fr_base64_str[in[i] >> 2];
+		*p++ = fr_base64_str[((in[i] << 4) | (in[i + 1] >> 4)) & 0x3f];
+		*p++ = fr_base64_str[(in[i + 1] << 2) & 0x3f];
+		*p++ = '=';
+		break;
+	}
+	*p = '\0';
+
+	return p - out;
+}
+
+static void base64_test_vectors(void)
+{
+	static struct {
+		char const	*in;
+		char const	*out;
+	} const vectors[] = {
+		{ "",		""		},
+		{ "f",		"Zg=="		},
+		{ "fo",		"Zm8="		},
+		{ "foo",	"Zm9v"		},
+		{ "foob",	"Zm9vYg=="	},
+		{ "fooba",	"Zm9vYmE="	},
+		{ "foobar",	"Zm9vYmFy"	},
+		{ "The quick brown fox jumps over the lazy dog",
+		  "VGhlIHF1aWNrIGJyb3duIGZveCBqdW1wcyBvdmVyIHRoZSBsYXp5IGRvZw==" }
+	};
+	char		out[128];
+	uint8_t		bin[128];
+	size_t		i;
+
+	for (i = 0; i < NUM_ELEMENTS(vectors); i++) {
+		size_t	len = strlen(vectors[i].in);
+		ssize_t	slen;
+
+		TEST_CASE(vectors[i].out);
+		TEST_CHECK(fr_base64_encode(out, sizeof(out), (uint8_t const *) vectors[i].in, len) ==
+			   strlen(vectors[i].out));
+		TEST_CHECK(strcmp(out, vectors[i].out) == 0);
+
+		slen = fr_base64_decode(bin, sizeof(bin), vectors[i].out, strlen(vectors[i].out));
+		TEST_CHECK(slen == (ssize_t) len);
+		TEST_CHECK(memcmp(bin, vectors[i].in, len) == 0);
+	}
+}
+
+/** Encode and decode every length, and compare against the reference
+ *
+ */
+static void base64_test_round_trip(void)
+{
+	char		out[FR_BASE64_ENC_LENGTH(BASE64_TEST_MAX_LEN) + 1];
+	char		expected[sizeof(out)];
+	uint8_t		bin[FR_BASE64_DEC_LENGTH(sizeof(out))];
+	size_t		len, slen;
+
+	base64_test_init();
+
+	for (len = 0; len <= BASE64_TEST_MAX_LEN; len++) {
+		slen = fr_base64_encode(out, sizeof(out), base64_test_data, len);
+		TEST_CHECK(slen == base64_test_encode(expected, base64_test_data, len));
+		TEST_CHECK(strcmp(out, expected) == 0);
+		TEST_MSG("Input length %zu", len);
+
+		TEST_CHECK(fr_base64_decode(bin, sizeof(bin), out, slen) == (ssize_t) len);
+		TEST_CHECK(memcmp(bin, base64_test_data, len) == 0);
+		TEST_MSG("Input length %zu", len);
+	}
+}
+
+/** Put an invalid char at every position, and check decoding fails
+ *
+ */
+static void base64_test_invalid(void)
+{
+	char		out[FR_BASE64_ENC_LENGTH(BASE64_TEST_MAX_LEN) + 1];
+	uint8_t		bin[FR_BASE64_DEC_LENGTH(sizeof(out))];
+	size_t		i, slen;
+
+	base64_test_init();
+
+	slen = fr_base64_encode(out, sizeof(out), base64_test_data, BASE64_TEST_MAX_LEN);
+
+	for (i = 0; i < slen; i++) {
+		char c = out[i];
+
+		out[i] = (i & 0x01) ? '*' : (char) 0xc1;
+		TEST_CHECK(fr_base64_decode(bin, sizeof(bin), out, slen) <= 0);
+		TEST_MSG("Invalid char at %zu", i);
+		out[i] = c;
+	}
+
+	TEST_CASE("Output buffer too small");
+	TEST_CHECK(fr_base64_decode(bin, 100, out, slen) <= 0);
+}
+
+TEST_LIST = {
+	{ "base64_test_vectors",	base64_test_vectors	},
+	{ "base64_test_round_trip",	base64_test_round_trip	},
+	{ "base64_test_invalid",	base64_test_invalid	},
+	{ NULL }
+};
@@ -0,0 +1,814 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** In-memory B+tree implementation
+ *
+ * Elements are stored only in the leaves, which are kept in a doubly linked
+ * list in sort order.  Inner nodes hold copies of element pointers to steer
+ * lookups, where key[i] is always the smallest element under child[i + 1].
+ * Keeping that invariant exact means every key points to an element which
+ * is still in the tree, so the comparator never sees freed memory.
+ *
+ * Every node other than the root holds between BTREE_MIN and BTREE_MAX
+ * elements (or keys), so a tree of a million elements is about four levels
+ * deep, against twenty or so for a red/black tree.
+ *
+ * @file src/lib/util/btree.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/btree.h>
+#include <freeradius-devel/util/strerror.h>
+
+#include <pthread.h>
+#include <string.h>
+
+#define BTREE_MAX	(31)			//!< Maximum elements in a leaf, or keys in an inner node.
+#define BTREE_MIN	(BTREE_MAX / 2)		//!< Minimum for any node other than the root.
+#define BTREE_MAX_DEPTH	(16)			//!< Far more than 2^32 elements need.
+
+typedef struct {
+	uint16_t		num;		//!< Elements in a leaf, or keys in an inner node.
+	bool			leaf;		//!< Whether this is a leaf.
+} btree_node_t;
+
+typedef struct btree_leaf_s btree_leaf_t;
+struct btree_leaf_s {
+	btree_node_t		node;
+	void			*data[BTREE_MAX];	//!< Elements, in sort order.
+	btree_leaf_t		*prev;		//!< Previous leaf in sort order.
+	btree_leaf_t		*next;		//!< Next leaf in sort order.
+};
+
+typedef struct {
+	btree_node_t		node;
+	void			*key[BTREE_MAX];	//!< key[i] is the smallest element under child[i + 1].
+	btree_node_t		*child[BTREE_MAX + 1];
+} btree_inner_t;
+
+struct fr_btree_s {
+#ifndef NDEBUG
+	uint32_t		magic;
+#endif
+	btree_node_t		*root;		//!< NULL if the tree is empty.
+	btree_leaf_t		*head;		//!< Leaf holding the smallest elements.
+	uint32_t		num_elements;
+	rb_comparator_t		compare;
+	rb_free_t		free;
+	bool			replace;
+	bool			lock;
+	pthread_mutex_t		mutex;
+	bool			being_freed;	//!< Prevent double frees in talloc_destructor.
+	char const		*type;		//!< Talloc type to check elements against.
+
+	TALLOC_CTX		*node_ctx;	//!< All nodes are allocated here.
+};
+
+#ifndef NDEBUG
+#  define BTREE_MAGIC (0x5ad09c43)
+#endif
+
+#define LEAF(_node)	((btree_leaf_t *)(_node))
+#define INNER(_node)	((btree_inner_t *)(_node))
+
+/** Free the B+tree, calling the free function for every element
+ *
+ * @param[in] tree to free.
+ * @return
+ *	- 0 if tree was freed.
+ *	- -1 if tree is already being freed.
+ */
+static int _btree_free(fr_btree_t *tree)
+{
+	btree_leaf_t	*leaf;
+
+	if (unlikely(tree->being_freed)) return -1;
+	tree->being_freed = true;
+
+	if (tree->free) for (leaf = tree->head; leaf; leaf = leaf->next) {
+		unsigned int i;
+
+		for (i = 0; i < leaf->node.num; i++) tree->free(leaf->data[i]);
+	}
+
+#ifndef NDEBUG
+	tree->magic = 0;
+#endif
+	tree->root = NULL;
+	tree->head = NULL;
+	tree->num_elements = 0;
+
+	talloc_free_children(tree);
+
+	if (tree->lock) pthread_mutex_destroy(&tree->mutex);
+
+	return 0;
+}
+
+/** Create a new B+tree
+ *
+ */
+fr_btree_t *_fr_btree_alloc(TALLOC_CTX *ctx, rb_comparator_t compare,
+			    char const *type, rb_free_t node_free, int flags)
+{
+	fr_btree_t *tree;
+
+	if (!compare) return NULL;
+
+	tree = talloc_zero(ctx, fr_btree_t);
+	if (!tree) return NULL;
+
+	tree->node_ctx = talloc_new(tree);
+	if (!tree->node_ctx) {
+		talloc_free(tree);
+		return NULL;
+	}
+
+#ifndef NDEBUG
+	tree->magic = BTREE_MAGIC;
+#endif
+	tree->compare = compare;
+	tree->replace = (flags & RBTREE_FLAG_REPLACE) != 0;
+	tree->lock = (flags & RBTREE_FLAG_LOCK) != 0;
+	if (tree->lock) pthread_mutex_init(&tree->mutex, NULL);
+
+	talloc_set_destructor(tree, _btree_free);
+	tree->free = node_free;
+	tree->type = type;
+
+	return tree;
+}
+
+static inline btree_leaf_t *leaf_alloc(fr_btree_t *tree)
+{
+	btree_leaf_t *leaf;
+
+	leaf = talloc_zero(tree->node_ctx, btree_leaf_t);
+	if (!leaf) return NULL;
+	leaf->node.leaf = true;
+
+	return leaf;
+}
+
+/** Return the index of the child of an inner node which may contain data
+ *
+ */
+static inline unsigned int inner_search(fr_btree_t *tree, btree_inner_t *inner, void const *data)
+{
+	unsigned int lo = 0, hi = inner->node.num;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (tree->compare(data, inner->key[mid]) >= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/** Return the index of the first element of a leaf which is >= data
+ *
+ */
+static inline unsigned int leaf_search(fr_btree_t *tree, btree_leaf_t *leaf, void const *data, bool *found)
+{
+	unsigned int lo = 0, hi = leaf->node.num;
+
+	*found = false;
+	while (lo < hi) {
+		unsigned int	mid = (lo + hi) / 2;
+		int		ret = tree->compare(data, leaf->data[mid]);
+
+		if (ret == 0) {
+			*found = true;
+			return mid;
+		}
+
+		if (ret > 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/** Find the first element which is >= data
+ *
+ * @return
+ *	- true if an element equal to data was found.
+ *	- false otherwise.
+ */
+static bool btree_seek(fr_btree_t *tree, void const *data, btree_leaf_t **leaf_p, unsigned int *idx_p)
+{
+	btree_node_t	*node = tree->root;
+	btree_leaf_t	*leaf;
+	unsigned int	idx;
+	bool		found;
+
+	if (!node) {
+		*leaf_p = NULL;
+		*idx_p = 0;
+		return false;
+	}
+
+	while (!node->leaf) node = INNER(node)->child[inner_search(tree, INNER(node), data)];
+
+	leaf = LEAF(node);
+	idx = leaf_search(tree, leaf, data, &found);
+	if (idx == leaf->node.num) {
+		leaf = leaf->next;
+		idx = 0;
+	}
+
+	*leaf_p = leaf;
+	*idx_p = idx;
+	return found;
+}
+
+static inline void *node_min(btree_node_t *node)
+{
+	while (!node->leaf) node = INNER(node)->child[0];
+
+	return LEAF(node)->data[0];
+}
+
+static inline void leaf_insert_at(btree_leaf_t *leaf, unsigned int idx, void *data)
+{
+	memmove(&leaf->data[idx + 1], &leaf->data[idx], (leaf->node.num - idx) * sizeof(leaf->data[0]));
+	leaf->data[idx] = data;
+	leaf->node.num++;
+}
+
+/** Split a full leaf, inserting data at idx
+ *
+ * @param[in] leaf	to split.
+ * @param[in] rleaf	Empty leaf to move the upper half of the elements into.
+ * @param[in] idx	where data would go in leaf.
+ * @param[in] data	to insert.
+ * @return the smallest element in rleaf.
+ */
+static void *leaf_split(btree_leaf_t *leaf, btree_leaf_t *rleaf, unsigned int idx, void *data)
+{
+	unsigned int left_n = (BTREE_MAX + 1) / 2;
+
+	if (idx < left_n) {
+		rleaf->node.num = BTREE_MAX - left_n + 1;
+		memcpy(rleaf->data, &leaf->data[left_n - 1], rleaf->node.num * sizeof(leaf->data[0]));
+		leaf->node.num = left_n - 1;
+		leaf_insert_at(leaf, idx, data);
+	} else {
+		rleaf->node.num = BTREE_MAX - left_n;
+		memcpy(rleaf->data, &leaf->data[left_n], rleaf->node.num * sizeof(leaf->data[0]));
+		leaf->node.num = left_n;
+		leaf_insert_at(rleaf, idx - left_n, data);
+	}
+
+	rleaf->next = leaf->next;
+	if (rleaf->next) rleaf->next->prev = rleaf;
+	rleaf->prev = leaf;
+	leaf->next = rleaf;
+
+	return rleaf->data[0];
+}
+
+/** Split a full inner node, inserting key at c, and child at c + 1
+ *
+ * Lays out all the keys and children as if the node had room, then
+ * hands the middle key up to the parent.
+ *
+ * @return the key to insert into the parent, to the left of right.
+ */
+static void *inner_split(btree_inner_t *inner, btree_inner_t *right, unsigned int c,
+			 void *sep, btree_node_t *split)
+{
+	void		*key[BTREE_MAX + 1];
+	btree_node_t	*child[BTREE_MAX + 2];
+	unsigned int	mid = (BTREE_MAX + 1) / 2;
+
+	memcpy(key, inner->key, c * sizeof(key[0]));
+	key[c] = sep;
+	memcpy(&key[c + 1], &inner->key[c], (BTREE_MAX - c) * sizeof(key[0]));
+
+	memcpy(child, inner->child, (c + 1) * sizeof(child[0]));
+	child[c + 1] = split;
+	memcpy(&child[c + 2], &inner->child[c + 1], (BTREE_MAX - c) * sizeof(child[0]));
+
+	memcpy(inner->key, key, mid * sizeof(key[0]));
+	memcpy(inner->child, child, (mid + 1) * sizeof(child[0]));
+	inner->node.num = mid;
+
+	right->node.num = BTREE_MAX - mid;
+	memcpy(right->key, &key[mid + 1], right->node.num * sizeof(key[0]));
+	memcpy(right->child, &child[mid + 1], (right->node.num + 1) * sizeof(child[0]));
+
+	return key[mid];
+}
+
+/** Insert an element into the tree
+ *
+ * @return
+ *	- true if the element was inserted (or replaced an existing one).
+ *	- false if it was a duplicate, or we ran out of memory.
+ */
+bool fr_btree_insert(fr_btree_t *tree, void const *data)
+{
+	btree_inner_t	*path[BTREE_MAX_DEPTH];
+	unsigned int	pos[BTREE_MAX_DEPTH];
+	btree_inner_t	*spare[BTREE_MAX_DEPTH + 1];
+	unsigned int	depth = 0, level, needed, i, idx;
+	btree_node_t	*node, *split;
+	btree_leaf_t	*leaf, *rleaf;
+	void		*sep, *mutable;
+	bool		found;
+
+	if (unlikely(tree->being_freed)) return false;
+
+	memcpy(&mutable, &data, sizeof(mutable));
+
+#ifndef TALLOC_GET_TYPE_ABORT_NOOP
+	if (tree->type) (void)_talloc_get_type_abort(data, tree->type, __location__);
+#endif
+
+	if (tree->lock) pthread_mutex_lock(&tree->mutex);
+
+	if (!tree->root) {
+		tree->head = leaf_alloc(tree);
+		if (!tree->head) goto oom;
+		tree->root = &tree->head->node;
+	}
+
+	/*
+	 *	Remember the path down, so we can split
+	 *	our way back up without recursing.
+	 */
+	node = tree->root;
+	while (!node->leaf) {
+		pos[depth] = inner_search(tree, INNER(node), data);
+		path[depth] = INNER(node);
+		node = path[depth]->child[pos[depth]];
+		depth++;
+	}
+
+	leaf = LEAF(node);
+	idx = leaf_search(tree, leaf, data, &found);
+	if (found) {
+		void *old;
+
+		if (!tree->replace) {
+			if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+			return false;
+		}
+
+		/*
+		 *	The old element may also be a key in
+		 *	one of the inner nodes above us.
+		 */
+		old = leaf->data[idx];
+		leaf->data[idx] = mutable;
+		for (level = 0; level < depth; level++) {
+			if ((pos[level] > 0) && (path[level]->key[pos[level] - 1] == old)) {
+				path[level]->key[pos[level] - 1] = mutable;
+			}
+		}
+		if (tree->free) tree->free(old);
+
+		if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+		return true;
+	}
+
+	tree->num_elements++;
+
+	if (leaf->node.num < BTREE_MAX) {
+		leaf_insert_at(leaf, idx, mutable);
+		if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+		return true;
+	}
+
+	/*
+	 *	Allocate everything the split needs before
+	 *	touching the tree, so we can't fail half way
+	 *	through.  That's one node for every full
+	 *	ancestor, plus a new root if they're all full.
+	 */
+	for (level = depth; (level > 0) && (path[level - 1]->node.num == BTREE_MAX); level--);
+	needed = (depth - level) + (level == 0);
+
+	rleaf = leaf_alloc(tree);
+	if (!rleaf) {
+	fail:
+		tree->num_elements--;
+		goto oom;
+	}
+	for (i = 0; i < needed; i++) {
+		spare[i] = talloc_zero(tree->node_ctx, btree_inner_t);
+		if (!spare[i]) {
+			while (i > 0) talloc_free(spare[--i]);
+			talloc_free(rleaf);
+			goto fail;
+		}
+	}
+
+	sep = leaf_split(leaf, rleaf, idx, mutable);
+	split = &rleaf->node;
+
+	for (level = depth, i = 0; level > 0; level--) {
+		btree_inner_t	*inner = path[level - 1];
+		unsigned int	c = pos[level - 1];
+
+		if (inner->node.num < BTREE_MAX) {
+			memmove(&inner->key[c + 1], &inner->key[c], (inner->node.num - c) * sizeof(inner->key[0]));
+			memmove(&inner->child[c + 2], &inner->child[c + 1],
+				(inner->node.num - c) * sizeof(inner->child[0]));
+			inner->key[c] = sep;
+			inner->child[c + 1] = split;
+			inner->node.num++;
+			split = NULL;
+			break;
+		}
+
+		sep = inner_split(inner, spare[i], c, sep, split);
+		split = &spare[i++]->node;
+	}
+
+	if (split) {
+		btree_inner_t *root = spare[i];
+
+		root->node.num = 1;
+		root->key[0] = sep;
+		root->child[0] = tree->root;
+		root->child[1] = split;
+		tree->root = &root->node;
+	}
+
+	if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+
+	return true;
+
+oom:
+	fr_strerror_printf("Out of memory");
+	if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+	return false;
+}
+
+/** Merge parent->child[i + 1] into parent->child[i]
+ *
+ */
+static void btree_merge(btree_inner_t *parent, unsigned int i)
+{
+	btree_node_t *a = parent->child[i], *b = parent->child[i + 1];
+
+	if (a->leaf) {
+		btree_leaf_t *la = LEAF(a), *lb = LEAF(b);
+
+		memcpy(&la->data[a->num], lb->data, b->num * sizeof(la->data[0]));
+		a->num += b->num;
+
+		la->next = lb->next;
+		if (la->next) la->next->prev = la;
+	} else {
+		btree_inner_t *ia = INNER(a), *ib = INNER(b);
+
+		ia->key[a->num] = parent->key[i];
+		memcpy(&ia->key[a->num + 1], ib->key, b->num * sizeof(ia->key[0]));
+		memcpy(&ia->child[a->num + 1], ib->child, (b->num + 1) * sizeof(ia->child[0]));
+		a->num += b->num + 1;
+	}
+
+	memmove(&parent->key[i], &parent->key[i + 1], (parent->node.num - i - 1) * sizeof(parent->key[0]));
+	memmove(&parent->child[i + 1], &parent->child[i + 2], (parent->node.num - i - 1) * sizeof(parent->child[0]));
+	parent->node.num--;
+
+	talloc_free(b);
+}
+
+/** Fix up parent->child[c] after it dropped below BTREE_MIN
+ *
+ * Borrow from a sibling if one can spare it, otherwise merge with one.
+ */
+static void btree_rebalance(btree_inner_t *parent, unsigned int c)
+{
+	btree_node_t *node = parent->child[c];
+	btree_node_t *left = (c > 0) ? parent->child[c - 1] : NULL;
+	btree_node_t *right = (c < parent->node.num) ? parent->child[c + 1] : NULL;
+
+	if (left && (left->num > BTREE_MIN)) {
+		if (node->leaf) {
+			btree_leaf_t *leaf = LEAF(node);
+
+			memmove(&leaf->data[1], &leaf->data[0], node->num * sizeof(leaf->data[0]));
+			leaf->data[0] = LEAF(left)->data[left->num - 1];
+			parent->key[c - 1] = leaf->data[0];
+		} else {
+			btree_inner_t *inner = INNER(node);
+
+			memmove(&inner->key[1], &inner->key[0], node->num * sizeof(inner->key[0]));
+			memmove(&inner->child[1], &inner->child[0], (node->num + 1) * sizeof(inner->child[0]));
+			inner->key[0] = parent->key[c - 1];
+			inner->child[0] = INNER(left)->child[left->num];
+			parent->key[c - 1] = INNER(left)->key[left->num - 1];
+		}
+		left->num--;
+		node->num++;
+		return;
+	}
+
+	if (right && (right->num > BTREE_MIN)) {
+		if (node->leaf) {
+			btree_leaf_t *rleaf = LEAF(right);
+
+			LEAF(node)->data[node->num] = rleaf->data[0];
+			memmove(&rleaf->data[0], &rleaf->data[1], (right->num - 1) * sizeof(rleaf->data[0]));
+			parent->key[c] = rleaf->data[0];
+		} else {
+			btree_inner_t *rinner = INNER(right);
+
+			INNER(node)->key[node->num] = parent->key[c];
+			INNER(node)->child[node->num + 1] = rinner->child[0];
+			parent->key[c] = rinner->key[0];
+			memmove(&rinner->key[0], &rinner->key[1], (right->num - 1) * sizeof(rinner->key[0]));
+			memmove(&rinner->child[0], &rinner->child[1], right->num * sizeof(rinner->child[0]));
+		}
+		right->num--;
+		node->num++;
+		return;
+	}
+
+	btree_merge(parent, left ? c - 1 : c);
+}
+
+/** Remove data from under node
+ *
+ * @return
+ *	- The element which was removed.
+ *	- NULL if there was no matching element.
+ */
+static void *btree_remove(fr_btree_t *tree, btree_node_t *node, void const *data)
+{
+	btree_inner_t	*inner;
+	unsigned int	c;
+	void		*removed;
+
+	if (node->leaf) {
+		btree_leaf_t	*leaf = LEAF(node);
+		unsigned int	idx;
+		bool		found;
+
+		idx = leaf_search(tree, leaf, data, &found);
+		if (!found) return NULL;
+
+		removed = leaf->data[idx];
+		memmove(&leaf->data[idx], &leaf->data[idx + 1], (node->num - idx - 1) * sizeof(leaf->data[0]));
+		node->num--;
+		return removed;
+	}
+
+	inner = INNER(node);
+	c = inner_search(tree, inner, data);
+
+	removed = btree_remove(tree, inner->child[c], data);
+	if (!removed) return NULL;
+
+	/*
+	 *	If we removed the smallest element under the
+	 *	child, the key pointing at it must go before
+	 *	anything else looks at it.  When c is 0, the
+	 *	key lives in one of our ancestors.
+	 */
+	if ((c > 0) && (inner->key[c - 1] == removed)) inner->key[c - 1] = node_min(inner->child[c]);
+
+	if (inner->child[c]->num < BTREE_MIN) btree_rebalance(inner, c);
+
+	return removed;
+}
+
+static void *btree_delete_internal(fr_btree_t *tree, void const *data)
+{
+	void *removed;
+
+	if (!tree->root) return NULL;
+
+	removed = btree_remove(tree, tree->root, data);
+	if (!removed) return NULL;
+
+	tree->num_elements--;
+
+	if (!tree->root->leaf && (tree->root->num == 0)) {
+		btree_node_t *old = tree->root;
+
+		tree->root = INNER(old)->child[0];
+		talloc_free(old);
+	}
+
+	if (tree->root->leaf && (tree->root->num == 0)) {
+		talloc_free(tree->root);
+		tree->root = NULL;
+		tree->head = NULL;
+	}
+
+	return removed;
+}
+
+/** Delete an element from the tree, calling the free function if set
+ *
+ * @return
+ *	- true if a matching element was found and deleted.
+ *	- false otherwise.
+ */
+bool fr_btree_deletebydata(fr_btree_t *tree, void const *data)
+{
+	void *removed;
+
+	if (unlikely(tree->being_freed)) return false;
+
+	if (tree->lock) pthread_mutex_lock(&tree->mutex);
+	removed = btree_delete_internal(tree, data);
+	if (removed && tree->free) tree->free(removed);
+	if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+
+	return (removed != NULL);
+}
+
+/** Find an element in the tree
+ *
+ */
+void *fr_btree_finddata(fr_btree_t *tree, void const *data)
+{
+	btree_node_t	*node;
+	void		*found = NULL;
+
+	if (unlikely(tree->being_freed)) return NULL;
+
+	if (tree->lock) pthread_mutex_lock(&tree->mutex);
+
+	node = tree->root;
+	if (node) {
+		unsigned int	idx;
+		bool		match;
+
+		while (!node->leaf) node = INNER(node)->child[inner_search(tree, INNER(node), data)];
+
+		idx = leaf_search(tree, LEAF(node), data, &match);
+		if (match) found = LEAF(node)->data[idx];
+	}
+
+	if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+
+	return found;
+}
+
+uint32_t fr_btree_num_elements(fr_btree_t *tree)
+{
+	if (!tree) return 0;
+
+	return tree->num_elements;
+}
+
+static int walk_delete_order(fr_btree_t *tree, rb_walker_t compare, void *uctx)
+{
+	btree_leaf_t	*leaf = tree->head;
+	unsigned int	idx = 0;
+	int		rcode = 0;
+
+	while (leaf) {
+		void *data, *next;
+
+		if (idx >= leaf->node.num) {
+			leaf = leaf->next;
+			idx = 0;
+			continue;
+		}
+
+		data = leaf->data[idx];
+		rcode = compare(data, uctx);
+		if (rcode < 0) return rcode;
+		if (!rcode) {
+			idx++;
+			continue;
+		}
+
+		/*
+		 *	Deleting may move elements between leaves,
+		 *	so remember where we were by value, and
+		 *	find it again afterwards.
+		 */
+		if ((idx + 1) < leaf->node.num) {
+			next = leaf->data[idx + 1];
+		} else {
+			next = leaf->next ? leaf->next->data[0] : NULL;
+		}
+
+		(void) btree_delete_internal(tree, data);
+		if (tree->free) tree->free(data);
+
+		if ((rcode != 2) || !next) return rcode;
+
+		(void) btree_seek(tree, next, &leaf, &idx);
+	}
+
+	return rcode;
+}
+
+/*
+ *	walk the entire tree.  The compare function CANNOT modify
+ *	the tree.
+ *
+ *	The compare function should return 0 to continue walking.
+ *	Any other value stops the walk, and is returned.
+ */
+int fr_btree_walk(fr_btree_t *tree, rb_order_t order, rb_walker_t compare, void *uctx)
+{
+	btree_leaf_t	*leaf;
+	int		rcode = 0;
+
+	if (!tree->root) return 0;
+
+	if (tree->lock) pthread_mutex_lock(&tree->mutex);
+
+	switch (order) {
+	case RBTREE_PRE_ORDER:
+	case RBTREE_IN_ORDER:
+	case RBTREE_POST_ORDER:
+		for (leaf = tree->head; leaf; leaf = leaf->next) {
+			unsigned int i;
+
+			for (i = 0; i < leaf->node.num; i++) {
+				rcode = compare(leaf->data[i], uctx);
+				if (rcode != 0) goto done;
+			}
+		}
+		break;
+
+	case RBTREE_DELETE_ORDER:
+		rcode = walk_delete_order(tree, compare, uctx);
+		break;
+
+	default:
+		rcode = -1;
+		break;
+	}
+
+done:
+	if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+	return rcode;
+}
+
+/** Return the smallest element, and set the iterator up to return the rest
+ *
+ * Iterators do not take the tree lock.
+ *
+ * @param[in] tree	to iterate over.
+ * @param[out] iter	to initialise.
+ * @return
+ *	- The smallest element.
+ *	- NULL if the tree is empty.
+ */
+void *fr_btree_iter_init(fr_btree_t *tree, fr_btree_iter_t *iter)
+{
+	iter->leaf = tree->head;
+	iter->idx = 0;
+
+	return fr_btree_iter_next(tree, iter);
+}
+
+/** Return the next element in sort order
+ *
+ * @param[in] tree	to iterate over.
+ * @param[in] iter	previously initialised with fr_btree_iter_init().
+ * @return
+ *	- The next element.
+ *	- NULL if there are no more elements.
+ */
+void *fr_btree_iter_next(UNUSED fr_btree_t *tree, fr_btree_iter_t *iter)
+{
+	btree_leaf_t *leaf = iter->leaf;
+
+	while (leaf && (iter->idx >= leaf->node.num)) {
+		leaf = leaf->next;
+		iter->idx = 0;
+	}
+
+	iter->leaf = leaf;
+	if (!leaf) return NULL;
+
+	return leaf->data[iter->idx++];
+}
@@ -0,0 +1,113 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** In-memory B+tree implementation
+ *
+ * A drop-in alternative to rbtree_t for large ordered sets.  It takes the
+ * same comparators, walkers and flags, but stores many elements per node,
+ * so lookups touch fewer cache lines, and ordered iteration is a walk
+ * along a linked list of leaves.
+ *
+ * @file src/lib/util/btree.h
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(btree_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+#include <freeradius-devel/util/rbtree.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <talloc.h>
+
+typedef struct fr_btree_s fr_btree_t;
+
+/** Position of an iterator within the tree
+ *
+ * Invalidated by any insertion into, or deletion from, the tree.
+ */
+typedef struct {
+	void			*leaf;		//!< Leaf we're currently in.
+	unsigned int		idx;		//!< Index of the next element in the leaf.
+} fr_btree_iter_t;
+
+/** Creates a B+tree that verifies elements are of a specific talloc type
+ *
+ * @param[in] _ctx		to tie tree lifetime to.
+ *				If ctx is freed, tree will free any elements, calling the
+ *				free function if set.
+ * @param[in] _cmp		Comparator used to compare elements.
+ * @param[in] _talloc_type	of elements.
+ * @param[in] _node_free	Optional function used to free data if elements are
+ *				deleted or replaced.
+ * @param[in] _flags		RBTREE_FLAG_* to modify tree behaviour.
+ * @return
+ *	- A new B+tree on success.
+ *	- NULL on failure.
+ */
+#define		fr_btree_talloc_alloc(_ctx, _cmp, _talloc_type, _node_free, _flags) \
+		_fr_btree_alloc(_ctx, _cmp, #_talloc_type, _node_free, _flags)
+
+/** Creates a B+tree
+ *
+ * @param[in] _ctx		to tie tree lifetime to.
+ *				If ctx is freed, tree will free any elements, calling the
+ *				free function if set.
+ * @param[in] _cmp		Comparator used to compare elements.
+ * @param[in] _node_free	Optional function used to free data if elements are
+ *				deleted or replaced.
+ * @param[in] _flags		RBTREE_FLAG_* to modify tree behaviour.
+ * @return
+ *	- A new B+tree on success.
+ *	- NULL on failure.
+ */
+#define		fr_btree_alloc(_ctx, _cmp, _node_free, _flags) \
+		_fr_btree_alloc(_ctx, _cmp, NULL, _node_free, _flags)
+
+fr_btree_t	*_fr_btree_alloc(TALLOC_CTX *ctx, rb_comparator_t compare,
+				 char const *type, rb_free_t node_free, int flags);
+
+bool		fr_btree_insert(fr_btree_t *tree, void const *data);
+
+bool		fr_btree_deletebydata(fr_btree_t *tree, void const *data);
+
+void		*fr_btree_finddata(fr_btree_t *tree, void const *data);
+
+uint32_t	fr_btree_num_elements(fr_btree_t *tree);
+
+/*
+ *	Callbacks are the same as for rbtree_walk().
+ *
+ *	A B+tree has no useful notion of pre or post order, so
+ *	RBTREE_PRE_ORDER and RBTREE_POST_ORDER walk the elements in
+ *	order.  RBTREE_DELETE_ORDER behaves as it does for rbtree_walk().
+ */
+int		fr_btree_walk(fr_btree_t *tree, rb_order_t order, rb_walker_t compare, void *uctx);
+
+void		*fr_btree_iter_init(fr_btree_t *tree, fr_btree_iter_t *iter);
+
+void		*fr_btree_iter_next(fr_btree_t *tree, fr_btree_iter_t *iter);
+
+#ifdef __cplusplus
+}
+#endif
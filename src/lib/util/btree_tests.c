@@ -0,0 +1,189 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "btree.c"
+
+typedef struct {
+	uint32_t	num;
+} btree_thing;
+
+static int btree_thing_cmp(void const *one, void const *two)
+{
+	btree_thing const *a = one, *b = two;
+
+	return (a->num > b->num) - (a->num < b->num);
+}
+
+/** Check the structure of a subtree, returning its depth, or -1 on error
+ *
+ * Every key must be the smallest element under the child to its right,
+ * and every node other than the root must be at least half full.
+ */
+static int btree_check_node(fr_btree_t *tree, btree_node_t *node, bool root,
+			    void const *lo, void const *hi)
+{
+	unsigned int	i;
+	int		depth = -1;
+
+	if (!root && (node->num < BTREE_MIN)) return -1;
+
+	if (node->leaf) {
+		btree_leaf_t *leaf = LEAF(node);
+
+		for (i = 0; i < node->num; i++) {
+			if (lo && (tree->compare(leaf->data[i], lo) < 0)) return -1;
+			if (hi && (tree->compare(leaf->data[i], hi) >= 0)) return -1;
+			if ((i > 0) && (tree->compare(leaf->data[i - 1], leaf->data[i]) >= 0)) return -1;
+		}
+		return 1;
+	}
+
+	for (i = 0; i <= node->num; i++) {
+		btree_node_t	*child = INNER(node)->child[i];
+		int		ret;
+
+		if ((i > 0) && (INNER(node)->key[i - 1] != node_min(child))) return -1;
+
+		ret = btree_check_node(tree, child,  false,
+				       (i > 0) ? INNER(node)->key[i - 1] : lo,
+				       (i < node->num) ? INNER(node)->key[i] : hi);
+		if (ret < 0) return -1;
+		if ((depth >= 0) && (ret != depth)) return -1;	/* Unbalanced */
+		depth = ret;
+	}
+
+	return depth + 1;
+}
+
+static bool btree_check(fr_btree_t *tree)
+{
+	if (!tree->root) return (tree->num_elements == 0);
+
+	return btree_check_node(tree, tree->root, true, NULL, NULL) > 0;
+}
+
+static bool btree_check_order(fr_btree_t *tree, uint32_t expected)
+{
+	fr_btree_iter_t	iter;
+	btree_thing	*p, *prev = NULL;
+	uint32_t	count = 0;
+
+	for (p = fr_btree_iter_init(tree, &iter); p; p = fr_btree_iter_next(tree, &iter)) {
+		if (prev && (prev->num >= p->num)) return false;
+		prev = p;
+		count++;
+	}
+
+	return count == expected;
+}
+
+#define BTREE_TEST_SIZE (16384)
+
+static btree_thing *btree_test_array(bool shuffle)
+{
+	btree_thing	*array;
+	uint32_t	i;
+
+	array = talloc_array(NULL, btree_thing, BTREE_TEST_SIZE);
+	for (i = 0; i < BTREE_TEST_SIZE; i++) array[i].num = i * 2;	/* Odd numbers are never inserted */
+
+	if (shuffle) for (i = BTREE_TEST_SIZE - 1; i > 0; i--) {
+		uint32_t	j = random() % (i + 1);
+		btree_thing	tmp = array[i];
+
+		array[i] = array[j];
+		array[j] = tmp;
+	}
+
+	return array;
+}
+
+static void btree_test_insert_delete(void)
+{
+	fr_btree_t	*tree;
+	btree_thing	*array, miss;
+	uint32_t	i;
+
+	tree = fr_btree_alloc(NULL, btree_thing_cmp, NULL, RBTREE_FLAG_NONE);
+	TEST_CHECK(tree != NULL);
+
+	array = btree_test_array(true);
+
+	for (i = 0; i < BTREE_TEST_SIZE; i++) {
+		TEST_CHECK(fr_btree_insert(tree, &array[i]));
+		TEST_MSG("insert %u failed", array[i].num);
+	}
+	TEST_CHECK(!fr_btree_insert(tree, &array[0]));
+	TEST_CHECK(fr_btree_num_elements(tree) == BTREE_TEST_SIZE);
+	TEST_CHECK(btree_check(tree));
+	TEST_CHECK(btree_check_order(tree, BTREE_TEST_SIZE));
+
+	for (i = 0; i < BTREE_TEST_SIZE; i++) {
+		TEST_CHECK(fr_btree_finddata(tree, &array[i]) == &array[i]);
+		miss.num = array[i].num + 1;
+		TEST_CHECK(fr_btree_finddata(tree, &miss) == NULL);
+	}
+
+	/*
+	 *	Delete half, in random order, checking the
+	 *	structure as we go.
+	 */
+	for (i = 0; i < BTREE_TEST_SIZE / 2; i++) {
+		TEST_CHECK(fr_btree_deletebydata(tree, &array[i]));
+		if ((i % 1024) == 0) TEST_CHECK(btree_check(tree));
+	}
+	TEST_CHECK(!fr_btree_deletebydata(tree, &array[0]));
+	TEST_CHECK(btree_check(tree));
+	TEST_CHECK(btree_check_order(tree, BTREE_TEST_SIZE / 2));
+
+	for (i = 0; i < BTREE_TEST_SIZE; i++) {
+		btree_thing *found = fr_btree_finddata(tree, &array[i]);
+
+		TEST_CHECK(found == ((i < BTREE_TEST_SIZE / 2) ? NULL : &array[i]));
+	}
+
+	for (i = BTREE_TEST_SIZE / 2; i < BTREE_TEST_SIZE; i++) TEST_CHECK(fr_btree_deletebydata(tree, &array[i]));
+	TEST_CHECK(fr_btree_num_elements(tree) == 0);
+	TEST_CHECK(tree->root == NULL);
+
+	talloc_free(tree);
+	talloc_free(array);
+}
+
+static int btree_delete_odd(void *data, UNUSED void *uctx)
+{
+	btree_thing *p = data;
+
+	return ((p->num / 2) % 2) ? 2 : 0;
+}
+
+static void btree_test_walk(void)
+{
+	fr_btree_t	*tree;
+	btree_thing	*array;
+	fr_btree_iter_t	iter;
+	btree_thing	*p;
+	uint32_t	i;
+
+	tree = fr_btree_alloc(NULL, btree_thing_cmp, NULL, RBTREE_FLAG_LOCK);
+	array = btree_test_array(true);
+	for (i = 0; i < BTREE_TEST_SIZE; i++) fr_btree_insert(tree, &array[i]);
+
+	TEST_CHECK(fr_btree_walk(tree, RBTREE_DELETE_ORDER, btree_delete_odd, NULL) >= 0);
+	TEST_CHECK(fr_btree_num_elements(tree) == BTREE_TEST_SIZE / 2);
+	TEST_CHECK(btree_check(tree));
+
+	for (p = fr_btree_iter_init(tree, &iter), i = 0; p; p = fr_btree_iter_next(tree, &iter), i++) {
+		TEST_CHECK(p->num == i * 4);
+		TEST_MSG("expected %u, got %u", i * 4, p->num);
+	}
+	TEST_CHECK(i == BTREE_TEST_SIZE / 2);
+
+	talloc_free(tree);
+	talloc_free(array);
+}
+
+TEST_LIST = {
+	{ "btree_test_insert_delete",	btree_test_insert_delete	},
+	{ "btree_test_walk",		btree_test_walk			},
+	{ NULL }
+};
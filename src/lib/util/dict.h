@@ -70,6 +70,9 @@ typedef struct {
 	unsigned int 		is_unknown : 1;			//!< &Attr-1.2.3.4 taken from a packet
 	unsigned int		is_raw : 1;			//!< &Attr-1.2.3.4 taken from the config,
 								//!< and added (along with parents) to the dictionionaries
+	unsigned int		is_interned : 1;		//!< Unknown attribute shared through the
+								///< per-thread cache.  Must not be freed,
+								///< stolen, or used by a pair.
 	unsigned int		internal : 1;			//!< Internal attribute, should not be received
 								///< in protocol packets, should not be encoded.
 	unsigned int		has_tag : 1;			//!< Tagged attribute.
@@ -439,6 +442,16 @@ int			fr_dict_free(fr_dict_t **dict);
  *
  * @{
  */
+
+/** How pre-tokenized dictionary caches are used
+ *
+ */
+typedef enum {
+	FR_DICT_CACHE_READ = 0,					//!< Use caches which are up to date (default).
+	FR_DICT_CACHE_NONE,					//!< Always read the dictionary files.
+	FR_DICT_CACHE_WRITE					//!< Read the dictionary files, and write caches.
+} fr_dict_cache_mode_t;
+
 fr_dict_gctx_t const	*fr_dict_global_ctx_init(TALLOC_CTX *ctx, char const *dict_dir);
 
 void			fr_dict_global_ctx_set(fr_dict_gctx_t const *gctx);
@@ -449,6 +462,10 @@ int			fr_dict_global_ctx_dir_set(char const *dict_dir);
 
 void			fr_dict_global_read_only(void);
 
+void			fr_dict_global_cache_mode_set(fr_dict_cache_mode_t mode);
+
+void			fr_dict_global_lazy_set(bool lazy);
+
 char const		*fr_dict_global_dir(void);
 
 fr_dict_t		*fr_dict_unconst(fr_dict_t const *dict);
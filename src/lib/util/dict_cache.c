@@ -0,0 +1,545 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Pre-tokenized dictionary caches
+ *
+ * A cache holds every line of every file read when loading a dictionary,
+ * already split into arguments, along with the size, mtime and inode of
+ * each file.  When all of the files are unchanged, the tokenizer reads
+ * lines from the mmap'd cache instead of opening, reading and splitting
+ * each file again.  If anything has changed, the cache is ignored.
+ *
+ * Caches are written by "radict -C", as @verbatim <dir>/<filename>.cache @endverbatim
+ * alongside the top level dictionary file.  The format is native endian, and
+ * is only meant to be read on the machine which wrote it.
+ *
+ * @file src/lib/util/dict_cache.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/dict_priv.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DICT_CACHE_MAGIC	"FRDICT\0"
+#define DICT_CACHE_VERSION	(1)
+#define DICT_CACHE_ALIGN(_x)	(((_x) + 7) & ~((size_t) 7))
+
+/** Start of a cache file
+ *
+ */
+typedef struct {
+	char			magic[8];	//!< #DICT_CACHE_MAGIC.
+	uint32_t		version;	//!< #DICT_CACHE_VERSION.
+	uint32_t		num_files;	//!< Number of files which follow.
+	uint64_t		len;		//!< Of the whole cache, to catch truncation.
+} dict_cache_hdr_t;
+
+/** Start of each source file, followed by its path, then its lines
+ *
+ */
+typedef struct {
+	uint64_t		size;		//!< st_size of the file.
+	int64_t			mtime;		//!< st_mtime of the file.
+	uint64_t		ino;		//!< st_ino of the file.
+	uint32_t		missing;	//!< The file didn't exist, and was an optional $INCLUDE-.
+	uint32_t		path_len;	//!< Including the trailing '\\0'.
+	uint64_t		data_len;	//!< Length of the lines.
+} dict_cache_file_hdr_t;
+
+/** Start of each line, followed by its arguments, each '\\0' terminated
+ *
+ */
+typedef struct {
+	uint32_t		line;		//!< Line number in the source file.
+	uint16_t		len;		//!< Length of the arguments.
+	uint16_t		argc;		//!< Number of arguments.
+} dict_cache_line_t;
+
+struct dict_cache_file_s {
+	char const		*path;		//!< Of the source file.
+	struct stat		sb;		//!< Of the source file at the time it was read.
+	bool			missing;	//!< Source file didn't exist.
+	uint8_t			*data;		//!< Lines.
+	size_t			data_len;	//!< How much of data is used.
+};
+
+struct dict_cache_s {
+	char			*path;		//!< Of the cache.
+
+	/*
+	 *	Reading
+	 */
+	uint8_t const		*map;		//!< mmap'd cache.
+	size_t			map_len;	//!< Length of the mapping.
+	uint8_t const		*next;		//!< Next file header to return.
+	uint32_t		files_left;	//!< Files not yet returned.
+
+	/*
+	 *	Writing
+	 */
+	dict_cache_file_t	**files;	//!< In the order they were opened.
+	uint32_t		num_files;	//!< Number of files.
+};
+
+static int _dict_cache_free(dict_cache_t *cache)
+{
+	if (cache->map) {
+		void *map;
+
+		memcpy(&map, &cache->map, sizeof(map));
+		munmap(map, cache->map_len);
+	}
+
+	return 0;
+}
+
+static char *dict_cache_path(TALLOC_CTX *ctx, char const *dir, char const *filename)
+{
+	if (!FR_DIR_IS_RELATIVE(filename)) return talloc_asprintf(ctx, "%s.cache", filename);
+
+	return talloc_asprintf(ctx, "%s%c%s.cache", dir, FR_DIR_SEP, filename);
+}
+
+/** Check that a source file is the same as it was when the cache was written
+ *
+ */
+static bool dict_cache_file_valid(dict_cache_file_hdr_t const *fh, char const *path)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) < 0) return (fh->missing && (errno == ENOENT));
+	if (fh->missing) return false;
+
+	if (!S_ISREG(sb.st_mode)) return false;
+#ifdef S_IWOTH
+	if ((sb.st_mode & S_IWOTH) != 0) return false;
+#endif
+
+	return ((uint64_t) sb.st_size == fh->size) &&
+	       ((int64_t) sb.st_mtime == fh->mtime) &&
+	       ((uint64_t) sb.st_ino == fh->ino);
+}
+
+/** Open a dictionary cache, if there's one which is up to date
+ *
+ * @param[in] ctx	to allocate the cache in.
+ * @param[in] dir	the top level dictionary file is in.
+ * @param[in] filename	of the top level dictionary file.
+ * @return
+ *	- A cache which can be read with dict_cache_file_next().
+ *	- NULL if there's no cache, or it's out of date.
+ */
+dict_cache_t *dict_cache_open(TALLOC_CTX *ctx, char const *dir, char const *filename)
+{
+	dict_cache_t			*cache;
+	dict_cache_hdr_t const		*hdr;
+	uint8_t const			*p, *end;
+	struct stat			sb;
+	uint32_t			i;
+	void				*map;
+	int				fd;
+
+	cache = talloc_zero(ctx, dict_cache_t);
+	if (!cache) return NULL;
+
+	cache->path = dict_cache_path(cache, dir, filename);
+	if (!cache->path) {
+	error:
+		talloc_free(cache);
+		return NULL;
+	}
+
+	fd = open(cache->path, O_RDONLY);
+	if (fd < 0) goto error;
+
+	if ((fstat(fd, &sb) < 0) || !S_ISREG(sb.st_mode) ||
+#ifdef S_IWOTH
+	    ((sb.st_mode & S_IWOTH) != 0) ||
+#endif
+	    ((size_t) sb.st_size < sizeof(*hdr))) {
+		close(fd);
+		goto error;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) goto error;
+
+	cache->map = map;
+	cache->map_len = sb.st_size;
+	talloc_set_destructor(cache, _dict_cache_free);
+
+	hdr = (dict_cache_hdr_t const *) cache->map;
+	if ((memcmp(hdr->magic, DICT_CACHE_MAGIC, sizeof(hdr->magic)) != 0) ||
+	    (hdr->version != DICT_CACHE_VERSION) ||
+	    (hdr->len != cache->map_len)) goto error;
+
+	/*
+	 *	Check every file, and the structure of the cache,
+	 *	before we use any of it.  Once the tokenizer starts
+	 *	reading from the cache, it can't go back to the
+	 *	source files.
+	 */
+	p = cache->map + sizeof(*hdr);
+	end = cache->map + cache->map_len;
+	for (i = 0; i < hdr->num_files; i++) {
+		dict_cache_file_hdr_t const	*fh = (dict_cache_file_hdr_t const *) p;
+		char const			*path;
+
+		if ((size_t) (end - p) < sizeof(*fh)) goto error;
+		p += sizeof(*fh);
+
+		if ((fh->path_len == 0) || ((size_t) (end - p) < DICT_CACHE_ALIGN(fh->path_len))) goto error;
+		path = (char const *) p;
+		if (path[fh->path_len - 1] != '\0') goto error;
+		p += DICT_CACHE_ALIGN(fh->path_len);
+
+		if ((uint64_t) (end - p) < DICT_CACHE_ALIGN(fh->data_len)) goto error;
+		p += DICT_CACHE_ALIGN(fh->data_len);
+
+		if (!dict_cache_file_valid(fh, path)) goto error;
+	}
+	if (p != end) goto error;
+
+	cache->next = cache->map + sizeof(*hdr);
+	cache->files_left = hdr->num_files;
+
+	return cache;
+}
+
+/** Start reading the lines of the next file in the cache
+ *
+ * Files are returned in the order the tokenizer opened them when the cache
+ * was written.  Provided the files haven't changed, it will open them in the
+ * same order when reading the cache.
+ *
+ * @param[out] cursor	to read the lines of the file with.
+ * @param[in] cache	to read from.
+ * @param[in] fn	the tokenizer expects the file to be.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the cache doesn't match what the tokenizer is loading.
+ *	- -2 if the file didn't exist when the cache was written.
+ */
+int dict_cache_file_next(dict_cache_cursor_t *cursor, dict_cache_t *cache, char const *fn)
+{
+	dict_cache_file_hdr_t const	*fh;
+	char const			*path;
+	uint8_t const			*p = cache->next;
+
+	if (!cache->files_left) {
+	mismatch:
+		fr_strerror_printf("Dictionary cache %s doesn't match %s.  Re-run \"radict -C\", "
+				   "or delete the cache", cache->path, fn);
+		return -1;
+	}
+
+	fh = (dict_cache_file_hdr_t const *) p;
+	p += sizeof(*fh);
+	path = (char const *) p;
+	p += DICT_CACHE_ALIGN(fh->path_len);
+
+	if (strcmp(path, fn) != 0) goto mismatch;
+
+	cursor->p = p;
+	cursor->end = p + fh->data_len;
+
+	cache->next = p + DICT_CACHE_ALIGN(fh->data_len);
+	cache->files_left--;
+
+	return fh->missing ? -2 : 0;
+}
+
+/** Read the next line of a file from the cache
+ *
+ * @param[in,out] cursor	of the file to read from.
+ * @param[out] line		number of the line in the source file.
+ * @param[in] buf		to copy the arguments to.  The tokenizer may modify them.
+ * @param[in] bufsize		size of buf.
+ * @param[out] argv		pointers to each argument in buf.
+ * @param[in] max_argc		size of argv.
+ * @return
+ *	- >0 the number of arguments.
+ *	- 0 at the end of the file.
+ *	- -1 if the cache is corrupt.
+ */
+int dict_cache_line_next(dict_cache_cursor_t *cursor, int *line,
+			 char *buf, size_t bufsize, char **argv, int max_argc)
+{
+	dict_cache_line_t const	*dl;
+	char			*p, *end;
+	int			argc;
+
+	if (cursor->p >= cursor->end) return 0;
+
+	if ((size_t) (cursor->end - cursor->p) < sizeof(*dl)) {
+	corrupt:
+		fr_strerror_printf("Dictionary cache is corrupt");
+		return -1;
+	}
+
+	dl = (dict_cache_line_t const *) cursor->p;
+	if ((dl->len == 0) || (dl->len > bufsize) || (dl->argc == 0) || (dl->argc > max_argc) ||
+	    ((size_t) (cursor->end - cursor->p) < (sizeof(*dl) + dl->len))) goto corrupt;
+
+	memcpy(buf, cursor->p + sizeof(*dl), dl->len);
+	if (buf[dl->len - 1] != '\0') goto corrupt;
+
+	for (p = buf, end = buf + dl->len, argc = 0; p < end; p += strlen(p) + 1) {
+		if (argc == dl->argc) goto corrupt;
+		argv[argc++] = p;
+	}
+	if (argc != dl->argc) goto corrupt;
+
+	*line = dl->line;
+	cursor->p += (sizeof(*dl) + dl->len + 3) & ~((size_t) 3);
+
+	return argc;
+}
+
+/** Allocate a cache to record a dictionary into as it's loaded
+ *
+ * @param[in] ctx	to allocate the cache in.
+ * @param[in] dir	the top level dictionary file is in.
+ * @param[in] filename	of the top level dictionary file.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+dict_cache_t *dict_cache_alloc(TALLOC_CTX *ctx, char const *dir, char const *filename)
+{
+	dict_cache_t *cache;
+
+	cache = talloc_zero(ctx, dict_cache_t);
+	if (!cache) return NULL;
+
+	cache->path = dict_cache_path(cache, dir, filename);
+	if (!cache->path) {
+		talloc_free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+/** Record that a file was opened
+ *
+ * @param[in] cache	to record the file in.
+ * @param[in] fn	of the file.
+ * @param[in] sb	of the file, or NULL if it doesn't exist.
+ * @return
+ *	- A handle to record the lines of the file with.
+ *	- NULL on error.
+ */
+dict_cache_file_t *dict_cache_file_add(dict_cache_t *cache, char const *fn, struct stat const *sb)
+{
+	dict_cache_file_t	*file, **files;
+
+	files = talloc_realloc(cache, cache->files, dict_cache_file_t *, cache->num_files + 1);
+	if (!files) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	cache->files = files;
+
+	file = talloc_zero(cache, dict_cache_file_t);
+	if (!file) goto oom;
+
+	file->path = talloc_strdup(file, fn);
+	if (!file->path) {
+		talloc_free(file);
+		goto oom;
+	}
+
+	if (sb) {
+		file->sb = *sb;
+	} else {
+		file->missing = true;
+	}
+
+	cache->files[cache->num_files++] = file;
+
+	return file;
+}
+
+/** Record a tokenized line
+ *
+ * @param[in] file	the line was read from.
+ * @param[in] line	number.
+ * @param[in] argc	number of arguments.
+ * @param[in] argv	arguments, before the tokenizer has modified them.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int dict_cache_line_add(dict_cache_file_t *file, int line, int argc, char * const argv[])
+{
+	dict_cache_line_t	dl = { .line = line, .argc = argc };
+	size_t			len = 0, need;
+	uint8_t			*p;
+	int			i;
+
+	for (i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+	if (len > UINT16_MAX) {
+		fr_strerror_printf("Line too long");
+		return -1;
+	}
+	dl.len = len;
+
+	need = file->data_len + ((sizeof(dl) + len + 3) & ~((size_t) 3));
+	if (need > talloc_array_length(file->data)) {
+		uint8_t *data;
+
+		data = talloc_realloc(file, file->data, uint8_t, need * 2);
+		if (!data) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		file->data = data;
+	}
+
+	p = file->data + file->data_len;
+	memset(p, 0, need - file->data_len);
+	memcpy(p, &dl, sizeof(dl));
+	p += sizeof(dl);
+	for (i = 0; i < argc; i++) {
+		size_t arg_len = strlen(argv[i]) + 1;
+
+		memcpy(p, argv[i], arg_len);
+		p += arg_len;
+	}
+	file->data_len = need;
+
+	return 0;
+}
+
+/** Write data, padded to the alignment of the cache format
+ *
+ */
+static int dict_cache_write(int fd, void const *data, size_t len)
+{
+	static uint8_t const	pad[8];
+	uint8_t const		*p = data;
+	size_t			left = len, pad_len = DICT_CACHE_ALIGN(len) - len;
+
+	for (;;) {
+		while (left > 0) {
+			ssize_t slen;
+
+			slen = write(fd, p, left);
+			if (slen < 0) {
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			p += slen;
+			left -= slen;
+		}
+
+		if (!pad_len) break;
+
+		p = pad;
+		left = pad_len;
+		pad_len = 0;
+	}
+
+	return 0;
+}
+
+/** Write out a cache which has been recorded
+ *
+ * The cache is written to a temporary file, then renamed into place, so
+ * anything reading the cache at the same time sees either the old one
+ * or the new one.
+ *
+ * @param[in] cache	to write.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int dict_cache_commit(dict_cache_t *cache)
+{
+	dict_cache_hdr_t	hdr = { .magic = DICT_CACHE_MAGIC, .version = DICT_CACHE_VERSION };
+	char			*tmp;
+	uint32_t		i;
+	int			fd;
+
+	hdr.num_files = cache->num_files;
+	hdr.len = sizeof(hdr);
+	for (i = 0; i < cache->num_files; i++) {
+		hdr.len += sizeof(dict_cache_file_hdr_t) +
+			   DICT_CACHE_ALIGN(strlen(cache->files[i]->path) + 1) +
+			   DICT_CACHE_ALIGN(cache->files[i]->data_len);
+	}
+
+	tmp = talloc_asprintf(NULL, "%s.%u", cache->path, (unsigned int) getpid());
+	if (!tmp) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fr_strerror_printf("Failed creating dictionary cache %s: %s", tmp, fr_syserror(errno));
+		talloc_free(tmp);
+		return -1;
+	}
+
+	if (dict_cache_write(fd, &hdr, sizeof(hdr)) < 0) {
+	error:
+		fr_strerror_printf("Failed writing dictionary cache %s: %s", tmp, fr_syserror(errno));
+		close(fd);
+		unlink(tmp);
+		talloc_free(tmp);
+		return -1;
+	}
+
+	for (i = 0; i < cache->num_files; i++) {
+		dict_cache_file_t	*file = cache->files[i];
+		dict_cache_file_hdr_t	fh = {
+						.missing = file->missing,
+						.path_len = strlen(file->path) + 1,
+						.data_len = file->data_len
+					};
+
+		if (!file->missing) {
+			fh.size = file->sb.st_size;
+			fh.mtime = file->sb.st_mtime;
+			fh.ino = file->sb.st_ino;
+		}
+
+		if ((dict_cache_write(fd, &fh, sizeof(fh)) < 0) ||
+		    (dict_cache_write(fd, file->path, fh.path_len) < 0) ||
+		    (file->data_len && (dict_cache_write(fd, file->data, file->data_len) < 0))) goto error;
+	}
+
+	if ((close(fd) < 0) || (rename(tmp, cache->path) < 0)) {
+		fr_strerror_printf("Failed writing dictionary cache %s: %s", cache->path, fr_syserror(errno));
+		unlink(tmp);
+		talloc_free(tmp);
+		return -1;
+	}
+	talloc_free(tmp);
+
+	return 0;
+}
@@ -32,8 +32,11 @@ extern "C" {
 #include <freeradius-devel/util/dl.h>
 #include <freeradius-devel/protocol/base.h>
 
+#include <sys/stat.h>
+
 #define DICT_POOL_SIZE		(1024 * 1024 * 2)
 #define DICT_FIXUP_POOL_SIZE	(1024)
+#define DICT_CHILDREN_BINS	(UINT8_MAX + 1)	//!< Size of child arrays while loading.
 
 /** Set the internal dictionary if none was provided
  *
@@ -103,6 +106,9 @@ struct fr_dict {
 
 struct fr_dict_gctx_s {
 	bool			read_only;
+	bool			lazy;			//!< Load protocol dictionaries the first time
+							///< a qualified name references them.
+	fr_dict_cache_mode_t	cache_mode;		//!< Whether dictionary caches are used, or written.
 	char			*dict_dir_default;	//!< The default location for loading dictionaries if one
 							///< wasn't provided.
 
@@ -171,6 +177,25 @@ static inline void dict_attr_init(fr_dict_attr_t *da,
 	}
 }
 
+/** Return the start of the chain of children which may have attribute number attr
+ *
+ * While a dictionary is being loaded, children are stored in #DICT_CHILDREN_BINS
+ * bins, indexed by attribute number modulo the number of bins.
+ *
+ * Once the dictionary is frozen, arrays whose children all fit are trimmed to
+ * the largest child number, still indexed modulo #DICT_CHILDREN_BINS.  Arrays
+ * with more than #DICT_CHILDREN_BINS entries are indexed directly by number.
+ */
+static inline fr_dict_attr_t const *dict_attr_children_bin(fr_dict_attr_t const *parent, unsigned int attr)
+{
+	size_t	len = talloc_array_length(parent->children);
+	size_t	slot = (len > DICT_CHILDREN_BINS) ? attr : (attr & UINT8_MAX);
+
+	if (slot >= len) return NULL;
+
+	return parent->children[slot];
+}
+
 fr_dict_attr_t 		*dict_attr_alloc_name(TALLOC_CTX *ctx, char const *name);
 
 fr_dict_attr_t		*dict_attr_alloc(TALLOC_CTX *ctx,
@@ -180,6 +205,41 @@ fr_dict_attr_t		*dict_attr_alloc(TALLOC_CTX *ctx,
 
 int			dict_attr_child_add(fr_dict_attr_t *parent, fr_dict_attr_t *child);
 
+int			dict_freeze(fr_dict_t *dict);
+
+void			dict_unknown_cache_invalidate(void);
+
+/** @name Pre-tokenized dictionary caches
+ *
+ * @{
+ */
+typedef struct dict_cache_s dict_cache_t;
+typedef struct dict_cache_file_s dict_cache_file_t;
+
+/** Position within the lines of one file in a dictionary cache
+ *
+ */
+typedef struct {
+	uint8_t const		*p;			//!< Next line.
+	uint8_t const		*end;			//!< End of the lines for this file.
+} dict_cache_cursor_t;
+
+dict_cache_t		*dict_cache_open(TALLOC_CTX *ctx, char const *dir, char const *filename);
+
+int			dict_cache_file_next(dict_cache_cursor_t *cursor, dict_cache_t *cache, char const *fn);
+
+int			dict_cache_line_next(dict_cache_cursor_t *cursor, int *line,
+					     char *buf, size_t bufsize, char **argv, int max_argc);
+
+dict_cache_t		*dict_cache_alloc(TALLOC_CTX *ctx, char const *dir, char const *filename);
+
+dict_cache_file_t	*dict_cache_file_add(dict_cache_t *cache, char const *fn, struct stat const *sb);
+
+int			dict_cache_line_add(dict_cache_file_t *file, int line, int argc, char * const argv[]);
+
+int			dict_cache_commit(dict_cache_t *cache);
+/** @} */
+
 int			dict_protocol_add(fr_dict_t *dict);
 
 int			dict_vendor_add(fr_dict_t *dict, char const *name, unsigned int num);
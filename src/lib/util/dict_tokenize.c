@@ -91,6 +91,9 @@ typedef struct {
 
 	dict_enum_fixup_t	*enum_fixup;
 	dict_group_fixup_t	*group_fixup;
+
+	dict_cache_t		*cache;			//!< Pre-tokenized lines to read instead of the files.
+	dict_cache_t		*record;		//!< Where to record the lines we read.
 } dict_tokenize_ctx_t;
 
 /*
@@ -1614,7 +1617,7 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 			   char const *dir_name, char const *filename,
 			   char const *src_file, int src_line)
 {
-	FILE			*fp;
+	FILE			*fp = NULL;
 	char 			dir[256], fn[256];
 	char			buf[256];
 	char			*p;
@@ -1624,6 +1627,8 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 	char			*argv[MAX_ARGV];
 	int			argc;
 	fr_dict_attr_t const	*da;
+	dict_cache_cursor_t	cursor;
+	dict_cache_file_t	*record = NULL;
 
 	/*
 	 *	Base flags are only set for the current file
@@ -1680,7 +1685,41 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 
 	ctx->stack[ctx->stack_depth].filename = fn;
 
+	/*
+	 *	Read the pre-tokenized lines for this file from the
+	 *	cache.  The cache was checked against all of the files
+	 *	when it was opened.
+	 */
+	if (ctx->cache) {
+		int ret;
+
+		ret = dict_cache_file_next(&cursor, ctx->cache, fn);
+		if (ret == -2) {
+			fr_strerror_printf_push("Couldn't open dictionary %s: %s", fr_syserror(ENOENT), fn);
+			return -2;
+		}
+
+		if (ret == 0) {
+			memset(&base_flags, 0, sizeof(base_flags));
+			goto read_lines;
+		}
+
+		/*
+		 *	Part way through, there's no going back.
+		 */
+		if (src_file) return -1;
+
+		/*
+		 *	Nothing has been read yet.  The cache is for
+		 *	some other path to the same file, so ignore it.
+		 */
+		TALLOC_FREE(ctx->cache);
+		fr_strerror_printf(NULL);
+	}
+
 	if ((fp = fopen(fn, "r")) == NULL) {
+		if (ctx->record && (errno == ENOENT) && !dict_cache_file_add(ctx->record, fn, NULL)) return -1;
+
 		if (!src_file) {
 			fr_strerror_printf_push("Couldn't open dictionary %s: %s", fr_syserror(errno), fn);
 		} else {
@@ -1695,12 +1734,12 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 	 *	If fopen works, this works.
 	 */
 	if (stat(fn, &statbuf) < 0) {
-		fclose(fp);
+		if (fp) fclose(fp);
 		return -1;
 	}
 
 	if (!S_ISREG(statbuf.st_mode)) {
-		fclose(fp);
+		if (fp) fclose(fp);
 		fr_strerror_printf_push("Dictionary is not a regular file: %s", fn);
 		return -1;
 	}
@@ -1711,13 +1750,21 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 	 */
 #ifdef S_IWOTH
 	if ((statbuf.st_mode & S_IWOTH) != 0) {
-		fclose(fp);
+		if (fp) fclose(fp);
 		fr_strerror_printf_push("Dictionary is globally writable: %s. "
 					"Refusing to start due to insecure configuration", fn);
 		return -1;
 	}
 #endif
 
+	if (ctx->record) {
+		record = dict_cache_file_add(ctx->record, fn, &statbuf);
+		if (!record) {
+			if (fp) fclose(fp);
+			return -1;
+		}
+	}
+
 	/*
 	 *	Seed the random pool with data.
 	 */
@@ -1725,33 +1772,53 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 
 	memset(&base_flags, 0, sizeof(base_flags));
 
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		ctx->stack[ctx->stack_depth].line = line++;
+read_lines:
+	for (;;) {
+		if (!fp) {
+			argc = dict_cache_line_next(&cursor, &line, buf, sizeof(buf), argv, MAX_ARGV);
+			if (argc == 0) break;
+			if (argc < 0) {
+				fr_strerror_printf_push("Error reading %s", fn);
+				return -1;
+			}
+			ctx->stack[ctx->stack_depth].line = line - 1;
 
-		switch (buf[0]) {
-		case '#':
-		case '\0':
-		case '\n':
-		case '\r':
-			continue;
-		}
+		} else {
+			if (fgets(buf, sizeof(buf), fp) == NULL) break;
 
-		/*
-		 *  Comment characters should NOT be appearing anywhere but
-		 *  as start of a comment;
-		 */
-		p = strchr(buf, '#');
-		if (p) *p = '\0';
+			ctx->stack[ctx->stack_depth].line = line++;
+
+			switch (buf[0]) {
+			case '#':
+			case '\0':
+			case '\n':
+			case '\r':
+				continue;
+			}
 
-		argc = fr_dict_str_to_argv(buf, argv, MAX_ARGV);
-		if (argc == 0) continue;
+			/*
+			 *  Comment characters should NOT be appearing anywhere but
+			 *  as start of a comment;
+			 */
+			p = strchr(buf, '#');
+			if (p) *p = '\0';
+
+			argc = fr_dict_str_to_argv(buf, argv, MAX_ARGV);
+			if (argc == 0) continue;
+
+			/*
+			 *	Record the line before the keyword handlers
+			 *	below modify the arguments.
+			 */
+			if (record && (dict_cache_line_add(record, line, argc, argv) < 0)) goto error;
+		}
 
 		if (argc == 1) {
 			fr_strerror_printf("Invalid entry");
 
 		error:
 			fr_strerror_printf_push("Error reading %s[%d]", fn, line);
-			fclose(fp);
+			if (fp) fclose(fp);
 			return -1;
 		}
 
@@ -1834,13 +1901,13 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 
 			if (rcode < 0) {
 				fr_strerror_printf_push("from $INCLUDE at %s[%d]", fn, line);
-				fclose(fp);
+				if (fp) fclose(fp);
 				return -1;
 			}
 
 			if (ctx->stack_depth < stack_depth) {
 				fr_strerror_printf_push("unexpected END-??? in $INCLUDE at %s[%d]", fn, line);
-				fclose(fp);
+				if (fp) fclose(fp);
 				return -1;
 			}
 
@@ -1851,7 +1918,7 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 				}
 
 				fr_strerror_printf_push("BEGIN-??? without END-... in file $INCLUDEd from %s[%d]", fn, line);
-				fclose(fp);
+				if (fp) fclose(fp);
 				return -1;
 			}
 
@@ -1992,8 +2059,8 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 			 *	error. So we don't need to do that
 			 *	here.
 			 */
-			if (fr_dict_finalise(ctx) < 0) {
-				fclose(fp);
+			if ((fr_dict_finalise(ctx) < 0) || (dict_freeze(ctx->dict) < 0)) {
+				if (fp) fclose(fp);
 				return -1;
 			}
 
@@ -2256,7 +2323,7 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 	 *	be missing things.
 	 */
 
-	fclose(fp);
+	if (fp) fclose(fp);
 	return 0;
 }
 
@@ -2273,10 +2340,27 @@ static int dict_from_file(fr_dict_t *dict,
 	ctx.stack[0].da = dict->root;
 	ctx.stack[0].nest = FR_TYPE_MAX;
 
+	switch (dict_gctx->cache_mode) {
+	case FR_DICT_CACHE_READ:
+		ctx.cache = dict_cache_open(NULL, dir_name, filename);
+		break;
+
+	case FR_DICT_CACHE_WRITE:
+		ctx.record = dict_cache_alloc(NULL, dir_name, filename);
+		if (!ctx.record) return -1;
+		break;
+
+	case FR_DICT_CACHE_NONE:
+		break;
+	}
+
 	rcode = _dict_from_file(&ctx,
 				dir_name, filename, src_file, src_line);
 	if (rcode < 0) {
+	error:
 		talloc_free(ctx.fixup_pool);
+		talloc_free(ctx.cache);
+		talloc_free(ctx.record);
 		return rcode;
 	}
 
@@ -2287,7 +2371,13 @@ static int dict_from_file(fr_dict_t *dict,
 	 *	Fixups should have been applied already to any protocol
 	 *	dictionaries.
 	 */
-	return fr_dict_finalise(&ctx);
+	rcode = -1;
+	if ((fr_dict_finalise(&ctx) < 0) || (ctx.record && (dict_cache_commit(ctx.record) < 0))) goto error;
+
+	talloc_free(ctx.cache);
+	talloc_free(ctx.record);
+
+	return dict_freeze(dict);
 }
 
 /** (Re-)Initialize the special internal dictionary
@@ -23,6 +23,46 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/util/dict_priv.h>
+#include <freeradius-devel/util/stdatomic.h>
+#include <freeradius-devel/util/thread_local.h>
+
+/** Maximum number of unknown attributes cached per thread
+ *
+ * Once the cache is full, unknown attributes are allocated for each
+ * packet, as they were before.
+ */
+#define DICT_UNKNOWN_CACHE_MAX	(1024)
+
+/** An unknown attribute, shared by every packet which contains it
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*parent;			//!< Parent passed to fr_dict_unknown_afrom_fields.
+	unsigned int		vendor;				//!< Vendor passed to fr_dict_unknown_afrom_fields.
+	unsigned int		attr;				//!< Attribute number.
+
+	fr_dict_attr_t const	*da;				//!< The shared unknown attribute, or a known
+								///< attribute with a matching name.
+} dict_unknown_entry_t;
+
+/** Per-thread cache of unknown attributes
+ *
+ */
+typedef struct {
+	fr_hash_table_t		*ht;				//!< Of #dict_unknown_entry_t.
+	uint32_t		entries;			//!< Number of attributes in the cache.
+	uint_fast32_t		generation;			//!< Of #dict_unknown_generation when the
+								///< cache was last emptied.
+} dict_unknown_cache_t;
+
+static _Thread_local dict_unknown_cache_t *dict_unknown_cache;
+
+/** Incremented whenever a dictionary is freed
+ *
+ * Cache entries point to their parents, which may belong to the freed
+ * dictionary, so each thread empties its cache when this changes.
+ */
+static atomic_uint_fast32_t dict_unknown_generation;
 
 /** Copy a known or unknown attribute to produce an unknown attribute
  *
@@ -35,9 +75,12 @@ fr_dict_attr_t *fr_dict_unknown_acopy(TALLOC_CTX *ctx, fr_dict_attr_t const *da)
 	fr_dict_attr_flags_t	flags = da->flags;
 
 	/*
-	 *	Set the unknown flag.
+	 *	Set the unknown flag.  The copy belongs to the
+	 *	caller, and not to the cache, even if the original
+	 *	was interned.
 	 */
 	flags.is_unknown = 1;
+	flags.is_interned = 0;
 
 	/*
 	 *	Allocate an attribute.
@@ -193,8 +236,8 @@ void fr_dict_unknown_free(fr_dict_attr_t const **da)
 
 	if (!da || !*da) return;
 
-	/* Don't free real DAs */
-	if (!(*da)->flags.is_unknown) {
+	/* Don't free real DAs, or ones owned by the cache */
+	if (!(*da)->flags.is_unknown || (*da)->flags.is_interned) {
 		return;
 	}
 
@@ -261,20 +304,93 @@ int fr_dict_unknown_vendor_afrom_num(TALLOC_CTX *ctx, fr_dict_attr_t **out,
 	}
 }
 
-/** Allocates an unknown attribute
+static uint32_t dict_unknown_entry_hash(void const *data)
+{
+	dict_unknown_entry_t const *entry = data;
+	uint32_t hash;
+
+	hash = fr_hash(&entry->parent, sizeof(entry->parent));
+	hash = fr_hash_update(&entry->vendor, sizeof(entry->vendor), hash);
+
+	return fr_hash_update(&entry->attr, sizeof(entry->attr), hash);
+}
+
+static int dict_unknown_entry_cmp(void const *one, void const *two)
+{
+	dict_unknown_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->parent > b->parent) - (a->parent < b->parent);
+	if (ret != 0) return ret;
+
+	ret = (a->vendor > b->vendor) - (a->vendor < b->vendor);
+	if (ret != 0) return ret;
+
+	return (a->attr > b->attr) - (a->attr < b->attr);
+}
+
+static void _dict_unknown_cache_free(void *arg)
+{
+	talloc_free(arg);
+	dict_unknown_cache = NULL;
+}
+
+static dict_unknown_cache_t *dict_unknown_cache_get(void)
+{
+	dict_unknown_cache_t	*cache = dict_unknown_cache;
+	uint_fast32_t		generation = atomic_load_explicit(&dict_unknown_generation, memory_order_acquire);
+
+	if (!cache) {
+		cache = talloc_zero(NULL, dict_unknown_cache_t);
+		if (!cache) return NULL;
+
+		fr_thread_local_set_destructor(dict_unknown_cache, _dict_unknown_cache_free, cache);
+
+	} else if (cache->ht && (cache->generation == generation)) {
+		return cache;
+	}
+
+	/*
+	 *	New cache, or a dictionary has been freed since
+	 *	we last emptied it.  The entries are keyed on the
+	 *	address of their parent, which may now be freed,
+	 *	or re-used for a different attribute.
+	 */
+	talloc_free_children(cache);
+	cache->ht = NULL;
+	cache->entries = 0;
+	cache->generation = generation;
+
+	cache->ht = fr_hash_table_create(cache, dict_unknown_entry_hash, dict_unknown_entry_cmp, NULL);
+	if (!cache->ht) return NULL;
+
+	return cache;
+}
+
+/** Empty every thread's cache of unknown attributes
  *
- * @note If vendor != 0, an unknown vendor (may) also be created, parented by
- *	the correct VSA attribute. This is accessible via da->parent,
- *	and will be use the unknown da as its talloc parent.
+ * Called when a dictionary is freed.  Each thread empties its own cache
+ * the next time it's used.
+ */
+void dict_unknown_cache_invalidate(void)
+{
+	atomic_fetch_add_explicit(&dict_unknown_generation, 1, memory_order_release);
+}
+
+/** Allocates an unknown attribute
  *
  * @param[in] ctx		to allocate DA in.
  * @param[in] parent		of the unknown attribute (may also be unknown).
  * @param[in] attr		number.
  * @param[in] vendor		number.
- * @return 0 on success.
+ * @param[in] interned		mark the attribute, and any unknown vendor, as
+ *				belonging to the cache.
+ * @return
+ *	- The new attribute on success.
+ *	- NULL on failure.
  */
-fr_dict_attr_t const *fr_dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr_t const *parent,
-						   unsigned int vendor, unsigned int attr)
+static fr_dict_attr_t const *dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr_t const *parent,
+						       unsigned int vendor, unsigned int attr, bool interned)
 {
 	fr_dict_attr_t const	*da;
 	fr_dict_attr_t		*n;
@@ -282,13 +398,9 @@ fr_dict_attr_t const *fr_dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr
 	fr_dict_attr_flags_t	flags = {
 		.is_unknown	= true,
 		.is_raw		= true,
+		.is_interned	= interned,
 	};
 
-	if (!fr_cond_assert(parent)) {
-		fr_strerror_printf("%s: Invalid argument - parent was NULL", __FUNCTION__);
-		return NULL;
-	}
-
 	/*
 	 *	If there's a vendor specified, we check to see
 	 *	if the parent is a VSA, and if it is
@@ -304,6 +416,7 @@ fr_dict_attr_t const *fr_dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr
 		da = fr_dict_attr_child_by_num(parent, vendor);
 		if (!da) {
 			if (fr_dict_unknown_vendor_afrom_num(ctx, &new_parent, parent, vendor) < 0) return NULL;
+			new_parent->flags.is_interned = interned;
 			da = new_parent;
 		}
 		parent = da;
@@ -312,9 +425,11 @@ fr_dict_attr_t const *fr_dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr
 	 *	Need to clone the unknown hierachy, as unknown
 	 *	attributes must parent the complete heirachy,
 	 *	and cannot share any parts with any other unknown
-	 *	attributes.
+	 *	attributes.  The exception is interned attributes,
+	 *	which may share interned parents, as both belong to
+	 *	the cache.
 	 */
-	} else if (parent->flags.is_unknown) {
+	} else if (parent->flags.is_unknown && !interned) {
 		new_parent = fr_dict_unknown_acopy(ctx, parent);
 		parent = new_parent;
 	}
@@ -329,9 +444,8 @@ fr_dict_attr_t const *fr_dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr
 	 */
 	da = fr_dict_attr_by_name(dict_by_da(parent), n->name);
 	if (da) {
-		fr_dict_unknown_free(&parent);
-		parent = n;
-		fr_dict_unknown_free(&parent);
+		if (new_parent && new_parent->flags.is_unknown) talloc_free(new_parent);
+		talloc_free(n);
 		return da;
 	}
 
@@ -345,6 +459,84 @@ fr_dict_attr_t const *fr_dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr
 	return n;
 }
 
+/** Allocates an unknown attribute
+ *
+ * Unknown attributes with known (or interned) parents are looked up in a
+ * per-thread cache first, so that vendors which send the same undocumented
+ * attributes in every packet don't cause allocations for each packet.
+ * Cached attributes must not be freed, or stolen, other than through
+ * #fr_dict_unknown_free (which ignores them).  They must not be kept
+ * beyond the current packet, as the cache belongs to the thread.  Pairs
+ * use a copy, made by #fr_pair_afrom_da.
+ *
+ * @note If vendor != 0, an unknown vendor (may) also be created, parented by
+ *	the correct VSA attribute. This is accessible via da->parent,
+ *	and will be use the unknown da as its talloc parent.
+ *
+ * @param[in] ctx		to allocate DA in, if it can't be cached.
+ * @param[in] parent		of the unknown attribute (may also be unknown).
+ * @param[in] attr		number.
+ * @param[in] vendor		number.
+ * @return
+ *	- The unknown attribute on success.
+ *	- NULL on failure.
+ */
+fr_dict_attr_t const *fr_dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr_t const *parent,
+						   unsigned int vendor, unsigned int attr)
+{
+	dict_unknown_cache_t	*cache;
+	dict_unknown_entry_t	*entry;
+	fr_dict_attr_t const	*da;
+
+	if (!fr_cond_assert(parent)) {
+		fr_strerror_printf("%s: Invalid argument - parent was NULL", __FUNCTION__);
+		return NULL;
+	}
+
+	/*
+	 *	Unknown parents are different for every packet, so
+	 *	there's no point in caching their children.
+	 */
+	if (parent->flags.is_unknown && !parent->flags.is_interned) {
+		return dict_unknown_afrom_fields(ctx, parent, vendor, attr, false);
+	}
+
+	cache = dict_unknown_cache_get();
+	if (!cache) return dict_unknown_afrom_fields(ctx, parent, vendor, attr, false);
+
+	entry = fr_hash_table_finddata(cache->ht, &(dict_unknown_entry_t){
+						.parent = parent,
+						.vendor = vendor,
+						.attr = attr
+					});
+	if (entry) return entry->da;
+
+	if (cache->entries >= DICT_UNKNOWN_CACHE_MAX) return dict_unknown_afrom_fields(ctx, parent, vendor, attr, false);
+
+	entry = talloc_zero(cache, dict_unknown_entry_t);
+	if (!entry) return NULL;
+
+	da = dict_unknown_afrom_fields(entry, parent, vendor, attr, true);
+	if (!da) {
+		talloc_free(entry);
+		return NULL;
+	}
+
+	entry->parent = parent;
+	entry->vendor = vendor;
+	entry->attr = attr;
+	entry->da = da;
+
+	if (!fr_hash_table_insert(cache->ht, entry)) {
+		talloc_free(entry);
+		return dict_unknown_afrom_fields(ctx, parent, vendor, attr, false);
+	}
+
+	cache->entries++;
+
+	return da;
+}
+
 /** Initialise a fr_dict_attr_t from an ASCII attribute and value
  *
  * Where the attribute name is in the form:
@@ -581,6 +581,63 @@ int dict_vendor_add(fr_dict_t *dict, char const *name, unsigned int num)
 	return 0;
 }
 
+/** Rearrange a parent's children into an array of a different size
+ *
+ * The order of children with the same attribute number is preserved.
+ *
+ * @param[in] parent	whose children we're rearranging.
+ * @param[in] len	of the new array.  See dict_attr_children_bin() for how
+ *			children are found in arrays of different sizes.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure (memory allocation error).
+ */
+static int dict_attr_children_resize(fr_dict_attr_t *parent, size_t len)
+{
+	fr_dict_attr_t const	**children, ***tails;
+	fr_dict_attr_t const	*p, *next;
+	fr_dict_attr_t		*mutable;
+	size_t			i, old_len = talloc_array_length(parent->children);
+
+	children = talloc_zero_array(parent, fr_dict_attr_t const *, len);
+	if (!children) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	tails = talloc_array(NULL, fr_dict_attr_t const **, len);
+	if (!tails) {
+		talloc_free(children);
+		goto oom;
+	}
+	for (i = 0; i < len; i++) tails[i] = &children[i];
+
+	/*
+	 *	Append each child to the end of its new chain.
+	 */
+	for (i = 0; i < old_len; i++) {
+		for (p = parent->children[i]; p; p = next) {
+			size_t slot = (len > DICT_CHILDREN_BINS) ? p->attr : (p->attr & UINT8_MAX);
+
+			fr_assert(slot < len);
+
+			next = p->next;
+			memcpy(&mutable, &p, sizeof(mutable));
+			mutable->next = NULL;
+
+			*tails[slot] = p;
+			tails[slot] = &mutable->next;
+		}
+	}
+	talloc_free(tails);
+
+	talloc_free(parent->children);
+	parent->children = children;
+
+	return 0;
+}
+
 /** Add a child to a parent.
  *
  * @param[in] parent	we're adding a child to.
@@ -629,11 +686,18 @@ int dict_attr_child_add(fr_dict_attr_t *parent, fr_dict_attr_t *child)
 	/*
 	 *	We only allocate the pointer array *if* the parent has children.
 	 */
-	if (!parent->children) parent->children = talloc_zero_array(parent, fr_dict_attr_t const *, UINT8_MAX + 1);
+	if (!parent->children) parent->children = talloc_zero_array(parent, fr_dict_attr_t const *, DICT_CHILDREN_BINS);
 	if (!parent->children) {
 		fr_strerror_printf("Out of memory");
 		return -1;
 	}
+
+	/*
+	 *	Children are being added after the dictionary was
+	 *	frozen, put them back into bins.
+	 */
+	if ((talloc_array_length(parent->children) != DICT_CHILDREN_BINS) &&
+	    (dict_attr_children_resize(parent, DICT_CHILDREN_BINS) < 0)) return -1;
 	/*
 	 *	Treat the array as a hash of 255 bins, with attributes
 	 *	sorted into bins using num % 255.
@@ -693,6 +757,74 @@ int dict_attr_child_add(fr_dict_attr_t *parent, fr_dict_attr_t *child)
 	return 0;
 }
 
+/** Children numbered higher than this are always kept in bins
+ *
+ */
+#define DICT_CHILDREN_DIRECT_MAX	(UINT16_MAX)
+
+/** Lay out the children of an attribute, and all of its descendants, for lookups
+ *
+ */
+static int dict_attr_freeze(fr_dict_attr_t *da)
+{
+	fr_dict_attr_t const	*p;
+	fr_dict_attr_t		*mutable;
+	unsigned int		max = 0, num = 0;
+	size_t			i, len;
+
+	/*
+	 *	Groups point to attributes in other places in
+	 *	the tree, and don't have children of their own.
+	 */
+	if ((da->type == FR_TYPE_GROUP) || !da->children) return 0;
+
+	len = talloc_array_length(da->children);
+	for (i = 0; i < len; i++) {
+		for (p = da->children[i]; p; p = p->next) {
+			if (p->attr > max) max = p->attr;
+			num++;
+
+			memcpy(&mutable, &p, sizeof(mutable));
+			if (dict_attr_freeze(mutable) < 0) return -1;
+		}
+	}
+
+	/*
+	 *	Already frozen.
+	 */
+	if (len != DICT_CHILDREN_BINS) return 0;
+
+	/*
+	 *	If the children all fit in the bins, trim off the
+	 *	empty bins at the end.  If they don't, index them
+	 *	directly, so long as the array isn't mostly empty.
+	 */
+	if ((max >= DICT_CHILDREN_BINS) &&
+	    ((max > DICT_CHILDREN_DIRECT_MAX) || (max >= (num * 8)))) return 0;
+
+	if ((max + 1) == len) return 0;
+
+	return dict_attr_children_resize(da, max + 1);
+}
+
+/** Optimise a dictionary for lookups, once it has been loaded
+ *
+ * Child arrays are trimmed, or expanded, so that most child lookups by
+ * number are a single array index, with no chains to walk.
+ *
+ * Attributes can still be added afterwards.  The parents they're added
+ * to go back to the layout used while loading.
+ *
+ * @param[in] dict	to freeze.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure (memory allocation error).
+ */
+int dict_freeze(fr_dict_t *dict)
+{
+	return dict_attr_freeze(dict->root);
+}
+
 /** Add an attribute to the name table for the dictionary.
  *
  * @param[in] dict		of protocol context we're operating in.
@@ -1317,8 +1449,78 @@ fr_dict_attr_t const *fr_dict_root(fr_dict_t const *dict)
 	return dict->root;
 }
 
-ssize_t dict_by_protocol_substr(fr_dict_attr_err_t *err,
-				fr_dict_t **out, fr_sbuff_t *name, fr_dict_t const *dict_def)
+/** Load a protocol dictionary the first time a qualified name references it
+ *
+ * Only protocols with a "<dictdir>/<name>/dictionary" file are loaded, and
+ * only until the dictionaries are marked read only.  The reference is held
+ * by the internal dictionary, so the protocol dictionary lives as long as
+ * it does.
+ *
+ * @param[in] name	of the protocol.
+ * @return
+ *	- The protocol dictionary.
+ *	- NULL if it was not, or could not be, loaded.
+ */
+static fr_dict_t *dict_by_protocol_lazy(char const *name)
+{
+	fr_dict_t	*dict = NULL;
+	char		proto_name[FR_DICT_ATTR_MAX_NAME_LEN + 1];
+	char		*dict_file;
+	struct stat	stat_buf;
+	size_t		i;
+	int		ret;
+
+	if (!dict_gctx->lazy || dict_gctx->read_only || !dict_gctx->internal ||
+	    dict_gctx->internal->read_only) return NULL;
+
+	/*
+	 *	Directory names are lower case, protocol names
+	 *	are compared without regard to case.
+	 */
+	for (i = 0; name[i] && (i < (sizeof(proto_name) - 1)); i++) {
+		if (name[i] == FR_DIR_SEP) return NULL;
+		proto_name[i] = tolower((uint8_t)name[i]);
+	}
+	if (name[i] || (i == 0)) return NULL;
+	proto_name[i] = '\0';
+
+	dict_file = talloc_asprintf(NULL, "%s%c%s%c%s", fr_dict_global_dir(), FR_DIR_SEP,
+				    proto_name, FR_DIR_SEP, FR_DICTIONARY_FILE);
+	if (!dict_file) return NULL;
+
+	ret = stat(dict_file, &stat_buf);
+	talloc_free(dict_file);
+	if (ret < 0) return NULL;
+
+	if (fr_dict_protocol_afrom_file(&dict, proto_name, NULL) < 0) return NULL;
+
+	/*
+	 *	Already holding a reference to this one.
+	 */
+	if (!fr_hash_table_insert(dict_gctx->internal->autoref, dict)) {
+		fr_dict_t *found = dict;
+
+		fr_dict_free(&found);
+	}
+
+	return dict;
+}
+
+/** Look up a protocol name embedded in another string
+ *
+ * @param[out] err		Parsing error.
+ * @param[out] out		the resolve dictionary or NULL if the dictionary
+ *				couldn't be resolved.
+ * @param[in] name		string start.
+ * @param[in] dict_def		The dictionary to return if no dictionary qualifier was found.
+ * @param[in] lazy		Load the protocol dictionary if it isn't loaded already.
+ * @return
+ *	- 0 and *out != NULL.  Couldn't find a dictionary qualifier, so returned dict_def.
+ *	- <= 0 on error and (*out == NULL) (offset as negative integer)
+ *	- > 0 on success (number of bytes parsed).
+ */
+static ssize_t _dict_by_protocol_substr(fr_dict_attr_err_t *err,
+					fr_dict_t **out, fr_sbuff_t *name, fr_dict_t const *dict_def, bool lazy)
 {
 	fr_dict_attr_t		root;
 
@@ -1360,6 +1562,7 @@ ssize_t dict_by_protocol_substr(fr_dict_attr_err_t *err,
 
 	root.name = buffer;
 	dict = fr_hash_table_finddata(dict_gctx->protocol_by_name, &(fr_dict_t){ .root = &root });
+	if (!dict && lazy) dict = dict_by_protocol_lazy(buffer);
 
 	if (!dict) {
 		fr_strerror_printf("Unknown protocol '%s'", root.name);
@@ -1371,6 +1574,21 @@ ssize_t dict_by_protocol_substr(fr_dict_attr_err_t *err,
 	return (size_t)fr_sbuff_set(name, &our_name);
 }
 
+/** Internal version of #fr_dict_by_protocol_substr
+ *
+ * Used by the dictionary tokenizer, which resolves references to
+ * protocols which aren't loaded yet itself.
+ *
+ * @note For internal use by the dictionary API only.
+ *
+ * @copybrief fr_dict_by_protocol_substr
+ */
+ssize_t dict_by_protocol_substr(fr_dict_attr_err_t *err,
+				fr_dict_t **out, fr_sbuff_t *name, fr_dict_t const *dict_def)
+{
+	return _dict_by_protocol_substr(err, out, name, dict_def, false);
+}
+
 /** Look up a protocol name embedded in another string
  *
  * @param[out] err		Parsing error.
@@ -1388,7 +1606,7 @@ ssize_t fr_dict_by_protocol_substr(fr_dict_attr_err_t *err, fr_dict_t const **ou
 	ssize_t		slen;
 	fr_dict_t	*dict = NULL;
 
-	slen = dict_by_protocol_substr(err, &dict, name, dict_def);
+	slen = _dict_by_protocol_substr(err, &dict, name, dict_def, true);
 	*out = dict;
 
 	return slen;
@@ -1524,7 +1742,8 @@ fr_dict_t *dict_by_attr_name(fr_dict_attr_t const **found, char const *name)
 
 /** Lookup a protocol by its name
  *
- * @note For internal use by the dictionary API only.
+ * If the protocol isn't loaded, and lazy loading is enabled, its
+ * dictionary is loaded.  @see fr_dict_global_lazy_set.
  *
  * @param[in] name of the protocol to locate.
  * @return
@@ -1533,7 +1752,12 @@ fr_dict_t *dict_by_attr_name(fr_dict_attr_t const **found, char const *name)
  */
 fr_dict_t const *fr_dict_by_protocol_name(char const *name)
 {
-	return dict_by_protocol_name(name);
+	fr_dict_t *dict;
+
+	dict = dict_by_protocol_name(name);
+	if (!dict && name && dict_gctx) dict = dict_by_protocol_lazy(name);
+
+	return dict;
 }
 
 /** Lookup a protocol by its number
@@ -1823,7 +2047,7 @@ ssize_t fr_dict_attr_by_qualified_name_substr(fr_dict_attr_err_t *err, fr_dict_a
 	 *	Figure out if we should use the default dictionary
 	 *	or if the string was qualified.
 	 */
-	slen = dict_by_protocol_substr(err, &dict, &our_name, dict_def);
+	slen = _dict_by_protocol_substr(err, &dict, &our_name, dict_def, true);
 	if (slen < 0) {
 		return 0;
 
@@ -1997,13 +2221,7 @@ fr_dict_attr_t const *fr_dict_attr_child_by_da(fr_dict_attr_t const *parent, fr_
 		break;
 	}
 
-	/*
-	 *	Child arrays may be trimmed back to save memory.
-	 *	Check that so we don't SEGV.
-	 */
-	if ((child->attr & 0xff) > talloc_array_length(parent->children)) return NULL;
-
-	bin = parent->children[child->attr & 0xff];
+	bin = dict_attr_children_bin(parent, child->attr);
 	for (;;) {
 		if (!bin) return NULL;
 		if (bin == child) return bin;
@@ -2030,13 +2248,7 @@ inline fr_dict_attr_t *dict_attr_child_by_num(fr_dict_attr_t const *parent, unsi
 	 */
 	if (parent->type == FR_TYPE_GROUP) parent = parent->ref;
 
-	/*
-	 *	Child arrays may be trimmed back to save memory.
-	 *	Check that so we don't SEGV.
-	 */
-	if ((attr & 0xff) > talloc_array_length(parent->children)) return NULL;
-
-	bin = parent->children[attr & 0xff];
+	bin = dict_attr_children_bin(parent, attr);
 	for (;;) {
 		if (!bin) return NULL;
 		if (bin->attr == attr) {
@@ -2268,6 +2480,12 @@ static int _dict_free(fr_dict_t *dict)
 	 */
 	dl_free(dict->dl);
 
+	/*
+	 *	Cached unknown attributes may be parented by
+	 *	attributes in this dictionary.
+	 */
+	dict_unknown_cache_invalidate();
+
 	/*
 	 *	We don't necessarily control the order of freeing
 	 *	children.
@@ -2674,6 +2892,7 @@ fr_dict_gctx_t const *fr_dict_global_ctx_init(TALLOC_CTX *ctx, char const *dict_
 
 	new_ctx->dict_dir_default = talloc_strdup(new_ctx, dict_dir);
 	if (!new_ctx->dict_dir_default) goto oom;
+	new_ctx->lazy = true;
 
 	new_ctx->dict_loader = dl_loader_init(new_ctx, NULL, false, false);
 	if (!new_ctx->dict_loader) goto error;
@@ -2735,6 +2954,33 @@ char const *fr_dict_global_dir(void)
 	return dict_gctx->dict_dir_default;
 }
 
+/** Set whether dictionaries are loaded from, or written to, pre-tokenized caches
+ *
+ * @param[in] mode	for dictionaries loaded after this call.
+ */
+void fr_dict_global_cache_mode_set(fr_dict_cache_mode_t mode)
+{
+	if (!dict_gctx) return;
+
+	dict_gctx->cache_mode = mode;
+}
+
+/** Set whether protocol dictionaries are loaded the first time they're referenced
+ *
+ * When enabled, #fr_dict_by_protocol_name and qualified attribute names
+ * ("<protocol>.<attribute>") load protocol dictionaries which haven't been
+ * loaded yet.  Programs which only use a few protocols then only pay for
+ * those they reference.
+ *
+ * @param[in] lazy	Whether unloaded protocols are loaded on demand.
+ */
+void fr_dict_global_lazy_set(bool lazy)
+{
+	if (!dict_gctx) return;
+
+	dict_gctx->lazy = lazy;
+}
+
 /** Mark all dictionaries and the global dictionary ctx as read only
  *
  * Any attempts to add new attributes will now fail.
@@ -2910,10 +3156,12 @@ void fr_dict_verify(char const *file, int line, fr_dict_attr_t const *da)
 fr_dict_attr_t const *fr_dict_attr_iterate_children(fr_dict_attr_t const *parent, fr_dict_attr_t const **prev)
 {
 	fr_dict_attr_t const * const *bin;
-	int i, start;
+	size_t i, start, len;
 
 	if (!parent || !parent->children || !prev) return NULL;
 
+	len = talloc_array_length(parent->children);
+
 	if (!*prev) {
 		start = 0;
 
@@ -2926,15 +3174,10 @@ fr_dict_attr_t const *fr_dict_attr_iterate_children(fr_dict_attr_t const *parent
 
 	} else {
 		/*
-		 *	Figure out which bin we were in.  If it was
-		 *	the last one, we're done.
-		 */
-		start = (*prev)->attr & 0xff;
-		if (start == 255) return NULL;
-
-		/*
-		 *	Start at the next bin.
+		 *	Figure out which bin we were in, and start
+		 *	at the next one.
 		 */
+		start = (len > DICT_CHILDREN_BINS) ? (*prev)->attr : ((*prev)->attr & UINT8_MAX);
 		start++;
 	}
 
@@ -2942,8 +3185,8 @@ fr_dict_attr_t const *fr_dict_attr_iterate_children(fr_dict_attr_t const *parent
 	 *	Look for a non-empty bin, and return the first child
 	 *	from there.
 	 */
-	for (i = start; i < 256; i++) {
-		bin = &parent->children[i & 0xff];
+	for (i = start; i < len; i++) {
+		bin = &parent->children[i];
 
 		if (*bin) return *bin;
 	}
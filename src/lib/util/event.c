@@ -45,6 +45,21 @@ RCSID("$Id$")
 #include <sys/wait.h>
 #include <pthread.h>
 
+/*
+ *	On Linux, socket readiness can be checked with io_uring instead
+ *	of going through libkqueue.  We need IORING_FEAT_EXT_ARG (5.11)
+ *	for timed waits.
+ */
+#ifdef HAVE_LINUX_IO_URING_H
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <poll.h>
+#  if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#    define WITH_EVENT_URING
+#  endif
+#endif
+
 #ifdef NDEBUG
 /*
  *	Turn off documentation warnings as file/line
@@ -56,6 +71,27 @@ DIAG_OFF(documentation)
 
 #define FR_EV_BATCH_FDS (256)
 
+#ifdef WITH_EVENT_URING
+#define FR_EV_URING_ENTRIES	(256)		//!< Size of the io_uring submission queue.
+
+/*
+ *	user_data for io_uring operations.  Polls encode the fd, a
+ *	sequence number, and whether it's a read or write poll, so
+ *	that completions for polls we've cancelled can be ignored.
+ */
+#define URING_POLL_READ		(0)
+#define URING_POLL_WRITE	(1)
+#define URING_POLL_KQ		(2)		//!< Poll of the kqueue itself.
+#define URING_IGNORE		(3)		//!< Don't care about the completion.
+
+#define URING_USER_DATA(_fd, _seq, _which)	((((uint64_t)(uint32_t)(_fd)) << 32) | \
+						 (((uint64_t)(_seq) & 0x3fffffff) << 2) | (_which))
+#define URING_USER_DATA_FD(_ud)			((int)((_ud) >> 32))
+#define URING_USER_DATA_WHICH(_ud)		((int)((_ud) & 0x03))
+
+static bool event_use_uring = false;		//!< Whether new event lists should use io_uring.
+#endif
+
 DIAG_OFF(unused-macros)
 #define fr_time() static_assert(0, "Use el->time for event loop timing")
 DIAG_ON(unused-macros)
@@ -106,6 +142,9 @@ struct fr_event_timer {
 	int32_t			heap_id;	       	//!< Where to store opaque heap data.
 	fr_dlist_t		entry;			//!< in linked list of event timers
 
+	fr_dlist_head_t		*wheel_slot;		//!< Timer wheel slot we're in, or NULL if we're in the heap.
+	fr_dlist_t		wheel_entry;		//!< Entry in the timer wheel slot.
+
 #ifndef NDEBUG
 	char const		*file;			//!< Source file this event was last updated in.
 	int			line;			//!< Line this event was last updated on.
@@ -276,6 +315,12 @@ struct fr_event_fd {
 
 	fr_event_fd_t		*next;			//!< item in a list of fr_event_fd (to free).
 
+#ifdef WITH_EVENT_URING
+	bool			uring;			//!< Readiness is checked with io_uring, not kqueue.
+	uint64_t		uring_armed[2];		//!< user_data of the outstanding read and write polls,
+							///< or 0 if not armed.
+#endif
+
 #ifndef NDEBUG
 	uintptr_t		armour;			//!< protection flag from being deleted.
 #endif
@@ -327,11 +372,73 @@ typedef struct {
 	void			*uctx;			//!< Context for the callback.
 } fr_event_user_t;
 
+#ifdef WITH_EVENT_URING
+/** An io_uring instance, and its mapped rings
+ *
+ */
+typedef struct {
+	int			fd;			//!< From io_uring_setup().
+
+	void			*sq_ring;		//!< Submission queue ring.
+	size_t			sq_ring_size;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_array;
+	unsigned		sq_mask;
+	unsigned		sq_entries;
+
+	struct io_uring_sqe	*sqes;			//!< Submission queue entries.
+	size_t			sqes_size;
+
+	unsigned		pending;		//!< Number of entries written but not yet submitted.
+
+	void			*cq_ring;		//!< Completion queue ring.  May be the same as sq_ring.
+	size_t			cq_ring_size;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	uint32_t		seq;			//!< For the next poll's user_data.
+	bool			kq_armed;		//!< Whether we're polling the kqueue.
+} fr_event_uring_t;
+#endif
+
+/*
+ *	Timer wheel geometry.  Each level has 64 slots, so a slot's
+ *	occupancy fits in one uint64_t.  Four levels cover 2^24 ticks,
+ *	e.g. 4.6 hours at 1ms.  Timers further out than that go into
+ *	the heap.
+ */
+#define FR_EVENT_WHEEL_LEVELS	(4)
+#define FR_EVENT_WHEEL_BITS	(6)
+#define FR_EVENT_WHEEL_SLOTS	(1 << FR_EVENT_WHEEL_BITS)
+#define FR_EVENT_WHEEL_MASK	(FR_EVENT_WHEEL_SLOTS - 1)
+
+/** A hierarchical timing wheel
+ *
+ * Timers are rounded up to the next tick, and go into a slot at the
+ * lowest level which can hold them.  As time advances, each time a
+ * level wraps the next slot of the level above is "cascaded" down.
+ * Insert and delete are O(1).
+ */
+typedef struct {
+	fr_time_delta_t		resolution;		//!< Length of a tick.
+	uint64_t		now;			//!< Next tick to be processed.
+	size_t			num;			//!< Number of timers in the wheel.
+
+	uint64_t		used[FR_EVENT_WHEEL_LEVELS];	//!< Bitmap of slots with timers in them.
+	fr_dlist_head_t		slots[FR_EVENT_WHEEL_LEVELS][FR_EVENT_WHEEL_SLOTS];
+
+	fr_dlist_head_t		expired;		//!< Timers which are due, in the order they expired.
+} fr_event_wheel_t;
+
 /** Stores all information relating to an event list
  *
  */
 struct fr_event_list {
 	fr_heap_t		*times;			//!< of timer events to be executed.
+	fr_event_wheel_t	*wheel;			//!< of timer events to be executed, or NULL to use the heap.
 	rbtree_t		*fds;			//!< Tree used to track FDs with filters in kqueue.
 
 	int			will_exit;		//!< Will exit on next call to fr_event_corral.
@@ -345,8 +452,14 @@ struct fr_event_list {
 
 	int			num_fd_events;		//!< Number of events in this event list.
 
+	fr_event_list_stats_t	stats;			//!< Utilisation statistics.
+
 	int			kq;			//!< instance associated with this event list.
 
+#ifdef WITH_EVENT_URING
+	fr_event_uring_t	*uring;			//!< io_uring for socket readiness, or NULL.
+#endif
+
 	fr_dlist_head_t		pre_callbacks;		//!< callbacks when we may be idle...
 	fr_dlist_head_t		user_callbacks;		//!< EVFILT_USER callbacks
 	fr_dlist_head_t		post_callbacks;		//!< post-processing callbacks
@@ -419,7 +532,7 @@ int fr_event_list_num_timers(fr_event_list_t *el)
 {
 	if (unlikely(!el)) return -1;
 
-	return fr_heap_num_elements(el->times);
+	return fr_heap_num_elements(el->times) + (el->wheel ? el->wheel->num : 0);
 }
 
 /** Return the kq associated with an event list.
@@ -454,6 +567,50 @@ fr_time_t fr_event_list_time(fr_event_list_t *el)
 	}
 }
 
+/** Get a copy of the utilisation statistics for an event list
+ *
+ * @param[out] out	Where to write the statistics.
+ * @param[in] el	to get statistics for.
+ */
+void fr_event_list_stats(fr_event_list_stats_t *out, fr_event_list_t const *el)
+{
+	*out = el->stats;
+}
+
+/** Print the utilisation statistics for an event list
+ *
+ * Utilisation is the fraction of the time since the event list was
+ * created which was not spent waiting for events.  Saturation is the
+ * fraction of iterations which returned a full batch of FD events,
+ * which means the thread is falling behind its sockets.
+ *
+ * @param[in] fp	to print to.
+ * @param[in] el	to print statistics for.
+ * @param[in] prefix	to print before each name, e.g. "loop".
+ */
+void fr_event_list_stats_fprint(FILE *fp, fr_event_list_t const *el, char const *prefix)
+{
+	fr_event_list_stats_t	stats = el->stats;
+	fr_time_delta_t		elapsed = el->time() - stats.start;
+	double			busy = 0, saturated = 0;
+
+	if (elapsed > 0) {
+		busy = 100.0 - (((double) stats.idle * 100) / elapsed);
+		if (busy < 0) busy = 0;
+	}
+	if (stats.loops) saturated = ((double) stats.full * 100) / stats.loops;
+
+	fprintf(fp, "%s.utilisation\t\t%.1f%%\n", prefix, busy);
+	fprintf(fp, "%s.saturation\t\t%.1f%%\n", prefix, saturated);
+	fprintf(fp, "%s.idle\t\t\t%u.%06u\n", prefix,
+		(unsigned int) (stats.idle / NSEC), (unsigned int) (stats.idle % NSEC) / 1000);
+	fprintf(fp, "%s.iterations\t\t%" PRIu64 "\n", prefix, stats.loops);
+	fprintf(fp, "%s.waits\t\t\t%" PRIu64 "\n", prefix, stats.waits);
+	fprintf(fp, "%s.fd_events\t\t%" PRIu64 "\n", prefix, stats.fd_events);
+	fprintf(fp, "%s.timers\t\t\t%u\n", prefix,
+		(unsigned int) (fr_heap_num_elements(el->times) + (el->wheel ? el->wheel->num : 0)));
+}
+
 /** Placeholder callback to avoid branches in service loop
  *
  * This is set in place of any NULL function pointers, so that the event loop doesn't
@@ -464,6 +621,414 @@ static void fr_event_fd_noop(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED i
 	return;
 }
 
+#ifdef WITH_EVENT_URING
+static int _event_uring_free(fr_event_uring_t *ur)
+{
+	if (ur->sqes) (void) munmap(ur->sqes, ur->sqes_size);
+	if (ur->cq_ring && (ur->cq_ring != ur->sq_ring)) (void) munmap(ur->cq_ring, ur->cq_ring_size);
+	if (ur->sq_ring) (void) munmap(ur->sq_ring, ur->sq_ring_size);
+	if (ur->fd >= 0) close(ur->fd);
+
+	return 0;
+}
+
+/** Create an io_uring, and map its rings
+ *
+ * @return
+ *	- A new io_uring on success.
+ *	- NULL on error, e.g. the kernel is too old, or io_uring is disabled.
+ */
+static fr_event_uring_t *event_uring_alloc(void)
+{
+	struct io_uring_params	p;
+	fr_event_uring_t	*ur;
+	uint8_t			*sq, *cq;
+	void			*ptr;
+
+	ur = talloc_zero(NULL, fr_event_uring_t);
+	if (!ur) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	ur->fd = -1;
+	talloc_set_destructor(ur, _event_uring_free);
+
+	memset(&p, 0, sizeof(p));
+	ur->fd = syscall(__NR_io_uring_setup, FR_EV_URING_ENTRIES, &p);
+	if (ur->fd < 0) {
+		fr_strerror_printf("Failed creating io_uring: %s", fr_syserror(errno));
+	error:
+		talloc_free(ur);
+		return NULL;
+	}
+
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		fr_strerror_printf("Kernel io_uring does not support timed waits");
+		goto error;
+	}
+
+	ur->sq_ring_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned));
+	ur->cq_ring_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_ring_size > ur->sq_ring_size) ur->sq_ring_size = ur->cq_ring_size;
+		ur->cq_ring_size = ur->sq_ring_size;
+	}
+
+	ptr = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   ur->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+	map_error:
+		fr_strerror_printf("Failed mapping io_uring: %s", fr_syserror(errno));
+		goto error;
+	}
+	ur->sq_ring = ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ring = ur->sq_ring;
+	} else {
+		ptr = mmap(NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   ur->fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED) goto map_error;
+		ur->cq_ring = ptr;
+	}
+
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   ur->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED) goto map_error;
+	ur->sqes = ptr;
+
+	sq = ur->sq_ring;
+	ur->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ur->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ur->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	ur->sq_entries = p.sq_entries;
+
+	cq = ur->cq_ring;
+	ur->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ur->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ur->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return ur;
+}
+
+/** Submit any queued operations, and optionally wait for completions
+ *
+ * @param[in] ur		to submit to.
+ * @param[in] min_complete	how many completions to wait for.
+ * @param[in] flags		IORING_ENTER_* flags.
+ * @param[in] ts		how long to wait for, or NULL to wait forever.
+ * @return
+ *	- >= 0 the number of operations submitted.
+ *	- < 0 on error, with errno set.
+ */
+static int event_uring_enter(fr_event_uring_t *ur, unsigned min_complete, unsigned flags, struct timespec const *ts)
+{
+	struct io_uring_getevents_arg	arg;
+	struct __kernel_timespec	kts;
+	int				ret;
+
+	memset(&arg, 0, sizeof(arg));
+	if (ts) {
+		kts.tv_sec = ts->tv_sec;
+		kts.tv_nsec = ts->tv_nsec;
+		arg.ts = (uint64_t)(uintptr_t)&kts;
+	}
+
+	ret = syscall(__NR_io_uring_enter, ur->fd, ur->pending, min_complete,
+		      flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (ret > 0) ur->pending -= ret;
+
+	return ret;
+}
+
+/** Queue an operation for the next call to io_uring_enter()
+ *
+ * If the submission queue is full, everything in it is submitted now.
+ */
+static int event_uring_push(fr_event_uring_t *ur, uint8_t opcode, int fd, uint32_t events,
+			    uint64_t addr, uint64_t user_data)
+{
+	unsigned		tail, idx;
+	struct io_uring_sqe	*sqe;
+
+	tail = *ur->sq_tail;
+	if ((tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE)) >= ur->sq_entries) {
+		if (event_uring_enter(ur, 0, 0, NULL) < 0) {
+			fr_strerror_printf("Failed submitting to io_uring: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = (events << 16) | (events >> 16);	/* poll32_events is word-reversed */
+#endif
+
+	idx = tail & ur->sq_mask;
+	sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = addr;
+	sqe->poll32_events = events;
+	sqe->user_data = user_data;
+
+	ur->sq_array[idx] = idx;
+	__atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ur->pending++;
+
+	return 0;
+}
+
+/** Start polling a socket for readability or writability
+ *
+ * Polls are one-shot.  They're re-armed after the event has been
+ * serviced, and all of the re-arms go to the kernel with the next wait.
+ */
+static int event_uring_arm(fr_event_list_t *el, fr_event_fd_t *ef, int which)
+{
+	fr_event_uring_t	*ur = el->uring;
+	uint64_t		user_data;
+
+	if (ef->uring_armed[which]) return 0;
+
+	if ((++ur->seq & 0x3fffffff) == 0) ur->seq++;	/* user_data of 0 means "not armed" */
+	user_data = URING_USER_DATA(ef->fd, ur->seq, which);
+
+	if (event_uring_push(ur, IORING_OP_POLL_ADD, ef->fd,
+			     (which == URING_POLL_READ) ? (POLLIN | POLLRDHUP) : POLLOUT, 0, user_data) < 0) return -1;
+
+	ef->uring_armed[which] = user_data;
+
+	return 0;
+}
+
+/** Stop polling a socket
+ *
+ * The completion for the cancelled poll is ignored, as it no longer
+ * matches the user_data recorded in the event.
+ */
+static void event_uring_disarm(fr_event_list_t *el, fr_event_fd_t *ef, int which)
+{
+	if (!ef->uring_armed[which]) return;
+
+	(void) event_uring_push(el->uring, IORING_OP_POLL_REMOVE, -1, 0, ef->uring_armed[which],
+				URING_USER_DATA(0, 0, URING_IGNORE));
+	ef->uring_armed[which] = 0;
+}
+
+/** Re-arm the polls for a socket after its events have been serviced
+ *
+ */
+static void event_uring_rearm(fr_event_list_t *el, fr_event_fd_t *ef)
+{
+	if (!ef->uring || !ef->is_registered) return;
+
+	if (ef->active.io.read && (ef->active.io.read != fr_event_fd_noop)) {
+		(void) event_uring_arm(el, ef, URING_POLL_READ);
+	}
+
+	if (ef->active.io.write && (ef->active.io.write != fr_event_fd_noop)) {
+		(void) event_uring_arm(el, ef, URING_POLL_WRITE);
+	}
+}
+
+/** Convert io_uring completions into kevents
+ *
+ * The rest of the event loop only deals with kevents, so sockets
+ * polled with io_uring look the same as everything else.
+ *
+ * @param[in] el	to reap completions for.
+ * @return the number of events written to el->events.
+ */
+static int event_uring_reap(fr_event_list_t *el)
+{
+	fr_event_uring_t	*ur = el->uring;
+	unsigned		head, tail;
+	int			num = 0;
+	bool			kq_ready = false;
+
+	head = *ur->cq_head;
+	tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+	while ((head != tail) && (num < FR_EV_BATCH_FDS)) {
+		struct io_uring_cqe	*cqe = &ur->cqes[head & ur->cq_mask];
+		uint64_t		user_data = cqe->user_data;
+		int			res = cqe->res;
+		int			which = URING_USER_DATA_WHICH(user_data);
+		fr_event_fd_t		*ef;
+		uint16_t		flags = 0;
+		uint32_t		fflags = 0;
+
+		head++;
+
+		switch (which) {
+		case URING_POLL_KQ:
+			ur->kq_armed = false;
+			kq_ready = true;
+			continue;
+
+		case URING_IGNORE:
+			continue;
+
+		default:
+			break;
+		}
+
+		/*
+		 *	Polls which have been cancelled, or replaced,
+		 *	won't match.
+		 */
+		ef = rbtree_finddata(el->fds, &(fr_event_fd_t){ .fd = URING_USER_DATA_FD(user_data),
+							       .filter = FR_EVENT_FILTER_IO });
+		if (!ef || (ef->uring_armed[which] != user_data)) continue;
+		ef->uring_armed[which] = 0;
+
+		if (res < 0) {
+			if (res == -ECANCELED) continue;
+
+			EV_SET(&el->events[num++], ef->fd, (which == URING_POLL_READ) ? EVFILT_READ : EVFILT_WRITE,
+			       EV_ERROR, 0, -res, ef);
+			continue;
+		}
+
+		/*
+		 *	The other end has gone away.  kevent puts the
+		 *	socket error in fflags.
+		 */
+		if (res & (POLLHUP | POLLRDHUP)) {
+			int		sock_err = 0;
+			socklen_t	len = sizeof(sock_err);
+
+			flags |= EV_EOF;
+			if (getsockopt(ef->fd, SOL_SOCKET, SO_ERROR, &sock_err, &len) == 0) fflags = sock_err;
+		}
+
+		EV_SET(&el->events[num++], ef->fd, (which == URING_POLL_READ) ? EVFILT_READ : EVFILT_WRITE,
+		       flags, fflags, 0, ef);
+	}
+
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+	/*
+	 *	Something is ready in the kqueue, get the events from
+	 *	it too.  If there's no room, the kqueue will be polled
+	 *	again, and will be immediately ready.
+	 */
+	if (kq_ready && (num < FR_EV_BATCH_FDS)) {
+		struct timespec	ts_zero = { 0 };
+		int		ret;
+
+		ret = kevent(el->kq, NULL, 0, el->events + num, FR_EV_BATCH_FDS - num, &ts_zero);
+		if (ret > 0) num += ret;
+	}
+
+	return num;
+}
+
+/** Submit changes and wait for events, using io_uring
+ *
+ * @param[in] el	to wait for events on.
+ * @param[in] ts_wake	how long to wait for.  NULL means forever.
+ * @return
+ *	- >= 0 the number of events in el->events.
+ *	- < 0 on error, with errno set.
+ */
+static int event_uring_corral(fr_event_list_t *el, struct timespec const *ts_wake)
+{
+	fr_event_uring_t	*ur = el->uring;
+	unsigned		min_complete = 1;
+
+	/*
+	 *	The kqueue still handles timers for child processes,
+	 *	user events, and file changes.  We poll it for
+	 *	readability, the same as the sockets.
+	 */
+	if (!ur->kq_armed) {
+		if (event_uring_push(ur, IORING_OP_POLL_ADD, el->kq, POLLIN, 0,
+				     URING_USER_DATA(el->kq, 0, URING_POLL_KQ)) < 0) {
+			errno = EIO;
+			return -1;
+		}
+		ur->kq_armed = true;
+	}
+
+	/*
+	 *	Don't block if we were asked not to, or if there are
+	 *	already completions waiting.
+	 */
+	if ((ts_wake && !ts_wake->tv_sec && !ts_wake->tv_nsec) ||
+	    (*ur->cq_head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE))) min_complete = 0;
+
+	if (event_uring_enter(ur, min_complete, IORING_ENTER_GETEVENTS, min_complete ? ts_wake : NULL) < 0) {
+		switch (errno) {
+		case ETIME:	/* Timed out */
+		case EBUSY:	/* Completion queue is full, go reap it */
+			break;
+
+		default:
+			return -1;
+		}
+	}
+
+	return event_uring_reap(el);
+}
+#endif
+
+/** Apply filter changes for a file descriptor
+ *
+ * Read and write filters for sockets polled by io_uring are handled
+ * here, and everything else is passed to kevent().
+ *
+ * @param[in] el	the event list.
+ * @param[in] evset	the changes, as produced by #fr_event_build_evset.
+ * @param[in] count	the number of changes.
+ * @return
+ *	- >= 0 on success.
+ *	- < 0 on error, with errno set.
+ */
+static int event_changes_apply(fr_event_list_t *el, struct kevent evset[], int count)
+{
+#ifdef WITH_EVENT_URING
+	int i, j;
+
+	for (i = 0, j = 0; i < count; i++) {
+		fr_event_fd_t	*ef = evset[i].udata;
+		int		which;
+
+		if (!ef->uring || ((evset[i].filter != EVFILT_READ) && (evset[i].filter != EVFILT_WRITE))) {
+			if (i != j) evset[j] = evset[i];
+			j++;
+			continue;
+		}
+
+		/*
+		 *	The event list is being freed.
+		 */
+		if (!el->uring) continue;
+
+		which = (evset[i].filter == EVFILT_READ) ? URING_POLL_READ : URING_POLL_WRITE;
+
+		if (evset[i].flags & EV_DELETE) {
+			event_uring_disarm(el, ef, which);
+			continue;
+		}
+
+		if (event_uring_arm(el, ef, which) < 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	count = j;
+	if (!count) return 0;
+#endif
+
+	return kevent(el->kq, evset, count, NULL, 0, NULL);
+}
+
 /** Build a new evset based on function pointers present
  *
  * @note The contents of active functions may be inconsistent if this function errors.  But the
@@ -690,7 +1255,7 @@ static int _event_fd_delete(fr_event_fd_t *ef)
 			/*
 			 *	If this fails, assert on debug builds.
 			 */
-			ret = kevent(el->kq, evset, count, NULL, 0, NULL);
+			ret = event_changes_apply(el, evset, count);
 			if (!fr_cond_assert_msg(ret >= 0,
 						"FD %i was closed without being removed from the KQ: %s",
 						ef->fd, fr_syserror(errno))) {
@@ -856,7 +1421,7 @@ int _fr_event_filter_update(NDEBUG_LOCATION_ARGS
 		return -1;
 	}
 
-	if (count && unlikely(kevent(el->kq, evset, count, NULL, 0, NULL) < 0)) {
+	if (count && unlikely(event_changes_apply(el, evset, count) < 0)) {
 		fr_strerror_printf("Failed updating filters for FD %i: %s", ef->fd, fr_syserror(errno));
 		goto error;
 	}
@@ -965,9 +1530,13 @@ int _fr_event_filter_insert(NDEBUG_LOCATION_ARGS
 			goto free;
 		}
 
+#ifdef WITH_EVENT_URING
+		ef->uring = el->uring && (filter == FR_EVENT_FILTER_IO) && (ef->type == FR_EVENT_FD_SOCKET);
+#endif
+
 		count = fr_event_build_evset(evset, sizeof(evset)/sizeof(*evset), &ef->active, ef, funcs, &ef->active);
 		if (count < 0) goto free;
-		if (count && (unlikely(kevent(el->kq, evset, count, NULL, 0, NULL) < 0))) {
+		if (count && (unlikely(event_changes_apply(el, evset, count) < 0))) {
 			fr_strerror_printf("Failed inserting filters for FD %i: %s", fd, fr_syserror(errno));
 			goto free;
 		}
@@ -998,7 +1567,7 @@ int _fr_event_filter_insert(NDEBUG_LOCATION_ARGS
 			memcpy(&ef->active, &active, sizeof(ef->active));
 			return -1;
 		}
-		if (count && (unlikely(kevent(el->kq, evset, count, NULL, 0, NULL) < 0))) {
+		if (count && (unlikely(event_changes_apply(el, evset, count) < 0))) {
 			fr_strerror_printf("Failed modifying filters for FD %i: %s", fd, fr_syserror(errno));
 			goto error;
 		}
@@ -1148,6 +1717,256 @@ int fr_event_fd_unarmour(fr_event_list_t *el, int fd, fr_event_filter_t filter,
 }
 #endif
 
+/** Insert a timer into a timer wheel
+ *
+ * @param[in] wh	to insert the timer into.
+ * @param[in] ev	to insert.
+ * @return
+ *	- true if the timer was inserted.
+ *	- false if it's too far in the future for the wheel.
+ */
+static bool event_wheel_insert(fr_event_wheel_t *wh, fr_event_timer_t *ev)
+{
+	uint64_t	tick, delta;
+	int		level;
+
+	/*
+	 *	Round up, so that timers never fire early.
+	 */
+	tick = (ev->when <= 0) ? 0 : ((uint64_t)ev->when + wh->resolution - 1) / wh->resolution;
+
+	/*
+	 *	Already due.
+	 */
+	if (tick < wh->now) {
+		ev->wheel_slot = &wh->expired;
+		goto done;
+	}
+
+	delta = tick - wh->now;
+	for (level = 0; level < FR_EVENT_WHEEL_LEVELS; level++) {
+		unsigned int idx;
+
+		if (delta >= ((uint64_t)1 << (FR_EVENT_WHEEL_BITS * (level + 1)))) continue;
+
+		idx = (tick >> (FR_EVENT_WHEEL_BITS * level)) & FR_EVENT_WHEEL_MASK;
+		wh->used[level] |= ((uint64_t)1 << idx);
+		ev->wheel_slot = &wh->slots[level][idx];
+		goto done;
+	}
+
+	return false;
+
+done:
+	fr_dlist_insert_tail(ev->wheel_slot, ev);
+	wh->num++;
+	return true;
+}
+
+/** Remove a timer from a timer wheel
+ *
+ */
+static void event_wheel_remove(fr_event_wheel_t *wh, fr_event_timer_t *ev)
+{
+	fr_dlist_head_t *slot = ev->wheel_slot;
+
+	(void) fr_dlist_remove(slot, ev);
+	ev->wheel_slot = NULL;
+	wh->num--;
+
+	if ((slot != &wh->expired) && fr_dlist_empty(slot)) {
+		size_t idx = slot - &wh->slots[0][0];
+
+		wh->used[idx / FR_EVENT_WHEEL_SLOTS] &= ~((uint64_t)1 << (idx % FR_EVENT_WHEEL_SLOTS));
+	}
+}
+
+/** Move the timers in a slot to the expired list, or down a level
+ *
+ */
+static void event_wheel_slot_empty(fr_event_wheel_t *wh, int level, unsigned int idx)
+{
+	fr_dlist_head_t		*slot = &wh->slots[level][idx];
+	fr_event_timer_t	*ev;
+
+	wh->used[level] &= ~((uint64_t)1 << idx);
+
+	while ((ev = fr_dlist_head(slot)) != NULL) {
+		(void) fr_dlist_remove(slot, ev);
+		wh->num--;
+
+		if (level == 0) {
+			ev->wheel_slot = &wh->expired;
+			fr_dlist_insert_tail(&wh->expired, ev);
+			wh->num++;
+			continue;
+		}
+
+		/*
+		 *	Timers cascade down from the slot
+		 *	when it's less than one rotation away,
+		 *	so they always fit.
+		 */
+		if (!fr_cond_assert(event_wheel_insert(wh, ev))) {
+			ev->wheel_slot = &wh->expired;
+			fr_dlist_insert_tail(&wh->expired, ev);
+			wh->num++;
+		}
+	}
+}
+
+/** Process all ticks up to and including the one containing "now"
+ *
+ * Any timers which are due are moved to the expired list.
+ */
+static void event_wheel_advance(fr_event_wheel_t *wh, fr_time_t now)
+{
+	uint64_t	target;
+
+	if (now < 0) return;
+	target = (uint64_t)now / wh->resolution;
+
+	while (wh->now <= target) {
+		unsigned int	idx = wh->now & FR_EVENT_WHEEL_MASK;
+
+		/*
+		 *	Nothing left in any slot, skip straight
+		 *	to the end.
+		 */
+		if (fr_dlist_num_elements(&wh->expired) == wh->num) {
+			wh->now = target + 1;
+			break;
+		}
+
+		/*
+		 *	Level 0 has wrapped, so cascade the
+		 *	next slot of each level above it.
+		 */
+		if (idx == 0) {
+			int level;
+
+			for (level = 1; level < FR_EVENT_WHEEL_LEVELS; level++) {
+				unsigned int up = (wh->now >> (FR_EVENT_WHEEL_BITS * level)) & FR_EVENT_WHEEL_MASK;
+
+				if (wh->used[level] & ((uint64_t)1 << up)) event_wheel_slot_empty(wh, level, up);
+				if (up != 0) break;
+			}
+		}
+
+		if (wh->used[0] & ((uint64_t)1 << idx)) event_wheel_slot_empty(wh, 0, idx);
+		wh->now++;
+
+		/*
+		 *	Skip empty level 0 slots until it wraps.
+		 */
+		idx = wh->now & FR_EVENT_WHEEL_MASK;
+		if (idx && !(wh->used[0] >> idx)) {
+			uint64_t next = (wh->now | FR_EVENT_WHEEL_MASK) + 1;
+
+			wh->now = (next > target) ? target + 1 : next;
+		}
+	}
+}
+
+/** Return the earliest time at which a timer in the wheel may be due
+ *
+ * For timers in the upper levels, this is when they cascade down,
+ * rather than when they fire.
+ *
+ * @param[in] wh	to check.
+ * @param[out] when	the wheel has to be advanced.
+ * @return
+ *	- true if there are timers in the wheel.
+ *	- false if the wheel is empty.
+ */
+static bool event_wheel_next(fr_event_wheel_t *wh, fr_time_t *when)
+{
+	fr_event_timer_t	*ev;
+	uint64_t		tick = UINT64_MAX;
+	int			level;
+
+	if (!wh->num) return false;
+
+	ev = fr_dlist_head(&wh->expired);
+	if (ev) {
+		*when = ev->when;
+		return true;
+	}
+
+	for (level = 0; level < FR_EVENT_WHEEL_LEVELS; level++) {
+		uint64_t	base = wh->now >> (FR_EVENT_WHEEL_BITS * level);
+		unsigned int	shift;
+		uint64_t	bits;
+
+		if (!wh->used[level]) continue;
+
+		/*
+		 *	Start at the current slot, unless it's already
+		 *	been cascaded.  That's the case once we're past
+		 *	the first tick it covers.
+		 */
+		if (wh->now & (((uint64_t)1 << (FR_EVENT_WHEEL_BITS * level)) - 1)) base++;
+
+		shift = base & FR_EVENT_WHEEL_MASK;
+		bits = shift ? ((wh->used[level] >> shift) | (wh->used[level] << (FR_EVENT_WHEEL_SLOTS - shift))) :
+			       wh->used[level];
+
+		base += __builtin_ctzll(bits);
+		base <<= (FR_EVENT_WHEEL_BITS * level);
+		if (base < tick) tick = base;
+	}
+
+	*when = tick * wh->resolution;
+	return true;
+}
+
+/** Add a timer to the timer store for an event list
+ *
+ */
+static int event_timer_insert(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	if (el->wheel && event_wheel_insert(el->wheel, ev)) return 0;
+
+	return fr_heap_insert(el->times, ev);
+}
+
+/** Remove a timer from the timer store for an event list
+ *
+ */
+static int event_timer_extract(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	if (ev->wheel_slot) {
+		event_wheel_remove(el->wheel, ev);
+		return 0;
+	}
+
+	return fr_heap_extract(el->times, ev);
+}
+
+/** Return when the next timer event may be due
+ *
+ * @param[in] el	to check.
+ * @param[out] when	the next timer is due.
+ * @return
+ *	- true if there are timers.
+ *	- false if there are no timers.
+ */
+static bool event_timer_next(fr_event_list_t *el, fr_time_t *when)
+{
+	fr_event_timer_t	*ev;
+	bool			found = false;
+
+	if (el->wheel) found = event_wheel_next(el->wheel, when);
+
+	ev = fr_heap_peek(el->times);
+	if (ev && (!found || (ev->when < *when))) {
+		*when = ev->when;
+		found = true;
+	}
+
+	return found;
+}
+
 /** Remove an event from the event loop
  *
  * @param[in] ev	to free.
@@ -1163,7 +1982,7 @@ static int _event_timer_free(fr_event_timer_t *ev)
 	if (fr_dlist_entry_in_list(&ev->entry)) {
 		(void) fr_dlist_remove(&el->ev_to_add, ev);
 	} else {
-		int	ret = fr_heap_extract(el->times, ev);
+		int	ret = event_timer_extract(el, ev);
 
 		/*
 		 *	Events MUST be in the heap (or the insertion list).
@@ -1278,7 +2097,7 @@ int _fr_event_timer_at(NDEBUG_LOCATION_ARGS
 		if (!fr_dlist_entry_in_list(&ev->entry)) {
 			int ret;
 
-			ret = fr_heap_extract(el->times, ev);
+			ret = event_timer_extract(el, ev);
 			/*
 			 *	Events MUST be in the heap (or the insertion list).
 			 */
@@ -1312,7 +2131,7 @@ int _fr_event_timer_at(NDEBUG_LOCATION_ARGS
 		 *	multiple times.
 		 */
 		if (!fr_dlist_entry_in_list(&ev->entry)) fr_dlist_insert_head(&el->ev_to_add, ev);
-	} else if (unlikely(fr_heap_insert(el->times, ev) < 0)) {
+	} else if (unlikely(event_timer_insert(el, ev) < 0)) {
 		fr_strerror_printf_push("Failed inserting event");
 		talloc_set_destructor(ev, NULL);
 		*ev_p = NULL;
@@ -1640,23 +2459,43 @@ int fr_event_timer_run(fr_event_list_t *el, fr_time_t *when)
 
 	if (unlikely(!el)) return 0;
 
-	if (fr_heap_num_elements(el->times) == 0) {
-		*when = 0;
-		return 0;
-	}
-
-	ev = fr_heap_peek(el->times);
-	if (!ev) {
-		*when = 0;
-		return 0;
-	}
-
 	/*
-	 *	See if it's time to do this one.
+	 *	Timers in the wheel which are due end up on the
+	 *	expired list.  Run those first, unless there's
+	 *	an earlier one in the heap.
 	 */
-	if (ev->when > *when) {
-		*when = ev->when;
-		return 0;
+	if (el->wheel) {
+		fr_event_timer_t *heap_ev;
+
+		event_wheel_advance(el->wheel, *when);
+
+		ev = fr_dlist_head(&el->wheel->expired);
+		heap_ev = fr_heap_peek(el->times);
+		if (heap_ev && (heap_ev->when <= *when) && (!ev || (heap_ev->when < ev->when))) ev = heap_ev;
+
+		if (!ev) {
+			if (!event_timer_next(el, when)) *when = 0;
+			return 0;
+		}
+	} else {
+		if (fr_heap_num_elements(el->times) == 0) {
+			*when = 0;
+			return 0;
+		}
+
+		ev = fr_heap_peek(el->times);
+		if (!ev) {
+			*when = 0;
+			return 0;
+		}
+
+		/*
+		 *	See if it's time to do this one.
+		 */
+		if (ev->when > *when) {
+			*when = ev->when;
+			return 0;
+		}
 	}
 
 	callback = ev->callback;
@@ -1687,10 +2526,12 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 {
 	fr_time_t		when, *wake;
 	struct timespec		ts_when, *ts_wake;
+	fr_time_t		next;
 	fr_event_pre_t		*pre;
 	int			num_fd_events;
 	bool			timer_event_ready = false;
-	fr_event_timer_t	*ev;
+	bool			blocking;
+	fr_time_t		started = 0;
 
 	el->num_fd_events = 0;
 
@@ -1714,13 +2555,12 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	 *	events are in the past.  Or, we wait for a future
 	 *	timer event.
 	 */
-	ev = fr_heap_peek(el->times);
-	if (ev) {
-		if (ev->when <= el->now) {
+	if (event_timer_next(el, &next)) {
+		if (next <= el->now) {
 			timer_event_ready = true;
 
 		} else if (wait) {
-			when = ev->when - el->now;
+			when = next - el->now;
 
 		} /* else we're not waiting, leave "when == 0" */
 
@@ -1768,8 +2608,22 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	 *	that occurred since this function was last called
 	 *	or wait for the next timer event.
 	 */
+	el->stats.loops++;
+	blocking = !ts_wake || (when > 0);
+	if (blocking) {
+		el->stats.waits++;
+		started = el->time();
+	}
+
+#ifdef WITH_EVENT_URING
+	if (el->uring) {
+		num_fd_events = event_uring_corral(el, ts_wake);
+	} else
+#endif
 	num_fd_events = kevent(el->kq, NULL, 0, el->events, FR_EV_BATCH_FDS, ts_wake);
 
+	if (blocking) el->stats.idle += el->time() - started;
+
 	/*
 	 *	Interrupt is different from timeout / FD events.
 	 */
@@ -1783,6 +2637,8 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	}
 
 	el->num_fd_events = num_fd_events;
+	el->stats.fd_events += num_fd_events;
+	if (num_fd_events == FR_EV_BATCH_FDS) el->stats.full++;
 
 	EVENT_DEBUG("%s - kevent returned %u FD events", __FUNCTION__, el->num_fd_events);
 
@@ -1995,6 +2851,19 @@ service:
 		}
 	}
 
+#ifdef WITH_EVENT_URING
+	/*
+	 *	Polls are one-shot, so re-arm the ones which fired.
+	 *	This is done after all of the handlers have run, so
+	 *	that the events they deleted aren't re-armed.
+	 */
+	if (el->uring) for (i = 0; i < el->num_fd_events; i++) {
+		if ((el->events[i].filter != EVFILT_READ) && (el->events[i].filter != EVFILT_WRITE)) continue;
+
+		event_uring_rearm(el, el->events[i].udata);
+	}
+#endif
+
 	/*
 	 *	Process any deferred frees performed
 	 *	by the I/O handlers.
@@ -2020,7 +2889,7 @@ service:
 	 *	Run all of the timer events.  Note that these can add
 	 *	new timers!
 	 */
-	if (fr_heap_num_elements(el->times) > 0) {
+	if (fr_event_list_num_timers(el) > 0) {
 		do {
 			when = el->now;
 		} while (fr_event_timer_run(el, &when) == 1);
@@ -2042,7 +2911,7 @@ service:
 	 */
 	while ((ev = fr_dlist_head(&el->ev_to_add)) != NULL) {
 		(void)fr_dlist_remove(&el->ev_to_add, ev);
-		if (unlikely(fr_heap_insert(el->times, ev) < 0)) {
+		if (unlikely(event_timer_insert(el, ev) < 0)) {
 			talloc_free(ev);
 			fr_assert_msg(0, "failed inserting heap event: %s", fr_strerror());	/* Die in debug builds */
 		}
@@ -2116,8 +2985,24 @@ static int _event_list_free(fr_event_list_t *el)
 
 	while ((ev = fr_heap_peek(el->times)) != NULL) fr_event_timer_delete(&ev);
 
+	/*
+	 *	Free the timers in the wheel before the wheel.
+	 */
+	if (el->wheel) {
+		fr_dlist_head_t *slot;
+
+		for (slot = &el->wheel->slots[0][0]; slot <= &el->wheel->slots[FR_EVENT_WHEEL_LEVELS - 1][FR_EVENT_WHEEL_MASK]; slot++) {
+			while ((ev = fr_dlist_head(slot)) != NULL) fr_event_timer_delete(&ev);
+		}
+		while ((ev = fr_dlist_head(&el->wheel->expired)) != NULL) fr_event_timer_delete(&ev);
+	}
+
 	talloc_free_children(el);
 
+#ifdef WITH_EVENT_URING
+	TALLOC_FREE(el->uring);
+#endif
+
 	if (el->kq >= 0) close(el->kq);
 
 	return 0;
@@ -2133,6 +3018,27 @@ static int _event_list_free(fr_event_list_t *el)
  *	- NULL on error.
  */
 fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t status, void *status_uctx)
+{
+	return fr_event_list_alloc_wheel(ctx, status, status_uctx, 0);
+}
+
+/** Initialise a new event list, which keeps its timers in a timer wheel
+ *
+ * A timer wheel has O(1) insert and delete, so it's better than the
+ * heap when there are a large number of timers, and most of them are
+ * deleted before they fire.  Timers are rounded up to the resolution
+ * of the wheel, so they may fire up to that much later than requested.
+ *
+ * @param[in] ctx		to allocate memory in.
+ * @param[in] status		callback, called on each iteration of the event list.
+ * @param[in] status_uctx	context for the status callback
+ * @param[in] resolution	of the timer wheel.  If 0, a heap is used instead.
+ * @return
+ *	- A pointer to a new event list on success (free with talloc_free).
+ *	- NULL on error.
+ */
+fr_event_list_t *fr_event_list_alloc_wheel(TALLOC_CTX *ctx, fr_event_status_cb_t status, void *status_uctx,
+					   fr_time_delta_t resolution)
 {
 	fr_event_list_t		*el;
 	struct kevent		kev;
@@ -2143,6 +3049,7 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 		return NULL;
 	}
 	el->time = fr_time;
+	el->stats.start = el->time();
 	el->kq = -1;	/* So destructor can be used before kqueue() provides us with fd */
 	talloc_set_destructor(el, _event_list_free);
 
@@ -2154,6 +3061,26 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 		return NULL;
 	}
 
+	if (resolution > 0) {
+		fr_event_wheel_t	*wh;
+		int			i, j;
+
+		el->wheel = wh = talloc_zero(el, fr_event_wheel_t);
+		if (!wh) {
+			fr_strerror_printf("Failed allocating timer wheel");
+			goto error;
+		}
+		wh->resolution = resolution;
+		if (el->time() > 0) wh->now = (uint64_t)el->time() / resolution;
+
+		for (i = 0; i < FR_EVENT_WHEEL_LEVELS; i++) {
+			for (j = 0; j < FR_EVENT_WHEEL_SLOTS; j++) {
+				fr_dlist_init(&wh->slots[i][j], fr_event_timer_t, wheel_entry);
+			}
+		}
+		fr_dlist_init(&wh->expired, fr_event_timer_t, wheel_entry);
+	}
+
 	el->fds = rbtree_talloc_alloc(el, fr_event_fd_cmp, fr_event_fd_t, NULL, 0);
 	if (!el->fds) {
 		fr_strerror_printf("Failed allocating FD tree");
@@ -2166,6 +3093,14 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 		goto error;
 	}
 
+#ifdef WITH_EVENT_URING
+	/*
+	 *	If io_uring isn't available, e.g. the kernel is too
+	 *	old, or it's blocked by seccomp, we just use kqueue.
+	 */
+	if (event_use_uring) el->uring = event_uring_alloc();
+#endif
+
 	fr_dlist_talloc_init(&el->pre_callbacks, fr_event_pre_t, entry);
 	fr_dlist_talloc_init(&el->post_callbacks, fr_event_post_t, entry);
 	fr_dlist_talloc_init(&el->user_callbacks, fr_event_user_t, entry);
@@ -2188,6 +3123,27 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 	return el;
 }
 
+/** Check socket readiness with io_uring instead of kqueue
+ *
+ * This only affects event lists which are allocated after it's called.
+ * If io_uring can't be used when an event list is allocated, the event
+ * list uses kqueue.
+ *
+ * @param[in] enable	whether to use io_uring.
+ * @return
+ *	- true if io_uring was built in.
+ *	- false if it's not supported on this platform.
+ */
+bool fr_event_list_use_io_uring(bool enable)
+{
+#ifdef WITH_EVENT_URING
+	event_use_uring = enable;
+	return true;
+#else
+	return !enable;
+#endif
+}
+
 /** Override event list time source
  *
  * @param[in] el	to set new time function for.
@@ -2196,6 +3152,16 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 void fr_event_list_set_time_func(fr_event_list_t *el, fr_event_time_source_t func)
 {
 	el->time = func;
+
+	/*
+	 *	The wheel starts from the current time, so if
+	 *	the time source changes, it has to start again.
+	 */
+	if (el->wheel && !el->wheel->num) {
+		fr_time_t now = func();
+
+		el->wheel->now = (now > 0) ? (uint64_t)now / el->wheel->resolution : 0;
+	}
 }
 
 /** Return whether the event loop has any active events
@@ -2203,7 +3169,7 @@ void fr_event_list_set_time_func(fr_event_list_t *el, fr_event_time_source_t fun
  */
 bool fr_event_list_empty(fr_event_list_t *el)
 {
-	return !fr_heap_num_elements(el->times) && !rbtree_num_elements(el->fds);
+	return !fr_event_list_num_timers(el) && !rbtree_num_elements(el->fds);
 }
 
 #ifdef WITH_EVENT_DEBUG
@@ -2251,12 +3217,68 @@ static int event_timer_print_location(void *node, UNUSED void *uctx)
 	return 0;
 }
 
+/** Iterate over the timers in the heap, and then the timer wheel
+ *
+ */
+typedef struct {
+	fr_heap_iter_t		heap;			//!< Position in the heap.
+	int			list;			//!< Wheel slot, or -1 if we're still in the heap.
+	fr_event_timer_t	*ev;			//!< Current timer.
+} event_timer_iter_t;
+
+/** Move to the next timer in the timer wheel
+ *
+ */
+static fr_event_timer_t *event_timer_iter_wheel(fr_event_list_t *el, event_timer_iter_t *iter)
+{
+	fr_dlist_head_t *list;
+
+	if (iter->ev) {
+		iter->ev = fr_dlist_next(iter->ev->wheel_slot, iter->ev);
+		if (iter->ev) return iter->ev;
+	}
+
+	if (!el->wheel) return NULL;
+
+	/*
+	 *	The expired list comes after the last slot.
+	 */
+	while (++iter->list <= (FR_EVENT_WHEEL_LEVELS * FR_EVENT_WHEEL_SLOTS)) {
+		list = (iter->list == (FR_EVENT_WHEEL_LEVELS * FR_EVENT_WHEEL_SLOTS)) ?
+		       &el->wheel->expired : &el->wheel->slots[0][0] + iter->list;
+
+		iter->ev = fr_dlist_head(list);
+		if (iter->ev) return iter->ev;
+	}
+
+	return NULL;
+}
+
+static fr_event_timer_t *event_timer_iter_init(fr_event_list_t *el, event_timer_iter_t *iter)
+{
+	iter->list = -1;
+	iter->ev = fr_heap_iter_init(el->times, &iter->heap);
+	if (iter->ev) return iter->ev;
+
+	return event_timer_iter_wheel(el, iter);
+}
+
+static fr_event_timer_t *event_timer_iter_next(fr_event_list_t *el, event_timer_iter_t *iter)
+{
+	if (iter->list < 0) {
+		iter->ev = fr_heap_iter_next(el->times, &iter->heap);
+		if (iter->ev) return iter->ev;
+	}
+
+	return event_timer_iter_wheel(el, iter);
+}
+
 /** Print out information about the number of events in the event loop
  *
  */
 void fr_event_report(fr_event_list_t *el, fr_time_t now, void *uctx)
 {
-	fr_heap_iter_t		iter;
+	event_timer_iter_t	iter;
 	fr_event_timer_t const	*ev;
 	size_t			i;
 
@@ -2282,9 +3304,9 @@ void fr_event_report(fr_event_list_t *el, fr_time_t now, void *uctx)
 	 *	Show which events are due, when they're due,
 	 *	and where they were allocated
 	 */
-	for (ev = fr_heap_iter_init(el->times, &iter);
+	for (ev = event_timer_iter_init(el, &iter);
 	     ev != NULL;
-	     ev = fr_heap_iter_next(el->times, &iter)) {
+	     ev = event_timer_iter_next(el, &iter)) {
 		fr_time_delta_t diff = ev->when - now;
 
 		for (i = 0; i < NUM_ELEMENTS(decades); i++) {
@@ -2338,7 +3360,7 @@ void fr_event_report(fr_event_list_t *el, fr_time_t now, void *uctx)
 #ifndef NDEBUG
 void fr_event_timer_dump(fr_event_list_t *el)
 {
-	fr_heap_iter_t		iter;
+	event_timer_iter_t	iter;
 	fr_event_timer_t 	*ev;
 	fr_time_t		now;
 
@@ -2346,9 +3368,9 @@ void fr_event_timer_dump(fr_event_list_t *el)
 
 	EVENT_DEBUG("Time is now %"PRId64"", now);
 
-	for (ev = fr_heap_iter_init(el->times, &iter);
+	for (ev = event_timer_iter_init(el, &iter);
 	     ev;
-	     ev = fr_heap_iter_next(el->times, &iter)) {
+	     ev = event_timer_iter_next(el, &iter)) {
 		(void)talloc_get_type_abort(ev, fr_event_timer_t);
 		EVENT_DEBUG("%s[%u]: %p time=%" PRId64 " (%c), callback=%p",
 			    ev->file, ev->line, ev, ev->when, now > ev->when ? '<' : '>', ev->callback);
@@ -195,10 +195,27 @@ typedef union {
 	fr_event_vnode_func_t	vnode;			//!< vnode callback functions.
 } fr_event_funcs_t;
 
+/** Utilisation statistics for an event list
+ *
+ * Updated by the thread which owns the event list, without locking,
+ * so a copy read from another thread is only approximately consistent.
+ */
+typedef struct {
+	fr_time_t		start;			//!< When the event list was created.
+	fr_time_delta_t		idle;			//!< Time spent blocked waiting for events.
+	uint64_t		loops;			//!< Number of calls to fr_event_corral().
+	uint64_t		waits;			//!< Number of those calls which could have blocked.
+	uint64_t		fd_events;		//!< Number of FD events returned.
+	uint64_t		full;			//!< Number of times a full batch of FD events was
+							///< returned, i.e. more were probably pending.
+} fr_event_list_stats_t;
+
 int		fr_event_list_num_fds(fr_event_list_t *el);
 int		fr_event_list_num_timers(fr_event_list_t *el);
 int		fr_event_list_kq(fr_event_list_t *el);
 fr_time_t	fr_event_list_time(fr_event_list_t *el) CC_HINT(nonnull);
+void		fr_event_list_stats(fr_event_list_stats_t *out, fr_event_list_t const *el) CC_HINT(nonnull);
+void		fr_event_list_stats_fprint(FILE *fp, fr_event_list_t const *el, char const *prefix) CC_HINT(nonnull);
 
 int		_fr_event_fd_move(NDEBUG_LOCATION_ARGS
 				 fr_event_list_t *dst, fr_event_list_t *src, int fd, fr_event_filter_t filter);
@@ -270,6 +287,10 @@ bool		fr_event_loop_exiting(fr_event_list_t *el);
 int		fr_event_loop(fr_event_list_t *el);
 
 fr_event_list_t	*fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t status, void *status_ctx);
+fr_event_list_t	*fr_event_list_alloc_wheel(TALLOC_CTX *ctx, fr_event_status_cb_t status, void *status_ctx,
+					   fr_time_delta_t resolution);
+
+bool		fr_event_list_use_io_uring(bool enable);
 void		fr_event_list_set_time_func(fr_event_list_t *el, fr_event_time_source_t func);
 
 bool		fr_event_list_empty(fr_event_list_t *el);
@@ -0,0 +1,141 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/talloc.h>
+
+#define EVENT_TEST_SIZE		(4096)
+#define EVENT_TEST_RESOLUTION	(fr_time_delta_from_msec(1))
+
+typedef struct {
+	fr_event_timer_t const	*ev;
+	fr_time_t		when;		//!< When the timer was supposed to fire.
+	fr_time_t		fired;		//!< When it did fire, or 0.
+} event_thing;
+
+static fr_time_t event_test_now;
+
+static fr_time_t event_test_time(void)
+{
+	return event_test_now;
+}
+
+static fr_time_delta_t event_test_rand(fr_time_delta_t range)
+{
+	return ((((uint64_t)fr_rand()) << 32) | fr_rand()) % range;
+}
+
+static void event_test_cb(UNUSED fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	event_thing *thing = uctx;
+
+	thing->fired = now;
+}
+
+/*
+ *	Timers in the wheel must never fire early, and must fire
+ *	within one tick (plus however far we step the clock) of
+ *	being due.
+ */
+static void event_test_wheel(fr_time_delta_t step, fr_time_delta_t range)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("event_test_wheel");
+	fr_event_list_t		*el;
+	event_thing		*array;
+	int			i, deleted = 0, fired = 0;
+	fr_time_t		end;
+
+	event_test_now = fr_time_delta_from_sec(1000);
+
+	el = fr_event_list_alloc_wheel(ctx, NULL, NULL, EVENT_TEST_RESOLUTION);
+	TEST_CHECK(el != NULL);
+	if (!el) return;
+	fr_event_list_set_time_func(el, event_test_time);
+
+	array = talloc_zero_array(ctx, event_thing, EVENT_TEST_SIZE);
+
+	for (i = 0; i < EVENT_TEST_SIZE; i++) {
+		array[i].when = event_test_now + event_test_rand(range);
+		TEST_CHECK(fr_event_timer_at(ctx, el, &array[i].ev, array[i].when, event_test_cb, &array[i]) == 0);
+	}
+	TEST_CHECK(fr_event_list_num_timers(el) == EVENT_TEST_SIZE);
+
+	/*
+	 *	Delete every third timer, and move every fifth.
+	 */
+	for (i = 0; i < EVENT_TEST_SIZE; i++) {
+		if ((i % 3) == 0) {
+			TEST_CHECK(fr_event_timer_delete(&array[i].ev) == 0);
+			TEST_CHECK(array[i].ev == NULL);
+			deleted++;
+			continue;
+		}
+
+		if ((i % 5) == 0) {
+			array[i].when = event_test_now + event_test_rand(range);
+			TEST_CHECK(fr_event_timer_at(ctx, el, &array[i].ev, array[i].when, event_test_cb, &array[i]) == 0);
+		}
+	}
+	TEST_CHECK(fr_event_list_num_timers(el) == (EVENT_TEST_SIZE - deleted));
+
+	end = event_test_now + range + step + EVENT_TEST_RESOLUTION;
+	while (event_test_now <= end) {
+		fr_time_t when;
+
+		do {
+			when = event_test_now;
+		} while (fr_event_timer_run(el, &when) == 1);
+
+		event_test_now += step;
+	}
+	TEST_CHECK(fr_event_list_num_timers(el) == 0);
+
+	for (i = 0; i < EVENT_TEST_SIZE; i++) {
+		if ((i % 3) == 0) {
+			TEST_CHECK(array[i].fired == 0);
+			continue;
+		}
+
+		TEST_CHECK(array[i].fired >= array[i].when);
+		TEST_MSG("timer %i fired early, due %"PRId64" fired %"PRId64, i, array[i].when, array[i].fired);
+
+		TEST_CHECK(array[i].fired <= (array[i].when + EVENT_TEST_RESOLUTION + step));
+		TEST_MSG("timer %i fired late, due %"PRId64" fired %"PRId64, i, array[i].when, array[i].fired);
+
+		fired++;
+	}
+	TEST_CHECK(fired == (EVENT_TEST_SIZE - deleted));
+
+	talloc_free(ctx);
+}
+
+static void event_test_wheel_level0(void)
+{
+	event_test_wheel(fr_time_delta_from_usec(100), fr_time_delta_from_msec(50));
+}
+
+static void event_test_wheel_cascade(void)
+{
+	event_test_wheel(fr_time_delta_from_usec(700), fr_time_delta_from_sec(30));
+}
+
+static void event_test_wheel_idle(void)
+{
+	event_test_wheel(fr_time_delta_from_sec(2), fr_time_delta_from_sec(600));
+}
+
+/*
+ *	Timers beyond the range of the wheel go into the heap.
+ */
+static void event_test_wheel_overflow(void)
+{
+	event_test_wheel(fr_time_delta_from_sec(60), fr_time_delta_from_sec(86400));
+}
+
+TEST_LIST = {
+	{ "event_test_wheel_level0",	event_test_wheel_level0		},
+	{ "event_test_wheel_cascade",	event_test_wheel_cascade	},
+	{ "event_test_wheel_idle",	event_test_wheel_idle		},
+	{ "event_test_wheel_overflow",	event_test_wheel_overflow	},
+	{ NULL }
+};
@@ -16,15 +16,21 @@
 
 /** Resizable hash tables
  *
- * The weird "reverse" function is based on an idea from
- * "Split-Ordered Lists - Lock-free Resizable Hash Tables", with
- * modifications so that they're not lock-free. :(
+ * The table uses open addressing, in the style of "Swiss tables".
+ * Each slot holds the hash of its entry, and a pointer to the user
+ * data.  There is no per-entry allocation.
  *
- * However, the split-order idea allows a fast & easy splitting of the
- * hash bucket chain when the hash table is resized.  Without it, we'd
- * have to check & update the pointers for every node in the buck chain,
- * rather than being able to move 1/2 of the entries in the chain with
- * one update.
+ * A separate array holds one control byte per slot.  The control
+ * byte says if the slot is empty, deleted, or full.  When it's full,
+ * the control byte holds 7 bits of the hash.  Lookups scan a group of
+ * control bytes at a time (16 with SSE2, 8 otherwise), and only look
+ * at the slots whose control byte matches.  Most failed comparisons
+ * never touch the slot array, or call the comparison function.
+ *
+ * Deleted entries leave a tombstone, unless no probe sequence could
+ * have passed over the slot.  Tombstones are cleaned up when the
+ * table is rehashed.  Entries never move, except when the table is
+ * rehashed.
  *
  * @file src/lib/util/hash.c
  *
@@ -35,245 +41,288 @@ RCSID("$Id$")
 #include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/talloc.h>
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 /*
- *	A reasonable number of buckets to start off with.
- *	Should be a power of two.
+ *	A reasonable number of slots to start off with.
+ *	Must be a power of two, and at least HASH_GROUP_WIDTH.
  */
-#define FR_HASH_NUM_BUCKETS (64)
+#define FR_HASH_NUM_BUCKETS (32)
 
-struct fr_hash_entry_s {
-	fr_hash_entry_t *next;
-	uint32_t	reversed;
-	uint32_t	key;
-	void 		*data;
-};
+/*
+ *	Control bytes.  Full slots have the top bit clear, and
+ *	hold the low 7 bits of the (mixed) hash.
+ */
+#define CTRL_EMPTY	(0x80)
+#define CTRL_DELETED	(0xfe)
+
+#define IS_FULL(_ctrl)	(((_ctrl) & 0x80) == 0)
+
+/*
+ *	Grow when the table is 7/8 full, counting tombstones.
+ */
+#define MAX_LOAD(_slots) ((_slots) - ((_slots) >> 3))
+
+typedef struct {
+	uint32_t	key;		//!< hash returned by the user's hash function.
+	void		*data;
+} fr_hash_slot_t;
 
 struct fr_hash_table_s {
-	int			num_elements;
-	int			num_buckets; /* power of 2 */
-	int			next_grow;
-	int			mask;
+	uint32_t		num_elements;
+	uint32_t		num_deleted;	//!< tombstones.
+	uint32_t		num_slots;	//!< power of 2.
+	uint32_t		mask;
+	uint32_t		next_grow;	//!< rehash when num_elements + num_deleted reaches this.
+	int			walking;	//!< don't rehash during a walk.
 
 	fr_hash_table_free_t	free;
 	fr_hash_table_hash_t	hash;
 	fr_hash_table_cmp_t	cmp;
 
-	fr_hash_entry_t		null;
-
-	fr_hash_entry_t		**buckets;
+	uint8_t			*ctrl;		//!< num_slots + HASH_GROUP_WIDTH control bytes.
+						///< The last group mirrors the first, so that
+						///< a group can be loaded at any position.
+	fr_hash_slot_t		*slots;
 };
 
-#ifdef TESTING
-static int grow = 0;
-#endif
+/*
+ *	A group of control bytes, and bitmasks of the matching
+ *	slots in it.
+ */
+#ifdef __SSE2__
+#  define HASH_GROUP_WIDTH	(16)
+
+typedef uint32_t group_mask_t;
+
+static inline group_mask_t group_match(uint8_t const *ctrl, uint8_t h2)
+{
+	__m128i g = _mm_loadu_si128((__m128i const *) ctrl);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char) h2)));
+}
+
+static inline group_mask_t group_match_empty(uint8_t const *ctrl)
+{
+	return group_match(ctrl, CTRL_EMPTY);
+}
 
 /*
- * perl -e 'foreach $i (0..255) {$r = 0; foreach $j (0 .. 7 ) { if (($i & ( 1<< $j)) != 0) { $r |= (1 << (7 - $j));}} print $r, ", ";if (($i & 7) == 7) {print "\n";}}'
- */
-static const uint8_t reversed_byte[256] = {
-	0,  128, 64, 192, 32, 160, 96,  224,
-	16, 144, 80, 208, 48, 176, 112, 240,
-	8,  136, 72, 200, 40, 168, 104, 232,
-	24, 152, 88, 216, 56, 184, 120, 248,
-	4,  132, 68, 196, 36, 164, 100, 228,
-	20, 148, 84, 212, 52, 180, 116, 244,
-	12, 140, 76, 204, 44, 172, 108, 236,
-	28, 156, 92, 220, 60, 188, 124, 252,
-	2,  130, 66, 194, 34, 162, 98,  226,
-	18, 146, 82, 210, 50, 178, 114, 242,
-	10, 138, 74, 202, 42, 170, 106, 234,
-	26, 154, 90, 218, 58, 186, 122, 250,
-	6,  134, 70, 198, 38, 166, 102, 230,
-	22, 150, 86, 214, 54, 182, 118, 246,
-	14, 142, 78, 206, 46, 174, 110, 238,
-	30, 158, 94, 222, 62, 190, 126, 254,
-	1,  129, 65, 193, 33, 161, 97,  225,
-	17, 145, 81, 209, 49, 177, 113, 241,
-	9,  137, 73, 201, 41, 169, 105, 233,
-	25, 153, 89, 217, 57, 185, 121, 249,
-	5,  133, 69, 197, 37, 165, 101, 229,
-	21, 149, 85, 213, 53, 181, 117, 245,
-	13, 141, 77, 205, 45, 173, 109, 237,
-	29, 157, 93, 221, 61, 189, 125, 253,
-	3,  131, 67, 195, 35, 163, 99,  227,
-	19, 147, 83, 211, 51, 179, 115, 243,
-	11, 139, 75, 203, 43, 171, 107, 235,
-	27, 155, 91, 219, 59, 187, 123, 251,
-	7,  135, 71, 199, 39, 167, 103, 231,
-	23, 151, 87, 215, 55, 183, 119, 247,
-	15, 143, 79, 207, 47, 175, 111, 239,
-	31, 159, 95, 223, 63, 191, 127, 255
-};
+ *	Empty and deleted both have the top bit set.
+ */
+static inline group_mask_t group_match_free(uint8_t const *ctrl)
+{
+	return _mm_movemask_epi8(_mm_loadu_si128((__m128i const *) ctrl));
+}
 
+#  define MASK_LOWEST(_m)	((uint32_t) __builtin_ctz(_m))
+#  define MASK_HIGHEST(_m)	((uint32_t) (31 - __builtin_clz(_m)))
 
+#else
 /*
- * perl -e 'foreach $i (0..255) {$r = 0;foreach $j (0 .. 7) { $r = $i & (1 << (7 - $j)); last if ($r)} print $i & ~($r), ", ";if (($i & 7) == 7) {print "\n";}}'
- */
-static uint8_t parent_byte[256] = {
-	0, 0, 0, 1, 0, 1, 2, 3,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	16, 17, 18, 19, 20, 21, 22, 23,
-	24, 25, 26, 27, 28, 29, 30, 31,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	16, 17, 18, 19, 20, 21, 22, 23,
-	24, 25, 26, 27, 28, 29, 30, 31,
-	32, 33, 34, 35, 36, 37, 38, 39,
-	40, 41, 42, 43, 44, 45, 46, 47,
-	48, 49, 50, 51, 52, 53, 54, 55,
-	56, 57, 58, 59, 60, 61, 62, 63,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	16, 17, 18, 19, 20, 21, 22, 23,
-	24, 25, 26, 27, 28, 29, 30, 31,
-	32, 33, 34, 35, 36, 37, 38, 39,
-	40, 41, 42, 43, 44, 45, 46, 47,
-	48, 49, 50, 51, 52, 53, 54, 55,
-	56, 57, 58, 59, 60, 61, 62, 63,
-	64, 65, 66, 67, 68, 69, 70, 71,
-	72, 73, 74, 75, 76, 77, 78, 79,
-	80, 81, 82, 83, 84, 85, 86, 87,
-	88, 89, 90, 91, 92, 93, 94, 95,
-	96, 97, 98, 99, 100, 101, 102, 103,
-	104, 105, 106, 107, 108, 109, 110, 111,
-	112, 113, 114, 115, 116, 117, 118, 119,
-	120, 121, 122, 123, 124, 125, 126, 127
-};
+ *	Portable version, which works on 8 control bytes in a
+ *	uint64_t.  Each match sets the top bit of the matching byte.
+ */
+#  define HASH_GROUP_WIDTH	(8)
 
+typedef uint64_t group_mask_t;
+
+#define GROUP_LSB	(0x0101010101010101ULL)
+#define GROUP_MSB	(0x8080808080808080ULL)
+
+static inline uint64_t group_load(uint8_t const *ctrl)
+{
+	uint64_t g;
+
+	memcpy(&g, ctrl, sizeof(g));
+#ifdef WORDS_BIGENDIAN
+	g = __builtin_bswap64(g);
+#endif
+	return g;
+}
 
 /*
- *	Reverse a key.
+ *	May return false positives in the byte above a real match.
+ *	That's fine, as the caller checks the full hash.
  */
-static uint32_t reverse(uint32_t key)
+static inline group_mask_t group_match(uint8_t const *ctrl, uint8_t h2)
 {
-	/*
-	 *	Cast to uint32_t is required because the
-	 *	default type of of the expression is an
-	 *	int and ubsan correctly complains that
-	 *	the result of 0xff << 24 won't fit in an
-	 *	unsigned 32bit integer.
-	 */
-	return (((uint32_t)reversed_byte[key & 0xff] << 24) |
-		((uint32_t)reversed_byte[(key >> 8) & 0xff] << 16) |
-		((uint32_t)reversed_byte[(key >> 16) & 0xff] << 8) |
-		((uint32_t)reversed_byte[(key >> 24) & 0xff]));
+	uint64_t x = group_load(ctrl) ^ (GROUP_LSB * h2);
+
+	return (x - GROUP_LSB) & ~x & GROUP_MSB;
 }
 
 /*
- *	Take the parent by discarding the highest bit that is set.
+ *	Top bit set, and bit 1 clear.
  */
-static uint32_t parent_of(uint32_t key)
+static inline group_mask_t group_match_empty(uint8_t const *ctrl)
 {
-	if (key > 0x00ffffff)
-		return (key & 0x00ffffff) | (parent_byte[key >> 24] << 24);
+	uint64_t g = group_load(ctrl);
 
-	if (key > 0x0000ffff)
-		return (key & 0x0000ffff) | (parent_byte[key >> 16] << 16);
+	return g & ~(g << 6) & GROUP_MSB;
+}
 
-	if (key > 0x000000ff)
-		return (key & 0x000000ff) | (parent_byte[key >> 8] << 8);
+/*
+ *	Top bit set, and bit 0 clear.
+ */
+static inline group_mask_t group_match_free(uint8_t const *ctrl)
+{
+	uint64_t g = group_load(ctrl);
 
-	return parent_byte[key];
+	return g & ~(g << 7) & GROUP_MSB;
 }
 
+#  define MASK_LOWEST(_m)	((uint32_t) (__builtin_ctzll(_m) >> 3))
+#  define MASK_HIGHEST(_m)	((uint32_t) ((63 - __builtin_clzll(_m)) >> 3))
+#endif
 
-static fr_hash_entry_t *list_find(fr_hash_table_t *ht,
-				    fr_hash_entry_t *head,
-				    uint32_t reversed,
-				    void const *data)
-{
-	fr_hash_entry_t *cur;
+#define MASK_NEXT(_m)	((_m) & ((_m) - 1))
 
-	for (cur = head; cur != &ht->null; cur = cur->next) {
-		if (cur->reversed == reversed) {
-			if (ht->cmp) {
-				int cmp = ht->cmp(data, cur->data);
-				if (cmp > 0) break;
-				if (cmp < 0) continue;
-			}
-			return cur;
-		}
-		if (cur->reversed > reversed) break;
-	}
+/*
+ *	The user's hash function may be weak in the low bits, which
+ *	we use for the position.  So mix it (murmur3 finalizer) first.
+ */
+static inline uint32_t hash_mix(uint32_t key)
+{
+	key ^= key >> 16;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35;
+	key ^= key >> 16;
 
-	return NULL;
+	return key;
 }
 
+#define H1(_mixed)	((_mixed) >> 7)
+#define H2(_mixed)	((uint8_t) ((_mixed) & 0x7f))
 
-/*
- *	Inserts a new entry into the list, in order.
+static inline void set_ctrl(fr_hash_table_t *ht, uint32_t i, uint8_t ctrl)
+{
+	ht->ctrl[i] = ctrl;
+	if (i < HASH_GROUP_WIDTH) ht->ctrl[ht->num_slots + i] = ctrl;
+}
+
+/** Find the slot holding an entry
+ *
+ * @param[in] ht	to search.
+ * @param[in] key	from the user's hash function.
+ * @param[in] data	to compare entries with.
+ * @param[out] insert	if not NULL, the first free slot in the probe
+ *			sequence, or UINT32_MAX if there wasn't one.
+ * @return
+ *	- index of the matching slot.
+ *	- UINT32_MAX if there's no matching entry.
  */
-static int list_insert(fr_hash_table_t *ht,
-		       fr_hash_entry_t **head, fr_hash_entry_t *node)
+static uint32_t hash_find_slot(fr_hash_table_t *ht, uint32_t key, void const *data, uint32_t *insert)
 {
-	fr_hash_entry_t **last, *cur;
+	uint32_t	mixed = hash_mix(key);
+	uint32_t	pos = H1(mixed) & ht->mask;
+	uint32_t	step = 0;
+	uint8_t		h2 = H2(mixed);
+
+	if (insert) *insert = UINT32_MAX;
+
+	/*
+	 *	Triangular probing over groups visits every group
+	 *	once, as the table size is a power of two.  There's
+	 *	always at least one empty slot, so the loop ends.
+	 */
+	for (;;) {
+		uint8_t const	*group = ht->ctrl + pos;
+		group_mask_t	m;
 
-	last = head;
+		for (m = group_match(group, h2); m; m = MASK_NEXT(m)) {
+			uint32_t	i = (pos + MASK_LOWEST(m)) & ht->mask;
+			fr_hash_slot_t	*slot = &ht->slots[i];
 
-	for (cur = *head; cur != &ht->null; cur = cur->next) {
-		if (cur->reversed > node->reversed) break;
-		last = &(cur->next);
+			if (slot->key != key) continue;
+			if (ht->cmp && (ht->cmp(data, slot->data) != 0)) continue;
 
-		if (cur->reversed == node->reversed) {
-			if (ht->cmp) {
-				int cmp = ht->cmp(node->data, cur->data);
-				if (cmp > 0) break;
-				if (cmp < 0) continue;
-			}
-			return 0;
+			return i;
 		}
-	}
 
-	node->next = *last;
-	*last = node;
+		if (insert && (*insert == UINT32_MAX)) {
+			m = group_match_free(group);
+			if (m) *insert = (pos + MASK_LOWEST(m)) & ht->mask;
+		}
 
-	return 1;
-}
+		if (group_match_empty(group)) return UINT32_MAX;
 
+		step += HASH_GROUP_WIDTH;
+		pos = (pos + step) & ht->mask;
+	}
+}
 
-/*
- *	Delete an entry from the list.
+/** Allocate empty slot and control arrays
+ *
  */
-static int list_delete(fr_hash_table_t *ht,
-		       fr_hash_entry_t **head, fr_hash_entry_t *node)
+static int hash_alloc_slots(fr_hash_table_t *ht, uint32_t num_slots)
 {
-	fr_hash_entry_t **last, *cur;
+	uint8_t		*ctrl;
+	fr_hash_slot_t	*slots;
 
-	last = head;
+	ctrl = talloc_array(ht, uint8_t, num_slots + HASH_GROUP_WIDTH);
+	if (!ctrl) return -1;
 
-	for (cur = *head; cur != &ht->null; cur = cur->next) {
-		if (cur == node) break;
-		last = &(cur->next);
+	slots = talloc_array(ht, fr_hash_slot_t, num_slots);
+	if (!slots) {
+		talloc_free(ctrl);
+		return -1;
 	}
+	memset(ctrl, CTRL_EMPTY, num_slots + HASH_GROUP_WIDTH);
 
-	*last = node->next;
-	return 1;
-}
+	ht->ctrl = ctrl;
+	ht->slots = slots;
+	ht->num_slots = num_slots;
+	ht->mask = num_slots - 1;
+	ht->next_grow = MAX_LOAD(num_slots);
+	ht->num_deleted = 0;
 
+	return 0;
+}
 
-static int _fr_hash_table_free(fr_hash_table_t *ht)
+/** Move all of the entries into new arrays, dropping the tombstones
+ *
+ * The table doubles in size, unless most of the load was tombstones.
+ */
+static int hash_rehash(fr_hash_table_t *ht)
 {
-	int i;
-	fr_hash_entry_t *node, *next;
+	uint8_t		*old_ctrl = ht->ctrl;
+	fr_hash_slot_t	*old_slots = ht->slots;
+	uint32_t	old_num = ht->num_slots;
+	uint32_t	num_slots = ht->num_slots;
+	uint32_t	i;
 
-	/*
-	 *	Walk over the buckets, freeing them all.
-	 */
-	for (i = 0; i < ht->num_buckets; i++) {
-		if (ht->buckets[i]) for (node = ht->buckets[i];
-					 node != &ht->null;
-					 node = next) {
-			next = node->next;
-			if (!node->data) continue; /* dummy entry */
-
-			talloc_free(node);
+	if (ht->num_elements >= (ht->next_grow >> 1)) num_slots <<= 1;
+
+	if (hash_alloc_slots(ht, num_slots) < 0) return -1;
+
+	for (i = 0; i < old_num; i++) {
+		uint32_t	mixed, pos, step = 0;
+		group_mask_t	m;
+
+		if (!IS_FULL(old_ctrl[i])) continue;
+
+		/*
+		 *	There are no tombstones, and no duplicates, so
+		 *	the first empty slot is where it goes.
+		 */
+		mixed = hash_mix(old_slots[i].key);
+		pos = H1(mixed) & ht->mask;
+		while (!(m = group_match_empty(ht->ctrl + pos))) {
+			step += HASH_GROUP_WIDTH;
+			pos = (pos + step) & ht->mask;
 		}
+		pos = (pos + MASK_LOWEST(m)) & ht->mask;
+
+		set_ctrl(ht, pos, H2(mixed));
+		ht->slots[pos] = old_slots[i];
 	}
-	talloc_free(ht->buckets);
+
+	talloc_free(old_ctrl);
+	talloc_free(old_slots);
 
 	return 0;
 }
@@ -281,7 +330,8 @@ static int _fr_hash_table_free(fr_hash_table_t *ht)
 /*
  *	Create the table.
  *
- *	Memory usage in bytes is (20/3) * number of entries.
+ *	Memory usage in bytes is about 19 * number of entries on
+ *	64-bit systems.
  */
 fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
 				      fr_hash_table_hash_t hashNode,
@@ -294,255 +344,128 @@ fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
 
 	ht = talloc_zero(NULL, fr_hash_table_t);
 	if (!ht) return NULL;
-	talloc_set_destructor(ht, _fr_hash_table_free);
 	talloc_link_ctx(ctx, ht);
 
 	ht->free = freeNode;
 	ht->hash = hashNode;
 	ht->cmp = cmpNode;
-	ht->num_buckets = FR_HASH_NUM_BUCKETS;
-	ht->mask = ht->num_buckets - 1;
 
-	/*
-	 *	Have a default load factor of 2.5.  In practice this
-	 *	means that the average load will hit 3 before the
-	 *	table grows.
-	 */
-	ht->next_grow = (ht->num_buckets << 1) + (ht->num_buckets >> 1);
-
-	ht->buckets = talloc_zero_array(NULL, fr_hash_entry_t *, ht->num_buckets);
-	if (!ht->buckets) {
+	if (hash_alloc_slots(ht, FR_HASH_NUM_BUCKETS) < 0) {
 		talloc_free(ht);
 		return NULL;
 	}
 
-	ht->null.reversed = ~0;
-	ht->null.key = ~0;
-	ht->null.next = &ht->null;
-	ht->buckets[0] = &ht->null;
-
 	return ht;
 }
 
-
-/*
- *	If the current bucket is uninitialized, initialize it
- *	by recursively copying information from the parent.
- *
- *	We may have a situation where entry E is a parent to 2 other
- *	entries E' and E".  If we split E into E and E', then the
- *	nodes meant for E" end up in E or E', either of which is
- *	wrong.  To solve that problem, we walk down the whole chain,
- *	inserting the elements into the correct place.
- */
-static void fr_hash_table_fixup(fr_hash_table_t *ht, uint32_t entry)
-{
-	uint32_t parent_entry;
-	fr_hash_entry_t **last, *cur;
-	uint32_t this;
-
-	parent_entry = parent_of(entry);
-
-	/* parent_entry == entry if and only if entry == 0 */
-
-	if (!ht->buckets[parent_entry]) {
-		fr_hash_table_fixup(ht, parent_entry);
-	}
-
-	/*
-	 *	Keep walking down cur, trying to find entries that
-	 *	don't belong here any more.  There may be multiple
-	 *	ones, so we can't have a naive algorithm...
-	 */
-	last = &ht->buckets[parent_entry];
-	this = parent_entry;
-
-	for (cur = *last; cur != &ht->null; cur = cur->next) {
-		uint32_t real_entry;
-
-		real_entry = cur->key & ht->mask;
-		if (real_entry != this) { /* ht->buckets[real_entry] == NULL */
-			*last = &ht->null;
-			ht->buckets[real_entry] = cur;
-			this = real_entry;
-		}
-
-		last = &(cur->next);
-	}
-
-	/*
-	 *	We may NOT have initialized this bucket, so do it now.
-	 */
-	if (!ht->buckets[entry]) ht->buckets[entry] = &ht->null;
-}
-
-/*
- *	This should be a power of two.  Changing it to 4 doesn't seem
- *	to make any difference.
- */
-#define GROW_FACTOR (2)
-
-/*
- *	Grow the hash table.
- */
-static void fr_hash_table_grow(fr_hash_table_t *ht)
-{
-	fr_hash_entry_t **buckets;
-
-	buckets = talloc_zero_array(NULL, fr_hash_entry_t *, GROW_FACTOR * ht->num_buckets);
-	if (!buckets) return;
-
-	memcpy(buckets, ht->buckets, sizeof(*buckets) * ht->num_buckets);
-	talloc_free(ht->buckets); /* Free the old buckets */
-
-	ht->buckets = buckets;
-	ht->num_buckets *= GROW_FACTOR;
-	ht->next_grow *= GROW_FACTOR;
-	ht->mask = ht->num_buckets - 1;
-#ifdef TESTING
-	grow = 1;
-	fprintf(stderr, "GROW TO %d\n", ht->num_buckets);
-#endif
-}
-
-
 /*
  *	Insert data.
  */
 int fr_hash_table_insert(fr_hash_table_t *ht, void const *data)
 {
 	uint32_t key;
-	uint32_t entry;
-	uint32_t reversed;
-	fr_hash_entry_t *node;
+	uint32_t insert;
 
 	if (!ht || !data) return 0;
 
 	key = ht->hash(data);
-	entry = key & ht->mask;
-	reversed = reverse(key);
 
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
+	/* already in the table, can't insert it */
+	if (hash_find_slot(ht, key, data, &insert) != UINT32_MAX) return 0;
 
 	/*
-	 *	If we try to do our own memory allocation here, the
-	 *	speedup is only ~15% or so, which isn't worth it.
+	 *	Check the load factor, and rehash the table if
+	 *	necessary.  During a walk we put off rehashing, as it
+	 *	moves the entries, until the table is almost full.
 	 */
-	node = talloc_zero(NULL, fr_hash_entry_t);
-	if (!node) return 0;
+	if ((ht->num_elements + ht->num_deleted) >= ht->next_grow) {
+		if (!ht->walking || ((ht->num_elements + ht->num_deleted) >= (ht->num_slots - 2))) {
+			if (hash_rehash(ht) < 0) return 0;
 
-	node->next = &ht->null;
-	node->reversed = reversed;
-	node->key = key;
-	memcpy(&node->data, &data, sizeof(node->data));
-
-	/* already in the table, can't insert it */
-	if (!list_insert(ht, &ht->buckets[entry], node)) {
-		talloc_free(node);
-		return 0;
+			(void) hash_find_slot(ht, key, data, &insert);
+		}
 	}
 
-	/*
-	 *	Check the load factor, and grow the table if
-	 *	necessary.
-	 */
+	if (ht->ctrl[insert] == CTRL_DELETED) ht->num_deleted--;
+
+	set_ctrl(ht, insert, H2(hash_mix(key)));
+	ht->slots[insert].key = key;
+	memcpy(&ht->slots[insert].data, &data, sizeof(ht->slots[insert].data));
 	ht->num_elements++;
-	if (ht->num_elements >= ht->next_grow) fr_hash_table_grow(ht);
 
 	return 1;
 }
 
-
-/*
- *	Internal find a node routine.
- */
-static fr_hash_entry_t *fr_hash_table_find(fr_hash_table_t *ht, void const *data)
-{
-	uint32_t key;
-	uint32_t entry;
-	uint32_t reversed;
-
-	if (!ht) return NULL;
-
-	key = ht->hash(data);
-	entry = key & ht->mask;
-	reversed = reverse(key);
-
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
-
-	return list_find(ht, ht->buckets[entry], reversed, data);
-}
-
-
 /*
  *	Replace old data with new data, OR insert if there is no old.
  */
 int fr_hash_table_replace(fr_hash_table_t *ht, void const *data)
 {
-	fr_hash_entry_t *node;
+	uint32_t i;
 
 	if (!ht || !data) return 0;
 
-	node = fr_hash_table_find(ht, data);
-	if (!node) return fr_hash_table_insert(ht, data);
+	i = hash_find_slot(ht, ht->hash(data), data, NULL);
+	if (i == UINT32_MAX) return fr_hash_table_insert(ht, data);
 
-	if (ht->free) ht->free(node->data);
+	if (ht->free) ht->free(ht->slots[i].data);
 
-	memcpy(&node->data, &data, sizeof(node->data));
+	memcpy(&ht->slots[i].data, &data, sizeof(ht->slots[i].data));
 
 	return 1;
 }
 
-
 /*
  *	Find data from a template
  */
 void *fr_hash_table_finddata(fr_hash_table_t *ht, void const *data)
 {
-	fr_hash_entry_t *node;
-	void *out;
+	uint32_t i;
 
-	node = fr_hash_table_find(ht, data);
-	if (!node) return NULL;
+	if (!ht) return NULL;
 
-	memcpy(&out, &node->data, sizeof(out));
+	i = hash_find_slot(ht, ht->hash(data), data, NULL);
+	if (i == UINT32_MAX) return NULL;
 
-	return out;
+	return ht->slots[i].data;
 }
 
-
-
 /*
  *	Yank an entry from the hash table, without freeing the data.
  */
 void *fr_hash_table_yank(fr_hash_table_t *ht, void const *data)
 {
-	uint32_t key;
-	uint32_t entry;
-	uint32_t reversed;
-	void *old;
-	fr_hash_entry_t *node;
+	uint32_t	i;
+	group_mask_t	before, after;
+	void		*old;
 
 	if (!ht) return NULL;
 
-	key = ht->hash(data);
-	entry = key & ht->mask;
-	reversed = reverse(key);
-
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
+	i = hash_find_slot(ht, ht->hash(data), data, NULL);
+	if (i == UINT32_MAX) return NULL;
 
-	node = list_find(ht, ht->buckets[entry], reversed, data);
-	if (!node) return NULL;
-
-	list_delete(ht, &ht->buckets[entry], node);
+	old = ht->slots[i].data;
 	ht->num_elements--;
 
-	old = node->data;
-	talloc_free(node);
+	/*
+	 *	If every group which includes this slot has an empty
+	 *	slot, then no probe ever continued past it, and it
+	 *	can be marked empty.  Otherwise we need a tombstone.
+	 */
+	before = group_match_empty(ht->ctrl + ((i - HASH_GROUP_WIDTH) & ht->mask));
+	after = group_match_empty(ht->ctrl + i);
+
+	if (before && after &&
+	    (((HASH_GROUP_WIDTH - 1 - MASK_HIGHEST(before)) + MASK_LOWEST(after)) < HASH_GROUP_WIDTH)) {
+		set_ctrl(ht, i, CTRL_EMPTY);
+	} else {
+		set_ctrl(ht, i, CTRL_DELETED);
+		ht->num_deleted++;
+	}
+
 	return old;
 }
 
-
 /*
  *	Delete a piece of data from the hash table.
  */
@@ -558,40 +481,27 @@ int fr_hash_table_delete(fr_hash_table_t *ht, void const *data)
 	return 1;
 }
 
-
 /*
  *	Free a hash table
  */
 void fr_hash_table_free(fr_hash_table_t *ht)
 {
-	int i;
-	fr_hash_entry_t *node, *next;
+	uint32_t i;
 
 	if (!ht) return;
 
-	/*
-	 *	Walk over the buckets, freeing them all.
-	 */
 	if (ht->free) {
-		for (i = 0; i < ht->num_buckets; i++) {
-			if (ht->buckets[i]) for (node = ht->buckets[i];
-						 node != &ht->null;
-						 node = next) {
-				next = node->next;
-				if (!node->data) continue; /* dummy entry */
-
-				ht->free(node->data);
-			}
+		for (i = 0; i < ht->num_slots; i++) {
+			if (IS_FULL(ht->ctrl[i])) ht->free(ht->slots[i].data);
 		}
 	}
 
 	/*
-	 *	Also frees nodes and buckets
+	 *	Also frees the slots
 	 */
 	talloc_free(ht);
 }
 
-
 /*
  *	Count number of elements
  */
@@ -602,36 +512,33 @@ int fr_hash_table_num_elements(fr_hash_table_t *ht)
 	return ht->num_elements;
 }
 
-
 /*
  *	Walk over the nodes, allowing deletes & inserts to happen.
+ *
+ *	Entries inserted during the walk may or may not be seen by
+ *	the callback.
  */
 int fr_hash_table_walk(fr_hash_table_t *ht,
 		       fr_hash_table_walk_t callback,
 		       void *context)
 {
-	int i, rcode;
+	uint32_t	i;
+	int		rcode = 0;
 
 	if (!ht || !callback) return 0;
 
-	for (i = ht->num_buckets - 1; i >= 0; i--) {
-		fr_hash_entry_t *node, *next;
-
-		/*
-		 *	Ensure that the current bucket is filled.
-		 */
-		if (!ht->buckets[i]) fr_hash_table_fixup(ht, i);
-
-		for (node = ht->buckets[i]; node != &ht->null; node = next) {
-			next = node->next;
+	ht->walking++;
 
-			rcode = callback(context, node->data);
+	for (i = 0; i < ht->num_slots; i++) {
+		if (!IS_FULL(ht->ctrl[i])) continue;
 
-			if (rcode != 0) return rcode;
-		}
+		rcode = callback(context, ht->slots[i].data);
+		if (rcode != 0) break;
 	}
 
-	return 0;
+	ht->walking--;
+
+	return rcode;
 }
 
 /** Iterate over entries in a hash table
@@ -647,33 +554,12 @@ int fr_hash_table_walk(fr_hash_table_t *ht,
  */
 void *fr_hash_table_iter_next(fr_hash_table_t *ht, fr_hash_iter_t *iter)
 {
-	fr_hash_entry_t *node;
-
 	if (unlikely(!ht)) return NULL;
 
-	/*
-	 *	Return the next element in the bucket
-	 */
-	if (iter->node != &ht->null) {
-		node = iter->node;
-		iter->node = node->next;
+	while (iter->slot < ht->num_slots) {
+		uint32_t i = iter->slot++;
 
-		return node->data;
-	}
-
-	/*
-	 *	We might have to go through multiple empty
-	 *	buckets to find one that contains something
-	 *	we should return
-	 */
-	while ((--iter->bucket) >= 0) {
-		if (!ht->buckets[iter->bucket]) fr_hash_table_fixup(ht, iter->bucket);
-
-		node = ht->buckets[iter->bucket];
-		if (node == &ht->null) continue;	/* This bucket was empty too... */
-
-		iter->node = node->next;		/* Store the next one to examine */
-		return node->data;
+		if (IS_FULL(ht->ctrl[i])) return ht->slots[i].data;
 	}
 
 	return NULL;
@@ -681,16 +567,14 @@ void *fr_hash_table_iter_next(fr_hash_table_t *ht, fr_hash_iter_t *iter)
 
 /** Ensure all buckets are filled
  *
- * This must be called if the table will be read by multiple threads without
- * synchronisation.  Synchronisation is still required for updates.
+ * Lookups never modify the table, so it can already be read by
+ * multiple threads without synchronisation.  Synchronisation is still
+ * required for updates.  This function is kept for compatibility.
  *
  * @param[in] ht	to fill.
  */
-void fr_hash_table_fill(fr_hash_table_t *ht)
+void fr_hash_table_fill(UNUSED fr_hash_table_t *ht)
 {
-	int i;
-
-	for (i = ht->num_buckets - 1; i >= 0; i--) if (!ht->buckets[i]) fr_hash_table_fixup(ht, i);
 }
 
 /** Initialise an iterator
@@ -707,8 +591,7 @@ void *fr_hash_table_iter_init(fr_hash_table_t *ht, fr_hash_iter_t *iter)
 {
 	if (unlikely(!ht)) return NULL;
 
-	iter->bucket = ht->num_buckets;
-	iter->node = &ht->null;
+	iter->slot = 0;
 
 	return fr_hash_table_iter_next(ht, iter);
 }
@@ -719,69 +602,40 @@ void *fr_hash_table_iter_init(fr_hash_table_t *ht, fr_hash_iter_t *iter)
  */
 int fr_hash_table_info(fr_hash_table_t *ht)
 {
-	int i, a, collisions, uninitialized;
-	int array[256];
+	uint32_t	i;
+	uint64_t	probes = 0;
+	uint32_t	max_probes = 0;
 
 	if (!ht) return 0;
 
-	uninitialized = collisions = 0;
-	memset(array, 0, sizeof(array));
+	/*
+	 *	Count how many groups a successful lookup of each
+	 *	entry has to look at.
+	 */
+	for (i = 0; i < ht->num_slots; i++) {
+		uint32_t	mixed, pos, step = 0, groups = 1;
 
-	for (i = 0; i < ht->num_buckets; i++) {
-		uint32_t key;
-		int load;
-		fr_hash_entry_t *node, *next;
+		if (!IS_FULL(ht->ctrl[i])) continue;
 
-		/*
-		 *	If we haven't inserted or looked up an entry
-		 *	in a bucket, it's uninitialized.
-		 */
-		if (!ht->buckets[i]) {
-			uninitialized++;
-			continue;
+		mixed = hash_mix(ht->slots[i].key);
+		pos = H1(mixed) & ht->mask;
+		while (((i - pos) & ht->mask) >= HASH_GROUP_WIDTH) {
+			step += HASH_GROUP_WIDTH;
+			pos = (pos + step) & ht->mask;
+			groups++;
 		}
 
-		load = 0;
-		key = ~0;
-		for (node = ht->buckets[i]; node != &ht->null; node = next) {
-			if (node->reversed == key) {
-				collisions++;
-			} else {
-				key = node->reversed;
-			}
-			next = node->next;
-			load++;
-		}
-
-		if (load > 255) load = 255;
-		array[load]++;
+		probes += groups;
+		if (groups > max_probes) max_probes = groups;
 	}
 
-	printf("HASH TABLE %p\tbuckets: %d\t(%d uninitialized)\n", ht,
-		ht->num_buckets, uninitialized);
-	printf("\tnum entries %d\thash collisions %d\n",
-		ht->num_elements, collisions);
-
-	a = 0;
-	for (i = 1; i < 256; i++) {
-		if (!array[i]) continue;
-		printf("%d\t%d\n", i, array[i]);
-
-		/*
-		 *	Since the entries are ordered, the lookup cost
-		 *	for any one element in a chain is (on average)
-		 *	the cost of walking half of the chain.
-		 */
-		if (i > 1) {
-			a += array[i] * i;
-		}
+	printf("HASH TABLE %p\tslots: %u\tgroup width %d\n", ht, ht->num_slots, HASH_GROUP_WIDTH);
+	printf("\tnum entries %u\ttombstones %u\tload %.2f\n",
+	       ht->num_elements, ht->num_deleted, (double) ht->num_elements / ht->num_slots);
+	if (ht->num_elements) {
+		printf("\tgroups per lookup %.3f average, %u max\n\n",
+		       (double) probes / ht->num_elements, max_probes);
 	}
-	a /= 2;
-	a += array[1];
-
-	printf("\texpected lookup cost = %d/%d or %f\n\n",
-	       ht->num_elements, a,
-	       (float) ht->num_elements / (float) a);
 
 	return 0;
 }
@@ -877,82 +731,167 @@ uint32_t fr_hash_case_string(char const *p)
 	return hash;
 }
 
+
 #ifdef TESTING
 /*
- *  cc -g -DTESTING -I ../include hash.c -o hash
+ *  cc -g -O2 -DTESTING -I ../include hash.c -o hash -ltalloc
+ *
+ *  ./hash [<max>]
  *
- *  ./hash
+ *  Benchmarks the common operations on tables of increasing size,
+ *  and checks the results as it goes.  Times are per operation.
  */
+#include <time.h>
+
 static uint32_t hash_int(void const *data)
 {
-	return fr_hash((int *) data, sizeof(int));
+	return fr_hash((int const *) data, sizeof(int));
 }
 
-#define MAX 1024*1024
-int main(int argc, char **argv)
+static int cmp_int(void const *one, void const *two)
+{
+	int a = *(int const *) one;
+	int b = *(int const *) two;
+
+	return (a > b) - (a < b);
+}
+
+static int walk_count(void *ctx, UNUSED void *data)
 {
-	int i, *p, *q, k;
+	(*(int *) ctx)++;
+	return 0;
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+#define BENCH_START(_name) do { \
+	char const *_bench_name = _name; \
+	uint64_t _bench_start = bench_now()
+
+#define BENCH_END(_ops) \
+	printf("\t%-24s %8.1f ns/op\n", _bench_name, (double) (bench_now() - _bench_start) / (_ops)); \
+	} while (0)
+
+#define CHECK(_cond, _fmt, ...) do { \
+	if (!(_cond)) { \
+		fprintf(stderr, "FAILED: " _fmt "\n", ## __VA_ARGS__); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+static void bench(int num)
+{
+	int		i, count, *q;
+	int		*array, *order;
 	fr_hash_table_t *ht;
-	int *array;
+	fr_hash_iter_t	iter;
+
+	printf("%d entries\n", num);
 
-	ht = fr_hash_table_create(NULL, hash_int, NULL, NULL);
-	if (!ht) {
-		fprintf(stderr, "Hash create failed\n");
-		fr_exit(1);
+	ht = fr_hash_table_create(NULL, hash_int, cmp_int, NULL);
+	CHECK(ht, "Hash create failed");
+
+	/*
+	 *	Keys are 0..num-1, and num..2*num-1 are never inserted,
+	 *	for failed lookups.  Lookups are done in a random order,
+	 *	so that they aren't helped by the cache.
+	 */
+	array = talloc_array(NULL, int, num * 2);
+	order = talloc_array(NULL, int, num);
+	CHECK(array && order, "Out of memory");
+
+	for (i = 0; i < (num * 2); i++) array[i] = i;
+	for (i = 0; i < num; i++) order[i] = i;
+	for (i = num - 1; i > 0; i--) {
+		int j = random() % (i + 1);
+		int tmp = order[i];
+
+		order[i] = order[j];
+		order[j] = tmp;
 	}
 
-	array = talloc_zero_array(NULL, int, MAX);
-	if (!array) fr_exit(1);
+	BENCH_START("insert");
+	for (i = 0; i < num; i++) CHECK(fr_hash_table_insert(ht, &array[i]), "Failed insert %d", i);
+	BENCH_END(num);
 
-	for (i = 0; i < MAX; i++) {
-		p = array + i;
-		*p = i;
+	BENCH_START("insert (duplicate)");
+	for (i = 0; i < num; i++) CHECK(!fr_hash_table_insert(ht, &array[order[i]]), "Duplicate insert %d", i);
+	BENCH_END(num);
 
-		if (!fr_hash_table_insert(ht, p)) {
-			fprintf(stderr, "Failed insert %08x\n", i);
-			fr_exit(1);
-		}
-#ifdef TEST_INSERT
-		q = fr_hash_table_finddata(ht, p);
-		if (q != p) {
-			fprintf(stderr, "Bad data %d\n", i);
-			fr_exit(1);
-		}
-#endif
+	BENCH_START("find (hit)");
+	for (i = 0; i < num; i++) {
+		q = fr_hash_table_finddata(ht, &array[order[i]]);
+		CHECK(q && (*q == order[i]), "Failed finding %d", order[i]);
 	}
+	BENCH_END(num);
+
+	BENCH_START("find (miss)");
+	for (i = 0; i < num; i++) {
+		q = fr_hash_table_finddata(ht, &array[num + order[i]]);
+		CHECK(!q, "Found %d, which was never inserted", num + order[i]);
+	}
+	BENCH_END(num);
+
+	BENCH_START("walk");
+	count = 0;
+	fr_hash_table_walk(ht, walk_count, &count);
+	BENCH_END(num);
+	CHECK(count == num, "Walk saw %d entries, expected %d", count, num);
+
+	BENCH_START("iterate");
+	count = 0;
+	for (q = fr_hash_table_iter_init(ht, &iter); q; q = fr_hash_table_iter_next(ht, &iter)) count++;
+	BENCH_END(num);
+	CHECK(count == num, "Iterator saw %d entries, expected %d", count, num);
 
 	fr_hash_table_info(ht);
 
 	/*
-	 *	Build this to see how lookups result in shortening
-	 *	of the hash chains.
+	 *	Delete and re-insert, which leaves tombstones behind.
 	 */
-	if (1) {
-		for (i = 0; i < MAX ; i++) {
-			q = fr_hash_table_finddata(ht, &i);
-			if (!q || *q != i) {
-				fprintf(stderr, "Failed finding %d\n", i);
-				fr_exit(1);
-			}
+	BENCH_START("delete + insert (churn)");
+	for (i = 0; i < num; i++) {
+		CHECK(fr_hash_table_delete(ht, &array[order[i]]), "Failed deleting %d", order[i]);
+		CHECK(fr_hash_table_insert(ht, &array[num + order[i]]), "Failed inserting %d", num + order[i]);
+	}
+	BENCH_END(num);
+	CHECK(fr_hash_table_num_elements(ht) == num, "Have %d entries, expected %d",
+	      fr_hash_table_num_elements(ht), num);
+
+	BENCH_START("find (after churn)");
+	for (i = 0; i < num; i++) {
+		q = fr_hash_table_finddata(ht, &array[num + order[i]]);
+		CHECK(q && (*q == num + order[i]), "Failed finding %d", num + order[i]);
+		CHECK(!fr_hash_table_finddata(ht, &array[order[i]]), "Found deleted %d", order[i]);
+	}
+	BENCH_END(num);
 
-#if 0
-			if (!fr_hash_table_delete(ht, &i)) {
-				fprintf(stderr, "Failed deleting %d\n", i);
-				fr_exit(1);
-			}
-			q = fr_hash_table_finddata(ht, &i);
-			if (q) {
-				fprintf(stderr, "Failed to delete %08x\n", i);
-				fr_exit(1);
-			}
-#endif
-		}
+	fr_hash_table_info(ht);
 
-		fr_hash_table_info(ht);
-	}
+	BENCH_START("delete");
+	for (i = 0; i < num; i++) CHECK(fr_hash_table_yank(ht, &array[num + order[i]]), "Failed deleting %d", i);
+	BENCH_END(num);
+	CHECK(fr_hash_table_num_elements(ht) == 0, "Table isn't empty");
 
 	fr_hash_table_free(ht);
 	talloc_free(array);
+	talloc_free(order);
+}
+
+int main(int argc, char **argv)
+{
+	int num, max = 1024 * 1024;
+
+	if (argc > 1) max = atoi(argv[1]);
+
+	for (num = 1024; num <= max; num *= 8) bench(num);
 
 	return EXIT_SUCCESS;
 }
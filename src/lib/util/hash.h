@@ -34,14 +34,11 @@ extern "C" {
 #include <stdint.h>
 #include <talloc.h>
 
-typedef struct fr_hash_entry_s fr_hash_entry_t;
-
 /** Stores the state of the current iteration operation
  *
  */
 typedef struct {
-	int			bucket;
-	fr_hash_entry_t		*node;
+	uint32_t		slot;
 } fr_hash_iter_t;
 
 /*
@@ -14,7 +14,7 @@
  *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 
-/** Functions for a basic binary heaps
+/** Functions for d-ary heaps
  *
  * @file src/lib/util/heap.c
  *
@@ -41,6 +41,7 @@ struct fr_heap_s {
 	size_t		offset;			//!< Offset of heap index in element structure.
 
 	int32_t		num_elements;		//!< Number of nodes used.
+	uint8_t		shift;			//!< log2 of the number of children per node.
 
 	char const	*type;			//!< Type of elements.
 	fr_heap_cmp_t	cmp;			//!< Comparator function.
@@ -49,23 +50,41 @@ struct fr_heap_s {
 };
 
 /*
- *	First node in a heap is element 0. Children of i are 2i+1 and
- *	2i+2.  These macros wrap the logic, so the code is more
- *	descriptive.
+ *	First node in a heap is element 0. With d = 2^shift children
+ *	per node, the children of i are d*i+1 to d*i+d.  These macros
+ *	wrap the logic, so the code is more descriptive.
  */
-#define HEAP_PARENT(_x)	(((_x) - 1 ) / 2)
-#define HEAP_LEFT(_x)	(2 * (_x) + 1)
-/* #define HEAP_RIGHT(_x) (2 * (_x) + 2 ) */
+#define HEAP_PARENT(_hp, _x)	(((_x) - 1) >> (_hp)->shift)
+#define HEAP_CHILD(_hp, _x)	(((_x) << (_hp)->shift) + 1)
+#define HEAP_ARITY(_hp)		(1 << (_hp)->shift)
 #define	HEAP_SWAP(_a, _b) { void *_tmp = _a; _a = _b; _b = _tmp; }
 
 static void fr_heap_bubble(fr_heap_t *hp, int32_t child);
 
-fr_heap_t *_fr_heap_alloc(TALLOC_CTX *ctx, fr_heap_cmp_t cmp, char const *type, size_t offset)
+/** Create a new heap
+ *
+ * @param[in] ctx	to allocate the heap in.
+ * @param[in] cmp	Comparator used to order elements.
+ * @param[in] type	Talloc type of elements, or NULL.
+ * @param[in] offset	of the heap index in each element.
+ * @param[in] arity	Children per node.  Must be a power of 2, between 2 and 16.
+ * @return
+ *	- A new heap.
+ *	- NULL on error.
+ */
+fr_heap_t *_fr_heap_alloc(TALLOC_CTX *ctx, fr_heap_cmp_t cmp, char const *type, size_t offset, unsigned int arity)
 {
-	fr_heap_t *fh;
+	fr_heap_t	*fh;
+	uint8_t		shift;
 
 	if (!cmp) return NULL;
 
+	if ((arity < 2) || (arity > 16) || (arity & (arity - 1))) {
+		fr_strerror_printf("Heap arity must be a power of 2, between 2 and 16, not %u", arity);
+		return NULL;
+	}
+	for (shift = 0; (1U << shift) < arity; shift++);
+
 	fh = talloc_zero(ctx, fr_heap_t);
 	if (!fh) return NULL;
 
@@ -79,6 +98,7 @@ fr_heap_t *_fr_heap_alloc(TALLOC_CTX *ctx, fr_heap_cmp_t cmp, char const *type,
 	fh->type = type;
 	fh->cmp = cmp;
 	fh->offset = offset;
+	fh->shift = shift;
 
 	return fh;
 }
@@ -96,26 +116,51 @@ static inline CC_HINT(always_inline) CC_HINT(nonnull) void index_set(fr_heap_t *
 #define OFFSET_SET(_heap, _idx) index_set(_heap, _heap->p[_idx], _idx);
 #define OFFSET_RESET(_heap, _idx) index_set(_heap, _heap->p[_idx], -1);
 
-/** Insert a new element into the heap
- *
- * Insert element in heap. Normally, p != NULL, we insert p in a
- * new position and bubble up. If p == NULL, then the element is
- * already in place, and key is the position where to start the
- * bubble-up.
+/** Make sure the heap has room for needed elements
  *
- * Returns -1 on failure (cannot allocate new heap entry)
- *
- * If offset > 0 the position (index, int) of the element in the
- * heap is also stored in the element itself at the given offset
- * in bytes.
- *
- * @param[in] hp	The heap to insert an element into.
- * @param[in] data	Data to insert into the heap.
+ * @param[in] hp	to grow.
+ * @param[in] needed	Total number of elements the heap must hold.
  * @return
  *	- 0 on success.
  *	- -1 on failure (heap full or malloc error).
  */
-int fr_heap_insert(fr_heap_t *hp, void *data)
+static int fr_heap_reserve(fr_heap_t *hp, size_t needed)
+{
+	void	**n;
+	size_t	n_size = hp->size;
+
+	if (needed <= hp->size) return 0;
+
+	/*
+	 *	heap_id is a 32-bit signed integer.  If the heap will
+	 *	grow to contain more than 2B elements, disallow
+	 *	integer overflow.  Tho TBH, that should really never
+	 *	happen.
+	 */
+	if (needed > INT32_MAX) {
+		fr_strerror_printf("Heap is full");
+		return -1;
+	}
+
+	while (n_size < needed) n_size *= 2;
+	if (n_size > INT32_MAX) n_size = INT32_MAX;
+
+	n = talloc_realloc(hp, hp->p, void *, n_size);
+	if (!n) {
+		fr_strerror_printf("Failed expanding heap to %zu elements (%zu bytes)",
+				   n_size, (n_size * sizeof(void *)));
+		return -1;
+	}
+	hp->size = n_size;
+	hp->p = n;
+
+	return 0;
+}
+
+/** Check an element can be inserted into the heap
+ *
+ */
+static inline CC_HINT(always_inline) int fr_heap_insert_check(fr_heap_t *hp, void *data)
 {
 	int32_t child;
 
@@ -133,48 +178,122 @@ int fr_heap_insert(fr_heap_t *hp, void *data)
 		return -1;
 	}
 
-	child = hp->num_elements;
-
 #ifndef TALLOC_GET_TYPE_ABORT_NOOP
 	if (hp->type) (void)_talloc_get_type_abort(data, hp->type, __location__);
 #endif
 
+	return 0;
+}
+
+/** Insert a new element into the heap
+ *
+ * Insert element in heap. Normally, p != NULL, we insert p in a
+ * new position and bubble up. If p == NULL, then the element is
+ * already in place, and key is the position where to start the
+ * bubble-up.
+ *
+ * Returns -1 on failure (cannot allocate new heap entry)
+ *
+ * If offset > 0 the position (index, int) of the element in the
+ * heap is also stored in the element itself at the given offset
+ * in bytes.
+ *
+ * @param[in] hp	The heap to insert an element into.
+ * @param[in] data	Data to insert into the heap.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure (heap full or malloc error).
+ */
+int fr_heap_insert(fr_heap_t *hp, void *data)
+{
+	int32_t child;
+
+	if (fr_heap_insert_check(hp, data) < 0) return -1;
+
+	child = hp->num_elements;
+
 	/*
 	 *	Heap is full.  Double it's size.
 	 */
-	if ((size_t)child == hp->size) {
-		void	**n;
-		size_t	n_size = hp->size * 2;
+	if (((size_t)child == hp->size) && (fr_heap_reserve(hp, (size_t)child + 1) < 0)) return -1;
 
-		/*
-		 *	heap_id is a 32-bit signed integer.  If the heap will
-		 *	grow to contain more than 2B elements, disallow
-		 *	integer overflow.  Tho TBH, that should really never
-		 *	happen.
-		 */
-		if (n_size > INT32_MAX) {
-			if (hp->size == INT32_MAX) {
-				fr_strerror_printf("Heap is full");
-				return -1;
-			} else {
-				n_size = INT32_MAX;
-			}
-		}
+	hp->p[child] = data;
+	hp->num_elements++;
 
-		n = talloc_realloc(hp, hp->p, void *, n_size);
-		if (!n) {
-			fr_strerror_printf("Failed expanding heap to %zu elements (%zu bytes)",
-					   n_size, (n_size * sizeof(void *)));
-			return -1;
+ 	fr_heap_bubble(hp, child);
+
+	return 0;
+}
+
+/** Move an element down the heap until it's smaller than all its children
+ *
+ */
+static void fr_heap_sift_down(fr_heap_t *hp, int32_t parent)
+{
+	void	*data = hp->p[parent];
+	int32_t	max = hp->num_elements - 1;
+	int32_t	child, last, i;
+
+	while ((child = HEAP_CHILD(hp, parent)) <= max) {
+		last = child + HEAP_ARITY(hp) - 1;
+		if (last > max) last = max;
+
+		for (i = child + 1; i <= last; i++) if (hp->cmp(hp->p[i], hp->p[child]) < 0) child = i;
+
+		if (hp->cmp(hp->p[child], data) >= 0) break;
+
+		hp->p[parent] = hp->p[child];
+		OFFSET_SET(hp, parent);
+		parent = child;
+	}
+
+	hp->p[parent] = data;
+	OFFSET_SET(hp, parent);
+}
+
+/** Insert multiple elements into the heap
+ *
+ * The heap array grows at most once.  If the batch is at least as
+ * large as the heap, the heap is rebuilt bottom up, which is O(n)
+ * instead of O(n log n).
+ *
+ * Either all of the elements are inserted, or none of them are.
+ *
+ * @param[in] hp	The heap to insert elements into.
+ * @param[in] data	Array of elements to insert.
+ * @param[in] num	Number of elements in data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure (element already in a heap, heap full or malloc error).
+ */
+int fr_heap_insert_n(fr_heap_t *hp, void *data[], uint32_t num)
+{
+	int32_t		start = hp->num_elements;
+	uint32_t	i;
+
+	if (num == 0) return 0;
+
+	for (i = 0; i < num; i++) if (fr_heap_insert_check(hp, data[i]) < 0) return -1;
+
+	if (fr_heap_reserve(hp, (size_t)start + num) < 0) return -1;
+
+	if ((int32_t)num < start) {
+		for (i = 0; i < num; i++) {
+			hp->p[hp->num_elements] = data[i];
+			fr_heap_bubble(hp, hp->num_elements++);
 		}
-		hp->size = n_size;
-		hp->p = n;
+		return 0;
 	}
 
-	hp->p[child] = data;
-	hp->num_elements++;
+	memcpy(&hp->p[start], data, num * sizeof(hp->p[0]));
+	hp->num_elements += num;
 
- 	fr_heap_bubble(hp, child);
+	/*
+	 *	Leaves are never moved by the sift, so
+	 *	their indexes need setting here.
+	 */
+	for (i = HEAP_PARENT(hp, hp->num_elements - 1) + 1; i < (uint32_t)hp->num_elements; i++) OFFSET_SET(hp, i);
+	for (i = HEAP_PARENT(hp, hp->num_elements - 1) + 1; i-- > 0; ) fr_heap_sift_down(hp, i);
 
 	return 0;
 }
@@ -185,7 +304,7 @@ static void fr_heap_bubble(fr_heap_t *hp, int32_t child)
 	 *	Bubble up the element.
 	 */
 	while (child > 0) {
-		int32_t parent = HEAP_PARENT(child);
+		int32_t parent = HEAP_PARENT(hp, child);
 
 		/*
 		 *	Parent is smaller than the child.  We're done.
@@ -244,19 +363,21 @@ int fr_heap_extract(fr_heap_t *hp, void *data)
 	max = hp->num_elements - 1;
 
 	OFFSET_RESET(hp, parent);
-	child = HEAP_LEFT(parent);
+	child = HEAP_CHILD(hp, parent);
 	while (child <= max) {
+		int32_t i, last;
+
 		/*
-		 *	Maybe take the right child.
+		 *	Take the smallest child.
 		 */
-		if ((child != max) &&
-		    (hp->cmp(hp->p[child + 1], hp->p[child]) < 0)) {
-			child = child + 1;
-		}
+		last = child + HEAP_ARITY(hp) - 1;
+		if (last > max) last = max;
+		for (i = child + 1; i <= last; i++) if (hp->cmp(hp->p[i], hp->p[child]) < 0) child = i;
+
 		hp->p[parent] = hp->p[child];
 		OFFSET_SET(hp, parent);
 		parent = child;
-		child = HEAP_LEFT(child);
+		child = HEAP_CHILD(hp, child);
 	}
 	hp->num_elements--;
 
@@ -297,6 +418,26 @@ void *fr_heap_pop(fr_heap_t *hp)
 	return data;
 }
 
+/** Remove up to num elements from the top of the heap
+ *
+ * @param[in] hp	The heap to pop elements from.
+ * @param[out] out	Where to write the elements, in heap order.
+ * @param[in] num	Maximum number of elements to pop.
+ * @return The number of elements written to out.
+ */
+uint32_t fr_heap_pop_n(fr_heap_t *hp, void *out[], uint32_t num)
+{
+	uint32_t i;
+
+	if ((int64_t)num > hp->num_elements) num = hp->num_elements;
+
+	for (i = 0; i < num; i++) {
+		out[i] = hp->p[0];
+		(void) fr_heap_extract(hp, out[i]);
+	}
+
+	return num;
+}
 
 void *fr_heap_peek_tail(fr_heap_t *hp)
 {
@@ -15,7 +15,7 @@
  *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 
-/** Structures and prototypes for binary heaps
+/** Structures and prototypes for d-ary heaps
  *
  * @file src/lib/util/heap.h
  *
@@ -44,6 +44,13 @@ typedef int8_t (*fr_heap_cmp_t)(void const *a, void const *b);
 
 typedef struct fr_heap_s fr_heap_t;
 
+/** Number of children each node has, unless the caller asks for something else
+ *
+ * A 4-ary heap is half the height of a binary one, and the children
+ * of a node usually share a cache line.
+ */
+#define FR_HEAP_ARITY_DEFAULT	4
+
 /** Creates a heap that can be used with non-talloced elements
  *
  * @param[in] _ctx		Talloc ctx to allocate heap in.
@@ -52,7 +59,18 @@ typedef struct fr_heap_s fr_heap_t;
  * @param[in] _field		to store heap indexes in.
  */
 #define fr_heap_alloc(_ctx, _cmp, _type, _field) \
-	_fr_heap_alloc(_ctx, _cmp, NULL, (size_t)offsetof(_type, _field))
+	_fr_heap_alloc(_ctx, _cmp, NULL, (size_t)offsetof(_type, _field), FR_HEAP_ARITY_DEFAULT)
+
+/** Creates a heap with a specific number of children per node
+ *
+ * @param[in] _ctx		Talloc ctx to allocate heap in.
+ * @param[in] _cmp		Comparator used to compare elements.
+ * @param[in] _type		Of elements.
+ * @param[in] _field		to store heap indexes in.
+ * @param[in] _arity		Children per node.  Must be a power of 2, between 2 and 16.
+ */
+#define fr_heap_alloc_arity(_ctx, _cmp, _type, _field, _arity) \
+	_fr_heap_alloc(_ctx, _cmp, NULL, (size_t)offsetof(_type, _field), _arity)
 
 /** Creates a heap that verifies elements are of a specific talloc type
  *
@@ -65,13 +83,16 @@ typedef struct fr_heap_s fr_heap_t;
  *	- NULL on error.
  */
 #define fr_heap_talloc_alloc(_ctx, _cmp, _talloc_type, _field) \
-	_fr_heap_alloc(_ctx, _cmp, #_talloc_type, (size_t)offsetof(_talloc_type, _field))
+	_fr_heap_alloc(_ctx, _cmp, #_talloc_type, (size_t)offsetof(_talloc_type, _field), FR_HEAP_ARITY_DEFAULT)
 
-fr_heap_t	*_fr_heap_alloc(TALLOC_CTX *ctx, fr_heap_cmp_t cmp, char const *talloc_type, size_t offset);
+fr_heap_t	*_fr_heap_alloc(TALLOC_CTX *ctx, fr_heap_cmp_t cmp, char const *talloc_type,
+				size_t offset, unsigned int arity);
 
 int		fr_heap_insert(fr_heap_t *hp, void *data) CC_HINT(nonnull);
+int		fr_heap_insert_n(fr_heap_t *hp, void *data[], uint32_t num) CC_HINT(nonnull);
 int		fr_heap_extract(fr_heap_t *hp, void *data) CC_HINT(nonnull(1));
 void		*fr_heap_pop(fr_heap_t *hp) CC_HINT(nonnull);
+uint32_t	fr_heap_pop_n(fr_heap_t *hp, void *out[], uint32_t num) CC_HINT(nonnull);
 void		*fr_heap_peek(fr_heap_t *hp);
 void		*fr_heap_peek_tail(fr_heap_t *hp);
 
@@ -216,6 +216,203 @@ static void heap_cycle(void)
 	free(remaining);
 }
 
+/** Check the heap property holds, and every element knows where it is
+ *
+ */
+static bool fr_heap_valid(fr_heap_t *hp)
+{
+	int32_t i;
+
+	for (i = 0; i < hp->num_elements; i++) {
+		if (index_get(hp, hp->p[i]) != i) return false;
+		if ((i > 0) && (hp->cmp(hp->p[HEAP_PARENT(hp, i)], hp->p[i]) > 0)) return false;
+	}
+
+	return true;
+}
+
+static void heap_test_arity(void)
+{
+	static unsigned int const arity[] = { 2, 4, 8, 16 };
+	fr_heap_t	*hp;
+	heap_thing	*array, *t, *prev;
+	size_t		a;
+	int		i;
+
+	array = malloc(sizeof(heap_thing) * HEAP_TEST_SIZE);
+
+	TEST_CHECK(fr_heap_alloc_arity(NULL, heap_cmp, heap_thing, heap, 3) == NULL);
+
+	for (a = 0; a < NUM_ELEMENTS(arity); a++) {
+		TEST_CASE("arity");
+		TEST_MSG("arity %u", arity[a]);
+
+		hp = fr_heap_alloc_arity(NULL, heap_cmp, heap_thing, heap, arity[a]);
+		TEST_CHECK(hp != NULL);
+
+		for (i = 0; i < HEAP_TEST_SIZE; i++) {
+			array[i].data = rand() % 65537;
+			array[i].heap = 0;
+			TEST_CHECK(fr_heap_insert(hp, &array[i]) >= 0);
+		}
+		TEST_CHECK(fr_heap_valid(hp));
+
+		for (i = 0; i < HEAP_TEST_SIZE; i += 3) TEST_CHECK(fr_heap_extract(hp, &array[i]) >= 0);
+		TEST_CHECK(fr_heap_valid(hp));
+
+		prev = NULL;
+		while ((t = fr_heap_pop(hp))) {
+			TEST_CHECK(!prev || (prev->data <= t->data));
+			prev = t;
+		}
+
+		talloc_free(hp);
+	}
+
+	free(array);
+}
+
+static void heap_test_batch(void)
+{
+	fr_heap_t	*hp;
+	heap_thing	*array, *prev;
+	void		**batch;
+	uint32_t	i, num, popped, total = 0;
+
+	hp = fr_heap_alloc(NULL, heap_cmp, heap_thing, heap);
+	TEST_CHECK(hp != NULL);
+
+	array = calloc(HEAP_TEST_SIZE, sizeof(heap_thing));
+	batch = malloc(sizeof(void *) * HEAP_TEST_SIZE);
+	for (i = 0; i < HEAP_TEST_SIZE; i++) {
+		array[i].data = rand() % 65537;
+		batch[i] = &array[i];
+	}
+
+	/*
+	 *	Large batch into an empty heap is built bottom up,
+	 *	small batches into a larger heap are bubbled up.
+	 */
+	TEST_CASE("insert_n");
+	num = HEAP_TEST_SIZE / 2;
+	TEST_CHECK(fr_heap_insert_n(hp, batch, num) == 0);
+	TEST_CHECK(fr_heap_num_elements(hp) == num);
+	TEST_CHECK(fr_heap_valid(hp));
+
+	for (i = num; i < HEAP_TEST_SIZE; i += 100) {
+		uint32_t n = ((HEAP_TEST_SIZE - i) < 100) ? (HEAP_TEST_SIZE - i) : 100;
+
+		TEST_CHECK(fr_heap_insert_n(hp, &batch[i], n) == 0);
+	}
+	TEST_CHECK(fr_heap_num_elements(hp) == HEAP_TEST_SIZE);
+	TEST_CHECK(fr_heap_valid(hp));
+
+	/*
+	 *	All or nothing.
+	 */
+	TEST_CHECK(fr_heap_insert_n(hp, batch, 10) < 0);
+	TEST_CHECK(fr_heap_num_elements(hp) == HEAP_TEST_SIZE);
+
+	TEST_CASE("pop_n");
+	prev = NULL;
+	while ((popped = fr_heap_pop_n(hp, batch, 64)) > 0) {
+		for (i = 0; i < popped; i++) {
+			heap_thing *t = batch[i];
+
+			TEST_CHECK(t->heap == -1);
+			TEST_CHECK(!prev || (prev->data <= t->data));
+			prev = t;
+		}
+		total += popped;
+	}
+	TEST_CHECK(total == HEAP_TEST_SIZE);
+	TEST_MSG("expected %i, got %u", HEAP_TEST_SIZE, total);
+
+	talloc_free(hp);
+	free(batch);
+	free(array);
+}
+
+#define HEAP_BENCH_SIZE (1000000)
+
+static uint64_t heap_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/** Throughput of the common operations, for each arity
+ *
+ * "churn" pops the top element and re-inserts it with a later key,
+ * which is what the worker and timer queues do most of.
+ */
+static void heap_test_throughput(void)
+{
+	static unsigned int const arity[] = { 2, 4, 8 };
+	fr_heap_t	*hp;
+	heap_thing	*array;
+	void		**batch;
+	size_t		a;
+	int		i;
+	uint64_t	start, insert, churn, pop, insert_n, pop_n;
+
+	array = malloc(sizeof(heap_thing) * HEAP_BENCH_SIZE);
+	batch = malloc(sizeof(void *) * HEAP_BENCH_SIZE);
+
+	for (a = 0; a < NUM_ELEMENTS(arity); a++) {
+		hp = fr_heap_alloc_arity(NULL, heap_cmp, heap_thing, heap, arity[a]);
+		TEST_CHECK(hp != NULL);
+
+		for (i = 0; i < HEAP_BENCH_SIZE; i++) {
+			array[i].data = rand() % (1 << 24);
+			array[i].heap = 0;
+			batch[i] = &array[i];
+		}
+
+		start = heap_bench_now();
+		for (i = 0; i < HEAP_BENCH_SIZE; i++) fr_heap_insert(hp, &array[i]);
+		insert = heap_bench_now() - start;
+
+		start = heap_bench_now();
+		for (i = 0; i < HEAP_BENCH_SIZE; i++) {
+			heap_thing *t = fr_heap_pop(hp);
+
+			t->data += rand() % 65537;
+			fr_heap_insert(hp, t);
+		}
+		churn = heap_bench_now() - start;
+
+		start = heap_bench_now();
+		while (fr_heap_pop(hp));
+		pop = heap_bench_now() - start;
+
+		start = heap_bench_now();
+		TEST_CHECK(fr_heap_insert_n(hp, batch, HEAP_BENCH_SIZE) == 0);
+		insert_n = heap_bench_now() - start;
+
+		start = heap_bench_now();
+		while (fr_heap_pop_n(hp, batch, 32) > 0);
+		pop_n = heap_bench_now() - start;
+
+		TEST_CHECK(fr_heap_num_elements(hp) == 0);
+
+		printf("\n\t%u-ary: insert %.1f, churn %.1f, pop %.1f, insert_n %.1f, pop_n %.1f ns/op",
+		       arity[a],
+		       (double)insert / HEAP_BENCH_SIZE, (double)churn / HEAP_BENCH_SIZE,
+		       (double)pop / HEAP_BENCH_SIZE, (double)insert_n / HEAP_BENCH_SIZE,
+		       (double)pop_n / HEAP_BENCH_SIZE);
+
+		talloc_free(hp);
+	}
+	printf("\n");
+
+	free(batch);
+	free(array);
+}
+
 TEST_LIST = {
 	/*
 	 *	Basic tests
@@ -224,6 +421,13 @@ TEST_LIST = {
 	{ "heap_test_skip_2",		heap_test_skip_2	},
 	{ "heap_test_skip_10",		heap_test_skip_10	},
 	{ "heap_cycle",			heap_cycle		},
+	{ "heap_test_arity",		heap_test_arity		},
+	{ "heap_test_batch",		heap_test_batch		},
+
+	/*
+	 *	Benchmarks
+	 */
+	{ "heap_test_throughput",	heap_test_throughput	},
 	{ NULL }
 };
 
@@ -150,6 +150,63 @@ void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *in, size_t in
 }
 #endif /* HAVE_OPENSSL_EVP_H */
 
+/** Calculate the HMACs of many independent messages, all with the same key
+ *
+ * Uses fr_md5_calc_multi() to process several messages at once, and only
+ * hashes the padded key once for the whole batch.
+ *
+ * @param msgs Messages to sign.  Each digest is written to msgs[i].out.
+ * @param num Number of messages.
+ * @param key Pointer to authentication key.
+ * @param key_len Length of authentication key.
+ */
+void fr_hmac_md5_multi(fr_md5_multi_t const msgs[], size_t num, uint8_t const *key, size_t key_len)
+{
+	uint8_t		k_ipad[MD5_BLOCK_LENGTH];
+	uint8_t		k_opad[MD5_BLOCK_LENGTH];
+	uint8_t		tk[MD5_DIGEST_LENGTH];
+	uint8_t		inner[FR_MD5_MULTI_LANES][MD5_DIGEST_LENGTH];
+	fr_md5_multi_t	outer[FR_MD5_MULTI_LANES];
+	size_t		i, j, chunk;
+
+	if (key_len > MD5_BLOCK_LENGTH) {
+		fr_md5_calc(tk, key, key_len);
+		key = tk;
+		key_len = sizeof(tk);
+	}
+
+	memset(k_ipad, 0, sizeof(k_ipad));
+	memcpy(k_ipad, key, key_len);
+	memcpy(k_opad, k_ipad, sizeof(k_opad));
+
+	for (i = 0; i < MD5_BLOCK_LENGTH; i++) {
+		k_ipad[i] ^= 0x36;
+		k_opad[i] ^= 0x5c;
+	}
+
+	for (i = 0; i < num; i += chunk) {
+		fr_md5_multi_t inner_msgs[FR_MD5_MULTI_LANES];
+
+		chunk = ((num - i) < FR_MD5_MULTI_LANES) ? (num - i) : FR_MD5_MULTI_LANES;
+
+		for (j = 0; j < chunk; j++) {
+			inner_msgs[j] = (fr_md5_multi_t){
+				.in = msgs[i + j].in,
+				.inlen = msgs[i + j].inlen,
+				.out = inner[j]
+			};
+			outer[j] = (fr_md5_multi_t){
+				.in = inner[j],
+				.inlen = MD5_DIGEST_LENGTH,
+				.out = msgs[i + j].out
+			};
+		}
+
+		fr_md5_calc_multi(inner_msgs, chunk, k_ipad);
+		fr_md5_calc_multi(outer, chunk, k_opad);
+	}
+}
+
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
 
@@ -330,6 +330,181 @@ char const *fr_inet_ntoh(fr_ipaddr_t const *src, char *out, size_t outlen)
 }
 
 
+/** Value of a hex digit, or -1 if c isn't one
+ *
+ */
+static inline int inet_hexval(char c)
+{
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+
+	return -1;
+}
+
+/** Parse a dotted quad, without copying or resolving
+ *
+ * Only accepts the form inet_pton(AF_INET, ...) accepts, four decimal
+ * octets with no leading zeros.  Anything else is left to the
+ * general parser.
+ *
+ * @param[out] out	Where to write the address, in network order.
+ * @param[in] in	String to parse.  Need not be \0 terminated.
+ * @param[in] inlen	Length of in.
+ * @return
+ *	- > 0 the number of chars parsed.
+ *	- -1 if in doesn't start with a dotted quad.
+ */
+static ssize_t inet_pton4_literal(struct in_addr *out, char const *in, size_t inlen)
+{
+	char const	*p = in, *end = in + inlen;
+	uint32_t	addr = 0;
+	int		i;
+
+	for (i = 0; i < 4; i++) {
+		char const	*start;
+		uint32_t	octet;
+
+		if (i > 0) {
+			if ((p >= end) || (*p != '.')) return -1;
+			p++;
+		}
+
+		if ((p >= end) || (*p < '0') || (*p > '9')) return -1;
+		start = p;
+		octet = *p++ - '0';
+
+		while ((p < end) && (*p >= '0') && (*p <= '9') && ((p - start) < 3)) {
+			if (octet == 0) return -1;	/* Leading zero */
+			octet = (octet * 10) + (*p++ - '0');
+		}
+		if (octet > 255) return -1;
+
+		addr = (addr << 8) | octet;
+	}
+
+	out->s_addr = htonl(addr);
+
+	return p - in;
+}
+
+/** Parse an IPv6 address, without copying or resolving
+ *
+ * Accepts hex groups, a single "::", and a trailing dotted quad,
+ * as inet_pton(AF_INET6, ...) does.
+ *
+ * @param[out] out	Where to write the address.
+ * @param[in] in	String to parse.  Need not be \0 terminated.
+ * @param[in] inlen	Length of in.
+ * @return
+ *	- > 0 the number of chars parsed.
+ *	- -1 if in doesn't start with an IPv6 address.
+ */
+static ssize_t inet_pton6_literal(struct in6_addr *out, char const *in, size_t inlen)
+{
+	uint8_t		tmp[16];
+	char const	*p = in, *end = in + inlen;
+	int		words = 0, gap = -1;
+
+	if ((p < end) && (*p == ':')) {
+		if (((p + 1) >= end) || (p[1] != ':')) return -1;
+		p += 2;
+		gap = 0;
+	}
+
+	while ((p < end) && (inet_hexval(*p) >= 0)) {
+		char const	*start = p;
+		uint32_t	word = 0;
+		int		v;
+
+		while ((p < end) && ((p - start) < 4) && ((v = inet_hexval(*p)) >= 0)) {
+			word = (word << 4) | v;
+			p++;
+		}
+
+		/*
+		 *	An IPv4 address in the last 32 bits.
+		 */
+		if ((p < end) && (*p == '.')) {
+			struct in_addr	v4;
+			ssize_t		slen;
+
+			if (words > 6) return -1;
+
+			slen = inet_pton4_literal(&v4, start, end - start);
+			if (slen < 0) return -1;
+
+			memcpy(tmp + (words * 2), &v4.s_addr, sizeof(v4.s_addr));
+			words += 2;
+			p = start + slen;
+			break;
+		}
+
+		if (words >= 8) return -1;
+		tmp[words * 2] = word >> 8;
+		tmp[(words * 2) + 1] = word & 0xff;
+		words++;
+
+		if ((p >= end) || (*p != ':')) break;
+		p++;
+
+		if ((p < end) && (*p == ':')) {
+			if (gap >= 0) return -1;
+			gap = words;
+			p++;
+			continue;
+		}
+
+		/*
+		 *	A single trailing ':'
+		 */
+		if ((p >= end) || (inet_hexval(*p) < 0)) return -1;
+	}
+
+	if (gap >= 0) {
+		size_t len = (words - gap) * 2;
+
+		if (words == 8) return -1;
+
+		memmove(tmp + sizeof(tmp) - len, tmp + (gap * 2), len);
+		memset(tmp + (gap * 2), 0, sizeof(tmp) - len - (gap * 2));
+	} else if (words != 8) {
+		return -1;
+	}
+
+	memcpy(out->s6_addr, tmp, sizeof(out->s6_addr));
+
+	return p - in;
+}
+
+/** Parse a prefix length, without copying
+ *
+ * @param[out] out	Where to write the prefix length.
+ * @param[in] in	String to parse, after the '/'.
+ * @param[in] inlen	Length of in.
+ * @param[in] max	Largest prefix length allowed.
+ * @return
+ *	- true if the whole of in is a valid prefix length.
+ *	- false if it should be left to the general parser.
+ */
+static inline bool inet_prefix_literal(unsigned int *out, char const *in, size_t inlen, unsigned int max)
+{
+	unsigned int	prefix = 0;
+	size_t		i;
+
+	if ((inlen == 0) || (inlen > 3)) return false;
+
+	for (i = 0; i < inlen; i++) {
+		if ((in[i] < '0') || (in[i] > '9')) return false;
+		prefix = (prefix * 10) + (in[i] - '0');
+	}
+	if (prefix > max) return false;
+
+	*out = prefix;
+
+	return true;
+}
+
 /** Parse a single octet of an IPv4 address string
  *
  * @param[out] out Where to write integer.
@@ -453,6 +628,33 @@ int fr_inet_pton4(fr_ipaddr_t *out, char const *value, ssize_t inlen, bool resol
 	}
 	inlen = end - value;
 
+	/*
+	 *	Most strings are plain addresses or prefixes, which
+	 *	can be parsed in place, without the resolver.
+	 */
+	{
+		size_t		len = (inlen >= 0) ? (size_t)inlen : strlen(value);
+		ssize_t		slen;
+
+		slen = inet_pton4_literal(&out->addr.v4, value, len);
+		if (slen > 0) {
+			if ((size_t)slen == len) {
+				out->af = AF_INET;
+				out->prefix = 32;
+				return 0;
+			}
+
+			if ((value[slen] == '/') &&
+			    inet_prefix_literal(&mask, value + slen + 1, len - (slen + 1), 32)) {
+				if (mask_bits && (mask < 32)) out->addr.v4 = fr_inaddr_mask(&out->addr.v4, mask);
+				out->af = AF_INET;
+				out->prefix = (uint8_t) mask;
+				return 0;
+			}
+		}
+		out->addr.v4.s_addr = 0;
+	}
+
 	/*
 	 *	Copy to intermediary buffer if we were given a length
 	 */
@@ -586,6 +788,38 @@ int fr_inet_pton6(fr_ipaddr_t *out, char const *value, ssize_t inlen, bool resol
 	}
 	inlen = end - value;
 
+	/*
+	 *	Most strings are plain addresses or prefixes, which
+	 *	can be parsed in place, without the resolver.
+	 */
+	{
+		size_t		len = (inlen >= 0) ? (size_t)inlen : strlen(value);
+		ssize_t		slen;
+
+		slen = inet_pton6_literal(&out->addr.v6, value, len);
+		if (slen > 0) {
+			if ((size_t)slen == len) {
+				out->af = AF_INET6;
+				out->prefix = 128;
+				return 0;
+			}
+
+			if ((value[slen] == '/') &&
+			    inet_prefix_literal(&prefix, value + slen + 1, len - (slen + 1), 128)) {
+				if (mask && (prefix < 128)) {
+					struct in6_addr addr;
+
+					addr = fr_in6addr_mask(&out->addr.v6, prefix);
+					memcpy(out->addr.v6.s6_addr, addr.s6_addr, sizeof(out->addr.v6.s6_addr));
+				}
+				out->af = AF_INET6;
+				out->prefix = (uint8_t) prefix;
+				return 0;
+			}
+		}
+		memset(&out->addr.v6, 0, sizeof(out->addr.v6));
+	}
+
 	/*
 	 *	Copy to intermediary buffer if we were given a length
 	 */
@@ -0,0 +1,216 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/util/inet.h>
+
+#include <arpa/inet.h>
+#include <time.h>
+
+#define INET_BENCH_ROUNDS	(1000000)
+
+/** Addresses which must parse the same way inet_pton() parses them
+ *
+ */
+static char const *inet_test_v4[] = {
+	"0.0.0.0",
+	"1.2.3.4",
+	"10.0.0.1",
+	"127.0.0.1",
+	"192.0.2.255",
+	"255.255.255.255",
+};
+
+static char const *inet_test_v6[] = {
+	"::",
+	"::1",
+	"1::",
+	"fe80::1",
+	"2001:db8::",
+	"2001:db8:0:0:1:0:0:1",
+	"2001:DB8:85A3:0000:0000:8A2E:0370:7334",
+	"1:2:3:4:5:6:7:8",
+	"1::8",
+	"1:2:3:4:5:6::8",
+	"::ffff:192.0.2.1",
+	"64:ff9b::192.0.2.33",
+	"1:2:3:4:5:6:1.2.3.4",
+};
+
+/** Strings which aren't addresses, and must not be accepted
+ *
+ */
+static char const *inet_test_invalid_v6[] = {
+	":",
+	":::",
+	"1:::2",
+	"1:2:3:4:5:6:7:8:9",
+	"1:2:3:4:5:6:7::8",
+	"12345::",
+	"1::2::3",
+	"1:",
+	"::ffff:1.2.3",
+	"::ffff:01.2.3.4",
+	"1:2:3:4:5:6:7:1.2.3.4",
+	"g::",
+};
+
+static void inet_test_pton4(void)
+{
+	fr_ipaddr_t	addr;
+	struct in_addr	expected;
+	size_t		i;
+
+	for (i = 0; i < NUM_ELEMENTS(inet_test_v4); i++) {
+		TEST_CASE(inet_test_v4[i]);
+		TEST_CHECK(inet_pton(AF_INET, inet_test_v4[i], &expected) == 1);
+		TEST_CHECK(fr_inet_pton4(&addr, inet_test_v4[i], -1, false, false, false) == 0);
+		TEST_CHECK(addr.af == AF_INET);
+		TEST_CHECK(addr.prefix == 32);
+		TEST_CHECK(addr.addr.v4.s_addr == expected.s_addr);
+
+		/*
+		 *	Not \0 terminated
+		 */
+		TEST_CHECK(fr_inet_pton4(&addr, inet_test_v4[i], strlen(inet_test_v4[i]), false, false, false) == 0);
+		TEST_CHECK(addr.addr.v4.s_addr == expected.s_addr);
+	}
+
+	TEST_CASE("Prefixes");
+	TEST_CHECK(fr_inet_pton4(&addr, "192.0.2.1/24", -1, false, false, true) == 0);
+	TEST_CHECK(addr.prefix == 24);
+	TEST_CHECK(addr.addr.v4.s_addr == htonl(0xc0000200));
+
+	TEST_CHECK(fr_inet_pton4(&addr, "192.0.2.1/24", -1, false, false, false) == 0);
+	TEST_CHECK(addr.addr.v4.s_addr == htonl(0xc0000201));
+
+	TEST_CHECK(fr_inet_pton4(&addr, "192.0.2.1/0", -1, false, false, true) == 0);
+	TEST_CHECK(addr.prefix == 0);
+	TEST_CHECK(addr.addr.v4.s_addr == 0);
+
+	TEST_CASE("Forms left to the general parser");
+	TEST_CHECK(fr_inet_pton4(&addr, "192.168/16", -1, false, false, false) == 0);
+	TEST_CHECK(addr.prefix == 16);
+	TEST_CHECK(addr.addr.v4.s_addr == htonl(0xc0a80000));
+
+	TEST_CHECK(fr_inet_pton4(&addr, "*", -1, false, false, false) == 0);
+	TEST_CHECK(addr.addr.v4.s_addr == htonl(INADDR_ANY));
+
+	TEST_CHECK(fr_inet_pton4(&addr, "16909060", -1, false, false, false) == 0);
+	TEST_CHECK(addr.addr.v4.s_addr == htonl(0x01020304));
+
+	TEST_CASE("Invalid");
+	TEST_CHECK(fr_inet_pton4(&addr, "1.2.3.256", -1, false, false, false) < 0);
+	TEST_CHECK(fr_inet_pton4(&addr, "1.2.3.4.5", -1, false, false, false) < 0);
+	TEST_CHECK(fr_inet_pton4(&addr, "1.2.3.4/33", -1, false, false, false) < 0);
+	TEST_CHECK(fr_inet_pton4(&addr, "1.2.3.4/2x", -1, false, false, false) < 0);
+	TEST_CHECK(fr_inet_pton4(&addr, "1.2.3.0004", -1, false, false, false) < 0);
+}
+
+static void inet_test_pton6(void)
+{
+	fr_ipaddr_t	addr;
+	struct in6_addr	expected;
+	size_t		i;
+
+	for (i = 0; i < NUM_ELEMENTS(inet_test_v6); i++) {
+		TEST_CASE(inet_test_v6[i]);
+		TEST_CHECK(inet_pton(AF_INET6, inet_test_v6[i], &expected) == 1);
+		TEST_CHECK(fr_inet_pton6(&addr, inet_test_v6[i], -1, false, false, false) == 0);
+		TEST_CHECK(addr.af == AF_INET6);
+		TEST_CHECK(addr.prefix == 128);
+		TEST_CHECK(memcmp(addr.addr.v6.s6_addr, expected.s6_addr, sizeof(expected.s6_addr)) == 0);
+
+		TEST_CHECK(fr_inet_pton(&addr, inet_test_v6[i], strlen(inet_test_v6[i]), AF_UNSPEC, false, false) == 0);
+		TEST_CHECK(memcmp(addr.addr.v6.s6_addr, expected.s6_addr, sizeof(expected.s6_addr)) == 0);
+	}
+
+	for (i = 0; i < NUM_ELEMENTS(inet_test_invalid_v6); i++) {
+		TEST_CASE(inet_test_invalid_v6[i]);
+		TEST_CHECK(inet_pton(AF_INET6, inet_test_invalid_v6[i], &expected) != 1);
+		TEST_CHECK(fr_inet_pton6(&addr, inet_test_invalid_v6[i], -1, false, false, false) < 0);
+	}
+
+	TEST_CASE("Prefixes");
+	TEST_CHECK(fr_inet_pton6(&addr, "2001:db8::1/32", -1, false, false, true) == 0);
+	TEST_CHECK(addr.prefix == 32);
+	TEST_CHECK(inet_pton(AF_INET6, "2001:db8::", &expected) == 1);
+	TEST_CHECK(memcmp(addr.addr.v6.s6_addr, expected.s6_addr, sizeof(expected.s6_addr)) == 0);
+
+	TEST_CHECK(fr_inet_pton6(&addr, "::/0", -1, false, false, true) == 0);
+	TEST_CHECK(addr.prefix == 0);
+
+	TEST_CHECK(fr_inet_pton6(&addr, "::1/129", -1, false, false, true) < 0);
+}
+
+/** Every address printed by inet_ntop() must parse back to itself
+ *
+ */
+static void inet_test_round_trip(void)
+{
+	fr_ipaddr_t	addr;
+	struct in6_addr	in;
+	char		buffer[INET6_ADDRSTRLEN];
+	size_t		i, j;
+
+	for (i = 0; i < 10000; i++) {
+		for (j = 0; j < sizeof(in.s6_addr); j++) {
+			/*
+			 *	Lots of zero groups, so "::" is used.
+			 */
+			in.s6_addr[j] = (((i >> (j / 2)) & 0x01) == 0) ? 0 : ((i * 131) + (j * 17)) & 0xff;
+		}
+
+		inet_ntop(AF_INET6, &in, buffer, sizeof(buffer));
+
+		TEST_CHECK(fr_inet_pton6(&addr, buffer, -1, false, false, false) == 0);
+		TEST_CHECK(memcmp(addr.addr.v6.s6_addr, in.s6_addr, sizeof(in.s6_addr)) == 0);
+		TEST_MSG("Address %s", buffer);
+	}
+}
+
+static uint64_t inet_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/** Parsing rate for addresses and prefixes
+ *
+ */
+static void inet_test_bench(void)
+{
+	static char const *in[] = {
+		"192.0.2.1",
+		"10.11.12.0/24",
+		"2001:db8::1",
+		"2001:db8:1234::/48",
+	};
+	fr_ipaddr_t	addr;
+	uint64_t	start, elapsed;
+	size_t		i, j;
+
+	printf("\n");
+	for (i = 0; i < NUM_ELEMENTS(in); i++) {
+		size_t	len = strlen(in[i]);
+		size_t	ok = 0;
+
+		start = inet_bench_now();
+		for (j = 0; j < INET_BENCH_ROUNDS; j++) {
+			ok += (fr_inet_pton(&addr, in[i], len, AF_UNSPEC, true, true) == 0);
+		}
+		elapsed = inet_bench_now() - start;
+
+		TEST_CHECK(ok == INET_BENCH_ROUNDS);
+		printf("\t%-20s %8.1f M/s\n", in[i], (double) INET_BENCH_ROUNDS * 1000 / (elapsed ? elapsed : 1));
+	}
+}
+
+TEST_LIST = {
+	{ "inet_test_pton4",		inet_test_pton4		},
+	{ "inet_test_pton6",		inet_test_pton6		},
+	{ "inet_test_round_trip",	inet_test_round_trip	},
+	{ "inet_test_bench",		inet_test_bench		},
+	{ NULL }
+};
@@ -8,9 +8,11 @@ TARGET		:= libfreeradius-util.a
 SOURCES		:= \
 		   ascend.c \
 		   base64.c \
+		   btree.c \
 		   cap.c \
 		   cursor.c \
 		   debug.c \
+		   dict_cache.c \
 		   dict_print.c \
 		   dict_tokenize.c \
 		   dict_unknown.c \
@@ -39,6 +41,7 @@ SOURCES		:= \
 		   net.c \
 		   packet.c \
 		   pair_cursor.c \
+		   pair_index.c \
 		   pair_legacy.c \
 		   pair_tokenize.c \
 		   pair.c \
@@ -65,6 +68,7 @@ SOURCES		:= \
 		   time.c \
 		   timeval.c \
 		   token.c \
+		   tpacket.c \
 		   trie.c \
 		   udp.c \
 		   udpfromto.c \
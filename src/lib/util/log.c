@@ -34,7 +34,9 @@ RCSID("$Id$")
 #ifdef HAVE_FEATURES_H
 #  include <features.h>
 #endif
+#include <pthread.h>
 #include <stdio.h>
+#include <sys/uio.h>
 #ifdef HAVE_SYSLOG_H
 #  include <syslog.h>
 #endif
@@ -205,6 +207,266 @@ fr_log_t default_log = {
 	.timestamp = L_TIMESTAMP_AUTO
 };
 
+/** Messages waiting to be written by the log thread
+ *
+ * Workers only copy formatted messages into the buffer, so they
+ * don't wait for the disk.  The log thread writes everything queued
+ * since its last write with a single writev().
+ */
+struct fr_log_async_s {
+	fr_log_t		*log;		//!< Whose fd we write to.
+
+	pthread_t		thread;		//!< Writing messages.
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+	pthread_cond_t		data;		//!< Signalled when messages are added.
+	pthread_cond_t		space;		//!< Signalled when messages have been written.
+
+	char			*buffer;	//!< Ring of queued messages.
+	size_t			size;		//!< Of the buffer.
+	size_t			head;		//!< Total bytes added.
+	size_t			tail;		//!< Total bytes written.
+
+	bool			block;		//!< Wait for space when the buffer is full.
+						///< Otherwise the message is dropped.
+	bool			stop;		//!< Tells the log thread to exit.
+	uint64_t		dropped;	//!< Messages discarded because the buffer was full.
+};
+
+/** Queue a message for the log thread
+ *
+ * @param[in] async	queue to add the message to.
+ * @param[in] msg	to write.
+ * @param[in] len	of msg.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the message was dropped.
+ */
+static int log_async_write(fr_log_async_t *async, char const *msg, size_t len)
+{
+	size_t	offset, chunk;
+
+	/*
+	 *	It'd never fit.
+	 */
+	if (len > async->size) {
+		pthread_mutex_lock(&async->mutex);
+		async->dropped++;
+		pthread_mutex_unlock(&async->mutex);
+		return -1;
+	}
+
+	pthread_mutex_lock(&async->mutex);
+	while ((async->size - (async->head - async->tail)) < len) {
+		if (!async->block || async->stop) {
+			async->dropped++;
+			pthread_mutex_unlock(&async->mutex);
+			return -1;
+		}
+		pthread_cond_wait(&async->space, &async->mutex);
+	}
+
+	offset = async->head % async->size;
+	chunk = async->size - offset;
+	if (chunk > len) chunk = len;
+
+	memcpy(async->buffer + offset, msg, chunk);
+	if (chunk < len) memcpy(async->buffer, msg + chunk, len - chunk);
+	async->head += len;
+
+	pthread_cond_signal(&async->data);
+	pthread_mutex_unlock(&async->mutex);
+
+	return 0;
+}
+
+/** Write queued messages until told to stop
+ *
+ */
+static void *log_async_thread(void *arg)
+{
+	fr_log_async_t	*async = arg;
+
+	pthread_mutex_lock(&async->mutex);
+	for (;;) {
+		size_t		start, end, offset;
+		struct iovec	iov[2];
+		int		iovcnt = 1;
+		ssize_t		wrote;
+
+		while ((async->head == async->tail) && !async->stop) {
+			pthread_cond_wait(&async->data, &async->mutex);
+		}
+		if (async->head == async->tail) break;
+
+		start = async->tail;
+		end = async->head;
+		pthread_mutex_unlock(&async->mutex);
+
+		/*
+		 *	Writers only add after head, so this region
+		 *	is ours until we move the tail.
+		 */
+		offset = start % async->size;
+		iov[0].iov_base = async->buffer + offset;
+		iov[0].iov_len = end - start;
+		if ((offset + iov[0].iov_len) > async->size) {
+			iov[0].iov_len = async->size - offset;
+			iov[1].iov_base = async->buffer;
+			iov[1].iov_len = (end - start) - iov[0].iov_len;
+			iovcnt = 2;
+		}
+
+		/*
+		 *	Finish partial writes, but give up on errors,
+		 *	as there's nowhere to report them.
+		 */
+		while ((wrote = writev(async->log->fd, iov, iovcnt)) > 0) {
+			if ((size_t)wrote < iov[0].iov_len) {
+				iov[0].iov_base = (char *)iov[0].iov_base + wrote;
+				iov[0].iov_len -= wrote;
+				continue;
+			}
+
+			wrote -= iov[0].iov_len;
+			if (iovcnt == 1) break;
+
+			iov[0].iov_base = (char *)iov[1].iov_base + wrote;
+			iov[0].iov_len = iov[1].iov_len - wrote;
+			iovcnt = 1;
+			if (!iov[0].iov_len) break;
+		}
+
+		pthread_mutex_lock(&async->mutex);
+		async->tail = end;
+		pthread_cond_broadcast(&async->space);
+	}
+	pthread_mutex_unlock(&async->mutex);
+
+	return NULL;
+}
+
+/** Write log messages from a separate thread
+ *
+ * Callers of fr_vlog() will then no longer wait for writes to complete,
+ * unless the buffer is full and block is true.
+ *
+ * Must be called after any fork(), and before any other threads are
+ * started which use the log.
+ *
+ * @param[in] log	to write asynchronously.  Must write to a file
+ *			descriptor.
+ * @param[in] size	of the buffer for queued messages.
+ * @param[in] block	if true, wait for space when the buffer is full.
+ *			Otherwise drop the message.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_log_async_start(fr_log_t *log, size_t size, bool block)
+{
+	fr_log_async_t	*async;
+	int		ret;
+
+	if (log->async) return 0;
+
+	switch (log->dst) {
+	case L_DST_FILES:
+	case L_DST_STDOUT:
+	case L_DST_STDERR:
+		break;
+
+	default:
+		fr_strerror_printf("Asynchronous logging is only supported for files, stdout and stderr");
+		return -1;
+	}
+
+	if (!size) {
+		fr_strerror_printf("Asynchronous log buffer size must be greater than zero");
+		return -1;
+	}
+
+	async = talloc_zero(NULL, fr_log_async_t);
+	if (!async) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		talloc_free(async);
+		return -1;
+	}
+
+	async->buffer = talloc_array(async, char, size);
+	if (!async->buffer) goto oom;
+
+	async->log = log;
+	async->size = size;
+	async->block = block;
+
+	pthread_mutex_init(&async->mutex, NULL);
+	pthread_cond_init(&async->data, NULL);
+	pthread_cond_init(&async->space, NULL);
+
+	ret = pthread_create(&async->thread, NULL, log_async_thread, async);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating log thread: %s", fr_syserror(ret));
+		pthread_cond_destroy(&async->space);
+		pthread_cond_destroy(&async->data);
+		pthread_mutex_destroy(&async->mutex);
+		talloc_free(async);
+		return -1;
+	}
+
+	log->async = async;
+
+	return 0;
+}
+
+/** Write any queued messages, and go back to writing synchronously
+ *
+ * Must only be called once all other threads using the log have exited.
+ *
+ * @param[in] log	to stop writing asynchronously.
+ */
+void fr_log_async_stop(fr_log_t *log)
+{
+	fr_log_async_t	*async = log->async;
+
+	if (!async) return;
+
+	pthread_mutex_lock(&async->mutex);
+	async->stop = true;
+	pthread_cond_signal(&async->data);
+	pthread_mutex_unlock(&async->mutex);
+
+	pthread_join(async->thread, NULL);
+
+	log->async = NULL;
+
+	if (async->dropped) {
+		fr_log(log, L_WARN, __FILE__, __LINE__,
+		       "Dropped %" PRIu64 " log messages as the log buffer was full", async->dropped);
+	}
+
+	pthread_cond_destroy(&async->space);
+	pthread_cond_destroy(&async->data);
+	pthread_mutex_destroy(&async->mutex);
+	talloc_free(async);
+}
+
+/** Return how many messages have been dropped because the log buffer was full
+ *
+ */
+uint64_t fr_log_async_dropped(fr_log_t const *log)
+{
+	uint64_t	dropped;
+
+	if (!log->async) return 0;
+
+	pthread_mutex_lock(&log->async->mutex);
+	dropped = log->async->dropped;
+	pthread_mutex_unlock(&log->async->mutex);
+
+	return dropped;
+}
+
 /** Cleanup the memory pool used by vlog_request
  *
  */
@@ -402,7 +664,7 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *file, int line,
 #ifdef HAVE_SYSLOG_H
 	case L_DST_SYSLOG:
 	{
-		int syslog_priority;
+		int syslog_priority = LOG_DEBUG;
 
 		switch (type) {
 		case L_DBG:
@@ -467,6 +729,11 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *file, int line,
 				 	 colourise ? VTC_RESET : "");
 
 		len = talloc_array_length(buffer) - 1;
+		if (log->async) {
+			ret = log_async_write(log->async, buffer, len);
+			break;
+		}
+
 		wrote = write(log->fd, buffer, len);
 		if (wrote < len) ret = -1;
 	}
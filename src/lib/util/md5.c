@@ -180,7 +180,6 @@ static void fr_md5_openssl_final(uint8_t out[static MD5_DIGEST_LENGTH], fr_md5_c
 }
 #endif
 
-#  define MD5_BLOCK_LENGTH 64
 typedef struct {
 	uint32_t state[4];			//!< State.
 	uint32_t count[2];			//!< Number of bits, mod 2^64.
@@ -238,6 +237,80 @@ static const uint8_t PADDING[MD5_BLOCK_LENGTH] = {
 /* This is the central step in the MD5 algorithm. */
 #define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = w << s | w >> (32 - s),  w += x)
 
+/** All 64 steps of the MD5 algorithm
+ *
+ * Works equally well on scalars, and on vectors of independent lanes.
+ */
+#define MD5_ROUNDS(a, b, c, d, in) do { \
+	MD5STEP(F1, a, b, c, d, (in)[ 0] + 0xd76aa478,  7); \
+	MD5STEP(F1, d, a, b, c, (in)[ 1] + 0xe8c7b756, 12); \
+	MD5STEP(F1, c, d, a, b, (in)[ 2] + 0x242070db, 17); \
+	MD5STEP(F1, b, c, d, a, (in)[ 3] + 0xc1bdceee, 22); \
+	MD5STEP(F1, a, b, c, d, (in)[ 4] + 0xf57c0faf,  7); \
+	MD5STEP(F1, d, a, b, c, (in)[ 5] + 0x4787c62a, 12); \
+	MD5STEP(F1, c, d, a, b, (in)[ 6] + 0xa8304613, 17); \
+	MD5STEP(F1, b, c, d, a, (in)[ 7] + 0xfd469501, 22); \
+	MD5STEP(F1, a, b, c, d, (in)[ 8] + 0x698098d8,  7); \
+	MD5STEP(F1, d, a, b, c, (in)[ 9] + 0x8b44f7af, 12); \
+	MD5STEP(F1, c, d, a, b, (in)[10] + 0xffff5bb1, 17); \
+	MD5STEP(F1, b, c, d, a, (in)[11] + 0x895cd7be, 22); \
+	MD5STEP(F1, a, b, c, d, (in)[12] + 0x6b901122,  7); \
+	MD5STEP(F1, d, a, b, c, (in)[13] + 0xfd987193, 12); \
+	MD5STEP(F1, c, d, a, b, (in)[14] + 0xa679438e, 17); \
+	MD5STEP(F1, b, c, d, a, (in)[15] + 0x49b40821, 22); \
+	\
+	MD5STEP(F2, a, b, c, d, (in)[ 1] + 0xf61e2562,  5); \
+	MD5STEP(F2, d, a, b, c, (in)[ 6] + 0xc040b340,  9); \
+	MD5STEP(F2, c, d, a, b, (in)[11] + 0x265e5a51, 14); \
+	MD5STEP(F2, b, c, d, a, (in)[ 0] + 0xe9b6c7aa, 20); \
+	MD5STEP(F2, a, b, c, d, (in)[ 5] + 0xd62f105d,  5); \
+	MD5STEP(F2, d, a, b, c, (in)[10] + 0x02441453,  9); \
+	MD5STEP(F2, c, d, a, b, (in)[15] + 0xd8a1e681, 14); \
+	MD5STEP(F2, b, c, d, a, (in)[ 4] + 0xe7d3fbc8, 20); \
+	MD5STEP(F2, a, b, c, d, (in)[ 9] + 0x21e1cde6,  5); \
+	MD5STEP(F2, d, a, b, c, (in)[14] + 0xc33707d6,  9); \
+	MD5STEP(F2, c, d, a, b, (in)[ 3] + 0xf4d50d87, 14); \
+	MD5STEP(F2, b, c, d, a, (in)[ 8] + 0x455a14ed, 20); \
+	MD5STEP(F2, a, b, c, d, (in)[13] + 0xa9e3e905,  5); \
+	MD5STEP(F2, d, a, b, c, (in)[ 2] + 0xfcefa3f8,  9); \
+	MD5STEP(F2, c, d, a, b, (in)[ 7] + 0x676f02d9, 14); \
+	MD5STEP(F2, b, c, d, a, (in)[12] + 0x8d2a4c8a, 20); \
+	\
+	MD5STEP(F3, a, b, c, d, (in)[ 5] + 0xfffa3942,  4); \
+	MD5STEP(F3, d, a, b, c, (in)[ 8] + 0x8771f681, 11); \
+	MD5STEP(F3, c, d, a, b, (in)[11] + 0x6d9d6122, 16); \
+	MD5STEP(F3, b, c, d, a, (in)[14] + 0xfde5380c, 23); \
+	MD5STEP(F3, a, b, c, d, (in)[ 1] + 0xa4beea44,  4); \
+	MD5STEP(F3, d, a, b, c, (in)[ 4] + 0x4bdecfa9, 11); \
+	MD5STEP(F3, c, d, a, b, (in)[ 7] + 0xf6bb4b60, 16); \
+	MD5STEP(F3, b, c, d, a, (in)[10] + 0xbebfbc70, 23); \
+	MD5STEP(F3, a, b, c, d, (in)[13] + 0x289b7ec6,  4); \
+	MD5STEP(F3, d, a, b, c, (in)[ 0] + 0xeaa127fa, 11); \
+	MD5STEP(F3, c, d, a, b, (in)[ 3] + 0xd4ef3085, 16); \
+	MD5STEP(F3, b, c, d, a, (in)[ 6] + 0x04881d05, 23); \
+	MD5STEP(F3, a, b, c, d, (in)[ 9] + 0xd9d4d039,  4); \
+	MD5STEP(F3, d, a, b, c, (in)[12] + 0xe6db99e5, 11); \
+	MD5STEP(F3, c, d, a, b, (in)[15] + 0x1fa27cf8, 16); \
+	MD5STEP(F3, b, c, d, a, (in)[2 ] + 0xc4ac5665, 23); \
+	\
+	MD5STEP(F4, a, b, c, d, (in)[ 0] + 0xf4292244,  6); \
+	MD5STEP(F4, d, a, b, c, (in)[7 ] + 0x432aff97, 10); \
+	MD5STEP(F4, c, d, a, b, (in)[14] + 0xab9423a7, 15); \
+	MD5STEP(F4, b, c, d, a, (in)[5 ] + 0xfc93a039, 21); \
+	MD5STEP(F4, a, b, c, d, (in)[12] + 0x655b59c3,  6); \
+	MD5STEP(F4, d, a, b, c, (in)[3 ] + 0x8f0ccc92, 10); \
+	MD5STEP(F4, c, d, a, b, (in)[10] + 0xffeff47d, 15); \
+	MD5STEP(F4, b, c, d, a, (in)[1 ] + 0x85845dd1, 21); \
+	MD5STEP(F4, a, b, c, d, (in)[8 ] + 0x6fa87e4f,  6); \
+	MD5STEP(F4, d, a, b, c, (in)[15] + 0xfe2ce6e0, 10); \
+	MD5STEP(F4, c, d, a, b, (in)[6 ] + 0xa3014314, 15); \
+	MD5STEP(F4, b, c, d, a, (in)[13] + 0x4e0811a1, 21); \
+	MD5STEP(F4, a, b, c, d, (in)[4 ] + 0xf7537e82,  6); \
+	MD5STEP(F4, d, a, b, c, (in)[11] + 0xbd3af235, 10); \
+	MD5STEP(F4, c, d, a, b, (in)[2 ] + 0x2ad7d2bb, 15); \
+	MD5STEP(F4, b, c, d, a, (in)[9 ] + 0xeb86d391, 21); \
+} while (0)
+
 /** The core of the MD5 algorithm
  *
  * This alters an existing MD5 hash to reflect the addition of 16
@@ -264,73 +337,7 @@ static void fr_md5_local_transform(uint32_t state[static 4], uint8_t const block
 	c = state[2];
 	d = state[3];
 
-	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7);
-	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12);
-	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17);
-	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22);
-	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7);
-	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12);
-	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17);
-	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22);
-	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7);
-	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12);
-	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7);
-	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
-	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
-	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
-
-	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5);
-	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9);
-	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20);
-	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5);
-	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9);
-	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20);
-	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5);
-	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9);
-	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14);
-	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20);
-	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5);
-	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9);
-	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14);
-	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
-
-	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4);
-	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11);
-	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4);
-	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11);
-	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16);
-	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4);
-	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11);
-	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16);
-	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23);
-	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4);
-	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23);
-
-	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6);
-	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10);
-	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21);
-	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6);
-	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10);
-	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21);
-	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6);
-	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15);
-	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6);
-	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15);
-	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21);
+	MD5_ROUNDS(a, b, c, d, in);
 
 	state[0] += a;
 	state[1] += b;
@@ -548,3 +555,191 @@ void fr_md5_calc(uint8_t out[static MD5_DIGEST_LENGTH], uint8_t const *in, size_
 	fr_md5_final(out, ctx);
 	fr_md5_ctx_free(&ctx);
 }
+
+/** The padded end of a message, which the transform reads instead of the message itself
+ *
+ */
+typedef struct {
+	uint8_t const	*in;				//!< Whole blocks of the message.
+	size_t		full;				//!< Number of whole blocks.
+	size_t		blocks;				//!< Total number of blocks, including the tail.
+	uint8_t		tail[MD5_BLOCK_LENGTH * 2];	//!< Remaining data, padding, and length.
+} md5_lane_t;
+
+static void md5_lane_init(md5_lane_t *lane, uint8_t const *in, size_t inlen, uint64_t prefix_len)
+{
+	size_t		rem = inlen % MD5_BLOCK_LENGTH;
+	uint64_t	bits = (prefix_len + inlen) << 3;
+	uint8_t		*p;
+	int		i;
+
+	lane->in = in;
+	lane->full = inlen / MD5_BLOCK_LENGTH;
+	lane->blocks = lane->full + ((rem < (MD5_BLOCK_LENGTH - 8)) ? 1 : 2);
+
+	memset(lane->tail, 0, sizeof(lane->tail));
+	if (rem) memcpy(lane->tail, in + (lane->full * MD5_BLOCK_LENGTH), rem);
+	lane->tail[rem] = 0x80;
+
+	p = lane->tail + ((lane->blocks - lane->full) * MD5_BLOCK_LENGTH) - 8;
+	for (i = 0; i < 8; i++) p[i] = bits >> (i * 8);
+}
+
+static inline CC_HINT(always_inline) uint8_t const *md5_lane_block(md5_lane_t const *lane, size_t i)
+{
+	if (i < lane->full) return lane->in + (i * MD5_BLOCK_LENGTH);
+
+	return lane->tail + ((i - lane->full) * MD5_BLOCK_LENGTH);
+}
+
+/** Hash a single message, without needing a ctx
+ *
+ */
+static void md5_single(fr_md5_multi_t const *msg, uint32_t const init[static 4], uint64_t prefix_len)
+{
+	md5_lane_t	lane;
+	uint32_t	state[4];
+	size_t		i;
+
+	md5_lane_init(&lane, msg->in, msg->inlen, prefix_len);
+	memcpy(state, init, sizeof(state));
+
+	for (i = 0; i < lane.blocks; i++) fr_md5_local_transform(state, md5_lane_block(&lane, i));
+
+	for (i = 0; i < 4; i++) PUT_32BIT_LE(msg->out + i * 4, state[i]);
+}
+
+/*
+ *	GCC and clang map operations on vector types to whatever SIMD
+ *	instructions the target has, SSE2, AVX2, NEON etc..., or to
+ *	scalar code if it has none.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#  define HAVE_MD5_MULTI
+
+/** A vector holding one 32bit word for each lane
+ *
+ */
+typedef uint32_t md5_vec_t __attribute__((vector_size(FR_MD5_MULTI_LANES * sizeof(uint32_t))));
+
+/** Hash up to #FR_MD5_MULTI_LANES messages in parallel
+ *
+ */
+static void md5_multi_lanes(fr_md5_multi_t const *msgs, size_t num,
+			    uint32_t const init[static 4], uint64_t prefix_len)
+{
+	md5_lane_t	lanes[FR_MD5_MULTI_LANES];
+	md5_vec_t	state[4], in[MD5_BLOCK_LENGTH / 4], mask;
+	md5_vec_t	a, b, c, d;
+	size_t		i, l, blocks = 0;
+	int		w;
+
+	for (l = 0; l < FR_MD5_MULTI_LANES; l++) {
+		/*
+		 *	Unused lanes have no blocks, and their
+		 *	results are never written anywhere.
+		 */
+		if (l >= num) {
+			memset(&lanes[l], 0, sizeof(lanes[l]));
+			continue;
+		}
+
+		md5_lane_init(&lanes[l], msgs[l].in, msgs[l].inlen, prefix_len);
+		if (lanes[l].blocks > blocks) blocks = lanes[l].blocks;
+	}
+
+	for (w = 0; w < 4; w++) {
+		for (l = 0; l < FR_MD5_MULTI_LANES; l++) state[w][l] = init[w];
+	}
+
+	for (i = 0; i < blocks; i++) {
+		for (l = 0; l < FR_MD5_MULTI_LANES; l++) {
+			md5_lane_t	*lane = &lanes[l];
+			uint8_t const	*block;
+
+			/*
+			 *	Lanes which have finished still go
+			 *	through the transform, but the mask
+			 *	stops their state changing.
+			 */
+			if (i >= lane->blocks) {
+				mask[l] = 0;
+				block = lane->tail;
+			} else {
+				mask[l] = UINT32_MAX;
+				block = md5_lane_block(lane, i);
+			}
+
+			for (w = 0; w < MD5_BLOCK_LENGTH / 4; w++) {
+				in[w][l] = (uint32_t)(block[w * 4 + 0]) |
+					   (uint32_t)(block[w * 4 + 1]) <<  8 |
+					   (uint32_t)(block[w * 4 + 2]) << 16 |
+					   (uint32_t)(block[w * 4 + 3]) << 24;
+			}
+		}
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+
+		MD5_ROUNDS(a, b, c, d, in);
+
+		state[0] += a & mask;
+		state[1] += b & mask;
+		state[2] += c & mask;
+		state[3] += d & mask;
+	}
+
+	for (l = 0; l < num; l++) {
+		for (w = 0; w < 4; w++) PUT_32BIT_LE(msgs[l].out + w * 4, state[w][l]);
+	}
+}
+#endif
+
+/** Calculate the MD5 hashes of many independent messages
+ *
+ * Where the compiler supports vector types, #FR_MD5_MULTI_LANES messages
+ * are hashed at once, one in each lane of a SIMD register.  This is much
+ * faster than hashing them one after another when there are several
+ * messages of similar length, such as the authenticators of a batch of
+ * RADIUS packets.
+ *
+ * @param[in] msgs	to hash.  Each digest is written to msgs[i].out.
+ * @param[in] num	number of messages.
+ * @param[in] prefix	Optional #MD5_BLOCK_LENGTH bytes of data to hash
+ *			before every message, e.g. the padded key of an HMAC.
+ *			May be NULL.
+ */
+void fr_md5_calc_multi(fr_md5_multi_t const msgs[], size_t num, uint8_t const *prefix)
+{
+	uint32_t	init[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint64_t	prefix_len = 0;
+	size_t		i;
+
+	/*
+	 *	The prefix is the same for every message,
+	 *	so only hash it once.
+	 */
+	if (prefix) {
+		fr_md5_local_transform(init, prefix);
+		prefix_len = MD5_BLOCK_LENGTH;
+	}
+
+#ifdef HAVE_MD5_MULTI
+	for (i = 0; (i + 1) < num; i += FR_MD5_MULTI_LANES) {
+		md5_multi_lanes(msgs + i, ((num - i) < FR_MD5_MULTI_LANES) ? (num - i) : FR_MD5_MULTI_LANES,
+				init, prefix_len);
+	}
+
+	/*
+	 *	One message left over isn't worth the
+	 *	overhead of the lanes.
+	 */
+	if (i >= num) return;
+#else
+	i = 0;
+#endif
+
+	for (; i < num; i++) md5_single(&msgs[i], init, prefix_len);
+}
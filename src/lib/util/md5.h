@@ -25,8 +25,27 @@ extern "C" {
 #  define MD5_DIGEST_LENGTH 16
 #endif
 
+#ifndef MD5_BLOCK_LENGTH
+#  define MD5_BLOCK_LENGTH 64
+#endif
+
+/** How many messages fr_md5_calc_multi() hashes at once
+ *
+ * Eight 32bit lanes fill an AVX2 register, or two SSE2 or NEON registers.
+ */
+#define FR_MD5_MULTI_LANES	(8)
+
 typedef void fr_md5_ctx_t;
 
+/** One of a batch of messages to hash
+ *
+ */
+typedef struct {
+	uint8_t const	*in;			//!< Data to hash.
+	size_t		inlen;			//!< Length of the data.
+	uint8_t		*out;			//!< Where to write the #MD5_DIGEST_LENGTH byte digest.
+} fr_md5_multi_t;
+
 /* md5.c */
 
 /** Reset the ctx to allow reuse
@@ -84,9 +103,13 @@ extern		fr_md5_final_t		fr_md5_final;
  */
 void		fr_md5_calc(uint8_t out[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen);
 
+void		fr_md5_calc_multi(fr_md5_multi_t const msgs[], size_t num, uint8_t const *prefix);
+
 /* hmac.c */
 void		fr_hmac_md5(uint8_t digest[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
 			    uint8_t const *key, size_t key_len);
+
+void		fr_hmac_md5_multi(fr_md5_multi_t const msgs[], size_t num, uint8_t const *key, size_t key_len);
 #ifdef __cplusplus
 }
 #endif
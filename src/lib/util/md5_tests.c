@@ -0,0 +1,131 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/util/md5.h>
+
+#define MD5_TEST_MAX_LEN	(300)
+
+static uint8_t	md5_test_data[MD5_TEST_MAX_LEN];
+
+static void md5_test_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(md5_test_data); i++) md5_test_data[i] = (i * 7) + 3;
+}
+
+/** Hash batches of every size, with messages of every length, and compare against fr_md5_calc()
+ *
+ */
+static void md5_test_multi(void)
+{
+	fr_md5_multi_t	msgs[FR_MD5_MULTI_LANES * 2 + 1];
+	uint8_t		out[NUM_ELEMENTS(msgs)][MD5_DIGEST_LENGTH];
+	uint8_t		expected[MD5_DIGEST_LENGTH];
+	size_t		num, i, len = 0;
+
+	md5_test_init();
+
+	for (num = 1; num <= NUM_ELEMENTS(msgs); num++) {
+		for (i = 0; i < num; i++) {
+			msgs[i] = (fr_md5_multi_t){
+				.in = md5_test_data,
+				.inlen = len,
+				.out = out[i]
+			};
+			len = (len + 13) % (MD5_TEST_MAX_LEN + 1);
+		}
+
+		fr_md5_calc_multi(msgs, num, NULL);
+
+		for (i = 0; i < num; i++) {
+			fr_md5_calc(expected, msgs[i].in, msgs[i].inlen);
+			TEST_CHECK(memcmp(expected, out[i], sizeof(expected)) == 0);
+			TEST_MSG("batch %zu, message %zu, length %zu", num, i, msgs[i].inlen);
+		}
+	}
+}
+
+/** Check all the lengths around the block and padding boundaries
+ *
+ */
+static void md5_test_multi_boundaries(void)
+{
+	fr_md5_multi_t	msgs[FR_MD5_MULTI_LANES];
+	uint8_t		out[FR_MD5_MULTI_LANES][MD5_DIGEST_LENGTH];
+	uint8_t		prefix[MD5_BLOCK_LENGTH];
+	uint8_t		expected[MD5_DIGEST_LENGTH];
+	size_t		i, len;
+	fr_md5_ctx_t	*ctx;
+
+	md5_test_init();
+	memset(prefix, 0x5a, sizeof(prefix));
+
+	for (len = 48; len < 136; len += FR_MD5_MULTI_LANES) {
+		for (i = 0; i < FR_MD5_MULTI_LANES; i++) {
+			msgs[i] = (fr_md5_multi_t){
+				.in = md5_test_data,
+				.inlen = len + i,
+				.out = out[i]
+			};
+		}
+
+		fr_md5_calc_multi(msgs, FR_MD5_MULTI_LANES, prefix);
+
+		for (i = 0; i < FR_MD5_MULTI_LANES; i++) {
+			ctx = fr_md5_ctx_alloc(true);
+			fr_md5_update(ctx, prefix, sizeof(prefix));
+			fr_md5_update(ctx, msgs[i].in, msgs[i].inlen);
+			fr_md5_final(expected, ctx);
+			fr_md5_ctx_free(&ctx);
+
+			TEST_CHECK(memcmp(expected, out[i], sizeof(expected)) == 0);
+			TEST_MSG("prefixed, length %zu", msgs[i].inlen);
+		}
+	}
+}
+
+static void md5_test_hmac_multi(void)
+{
+	fr_md5_multi_t	msgs[FR_MD5_MULTI_LANES + 3];
+	uint8_t		out[NUM_ELEMENTS(msgs)][MD5_DIGEST_LENGTH];
+	uint8_t		expected[MD5_DIGEST_LENGTH];
+	uint8_t		long_key[MD5_BLOCK_LENGTH + 16];
+	size_t		i;
+
+	/*
+	 *	RFC 2104 test vector.
+	 */
+	msgs[0] = (fr_md5_multi_t){
+		.in = (uint8_t const *)"what do ya want for nothing?",
+		.inlen = 28,
+		.out = out[0]
+	};
+	fr_hmac_md5_multi(msgs, 1, (uint8_t const *)"Jefe", 4);
+	TEST_CHECK(memcmp(out[0], "\x75\x0c\x78\x3e\x6a\xb0\xb5\x03\xea\xa8\x6e\x31\x0a\x5d\xb7\x38", 16) == 0);
+
+	md5_test_init();
+	memset(long_key, 0x0b, sizeof(long_key));
+
+	for (i = 0; i < NUM_ELEMENTS(msgs); i++) {
+		msgs[i] = (fr_md5_multi_t){
+			.in = md5_test_data,
+			.inlen = 20 + (i * 17),
+			.out = out[i]
+		};
+	}
+
+	fr_hmac_md5_multi(msgs, NUM_ELEMENTS(msgs), long_key, sizeof(long_key));
+
+	for (i = 0; i < NUM_ELEMENTS(msgs); i++) {
+		fr_hmac_md5(expected, msgs[i].in, msgs[i].inlen, long_key, sizeof(long_key));
+		TEST_CHECK(memcmp(expected, out[i], sizeof(expected)) == 0);
+		TEST_MSG("hmac, length %zu", msgs[i].inlen);
+	}
+}
+
+TEST_LIST = {
+	{ "md5_test_multi",		md5_test_multi			},
+	{ "md5_test_multi_boundaries",	md5_test_multi_boundaries	},
+	{ "md5_test_hmac_multi",	md5_test_hmac_multi		},
+	{ NULL }
+};
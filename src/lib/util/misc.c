@@ -41,6 +41,10 @@ RCSID("$Id$")
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 #define FR_PUT_LE16(a, val)\
 	do {\
 		a[1] = ((uint16_t) (val)) >> 8;\
@@ -160,6 +164,48 @@ int rad_unlockfd(int fd, int lock_len)
 
 static char const hextab[] = "0123456789abcdef";
 
+#ifdef __SSE2__
+/** Convert 16 hex chars to their values
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if any of the chars aren't hex digits.
+ */
+static inline int hex_nibbles(__m128i *out, __m128i c)
+{
+	__m128i lc = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lc, _mm_set1_epi8('f' + 1)));
+
+	if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff) return -1;
+
+	/*
+	 *	Digits have their value in the low nibble, and
+	 *	letters have their value minus 9.
+	 */
+	*out = _mm_add_epi8(_mm_and_si128(c, _mm_set1_epi8(0x0f)), _mm_and_si128(alpha, _mm_set1_epi8(9)));
+
+	return 0;
+}
+
+/** Join pairs of nibbles into bytes
+ *
+ */
+static inline __m128i hex_join(__m128i n)
+{
+	return _mm_or_si128(_mm_and_si128(_mm_slli_epi16(n, 4), _mm_set1_epi16(0x00f0)), _mm_srli_epi16(n, 8));
+}
+
+/** Convert nibble values to lowercase hex chars
+ *
+ */
+static inline __m128i hex_chars(__m128i n)
+{
+	return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')),
+			    _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10)));
+}
+#endif
+
 /** Convert hex strings to binary data
  *
  * @param bin Buffer to write output to.
@@ -181,7 +227,25 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
 	len = inlen >> 1;
 	if (len > outlen) len = outlen;
 
-	for (i = 0; i < len; i++) {
+	i = 0;
+
+#ifdef __SSE2__
+	/*
+	 *	32 chars at a time, until we find something which
+	 *	isn't hex.  The loop below finds exactly where.
+	 */
+	while ((len - i) >= 16) {
+		__m128i a, b;
+
+		if ((hex_nibbles(&a, _mm_loadu_si128((__m128i const *) (hex + (i << 1)))) < 0) ||
+		    (hex_nibbles(&b, _mm_loadu_si128((__m128i const *) (hex + (i << 1) + 16))) < 0)) break;
+
+		_mm_storeu_si128((__m128i *) (bin + i), _mm_packus_epi16(hex_join(a), hex_join(b)));
+		i += 16;
+	}
+#endif
+
+	for (; i < len; i++) {
 		if(!(c1 = memchr(hextab, tolower((int) hex[i << 1]), sizeof(hextab))) ||
 		   !(c2 = memchr(hextab, tolower((int) hex[(i << 1) + 1]), sizeof(hextab))))
 			break;
@@ -204,9 +268,23 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
  */
 size_t fr_bin2hex(char *hex, uint8_t const *bin, size_t inlen)
 {
-	size_t i;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	while ((inlen - i) >= 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *) bin);
+		__m128i hi = hex_chars(_mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f)));
+		__m128i lo = hex_chars(_mm_and_si128(v, _mm_set1_epi8(0x0f)));
+
+		_mm_storeu_si128((__m128i *) hex, _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *) (hex + 16), _mm_unpackhi_epi8(hi, lo));
+		hex += 32;
+		bin += 16;
+		i += 16;
+	}
+#endif
 
-	for (i = 0; i < inlen; i++) {
+	for (; i < inlen; i++) {
 		hex[0] = hextab[((*bin) >> 4) & 0x0f];
 		hex[1] = hextab[*bin & 0x0f];
 		hex += 2;
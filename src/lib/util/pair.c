@@ -57,18 +57,19 @@ static int _fr_pair_free(NDEBUG_UNUSED VALUE_PAIR *vp)
 	return 0;
 }
 
-/** Dynamically allocate a new attribute
- *
- * @param[in] ctx	Talloc ctx to allocate the pair in.
- * @return
- *	- A new #VALUE_PAIR.
- *	- NULL if an error occurred.
- */
-VALUE_PAIR *fr_pair_alloc(TALLOC_CTX *ctx)
+static inline CC_HINT(always_inline) VALUE_PAIR *pair_alloc(TALLOC_CTX *ctx, bool pooled)
 {
 	VALUE_PAIR *vp;
 
-	vp = talloc_zero(ctx, VALUE_PAIR);
+	/*
+	 *	Short string and octets values are then
+	 *	allocated from the pair's own pool.
+	 */
+	if (pooled) {
+		vp = talloc_zero_pooled_object(ctx, VALUE_PAIR, 1, FR_VALUE_BOX_POOL_SIZE);
+	} else {
+		vp = talloc_zero(ctx, VALUE_PAIR);
+	}
 	if (!vp) {
 		fr_strerror_printf("Out of memory");
 		return NULL;
@@ -83,6 +84,18 @@ VALUE_PAIR *fr_pair_alloc(TALLOC_CTX *ctx)
 	return vp;
 }
 
+/** Dynamically allocate a new attribute
+ *
+ * @param[in] ctx	Talloc ctx to allocate the pair in.
+ * @return
+ *	- A new #VALUE_PAIR.
+ *	- NULL if an error occurred.
+ */
+VALUE_PAIR *fr_pair_alloc(TALLOC_CTX *ctx)
+{
+	return pair_alloc(ctx, false);
+}
+
 /** Dynamically allocate a new attribute and fill in the da field
  *
  * Allocates a new attribute and a new dictionary attr if no DA is provided.
@@ -107,7 +120,7 @@ VALUE_PAIR *fr_pair_afrom_da(TALLOC_CTX *ctx, fr_dict_attr_t const *da)
 		return NULL;
 	}
 
-	vp = fr_pair_alloc(ctx);
+	vp = pair_alloc(ctx, (da->type == FR_TYPE_STRING) || (da->type == FR_TYPE_OCTETS));
 	if (!vp) {
 		fr_strerror_printf("Out of memory");
 		return NULL;
@@ -115,7 +128,8 @@ VALUE_PAIR *fr_pair_afrom_da(TALLOC_CTX *ctx, fr_dict_attr_t const *da)
 
 	/*
 	 *	If we get passed an unknown da, we need to ensure that
-	 *	it's parented by "vp".
+	 *	it's parented by "vp".  That includes interned
+	 *	unknowns, as the pair may outlive the thread.
 	 */
 	if (da->flags.is_unknown) {
 		fr_dict_attr_t const *unknown;
@@ -206,16 +220,9 @@ VALUE_PAIR *fr_pair_copy(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
 	n->type = vp->type;
 
 	/*
-	 *	Copy the unknown attribute hierarchy
+	 *	fr_pair_afrom_da() has already copied the unknown
+	 *	attribute hierarchy, so there's nothing more to do here.
 	 */
-	if (n->da->flags.is_unknown) {
-		n->da = fr_dict_unknown_acopy(n, n->da);
-		if (!n->da) {
-			talloc_free(n);
-			return NULL;
-		}
-	}
-
 
 	/*
 	 *	If it's an xlat, copy the raw string and return
@@ -253,6 +260,12 @@ void fr_pair_steal(TALLOC_CTX *ctx, VALUE_PAIR *vp)
 {
 	(void) talloc_steal(ctx, vp);
 
+	/*
+	 *	The VP may now outlive the buffer it points to, so
+	 *	give it its own copy.
+	 */
+	if (vp->data.shallow) (void) fr_value_box_unshare(vp, &vp->data);
+
 	/*
 	 *	The DA may be unknown.  If we're stealing the VPs to a
 	 *	different context, copy the unknown DA.  We use the VP
@@ -313,6 +326,14 @@ int fr_pair_to_unknown(VALUE_PAIR *vp)
 	da = fr_dict_unknown_afrom_fields(vp, vp->da->parent, fr_dict_vendor_num_by_da(vp->da), vp->da->attr);
 	if (!da) return -1;
 
+	/*
+	 *	The pair needs its own copy of interned attributes.
+	 */
+	if (da->flags.is_interned) {
+		da = fr_dict_unknown_acopy(vp, da);
+		if (!da) return -1;
+	}
+
 	fr_dict_unknown_free(&vp->da);	/* Only frees unknown attributes */
 	vp->da = da;
 
@@ -2452,6 +2473,12 @@ void fr_pair_verify(char const *file, int line, VALUE_PAIR const *vp)
 		size_t len;
 		TALLOC_CTX *parent;
 
+		/*
+		 *	The buffer belongs to someone else, so we
+		 *	can't check it.
+		 */
+		if (vp->data.shallow) break;
+
 		if (!talloc_get_type(vp->vp_ptr, uint8_t)) {
 			fr_fatal_assert_fail("CONSISTENCY CHECK FAILED %s[%u]: VALUE_PAIR \"%s\" data buffer type should be "
 					     "uint8_t but is %s\n", file, line, vp->da->name, talloc_get_name(vp->vp_ptr));
@@ -0,0 +1,353 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Index VALUE_PAIR lists by attribute
+ *
+ * The index is built the first time a list of #FR_PAIR_INDEX_THRESHOLD or
+ * more pairs is searched, and is then kept up to date as pairs are added
+ * and removed through the index.  Pairs appended to the list by other
+ * means, such as fr_pair_add(), are picked up the next time the index is
+ * used.  Each attribute maps to an array of the pairs of that attribute,
+ * in list order.
+ *
+ * @file src/lib/util/pair_index.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/pair_index.h>
+
+/** All of the pairs in a list with a particular attribute
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;		//!< Attribute of the pairs.
+	uint32_t		num;		//!< Number of pairs.
+	uint32_t		alloced;	//!< Size of the vps array.
+	VALUE_PAIR		**vps;		//!< Pairs, in list order.
+} pair_index_entry_t;
+
+struct fr_pair_index_s {
+	VALUE_PAIR		**list;		//!< List we're indexing.
+	VALUE_PAIR		*tail;		//!< Last pair in the list, so appends are O(1).
+	uint32_t		num;		//!< Number of pairs in the list.
+	fr_hash_table_t		*ht;		//!< Maps attributes to #pair_index_entry_t.
+						///< NULL until the index is built.
+};
+
+static uint32_t pair_index_hash(void const *data)
+{
+	pair_index_entry_t const *entry = data;
+
+	return fr_hash(&entry->da, sizeof(entry->da));
+}
+
+static int pair_index_cmp(void const *one, void const *two)
+{
+	pair_index_entry_t const *a = one, *b = two;
+
+	return (a->da > b->da) - (a->da < b->da);
+}
+
+static inline CC_HINT(always_inline) pair_index_entry_t *pair_index_entry(fr_pair_index_t *idx,
+									   fr_dict_attr_t const *da)
+{
+	return fr_hash_table_finddata(idx->ht, &(pair_index_entry_t){ .da = da });
+}
+
+/** Add a pair to the end of its attribute's entry
+ *
+ */
+static int pair_index_insert(fr_pair_index_t *idx, VALUE_PAIR *vp)
+{
+	pair_index_entry_t	*entry;
+
+	entry = pair_index_entry(idx, vp->da);
+	if (!entry) {
+		entry = talloc_zero(idx->ht, pair_index_entry_t);
+		if (!entry) return -1;
+
+		entry->da = vp->da;
+		if (!fr_hash_table_insert(idx->ht, entry)) {
+			talloc_free(entry);
+			return -1;
+		}
+	}
+
+	/*
+	 *	Grow in powers of two.
+	 */
+	if (entry->num == entry->alloced) {
+		VALUE_PAIR	**vps;
+		uint32_t	alloced = entry->alloced ? entry->alloced * 2 : 1;
+
+		vps = talloc_realloc(entry, entry->vps, VALUE_PAIR *, alloced);
+		if (!vps) return -1;
+		entry->vps = vps;
+		entry->alloced = alloced;
+	}
+	entry->vps[entry->num++] = vp;
+
+	return 0;
+}
+
+/** Pick up any pairs which were appended to the list by other means
+ *
+ */
+static inline CC_HINT(always_inline) void pair_index_sync(fr_pair_index_t *idx)
+{
+	VALUE_PAIR *vp;
+
+	for (vp = idx->tail ? idx->tail->next : *idx->list; vp; vp = vp->next) {
+		idx->tail = vp;
+		idx->num++;
+
+		if (idx->ht && (pair_index_insert(idx, vp) < 0)) TALLOC_FREE(idx->ht);
+	}
+}
+
+/** Build the index, or fail and leave the list unindexed
+ *
+ */
+static void pair_index_build(fr_pair_index_t *idx)
+{
+	VALUE_PAIR	*vp;
+
+	idx->ht = fr_hash_table_create(idx, pair_index_hash, pair_index_cmp, NULL);
+	if (!idx->ht) return;
+
+	for (vp = *idx->list; vp; vp = vp->next) {
+		if (pair_index_insert(idx, vp) < 0) {
+			TALLOC_FREE(idx->ht);
+			return;
+		}
+	}
+}
+
+/** Allocate an index for a list of pairs
+ *
+ * The index isn't built until the list is searched, and only if the list
+ * is long enough to make it worthwhile.
+ *
+ * @param[in] ctx	to allocate the index in.
+ * @param[in] list	to index.  Must remain valid for the lifetime of the index.
+ * @return
+ *	- The new index.
+ *	- NULL on error.
+ */
+fr_pair_index_t *fr_pair_index_alloc(TALLOC_CTX *ctx, VALUE_PAIR **list)
+{
+	fr_pair_index_t *idx;
+
+	idx = talloc_zero(ctx, fr_pair_index_t);
+	if (!idx) return NULL;
+
+	idx->list = list;
+	fr_pair_index_reset(idx);
+
+	return idx;
+}
+
+/** Discard the index, after the list has been modified by other means
+ *
+ * @param[in] idx	to reset.
+ */
+void fr_pair_index_reset(fr_pair_index_t *idx)
+{
+	VALUE_PAIR *vp;
+
+	TALLOC_FREE(idx->ht);
+
+	idx->num = 0;
+	idx->tail = NULL;
+	for (vp = *idx->list; vp; vp = vp->next) {
+		idx->tail = vp;
+		idx->num++;
+	}
+}
+
+/** Return the number of pairs in the list
+ *
+ */
+uint32_t fr_pair_index_num_elements(fr_pair_index_t *idx)
+{
+	pair_index_sync(idx);
+
+	return idx->num;
+}
+
+/** Add a pair, or a list of pairs, to the end of the list
+ *
+ * @param[in] idx	of the list to add to.
+ * @param[in] add	pair(s) to add.
+ */
+void fr_pair_index_add(fr_pair_index_t *idx, VALUE_PAIR *add)
+{
+	VALUE_PAIR *vp;
+
+	if (!add) return;
+
+	pair_index_sync(idx);
+
+	if (idx->tail) {
+		idx->tail->next = add;
+	} else {
+		*idx->list = add;
+	}
+
+	for (vp = add; vp; vp = vp->next) {
+		VP_VERIFY(vp);
+
+		idx->tail = vp;
+		idx->num++;
+
+		if (idx->ht && (pair_index_insert(idx, vp) < 0)) TALLOC_FREE(idx->ht);
+	}
+}
+
+/** Unlink a pair from the list, without freeing it
+ *
+ * @param[in] idx	of the list to remove the pair from.
+ * @param[in] vp	to remove.
+ * @return
+ *	- The pair which was removed.
+ *	- NULL if the pair wasn't in the list.
+ */
+VALUE_PAIR *fr_pair_index_remove(fr_pair_index_t *idx, VALUE_PAIR *vp)
+{
+	VALUE_PAIR	**last, *prev = NULL, *p;
+
+	pair_index_sync(idx);
+
+	for (last = idx->list, p = *last; p; prev = p, last = &p->next, p = *last) {
+		if (p == vp) break;
+	}
+	if (!p) return NULL;
+
+	*last = vp->next;
+	vp->next = NULL;
+	if (idx->tail == vp) idx->tail = prev;
+	idx->num--;
+
+	if (idx->ht) {
+		pair_index_entry_t	*entry;
+		uint32_t		i;
+
+		entry = pair_index_entry(idx, vp->da);
+		if (entry) for (i = 0; i < entry->num; i++) {
+			if (entry->vps[i] != vp) continue;
+
+			memmove(&entry->vps[i], &entry->vps[i + 1], sizeof(entry->vps[0]) * (entry->num - i - 1));
+			entry->num--;
+			break;
+		}
+	}
+
+	return vp;
+}
+
+/** Unlink a pair from the list, and free it
+ *
+ * @param[in] idx	of the list to remove the pair from.
+ * @param[in] vp	to delete.
+ */
+void fr_pair_index_delete(fr_pair_index_t *idx, VALUE_PAIR *vp)
+{
+	if (fr_pair_index_remove(idx, vp)) talloc_free(vp);
+}
+
+/** Find the first pair with a matching attribute and tag
+ *
+ * @param[in] idx	of the list to search.
+ * @param[in] da	to search for.
+ * @param[in] tag	to search for.  TAG_ANY matches any tag.
+ * @return
+ *	- The first matching pair.
+ *	- NULL if there are none.
+ */
+VALUE_PAIR *fr_pair_index_find_by_da(fr_pair_index_t *idx, fr_dict_attr_t const *da, int8_t tag)
+{
+	pair_index_entry_t	*entry;
+	uint32_t		i;
+
+	if (!da) return NULL;
+
+	pair_index_sync(idx);
+
+	if (!idx->ht && (idx->num >= FR_PAIR_INDEX_THRESHOLD)) pair_index_build(idx);
+
+	if (!idx->ht) {
+		VALUE_PAIR *vp;
+
+		for (vp = *idx->list; vp; vp = vp->next) {
+			if ((vp->da == da) && TAG_EQ(tag, vp->tag)) return vp;
+		}
+		return NULL;
+	}
+
+	entry = pair_index_entry(idx, da);
+	if (!entry) return NULL;
+
+	for (i = 0; i < entry->num; i++) {
+		if (TAG_EQ(tag, entry->vps[i]->tag)) return entry->vps[i];
+	}
+
+	return NULL;
+}
+
+/** Find the next pair after prev with the same attribute, and a matching tag
+ *
+ * @param[in] idx	of the list to search.
+ * @param[in] prev	pair returned by an earlier call to fr_pair_index_find_by_da()
+ *			or fr_pair_index_next_by_da().
+ * @param[in] tag	to search for.  TAG_ANY matches any tag.
+ * @return
+ *	- The next matching pair.
+ *	- NULL if there are no more.
+ */
+VALUE_PAIR *fr_pair_index_next_by_da(fr_pair_index_t *idx, VALUE_PAIR const *prev, int8_t tag)
+{
+	pair_index_entry_t	*entry;
+	uint32_t		i;
+
+	if (!prev) return NULL;
+
+	pair_index_sync(idx);
+
+	if (!idx->ht) {
+		VALUE_PAIR *vp;
+
+		for (vp = prev->next; vp; vp = vp->next) {
+			if ((vp->da == prev->da) && TAG_EQ(tag, vp->tag)) return vp;
+		}
+		return NULL;
+	}
+
+	entry = pair_index_entry(idx, prev->da);
+	if (!entry) return NULL;
+
+	for (i = 0; i < entry->num; i++) {
+		if (entry->vps[i] == prev) break;
+	}
+
+	for (i++; i < entry->num; i++) {
+		if (TAG_EQ(tag, entry->vps[i]->tag)) return entry->vps[i];
+	}
+
+	return NULL;
+}
@@ -0,0 +1,69 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Index VALUE_PAIR lists by attribute
+ *
+ * Finding an attribute in a list of pairs means walking the list.  For
+ * large lists which are searched many times, an index makes each lookup
+ * O(1) instead.
+ *
+ * @note Pairs appended to the list by other means are picked up, but the
+ *	 index doesn't know about any other changes made to the list by
+ *	 anything other than the fr_pair_index_* functions.  If pairs are
+ *	 removed or reordered by other means, call fr_pair_index_reset()
+ *	 before using the index again.
+ *
+ * @file src/lib/util/pair_index.h
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(pair_index_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+#include <freeradius-devel/util/pair.h>
+
+/** Lists shorter than this are searched linearly, and no index is built
+ *
+ */
+#define FR_PAIR_INDEX_THRESHOLD	(32)
+
+typedef struct fr_pair_index_s fr_pair_index_t;
+
+fr_pair_index_t	*fr_pair_index_alloc(TALLOC_CTX *ctx, VALUE_PAIR **list);
+
+void		fr_pair_index_reset(fr_pair_index_t *idx);
+
+uint32_t	fr_pair_index_num_elements(fr_pair_index_t *idx);
+
+void		fr_pair_index_add(fr_pair_index_t *idx, VALUE_PAIR *add);
+
+VALUE_PAIR	*fr_pair_index_remove(fr_pair_index_t *idx, VALUE_PAIR *vp);
+
+void		fr_pair_index_delete(fr_pair_index_t *idx, VALUE_PAIR *vp);
+
+VALUE_PAIR	*fr_pair_index_find_by_da(fr_pair_index_t *idx, fr_dict_attr_t const *da, int8_t tag);
+
+VALUE_PAIR	*fr_pair_index_next_by_da(fr_pair_index_t *idx, VALUE_PAIR const *prev, int8_t tag);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,137 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "pair_index.c"
+
+#define PAIR_INDEX_TEST_DAS	(8)
+#define PAIR_INDEX_TEST_SIZE	(100)
+
+static fr_dict_attr_t	test_da[PAIR_INDEX_TEST_DAS];
+
+/** Build a list where pair i has attribute i % PAIR_INDEX_TEST_DAS, and tag i % 3
+ *
+ */
+static VALUE_PAIR *pair_index_test_list(TALLOC_CTX *ctx, unsigned int num)
+{
+	VALUE_PAIR	*head = NULL, **last = &head;
+	unsigned int	i;
+
+	for (i = 0; i < num; i++) {
+		VALUE_PAIR *vp = talloc_zero(ctx, VALUE_PAIR);
+
+		vp->da = &test_da[i % PAIR_INDEX_TEST_DAS];
+		vp->tag = i % 3;
+		*last = vp;
+		last = &vp->next;
+	}
+
+	return head;
+}
+
+/** Check every lookup against a walk of the list
+ *
+ */
+static void pair_index_test_check(fr_pair_index_t *idx, VALUE_PAIR *head)
+{
+	unsigned int	i, count = 0;
+	VALUE_PAIR	*vp, *found;
+
+	for (vp = head; vp; vp = vp->next) count++;
+	TEST_CHECK(fr_pair_index_num_elements(idx) == count);
+
+	for (i = 0; i < PAIR_INDEX_TEST_DAS; i++) {
+		for (vp = head; vp && (vp->da != &test_da[i]); vp = vp->next);
+
+		for (found = fr_pair_index_find_by_da(idx, &test_da[i], TAG_ANY);
+		     found;
+		     found = fr_pair_index_next_by_da(idx, found, TAG_ANY)) {
+			TEST_CHECK(found == vp);
+			TEST_MSG("attribute %u out of order", i);
+
+			for (vp = vp->next; vp && (vp->da != &test_da[i]); vp = vp->next);
+		}
+		TEST_CHECK(vp == NULL);
+
+		for (vp = head; vp && ((vp->da != &test_da[i]) || (vp->tag != 2)); vp = vp->next);
+		TEST_CHECK(fr_pair_index_find_by_da(idx, &test_da[i], 2) == vp);
+	}
+}
+
+static void pair_index_test_small(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("pair_index_test");
+	VALUE_PAIR	*head = pair_index_test_list(ctx, FR_PAIR_INDEX_THRESHOLD - 1);
+	fr_pair_index_t	*idx;
+
+	idx = fr_pair_index_alloc(ctx, &head);
+	TEST_CHECK(idx != NULL);
+
+	pair_index_test_check(idx, head);
+	TEST_CHECK(idx->ht == NULL);
+
+	talloc_free(ctx);
+}
+
+static void pair_index_test_large(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("pair_index_test");
+	VALUE_PAIR	*head = pair_index_test_list(ctx, PAIR_INDEX_TEST_SIZE);
+	VALUE_PAIR	*vp, *next;
+	fr_pair_index_t	*idx;
+	unsigned int	i;
+
+	idx = fr_pair_index_alloc(ctx, &head);
+	TEST_CHECK(idx != NULL);
+
+	pair_index_test_check(idx, head);
+	TEST_CHECK(idx->ht != NULL);
+
+	/*
+	 *	Remove every third pair, which is the head, some
+	 *	tails, and everything in between.
+	 */
+	for (vp = head, i = 0; vp; vp = next, i++) {
+		next = vp->next;
+		if ((i % 3) == 0) fr_pair_index_delete(idx, vp);
+	}
+	TEST_CHECK(idx->ht != NULL);
+	pair_index_test_check(idx, head);
+
+	/*
+	 *	Add more, which have to go at the end.
+	 */
+	fr_pair_index_add(idx, pair_index_test_list(ctx, PAIR_INDEX_TEST_SIZE));
+	pair_index_test_check(idx, head);
+
+	/*
+	 *	Removing the tail still lets us append.
+	 */
+	for (vp = head; vp->next; vp = vp->next);
+	TEST_CHECK(fr_pair_index_remove(idx, vp) == vp);
+	TEST_CHECK(fr_pair_index_remove(idx, vp) == NULL);
+	fr_pair_index_add(idx, vp);
+	pair_index_test_check(idx, head);
+
+	/*
+	 *	Append behind the index's back, which it
+	 *	picks up without being reset.
+	 */
+	for (vp = head; vp->next; vp = vp->next);
+	vp->next = pair_index_test_list(ctx, PAIR_INDEX_TEST_DAS * 2);
+	pair_index_test_check(idx, head);
+	TEST_CHECK(idx->ht != NULL);
+
+	/*
+	 *	Modify the list behind the index's back.
+	 */
+	head = head->next;
+	fr_pair_index_reset(idx);
+	pair_index_test_check(idx, head);
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "pair_index_test_small",	pair_index_test_small	},
+	{ "pair_index_test_large",	pair_index_test_large	},
+	{ NULL }
+};
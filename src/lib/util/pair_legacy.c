@@ -83,6 +83,7 @@ alloc:
 		 *	Ensure that the DA is parented by the VP.
 		 */
 		da = fr_dict_unknown_afrom_fields(vp, fr_dict_root(fr_dict_internal()), vendor, attr);
+		if (da && da->flags.is_interned) da = fr_dict_unknown_acopy(vp, da);
 		if (!da) {
 			talloc_free(vp);
 			return NULL;
@@ -38,6 +38,10 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#  include <linux/if_packet.h>
+#endif
+
 #ifndef SIOCGIFHWADDR
 #  include <ifaddrs.h>
 #  include <net/if_dl.h>
@@ -363,6 +367,43 @@ int fr_pcap_open(fr_pcap_t *pcap)
 	return 0;
 }
 
+/** Add a live capture handle to a fanout group
+ *
+ * The kernel distributes packets between the members of a group using a symmetric hash of
+ * the flow, so packets travelling in either direction between two hosts are received by the
+ * same member.  Fragments are reassembled first, so they're hashed with the rest of the packet.
+ *
+ * @param pcap handle to add.  Must be an open live capture handle.
+ * @param group identifier shared by all members of the group.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, or if fanout isn't supported on this platform.
+ */
+int fr_pcap_fanout(fr_pcap_t *pcap, uint16_t group)
+{
+	if (!pcap->handle || (pcap->type != PCAP_INTERFACE_IN)) {
+		fr_strerror_printf("Fanout groups can only be joined by live capture handles");
+		return -1;
+	}
+
+#ifdef PACKET_FANOUT
+	{
+		int arg = group | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+
+		if (setsockopt(pcap->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+			fr_strerror_printf("Failed joining fanout group %u on %s: %s",
+					   group, pcap->name, fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+#else
+	fr_strerror_printf("Packet fanout is not supported on this platform");
+	return -1;
+#endif
+}
+
 /** Apply capture filter to an interface
  *
  * @param pcap handle to apply filter to.
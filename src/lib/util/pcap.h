@@ -102,6 +102,7 @@ struct fr_pcap {
 int		fr_pcap_if_link_layer(pcap_if_t *dev);
 fr_pcap_t	*fr_pcap_init(TALLOC_CTX *ctx, char const *name, fr_pcap_type_t type);
 int		fr_pcap_open(fr_pcap_t *handle);
+int		fr_pcap_fanout(fr_pcap_t *handle, uint16_t group);
 int		fr_pcap_apply_filter(fr_pcap_t *handle, char const *expression);
 char		*fr_pcap_device_names(TALLOC_CTX *ctx, fr_pcap_t *handle, char c);
 int		fr_pcap_mac_addr(uint8_t *macaddr, char *ifname);
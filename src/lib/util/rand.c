@@ -90,6 +90,11 @@ void fr_rand_seed(void const *data, size_t size)
 
 /** Return a 32-bit random number
  *
+ * The generator state is per thread, so this needs no locking.  The
+ * output is suitable for Request Authenticators, IDs and nonces.
+ *
+ * Callers which only need an unpredictable spread, such as load
+ * balancing, should use fr_fast_rand() with their own context.
  */
 uint32_t fr_rand(void)
 {
@@ -111,33 +116,40 @@ uint32_t fr_rand(void)
 	return num;
 }
 
+/** Fill a buffer with random data
+ *
+ * ISAAC generates 256 words at a time, so we copy straight from its
+ * output, instead of calling fr_rand() once per word.  Filling many
+ * authentication vectors is then a few memcpy()s and one call to
+ * fr_isaac() for every 1K of output.
+ *
+ * @param[out] start	of the buffer to fill.
+ * @param[in] length	of the buffer.
+ */
 void fr_rand_buffer(void *start, size_t length)
 {
-	uint32_t x;
-	uint8_t *buffer = start;
-	size_t buflen = length;
+	uint8_t *p = start;
 
-	if (buflen > 4) {
-		size_t i;
+	if (!fr_rand_initialized) fr_rand_seed(NULL, 0);
 
-		for (i = 0; i < buflen; i += 4) {
-			x = fr_rand();
-			memcpy(buffer + i, &x, sizeof(x));
-		}
+	while (length > 0) {
+		size_t todo = (256 - fr_rand_pool.randcnt) * sizeof(uint32_t);
+
+		if (todo > length) todo = length;
+
+		memcpy(p, &fr_rand_pool.randrsl[fr_rand_pool.randcnt], todo);
+		p += todo;
+		length -= todo;
 
 		/*
-		 *	Keep only the last bytes in the word.
+		 *	Discard the rest of a partially used word.
 		 */
-		i = buflen & ~0x03;
-		buffer += i;
-		buflen &= 0x03;
+		fr_rand_pool.randcnt += (todo + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+		if (fr_rand_pool.randcnt >= 256) {
+			fr_rand_pool.randcnt = 0;
+			fr_isaac(&fr_rand_pool);
+		}
 	}
-
-	if (!buflen) return;
-
-	x = fr_rand();
-
-	memcpy(buffer, &x, buflen);
 }
 
 /** Generate a random string
@@ -246,6 +258,10 @@ while (p < end) { \
 	}
 }
 
+/** Return a 32-bit number which is NOT suitable for cryptographic use
+ *
+ * @param[in] ctx	seeded with fr_rand(), and owned by one thread.
+ */
 uint32_t fr_fast_rand(fr_fast_rand_t *ctx)
 {
 	ctx->a = (36969 * (ctx->a & 0xffff)) + (ctx->a >> 16);
@@ -16,6 +16,15 @@
  */
 
 /** Functions to get randomness
+ *
+ * There are two generators:
+ *
+ *  - fr_rand(), fr_rand_buffer() and fr_rand_str() use ISAAC, with
+ *    state kept per thread.  Use these for anything an attacker must
+ *    not be able to predict, such as authenticators, IDs and nonces.
+ *  - fr_fast_rand() is a small multiply with carry generator, with
+ *    state owned by the caller.  Use it for load balancing, jitter
+ *    and tests, where speed matters more than unpredictability.
  *
  * @file src/lib/util/rand.h
  *
@@ -64,6 +64,84 @@ int fr_retry_init(fr_retry_t *r, fr_time_t now, fr_retry_config_t const *config)
 	return 0;
 }
 
+/** Initialize a retransmission counter using a round trip time estimate
+ *
+ * Once there are RTT samples for the destination, the first
+ * retransmission happens after the estimated RTO (+/- 10%), instead
+ * of after IRT.  The RTO is capped at MRT.  Later retransmissions back
+ * off exactly as with fr_retry_init().
+ *
+ * @param[in,out] r the retransmission structure
+ * @param now when the retransmission starts
+ * @param config the counters to track.  They shouldn't change while the retransmission is happening
+ * @param rtt the round trip time estimate for the destination.
+ */
+int fr_retry_init_rtt(fr_retry_t *r, fr_time_t now, fr_retry_config_t const *config, fr_retry_rtt_t const *rtt)
+{
+	fr_time_delta_t rto, jitter;
+
+	fr_retry_init(r, now, config);
+
+	if (!rtt->samples) return 0;
+
+	rto = rtt->rto;
+	if (config->mrt && (rto > config->mrt)) rto = config->mrt;
+
+	/*
+	 *	RT = RTO + RAND * RTO, with RAND in -0.1..+0.1
+	 */
+	jitter = rto / 5;
+	if (jitter > 0) rto += (fr_time_delta_t) (fr_rand() % (uint64_t) jitter) - (jitter / 2);
+
+	r->rt = rto;
+	r->next = now + rto;
+
+	return 0;
+}
+
+/** Update a round trip time estimate
+ *
+ * RFC 6298 Section 2.  The caller should only pass samples for
+ * packets which were never retransmitted (Karn's algorithm), as
+ * otherwise we can't tell which transmission the reply was for.
+ *
+ * @param[in,out] rtt the estimate to update.
+ * @param sample the measured round trip time.
+ */
+void fr_retry_rtt_update(fr_retry_rtt_t *rtt, fr_time_delta_t sample)
+{
+	fr_time_delta_t delta, rto;
+
+	if (sample <= 0) sample = 1;
+
+	if (!rtt->samples) {
+		/*
+		 *	SRTT = R, RTTVAR = R / 2
+		 */
+		rtt->srtt = sample;
+		rtt->rttvar = sample / 2;
+	} else {
+		/*
+		 *	RTTVAR = 3/4 * RTTVAR + 1/4 * |SRTT - R|
+		 *	SRTT = 7/8 * SRTT + 1/8 * R
+		 */
+		delta = rtt->srtt - sample;
+		if (delta < 0) delta = -delta;
+
+		rtt->rttvar = rtt->rttvar - (rtt->rttvar / 4) + (delta / 4);
+		rtt->srtt = rtt->srtt - (rtt->srtt / 8) + (sample / 8);
+	}
+	rtt->samples++;
+
+	/*
+	 *	RTO = SRTT + 4 * RTTVAR
+	 */
+	rto = rtt->srtt + (4 * rtt->rttvar);
+	if (rto < FR_RETRY_RTO_MIN) rto = FR_RETRY_RTO_MIN;
+
+	rtt->rto = rto;
+}
+
 /** Initialize a retransmission counter
  *
  * @param[in,out] r the retransmission structure
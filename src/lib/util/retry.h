@@ -45,6 +45,24 @@ typedef struct {
 	uint32_t		count;			//!< number of sent packets
 } fr_retry_t;
 
+/** Round trip time estimate for one destination
+ *
+ * Tracked as per RFC 6298, and used to pick the initial retransmission
+ * time instead of the fixed IRT.
+ */
+typedef struct {
+	fr_time_delta_t		srtt;			//!< Smoothed round trip time.
+	fr_time_delta_t		rttvar;			//!< Round trip time variation.
+	fr_time_delta_t		rto;			//!< Retransmission timeout derived from the above.
+	uint64_t		samples;		//!< Number of round trip times measured.
+} fr_retry_rtt_t;
+
+/*
+ *	Lower bound on the computed retransmission timeout.  The
+ *	upper bound is the MRT of the retransmission configuration.
+ */
+#define FR_RETRY_RTO_MIN	(NSEC / 10)
+
 /*
  *	Anything other than "CONTINUE" means "DONE".  For helpfulness,
  *	we return *why* the timer is done.
@@ -56,8 +74,12 @@ typedef enum {
 } fr_retry_state_t;
 
 int		fr_retry_init(fr_retry_t *r, fr_time_t now, fr_retry_config_t const *config) CC_HINT(nonnull);
+int		fr_retry_init_rtt(fr_retry_t *r, fr_time_t now, fr_retry_config_t const *config,
+				  fr_retry_rtt_t const *rtt) CC_HINT(nonnull);
 fr_retry_state_t fr_retry_next(fr_retry_t *r, fr_time_t now) CC_HINT(nonnull);
 
+void		fr_retry_rtt_update(fr_retry_rtt_t *rtt, fr_time_delta_t sample) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
@@ -33,6 +33,14 @@ RCSID("$Id$")
 #include <stdint.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define SBUFF_SCAN_SIMD
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>
+#  define SBUFF_SCAN_SIMD
+#endif
+
 _Thread_local char *sbuff_scratch;
 
 static_assert(sizeof(long long) >= sizeof(int64_t), "long long must be as wide or wider than an int64_t");
@@ -52,6 +60,187 @@ size_t sbuff_parse_error_table_len = NUM_ELEMENTS(sbuff_parse_error_table);
 #  define CHECK_SBUFF_INIT(_sbuff)
 #endif
 
+/** Whitespace, as matched by isspace() in the C locale
+ *
+ */
+static bool const sbuff_whitespace[UINT8_MAX + 1] = {
+	[' '] = true, ['\t'] = true, ['\n'] = true, ['\v'] = true, ['\f'] = true, ['\r'] = true
+};
+
+/** Find the first char in a range where table[char] == stop
+ *
+ * Scalar version, also used for the tail of the SIMD version.
+ */
+static inline CC_HINT(always_inline) char const *sbuff_scan_bytes(char const *p, char const *end,
+								 bool const table[static UINT8_MAX + 1], bool stop)
+{
+	while ((end - p) >= 4) {
+		if (table[(uint8_t)p[0]] == stop) return p;
+		if (table[(uint8_t)p[1]] == stop) return p + 1;
+		if (table[(uint8_t)p[2]] == stop) return p + 2;
+		if (table[(uint8_t)p[3]] == stop) return p + 3;
+		p += 4;
+	}
+
+	while ((p < end) && (table[(uint8_t)*p] != stop)) p++;
+
+	return p;
+}
+
+#ifdef SBUFF_SCAN_SIMD
+#define SBUFF_SCAN_SET_MAX	8	//!< More chars than this, and the compares cost more than the lookups.
+#define SBUFF_SCAN_MIN_LEN	64	//!< Less data than this, and we don't recover the setup cost.
+
+static_assert(sizeof(bool) == 1, "bool tables must be one byte per entry");
+
+/** The chars to compare against, 16 bytes at a time
+ *
+ * Most tables mark only a few chars (terminals, whitespace, quotes),
+ * or all but a few (allowed chars).  Either way, we can compare
+ * each block against those few chars, instead of looking each byte up
+ * in the table.
+ */
+typedef struct {
+	uint8_t		chr[SBUFF_SCAN_SET_MAX];	//!< Chars to compare against.
+	int		num;				//!< How many there are.
+	bool		in_set;				//!< Stop at the first char which is in chr,
+							///< otherwise stop at the first char which isn't.
+} sbuff_scan_set_t;
+
+/** Build a compare set from a table
+ *
+ * @return
+ *	- true if the table can be scanned with SIMD.
+ *	- false if too many chars would have to be compared.
+ */
+static bool sbuff_scan_set(sbuff_scan_set_t *set, bool const table[static UINT8_MAX + 1], bool stop)
+{
+	uint16_t	mask[16];
+	int		i, num = 0;
+	bool		want;
+
+	/*
+	 *	One bit per table entry.
+	 */
+	for (i = 0; i < 16; i++) {
+#ifdef __SSE2__
+		__m128i v = _mm_loadu_si128((__m128i const *) &table[i * 16]);
+
+		mask[i] = _mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_setzero_si128()));
+#else
+		int j;
+
+		mask[i] = 0;
+		for (j = 0; j < 16; j++) if (table[(i * 16) + j]) mask[i] |= (1 << j);
+#endif
+		num += __builtin_popcount(mask[i]);
+	}
+
+	/*
+	 *	Compare against whichever of the true or false
+	 *	entries there are fewer of.
+	 */
+	if (num <= SBUFF_SCAN_SET_MAX) {
+		want = true;
+	} else if ((256 - num) <= SBUFF_SCAN_SET_MAX) {
+		want = false;
+		num = 256 - num;
+	} else {
+		return false;
+	}
+
+	set->num = 0;
+	set->in_set = (want == stop);
+
+	for (i = 0; i < 16; i++) {
+		unsigned int bits = want ? mask[i] : (uint16_t) ~mask[i];
+
+		while (bits) {
+			set->chr[set->num++] = (i * 16) + __builtin_ctz(bits);
+			bits &= bits - 1;
+		}
+	}
+
+	return true;
+}
+
+/** Scan whole 16 byte blocks, stopping at the block containing a match
+ *
+ * @return where the scan stopped.  If it's less than 16 bytes from
+ *	the end, there was no match in the blocks scanned.
+ */
+static char const *sbuff_scan_simd(char const *p, char const *end, sbuff_scan_set_t const *set)
+{
+	int i;
+
+#ifdef __SSE2__
+	__m128i chr[SBUFF_SCAN_SET_MAX];
+
+	for (i = 0; i < set->num; i++) chr[i] = _mm_set1_epi8((char) set->chr[i]);
+
+	while ((end - p) >= 16) {
+		__m128i		v = _mm_loadu_si128((__m128i const *) p);
+		__m128i		m = _mm_setzero_si128();
+		unsigned int	bits;
+
+		for (i = 0; i < set->num; i++) m = _mm_or_si128(m, _mm_cmpeq_epi8(v, chr[i]));
+
+		bits = _mm_movemask_epi8(m);
+		if (!set->in_set) bits = ~bits & 0xffff;
+		if (bits) return p + __builtin_ctz(bits);
+
+		p += 16;
+	}
+#else
+	uint8x16_t chr[SBUFF_SCAN_SET_MAX];
+
+	for (i = 0; i < set->num; i++) chr[i] = vdupq_n_u8(set->chr[i]);
+
+	while ((end - p) >= 16) {
+		uint8x16_t	v = vld1q_u8((uint8_t const *) p);
+		uint8x16_t	m = vdupq_n_u8(0);
+
+		for (i = 0; i < set->num; i++) m = vorrq_u8(m, vceqq_u8(v, chr[i]));
+		if (!set->in_set) m = vmvnq_u8(m);
+
+		/*
+		 *	A match somewhere in the block.  Let the
+		 *	caller find exactly where.
+		 */
+		if (vmaxvq_u8(m)) return p;
+
+		p += 16;
+	}
+#endif
+
+	return p;
+}
+#endif
+
+/** Find the first char in a range where table[char] == stop
+ *
+ * Long ranges are scanned 16 bytes at a time with SSE2 or NEON, if
+ * the table allows it.
+ *
+ * @param[in] p		Where to start.
+ * @param[in] end	Of the range.
+ * @param[in] table	of chars.
+ * @param[in] stop	Value of table[char] to stop at.
+ * @return where the first matching char is, or end.
+ */
+static inline char const *sbuff_scan(char const *p, char const *end, bool const table[static UINT8_MAX + 1], bool stop)
+{
+#ifdef SBUFF_SCAN_SIMD
+	sbuff_scan_set_t set;
+
+	if (((end - p) >= SBUFF_SCAN_MIN_LEN) && sbuff_scan_set(&set, table, stop)) {
+		p = sbuff_scan_simd(p, end, &set);
+	}
+#endif
+
+	return sbuff_scan_bytes(p, end, table, stop);
+}
+
 /** Update all markers and pointers in the set of sbuffs to point to new_buff
  *
  * This function should be used if the underlying buffer is realloced.
@@ -517,10 +706,9 @@ size_t fr_sbuff_out_bstrncpy_allowed(char *out, size_t outlen, fr_sbuff_t *in, s
 
 	end = p + len;
 
-	while ((p < end) && allowed_chars[(uint8_t)*p]) *out_p++ = *p++;
-	*out_p = '\0';
-
-	copied = (p - in->p);
+	copied = sbuff_scan(p, end, allowed_chars, false) - p;
+	memcpy(out_p, p, copied);
+	out_p[copied] = '\0';
 
 	fr_sbuff_advance(in, copied);
 
@@ -560,10 +748,9 @@ size_t fr_sbuff_out_bstrncpy_until(char *out, size_t outlen, fr_sbuff_t *in, siz
 
 	end = p + len;
 
-	while ((p < end) && !until[(uint8_t)*p]) *out_p++ = *p++;
-	*out_p = '\0';
-
-	copied = (p - in->p);
+	copied = sbuff_scan(p, end, until, true) - p;
+	memcpy(out_p, p, copied);
+	out_p[copied] = '\0';
 
 	fr_sbuff_advance(in, copied);
 
@@ -974,13 +1161,9 @@ bool fr_sbuff_adv_past_strcase(fr_sbuff_t *sbuff, char const *needle, size_t len
  */
 size_t fr_sbuff_adv_past_whitespace(fr_sbuff_t *sbuff)
 {
-	char const *p = sbuff->p;
-
 	CHECK_SBUFF_INIT(sbuff);
 
-	while ((p < sbuff->end) && isspace(*(sbuff->p))) p++;
-
-	return fr_sbuff_set(sbuff, p);
+	return fr_sbuff_set(sbuff, sbuff_scan(sbuff->p, sbuff->end, sbuff_whitespace, false));
 }
 
 /** Wind position to first instance of specified multibyte utf8 char
@@ -339,6 +339,180 @@ static void test_talloc_extend_with_marker(void)
 	TEST_SBUFF_LEN(&sbuff_0, 5);
 }
 
+static void test_bstrncpy_until(void)
+{
+	char const	*str;
+	char		out[256];
+	char		in[200];
+	fr_sbuff_t	sbuff;
+	bool		until[UINT8_MAX + 1] = { ['"'] = true, ['\\'] = true };
+	size_t		i;
+
+	TEST_CASE("Copy until a terminal");
+	str = "i am a \"test\" string";
+	fr_sbuff_init(&sbuff, str, strlen(str));
+	TEST_CHECK(fr_sbuff_out_bstrncpy_until(out, sizeof(out), &sbuff, SIZE_MAX, until) == 7);
+	TEST_CHECK(strcmp(out, "i am a ") == 0);
+	TEST_CHECK(*sbuff.p == '"');
+
+	TEST_CASE("Copy until a terminal - No terminal");
+	str = "i am a test string";
+	fr_sbuff_init(&sbuff, str, strlen(str));
+	TEST_CHECK(fr_sbuff_out_bstrncpy_until(out, sizeof(out), &sbuff, SIZE_MAX, until) == 18);
+	TEST_CHECK(strcmp(out, "i am a test string") == 0);
+
+	/*
+	 *	Long enough to be scanned in blocks, with the
+	 *	terminal at every position in and around them.
+	 */
+	for (i = 0; i < sizeof(in); i++) {
+		memset(in, 'a', sizeof(in));
+		in[i] = '\\';
+
+		TEST_CASE("Copy until a terminal - Long input");
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		TEST_CHECK(fr_sbuff_out_bstrncpy_until(out, sizeof(out), &sbuff, SIZE_MAX, until) == i);
+		TEST_MSG("Terminal at %zu", i);
+		TEST_CHECK(sbuff.p == in + i);
+	}
+
+	TEST_CASE("Copy until a terminal - Long input, no terminal, truncated by len");
+	memset(in, 'a', sizeof(in));
+	fr_sbuff_init(&sbuff, in, sizeof(in));
+	TEST_CHECK(fr_sbuff_out_bstrncpy_until(out, sizeof(out), &sbuff, 150, until) == 150);
+	TEST_CHECK(strlen(out) == 150);
+}
+
+static void test_bstrncpy_allowed(void)
+{
+	char const	*str;
+	char		out[256];
+	char		in[200];
+	fr_sbuff_t	sbuff;
+	bool		allowed[UINT8_MAX + 1];
+	size_t		i;
+
+	for (i = 0; i < NUM_ELEMENTS(allowed); i++) allowed[i] = isalnum((int) i) || (i == '-') || (i == '_');
+
+	TEST_CASE("Copy allowed chars");
+	str = "Attr-Name.child";
+	fr_sbuff_init(&sbuff, str, strlen(str));
+	TEST_CHECK(fr_sbuff_out_bstrncpy_allowed(out, sizeof(out), &sbuff, SIZE_MAX, allowed) == 9);
+	TEST_CHECK(strcmp(out, "Attr-Name") == 0);
+	TEST_CHECK(*sbuff.p == '.');
+
+	for (i = 0; i < sizeof(in); i++) {
+		memset(in, 'x', sizeof(in));
+		in[i] = ' ';
+
+		TEST_CASE("Copy allowed chars - Long input");
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		TEST_CHECK(fr_sbuff_out_bstrncpy_allowed(out, sizeof(out), &sbuff, SIZE_MAX, allowed) == i);
+		TEST_MSG("Disallowed char at %zu", i);
+	}
+
+	/*
+	 *	Everything but a few chars is allowed.
+	 */
+	for (i = 0; i < NUM_ELEMENTS(allowed); i++) allowed[i] = (i != '\0') && (i != ',') && (i != '\n');
+
+	for (i = 0; i < sizeof(in); i++) {
+		memset(in, ' ', sizeof(in));
+		in[i] = ',';
+
+		TEST_CASE("Copy allowed chars - Long input, mostly allowed");
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		TEST_CHECK(fr_sbuff_out_bstrncpy_allowed(out, sizeof(out), &sbuff, SIZE_MAX, allowed) == i);
+		TEST_MSG("Disallowed char at %zu", i);
+	}
+}
+
+static void test_adv_past_whitespace(void)
+{
+	char const	*str;
+	char		in[200];
+	fr_sbuff_t	sbuff;
+	size_t		i;
+
+	TEST_CASE("Skip whitespace");
+	str = " \t\r\n foo";
+	fr_sbuff_init(&sbuff, str, strlen(str));
+	TEST_CHECK(fr_sbuff_adv_past_whitespace(&sbuff) == 5);
+	TEST_CHECK(*sbuff.p == 'f');
+
+	TEST_CASE("Skip whitespace - None");
+	str = "foo ";
+	fr_sbuff_init(&sbuff, str, strlen(str));
+	TEST_CHECK(fr_sbuff_adv_past_whitespace(&sbuff) == 0);
+	TEST_CHECK(sbuff.p == sbuff.start);
+
+	TEST_CASE("Skip whitespace - All");
+	str = " \t ";
+	fr_sbuff_init(&sbuff, str, strlen(str));
+	TEST_CHECK(fr_sbuff_adv_past_whitespace(&sbuff) == 3);
+	TEST_CHECK(sbuff.p == sbuff.end);
+
+	for (i = 0; i < sizeof(in); i++) {
+		memset(in, ' ', sizeof(in));
+		in[i] = 'x';
+
+		TEST_CASE("Skip whitespace - Long input");
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		TEST_CHECK(fr_sbuff_adv_past_whitespace(&sbuff) == i);
+		TEST_MSG("Non-whitespace at %zu", i);
+	}
+}
+
+#define SBUFF_BENCH_LEN		(4096)
+#define SBUFF_BENCH_ROUNDS	(100000)
+
+static uint64_t sbuff_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/** Throughput of the scanning copies, over long strings
+ *
+ */
+static void test_scan_bench(void)
+{
+	static char	in[SBUFF_BENCH_LEN + 1];
+	static char	out[SBUFF_BENCH_LEN + 1];
+	fr_sbuff_t	sbuff;
+	bool		until[UINT8_MAX + 1] = { ['"'] = true, ['\\'] = true, ['$'] = true };
+	bool		allowed[UINT8_MAX + 1];
+	uint64_t	start, elapsed;
+	size_t		i, total;
+
+	for (i = 0; i < NUM_ELEMENTS(allowed); i++) allowed[i] = isalnum((int) i) || (i == '-') || (i == '_');
+	for (i = 0; i < SBUFF_BENCH_LEN; i++) in[i] = 'a' + (i % 26);
+	in[SBUFF_BENCH_LEN] = '"';
+
+	total = 0;
+	start = sbuff_bench_now();
+	for (i = 0; i < SBUFF_BENCH_ROUNDS; i++) {
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		total += fr_sbuff_out_bstrncpy_until(out, sizeof(out), &sbuff, SIZE_MAX, until);
+	}
+	elapsed = sbuff_bench_now() - start;
+	TEST_CHECK(total == (size_t) SBUFF_BENCH_LEN * SBUFF_BENCH_ROUNDS);
+	printf("\n\tuntil   %8.1f MB/s", (double) total * 1000 / (elapsed ? elapsed : 1));
+
+	total = 0;
+	start = sbuff_bench_now();
+	for (i = 0; i < SBUFF_BENCH_ROUNDS; i++) {
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		total += fr_sbuff_out_bstrncpy_allowed(out, sizeof(out), &sbuff, SIZE_MAX, allowed);
+	}
+	elapsed = sbuff_bench_now() - start;
+	TEST_CHECK(total == (size_t) SBUFF_BENCH_LEN * SBUFF_BENCH_ROUNDS);
+	printf("\n\tallowed %8.1f MB/s\n", (double) total * 1000 / (elapsed ? elapsed : 1));
+}
+
 TEST_LIST = {
 	/*
 	 *	Basic tests
@@ -357,5 +531,13 @@ TEST_LIST = {
 
 	{ "fr_sbuff_no_advance",		test_no_advance },
 
+	/*
+	 *	Scanning
+	 */
+	{ "fr_sbuff_out_bstrncpy_until",	test_bstrncpy_until },
+	{ "fr_sbuff_out_bstrncpy_allowed",	test_bstrncpy_allowed },
+	{ "fr_sbuff_adv_past_whitespace",	test_adv_past_whitespace },
+	{ "fr_sbuff_scan_bench",		test_scan_bench },
+
 	{ NULL }
 };
@@ -44,6 +44,10 @@
 
 #include <ifaddrs.h>
 
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+#  include <linux/filter.h>
+#endif
+
 /** Resolve a named service to a port
  *
  * @param[in] proto	The protocol. Either IPPROTO_TCP or IPPROTO_UDP.
@@ -1051,3 +1055,67 @@ done:
 #endif
 	return 0;
 }
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+/** Steer packets to sockets in a SO_REUSEPORT group by source IP address
+ *
+ * Attaches a classic BPF program to the reuseport group which the
+ * socket is a member of.  The program selects the socket by taking
+ * the last 32 bits of the source IP address, modulo the number of
+ * sockets in the group.  Packets from one source IP therefore always
+ * arrive on the same socket, for as long as the group membership
+ * doesn't change.
+ *
+ * @param[in] sockfd	a bound member of the reuseport group.
+ * @param[in] af	address family of the group, AF_INET or AF_INET6.
+ * @param[in] num	the number of sockets in the group.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_socket_reuseport_steer(int sockfd, int af, uint32_t num)
+{
+	struct sock_filter	code[3];
+	struct sock_fprog	prog;
+	uint32_t		offset;
+
+	switch (af) {
+	case AF_INET:
+		offset = 12;	/* ip_src */
+		break;
+
+	case AF_INET6:
+		offset = 20;	/* last word of ip6_src */
+		break;
+
+	default:
+		fr_strerror_printf("Can't steer packets for address family %d", af);
+		return -1;
+	}
+
+	if (num < 2) return 0;
+
+	/*
+	 *	A = ntohl(src_ip), A %= num, return A
+	 */
+	code[0] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + offset);
+	code[1] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num);
+	code[2] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+	prog.len = NUM_ELEMENTS(code);
+	prog.filter = code;
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed attaching reuseport steering program: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+#else
+int fr_socket_reuseport_steer(UNUSED int sockfd, UNUSED int af, UNUSED uint32_t num)
+{
+	fr_strerror_printf("Steering packets in a reuseport group is not supported on this system");
+	return -1;
+}
+#endif
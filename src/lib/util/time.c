@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/autoconf.h>
 #include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/sbuff.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/time.h>
@@ -53,6 +54,16 @@ USES_APPLE_DEPRECATED_API
 
 #include <stdatomic.h>
 
+/*
+ *	The TSC clock needs an invariant TSC, and 128 bit
+ *	multiplies to convert ticks to nanoseconds.
+ */
+#if defined(HAVE_CLOCK_GETTIME) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define HAVE_TSC_CLOCK
+#  include <cpuid.h>
+#  include <x86intrin.h>
+#endif
+
 static _Atomic int64_t			our_realtime;	//!< realtime at the start of the epoch in nanoseconds.
 static char const			*tz_names[2] = { NULL, NULL };	//!< normal, DST, from localtime_r(), tm_zone
 static long				gmtoff[2] = {0, 0};	       	//!< from localtime_r(), tm_gmtoff
@@ -65,6 +76,114 @@ static mach_timebase_info_data_t	timebase;
 static uint64_t				our_mach_epoch;
 #endif
 
+#ifdef HAVE_TSC_CLOCK
+/** Parameters for converting TSC ticks to fr_time_t
+ *
+ * Written by fr_time_sync(), and read by every thread in fr_time().
+ * The sequence number is odd while the parameters are being changed.
+ */
+typedef struct {
+	_Atomic uint32_t	seq;		//!< Sequence lock.
+	_Atomic uint64_t	tsc;		//!< TSC at the last resync.
+	_Atomic int64_t		when;		//!< fr_time() at the last resync.
+	_Atomic uint64_t	mult;		//!< Nanoseconds per tick, as a 32.32 fixed point number.
+} fr_time_tsc_t;
+
+static fr_time_tsc_t			tsc_clock;
+static bool				tsc_enabled;	//!< Only changed before threads are started.
+static uint64_t				tsc_last;	//!< TSC when CLOCK_MONOTONIC was last sampled.
+static int64_t				mono_last;	//!< CLOCK_MONOTONIC when it was last sampled.
+#endif
+
+#ifdef HAVE_TSC_CLOCK
+static inline int64_t mono_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return fr_time_delta_from_timespec(&ts) - our_epoch;
+}
+
+/** Sample the TSC and CLOCK_MONOTONIC as close together as possible
+ *
+ */
+static inline void tsc_sample(uint64_t *tsc, int64_t *mono)
+{
+	unsigned int aux;
+
+	*tsc = __rdtscp(&aux);
+	*mono = mono_now();
+}
+
+static inline fr_time_t tsc_time(void)
+{
+	uint32_t	seq;
+	uint64_t	tsc, base, mult;
+	int64_t		when;
+	unsigned int	aux;
+
+	do {
+		seq = atomic_load_explicit(&tsc_clock.seq, memory_order_acquire);
+		base = atomic_load_explicit(&tsc_clock.tsc, memory_order_relaxed);
+		when = atomic_load_explicit(&tsc_clock.when, memory_order_relaxed);
+		mult = atomic_load_explicit(&tsc_clock.mult, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) || (seq != atomic_load_explicit(&tsc_clock.seq, memory_order_relaxed)));
+
+	tsc = __rdtscp(&aux);
+	if (tsc < base) return when;
+
+	return when + (int64_t) (((unsigned __int128) (tsc - base) * mult) >> 32);
+}
+
+static void tsc_publish(uint64_t tsc, int64_t when, uint64_t mult)
+{
+	uint32_t seq = atomic_load_explicit(&tsc_clock.seq, memory_order_relaxed);
+
+	atomic_store_explicit(&tsc_clock.seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&tsc_clock.tsc, tsc, memory_order_relaxed);
+	atomic_store_explicit(&tsc_clock.when, when, memory_order_relaxed);
+	atomic_store_explicit(&tsc_clock.mult, mult, memory_order_relaxed);
+
+	atomic_store_explicit(&tsc_clock.seq, seq + 2, memory_order_release);
+}
+
+/** Recalibrate the TSC clock against CLOCK_MONOTONIC
+ *
+ * The rate is measured over the time since the last resync.  The TSC
+ * time is never stepped backwards.  If it has drifted ahead of
+ * CLOCK_MONOTONIC, the new rate is slowed so that they meet again at
+ * the next resync.
+ */
+static void tsc_resync(void)
+{
+	uint64_t	tsc, ticks;
+	int64_t		mono, elapsed, now, target;
+
+	tsc_sample(&tsc, &mono);
+
+	ticks = tsc - tsc_last;
+	elapsed = mono - mono_last;
+	if ((tsc <= tsc_last) || (elapsed <= 0)) return;
+
+	/*
+	 *	Where the clock is now, and where it should be when
+	 *	the same time has elapsed again.
+	 */
+	now = tsc_time();
+	if (now < mono) now = mono;
+	target = mono + elapsed;
+	if (target <= now) target = now + 1;
+
+	tsc_publish(tsc, now, (uint64_t) ((((unsigned __int128) (target - now)) << 32) / ticks));
+
+	tsc_last = tsc;
+	mono_last = mono;
+}
+#endif
+
 /** Get a new our_realtime value
  *
  * Should be done regularly to adjust for changes in system time.
@@ -104,6 +223,10 @@ int fr_time_sync(void)
 				      memory_order_release);
 
 		now = ts_realtime.tv_sec;
+
+#ifdef HAVE_TSC_CLOCK
+		if (tsc_enabled) tsc_resync();
+#endif
 	}
 #else
 	{
@@ -138,6 +261,61 @@ int fr_time_sync(void)
 	return 0;
 }
 
+/** Use the TSC as the source for fr_time()
+ *
+ * Reading the TSC is cheaper than calling clock_gettime(), and it
+ * doesn't depend on the hypervisor providing a fast vDSO clock.  The
+ * TSC is calibrated against CLOCK_MONOTONIC here, and fr_time_sync()
+ * keeps it in step.  So fr_time_sync() MUST be called regularly
+ * (about once a second) while the TSC clock is in use.
+ *
+ * MUST be called before any other threads are started, and after
+ * fr_time_start().
+ *
+ * @param[in] enable	whether to use the TSC.
+ * @return
+ *	- true if fr_time() uses the TSC.
+ *	- false if it doesn't, either because enable was false, or
+ *	  because the CPU doesn't advertise an invariant TSC.
+ */
+bool fr_time_use_tsc(bool enable)
+{
+#ifdef HAVE_TSC_CLOCK
+	unsigned int		eax, ebx, ecx, edx;
+	uint64_t		tsc;
+	int64_t			mono;
+	struct timespec		delay = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+
+	tsc_enabled = false;
+	if (!enable) return false;
+
+	/*
+	 *	CPUID.80000007H:EDX[8] is "invariant TSC".  It runs
+	 *	at a constant rate in all power states, and is
+	 *	synchronised across cores.
+	 */
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) return false;
+
+	/*
+	 *	Initial calibration.  fr_time_sync() refines it.
+	 */
+	tsc_sample(&tsc_last, &mono_last);
+	(void) nanosleep(&delay, NULL);
+	tsc_sample(&tsc, &mono);
+
+	if ((tsc <= tsc_last) || (mono <= mono_last)) return false;
+
+	tsc_publish(tsc, mono, (uint64_t) ((((unsigned __int128) (mono - mono_last)) << 32) / (tsc - tsc_last)));
+	tsc_last = tsc;
+	mono_last = mono;
+	tsc_enabled = true;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
 /** Initialize the local time.
  *
  *  MUST be called when the program starts.  MUST NOT be called after
@@ -177,6 +355,11 @@ fr_time_t fr_time(void)
 {
 #ifdef HAVE_CLOCK_GETTIME
 	struct timespec ts;
+
+#  ifdef HAVE_TSC_CLOCK
+	if (tsc_enabled) return tsc_time();
+#  endif
+
 	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
 	return fr_time_delta_from_timespec(&ts) - our_epoch;
 #else  /* __MACH__ is defined */
@@ -189,6 +372,28 @@ fr_time_t fr_time(void)
 #endif
 }
 
+/** Return a relative time since the server our_epoch, with millisecond precision
+ *
+ *  This is cheaper than fr_time().  On Linux it reads the time the
+ *  kernel cached at the last clock tick.  It may be a few milliseconds
+ *  behind fr_time(), so it should only be used where that doesn't
+ *  matter, such as for statistics and coarse timeouts.  It should
+ *  not be compared with times from fr_time().
+ *
+ * @returns fr_time_t time in nanoseconds since the server our_epoch.
+ */
+fr_time_t fr_time_coarse(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC_COARSE)
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return fr_time_delta_from_timespec(&ts) - our_epoch;
+#else
+	return fr_time();
+#endif
+}
+
 /** Nanoseconds since the Unix Epoch the last time we synced internal time with wallclock time
  *
  */
@@ -627,3 +832,123 @@ void fr_time_elapsed_fprint(FILE *fp, fr_time_elapsed_t const *elapsed, char con
 		}
 	}
 }
+
+/** Map a time delta to its histogram bucket
+ *
+ */
+static inline unsigned int time_histogram_bucket(fr_time_delta_t delta)
+{
+	uint64_t	value = (uint64_t) delta;
+	unsigned int	bits;
+
+	if (value < FR_TIME_HISTOGRAM_SUB) return value;
+
+	bits = fr_high_bit_pos(value) - 1;
+	if (bits >= FR_TIME_HISTOGRAM_MAX_BITS) return FR_TIME_HISTOGRAM_BUCKETS - 1;
+
+	return ((bits - FR_TIME_HISTOGRAM_SUB_BITS + 1) << FR_TIME_HISTOGRAM_SUB_BITS) +
+	       ((value >> (bits - FR_TIME_HISTOGRAM_SUB_BITS)) & (FR_TIME_HISTOGRAM_SUB - 1));
+}
+
+/** Return the largest value which maps to a histogram bucket
+ *
+ */
+static inline fr_time_delta_t time_histogram_bucket_max(unsigned int bucket)
+{
+	unsigned int group, sub;
+
+	bucket++;
+	if (bucket < FR_TIME_HISTOGRAM_SUB) return bucket - 1;
+
+	group = bucket >> FR_TIME_HISTOGRAM_SUB_BITS;
+	sub = bucket & (FR_TIME_HISTOGRAM_SUB - 1);
+
+	return (((fr_time_delta_t) (FR_TIME_HISTOGRAM_SUB + sub)) << (group - 1)) - 1;
+}
+
+/** Record a value in a latency histogram
+ *
+ * @param[in] hist	to update.
+ * @param[in] delta	to record.  Negative values are recorded as zero.
+ */
+void fr_time_histogram_add(fr_time_histogram_t *hist, fr_time_delta_t delta)
+{
+	if (delta < 0) delta = 0;
+
+	hist->bucket[time_histogram_bucket(delta)]++;
+	hist->count++;
+	if (delta > hist->max) hist->max = delta;
+}
+
+/** Add the values from one histogram to another
+ *
+ * @param[in,out] out	histogram to add values to.
+ * @param[in] in	histogram to read values from.
+ */
+void fr_time_histogram_merge(fr_time_histogram_t *out, fr_time_histogram_t const *in)
+{
+	unsigned int i;
+
+	if (!in->count) return;
+
+	for (i = 0; i < FR_TIME_HISTOGRAM_BUCKETS; i++) out->bucket[i] += in->bucket[i];
+
+	out->count += in->count;
+	if (in->max > out->max) out->max = in->max;
+}
+
+/** Return the value which a given percentage of recorded values are less than or equal to
+ *
+ * The value returned is the upper bound of the bucket the percentile falls into,
+ * capped at the largest value recorded.
+ *
+ * @param[in] hist	to examine.
+ * @param[in] pct	percentile, from 0 to 100.
+ * @return the percentile, or 0 if no values have been recorded.
+ */
+fr_time_delta_t fr_time_histogram_percentile(fr_time_histogram_t const *hist, double pct)
+{
+	uint64_t	target, seen = 0;
+	unsigned int	i;
+
+	if (!hist->count) return 0;
+
+	if (pct <= 0) pct = 0;
+	if (pct >= 100) return hist->max;
+
+	target = (uint64_t) ((hist->count * pct) / 100.0);
+	if (target < 1) target = 1;
+
+	for (i = 0; i < FR_TIME_HISTOGRAM_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= target) {
+			fr_time_delta_t value = time_histogram_bucket_max(i);
+
+			return (value < hist->max) ? value : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+/** Print the count, common percentiles, and maximum of a histogram
+ *
+ * Times are printed in microseconds.
+ */
+void fr_time_histogram_fprint(FILE *fp, fr_time_histogram_t const *hist, char const *prefix)
+{
+	static double const	pct[] = { 50, 90, 99, 99.9 };
+	static char const	*pct_names[] = { "p50", "p90", "p99", "p99.9" };
+	size_t			i;
+
+	if (!prefix) prefix = "latency";
+
+	fprintf(fp, "%s.count\t%" PRIu64 "\n", prefix, hist->count);
+	if (!hist->count) return;
+
+	for (i = 0; i < NUM_ELEMENTS(pct); i++) {
+		fprintf(fp, "%s.%s\t%" PRIu64 "us\n", prefix, pct_names[i],
+			(uint64_t) fr_time_histogram_percentile(hist, pct[i]) / 1000);
+	}
+	fprintf(fp, "%s.max\t%" PRIu64 "us\n", prefix, (uint64_t) hist->max / 1000);
+}
@@ -83,12 +83,35 @@ typedef struct {
 	uint64_t	array[8];		//!< 100ns to 100s
 } fr_time_elapsed_t;
 
+#define FR_TIME_HISTOGRAM_SUB_BITS	3						//!< log2 of the linear sub-buckets per power of 2.
+#define FR_TIME_HISTOGRAM_SUB		(1 << FR_TIME_HISTOGRAM_SUB_BITS)
+#define FR_TIME_HISTOGRAM_MAX_BITS	40						//!< 2^40ns, or ~18 minutes.
+#define FR_TIME_HISTOGRAM_BUCKETS	((FR_TIME_HISTOGRAM_MAX_BITS - FR_TIME_HISTOGRAM_SUB_BITS + 1) * \
+					 FR_TIME_HISTOGRAM_SUB)
+
+/** A log-linear latency histogram
+ *
+ * Each power of two is split into #FR_TIME_HISTOGRAM_SUB linear buckets,
+ * so any recorded value is accurate to within 12.5%.  Values larger than
+ * 2^#FR_TIME_HISTOGRAM_MAX_BITS nanoseconds are recorded in the last bucket.
+ *
+ * Histograms are not thread safe.  They should be updated by one thread,
+ * and merged with #fr_time_histogram_merge when the totals are needed.
+ */
+typedef struct {
+	uint64_t	count;					//!< Number of values recorded.
+	fr_time_delta_t	max;					//!< Largest value recorded.
+	uint64_t	bucket[FR_TIME_HISTOGRAM_BUCKETS];
+} fr_time_histogram_t;
+
 #define NSEC	(1000000000)
 #define USEC	(1000000)
 
 int fr_time_start(void);
 int fr_time_sync(void);
+bool fr_time_use_tsc(bool enable);
 fr_time_t fr_time(void);
+fr_time_t fr_time_coarse(void);
 
 /*
  *	Need cast because of difference in sign
@@ -208,6 +231,11 @@ size_t		fr_time_strftime_utc(fr_sbuff_t *out, fr_time_t time, char const *fmt)
 void		fr_time_elapsed_update(fr_time_elapsed_t *elapsed, fr_time_t start, fr_time_t end) CC_HINT(nonnull);
 void		fr_time_elapsed_fprint(FILE *fp, fr_time_elapsed_t const *elapsed, char const *prefix, int tabs) CC_HINT(nonnull(1,2));
 
+void		fr_time_histogram_add(fr_time_histogram_t *hist, fr_time_delta_t delta) CC_HINT(nonnull);
+void		fr_time_histogram_merge(fr_time_histogram_t *out, fr_time_histogram_t const *in) CC_HINT(nonnull);
+fr_time_delta_t	fr_time_histogram_percentile(fr_time_histogram_t const *hist, double pct) CC_HINT(nonnull);
+void		fr_time_histogram_fprint(FILE *fp, fr_time_histogram_t const *hist, char const *prefix) CC_HINT(nonnull(1,2));
+
 #ifdef __cplusplus
 }
 #endif
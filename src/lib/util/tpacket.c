@@ -0,0 +1,476 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Memory mapped AF_PACKET rings, for reading and writing link layer frames
+ *
+ * Frames are read in blocks straight out of a receive ring shared with the
+ * kernel, so there's no system call or copy per frame.  Frames being sent
+ * are queued in a transmit ring, and handed to the kernel with a single
+ * system call by fr_tpacket_flush().
+ *
+ * @file src/lib/util/tpacket.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/stdatomic.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/tpacket.h>
+
+#ifdef HAVE_TPACKET_V3
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBPCAP
+#  include <pcap.h>
+#endif
+
+/*
+ *	Where the frame data starts in a transmit slot.
+ */
+#define TPACKET_TX_DATA_OFFSET	(TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+struct fr_tpacket_s {
+	int			fd;			//!< AF_PACKET socket.
+	int			if_index;		//!< Interface the socket is bound to.
+
+	uint8_t			*map;			//!< Both rings, as mapped from the kernel.
+	size_t			map_len;		//!< Length of the mapping.
+
+	uint8_t			*rx_ring;		//!< Start of the receive ring.
+	uint32_t		block_size;		//!< Size of each receive block.
+	uint32_t		num_blocks;		//!< Number of receive blocks.
+	uint32_t		block;			//!< Block we're reading, or will read next.
+	bool			holding;		//!< Whether we own "block".
+	uint32_t		remaining;		//!< Frames in "block" which haven't been returned.
+	struct tpacket3_hdr	*pkt;			//!< Next frame to return from "block".
+
+	uint8_t			*tx_ring;		//!< Start of the transmit ring.  NULL if there isn't one.
+	uint32_t		frame_size;		//!< Size of each transmit slot.
+	uint32_t		num_tx_frames;		//!< Number of transmit slots.
+	uint32_t		tx_next;		//!< Next transmit slot to fill.
+	uint32_t		tx_queued;		//!< Frames queued since the last flush.
+};
+
+static int _tpacket_free(fr_tpacket_t *t)
+{
+	if (t->map) munmap(t->map, t->map_len);
+	if (t->fd >= 0) close(t->fd);
+
+	return 0;
+}
+
+static inline CC_HINT(always_inline) struct tpacket_block_desc *tpacket_block(fr_tpacket_t const *t, uint32_t i)
+{
+	return (struct tpacket_block_desc *)(t->rx_ring + ((size_t) i * t->block_size));
+}
+
+static inline CC_HINT(always_inline) struct tpacket3_hdr *tpacket_tx_slot(fr_tpacket_t const *t, uint32_t i)
+{
+	return (struct tpacket3_hdr *)(t->tx_ring + ((size_t) i * t->frame_size));
+}
+
+/** Open an AF_PACKET socket, and map its rings
+ *
+ * @param[in] ctx		to allocate the handle in.
+ * @param[in] interface		to bind to.
+ * @param[in] protocol		Ethertype to receive, in host byte order.  ETH_P_ALL for all frames.
+ * @param[in] filter		Kernel BPF program, attached before any frames are received.
+ *				May be NULL.
+ * @param[in] conf		Size of the rings.  Zeroed fields take their default value.
+ * @return
+ *	- A new handle on success.
+ *	- NULL on failure.
+ */
+fr_tpacket_t *fr_tpacket_open(TALLOC_CTX *ctx, char const *interface, uint16_t protocol,
+			      struct sock_fprog const *filter, fr_tpacket_config_t const *conf)
+{
+	fr_tpacket_t		*t;
+	struct tpacket_req3	req;
+	struct sockaddr_ll	ll;
+	int			version = TPACKET_V3;
+	long			page_size = sysconf(_SC_PAGESIZE);
+	size_t			rx_len, tx_len = 0;
+	uint32_t		frames_per_block;
+
+	t = talloc_zero(ctx, fr_tpacket_t);
+	if (!t) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	t->fd = -1;
+	talloc_set_destructor(t, _tpacket_free);
+
+	t->block_size = conf->block_size ? conf->block_size : FR_TPACKET_BLOCK_SIZE_DEFAULT;
+	t->num_blocks = conf->num_blocks ? conf->num_blocks : FR_TPACKET_NUM_BLOCKS_DEFAULT;
+	t->frame_size = conf->frame_size ? conf->frame_size : FR_TPACKET_FRAME_SIZE_DEFAULT;
+
+	if ((page_size <= 0) || (t->block_size % page_size) || (t->block_size & (t->block_size - 1))) {
+		fr_strerror_printf("Ring block size %u must be a power of 2, and a multiple of the page size",
+				   t->block_size);
+		goto error;
+	}
+
+	if ((t->frame_size < TPACKET3_HDRLEN) || (t->frame_size > t->block_size) ||
+	    (t->frame_size % TPACKET_ALIGNMENT)) {
+		fr_strerror_printf("Ring frame size %u must be between %zu and %u, and a multiple of %u",
+				   t->frame_size, (size_t) TPACKET3_HDRLEN, t->block_size, TPACKET_ALIGNMENT);
+		goto error;
+	}
+
+	t->if_index = if_nametoindex(interface);
+	if (!t->if_index) {
+		fr_strerror_printf("Unknown interface \"%s\"", interface);
+		goto error;
+	}
+
+	/*
+	 *	Protocol 0 means nothing is received until the
+	 *	socket is bound, by which time the rings and
+	 *	filter are in place.
+	 */
+	t->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (t->fd < 0) {
+		fr_strerror_printf("Failed opening packet socket: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (setsockopt(t->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		fr_strerror_printf("Failed selecting TPACKET_V3: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (filter && (setsockopt(t->fd, SOL_SOCKET, SO_ATTACH_FILTER, filter, sizeof(*filter)) < 0)) {
+		fr_strerror_printf("Failed attaching packet filter: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	/*
+	 *	The frame size for a TPACKET_V3 receive ring is
+	 *	nominal, frames are packed into each block.
+	 */
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = t->block_size;
+	req.tp_block_nr = t->num_blocks;
+	req.tp_frame_size = FR_TPACKET_FRAME_SIZE_DEFAULT;
+	req.tp_frame_nr = (t->block_size / req.tp_frame_size) * t->num_blocks;
+	req.tp_retire_blk_tov = conf->block_timeout ? fr_time_delta_to_msec(conf->block_timeout) : 10;
+	if (!req.tp_retire_blk_tov) req.tp_retire_blk_tov = 1;
+
+	if (setsockopt(t->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		fr_strerror_printf("Failed creating receive ring: %s", fr_syserror(errno));
+		goto error;
+	}
+	rx_len = (size_t) t->block_size * t->num_blocks;
+
+	if (conf->num_tx_frames) {
+		frames_per_block = t->block_size / t->frame_size;
+
+		memset(&req, 0, sizeof(req));
+		req.tp_block_size = t->block_size;
+		req.tp_block_nr = (conf->num_tx_frames + (frames_per_block - 1)) / frames_per_block;
+		req.tp_frame_size = t->frame_size;
+		req.tp_frame_nr = req.tp_block_nr * frames_per_block;
+
+		if (setsockopt(t->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+			fr_strerror_printf("Failed creating transmit ring: %s", fr_syserror(errno));
+			goto error;
+		}
+		t->num_tx_frames = req.tp_frame_nr;
+		tx_len = (size_t) t->block_size * req.tp_block_nr;
+	}
+
+	/*
+	 *	The transmit ring is always mapped straight after
+	 *	the receive ring.
+	 */
+	t->map_len = rx_len + tx_len;
+	t->map = mmap(NULL, t->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+	if (t->map == MAP_FAILED) {
+		t->map = NULL;
+		fr_strerror_printf("Failed mapping packet rings: %s", fr_syserror(errno));
+		goto error;
+	}
+	t->rx_ring = t->map;
+	if (tx_len) t->tx_ring = t->map + rx_len;
+
+	memset(&ll, 0, sizeof(ll));
+	ll.sll_family = AF_PACKET;
+	ll.sll_protocol = htons(protocol);
+	ll.sll_ifindex = t->if_index;
+
+	if (bind(t->fd, (struct sockaddr *) &ll, sizeof(ll)) < 0) {
+		fr_strerror_printf("Failed binding packet socket to %s: %s", interface, fr_syserror(errno));
+		goto error;
+	}
+
+	return t;
+
+error:
+	talloc_free(t);
+	return NULL;
+}
+
+/** Return the file descriptor to insert into the event loop
+ *
+ * The descriptor is readable whenever there's a block ready in the
+ * receive ring.
+ */
+int fr_tpacket_fd(fr_tpacket_t const *t)
+{
+	return t->fd;
+}
+
+#ifdef HAVE_LIBPCAP
+/** Compile a pcap filter expression into a kernel BPF program
+ *
+ * @param[in] ctx		to allocate the program in.
+ * @param[out] out		Where to write the program.  out->filter must be freed
+ *				with talloc_free().
+ * @param[in] expression	in pcap-filter(7) syntax.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_tpacket_filter_compile(TALLOC_CTX *ctx, struct sock_fprog *out, char const *expression)
+{
+	pcap_t			*handle;
+	struct bpf_program	prog;
+	size_t			i;
+
+	handle = pcap_open_dead(DLT_EN10MB, UINT16_MAX);
+	if (!handle) {
+		fr_strerror_printf("Failed allocating pcap handle");
+		return -1;
+	}
+
+	if (pcap_compile(handle, &prog, expression, 1, PCAP_NETMASK_UNKNOWN) < 0) {
+		fr_strerror_printf("Failed compiling filter \"%s\": %s", expression, pcap_geterr(handle));
+		pcap_close(handle);
+		return -1;
+	}
+
+	out->filter = talloc_array(ctx, struct sock_filter, prog.bf_len);
+	if (!out->filter) {
+		fr_strerror_printf("Out of memory");
+		pcap_freecode(&prog);
+		pcap_close(handle);
+		return -1;
+	}
+	out->len = prog.bf_len;
+
+	for (i = 0; i < prog.bf_len; i++) {
+		out->filter[i].code = prog.bf_insns[i].code;
+		out->filter[i].jt = prog.bf_insns[i].jt;
+		out->filter[i].jf = prog.bf_insns[i].jf;
+		out->filter[i].k = prog.bf_insns[i].k;
+	}
+
+	pcap_freecode(&prog);
+	pcap_close(handle);
+
+	return 0;
+}
+#endif
+
+/** Give the block we've finished reading back to the kernel
+ *
+ * Called by fr_tpacket_recv(), but callers should also call it once they've
+ * finished with the last frame returned, so that the kernel isn't kept
+ * waiting for the block.
+ */
+void fr_tpacket_recv_done(fr_tpacket_t *t)
+{
+	struct tpacket_block_desc *bd;
+
+	if (!t->holding || t->remaining) return;
+
+	bd = tpacket_block(t, t->block);
+
+	/*
+	 *	Don't let the kernel have the block back while
+	 *	there are still reads from it in flight.
+	 */
+	atomic_thread_fence(memory_order_release);
+	bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+	t->holding = false;
+	t->block = (t->block + 1) % t->num_blocks;
+}
+
+/** Return the next frame from the receive ring
+ *
+ * @param[in] t		to read from.
+ * @param[out] frame	Start of the link layer header.  Only valid until the next call
+ *			to fr_tpacket_recv() or fr_tpacket_recv_done().
+ * @param[out] when	the kernel received the frame.  May be NULL.
+ * @return
+ *	- >0 the length of the frame.
+ *	- 0 if there are no frames ready.
+ */
+ssize_t fr_tpacket_recv(fr_tpacket_t *t, uint8_t const **frame, fr_time_t *when)
+{
+	struct tpacket3_hdr	*pkt;
+
+	fr_tpacket_recv_done(t);
+
+	while (!t->holding) {
+		struct tpacket_block_desc *bd = tpacket_block(t, t->block);
+
+		if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) return 0;
+
+		/*
+		 *	Don't read the frames until we know the
+		 *	kernel has finished writing them.
+		 */
+		atomic_thread_fence(memory_order_acquire);
+
+		t->holding = true;
+		t->remaining = bd->hdr.bh1.num_pkts;
+		t->pkt = (struct tpacket3_hdr *)((uint8_t *) bd + bd->hdr.bh1.offset_to_first_pkt);
+
+		fr_tpacket_recv_done(t);	/* Empty block */
+	}
+
+	pkt = t->pkt;
+	if (--t->remaining) t->pkt = (struct tpacket3_hdr *)((uint8_t *) pkt + pkt->tp_next_offset);
+
+	if (when) {
+		struct timespec ts = { .tv_sec = pkt->tp_sec, .tv_nsec = pkt->tp_nsec };
+
+		*when = fr_time_from_timespec(&ts);
+	}
+
+	*frame = (uint8_t const *) pkt + pkt->tp_mac;
+
+	return pkt->tp_snaplen;
+}
+
+/** How many frames are ready to be read without waiting for the kernel
+ *
+ */
+unsigned int fr_tpacket_recv_pending(fr_tpacket_t const *t)
+{
+	struct tpacket_block_desc *bd;
+
+	if (t->remaining) return t->remaining;
+
+	bd = tpacket_block(t, t->holding ? ((t->block + 1) % t->num_blocks) : t->block);
+	if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) return 0;
+
+	return bd->hdr.bh1.num_pkts;
+}
+
+/** Reserve the next slot in the transmit ring
+ *
+ * @param[in] t		to write to.
+ * @param[out] len	The maximum length of the frame.
+ * @return
+ *	- Where to write the frame, starting with the link layer header.
+ *	- NULL if there's no transmit ring, or it's full.
+ */
+uint8_t *fr_tpacket_send_reserve(fr_tpacket_t *t, size_t *len)
+{
+	struct tpacket3_hdr *slot;
+
+	if (!t->tx_ring) {
+		fr_strerror_printf("No transmit ring");
+		return NULL;
+	}
+
+	slot = tpacket_tx_slot(t, t->tx_next);
+	switch (slot->tp_status) {
+	case TP_STATUS_AVAILABLE:
+		break;
+
+	/*
+	 *	The kernel didn't like the last frame written to
+	 *	this slot.  It's discarded, and the slot reused.
+	 */
+	case TP_STATUS_WRONG_FORMAT:
+		slot->tp_status = TP_STATUS_AVAILABLE;
+		break;
+
+	default:
+		fr_strerror_printf("Transmit ring is full");
+		return NULL;
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	*len = t->frame_size - TPACKET_TX_DATA_OFFSET;
+
+	return (uint8_t *) slot + TPACKET_TX_DATA_OFFSET;
+}
+
+/** Queue the frame written to the slot returned by fr_tpacket_send_reserve()
+ *
+ * @param[in] t		to write to.
+ * @param[in] len	of the frame.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_tpacket_send_commit(fr_tpacket_t *t, size_t len)
+{
+	struct tpacket3_hdr *slot = tpacket_tx_slot(t, t->tx_next);
+
+	if (len > (t->frame_size - TPACKET_TX_DATA_OFFSET)) {
+		fr_strerror_printf("Frame is too large (%zu > %zu)", len, t->frame_size - TPACKET_TX_DATA_OFFSET);
+		return -1;
+	}
+
+	slot->tp_len = len;
+	slot->tp_snaplen = len;
+	slot->tp_next_offset = 0;
+
+	/*
+	 *	The frame must be visible to the kernel before
+	 *	it's told it can send it.
+	 */
+	atomic_thread_fence(memory_order_release);
+	slot->tp_status = TP_STATUS_SEND_REQUEST;
+
+	t->tx_next = (t->tx_next + 1) % t->num_tx_frames;
+	t->tx_queued++;
+
+	return 0;
+}
+
+/** Tell the kernel to send the queued frames
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_tpacket_flush(fr_tpacket_t *t)
+{
+	if (!t->tx_queued) return 0;
+
+	t->tx_queued = 0;
+
+	if ((send(t->fd, NULL, 0, MSG_DONTWAIT) < 0) && (errno != EAGAIN) && (errno != ENOBUFS)) {
+		fr_strerror_printf("Failed flushing transmit ring: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+#endif
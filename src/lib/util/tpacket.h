@@ -0,0 +1,93 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Memory mapped AF_PACKET rings, for reading and writing link layer frames
+ *
+ * @file src/lib/util/tpacket.h
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(tpacket_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+#include <freeradius-devel/util/time.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <talloc.h>
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#  include <linux/if_packet.h>
+#  include <linux/filter.h>
+#  ifdef TPACKET3_HDRLEN
+#    define HAVE_TPACKET_V3 1
+#  endif
+#endif
+
+#ifdef HAVE_TPACKET_V3
+/** Sizes of the rings shared with the kernel
+ *
+ */
+typedef struct {
+	uint32_t		block_size;		//!< Size of each receive block.  Must be a multiple of
+							///< the page size, and a power of 2.
+	uint32_t		num_blocks;		//!< Number of receive blocks.
+	fr_time_delta_t		block_timeout;		//!< How long the kernel waits before handing over a
+							///< block which isn't full.
+	uint32_t		frame_size;		//!< Size of each transmit frame.
+	uint32_t		num_tx_frames;		//!< Number of transmit frames.  0 means no transmit ring.
+} fr_tpacket_config_t;
+
+/** An AF_PACKET socket with TPACKET_V3 receive (and optionally transmit) rings
+ *
+ */
+typedef struct fr_tpacket_s fr_tpacket_t;
+
+#define FR_TPACKET_BLOCK_SIZE_DEFAULT	(1 << 16)
+#define FR_TPACKET_NUM_BLOCKS_DEFAULT	(16)
+#define FR_TPACKET_FRAME_SIZE_DEFAULT	(2048)
+
+fr_tpacket_t	*fr_tpacket_open(TALLOC_CTX *ctx, char const *interface, uint16_t protocol,
+				 struct sock_fprog const *filter, fr_tpacket_config_t const *conf);
+
+int		fr_tpacket_fd(fr_tpacket_t const *t);
+
+#ifdef HAVE_LIBPCAP
+int		fr_tpacket_filter_compile(TALLOC_CTX *ctx, struct sock_fprog *out, char const *expression);
+#endif
+
+ssize_t		fr_tpacket_recv(fr_tpacket_t *t, uint8_t const **frame, fr_time_t *when);
+
+void		fr_tpacket_recv_done(fr_tpacket_t *t);
+
+unsigned int	fr_tpacket_recv_pending(fr_tpacket_t const *t);
+
+uint8_t		*fr_tpacket_send_reserve(fr_tpacket_t *t, size_t *len);
+
+int		fr_tpacket_send_commit(fr_tpacket_t *t, size_t len);
+
+int		fr_tpacket_flush(fr_tpacket_t *t);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -38,6 +38,46 @@ RCSID("$Id$")
 
 #define FR_DEBUG_STRERROR_PRINTF if (fr_debug_lvl) fr_strerror_printf
 
+/*
+ *	Same size as the control buffer used by recvfromto().
+ */
+#define UDP_CMSG_SIZE (256)
+
+struct udp_recv_batch_s {
+	unsigned int		num;			//!< Maximum number of packets read per recvmmsg() call.
+	unsigned int		received;		//!< Number of packets returned by the last recvmmsg() call.
+	unsigned int		next;			//!< Index of the next packet to hand to the caller.
+	unsigned int		truncated;		//!< Number of truncated packets discarded since
+							///< the last call to udp_recv_batch_truncated().
+
+	size_t			max_packet_size;	//!< Size of each packet buffer.
+
+	struct mmsghdr		*msgvec;		//!< Message headers passed to recvmmsg().
+	struct iovec		*iov;			//!< One iovec per packet buffer.
+	struct sockaddr_storage	*src;			//!< Source address of each packet.
+	uint8_t			*cbuf;			//!< Control data (IP_PKTINFO etc.) for each packet.
+	uint8_t			*buffer;		//!< Packet data.
+
+	struct sockaddr_storage	bound;			//!< Address the socket is bound to.
+	socklen_t		sizeof_bound;		//!< Length of the bound address.
+
+	fr_time_t		when;			//!< When the batch was read.  Used if the kernel
+							///< didn't give us a timestamp.
+};
+
+struct udp_send_batch_s {
+	unsigned int		num;			//!< Maximum number of packets sent per sendmmsg() call.
+	unsigned int		queued;			//!< Number of packets waiting to be sent.
+
+	size_t			max_packet_size;	//!< Size of each packet buffer.
+
+	struct mmsghdr		*msgvec;		//!< Message headers passed to sendmmsg().
+	struct iovec		*iov;			//!< One iovec per packet buffer.
+	struct sockaddr_storage	*dst;			//!< Destination address of each packet.
+	uint8_t			*cbuf;			//!< Control data (IP_PKTINFO etc.) for each packet.
+	uint8_t			*buffer;		//!< Packet data.
+};
+
 /** Send a packet via a UDP socket.
  *
  * @param[in] sockfd we're reading from.
@@ -256,3 +296,438 @@ done:
 
 	return received;
 }
+
+
+/** Allocate a structure for reading multiple UDP packets in one system call
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] num		maximum number of packets to read per recvmmsg() call.
+ * @param[in] max_packet_size	maximum size of any one packet.
+ * @return
+ *	- A new batch structure.
+ *	- NULL on error.
+ */
+udp_recv_batch_t *udp_recv_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t max_packet_size)
+{
+	udp_recv_batch_t	*batch;
+	unsigned int		i;
+
+	if (!num || !max_packet_size) {
+		fr_strerror_printf("Invalid arguments for UDP receive batch");
+		return NULL;
+	}
+
+	batch = talloc_zero(ctx, udp_recv_batch_t);
+	if (!batch) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	batch->num = num;
+	batch->max_packet_size = max_packet_size;
+
+	batch->msgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->src = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->cbuf = talloc_zero_array(batch, uint8_t, num * UDP_CMSG_SIZE);
+	batch->buffer = talloc_array(batch, uint8_t, num * max_packet_size);
+	if (!batch->msgvec || !batch->iov || !batch->src || !batch->cbuf || !batch->buffer) {
+		talloc_free(batch);
+		goto oom;
+	}
+
+	for (i = 0; i < num; i++) {
+		batch->iov[i].iov_base = batch->buffer + (i * max_packet_size);
+		batch->iov[i].iov_len = max_packet_size;
+
+		batch->msgvec[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msgvec[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return batch;
+}
+
+/** Return the number of packets which have been read from the kernel, but not yet returned
+ *
+ * @param[in] batch	to check.
+ * @return the number of packets which udp_recv_batch() will return without reading the socket.
+ */
+unsigned int udp_recv_batch_pending(udp_recv_batch_t const *batch)
+{
+	if (!batch) return 0;
+
+	return batch->received - batch->next;
+}
+
+/** Return the number of truncated packets which have been discarded
+ *
+ * The counter is reset on every call, so that the caller can add
+ * the result to its own statistics.
+ *
+ * @param[in] batch	to check.
+ * @return the number of packets discarded since the last call.
+ */
+unsigned int udp_recv_batch_truncated(udp_recv_batch_t *batch)
+{
+	unsigned int truncated;
+
+	if (!batch) return 0;
+
+	truncated = batch->truncated;
+	batch->truncated = 0;
+
+	return truncated;
+}
+
+/** Fill the batch with as many packets as the kernel will give us
+ *
+ * @param[in] batch	to fill.
+ * @param[in] sockfd	to read from.
+ * @param[in] want_dst	whether the caller needs the destination address.
+ * @return
+ *	- > 0 the number of packets read.
+ *	- 0 if no packets were available.
+ *	- < 0 on failure.
+ */
+static int udp_recv_batch_fill(udp_recv_batch_t *batch, int sockfd, bool want_dst)
+{
+	unsigned int	i;
+	int		received;
+
+	batch->next = batch->received = 0;
+
+	/*
+	 *	The cmsg data only contains the destination IP, not
+	 *	the port.  So we get that from the socket, once per
+	 *	batch.
+	 */
+	if (want_dst) {
+		batch->sizeof_bound = sizeof(batch->bound);
+		if (getsockname(sockfd, (struct sockaddr *)&batch->bound, &batch->sizeof_bound) < 0) {
+			fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	for (i = 0; i < batch->num; i++) {
+		struct msghdr *msgh = &batch->msgvec[i].msg_hdr;
+
+		msgh->msg_name = &batch->src[i];
+		msgh->msg_namelen = sizeof(batch->src[i]);
+#ifdef WITH_UDPFROMTO
+		msgh->msg_control = want_dst ? batch->cbuf + (i * UDP_CMSG_SIZE) : NULL;
+		msgh->msg_controllen = want_dst ? UDP_CMSG_SIZE : 0;
+#endif
+		msgh->msg_flags = 0;
+		batch->msgvec[i].msg_len = 0;
+	}
+
+	received = recvmmsg(sockfd, batch->msgvec, batch->num, 0, NULL);
+	if (received < 0) {
+		if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) return 0;
+
+		fr_strerror_printf("Failed reading socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	batch->received = received;
+	batch->when = fr_time();
+
+	return received;
+}
+
+/** Read a UDP packet, using recvmmsg() to read many packets from the kernel at once
+ *
+ * The first call reads up to "num" packets from the socket.
+ * Subsequent calls return the buffered packets one at a time,
+ * until the batch is exhausted.  The socket is then read again.
+ *
+ * Connected sockets, and peeks, are passed through to udp_recv().
+ *
+ * Packets which were truncated by the kernel, or which don't fit
+ * in the callers buffer, are discarded, and counted.  See
+ * udp_recv_batch_truncated().
+ *
+ * @param[in] batch	as allocated by udp_recv_batch_alloc().
+ * @param[in] sockfd	we're reading from.
+ * @param[out] data	pointer where data will be written
+ * @param[in] data_len	length of data to read
+ * @param[in] flags	for things
+ * @param[out] src_ipaddr of the packet.
+ * @param[out] src_port	of the packet.
+ * @param[out] dst_ipaddr of the packet.
+ * @param[out] dst_port	of the packet.
+ * @param[out] if_index	of the interface that received the packet.
+ * @param[out] when	the packet was received.
+ * @return
+ *	- > 0 on success (number of bytes read).
+ *	- 0 if there is no data.
+ *	- < 0 on failure.
+ */
+ssize_t udp_recv_batch(udp_recv_batch_t *batch, int sockfd, void *data, size_t data_len, int flags,
+		       fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
+		       fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
+		       fr_time_t *when)
+{
+	struct mmsghdr		*mm;
+	struct sockaddr_storage	dst;
+	socklen_t		sizeof_dst;
+	size_t			received;
+	uint16_t		port;
+
+	if ((flags & (UDP_FLAGS_CONNECTED | UDP_FLAGS_PEEK)) != 0) {
+		return udp_recv(sockfd, data, data_len, flags,
+				src_ipaddr, src_port, dst_ipaddr, dst_port, if_index, when);
+	}
+
+	if (when) *when = 0;
+
+	for (;;) {
+		if (batch->next >= batch->received) {
+			int rcode;
+
+			rcode = udp_recv_batch_fill(batch, sockfd, (dst_ipaddr != NULL));
+			if (rcode <= 0) return rcode;
+		}
+
+		mm = &batch->msgvec[batch->next];
+
+		/*
+		 *	The packet was larger than the buffer, so the
+		 *	kernel discarded the tail of it.  Don't hand
+		 *	the caller a partial packet, just drop it.
+		 */
+		if (((mm->msg_hdr.msg_flags & MSG_TRUNC) == 0) && (mm->msg_len <= data_len)) break;
+
+		batch->truncated++;
+		batch->next++;
+	}
+
+	received = mm->msg_len;
+
+	memcpy(data, batch->iov[batch->next].iov_base, received);
+
+	if (fr_ipaddr_from_sockaddr(&batch->src[batch->next], mm->msg_hdr.msg_namelen, src_ipaddr, &port) < 0) {
+		batch->next++;
+		fr_strerror_printf_push("Failed converting sockaddr to ipaddr");
+		return -1;
+	}
+	*src_port = port;
+
+	if (dst_ipaddr) {
+		memcpy(&dst, &batch->bound, sizeof(dst));
+		sizeof_dst = batch->sizeof_bound;
+
+#ifdef WITH_UDPFROMTO
+		udpfromto_cmsg_parse(&mm->msg_hdr, (struct sockaddr *)&dst, &sizeof_dst, if_index, when);
+#else
+		if (if_index) *if_index = 0;
+#endif
+
+		fr_ipaddr_from_sockaddr(&dst, sizeof_dst, dst_ipaddr, &port);
+		*dst_port = port;
+	}
+
+	batch->next++;
+
+	if (when && !*when) *when = batch->when;
+
+	return received;
+}
+
+
+/** Allocate a structure for writing multiple UDP packets in one system call
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] num		maximum number of packets to queue before
+ *				they are written to the socket.
+ * @param[in] max_packet_size	maximum size of any one packet.
+ * @return
+ *	- A new batch structure.
+ *	- NULL on error.
+ */
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t max_packet_size)
+{
+	udp_send_batch_t	*batch;
+	unsigned int		i;
+
+	if (!num || !max_packet_size) {
+		fr_strerror_printf("Invalid arguments for UDP send batch");
+		return NULL;
+	}
+
+	batch = talloc_zero(ctx, udp_send_batch_t);
+	if (!batch) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	batch->num = num;
+	batch->max_packet_size = max_packet_size;
+
+	batch->msgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->dst = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->cbuf = talloc_zero_array(batch, uint8_t, num * UDP_CMSG_SIZE);
+	batch->buffer = talloc_array(batch, uint8_t, num * max_packet_size);
+	if (!batch->msgvec || !batch->iov || !batch->dst || !batch->cbuf || !batch->buffer) {
+		talloc_free(batch);
+		goto oom;
+	}
+
+	for (i = 0; i < num; i++) {
+		batch->iov[i].iov_base = batch->buffer + (i * max_packet_size);
+
+		batch->msgvec[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msgvec[i].msg_hdr.msg_iovlen = 1;
+		batch->msgvec[i].msg_hdr.msg_name = &batch->dst[i];
+	}
+
+	return batch;
+}
+
+/** Queue a UDP packet for sending
+ *
+ * The packet is copied into the batch, so the caller can free or
+ * re-use the buffer as soon as this function returns.  The packets
+ * are written when udp_send_batch_flush() is called, or when the
+ * batch is full.
+ *
+ * Connected sockets, oversized packets, and calls where there is no
+ * batch are sent immediately with udp_send().
+ *
+ * @param[in] batch	as allocated by udp_send_batch_alloc().  May be NULL.
+ * @param[in] sockfd	we're writing to.
+ * @param[in] data	pointer to data to send
+ * @param[in] data_len	length of data to send
+ * @param[in] flags	for things
+ * @param[in] src_ipaddr of the packet.
+ * @param[in] src_port	of the packet.
+ * @param[in] if_index	of the packet.
+ * @param[in] dst_ipaddr of the packet.
+ * @param[in] dst_port	of the packet.
+ * @return
+ *	- > 0 on success (number of bytes queued or sent).
+ *	- < 0 on failure.
+ */
+ssize_t udp_send_batch_add(udp_send_batch_t *batch, int sockfd, void *data, size_t data_len, int flags,
+			   fr_ipaddr_t const *src_ipaddr, uint16_t src_port, int if_index,
+			   fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port)
+{
+	struct msghdr	*msgh;
+	socklen_t	sizeof_dst;
+
+	if (!batch || ((flags & UDP_FLAGS_CONNECTED) != 0) || (data_len > batch->max_packet_size)) {
+		/*
+		 *	Don't re-order packets.
+		 */
+		if (batch && batch->queued) (void) udp_send_batch_flush(batch, sockfd);
+
+		return udp_send(sockfd, data, data_len, flags,
+				src_ipaddr, src_port, if_index, dst_ipaddr, dst_port);
+	}
+
+	if (batch->queued == batch->num) (void) udp_send_batch_flush(batch, sockfd);
+
+	msgh = &batch->msgvec[batch->queued].msg_hdr;
+
+	if (fr_ipaddr_to_sockaddr(dst_ipaddr, dst_port, &batch->dst[batch->queued], &sizeof_dst) < 0) return -1;
+	msgh->msg_namelen = sizeof_dst;
+
+	memcpy(batch->iov[batch->queued].iov_base, data, data_len);
+	batch->iov[batch->queued].iov_len = data_len;
+
+	msgh->msg_control = NULL;
+	msgh->msg_controllen = 0;
+
+#ifdef WITH_UDPFROMTO
+	/*
+	 *	As with udp_send(), only use the source address
+	 *	if it's been specified.
+	 */
+	if ((src_ipaddr->af != AF_UNSPEC) && (dst_ipaddr->af != AF_UNSPEC) &&
+	    !fr_ipaddr_is_inaddr_any(src_ipaddr)) {
+		struct sockaddr_storage	src;
+		socklen_t		sizeof_src;
+
+		fr_ipaddr_to_sockaddr(src_ipaddr, src_port, &src, &sizeof_src);
+
+		msgh->msg_control = batch->cbuf + (batch->queued * UDP_CMSG_SIZE);
+		memset(msgh->msg_control, 0, UDP_CMSG_SIZE);
+		udpfromto_cmsg_set(msgh, (struct sockaddr *)&src, if_index);
+	}
+#endif
+
+	batch->queued++;
+
+	return data_len;
+}
+
+/** Write all queued packets to the socket
+ *
+ * Packets which the kernel refuses are discarded, as would happen
+ * with a failed sendto().
+ *
+ * @param[in] batch	of queued packets.
+ * @param[in] sockfd	to write them to.
+ * @return
+ *	- 0 on success.
+ *	- < 0 if one or more packets could not be written.
+ */
+int udp_send_batch_flush(udp_send_batch_t *batch, int sockfd)
+{
+	unsigned int	done = 0;
+	int		rcode = 0;
+
+	if (!batch || !batch->queued) return 0;
+
+#if defined(WITH_UDPFROMTO) && defined(__FreeBSD__)
+	/*
+	 *	See sendfromto().  FreeBSD won't let us use
+	 *	IP_SENDSRCADDR on sockets which are bound to a
+	 *	specific address.
+	 */
+	{
+		struct sockaddr_storage	bound;
+		socklen_t		bound_len = sizeof(bound);
+		fr_ipaddr_t		ipaddr;
+		uint16_t		port;
+
+		if ((getsockname(sockfd, (struct sockaddr *)&bound, &bound_len) == 0) &&
+		    (fr_ipaddr_from_sockaddr(&bound, bound_len, &ipaddr, &port) == 0) &&
+		    !fr_ipaddr_is_inaddr_any(&ipaddr)) {
+			unsigned int i;
+
+			for (i = 0; i < batch->queued; i++) {
+				batch->msgvec[i].msg_hdr.msg_control = NULL;
+				batch->msgvec[i].msg_hdr.msg_controllen = 0;
+			}
+		}
+	}
+#endif
+
+	while (done < batch->queued) {
+		int sent;
+
+		sent = sendmmsg(sockfd, batch->msgvec + done, batch->queued - done, 0);
+		if (sent <= 0) {
+			/*
+			 *	sendmmsg() only returns an error if the
+			 *	first packet couldn't be sent.  Skip it,
+			 *	and try the rest.
+			 */
+			fr_strerror_printf("udp_sendmmsg failed: %s", fr_syserror(errno));
+			rcode = -1;
+			done++;
+			continue;
+		}
+
+		done += sent;
+	}
+
+	batch->queued = 0;
+
+	return rcode;
+}
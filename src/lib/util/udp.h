@@ -39,6 +39,16 @@ extern "C" {
 #define UDP_FLAGS_CONNECTED	(1 << 0)
 #define UDP_FLAGS_PEEK		(1 << 1)
 
+/** Packets read from a UDP socket with a single recvmmsg() call
+ *
+ */
+typedef struct udp_recv_batch_s udp_recv_batch_t;
+
+/** Packets queued for writing to a UDP socket with a single sendmmsg() call
+ *
+ */
+typedef struct udp_send_batch_s udp_send_batch_t;
+
 ssize_t udp_send(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t const *src_ipaddr, uint16_t src_port, int if_index,
 		 fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port);
@@ -52,6 +62,25 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
 		 fr_time_t *when);
 
+udp_recv_batch_t *udp_recv_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t max_packet_size);
+
+unsigned int udp_recv_batch_pending(udp_recv_batch_t const *batch);
+
+unsigned int udp_recv_batch_truncated(udp_recv_batch_t *batch);
+
+ssize_t udp_recv_batch(udp_recv_batch_t *batch, int sockfd, void *data, size_t data_len, int flags,
+		       fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
+		       fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
+		       fr_time_t *when);
+
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t max_packet_size);
+
+ssize_t udp_send_batch_add(udp_send_batch_t *batch, int sockfd, void *data, size_t data_len, int flags,
+			   fr_ipaddr_t const *src_ipaddr, uint16_t src_port, int if_index,
+			   fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port);
+
+int udp_send_batch_flush(udp_send_batch_t *batch, int sockfd);
+
 #ifdef __cplusplus
 }
 #endif
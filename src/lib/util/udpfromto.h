@@ -45,6 +45,11 @@ int	recvfromto(int s, void *buf, size_t len, int flags,
 		   struct sockaddr *to, socklen_t *tolen,
 		   int *if_index, fr_time_t *when);
 
+void	udpfromto_cmsg_parse(struct msghdr *msgh, struct sockaddr *to, socklen_t *to_len,
+			     int *if_index, fr_time_t *when);
+
+void	udpfromto_cmsg_set(struct msghdr *msgh, struct sockaddr const *from, int if_index);
+
 int	sendfromto(int s, void *buf, size_t len, int flags,
 		   struct sockaddr *from, socklen_t fromlen,
 		   struct sockaddr *to, socklen_t tolen,
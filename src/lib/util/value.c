@@ -307,6 +307,7 @@ static inline void fr_value_box_copy_meta(fr_value_box_t *dst, fr_value_box_t co
 	dst->enumv = src->enumv;
 	dst->type = src->type;
 	dst->tainted = src->tainted;
+	dst->shallow = false;
 	dst->next = NULL;	/* copy one */
 }
 
@@ -3256,6 +3257,9 @@ inline void fr_value_box_clear_value(fr_value_box_t *data)
 {
 	switch (data->type) {
 	case FR_TYPE_OCTETS:
+		if (data->shallow) break;
+		FALL_THROUGH;
+
 	case FR_TYPE_STRING:
 		talloc_free(data->datum.ptr);
 		break;
@@ -3397,6 +3401,17 @@ void fr_value_box_copy_shallow(TALLOC_CTX *ctx, fr_value_box_t *dst, fr_value_bo
 
 	case FR_TYPE_STRING:
 	case FR_TYPE_OCTETS:
+		/*
+		 *	Buffers we don't own can't be referenced.
+		 *	Whoever owns them has to keep them around.
+		 */
+		if (src->shallow) {
+			dst->datum.ptr = src->datum.ptr;
+			fr_value_box_copy_meta(dst, src);
+			dst->shallow = true;
+			break;
+		}
+
 		dst->datum.ptr = ctx ? talloc_reference(ctx, src->datum.ptr) : src->datum.ptr;
 		fr_value_box_copy_meta(dst, src);
 		break;
@@ -3439,6 +3454,11 @@ int fr_value_box_steal(TALLOC_CTX *ctx, fr_value_box_t *dst, fr_value_box_t cons
 	{
 		uint8_t const *bin;
 
+		/*
+		 *	There's nothing to steal, the buffer isn't ours.
+		 */
+		if (src->shallow) return fr_value_box_copy(ctx, dst, src);
+
  		bin = talloc_steal(ctx, src->vb_octets);
 		if (!bin) {
 			fr_strerror_printf("Failed stealing octets buffer");
@@ -3902,6 +3922,8 @@ int fr_value_box_mem_realloc(TALLOC_CTX *ctx, uint8_t **out, fr_value_box_t *dst
 
 	fr_assert(dst->type == FR_TYPE_OCTETS);
 
+	if (fr_value_box_unshare(ctx, dst) < 0) return -1;
+
 	memcpy(&cbin, &dst->vb_octets, sizeof(cbin));
 
 	clen = talloc_array_length(dst->vb_octets);
@@ -3985,15 +4007,15 @@ int fr_value_box_memdup_buffer(TALLOC_CTX *ctx, fr_value_box_t *dst, fr_dict_att
 
 /** Assign a buffer to a box, but don't copy it
  *
- * Adds a reference to the src buffer so that it cannot be freed until the ctx is freed.
+ * The caller must ensure that src outlives the box.  The buffer is
+ * not freed when the box is cleared, and is copied before the box's
+ * value is changed.  It need not be talloced.
  *
  * Caller should set dst->taint = true, where the value was acquired from an untrusted source.
  *
- * @note Will free any exiting buffers associated with the value box.
- *
  * @param[in] dst 	to assign buffer to.
  * @param[in] enumv	Aliases for values.
- * @param[in] src	a talloced buffer.
+ * @param[in] src	a buffer.
  * @param[in] len	of buffer.
  * @param[in] tainted	Whether the value came from a trusted source.
  */
@@ -4003,6 +4025,34 @@ void fr_value_box_memdup_shallow(fr_value_box_t *dst, fr_dict_attr_t const *enum
 	fr_value_box_init(dst, FR_TYPE_OCTETS, enumv, tainted);
 	dst->vb_octets = src;
 	dst->datum.length = len;
+	dst->shallow = true;
+}
+
+/** Give a box its own copy of a buffer it was only pointing to
+ *
+ * @param[in] ctx	to allocate the copy in.
+ * @param[in] vb	to unshare.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_value_box_unshare(TALLOC_CTX *ctx, fr_value_box_t *vb)
+{
+	uint8_t *bin;
+
+	if (!vb->shallow) return 0;
+
+	bin = talloc_memdup(ctx, vb->vb_octets, vb->datum.length);
+	if (!bin) {
+		fr_strerror_printf("Failed allocating octets buffer");
+		return -1;
+	}
+	talloc_set_type(bin, uint8_t);
+
+	vb->vb_octets = bin;
+	vb->shallow = false;
+
+	return 0;
 }
 
 /** Assign a talloced buffer to a box, but don't copy it
@@ -4050,6 +4100,8 @@ int fr_value_box_mem_append(TALLOC_CTX *ctx, fr_value_box_t *dst, uint8_t const
 		return -1;
 	}
 
+	if (fr_value_box_unshare(ctx, dst) < 0) return -1;
+
 	memcpy(&ptr, &dst->datum.ptr, sizeof(ptr));	/* defeat const */
 	if (!fr_cond_assert(ptr)) return -1;
 
@@ -44,6 +44,7 @@ typedef struct value_box_s fr_value_box_t;
 #include <freeradius-devel/util/log.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/table.h>
+#include <freeradius-devel/util/talloc.h>
 #include <freeradius-devel/util/token.h>
 #include <freeradius-devel/util/types.h>
 #include <freeradius-devel/util/time.h>
@@ -151,6 +152,8 @@ struct value_box_s {
 	fr_dict_attr_t const		*enumv;			//!< Enumeration values.
 
 	bool				tainted;		//!< i.e. did it come from an untrusted source
+	bool				shallow;		//!< octets buffer belongs to someone else,
+								///< and is copied before being changed.
 
 	fr_value_box_t			*next;			//!< Next in a series of value_box.
 };
@@ -357,11 +360,24 @@ static inline CC_HINT(always_inline) void fr_value_box_init_null(fr_value_box_t
 	fr_value_box_init(vb, FR_TYPE_INVALID, NULL, false);
 }
 
+/** Bytes reserved for the buffer of a string or octets box
+ *
+ * Boxes (and pairs) of those types are allocated as talloc pooled
+ * objects, so a value of up to this many bytes, including the
+ * trailing '\0' of a string, is carved out of the same allocation
+ * as the box when the box is used as its ctx.  Longer values are
+ * allocated from the heap as usual.
+ */
+#define FR_VALUE_BOX_POOL_SIZE	32
+
 /** Allocate a value box of a specific type
  *
  * Allocates memory for the box, and sets the length of the value
  * for fixed length types.
  *
+ * String and octets boxes are allocated with space for a short
+ * buffer, see #FR_VALUE_BOX_POOL_SIZE.
+ *
  * @param[in] ctx	to allocate the value_box in.
  * @param[in] type	of value.
  * @param[in] enumv	Enumeration values.
@@ -375,7 +391,16 @@ static inline CC_HINT(always_inline) fr_value_box_t *fr_value_box_alloc(TALLOC_C
 {
 	fr_value_box_t *vb;
 
-	vb = talloc(ctx, fr_value_box_t);
+	switch (type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+		vb = talloc_pooled_object(ctx, fr_value_box_t, 1, FR_VALUE_BOX_POOL_SIZE);
+		break;
+
+	default:
+		vb = talloc(ctx, fr_value_box_t);
+		break;
+	}
 	if (unlikely(!vb)) return NULL;
 
 	fr_value_box_init(vb, type, enumv, tainted);
@@ -675,6 +700,8 @@ int		fr_value_box_memdup_buffer(TALLOC_CTX *ctx, fr_value_box_t *dst, fr_dict_at
 void		fr_value_box_memdup_shallow(fr_value_box_t *dst, fr_dict_attr_t const *enumv,
 					    uint8_t const *src, size_t len, bool tainted);
 
+int		fr_value_box_unshare(TALLOC_CTX *ctx, fr_value_box_t *vb);
+
 void		fr_value_box_memdup_buffer_shallow(TALLOC_CTX *ctx, fr_value_box_t *dst, fr_dict_attr_t const *enumv,
 						   uint8_t const *src, bool tainted);
 
@@ -33,6 +33,7 @@
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/tpacket.h>
 
 #include "proto_arp.h"
 
@@ -41,14 +42,33 @@ extern fr_app_io_t proto_arp_ethernet;
 typedef struct {
 	char const			*name;			//!< socket name
 	fr_pcap_t			*pcap;			//!< PCAP handler
+#ifdef HAVE_TPACKET_V3
+	fr_tpacket_t			*ring;			//!< Memory mapped rings, used instead of PCAP.
+	uint8_t				ether_addr[ETHER_ADDR_LEN];	//!< The MAC address of the interface.
+#endif
 } proto_arp_ethernet_thread_t;
 
 typedef struct {
 	CONF_SECTION			*cs;			//!< our configuration
 	char const			*interface;		//!< Interface to bind to.
 	char const			*filter;		//!< Additional PCAP filter
+#ifdef HAVE_TPACKET_V3
+	bool				use_mmap;		//!< Read and write frames via memory mapped rings.
+	fr_tpacket_config_t		ring;			//!< Sizes of the rings.
+#endif
 } proto_arp_ethernet_t;
 
+#ifdef HAVE_TPACKET_V3
+static CONF_PARSER const ring_config[] = {
+	{ FR_CONF_OFFSET("block_size", FR_TYPE_UINT32, fr_tpacket_config_t, block_size), .dflt = "65536" },
+	{ FR_CONF_OFFSET("blocks", FR_TYPE_UINT32, fr_tpacket_config_t, num_blocks), .dflt = "16" },
+	{ FR_CONF_OFFSET("block_timeout", FR_TYPE_TIME_DELTA, fr_tpacket_config_t, block_timeout), .dflt = "0.01" },
+	{ FR_CONF_OFFSET("tx_frames", FR_TYPE_UINT32, fr_tpacket_config_t, num_tx_frames), .dflt = "64" },
+
+	CONF_PARSER_TERMINATOR
+};
+#endif
+
 
 /** How to parse an ARP listen section
  *
@@ -59,6 +79,11 @@ static CONF_PARSER const arp_listen_config[] = {
 
 	{ FR_CONF_OFFSET("filter", FR_TYPE_STRING, proto_arp_ethernet_t, filter) },
 
+#ifdef HAVE_TPACKET_V3
+	{ FR_CONF_OFFSET("mmap", FR_TYPE_BOOL, proto_arp_ethernet_t, use_mmap), .dflt = "yes" },
+	{ FR_CONF_OFFSET("ring", FR_TYPE_SUBSECTION, proto_arp_ethernet_t, ring), .subcs = (void const *) ring_config },
+#endif
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -73,6 +98,39 @@ static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, fr_time_t *re
 
 	*leftover = 0;		/* always for message oriented protocols */
 
+#ifdef HAVE_TPACKET_V3
+	/*
+	 *	Frames are read straight out of the ring, and the
+	 *	network side is told how many more are ready, so
+	 *	it can read a whole block without polling.
+	 */
+	if (thread->ring) {
+		ssize_t	frame_len;
+
+		frame_len = fr_tpacket_recv(thread->ring, &data, recv_time_p);
+		if (frame_len <= 0) {
+			li->recv_pending = 0;
+			return 0;
+		}
+		p = data;
+		end = data + frame_len;
+
+		len = fr_pcap_link_layer_offset(data, frame_len, DLT_EN10MB);
+		if ((len < 0) || ((end - (p + len)) < FR_ARP_PACKET_SIZE) || (buffer_len < FR_ARP_PACKET_SIZE)) {
+			DEBUG("Frame is too small (%d) to be ARP", (int) frame_len);
+			ret = 0;
+		} else {
+			memcpy(buffer, p + len, FR_ARP_PACKET_SIZE);
+			ret = FR_ARP_PACKET_SIZE;
+		}
+
+		fr_tpacket_recv_done(thread->ring);
+		li->recv_pending = fr_tpacket_recv_pending(thread->ring);
+
+		return ret;
+	}
+#endif
+
 	ret = pcap_next_ex(thread->pcap->handle, &header, &data);
 	if (ret == 0) return 0;
 	if (ret < 0) {
@@ -128,6 +186,43 @@ static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, UNUSED fr_tim
 	 */
 	if (buffer_len == 1) return buffer_len;
 
+#ifdef HAVE_TPACKET_V3
+	/*
+	 *	Build the frame straight in the transmit ring.  It's
+	 *	sent when mod_flush() is called.
+	 */
+	if (thread->ring) {
+		uint8_t	*frame;
+		size_t	frame_max;
+		size_t	hdr_len = ETHER_ADDR_LEN + ETHER_ADDR_LEN + sizeof(eth_hdr->ether_type);
+
+		frame = fr_tpacket_send_reserve(thread->ring, &frame_max);
+		if (!frame) {
+			(void) fr_tpacket_flush(thread->ring);
+			frame = fr_tpacket_send_reserve(thread->ring, &frame_max);
+		}
+		if (!frame || (frame_max < (hdr_len + buffer_len))) {
+			RATE_LIMIT_GLOBAL(PERROR, "Failed queueing ARP reply");
+			return 0;
+		}
+
+		eth_hdr = (ethernet_header_t *)frame;
+		eth_hdr->ether_type = htons(ETH_TYPE_ARP);
+		arp = (fr_arp_packet_t *)(frame + hdr_len);
+		memcpy(arp, buffer, buffer_len);
+
+		memcpy(eth_hdr->src_addr, thread->ether_addr, ETHER_ADDR_LEN);
+		memcpy(eth_hdr->dst_addr, arp->tha, ETHER_ADDR_LEN);
+
+		if (fr_tpacket_send_commit(thread->ring, hdr_len + buffer_len) < 0) {
+			RATE_LIMIT_GLOBAL(PERROR, "Failed queueing ARP reply");
+			return 0;
+		}
+
+		return FR_ARP_PACKET_SIZE;
+	}
+#endif
+
 	/* fill in Ethernet layer (L2) */
 	eth_hdr = (ethernet_header_t *)arp_packet;
 	eth_hdr->ether_type = htons(ETH_TYPE_ARP);
@@ -167,28 +262,65 @@ static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, UNUSED fr_tim
 	return FR_ARP_PACKET_SIZE;
 }
 
-/** Open a pcap file for ARP
+#ifdef HAVE_TPACKET_V3
+/** Send any replies which have been queued in the transmit ring
  *
  */
-static int mod_open(fr_listen_t *li)
+static int mod_flush(fr_listen_t *li)
+{
+	proto_arp_ethernet_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_arp_ethernet_thread_t);
+
+	if (!thread->ring) return 0;
+
+	return fr_tpacket_flush(thread->ring);
+}
+
+/** Open memory mapped rings for ARP
+ *
+ * The filter is compiled by libpcap, but run by the kernel, so frames
+ * which aren't ARP never reach the ring.
+ */
+static int mod_open_ring(fr_listen_t *li, char const *filter)
 {
 	proto_arp_ethernet_t const      *inst = talloc_get_type_abort_const(li->app_io_instance, proto_arp_ethernet_t);
 	proto_arp_ethernet_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_arp_ethernet_thread_t);
+	struct sock_fprog		prog;
 
-	char const			*filter;
-	char				*our_filter = NULL;
+	if (fr_tpacket_filter_compile(thread, &prog, filter) < 0) {
+		PERROR("Failed compiling filter '%s'", filter);
+		return -1;
+	}
 
-	thread->pcap = fr_pcap_init(thread, inst->interface, PCAP_INTERFACE_IN);
-	if (!thread->pcap) {
-		PERROR("Failed initializing pcap handle.");
+	thread->ring = fr_tpacket_open(thread, inst->interface, ETH_TYPE_ARP, &prog, &inst->ring);
+	talloc_free(prog.filter);
+	if (!thread->ring) {
+		PERROR("Failed opening rings on interface %s", inst->interface);
 		return -1;
 	}
 
-	if (fr_pcap_open(thread->pcap) < 0) {
-		PERROR("Failed opening interface %s", inst->interface);
+	if (fr_interface_to_ethernet(inst->interface, thread->ether_addr) < 0) {
+		PERROR("Failed getting MAC address for interface %s", inst->interface);
+		TALLOC_FREE(thread->ring);
 		return -1;
 	}
 
+	li->fd = fr_tpacket_fd(thread->ring);
+
+	return 0;
+}
+#endif
+
+/** Open a pcap file for ARP
+ *
+ */
+static int mod_open(fr_listen_t *li)
+{
+	proto_arp_ethernet_t const      *inst = talloc_get_type_abort_const(li->app_io_instance, proto_arp_ethernet_t);
+	proto_arp_ethernet_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_arp_ethernet_thread_t);
+
+	char const			*filter;
+	char				*our_filter = NULL;
+
 	/*
 	 *	Ensure that we only get ARP, and an optional additional filter.
 	 */
@@ -198,6 +330,31 @@ static int mod_open(fr_listen_t *li)
 		MEM(filter = our_filter = talloc_asprintf(li, "arp and %s", inst->filter));
 	}
 
+#ifdef HAVE_TPACKET_V3
+	if (inst->use_mmap) {
+		int ret;
+
+		ret = mod_open_ring(li, filter);
+		talloc_free(our_filter);
+		if (ret < 0) return -1;
+
+		goto done;
+	}
+#endif
+
+	thread->pcap = fr_pcap_init(thread, inst->interface, PCAP_INTERFACE_IN);
+	if (!thread->pcap) {
+		PERROR("Failed initializing pcap handle.");
+		talloc_free(our_filter);
+		return -1;
+	}
+
+	if (fr_pcap_open(thread->pcap) < 0) {
+		PERROR("Failed opening interface %s", inst->interface);
+		talloc_free(our_filter);
+		return -1;
+	}
+
 	if (fr_pcap_apply_filter(thread->pcap, filter) < 0) {
 		PERROR("Failed applying pcap filter '%s'", filter);
 		talloc_free(our_filter);
@@ -207,6 +364,9 @@ static int mod_open(fr_listen_t *li)
 
 	li->fd = thread->pcap->fd;
 
+#ifdef HAVE_TPACKET_V3
+done:
+#endif
 	fr_assert(cf_parent(inst->cs) != NULL);	/* listen { ... } */
 
 	thread->name = talloc_asprintf(thread, "arp on interface %s", inst->interface);
@@ -244,5 +404,8 @@ fr_app_io_t proto_arp_ethernet = {
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+#ifdef HAVE_TPACKET_V3
+	.flush			= mod_flush,
+#endif
 	.get_name      		= mod_name,
 };
@@ -27,6 +27,7 @@
 
 #include <freeradius-devel/unlang/base.h>
 
+#include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
@@ -37,6 +38,14 @@
 
 #define BFD_MAX_SECRET_LENGTH 20
 
+#define BFD_MIN_INTERVAL	10		//!< Shortest transmit / receive interval (milliseconds).
+#define BFD_MAX_INTERVAL	10000		//!< Longest transmit / receive interval (milliseconds).
+#define BFD_MAX_WORKERS		64
+
+#define BFD_WHEEL_TICK		(NSEC / 1000)	//!< Timer wheel resolution, 1ms.
+#define BFD_WHEEL_SLOTS		1024		//!< Must be a power of 2, and a multiple of 64.
+#define BFD_BATCH_MAX		64		//!< Most packets we sign and send in one go.
+
 typedef enum bfd_session_state_t {
 	BFD_STATE_ADMIN_DOWN = 0,
 	BFD_STATE_DOWN,
@@ -67,18 +76,52 @@ typedef enum bfd_auth_type_t {
 
 #define BFD_AUTH_INVALID (BFD_AUTH_MET_KEYED_SHA1 + 1)
 
+typedef struct bfd_state_s bfd_state_t;
+typedef struct bfd_worker_s bfd_worker_t;
+
+typedef void (*bfd_timer_cb_t)(bfd_state_t *session, fr_time_t now);
+
+/*
+ *	A timer in a worker's timer wheel.
+ */
+typedef struct {
+	fr_dlist_t	entry;		//!< Entry in a wheel slot.
+	fr_dlist_head_t	*list;		//!< List we're in, or NULL if the timer isn't armed.
+	uint64_t	tick;		//!< Wheel tick the timer expires on.
+	fr_time_t	when;		//!< When the timer was asked to expire.
+	bfd_timer_cb_t	callback;
+	bfd_state_t	*session;
+} bfd_timer_t;
+
+/*
+ *	Per-session statistics.
+ */
 typedef struct {
+	uint64_t	packets_sent;
+	uint64_t	packets_recv;
+	uint64_t	auth_failed;
+	uint64_t	dropped;		//!< Packets we couldn't pass to the worker.
+
+	fr_time_delta_t	rx_interval;		//!< Between the last two packets received.
+	fr_time_delta_t	rx_interval_max;
+	fr_time_delta_t	rx_jitter;		//!< Smoothed variation in rx_interval, as with RFC 3550.
+	fr_time_delta_t	tx_jitter;		//!< Jitter applied to the last transmit interval.
+	fr_time_delta_t	timer_late_max;		//!< Latest any of our timers has run.
+
+	uint64_t	detections;		//!< Number of detection timeouts.
+	fr_time_delta_t	detect_min;		//!< Shortest time between the last packet and a timeout.
+	fr_time_delta_t	detect_max;		//!< Longest time between the last packet and a timeout.
+} bfd_stats_t;
+
+struct bfd_state_s {
 	int		number;
 	int		sockfd;
 
-	fr_event_list_t *el;
+	bfd_worker_t	*worker;	//!< Event loop this session runs in.
+	fr_dlist_t	entry;		//!< Entry in the worker's list of sessions.
 	CONF_SECTION	*server_cs;
 	CONF_SECTION	*unlang;
 
-	bool		blocked;
-	int		pipefd[2];
-	pthread_t	pthread_id;
-
 	bfd_auth_type_t auth_type;
 	uint8_t		secret[BFD_MAX_SECRET_LENGTH];
 	size_t		secret_len;
@@ -94,8 +137,8 @@ typedef struct {
 	struct sockaddr_storage remote_sockaddr;
 	socklen_t	salen;
 
-	fr_event_timer_t const	*ev_timeout;
-	fr_event_timer_t const	*ev_packet;
+	bfd_timer_t	ev_timeout;
+	bfd_timer_t	ev_packet;
 	fr_time_t	last_recv;
 	fr_time_t	next_recv;
 	fr_time_t	last_sent;
@@ -132,7 +175,9 @@ typedef struct {
 	int		detection_timeouts;
 
 	int		passive;
-} bfd_state_t;
+
+	bfd_stats_t	stats;
+};
 
 typedef struct {
 	uint8_t		auth_type;
@@ -210,6 +255,41 @@ typedef struct {
 	bfd_auth_t	auth;
 } __attribute__ ((packed)) bfd_packet_t;
 
+/*
+ *	A packet passed from the network thread to a worker.
+ */
+typedef struct {
+	bfd_state_t	*session;		//!< NULL tells the worker to exit.
+	bfd_packet_t	packet;
+} bfd_pipe_msg_t;
+
+/*
+ *	An event loop shared by many sessions.
+ */
+struct bfd_worker_s {
+	int			id;
+	fr_event_list_t		*el;
+	pthread_t		pthread_id;
+	bool			running;			//!< Whether we have a thread to join.
+	int			pipefd[2];			//!< Packets from the network thread.
+
+	fr_dlist_head_t		sessions;			//!< Sessions which run in this worker.
+
+	fr_dlist_head_t		slots[BFD_WHEEL_SLOTS];		//!< The timer wheel.
+	uint64_t		occupied[BFD_WHEEL_SLOTS / 64];	//!< Slots which may have timers.
+	uint32_t		num_timers;			//!< Armed timers.
+	uint64_t		tick;				//!< Next tick to process.
+	bool			processing;			//!< Running expired timers.
+	fr_event_timer_t const	*ev_tick;			//!< Fires when the next occupied slot is due.
+	uint64_t		ev_tick_at;			//!< Tick ev_tick is set for.
+
+	bfd_packet_t		batch[BFD_BATCH_MAX];		//!< Packets waiting to be signed and sent.
+	bfd_state_t		*batch_session[BFD_BATCH_MAX];
+	struct iovec		iov[BFD_BATCH_MAX];
+	struct mmsghdr		mmsgvec[BFD_BATCH_MAX];
+	int			batched;
+};
+
 
 typedef struct {
 	fr_ipaddr_t	my_ipaddr;
@@ -226,6 +306,9 @@ typedef struct {
 	uint32_t	max_timeouts;
 	bool		demand;
 
+	uint32_t	num_workers;
+	bfd_worker_t	**workers;
+
 	bfd_auth_type_t	auth_type;
 	uint8_t		secret[BFD_MAX_SECRET_LENGTH];
 	size_t		secret_len;
@@ -244,8 +327,12 @@ fr_dict_autoload_t proto_bfd_dict[] = {
 static int bfd_start_packets(bfd_state_t *session);
 static int bfd_start_control(bfd_state_t *session);
 static int bfd_stop_control(bfd_state_t *session);
-static void bfd_detection_timeout(UNUSED fr_event_list_t *eel, fr_time_t now, void *ctx);
+static void bfd_detection_timeout(bfd_state_t *session, fr_time_t now);
+static void bfd_send_packet(bfd_state_t *session, fr_time_t now);
 static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd);
+static void bfd_sign(bfd_state_t *session, bfd_packet_t *bfd);
+static void bfd_wheel_tick(fr_event_list_t *el, fr_time_t now, void *ctx);
+static void bfd_worker_flush(bfd_worker_t *worker);
 
 static fr_event_list_t *event_list = NULL; /* don't ask */
 
@@ -256,128 +343,421 @@ void bfd_init(fr_event_list_t *xel)
 	event_list = xel;
 }
 
-static void bfd_pthread_free(bfd_state_t *session)
+/*
+ *	Timers live in a hashed timer wheel, one per worker.  Each
+ *	slot holds the timers which expire on one tick, modulo the
+ *	number of slots.  Inserting and deleting a timer is O(1), and
+ *	the worker has a single event for the next occupied slot, no
+ *	matter how many sessions it has.
+ */
+static inline bool bfd_timer_armed(bfd_timer_t const *timer)
+{
+	return (timer->list != NULL);
+}
+
+static void bfd_timer_init(bfd_timer_t *timer, bfd_state_t *session, bfd_timer_cb_t callback)
 {
-	session->blocked = true;
+	fr_dlist_entry_init(&timer->entry);
+	timer->list = NULL;
+	timer->session = session;
+	timer->callback = callback;
+}
+
+static void bfd_timer_delete(bfd_timer_t *timer)
+{
+	if (!timer->list) return;
+
+	/*
+	 *	The slot is marked as unoccupied when it's next
+	 *	processed.
+	 */
+	fr_dlist_remove(timer->list, timer);
+	timer->list = NULL;
+	timer->session->worker->num_timers--;
+}
+
+/*
+ *	Make sure the worker's event fires no later than "tick".
+ */
+static void bfd_wheel_arm(bfd_worker_t *worker, uint64_t tick)
+{
+	if (worker->ev_tick && (worker->ev_tick_at <= tick)) return;
+
+	worker->ev_tick_at = tick;
+	if (fr_event_timer_at(worker, worker->el, &worker->ev_tick,
+			      tick * BFD_WHEEL_TICK, bfd_wheel_tick, worker) < 0) {
+		fr_assert("Failed to insert event" == NULL);
+	}
+}
+
+static void bfd_timer_insert(bfd_timer_t *timer, fr_time_t when)
+{
+	bfd_worker_t	*worker = timer->session->worker;
+	uint64_t	tick;
+	uint32_t	slot;
+
+	bfd_timer_delete(timer);
 
-	close(session->pipefd[0]);
-	close(session->pipefd[1]);
+	tick = ROUND_UP_DIV((uint64_t) when, BFD_WHEEL_TICK);
+	if (tick < worker->tick) tick = worker->tick;
 
-	talloc_free(session->el);
+	slot = tick & (BFD_WHEEL_SLOTS - 1);
+	timer->tick = tick;
+	timer->when = when;
+	timer->list = &worker->slots[slot];
+	fr_dlist_insert_tail(timer->list, timer);
 
-	session->el = NULL;
-	session->pipefd[0] = session->pipefd[1] = -1;
+	worker->occupied[slot / 64] |= ((uint64_t) 1) << (slot % 64);
+	worker->num_timers++;
 
-	session->blocked = false;
+	/*
+	 *	The event is re-armed once all of the expired slots
+	 *	have been processed.
+	 */
+	if (!worker->processing) bfd_wheel_arm(worker, tick);
 }
 
 /*
- *	A child thread reads the packet from a pipe, and processes it.
+ *	Set the worker's event for the next slot which may have timers.
  */
-static void bfd_pipe_recv(UNUSED fr_event_list_t *xel, int fd, UNUSED int flags, void *ctx)
+static void bfd_wheel_schedule(bfd_worker_t *worker)
 {
-	ssize_t num;
-	bfd_state_t *session = ctx;
-	bfd_packet_t bfd;
+	uint32_t	slot, i;
+
+	if (!worker->num_timers) return;
 
-	if (session->blocked) return;
+	slot = worker->tick & (BFD_WHEEL_SLOTS - 1);
 
 	/*
-	 *	Read the header
+	 *	Walk the occupied bitmap, starting at the next slot,
+	 *	and wrapping round to just before it.
 	 */
-	num = read(fd, &bfd, 4);
-	if ((num < 4) || (bfd.length < 4)) {
-	fail:
-		ERROR("BFD Failed reading from pipe!");
-		session->blocked = true;
+	for (i = 0; i <= (BFD_WHEEL_SLOTS / 64); i++) {
+		uint32_t	word = ((slot / 64) + i) % (BFD_WHEEL_SLOTS / 64);
+		uint64_t	bits = worker->occupied[word];
+		uint32_t	next;
+
+		if (i == 0) bits &= ~((((uint64_t) 1) << (slot % 64)) - 1);
+		if (i == (BFD_WHEEL_SLOTS / 64)) bits &= (((uint64_t) 1) << (slot % 64)) - 1;
+		if (!bits) continue;
+
+		next = (word * 64) + fr_high_bit_pos(bits & (~bits + 1)) - 1;
+		bfd_wheel_arm(worker, worker->tick + ((next - slot) & (BFD_WHEEL_SLOTS - 1)));
 		return;
 	}
+}
+
+/*
+ *	Run the timers in one slot which expire on or before "tick".
+ */
+static void bfd_wheel_expire(bfd_worker_t *worker, uint32_t slot, uint64_t tick, fr_time_t now)
+{
+	fr_dlist_head_t	*list = &worker->slots[slot];
+	fr_dlist_head_t	expired;
+	bfd_timer_t	*timer, *next;
+
+	fr_dlist_init(&expired, bfd_timer_t, entry);
+
+	for (timer = fr_dlist_head(list); timer; timer = next) {
+		next = fr_dlist_next(list, timer);
+
+		if (timer->tick > tick) continue; /* a later revolution */
+
+		fr_dlist_remove(list, timer);
+		fr_dlist_insert_tail(&expired, timer);
+		timer->list = &expired;
+	}
+
+	if (fr_dlist_empty(list)) worker->occupied[slot / 64] &= ~(((uint64_t) 1) << (slot % 64));
+
+	/*
+	 *	The callbacks may delete or insert any timer,
+	 *	including ones which are still on the expired list.
+	 */
+	while ((timer = fr_dlist_head(&expired))) {
+		bfd_stats_t *stats = &timer->session->stats;
+
+		bfd_timer_delete(timer);
+
+		if ((now - timer->when) > stats->timer_late_max) stats->timer_late_max = now - timer->when;
+
+		timer->callback(timer->session, now);
+	}
+}
+
+static void bfd_wheel_tick(UNUSED fr_event_list_t *el, fr_time_t now, void *ctx)
+{
+	bfd_worker_t	*worker = ctx;
+	uint64_t	now_tick = (uint64_t) now / BFD_WHEEL_TICK;
+
+	/*
+	 *	If we're more than one revolution behind, a single
+	 *	pass over every slot runs everything which has
+	 *	expired.
+	 */
+	if ((now_tick >= worker->tick) && ((now_tick - worker->tick) >= BFD_WHEEL_SLOTS)) {
+		worker->tick = now_tick - BFD_WHEEL_SLOTS + 1;
+	}
+
+	worker->processing = true;
+	while (worker->tick <= now_tick) {
+		uint64_t	tick = worker->tick++;
+		uint32_t	slot = tick & (BFD_WHEEL_SLOTS - 1);
+
+		if (!(worker->occupied[slot / 64] & (((uint64_t) 1) << (slot % 64)))) continue;
+
+		bfd_wheel_expire(worker, slot, tick, now);
+	}
+	worker->processing = false;
+
+	bfd_worker_flush(worker);
+	bfd_wheel_schedule(worker);
+}
+
+/*
+ *	Queue a packet for sending.  Packets are signed and sent in
+ *	batches, once the worker has finished processing its timers
+ *	or the packets it has received.
+ */
+static void bfd_send(bfd_state_t *session, bfd_packet_t const *bfd)
+{
+	bfd_worker_t	*worker = session->worker;
+
+	if (worker->batched == BFD_BATCH_MAX) bfd_worker_flush(worker);
+
+	worker->batch[worker->batched] = *bfd;
+	worker->batch_session[worker->batched] = session;
+	worker->batched++;
+}
+
+static void bfd_worker_flush(bfd_worker_t *worker)
+{
+	int i, j;
+
+	if (!worker->batched) return;
+
+	for (i = 0; i < worker->batched; i++) {
+		bfd_state_t *session = worker->batch_session[i];
+
+		bfd_sign(session, &worker->batch[i]);
+
+		worker->iov[i].iov_base = &worker->batch[i];
+		worker->iov[i].iov_len = worker->batch[i].length;
+
+		worker->mmsgvec[i] = (struct mmsghdr) {
+			.msg_hdr = {
+				.msg_name = &session->remote_sockaddr,
+				.msg_namelen = session->salen,
+				.msg_iov = &worker->iov[i],
+				.msg_iovlen = 1
+			}
+		};
+
+		session->stats.packets_sent++;
+	}
 
 	/*
-	 *	This is already checked in the caller, but what the heck...
+	 *	Consecutive packets for the same socket are sent with
+	 *	one sendmmsg() call.
 	 */
-	if (bfd.length > sizeof(bfd)) goto fail;
+	for (i = 0; i < worker->batched; i = j) {
+		int	sockfd = worker->batch_session[i]->sockfd;
+		int	k;
+
+		for (j = i + 1; (j < worker->batched) && (worker->batch_session[j]->sockfd == sockfd); j++);
+
+		for (k = i; k < j; ) {
+			int sent;
+
+			sent = sendmmsg(sockfd, &worker->mmsgvec[k], j - k, 0);
+			if (sent <= 0) {
+				if ((sent < 0) && (errno == EINTR)) continue;
+
+				ERROR("Failed sending packet: %s", fr_syserror(errno));
+				break;
+			}
+			k += sent;
+		}
+	}
+
+	worker->batched = 0;
+}
+
+/*
+ *	A worker reads packets from a pipe, and processes them.
+ */
+static void bfd_pipe_recv(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *ctx)
+{
+	bfd_worker_t	*worker = ctx;
+	bfd_pipe_msg_t	msg;
+	ssize_t		num;
 
 	/*
-	 *	Read the rest of the packet.
+	 *	Drain the pipe, so that packets which arrived together
+	 *	are answered together.
 	 */
-	num = read(fd, ((uint8_t *) &bfd) + 4, bfd.length - 4);
-	if ((num < 0) || ((num + 4) != bfd.length)) goto fail;
+	for (;;) {
+		num = read(fd, &msg, sizeof(msg));
+		if (num < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+
+			ERROR("BFD worker %d failed reading from pipe: %s", worker->id, fr_syserror(errno));
+			break;
+		}
+
+		/*
+		 *	Messages are smaller than PIPE_BUF, so they're
+		 *	written atomically.
+		 */
+		if (num != sizeof(msg)) {
+			if (num > 0) ERROR("BFD worker %d short read from pipe", worker->id);
+			break;
+		}
+
+		if (!msg.session) {
+			fr_event_loop_exit(worker->el, 1);
+			break;
+		}
 
-	bfd_process(session, &bfd);
+		bfd_process(msg.session, &msg.packet);
+	}
+
+	bfd_worker_flush(worker);
 }
 
 /*
- *	Do nothing more than read from the sockets and process the
+ *	Do nothing more than read from the pipe and process the
  *	timers.
  */
-static void *bfd_child_thread(void *ctx)
+static void *bfd_worker_thread(void *ctx)
 {
-	bfd_state_t *session = ctx;
+	bfd_worker_t	*worker = ctx;
+	bfd_state_t	*session = NULL;
 
-	DEBUG("BFD %d starting child thread", session->number);
-	bfd_start_control(session);
+	DEBUG("BFD worker %d starting with %zu sessions", worker->id, fr_dlist_num_elements(&worker->sessions));
 
-	fr_event_loop(session->el);
+	while ((session = fr_dlist_next(&worker->sessions, session))) bfd_start_control(session);
 
-	bfd_pthread_free(session);
+	fr_event_loop(worker->el);
 
 	return NULL;
 }
 
+static int _bfd_worker_free(bfd_worker_t *worker)
+{
+	bfd_state_t *session;
+
+	if (worker->running) {
+		bfd_pipe_msg_t	msg = { .session = NULL };
+		ssize_t		num;
+
+		do {
+			num = write(worker->pipefd[1], &msg, sizeof(msg));
+		} while ((num < 0) && ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK)));
+
+		if (num == sizeof(msg)) pthread_join(worker->pthread_id, NULL);
+	}
+
+	/*
+	 *	The sessions may outlive us.
+	 */
+	while ((session = fr_dlist_pop_head(&worker->sessions))) {
+		session->worker = NULL;
+		session->ev_timeout.list = NULL;
+		session->ev_packet.list = NULL;
+	}
+
+	if (worker->pipefd[0] >= 0) {
+		close(worker->pipefd[0]);
+		close(worker->pipefd[1]);
+	}
 
-static int bfd_pthread_create(bfd_state_t *session)
+	return 0;
+}
+
+static bfd_worker_t *bfd_worker_alloc(TALLOC_CTX *ctx, int id)
 {
-	pthread_attr_t attr;
+	bfd_worker_t	*worker;
+	int		i;
+
+	worker = talloc_zero(ctx, bfd_worker_t);
+	if (!worker) return NULL;
+
+	worker->id = id;
+	worker->pipefd[0] = worker->pipefd[1] = -1;
+	worker->tick = (uint64_t) fr_time() / BFD_WHEEL_TICK;
+	fr_dlist_talloc_init(&worker->sessions, bfd_state_t, entry);
+	for (i = 0; i < BFD_WHEEL_SLOTS; i++) fr_dlist_init(&worker->slots[i], bfd_timer_t, entry);
+	talloc_set_destructor(worker, _bfd_worker_free);
 
-	if (pipe(session->pipefd) < 0) {
+	/*
+	 *	Non-threaded operation.  Everything runs in the
+	 *	main event list.
+	 */
+	if (event_list) {
+		worker->el = event_list;
+		return worker;
+	}
+
+	if (pipe(worker->pipefd) < 0) {
 		ERROR("Failed opening pipe: %s", fr_syserror(errno));
-		return 0;
+		worker->pipefd[0] = worker->pipefd[1] = -1;
+	error:
+		talloc_free(worker);
+		return NULL;
 	}
 
-	session->el = fr_event_list_alloc(session, NULL, NULL);
-	if (!session->el) {
-		ERROR("Failed creating event list");
-	close_pipes:
-		close(session->pipefd[0]);
-		close(session->pipefd[1]);
-		session->pipefd[0] = session->pipefd[1] = -1;
-		return 0;
+	if ((fr_nonblock(worker->pipefd[0]) < 0) || (fr_nonblock(worker->pipefd[1]) < 0)) {
+		ERROR("Failed setting pipe to non-blocking: %s", fr_syserror(errno));
+		goto error;
 	}
 
-#ifdef O_NONBLOCK
-	fcntl(session->pipefd[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
-	fcntl(session->pipefd[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
-#endif
+	worker->el = fr_event_list_alloc(worker, NULL, NULL);
+	if (!worker->el) {
+		ERROR("Failed creating event list");
+		goto error;
+	}
 
-	if (fr_event_fd_insert(session, session->el, session->pipefd[0],
+	if (fr_event_fd_insert(worker, worker->el, worker->pipefd[0],
 			       bfd_pipe_recv,
 			       NULL,
 			       NULL,
-			       session) < 0) {
+			       worker) < 0) {
 		PERROR("Failed inserting file descriptor into event list");
-		goto close_pipes;
+		goto error;
 	}
 
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	return worker;
+}
 
-	/*
-	 *	Create the thread detached, so that it cleans up it's
-	 *	own memory when it exits.
-	 *
-	 *	Note that the function returns non-zero on error, NOT
-	 *	-1.  The return code is the error, and errno isn't set.
-	 */
-	if (fr_schedule_pthread_create(&session->pthread_id, bfd_child_thread, session) < 0) {
-		talloc_free(session->el);
-		session->el = NULL;
-		PERROR("Thread create failed");
-		goto close_pipes;
+static int bfd_worker_start(bfd_worker_t *worker)
+{
+	if (worker->el == event_list) return 0;
+
+	if (fr_schedule_pthread_create(&worker->pthread_id, bfd_worker_thread, worker) < 0) {
+		PERROR("BFD worker %d thread create failed", worker->id);
+		return -1;
 	}
-	pthread_attr_destroy(&attr);
+	worker->running = true;
 
-	return 1;
+	return 0;
+}
+
+static void bfd_stats_debug(bfd_state_t const *session)
+{
+	bfd_stats_t const *stats = &session->stats;
+
+	DEBUG("BFD %d sent %" PRIu64 ", received %" PRIu64 ", failed authentication %" PRIu64 ", dropped %" PRIu64,
+	      session->number, stats->packets_sent, stats->packets_recv, stats->auth_failed, stats->dropped);
+	DEBUG("BFD %d rx interval %" PRId64 "us (max %" PRId64 "us), rx jitter %" PRId64 "us, "
+	      "tx jitter %" PRId64 "us, timer late by up to %" PRId64 "us",
+	      session->number, fr_time_delta_to_usec(stats->rx_interval), fr_time_delta_to_usec(stats->rx_interval_max),
+	      fr_time_delta_to_usec(stats->rx_jitter), fr_time_delta_to_usec(stats->tx_jitter),
+	      fr_time_delta_to_usec(stats->timer_late_max));
+	DEBUG("BFD %d detection time %uus, %" PRIu64 " timeouts after %" PRId64 "us - %" PRId64 "us",
+	      session->number, session->detection_time, stats->detections,
+	      fr_time_delta_to_usec(stats->detect_min), fr_time_delta_to_usec(stats->detect_max));
 }
 
 static const char *bfd_state[] = {
@@ -416,6 +796,8 @@ static void bfd_trigger(bfd_state_t *session)
 	bfd_request(session, &request, &packet);
 
 	trigger_exec(&request, NULL, buffer, false, NULL);
+
+	if (DEBUG_ENABLED) bfd_stats_debug(session);
 }
 
 
@@ -423,11 +805,14 @@ static void bfd_session_free(void *ctx)
 {
 	bfd_state_t *session = ctx;
 
-	if (event_list != session->el) {
-		/*
-		 *	FIXME: this isn't particularly safe.
-		 */
-		bfd_pthread_free(session);
+	/*
+	 *	Workers are normally freed first, which stops their
+	 *	threads and detaches the sessions.
+	 */
+	if (session->worker) {
+		bfd_timer_delete(&session->ev_timeout);
+		bfd_timer_delete(&session->ev_packet);
+		fr_dlist_remove(&session->worker->sessions, session);
 	}
 
 	talloc_free(session);
@@ -483,6 +868,8 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 	bfd_state_t *session;
 
 	session = talloc_zero(sock, bfd_state_t);
+	bfd_timer_init(&session->ev_timeout, session, bfd_detection_timeout);
+	bfd_timer_init(&session->ev_packet, session, bfd_send_packet);
 
 	/*
 	 *	Initialize according to RFC.
@@ -524,8 +911,8 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 
 		rcode = cf_pair_parse(NULL, cs, "min_transmit_interval", FR_ITEM_POINTER(FR_TYPE_UINT32, &number), NULL, T_INVALID);
 		if (rcode == 0) {
-			if (number < 100) number = 100;
-			if (number > 10000) number = 10000;
+			if (number < BFD_MIN_INTERVAL) number = BFD_MIN_INTERVAL;
+			if (number > BFD_MAX_INTERVAL) number = BFD_MAX_INTERVAL;
 
 			session->desired_min_tx_interval = number * 1000;
 		}
@@ -536,8 +923,8 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 
 		rcode = cf_pair_parse(NULL, cs, "min_receive_interval", FR_ITEM_POINTER(FR_TYPE_UINT32, &number), NULL, T_INVALID);
 		if (rcode == 0) {
-			if (number < 100) number = 100;
-			if (number > 10000) number = 10000;
+			if (number < BFD_MIN_INTERVAL) number = BFD_MIN_INTERVAL;
+			if (number > BFD_MAX_INTERVAL) number = BFD_MAX_INTERVAL;
 
 			session->required_min_rx_interval = number * 1000;
 		}
@@ -603,22 +990,13 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 	bfd_trigger(session);
 
 	/*
-	 *	Check for threaded / non-threaded operation.
+	 *	Spread the sessions over the workers.  Threaded
+	 *	workers start their sessions when the thread starts.
 	 */
-	if (event_list) {
-		session->el = event_list;
-
-		bfd_start_control(session);
+	session->worker = sock->workers[session->number % sock->num_workers];
+	fr_dlist_insert_tail(&session->worker->sessions, session);
 
-		session->pipefd[0] = session->pipefd[1] = -1;
-		session->pthread_id = pthread_self();
-	} else {
-		if (!bfd_pthread_create(session)) {
-			rbtree_deletebydata(sock->session_tree, session);
-			talloc_free(session);
-			return NULL;
-		}
-	}
+	if (session->worker->el == event_list) bfd_start_control(session);
 
 	return session;
 }
@@ -883,9 +1261,8 @@ static void bfd_sign(bfd_state_t *session, bfd_packet_t *bfd)
 /*
  *	Send a packet.
  */
-static void bfd_send_packet(UNUSED fr_event_list_t *eel, UNUSED fr_time_t now, void *ctx)
+static void bfd_send_packet(bfd_state_t *session, UNUSED fr_time_t now)
 {
-	bfd_state_t *session = ctx;
 	bfd_packet_t bfd;
 
 	bfd_control_packet_init(session, &bfd);
@@ -898,15 +1275,9 @@ static void bfd_send_packet(UNUSED fr_event_list_t *eel, UNUSED fr_time_t now, v
 		bfd_start_packets(session);
 	}
 
-	bfd_sign(session, &bfd);
-
 	DEBUG("BFD %d sending packet state %s",
 	      session->number, bfd_state[session->session_state]);
-	if (sendto(session->sockfd, &bfd, bfd.length, 0,
-		   (struct sockaddr *) &session->remote_sockaddr,
-		   session->salen) < 0) {
-		ERROR("Failed sending packet: %s", fr_syserror(errno));
-	}
+	bfd_send(session, &bfd);
 }
 
 static int bfd_start_packets(bfd_state_t *session)
@@ -917,7 +1288,7 @@ static int bfd_start_packets(bfd_state_t *session)
 	/*
 	 *	Reset the timers.
 	 */
-	fr_event_timer_delete(&session->ev_packet);
+	bfd_timer_delete(&session->ev_packet);
 
 	session->last_sent = fr_time();
 
@@ -941,12 +1312,9 @@ static int bfd_start_packets(bfd_state_t *session)
 	jitter >>= 32;
 	interval = base;
 	interval += jitter;
+	session->stats.tx_jitter = fr_time_delta_from_usec(jitter);
 
-	if (fr_event_timer_in(session, session->el, &session->ev_packet,
-			      fr_time_delta_from_usec(interval),
-			      bfd_send_packet, session) < 0) {
-		fr_assert("Failed to insert event" == NULL);
-	}
+	bfd_timer_insert(&session->ev_packet, session->last_sent + fr_time_delta_from_usec(interval));
 
 	return 0;
 }
@@ -956,8 +1324,6 @@ static void bfd_set_timeout(bfd_state_t *session, fr_time_t when)
 {
 	fr_time_t now = when;
 
-	fr_event_timer_delete(&session->ev_timeout);
-
 	now += fr_time_delta_from_usec(session->detection_time);
 
 	if (session->detect_multi >= 2) {
@@ -970,10 +1336,7 @@ static void bfd_set_timeout(bfd_state_t *session, fr_time_t when)
 		session->next_recv += fr_time_delta_from_usec(delay);
 	}
 
-	if (fr_event_timer_at(session, session->el, &session->ev_timeout,
-			      now, bfd_detection_timeout, session) < 0) {
-		fr_assert("Failed to insert event" == NULL);
-	}
+	bfd_timer_insert(&session->ev_timeout, now);
 }
 
 
@@ -996,15 +1359,15 @@ static int bfd_start_control(bfd_state_t *session)
 
 	bfd_set_timeout(session, session->last_recv);
 
-	if (session->ev_packet) return 0;
+	if (bfd_timer_armed(&session->ev_packet)) return 0;
 
 	return bfd_start_packets(session);
 }
 
 static int bfd_stop_control(bfd_state_t *session)
 {
-	fr_event_timer_delete(&session->ev_timeout);
-	fr_event_timer_delete(&session->ev_packet);
+	bfd_timer_delete(&session->ev_timeout);
+	bfd_timer_delete(&session->ev_packet);
 	return 1;
 }
 
@@ -1049,8 +1412,8 @@ static int bfd_stop_poll(bfd_state_t *session)
 	 *	re-set the timers.
 	 */
 	if (!session->remote_demand_mode) {
-		fr_assert(session->ev_timeout != NULL);
-		fr_assert(session->ev_packet != NULL);
+		fr_assert(bfd_timer_armed(&session->ev_timeout));
+		fr_assert(bfd_timer_armed(&session->ev_packet));
 		session->doing_poll = 0;
 
 		bfd_stop_control(session);
@@ -1087,9 +1450,20 @@ static void bfd_set_desired_min_tx_interval(bfd_state_t *session, uint32_t value
 	bfd_start_poll(session);
 }
 
-static void bfd_detection_timeout(UNUSED fr_event_list_t *eel, fr_time_t now, void *ctx)
+static void bfd_detection_timeout(bfd_state_t *session, fr_time_t now)
 {
-	bfd_state_t *session = ctx;
+	/*
+	 *	How long it actually took us to notice.
+	 */
+	if (session->last_recv) {
+		fr_time_delta_t detect = now - session->last_recv;
+
+		if (!session->stats.detections || (detect < session->stats.detect_min)) {
+			session->stats.detect_min = detect;
+		}
+		if (detect > session->stats.detect_max) session->stats.detect_max = detect;
+	}
+	session->stats.detections++;
 
 	DEBUG("BFD %d Timeout state %s ****** ", session->number,
 	      bfd_state[session->session_state]);
@@ -1144,31 +1518,30 @@ static void bfd_poll_response(bfd_state_t *session)
 	 *	TO DO: rate limit poll responses.
 	 */
 
-	bfd_sign(session, &bfd);
-
-	if (sendto(session->sockfd, &bfd, bfd.length, 0,
-		   (struct sockaddr *) &session->remote_sockaddr,
-		   session->salen) < 0) {
-		ERROR("Failed sending poll response: %s", fr_syserror(errno));
-	}
+	bfd_send(session, &bfd);
 }
 
 
 static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd)
 {
+	fr_time_t now;
+
 	if (bfd->auth_present &&
 	    (session->auth_type == BFD_AUTH_RESERVED)) {
 		DEBUG("BFD %d packet asked to authenticate an unauthenticated session.", session->number);
+		session->stats.auth_failed++;
 		return 0;
 	}
 
 	if (!bfd->auth_present &&
 	    (session->auth_type != BFD_AUTH_RESERVED)) {
 		DEBUG("BFD %d packet failed to authenticate an authenticated session.", session->number);
+		session->stats.auth_failed++;
 		return 0;
 	}
 
 	if (bfd->auth_present && !bfd_authenticate(session, bfd)) {
+		session->stats.auth_failed++;
 		return 0;
 	}
 
@@ -1324,7 +1697,19 @@ static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd)
 	 *	We've received the packet for the purpose of Section
 	 *	6.8.4.
 	 */
-	session->last_recv = fr_time();
+	now = fr_time();
+	if (session->last_recv) {
+		fr_time_delta_t interval = now - session->last_recv;
+		fr_time_delta_t delta = interval - session->stats.rx_interval;
+
+		if (delta < 0) delta = -delta;
+		if (session->stats.packets_recv > 1) session->stats.rx_jitter += (delta - session->stats.rx_jitter) / 16;
+
+		session->stats.rx_interval = interval;
+		if (interval > session->stats.rx_interval_max) session->stats.rx_interval_max = interval;
+	}
+	session->stats.packets_recv++;
+	session->last_recv = now;
 
 	/*
 	 *	We've received a packet, but missed the previous one.
@@ -1502,40 +1887,30 @@ static int bfd_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	if (!event_list) {
-		uint8_t *p = (uint8_t *) &bfd;
-		size_t total = bfd.length;
+	if (!session->worker) return 0;
 
-		/*
-		 *	A child has had a problem.  Do some cleanups.
-		 */
-		if (session->blocked) bfd_pthread_free(session);
+	if (session->worker->el == event_list) {
+		rcode = bfd_process(session, &bfd);
+		bfd_worker_flush(session->worker);
+		return rcode;
+	}
 
-		/*
-		 *	No event list, try to create a new one.
-		 */
-		if (!session->el && !bfd_pthread_create(session)) {
-			DEBUG("BFD %d - error trying to create child thread",
-			      session->number);
-			return 0;
-		}
+	/*
+	 *	Hand the packet to the session's worker.  If the
+	 *	worker is that far behind, the packet is dropped, the
+	 *	same as if the socket buffer had filled.
+	 */
+	{
+		bfd_pipe_msg_t msg = { .session = session, .packet = bfd };
 
 		do {
-			rcode = write(session->pipefd[1], p, total);
-			if ((rcode < 0) && (errno == EINTR)) continue;
+			rcode = write(session->worker->pipefd[1], &msg, sizeof(msg));
+		} while ((rcode < 0) && (errno == EINTR));
 
-			if (rcode < 0) {
-				session->blocked = true;
-				return 0;
-			}
-
-			total -= rcode;
-			p += rcode;
-		} while (total > 0);
-		return 0;
+		if (rcode != sizeof(msg)) session->stats.dropped++;
 	}
 
-	return bfd_process(session, &bfd);
+	return 0;
 }
 
 static int bfd_parse_ip_port(CONF_SECTION *cs, fr_ipaddr_t *ipaddr, uint16_t *port)
@@ -1669,12 +2044,16 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 
 	if (cf_pair_parse(sock, cs, "interface", FR_ITEM_POINTER(FR_TYPE_STRING, &sock->interface), NULL, T_INVALID) < 0) return -1;
 
+	if (cf_pair_parse(sock, cs, "min_transmit_interval", FR_ITEM_POINTER(FR_TYPE_UINT32,
+			  &sock->min_tx_interval), "1000", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(sock, cs, "min_receive_interval", FR_ITEM_POINTER(FR_TYPE_UINT32,
 			  &sock->min_rx_interval), "1000", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(sock, cs, "max_timeouts", FR_ITEM_POINTER(FR_TYPE_UINT32,
 			  &sock->max_timeouts), "3", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(sock, cs, "demand", FR_ITEM_POINTER(FR_TYPE_BOOL, &sock->demand),
 			  "no", T_DOUBLE_QUOTED_STRING) < 0) return -1;
+	if (cf_pair_parse(sock, cs, "threads", FR_ITEM_POINTER(FR_TYPE_UINT32, &sock->num_workers),
+			  "1", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(NULL, cs, "auth_type", FR_ITEM_POINTER(FR_TYPE_STRING, &auth_type_str),
 			  NULL, T_INVALID) < 0) return -1;
 
@@ -1687,11 +2066,18 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		sock->server_cs = this->server_cs;
 	}
 
-	if (sock->min_tx_interval < 100) sock->min_tx_interval = 100;
-	if (sock->min_tx_interval > 10000) sock->min_tx_interval = 10000;
+	if (sock->min_tx_interval < BFD_MIN_INTERVAL) sock->min_tx_interval = BFD_MIN_INTERVAL;
+	if (sock->min_tx_interval > BFD_MAX_INTERVAL) sock->min_tx_interval = BFD_MAX_INTERVAL;
 
-	if (sock->min_rx_interval < 100) sock->min_rx_interval = 100;
-	if (sock->min_rx_interval > 10000) sock->min_rx_interval = 10000;
+	if (sock->min_rx_interval < BFD_MIN_INTERVAL) sock->min_rx_interval = BFD_MIN_INTERVAL;
+	if (sock->min_rx_interval > BFD_MAX_INTERVAL) sock->min_rx_interval = BFD_MAX_INTERVAL;
+
+	/*
+	 *	Without threads, everything runs in the main event
+	 *	list.
+	 */
+	if (event_list || (sock->num_workers == 0)) sock->num_workers = 1;
+	if (sock->num_workers > BFD_MAX_WORKERS) sock->num_workers = BFD_MAX_WORKERS;
 
 	if (sock->max_timeouts == 0) sock->max_timeouts = 1;
 	if (sock->max_timeouts > 10) sock->max_timeouts = 10;
@@ -1740,6 +2126,7 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 {
 	int rcode;
+	uint32_t i;
 	uint16_t port;
 	bfd_socket_t *sock = this->data;
 
@@ -1769,6 +2156,12 @@ static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
+	sock->workers = talloc_zero_array(sock, bfd_worker_t *, sock->num_workers);
+	for (i = 0; i < sock->num_workers; i++) {
+		sock->workers[i] = bfd_worker_alloc(sock, i);
+		if (!sock->workers[i]) return -1;
+	}
+
 	/*
 	 *	Bootstrap the initial set of connections.
 	 */
@@ -1776,6 +2169,10 @@ static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
+	for (i = 0; i < sock->num_workers; i++) {
+		if (bfd_worker_start(sock->workers[i]) < 0) return -1;
+	}
+
 	return 0;
 }
 
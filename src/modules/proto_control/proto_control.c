@@ -40,6 +40,7 @@ static CONF_PARSER const limit_config[] = {
 	{ FR_CONF_OFFSET("max_connections", FR_TYPE_UINT32, proto_control_t, io.max_connections), .dflt = "1024" } ,
 	{ FR_CONF_OFFSET("max_clients", FR_TYPE_UINT32, proto_control_t, io.max_clients), .dflt = "256" } ,
 	{ FR_CONF_OFFSET("max_pending_packets", FR_TYPE_UINT32, proto_control_t, io.max_pending_packets), .dflt = "256" } ,
+	{ FR_CONF_OFFSET("max_nak_clients", FR_TYPE_UINT32, proto_control_t, io.max_nak_clients), .dflt = "1024" } ,
 
 	/*
 	 *	For performance tweaking.  NOT for normal humans.
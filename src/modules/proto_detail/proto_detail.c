@@ -23,6 +23,7 @@
  * @copyright 2016 Alan DeKok (aland@freeradius.org)
  */
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
@@ -233,6 +234,67 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, UNUSED void *parent,
 /** Decode the packet, and set the request->process function
  *
  */
+/** Set the original src/dst ip/port from a pair
+ *
+ * @return true if the pair was one of the address attributes.
+ */
+static bool detail_packet_addr_set(REQUEST *request, VALUE_PAIR const *vp)
+{
+	if ((vp->da == attr_packet_src_ip_address) ||
+	    (vp->da == attr_packet_src_ipv6_address)) {
+		request->packet->src_ipaddr = vp->vp_ip;
+	} else if ((vp->da == attr_packet_dst_ip_address) ||
+		   (vp->da == attr_packet_dst_ipv6_address)) {
+		request->packet->dst_ipaddr = vp->vp_ip;
+	} else if (vp->da == attr_packet_src_port) {
+		request->packet->src_port = vp->vp_uint16;
+	} else if (vp->da == attr_packet_dst_port) {
+		request->packet->dst_port = vp->vp_uint16;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+/** Decode a binary detail record
+ *
+ * The record holds the protocol, the original timestamp, and the
+ * pairs in the internal encoding, so there's no text to parse.
+ */
+static int mod_decode_binary(proto_detail_t const *inst, REQUEST *request, uint8_t *const data, size_t data_len)
+{
+	fr_detail_record_t	rec;
+	fr_dict_t const		*dict;
+	VALUE_PAIR		*vp, *head = NULL;
+	fr_cursor_t		cursor;
+
+	if (fr_detail_record_decode(request->packet, &head, &dict, &rec, data, data_len) < 0) {
+		RPEDEBUG("Failed decoding binary detail record");
+		return -1;
+	}
+	request->dict = dict;
+
+	for (vp = fr_cursor_init(&cursor, &head);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		(void) detail_packet_addr_set(request, vp);
+	}
+
+	vp = fr_pair_afrom_da(request->packet, attr_packet_original_timestamp);
+	if (vp) {
+		vp->vp_date = rec.timestamp;
+		fr_pair_add(&head, vp);
+	}
+
+	fr_pair_add(&request->packet->vps, head);
+
+	/*
+	 *	Let the app_io take care of populating additional fields in the request
+	 */
+	return inst->app_io->decode(inst->app_io_instance, request, data, data_len);
+}
+
 static int mod_decode(void const *instance, REQUEST *request, uint8_t *const data, size_t data_len)
 {
 	proto_detail_t const	*inst = talloc_get_type_abort_const(instance, proto_detail_t);
@@ -257,6 +319,8 @@ static int mod_decode(void const *instance, REQUEST *request, uint8_t *const dat
 	request->reply->src_ipaddr = request->packet->src_ipaddr;
 	request->reply->dst_ipaddr = request->packet->src_ipaddr;
 
+	if (fr_detail_record_is_binary(data, data_len)) return mod_decode_binary(inst, request, data, data_len);
+
 	end = data + data_len;
 
 	MPRINT("HEADER %s", data);
@@ -351,23 +415,11 @@ static int mod_decode(void const *instance, REQUEST *request, uint8_t *const dat
 		/*
 		 *	Set the original src/dst ip/port
 		 */
-		if (vp) {
-			if ((vp->da == attr_packet_src_ip_address) ||
-			    (vp->da == attr_packet_src_ipv6_address)) {
-				request->packet->src_ipaddr = vp->vp_ip;
-			} else if ((vp->da == attr_packet_dst_ip_address) ||
-				   (vp->da == attr_packet_dst_ipv6_address)) {
-				request->packet->dst_ipaddr = vp->vp_ip;
-			} else if (vp->da == attr_packet_src_port) {
-				request->packet->src_port = vp->vp_uint16;
-			} else if (vp->da == attr_packet_dst_port) {
-				request->packet->dst_port = vp->vp_uint16;
-			} else if (vp->da == attr_protocol) {
-				request->dict = fr_dict_by_protocol_num(vp->vp_uint32);
-				if (!request->dict) {
-					REDEBUG("Invalid protocol: %pP", vp);
-					goto error;
-				}
+		if (vp && !detail_packet_addr_set(request, vp) && (vp->da == attr_protocol)) {
+			request->dict = fr_dict_by_protocol_num(vp->vp_uint32);
+			if (!request->dict) {
+				REDEBUG("Invalid protocol: %pP", vp);
+				goto error;
 			}
 		}
 
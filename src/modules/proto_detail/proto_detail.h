@@ -103,6 +103,15 @@ struct proto_detail_work_s {
 
 typedef struct proto_detail_work_thread_s proto_detail_work_thread_t;
 
+/** Progress through one block of a binary detail file
+ *
+ */
+typedef struct {
+	off_t				offset;			//!< of the block header in the file
+	uint8_t				flags;			//!< from the block header
+	uint32_t			pending;		//!< records which haven't been acknowledged
+} proto_detail_block_t;
+
 struct proto_detail_work_thread_s {
 	char const			*name;			//!< debug name for printing
 	proto_detail_work_t const	*inst;			//!< instance data
@@ -117,6 +126,11 @@ struct proto_detail_work_thread_s {
 
 	char const			*filename_work;		//!< work file name
 	fr_dlist_head_t			list;			//!< for retransmissions
+	fr_dlist_head_t			window;			//!< entries in flight, in file order
+
+	uint8_t				*map;			//!< read-only mapping of filename_work
+	size_t				map_len;		//!< length of the mapping
+	size_t				map_released;		//!< pages before this have been released
 
 	uint32_t       			outstanding;		//!< number of currently outstanding records;
 	fr_time_delta_t			lock_interval;		//!< interval between trying the locks.
@@ -133,9 +147,21 @@ struct proto_detail_work_thread_s {
 	size_t				last_search;		//!< where we last searched in the buffer
 								//!< MUST be offset, as the buffers can change.
 
+	bool				binary;			//!< filename_work holds binary blocks, not text
+	off_t				data_end;		//!< end of the blocks, and start of any index
+	off_t				block_offset;		//!< of the current block header
+	bool				block_compressed;	//!< records in the current block were compressed
+	uint8_t const			*records;		//!< of the current block
+	size_t				records_len;		//!< length of the records
+	size_t				records_pos;		//!< offset of the next record
+	uint8_t				*block_stored;		//!< block as read from the file, when it isn't mapped
+	uint8_t				*block_raw;		//!< decompressed records
+	proto_detail_block_t		*block;			//!< tracks acknowledgements for the current block
+
 	off_t				file_size;		//!< size of the file
 	off_t				header_offset;		//!< offset of the current header we're reading
 	off_t				read_offset;		//!< where we're reading from in filename_work
+	off_t				checkpoint;		//!< all entries before this have been acknowledged
 
 	fr_event_timer_t const		*ev;			//!< for detail file timers.
 
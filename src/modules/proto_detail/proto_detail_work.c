@@ -24,6 +24,7 @@
  */
 #include <netdb.h>
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/io/base.h>
@@ -36,6 +37,7 @@
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #ifndef NDEBUG
 #if 0
@@ -56,15 +58,21 @@ typedef struct {
 	proto_detail_work_thread_t	*parent;		//!< talloc_parent is SLOW!
 	fr_time_t			timestamp;		//!< when we read the entry.
 	off_t				done_offset;		//!< where we're tracking the status
+	off_t				offset;			//!< start of the entry in the file
+	off_t				end;			//!< end of the entry in the file
+	bool				done;			//!< the entry has been acknowledged
 
 	int				id;			//!< for retransmission counters
 
 	uint8_t				*packet;		//!< for retransmissions
 	size_t				packet_len;		//!< for retransmissions
 
+	proto_detail_block_t		*block;			//!< binary block holding the entry
+
 	fr_retry_t			retry;			//!< our retry timers
 	fr_event_timer_t const		*ev;			//!< retransmission timer
 	fr_dlist_t			entry;			//!< for the retransmission list
+	fr_dlist_t			window_entry;		//!< for the in-flight window, in file order
 } fr_detail_entry_t;
 
 static CONF_PARSER limit_config[] = {
@@ -145,6 +153,242 @@ static fr_event_update_t resume_read[] = {
 	{ 0 }
 };
 
+/** Allocate the tracking entry for a record
+ *
+ */
+static fr_detail_entry_t *work_track_alloc(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+					   uint8_t const *buffer, size_t packet_len, off_t done_offset, off_t end)
+{
+	fr_detail_entry_t *track;
+
+	track = talloc_zero(thread, fr_detail_entry_t);
+	track->parent = thread;
+	track->timestamp = fr_time();
+	track->id = thread->count++;
+
+	track->done_offset = done_offset;
+	if (inst->retransmit) {
+		track->packet = talloc_memdup(track, buffer, packet_len);
+		track->packet_len = packet_len;
+	}
+
+	/*
+	 *	Entries can be acknowledged in any order, so remember
+	 *	where each one lives in the file.
+	 */
+	track->offset = thread->header_offset;
+	track->end = end;
+	fr_dlist_insert_tail(&thread->window, track);
+
+	thread->header_offset = end;
+
+	return track;
+}
+
+/** Read from the work file, or from its mapping
+ *
+ */
+static ssize_t work_pread(proto_detail_work_thread_t *thread, uint8_t *out, size_t len, off_t offset)
+{
+	if (!thread->map) return pread(thread->fd, out, len, offset);
+
+	if ((size_t) offset >= thread->map_len) return 0;
+	if (len > (thread->map_len - offset)) len = thread->map_len - offset;
+
+	memcpy(out, thread->map + offset, len);
+	return len;
+}
+
+/** Account for one record of a binary block being finished with
+ *
+ * Compressed records can't be marked individually, so once all of
+ * the records in a block have been acknowledged, the whole block is
+ * marked as done.
+ */
+static void work_block_done(proto_detail_work_thread_t *thread, proto_detail_block_t *block)
+{
+	uint8_t flags;
+
+	if (!block || !block->pending) return;
+
+	if (--block->pending > 0) return;
+
+	flags = block->flags | FR_DETAIL_FLAG_DONE;
+	if (pwrite(thread->fd, &flags, sizeof(flags), block->offset + FR_DETAIL_BLOCK_FLAGS_OFFSET) < 0) {
+		ERROR("%s - Failed marking block as done: %s", thread->name, fr_syserror(errno));
+	}
+
+	if (thread->block == block) thread->block = NULL;
+	talloc_free(block);
+}
+
+/** Load the next block of a binary detail file
+ *
+ * @return
+ *	- 1 if a block was loaded.
+ *	- 0 if there are no more blocks.
+ *	- -1 on error.
+ */
+static int work_block_load(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread)
+{
+	fr_detail_block_t	block;
+	uint8_t			hdr[FR_DETAIL_BLOCK_HDR_LEN];
+	uint8_t const		*stored;
+	ssize_t			slen;
+
+	thread->records = NULL;
+	thread->records_len = thread->records_pos = 0;
+	thread->block = NULL;
+
+redo:
+	if (thread->read_offset >= thread->data_end) return 0;
+
+	slen = work_pread(thread, hdr, sizeof(hdr), thread->read_offset);
+	if (slen < 0) {
+		ERROR("proto_detail (%s): Failed reading file %s: %s",
+		      thread->name, thread->filename_work, fr_syserror(errno));
+		return -1;
+	}
+	if (slen == 0) return 0;
+
+	if (fr_detail_block_header_decode(&block, hdr, slen) <= 0) {
+		if (slen < (ssize_t) sizeof(hdr)) fr_strerror_printf("Truncated block header");
+	malformed:
+		PERROR("proto_detail (%s): Malformed block at offset %zu of file %s",
+		       thread->name, (size_t) thread->read_offset, thread->filename_work);
+		return -1;
+	}
+
+	/*
+	 *	The index is only ever at the end.
+	 */
+	if (block.flags & FR_DETAIL_FLAG_INDEX) {
+		thread->data_end = thread->read_offset;
+		return 0;
+	}
+
+	thread->block_offset = thread->read_offset;
+	thread->read_offset += FR_DETAIL_BLOCK_HDR_LEN + block.stored_len;
+
+	if ((block.flags & FR_DETAIL_FLAG_DONE) || !block.num_records) goto redo;
+
+	/*
+	 *	Uncompressed blocks in a mapped file are parsed
+	 *	in place.
+	 */
+	if (thread->map) {
+		if ((size_t) thread->read_offset > thread->map_len) {
+			fr_strerror_printf("Truncated block");
+			goto malformed;
+		}
+		stored = thread->map + thread->block_offset + FR_DETAIL_BLOCK_HDR_LEN;
+	} else {
+		if (talloc_array_length(thread->block_stored) < block.stored_len) {
+			talloc_free(thread->block_stored);
+			MEM(thread->block_stored = talloc_array(thread, uint8_t, block.stored_len));
+		}
+
+		slen = pread(thread->fd, thread->block_stored, block.stored_len,
+			     thread->block_offset + FR_DETAIL_BLOCK_HDR_LEN);
+		if (slen < 0) {
+			ERROR("proto_detail (%s): Failed reading file %s: %s",
+			      thread->name, thread->filename_work, fr_syserror(errno));
+			return -1;
+		}
+		if ((size_t) slen < block.stored_len) {
+			fr_strerror_printf("Truncated block");
+			goto malformed;
+		}
+		stored = thread->block_stored;
+	}
+
+	if (block.compress == FR_DETAIL_COMPRESS_NONE) {
+		thread->records = stored;
+	} else {
+		if (talloc_array_length(thread->block_raw) < block.raw_len) {
+			talloc_free(thread->block_raw);
+			MEM(thread->block_raw = talloc_array(thread, uint8_t, block.raw_len));
+		}
+
+		if (fr_detail_block_decompress(thread->block_raw, block.raw_len, &block, stored) < 0) goto malformed;
+		thread->records = thread->block_raw;
+	}
+	thread->records_len = block.raw_len;
+	thread->block_compressed = (block.compress != FR_DETAIL_COMPRESS_NONE);
+
+	if (inst->track_progress) {
+		MEM(thread->block = talloc_zero(thread, proto_detail_block_t));
+		thread->block->offset = thread->block_offset;
+		thread->block->flags = block.flags;
+		thread->block->pending = block.num_records;
+	}
+
+	return 1;
+}
+
+/** Get the next record from a binary detail file
+ *
+ * Blocks are read whole, and decompressed if necessary.  Records
+ * are then handed out one at a time, in file order.
+ *
+ * @return
+ *	- >0 the length of the record copied to buffer.
+ *	- 0 there are no more records.
+ *	- -1 on error.
+ */
+static ssize_t work_read_binary(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+				uint8_t *buffer, size_t buffer_len, off_t *done_offset)
+{
+	uint8_t const	*p;
+	ssize_t		slen;
+	int		ret;
+
+	for (;;) {
+		if (thread->records_pos >= thread->records_len) {
+			ret = work_block_load(inst, thread);
+			if (ret <= 0) return ret;
+		}
+
+		p = thread->records + thread->records_pos;
+		slen = fr_detail_record_len(p, thread->records_len - thread->records_pos);
+		if (slen <= 0) {
+			if (slen == 0) fr_strerror_printf("Truncated record");
+			PERROR("proto_detail (%s): Malformed record in block at offset %zu of file %s",
+			       thread->name, (size_t) thread->block_offset, thread->filename_work);
+			return -1;
+		}
+		thread->records_pos += slen;
+
+		if (p[FR_DETAIL_RECORD_FLAGS_OFFSET] & FR_DETAIL_FLAG_DONE) {
+			work_block_done(thread, thread->block);
+			continue;
+		}
+
+		if (((size_t) slen > buffer_len) || ((size_t) slen > inst->parent->max_packet_size)) {
+			DEBUG("Ignoring 'too large' entry in block at offset %zu of %s",
+			      (size_t) thread->block_offset, thread->filename_work);
+			DEBUG("Entry size %zd is greater than allowed maximum %u",
+			      slen, inst->parent->max_packet_size);
+			work_block_done(thread, thread->block);
+			continue;
+		}
+
+		memcpy(buffer, p, slen);
+
+		/*
+		 *	Records in uncompressed blocks are marked as
+		 *	done in place.
+		 */
+		*done_offset = 0;
+		if (!thread->block_compressed) {
+			*done_offset = thread->block_offset + FR_DETAIL_BLOCK_HDR_LEN +
+				       (p - thread->records) + FR_DETAIL_RECORD_FLAGS_OFFSET;
+		}
+
+		return slen;
+	}
+}
+
 static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, UNUSED bool *is_dup)
 {
 	proto_detail_work_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_work_t);
@@ -162,6 +406,8 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 
 	MPRINT("AT COUNT %d offset %ld", thread->count, (long) thread->read_offset);
 
+	if (thread->binary) li->recv_pending = 0;
+
 	/*
 	 *	Process retransmissions before anything else in the
 	 *	file.
@@ -212,6 +458,50 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 		return 0;
 	}
 
+	if (thread->binary) {
+		done_offset = 0;
+		data_size = work_read_binary(inst, thread, buffer, buffer_len, &done_offset);
+		if (data_size < 0) return -1;
+
+		*leftover = 0;
+		thread->eof = (thread->records_pos >= thread->records_len) && (thread->read_offset >= thread->data_end);
+
+		if (data_size == 0) {
+			thread->closing = true;
+
+			/*
+			 *	Every record had already been replayed,
+			 *	so we're done with the file.
+			 */
+			if (!thread->outstanding) return -1;
+			return 0;
+		}
+		packet_len = data_size;
+
+		/*
+		 *	The checkpoint can only move past a block once
+		 *	its last record has been acknowledged.
+		 */
+		track = work_track_alloc(inst, thread, buffer, packet_len, done_offset,
+					 (thread->records_pos < thread->records_len) ?
+					 thread->block_offset : thread->read_offset);
+		track->block = thread->block;
+
+		/*
+		 *	Keep the descriptor readable until we're at EOF,
+		 *	and tell the network side when there are more
+		 *	records from this block ready to go.
+		 */
+		(void) lseek(thread->fd, thread->eof ? thread->read_offset : 0, SEEK_SET);
+		if ((thread->records_pos < thread->records_len) &&
+		    ((thread->outstanding + 1) < inst->max_outstanding)) li->recv_pending = 1;
+
+		*packet_ctx = track;
+		*recv_time_p = track->timestamp;
+		*priority = inst->parent->priority;
+		goto done;
+	}
+
 	/*
 	 *	If we've cached leftover data from the ring buffer,
 	 *	copy it back.
@@ -247,19 +537,36 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 
 		room = buffer_len - *leftover;
 
-		data_size = read(thread->fd, partial, room);
-		if (data_size < 0) {
-			ERROR("proto_detail (%s): Failed reading file %s: %s",
-			      thread->name, thread->filename_work, fr_syserror(errno));
-			return -1;
+		if (thread->map) {
+			/*
+			 *	The file is mapped, so "reading" is
+			 *	just a copy out of the page cache.
+			 */
+			data_size = thread->map_len - thread->read_offset;
+			if ((size_t) data_size > room) data_size = room;
+
+			memcpy(partial, thread->map + thread->read_offset, data_size);
+			thread->read_offset += data_size;
+
+		} else {
+			data_size = read(thread->fd, partial, room);
+			if (data_size < 0) {
+				ERROR("proto_detail (%s): Failed reading file %s: %s",
+				      thread->name, thread->filename_work, fr_syserror(errno));
+				return -1;
+			}
+
+			/*
+			 *	Remember the read offset.
+			 */
+			thread->read_offset = lseek(thread->fd, 0, SEEK_CUR);
 		}
 
 		MPRINT("GOT %zd bytes", data_size);
 
 		/*
-		 *	Remember the read offset, and whether we got EOF.
+		 *	Remember whether we got EOF.
 		 */
-		thread->read_offset = lseek(thread->fd, 0, SEEK_CUR);
 
 		/*
 		 *	Only set EOF if there's no more data in the buffer to manage.
@@ -484,23 +791,11 @@ redo:
 	}
 
 	/*
-	 *	Allocate the tracking entry.
+	 *	Allocate the tracking entry.  We've read one more
+	 *	packet.
 	 */
-	track = talloc_zero(thread, fr_detail_entry_t);
-	track->parent = thread;
-	track->timestamp = fr_time();
-	track->id = thread->count++;
-
-	track->done_offset = done_offset;
-	if (inst->retransmit) {
-		track->packet = talloc_memdup(track, buffer, packet_len);
-		track->packet_len = packet_len;
-	}
-
-	/*
-	 *	We've read one more packet.
-	 */
-	thread->header_offset += packet_len;
+	track = work_track_alloc(inst, thread, buffer, packet_len, done_offset,
+				 thread->header_offset + packet_len);
 
 	*packet_ctx = track;
 	*recv_time_p = track->timestamp;
@@ -542,6 +837,52 @@ done:
 }
 
 
+/** Mark an entry as acknowledged, and advance the checkpoint
+ *
+ * Entries complete in whatever order the workers finish them.  Each
+ * one has its own "Done" marker in the file, so replay is safe no
+ * matter the order.  The checkpoint only moves forward over entries
+ * which are contiguously complete, and the mapped pages behind it are
+ * released, as they will never be read again.
+ */
+static void work_checkpoint(proto_detail_work_thread_t *thread, fr_detail_entry_t *track)
+{
+	track->done = true;
+	TALLOC_FREE(track->packet);
+
+	while ((track = fr_dlist_head(&thread->window)) != NULL) {
+		if (!track->done) break;
+
+		thread->checkpoint = track->end;
+		fr_dlist_remove(&thread->window, track);
+
+		/*
+		 *	@todo - add a used / free pool for these
+		 */
+		talloc_free(track);
+	}
+
+	/*
+	 *	Nothing is in flight, so everything we've parsed has
+	 *	been dealt with, including skipped entries.
+	 */
+	if (!track) thread->checkpoint = thread->header_offset;
+
+#ifdef MADV_DONTNEED
+	if (thread->map) {
+		size_t	pagesize = getpagesize();
+		size_t	release = ((size_t) thread->checkpoint / pagesize) * pagesize;
+
+		if (release > thread->map_released) {
+			(void) madvise(thread->map + thread->map_released, release - thread->map_released, MADV_DONTNEED);
+			thread->map_released = release;
+		}
+	}
+#endif
+
+	MPRINT("CHECKPOINT at %ld", (long) thread->checkpoint);
+}
+
 static void work_retransmit(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
 {
 	fr_detail_entry_t		*track = talloc_get_type_abort(uctx, fr_detail_entry_t);
@@ -614,7 +955,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 				      track->retry.next, work_retransmit, track) < 0) {
 			ERROR("%s - Failed inserting retransmission timeout", thread->name);
 		fail:
-			if (inst->track_progress && (track->done_offset > 0)) goto mark_done;
+			if (inst->track_progress && ((track->done_offset > 0) || track->block)) goto mark_done;
 			goto free_track;
 		}
 
@@ -625,17 +966,27 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 
 		return 1;
 
-	} else if (inst->track_progress && (track->done_offset > 0)) {
+	} else if (inst->track_progress && ((track->done_offset > 0) || track->block)) {
 	mark_done:
 		/*
-		 *	Seek to the entry, mark it as done, and then seek to
-		 *	the point in the file where we were reading from.
+		 *	Mark the entry as done, without disturbing the
+		 *	point in the file where we were reading from.
 		 */
-		(void) lseek(thread->fd, track->done_offset, SEEK_SET);
-		if (write(thread->fd, "Done", 4) < 0) {
-			ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
+		if (!thread->binary) {
+			if (pwrite(thread->fd, "Done", 4, track->done_offset) < 0) {
+				ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
+			}
+		} else {
+			uint8_t flags = FR_DETAIL_FLAG_DONE;
+
+			if ((track->done_offset > 0) &&
+			    (pwrite(thread->fd, &flags, sizeof(flags), track->done_offset) < 0)) {
+				ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
+			}
+
+			work_block_done(thread, track->block);
+			track->block = NULL;
 		}
-		(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
 	}
 
 free_track:
@@ -656,10 +1007,7 @@ free_track:
 		(void) lseek(thread->fd, 0, SEEK_SET);
 	}
 
-	/*
-	 *	@todo - add a used / free pool for these
-	 */
-	talloc_free(track);
+	work_checkpoint(thread, track);
 
 	/*
 	 *	Close the socket if we're at EOF, and there are no
@@ -682,7 +1030,10 @@ static int mod_open(fr_listen_t *li)
 	proto_detail_work_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_work_t);
 	proto_detail_work_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_detail_work_thread_t);
 
+	struct stat			buf;
+
 	fr_dlist_init(&thread->list, fr_detail_entry_t, entry);
+	fr_dlist_init(&thread->window, fr_detail_entry_t, window_entry);
 
 	/*
 	 *	Open the file if we haven't already been given one.
@@ -697,17 +1048,60 @@ static int mod_open(fr_listen_t *li)
 		}
 	}
 
+	if (fstat(thread->fd, &buf) < 0) {
+		cf_log_err(inst->cs, "Failed examining %s: %s", thread->filename_work, fr_syserror(errno));
+		return -1;
+	}
+
 	/*
-	 *	If we're tracking progress, learn where the EOF is.
+	 *	The work file has been renamed away from the writer,
+	 *	so it won't grow underneath us.  Map it, and parse the
+	 *	entries directly from the page cache.  If the mapping
+	 *	fails, we fall back to read().
 	 */
-	if (inst->track_progress) {
-		struct stat buf;
+	if (S_ISREG(buf.st_mode) && (buf.st_size > 0)) {
+		void *map;
+
+		map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, thread->fd, 0);
+		if (map != MAP_FAILED) {
+			thread->map = map;
+			thread->map_len = buf.st_size;
+#ifdef MADV_SEQUENTIAL
+			(void) madvise(map, buf.st_size, MADV_SEQUENTIAL);
+#endif
+		} else {
+			DEBUG("Failed mapping %s, falling back to read(): %s",
+			      thread->filename_work, fr_syserror(errno));
+		}
+	}
 
-		if (fstat(thread->fd, &buf) < 0) {
-			cf_log_err(inst->cs, "Failed examining %s: %s", thread->filename_work, fr_syserror(errno));
-			return -1;
+	/*
+	 *	Binary files are read block by block, and end either
+	 *	at EOF, or at the block index.
+	 */
+	{
+		uint8_t magic[FR_DETAIL_MAGIC_LEN];
+
+		if ((pread(thread->fd, magic, sizeof(magic), 0) == sizeof(magic)) &&
+		    fr_detail_is_binary(magic, sizeof(magic))) {
+			fr_detail_index_t	*index;
+			uint32_t		num;
+			uint64_t		offset;
+
+			thread->binary = true;
+			thread->data_end = buf.st_size;
+
+			if (fr_detail_index_read(thread, &index, &num, &offset, thread->fd, buf.st_size) == 1) {
+				thread->data_end = offset;
+				talloc_free(index);
+			}
 		}
+	}
 
+	/*
+	 *	If we're tracking progress, learn where the EOF is.
+	 */
+	if (inst->track_progress) {
 		thread->file_size = buf.st_size;
 	} else {
 		/*
@@ -746,6 +1140,11 @@ static int mod_close_internal(proto_detail_work_thread_t *thread)
 
 	unlink(thread->filename_work);
 
+	if (thread->map) {
+		(void) munmap(thread->map, thread->map_len);
+		thread->map = NULL;
+	}
+
 	close(thread->fd);
 	thread->fd = -1;
 
@@ -877,7 +1276,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	}
 
 	FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, >=, 1);
-	FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, <=, 256);
+	FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, <=, 4096);
 
 	return 0;
 }
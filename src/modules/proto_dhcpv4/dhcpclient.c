@@ -53,7 +53,7 @@ static int retries = 3;
 static fr_time_delta_t	timeout;
 
 static int sockfd;
-#ifdef HAVE_LIBPCAP
+#if defined(HAVE_LIBPCAP) && !defined(HAVE_TPACKET_V3)
 static fr_pcap_t	*pcap;
 #endif
 
@@ -63,6 +63,9 @@ static int iface_ind = -1;
 #ifdef HAVE_LINUX_IF_PACKET_H
 static struct sockaddr_ll ll;	/* Socket address structure */
 #endif
+#ifdef HAVE_TPACKET_V3
+static fr_tpacket_t	*ring;	/* Memory mapped raw socket */
+#endif
 
 static bool raw_mode = false;
 static bool reply_expected = true;
@@ -338,6 +341,11 @@ static RADIUS_PACKET *fr_dhcpv4_recv_raw_loop(int lsockfd,
 		if (retval > 0 && FD_ISSET(lsockfd, &read_fd)) {
 			/* There is something to read on our socket */
 
+#ifdef HAVE_TPACKET_V3
+			if (ring) {
+				reply = fr_dhcpv4_raw_ring_recv(ring, packet_p);
+			} else
+#endif
 #ifdef HAVE_LINUX_IF_PACKET_H
 			reply = fr_dhcv4_raw_packet_recv(lsockfd, p_ll, packet_p);
 #else
@@ -487,7 +495,48 @@ static int send_with_socket(RADIUS_PACKET **reply, RADIUS_PACKET *packet)
 	return 0;
 }
 
-#ifdef HAVE_LIBPCAP
+#ifdef HAVE_TPACKET_V3
+static int send_with_ring(RADIUS_PACKET **reply, RADIUS_PACKET *packet)
+{
+	fr_tpacket_config_t conf = {
+		.num_blocks = 4,
+		.num_tx_frames = 1
+	};
+
+	ring = fr_dhcpv4_raw_ring_open(NULL, iface, packet->src_port, &conf);
+	if (!ring) {
+		ERROR("Failed opening packet ring - %s", fr_strerror());
+		return -1;
+	}
+	packet->sockfd = fr_tpacket_fd(ring);
+
+	if ((fr_dhcpv4_raw_ring_send(ring, packet) < 0) || (fr_tpacket_flush(ring) < 0)) {
+		ERROR("Failed sending packet - %s", fr_strerror());
+		TALLOC_FREE(ring);
+		return -1;
+	}
+
+	if (!reply_expected) {
+		TALLOC_FREE(ring);
+		return 0;
+	}
+
+	*reply = fr_dhcpv4_recv_raw_loop(fr_tpacket_fd(ring), &ll, packet);
+	if (!*reply) {
+		ERROR("Error receiving reply");
+		TALLOC_FREE(ring);
+		return -1;
+	}
+
+	/*
+	 *	The reply is a copy, so it outlives the ring.
+	 */
+	TALLOC_FREE(ring);
+	return 0;
+}
+#endif	/* HAVE_TPACKET_V3 */
+
+#if defined(HAVE_LIBPCAP) && !defined(HAVE_TPACKET_V3)
 static int send_with_pcap(RADIUS_PACKET **reply, RADIUS_PACKET *packet)
 {
 	char ip[16];
@@ -537,7 +586,7 @@ static int send_with_pcap(RADIUS_PACKET **reply, RADIUS_PACKET *packet)
 	talloc_free(pcap);
 	return 0;
 }
-#endif	/* HAVE_LIBPCAP */
+#endif	/* HAVE_LIBPCAP && !HAVE_TPACKET_V3 */
 
 static void dhcp_packet_debug(RADIUS_PACKET *packet, bool received)
 {
@@ -791,7 +840,11 @@ int main(int argc, char **argv)
 		dhcp_packet_debug(packet, false);
 	}
 
-#ifdef HAVE_LIBPCAP
+#ifdef HAVE_TPACKET_V3
+	if (raw_mode) {
+		ret = send_with_ring(&reply, packet);
+	} else
+#elif defined(HAVE_LIBPCAP)
 	if (raw_mode) {
 		ret = send_with_pcap(&reply, packet);
 	} else
@@ -58,6 +58,7 @@ static CONF_PARSER const limit_config[] = {
 	{ FR_CONF_OFFSET("max_connections", FR_TYPE_UINT32, proto_dhcpv4_t, io.max_connections), .dflt = "1024" } ,
 	{ FR_CONF_OFFSET("max_clients", FR_TYPE_UINT32, proto_dhcpv4_t, io.max_clients), .dflt = "256" } ,
 	{ FR_CONF_OFFSET("max_pending_packets", FR_TYPE_UINT32, proto_dhcpv4_t, io.max_pending_packets), .dflt = "256" } ,
+	{ FR_CONF_OFFSET("max_nak_clients", FR_TYPE_UINT32, proto_dhcpv4_t, io.max_nak_clients), .dflt = "1024" } ,
 
 	/*
 	 *	For performance tweaking.  NOT for normal humans.
@@ -78,6 +79,11 @@ static CONF_PARSER const proto_dhcpv4_config[] = {
 	{ FR_CONF_OFFSET("transport", FR_TYPE_VOID, proto_dhcpv4_t, io.submodule),
 	  .func = transport_parse },
 
+	/*
+	 *	Don't copy octets attributes out of the packet.
+	 */
+	{ FR_CONF_OFFSET("zero_copy", FR_TYPE_BOOL, proto_dhcpv4_t, zero_copy), .dflt = "no" } ,
+
 	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 
 	CONF_PARSER_TERMINATOR
@@ -275,8 +281,12 @@ static int mod_decode(void const *instance, REQUEST *request, uint8_t *const dat
 	 *	Note that we don't set a limit on max_attributes here.
 	 *	That MUST be set and checked in the underlying
 	 *	transport, via a call to fr_dhcpv4_ok().
+	 *
+	 *	packet->data lives as long as the request, so the
+	 *	attributes can point into it.
 	 */
-	if (fr_dhcpv4_decode(packet, packet->data, packet->data_len, &packet->vps, &packet->code) < 0) {
+	if ((inst->zero_copy ? fr_dhcpv4_decode_shallow : fr_dhcpv4_decode)(packet, packet->data, packet->data_len,
+									  &packet->vps, &packet->code) < 0) {
 		RPEDEBUG("Failed decoding packet");
 		return -1;
 	}
@@ -38,6 +38,8 @@ typedef struct {
 	uint32_t			max_packet_size;		//!< for message ring buffer.
 	uint32_t			num_messages;			//!< for message ring buffer.
 
+	bool				zero_copy;			//!< octets attributes point into the packet.
+
 	bool				code_allowed[FR_DHCP_MAX];     	//!< Allowed packet codes.
 
 	uint32_t			priorities[FR_DHCP_MAX];       	//!< priorities for individual packets
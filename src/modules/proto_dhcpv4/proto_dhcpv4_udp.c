@@ -44,6 +44,9 @@ typedef struct {
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	udp_recv_batch_t		*batch;			//!< for reading multiple packets per system call.
+	udp_send_batch_t		*send_batch;		//!< for writing multiple packets per system call.
+
 	fr_stats_t			stats;			//!< statistics for this socket
 }  proto_dhcpv4_udp_thread_t;
 
@@ -61,6 +64,8 @@ typedef struct {
 
 	uint32_t			max_packet_size;	//!< for message ring buffer.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
+	uint32_t			recv_batch;		//!< Maximum number of packets to read per system call.
+	uint32_t			send_batch;		//!< Maximum number of packets to write per system call.
 
 	uint16_t			port;			//!< Port to listen on.
 
@@ -69,6 +74,8 @@ typedef struct {
 	bool				recv_buff_is_set;	//!< Whether we were provided with a receive
 								//!< buffer value.
 	bool				dynamic_clients;	//!< whether we have dynamic clients
+	bool				reuse_port;		//!< open one socket per network thread
+	bool				reuse_port_steer;	//!< steer packets to sockets by source IP
 
 	RADCLIENT_LIST			*clients;		//!< local clients
 	RADCLIENT			*default_client;	//!< default 0/0 client
@@ -98,6 +105,10 @@ static const CONF_PARSER udp_listen_config[] = {
 
 	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, proto_dhcpv4_udp_t, port) },
 	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, proto_dhcpv4_udp_t, recv_buff) },
+	{ FR_CONF_OFFSET("recv_batch", FR_TYPE_UINT32, proto_dhcpv4_udp_t, recv_batch), .dflt = "1" },
+	{ FR_CONF_OFFSET("send_batch", FR_TYPE_UINT32, proto_dhcpv4_udp_t, send_batch), .dflt = "1" },
+	{ FR_CONF_OFFSET("reuse_port", FR_TYPE_BOOL, proto_dhcpv4_udp_t, reuse_port), .dflt = "no" },
+	{ FR_CONF_OFFSET("reuse_port_steer", FR_TYPE_BOOL, proto_dhcpv4_udp_t, reuse_port_steer), .dflt = "yes" },
 
 	{ FR_CONF_OFFSET("broadcast", FR_TYPE_BOOL, proto_dhcpv4_udp_t, broadcast) } ,
 
@@ -154,10 +165,18 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, buffer, buffer_len, flags,
-			     &address->src_ipaddr, &address->src_port,
-			     &address->dst_ipaddr, &address->dst_port,
-			     &address->if_index, recv_time_p);
+	if (thread->batch) {
+		data_size = udp_recv_batch(thread->batch, thread->sockfd, buffer, buffer_len, flags,
+					   &address->src_ipaddr, &address->src_port,
+					   &address->dst_ipaddr, &address->dst_port,
+					   &address->if_index, recv_time_p);
+		li->recv_pending = udp_recv_batch_pending(thread->batch);
+	} else {
+		data_size = udp_recv(thread->sockfd, buffer, buffer_len, flags,
+				     &address->src_ipaddr, &address->src_port,
+				     &address->dst_ipaddr, &address->dst_port,
+				     &address->if_index, recv_time_p);
+	}
 	if (data_size < 0) {
 		DEBUG2("proto_dhvpv4_udp got read error %zd: %s", data_size, fr_strerror());
 		return data_size;
@@ -418,10 +437,10 @@ send_reply:
 	/*
 	 *	proto_dhcpv4 takes care of suppressing do-not-respond, etc.
 	 */
-	data_size = udp_send(thread->sockfd, buffer, buffer_len, flags,
-			     &address.src_ipaddr, address.src_port,
-			     address.if_index,
-			     &address.dst_ipaddr, address.dst_port);
+	data_size = udp_send_batch_add(thread->send_batch, thread->sockfd, buffer, buffer_len, flags,
+				       &address.src_ipaddr, address.src_port,
+				       address.if_index,
+				       &address.dst_ipaddr, address.dst_port);
 
 	/*
 	 *	This socket is dead.  That's an error...
@@ -432,6 +451,17 @@ send_reply:
 }
 
 
+/** Write any replies which have been queued by mod_write()
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_dhcpv4_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv4_udp_thread_t);
+
+	return udp_send_batch_flush(thread->send_batch, thread->sockfd);
+}
+
+
 static int mod_connection_set(fr_listen_t *li, fr_io_address_t *connection)
 {
 	proto_dhcpv4_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv4_udp_thread_t);
@@ -471,6 +501,13 @@ static int mod_open(fr_listen_t *li)
 
 	li->app_io_addr = fr_app_io_socket_addr(li, IPPROTO_UDP, &inst->ipaddr, port);
 
+	/*
+	 *	Tell the master IO handler to open one of these
+	 *	sockets for each network thread.
+	 */
+	li->sharded = inst->reuse_port;
+	li->steer_by_src = inst->reuse_port_steer;
+
 	/*
 	 *	Set SO_REUSEPORT before bind, so that all packets can
 	 *	listen on the same destination IP address.
@@ -504,6 +541,30 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Read multiple packets per system call.
+	 */
+	if (inst->recv_batch > 1) {
+		thread->batch = udp_recv_batch_alloc(thread, inst->recv_batch, inst->max_packet_size);
+		if (!thread->batch) {
+			close(sockfd);
+			PERROR("Failed allocating receive batch");
+			goto error;
+		}
+	}
+
+	/*
+	 *	Write multiple packets per system call.
+	 */
+	if (inst->send_batch > 1) {
+		thread->send_batch = udp_send_batch_alloc(thread, inst->send_batch, inst->max_packet_size);
+		if (!thread->send_batch) {
+			close(sockfd);
+			PERROR("Failed allocating send batch");
+			goto error;
+		}
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_dhcpv4_udp,
@@ -578,6 +639,13 @@ static int mod_compare(UNUSED void const *instance, UNUSED void *thread_instance
 	return (a->message_type < b->message_type) - (a->message_type > b->message_type);
 }
 
+static uint32_t mod_hash(UNUSED void const *instance, void const *track)
+{
+	proto_dhcpv4_track_t const *a = track;
+
+	return fr_hash(&a->xid, sizeof(a->xid));
+}
+
 static char const *mod_name(fr_listen_t *li)
 {
 	proto_dhcpv4_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv4_udp_thread_t);
@@ -634,6 +702,12 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, MIN_PACKET_SIZE);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, <=, 256);
+
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, <=, 256);
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -747,9 +821,11 @@ fr_app_io_t proto_dhcpv4_udp = {
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.fd_set			= mod_fd_set,
 	.track			= mod_track_create,
 	.compare		= mod_compare,
+	.hash			= mod_hash,
 	.connection_set		= mod_connection_set,
 	.network_get		= mod_network_get,
 	.client_find		= mod_client_find,
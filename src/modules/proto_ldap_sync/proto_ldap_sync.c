@@ -123,6 +123,10 @@ static CONF_PARSER ldap_sync_search_config[] = {
 
 	{ FR_CONF_OFFSET("allow_refresh", FR_TYPE_BOOL, sync_config_t, allow_refresh), .dflt = "no" },
 
+	{ FR_CONF_OFFSET("replica", FR_TYPE_STRING, sync_config_t, replica_name) },
+
+	{ FR_CONF_OFFSET("replica_index", FR_TYPE_STRING, sync_config_t, replica_index) },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -568,6 +572,12 @@ static void proto_ldap_sync_reinit(fr_event_list_t *el, fr_time_t now, void *use
 	sync_config_t		*config = talloc_get_type_abort(user_ctx, sync_config_t);
 	proto_ldap_inst_t	*inst = talloc_get_type_abort(config->user_ctx, proto_ldap_inst_t);
 
+	/*
+	 *	The directory will send its full content
+	 *	again, so start the replica from scratch.
+	 */
+	if (config->replica) fr_ldap_replica_synced(config->replica, false, true);
+
 	/*
 	 *	Reinitialise the sync
 	 */
@@ -658,6 +668,62 @@ static int _proto_ldap_present(fr_ldap_connection_t *conn, sync_config_t const *
 	return 0;
 }
 
+/** Receive notification that the refresh phase is complete
+ *
+ * From here on the replica only receives changes, so it can be used to
+ * answer lookups.
+ *
+ * @note This is a callback for the sync_demux function.
+ *
+ * @param[in] conn	the sync belongs to.
+ * @param[in] config	of the sync that completed the refresh phase.
+ * @param[in] sync_id	of the sync that completed the refresh phase.
+ * @param[in] phase	Refresh phase the sync was previously in.
+ * @param[in] user_ctx	The listener.
+ * @return 0.
+ */
+static int _proto_ldap_done(UNUSED fr_ldap_connection_t *conn, sync_config_t const *config,
+			    UNUSED int sync_id, UNUSED sync_phases_t phase, UNUSED void *user_ctx)
+{
+	if (config->replica) {
+		DEBUG2("Refresh complete, replica \"%s\" is in sync", config->replica_name);
+		fr_ldap_replica_synced(config->replica, true, false);
+	}
+
+	return 0;
+}
+
+/** Apply a change to the replica
+ *
+ */
+static int proto_ldap_replica_update(fr_ldap_connection_t *conn, sync_config_t const *config,
+				     uint8_t const uuid[SYNC_UUID_LENGTH], LDAPMessage *msg, sync_states_t state)
+{
+	switch (state) {
+	case SYNC_STATE_ADD:
+	case SYNC_STATE_MODIFY:
+	case SYNC_STATE_PRESENT:
+		/*
+		 *	Present entries in an idset come without
+		 *	content, our copy is already up to date.
+		 */
+		if (!msg) return 0;
+
+		if (fr_ldap_replica_update(config->replica, uuid, SYNC_UUID_LENGTH, conn->handle, msg) < 0) {
+			PERROR("Failed updating replica \"%s\"", config->replica_name);
+			return -1;
+		}
+		return 0;
+
+	case SYNC_STATE_DELETE:
+		fr_ldap_replica_delete(config->replica, uuid, SYNC_UUID_LENGTH);
+		return 0;
+
+	default:
+		return 0;
+	}
+}
+
 /** Enque a new cookie store request
  *
  * Create a new request containing the cookie we received from the LDAP server. This allows
@@ -725,6 +791,8 @@ static int _proto_ldap_entry(fr_ldap_connection_t *conn, sync_config_t const *co
 	fr_ldap_map_exp_t	expanded;
 	REQUEST			*request;
 
+	if (config->replica && (proto_ldap_replica_update(conn, config, uuid, msg, state) < 0)) return -1;
+
 	request = proto_ldap_request_setup(listen, inst, sync_id);
 	if (!request) return -1;
 
@@ -924,6 +992,7 @@ static int proto_ldap_socket_recv(rad_listen_t *listen)
 
  		config = sync_state_config_get(inst->conn, sync_id);
 		sync_state_destroy(inst->conn, sync_id);	/* Destroy the old state */
+		if (config && config->replica) fr_ldap_replica_synced(config->replica, false, false);
 
 		/*
 		 *	Schedule sync reinit, but don't perform it immediately.
@@ -939,6 +1008,20 @@ static int proto_ldap_socket_recv(rad_listen_t *listen)
  	case -2:
  		PERROR("Connection failed - will retry in %pV seconds", fr_box_time_delta(inst->conn_retry_interval));
 
+		/*
+		 *	Lookups go to the directory until we're
+		 *	back in sync.
+		 */
+		{
+			size_t i;
+
+			for (i = 0; i < talloc_array_length(inst->sync_config); i++) {
+				if (inst->sync_config[i]->replica) {
+					fr_ldap_replica_synced(inst->sync_config[i]->replica, false, false);
+				}
+			}
+		}
+
 		/*
 		 *	Schedule conn reinit, but don't perform it immediately
 		 */
@@ -1148,6 +1231,25 @@ static int proto_ldap_socket_parse(CONF_SECTION *cs, rad_listen_t *listen)
 		inst->sync_config[i]->entry = _proto_ldap_entry;
 		inst->sync_config[i]->refresh_required = _proto_ldap_refresh_required;
 		inst->sync_config[i]->present = _proto_ldap_present;
+		inst->sync_config[i]->done = _proto_ldap_done;
+
+		/*
+		 *	Find or create the replica, modules read
+		 *	from it by name.
+		 */
+		if (inst->sync_config[i]->replica_name) {
+			if (!inst->sync_config[i]->replica_index) {
+				cf_log_err(sync_cs, "'replica_index' must be set when 'replica' is set");
+				return -1;
+			}
+
+			inst->sync_config[i]->replica = fr_ldap_replica_get(inst->sync_config[i]->replica_name,
+									    inst->sync_config[i]->replica_index);
+			if (!inst->sync_config[i]->replica) {
+				cf_log_perr(sync_cs, "Failed creating replica");
+				return -1;
+			}
+		}
 
 		/*
 		 *	Parse and validate any maps
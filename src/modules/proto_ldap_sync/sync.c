@@ -548,7 +548,7 @@ static int sync_intermediate(sync_state_t *sync, LDAPMessage *msg, UNUSED LDAPCo
 			ret = sync->config->entry(sync->conn, sync->config, sync->msgid, sync->phase,
 						  (uint8_t const *)sync_uuids[i].bv_val, NULL, SYNC_STATE_DELETE,
 						  sync->config->user_ctx);
-			if (!ret) goto error;
+			if (ret < 0) goto error;
 		}
 
 		ber_bvarray_free(sync_uuids);
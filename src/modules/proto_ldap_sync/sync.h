@@ -152,6 +152,13 @@ struct sync_config_s {
 	vp_map_t			*entry_map;		//!< How to convert attributes in entries
 								//!< to FreeRADIUS attributes.
 
+	/*
+	 *	Local copy of the entries
+	 */
+	char const			*replica_name;		//!< Name of the replica to maintain, if any.
+	char const			*replica_index;		//!< Attribute to index the replica by.
+	fr_ldap_replica_t		*replica;		//!< Replica entries are written to.
+
 	/*
 	 *	Callbacks for various events
 	 */
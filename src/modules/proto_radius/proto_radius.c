@@ -43,6 +43,7 @@ static CONF_PARSER const limit_config[] = {
 	{ FR_CONF_OFFSET("max_connections", FR_TYPE_UINT32, proto_radius_t, io.max_connections), .dflt = "1024" } ,
 	{ FR_CONF_OFFSET("max_clients", FR_TYPE_UINT32, proto_radius_t, io.max_clients), .dflt = "256" } ,
 	{ FR_CONF_OFFSET("max_pending_packets", FR_TYPE_UINT32, proto_radius_t, io.max_pending_packets), .dflt = "256" } ,
+	{ FR_CONF_OFFSET("max_nak_clients", FR_TYPE_UINT32, proto_radius_t, io.max_nak_clients), .dflt = "1024" } ,
 
 	/*
 	 *	For performance tweaking.  NOT for normal humans.
@@ -83,6 +84,11 @@ static CONF_PARSER const proto_radius_config[] = {
 	 */
 	{ FR_CONF_OFFSET("tunnel_password_zeros", FR_TYPE_BOOL, proto_radius_t, tunnel_password_zeros) } ,
 
+	/*
+	 *	Don't copy octets attributes out of the packet.
+	 */
+	{ FR_CONF_OFFSET("zero_copy", FR_TYPE_BOOL, proto_radius_t, zero_copy), .dflt = "no" } ,
+
 	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 	{ FR_CONF_POINTER("priority", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) priority_config },
 
@@ -306,10 +312,14 @@ static int mod_decode(void const *instance, REQUEST *request, uint8_t *const dat
 	 *	Note that we don't set a limit on max_attributes here.
 	 *	That MUST be set and checked in the underlying
 	 *	transport, via a call to fr_radius_ok().
-	 */
-	if (fr_radius_decode(request->packet, request->packet->data, request->packet->data_len,
-			     NULL, client->secret, talloc_array_length(client->secret) - 1,
-			     &request->packet->vps) < 0) {
+	 *
+	 *	packet->data lives as long as the request, so the
+	 *	attributes can point into it.
+	 */
+	if ((inst->zero_copy ? fr_radius_decode_shallow : fr_radius_decode)(request->packet,
+			request->packet->data, request->packet->data_len,
+			NULL, client->secret, talloc_array_length(client->secret) - 1,
+			&request->packet->vps) < 0) {
 		RPEDEBUG("Failed decoding packet");
 		return -1;
 	}
@@ -39,6 +39,7 @@ typedef struct {
 	uint32_t			num_messages;			//!< for message ring buffer.
 
 	bool				tunnel_password_zeros;		//!< check for trailing zeroes in Tunnel-Password.
+	bool				zero_copy;			//!< octets attributes point into the packet.
 
 	bool				code_allowed[FR_CODE_RADIUS_MAX + 1];	//!< Allowed packet codes.
 
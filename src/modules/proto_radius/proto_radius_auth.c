@@ -59,6 +59,8 @@ typedef struct {
 							//!< authenticating server to be identified in packet
 							//!< captures.
 
+	bool		session_compact;		//!< Encode session-state between rounds.
+
 	fr_state_tree_t	*state_tree;			//!< State tree to link multiple requests/responses.
 
 	CONF_SECTION	*recv_access_request;
@@ -79,6 +81,7 @@ static const CONF_PARSER session_config[] = {
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, proto_radius_auth_t, session_timeout), .dflt = "15" },
 	{ FR_CONF_OFFSET("max", FR_TYPE_UINT32, proto_radius_auth_t, max_session), .dflt = "4096" },
 	{ FR_CONF_OFFSET("state_server_id", FR_TYPE_UINT8, proto_radius_auth_t, state_server_id) },
+	{ FR_CONF_OFFSET("compact", FR_TYPE_BOOL, proto_radius_auth_t, session_compact), .dflt = "no" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -727,12 +730,24 @@ static virtual_server_compile_t compile_list[] = {
 	COMPILE_TERMINATOR
 };
 
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *process_app_cs)
+static int mod_instantiate(void *instance, CONF_SECTION *process_app_cs)
 {
 	proto_radius_auth_t	*inst = instance;
+	CONF_SECTION		*server_cs = cf_item_to_section(cf_parent(cf_parent(process_app_cs)));
 
 	inst->state_tree = fr_state_tree_init(inst, attr_state, main_config->spawn_workers, inst->max_session,
 					      inst->session_timeout, inst->state_server_id);
+	if (!inst->state_tree) return -1;
+
+	fr_state_tree_compact_set(inst->state_tree, inst->session_compact);
+
+	/*
+	 *	Only the first listener in a virtual server gets
+	 *	commands, the names would clash otherwise.
+	 */
+	if (fr_state_tree_command_register(inst->state_tree, cf_section_name2(server_cs)) < 0) {
+		cf_log_debug(process_app_cs, "Not registering state commands: %s", fr_strerror());
+	}
 
 	return 0;
 }
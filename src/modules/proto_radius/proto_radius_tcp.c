@@ -57,6 +57,7 @@ typedef struct {
 	uint32_t			recv_buff;		//!< How big the kernel's receive buffer should be.
 
 	uint32_t			max_packet_size;	//!< for message ring buffer.
+	uint32_t			read_size;		//!< How much data we read from a connection at once.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
 	uint16_t			port;			//!< Port to listen on.
@@ -95,6 +96,7 @@ static const CONF_PARSER tcp_listen_config[] = {
 	{ FR_CONF_POINTER("networks", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) networks_config },
 
 	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, proto_radius_tcp_t, max_packet_size), .dflt = "4096" } ,
+	{ FR_CONF_OFFSET("read_size", FR_TYPE_UINT32, proto_radius_tcp_t, read_size), .dflt = "65536" } ,
        	{ FR_CONF_OFFSET("max_attributes", FR_TYPE_UINT32, proto_radius_tcp_t, max_attributes), .dflt = STRINGIFY(RADIUS_MAX_ATTRIBUTES) } ,
 
 	CONF_PARSER_TERMINATOR
@@ -105,18 +107,12 @@ static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, fr_time_t *re
 {
 	proto_radius_tcp_t const       	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_radius_tcp_t);
 	proto_radius_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_tcp_thread_t);
-	ssize_t				data_size;
+	ssize_t				data_size, slen;
+	size_t				in_buffer = *leftover;
 	size_t				packet_len;
 	decode_fail_t			reason;
 
-	/*
-	 *      Read data into the buffer.
-	 */
-	data_size = read(thread->sockfd, buffer + *leftover, buffer_len - *leftover);
-	if (data_size < 0) {
-		PDEBUG2("proto_radius_tcp got read error %zd", data_size);
-		return data_size;
-	}
+	li->recv_pending = 0;
 
 	/*
 	 *	Note that we return ERROR for all bad packets, as
@@ -125,51 +121,63 @@ static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, fr_time_t *re
 	 */
 
 	/*
-	 *	TCP read of zero means the socket is dead.
+	 *	A previous read may have left one or more complete
+	 *	packets in the buffer.  If so, we frame the next one
+	 *	in place, without reading more data.
 	 */
-	if (!data_size) {
-		DEBUG2("proto_radius_tcp - other side closed the socket.");
-		return -1;
+	slen = fr_radius_tcp_packet_len(buffer, in_buffer);
+	if (slen == 0) {
+		/*
+		 *      Read as much data into the buffer as we can.
+		 */
+		data_size = read(thread->sockfd, buffer + in_buffer, buffer_len - in_buffer);
+		if (data_size < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+			PDEBUG2("proto_radius_tcp got read error %zd", data_size);
+			return data_size;
+		}
+
+		/*
+		 *	TCP read of zero means the socket is dead.
+		 */
+		if (!data_size) {
+			DEBUG2("proto_radius_tcp - other side closed the socket.");
+			return -1;
+		}
+
+		in_buffer += data_size;
+		slen = fr_radius_tcp_packet_len(buffer, in_buffer);
 	}
 
 	/*
 	 *	We MUST always start with a known RADIUS packet.
 	 */
-	if ((buffer[0] == 0) || (buffer[0] > FR_RADIUS_MAX_PACKET_CODE)) {
-		DEBUG("proto_radius_tcp got invalid packet code %d", buffer[0]);
+	if (slen < 0) {
+		PDEBUG("proto_radius_tcp got invalid packet");
 		thread->stats.total_unknown_types++;
 		return -1;
 	}
 
-	/*
-	 *	Not enough for one packet.  Tell the caller that we need to read more.
-	 */
-	if (data_size < 20) {
-		*leftover = data_size;
-		return 0;
-	}
-
-	/*
-	 *	Figure out how large the RADIUS packet is.
-	 */
-	packet_len = (buffer[2] << 8) | buffer[3];
-
 	/*
 	 *	We don't have a complete RADIUS packet.  Tell the
 	 *	caller that we need to read more.
 	 */
-	if ((size_t) data_size < packet_len) {
-		*leftover = data_size;
+	if (slen == 0) {
+		*leftover = in_buffer;
 		return 0;
 	}
+	packet_len = slen;
 
 	/*
-	 *	We've read more than one packet.  Tell the caller that
-	 *	there's more data available, and return only one packet.
+	 *	We've read more than one packet.  Tell the caller
+	 *	that there's more data available, and return only one
+	 *	packet.  If there's another complete packet, tell the
+	 *	network side to come back for it, instead of waiting
+	 *	for the socket to become readable.
 	 */
-	if ((size_t) data_size > packet_len) {
-		*leftover = data_size - packet_len;
-	}
+	*leftover = in_buffer - packet_len;
+	if (*leftover && (fr_radius_tcp_packet_len(buffer + packet_len, *leftover) != 0)) li->recv_pending = 1;
 
 	/*
 	 *      If it's not a RADIUS packet, ignore it.
@@ -314,6 +322,11 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Connections read many packets at once.
+	 */
+	li->read_size = inst->read_size;
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_radius_tcp,
@@ -404,6 +417,9 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 20);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("read_size", inst->read_size, >=, inst->max_packet_size);
+	FR_INTEGER_BOUND_CHECK("read_size", inst->read_size, <=, 262144);
+
 	if (!inst->port) {
 		struct servent *s;
 
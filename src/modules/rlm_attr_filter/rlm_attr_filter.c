@@ -37,15 +37,47 @@ RCSID("$Id$")
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/** The check items for one attribute in a filter entry
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;		//!< Attribute the check items apply to.
+	VALUE_PAIR		**check;	//!< Check items, in the order they appear in the file.
+} attr_filter_rule_t;
+
+/** A filter entry, compiled for lookups by attribute
+ *
+ */
+typedef struct {
+	PAIR_LIST		*pl;		//!< Entry we were compiled from.
+	VALUE_PAIR		**set;		//!< Items which are added to the output list.
+	fr_hash_table_t		*rules;		//!< #attr_filter_rule_t, keyed by attribute.
+	int			vsa_pass;	//!< Number of "Vendor-Specific =* ANY" items, which
+						///< pass any vendor attribute.
+	bool			fall_through;	//!< Continue with the next matching entry.
+	bool			relax_filter;	//!< Copy attributes which have no check items.
+} attr_filter_entry_t;
+
+/** The entries which apply to a key, in the order they appear in the file
+ *
+ */
+typedef struct {
+	char const		*name;
+	attr_filter_entry_t	**entries;
+} attr_filter_key_t;
+
 /*
  *	Define a structure with the module configuration, so it can
  *	be used as the instance handle.
  */
 typedef struct {
-	char const	*filename;
-	vp_tmpl_t	*key;
-	bool		relaxed;
-	PAIR_LIST	*attrs;
+	char const		*filename;
+	vp_tmpl_t		*key;
+	bool			relaxed;
+	PAIR_LIST		*attrs;
+
+	fr_hash_table_t		*keys;		//!< #attr_filter_key_t for each named entry.
+	attr_filter_entry_t	**defaults;	//!< DEFAULT entries, for keys with no named entries.
 } rlm_attr_filter_t;
 
 static const CONF_PARSER module_config[] = {
@@ -85,8 +117,6 @@ static void check_pair(REQUEST *request, VALUE_PAIR *check_item, VALUE_PAIR *rep
 {
 	int compare;
 
-	if (check_item->op == T_OP_SET) return;
-
 	compare = fr_pair_cmp(check_item, reply_item);
 	if (compare < 0) RPEDEBUG("Comparison failed");
 
@@ -101,6 +131,155 @@ static void check_pair(REQUEST *request, VALUE_PAIR *check_item, VALUE_PAIR *rep
 	return;
 }
 
+static uint32_t attr_filter_rule_hash(void const *data)
+{
+	attr_filter_rule_t const *rule = data;
+
+	return fr_hash(&rule->da, sizeof(rule->da));
+}
+
+static int attr_filter_rule_cmp(void const *one, void const *two)
+{
+	attr_filter_rule_t const *a = one, *b = two;
+
+	return (a->da > b->da) - (a->da < b->da);
+}
+
+static uint32_t attr_filter_key_hash(void const *data)
+{
+	attr_filter_key_t const *key = data;
+
+	return fr_hash_string(key->name);
+}
+
+static int attr_filter_key_cmp(void const *one, void const *two)
+{
+	attr_filter_key_t const *a = one, *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+/** Append an item to a talloced array of pointers
+ *
+ */
+#define ARRAY_APPEND(_ctx, _array, _item) do { \
+	size_t _len = talloc_array_length(_array); \
+	MEM(_array = talloc_realloc(_ctx, _array, __typeof__(*(_array)), _len + 1)); \
+	(_array)[_len] = _item; \
+} while (0)
+
+/** Compile a filter entry into a table of check items keyed by attribute
+ *
+ */
+static attr_filter_entry_t *attr_filter_compile(rlm_attr_filter_t *inst, PAIR_LIST *pl)
+{
+	attr_filter_entry_t	*entry;
+	fr_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+
+	MEM(entry = talloc_zero(inst, attr_filter_entry_t));
+	entry->pl = pl;
+	entry->relax_filter = inst->relaxed;
+	MEM(entry->rules = fr_hash_table_create(entry, attr_filter_rule_hash, attr_filter_rule_cmp, NULL));
+
+	for (vp = fr_cursor_init(&cursor, &pl->check);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		attr_filter_rule_t	*rule, my_rule;
+
+		if (vp->da == attr_fall_through) {
+			if (vp->vp_bool) entry->fall_through = true;
+		} else if (vp->da == attr_relax_filter) {
+			entry->relax_filter = vp->vp_bool;
+		}
+
+		/*
+		 *	SET items are added to the output list without
+		 *	checking anything.
+		 */
+		if (vp->op == T_OP_SET) {
+			if ((vp->da != attr_fall_through) || !vp->vp_bool) ARRAY_APPEND(entry, entry->set, vp);
+			continue;
+		}
+
+		/*
+		 *	Vendor-Specific is special, and matches any VSA if the
+		 *	comparison is always true.
+		 */
+		if ((vp->da == attr_vendor_specific) && (vp->op == T_OP_CMP_TRUE)) entry->vsa_pass++;
+
+		my_rule.da = vp->da;
+		rule = fr_hash_table_finddata(entry->rules, &my_rule);
+		if (!rule) {
+			MEM(rule = talloc_zero(entry, attr_filter_rule_t));
+			rule->da = vp->da;
+			if (!fr_hash_table_insert(entry->rules, rule)) {
+				talloc_free(entry);
+				return NULL;
+			}
+		}
+		ARRAY_APPEND(rule, rule->check, vp);
+	}
+
+	return entry;
+}
+
+static int _attr_filter_key_add_default(void *ctx, void *data)
+{
+	attr_filter_entry_t	*entry = ctx;
+	attr_filter_key_t	*key = data;
+
+	ARRAY_APPEND(key, key->entries, entry);
+
+	return 0;
+}
+
+/** Compile every entry, and work out which entries apply to each key
+ *
+ * The entries for a key are the named entries, and the DEFAULT
+ * entries, in the order they appear in the file.
+ */
+static int attr_filter_index(rlm_attr_filter_t *inst)
+{
+	PAIR_LIST	*pl;
+
+	MEM(inst->keys = fr_hash_table_create(inst, attr_filter_key_hash, attr_filter_key_cmp, NULL));
+
+	for (pl = inst->attrs; pl; pl = pl->next) {
+		attr_filter_entry_t	*entry;
+		attr_filter_key_t	*key, my_key;
+
+		entry = attr_filter_compile(inst, pl);
+		if (!entry) return -1;
+
+		if (strcmp(pl->name, "DEFAULT") == 0) {
+			ARRAY_APPEND(inst, inst->defaults, entry);
+			(void) fr_hash_table_walk(inst->keys, _attr_filter_key_add_default, entry);
+			continue;
+		}
+
+		my_key.name = pl->name;
+		key = fr_hash_table_finddata(inst->keys, &my_key);
+		if (!key) {
+			MEM(key = talloc_zero(inst, attr_filter_key_t));
+			key->name = pl->name;
+
+			/*
+			 *	Any DEFAULT entries we've seen so far
+			 *	come first.
+			 */
+			if (inst->defaults) {
+				MEM(key->entries = talloc_memdup(key, inst->defaults, talloc_get_size(inst->defaults)));
+			}
+
+			if (!fr_hash_table_insert(inst->keys, key)) return -1;
+		}
+		ARRAY_APPEND(key, key->entries, entry);
+	}
+
+	return 0;
+}
+
 static int attr_filter_getfile(TALLOC_CTX *ctx, rlm_attr_filter_t *inst, char const *filename, PAIR_LIST **pair_list)
 {
 	fr_cursor_t cursor;
@@ -161,7 +340,7 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
 		return -1;
 	}
 
-	return 0;
+	return attr_filter_index(inst);
 }
 
 
@@ -172,11 +351,13 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 							    RADIUS_PACKET *packet)
 {
 	rlm_attr_filter_t const *inst = talloc_get_type_abort_const(instance, rlm_attr_filter_t);
-	VALUE_PAIR	*vp;
-	fr_cursor_t	input, check, out;
-	VALUE_PAIR	*input_item, *check_item, *output;
-	PAIR_LIST	*pl;
-	int		found = 0;
+	VALUE_PAIR		*vp;
+	fr_cursor_t		input, out;
+	VALUE_PAIR		*input_item, *output;
+	attr_filter_key_t	*key, my_key;
+	attr_filter_entry_t	**entries;
+	size_t			i, num_entries;
+	int			found = 0;
 	int		pass, fail = 0;
 	char const	*keyname = NULL;
 	char		buffer[256];
@@ -198,82 +379,54 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 	fr_cursor_init(&out, &output);
 
 	/*
-	 *      Find the attr_filter profile entry for the entry.
+	 *      Find the attr_filter profile entries for the key.
 	 */
-	for (pl = inst->attrs; pl; pl = pl->next) {
-		int fall_through = 0;
-		int relax_filter = inst->relaxed;
+	my_key.name = keyname;
+	key = fr_hash_table_finddata(inst->keys, &my_key);
+	entries = key ? key->entries : inst->defaults;
+	num_entries = talloc_array_length(entries);
 
-		/*
-		 *  If the current entry is NOT a default,
-		 *  AND the realm does NOT match the current entry,
-		 *  then skip to the next entry.
-		 */
-		if ((strcmp(pl->name, "DEFAULT") != 0) &&
-		    (strcmp(keyname, pl->name) != 0))  {
-		    continue;
-		}
+	for (i = 0; i < num_entries; i++) {
+		attr_filter_entry_t const	*entry = entries[i];
+		size_t				j;
 
-		RDEBUG2("Matched entry %s at line %d", pl->name, pl->lineno);
+		RDEBUG2("Matched entry %s at line %d", entry->pl->name, entry->pl->lineno);
 		found = 1;
 
-		for (check_item = fr_cursor_init(&check, &pl->check);
-		     check_item;
-		     check_item = fr_cursor_next(&check)) {
-		     	if (check_item->da == attr_fall_through) {
-				if (check_item->vp_uint32 == 1) {
-					fall_through = 1;
-					continue;
-				}
-		     	} else if (check_item->da == attr_relax_filter) {
-				relax_filter = check_item->vp_uint32;
-		     	}
-
-			/*
-			 *    If it is a SET operator, add the attribute to
-			 *    the output list without checking it.
-			 */
-			if (check_item->op == T_OP_SET ) {
-				vp = fr_pair_copy(packet, check_item);
-				if (!vp) goto error;
+		/*
+		 *    Add the SET items to the output list without
+		 *    checking them.
+		 */
+		for (j = 0; j < talloc_array_length(entry->set); j++) {
+			vp = fr_pair_copy(packet, entry->set[j]);
+			if (!vp) goto error;
 
-				xlat_eval_pair(request, vp);
-				fr_cursor_append(&out, vp);
-			}
+			xlat_eval_pair(request, vp);
+			fr_cursor_append(&out, vp);
 		}
 
 		/*
 		 *	Iterate through the input items, comparing
-		 *	each item to every rule, then moving it to the
-		 *	output list only if it matches all rules
-		 *	for that attribute.  IE, Idle-Timeout is moved
+		 *	each item to the rules for its attribute, then
+		 *	moving it to the output list only if it
+		 *	matches all of them.  IE, Idle-Timeout is moved
 		 *	only if it matches all rules that describe an
 		 *	Idle-Timeout.
 		 */
 		for (input_item = fr_cursor_init(&input, &packet->vps);
 		     input_item;
 		     input_item = fr_cursor_next(&input)) {
+			attr_filter_rule_t	*rule, my_rule;
+
 			pass = fail = 0; /* reset the pass,fail vars for each reply item */
 
-			/*
-			 *  Reset the check_item pointer to beginning of the list
-			 */
-			for (check_item = fr_cursor_head(&check);
-			     check_item;
-			     check_item = fr_cursor_next(&check)) {
-				/*
-				 *  Vendor-Specific is special, and matches any VSA if the
-				 *  comparison is always true.
-				 */
-				if ((check_item->da == attr_vendor_specific) &&
-				    (fr_dict_vendor_num_by_da(input_item->da) != 0) &&
-				    (check_item->op == T_OP_CMP_TRUE)) {
-					pass++;
-					continue;
-				}
+			if (entry->vsa_pass && (fr_dict_vendor_num_by_da(input_item->da) != 0)) pass += entry->vsa_pass;
 
-				if (input_item->da == check_item->da) {
-					check_pair(request, check_item, input_item, &pass, &fail);
+			my_rule.da = input_item->da;
+			rule = fr_hash_table_finddata(entry->rules, &my_rule);
+			if (rule) {
+				for (j = 0; j < talloc_array_length(rule->check); j++) {
+					check_pair(request, rule->check[j], input_item, &pass, &fail);
 				}
 			}
 
@@ -283,7 +436,7 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 			 *  Only move attribute if it passed all rules, or if the config says we
 			 *  should copy unmatched attributes ('relaxed' mode).
 			 */
-			if (fail == 0 && (pass > 0 || relax_filter)) {
+			if (fail == 0 && (pass > 0 || entry->relax_filter)) {
 				if (!pass) {
 					RDEBUG3("Attribute \"%s\" allowed by relaxed mode", input_item->da->name);
 				}
@@ -296,7 +449,7 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 		}
 
 		/* If we shouldn't fall through, break */
-		if (!fall_through) {
+		if (!entry->fall_through) {
 			break;
 		}
 	}
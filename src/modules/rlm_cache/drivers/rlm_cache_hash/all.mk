@@ -0,0 +1,3 @@
+TARGET		:= rlm_cache_hash.a
+SOURCES		:= rlm_cache_hash.c
+TGT_LDLIBS	:= $(LIBS)
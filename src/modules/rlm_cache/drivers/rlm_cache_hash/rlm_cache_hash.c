@@ -0,0 +1,503 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_hash.c
+ * @brief Sharded hash table based cache.
+ *
+ * Entries are split between a number of shards by the hash of their key.
+ * Each shard has its own lock, so requests looking up different keys
+ * rarely wait for each other.
+ *
+ * If a maximum size is configured, entries are evicted with the CLOCK
+ * (second chance) algorithm.  Entries which have been read since the
+ * last pass of the clock hand are kept, and the others are evicted.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/heap.h>
+#include "../../rlm_cache.h"
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+typedef struct {
+	pthread_mutex_t		mutex;		//!< Protects everything in the shard.
+
+	fr_hash_table_t		*cache;		//!< For looking up cache keys.
+	fr_heap_t		*heap;		//!< For managing entry expiry.
+	fr_dlist_head_t		clock;		//!< Entries in the order the clock hand visits them.
+
+	size_t			size;		//!< Bytes used by entries in this shard.
+
+	uint64_t		hits;		//!< Lookups which found an entry.
+	uint64_t		misses;		//!< Lookups which didn't.
+	uint64_t		evictions;	//!< Entries removed to make space.
+} rlm_cache_hash_shard_t;
+
+typedef struct {
+	uint32_t		num_shards;	//!< How many shards to split the cache into.
+	size_t			max_size;	//!< Maximum bytes used by all entries.  0 means no limit.
+
+	size_t			shard_max_size;	//!< Maximum bytes used by each shard.
+	rlm_cache_hash_shard_t	*shards;	//!< Array of shards.
+
+	atomic_uint_fast64_t	count;		//!< Entries in all shards.
+} rlm_cache_hash_t;
+
+typedef struct {
+	rlm_cache_entry_t	fields;		//!< Entry data.
+	int32_t			heap_id;	//!< Offset used for heap.
+	fr_dlist_t		entry;		//!< In the clock list.
+	size_t			size;		//!< Bytes used by this entry.
+	bool			referenced;	//!< Read since the clock hand last passed.
+} rlm_cache_hash_entry_t;
+
+/** The shard a request has locked
+ *
+ */
+typedef struct {
+	rlm_cache_hash_shard_t	*shard;		//!< Currently locked, or NULL.
+} rlm_cache_hash_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", FR_TYPE_UINT32, rlm_cache_hash_t, num_shards), .dflt = "16" },
+	{ FR_CONF_OFFSET("max_size", FR_TYPE_SIZE, rlm_cache_hash_t, max_size), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_entry_t const *c = data;
+
+	return fr_hash(c->key, c->key_len);
+}
+
+/** Compare two entries by key
+ *
+ * There may only be one entry with the same key.
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Compare two entries by expiry time
+ *
+ * There may be multiple entries with the same expiry time.
+ */
+static int8_t cache_heap_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one, *b = two;
+
+	return (a->expires > b->expires) - (a->expires < b->expires);
+}
+
+/** Lock the shard holding a key, if the handle doesn't already hold it
+ *
+ * The lock is held until the handle is released, as the caller may use
+ * the entries it finds until then.
+ */
+static rlm_cache_hash_shard_t *cache_shard_lock(rlm_cache_hash_t *driver, rlm_cache_hash_handle_t *handle,
+						uint8_t const *key, size_t key_len)
+{
+	rlm_cache_hash_shard_t *shard = &driver->shards[fr_hash(key, key_len) % driver->num_shards];
+
+	if (handle->shard == shard) return shard;
+
+	if (handle->shard) pthread_mutex_unlock(&handle->shard->mutex);
+	pthread_mutex_lock(&shard->mutex);
+	handle->shard = shard;
+
+	return shard;
+}
+
+/** Remove an entry from a shard, and free it
+ *
+ */
+static void cache_shard_remove(rlm_cache_hash_t *driver, rlm_cache_hash_shard_t *shard, rlm_cache_hash_entry_t *c)
+{
+	fr_heap_extract(shard->heap, c);
+	fr_hash_table_delete(shard->cache, c);
+	fr_dlist_remove(&shard->clock, c);
+	shard->size -= c->size;
+	atomic_fetch_sub_explicit(&driver->count, 1, memory_order_relaxed);
+	talloc_free(c);
+}
+
+/** Evict entries until there's space for another
+ *
+ * @return
+ *	- 0 if there's now enough space.
+ *	- -1 if the entry is larger than the shard.
+ */
+static int cache_shard_evict(rlm_cache_hash_t *driver, rlm_cache_hash_shard_t *shard, size_t size)
+{
+	rlm_cache_hash_entry_t *c;
+
+	if (!driver->max_size) return 0;
+	if (size > driver->shard_max_size) return -1;
+
+	while ((shard->size + size) > driver->shard_max_size) {
+		c = fr_dlist_head(&shard->clock);
+		if (!fr_cond_assert(c)) return -1;
+
+		/*
+		 *	Second chance.
+		 */
+		if (c->referenced) {
+			c->referenced = false;
+			fr_dlist_remove(&shard->clock, c);
+			fr_dlist_insert_tail(&shard->clock, c);
+			continue;
+		}
+
+		cache_shard_remove(driver, shard, c);
+		shard->evictions++;
+	}
+
+	return 0;
+}
+
+/** Cleanup a cache_hash instance
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_hash_t	*driver = talloc_get_type_abort(instance, rlm_cache_hash_t);
+	rlm_cache_config_t const *config = dl_module_parent_data_by_child_data(instance);
+	uint64_t		hits = 0, misses = 0, evictions = 0;
+	uint32_t		i;
+
+	if (!driver->shards) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_hash_shard_t	*shard = &driver->shards[i];
+		rlm_cache_hash_entry_t	*c;
+
+		hits += shard->hits;
+		misses += shard->misses;
+		evictions += shard->evictions;
+
+		while ((c = fr_dlist_head(&shard->clock))) {
+			fr_dlist_remove(&shard->clock, c);
+			talloc_free(c);
+		}
+
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	DEBUG("rlm_cache (%s) - %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions",
+	      config ? config->name : "unknown", hits, misses, evictions);
+
+	return 0;
+}
+
+/** Create a new cache_hash instance
+ *
+ * @param instance	A uint8_t array of inst_size if inst_size > 0, else NULL,
+ *			this should contain the result of parsing the driver's
+ *			CONF_PARSER array that it specified in the interface struct.
+ * @param conf		section holding driver specific #CONF_PAIR (s).
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_cache_hash_t	*driver = talloc_get_type_abort(instance, rlm_cache_hash_t);
+	uint32_t		i;
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, 1024);
+
+	driver->shard_max_size = driver->max_size / driver->num_shards;
+	if (driver->max_size && !driver->shard_max_size) {
+		cf_log_err(conf, "\"max_size\" must be at least one byte per shard");
+		return -1;
+	}
+
+	MEM(driver->shards = talloc_zero_array(driver, rlm_cache_hash_shard_t, driver->num_shards));
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_hash_shard_t *shard = &driver->shards[i];
+
+		shard->cache = fr_hash_table_create(driver->shards, cache_entry_hash, cache_entry_cmp, NULL);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+
+		shard->heap = fr_heap_talloc_alloc(driver->shards, cache_heap_cmp, rlm_cache_hash_entry_t, heap_id);
+		if (!shard->heap) {
+			ERROR("Failed to create heap for the cache");
+			return -1;
+		}
+
+		fr_dlist_init(&shard->clock, rlm_cache_hash_entry_t, entry);
+
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    REQUEST *request)
+{
+	rlm_cache_hash_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_hash_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+	c->heap_id = -1;
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_hash_t	*driver = talloc_get_type_abort(instance, rlm_cache_hash_t);
+	rlm_cache_hash_shard_t	*shard;
+	rlm_cache_hash_entry_t	*c;
+	fr_unix_time_t		now = fr_time_to_unix_time(request->packet->timestamp);
+
+	shard = cache_shard_lock(driver, handle, key, key_len);
+
+	/*
+	 *	Clear out old entries
+	 */
+	while ((c = fr_heap_peek(shard->heap)) && (c->fields.expires < now)) {
+		cache_shard_remove(driver, shard, c);
+	}
+
+	/*
+	 *	Is there an entry for this key?
+	 */
+	c = fr_hash_table_finddata(shard->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	if (!c) {
+		shard->misses++;
+		*out = NULL;
+		return CACHE_MISS;
+	}
+	shard->hits++;
+	c->referenced = true;
+	*out = &c->fields;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_hash_t	*driver = talloc_get_type_abort(instance, rlm_cache_hash_t);
+	rlm_cache_hash_shard_t	*shard;
+	rlm_cache_hash_entry_t	*c;
+
+	if (!request) return CACHE_ERROR;
+
+	shard = cache_shard_lock(driver, handle, key, key_len);
+
+	c = fr_hash_table_finddata(shard->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	if (!c) return CACHE_MISS;
+
+	cache_shard_remove(driver, shard, c);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_hash_t	*driver = talloc_get_type_abort(instance, rlm_cache_hash_t);
+	rlm_cache_hash_shard_t	*shard;
+	rlm_cache_hash_entry_t	*my_c, *old;
+
+	if (!request) return CACHE_ERROR;
+
+	memcpy(&my_c, &c, sizeof(my_c));
+
+	shard = cache_shard_lock(driver, handle, c->key, c->key_len);
+
+	/*
+	 *	Allow overwriting
+	 */
+	old = fr_hash_table_finddata(shard->cache, my_c);
+	if (old) cache_shard_remove(driver, shard, old);
+
+	my_c->size = talloc_total_size(my_c);
+	if (cache_shard_evict(driver, shard, my_c->size) < 0) {
+		RWARN("Entry of %zu bytes is larger than the space available in a shard", my_c->size);
+		return CACHE_ERROR;
+	}
+
+	if (!fr_hash_table_insert(shard->cache, my_c)) {
+		RERROR("Failed adding entry");
+		return CACHE_ERROR;
+	}
+
+	if (fr_heap_insert(shard->heap, my_c) < 0) {
+		fr_hash_table_delete(shard->cache, my_c);
+		RERROR("Failed adding entry to expiry heap");
+		return CACHE_ERROR;
+	}
+
+	fr_dlist_insert_tail(&shard->clock, my_c);
+	shard->size += my_c->size;
+	atomic_fetch_add_explicit(&driver->count, 1, memory_order_relaxed);
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, void *instance,
+					  REQUEST *request, void *handle,
+					  rlm_cache_entry_t *c)
+{
+	rlm_cache_hash_t	*driver = talloc_get_type_abort(instance, rlm_cache_hash_t);
+	rlm_cache_hash_shard_t	*shard;
+
+#ifdef NDEBUG
+	if (!request) return CACHE_ERROR;
+#endif
+
+	shard = cache_shard_lock(driver, handle, c->key, c->key_len);
+
+	if (!fr_cond_assert(fr_heap_extract(shard->heap, c) == 0)) {
+		RERROR("Entry not in heap");
+		return CACHE_ERROR;
+	}
+
+	if (fr_heap_insert(shard->heap, c) < 0) {
+		cache_shard_remove(driver, shard, (rlm_cache_hash_entry_t *)c);	/* make sure we don't leak entries... */
+		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
+		return CACHE_ERROR;
+	}
+	return CACHE_OK;
+}
+
+/** Return the number of entries in the cache
+ *
+ * Doesn't lock any shards.
+ *
+ * @copydetails cache_entry_count_t
+ */
+static uint32_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *instance,
+				  REQUEST *request, UNUSED void *handle)
+{
+	rlm_cache_hash_t *driver = talloc_get_type_abort(instance, rlm_cache_hash_t);
+
+	if (!request) return CACHE_ERROR;
+
+	return atomic_load_explicit(&driver->count, memory_order_relaxed);
+}
+
+/** Allocate a handle
+ *
+ * No shard is locked until we know which key the request wants.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+			 REQUEST *request)
+{
+	rlm_cache_hash_handle_t *h;
+
+	MEM(h = talloc_zero(request, rlm_cache_hash_handle_t));
+	*handle = h;
+
+	return 0;
+}
+
+/** Release a handle, unlocking the shard it holds
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, REQUEST *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_hash_handle_t *h = talloc_get_type_abort(handle, rlm_cache_hash_handle_t);
+
+	if (h->shard) {
+		pthread_mutex_unlock(&h->shard->mutex);
+		RDEBUG3("Mutex released");
+	}
+
+	talloc_free(h);
+}
+
+extern rlm_cache_driver_t rlm_cache_hash;
+rlm_cache_driver_t rlm_cache_hash = {
+	.name		= "rlm_cache_hash",
+	.magic		= RLM_MODULE_INIT,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_hash_t),
+	.config		= driver_config,
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+	.count		= cache_entry_count,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+};
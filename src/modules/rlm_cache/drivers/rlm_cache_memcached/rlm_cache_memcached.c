@@ -39,11 +39,15 @@ typedef struct {
 
 typedef struct {
 	char const 		*options;	//!< Connection options
+	fr_time_delta_t		timeout;	//!< Longest time to wait for a reply.
+	bool			noreply;	//!< Don't wait for replies to updates.
 	fr_pool_t	*pool;
 } rlm_cache_memcached_t;
 
 static const CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("options", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_cache_memcached_t, options), .dflt = "--SERVER=localhost" },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_cache_memcached_t, timeout), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("noreply", FR_TYPE_BOOL, rlm_cache_memcached_t, noreply), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -76,7 +80,25 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t ti
 		return NULL;
 	}
 
+	/*
+	 *	Lookups block the worker until memcached replies,
+	 *	so bound how long that can be, and don't let Nagle
+	 *	delay our small requests.
+	 */
 	ret = memcached_behavior_set(sandle, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, fr_time_delta_to_msec(timeout));
+	if (ret == MEMCACHED_SUCCESS) {
+		ret = memcached_behavior_set(sandle, MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+					     fr_time_delta_to_msec(driver->timeout));
+	}
+	if (ret == MEMCACHED_SUCCESS) ret = memcached_behavior_set(sandle, MEMCACHED_BEHAVIOR_TCP_NODELAY, 1);
+
+	/*
+	 *	Updates are written without waiting for the server
+	 *	to acknowledge them.
+	 */
+	if ((ret == MEMCACHED_SUCCESS) && driver->noreply) {
+		ret = memcached_behavior_set(sandle, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+	}
 	if (ret != MEMCACHED_SUCCESS) {
 		ERROR("%s: %s", memcached_strerror(sandle, ret), memcached_last_error_message(sandle));
 	error:
@@ -118,6 +140,11 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	snprintf(buffer, sizeof(buffer), "rlm_cache (%s)", config->name);
 
+	if (!driver->timeout) {
+		cf_log_err(conf, "'timeout' must be non-zero");
+		return -1;
+	}
+
 	ret = libmemcached_check_configuration(driver->options, talloc_array_length(driver->options) -1,
 					       buffer, sizeof(buffer));
 	if (ret != MEMCACHED_SUCCESS) {
@@ -182,7 +209,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_ERROR;
 	}
 	RDEBUG2("Retrieved %zu bytes from memcached", len);
-	RDEBUG2("%s", from_store);
+	if ((len > 0) && ((uint8_t)from_store[0] != CACHE_SERIALIZE_BINARY)) RDEBUG2("%s", from_store);
 
 	c = talloc_zero(NULL, rlm_cache_entry_t);
 	ret = cache_deserialize(c, request->dict, from_store, len);
@@ -211,23 +238,19 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 
 	memcached_return_t ret;
 
-	TALLOC_CTX *pool;
-	char *to_store;
-
-	pool = talloc_pool(NULL, 1024);
-	if (!pool) return CACHE_ERROR;
+	uint8_t *to_store;
+	size_t len;
 
-	if (cache_serialize(pool, &to_store, c) < 0) {
-		talloc_free(pool);
+	if (cache_serialize_binary(NULL, &to_store, &len, c) < 0) {
+		RPERROR("Failed serializing entry");
 
 		return CACHE_ERROR;
 	}
 
 	ret = memcached_set(mandle->handle, (char const *)c->key, c->key_len,
-		            to_store ? to_store : "",
-		            to_store ? talloc_array_length(to_store) - 1 : 0, c->expires, 0);
-	talloc_free(pool);
-	if (ret != MEMCACHED_SUCCESS) {
+		            (char const *)to_store, len, c->expires, 0);
+	talloc_free(to_store);
+	if ((ret != MEMCACHED_SUCCESS) && (ret != MEMCACHED_BUFFERED)) {
 		RERROR("Failed storing entry: %s: %s", memcached_strerror(mandle->handle, ret),
 		       memcached_last_error_message(mandle->handle));
 
@@ -251,6 +274,7 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 	ret = memcached_delete(mandle->handle, (char const *)key, key_len, 0);
 	switch (ret) {
 	case MEMCACHED_SUCCESS:
+	case MEMCACHED_BUFFERED:
 		return CACHE_OK;
 
 	case MEMCACHED_DATA_DOES_NOT_EXIST:
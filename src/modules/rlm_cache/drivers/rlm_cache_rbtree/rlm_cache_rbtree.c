@@ -17,17 +17,18 @@
 /**
  * $Id$
  * @file rlm_cache_rbtree.c
- * @brief Simple rbtree based cache.
+ * @brief Simple in memory cache, with entries held in a B+tree.
  *
  * @copyright 2014 The FreeRADIUS server project
  */
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/btree.h>
 #include <freeradius-devel/util/heap.h>
 #include <freeradius-devel/util/debug.h>
 #include "../../rlm_cache.h"
 
 typedef struct {
-	rbtree_t		*cache;		//!< Tree for looking up cache keys.
+	fr_btree_t		*cache;		//!< Tree for looking up cache keys.
 	fr_heap_t		*heap;		//!< For managing entry expiry.
 
 	pthread_mutex_t		mutex;		//!< Protect the tree from multiple readers/writers.
@@ -64,7 +65,7 @@ static int8_t cache_heap_cmp(void const *one, void const *two)
 	return (a->expires > b->expires) - (a->expires < b->expires);
 }
 
-/** Walk over the cache rbtree
+/** Walk over the cache tree
  *
  * Used to free any entries left in the tree on detach.
  *
@@ -87,7 +88,7 @@ static int mod_detach(void *instance)
 	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
 
 	if (driver->cache) {
-		rbtree_walk(driver->cache, RBTREE_DELETE_ORDER, _cache_entry_free, NULL);
+		fr_btree_walk(driver->cache, RBTREE_DELETE_ORDER, _cache_entry_free, NULL);
 		talloc_free(driver->cache);
 	}
 
@@ -113,7 +114,7 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
 	/*
 	 *	The cache.
 	 */
-	driver->cache = rbtree_talloc_alloc(NULL, cache_entry_cmp, rlm_cache_rbtree_entry_t, NULL, 0);
+	driver->cache = fr_btree_talloc_alloc(NULL, cache_entry_cmp, rlm_cache_rbtree_entry_t, NULL, 0);
 	if (!driver->cache) {
 		ERROR("Failed to create cache");
 		return -1;
@@ -180,14 +181,14 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 	c = fr_heap_peek(driver->heap);
 	if (c && (c->expires < fr_time_to_unix_time(request->packet->timestamp))) {
 		fr_heap_extract(driver->heap, c);
-		rbtree_deletebydata(driver->cache, c);
+		fr_btree_deletebydata(driver->cache, c);
 		talloc_free(c);
 	}
 
 	/*
 	 *	Is there an entry for this key?
 	 */
-	c = rbtree_finddata(driver->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	c = fr_btree_finddata(driver->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
 	if (!c) {
 		*out = NULL;
 		return CACHE_MISS;
@@ -212,11 +213,11 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 
 	if (!request) return CACHE_ERROR;
 
-	c = rbtree_finddata(driver->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	c = fr_btree_finddata(driver->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
 	if (!c) return CACHE_MISS;
 
 	fr_heap_extract(driver->heap, c);
-	rbtree_deletebydata(driver->cache, c);
+	fr_btree_deletebydata(driver->cache, c);
 	talloc_free(c);
 
 	return CACHE_OK;
@@ -246,11 +247,11 @@ static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void
 	/*
 	 *	Allow overwriting
 	 */
-	if (!rbtree_insert(driver->cache, my_c)) {
+	if (!fr_btree_insert(driver->cache, my_c)) {
 		status = cache_entry_expire(config, instance, request, handle, c->key, c->key_len);
 		if ((status != CACHE_OK) && !fr_cond_assert(0)) return CACHE_ERROR;
 
-		if (!rbtree_insert(driver->cache, my_c)) {
+		if (!fr_btree_insert(driver->cache, my_c)) {
 			RERROR("Failed adding entry");
 
 			return CACHE_ERROR;
@@ -258,7 +259,7 @@ static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void
 	}
 
 	if (fr_heap_insert(driver->heap, my_c) < 0) {
-		rbtree_deletebydata(driver->cache, my_c);
+		fr_btree_deletebydata(driver->cache, my_c);
 		RERROR("Failed adding entry to expiry heap");
 
 		return CACHE_ERROR;
@@ -289,7 +290,7 @@ static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *confi
 	}
 
 	if (fr_heap_insert(driver->heap, c) < 0) {
-		rbtree_deletebydata(driver->cache, c);	/* make sure we don't leak entries... */
+		fr_btree_deletebydata(driver->cache, c);	/* make sure we don't leak entries... */
 		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
 		return CACHE_ERROR;
 	}
@@ -309,10 +310,10 @@ static uint32_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void
 
 	if (!request) return CACHE_ERROR;
 
-	return rbtree_num_elements(driver->cache);
+	return fr_btree_num_elements(driver->cache);
 }
 
-/** Lock the rbtree
+/** Lock the tree
  *
  * @note handle not used except for sanity checks.
  *
@@ -30,9 +30,12 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/dl_module.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/rand.h>
 
 #include "rlm_cache.h"
+#include "serialize.h"
 
 extern module_t rlm_cache;
 
@@ -40,6 +43,11 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", FR_TYPE_STRING, rlm_cache_config_t, driver_name), .dflt = "rlm_cache_rbtree" },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_cache_config_t, key) },
 	{ FR_CONF_OFFSET("ttl", FR_TYPE_UINT32, rlm_cache_config_t, ttl), .dflt = "500" },
+	{ FR_CONF_OFFSET("negative_ttl", FR_TYPE_UINT32, rlm_cache_config_t, negative_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("refresh_window", FR_TYPE_UINT32, rlm_cache_config_t, refresh_window), .dflt = "0" },
+	{ FR_CONF_OFFSET("lock_timeout", FR_TYPE_TIME_DELTA, rlm_cache_config_t, lock_timeout), .dflt = "0" },
+	{ FR_CONF_OFFSET("l1_max_entries", FR_TYPE_UINT32, rlm_cache_config_t, l1_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("l1_ttl", FR_TYPE_TIME_DELTA, rlm_cache_config_t, l1_ttl), .dflt = "1.0" },
 	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_cache_config_t, max_entries), .dflt = "0" },
 
 	/* Should be a type which matches time_t, @fixme before 2038 */
@@ -74,6 +82,242 @@ fr_dict_attr_autoload_t rlm_cache_dict_attr[] = {
 	{ NULL }
 };
 
+/** How often requests waiting for another request to add an entry check for it
+ *
+ */
+#define CACHE_CLAIM_POLL	(NSEC / 100)
+
+/** A key which a request is looking up, so that it can add it to the cache
+ *
+ */
+typedef struct {
+	uint8_t const		*key;			//!< Being looked up.
+	size_t			key_len;		//!< Length of key data.
+	fr_time_t		expires;		//!< When other requests stop waiting for it.
+	uint64_t		id;			//!< Of this claim.
+} cache_claim_t;
+
+/** Held by the request which claimed a key
+ *
+ * Releases the claim if the request is freed without adding an entry.
+ */
+typedef struct {
+	rlm_cache_in_flight_t	*in_flight;		//!< The claim was made in.
+	uint8_t const		*key;			//!< Which was claimed.
+	size_t			key_len;		//!< Length of key data.
+	uint64_t		id;			//!< Of the claim.
+} cache_claim_ref_t;
+
+static int cache_claim_cmp(void const *one, void const *two)
+{
+	cache_claim_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Release a claim on a key
+ *
+ * @param[in] in_flight	the claim was made in.
+ * @param[in] key	which was claimed.
+ * @param[in] key_len	Length of key data.
+ * @param[in] id	of the claim, or 0 to release any claim on the key.
+ */
+static void cache_claim_release(rlm_cache_in_flight_t *in_flight, uint8_t const *key, size_t key_len, uint64_t id)
+{
+	cache_claim_t *claim;
+
+	pthread_mutex_lock(&in_flight->mutex);
+	claim = rbtree_finddata(in_flight->tree, &(cache_claim_t){ .key = key, .key_len = key_len });
+	if (claim && (!id || (claim->id == id))) rbtree_deletebydata(in_flight->tree, claim);
+	pthread_mutex_unlock(&in_flight->mutex);
+}
+
+static int _cache_claim_ref_free(cache_claim_ref_t *ref)
+{
+	cache_claim_release(ref->in_flight, ref->key, ref->key_len, ref->id);
+
+	return 0;
+}
+
+/** Claim a missing key, so that other requests wait for this one to add it
+ *
+ * A claim which hasn't been released after lock_timeout can be taken over
+ * by another request.
+ *
+ * @return
+ *	- true if the request now holds the claim.
+ *	- false if another request holds it.
+ */
+static bool cache_claim(rlm_cache_t const *inst, REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_in_flight_t	*in_flight = inst->in_flight;
+	cache_claim_t		*claim;
+	cache_claim_ref_t	*ref;
+	fr_time_t		now = fr_time();
+	uint64_t		id;
+
+	pthread_mutex_lock(&in_flight->mutex);
+	claim = rbtree_finddata(in_flight->tree, &(cache_claim_t){ .key = key, .key_len = key_len });
+	if (claim && (claim->expires > now)) {
+		pthread_mutex_unlock(&in_flight->mutex);
+		return false;
+	}
+
+	if (!claim) {
+		MEM(claim = talloc_zero(NULL, cache_claim_t));
+		MEM(claim->key = talloc_memdup(claim, key, key_len));
+		claim->key_len = key_len;
+		if (!rbtree_insert(in_flight->tree, claim)) {
+			pthread_mutex_unlock(&in_flight->mutex);
+			talloc_free(claim);
+			return true;	/* Just do the lookup, without telling anyone */
+		}
+	}
+	claim->expires = now + inst->config.lock_timeout;
+	id = claim->id = ++in_flight->next_id;
+	pthread_mutex_unlock(&in_flight->mutex);
+
+	MEM(ref = talloc_zero(request, cache_claim_ref_t));
+	ref->in_flight = in_flight;
+	MEM(ref->key = talloc_memdup(ref, key, key_len));
+	ref->key_len = key_len;
+	ref->id = id;
+	talloc_set_destructor(ref, _cache_claim_ref_free);
+
+	RDEBUG2("Claimed \"%pV\" until it is added to the cache", fr_box_strvalue_len((char const *)key, key_len));
+
+	return true;
+}
+
+/** A copy of an entry in a thread's local cache
+ *
+ */
+typedef struct {
+	uint8_t const		*key;			//!< Key used to identify entry.
+	size_t			key_len;		//!< Length of key data.
+	fr_time_t		expires;		//!< When the copy is discarded.
+	uint8_t			*data;			//!< Serialized entry.
+	size_t			data_len;		//!< Length of the serialized entry.
+	fr_dlist_t		entry;			//!< In the LRU list.
+} cache_l1_entry_t;
+
+static uint32_t cache_l1_hash(void const *data)
+{
+	cache_l1_entry_t const *e = data;
+
+	return fr_hash(e->key, e->key_len);
+}
+
+static int cache_l1_cmp(void const *one, void const *two)
+{
+	cache_l1_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Discard the local copy of an entry
+ *
+ */
+static void cache_l1_remove(rlm_cache_thread_t *t, uint8_t const *key, size_t key_len)
+{
+	cache_l1_entry_t *e;
+
+	if (!t->l1) return;
+
+	e = fr_hash_table_finddata(t->l1, &(cache_l1_entry_t){ .key = key, .key_len = key_len });
+	if (!e) return;
+
+	fr_hash_table_delete(t->l1, e);
+	fr_dlist_remove(&t->lru, e);
+	talloc_free(e);
+}
+
+/** Find the local copy of an entry
+ *
+ * @return
+ *	- A new entry, which the caller must free with talloc_free().
+ *	- NULL if there's no usable copy.
+ */
+static rlm_cache_entry_t *cache_l1_find(rlm_cache_t const *inst, rlm_cache_thread_t *t, REQUEST *request,
+					uint8_t const *key, size_t key_len)
+{
+	cache_l1_entry_t	*e;
+	rlm_cache_entry_t	*c;
+
+	e = fr_hash_table_finddata(t->l1, &(cache_l1_entry_t){ .key = key, .key_len = key_len });
+	if (!e) goto miss;
+
+	if (e->expires < fr_time()) {
+	discard:
+		cache_l1_remove(t, key, key_len);
+	miss:
+		t->l1_misses++;
+		return NULL;
+	}
+
+	MEM(c = talloc_zero(NULL, rlm_cache_entry_t));
+	if (cache_deserialize(c, request->dict, (char *)e->data, e->data_len) < 0) {
+		RPWARN("Failed reading local copy of entry");
+		talloc_free(c);
+		goto discard;
+	}
+
+	/*
+	 *	The entry itself expired, or the "forget all" epoch
+	 *	has passed.
+	 */
+	if ((c->expires < fr_time_to_unix_time(request->packet->timestamp)) ||
+	    (c->created < fr_unix_time_from_sec(inst->config.epoch))) {
+		talloc_free(c);
+		goto discard;
+	}
+
+	fr_dlist_remove(&t->lru, e);
+	fr_dlist_insert_head(&t->lru, e);
+	t->l1_hits++;
+
+	return c;
+}
+
+/** Keep a local copy of an entry found by the driver
+ *
+ */
+static void cache_l1_add(rlm_cache_t const *inst, rlm_cache_thread_t *t, REQUEST *request, rlm_cache_entry_t const *c)
+{
+	cache_l1_entry_t *e;
+
+	cache_l1_remove(t, c->key, c->key_len);
+
+	MEM(e = talloc_zero(t, cache_l1_entry_t));
+	if (cache_serialize_binary(e, &e->data, &e->data_len, c) < 0) {
+		RPDEBUG2("Not keeping a local copy of the entry");
+		talloc_free(e);
+		return;
+	}
+	MEM(e->key = talloc_memdup(e, c->key, c->key_len));
+	e->key_len = c->key_len;
+	e->expires = fr_time() + inst->config.l1_ttl;
+
+	if (!fr_hash_table_insert(t->l1, e)) {
+		talloc_free(e);
+		return;
+	}
+	fr_dlist_insert_head(&t->lru, e);
+
+	if (fr_dlist_num_elements(&t->lru) > inst->config.l1_max_entries) {
+		e = fr_dlist_tail(&t->lru);
+		cache_l1_remove(t, e->key, e->key_len);
+	}
+}
+
 /** Get exclusive use of a handle to access the cache
  *
  */
@@ -200,7 +444,7 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, REQUEST *request, rlm_ca
  *	- #RLM_MODULE_NOTFOUND on cache miss.
  */
 static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst, REQUEST *request,
-			      rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
+			      rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len, bool refresh)
 {
 	cache_status_t ret;
 
@@ -247,6 +491,25 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 		return RLM_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
 
+	/*
+	 *	Close to expiry, pretend some requests didn't find the
+	 *	entry, so that it's replaced before it expires.  It
+	 *	gets more likely as expiry approaches, so that few
+	 *	requests do the lookup at once.
+	 */
+	if (refresh && inst->config.refresh_window) {
+		fr_time_delta_t	window = fr_time_delta_from_sec(inst->config.refresh_window);
+		fr_time_delta_t	remaining = c->expires - fr_time_to_unix_time(request->packet->timestamp);
+
+		if ((remaining < window) &&
+		    (((double)fr_rand() / UINT32_MAX) < ((double)(window - remaining) / window))) {
+			RDEBUG2("Found entry for \"%pV\", but refreshing it %pV seconds before it expires",
+				fr_box_strvalue_len((char const *)key, key_len), fr_box_time_delta(remaining));
+			cache_free(inst, &c);
+			return RLM_MODULE_NOTFOUND;
+		}
+	}
+
 	RDEBUG2("Found entry for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
 
 	c->hits++;
@@ -314,12 +577,6 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 	c->key = talloc_memdup(c, key, key_len);
 	c->key_len = key_len;
 
-	/*
-	 *	All in NSEC resolution
-	 */
-	c->created = c->expires = fr_time_to_unix_time(request->packet->timestamp);
-	c->expires += fr_time_delta_from_sec(ttl);
-
 	last = &c->maps;
 
 	RDEBUG2("Creating new cache entry");
@@ -424,6 +681,20 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 	}
 	talloc_free(pool);
 
+	/*
+	 *	Nothing was found to cache.
+	 */
+	if (!c->maps && inst->config.negative_ttl) {
+		RDEBUG2("Entry is empty, using negative_ttl");
+		ttl = inst->config.negative_ttl;
+	}
+
+	/*
+	 *	All in NSEC resolution
+	 */
+	c->created = c->expires = fr_time_to_unix_time(request->packet->timestamp);
+	c->expires += fr_time_delta_from_sec(ttl);
+
 	/*
 	 *	Check to see if we need to merge the entry into the request
 	 */
@@ -443,6 +714,7 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 
 		case CACHE_OK:
 			RDEBUG2("Committed entry, TTL %d seconds", ttl);
+			if (inst->in_flight) cache_claim_release(inst->in_flight, key, key_len, 0);
 			cache_free(inst, &c);
 			return merge ? RLM_MODULE_UPDATED :
 				       RLM_MODULE_OK;
@@ -523,6 +795,53 @@ static int cache_verify(vp_map_t *map, void *ctx)
 	return 0;
 }
 
+static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(module_ctx_t const *mctx, REQUEST *request);
+
+static void _cache_wait_done(UNUSED module_ctx_t const *mctx, REQUEST *request, UNUSED void *rctx,
+			     UNUSED fr_time_t fired)
+{
+	unlang_interpret_resumable(request);
+}
+
+/** Check whether the entry has been added, after waiting for it
+ *
+ */
+static rlm_rcode_t mod_cache_resume(module_ctx_t const *mctx, REQUEST *request, void *rctx)
+{
+	talloc_free(rctx);
+
+	return mod_cache_it(mctx, request);
+}
+
+static void mod_cache_signal(UNUSED module_ctx_t const *mctx, REQUEST *request, void *rctx,
+			     fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	(void) unlang_module_timeout_delete(request, rctx);
+}
+
+/** Yield until another request may have added the entry
+ *
+ */
+static rlm_rcode_t cache_wait(REQUEST *request)
+{
+	fr_time_t *yielded_at;
+
+	RDEBUG2("Entry is being looked up by another request, waiting for it");
+
+	MEM(yielded_at = talloc(request, fr_time_t));
+	*yielded_at = fr_time();
+
+	if (unlang_module_timeout_add(request, _cache_wait_done, yielded_at, *yielded_at + CACHE_CLAIM_POLL) < 0) {
+		RPEDEBUG("Adding event failed");
+		talloc_free(yielded_at);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_cache_resume, mod_cache_signal, yielded_at);
+}
+
 /** Do caching checks
  *
  * Since we can update ANY VP list, we do exactly the same thing for all sections
@@ -535,8 +854,10 @@ static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(module_ctx_t const *mctx, REQUE
 {
 	rlm_cache_entry_t	*c = NULL;
 	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
 
 	rlm_cache_handle_t	*handle;
+	bool			l1;
 
 	fr_cursor_t		cursor;
 	VALUE_PAIR		*vp;
@@ -572,7 +893,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(module_ctx_t const *mctx, REQUE
 
 		if (cache_acquire(&handle, inst, request) < 0) return RLM_MODULE_FAIL;
 
-		rcode = cache_find(&c, inst, request, &handle, key, key_len);
+		rcode = cache_find(&c, inst, request, &handle, key, key_len, false);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
 		fr_assert(!inst->driver->acquire || handle);
 
@@ -610,6 +931,26 @@ static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(module_ctx_t const *mctx, REQUE
 	RDEBUG3("expire : %s", expire ? "yes" : "no");
 	RDEBUG3("ttl    : %i", ttl);
 	REXDENT();
+
+	/*
+	 *	The local cache can only be used for plain lookups.
+	 *	Anything which changes the entry discards our copy,
+	 *	though copies held by other threads remain until
+	 *	l1_ttl passes.
+	 */
+	l1 = t->l1 && merge && !expire && !set_ttl;
+	if (!l1) {
+		cache_l1_remove(t, key, key_len);
+	} else {
+		c = cache_l1_find(inst, t, request, key, key_len);
+		if (c) {
+			RDEBUG2("Found local copy of entry for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
+			rcode = cache_merge(inst, request, c);
+			talloc_free(c);
+			goto done;
+		}
+	}
+
 	if (cache_acquire(&handle, inst, request) < 0) return RLM_MODULE_FAIL;
 
 	/*
@@ -617,7 +958,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(module_ctx_t const *mctx, REQUE
 	 *	recording whether the entry existed.
 	 */
 	if (merge) {
-		rcode = cache_find(&c, inst, request, &handle, key, key_len);
+		rcode = cache_find(&c, inst, request, &handle, key, key_len, true);
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 			goto finish;
@@ -625,11 +966,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(module_ctx_t const *mctx, REQUE
 		case RLM_MODULE_OK:
 			rcode = cache_merge(inst, request, c);
 			exists = 1;
+			t->l2_hits++;
+			if (l1) cache_l1_add(inst, t, request, c);
 			break;
 
 		case RLM_MODULE_NOTFOUND:
 			rcode = RLM_MODULE_NOTFOUND;
 			exists = 0;
+			t->l2_misses++;
 			break;
 
 		default:
@@ -638,6 +982,16 @@ static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(module_ctx_t const *mctx, REQUE
 		fr_assert(!inst->driver->acquire || handle);
 	}
 
+	/*
+	 *	Nothing's cached, and this call won't add it.  If
+	 *	another request is already looking the entry up, wait
+	 *	for that to finish, rather than repeating the lookup.
+	 */
+	if ((exists == 0) && !insert && inst->in_flight && !cache_claim(inst, request, key, key_len)) {
+		cache_release(inst, request, &handle);
+		return cache_wait(request);
+	}
+
 	/*
 	 *	Expire the entry if told to, and we either don't know whether
 	 *	it exists, or we know it does.
@@ -677,7 +1031,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(module_ctx_t const *mctx, REQUE
 	 *	determine that now.
 	 */
 	if ((exists < 0) && (insert || set_ttl)) {
-		switch (cache_find(&c, inst, request, &handle, key, key_len)) {
+		switch (cache_find(&c, inst, request, &handle, key, key_len, false)) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
@@ -727,6 +1081,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(module_ctx_t const *mctx, REQUE
 	 *	insert.
 	 */
 	if (insert && (exists == 0)) {
+		cache_l1_remove(t, key, key_len);
+
 		switch (cache_insert(inst, request, &handle, key, key_len, ttl)) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
@@ -752,6 +1108,7 @@ finish:
 	cache_free(inst, &c);
 	cache_release(inst, request, &handle);
 
+done:
 	/*
 	 *	Clear control attributes
 	 */
@@ -823,7 +1180,7 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 		return -1;
 	}
 
-	switch (cache_find(&c, mod_inst, request, &handle, key, key_len)) {
+	switch (cache_find(&c, mod_inst, request, &handle, key, key_len, false)) {
 	case RLM_MODULE_OK:		/* found */
 		break;
 
@@ -858,6 +1215,44 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 	return ret;
 }
 
+/** Create the thread's local cache
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, UNUSED fr_event_list_t *el,
+				  void *thread)
+{
+	rlm_cache_t		*inst = talloc_get_type_abort(instance, rlm_cache_t);
+	rlm_cache_thread_t	*t = thread;
+
+	(void) talloc_set_type(t, rlm_cache_thread_t);
+	t->inst = inst;
+
+	if (!inst->config.l1_max_entries) return 0;
+
+	t->l1 = fr_hash_table_create(t, cache_l1_hash, cache_l1_cmp, NULL);
+	if (!t->l1) return -1;
+	fr_dlist_init(&t->lru, cache_l1_entry_t, entry);
+
+	return 0;
+}
+
+/** Log the thread's statistics
+ *
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_cache_thread_t	*t = talloc_get_type_abort(thread, rlm_cache_thread_t);
+	rlm_cache_t const	*inst = t->inst;
+
+	if (t->l1) {
+		DEBUG2("Local cache %" PRIu64 " hits, %" PRIu64 " misses.  "
+		       "Driver %" PRIu64 " hits, %" PRIu64 " misses",
+		       t->l1_hits, t->l1_misses, t->l2_hits, t->l2_misses);
+	}
+
+	return 0;
+}
+
 /** Free any memory allocated under the instance
  *
  */
@@ -865,6 +1260,8 @@ static int mod_detach(void *instance)
 {
 	rlm_cache_t *inst = instance;
 
+	if (inst->in_flight) pthread_mutex_destroy(&inst->in_flight->mutex);
+
 	/*
 	 *	We need to explicitly free all children, so if the driver
 	 *	parented any memory off the instance, their destructors
@@ -987,6 +1384,23 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->config.refresh_window >= inst->config.ttl) {
+		cf_log_err(conf, "'refresh_window' must be less than 'ttl'");
+		return -1;
+	}
+
+	if (inst->config.l1_max_entries && !inst->config.l1_ttl) {
+		cf_log_err(conf, "'l1_ttl' must be non-zero when 'l1_max_entries' is set");
+		return -1;
+	}
+
+	if (inst->config.lock_timeout) {
+		MEM(inst->in_flight = talloc_zero(inst, rlm_cache_in_flight_t));
+		MEM(inst->in_flight->tree = rbtree_talloc_alloc(inst->in_flight, cache_claim_cmp, cache_claim_t,
+								rbtree_node_talloc_free, RBTREE_FLAG_NONE));
+		pthread_mutex_init(&inst->in_flight->mutex, NULL);
+	}
+
 	return 0;
 }
 
@@ -1003,10 +1417,13 @@ module_t rlm_cache = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "cache",
 	.inst_size	= sizeof(rlm_cache_t),
+	.thread_inst_size	= sizeof(rlm_cache_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_cache_it,
 		[MOD_PREACCT]		= mod_cache_it,
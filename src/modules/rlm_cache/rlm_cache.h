@@ -52,11 +52,26 @@ typedef struct {
 	char const		*driver_name;		//!< Driver name.
 	vp_tmpl_t		*key;			//!< What to expand to get the value of the key.
 	uint32_t		ttl;			//!< How long an entry is valid for.
+	uint32_t		negative_ttl;		//!< How long an entry with no attributes is valid for.
+	uint32_t		refresh_window;		//!< How long before expiry entries may be refreshed.
+	fr_time_delta_t		lock_timeout;		//!< Longest time to wait for another request to
+							///< add a missing entry.
+	uint32_t		l1_max_entries;		//!< Maximum entries in each thread's local cache.
+	fr_time_delta_t		l1_ttl;			//!< How long entries are kept in the local cache.
 	uint32_t		max_entries;		//!< Maximum entries allowed.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
 	bool			stats;			//!< Generate statistics.
 } rlm_cache_config_t;
 
+/** Keys which requests are looking up, so that they can be added to the cache
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;			//!< Protects everything below.
+	rbtree_t		*tree;			//!< Claims, indexed by key.
+	uint64_t		next_id;		//!< To tell claims on the same key apart.
+} rlm_cache_in_flight_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -73,8 +88,27 @@ typedef struct {
 	vp_map_t		*maps;			//!< Attribute map applied to users.
 							//!< and profiles.
 	CONF_SECTION		*cs;
+
+	rlm_cache_in_flight_t	*in_flight;		//!< Keys being looked up, so they can be added.
 } rlm_cache_t;
 
+/** Per-thread data
+ *
+ * The local cache holds serialized copies of recently found entries,
+ * so that they can be found without going to the driver.
+ */
+typedef struct {
+	rlm_cache_t const	*inst;			//!< Instance this thread's data belongs to.
+
+	fr_hash_table_t		*l1;			//!< Local copies, indexed by key.
+	fr_dlist_head_t		lru;			//!< Local copies, most recently used first.
+
+	uint64_t		l1_hits;		//!< Found in the local cache.
+	uint64_t		l1_misses;		//!< Not found in the local cache.
+	uint64_t		l2_hits;		//!< Found by the driver.
+	uint64_t		l2_misses;		//!< Not found by the driver.
+} rlm_cache_thread_t;
+
 typedef struct {
 	uint8_t const		*key;			//!< Key used to identify entry.
 	size_t			key_len;		//!< Length of key data.
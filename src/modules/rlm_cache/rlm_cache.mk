@@ -1,3 +1,4 @@
 TARGET		:= rlm_cache.a
-SOURCES		:= rlm_cache.c
+SOURCES		:= rlm_cache.c serialize.c
 TGT_LDLIBS	:= $(LIBS)
+TGT_PREREQS	:= libfreeradius-internal.a
@@ -28,6 +28,25 @@ RCSID("$Id$")
 #include "rlm_cache.h"
 #include "serialize.h"
 
+#include <freeradius-devel/internal/internal.h>
+#include <freeradius-devel/io/pair.h>
+#include <freeradius-devel/util/net.h>
+
+/*
+ *	Marker, version, created and expires.
+ */
+#define CACHE_BINARY_HDR_LEN	(1 + 1 + sizeof(uint64_t) + sizeof(uint64_t))
+
+/*
+ *	Request, list, operator and tag.
+ */
+#define CACHE_BINARY_MAP_LEN	(4)
+
+/*
+ *	Larger entries probably can't be stored anyway.
+ */
+#define CACHE_BINARY_MAX_LEN	(1024 * 1024)
+
 /** Serialize a cache entry as a humanly readable string
  *
  * @param ctx to alloc new string in. Should be a talloc pool a little bigger
@@ -89,13 +108,176 @@ finish:
 	return 0;
 }
 
+/** Serialize a cache entry in the compact binary format
+ *
+ * The header is #CACHE_SERIALIZE_BINARY, the version of the internal
+ * encoding, and the created and expires times.  Each map is then the
+ * request, list, operator and tag of the map, followed by its attribute
+ * and value, written by the internal encoder.
+ *
+ * @param[in] ctx	to alloc the serialized entry in.
+ * @param[out] out	Where to write pointer to serialized cache entry.
+ * @param[out] outlen	Length of the serialized cache entry.
+ * @param[in] c		Cache entry to serialize.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen, rlm_cache_entry_t const *c)
+{
+	uint8_t		*buff, *p;
+	size_t		len = 1024;
+	vp_map_t	*map;
+
+	buff = talloc_array(ctx, uint8_t, len);
+	if (!buff) return -1;
+
+	p = buff;
+	*p++ = CACHE_SERIALIZE_BINARY;
+	*p++ = FR_INTERNAL_VERSION;
+	fr_net_from_uint64(p, (uint64_t)c->created);
+	p += sizeof(uint64_t);
+	fr_net_from_uint64(p, (uint64_t)c->expires);
+	p += sizeof(uint64_t);
+
+	for (map = c->maps; map; map = map->next) {
+		VALUE_PAIR	*vp;
+		fr_cursor_t	cursor;
+		ssize_t		slen = 0;
+
+		vp = fr_pair_afrom_da(NULL, tmpl_da(map->lhs));
+		if (!vp) {
+		error:
+			talloc_free(buff);
+			return -1;
+		}
+
+		if (fr_value_box_copy(vp, &vp->data, tmpl_value(map->rhs)) < 0) {
+			talloc_free(vp);
+			goto error;
+		}
+
+		for (;;) {
+			size_t used = p - buff;
+
+			if ((len - used) > CACHE_BINARY_MAP_LEN) {
+				fr_cursor_init(&cursor, &vp);
+				slen = fr_internal_encode_pair(p + CACHE_BINARY_MAP_LEN,
+							       len - used - CACHE_BINARY_MAP_LEN, &cursor, NULL);
+				if (slen > 0) break;
+				if ((slen == 0) || fr_pair_encode_is_error(slen)) {
+					fr_strerror_printf("Failed encoding %s", vp->da->name);
+					talloc_free(vp);
+					goto error;
+				}
+			}
+
+			/*
+			 *	Out of space, double the buffer and
+			 *	try again.
+			 */
+			if ((len * 2) > CACHE_BINARY_MAX_LEN) {
+				fr_strerror_printf("Serialized entry too long.  Must be < %u bytes", CACHE_BINARY_MAX_LEN);
+				talloc_free(vp);
+				goto error;
+			}
+
+			len *= 2;
+			MEM(buff = talloc_realloc(ctx, buff, uint8_t, len));
+			p = buff + used;
+		}
+		talloc_free(vp);
+
+		p[0] = tmpl_request(map->lhs);
+		p[1] = tmpl_list(map->lhs);
+		p[2] = map->op;
+		p[3] = (uint8_t)tmpl_tag(map->lhs);
+		p += CACHE_BINARY_MAP_LEN + slen;
+	}
+
+	*out = buff;
+	*outlen = p - buff;
+
+	return 0;
+}
+
+/** Converts a binary serialized cache entry back into a structure
+ *
+ */
+static int cache_deserialize_binary(rlm_cache_entry_t *c, fr_dict_t const *dict, uint8_t const *in, size_t inlen)
+{
+	uint8_t const	*p = in, *end = in + inlen;
+	vp_map_t	**last = &c->maps;
+
+	if (inlen < CACHE_BINARY_HDR_LEN) {
+		fr_strerror_printf("Serialized entry too short.  Need %zu bytes, got %zu bytes",
+				   CACHE_BINARY_HDR_LEN, inlen);
+		return -1;
+	}
+
+	if (p[1] != FR_INTERNAL_VERSION) {
+		fr_strerror_printf("Serialized entry has version %u, expected %u", p[1], FR_INTERNAL_VERSION);
+		return -1;
+	}
+	p += 2;
+
+	c->created = (fr_unix_time_t)fr_net_to_uint64(p);
+	p += sizeof(uint64_t);
+	c->expires = (fr_unix_time_t)fr_net_to_uint64(p);
+	p += sizeof(uint64_t);
+
+	while (p < end) {
+		VALUE_PAIR	*vp = NULL;
+		vp_map_t	*map;
+		fr_cursor_t	cursor;
+		ssize_t		slen;
+
+		if (((end - p) <= CACHE_BINARY_MAP_LEN) ||
+		    (p[0] >= REQUEST_UNKNOWN) || (p[1] >= PAIR_LIST_UNKNOWN) || (p[2] >= T_TOKEN_LAST)) {
+			fr_strerror_printf("Invalid map at offset %zu", (size_t)(p - in));
+			return -1;
+		}
+
+		fr_cursor_init(&cursor, &vp);
+		slen = fr_internal_decode_pair(c, &cursor, dict, p + CACHE_BINARY_MAP_LEN,
+					       end - (p + CACHE_BINARY_MAP_LEN), NULL);
+		if ((slen <= 0) || !vp) {
+			fr_strerror_printf_push("Failed decoding map at offset %zu", (size_t)(p - in));
+			fr_pair_list_free(&vp);
+			return -1;
+		}
+		vp->tag = (int8_t)p[3];
+
+		if (map_afrom_vp(c, &map, vp, &(vp_tmpl_rules_t){
+					.dict_def = dict,
+					.request_def = p[0],
+					.list_def = p[1]
+				 }) < 0) {
+			fr_pair_list_free(&vp);
+			return -1;
+		}
+		map->op = p[2];
+		fr_pair_list_free(&vp);
+
+		MAP_VERIFY(map);
+
+		*last = map;
+		last = &(*last)->next;
+
+		p += CACHE_BINARY_MAP_LEN + slen;
+	}
+
+	return 0;
+}
+
 /** Converts a serialized cache entry back into a structure
  *
  * @param[in] c		Cache entry to populate (should already be allocated)
  * @param[in] dict	to use for unqualified attributes.
- * @param[in] in	String representation of cache entry.
+ * @param[in] in	String or binary representation of cache entry.
  * @param[in] inlen	Length of string. May be < 0 in which case strlen will be
- *			used to calculate the length of the string.
+ *			used to calculate the length of the string.  Must be
+ *			>= 0 for binary entries.
  * @return
  *	- 0 on success.
  *	- -1 on failure.
@@ -105,6 +287,10 @@ int cache_deserialize(rlm_cache_entry_t *c, fr_dict_t const *dict, char *in, ssi
 	vp_map_t	**last = &c->maps;
 	char		*p, *q;
 
+	if ((inlen > 0) && ((uint8_t)in[0] == CACHE_SERIALIZE_BINARY)) {
+		return cache_deserialize_binary(c, dict, (uint8_t const *)in, inlen);
+	}
+
 	if (inlen < 0) inlen = strlen(in);
 
 	p = in;
@@ -26,5 +26,11 @@
  */
 RCSIDH(serialize_h, "$Id$")
 
+/*
+ *	First byte of a binary entry.  Text entries always start with '&'.
+ */
+#define CACHE_SERIALIZE_BINARY	(0xff)
+
 int cache_serialize(TALLOC_CTX *ctx, char **out, rlm_cache_entry_t const *c);
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen, rlm_cache_entry_t const *c);
 int cache_deserialize(rlm_cache_entry_t *c, fr_dict_t const *dict, char *in, ssize_t inlen);
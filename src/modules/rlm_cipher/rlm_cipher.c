@@ -29,10 +29,14 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/offload.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/tls/base.h>
 
 #include <openssl/crypto.h>
+#include <openssl/err.h>
 #include <openssl/pem.h>
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
@@ -83,6 +87,11 @@ static fr_table_num_sorted_t const cipher_type[] = {
 };
 static size_t cipher_type_len = NUM_ELEMENTS(cipher_type);
 
+/** Per-thread contexts
+ *
+ * Each worker has one of these, as does each offload thread.  The
+ * offload field is only used by workers.
+ */
 typedef struct {
 	EVP_PKEY_CTX		*evp_encrypt_ctx;		//!< Pre-allocated evp_pkey_ctx.
 	EVP_PKEY_CTX		*evp_sign_ctx;			//!< Pre-allocated evp_pkey_ctx.
@@ -91,6 +100,8 @@ typedef struct {
 
 	EVP_MD_CTX		*evp_md_ctx;			//!< Pre-allocated evp_md_ctx for sign and verify.
 	uint8_t			*digest_buff;			//!< Pre-allocated digest buffer.
+
+	fr_offload_thread_t	*offload;			//!< Where completed jobs are returned, NULL if disabled.
 } rlm_cipher_rsa_thread_inst_t;
 
 /** Configuration for the OAEP padding method
@@ -136,8 +147,45 @@ typedef struct {
 	union {
 		cipher_rsa_t	*rsa;				//!< Use RSA encryption (with optional padding).
 	};
+
+	fr_offload_conf_t	offload_conf;			//!< Threads performing key operations.
+	fr_offload_t		*offload;			//!< Offload pool, NULL if disabled.
 } rlm_cipher_t;
 
+/** Key operations which may be performed by an offload thread
+ *
+ */
+typedef enum {
+	CIPHER_JOB_ENCRYPT = 0,
+	CIPHER_JOB_DECRYPT,
+	CIPHER_JOB_SIGN,
+	CIPHER_JOB_VERIFY
+} cipher_job_type_t;
+
+/** A key operation, performed by an offload thread or inline
+ *
+ * Everything the offload thread needs is copied into the job, and the
+ * output buffer is allocated before the job is queued, so the offload
+ * thread never touches the request, and never allocates or frees memory.
+ */
+typedef struct {
+	fr_offload_job_t	job;				//!< Must be first.
+
+	cipher_job_type_t	type;				//!< What operation to perform.
+
+	uint8_t const		*in;				//!< Plaintext, ciphertext, or message.
+	size_t			in_len;				//!< Length of the input.
+	uint8_t const		*sig;				//!< Signature to verify.
+	size_t			sig_len;			//!< Length of the signature.
+
+	uint8_t			*out;				//!< Ciphertext, plaintext, or signature.
+	size_t			out_len;			//!< Size of the output buffer, then of the output.
+
+	int			result;				//!< 1 on success or valid signature,
+								///< 0 on invalid signature, -1 on error.
+	char			error[256];			//!< Why the operation failed.
+} cipher_job_t;
+
 /** Configuration for the RSA-PCKS1-OAEP padding scheme
  *
  */
@@ -176,6 +224,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("type", FR_TYPE_VOID | FR_TYPE_NOT_EMPTY, rlm_cipher_t, type), .func = cipher_type_parse, .dflt = "rsa" },
 	{ FR_CONF_OFFSET("rsa", FR_TYPE_SUBSECTION, rlm_cipher_t, rsa),
 			 .subcs_size = sizeof(cipher_rsa_t), .subcs_type = "cipher_rsa_t", .subcs = (void const *) rsa_config },
+	{ FR_CONF_OFFSET("offload", FR_TYPE_SUBSECTION, rlm_cipher_t, offload_conf), .subcs = (void const *) fr_offload_config },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -453,6 +502,244 @@ static int cipher_rsa_certificate_file_load(TALLOC_CTX *ctx, void *out, UNUSED v
 	return 0;
 }
 
+/** Record why a job failed, along with the last OpenSSL error
+ *
+ * OpenSSL's error queue is per-thread, so errors from offload threads
+ * have to be copied into the job for the worker to log.
+ */
+static void cipher_job_error(cipher_job_t *job, char const *msg)
+{
+	unsigned long	err = ERR_get_error();
+	char		buffer[256];
+
+	if (!err) {
+		snprintf(job->error, sizeof(job->error), "%s", msg);
+		return;
+	}
+
+	ERR_error_string_n(err, buffer, sizeof(buffer));
+	snprintf(job->error, sizeof(job->error), "%s: %s", msg, buffer);
+	ERR_clear_error();
+}
+
+/** Perform the key operation for a job
+ *
+ * Called from an offload thread, or inline if offloading is disabled
+ * or the pool is full.  Does not log or allocate memory.
+ *
+ * @param[in] inst	Module instance.
+ * @param[in] t		EVP contexts belonging to the calling thread.
+ * @param[in] job	to process.
+ */
+static void cipher_job_run(rlm_cipher_t const *inst, rlm_cipher_rsa_thread_inst_t *t, cipher_job_t *job)
+{
+	unsigned int	digest_len = 0;
+
+	job->result = -1;
+
+	switch (job->type) {
+	case CIPHER_JOB_ENCRYPT:
+		if (EVP_PKEY_encrypt(t->evp_encrypt_ctx, job->out, &job->out_len, job->in, job->in_len) <= 0) {
+			cipher_job_error(job, "Failed encrypting plaintext");
+			return;
+		}
+		break;
+
+	case CIPHER_JOB_DECRYPT:
+		if (EVP_PKEY_decrypt(t->evp_decrypt_ctx, job->out, &job->out_len, job->in, job->in_len) <= 0) {
+			cipher_job_error(job, "Failed decrypting ciphertext");
+			return;
+		}
+		break;
+
+	case CIPHER_JOB_SIGN:
+	case CIPHER_JOB_VERIFY:
+		/*
+		 *	First produce a digest of the message
+		 */
+		if (unlikely(EVP_DigestInit_ex(t->evp_md_ctx, inst->rsa->sig_digest, NULL) <= 0)) {
+			cipher_job_error(job, "Failed initialising message digest");
+			return;
+		}
+
+		if (EVP_DigestUpdate(t->evp_md_ctx, job->in, job->in_len) <= 0) {
+			cipher_job_error(job, "Failed ingesting message");
+			return;
+		}
+
+		if (EVP_DigestFinal_ex(t->evp_md_ctx, t->digest_buff, &digest_len) <= 0) {
+			cipher_job_error(job, "Failed finalising message digest");
+			return;
+		}
+		fr_assert((size_t)digest_len == talloc_array_length(t->digest_buff));
+
+		/*
+		 *	Then sign the digest
+		 */
+		if (job->type == CIPHER_JOB_SIGN) {
+			if (EVP_PKEY_sign(t->evp_sign_ctx, job->out, &job->out_len,
+					  t->digest_buff, (size_t)digest_len) <= 0) {
+				cipher_job_error(job, "Failed signing message digest");
+				return;
+			}
+			break;
+		}
+
+		/*
+		 *	Or check the signature matches what we expected
+		 */
+		switch (EVP_PKEY_verify(t->evp_verify_ctx, job->sig, job->sig_len,
+					t->digest_buff, (size_t)digest_len)) {
+		case 1:		/* success (signature valid) */
+			break;
+
+		case 0:		/* failure (signature not valid) */
+			job->result = 0;
+			return;
+
+		default:
+			cipher_job_error(job, "Failed validating signature");
+			return;
+		}
+		break;
+	}
+
+	job->result = 1;
+}
+
+/** Allocate a job
+ *
+ * If offloading is enabled, the job is parented by the NULL ctx, so
+ * that it survives the request being cancelled while an offload thread
+ * is using it, and the input is copied for the same reason.
+ *
+ * @param[in] ctx	to allocate the job in, if offloading is disabled.
+ * @param[in] inst	Module instance.
+ * @param[in] type	of operation.
+ * @param[in] pkey	used for the operation, which determines the size of the output.
+ * @param[in] in	Input data.
+ * @param[in] in_len	Length of the input data.
+ * @return A new job.
+ */
+static cipher_job_t *cipher_job_alloc(TALLOC_CTX *ctx, rlm_cipher_t const *inst, cipher_job_type_t type,
+				      EVP_PKEY *pkey, uint8_t const *in, size_t in_len)
+{
+	cipher_job_t	*job;
+
+	MEM(job = talloc_zero(inst->offload ? NULL : ctx, cipher_job_t));
+	job->type = type;
+
+	if (inst->offload) {
+		MEM(job->in = talloc_memdup(job, in, in_len));
+	} else {
+		job->in = in;
+	}
+	job->in_len = in_len;
+
+	if (type != CIPHER_JOB_VERIFY) {
+		job->out_len = EVP_PKEY_size(pkey);
+		MEM(job->out = talloc_array(job, uint8_t, job->out_len));
+	}
+
+	return job;
+}
+
+/** Convert the result of a job into the output of an xlat
+ *
+ */
+static xlat_action_t cipher_job_result(TALLOC_CTX *ctx, fr_cursor_t *out, REQUEST *request, cipher_job_t const *job)
+{
+	fr_value_box_t	*vb;
+
+	if (job->result < 0) {
+		REDEBUG("%s", job->error);
+		return XLAT_ACTION_FAIL;
+	}
+
+	switch (job->type) {
+	case CIPHER_JOB_ENCRYPT:
+		RHEXDUMP3(job->out, job->out_len, "Ciphertext (%zu bytes)", job->out_len);
+		FALL_THROUGH;
+
+	case CIPHER_JOB_SIGN:
+		MEM(vb = fr_value_box_alloc_null(ctx));
+		MEM(fr_value_box_memdup(vb, vb, NULL, job->out, job->out_len, false) == 0);
+		break;
+
+	case CIPHER_JOB_DECRYPT:
+		RHEXDUMP3(job->out, job->out_len, "Plaintext (%zu bytes)", job->out_len);
+		MEM(vb = fr_value_box_alloc_null(ctx));
+		MEM(fr_value_box_bstrndup(vb, vb, NULL, (char const *)job->out, job->out_len, true) == 0);
+		break;
+
+	case CIPHER_JOB_VERIFY:
+		MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_BOOL, NULL, false));
+		vb->vb_bool = (job->result == 1);
+		break;
+
+	default:
+		fr_assert(0);
+		return XLAT_ACTION_FAIL;
+	}
+
+	fr_cursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
+}
+
+static xlat_action_t cipher_offload_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
+					   REQUEST *request, UNUSED void const *xlat_inst,
+					   UNUSED void *xlat_thread_inst, UNUSED fr_value_box_t **in, void *rctx)
+{
+	cipher_job_t	*job = talloc_get_type_abort(rctx, cipher_job_t);
+	xlat_action_t	ret;
+
+	ret = cipher_job_result(ctx, out, request, job);
+	talloc_free(job);
+
+	return ret;
+}
+
+static void cipher_offload_signal(UNUSED REQUEST *request, UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst,
+				  void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	fr_offload_cancel(talloc_get_type_abort(rctx, cipher_job_t));
+}
+
+/** Perform a key operation, in an offload thread if possible
+ *
+ * @param[in] ctx	to allocate output in.
+ * @param[out] out	Where to write the output.
+ * @param[in] request	The current request.
+ * @param[in] inst	Module instance.
+ * @param[in] t		Worker's thread instance.
+ * @param[in] job	to process.  Will be freed, or owned by the pool.
+ * @return
+ *	- XLAT_ACTION_YIELD if the job was queued.
+ *	- The result of the operation otherwise.
+ */
+static xlat_action_t cipher_job_submit(TALLOC_CTX *ctx, fr_cursor_t *out, REQUEST *request,
+				       rlm_cipher_t const *inst, rlm_cipher_rsa_thread_inst_t *t, cipher_job_t *job)
+{
+	xlat_action_t		ret;
+
+	/*
+	 *	If the pool is saturated, doing the work inline
+	 *	is better than delaying the request further.
+	 */
+	if (t->offload && (fr_offload_submit(t->offload, request, job) == 0)) {
+		return unlang_xlat_yield(request, cipher_offload_resume, cipher_offload_signal, job);
+	}
+
+	cipher_job_run(inst, t, job);
+	ret = cipher_job_result(ctx, out, request, job);
+	talloc_free(job);
+
+	return ret;
+}
+
 /** Encrypt input data
  *
  * Arguments are @verbatim(<plaintext>...)@endverbatim
@@ -466,19 +753,18 @@ static int cipher_rsa_certificate_file_load(TALLOC_CTX *ctx, void *out, UNUSED v
  * @ingroup xlat_functions
  */
 static xlat_action_t cipher_rsa_encrypt_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
-					     REQUEST *request, UNUSED void const *xlat_inst, void *xlat_thread_inst,
+					     REQUEST *request, void const *xlat_inst, void *xlat_thread_inst,
 					     fr_value_box_t **in)
 {
+	rlm_cipher_t const		*inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst),
+									    rlm_cipher_t);
 	rlm_cipher_rsa_thread_inst_t	*xt = talloc_get_type_abort(*((void **)xlat_thread_inst),
 								    rlm_cipher_rsa_thread_inst_t);
 
 	char const			*plaintext;
 	size_t				plaintext_len;
 
-	uint8_t				*ciphertext;
-	size_t				ciphertext_len;
-
-	fr_value_box_t			*vb;
+	cipher_job_t			*job;
 
 	if (!*in) {
 		REDEBUG("encrypt requires one or arguments (<plaintext>...)");
@@ -492,29 +778,12 @@ static xlat_action_t cipher_rsa_encrypt_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 	plaintext = (*in)->vb_strvalue;
 	plaintext_len = (*in)->vb_length;
 
-	/*
-	 *	Figure out the buffer we need
-	 */
 	RHEXDUMP3((uint8_t const *)plaintext, plaintext_len, "Plaintext (%zu bytes)", plaintext_len);
-	if (EVP_PKEY_encrypt(xt->evp_encrypt_ctx, NULL, &ciphertext_len,
-			     (unsigned char const *)plaintext, plaintext_len) <= 0) {
-		fr_tls_log_error(request, "Failed getting length of encrypted plaintext");
-		return XLAT_ACTION_FAIL;
-	}
 
-	MEM(vb = fr_value_box_alloc_null(ctx));
-	MEM(fr_value_box_mem_alloc(vb, &ciphertext, vb, NULL, ciphertext_len, false) == 0);
-	if (EVP_PKEY_encrypt(xt->evp_encrypt_ctx, ciphertext, &ciphertext_len,
-			     (unsigned char const *)plaintext, plaintext_len) <= 0) {
-		fr_tls_log_error(request, "Failed encrypting plaintext");
-		talloc_free(vb);
-		return XLAT_ACTION_FAIL;
-	}
-	RHEXDUMP3(ciphertext, ciphertext_len, "Ciphertext (%zu bytes)", ciphertext_len);
-	MEM(fr_value_box_mem_realloc(vb, NULL, vb, ciphertext_len) == 0);
-	fr_cursor_append(out, vb);
+	job = cipher_job_alloc(ctx, inst, CIPHER_JOB_ENCRYPT, inst->rsa->certificate_file,
+			       (uint8_t const *)plaintext, plaintext_len);
 
-	return XLAT_ACTION_DONE;
+	return cipher_job_submit(ctx, out, request, inst, xt, job);
 }
 
 /** Sign input data
@@ -541,12 +810,7 @@ static xlat_action_t cipher_rsa_sign_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 	char const			*msg;
 	size_t				msg_len;
 
-	uint8_t				*sig;
-	size_t				sig_len;
-
-	unsigned int			digest_len = 0;
-
-	fr_value_box_t			*vb;
+	cipher_job_t			*job;
 
 	if (!*in) {
 		REDEBUG("sign requires one or arguments (<plaintext>...)");
@@ -560,44 +824,10 @@ static xlat_action_t cipher_rsa_sign_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 	msg = (*in)->vb_strvalue;
 	msg_len = (*in)->vb_length;
 
-	/*
-	 *	First produce a digest of the message
-	 */
-	if (unlikely(EVP_DigestInit_ex(xt->evp_md_ctx, inst->rsa->sig_digest, NULL) <= 0)) {
-		fr_tls_log_error(request, "Failed initialising message digest");
-		return XLAT_ACTION_FAIL;
-	}
-
-	if (EVP_DigestUpdate(xt->evp_md_ctx, msg, msg_len) <= 0) {
-		fr_tls_log_error(request, "Failed ingesting message");
-		return XLAT_ACTION_FAIL;
-	}
-
-	if (EVP_DigestFinal_ex(xt->evp_md_ctx, xt->digest_buff, &digest_len) <= 0) {
-		fr_tls_log_error(request, "Failed finalising message digest");
-		return XLAT_ACTION_FAIL;
-	}
-	fr_assert((size_t)digest_len == talloc_array_length(xt->digest_buff));
-
-	/*
-	 *	Then sign the digest
-	 */
-	if (EVP_PKEY_sign(xt->evp_sign_ctx, NULL, &sig_len, xt->digest_buff, (size_t)digest_len) <= 0) {
-		fr_tls_log_error(request, "Failed getting length of digest");
-		return XLAT_ACTION_FAIL;
-	}
-
-	MEM(vb = fr_value_box_alloc_null(ctx));
-	MEM(fr_value_box_mem_alloc(vb, &sig, vb, NULL, sig_len, false) == 0);
-	if (EVP_PKEY_sign(xt->evp_sign_ctx, sig, &sig_len, xt->digest_buff, (size_t)digest_len) <= 0) {
-		fr_tls_log_error(request, "Failed signing message digest");
-		talloc_free(vb);
-		return XLAT_ACTION_FAIL;
-	}
-	MEM(fr_value_box_mem_realloc(vb, NULL, vb, sig_len) == 0);
-	fr_cursor_append(out, vb);
+	job = cipher_job_alloc(ctx, inst, CIPHER_JOB_SIGN, inst->rsa->private_key_file,
+			       (uint8_t const *)msg, msg_len);
 
-	return XLAT_ACTION_DONE;
+	return cipher_job_submit(ctx, out, request, inst, xt, job);
 }
 
 /** Decrypt input data
@@ -613,19 +843,18 @@ static xlat_action_t cipher_rsa_sign_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
  * @ingroup xlat_functions
  */
 static xlat_action_t cipher_rsa_decrypt_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
-					     REQUEST *request, UNUSED void const *xlat_inst, void *xlat_thread_inst,
+					     REQUEST *request, void const *xlat_inst, void *xlat_thread_inst,
 					     fr_value_box_t **in)
 {
+	rlm_cipher_t const		*inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst),
+									    rlm_cipher_t);
 	rlm_cipher_rsa_thread_inst_t	*xt = talloc_get_type_abort(*((void **)xlat_thread_inst),
 								    rlm_cipher_rsa_thread_inst_t);
 
 	uint8_t	const			*ciphertext;
 	size_t				ciphertext_len;
 
-	char				*plaintext;
-	size_t				plaintext_len;
-
-	fr_value_box_t			*vb;
+	cipher_job_t			*job;
 
 	if (!*in) {
 		REDEBUG("decrypt requires one or more arguments (<ciphertext>...)");
@@ -639,28 +868,12 @@ static xlat_action_t cipher_rsa_decrypt_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 	ciphertext = (*in)->vb_octets;
 	ciphertext_len = (*in)->vb_length;
 
-	/*
-	 *	Decrypt the ciphertext
-	 */
 	RHEXDUMP3(ciphertext, ciphertext_len, "Ciphertext (%zu bytes)", ciphertext_len);
-	if (EVP_PKEY_decrypt(xt->evp_decrypt_ctx, NULL, &plaintext_len, ciphertext, ciphertext_len) <= 0) {
-		fr_tls_log_error(request, "Failed getting length of cleartext");
-		return XLAT_ACTION_FAIL;
-	}
 
-	MEM(vb = fr_value_box_alloc_null(ctx));
-	MEM(fr_value_box_bstr_alloc(vb, &plaintext, vb, NULL, plaintext_len, true) == 0);
-	if (EVP_PKEY_decrypt(xt->evp_decrypt_ctx, (unsigned char *)plaintext, &plaintext_len,
-			     ciphertext, ciphertext_len) <= 0) {
-		fr_tls_log_error(request, "Failed decrypting ciphertext");
-		talloc_free(vb);
-		return XLAT_ACTION_FAIL;
-	}
-	RHEXDUMP3((uint8_t const *)plaintext, plaintext_len, "Plaintext (%zu bytes)", plaintext_len);
-	MEM(fr_value_box_bstr_realloc(vb, NULL, vb, plaintext_len) == 0);
-	fr_cursor_append(out, vb);
+	job = cipher_job_alloc(ctx, inst, CIPHER_JOB_DECRYPT, inst->rsa->private_key_file,
+			       ciphertext, ciphertext_len);
 
-	return XLAT_ACTION_DONE;
+	return cipher_job_submit(ctx, out, request, inst, xt, job);
 }
 
 /** Verify input data
@@ -691,9 +904,7 @@ static xlat_action_t cipher_rsa_verify_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 	char const			*msg;
 	size_t				msg_len;
 
-	unsigned int			digest_len = 0;
-
-	fr_value_box_t			*vb;
+	cipher_job_t			*job;
 
 	if (!*in) {
 		REDEBUG("verification requires two or more arguments (<signature>, <message>...)");
@@ -750,47 +961,15 @@ static xlat_action_t cipher_rsa_verify_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 		return XLAT_ACTION_FAIL;
 	}
 
-	/*
-	 *	First produce a digest of the message
-	 */
-	if (unlikely(EVP_DigestInit_ex(xt->evp_md_ctx, inst->rsa->sig_digest, NULL) <= 0)) {
-		fr_tls_log_error(request, "Failed initialising message digest");
-		return XLAT_ACTION_FAIL;
-	}
-
-	if (EVP_DigestUpdate(xt->evp_md_ctx, msg, msg_len) <= 0) {
-		fr_tls_log_error(request, "Failed ingesting message");
-		return XLAT_ACTION_FAIL;
-	}
-
-	if (EVP_DigestFinal_ex(xt->evp_md_ctx, xt->digest_buff, &digest_len) <= 0) {
-		fr_tls_log_error(request, "Failed finalising message digest");
-		return XLAT_ACTION_FAIL;
-	}
-	fr_assert((size_t)digest_len == talloc_array_length(xt->digest_buff));
-
-	/*
-	 *	Now check the signature matches what we expected
-	 */
-	switch (EVP_PKEY_verify(xt->evp_verify_ctx, sig, sig_len, xt->digest_buff, (size_t)digest_len)) {
-	case 1:		/* success (signature valid) */
-		MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_BOOL, NULL, false));
-		vb->vb_bool = true;
-		fr_cursor_append(out, vb);
-		break;
-
-	case 0:		/* failure (signature not valid) */
-		MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_BOOL, NULL, false));
-		vb->vb_bool = false;
-		fr_cursor_append(out, vb);
-		break;
-
-	default:
-		fr_tls_log_error(request, "Failed validating signature");
-		return XLAT_ACTION_FAIL;
+	job = cipher_job_alloc(ctx, inst, CIPHER_JOB_VERIFY, NULL, (uint8_t const *)msg, msg_len);
+	if (inst->offload) {
+		MEM(job->sig = talloc_memdup(job, sig, sig_len));
+	} else {
+		job->sig = sig;
 	}
+	job->sig_len = sig_len;
 
-	return XLAT_ACTION_DONE;
+	return cipher_job_submit(ctx, out, request, inst, xt, job);
 }
 
 /** Talloc destructor for freeing an EVP_PKEY_CTX
@@ -940,7 +1119,7 @@ static int cipher_rsa_thread_instantiate(UNUSED CONF_SECTION const *conf, void *
 		if (unlikely(EVP_PKEY_encrypt_init(ti->evp_encrypt_ctx) <= 0)) {
 			tls_strerror_printf(NULL);
 			PERROR("%s: Failed initialising encrypt EVP_PKEY_CTX", __FUNCTION__);
-			return XLAT_ACTION_FAIL;
+			return -1;
 		}
 		if (unlikely(cipher_rsa_padding_params_set(ti->evp_encrypt_ctx, inst->rsa) < 0)) {
 			ERROR("%s: Failed setting padding for encrypt EVP_PKEY_CTX", __FUNCTION__);
@@ -966,7 +1145,7 @@ static int cipher_rsa_thread_instantiate(UNUSED CONF_SECTION const *conf, void *
 		if (unlikely(EVP_PKEY_verify_init(ti->evp_verify_ctx) <= 0)) {
 			tls_strerror_printf(NULL);
 			PERROR("%s: Failed initialising verify EVP_PKEY_CTX", __FUNCTION__);
-			return XLAT_ACTION_FAIL;
+			return -1;
 		}
 
 		/*
@@ -982,7 +1161,7 @@ static int cipher_rsa_thread_instantiate(UNUSED CONF_SECTION const *conf, void *
 		if (unlikely(EVP_PKEY_CTX_set_signature_md(ti->evp_verify_ctx, inst->rsa->sig_digest)) <= 0) {
 			tls_strerror_printf(NULL);
 			PERROR("%s: Failed setting signature digest type", __FUNCTION__);
-			return XLAT_ACTION_FAIL;
+			return -1;
 		}
 	}
 
@@ -1006,7 +1185,7 @@ static int cipher_rsa_thread_instantiate(UNUSED CONF_SECTION const *conf, void *
 		if (unlikely(EVP_PKEY_decrypt_init(ti->evp_decrypt_ctx) <= 0)) {
 			tls_strerror_printf(NULL);
 			PERROR("%s: Failed initialising decrypt EVP_PKEY_CTX", __FUNCTION__);
-			return XLAT_ACTION_FAIL;
+			return -1;
 		}
 		if (unlikely(cipher_rsa_padding_params_set(ti->evp_decrypt_ctx, inst->rsa) < 0)) {
 			ERROR("%s: Failed setting padding for decrypt EVP_PKEY_CTX", __FUNCTION__);
@@ -1032,7 +1211,7 @@ static int cipher_rsa_thread_instantiate(UNUSED CONF_SECTION const *conf, void *
 		if (unlikely(EVP_PKEY_sign_init(ti->evp_sign_ctx) <= 0)) {
 			tls_strerror_printf(NULL);
 			PERROR("%s: Failed initialising sign EVP_PKEY_CTX", __FUNCTION__);
-			return XLAT_ACTION_FAIL;
+			return -1;
 		}
 
 		/*
@@ -1048,7 +1227,7 @@ static int cipher_rsa_thread_instantiate(UNUSED CONF_SECTION const *conf, void *
 		if (unlikely(EVP_PKEY_CTX_set_signature_md(ti->evp_sign_ctx, inst->rsa->sig_digest)) <= 0) {
 			tls_strerror_printf(NULL);
 			PERROR("%s: Failed setting signature digest type", __FUNCTION__);
-			return XLAT_ACTION_FAIL;
+			return -1;
 		}
 
 		/*
@@ -1072,17 +1251,74 @@ static int cipher_rsa_thread_instantiate(UNUSED CONF_SECTION const *conf, void *
 static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance,
 				  fr_event_list_t *el, void *thread)
 {
-	rlm_cipher_t	*inst = talloc_get_type_abort(instance, rlm_cipher_t);
+	rlm_cipher_t			*inst = talloc_get_type_abort(instance, rlm_cipher_t);
+	rlm_cipher_rsa_thread_inst_t	*t = thread;
 
 	switch (inst->type) {
 	case RLM_CIPHER_TYPE_RSA:
 		talloc_set_type(thread, rlm_cipher_rsa_thread_inst_t);
-		return cipher_rsa_thread_instantiate(conf, instance, el, thread);
+		if (cipher_rsa_thread_instantiate(conf, instance, el, thread) < 0) return -1;
+		break;
 
 	case RLM_CIPHER_TYPE_INVALID:
 		fr_assert(0);
 	}
 
+	if (!inst->offload) return 0;
+
+	t->offload = fr_offload_thread_alloc(t, inst->offload, el);
+	if (!t->offload) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_cipher_rsa_thread_inst_t	*t = talloc_get_type_abort(thread, rlm_cipher_rsa_thread_inst_t);
+
+	TALLOC_FREE(t->offload);
+
+	return 0;
+}
+
+/** Perform a key operation in an offload thread
+ *
+ */
+static void cipher_offload_run(void *job, void *thread_ctx, void *uctx)
+{
+	cipher_job_run(uctx, thread_ctx, job);
+}
+
+/** Give each offload thread its own set of EVP contexts
+ *
+ * These are allocated as they would be for a worker.
+ */
+static void *cipher_offload_thread_ctx_alloc(TALLOC_CTX *ctx, void *uctx)
+{
+	rlm_cipher_rsa_thread_inst_t	*ti;
+
+	MEM(ti = talloc_zero(ctx, rlm_cipher_rsa_thread_inst_t));
+	if (cipher_rsa_thread_instantiate(NULL, uctx, NULL, ti) < 0) {
+		talloc_free(ti);
+		return NULL;
+	}
+
+	return ti;
+}
+
+/** Start the offload threads, if any are configured
+ *
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *cs)
+{
+	rlm_cipher_t		*inst = talloc_get_type_abort(instance, rlm_cipher_t);
+
+	if (!inst->offload_conf.threads) return 0;
+
+	inst->offload = fr_offload_alloc(inst, cs, &inst->offload_conf,
+					 cipher_offload_run, cipher_offload_thread_ctx_alloc, inst);
+	if (!inst->offload) return -1;
+
 	return 0;
 }
 
@@ -1217,5 +1453,7 @@ module_t rlm_cipher = {
 	.thread_inst_size	= sizeof(rlm_cipher_rsa_thread_inst_t),
 	.config			= module_config,
 	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
 	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 };
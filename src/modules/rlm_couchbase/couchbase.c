@@ -179,22 +179,20 @@ void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance, co
 	(void)request;
 }
 
-/** Initialize a Couchbase connection instance
+/** Create a Couchbase instance and apply the module's settings
  *
- * Initialize all information relating to a Couchbase instance and configure available method callbacks.
- * This function forces synchronous operation and will wait for a connection or timeout.
- *
- * @param instance Empty (un-allocated) Couchbase instance object.
+ * @param instance   Empty (un-allocated) Couchbase instance object.
  * @param host       The Couchbase server or list of servers.
  * @param bucket     The Couchbase bucket to associate with the instance.
  * @param user       The Couchbase bucket user (NULL if none).
  * @param pass       The Couchbase bucket password (NULL if none).
  * @param timeout    Maximum time to wait for obtaining the initial configuration.
  * @param opts       Extra options to configure the libcouchbase.
+ * @param io         IO plugin to use (NULL for the libcouchbase default).
  * @return           Couchbase error object.
  */
-lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *user, const char *pass,
-				      lcb_uint32_t timeout, const couchbase_opts_t *opts)
+static lcb_error_t couchbase_create(lcb_t *instance, const char *host, const char *bucket, const char *user,
+				    const char *pass, lcb_uint32_t timeout, const couchbase_opts_t *opts, lcb_io_opt_t io)
 {
 	lcb_error_t error;                      /* couchbase command return */
 	struct lcb_create_st options;           /* init create struct */
@@ -207,6 +205,7 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 	options.v.v0.bucket = bucket;
 	options.v.v0.user = user;
 	options.v.v0.passwd = pass;
+	options.v.v0.io = io;
 
 	/* create couchbase connection instance */
 	error = lcb_create(instance, &options);
@@ -228,6 +227,31 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 		}
 	}
 
+	return LCB_SUCCESS;
+}
+
+/** Initialize a Couchbase connection instance
+ *
+ * Initialize all information relating to a Couchbase instance and configure available method callbacks.
+ * This function forces synchronous operation and will wait for a connection or timeout.
+ *
+ * @param instance Empty (un-allocated) Couchbase instance object.
+ * @param host       The Couchbase server or list of servers.
+ * @param bucket     The Couchbase bucket to associate with the instance.
+ * @param user       The Couchbase bucket user (NULL if none).
+ * @param pass       The Couchbase bucket password (NULL if none).
+ * @param timeout    Maximum time to wait for obtaining the initial configuration.
+ * @param opts       Extra options to configure the libcouchbase.
+ * @return           Couchbase error object.
+ */
+lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *user, const char *pass,
+				      lcb_uint32_t timeout, const couchbase_opts_t *opts)
+{
+	lcb_error_t error;                      /* couchbase command return */
+
+	error = couchbase_create(instance, host, bucket, user, pass, timeout, opts, NULL);
+	if (error != LCB_SUCCESS) return error;
+
 	/* initiate connection */
 	error = lcb_connect(*instance);
 	if (error != LCB_SUCCESS) return error;
@@ -243,6 +267,36 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 	return LCB_SUCCESS;
 }
 
+/** Initialize a Couchbase connection instance driven by an event list
+ *
+ * Unlike couchbase_init_connection() this does not wait for the cluster
+ * configuration.  The bootstrap completes as the event list is serviced,
+ * and commands scheduled before then are queued by libcouchbase.
+ *
+ * The caller must install its own callbacks.
+ *
+ * @param instance   Empty (un-allocated) Couchbase instance object.
+ * @param host       The Couchbase server or list of servers.
+ * @param bucket     The Couchbase bucket to associate with the instance.
+ * @param user       The Couchbase bucket user (NULL if none).
+ * @param pass       The Couchbase bucket password (NULL if none).
+ * @param timeout    Maximum time to wait for obtaining the initial configuration.
+ * @param opts       Extra options to configure the libcouchbase.
+ * @param io         Created by couchbase_io_alloc().
+ * @return           Couchbase error object.
+ */
+lcb_error_t couchbase_init_async(lcb_t *instance, const char *host, const char *bucket, const char *user,
+				 const char *pass, lcb_uint32_t timeout, const couchbase_opts_t *opts, lcb_io_opt_t io)
+{
+	lcb_error_t error;                      /* couchbase command return */
+
+	error = couchbase_create(instance, host, bucket, user, pass, timeout, opts, io);
+	if (error != LCB_SUCCESS) return error;
+
+	/* initiate connection, completes in the event loop */
+	return lcb_connect(*instance);
+}
+
 /** Request Couchbase server statistics
  *
  * Setup and execute a request for cluster statistics and wait for the result.
@@ -419,3 +473,227 @@ lcb_error_t couchbase_query_view(lcb_t instance, const void *cookie, const char
 	/* return error */
 	return error;
 }
+
+/** libcouchbase IO plugin which uses a FreeRADIUS event list
+ *
+ * libcouchbase is told to use the "event" IO model, where it asks to be
+ * notified of socket readiness and does the reads and writes itself.
+ * Sockets and timers are inserted into the event list of the thread
+ * which owns the instance, so the instance is serviced by that thread's
+ * event loop and lcb_wait() is never called.
+ */
+typedef struct {
+	struct lcb_io_opt_st	io;		//!< Passed to libcouchbase.  Must be first.
+	fr_event_list_t		*el;		//!< Event list sockets and timers are inserted into.
+} couchbase_io_t;
+
+/** A socket libcouchbase wants to be notified about
+ *
+ */
+typedef struct {
+	couchbase_io_t		*cio;		//!< IO plugin this event belongs to.
+	lcb_socket_t		sock;		//!< Socket being watched.
+	short			flags;		//!< LCB_READ_EVENT and/or LCB_WRITE_EVENT.  0 if not watching.
+	void			*uarg;		//!< Passed to the callback.
+	lcb_ioE_callback	callback;	//!< libcouchbase's handler.
+} couchbase_io_event_t;
+
+/** A timer libcouchbase wants to be notified about
+ *
+ */
+typedef struct {
+	couchbase_io_t		*cio;		//!< IO plugin this timer belongs to.
+	fr_event_timer_t const	*ev;		//!< Timer event.  NULL if not scheduled.
+	void			*uarg;		//!< Passed to the callback.
+	lcb_ioE_callback	callback;	//!< libcouchbase's handler.
+} couchbase_io_timer_t;
+
+static void _io_event_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	couchbase_io_event_t	*ev = talloc_get_type_abort(uctx, couchbase_io_event_t);
+
+	ev->callback(fd, LCB_READ_EVENT, ev->uarg);
+}
+
+static void _io_event_write(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	couchbase_io_event_t	*ev = talloc_get_type_abort(uctx, couchbase_io_event_t);
+
+	ev->callback(fd, LCB_WRITE_EVENT, ev->uarg);
+}
+
+/** Tell libcouchbase the socket is ready for whatever it was waiting on
+ *
+ * The read or write it then attempts fails with the socket's error,
+ * which libcouchbase handles as it would for any other IO plugin.
+ */
+static void _io_event_error(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, UNUSED int fd_errno, void *uctx)
+{
+	couchbase_io_event_t	*ev = talloc_get_type_abort(uctx, couchbase_io_event_t);
+
+	ev->callback(fd, ev->flags, ev->uarg);
+}
+
+static void *_io_event_create(lcb_io_opt_t iops)
+{
+	couchbase_io_t		*cio = iops->v.v2.cookie;
+	couchbase_io_event_t	*ev;
+
+	ev = talloc_zero(cio, couchbase_io_event_t);
+	if (!ev) return NULL;
+
+	ev->cio = cio;
+	ev->sock = -1;
+
+	return ev;
+}
+
+static void _io_event_cancel(UNUSED lcb_io_opt_t iops, UNUSED lcb_socket_t sock, void *event)
+{
+	couchbase_io_event_t	*ev = talloc_get_type_abort(event, couchbase_io_event_t);
+
+	if (!ev->flags) return;
+
+	(void) fr_event_fd_delete(ev->cio->el, ev->sock, FR_EVENT_FILTER_IO);
+	ev->flags = 0;
+}
+
+static void _io_event_destroy(lcb_io_opt_t iops, void *event)
+{
+	_io_event_cancel(iops, -1, event);
+	talloc_free(event);
+}
+
+static int _io_event_watch(lcb_io_opt_t iops, lcb_socket_t sock, void *event, short flags,
+			   void *uarg, lcb_ioE_callback callback)
+{
+	couchbase_io_event_t	*ev = talloc_get_type_abort(event, couchbase_io_event_t);
+
+	flags &= (LCB_READ_EVENT | LCB_WRITE_EVENT);
+
+	/*
+	 *	Re-inserting the same fd updates the filters,
+	 *	so the old registration only needs removing
+	 *	if the socket changed or nothing is wanted.
+	 */
+	if (ev->flags && (!flags || (ev->sock != sock))) _io_event_cancel(iops, ev->sock, ev);
+
+	ev->uarg = uarg;
+	ev->callback = callback;
+	if (!flags) return 0;
+
+	if (fr_event_fd_insert(ev, ev->cio->el, sock,
+			       (flags & LCB_READ_EVENT) ? _io_event_read : NULL,
+			       (flags & LCB_WRITE_EVENT) ? _io_event_write : NULL,
+			       _io_event_error, ev) < 0) {
+		PERROR("Failed watching couchbase socket %i", sock);
+		ev->flags = 0;
+		return -1;
+	}
+	ev->sock = sock;
+	ev->flags = flags;
+
+	return 0;
+}
+
+static void _io_timer_fire(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	couchbase_io_timer_t	*timer = talloc_get_type_abort(uctx, couchbase_io_timer_t);
+
+	timer->callback(-1, 0, timer->uarg);
+}
+
+static void *_io_timer_create(lcb_io_opt_t iops)
+{
+	couchbase_io_t		*cio = iops->v.v2.cookie;
+	couchbase_io_timer_t	*timer;
+
+	timer = talloc_zero(cio, couchbase_io_timer_t);
+	if (!timer) return NULL;
+
+	timer->cio = cio;
+
+	return timer;
+}
+
+static void _io_timer_cancel(UNUSED lcb_io_opt_t iops, void *uctx)
+{
+	couchbase_io_timer_t	*timer = talloc_get_type_abort(uctx, couchbase_io_timer_t);
+
+	if (timer->ev) fr_event_timer_delete(&timer->ev);
+}
+
+static void _io_timer_destroy(lcb_io_opt_t iops, void *uctx)
+{
+	_io_timer_cancel(iops, uctx);
+	talloc_free(uctx);
+}
+
+static int _io_timer_schedule(UNUSED lcb_io_opt_t iops, void *uctx, lcb_U32 usec,
+			      void *uarg, lcb_ioE_callback callback)
+{
+	couchbase_io_timer_t	*timer = talloc_get_type_abort(uctx, couchbase_io_timer_t);
+
+	timer->uarg = uarg;
+	timer->callback = callback;
+
+	if (fr_event_timer_in(timer, timer->cio->el, &timer->ev, fr_time_delta_from_usec(usec),
+			      _io_timer_fire, timer) < 0) {
+		PERROR("Failed scheduling couchbase timer");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** The event loop is run by the worker, never by libcouchbase
+ *
+ */
+static void _io_loop_noop(UNUSED lcb_io_opt_t iops)
+{
+}
+
+static void _io_get_procs(int version, lcb_loopprocs *loop_procs, lcb_timerprocs *timer_procs,
+			  lcb_bsdprocs *bsd_procs, lcb_evprocs *ev_procs,
+			  UNUSED lcb_completion_procs *completion_procs, lcb_iomodel_t *iomodel)
+{
+	*iomodel = LCB_IOMODEL_EVENT;
+
+	loop_procs->start = _io_loop_noop;
+	loop_procs->stop = _io_loop_noop;
+
+	timer_procs->create = _io_timer_create;
+	timer_procs->destroy = _io_timer_destroy;
+	timer_procs->cancel = _io_timer_cancel;
+	timer_procs->schedule = _io_timer_schedule;
+
+	ev_procs->create = _io_event_create;
+	ev_procs->destroy = _io_event_destroy;
+	ev_procs->cancel = _io_event_cancel;
+	ev_procs->watch = _io_event_watch;
+
+	lcb_iops_wire_bsd_impl2(bsd_procs, version);
+}
+
+/** Allocate an IO plugin which inserts libcouchbase's sockets and timers into an event list
+ *
+ * The plugin must outlive any instance created with it.  Freeing it
+ * frees any remaining events.
+ *
+ * @param ctx	to allocate the plugin in.
+ * @param el	to insert sockets and timers into.
+ * @return	IO plugin to pass to couchbase_init_async().
+ */
+lcb_io_opt_t couchbase_io_alloc(TALLOC_CTX *ctx, fr_event_list_t *el)
+{
+	couchbase_io_t		*cio;
+
+	MEM(cio = talloc_zero(ctx, couchbase_io_t));
+	cio->el = el;
+
+	cio->io.version = 2;
+	cio->io.v.v2.cookie = cio;
+	cio->io.v.v2.get_procs = _io_get_procs;
+
+	return &cio->io;
+}
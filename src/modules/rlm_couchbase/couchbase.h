@@ -35,6 +35,7 @@ DIAG_ON(documentation)
 #endif
 
 #include <freeradius-devel/json/base.h>
+#include <freeradius-devel/util/event.h>
 
 /** Information relating to the parsing of Couchbase document payloads
  *
@@ -94,6 +95,13 @@ void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance,
 lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *user,
 					const char *pass, lcb_uint32_t timeout, const couchbase_opts_t *opts);
 
+/* create a couchbase instance serviced by an event list */
+lcb_error_t couchbase_init_async(lcb_t *instance, const char *host, const char *bucket, const char *user,
+				 const char *pass, lcb_uint32_t timeout, const couchbase_opts_t *opts, lcb_io_opt_t io);
+
+/* allocate an io plugin which inserts libcouchbase sockets and timers into an event list */
+lcb_io_opt_t couchbase_io_alloc(TALLOC_CTX *ctx, fr_event_list_t *el);
+
 /* get server statistics */
 lcb_error_t couchbase_server_stats(lcb_t instance, const void *cookie);
 
@@ -45,6 +45,10 @@ typedef struct {
 	vp_tmpl_t		*acct_key;		//!< Accounting document key.
 	char const		*doctype;		//!< Value of accounting 'docType' element name.
 	uint32_t		expire;			//!< Accounting document expire time in seconds.
+	uint32_t		persist_to;		//!< Nodes accounting documents must be persisted to
+							//!< before the async store completes.
+	uint32_t		replicate_to;		//!< Replicas accounting documents must reach
+							//!< before the async store completes.
 
 	char const		*server_raw;     	//!< Raw server string before parsing.
 	char const		*server;         	//!< Couchbase server list.
@@ -59,6 +63,8 @@ typedef struct {
 
 	json_object		*map;           	//!< Json object to hold user defined attribute map.
 	fr_pool_t		*pool;			//!< Connection pool.
+	bool			async;			//!< Issue operations from yielding requests, using
+							//!< a Couchbase instance per thread.
 	char const		*name;			//!< Module instance name.
 	void			*api_opts;		//!< Couchbase API internal options.
 } rlm_couchbase_t;
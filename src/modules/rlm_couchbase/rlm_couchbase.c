@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/map.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/base.h>
 
@@ -59,7 +60,10 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("acct_key", FR_TYPE_TMPL, rlm_couchbase_t, acct_key), .dflt = "radacct_%{%{Acct-Unique-Session-Id}:-%{Acct-Session-Id}}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("doctype", FR_TYPE_STRING, rlm_couchbase_t, doctype), .dflt = "radacct" },
 	{ FR_CONF_OFFSET("expire", FR_TYPE_UINT32, rlm_couchbase_t, expire), .dflt = 0 },
+	{ FR_CONF_OFFSET("persist_to", FR_TYPE_UINT32, rlm_couchbase_t, persist_to), .dflt = "0" },
+	{ FR_CONF_OFFSET("replicate_to", FR_TYPE_UINT32, rlm_couchbase_t, replicate_to), .dflt = "0" },
 #endif
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, rlm_couchbase_t, async), .dflt = "no" },
 	{ FR_CONF_OFFSET("user_key", FR_TYPE_TMPL, rlm_couchbase_t, user_key), .dflt = "raduser_%{md5:%{tolower:%{%{Stripped-User-Name}:-%{User-Name}}}}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("read_clients", FR_TYPE_BOOL, rlm_couchbase_t, read_clients) }, /* NULL defaults to "no" */
 	{ FR_CONF_POINTER("client", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) client_config },
@@ -86,6 +90,344 @@ fr_dict_attr_autoload_t rlm_couchbase_dict_attr[] = {
 	{ NULL }
 };
 
+/** Thread specific data
+ *
+ * When async, each thread has its own Couchbase instance, serviced by the
+ * thread's event list.  Commands from every request the thread is running
+ * are batched, and flushed to the nodes together.
+ */
+typedef struct {
+	fr_event_list_t		*el;		//!< Event list the instance's sockets are inserted into.
+	lcb_io_opt_t		io;		//!< IO plugin bridging libcouchbase to the event list.
+	lcb_t			cb;		//!< Couchbase instance.  NULL unless async.
+	fr_event_timer_t const	*ev_flush;	//!< Flushes the commands scheduled this pass of the event loop.
+	bool			scheduling;	//!< Between lcb_sched_enter() and lcb_sched_leave().
+} rlm_couchbase_thread_t;
+
+/** The state of an async get or store
+ *
+ * libcouchbase can't cancel individual commands.  If the request is cancelled
+ * this is reparented to the thread, and the callback frees it.
+ */
+typedef struct {
+	REQUEST			*request;	//!< The request.  NULL if it was cancelled.
+	char const		*dockey;	//!< The document key.
+	int			status;		//!< Acct-Status-Type of accounting requests.
+	lcb_error_t		error;		//!< Result of the command.
+	bool			store_ok;	//!< Store succeeded, even if durability requirements weren't met.
+	json_object		*jobj;		//!< Parsed document.
+} rlm_couchbase_rctx_t;
+
+/** Apply the contents of a user document to the request
+ *
+ * @param request	The authorization request.
+ * @param jobj		The parsed user document.
+ * @return Operation status (#rlm_rcode_t).
+ */
+static rlm_rcode_t couchbase_user_document_apply(REQUEST *request, json_object *jobj)
+{
+	TALLOC_CTX	*pool = talloc_pool(request, 1024);	/* We need to do lots of allocs */
+	fr_cursor_t	maps, vlms;
+	vp_map_t	*map_head = NULL, *map;
+	vp_list_mod_t	*vlm_head = NULL, *vlm;
+	rlm_rcode_t	rcode = RLM_MODULE_OK;
+
+	/* debugging */
+	RDEBUG3("parsed user document == %s", json_object_to_json_string(jobj));
+
+	fr_cursor_init(&maps, &map_head);
+
+	/*
+	 *	Convert JSON data into maps
+	 */
+	if ((mod_json_object_to_map(pool, &maps, request, jobj, PAIR_LIST_CONTROL) < 0) ||
+	    (mod_json_object_to_map(pool, &maps, request, jobj, PAIR_LIST_REPLY) < 0) ||
+	    (mod_json_object_to_map(pool, &maps, request, jobj, PAIR_LIST_REQUEST) < 0) ||
+	    (mod_json_object_to_map(pool, &maps, request, jobj, PAIR_LIST_STATE) < 0)) {
+	invalid:
+		rcode = RLM_MODULE_INVALID;
+		goto finish;
+	}
+
+	fr_cursor_init(&vlms, &vlm_head);
+
+	/*
+	 *	Convert all the maps into list modifications,
+	 *	which are guaranteed to succeed.
+	 */
+	for (map = fr_cursor_head(&maps);
+	     map;
+	     map = fr_cursor_next(&maps)) {
+		if (map_to_list_mod(pool, &vlm, request, map, NULL, NULL) < 0) goto invalid;
+		fr_cursor_insert(&vlms, vlm);
+	}
+
+	if (!vlm_head) {
+		RDEBUG2("Nothing to update");
+		rcode = RLM_MODULE_NOOP;
+		goto finish;
+	}
+
+	/*
+	 *	Apply the list of modifications
+	 */
+	for (vlm = fr_cursor_head(&vlms);
+	     vlm;
+	     vlm = fr_cursor_next(&vlms)) {
+		int ret;
+
+		ret = map_list_mod_apply(request, vlm);	/* SHOULD NOT FAIL */
+		if (!fr_cond_assert(ret == 0)) {
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+	}
+
+finish:
+	talloc_free(pool);
+
+	return rcode;
+}
+
+static int _rctx_free(rlm_couchbase_rctx_t *rctx)
+{
+	if (rctx->jobj) json_object_put(rctx->jobj);
+
+	return 0;
+}
+
+/** Allocate the state for an async get or store
+ *
+ */
+static rlm_couchbase_rctx_t *couchbase_rctx_alloc(REQUEST *request, char const *dockey)
+{
+	rlm_couchbase_rctx_t	*rctx;
+
+	MEM(rctx = talloc_zero(request, rlm_couchbase_rctx_t));
+	talloc_set_destructor(rctx, _rctx_free);
+	rctx->request = request;
+	MEM(rctx->dockey = talloc_typed_strdup(rctx, dockey));
+
+	return rctx;
+}
+
+/** Flush all the commands scheduled during the last pass of the event loop
+ *
+ * libcouchbase groups the commands by the node owning each key, so commands
+ * from concurrent requests go out as one write per node.
+ */
+static void _couchbase_flush(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_couchbase_thread_t	*t = talloc_get_type_abort(uctx, rlm_couchbase_thread_t);
+
+	t->scheduling = false;
+	lcb_sched_leave(t->cb);
+}
+
+/** Start a batch of commands, if one isn't already open
+ *
+ */
+static int couchbase_sched_enter(rlm_couchbase_thread_t *t, REQUEST *request)
+{
+	if (t->scheduling) return 0;
+
+	if (fr_event_timer_in(t, t->el, &t->ev_flush, 0, _couchbase_flush, t) < 0) {
+		RPERROR("Failed scheduling couchbase flush");
+		return -1;
+	}
+
+	lcb_sched_enter(t->cb);
+	t->scheduling = true;
+
+	return 0;
+}
+
+/** Schedule a get for the rctx's document
+ *
+ */
+static int couchbase_async_get(rlm_couchbase_thread_t *t, REQUEST *request, rlm_couchbase_rctx_t *rctx)
+{
+	lcb_CMDGET	cmd;
+	lcb_error_t	error;
+
+	if (couchbase_sched_enter(t, request) < 0) return -1;
+
+	memset(&cmd, 0, sizeof(cmd));
+	LCB_CMD_SET_KEY(&cmd, rctx->dockey, talloc_array_length(rctx->dockey) - 1);
+
+	RDEBUG3("fetching document %s", rctx->dockey);
+
+	error = lcb_get3(t->cb, rctx, &cmd);
+	if (error != LCB_SUCCESS) {
+		RERROR("Failed scheduling get of document (%s): %s (0x%x)",
+		       rctx->dockey, lcb_strerror(t->cb, error), error);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Schedule an upsert of the rctx's document
+ *
+ * If persist_to or replicate_to are set, the callback for the command only
+ * runs once the document has been persisted or replicated to that many nodes.
+ */
+static int couchbase_async_store(rlm_couchbase_t const *inst, rlm_couchbase_thread_t *t, REQUEST *request,
+				 rlm_couchbase_rctx_t *rctx, char const *document)
+{
+	lcb_error_t	error;
+
+	if (couchbase_sched_enter(t, request) < 0) return -1;
+
+	if (inst->persist_to || inst->replicate_to) {
+		lcb_CMDSTOREDUR	cmd;
+
+		memset(&cmd, 0, sizeof(cmd));
+		LCB_CMD_SET_KEY(&cmd, rctx->dockey, talloc_array_length(rctx->dockey) - 1);
+		LCB_CMD_SET_VALUE(&cmd, document, strlen(document));
+		cmd.exptime = inst->expire;
+		cmd.operation = LCB_SET;
+		cmd.persist_to = inst->persist_to;
+		cmd.replicate_to = inst->replicate_to;
+
+		error = lcb_storedur3(t->cb, rctx, &cmd);
+	} else {
+		lcb_CMDSTORE	cmd;
+
+		memset(&cmd, 0, sizeof(cmd));
+		LCB_CMD_SET_KEY(&cmd, rctx->dockey, talloc_array_length(rctx->dockey) - 1);
+		LCB_CMD_SET_VALUE(&cmd, document, strlen(document));
+		cmd.exptime = inst->expire;
+		cmd.operation = LCB_SET;
+
+		error = lcb_store3(t->cb, rctx, &cmd);
+	}
+	if (error != LCB_SUCCESS) {
+		RERROR("Failed scheduling store of document (%s): %s (0x%x)",
+		       rctx->dockey, lcb_strerror(t->cb, error), error);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Couchbase callback for async get operations
+ *
+ * Parses the document and marks the request as runnable.
+ */
+static void _couchbase_get_callback(lcb_t instance, UNUSED int cbtype, lcb_RESPBASE const *rb)
+{
+	lcb_RESPGET const	*resp = (lcb_RESPGET const *)rb;
+	rlm_couchbase_rctx_t	*rctx = talloc_get_type_abort(rb->cookie, rlm_couchbase_rctx_t);
+	REQUEST			*request = rctx->request;
+
+	if (!request) {
+		talloc_free(rctx);
+		return;
+	}
+
+	rctx->error = rb->rc;
+	switch (rb->rc) {
+	case LCB_SUCCESS:
+	{
+		json_tokener		*jtok;
+		enum json_tokener_error	jerr;
+
+		if (!resp->value || (resp->nvalue <= 1)) break;
+
+		RDEBUG3("got %zu bytes", (size_t)resp->nvalue);
+
+		jtok = json_tokener_new();
+		rctx->jobj = json_tokener_parse_ex(jtok, resp->value, resp->nvalue);
+		jerr = json_tokener_get_error(jtok);
+		json_tokener_free(jtok);
+
+		if (jerr != json_tokener_success) {
+			RERROR("json parsing error for document (%s): %s", rctx->dockey, json_tokener_error_desc(jerr));
+			if (rctx->jobj) {
+				json_object_put(rctx->jobj);
+				rctx->jobj = NULL;
+			}
+		}
+	}
+		break;
+
+	case LCB_KEY_ENOENT:
+		RDEBUG2("document (%s) does not exist", rctx->dockey);
+		break;
+
+	default:
+		RERROR("failed to fetch document (%s): %s (0x%x)", rctx->dockey, lcb_strerror(instance, rb->rc), rb->rc);
+		break;
+	}
+
+	unlang_interpret_resumable(request);
+}
+
+/** Couchbase callback for async store operations, with or without durability requirements
+ *
+ */
+static void _couchbase_store_callback(UNUSED lcb_t instance, int cbtype, lcb_RESPBASE const *rb)
+{
+	rlm_couchbase_rctx_t	*rctx = talloc_get_type_abort(rb->cookie, rlm_couchbase_rctx_t);
+
+	if (!rctx->request) {
+		talloc_free(rctx);
+		return;
+	}
+
+	rctx->error = rb->rc;
+	if (cbtype == LCB_CALLBACK_STOREDUR) {
+		rctx->store_ok = ((lcb_RESPSTOREDUR const *)rb)->store_ok;
+	} else {
+		rctx->store_ok = (rb->rc == LCB_SUCCESS);
+	}
+
+	unlang_interpret_resumable(rctx->request);
+}
+
+static void _couchbase_bootstrap_callback(lcb_t instance, lcb_error_t error)
+{
+	if (error != LCB_SUCCESS) {
+		ERROR("failed to bootstrap couchbase instance: %s (0x%x)", lcb_strerror(instance, error), error);
+		return;
+	}
+
+	DEBUG2("couchbase instance bootstrapped");
+}
+
+/** Stop the request waiting on the command
+ *
+ * The command will still complete, so the rctx is kept until the callback runs.
+ */
+static void mod_async_signal(module_ctx_t const *mctx, UNUSED REQUEST *request, void *uctx, fr_state_signal_t action)
+{
+	rlm_couchbase_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_couchbase_thread_t);
+	rlm_couchbase_rctx_t	*rctx = talloc_get_type_abort(uctx, rlm_couchbase_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	rctx->request = NULL;
+	talloc_steal(t, rctx);
+}
+
+static rlm_rcode_t mod_authorize_resume(UNUSED module_ctx_t const *mctx, REQUEST *request, void *uctx)
+{
+	rlm_couchbase_rctx_t	*rctx = talloc_get_type_abort(uctx, rlm_couchbase_rctx_t);
+	rlm_rcode_t		rcode;
+
+	if ((rctx->error != LCB_SUCCESS) || !rctx->jobj) {
+		RERROR("failed to fetch document or parse return");
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	rcode = couchbase_user_document_apply(request, rctx->jobj);
+	talloc_free(rctx);
+
+	return rcode;
+}
+
 /** Handle authorization requests using Couchbase document data
  *
  * Attempt to fetch the document assocaited with the requested user by
@@ -100,6 +442,7 @@ fr_dict_attr_autoload_t rlm_couchbase_dict_attr[] = {
 static rlm_rcode_t mod_authorize(module_ctx_t const *mctx, REQUEST *request)
 {
 	rlm_couchbase_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_couchbase_t);		/* our module instance */
+	rlm_couchbase_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_couchbase_thread_t);
 	rlm_couchbase_handle_t	*handle = NULL;			/* connection pool handle */
 	char			buffer[MAX_KEY_SIZE];
 	char const		*dockey;			/* our document key */
@@ -118,6 +461,19 @@ static rlm_rcode_t mod_authorize(module_ctx_t const *mctx, REQUEST *request)
 		return RLM_MODULE_FAIL;
 	}
 
+	/* fetch the document asynchronously */
+	if (t->cb) {
+		rlm_couchbase_rctx_t *rctx;
+
+		rctx = couchbase_rctx_alloc(request, dockey);
+		if (couchbase_async_get(t, request, rctx) < 0) {
+			talloc_free(rctx);
+			return RLM_MODULE_FAIL;
+		}
+
+		return unlang_module_yield(request, mod_authorize_resume, mod_async_signal, rctx);
+	}
+
 	/* get handle */
 	handle = fr_pool_connection_get(inst->pool, request);
 
@@ -143,68 +499,7 @@ static rlm_rcode_t mod_authorize(module_ctx_t const *mctx, REQUEST *request)
 		goto finish;
 	}
 
-	/* debugging */
-	RDEBUG3("parsed user document == %s", json_object_to_json_string(cookie->jobj));
-
-	{
-		TALLOC_CTX	*pool = talloc_pool(request, 1024);	/* We need to do lots of allocs */
-		fr_cursor_t	maps, vlms;
-		vp_map_t	*map_head = NULL, *map;
-		vp_list_mod_t	*vlm_head = NULL, *vlm;
-
-		fr_cursor_init(&maps, &map_head);
-
-		/*
-		 *	Convert JSON data into maps
-		 */
-		if ((mod_json_object_to_map(pool, &maps, request, cookie->jobj, PAIR_LIST_CONTROL) < 0) ||
-		    (mod_json_object_to_map(pool, &maps, request, cookie->jobj, PAIR_LIST_REPLY) < 0) ||
-		    (mod_json_object_to_map(pool, &maps, request, cookie->jobj, PAIR_LIST_REQUEST) < 0) ||
-		    (mod_json_object_to_map(pool, &maps, request, cookie->jobj, PAIR_LIST_STATE) < 0)) {
-		invalid:
-			talloc_free(pool);
-			rcode = RLM_MODULE_INVALID;
-			goto finish;
-		}
-
-		fr_cursor_init(&vlms, &vlm_head);
-
-		/*
-		 *	Convert all the maps into list modifications,
-		 *	which are guaranteed to succeed.
-		 */
-		for (map = fr_cursor_head(&maps);
-		     map;
-		     map = fr_cursor_next(&maps)) {
-			if (map_to_list_mod(pool, &vlm, request, map, NULL, NULL) < 0) goto invalid;
-			fr_cursor_insert(&vlms, vlm);
-		}
-
-		if (!vlm_head) {
-			RDEBUG2("Nothing to update");
-			talloc_free(pool);
-			rcode = RLM_MODULE_NOOP;
-			goto finish;
-		}
-
-		/*
-		 *	Apply the list of modifications
-		 */
-		for (vlm = fr_cursor_head(&vlms);
-		     vlm;
-		     vlm = fr_cursor_next(&vlms)) {
-			int ret;
-
-			ret = map_list_mod_apply(request, vlm);	/* SHOULD NOT FAIL */
-			if (!fr_cond_assert(ret == 0)) {
-				talloc_free(pool);
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-		}
-
-		talloc_free(pool);
-	}
+	rcode = couchbase_user_document_apply(request, cookie->jobj);
 
 finish:
 	/* free json object */
@@ -221,6 +516,143 @@ finish:
 }
 
 #ifdef WITH_ACCOUNTING
+/** Merge the accounting request into the session's document
+ *
+ * @param inst		This instance of rlm_couchbase.
+ * @param request	The accounting request.
+ * @param status	Acct-Status-Type of the request.
+ * @param jobj		The existing document, or NULL to create a new one.
+ * @param document	Where to write the merged document.
+ * @param doclen	Length of the document buffer.
+ * @return
+ *	- RLM_MODULE_OK if the document should be stored.
+ *	- RLM_MODULE_NOOP if the status type isn't recorded.
+ *	- RLM_MODULE_FAIL if the document is too large.
+ */
+static rlm_rcode_t couchbase_acct_document_merge(rlm_couchbase_t const *inst, REQUEST *request, int status,
+						 json_object **jobj, char *document, size_t doclen)
+{
+	VALUE_PAIR	*vp;			/* radius value pair linked list */
+	char		element[MAX_KEY_SIZE];	/* mapped radius attribute to element name */
+
+	/* start json document if needed */
+	if (!*jobj) {
+		/* debugging */
+		RDEBUG2("no existing document found - creating new json document");
+		/* create new json object */
+		*jobj = json_object_new_object();
+		/* set 'docType' element for new document */
+		json_object_object_add(*jobj, "docType", json_object_new_string(inst->doctype));
+		/* default startTimestamp and stopTimestamp to null values */
+		json_object_object_add(*jobj, "startTimestamp", NULL);
+		json_object_object_add(*jobj, "stopTimestamp", NULL);
+	}
+
+	/* status specific replacements for start/stop time */
+	switch (status) {
+	case FR_STATUS_START:
+		/* add start time */
+		if ((vp = fr_pair_find_by_da(request->packet->vps, attr_acct_status_type, TAG_ANY)) != NULL) {
+			/* add to json object */
+			json_object_object_add(*jobj, "startTimestamp",
+					       mod_value_pair_to_json_object(request, vp));
+		}
+		break;
+
+	case FR_STATUS_STOP:
+		/* add stop time */
+		if ((vp = fr_pair_find_by_da(request->packet->vps, attr_event_timestamp, TAG_ANY)) != NULL) {
+			/* add to json object */
+			json_object_object_add(*jobj, "stopTimestamp",
+					       mod_value_pair_to_json_object(request, vp));
+		}
+		/* check start timestamp and adjust if needed */
+		mod_ensure_start_timestamp(*jobj, request->packet->vps);
+		break;
+
+	case FR_STATUS_ALIVE:
+		/* check start timestamp and adjust if needed */
+		mod_ensure_start_timestamp(*jobj, request->packet->vps);
+		break;
+
+	default:
+		/* don't doing anything */
+		return RLM_MODULE_NOOP;
+	}
+
+	/* loop through pairs and add to json document */
+	for (vp = request->packet->vps; vp; vp = vp->next) {
+		/* map attribute to element */
+		if (mod_attribute_to_element(vp->da->name, inst->map, &element) == 0) {
+			/* debug */
+			RDEBUG3("mapped attribute %s => %s", vp->da->name, element);
+			/* add to json object with mapped name */
+			json_object_object_add(*jobj, element, mod_value_pair_to_json_object(request, vp));
+		}
+	}
+
+	/* copy json string to document and check size */
+	if (strlcpy(document, json_object_to_json_string(*jobj), doclen) >= doclen) {
+		/* this isn't good */
+		RERROR("could not write json document - insufficient buffer space");
+		/* return */
+		return RLM_MODULE_FAIL;
+	}
+
+	return RLM_MODULE_OK;
+}
+
+static rlm_rcode_t mod_accounting_store_resume(UNUSED module_ctx_t const *mctx, REQUEST *request, void *uctx)
+{
+	rlm_couchbase_rctx_t	*rctx = talloc_get_type_abort(uctx, rlm_couchbase_rctx_t);
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	if (!rctx->store_ok) {
+		RERROR("failed to store document (%s): %s (0x%x)",
+		       rctx->dockey, lcb_strerror(NULL, rctx->error), rctx->error);
+		rcode = RLM_MODULE_FAIL;
+	} else if (rctx->error != LCB_SUCCESS) {
+		RERROR("document (%s) stored, but durability requirements not met: %s (0x%x)",
+		       rctx->dockey, lcb_strerror(NULL, rctx->error), rctx->error);
+		rcode = RLM_MODULE_FAIL;
+	}
+	talloc_free(rctx);
+
+	return rcode;
+}
+
+static rlm_rcode_t mod_accounting_get_resume(module_ctx_t const *mctx, REQUEST *request, void *uctx)
+{
+	rlm_couchbase_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_couchbase_t);
+	rlm_couchbase_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_couchbase_thread_t);
+	rlm_couchbase_rctx_t	*rctx = talloc_get_type_abort(uctx, rlm_couchbase_rctx_t);
+	char			document[MAX_VALUE_SIZE];	/* our document body */
+	rlm_rcode_t		rcode;
+
+	/*
+	 *	Errors were logged by the callback.  As with
+	 *	the synchronous path, a new document is
+	 *	created if the existing one can't be fetched.
+	 */
+	if (rctx->jobj) RDEBUG3("parsed json body from couchbase: %s", json_object_to_json_string(rctx->jobj));
+
+	rcode = couchbase_acct_document_merge(inst, request, rctx->status, &rctx->jobj, document, sizeof(document));
+	if (rcode != RLM_MODULE_OK) {
+		talloc_free(rctx);
+		return rcode;
+	}
+
+	/* debugging */
+	RDEBUG3("setting '%s' => '%s'", rctx->dockey, document);
+
+	if (couchbase_async_store(inst, t, request, rctx, document) < 0) {
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_accounting_store_resume, mod_async_signal, rctx);
+}
+
 /** Write accounting data to Couchbase documents
  *
  * Handle accounting requests and store the associated data into JSON documents
@@ -237,15 +669,14 @@ finish:
 static rlm_rcode_t mod_accounting(module_ctx_t const *mctx, REQUEST *request)
 {
 	rlm_couchbase_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_couchbase_t);       /* our module instance */
+	rlm_couchbase_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_couchbase_thread_t);
 	rlm_couchbase_handle_t *handle = NULL;  /* connection pool handle */
 	rlm_rcode_t rcode = RLM_MODULE_OK;      /* return code */
 	VALUE_PAIR *vp;                         /* radius value pair linked list */
 	char buffer[MAX_KEY_SIZE];
 	char const *dockey;			/* our document key */
 	char document[MAX_VALUE_SIZE];          /* our document body */
-	char element[MAX_KEY_SIZE];             /* mapped radius attribute to element name */
 	int status = 0;                         /* account status type */
-	int docfound = 0;                       /* document found toggle */
 	lcb_error_t cb_error = LCB_SUCCESS;     /* couchbase error holder */
 	ssize_t slen;
 
@@ -271,6 +702,28 @@ static rlm_rcode_t mod_accounting(module_ctx_t const *mctx, REQUEST *request)
 		return RLM_MODULE_OK;
 	}
 
+	/* attempt to build document key */
+	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->acct_key, NULL, NULL);
+	if (slen < 0) return RLM_MODULE_FAIL;
+	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
+		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
+		return RLM_MODULE_FAIL;
+	}
+
+	/* fetch the existing document asynchronously, then merge and store it */
+	if (t->cb) {
+		rlm_couchbase_rctx_t *rctx;
+
+		rctx = couchbase_rctx_alloc(request, dockey);
+		rctx->status = status;
+		if (couchbase_async_get(t, request, rctx) < 0) {
+			talloc_free(rctx);
+			return RLM_MODULE_FAIL;
+		}
+
+		return unlang_module_yield(request, mod_accounting_get_resume, mod_async_signal, rctx);
+	}
+
 	/* get handle */
 	handle = fr_pool_connection_get(inst->pool, request);
 
@@ -283,19 +736,6 @@ static rlm_rcode_t mod_accounting(module_ctx_t const *mctx, REQUEST *request)
 	/* set cookie */
 	cookie_t *cookie = handle->cookie;
 
-	/* attempt to build document key */
-	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->acct_key, NULL, NULL);
-	if (slen < 0) {
-		rcode = RLM_MODULE_FAIL;
-		goto finish;
-	}
-	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
-		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
-		rcode = RLM_MODULE_FAIL;
-		/* return */
-		goto finish;
-	}
-
 	/* attempt to fetch document */
 	cb_error = couchbase_get_key(cb_inst, cookie, dockey);
 
@@ -310,79 +750,13 @@ static rlm_rcode_t mod_accounting(module_ctx_t const *mctx, REQUEST *request)
 		}
 	/* check cookie json object */
 	} else if (cookie->jobj) {
-		/* set doc found */
-		docfound = 1;
 		/* debugging */
 		RDEBUG3("parsed json body from couchbase: %s", json_object_to_json_string(cookie->jobj));
 	}
 
-	/* start json document if needed */
-	if (docfound != 1) {
-		/* debugging */
-		RDEBUG2("no existing document found - creating new json document");
-		/* create new json object */
-		cookie->jobj = json_object_new_object();
-		/* set 'docType' element for new document */
-		json_object_object_add(cookie->jobj, "docType", json_object_new_string(inst->doctype));
-		/* default startTimestamp and stopTimestamp to null values */
-		json_object_object_add(cookie->jobj, "startTimestamp", NULL);
-		json_object_object_add(cookie->jobj, "stopTimestamp", NULL);
-	}
-
-	/* status specific replacements for start/stop time */
-	switch (status) {
-	case FR_STATUS_START:
-		/* add start time */
-		if ((vp = fr_pair_find_by_da(request->packet->vps, attr_acct_status_type, TAG_ANY)) != NULL) {
-			/* add to json object */
-			json_object_object_add(cookie->jobj, "startTimestamp",
-					       mod_value_pair_to_json_object(request, vp));
-		}
-		break;
-
-	case FR_STATUS_STOP:
-		/* add stop time */
-		if ((vp = fr_pair_find_by_da(request->packet->vps, attr_event_timestamp, TAG_ANY)) != NULL) {
-			/* add to json object */
-			json_object_object_add(cookie->jobj, "stopTimestamp",
-					       mod_value_pair_to_json_object(request, vp));
-		}
-		/* check start timestamp and adjust if needed */
-		mod_ensure_start_timestamp(cookie->jobj, request->packet->vps);
-		break;
-
-	case FR_STATUS_ALIVE:
-		/* check start timestamp and adjust if needed */
-		mod_ensure_start_timestamp(cookie->jobj, request->packet->vps);
-		break;
-
-	default:
-		/* don't doing anything */
-		rcode = RLM_MODULE_NOOP;
-		/* return */
-		goto finish;
-	}
-
-	/* loop through pairs and add to json document */
-	for (vp = request->packet->vps; vp; vp = vp->next) {
-		/* map attribute to element */
-		if (mod_attribute_to_element(vp->da->name, inst->map, &element) == 0) {
-			/* debug */
-			RDEBUG3("mapped attribute %s => %s", vp->da->name, element);
-			/* add to json object with mapped name */
-			json_object_object_add(cookie->jobj, element, mod_value_pair_to_json_object(request, vp));
-		}
-	}
-
-	/* copy json string to document and check size */
-	if (strlcpy(document, json_object_to_json_string(cookie->jobj), sizeof(document)) >= sizeof(document)) {
-		/* this isn't good */
-		RERROR("could not write json document - insufficient buffer space");
-		/* set return */
-		rcode = RLM_MODULE_FAIL;
-		/* return */
-		goto finish;
-	}
+	/* merge the request into the document */
+	rcode = couchbase_acct_document_merge(inst, request, status, &cookie->jobj, document, sizeof(document));
+	if (rcode != RLM_MODULE_OK) goto finish;
 
 	/* debugging */
 	RDEBUG3("setting '%s' => '%s'", dockey, document);
@@ -495,6 +869,11 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		inst->server = server;
 	}
 
+#ifdef WITH_ACCOUNTING
+	FR_INTEGER_BOUND_CHECK("persist_to", inst->persist_to, <=, 4);
+	FR_INTEGER_BOUND_CHECK("replicate_to", inst->replicate_to, <=, 3);
+#endif
+
 	/* setup item map */
 	if (mod_build_attribute_element_map(conf, inst) != 0) {
 		/* fail */
@@ -553,6 +932,60 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/** Create the thread's Couchbase instance
+ *
+ * Only used when async.  The instance bootstraps from the event loop, and
+ * commands issued before the bootstrap completes are queued by libcouchbase.
+ * The bootstrap is bounded by the same timeout as the pool's connections.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_couchbase_t		*inst = talloc_get_type_abort(instance, rlm_couchbase_t);
+	rlm_couchbase_thread_t	*t = talloc_get_type_abort(thread, rlm_couchbase_thread_t);
+	lcb_error_t		cb_error;
+
+	if (!inst->async) return 0;
+
+	t->el = el;
+	t->io = couchbase_io_alloc(t, el);
+
+	cb_error = couchbase_init_async(&t->cb, inst->server, inst->bucket, inst->username, inst->password,
+					fr_time_delta_to_sec(fr_pool_timeout(inst->pool)), inst->api_opts, t->io);
+	if (cb_error != LCB_SUCCESS) {
+		ERROR("failed to initiate couchbase connection: %s (0x%x)",
+		      lcb_strerror(NULL, cb_error), cb_error);
+		if (t->cb) {
+			lcb_destroy(t->cb);
+			t->cb = NULL;
+		}
+		return -1;
+	}
+
+	lcb_set_bootstrap_callback(t->cb, _couchbase_bootstrap_callback);
+	lcb_install_callback3(t->cb, LCB_CALLBACK_GET, _couchbase_get_callback);
+	lcb_install_callback3(t->cb, LCB_CALLBACK_STORE, _couchbase_store_callback);
+	lcb_install_callback3(t->cb, LCB_CALLBACK_STOREDUR, _couchbase_store_callback);
+
+	return 0;
+}
+
+/** Destroy the thread's Couchbase instance
+ *
+ * Must happen before the IO plugin is freed with the thread instance.
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_couchbase_thread_t	*t = talloc_get_type_abort(thread, rlm_couchbase_thread_t);
+
+	if (!t->cb) return 0;
+
+	if (t->scheduling) lcb_sched_fail(t->cb);
+	lcb_destroy(t->cb);
+	t->cb = NULL;
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	INFO("libcouchbase version: %s", lcb_get_version(NULL));
@@ -574,6 +1007,10 @@ module_t rlm_couchbase = {
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_couchbase_thread_t),
+	.thread_inst_type	= "rlm_couchbase_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 #ifdef WITH_ACCOUNTING
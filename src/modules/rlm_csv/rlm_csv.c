@@ -24,15 +24,43 @@
  */
 RCSID("$Id$")
 
+#define LOG_PREFIX "rlm_csv (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
 
 #include <freeradius-devel/server/map_proc.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST *request,
 				fr_value_box_t **key, vp_map_t const *maps);
 
+/** How keys in the file are matched against the lookup key
+ *
+ */
+typedef enum {
+	CSV_KEY_INVALID = 0,
+	CSV_KEY_EXACT,					//!< Key must match the index field exactly.
+	CSV_KEY_PREFIX,					//!< Longest index field which is a prefix of the key.
+	CSV_KEY_RANGE					//!< Key is between the index field and range_end_field.
+} csv_key_type_t;
+
+static fr_table_num_sorted_t const csv_key_type_table[] = {
+	{ "exact",	CSV_KEY_EXACT	},
+	{ "prefix",	CSV_KEY_PREFIX	},
+	{ "range",	CSV_KEY_RANGE	}
+};
+static size_t csv_key_type_table_len = NUM_ELEMENTS(csv_key_type_table);
+
+typedef struct rlm_csv_index_s rlm_csv_index_t;
+typedef struct rlm_csv_reload_s rlm_csv_reload_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -47,20 +75,27 @@ typedef struct {
 	char const	*fields;
 	char const	*index_field_name;
 	char const	*data_type_name;
+	char const	*key_type_name;
+	char const	*range_end_field_name;
 
 	fr_type_t	data_type;
+	csv_key_type_t	key_type;
 
 	bool		header;
+	bool		mmap;		//!< Map the file, and parse lines when they're looked up.
+	fr_time_delta_t	reload_interval; //!< How often to check the file for changes.
 
 	int		num_fields;
 	int		used_fields;
 	int		index_field;
+	int		range_end_field;
 
 	char const     	**field_names;
 	int		*field_offsets; /* field X from the file maps to array entry Y here */
 	fr_type_t	*field_types;
-	rbtree_t	*tree;
-	fr_trie_t	*trie;
+
+	rlm_csv_index_t	*index;		//!< The data loaded from the file, if we're not reloading it.
+	rlm_csv_reload_t *reload;	//!< Reloads the file, NULL if reload_interval is 0.
 
 	vp_tmpl_t	*key;
 	vp_map_t	*map;		//!< if there is an "update" section in the configuration.
@@ -70,9 +105,59 @@ typedef struct rlm_csv_entry_s rlm_csv_entry_t;
 struct rlm_csv_entry_s {
 	rlm_csv_entry_t *next;
 	fr_value_box_t *key;
+	fr_value_box_t *end;		//!< Inclusive end of the range, if key_type = range.
+	size_t		offset;		//!< Start of the line in the file, mmap mode only.
 	char *data[];
 };
 
+/** A slot in the hash index of a mapped file
+ *
+ * Only the hash of the key and the location of the line are
+ * stored, keys are re-parsed from the file to resolve collisions.
+ */
+typedef struct {
+	uint64_t	offset;		//!< Offset of the line + 1, 0 means the slot is free.
+	uint32_t	hash;		//!< Hash of the key.
+} csv_slot_t;
+
+/** Everything loaded from one version of the file
+ *
+ * Reloading builds a new index in the background, and swaps it
+ * with the current one.  The old index is freed once the last
+ * lookup using it has completed.
+ */
+struct rlm_csv_index_s {
+	rlm_csv_t const	*inst;		//!< Instance the index belongs to.
+
+	uint8_t const	*map;		//!< The mapped file, mmap mode only.
+	size_t		map_len;	//!< Length of the mapped file.
+
+	csv_slot_t	*slots;		//!< Hash index, mmap mode with exact string/integer keys.
+	size_t		num_slots;	//!< Always a power of 2.
+
+	rbtree_t	*tree;		//!< Entries by key, exact keys.
+	fr_trie_t	*trie;		//!< Entries by prefix, key_type = prefix, or IP address keys.
+	rlm_csv_entry_t	**ranges;	//!< Entries sorted by start of range, key_type = range.
+	size_t		num_ranges;
+
+	dev_t		dev;		//!< Identity of the file we loaded.
+	ino_t		ino;
+	off_t		size;
+	struct timespec	mtime;
+
+	uint32_t	refs;		//!< Lookups using this index, protected by the reload mutex.
+};
+
+struct rlm_csv_reload_s {
+	rlm_csv_t const	*inst;		//!< Instance data.
+	pthread_t	thread;		//!< Checks the file, and builds new indexes.
+	pthread_mutex_t	mutex;		//!< Protects current, refs, and stop.
+	pthread_cond_t	cond;		//!< Signalled on exit.
+	rlm_csv_index_t	*current;	//!< Index lookups should use.
+	bool		stop;		//!< Tell the reload thread to exit.
+	bool		running;	//!< Reload thread was started.
+};
+
 /*
  *	A mapping of configuration file names to internal variables.
  */
@@ -83,10 +168,34 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("header", FR_TYPE_BOOL, rlm_csv_t, header) },
 	{ FR_CONF_OFFSET("index_field", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, rlm_csv_t, index_field_name) },
 	{ FR_CONF_OFFSET("data_type", FR_TYPE_STRING, rlm_csv_t, data_type_name) },
+	{ FR_CONF_OFFSET("key_type", FR_TYPE_STRING, rlm_csv_t, key_type_name), .dflt = "exact" },
+	{ FR_CONF_OFFSET("range_end_field", FR_TYPE_STRING, rlm_csv_t, range_end_field_name) },
+	{ FR_CONF_OFFSET("mmap", FR_TYPE_BOOL, rlm_csv_t, mmap), .dflt = "no" },
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_TIME_DELTA, rlm_csv_t, reload_interval), .dflt = "0" },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL, rlm_csv_t, key) },
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Errors found when loading the file are logged against the
+ *	config section at startup, or with the instance name when
+ *	reloading.
+ */
+#define csv_log_err(_conf, _fmt, ...) \
+do { \
+	if (_conf) { \
+		cf_log_err(_conf, _fmt, ## __VA_ARGS__); \
+	} else { \
+		ERROR(_fmt, ## __VA_ARGS__); \
+	} \
+} while (0)
+
+static inline bool csv_is_ip_type(fr_type_t type)
+{
+	return ((type == FR_TYPE_IPV4_ADDR) || (type == FR_TYPE_IPV4_PREFIX) ||
+		(type == FR_TYPE_IPV6_ADDR) || (type == FR_TYPE_IPV6_PREFIX));
+}
+
 static int csv_entry_cmp(void const *one, void const *two)
 {
 	rlm_csv_entry_t const *a = one;
@@ -95,10 +204,52 @@ static int csv_entry_cmp(void const *one, void const *two)
 	return fr_value_box_cmp(a->key, b->key);
 }
 
+static int csv_range_cmp(void const *one, void const *two)
+{
+	rlm_csv_entry_t const * const *a = one;
+	rlm_csv_entry_t const * const *b = two;
+
+	return fr_value_box_cmp((*a)->key, (*b)->key);
+}
+
+/** Hash a key in the same way for file entries and lookups
+ *
+ */
+static uint32_t csv_key_hash(fr_value_box_t const *key)
+{
+	uint8_t buffer[256];
+	ssize_t	len;
+
+	switch (key->type) {
+	case FR_TYPE_STRING:
+		return fr_hash(key->vb_strvalue, key->vb_length);
+
+	case FR_TYPE_OCTETS:
+		return fr_hash(key->vb_octets, key->vb_length);
+
+	default:
+		len = fr_value_box_to_network(NULL, buffer, sizeof(buffer), key);
+		if (len < 0) return 0;
+		return fr_hash(buffer, len);
+	}
+}
+
+/** Bytes of a string or octets key, for the prefix trie
+ *
+ */
+static uint8_t const *csv_key_bytes(fr_value_box_t const *key, size_t *len)
+{
+	*len = key->vb_length;
+
+	if (key->type == FR_TYPE_STRING) return (uint8_t const *)key->vb_strvalue;
+
+	return key->vb_octets;
+}
+
 /*
  *	Allow for quotation marks.
  */
-static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
+static bool buf2entry(rlm_csv_t const *inst, char *buf, char **out)
 {
 	char *p, *q;
 
@@ -166,65 +317,244 @@ static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
 	return false;
 }
 
+/** Split a line into its fields, in place
+ *
+ * @param[in] inst	Module instance.
+ * @param[in] buffer	Line to split.
+ * @param[out] fields	Array of num_fields pointers into buffer.
+ * @return
+ *	- The number of fields, which is num_fields + 1 if there are too many.
+ *	- -1 if the line is malformed.
+ */
+static int csv_line_split(rlm_csv_t const *inst, char *buffer, char **fields)
+{
+	int	i;
+	char	*p, *q;
+
+	for (p = buffer, i = 0; p != NULL; p = q, i++) {
+		if (!buf2entry(inst, p, &q)) return -1;
+
+		if (q) *(q++) = '\0';
+
+		if (i >= inst->num_fields) return inst->num_fields + 1;
+
+		fields[i] = p;
+	}
+
+	return i;
+}
+
+/** Copy a line out of the mapped file, so it can be split
+ *
+ */
+static char *csv_line_copy(TALLOC_CTX *ctx, rlm_csv_index_t const *idx, size_t offset)
+{
+	uint8_t const	*start = idx->map + offset, *end;
+	char		*line;
+
+	end = memchr(start, '\n', idx->map_len - offset);
+	if (!end) end = idx->map + idx->map_len;
+
+	MEM(line = talloc_array(ctx, char, (end - start) + 1));
+	memcpy(line, start, end - start);
+	line[end - start] = '\0';
+
+	return line;
+}
+
+/** Parse the key of a line in the mapped file
+ *
+ */
+static int csv_line_key(TALLOC_CTX *ctx, fr_value_box_t *out, rlm_csv_index_t const *idx, size_t offset)
+{
+	rlm_csv_t const	*inst = idx->inst;
+	char		*line;
+	char		*fields[inst->num_fields];
+	fr_type_t	type = inst->data_type;
+	int		ret;
+
+	line = csv_line_copy(NULL, idx, offset);
+	if (csv_line_split(inst, line, fields) <= inst->index_field) {
+		talloc_free(line);
+		return -1;
+	}
+
+	ret = fr_value_box_from_str(ctx, out, &type, NULL, fields[inst->index_field], -1, 0, false);
+	talloc_free(line);
+
+	return ret;
+}
+
+/** Add a line to the hash index of a mapped file
+ *
+ */
+static int csv_slot_insert(CONF_SECTION *conf, rlm_csv_index_t *idx, int lineno,
+			   fr_value_box_t const *key, size_t offset)
+{
+	rlm_csv_t const	*inst = idx->inst;
+	uint32_t	hash = csv_key_hash(key);
+	size_t		i;
+
+	for (i = hash & (idx->num_slots - 1);
+	     idx->slots[i].offset != 0;
+	     i = (i + 1) & (idx->num_slots - 1)) {
+		fr_value_box_t	other;
+		int		cmp;
+
+		if (idx->slots[i].hash != hash) continue;
+
+		if (csv_line_key(NULL, &other, idx, idx->slots[i].offset - 1) < 0) continue;
+		cmp = fr_value_box_cmp(&other, key);
+		fr_value_box_clear(&other);
+
+		if (cmp == 0) {
+			/*
+			 *	@todo - allow duplicate keys later
+			 */
+			csv_log_err(conf, "Failed inserting entry for file %s line %d: duplicate entry",
+				    inst->filename, lineno);
+			return -1;
+		}
+	}
+
+	idx->slots[i].offset = offset + 1;
+	idx->slots[i].hash = hash;
+
+	return 0;
+}
+
+/** Find a line in the hash index of a mapped file
+ *
+ * @return
+ *	- The offset of the line + 1.
+ *	- 0 if no line matches.
+ */
+static size_t csv_slot_find(rlm_csv_index_t const *idx, fr_value_box_t const *key)
+{
+	uint32_t	hash = csv_key_hash(key);
+	size_t		i;
+
+	for (i = hash & (idx->num_slots - 1);
+	     idx->slots[i].offset != 0;
+	     i = (i + 1) & (idx->num_slots - 1)) {
+		fr_value_box_t	other;
+		int		cmp;
+
+		if (idx->slots[i].hash != hash) continue;
+
+		if (csv_line_key(NULL, &other, idx, idx->slots[i].offset - 1) < 0) continue;
+		cmp = fr_value_box_cmp(&other, key);
+		fr_value_box_clear(&other);
+
+		if (cmp == 0) return idx->slots[i].offset;
+	}
+
+	return 0;
+}
+
 /*
  *	Convert a buffer to a CSV entry
  */
-static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buffer)
+static int file2csv(CONF_SECTION *conf, rlm_csv_index_t *idx, int lineno, char *buffer, size_t offset)
 {
+	rlm_csv_t const *inst = idx->inst;
 	rlm_csv_entry_t *e;
-	int i;
-	char *p, *q;
+	int i, num;
+	char *fields[inst->num_fields];
+	fr_type_t type = inst->data_type;
+	fr_value_box_t key;
+
+	num = csv_line_split(inst, buffer, fields);
+	if (num < 0) {
+		csv_log_err(conf, "Malformed entry in file %s line %d", inst->filename, lineno);
+		return -1;
+	}
 
-	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(inst, uint8_t,
-						     sizeof(*e) + (inst->used_fields * sizeof(e->data[0]))));
-	talloc_set_type(e, rlm_csv_entry_t);
+	if (num > inst->num_fields) {
+		csv_log_err(conf, "Too many fields at file %s line %d", inst->filename, lineno);
+		return -1;
+	}
 
-	for (p = buffer, i = 0; p != NULL; p = q, i++) {
-		if (!buf2entry(inst, p, &q)) {
-			cf_log_err(conf, "Malformed entry in file %s line %d", inst->filename, lineno);
-			return NULL;
+	if (num < inst->num_fields) {
+		csv_log_err(conf, "Too few fields in file %s at line %d (%d < %d)",
+			    inst->filename, lineno, num, inst->num_fields);
+		return -1;
+	}
+
+	/*
+	 *	Mapped files with exact keys only record where the
+	 *	line is, everything else is parsed on lookup.
+	 */
+	if (idx->slots) {
+		if (fr_value_box_from_str(NULL, &key, &type, NULL, fields[inst->index_field], -1, 0, false) < 0) {
+			csv_log_err(conf, "Failed parsing key field in file %s line %d - %s", inst->filename, lineno,
+				    fr_strerror());
+			return -1;
 		}
 
-		if (q) *(q++) = '\0';
+		i = csv_slot_insert(conf, idx, lineno, &key, offset);
+		fr_value_box_clear(&key);
 
-		if (i >= inst->num_fields) {
-			cf_log_err(conf, "Too many fields at file %s line %d", inst->filename, lineno);
-			return NULL;
-		}
+		return i;
+	}
+
+	if (idx->map) {
+		MEM(e = talloc_zero(idx, rlm_csv_entry_t));
+	} else {
+		MEM(e = (rlm_csv_entry_t *)talloc_zero_array(idx, uint8_t,
+							     sizeof(*e) + (inst->used_fields * sizeof(e->data[0]))));
+		talloc_set_type(e, rlm_csv_entry_t);
+	}
+	e->offset = offset;
+
+	for (i = 0; i < inst->num_fields; i++) {
+		char *p = fields[i];
 
 		/*
 		 *	This is the key field.
 		 */
 		if (i == inst->index_field) {
-			fr_type_t type = inst->data_type;
-
-			e->key = talloc_zero(e, fr_value_box_t);
+			MEM(e->key = talloc_zero(e, fr_value_box_t));
 			if (fr_value_box_from_str(e->key, e->key, &type, NULL, p, -1, 0, false) < 0) {
-				cf_log_err(conf, "Failed parsing key field in file %s line %d - %s", inst->filename, lineno,
-					   fr_strerror());
+				csv_log_err(conf, "Failed parsing key field in file %s line %d - %s", inst->filename, lineno,
+					    fr_strerror());
+			error:
 				talloc_free(e);
-				return NULL;
+				return -1;
 			}
 			continue;
 		}
 
 		/*
-		 *	This field is unused.  Ignore it.
+		 *	This is the end of the range.
 		 */
-		if (inst->field_offsets[i] < 0) continue;
+		if (i == inst->range_end_field) {
+			fr_type_t end_type = inst->data_type;
+
+			MEM(e->end = talloc_zero(e, fr_value_box_t));
+			if (fr_value_box_from_str(e->end, e->end, &end_type, NULL, p, -1, 0, false) < 0) {
+				csv_log_err(conf, "Failed parsing range end field in file %s line %d - %s",
+					    inst->filename, lineno, fr_strerror());
+				goto error;
+			}
+		}
+
+		/*
+		 *	This field is unused, or we'll parse it on lookup.
+		 */
+		if ((inst->field_offsets[i] < 0) || idx->map) continue;
 
 		/*
 		 *	Try to parse fields as data types if the data type is defined.
 		 */
 		if (inst->field_types[i] != FR_TYPE_INVALID) {
 			fr_value_box_t box;
-			fr_type_t type = inst->field_types[i];
+			fr_type_t field_type = inst->field_types[i];
 
-			if (fr_value_box_from_str(e, &box, &type, NULL, p, -1, 0, false) < 0) {
-				cf_log_err(conf, "Failed parsing field '%s' in file %s line %d - %s", inst->field_names[i],
-					   inst->filename, lineno, fr_strerror());
-				talloc_free(e);
-				return NULL;
+			if (fr_value_box_from_str(e, &box, &field_type, NULL, p, -1, 0, false) < 0) {
+				csv_log_err(conf, "Failed parsing field '%s' in file %s line %d - %s", inst->field_names[i],
+					    inst->filename, lineno, fr_strerror());
+				goto error;
 			}
 
 			fr_value_box_clear(&box);
@@ -233,37 +563,456 @@ static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno
 		MEM(e->data[inst->field_offsets[i]] = talloc_typed_strdup(e, p));
 	}
 
-	if (i < inst->num_fields) {
-		cf_log_err(conf, "Too few fields in file %s at line %d (%d < %d)", inst->filename, lineno, i, inst->num_fields);
-		return NULL;
-	}
+	if (csv_is_ip_type(inst->data_type)) {
+		if (inst->data_type == FR_TYPE_IPV4_ADDR || inst->data_type == FR_TYPE_IPV4_PREFIX) {
+			if (fr_trie_insert(idx->trie, &e->key->vb_ip.addr.v4.s_addr, e->key->vb_ip.prefix, e) < 0) {
+			trie_error:
+				csv_log_err(conf, "Failed inserting entry for file %s line %d: %s",
+					    inst->filename, lineno, fr_strerror());
+				goto error;
+			}
+		} else {
+			if (fr_trie_insert(idx->trie, &e->key->vb_ip.addr.v6.s6_addr, e->key->vb_ip.prefix, e) < 0) {
+				goto trie_error;
+			}
+		}
 
-	if ((inst->data_type == FR_TYPE_IPV4_ADDR) || (inst->data_type == FR_TYPE_IPV4_PREFIX)) {
-		if (fr_trie_insert(inst->trie, &e->key->vb_ip.addr.v4.s_addr, e->key->vb_ip.prefix, e) < 0) {
-			cf_log_err(conf, "Failed inserting entry for file %s line %d: %s",
-				   inst->filename, lineno, fr_strerror());
-			return NULL;
+	} else if (inst->key_type == CSV_KEY_PREFIX) {
+		uint8_t const	*bytes;
+		size_t		len;
+
+		bytes = csv_key_bytes(e->key, &len);
+		if (fr_trie_insert(idx->trie, bytes, len * 8, e) < 0) goto trie_error;
+
+	} else if (inst->key_type == CSV_KEY_RANGE) {
+		if (fr_value_box_cmp(e->key, e->end) > 0) {
+			csv_log_err(conf, "Range start is after range end in file %s line %d",
+				    inst->filename, lineno);
+			goto error;
 		}
 
-	} else if ((inst->data_type == FR_TYPE_IPV6_ADDR) || (inst->data_type == FR_TYPE_IPV6_PREFIX)) {
-		if (fr_trie_insert(inst->trie, &e->key->vb_ip.addr.v6.s6_addr, e->key->vb_ip.prefix, e) < 0) {
-			cf_log_err(conf, "Failed inserting entry for file %s line %d: %s",
-				   inst->filename, lineno, fr_strerror());
-			return NULL;
+		/*
+		 *	Sorted, and checked for overlaps, once
+		 *	we've read the whole file.
+		 */
+		if (idx->num_ranges >= talloc_array_length(idx->ranges)) {
+			MEM(idx->ranges = talloc_realloc(idx, idx->ranges, rlm_csv_entry_t *,
+							 idx->num_ranges ? (idx->num_ranges * 2) : 64));
 		}
+		idx->ranges[idx->num_ranges++] = e;
 
-	} else if (!rbtree_insert(inst->tree, e)) {
+	} else if (!rbtree_insert(idx->tree, e)) {
 		/*
 		 *	@todo - allow duplicate keys later
 		 */
-		cf_log_err(conf, "Failed inserting entry for file %s line %d: duplicate entry",
-			      inst->filename, lineno);
+		csv_log_err(conf, "Failed inserting entry for file %s line %d: duplicate entry",
+			    inst->filename, lineno);
+		goto error;
+	}
+
+	return 0;
+}
+
+/** Sort the ranges, and make sure they don't overlap
+ *
+ */
+static int csv_ranges_sort(CONF_SECTION *conf, rlm_csv_index_t *idx)
+{
+	rlm_csv_t const	*inst = idx->inst;
+	size_t		i;
+
+	if (idx->num_ranges == 0) return 0;
+
+	qsort(idx->ranges, idx->num_ranges, sizeof(idx->ranges[0]), csv_range_cmp);
+
+	for (i = 1; i < idx->num_ranges; i++) {
+		if (fr_value_box_cmp(idx->ranges[i - 1]->end, idx->ranges[i]->key) >= 0) {
+			csv_log_err(conf, "Overlapping ranges in file %s, starting at %pV and %pV",
+				    inst->filename, idx->ranges[i - 1]->key, idx->ranges[i]->key);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Find the range containing a key
+ *
+ */
+static rlm_csv_entry_t *csv_range_find(rlm_csv_index_t const *idx, fr_value_box_t const *key)
+{
+	size_t low = 0, high = idx->num_ranges;
+
+	/*
+	 *	Find the first range starting after the key,
+	 *	the one before it is the only candidate.
+	 */
+	while (low < high) {
+		size_t mid = low + ((high - low) / 2);
+
+		if (fr_value_box_cmp(idx->ranges[mid]->key, key) <= 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low == 0) return NULL;
+
+	if (fr_value_box_cmp(key, idx->ranges[low - 1]->end) > 0) return NULL;
+
+	return idx->ranges[low - 1];
+}
+
+static int _csv_index_free(rlm_csv_index_t *idx)
+{
+	void *map;
+
+	if (!idx->map) return 0;
+
+	memcpy(&map, &idx->map, sizeof(map)); /* const issues */
+	munmap(map, idx->map_len);
+
+	return 0;
+}
+
+/** Allocate a new index, and the structures the key type needs
+ *
+ */
+static rlm_csv_index_t *csv_index_alloc(rlm_csv_t const *inst)
+{
+	rlm_csv_index_t *idx;
+
+	/*
+	 *	Not parented, as reload threads allocate
+	 *	these outside of the instance's hierarchy.
+	 */
+	MEM(idx = talloc_zero(NULL, rlm_csv_index_t));
+	idx->inst = inst;
+	talloc_set_destructor(idx, _csv_index_free);
+
+	/*
+	 *	IP addresses go into tries.  Everything else into binary tries.
+	 */
+	if (csv_is_ip_type(inst->data_type) || (inst->key_type == CSV_KEY_PREFIX)) {
+		MEM(idx->trie = fr_trie_alloc(idx));
+	} else if (inst->key_type == CSV_KEY_EXACT) {
+		if (!inst->mmap) MEM(idx->tree = rbtree_talloc_alloc(idx, csv_entry_cmp, rlm_csv_entry_t, NULL, 0));
+	}
+
+	return idx;
+}
+
+/** Read the file into memory, one entry per line
+ *
+ */
+static int csv_index_read(CONF_SECTION *conf, rlm_csv_index_t *idx)
+{
+	rlm_csv_t const	*inst = idx->inst;
+	FILE		*fp;
+	int		lineno;
+	struct stat	st;
+	char		buffer[8192];
+
+	fp = fopen(inst->filename, "r");
+	if (!fp) {
+		csv_log_err(conf, "Error opening filename %s: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fileno(fp), &st) == 0) {
+		idx->dev = st.st_dev;
+		idx->ino = st.st_ino;
+		idx->size = st.st_size;
+		idx->mtime = st.st_mtim;
+	}
+	lineno = 1;
+
+	/*
+	 *	If there is a header in the file, then read that first.
+	 *	This time we just ignore it.
+	 */
+	if (inst->header) {
+		char *p = fgets(buffer, sizeof(buffer), fp);
+		if (!p) {
+			csv_log_err(conf, "Error reading filename %s: Unexpected EOF", inst->filename);
+			fclose(fp);
+			return -1;
+		}
+		lineno++;
+	}
+
+	/*
+	 *	Read the rest of the file.
+	 */
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		if (file2csv(conf, idx, lineno, buffer, 0) < 0) {
+			fclose(fp);
+			return -1;
+		}
+
+		lineno++;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+/** Map the file, and index the lines
+ *
+ */
+static int csv_index_map(CONF_SECTION *conf, rlm_csv_index_t *idx)
+{
+	rlm_csv_t const	*inst = idx->inst;
+	int		fd, lineno = 1;
+	struct stat	st;
+	void		*map;
+	uint8_t const	*p, *end, *eol;
+	size_t		lines = 0, bufsize = 0;
+	char		*buffer = NULL;
+
+	fd = open(inst->filename, O_RDONLY);
+	if (fd < 0) {
+		csv_log_err(conf, "Error opening filename %s: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		csv_log_err(conf, "Error reading filename %s: %s", inst->filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+	idx->dev = st.st_dev;
+	idx->ino = st.st_ino;
+	idx->size = st.st_size;
+	idx->mtime = st.st_mtim;
+
+	if (st.st_size == 0) {
+		close(fd);
+		goto done;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		csv_log_err(conf, "Error mapping filename %s: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+	idx->map = map;
+	idx->map_len = st.st_size;
+	end = idx->map + idx->map_len;
+
+	/*
+	 *	Size the hash index for a load factor of at most 0.5.
+	 */
+	if (!idx->trie && (inst->key_type == CSV_KEY_EXACT)) {
+		for (p = idx->map; p < end; p = eol + 1) {
+			eol = memchr(p, '\n', end - p);
+			lines++;
+			if (!eol) break;
+		}
+
+		idx->num_slots = 16;
+		while (idx->num_slots < (lines * 2)) idx->num_slots <<= 1;
+		idx->slots = talloc_zero_array(idx, csv_slot_t, idx->num_slots);
+		if (!idx->slots) {
+			csv_log_err(conf, "Failed allocating index for %zu lines of %s", lines, inst->filename);
+			return -1;
+		}
+	}
+
+	p = idx->map;
+
+	/*
+	 *	Skip the header.
+	 */
+	if (inst->header) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol) {
+			csv_log_err(conf, "Error reading filename %s: Unexpected EOF", inst->filename);
+			return -1;
+		}
+		p = eol + 1;
+		lineno++;
+	}
+
+	for (; p < end; p = eol + 1, lineno++) {
+		size_t len;
+
+		eol = memchr(p, '\n', end - p);
+		if (!eol) eol = end;
+
+		len = eol - p;
+		if ((len == 0) || ((len == 1) && (*p == '\r'))) continue;
+
+		/*
+		 *	Splitting modifies the line, so work on a copy.
+		 */
+		if (len >= bufsize) {
+			bufsize = len + 1;
+			MEM(buffer = talloc_realloc(idx, buffer, char, bufsize));
+		}
+		memcpy(buffer, p, len);
+		buffer[len] = '\0';
+
+		if (file2csv(conf, idx, lineno, buffer, p - idx->map) < 0) {
+			talloc_free(buffer);
+			return -1;
+		}
+	}
+	talloc_free(buffer);
+
+	/*
+	 *	From here on, lookups are random.
+	 */
+	(void)madvise(map, idx->map_len, MADV_RANDOM);
+
+done:
+	return 0;
+}
+
+/** Build a new index from the current contents of the file
+ *
+ * @param[in] conf	to log errors against, or NULL if we're reloading.
+ * @param[in] inst	Module instance.
+ * @return
+ *	- The new index.
+ *	- NULL on error.
+ */
+static rlm_csv_index_t *csv_index_build(CONF_SECTION *conf, rlm_csv_t const *inst)
+{
+	rlm_csv_index_t *idx;
+
+	idx = csv_index_alloc(inst);
+
+	if (((inst->mmap ? csv_index_map(conf, idx) : csv_index_read(conf, idx)) < 0) ||
+	    (csv_ranges_sort(conf, idx) < 0)) {
+		talloc_free(idx);
 		return NULL;
 	}
 
-	return e;
+	return idx;
+}
+
+/** Get the index lookups should use, and stop it being freed
+ *
+ */
+static rlm_csv_index_t *csv_index_acquire(rlm_csv_t const *inst)
+{
+	rlm_csv_index_t *idx;
+
+	if (!inst->reload) return inst->index;
+
+	pthread_mutex_lock(&inst->reload->mutex);
+	idx = inst->reload->current;
+	idx->refs++;
+	pthread_mutex_unlock(&inst->reload->mutex);
+
+	return idx;
+}
+
+/** Release an index, freeing it if it's been replaced and this was the last lookup using it
+ *
+ */
+static void csv_index_release(rlm_csv_t const *inst, rlm_csv_index_t *idx)
+{
+	bool unused;
+
+	if (!inst->reload) return;
+
+	pthread_mutex_lock(&inst->reload->mutex);
+	unused = ((--idx->refs == 0) && (idx != inst->reload->current));
+	pthread_mutex_unlock(&inst->reload->mutex);
+
+	if (unused) talloc_free(idx);
+}
+
+/** Rebuild the index whenever the file changes, and swap it with the current one
+ *
+ */
+static void *csv_reload_thread(void *arg)
+{
+	rlm_csv_reload_t	*reload = arg;
+	rlm_csv_t const		*inst = reload->inst;
+
+	pthread_mutex_lock(&reload->mutex);
+	while (!reload->stop) {
+		struct timespec		when;
+		struct stat		st;
+		rlm_csv_index_t		*idx, *old;
+		bool			unused;
+
+		clock_gettime(CLOCK_REALTIME, &when);
+		when.tv_sec += inst->reload_interval / NSEC;
+		when.tv_nsec += inst->reload_interval % NSEC;
+		if (when.tv_nsec >= NSEC) {
+			when.tv_sec++;
+			when.tv_nsec -= NSEC;
+		}
+
+		(void)pthread_cond_timedwait(&reload->cond, &reload->mutex, &when);
+		if (reload->stop) break;
+
+		/*
+		 *	Only this thread changes current, so it's
+		 *	safe to look at it without the mutex.
+		 */
+		old = reload->current;
+		pthread_mutex_unlock(&reload->mutex);
+
+		if ((stat(inst->filename, &st) < 0) ||
+		    ((st.st_dev == old->dev) && (st.st_ino == old->ino) && (st.st_size == old->size) &&
+		     (st.st_mtim.tv_sec == old->mtime.tv_sec) && (st.st_mtim.tv_nsec == old->mtime.tv_nsec))) {
+			pthread_mutex_lock(&reload->mutex);
+			continue;
+		}
+
+		INFO("File %s has changed, reloading", inst->filename);
+
+		idx = csv_index_build(NULL, inst);
+
+		pthread_mutex_lock(&reload->mutex);
+		if (!idx) {
+			ERROR("Failed reloading %s, continuing to use the previous version", inst->filename);
+			continue;
+		}
+
+		reload->current = idx;
+		unused = (old->refs == 0);
+		pthread_mutex_unlock(&reload->mutex);
+
+		/*
+		 *	Otherwise the last lookup using it frees it.
+		 */
+		if (unused) talloc_free(old);
+
+		pthread_mutex_lock(&reload->mutex);
+	}
+	pthread_mutex_unlock(&reload->mutex);
+
+	return NULL;
 }
 
+static int _csv_reload_free(rlm_csv_reload_t *reload)
+{
+	if (reload->running) {
+		pthread_mutex_lock(&reload->mutex);
+		reload->stop = true;
+		pthread_cond_signal(&reload->cond);
+		pthread_mutex_unlock(&reload->mutex);
+
+		pthread_join(reload->thread, NULL);
+	}
+
+	/*
+	 *	Nothing can be using the index now.
+	 */
+	talloc_free(reload->current);
+
+	pthread_cond_destroy(&reload->cond);
+	pthread_mutex_destroy(&reload->mutex);
+
+	return 0;
+}
 
 static int fieldname2offset(rlm_csv_t const *inst, char const *field_name, int *array_offset)
 {
@@ -450,14 +1199,39 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		}
 	}
 
-	/*
-	 *	IP addresses go into tries.  Everything else into binary tries.
-	 */
-	if ((inst->data_type == FR_TYPE_IPV4_ADDR) || (inst->data_type == FR_TYPE_IPV4_PREFIX) ||
-	    (inst->data_type == FR_TYPE_IPV6_ADDR) || (inst->data_type == FR_TYPE_IPV6_PREFIX)) {
-		MEM(inst->trie = fr_trie_alloc(inst));
-	} else {
-		MEM(inst->tree = rbtree_talloc_alloc(inst, csv_entry_cmp, rlm_csv_entry_t, NULL, 0));
+	inst->key_type = fr_table_value_by_str(csv_key_type_table, inst->key_type_name, CSV_KEY_INVALID);
+	switch (inst->key_type) {
+	case CSV_KEY_INVALID:
+		cf_log_err(conf, "Invalid key_type '%s'", inst->key_type_name);
+		return -1;
+
+	case CSV_KEY_PREFIX:
+		if ((inst->data_type != FR_TYPE_STRING) && (inst->data_type != FR_TYPE_OCTETS)) {
+			cf_log_err(conf, "key_type = prefix requires data_type = string or octets");
+			return -1;
+		}
+		break;
+
+	case CSV_KEY_RANGE:
+		if (csv_is_ip_type(inst->data_type)) {
+			cf_log_err(conf, "key_type = range cannot be used with IP addresses, they always "
+				   "match the longest prefix");
+			return -1;
+		}
+
+		if (!inst->range_end_field_name || !*inst->range_end_field_name) {
+			cf_log_err(conf, "key_type = range requires a range_end_field");
+			return -1;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	if (inst->reload_interval && (inst->reload_interval < NSEC)) {
+		cf_log_err(conf, "reload_interval must be at least 1 second");
+		return -1;
 	}
 
 	/*
@@ -526,6 +1300,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	 *	in which case they don't map to anything.
 	 */
 	inst->index_field = -1;
+	inst->range_end_field = -1;
 
 	/*
 	 *	Parse the field names
@@ -585,6 +1360,10 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 			inst->field_offsets[i] = inst->used_fields++;
 		}
 
+		if ((inst->key_type == CSV_KEY_RANGE) && (strcmp(p, inst->range_end_field_name) == 0)) {
+			inst->range_end_field = i;
+		}
+
 		/*
 		 *	Save the field names, even when the field names are empty.
 		 */
@@ -604,6 +1383,14 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if ((inst->key_type == CSV_KEY_RANGE) &&
+	    ((inst->range_end_field < 0) || (inst->range_end_field == inst->index_field))) {
+		fclose(fp);
+		cf_log_err(conf, "range_end_field '%s' must be a field other than the index_field",
+			   inst->range_end_field_name);
+		return -1;
+	}
+
 	/*
 	 *	Set the data type of the index field.
 	 */
@@ -634,12 +1421,11 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_csv_t *inst = instance;
 	CONF_SECTION *cs;
-	int lineno;
-	FILE *fp;
+	rlm_csv_reload_t *reload;
+	int ret;
 	vp_tmpl_rules_t	parse_rules = {
 		.allow_foreign = true	/* Because we don't know where we'll be called */
 	};
-	char buffer[8192];
 
 	/*
 	 *	"update" without "key" is invalid, as we can't run the
@@ -669,44 +1455,33 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	}
 
 	/*
-	 *	Re-open the file and read it all.
+	 *	Read the whole file, now that the maps have told us
+	 *	which data types the fields have.
 	 */
-	fp = fopen(inst->filename, "r");
-	if (!fp) {
-		cf_log_err(conf, "Error opening filename %s: %s", inst->filename, fr_syserror(errno));
-		return -1;
-	}
-	lineno = 1;
+	if (!inst->reload_interval) {
+		inst->index = csv_index_build(conf, inst);
+		if (!inst->index) return -1;
 
-	/*
-	 *	If there is a header in the file, then read that first.
-	 *	This time we just ignore it.
-	 */
-	if (inst->header) {
-		char *p = fgets(buffer, sizeof(buffer), fp);
-		if (!p) {
-			cf_log_err(conf, "Error reading filename %s: Unexpected EOF", inst->filename);
-			fclose(fp);
-			return -1;
-		}
-		lineno++;
+		talloc_steal(inst, inst->index);
+		return 0;
 	}
 
-	/*
-	 *	Read the rest of the file.
-	 */
-	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-		rlm_csv_entry_t *e;
+	MEM(reload = talloc_zero(inst, rlm_csv_reload_t));
+	reload->inst = inst;
+	pthread_mutex_init(&reload->mutex, NULL);
+	pthread_cond_init(&reload->cond, NULL);
+	talloc_set_destructor(reload, _csv_reload_free);
+	inst->reload = reload;
 
-		e = file2csv(conf, inst, lineno, buffer);
-		if (!e) {
-			fclose(fp);
-			return -1;
-		}
+	reload->current = csv_index_build(conf, inst);
+	if (!reload->current) return -1;
 
-		lineno++;
+	ret = pthread_create(&reload->thread, NULL, csv_reload_thread, reload);
+	if (ret != 0) {
+		cf_log_err(conf, "Failed creating reload thread: %s", fr_syserror(ret));
+		return -1;
 	}
-	fclose(fp);
+	reload->running = true;
 
 	return 0;
 }
@@ -752,7 +1527,7 @@ static int csv_map_getvalue(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request,
 	vp = fr_pair_afrom_da(ctx, da);
 	fr_assert(vp);
 
-	if (fr_pair_value_from_str(vp, str, talloc_array_length(str) - 1, '\0', true) < 0) {
+	if (fr_pair_value_from_str(vp, str, strlen(str), '\0', true) < 0) {
 		RPWDEBUG("Failed parsing value \"%pV\" for attribute %s", fr_box_strvalue_buffer(str),
 			tmpl_da(map->lhs)->name);
 		talloc_free(vp);
@@ -783,27 +1558,88 @@ static rlm_rcode_t mod_map_apply(rlm_csv_t const *inst, REQUEST *request,
 				fr_value_box_t const *key, vp_map_t const *maps)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_UPDATED;
-	rlm_csv_entry_t		*e;
+	rlm_csv_index_t		*idx;
+	rlm_csv_entry_t		*e = NULL;
 	vp_map_t const		*map;
+	size_t			offset = 0;
+	bool			found = false;
+	char			*line = NULL;
+	char			**data;
+	char			*fields[inst->num_fields];
+	char			*used[inst->used_fields];
+
+	idx = csv_index_acquire(inst);
 
 	if ((inst->data_type == FR_TYPE_IPV4_ADDR) || (inst->data_type == FR_TYPE_IPV4_PREFIX)) {
-		e = fr_trie_lookup(inst->trie, &key->vb_ip.addr.v4.s_addr, key->vb_ip.prefix);
+		e = fr_trie_lookup(idx->trie, &key->vb_ip.addr.v4.s_addr, key->vb_ip.prefix);
 
 	} else if ((inst->data_type == FR_TYPE_IPV6_ADDR) || (inst->data_type == FR_TYPE_IPV6_PREFIX)) {
-		e = fr_trie_lookup(inst->trie, &key->vb_ip.addr.v6.s6_addr, key->vb_ip.prefix);
+		e = fr_trie_lookup(idx->trie, &key->vb_ip.addr.v6.s6_addr, key->vb_ip.prefix);
+
+	} else if (inst->key_type == CSV_KEY_PREFIX) {
+		uint8_t const	*bytes;
+		size_t		len;
+
+		/*
+		 *	The trie can't hold longer keys, so nothing
+		 *	can match past that.
+		 */
+		bytes = csv_key_bytes(key, &len);
+		if (len > 256) len = 256;
+
+		e = fr_trie_lookup(idx->trie, bytes, len * 8);
+
+	} else if (inst->key_type == CSV_KEY_RANGE) {
+		e = csv_range_find(idx, key);
+
+	} else if (idx->slots) {
+		/*
+		 *	Slots store the offset + 1, so that 0 means "not found".
+		 */
+		offset = csv_slot_find(idx, key);
+		if (offset) {
+			offset--;
+			found = true;
+		}
 
 	} else {
 		rlm_csv_entry_t my_e;
 
 		memcpy(&my_e.key, &key, sizeof(key)); /* const issues */
 
-		e = rbtree_finddata(inst->tree, &my_e);
+		e = rbtree_finddata(idx->tree, &my_e);
 	}
-	if (!e) {
+	if (e) found = true;
+
+	if (!found) {
 		rcode = RLM_MODULE_NOOP;
 		goto finish;
 	}
 
+	/*
+	 *	Lines in mapped files are only split when
+	 *	they're used.
+	 */
+	if (idx->map) {
+		int i;
+
+		if (e) offset = e->offset;
+
+		line = csv_line_copy(request, idx, offset);
+		if (csv_line_split(inst, line, fields) != inst->num_fields) {
+			REDEBUG("Line at offset %zu of %s has changed since it was loaded", offset, inst->filename);
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+
+		for (i = 0; i < inst->num_fields; i++) {
+			if (inst->field_offsets[i] >= 0) used[inst->field_offsets[i]] = fields[i];
+		}
+		data = used;
+	} else {
+		data = e->data;
+	}
+
 	RINDENT();
 	for (map = maps;
 	     map != NULL;
@@ -840,7 +1676,7 @@ static rlm_rcode_t mod_map_apply(rlm_csv_t const *inst, REQUEST *request,
 		 *	Pass the raw data to the callback, which will
 		 *	create the VP and add it to the map.
 		 */
-		if (map_to_request(request, map, csv_map_getvalue, e->data[field]) < 0) {
+		if (map_to_request(request, map, csv_map_getvalue, data[field]) < 0) {
 			REXDENT();
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
@@ -850,6 +1686,9 @@ static rlm_rcode_t mod_map_apply(rlm_csv_t const *inst, REQUEST *request,
 	REXDENT();
 
 finish:
+	talloc_free(line);
+	csv_index_release(inst, idx);
+
 	return rcode;
 }
 
@@ -299,6 +299,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 
 	xlat = xlat_async_register(inst, inst->xlat_name, xlat_delay);
 	xlat_async_instantiate_set(xlat, mod_xlat_instantiate, rlm_delay_t *, NULL, inst);
+	xlat_async_yields_set(xlat);
 	return 0;
 }
 
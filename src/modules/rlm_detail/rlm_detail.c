@@ -27,13 +27,17 @@ RCSID("$Id$")
 #define LOG_PREFIX_ARGS inst->name
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/unlang/base.h>
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #ifdef HAVE_UNISTD_H
 #  include <unistd.h>
@@ -44,6 +48,9 @@ RCSID("$Id$")
 #endif
 
 #define DIRLEN	8192		//!< Maximum path length.
+#define DETAIL_IOV_MAX	64	//!< Maximum batches coalesced into one writev().
+
+typedef struct detail_writer_s detail_writer_t;
 
 /** Instance configuration for rlm_detail
  *
@@ -57,9 +64,13 @@ typedef struct {
 
 	char const	*header;	//!< Header format.
 	bool		locking;	//!< Whether the file should be locked.
+	bool		append_only;	//!< Keep a descriptor open per thread, opened with O_APPEND.
 
 	bool		log_srcdst;	//!< Add IP src/dst attributes to entries.
 
+	char const	*format_name;	//!< "text" or "binary".
+	bool		binary;		//!< Write binary records, instead of text.
+
 	bool		escape;		//!< do filename escaping, yes / no
 
 	xlat_escape_t	escape_func; //!< escape function
@@ -67,19 +78,103 @@ typedef struct {
 	exfile_t    	*ef;		//!< Log file handler
 
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
+
+	uint32_t	buffer_size;	//!< Bytes buffered per worker before flushing.  0 disables buffering.
+	fr_time_delta_t	flush_interval;	//!< Maximum time a record is buffered for.
+	bool		fsync;		//!< fsync() after writing each group of records.
+	bool		durable;	//!< Hold requests until their record is written.
+	char const	*compression_name;	//!< How binary batches are compressed.
+	fr_detail_compress_t compress;	//!< Parsed version of compression_name.
+	uint32_t	compression_level;	//!< zstd compression level.
+
+	detail_writer_t	*writer;	//!< Writes buffered records, NULL if buffering is disabled.
 } rlm_detail_t;
 
+/** Per-worker state for buffered writes
+ *
+ */
+typedef struct {
+	rlm_detail_t const	*inst;		//!< Instance data.
+	fr_event_list_t		*el;		//!< Worker's event list.
+	int			pipe[2];	//!< Written batches, read side is non-blocking.
+	uint32_t		outstanding;	//!< Batches held by the writer thread.
+
+	rbtree_t		*tree;		//!< Batches being filled, by filename.
+	fr_dlist_head_t		filling;	//!< Batches being filled, in order of creation.
+	size_t			buffered;	//!< Bytes in all batches being filled.
+	fr_event_timer_t const	*ev;		//!< Flushes batches at flush_interval.
+} rlm_detail_thread_t;
+
+/** Records for one file, from one worker
+ *
+ * Filled by the worker, then handed to the writer thread.  The writer
+ * only touches fd, data, len, block, block_len, result and entry.
+ */
+typedef struct {
+	char			*filename;	//!< Expanded filename.
+	rlm_detail_thread_t	*thread;	//!< Worker the batch belongs to.
+	uint8_t			*data;		//!< Formatted records.
+	size_t			len;		//!< Bytes of data used.
+	uint32_t		num_records;	//!< Number of records in data.
+	uint8_t			*block;		//!< Binary records wrapped in a block, malloc'd by the writer.
+	size_t			block_len;	//!< Length of the block.
+	int			fd;		//!< Private descriptor for the writer.
+	int			result;		//!< 0 on success, or errno of the failed write.
+	fr_dlist_head_t		waiting;	//!< Requests held until the batch is written.
+	fr_dlist_t		entry;		//!< Entry in the filling list, or the writer's queue.
+} detail_batch_t;
+
+/** A request waiting for its record to be written
+ *
+ */
+typedef struct {
+	REQUEST			*request;	//!< To resume.
+	detail_batch_t		*batch;		//!< Batch holding the record, NULL once written.
+	int			result;		//!< Result of the write.
+	fr_dlist_t		entry;		//!< Entry in the batch's waiting list.
+} detail_wait_t;
+
+struct detail_writer_s {
+	rlm_detail_t const	*inst;		//!< Instance data, for logging.
+	pthread_t		thread;		//!< Writing batches.
+	pthread_mutex_t		mutex;		//!< Protects the queue.
+	pthread_cond_t		cond;		//!< Signalled when batches are queued, or on exit.
+	fr_dlist_head_t		queue;		//!< Batches waiting to be written.
+	bool			fsync;		//!< fsync() after writing.
+	bool			stop;		//!< Tell the writer thread to exit.
+	bool			running;	//!< Writer thread was started.
+};
+
+static const CONF_PARSER buffer_config[] = {
+	{ FR_CONF_OFFSET("size", FR_TYPE_UINT32, rlm_detail_t, buffer_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("flush_interval", FR_TYPE_TIME_DELTA, rlm_detail_t, flush_interval), .dflt = "0.1" },
+	{ FR_CONF_OFFSET("fsync", FR_TYPE_BOOL, rlm_detail_t, fsync), .dflt = "no" },
+	{ FR_CONF_OFFSET("durable", FR_TYPE_BOOL, rlm_detail_t, durable), .dflt = "no" },
+	{ FR_CONF_OFFSET("compression", FR_TYPE_STRING, rlm_detail_t, compression_name), .dflt = "none" },
+	{ FR_CONF_OFFSET("compression_level", FR_TYPE_UINT32, rlm_detail_t, compression_level), .dflt = "3" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_detail_t, filename), .dflt = "%A/%{Packet-Src-IP-Address}/detail" },
 	{ FR_CONF_OFFSET("header", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_detail_t, header), .dflt = "%t" },
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_detail_t, perm), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", FR_TYPE_STRING, rlm_detail_t, group) },
 	{ FR_CONF_OFFSET("locking", FR_TYPE_BOOL, rlm_detail_t, locking), .dflt = "no" },
+	{ FR_CONF_OFFSET("append_only", FR_TYPE_BOOL, rlm_detail_t, append_only), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", FR_TYPE_BOOL, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET("format", FR_TYPE_STRING, rlm_detail_t, format_name), .dflt = "text" },
+	{ FR_CONF_POINTER("buffer", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) buffer_config },
 	CONF_PARSER_TERMINATOR
 };
 
+static fr_table_num_sorted_t const detail_format_table[] = {
+	{ "binary",	true	},
+	{ "text",	false	}
+};
+static size_t detail_format_table_len = NUM_ELEMENTS(detail_format_table);
+
 static fr_dict_t const *dict_freeradius;
 static fr_dict_t const *dict_radius;
 
@@ -140,6 +235,134 @@ static int detail_cmp(void const *a, void const *b)
 	return (a < b) - (a > b);
 }
 
+/** Wrap the binary records in a batch in a block
+ *
+ * This is done by the writer, so that workers don't spend their time
+ * compressing.
+ */
+static int detail_batch_block(rlm_detail_t const *inst, detail_batch_t *batch)
+{
+	size_t	size;
+	ssize_t	slen;
+
+	size = fr_detail_block_bound(batch->len, inst->compress);
+	batch->block = malloc(size);
+	if (!batch->block) return -1;
+
+	slen = fr_detail_block_encode(batch->block, size, batch->data, batch->len, batch->num_records,
+				      inst->compress, inst->compression_level);
+	if (slen < 0) {
+		PERROR("Failed creating block for %s", batch->filename);
+		free(batch->block);
+		batch->block = NULL;
+		return -1;
+	}
+	batch->block_len = slen;
+
+	return 0;
+}
+
+/** Write queued batches until told to stop
+ *
+ * Consecutive batches for the same file are written with a single
+ * writev(), and share an fsync().  Binary batches are each written
+ * as one block.
+ */
+static void *detail_writer_thread(void *arg)
+{
+	detail_writer_t	*writer = arg;
+	rlm_detail_t const *inst = writer->inst;
+	fr_dlist_head_t	todo;
+	detail_batch_t	*batch;
+
+	fr_dlist_init(&todo, detail_batch_t, entry);
+
+	pthread_mutex_lock(&writer->mutex);
+	for (;;) {
+		while (fr_dlist_empty(&writer->queue) && !writer->stop) {
+			pthread_cond_wait(&writer->cond, &writer->mutex);
+		}
+		if (fr_dlist_empty(&writer->queue)) break;
+
+		while ((batch = fr_dlist_head(&writer->queue))) {
+			fr_dlist_remove(&writer->queue, batch);
+			fr_dlist_insert_tail(&todo, batch);
+		}
+		pthread_mutex_unlock(&writer->mutex);
+
+		while ((batch = fr_dlist_head(&todo))) {
+			struct iovec	iov[DETAIL_IOV_MAX];
+			detail_batch_t	*group[DETAIL_IOV_MAX];
+			detail_batch_t	*next;
+			int		i, num = 0, result = 0;
+
+			for (next = batch;
+			     next && (num < DETAIL_IOV_MAX) && (strcmp(next->filename, batch->filename) == 0);
+			     next = fr_dlist_next(&todo, next)) {
+				if (inst->binary) {
+					if (detail_batch_block(inst, next) < 0) result = ENOMEM;
+					iov[num].iov_base = next->block;
+					iov[num].iov_len = next->block_len;
+				} else {
+					iov[num].iov_base = next->data;
+					iov[num].iov_len = next->len;
+				}
+				group[num++] = next;
+			}
+
+			/*
+			 *	Don't write part of a group.
+			 */
+			if (result == 0) {
+				if (fr_writev(batch->fd, iov, num, 0) < 0) {
+					result = errno;
+				} else if (writer->fsync && (fsync(batch->fd) < 0)) {
+					result = errno;
+				}
+			}
+
+			/*
+			 *	Worker descriptors share a file description,
+			 *	so one write covers the whole group.
+			 */
+			for (i = 0; i < num; i++) {
+				fr_dlist_remove(&todo, group[i]);
+				close(group[i]->fd);
+				group[i]->fd = -1;
+				free(group[i]->block);
+				group[i]->block = NULL;
+				group[i]->result = result;
+
+				if (write(group[i]->thread->pipe[1], &group[i], sizeof(group[i])) != sizeof(group[i])) {
+					ERROR("Failed returning batch to worker: %s", fr_syserror(errno));
+				}
+			}
+		}
+
+		pthread_mutex_lock(&writer->mutex);
+	}
+	pthread_mutex_unlock(&writer->mutex);
+
+	return NULL;
+}
+
+static int _detail_writer_free(detail_writer_t *writer)
+{
+	if (writer->running) {
+		pthread_mutex_lock(&writer->mutex);
+		writer->stop = true;
+		pthread_cond_signal(&writer->cond);
+		pthread_mutex_unlock(&writer->mutex);
+
+		pthread_join(writer->thread, NULL);
+	}
+
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->mutex);
+
+	return 0;
+}
+
 /*
  *	(Re-)read radiusd.conf into memory.
  */
@@ -160,7 +383,37 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		inst->escape_func = rad_filename_make_safe;
 	}
 
-	inst->ef = module_exfile_init(inst, conf, 256, 30, inst->locking, NULL, NULL);
+	if (inst->locking && inst->append_only) {
+		cf_log_err(conf, "\"append_only\" cannot be used with \"locking\"");
+		return -1;
+	}
+
+	{
+		int binary;
+
+		binary = fr_table_value_by_str(detail_format_table, inst->format_name, -1);
+		if (binary < 0) {
+			cf_log_err(conf, "Invalid \"format\" '%s', expected \"text\" or \"binary\"", inst->format_name);
+			return -1;
+		}
+		inst->binary = binary;
+	}
+
+	{
+		int compress;
+
+		compress = fr_table_value_by_str(fr_detail_compress_table, inst->compression_name, -1);
+		if (compress < 0) {
+			cf_log_err(conf, "Invalid \"buffer.compression\" '%s', expected \"none\" or \"zstd\"",
+				   inst->compression_name);
+			return -1;
+		}
+		inst->compress = compress;
+	}
+
+	inst->ef = module_exfile_init(inst, conf, 256, 30,
+				      inst->locking ? EXFILE_LOCKED : (inst->append_only ? EXFILE_APPEND : EXFILE_UNLOCKED),
+				      NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
 		return -1;
@@ -217,6 +470,67 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		}
 	}
 
+	if (inst->compress != FR_DETAIL_COMPRESS_NONE) {
+		if (!inst->binary || !inst->buffer_size) {
+			WARN("Ignoring \"buffer.compression\", it needs \"format = binary\" and buffering");
+			inst->compress = FR_DETAIL_COMPRESS_NONE;
+		} else {
+#ifndef HAVE_ZSTD_H
+			cf_log_err(conf, "\"buffer.compression = zstd\" is not available, "
+				   "the server was built without zstd");
+			return -1;
+#else
+			FR_INTEGER_BOUND_CHECK("buffer.compression_level", inst->compression_level, >=, 1);
+			FR_INTEGER_BOUND_CHECK("buffer.compression_level", inst->compression_level, <=, 19);
+#endif
+		}
+	}
+
+	if (!inst->buffer_size) {
+		if (inst->durable) WARN("Ignoring \"buffer.durable\", buffering is disabled");
+		return 0;
+	}
+
+	/*
+	 *	Locks are released as soon as the worker closes
+	 *	its descriptor, long before the writer is done.
+	 */
+	if (inst->locking) {
+		cf_log_err(conf, "\"locking\" cannot be used with buffered writes");
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("buffer.size", inst->buffer_size, >=, 512);
+
+	/*
+	 *	Each batch becomes one block.
+	 */
+	if (inst->binary) FR_INTEGER_BOUND_CHECK("buffer.size", inst->buffer_size, <=, FR_DETAIL_BLOCK_MAX / 2);
+	FR_TIME_DELTA_BOUND_CHECK("buffer.flush_interval", inst->flush_interval, >=, fr_time_delta_from_msec(1));
+	FR_TIME_DELTA_BOUND_CHECK("buffer.flush_interval", inst->flush_interval, <=, fr_time_delta_from_sec(10));
+
+	{
+		detail_writer_t	*writer;
+		int		ret;
+
+		MEM(writer = talloc_zero(inst, detail_writer_t));
+		pthread_mutex_init(&writer->mutex, NULL);
+		pthread_cond_init(&writer->cond, NULL);
+		fr_dlist_init(&writer->queue, detail_batch_t, entry);
+		writer->inst = inst;
+		writer->fsync = inst->fsync;
+		talloc_set_destructor(writer, _detail_writer_free);
+
+		ret = pthread_create(&writer->thread, NULL, detail_writer_thread, writer);
+		if (ret != 0) {
+			cf_log_err(conf, "Failed creating writer thread: %s", fr_syserror(ret));
+			talloc_free(writer);
+			return -1;
+		}
+		writer->running = true;
+		inst->writer = writer;
+	}
+
 	return 0;
 }
 
@@ -377,10 +691,461 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 	return 0;
 }
 
+typedef struct {
+	rlm_detail_t const	*inst;		//!< Instance data.
+	bool			compat;		//!< Entry is in compatibility mode.
+} detail_skip_ctx_t;
+
+/** Skip the same pairs as detail_write()
+ *
+ */
+static bool detail_binary_skip(VALUE_PAIR const *vp, void *uctx)
+{
+	detail_skip_ctx_t const	*skip = uctx;
+
+	if (skip->inst->ht && fr_hash_table_finddata(skip->inst->ht, vp->da)) return true;
+
+	return skip->compat && (vp->da == attr_user_password);
+}
+
+/** Encode a detail entry as a binary record
+ *
+ * The record is preceded by FR_DETAIL_BLOCK_HDR_LEN bytes, so that
+ * it can be written as a block on its own without copying it.
+ *
+ * @param[in] ctx	to allocate the record in.
+ * @param[out] out	The record, after the space for a block header.
+ * @param[in] inst	Instance of rlm_detail.
+ * @param[in] request	The current request.
+ * @param[in] packet	associated with the request (request, reply...).
+ * @param[in] compat	Write out entry in compatibility mode.
+ * @return
+ *	- The length of the record.
+ *	- 0 if the packet is empty.
+ *	- <0 on error.
+ */
+static ssize_t detail_binary_encode(TALLOC_CTX *ctx, uint8_t **out, rlm_detail_t const *inst,
+				    REQUEST *request, RADIUS_PACKET *packet, bool compat)
+{
+	detail_skip_ctx_t	skip = { .inst = inst, .compat = compat };
+	fr_detail_record_t	rec = {
+					.protocol = fr_dict_root(request->dict)->attr,
+					.timestamp = fr_time_to_unix_time(request->packet->timestamp)
+				};
+	VALUE_PAIR		*extra = NULL, *vp;
+	uint8_t			*buff = NULL;
+	size_t			size;
+	ssize_t			slen = -1;
+
+	if (!packet->vps) {
+		RWDEBUG("Skipping empty packet");
+		return 0;
+	}
+
+	if (!compat) {
+		MEM(vp = fr_pair_afrom_da(ctx, attr_packet_type));
+		vp->vp_uint32 = packet->code;
+		fr_pair_add(&extra, vp);
+	}
+
+	if (inst->log_srcdst) {
+		switch (packet->src_ipaddr.af) {
+		case AF_INET:
+			MEM(vp = fr_pair_afrom_da(ctx, attr_packet_src_ipv4_address));
+			vp->vp_ip = packet->src_ipaddr;
+			fr_pair_add(&extra, vp);
+
+			MEM(vp = fr_pair_afrom_da(ctx, attr_packet_dst_ipv4_address));
+			vp->vp_ip = packet->dst_ipaddr;
+			fr_pair_add(&extra, vp);
+			break;
+
+		case AF_INET6:
+			MEM(vp = fr_pair_afrom_da(ctx, attr_packet_src_ipv6_address));
+			vp->vp_ip = packet->src_ipaddr;
+			fr_pair_add(&extra, vp);
+
+			MEM(vp = fr_pair_afrom_da(ctx, attr_packet_dst_ipv6_address));
+			vp->vp_ip = packet->dst_ipaddr;
+			fr_pair_add(&extra, vp);
+			break;
+
+		default:
+			break;
+		}
+
+		MEM(vp = fr_pair_afrom_da(ctx, attr_packet_src_port));
+		vp->vp_uint16 = packet->src_port;
+		fr_pair_add(&extra, vp);
+
+		MEM(vp = fr_pair_afrom_da(ctx, attr_packet_dst_port));
+		vp->vp_uint16 = packet->dst_port;
+		fr_pair_add(&extra, vp);
+	}
+
+	/*
+	 *	Records are limited so that a buffered batch
+	 *	always fits in one block.
+	 */
+	for (size = 1024; size <= (FR_DETAIL_BLOCK_MAX / 2); size *= 2) {
+		MEM(buff = talloc_realloc(ctx, buff, uint8_t, FR_DETAIL_BLOCK_HDR_LEN + size));
+
+		slen = fr_detail_record_encode(buff + FR_DETAIL_BLOCK_HDR_LEN, size, &rec, request->dict,
+					       packet->vps, extra, detail_binary_skip, &skip);
+		if (slen > 0) break;
+	}
+	fr_pair_list_free(&extra);
+
+	if (slen <= 0) {
+		RPERROR("Failed encoding detail record");
+		talloc_free(buff);
+		return -1;
+	}
+
+	*out = buff;
+	return slen;
+}
+
+/** Write a single binary detail entry as a block
+ *
+ * @param[in] outfd	to write to.
+ * @param[in] inst	Instance of rlm_detail.
+ * @param[in] request	The current request.
+ * @param[in] packet	associated with the request (request, reply...).
+ * @param[in] compat	Write out entry in compatibility mode.
+ */
+static int detail_binary_write(int outfd, rlm_detail_t const *inst, REQUEST *request,
+			       RADIUS_PACKET *packet, bool compat)
+{
+	uint8_t			*buff;
+	ssize_t			slen;
+	fr_detail_block_t	block = { .compress = FR_DETAIL_COMPRESS_NONE, .num_records = 1 };
+
+	slen = detail_binary_encode(request, &buff, inst, request, packet, compat);
+	if (slen <= 0) return slen;
+
+	block.raw_len = block.stored_len = slen;
+	fr_detail_block_header_encode(buff, &block);
+	slen += FR_DETAIL_BLOCK_HDR_LEN;
+
+	/*
+	 *	The block has to go in one write(), so that other
+	 *	writers can't put anything in the middle of it.
+	 */
+	if ((fcntl(outfd, F_SETFL, fcntl(outfd, F_GETFL) | O_APPEND) < 0) ||
+	    (write(outfd, buff, slen) != slen)) {
+		RERROR("Failed writing to detail file: %s", fr_syserror(errno));
+		talloc_free(buff);
+		return -1;
+	}
+	talloc_free(buff);
+
+	return 0;
+}
+
+/** Open a detail file, and set its group
+ *
+ * @param[in] inst	Instance of rlm_detail.
+ * @param[in] request	The current request, may be NULL.
+ * @param[in] filename	Expanded filename.
+ * @return
+ *	- A descriptor from exfile_open().
+ *	- -1 on failure.
+ */
+static int detail_open(rlm_detail_t const *inst, REQUEST *request, char const *filename)
+{
+	int		outfd;
+
+#ifdef HAVE_GRP_H
+	gid_t		gid;
+	char		*endptr;
+#endif
+
+	outfd = exfile_open(inst->ef, request, filename, inst->perm);
+	if (outfd < 0) {
+		ROPTIONAL(RPERROR, PERROR, "Couldn't open file %s", filename);
+		/* coverity[missing_unlock] */
+		return -1;
+	}
+
+#ifdef HAVE_GRP_H
+	if (inst->group != NULL) {
+		gid = strtol(inst->group, &endptr, 10);
+		if (*endptr != '\0') {
+			if (rad_getgid(request, &gid, inst->group) < 0) {
+				ROPTIONAL(RDEBUG2, DEBUG2, "Unable to find system group '%s'", inst->group);
+				return outfd;
+			}
+		}
+
+		if (chown(filename, -1, gid) == -1) {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Unable to change system group of '%s'", filename);
+		}
+	}
+#endif
+
+	return outfd;
+}
+
+static void detail_flush(rlm_detail_thread_t *t);
+
+/** Release requests waiting on a batch, and free it
+ *
+ */
+static void detail_batch_done(detail_batch_t *batch, int result)
+{
+	rlm_detail_t const	*inst = batch->thread->inst;
+	detail_wait_t		*wait;
+
+	if (result != 0) ERROR("Failed writing to %s: %s", batch->filename, fr_syserror(result));
+
+	while ((wait = fr_dlist_head(&batch->waiting))) {
+		fr_dlist_remove(&batch->waiting, wait);
+		wait->batch = NULL;
+		wait->result = result;
+		unlang_interpret_resumable(wait->request);
+	}
+
+	talloc_free(batch);
+}
+
+static int detail_batch_cmp(void const *one, void const *two)
+{
+	detail_batch_t const *a = one, *b = two;
+
+	return strcmp(a->filename, b->filename);
+}
+
+static void _detail_flush_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_detail_thread_t	*t = talloc_get_type_abort(uctx, rlm_detail_thread_t);
+
+	t->ev = NULL;	/* Already fired */
+	detail_flush(t);
+}
+
+/** Hand every batch being filled to the writer thread
+ *
+ * Files are opened here, so that exfile, and its triggers, are
+ * only used from the worker.
+ */
+static void detail_flush(rlm_detail_thread_t *t)
+{
+	rlm_detail_t const	*inst = t->inst;
+	detail_writer_t		*writer = inst->writer;
+	fr_dlist_head_t		ready;
+	detail_batch_t		*batch;
+
+	if (t->ev) fr_event_timer_delete(&t->ev);
+
+	fr_dlist_init(&ready, detail_batch_t, entry);
+
+	while ((batch = fr_dlist_head(&t->filling))) {
+		int outfd;
+
+		fr_dlist_remove(&t->filling, batch);
+		rbtree_deletebydata(t->tree, batch);
+
+		outfd = detail_open(inst, NULL, batch->filename);
+		if (outfd < 0) {
+			detail_batch_done(batch, EIO);
+			continue;
+		}
+
+		/*
+		 *	The writer gets its own descriptor.  O_APPEND is
+		 *	set on the shared file description, so workers
+		 *	writing to the same file can't overwrite each
+		 *	other's records.
+		 */
+		batch->fd = dup(outfd);
+		if ((batch->fd < 0) || (fcntl(batch->fd, F_SETFL, fcntl(batch->fd, F_GETFL) | O_APPEND) < 0)) {
+			int err = errno;
+
+			if (batch->fd >= 0) close(batch->fd);
+			batch->fd = -1;
+			exfile_close(inst->ef, NULL, outfd);
+			detail_batch_done(batch, err);
+			continue;
+		}
+		exfile_close(inst->ef, NULL, outfd);
+
+		fr_dlist_insert_tail(&ready, batch);
+		t->outstanding++;
+	}
+	t->buffered = 0;
+
+	if (fr_dlist_empty(&ready)) return;
+
+	pthread_mutex_lock(&writer->mutex);
+	while ((batch = fr_dlist_head(&ready))) {
+		fr_dlist_remove(&ready, batch);
+		fr_dlist_insert_tail(&writer->queue, batch);
+	}
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+}
+
+/** Release requests whose records have been written
+ *
+ */
+static void detail_pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_detail_thread_t	*t = talloc_get_type_abort(uctx, rlm_detail_thread_t);
+	detail_batch_t		*batch;
+
+	while (read(fd, &batch, sizeof(batch)) == sizeof(batch)) {
+		t->outstanding--;
+		detail_batch_done(batch, batch->result);
+	}
+}
+
+static rlm_rcode_t detail_buffer_resume(UNUSED module_ctx_t const *mctx, REQUEST *request, void *rctx)
+{
+	detail_wait_t	*wait = talloc_get_type_abort(rctx, detail_wait_t);
+	int		result = wait->result;
+
+	talloc_free(wait);
+
+	if (result != 0) {
+		REDEBUG("Failed writing detail record: %s", fr_syserror(result));
+		return RLM_MODULE_FAIL;
+	}
+
+	return RLM_MODULE_OK;
+}
+
+static void detail_buffer_signal(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request, void *rctx,
+				 fr_state_signal_t action)
+{
+	detail_wait_t	*wait = talloc_get_type_abort(rctx, detail_wait_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	/*
+	 *	The record is still written, we just
+	 *	don't wait for it.
+	 */
+	if (wait->batch) fr_dlist_remove(&wait->batch->waiting, wait);
+	talloc_free(wait);
+}
+
+/** Add a detail entry to the worker's buffer
+ *
+ * @param[in] mctx	Module calling ctx.
+ * @param[in] request	The current request.
+ * @param[in] filename	Expanded filename.
+ * @param[in] packet	associated with the request (request, reply...).
+ * @param[in] compat	Write out entry in compatibility mode.
+ * @return
+ *	- RLM_MODULE_OK if the entry was buffered.
+ *	- RLM_MODULE_YIELD if the request is held until the entry is written.
+ *	- RLM_MODULE_FAIL on error.
+ */
+static rlm_rcode_t detail_buffer(module_ctx_t const *mctx, REQUEST *request, char const *filename,
+				 RADIUS_PACKET *packet, bool compat)
+{
+	rlm_detail_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_detail_t);
+	rlm_detail_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_detail_thread_t);
+	detail_batch_t		*batch;
+	detail_wait_t		*wait;
+	FILE			*fp;
+	char			*record = NULL;
+	uint8_t			*binary = NULL;
+	uint8_t const		*data;
+	size_t			len = 0;
+
+	/*
+	 *	Format the entry, so a failure part way through
+	 *	doesn't leave a partial entry in the batch.
+	 */
+	if (inst->binary) {
+		ssize_t slen;
+
+		slen = detail_binary_encode(request, &binary, inst, request, packet, compat);
+		if (slen < 0) return RLM_MODULE_FAIL;
+		if (slen == 0) return RLM_MODULE_OK;
+
+		data = binary + FR_DETAIL_BLOCK_HDR_LEN;
+		len = slen;
+	} else {
+		fp = open_memstream(&record, &len);
+		if (!fp) {
+			RERROR("Failed opening memory stream: %s", fr_syserror(errno));
+			return RLM_MODULE_FAIL;
+		}
+		if (detail_write(fp, inst, request, packet, compat) < 0) {
+			fclose(fp);
+			free(record);
+			return RLM_MODULE_FAIL;
+		}
+		fclose(fp);
+
+		if (len == 0) {
+			free(record);
+			return RLM_MODULE_OK;
+		}
+		data = (uint8_t const *) record;
+	}
+
+	/*
+	 *	Group commit.  Flush what we have if this entry
+	 *	would take us over the limit.
+	 */
+	if ((t->buffered + len) > inst->buffer_size) detail_flush(t);
+
+	{
+		detail_batch_t find;
+
+		memcpy(&find.filename, &filename, sizeof(find.filename)); /* const issues */
+		batch = rbtree_finddata(t->tree, &find);
+	}
+	if (!batch) {
+		MEM(batch = talloc_zero(t, detail_batch_t));
+		MEM(batch->filename = talloc_typed_strdup(batch, filename));
+		batch->thread = t;
+		batch->fd = -1;
+		fr_dlist_init(&batch->waiting, detail_wait_t, entry);
+		rbtree_insert(t->tree, batch);
+		fr_dlist_insert_tail(&t->filling, batch);
+	}
+
+	if ((batch->len + len) > talloc_array_length(batch->data)) {
+		size_t size = talloc_array_length(batch->data) * 2;
+
+		if (size < (batch->len + len)) size = batch->len + len;
+		MEM(batch->data = talloc_realloc(batch, batch->data, uint8_t, size));
+	}
+	memcpy(batch->data + batch->len, data, len);
+	batch->len += len;
+	batch->num_records++;
+	t->buffered += len;
+	if (binary) {
+		talloc_free(binary);
+	} else {
+		free(record);
+	}
+
+	if (!t->ev && (fr_event_timer_in(t, t->el, &t->ev, inst->flush_interval, _detail_flush_timer, t) < 0)) {
+		RPWARN("Failed arming flush timer, flushing now");
+		detail_flush(t);
+		return RLM_MODULE_OK;
+	}
+
+	if (!inst->durable) return RLM_MODULE_OK;
+
+	MEM(wait = talloc_zero(request, detail_wait_t));
+	wait->request = request;
+	wait->batch = batch;
+	fr_dlist_insert_tail(&batch->waiting, wait);
+
+	return unlang_module_yield(request, detail_buffer_resume, detail_buffer_signal, wait);
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
-static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) detail_do(module_ctx_t const *mctx, REQUEST *request,
 					      RADIUS_PACKET *packet, bool compat)
 {
 	int		outfd, dupfd;
@@ -388,12 +1153,7 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *req
 
 	FILE		*outfp;
 
-#ifdef HAVE_GRP_H
-	gid_t		gid;
-	char		*endptr;
-#endif
-
-	rlm_detail_t const *inst = talloc_get_type_abort_const(instance, rlm_detail_t);
+	rlm_detail_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_detail_t);
 
 	/*
 	 *	Generate the path for the detail file.  Use the same
@@ -406,28 +1166,20 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *req
 
 	RDEBUG2("%s expands to %s", inst->filename, buffer);
 
-	outfd = exfile_open(inst->ef, request, buffer, inst->perm);
-	if (outfd < 0) {
-		RPERROR("Couldn't open file %s", buffer);
-		/* coverity[missing_unlock] */
-		return RLM_MODULE_FAIL;
-	}
+	if (inst->writer) return detail_buffer(mctx, request, buffer, packet, compat);
 
-	if (inst->group != NULL) {
-		gid = strtol(inst->group, &endptr, 10);
-		if (*endptr != '\0') {
-			if (rad_getgid(request, &gid, inst->group) < 0) {
-				RDEBUG2("Unable to find system group '%s'", inst->group);
-				goto skip_group;
-			}
-		}
+	outfd = detail_open(inst, request, buffer);
+	if (outfd < 0) return RLM_MODULE_FAIL;
 
-		if (chown(buffer, -1, gid) == -1) {
-			RDEBUG2("Unable to change system group of '%s'", buffer);
-		}
+	if (inst->binary) {
+		int ret;
+
+		ret = detail_binary_write(outfd, inst, request, packet, compat);
+		exfile_close(inst->ef, request, outfd);
+
+		return (ret < 0) ? RLM_MODULE_FAIL : RLM_MODULE_OK;
 	}
 
-skip_group:
 	outfp = NULL;
 	dupfd = dup(outfd);
 	if (dupfd < 0) {
@@ -465,7 +1217,7 @@ skip_group:
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQUEST *request)
 {
-	return detail_do(mctx->instance, request, request->packet, true);
+	return detail_do(mctx, request, request->packet, true);
 }
 
 /*
@@ -473,7 +1225,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQ
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQUEST *request)
 {
-	return detail_do(mctx->instance, request, request->packet, false);
+	return detail_do(mctx, request, request->packet, false);
 }
 
 /*
@@ -481,7 +1233,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQU
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(module_ctx_t const *mctx, REQUEST *request)
 {
-	return detail_do(mctx->instance, request, request->reply, false);
+	return detail_do(mctx, request, request->reply, false);
 }
 
 #ifdef WITH_COA
@@ -490,7 +1242,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(module_ctx_t const *mctx, REQU
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_recv_coa(module_ctx_t const *mctx, REQUEST *request)
 {
-	return detail_do(mctx->instance, request, request->packet, false);
+	return detail_do(mctx, request, request->packet, false);
 }
 
 /*
@@ -498,7 +1250,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_recv_coa(module_ctx_t const *mctx, REQUE
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_send_coa(module_ctx_t const *mctx, REQUEST *request)
 {
-	return detail_do(mctx->instance, request, request->reply, false);
+	return detail_do(mctx, request, request->reply, false);
 }
 #endif
 
@@ -508,7 +1260,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_send_coa(module_ctx_t const *mctx, REQUE
 #ifdef WITH_PROXY
 static rlm_rcode_t CC_HINT(nonnull) mod_pre_proxy(module_ctx_t const *mctx, REQUEST *request)
 {
-	return detail_do(mctx->instance, request, request->proxy->packet, false);
+	return detail_do(mctx, request, request->proxy->packet, false);
 }
 
 
@@ -534,10 +1286,75 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_proxy(module_ctx_t const *mctx, REQ
 		return rcode;
 	}
 
-	return detail_do(mctx->instance, request, request->proxy->reply, false);
+	return detail_do(mctx, request, request->proxy->reply, false);
 }
 #endif
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_detail_t		*inst = talloc_get_type_abort(instance, rlm_detail_t);
+	rlm_detail_thread_t	*t = talloc_get_type_abort(thread, rlm_detail_thread_t);
+
+	t->inst = inst;
+	t->el = el;
+	t->pipe[0] = t->pipe[1] = -1;
+
+	if (!inst->writer) return 0;
+
+	MEM(t->tree = rbtree_talloc_alloc(t, detail_batch_cmp, detail_batch_t, NULL, 0));
+	fr_dlist_init(&t->filling, detail_batch_t, entry);
+
+	if (pipe(t->pipe) < 0) {
+		ERROR("Failed creating writer pipe: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (fr_nonblock(t->pipe[0]) < 0) {
+		PERROR("Failed setting writer pipe non-blocking");
+	error:
+		close(t->pipe[0]);
+		close(t->pipe[1]);
+		t->pipe[0] = t->pipe[1] = -1;
+		return -1;
+	}
+
+	if (fr_event_fd_insert(t, el, t->pipe[0], detail_pipe_read, NULL, NULL, t) < 0) {
+		PERROR("Failed inserting writer pipe into event loop");
+		goto error;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(fr_event_list_t *el, void *thread)
+{
+	rlm_detail_thread_t	*t = talloc_get_type_abort(thread, rlm_detail_thread_t);
+	detail_batch_t		*batch;
+
+	if (t->pipe[0] < 0) return 0;
+
+	/*
+	 *	Write out anything still buffered, and wait for
+	 *	the writer to return all of our batches, so it
+	 *	doesn't write to a closed pipe.
+	 */
+	detail_flush(t);
+
+	fr_event_fd_delete(el, t->pipe[0], FR_EVENT_FILTER_IO);
+
+	fr_blocking(t->pipe[0]);
+	while ((t->outstanding > 0) && (read(t->pipe[0], &batch, sizeof(batch)) == sizeof(batch))) {
+		t->outstanding--;
+		detail_batch_done(batch, batch->result);
+	}
+
+	close(t->pipe[0]);
+	close(t->pipe[1]);
+
+	return 0;
+}
+
 /* globally exported name */
 extern module_t rlm_detail;
 module_t rlm_detail = {
@@ -547,6 +1364,9 @@ module_t rlm_detail = {
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_detail_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 		[MOD_PREACCT]		= mod_accounting,
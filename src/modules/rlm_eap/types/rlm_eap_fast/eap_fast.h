@@ -186,6 +186,8 @@ typedef struct {
 	char const		*authority_identity;
 	uint8_t const 		*a_id;
 	uint8_t const 		*pac_opaque_key;
+	fr_hash_table_t		*pac_cache;			//!< Decrypted PAC-Opaques for the thread
+								///< processing this round.  Set every round.
 
 	struct {
 		uint8_t			*key;
@@ -27,6 +27,7 @@
 RCSID("$Id$")
 USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/md5.h>
 
 #include "eap_fast.h"
@@ -56,6 +57,30 @@ typedef struct {
 	char const		*pac_opaque_key;			//!< The key used to encrypt PAC-Opaque
 } rlm_eap_fast_t;
 
+/** Maximum number of decrypted PAC-Opaques each thread remembers
+ *
+ */
+#define EAP_FAST_PAC_CACHE_MAX	(4096)
+
+/** A PAC-Opaque we've already decrypted and validated
+ *
+ * The PAC-Opaque is encrypted with a key which doesn't change while the
+ * server is running, so the same PAC-Opaque always decrypts to the same
+ * PAC.
+ */
+typedef struct {
+	uint8_t const		*opaque;			//!< PAC-Opaque as received.
+	size_t			opaque_len;			//!< Length of the PAC-Opaque.
+
+	eap_fast_pac_type_t	type;				//!< Of the PAC.
+	uint32_t		expires;			//!< When the PAC expires.
+	uint8_t			key[PAC_KEY_LENGTH];		//!< PAC key.
+} eap_fast_pac_cache_entry_t;
+
+typedef struct {
+	fr_hash_table_t		*pac_cache;			//!< Decrypted PAC-Opaques, keyed by their contents.
+} rlm_eap_fast_thread_t;
+
 
 static CONF_PARSER submodule_config[] = {
 	{ FR_CONF_OFFSET("tls", FR_TYPE_STRING, rlm_eap_fast_t, tls_conf_name) },
@@ -234,6 +259,87 @@ static int mod_instantiate(void *instance, CONF_SECTION *cs)
 	return 0;
 }
 
+static uint32_t pac_cache_hash(void const *data)
+{
+	eap_fast_pac_cache_entry_t const *entry = data;
+
+	return fr_hash(entry->opaque, entry->opaque_len);
+}
+
+static int pac_cache_cmp(void const *one, void const *two)
+{
+	eap_fast_pac_cache_entry_t const *a = one, *b = two;
+
+	if (a->opaque_len != b->opaque_len) return (a->opaque_len < b->opaque_len) - (a->opaque_len > b->opaque_len);
+
+	return memcmp(a->opaque, b->opaque, a->opaque_len);
+}
+
+static void pac_cache_free(void *data)
+{
+	eap_fast_pac_cache_entry_t *entry = data;
+
+	memset(entry->key, 0, sizeof(entry->key));
+	talloc_free(entry);
+}
+
+/** Fill in the tunnel's PAC from a cached PAC-Opaque
+ *
+ * @return
+ *	- true if the PAC-Opaque was found.
+ *	- false if it needs decrypting.
+ */
+static bool pac_cache_find(REQUEST *request, eap_fast_tunnel_t *t, uint8_t const *opaque, size_t opaque_len)
+{
+	eap_fast_pac_cache_entry_t	*entry;
+
+	if (!t->pac_cache) return false;
+
+	entry = fr_hash_table_finddata(t->pac_cache, &(eap_fast_pac_cache_entry_t){
+						.opaque = opaque,
+						.opaque_len = opaque_len
+					});
+	if (!entry) return false;
+
+	/*
+	 *	It'll be re-provisioned, so there's no point
+	 *	remembering it any more.
+	 */
+	if (entry->expires <= time(NULL)) {
+		fr_hash_table_delete(t->pac_cache, entry);
+		return false;
+	}
+
+	RDEBUG2("PAC-Opaque has already been validated");
+
+	t->pac.type = entry->type;
+	t->pac.expires = entry->expires;
+	t->pac.expired = false;
+	MEM(t->pac.key = talloc_memdup(t, entry->key, PAC_KEY_LENGTH));
+
+	return true;
+}
+
+/** Remember a PAC-Opaque which decrypted and validated correctly
+ *
+ */
+static void pac_cache_insert(eap_fast_tunnel_t *t, uint8_t const *opaque, size_t opaque_len)
+{
+	eap_fast_pac_cache_entry_t	*entry;
+
+	if (!t->pac_cache || t->pac.expired) return;
+	if (fr_hash_table_num_elements(t->pac_cache) >= EAP_FAST_PAC_CACHE_MAX) return;
+
+	MEM(entry = talloc_zero(t->pac_cache, eap_fast_pac_cache_entry_t));
+	MEM(entry->opaque = talloc_memdup(entry, opaque, opaque_len));
+	entry->opaque_len = opaque_len;
+	entry->type = t->pac.type;
+	entry->expires = t->pac.expires;
+	memcpy(entry->key, t->pac.key, PAC_KEY_LENGTH);
+
+	if (fr_hash_table_insert(t->pac_cache, entry) != 1) pac_cache_free(entry);
+}
+
 /** Allocate the FAST per-session data
  *
  */
@@ -369,6 +475,8 @@ error:
 		goto error;
 	}
 
+	if (pac_cache_find(request, t, data, sizeof(opaque->hdr) + length)) goto done;
+
 	dlen = length - sizeof(opaque->aad) - sizeof(opaque->iv) - sizeof(opaque->tag);
 	plen = eap_fast_decrypt(opaque->data, dlen, opaque->aad, PAC_A_ID_LENGTH,
 			        (uint8_t const *) opaque->tag, t->pac_opaque_key, opaque->iv,
@@ -439,6 +547,9 @@ error:
 		goto error;
 	}
 
+	pac_cache_insert(t, data, sizeof(opaque->hdr) + length);
+
+done:
 	if (!SSL_set_session_secret_cb(tls_session->ssl, _session_secret, tls_session)) {
 		RERROR("Failed setting SSL session secret callback");
 		return 0;
@@ -454,6 +565,7 @@ error:
 static rlm_rcode_t mod_process(module_ctx_t const *mctx, REQUEST *request)
 {
 	rlm_eap_fast_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_eap_fast_t);
+	rlm_eap_fast_thread_t	*thread = talloc_get_type_abort(mctx->thread, rlm_eap_fast_thread_t);
 	eap_tls_status_t	status;
 
 	eap_session_t		*eap_session = eap_session_get(request->parent);
@@ -466,6 +578,11 @@ static rlm_rcode_t mod_process(module_ctx_t const *mctx, REQUEST *request)
 	 */
 	if (!tls_session->opaque) tls_session->opaque = eap_fast_alloc(tls_session, inst);
 
+	/*
+	 *	Rounds may be processed by different threads.
+	 */
+	((eap_fast_tunnel_t *)tls_session->opaque)->pac_cache = thread->pac_cache;
+
 	/*
 	 *	Process TLS layer until done.
 	 */
@@ -497,6 +614,13 @@ static rlm_rcode_t mod_process(module_ctx_t const *mctx, REQUEST *request)
 	case EAP_TLS_HANDLED:
 		return RLM_MODULE_HANDLED;
 
+	/*
+	 *	The handshake is waiting on an asynchronous
+	 *	crypto operation, come back when it's done.
+	 */
+	case EAP_TLS_YIELD:
+		return eap_tls_yield(request, eap_session, mod_process);
+
 	/*
 	 *	Handshake is done, proceed with decoding tunneled
 	 *	data.
@@ -640,6 +764,20 @@ static rlm_rcode_t mod_session_init(module_ctx_t const *mctx, REQUEST *request)
 }
 
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, UNUSED void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_eap_fast_thread_t	*t = talloc_get_type_abort(thread, rlm_eap_fast_thread_t);
+
+	t->pac_cache = fr_hash_table_create(t, pac_cache_hash, pac_cache_cmp, pac_cache_free);
+	if (!t->pac_cache) {
+		ERROR("Failed creating PAC cache");
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -654,6 +792,10 @@ rlm_eap_submodule_t rlm_eap_fast = {
 	.config		= submodule_config,
 	.instantiate	= mod_instantiate,	/* Create new submodule instance */
 
+	.thread_inst_size	= sizeof(rlm_eap_fast_thread_t),
+	.thread_inst_type	= "rlm_eap_fast_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+
 	.session_init	= mod_session_init,	/* Initialise a new EAP session */
 	.entry_point	= mod_process		/* Process next round of EAP method */
 };
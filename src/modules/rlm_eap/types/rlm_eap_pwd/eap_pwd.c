@@ -107,22 +107,22 @@ static BIGNUM *consttime_BN (void)
 /*
  * compute the legendre symbol in constant time
  */
-static int legendre(BIGNUM *a, BIGNUM *p, BN_CTX *bnctx)
+static int legendre(BIGNUM *a, pwd_group_t const *grp, BN_CTX *bnctx)
 {
 	int		symbol;
 	unsigned int	mask;
-	BIGNUM		*res, *pm1over2;
+	BIGNUM		*res;
 
-	pm1over2 = consttime_BN();
-	res = consttime_BN();
-
-	if (!BN_sub(pm1over2, p, BN_value_one()) ||
-	    !BN_rshift1(pm1over2, pm1over2) ||
-	    !BN_mod_exp_mont_consttime(res, a, pm1over2, p, bnctx, NULL)) {
-		BN_free(pm1over2);
-		BN_free(res);
+	BN_CTX_start(bnctx);
+	res = BN_CTX_get(bnctx);
+	if (!res) {
+	error:
+		BN_CTX_end(bnctx);
 		return -2;
 	}
+	BN_set_flags(res, BN_FLG_CONSTTIME);
+
+	if (!BN_mod_exp_mont_consttime(res, a, grp->pm1over2, grp->prime, bnctx, NULL)) goto error;
 
 	symbol = -1;
 	mask = const_time_eq(BN_is_word(res, 1), 1);
@@ -130,83 +130,62 @@ static int legendre(BIGNUM *a, BIGNUM *p, BN_CTX *bnctx)
 	mask = const_time_eq(BN_is_zero(res), 1);
 	symbol = const_time_select_int(mask, -1, symbol);
 
-	BN_free(pm1over2);
-	BN_free(res);
+	BN_CTX_end(bnctx);
 
 	return symbol;
 }
 
-static void do_equation(EC_GROUP *group, BIGNUM *y2, BIGNUM *x, BN_CTX *bnctx)
+static void do_equation(pwd_group_t const *grp, BIGNUM *y2, BIGNUM *x, BN_CTX *bnctx)
 {
-	BIGNUM *p, *a, *b, *tmp1, *pm1;
-
-	tmp1 = BN_new();
-	pm1 = BN_new();
-	p = BN_new();
-	a = BN_new();
-	b = BN_new();
-	EC_GROUP_get_curve_GFp(group, p, a, b, bnctx);
+	BIGNUM *tmp1;
 
-	BN_sub(pm1, p, BN_value_one());
+	BN_CTX_start(bnctx);
+	tmp1 = BN_CTX_get(bnctx);
+	if (!tmp1) {
+		BN_CTX_end(bnctx);
+		return;
+	}
 
 	/*
 	 * y2 = x^3 + ax + b
 	 */
-	BN_mod_sqr(tmp1, x, p, bnctx);
-	BN_mod_mul(y2, tmp1, x, p, bnctx);
-	BN_mod_mul(tmp1, a, x, p, bnctx);
-	BN_mod_add_quick(y2, y2, tmp1, p);
-	BN_mod_add_quick(y2, y2, b, p);
-
-	BN_free(tmp1);
-	BN_free(pm1);
-	BN_free(p);
-	BN_free(a);
-	BN_free(b);
-
-	return;
+	BN_mod_sqr(tmp1, x, grp->prime, bnctx);
+	BN_mod_mul(y2, tmp1, x, grp->prime, bnctx);
+	BN_mod_mul(tmp1, grp->a, x, grp->prime, bnctx);
+	BN_mod_add_quick(y2, y2, tmp1, grp->prime);
+	BN_mod_add_quick(y2, y2, grp->b, grp->prime);
+
+	BN_CTX_end(bnctx);
 }
 
-static int is_quadratic_residue(BIGNUM *val, BIGNUM *p, BIGNUM *qr, BIGNUM *qnr, BN_CTX *bnctx)
+/*
+ * qr_bin, qnr_bin and qr_or_qnr_bin are all primebytelen long, the first
+ * two holding the quadratic residue and non-residue, zero padded.
+ */
+static int is_quadratic_residue(BIGNUM *val, pwd_group_t const *grp,
+				uint8_t const *qr_bin, uint8_t const *qnr_bin, uint8_t *qr_or_qnr_bin,
+				BN_CTX *bnctx)
 {
-	int offset, check, ret = 0;
-	BIGNUM *r = NULL, *pm1 = NULL, *res = NULL, *qr_or_qnr = NULL;
+	int check, ret = 0;
+	BIGNUM *r, *res, *qr_or_qnr;
 	unsigned int mask;
-	unsigned char *qr_bin = NULL, *qnr_bin = NULL, *qr_or_qnr_bin = NULL;
-
-	if (((r = consttime_BN()) == NULL) ||
-	    ((res = consttime_BN()) == NULL) ||
-	    ((qr_or_qnr = consttime_BN()) == NULL) ||
-	    ((pm1 = consttime_BN()) == NULL)) {
-		ret = -2;
-		goto fail;
-	}
 
-	if (((qr_bin = (unsigned char *)malloc(BN_num_bytes(p))) == NULL) ||
-	    ((qnr_bin = (unsigned char *)malloc(BN_num_bytes(p))) == NULL) ||
-	    ((qr_or_qnr_bin = (unsigned char *)malloc(BN_num_bytes(p))) == NULL)) {
+	BN_CTX_start(bnctx);
+	r = BN_CTX_get(bnctx);
+	res = BN_CTX_get(bnctx);
+	qr_or_qnr = BN_CTX_get(bnctx);
+	if (!qr_or_qnr) {
 		ret = -2;
 		goto fail;
 	}
-
-	/*
-	 * we select binary in constant time so make them binary
-	 */
-	memset(qr_bin, 0, BN_num_bytes(p));
-	memset(qnr_bin, 0, BN_num_bytes(p));
-	memset(qr_or_qnr_bin, 0, BN_num_bytes(p));
-
-	offset = BN_num_bytes(p) - BN_num_bytes(qr);
-	BN_bn2bin(qr, qr_bin + offset);
-
-	offset = BN_num_bytes(p) - BN_num_bytes(qnr);
-	BN_bn2bin(qnr, qnr_bin + offset);
+	BN_set_flags(r, BN_FLG_CONSTTIME);
+	BN_set_flags(res, BN_FLG_CONSTTIME);
+	BN_set_flags(qr_or_qnr, BN_FLG_CONSTTIME);
 
 	/*
 	 * r = (random() mod p-1) + 1
 	 */
-	BN_sub(pm1, p, BN_value_one());
-	BN_rand_range(r, pm1);
+	BN_rand_range(r, grp->pm1);
 	BN_add(r, r, BN_value_one());
 
 	BN_copy(res, val);
@@ -214,20 +193,20 @@ static int is_quadratic_residue(BIGNUM *val, BIGNUM *p, BIGNUM *qr, BIGNUM *qnr,
 	/*
 	 * res = val * r * r which ensures res != val but has same quadratic residocity
 	 */
-	BN_mod_mul(res, res, r, p, bnctx);
-	BN_mod_mul(res, res, r, p, bnctx);
+	BN_mod_mul(res, res, r, grp->prime, bnctx);
+	BN_mod_mul(res, res, r, grp->prime, bnctx);
 
 	/*
 	 * if r is even (mask is -1) then multiply by qnr and our check is qnr
 	 * otherwise multiply by qr and our check is qr
 	 */
 	mask = const_time_is_zero(BN_is_odd(r));
-	const_time_select_bin(mask, qnr_bin, qr_bin, BN_num_bytes(p), qr_or_qnr_bin);
-	BN_bin2bn(qr_or_qnr_bin, BN_num_bytes(p), qr_or_qnr);
-	BN_mod_mul(res, res, qr_or_qnr, p, bnctx);
+	const_time_select_bin(mask, qnr_bin, qr_bin, grp->primebytelen, qr_or_qnr_bin);
+	BN_bin2bn(qr_or_qnr_bin, grp->primebytelen, qr_or_qnr);
+	BN_mod_mul(res, res, qr_or_qnr, grp->prime, bnctx);
 	check = const_time_select_int(mask, -1, 1);
 
-	if ((ret = legendre(res, p, bnctx)) == -2) {
+	if ((ret = legendre(res, grp, bnctx)) == -2) {
 		ret = -1;	/* just say no it's not */
 		goto fail;
 	}
@@ -235,59 +214,127 @@ static int is_quadratic_residue(BIGNUM *val, BIGNUM *p, BIGNUM *qr, BIGNUM *qnr,
 	ret = const_time_select_int(mask, 1, 0);
 
 fail:
-	if (qr_bin != NULL) free(qr_bin);
-	if (qnr_bin != NULL) free(qnr_bin);
-	if (qr_or_qnr_bin != NULL) free(qr_or_qnr_bin);
-	BN_free(r);
-	BN_free(res);
-	BN_free(qr_or_qnr);
-	BN_free(pm1);
+	BN_CTX_end(bnctx);
 
 	return ret;
 }
 
-int compute_password_element (REQUEST *request, pwd_session_t *session, uint16_t grp_num,
-			      char const *password, int password_len,
-			      char const *id_server, int id_server_len,
-			      char const *id_peer, int id_peer_len,
-			      uint32_t *token, BN_CTX *bnctx)
+static int pwd_group_nid(uint16_t grp_num)
 {
-	BIGNUM *x_candidate = NULL, *rnd = NULL, *y_sqrd = NULL, *qr = NULL, *qnr = NULL;
-	HMAC_CTX *ctx = NULL;
-	uint8_t pwe_digest[SHA256_DIGEST_LENGTH], *prfbuf = NULL, *xbuf = NULL, *pm1buf = NULL, ctr;
-	int nid, is_odd, primebitlen, primebytelen, ret = 0, found = 0, mask;
-	int save, i, rbits, qr_or_qnr, save_is_odd = 0, cmp;
-	unsigned int skip;
-
-	ctx = HMAC_CTX_new();
-	if (ctx == NULL) {
-		DEBUG("failed allocating HMAC context");
-		goto fail;
-	}
-
 	switch (grp_num) { /* from IANA registry for IKE D-H groups */
 	case 19:
-		nid = NID_X9_62_prime256v1;
-		break;
+		return NID_X9_62_prime256v1;
 
 	case 20:
-		nid = NID_secp384r1;
-		break;
+		return NID_secp384r1;
 
 	case 21:
-		nid = NID_secp521r1;
-		break;
+		return NID_secp521r1;
 
 	case 25:
-		nid = NID_X9_62_prime192v1;
-		break;
+		return NID_X9_62_prime192v1;
 
 	case 26:
-		nid = NID_secp224r1;
-		break;
+		return NID_secp224r1;
 
 	default:
-		DEBUG("unknown group %d", grp_num);
+		return NID_undef;
+	}
+}
+
+static int _pwd_group_free(pwd_group_t *grp)
+{
+	BN_free(grp->prime);
+	BN_free(grp->a);
+	BN_free(grp->b);
+	BN_free(grp->pm1);
+	BN_free(grp->pm1over2);
+
+	return 0;
+}
+
+/** Derive the values hunting and pecking needs for a group
+ *
+ * These are the same for every session using the group, so they're
+ * computed once, instead of on every iteration of the loop.
+ *
+ * @param[in] ctx	to allocate the group in.
+ * @param[in] grp_num	IANA group number.
+ * @param[in] bnctx	to use for temporary values.
+ * @return
+ *	- The group values.
+ *	- NULL on error.
+ */
+pwd_group_t *pwd_group_alloc(TALLOC_CTX *ctx, uint16_t grp_num, BN_CTX *bnctx)
+{
+	pwd_group_t	*grp;
+	EC_GROUP	*group;
+	int		nid;
+
+	nid = pwd_group_nid(grp_num);
+	if (nid == NID_undef) {
+		ERROR("Unknown group %d", grp_num);
+		return NULL;
+	}
+
+	group = EC_GROUP_new_by_curve_name(nid);
+	if (!group) {
+		ERROR("Unable to create EC_GROUP");
+		return NULL;
+	}
+
+	MEM(grp = talloc_zero(ctx, pwd_group_t));
+	talloc_set_destructor(grp, _pwd_group_free);
+	grp->group_num = grp_num;
+
+	if (((grp->prime = consttime_BN()) == NULL) ||
+	    ((grp->a = consttime_BN()) == NULL) ||
+	    ((grp->b = consttime_BN()) == NULL) ||
+	    ((grp->pm1 = consttime_BN()) == NULL) ||
+	    ((grp->pm1over2 = consttime_BN()) == NULL)) {
+		ERROR("Unable to create bignums");
+	error:
+		EC_GROUP_free(group);
+		talloc_free(grp);
+		return NULL;
+	}
+
+	if (!EC_GROUP_get_curve_GFp(group, grp->prime, grp->a, grp->b, bnctx)) {
+		ERROR("Unable to get curve parameters");
+		goto error;
+	}
+
+	if (!BN_sub(grp->pm1, grp->prime, BN_value_one()) ||
+	    !BN_rshift1(grp->pm1over2, grp->pm1)) goto error;
+
+	grp->primebitlen = BN_num_bits(grp->prime);
+	grp->primebytelen = BN_num_bytes(grp->prime);
+
+	MEM(grp->pm1buf = talloc_zero_array(grp, uint8_t, grp->primebytelen));
+	BN_bn2bin(grp->pm1, grp->pm1buf);
+
+	EC_GROUP_free(group);
+
+	return grp;
+}
+
+int compute_password_element (REQUEST *request, pwd_session_t *session, pwd_group_t const *grp,
+			      char const *password, int password_len,
+			      char const *id_server, int id_server_len,
+			      char const *id_peer, int id_peer_len,
+			      uint32_t *token, BN_CTX *bnctx)
+{
+	BIGNUM *x_candidate = NULL, *rnd = NULL, *y_sqrd = NULL, *qr = NULL, *qnr = NULL;
+	HMAC_CTX *ctx = NULL;
+	uint8_t pwe_digest[SHA256_DIGEST_LENGTH], *prfbuf = NULL, *xbuf = NULL, ctr;
+	uint8_t *qr_bin = NULL, *qnr_bin = NULL, *qr_or_qnr_bin = NULL;
+	int is_odd, primebitlen, primebytelen, ret = 0, found = 0, mask;
+	int save, i, rbits, qr_or_qnr, save_is_odd = 0, cmp;
+	unsigned int skip;
+
+	ctx = HMAC_CTX_new();
+	if (ctx == NULL) {
+		DEBUG("failed allocating HMAC context");
 		goto fail;
 	}
 
@@ -295,7 +342,7 @@ int compute_password_element (REQUEST *request, pwd_session_t *session, uint16_t
 	session->order = NULL;
 	session->prime = NULL;
 
-	if ((session->group = EC_GROUP_new_by_curve_name(nid)) == NULL) {
+	if ((session->group = EC_GROUP_new_by_curve_name(pwd_group_nid(grp->group_num))) == NULL) {
 		DEBUG("unable to create EC_GROUP");
 		goto fail;
 	}
@@ -303,7 +350,7 @@ int compute_password_element (REQUEST *request, pwd_session_t *session, uint16_t
 	if (((rnd = consttime_BN()) == NULL) ||
 	    ((session->pwe = EC_POINT_new(session->group)) == NULL) ||
 	    ((session->order = consttime_BN()) == NULL) ||
-	    ((session->prime = consttime_BN()) == NULL) ||
+	    ((session->prime = BN_dup(grp->prime)) == NULL) ||
 	    ((qr = consttime_BN()) == NULL) ||
 	    ((qnr = consttime_BN()) == NULL) ||
 	    ((x_candidate = consttime_BN()) == NULL) ||
@@ -311,19 +358,15 @@ int compute_password_element (REQUEST *request, pwd_session_t *session, uint16_t
 		DEBUG("unable to create bignums");
 		goto fail;
 	}
-
-	if (!EC_GROUP_get_curve_GFp(session->group, session->prime, NULL, NULL, NULL)) {
-		DEBUG("unable to get prime for GFp curve");
-		goto fail;
-	}
+	BN_set_flags(session->prime, BN_FLG_CONSTTIME);
 
 	if (!EC_GROUP_get_order(session->group, session->order, NULL)) {
 		DEBUG("unable to get order for curve");
 		goto fail;
 	}
 
-	primebitlen = BN_num_bits(session->prime);
-	primebytelen = BN_num_bytes(session->prime);
+	primebitlen = grp->primebitlen;
+	primebytelen = grp->primebytelen;
 	if ((prfbuf = talloc_zero_array(session, uint8_t, primebytelen)) == NULL) {
 		DEBUG("unable to alloc space for prf buffer");
 		goto fail;
@@ -332,8 +375,10 @@ int compute_password_element (REQUEST *request, pwd_session_t *session, uint16_t
 		DEBUG("unable to alloc space for x buffer");
 		goto fail;
 	}
-	if ((pm1buf = talloc_zero_array(request, uint8_t, primebytelen)) == NULL) {
-		DEBUG("unable to alloc space for pm1 buffer");
+	if (((qr_bin = talloc_zero_array(request, uint8_t, primebytelen)) == NULL) ||
+	    ((qnr_bin = talloc_zero_array(request, uint8_t, primebytelen)) == NULL) ||
+	    ((qr_or_qnr_bin = talloc_zero_array(request, uint8_t, primebytelen)) == NULL)) {
+		DEBUG("unable to alloc space for residue buffers");
 		goto fail;
 	}
 
@@ -341,17 +386,18 @@ int compute_password_element (REQUEST *request, pwd_session_t *session, uint16_t
 	* derive random quadradic residue and quadratic non-residue
 	*/
 	do {
-		BN_rand_range(qr, session->prime);
-	} while (legendre(qr, session->prime, bnctx) != 1);
+		BN_rand_range(qr, grp->prime);
+	} while (legendre(qr, grp, bnctx) != 1);
 
 	do {
-		BN_rand_range(qnr, session->prime);
-	} while (legendre(qnr, session->prime, bnctx) != -1);
+		BN_rand_range(qnr, grp->prime);
+	} while (legendre(qnr, grp, bnctx) != -1);
 
-	if (!BN_sub(rnd, session->prime, BN_value_one())) {
-		goto fail;
-	}
-	BN_bn2bin(rnd, pm1buf);
+	/*
+	 * we select binary in constant time so make them binary
+	 */
+	BN_bn2bin(qr, qr_bin + (primebytelen - BN_num_bytes(qr)));
+	BN_bn2bin(qnr, qnr_bin + (primebytelen - BN_num_bytes(qnr)));
 
 	save_is_odd = 0;
 	found = 0;
@@ -398,7 +444,7 @@ int compute_password_element (REQUEST *request, pwd_session_t *session, uint16_t
 		* modulo the prime but it didn't. So if the candidate >= prime
 		* we need to skip it but still run through the operations below
 		*/
-		cmp = const_time_memcmp(pm1buf, prfbuf, primebytelen);
+		cmp = const_time_memcmp(grp->pm1buf, prfbuf, primebytelen);
 		skip = const_time_fill_msb((unsigned int)cmp);
 
 		/*
@@ -413,8 +459,8 @@ int compute_password_element (REQUEST *request, pwd_session_t *session, uint16_t
 		* save the first quadratic residue we find in the loop but do
 		* it in constant time.
 		*/
-		do_equation(session->group, y_sqrd, x_candidate, bnctx);
-		qr_or_qnr = is_quadratic_residue(y_sqrd, session->prime, qr, qnr, bnctx);
+		do_equation(grp, y_sqrd, x_candidate, bnctx);
+		qr_or_qnr = is_quadratic_residue(y_sqrd, grp, qr_bin, qnr_bin, qr_or_qnr_bin, bnctx);
 
 		/*
 		* if the candidate >= prime then we want to skip it
@@ -453,7 +499,7 @@ int compute_password_element (REQUEST *request, pwd_session_t *session, uint16_t
 		goto fail;
 	}
 
-	session->group_num = grp_num;
+	session->group_num = grp->group_num;
 	if (0) {
 		fail:		/* DON'T free session, it's in handler->opaque */
 		ret = -1;
@@ -468,7 +514,9 @@ int compute_password_element (REQUEST *request, pwd_session_t *session, uint16_t
 
 	if (prfbuf) talloc_free(prfbuf);
 	if (xbuf) talloc_free(xbuf);
-	if (pm1buf) talloc_free(pm1buf);
+	if (qr_bin) talloc_free(qr_bin);
+	if (qnr_bin) talloc_free(qnr_bin);
+	if (qr_or_qnr_bin) talloc_free(qr_or_qnr_bin);
 
 	HMAC_CTX_free(ctx);
 
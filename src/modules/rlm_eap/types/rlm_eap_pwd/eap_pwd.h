@@ -100,7 +100,24 @@ typedef struct {
     uint8_t	my_confirm[SHA256_DIGEST_LENGTH];
 } pwd_session_t;
 
-int compute_password_element(REQUEST *request, pwd_session_t *sess, uint16_t grp_num,
+/** Values derived from a group, which are the same for every session using it
+ *
+ */
+typedef struct {
+    uint16_t	group_num;		//!< IANA group number.
+    BIGNUM	*prime;			//!< Of the field the curve is defined over.
+    BIGNUM	*a;			//!< Curve coefficient.
+    BIGNUM	*b;			//!< Curve coefficient.
+    BIGNUM	*pm1;			//!< prime - 1.
+    BIGNUM	*pm1over2;		//!< (prime - 1) / 2, for the legendre symbol.
+    uint8_t	*pm1buf;		//!< prime - 1, as a big endian binary string.
+    int		primebitlen;
+    int		primebytelen;
+} pwd_group_t;
+
+pwd_group_t *pwd_group_alloc(TALLOC_CTX *ctx, uint16_t grp_num, BN_CTX *bnctx);
+
+int compute_password_element(REQUEST *request, pwd_session_t *sess, pwd_group_t const *grp,
 			     char const *password, int password_len,
 			     char const *id_server, int id_server_len,
 			     char const *id_peer, int id_peer_len,
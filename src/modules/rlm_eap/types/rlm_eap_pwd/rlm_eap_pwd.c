@@ -42,14 +42,17 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include "eap_pwd.h"
 
 typedef struct {
-    BN_CTX *bnctx;
-
     uint32_t	group;
     uint32_t	fragment_size;
     char const	*server_id;
     char const	*virtual_server;
 } rlm_eap_pwd_t;
 
+typedef struct {
+    BN_CTX	*bnctx;			//!< Scratch space for big number operations.
+    pwd_group_t	*group;			//!< Values derived from the configured group.
+} rlm_eap_pwd_thread_t;
+
 #define MPPE_KEY_LEN    32
 #define MSK_EMSK_LEN    (2 * MPPE_KEY_LEN)
 
@@ -157,6 +160,7 @@ static int send_pwd_request(REQUEST *request, pwd_session_t *session, eap_round_
 static rlm_rcode_t mod_process(module_ctx_t const *mctx, REQUEST *request)
 {
 	rlm_eap_pwd_t	*inst = talloc_get_type_abort(mctx->instance, rlm_eap_pwd_t);
+	rlm_eap_pwd_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_eap_pwd_thread_t);
 	eap_session_t	*eap_session = eap_session_get(request->parent);
 
 	pwd_session_t	*session;
@@ -329,11 +333,11 @@ static rlm_rcode_t mod_process(module_ctx_t const *mctx, REQUEST *request)
 			return RLM_MODULE_FAIL;
 		}
 
-		ret = compute_password_element(request, session, session->group_num,
+		ret = compute_password_element(request, session, t->group,
 					       known_good->vp_strvalue, known_good->vp_length,
 					       inst->server_id, strlen(inst->server_id),
 					       session->peer_id, strlen(session->peer_id),
-					       &session->token, inst->bnctx);
+					       &session->token, t->bnctx);
 		if (ephemeral) talloc_list_free(&known_good);
 		if (ret < 0) {
 			REDEBUG("Failed to obtain password element");
@@ -343,7 +347,7 @@ static rlm_rcode_t mod_process(module_ctx_t const *mctx, REQUEST *request)
 		/*
 		 *	Compute our scalar and element
 		 */
-		if (compute_scalar_element(request, session, inst->bnctx)) {
+		if (compute_scalar_element(request, session, t->bnctx)) {
 			REDEBUG("Failed to compute server's scalar and element");
 			return RLM_MODULE_FAIL;
 		}
@@ -354,7 +358,7 @@ static rlm_rcode_t mod_process(module_ctx_t const *mctx, REQUEST *request)
 		/*
 		 *	Element is a point, get both coordinates: x and y
 		 */
-		if (!EC_POINT_get_affine_coordinates_GFp(session->group, session->my_element, x, y, inst->bnctx)) {
+		if (!EC_POINT_get_affine_coordinates_GFp(session->group, session->my_element, x, y, t->bnctx)) {
 			REDEBUG("Server point assignment failed");
 			BN_clear_free(x);
 			BN_clear_free(y);
@@ -395,7 +399,7 @@ static rlm_rcode_t mod_process(module_ctx_t const *mctx, REQUEST *request)
 		/*
 		 *	Process the peer's commit and generate the shared key, k
 		 */
-		if (process_peer_commit(request, session, in, in_len, inst->bnctx)) {
+		if (process_peer_commit(request, session, in, in_len, t->bnctx)) {
 			REDEBUG("Failed processing peer's commit");
 			return RLM_MODULE_FAIL;
 		}
@@ -403,7 +407,7 @@ static rlm_rcode_t mod_process(module_ctx_t const *mctx, REQUEST *request)
 		/*
 		 *	Compute our confirm blob
 		 */
-		if (compute_server_confirm(request, session, session->my_confirm, inst->bnctx)) {
+		if (compute_server_confirm(request, session, session->my_confirm, t->bnctx)) {
 			REDEBUG("Failed computing confirm");
 			return RLM_MODULE_FAIL;
 		}
@@ -431,7 +435,7 @@ static rlm_rcode_t mod_process(module_ctx_t const *mctx, REQUEST *request)
 			REDEBUG("PWD exchange is incorrect, not commit");
 			return RLM_MODULE_INVALID;
 		}
-		if (compute_peer_confirm(request, session, peer_confirm, inst->bnctx)) {
+		if (compute_peer_confirm(request, session, peer_confirm, t->bnctx)) {
 			REDEBUG("Cannot compute peer's confirm");
 			return RLM_MODULE_FAIL;
 		}
@@ -544,13 +548,33 @@ static rlm_rcode_t mod_session_init(module_ctx_t const *mctx, REQUEST *request)
 	return RLM_MODULE_HANDLED;
 }
 
-static int mod_detach(void *arg)
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
 {
-	rlm_eap_pwd_t *inst;
+	rlm_eap_pwd_t		*inst = talloc_get_type_abort(instance, rlm_eap_pwd_t);
+	rlm_eap_pwd_thread_t	*t = talloc_get_type_abort(thread, rlm_eap_pwd_thread_t);
 
-	inst = (rlm_eap_pwd_t *) arg;
+	/*
+	 *	BN_CTXs can't be shared between threads.
+	 */
+	t->bnctx = BN_CTX_new();
+	if (!t->bnctx) {
+		ERROR("Failed to get BN context");
+		return -1;
+	}
 
-	if (inst->bnctx) BN_CTX_free(inst->bnctx);
+	t->group = pwd_group_alloc(t, inst->group, t->bnctx);
+	if (!t->group) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_eap_pwd_thread_t	*t = talloc_get_type_abort(thread, rlm_eap_pwd_thread_t);
+
+	TALLOC_FREE(t->group);
+	if (t->bnctx) BN_CTX_free(t->bnctx);
 
 	return 0;
 }
@@ -577,12 +601,6 @@ static int mod_instantiate(void *instance, CONF_SECTION *cs)
 		return -1;
 	}
 
-	inst->bnctx = BN_CTX_new();
-	if (!inst->bnctx) {
-		ERROR("Failed to get BN context");
-		return -1;
-	}
-
 	return 0;
 }
 
@@ -595,7 +613,11 @@ rlm_eap_submodule_t rlm_eap_pwd = {
 	.inst_size	= sizeof(rlm_eap_pwd_t),
 	.config		= submodule_config,
 	.instantiate	= mod_instantiate,	/* Create new submodule instance */
-	.detach		= mod_detach,
+
+	.thread_inst_size	= sizeof(rlm_eap_pwd_thread_t),
+	.thread_inst_type	= "rlm_eap_pwd_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 
 	.session_init	= mod_session_init,	/* Create the initial request */
 	.entry_point	= mod_process,		/* Process next round of EAP method */
@@ -226,6 +226,13 @@ static rlm_rcode_t mod_process(module_ctx_t const *mctx, REQUEST *request)
 	case EAP_TLS_HANDLED:
 		return RLM_MODULE_HANDLED;
 
+	/*
+	 *	The handshake is waiting on an asynchronous
+	 *	crypto operation, come back when it's done.
+	 */
+	case EAP_TLS_YIELD:
+		return eap_tls_yield(request, eap_session, mod_process);
+
 	/*
 	 *	Handshake is done, proceed with decoding tunneled
 	 *	data.
@@ -29,8 +29,22 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/pair_legacy.h>
+#include <freeradius-devel/util/syserror.h>
+
+/** Longest line we accept from a coprocess
+ *
+ */
+#define EXEC_COPROC_MAX_LINE	(8192)
+
+/** Largest reply we accept from a coprocess, for a single request
+ *
+ */
+#define EXEC_COPROC_MAX_REPLY	(65536)
 
 /*
  *	Define a structure for our module configuration.
@@ -47,9 +61,54 @@ typedef struct {
 	fr_time_delta_t	timeout;
 	bool		timeout_is_set;
 
+	bool		coprocess;		//!< Send requests to long-lived programs, instead
+						///< of running the program for every request.
+	uint32_t	coprocess_count;	//!< How many coprocesses each thread starts.
+
 	vp_tmpl_t	*tmpl;
 } rlm_exec_t;
 
+typedef struct rlm_exec_coproc_s rlm_exec_coproc_t;
+
+/** Thread specific data
+ *
+ */
+typedef struct {
+	rlm_exec_t const	*inst;			//!< Instance of the module.
+	fr_event_list_t		*el;			//!< This thread's event list.
+	rlm_exec_coproc_t	**coproc;		//!< Array of coprocess_count coprocesses.
+} rlm_exec_thread_t;
+
+/** A long-lived program which we send requests to
+ *
+ */
+struct rlm_exec_coproc_s {
+	rlm_exec_thread_t	*thread;		//!< Thread which owns the coprocess.
+	pid_t			pid;			//!< Of the coprocess, or -1 if it's not running.
+	int			to_child;		//!< We write requests here.
+	int			from_child;		//!< We read replies from here.
+
+	fr_dlist_head_t		pending;		//!< Requests which have been written, in the
+							///< order that the replies will arrive.
+
+	char			buffer[EXEC_COPROC_MAX_LINE];	//!< Data read, but not yet processed.
+	size_t			used;				//!< How much of the buffer is used.
+};
+
+/** A request which has been sent to a coprocess
+ *
+ * This is parented by the coprocess, not the request, as the reply
+ * must still be read if the request goes away.
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the coprocess' pending list.
+	REQUEST			*request;		//!< NULL if the request no longer wants the reply.
+	char			*reply;			//!< Lines of the reply, excluding the status.
+	int			status;			//!< Interpreted the same as a program's exit status.
+	bool			done;			//!< The reply has been received.
+	bool			failed;			//!< The coprocess went away before replying.
+} rlm_exec_coproc_request_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("wait", FR_TYPE_BOOL, rlm_exec_t, wait), .dflt = "yes" },
 	{ FR_CONF_OFFSET("program", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_exec_t, program) },
@@ -57,6 +116,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("output_pairs", FR_TYPE_STRING, rlm_exec_t, output) },
 	{ FR_CONF_OFFSET("shell_escape", FR_TYPE_BOOL, rlm_exec_t, shell_escape), .dflt = "yes" },
 	{ FR_CONF_OFFSET_IS_SET("timeout", FR_TYPE_TIME_DELTA, rlm_exec_t, timeout) },
+	{ FR_CONF_OFFSET("coprocess", FR_TYPE_BOOL, rlm_exec_t, coprocess), .dflt = "no" },
+	{ FR_CONF_OFFSET("coprocess_count", FR_TYPE_UINT32, rlm_exec_t, coprocess_count), .dflt = "1" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -184,6 +245,23 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->coprocess) {
+		if (!inst->program) {
+			cf_log_err(conf, "'program' must be set when 'coprocess = yes'");
+			return -1;
+		}
+
+		if (!inst->wait) {
+			cf_log_err(conf, "Cannot use 'coprocess = yes' with 'wait = no'");
+			return -1;
+		}
+
+		if ((inst->coprocess_count == 0) || (inst->coprocess_count > 64)) {
+			cf_log_err(conf, "'coprocess_count' must be between 1 and 64");
+			return -1;
+		}
+	}
+
 	if (inst->timeout_is_set || !inst->timeout) {
 		/*
 		 *	Pick the shorter one
@@ -289,9 +367,31 @@ typedef struct {
 } rlm_exec_ctx_t;
 
 
+/** Convert the exit status of a program to an rcode
+ *
+ */
+static rlm_rcode_t exec_status_to_rcode(REQUEST *request, int status)
+{
+	/*
+	 *	Don't print anything on success.
+	 */
+	if (status == 0) return RLM_MODULE_OK;
+
+	if (status < 0) {
+		REDEBUG("Program exited with signal %d", -status);
+		return RLM_MODULE_FAIL;
+	}
+
+	if (status > RLM_MODULE_NUMCODES) return RLM_MODULE_OK;
+
+	/*
+	 *	Return the exit status as an rcode.
+	 */
+	return status - 1;
+}
+
 static rlm_rcode_t mod_exec_wait_resume(module_ctx_t const *mctx, REQUEST *request, void *rctx)
 {
-	int			status;
 	rlm_exec_ctx_t		*m = talloc_get_type_abort(rctx, rlm_exec_ctx_t);
 	rlm_exec_t const       	*inst = talloc_get_type_abort_const(mctx->instance, rlm_exec_t);
 
@@ -310,24 +410,348 @@ static rlm_rcode_t mod_exec_wait_resume(module_ctx_t const *mctx, REQUEST *reque
 		if (vps) fr_pair_list_move(output_pairs, &vps);
 	}
 
-	status = m->status;
+	return exec_status_to_rcode(request, m->status);
+}
+
+static int exec_coproc_start(rlm_exec_coproc_t *cp);
+
+/** Stop a coprocess, failing any requests which are waiting for it
+ *
+ */
+static void exec_coproc_stop(rlm_exec_coproc_t *cp)
+{
+	rlm_exec_coproc_request_t	*cpr;
+
+	while ((cpr = fr_dlist_pop_head(&cp->pending))) {
+		if (!cpr->request) {
+			talloc_free(cpr);
+			continue;
+		}
+
+		cpr->failed = true;
+		cpr->done = true;
+		unlang_interpret_resumable(cpr->request);
+	}
+
+	if (cp->pid < 0) return;
+
+	(void) fr_event_fd_delete(cp->thread->el, cp->from_child, FR_EVENT_FILTER_IO);
+	close(cp->to_child);
+	close(cp->from_child);
 
 	/*
-	 *	Don't print anything on success.
+	 *	Closing STDIN tells the coprocess to exit.
 	 */
-	if (status == 0) return RLM_MODULE_OK;
+	fr_exec_waitpid(cp->pid);
+	cp->pid = -1;
+	cp->used = 0;
+}
 
-	if (status < 0) {
-		REDEBUG("Program exited with signal %d", -status);
+/** Process one line of a reply from a coprocess
+ *
+ * The reply is zero or more attribute lines, followed by a line
+ * containing only the status.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the coprocess isn't following the protocol.
+ */
+static int exec_coproc_line(rlm_exec_coproc_t *cp, char const *line, size_t len)
+{
+	rlm_exec_t const		*inst = cp->thread->inst;
+	rlm_exec_coproc_request_t	*cpr;
+	size_t				i;
+
+	cpr = fr_dlist_head(&cp->pending);
+	if (!cpr) {
+		ERROR("Coprocess %u wrote data when no requests were outstanding", cp->pid);
+		return -1;
+	}
+
+	for (i = 0; i < len; i++) if (!isdigit((int) line[i])) break;
+
+	/*
+	 *	Not the status, so it's part of the reply.
+	 */
+	if ((len == 0) || (i < len)) {
+		if (len == 0) return 0;
+
+		if ((talloc_array_length(cpr->reply) + len) > EXEC_COPROC_MAX_REPLY) {
+			ERROR("Reply from coprocess %u is too long", cp->pid);
+			return -1;
+		}
+
+		MEM(cpr->reply = talloc_strndup_append_buffer(cpr->reply, line, len));
+		MEM(cpr->reply = talloc_strdup_append_buffer(cpr->reply, "\n"));
+		return 0;
+	}
+
+	cpr->status = atoi(line);
+	cpr->done = true;
+	fr_dlist_remove(&cp->pending, cpr);
+
+	if (!cpr->request) {
+		talloc_free(cpr);
+		return 0;
+	}
+
+	unlang_interpret_resumable(cpr->request);
+	return 0;
+}
+
+/** Read replies from a coprocess
+ *
+ */
+static void exec_coproc_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	rlm_exec_coproc_t	*cp = talloc_get_type_abort(uctx, rlm_exec_coproc_t);
+	rlm_exec_t const	*inst = cp->thread->inst;
+	ssize_t			slen;
+	char			*p, *end, *eol;
+
+	for (;;) {
+		slen = read(cp->from_child, cp->buffer + cp->used, sizeof(cp->buffer) - cp->used);
+		if (slen == 0) {
+			ERROR("Coprocess %u closed its output", cp->pid);
+			goto restart;
+		}
+
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+
+			ERROR("Failed reading from coprocess %u: %s", cp->pid, fr_syserror(errno));
+			goto restart;
+		}
+
+		cp->used += slen;
+		p = cp->buffer;
+		end = cp->buffer + cp->used;
+
+		while ((eol = memchr(p, '\n', end - p))) {
+			*eol = '\0';
+			if (exec_coproc_line(cp, p, eol - p) < 0) goto restart;
+			p = eol + 1;
+		}
+
+		if (p == cp->buffer) {
+			if (cp->used == sizeof(cp->buffer)) {
+				ERROR("Line from coprocess %u is too long", cp->pid);
+				goto restart;
+			}
+			continue;
+		}
+
+		cp->used = end - p;
+		if (cp->used) memmove(cp->buffer, p, cp->used);
+	}
+
+restart:
+	exec_coproc_stop(cp);
+	(void) exec_coproc_start(cp);
+}
+
+/** Handle errors on the output of a coprocess
+ *
+ */
+static void exec_coproc_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	rlm_exec_coproc_t	*cp = talloc_get_type_abort(uctx, rlm_exec_coproc_t);
+	rlm_exec_t const	*inst = cp->thread->inst;
+
+	ERROR("Coprocess %u failed: %s", cp->pid, fr_syserror(fd_errno));
+
+	exec_coproc_stop(cp);
+	(void) exec_coproc_start(cp);
+}
+
+/** Start a coprocess
+ *
+ * The program isn't expanded, as there is no request to expand it with.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int exec_coproc_start(rlm_exec_coproc_t *cp)
+{
+	rlm_exec_t const	*inst = cp->thread->inst;
+	pid_t			pid;
+
+	pid = radius_start_program(inst->program, NULL, true, &cp->to_child, &cp->from_child, NULL, false);
+	if (pid < 0) {
+		PERROR("Failed starting coprocess");
+		return -1;
+	}
+	cp->pid = pid;
+
+	if ((fr_nonblock(cp->to_child) < 0) || (fr_nonblock(cp->from_child) < 0) ||
+	    (fr_event_fd_insert(cp, cp->thread->el, cp->from_child,
+				exec_coproc_read, NULL, exec_coproc_error, cp) < 0)) {
+		PERROR("Failed setting up coprocess %u", pid);
+		exec_coproc_stop(cp);
+		return -1;
+	}
+
+	DEBUG2("Started coprocess %u", pid);
+
+	return 0;
+}
+
+/** Resume a request when the coprocess has replied, or we gave up waiting
+ *
+ */
+static rlm_rcode_t mod_exec_coproc_resume(module_ctx_t const *mctx, REQUEST *request, void *rctx)
+{
+	rlm_exec_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_exec_t);
+	rlm_exec_coproc_request_t	*cpr = talloc_get_type_abort(rctx, rlm_exec_coproc_request_t);
+	rlm_rcode_t			rcode;
+
+	/*
+	 *	Timed out.  The coprocess still owes us a reply,
+	 *	which will be discarded when it arrives.
+	 */
+	if (!cpr->done) {
+		REDEBUG("Timeout waiting for coprocess");
+		cpr->request = NULL;
 		return RLM_MODULE_FAIL;
 	}
 
-	if (status > RLM_MODULE_NUMCODES) return RLM_MODULE_OK;
+	if (cpr->failed) {
+		REDEBUG("Coprocess exited before replying");
+		talloc_free(cpr);
+		return RLM_MODULE_FAIL;
+	}
+
+	if (inst->output && cpr->reply) {
+		TALLOC_CTX	*ctx;
+		VALUE_PAIR	*vps = NULL, **output_pairs;
+		char		*p, *eol;
+
+		output_pairs = radius_list(request, inst->output_list);
+		fr_assert(output_pairs != NULL);
+
+		ctx = radius_list_ctx(request, inst->output_list);
+
+		for (p = cpr->reply; (eol = strchr(p, '\n')); p = eol + 1) {
+			*eol = '\0';
+			if (fr_pair_list_afrom_str(ctx, request->dict, p, &vps) == T_INVALID) {
+				RPEDEBUG("Failed parsing output from coprocess");
+				fr_pair_list_free(&vps);
+				talloc_free(cpr);
+				return RLM_MODULE_FAIL;
+			}
+		}
+
+		fr_pair_list_tainted(vps);
+		fr_pair_list_move(output_pairs, &vps);
+	}
+
+	rcode = exec_status_to_rcode(request, cpr->status);
+	talloc_free(cpr);
+
+	return rcode;
+}
+
+/** Give up waiting for a coprocess
+ *
+ */
+static void mod_exec_coproc_timeout(UNUSED module_ctx_t const *mctx, REQUEST *request,
+				    UNUSED void *rctx, UNUSED fr_time_t fired)
+{
+	unlang_interpret_resumable(request);
+}
+
+/** Stop waiting for the coprocess if the request is cancelled
+ *
+ */
+static void mod_exec_coproc_signal(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request,
+				   void *rctx, fr_state_signal_t action)
+{
+	rlm_exec_coproc_request_t	*cpr = talloc_get_type_abort(rctx, rlm_exec_coproc_request_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (cpr->done) {
+		talloc_free(cpr);
+		return;
+	}
+
+	cpr->request = NULL;
+}
+
+/** Send a request to the least busy coprocess
+ *
+ * The request is written as one attribute per line, followed by
+ * an empty line.
+ */
+static rlm_rcode_t mod_exec_coproc_dispatch(module_ctx_t const *mctx, REQUEST *request, VALUE_PAIR *env_pairs)
+{
+	rlm_exec_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_exec_t);
+	rlm_exec_thread_t		*t = talloc_get_type_abort(mctx->thread, rlm_exec_thread_t);
+	rlm_exec_coproc_t		*cp = NULL;
+	rlm_exec_coproc_request_t	*cpr;
+	fr_cursor_t			cursor;
+	VALUE_PAIR			*vp;
+	char				*msg, *p;
+	size_t				len;
+	ssize_t				slen;
+	uint32_t			i;
+
+	for (i = 0; i < inst->coprocess_count; i++) {
+		if ((t->coproc[i]->pid < 0) && (exec_coproc_start(t->coproc[i]) < 0)) continue;
+
+		if (!cp || (fr_dlist_num_elements(&t->coproc[i]->pending) < fr_dlist_num_elements(&cp->pending))) {
+			cp = t->coproc[i];
+		}
+	}
+
+	if (!cp) {
+		REDEBUG("No coprocesses are running");
+		return RLM_MODULE_FAIL;
+	}
+
+	MEM(msg = talloc_strdup(request, ""));
+	for (vp = fr_cursor_init(&cursor, &env_pairs);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		MEM(p = fr_pair_asprint(msg, vp, '"'));
+		MEM(msg = talloc_asprintf_append_buffer(msg, "%s = %s\n", vp->da->name, p));
+		talloc_free(p);
+	}
+	MEM(msg = talloc_strdup_append_buffer(msg, "\n"));
+	len = talloc_array_length(msg) - 1;
 
 	/*
-	 *	Return the exit status as an rcode.
+	 *	The request is small, so if the pipe is full the
+	 *	coprocess isn't reading its input.  As we can't
+	 *	send part of a request, restart the coprocess.
 	 */
-	return status - 1;
+	do {
+		slen = write(cp->to_child, msg, len);
+	} while ((slen < 0) && (errno == EINTR));
+	talloc_free(msg);
+
+	if (slen != (ssize_t) len) {
+		REDEBUG("Failed writing to coprocess %u: %s", cp->pid,
+			(slen < 0) ? fr_syserror(errno) : "Input is full");
+		exec_coproc_stop(cp);
+		(void) exec_coproc_start(cp);
+		return RLM_MODULE_FAIL;
+	}
+
+	MEM(cpr = talloc_zero(cp, rlm_exec_coproc_request_t));
+	cpr->request = request;
+	fr_dlist_insert_tail(&cp->pending, cpr);
+
+	RDEBUG2("Sent request to coprocess %u", cp->pid);
+
+	if (unlang_module_timeout_add(request, mod_exec_coproc_timeout, cpr, fr_time() + inst->timeout) < 0) {
+		cpr->request = NULL;
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_exec_coproc_resume, mod_exec_coproc_signal, cpr);
 }
 
 /*
@@ -379,11 +803,55 @@ static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(module_ctx_t const *mctx,
 		}
 	}
 
+	if (inst->coprocess) return mod_exec_coproc_dispatch(mctx, request, env_pairs);
+
 	m = talloc_zero(ctx, rlm_exec_ctx_t);
 
 	return unlang_module_yield_to_tmpl(m, &m->box, &m->status, request, inst->tmpl, env_pairs, mod_exec_wait_resume, NULL, m);
 }
 
+/** Start this thread's coprocesses
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_exec_t		*inst = talloc_get_type_abort(instance, rlm_exec_t);
+	rlm_exec_thread_t	*t = talloc_get_type_abort(thread, rlm_exec_thread_t);
+	uint32_t		i;
+
+	if (!inst->coprocess) return 0;
+
+	t->inst = inst;
+	t->el = el;
+
+	MEM(t->coproc = talloc_zero_array(t, rlm_exec_coproc_t *, inst->coprocess_count));
+	for (i = 0; i < inst->coprocess_count; i++) {
+		rlm_exec_coproc_t *cp;
+
+		MEM(cp = talloc_zero(t->coproc, rlm_exec_coproc_t));
+		cp->thread = t;
+		cp->pid = -1;
+		fr_dlist_talloc_init(&cp->pending, rlm_exec_coproc_request_t, entry);
+		t->coproc[i] = cp;
+
+		if (exec_coproc_start(cp) < 0) return -1;
+	}
+
+	return 0;
+}
+
+/** Stop this thread's coprocesses
+ *
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_exec_thread_t	*t = talloc_get_type_abort(thread, rlm_exec_thread_t);
+	size_t			i;
+
+	for (i = 0; i < talloc_array_length(t->coproc); i++) exec_coproc_stop(t->coproc[i]);
+
+	return 0;
+}
 
 /*
  *	The module name should be the only globally exported symbol.
@@ -403,6 +871,9 @@ module_t rlm_exec = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_exec_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_exec_dispatch,
 		[MOD_AUTHORIZE]		= mod_exec_dispatch,
@@ -29,31 +29,41 @@ RCSID("$Id$")
 #include <freeradius-devel/server/pairmove.h>
 #include <freeradius-devel/server/users_file.h>
 
+#include <freeradius-devel/util/hash.h>
+
 #include <ctype.h>
 #include <fcntl.h>
 
+/** The entries read from one users file
+ *
+ */
+typedef struct {
+	fr_hash_table_t	*users;		//!< Lists of entries with the same name, indexed by name.
+	PAIR_LIST	*defaults;	//!< DEFAULT entries, in the order they were read.
+} rlm_files_index_t;
+
 typedef struct {
 	vp_tmpl_t *key;
 
 	char const *filename;
-	rbtree_t *common;
+	rlm_files_index_t *common;
 
 	/* autz */
 	char const *usersfile;
-	rbtree_t *users;
+	rlm_files_index_t *users;
 
 
 	/* authenticate */
 	char const *auth_usersfile;
-	rbtree_t *auth_users;
+	rlm_files_index_t *auth_users;
 
 	/* preacct */
 	char const *acct_usersfile;
-	rbtree_t *acct_users;
+	rlm_files_index_t *acct_users;
 
 	/* post-authenticate */
 	char const *postauth_usersfile;
-	rbtree_t *postauth_users;
+	rlm_files_index_t *postauth_users;
 } rlm_files_t;
 
 static fr_dict_t const *dict_freeradius;
@@ -97,22 +107,27 @@ static const CONF_PARSER module_config[] = {
 };
 
 
+static uint32_t pairlist_hash(void const *data)
+{
+	return fr_hash_string(((PAIR_LIST const *)data)->name);
+}
+
 static int pairlist_cmp(void const *a, void const *b)
 {
 	return strcmp(((PAIR_LIST const *)a)->name, ((PAIR_LIST const *)b)->name);
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, rlm_files_index_t **pindex)
 {
 	int rcode;
 	VALUE_PAIR *vp;
 	PAIR_LIST *users = NULL;
 	PAIR_LIST *entry, *next;
-	PAIR_LIST *user_list, *default_list, **default_tail;
-	rbtree_t *tree;
+	PAIR_LIST *user_list, **default_tail;
+	rlm_files_index_t *index;
 
 	if (!filename) {
-		*ptree = NULL;
+		*pindex = NULL;
 		return 0;
 	}
 
@@ -191,19 +206,24 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		entry = entry->next;
 	}
 
-	tree = rbtree_alloc(ctx, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
-	if (!tree) {
+	MEM(index = talloc_zero(ctx, rlm_files_index_t));
+	index->users = fr_hash_table_create(index, pairlist_hash, pairlist_cmp, NULL);
+	if (!index->users) {
 		pairlist_free(&users);
+		talloc_free(index);
 		return -1;
 	}
 
-	default_list = NULL;
-	default_tail = &default_list;
+	default_tail = &index->defaults;
 
 	/*
 	 *	We've read the entries in linearly, but putting them
 	 *	into an indexed data structure would be much faster.
 	 *	Let's go fix that now.
+	 *
+	 *	Named entries go into a hash table, as lookups are by
+	 *	exact name.  The DEFAULT entries are kept apart, so
+	 *	that they don't need to be looked up at all.
 	 */
 	for (entry = users; entry != NULL; entry = next) {
 		/*
@@ -216,28 +236,11 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		 *	DEFAULT entries get their own list.
 		 */
 		if (strcmp(entry->name, "DEFAULT") == 0) {
-			if (!default_list) {
-				default_list = entry;
-
-				/*
-				 *	Insert the first DEFAULT into the tree.
-				 */
-				if (!rbtree_insert(tree, entry)) {
-				error:
-					pairlist_free(&entry);
-					pairlist_free(&next);
-					talloc_free(tree);
-					return -1;
-				}
-
-			} else {
-				/*
-				 *	Tack this entry onto the tail
-				 *	of the DEFAULT list.
-				 */
-				*default_tail = entry;
-			}
-
+			/*
+			 *	Tack this entry onto the tail
+			 *	of the DEFAULT list.
+			 */
+			*default_tail = entry;
 			default_tail = &entry->next;
 			continue;
 		}
@@ -245,12 +248,17 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		/*
 		 *	Not DEFAULT, must be a normal user.
 		 */
-		user_list = rbtree_finddata(tree, entry);
+		user_list = fr_hash_table_finddata(index->users, entry);
 		if (!user_list) {
 			/*
 			 *	Insert the first one.
 			 */
-			if (!rbtree_insert(tree, entry)) goto error;
+			if (!fr_hash_table_insert(index->users, entry)) {
+				pairlist_free(&entry);
+				pairlist_free(&next);
+				talloc_free(index);
+				return -1;
+			}
 		} else {
 			/*
 			 *	Find the tail of this list, and add it
@@ -262,7 +270,7 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		}
 	}
 
-	*ptree = tree;
+	*pindex = index;
 
 	return 0;
 }
@@ -291,8 +299,8 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
 /*
  *	Common code called by everything below.
  */
-static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename, rbtree_t *tree,
-			       RADIUS_PACKET *packet, RADIUS_PACKET *reply)
+static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename,
+			       rlm_files_index_t const *index, RADIUS_PACKET *packet, RADIUS_PACKET *reply)
 {
 	char const	*name;
 	VALUE_PAIR	*check_tmp = NULL;
@@ -301,18 +309,25 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 	bool		found = false;
 	PAIR_LIST	my_pl;
 	char		buffer[256];
+	fr_pair_index_t	*idx;
 
 	if (tmpl_expand(&name, buffer, sizeof(buffer), request, inst->key, NULL, NULL) < 0) {
 		REDEBUG("Failed expanding key %s", inst->key->name);
 		return RLM_MODULE_FAIL;
 	}
 
-	if (!tree) return RLM_MODULE_NOOP;
+	if (!index) return RLM_MODULE_NOOP;
 
 	my_pl.name = name;
-	user_pl = rbtree_finddata(tree, &my_pl);
-	my_pl.name = "DEFAULT";
-	default_pl = rbtree_finddata(tree, &my_pl);
+	user_pl = fr_hash_table_finddata(index->users, &my_pl);
+	default_pl = index->defaults;
+
+	/*
+	 *	Every entry is compared against the same request
+	 *	list, so index it once instead of searching it
+	 *	for each check item of each entry.
+	 */
+	MEM(idx = fr_pair_index_alloc(request, &packet->vps));
 
 	/*
 	 *	Find the entry for the user.
@@ -321,6 +336,7 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		fr_cursor_t cursor;
 		VALUE_PAIR *vp;
 		PAIR_LIST const *pl;
+		bool expanded = false;
 
 		/*
 		 *	Figure out which entry to match on.
@@ -347,6 +363,8 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		for (vp = fr_cursor_init(&cursor, &check_tmp);
 		     vp;
 		     vp = fr_cursor_next(&cursor)) {
+			if (vp->type == VT_XLAT) expanded = true;
+
 			if (xlat_eval_pair(request, vp) < 0) {
 				RPWARN("Failed parsing expanded value for check item, skipping entry");
 				fr_pair_list_free(&check_tmp);
@@ -354,7 +372,13 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 			}
 		}
 
-		if (paircmp(request, packet->vps, check_tmp, &reply->vps) == 0) {
+		/*
+		 *	Expansions can do anything to the request
+		 *	list, so the index can't be trusted after them.
+		 */
+		if (expanded) fr_pair_index_reset(idx);
+
+		if (paircmp_index(request, packet->vps, idx, check_tmp, &reply->vps) == 0) {
 			RDEBUG2("Found match \"%s\" one line %d of %s", pl->name, pl->lineno, filename);
 			found = true;
 
@@ -374,6 +398,7 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 			if (!fall_through(pl->reply)) break;
 		}
 	}
+	talloc_free(idx);
 
 	/*
 	 *	Remove server internal parameters.
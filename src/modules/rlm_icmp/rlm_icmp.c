@@ -48,7 +48,10 @@ typedef struct {
 
 typedef struct {
 	rlm_icmp_t	*inst;
-	rbtree_t	*tree;
+	fr_hash_table_t	*echoes;		//!< Outstanding probes, by ident, sequence and destination.
+	fr_hash_table_t	*targets;		//!< Outstanding probes, by destination.
+	fr_dlist_head_t	send_queue;		//!< Probes waiting for the next batched send.
+	fr_event_timer_t const *flush_ev;	//!< Writes out the send queue.
 	int		fd;
 	fr_event_list_t *el;
 
@@ -61,11 +64,36 @@ typedef struct {
 	uint8_t		reply_type;
 } rlm_icmp_thread_t;
 
+typedef struct CC_HINT(__packed__) {
+	uint8_t		type;
+	uint8_t		code;
+	uint16_t	checksum;
+	uint16_t	ident;
+	uint16_t	sequence;
+	uint32_t	data;			//!< another 32-bits of randomness
+	uint32_t	counter;		//!< so that requests for the same IP are unique
+} icmp_header_t;
+
+/** A single echo request on the wire
+ *
+ * Shared by all requests which ping the same IP while it's outstanding.
+ */
 typedef struct {
-	bool		replied;		//!< do we have a reply?
-	fr_value_box_t	*ip;			//!< the IP we're pinging
+	fr_ipaddr_t	ip;			//!< the IP we're pinging
+	uint16_t	ident;			//!< ident the echo was sent with
+	uint16_t	sequence;		//!< sequence the echo was sent with
 	uint32_t	counter;	       	//!< for pinging the same IP multiple times
+	icmp_header_t	icmp;			//!< the packet we're sending
+	bool		queued;			//!< is it in the send queue?
+	fr_dlist_head_t	waiters;		//!< requests waiting for the echo reply
+	fr_dlist_t	entry;			//!< entry in the send queue
+} rlm_icmp_probe_t;
+
+typedef struct {
+	bool		replied;		//!< do we have a reply?
+	rlm_icmp_probe_t *probe;		//!< the probe we're waiting on, NULL once the result is known
 	REQUEST		*request;		//!< so it can be resumed when we get the echo reply
+	fr_dlist_t	entry;			//!< entry in the list of waiters for the probe
 } rlm_icmp_echo_t;
 
 /** Wrapper around the module thread stuct for individual xlats
@@ -76,22 +104,17 @@ typedef struct {
 	rlm_icmp_thread_t	*t;		//!< rlm_icmp thread instance.
 } xlat_icmp_thread_inst_t;
 
-typedef struct CC_HINT(__packed__) {
-	uint8_t		type;
-	uint8_t		code;
-	uint16_t	checksum;
-	uint16_t	ident;
-	uint16_t	sequence;
-	uint32_t	data;			//!< another 32-bits of randomness
-	uint32_t	counter;		//!< so that requests for the same IP are unique
-} icmp_header_t;
-
 #define ICMP_ECHOREPLY		(0)
 #define ICMP_ECHOREQUEST	(8)
 
 #define ICMPV6_ECHOREQUEST	(128)
 #define ICMPV6_ECHOREPLY	(129)
 
+/*
+ *	Maximum number of echo requests written by a single sendmmsg() call.
+ */
+#define ICMP_SEND_BATCH		(64)
+
 /*
  *	Calculate the ICMP portion of the checksum
  */
@@ -122,6 +145,99 @@ static const CONF_PARSER module_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+/** Hash a probe by its destination
+ *
+ */
+static uint32_t target_hash(void const *data)
+{
+	rlm_icmp_probe_t const *probe = data;
+
+	if (probe->ip.af == AF_INET) return fr_hash(&probe->ip.addr.v4, sizeof(probe->ip.addr.v4));
+
+	return fr_hash(&probe->ip.addr.v6, sizeof(probe->ip.addr.v6));
+}
+
+static int target_cmp(void const *one, void const *two)
+{
+	rlm_icmp_probe_t const *a = one;
+	rlm_icmp_probe_t const *b = two;
+
+	return fr_ipaddr_cmp(&a->ip, &b->ip);
+}
+
+/** Hash a probe by the fields of the echo reply
+ *
+ */
+static uint32_t echo_hash(void const *data)
+{
+	rlm_icmp_probe_t const *probe = data;
+	uint32_t hash;
+
+	hash = fr_hash_update(&probe->ident, sizeof(probe->ident), target_hash(probe));
+
+	return fr_hash_update(&probe->sequence, sizeof(probe->sequence), hash);
+}
+
+static int echo_cmp(void const *one, void const *two)
+{
+	rlm_icmp_probe_t const *a = one;
+	rlm_icmp_probe_t const *b = two;
+	int ret;
+
+	ret = (a->ident > b->ident) - (a->ident < b->ident);
+	if (ret != 0) return ret;
+
+	ret = (a->sequence > b->sequence) - (a->sequence < b->sequence);
+	if (ret != 0) return ret;
+
+	return target_cmp(a, b);
+}
+
+/** Remove a probe from all the tracking structures, and free it
+ *
+ */
+static void probe_free(rlm_icmp_thread_t *t, rlm_icmp_probe_t *probe)
+{
+	(void) fr_hash_table_delete(t->echoes, probe);
+	(void) fr_hash_table_delete(t->targets, probe);
+	if (probe->queued) fr_dlist_remove(&t->send_queue, probe);
+
+	talloc_free(probe);
+}
+
+/** Tell all of the requests waiting on a probe what the result was
+ *
+ */
+static void probe_done(rlm_icmp_thread_t *t, rlm_icmp_probe_t *probe, bool replied)
+{
+	rlm_icmp_echo_t *echo;
+
+	while ((echo = fr_dlist_head(&probe->waiters))) {
+		fr_dlist_remove(&probe->waiters, echo);
+		echo->probe = NULL;
+		echo->replied = replied;
+		unlang_interpret_resumable(echo->request);
+	}
+
+	probe_free(t, probe);
+}
+
+/** Stop a request waiting on a probe
+ *
+ * The probe is freed once no one is waiting on it.
+ */
+static void echo_release(rlm_icmp_thread_t *t, rlm_icmp_echo_t *echo)
+{
+	rlm_icmp_probe_t *probe = echo->probe;
+
+	if (!probe) return;
+
+	fr_dlist_remove(&probe->waiters, echo);
+	echo->probe = NULL;
+
+	if (fr_dlist_num_elements(&probe->waiters) == 0) probe_free(t, probe);
+}
+
 static xlat_action_t xlat_icmp_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
 				      UNUSED REQUEST *request,
 				      UNUSED void const *xlat_inst, void *xlat_thread_inst,
@@ -134,7 +250,7 @@ static xlat_action_t xlat_icmp_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
 	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_BOOL, NULL, false));
 	vb->vb_bool = echo->replied;
 
-	(void) rbtree_deletebydata(thread->t->tree, echo);
+	echo_release(thread->t, echo);
 	talloc_free(echo);
 
 	fr_cursor_insert(out, vb);
@@ -150,26 +266,108 @@ static void xlat_icmp_cancel(REQUEST *request, UNUSED void *xlat_inst, void *xla
 
 	if (action != FR_SIGNAL_CANCEL) return;
 
-	RDEBUG2("Cancelling ICMP request for %pV (counter=%d)", echo->ip, echo->counter);
+	if (echo->probe) {
+		RDEBUG2("Cancelling ICMP request for %pV (counter=%d)",
+			fr_box_ipaddr(echo->probe->ip), echo->probe->counter);
+	}
 
-	(void) rbtree_deletebydata(thread->t->tree, echo);
+	echo_release(thread->t, echo);
 	talloc_free(echo);
 }
 
 
 static void _xlat_icmp_timeout(REQUEST *request,
-			     UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst, void *rctx, UNUSED fr_time_t fired)
+			     UNUSED void *xlat_inst, void *xlat_thread_inst, void *rctx, UNUSED fr_time_t fired)
 {
 	rlm_icmp_echo_t *echo = talloc_get_type_abort(rctx, rlm_icmp_echo_t);
+	xlat_icmp_thread_inst_t	*thread = talloc_get_type_abort(xlat_thread_inst, xlat_icmp_thread_inst_t);
 
-	if (echo->replied) return; /* it MUST already have been marked resumable. */
+	if (!echo->probe) return; /* it MUST already have been marked resumable. */
 
-	RDEBUG2("No response to ICMP request for %pV (counter=%d)", echo->ip, echo->counter);
+	RDEBUG2("No response to ICMP request for %pV (counter=%d)",
+		fr_box_ipaddr(echo->probe->ip), echo->probe->counter);
+
+	echo_release(thread->t, echo);
 
 	unlang_interpret_resumable(request);
 }
 
-/** Xlat to delay the request
+/** Write out all queued echo requests
+ *
+ * Probes are queued by the xlat, and written here in batches, so
+ * that pinging many addresses costs one system call per batch
+ * instead of one per address.
+ */
+static void mod_icmp_flush(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_icmp_thread_t	*t = talloc_get_type_abort(uctx, rlm_icmp_thread_t);
+	rlm_icmp_t		*inst = t->inst;
+	rlm_icmp_probe_t	*probe, *probes[ICMP_SEND_BATCH];
+	struct mmsghdr		mmsgvec[ICMP_SEND_BATCH];
+	struct iovec		iov[ICMP_SEND_BATCH];
+	struct sockaddr_storage	dst[ICMP_SEND_BATCH];
+	int			i, j, count, sent;
+
+	while (fr_dlist_num_elements(&t->send_queue) > 0) {
+		count = 0;
+
+		while ((count < ICMP_SEND_BATCH) && (probe = fr_dlist_head(&t->send_queue))) {
+			socklen_t salen;
+
+			fr_dlist_remove(&t->send_queue, probe);
+			probe->queued = false;
+
+			(void) fr_ipaddr_to_sockaddr(&probe->ip, 0, &dst[count], &salen);
+
+			iov[count].iov_base = &probe->icmp;
+			iov[count].iov_len = sizeof(probe->icmp);
+
+			memset(&mmsgvec[count], 0, sizeof(mmsgvec[count]));
+			mmsgvec[count].msg_hdr.msg_name = &dst[count];
+			mmsgvec[count].msg_hdr.msg_namelen = salen;
+			mmsgvec[count].msg_hdr.msg_iov = &iov[count];
+			mmsgvec[count].msg_hdr.msg_iovlen = 1;
+
+			probes[count++] = probe;
+		}
+
+		for (i = 0; i < count; i += sent) {
+			if (t->fd < 0) {
+				probe_done(t, probes[i], false);
+				sent = 1;
+				continue;
+			}
+
+			sent = sendmmsg(t->fd, &mmsgvec[i], count - i, 0);
+			if (sent <= 0) {
+				/*
+				 *	sendmmsg only returns an error
+				 *	if the first packet fails, so
+				 *	fail that one, and carry on with
+				 *	the rest.
+				 */
+				ERROR("Failed sending ICMP request to %pV: %s",
+				      fr_box_ipaddr(probes[i]->ip), fr_syserror(errno));
+				probe_done(t, probes[i], false);
+				sent = 1;
+				continue;
+			}
+
+			for (j = i; j < (i + sent); j++) {
+				if (mmsgvec[j].msg_len >= sizeof(icmp_header_t)) continue;
+
+				ERROR("Failed sending entire ICMP packet to %pV", fr_box_ipaddr(probes[j]->ip));
+				probe_done(t, probes[j], false);
+			}
+		}
+	}
+}
+
+/** Xlat to ping an IP address
+ *
+ * Requests which ping an IP that already has an echo request
+ * outstanding wait for the result of that echo request, instead
+ * of sending another one.
  *
  * Example (ping 192.0.2.1):
 @verbatim
@@ -185,12 +383,10 @@ static xlat_action_t xlat_icmp(TALLOC_CTX *ctx, UNUSED fr_cursor_t *out,
 	void			*instance;
 	rlm_icmp_t const	*inst;
 	xlat_icmp_thread_inst_t	*thread = talloc_get_type_abort(xlat_thread_inst, xlat_icmp_thread_inst_t);
+	rlm_icmp_thread_t	*t = thread->t;
 	rlm_icmp_echo_t		*echo;
-	icmp_header_t		icmp;
+	rlm_icmp_probe_t	*probe;
 	uint16_t		checksum;
-	ssize_t			rcode;
-	socklen_t      		salen;
-	struct sockaddr_storage	dst;
 
 	memcpy(&instance, xlat_inst, sizeof(instance));	/* Stupid const issues */
 
@@ -206,47 +402,66 @@ static xlat_action_t xlat_icmp(TALLOC_CTX *ctx, UNUSED fr_cursor_t *out,
 		return XLAT_ACTION_FAIL;
 	}
 
-	if (fr_value_box_cast_in_place(ctx, *in, thread->t->ipaddr_type, NULL) < 0) {
+	if (fr_value_box_cast_in_place(ctx, *in, t->ipaddr_type, NULL) < 0) {
 		RPEDEBUG("Failed casting result to IP address");
 		return XLAT_ACTION_FAIL;
 	}
 
+	if (t->fd < 0) {
+		REDEBUG("ICMP socket is closed");
+		return XLAT_ACTION_FAIL;
+	}
+
 	MEM(echo = talloc_zero(ctx, rlm_icmp_echo_t));
-	echo->ip = *in;
 	echo->request = request;
-	echo->counter = thread->t->counter++;
 
 	/*
-	 *	Add the IP to the local tracking heap, so that the IO
-	 *	functions can find it.
+	 *	If there's already an echo request outstanding for
+	 *	this IP, just wait for its reply.
+	 */
+	probe = fr_hash_table_finddata(t->targets, &(rlm_icmp_probe_t){ .ip = (*in)->vb_ip });
+	if (probe) {
+		RDEBUG("Waiting on outstanding ICMP request to %pV (counter=%d)", *in, probe->counter);
+		goto wait;
+	}
+
+	MEM(probe = talloc_zero(t, rlm_icmp_probe_t));
+	probe->ip = (*in)->vb_ip;
+	probe->ident = t->ident;
+	probe->counter = t->counter++;
+	probe->sequence = probe->counter & 0xffff;
+	fr_dlist_talloc_init(&probe->waiters, rlm_icmp_echo_t, entry);
+
+	/*
+	 *	Add the probe to the local tracking tables, so that
+	 *	the IO functions and other requests can find it.
 	 *
-	 *	This insert will never fail, because of the unique
-	 *	counter above.
+	 *	If another probe with the same ident and sequence is
+	 *	still outstanding for this IP (i.e. we've wrapped
+	 *	the sequence), give up.
 	 */
-	if (!rbtree_insert(thread->t->tree, echo)) {
-		RPEDEBUG("Failed inserting IP into tracking table");
+	if (!fr_hash_table_insert(t->echoes, probe)) {
+		REDEBUG("Too many outstanding ICMP requests for %pV", *in);
+		talloc_free(probe);
 		talloc_free(echo);
 		return XLAT_ACTION_FAIL;
 	}
-
-	if (unlang_xlat_event_timeout_add(request, _xlat_icmp_timeout, echo, fr_time() + inst->timeout) < 0) {
-		RPEDEBUG("Failed adding timeout");
-		(void) rbtree_deletebydata(thread->t->tree, echo);
+	if (!fr_hash_table_insert(t->targets, probe)) {
+		REDEBUG("Failed inserting IP into tracking table");
+		(void) fr_hash_table_delete(t->echoes, probe);
+		talloc_free(probe);
 		talloc_free(echo);
 		return XLAT_ACTION_FAIL;
 	}
 
-	RDEBUG("Sending ICMP request to %pV (counter=%d)", echo->ip, echo->counter);
-
-	icmp = (icmp_header_t) {
-		.type = thread->t->request_type,
-		.ident = thread->t->ident,
-		.data = thread->t->data,
-		.counter = echo->counter
+	probe->icmp = (icmp_header_t) {
+		.type = t->request_type,
+		.ident = probe->ident,
+		.sequence = probe->sequence,
+		.data = t->data,
+		.counter = probe->counter
 	};
 
-	(void) fr_ipaddr_to_sockaddr(&echo->ip->vb_ip, 0, &dst, &salen);
-
 	/*
 	 *	Calculate the checksum
 	 */
@@ -255,27 +470,39 @@ static xlat_action_t xlat_icmp(TALLOC_CTX *ctx, UNUSED fr_cursor_t *out,
 	/*
 	 *	Start off with the IPv6 pseudo-header checksum
 	 */
-	if (thread->t->ipaddr_type == FR_TYPE_IPV6_ADDR) {
-		checksum = fr_ip6_pesudo_header_checksum(&thread->t->inst->src_ipaddr.addr.v6, &echo->ip->vb_ip.addr.v6,
-							 sizeof(ip_header6_t) + sizeof(icmp), IPPROTO_ICMPV6);
+	if (t->ipaddr_type == FR_TYPE_IPV6_ADDR) {
+		checksum = fr_ip6_pesudo_header_checksum(&t->inst->src_ipaddr.addr.v6, &probe->ip.addr.v6,
+							 sizeof(ip_header6_t) + sizeof(probe->icmp), IPPROTO_ICMPV6);
 	}
 
 	/*
 	 *	Followed by checksumming the actual ICMP packet.
 	 */
-	icmp.checksum = htons(icmp_checksum((uint8_t *) &icmp, sizeof(icmp), checksum));
+	probe->icmp.checksum = htons(icmp_checksum((uint8_t *) &probe->icmp, sizeof(probe->icmp), checksum));
 
-	rcode = sendto(thread->t->fd, &icmp, sizeof(icmp), 0, (struct sockaddr *) &dst, salen);
-	if (rcode < 0) {
-		REDEBUG("Failed sending ICMP request to %pV: %s", echo->ip, fr_syserror(errno));
-		(void) rbtree_deletebydata(thread->t->tree, echo);
+	/*
+	 *	Queue the probe, and write out everything queued
+	 *	during this pass through the event loop in one go.
+	 */
+	RDEBUG("Sending ICMP request to %pV (counter=%d)", *in, probe->counter);
+
+	fr_dlist_insert_tail(&t->send_queue, probe);
+	probe->queued = true;
+
+	if (!t->flush_ev && (fr_event_timer_in(t, t->el, &t->flush_ev, 0, mod_icmp_flush, t) < 0)) {
+		RPEDEBUG("Failed adding send event");
+		probe_free(t, probe);
 		talloc_free(echo);
 		return XLAT_ACTION_FAIL;
 	}
 
-	if ((size_t) rcode < sizeof(icmp)) {
-		REDEBUG("Failed sending entire ICMP packet");
-		(void) rbtree_deletebydata(thread->t->tree, echo);
+wait:
+	fr_dlist_insert_tail(&probe->waiters, echo);
+	echo->probe = probe;
+
+	if (unlang_xlat_event_timeout_add(request, _xlat_icmp_timeout, echo, fr_time() + inst->timeout) < 0) {
+		RPEDEBUG("Failed adding timeout");
+		echo_release(t, echo);
 		talloc_free(echo);
 		return XLAT_ACTION_FAIL;
 	}
@@ -283,27 +510,19 @@ static xlat_action_t xlat_icmp(TALLOC_CTX *ctx, UNUSED fr_cursor_t *out,
 	return unlang_xlat_yield(request, xlat_icmp_resume, xlat_icmp_cancel, echo);
 }
 
-static int echo_cmp(void const *one, void const *two)
-{
-	rlm_icmp_echo_t const *a = one;
-	rlm_icmp_echo_t const *b = two;
-
-	/*
-	 *	No need to check IP, because "counter" is unique for each packet.
-	 */
-	return (a->counter < b->counter) - (a->counter > b->counter);
-}
-
 static void mod_icmp_read(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUSED int flags, void *ctx)
 {
 	rlm_icmp_thread_t *t = talloc_get_type_abort(ctx, rlm_icmp_thread_t);
 	rlm_icmp_t *inst = t->inst;
 	ssize_t len;
 	icmp_header_t *icmp;
-	rlm_icmp_echo_t my_echo, *echo;
+	rlm_icmp_probe_t my_probe, *probe;
 	uint64_t buffer[256];
+	struct sockaddr_storage from;
+	socklen_t fromlen = sizeof(from);
+	uint16_t port;
 
-	len = read(t->fd, (char *) buffer, sizeof(buffer));
+	len = recvfrom(t->fd, (char *) buffer, sizeof(buffer), 0, (struct sockaddr *) &from, &fromlen);
 	if (len <= 0) return;
 
 	HEXDUMP4((uint8_t const *)buffer, len, "received icmp packet ");
@@ -311,7 +530,7 @@ static void mod_icmp_read(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUSED
 	/*
 	 *	Ignore packets if we haven't sent any requests.
 	 */
-	if (rbtree_num_elements(t->tree) == 0) {
+	if (fr_hash_table_num_elements(t->echoes) == 0) {
 		return;
 	}
 
@@ -351,7 +570,7 @@ static void mod_icmp_read(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUSED
 	/*
 	 *	Ignore packets which aren't an echo reply, or which
 	 *	weren't for us.  This is done *before* looking packets
-	 *	up in the rbtree, as these checks ensure that the
+	 *	up in the hash table, as these checks ensure that the
 	 *	packet is for this specific thread.
 	 */
 	if ((icmp->type != t->reply_type) ||
@@ -362,20 +581,23 @@ static void mod_icmp_read(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUSED
 	/*
 	 *	Look up the packet by the fields which determine *our* ICMP packets.
 	 */
-	my_echo.counter = icmp->counter;
-	echo = rbtree_finddata(t->tree, &my_echo);
-	if (!echo) {
-		DEBUG("Can't find packet counter=%d in tree", icmp->counter);
+	memset(&my_probe, 0, sizeof(my_probe));
+	if (fr_ipaddr_from_sockaddr(&from, fromlen, &my_probe.ip, &port) < 0) return;
+	my_probe.ident = icmp->ident;
+	my_probe.sequence = icmp->sequence;
+
+	probe = fr_hash_table_finddata(t->echoes, &my_probe);
+	if (!probe || (probe->counter != icmp->counter)) {
+		DEBUG("Can't find packet counter=%d from %pV in tracking table",
+		      icmp->counter, fr_box_ipaddr(my_probe.ip));
 		return;
 	}
 
-	(void) rbtree_deletebydata(t->tree, echo);
-
 	/*
-	 *	We have a reply!
+	 *	We have a reply!  Resume everyone who was waiting
+	 *	for it.
 	 */
-	echo->replied = true;
-	unlang_interpret_resumable(echo->request);
+	probe_done(t, probe, true);
 }
 
 static void mod_icmp_error(fr_event_list_t *el, UNUSED int sockfd, UNUSED int flags,
@@ -429,7 +651,9 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
 	rlm_icmp_thread_t *t = talloc_get_type_abort(thread, rlm_icmp_thread_t);
 	fr_ipaddr_t ipaddr, *src;
 
-	MEM(t->tree = rbtree_alloc(t, echo_cmp, NULL, RBTREE_FLAG_NONE));
+	MEM(t->echoes = fr_hash_table_create(t, echo_hash, echo_cmp, NULL));
+	MEM(t->targets = fr_hash_table_create(t, target_hash, target_cmp, NULL));
+	fr_dlist_talloc_init(&t->send_queue, rlm_icmp_probe_t, entry);
 	t->inst = inst;
 	t->el = el;
 
@@ -529,6 +753,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	xlat = xlat_async_register(inst, inst->xlat_name, xlat_icmp);
 	xlat_async_instantiate_set(xlat, mod_xlat_instantiate, rlm_icmp_t *, NULL, inst);
 	xlat_async_thread_instantiate_set(xlat, mod_xlat_thread_instantiate, xlat_icmp_thread_inst_t, NULL, inst);
+	xlat_async_yields_set(xlat);
 
 	FR_TIME_DELTA_BOUND_CHECK("timeout", inst->timeout, >=, fr_time_delta_from_msec(100)); /* 1/10s minimum timeout */
 	FR_TIME_DELTA_BOUND_CHECK("timeout", inst->timeout, <=, fr_time_delta_from_sec(10));
@@ -27,6 +27,10 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/curl/base.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/sha1.h>
+
+#include <pthread.h>
 
 static fr_dict_t 	const 		*dict_radius; /*dictionary for radius protocol*/
 
@@ -46,10 +50,35 @@ fr_dict_attr_autoload_t rlm_imap_dict_attr[] = {
 	{ NULL },
 };
 
+#define IMAP_CACHE_SECRET_LEN	(16)
+
+/** Credentials which recently authenticated successfully
+ *
+ * Only a keyed hash of the password is kept.
+ */
+typedef struct {
+	char			*username;			//!< User-Name the credentials are for.
+	uint8_t			digest[SHA1_DIGEST_LENGTH];	//!< HMAC of the User-Password.
+	fr_time_t		expires;			//!< When the entry should no longer be used.
+	fr_dlist_t		entry;				//!< Entry in the LRU list.
+} imap_cache_entry_t;
+
+typedef struct {
+	pthread_mutex_t		mutex;				//!< Workers all share the same cache.
+	rbtree_t		*tree;				//!< Entries, keyed on username.
+	fr_dlist_head_t		lru;				//!< Most recently added to at the head.
+	uint8_t			secret[IMAP_CACHE_SECRET_LEN];	//!< Random key for the password HMAC.
+} imap_cache_t;
+
 typedef struct {
 	char const			*uri;		//!< URI of imap server
 	fr_time_delta_t 		timeout;	//!< Timeout for connection and server response
 	fr_curl_tls_t			tls;
+
+	uint32_t			cache_max_entries;	//!< Maximum number of cached credentials.
+							///< 0 disables the cache.
+	fr_time_delta_t			cache_lifetime;	//!< How long successful credentials are cached for.
+	imap_cache_t			*cache;		//!< Cache of credentials, NULL if disabled.
 } rlm_imap_t;
 
 typedef struct {
@@ -57,6 +86,20 @@ typedef struct {
 	fr_curl_handle_t    		*mhandle;	//!< Thread specific multi handle.  Serves as the dispatch and coralling structure for imap requests.
 } rlm_imap_thread_t;
 
+/** Data needed to cache the credentials once the IMAP server responds
+ *
+ */
+typedef struct {
+	char const			*username;	//!< User-Name, parented by the request.
+	uint8_t				digest[SHA1_DIGEST_LENGTH];	//!< HMAC of the User-Password.
+} imap_auth_ctx_t;
+
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_imap_t, cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_TIME_DELTA, rlm_imap_t, cache_lifetime), .dflt = "30" },
+	CONF_PARSER_TERMINATOR
+};
+
 /*
  *	A mapping of configuration file names to internal variables.
  */
@@ -64,9 +107,113 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("uri", FR_TYPE_STRING, rlm_imap_t, uri) },
 	{ FR_CONF_OFFSET("timeout",FR_TYPE_TIME_DELTA, rlm_imap_t, timeout) },
 	{ FR_CONF_OFFSET("tls", FR_TYPE_SUBSECTION, rlm_imap_t, tls), .subcs = (void const *) fr_curl_tls_config },//!<loading the tls values
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
+static int imap_cache_cmp(void const *one, void const *two)
+{
+	imap_cache_entry_t const *a = one, *b = two;
+
+	return strcmp(a->username, b->username);
+}
+
+static int _imap_cache_free(imap_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+static void imap_cache_entry_free(imap_cache_t *cache, imap_cache_entry_t *entry)
+{
+	rbtree_deletebydata(cache->tree, entry);
+	fr_dlist_remove(&cache->lru, entry);
+	talloc_free(entry);
+}
+
+/** Calculate the keyed hash of a password, which is what the cache stores
+ *
+ */
+static void imap_cache_digest(uint8_t digest[static SHA1_DIGEST_LENGTH], imap_cache_t const *cache,
+			      VALUE_PAIR const *password)
+{
+	fr_hmac_sha1(digest, password->vp_octets, password->vp_length, cache->secret, sizeof(cache->secret));
+}
+
+/** Check whether credentials authenticated successfully within the last lifetime
+ *
+ * @param[in] cache	to search.
+ * @param[in] username	to find.
+ * @param[in] digest	of the User-Password.
+ * @param[in] now	The current time.
+ * @return
+ *	- true if the credentials are cached.
+ *	- false if they're not, or the cached password is different.
+ */
+static bool imap_cache_find(imap_cache_t *cache, char const *username,
+			    uint8_t const digest[static SHA1_DIGEST_LENGTH], fr_time_t now)
+{
+	imap_cache_entry_t	find, *entry;
+	bool			found = false;
+
+	memcpy(&find.username, &username, sizeof(find.username));	/* Only used for the comparison */
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = rbtree_finddata(cache->tree, &find);
+	if (entry) {
+		if (entry->expires <= now) {
+			imap_cache_entry_free(cache, entry);
+		} else {
+			found = (fr_digest_cmp(entry->digest, digest, SHA1_DIGEST_LENGTH) == 0);
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return found;
+}
+
+/** Record credentials which the IMAP server accepted
+ *
+ */
+static void imap_cache_add(rlm_imap_t const *inst, char const *username,
+			   uint8_t const digest[static SHA1_DIGEST_LENGTH], fr_time_t now)
+{
+	imap_cache_t		*cache = inst->cache;
+	imap_cache_entry_t	find, *entry;
+
+	memcpy(&find.username, &username, sizeof(find.username));	/* Only used for the comparison */
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = rbtree_finddata(cache->tree, &find);
+	if (!entry) {
+		/*
+		 *	Make room by evicting whichever entry was
+		 *	added to least recently.
+		 */
+		if (rbtree_num_elements(cache->tree) >= inst->cache_max_entries) {
+			imap_cache_entry_t *oldest = fr_dlist_tail(&cache->lru);
+
+			if (oldest) imap_cache_entry_free(cache, oldest);
+		}
+
+		MEM(entry = talloc_zero(cache, imap_cache_entry_t));
+		MEM(entry->username = talloc_strdup(entry, username));
+		if (!rbtree_insert(cache->tree, entry)) {
+			pthread_mutex_unlock(&cache->mutex);
+			talloc_free(entry);
+			return;
+		}
+	} else {
+		fr_dlist_remove(&cache->lru, entry);
+	}
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	memcpy(entry->digest, digest, sizeof(entry->digest));
+	entry->expires = now + inst->cache_lifetime;
+	pthread_mutex_unlock(&cache->mutex);
+}
+
 /*
  *	Called when the IMAP server responds
  *	It checks if the response was CURLE_OK
@@ -76,6 +223,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate_resume(module_ctx_t const *
 {
 	rlm_imap_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_imap_t);
 	fr_curl_io_request_t     	*randle = rctx;
+	imap_auth_ctx_t			*auth = randle->uctx;
 	fr_curl_tls_t const		*tls;
 	long 				curl_out;
 	long				curl_out_valid;
@@ -96,6 +244,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate_resume(module_ctx_t const *
 
 	if (tls->extract_cert_attrs) fr_curl_response_certinfo(request, randle);
 
+	if (auth) imap_cache_add(inst, auth->username, auth->digest, fr_time());
+
 	talloc_free(randle);
 	return RLM_MODULE_OK;
 }
@@ -119,12 +269,7 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) mod_authenticate(module_ctx_t const *mc
 	VALUE_PAIR const 	*username;
 	VALUE_PAIR const 	*password;
 	fr_curl_io_request_t    *randle;
-
-	randle = fr_curl_io_request_alloc(request);
-	if (!randle){
-	error:
-		return RLM_MODULE_FAIL;
-	}
+	imap_auth_ctx_t		*auth = NULL;
 
 	username = fr_pair_find_by_da(request->packet->vps, attr_user_name, TAG_ANY);
 	password = fr_pair_find_by_da(request->packet->vps, attr_user_password, TAG_ANY);
@@ -144,6 +289,31 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) mod_authenticate(module_ctx_t const *mc
 		return RLM_MODULE_INVALID;
 	}
 
+	/*
+	 *	Don't go back to the IMAP server if the same
+	 *	credentials were accepted recently.
+	 */
+	if (inst->cache) {
+		uint8_t digest[SHA1_DIGEST_LENGTH];
+
+		imap_cache_digest(digest, inst->cache, password);
+		if (imap_cache_find(inst->cache, username->vp_strvalue, digest, fr_time())) {
+			RDEBUG2("Credentials were recently accepted by the IMAP server");
+			return RLM_MODULE_OK;
+		}
+
+		MEM(auth = talloc(request, imap_auth_ctx_t));
+		auth->username = username->vp_strvalue;
+		memcpy(auth->digest, digest, sizeof(auth->digest));
+	}
+
+	randle = fr_curl_io_request_alloc(request);
+	if (!randle){
+	error:
+		return RLM_MODULE_FAIL;
+	}
+	randle->uctx = auth;
+
 	FR_CURL_REQUEST_SET_OPTION(CURLOPT_USERNAME, username->vp_strvalue);
 	FR_CURL_REQUEST_SET_OPTION(CURLOPT_PASSWORD, password->vp_strvalue);
 
@@ -152,8 +322,6 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) mod_authenticate(module_ctx_t const *mc
 	FR_CURL_REQUEST_SET_OPTION(CURLOPT_CONNECTTIMEOUT_MS, fr_time_delta_to_msec(inst->timeout));
 	FR_CURL_REQUEST_SET_OPTION(CURLOPT_TIMEOUT_MS, fr_time_delta_to_msec(inst->timeout));
 
-	FR_CURL_REQUEST_SET_OPTION(CURLOPT_VERBOSE, 1L);
-
 	if (fr_curl_easy_tls_init(randle, &inst->tls) != 0) return RLM_MODULE_INVALID;
 
 	if (fr_curl_io_request_enqueue(t->mhandle, request, randle)) return RLM_MODULE_INVALID;
@@ -161,6 +329,34 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) mod_authenticate(module_ctx_t const *mc
 	return unlang_module_yield(request, mod_authenticate_resume, NULL, randle);
 }
 
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_imap_t	*inst = talloc_get_type_abort(instance, rlm_imap_t);
+	imap_cache_t	*cache;
+	size_t		i;
+
+	if (!inst->cache_max_entries) return 0;
+
+	FR_TIME_DELTA_BOUND_CHECK("cache.lifetime", inst->cache_lifetime, >=, fr_time_delta_from_sec(1));
+
+	MEM(cache = talloc_zero(inst, imap_cache_t));
+	cache->tree = rbtree_talloc_alloc(cache, imap_cache_cmp, imap_cache_entry_t, NULL, 0);
+	if (!cache->tree) {
+		cf_log_err(conf, "Failed creating credential cache");
+		talloc_free(cache);
+		return -1;
+	}
+	fr_dlist_talloc_init(&cache->lru, imap_cache_entry_t, entry);
+
+	for (i = 0; i < sizeof(cache->secret); i++) cache->secret[i] = fr_rand();
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _imap_cache_free);
+	inst->cache = cache;
+
+	return 0;
+}
+
 /*
  *	Initialize global curl instance
  */
@@ -188,7 +384,7 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instanc
 
 	t->inst = instance;
 
-	mhandle = fr_curl_io_init(t, el, false);
+	mhandle = fr_curl_io_init(t, el, NULL);
 	if (!mhandle) return -1;
 
 	t->mhandle = mhandle;
@@ -223,6 +419,7 @@ module_t rlm_imap = {
 	.inst_size	        = sizeof(rlm_imap_t),
 	.thread_inst_size   	= sizeof(rlm_imap_thread_t),
 	.config		        = module_config,
+	.instantiate		= mod_instantiate,
 	.onload            	= mod_load,
 	.unload             	= mod_unload,
 	.thread_instantiate 	= mod_thread_instantiate,
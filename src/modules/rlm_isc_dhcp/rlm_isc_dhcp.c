@@ -81,15 +81,17 @@ typedef struct {
 	rlm_isc_dhcp_info_t	*head;
 
 	/*
-	 *	While "host" blocks can appear anywhere, their
-	 *	definitions are global.  We use these hashes for
-	 *	dedup, and for assigning IP addresses in the `recv`
-	 *	section.  We still need to have host hashes in the
-	 *	subsections, so that we can apply options from the
-	 *	bottom up.
+	 *	While "host" and "subnet" blocks can appear anywhere,
+	 *	their definitions are global.  We use these for
+	 *	dedup, for assigning IP addresses in the `recv`
+	 *	section, and for finding the options to apply.  Each
+	 *	host and subnet has its options pre-merged with those
+	 *	of the sections which enclose it, so we don't need
+	 *	to walk the sections when processing packets.
 	 */
 	fr_hash_table_t		*hosts_by_ether;       	//!< by MAC address
 	fr_hash_table_t		*hosts_by_uid;		//!< by client identifier
+	fr_trie_t		*subnets;		//!< by network, for longest prefix match
 } rlm_isc_dhcp_t;
 
 /*
@@ -156,6 +158,7 @@ typedef enum rlm_isc_dhcp_type_t {
 	ISC_GROUP,
 	ISC_HOST,
 	ISC_SUBNET,
+	ISC_SHARED_NETWORK,
 	ISC_OPTION,
 	ISC_HARDWARE_ETHERNET,
 	ISC_FIXED_ADDRESS,
@@ -192,10 +195,8 @@ struct rlm_isc_dhcp_info_s {
 	/*
 	 *	Only for things that have sections
 	 */
-	fr_hash_table_t		*hosts_by_ether;  //!< by MAC address
-	fr_hash_table_t		*hosts_by_uid;	//!< by client identifier
 	VALUE_PAIR		*options;	//!< DHCP options
-	fr_trie_t		*subnets;
+	VALUE_PAIR		*merged;	//!< options from this section, and all enclosing ones.
 	rlm_isc_dhcp_info_t	*child;
 	rlm_isc_dhcp_info_t	**last;		//!< pointer to last child
 };
@@ -1381,7 +1382,7 @@ static int parse_host(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *info
 {
 	isc_host_ether_t *my_ether, *old_ether;
 	isc_host_uid_t *my_uid, *old_uid;
-	rlm_isc_dhcp_info_t *ether, *child, *parent;
+	rlm_isc_dhcp_info_t *ether, *child;
 	VALUE_PAIR *vp;
 
 	ether = NULL;
@@ -1465,57 +1466,10 @@ static int parse_host(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *info
 		}
 	}
 
-	/*
-	 *	The host doesn't have a parent, that's fine..
-	 *
-	 *	It typically should tho...
-	 */
-	if (!info->parent) return 2;
-
-	parent = info->parent;
-
-	/*
-	 *	Add the host to the *parents* hash table.  That way
-	 *	when we apply the parent, we can look up the host in
-	 *	its hash table.  And avoid the O(N) issue of having
-	 *	thousands of "host" entries in the parent->child list.
-	 */
-	if (!parent->hosts_by_ether) {
-		parent->hosts_by_ether = fr_hash_table_create(parent, host_ether_hash, host_ether_cmp, NULL);
-		if (!parent->hosts_by_ether) {
-			return -1;
-		}
-	}
-
-	if (fr_hash_table_insert(parent->hosts_by_ether, my_ether) < 0) {
-		fr_strerror_printf("Failed inserting 'host %s' into hash table",
-				   info->argv[0]->vb_strvalue);
-		return -1;
-	}
-
-	/*
-	 *	If we have a UID, insert into the UID hashes.
-	 */
-	if (my_uid) {
-		if (!parent->hosts_by_uid) {
-			parent->hosts_by_uid = fr_hash_table_create(parent, host_uid_hash, host_uid_cmp, NULL);
-			if (!parent->hosts_by_uid) {
-				return -1;
-			}
-		}
-
-
-		if (fr_hash_table_insert(parent->hosts_by_uid, my_uid) < 0) {
-			fr_strerror_printf("Failed inserting 'host %s' into hash table",
-					   info->argv[0]->vb_strvalue);
-			return -1;
-		}
-	}
-
 	IDEBUG("%.*s host %s { ... }", state->braces, spaces, info->argv[0]->vb_strvalue);
 
 	/*
-	 *	We've remembered the host in the parent hosts hash.
+	 *	We've remembered the host in the global hosts hash.
 	 *	There's no need to add it to the child list here.
 	 */
 	return 2;
@@ -1531,7 +1485,7 @@ static int parse_host(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *info
  */
 static int parse_subnet(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *info)
 {
-	rlm_isc_dhcp_info_t *parent;
+	rlm_isc_dhcp_info_t *old;
 	int rcode, bits;
 	uint32_t netmask = info->argv[1]->vb_ipv4addr;
 
@@ -1561,32 +1515,24 @@ static int parse_subnet(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *in
 	netmask = netmask + (netmask >> 16);
 	bits = netmask & 0x0000003F;
 
-	parent = info->parent;
-	if (parent->subnets) {
-		rlm_isc_dhcp_info_t *old;
-
-		/*
-		 *	Duplicate or overlapping "subnet" entries aren't allowd.
-		 */
-		old = fr_trie_lookup(parent->subnets, &(info->argv[0]->vb_ipv4addr), bits);
-		if (old) {
-			fr_strerror_printf("subnet %pV netmask %pV' overlaps with existing subnet", info->argv[0], info->argv[1]);
-			return -1;
-
-		}
-	} else {
-		parent->subnets = fr_trie_alloc(parent);
-		if (!parent->subnets) return -1;
+	/*
+	 *	Duplicate or overlapping "subnet" entries aren't allowed,
+	 *	no matter which sections they're in.
+	 */
+	old = fr_trie_lookup(state->inst->subnets, &(info->argv[0]->vb_ipv4addr), bits);
+	if (old) {
+		fr_strerror_printf("subnet %pV netmask %pV' overlaps with existing subnet %pV netmask %pV",
+				   info->argv[0], info->argv[1], old->argv[0], old->argv[1]);
+		return -1;
 	}
 
 	/*
-	 *	Add the subnet to the *parents* trie.  That way when
-	 *	we apply the parent, we can look up the subnet in its
-	 *	trie.  And avoid the O(N) issue of having thousands of
-	 *	"subnet" entries in the parent->child list.
+	 *	Add the subnet to the global trie.  That way we can
+	 *	find the subnet for an address with one lookup, and
+	 *	avoid the O(N) issue of having thousands of "subnet"
+	 *	entries in the parent->child list.
 	 */
-
-	rcode = fr_trie_insert(parent->subnets, &(info->argv[0]->vb_ipv4addr), bits, info);
+	rcode = fr_trie_insert(state->inst->subnets, &(info->argv[0]->vb_ipv4addr), bits, info);
 	if (rcode < 0) {
 		fr_strerror_printf("Failed inserting 'subnet %pV netmask %pV' into trie",
 				   info->argv[0], info->argv[1]);
@@ -1603,7 +1549,7 @@ static int parse_subnet(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *in
 	IDEBUG("%.*s subnet %pV netmask %pV { ... }", state->braces, spaces, info->argv[0], info->argv[1]);
 
 	/*
-	 *	We've remembered the subnet in the parent trie.
+	 *	We've remembered the subnet in the global trie.
 	 *	There's no need to add it to the child list here.
 	 */
 	return 2;
@@ -1802,129 +1748,159 @@ static int apply_fixed_ip(rlm_isc_dhcp_t const *inst, REQUEST *request)
 	return 0;
 }
 
-/** Apply all rules *except* fixed IP
+/** Add options to a reply, unless the reply already has them
  *
  */
-static int apply(rlm_isc_dhcp_t const *inst, REQUEST *request, rlm_isc_dhcp_info_t *head)
+static int apply_options(REQUEST *request, VALUE_PAIR *options)
 {
-	int rcode, child_rcode;
-	rlm_isc_dhcp_info_t *info;
-	VALUE_PAIR *yiaddr;
+	VALUE_PAIR *vp = NULL;
+	fr_cursor_t option_cursor;
+	fr_cursor_t reply_cursor;
 
-	rcode = 0;
-	yiaddr = fr_pair_find_by_da(request->reply->vps, attr_your_ip_address, TAG_ANY);
+	if (!options) return 0;
+
+	(void) fr_cursor_init(&reply_cursor, &request->reply->vps);
+	(void) fr_cursor_tail(&reply_cursor);
 
 	/*
-	 *	First, apply any "host" options
+	 *	Walk over the input list, adding the options
+	 *	only if they don't already exist in the reply.
+	 *
+	 *	This is O(R*P), complexity is (reply VPs * option
+	 *	VPs).  The options were merged from all of the
+	 *	enclosing sections when the file was read, so we
+	 *	don't need to do this again for each section.
 	 */
-	if (head->hosts_by_ether) {
-		rlm_isc_dhcp_info_t *host = NULL;
+	for (vp = fr_cursor_init(&option_cursor, &options);
+	     vp != NULL;
+	     vp = fr_cursor_next(&option_cursor)) {
+		VALUE_PAIR *reply;
 
-		host = get_host(request, head->hosts_by_ether, head->hosts_by_uid);
-		if (!host) goto subnet;
+		reply = fr_pair_find_by_da(request->reply->vps, vp->da, TAG_ANY);
+		if (reply) continue;
 
 		/*
-		 *	Apply any options in the "host" section.
+		 *	Copy all of the same options to the
+		 *	reply.
 		 */
-		child_rcode = apply(inst, request, host);
-		if (child_rcode < 0) return child_rcode;
-		if (child_rcode == 1) rcode = 1;
+		while (vp) {
+			VALUE_PAIR *next, *copy;
+
+			copy = fr_pair_copy(request->reply, vp);
+			if (!copy) return -1;
+
+			fr_cursor_append(&reply_cursor, copy);
+			(void) fr_cursor_tail(&reply_cursor);
+
+			next = fr_cursor_next_peek(&option_cursor);
+			if (!next) break;
+			if (next->da != vp->da) break;
+
+			vp = fr_cursor_next(&option_cursor);
+		}
 	}
 
-subnet:
 	/*
-	 *	Look in the trie for matching subnets, and apply any
-	 *	subnets that match.
+	 *	We applied some options.
 	 */
-	if (head->subnets && yiaddr) {
-		info = fr_trie_lookup(head->subnets, &yiaddr->vp_ipv4addr, 32);
-		if (!info) goto recurse;
+	return 1;
+}
+
+/** Apply all rules *except* fixed IP
+ *
+ *	The "host" is more specific than the "subnet", so its
+ *	options are applied first.  Options from the top level of
+ *	the file are in both merged lists, and are applied only
+ *	if there's no host or subnet.
+ */
+static int apply(rlm_isc_dhcp_t const *inst, REQUEST *request)
+{
+	int rcode, child_rcode;
+	rlm_isc_dhcp_info_t *host, *subnet = NULL;
+	VALUE_PAIR *yiaddr;
+
+	rcode = 0;
 
-		child_rcode = apply(inst, request, info);
+	host = get_host(request, inst->hosts_by_ether, inst->hosts_by_uid);
+	if (host) {
+		child_rcode = apply_options(request, host->merged);
 		if (child_rcode < 0) return child_rcode;
 		if (child_rcode == 1) rcode = 1;
 	}
 
-recurse:
-	for (info = head->child; info != NULL; info = info->next) {
-		if (!info->cmd) return -1; /* internal error */
-
-		if (!info->cmd->apply) continue;
+	/*
+	 *	Look in the trie for the most specific subnet
+	 *	containing the address we're assigning.
+	 */
+	yiaddr = fr_pair_find_by_da(request->reply->vps, attr_your_ip_address, TAG_ANY);
+	if (yiaddr) subnet = fr_trie_lookup(inst->subnets, &yiaddr->vp_ipv4addr, 32);
 
-		child_rcode = info->cmd->apply(inst, request, info);
+	if (subnet) {
+		child_rcode = apply_options(request, subnet->merged);
 		if (child_rcode < 0) return child_rcode;
-		if (child_rcode == 0) continue;
-
-		rcode = 1;
+		if (child_rcode == 1) rcode = 1;
 	}
 
-	/*
-	 *	Now that our children have added options, see if we
-	 *	can add some, too.
-	 */
-	if (head->options) {
-		VALUE_PAIR *vp = NULL;
-		fr_cursor_t option_cursor;
-		fr_cursor_t reply_cursor;
+	if (!host && !subnet) {
+		child_rcode = apply_options(request, inst->head->options);
+		if (child_rcode < 0) return child_rcode;
+		if (child_rcode == 1) rcode = 1;
+	}
 
-		(void) fr_cursor_init(&reply_cursor, &request->reply->vps);
-		(void) fr_cursor_tail(&reply_cursor);
+	return rcode;
+}
 
-		/*
-		 *	Walk over the input list, adding the options
-		 *	only if they don't already exist in the reply.
-		 *
-		 *	Yes, we know that this is O(R*P*D), complexity
-		 *	is (reply VPs * option VPs * depth of options).
-		 *
-		 *	Unless we make the code a lot smarter, this is
-		 *	the best we can do.  Since there are likely
-		 *	only a few options (i.e. less than 100), this
-		 *	is deemed to be OK.
-		 *
-		 *	In order to fix this, we would need to sort
-		 *	all of the options first, sort the reply VPs,
-		 *	then walk over the reply VPs, and look at each
-		 *	option list in turn, seeing if there are
-		 *	options that match.  This would likely be
-		 *	faster.
-		 */
-		for (vp = fr_cursor_init(&option_cursor, &head->options);
-		     vp != NULL;
-		     vp = fr_cursor_next(&option_cursor)) {
-			VALUE_PAIR *reply;
+/** Merge the options of a section with the options of all enclosing sections
+ *
+ *	If an option is in more than one section, the most specific
+ *	section wins, and all of its copies of that option are used.
+ */
+static int merge_options(rlm_isc_dhcp_info_t *info)
+{
+	rlm_isc_dhcp_info_t *section;
+	VALUE_PAIR **tail = &info->merged;
 
-			reply = fr_pair_find_by_da(request->reply->vps, vp->da, TAG_ANY);
-			if (reply) continue;
+	for (section = info; section != NULL; section = section->parent) {
+		VALUE_PAIR *vp, *head = NULL;
+		fr_cursor_t section_cursor, cursor;
 
-			/*
-			 *	Copy all of the same options to the
-			 *	reply.
-			 */
-			while (vp) {
-				VALUE_PAIR *next, *copy;
+		fr_cursor_init(&cursor, &head);
 
-				copy = fr_pair_copy(request->reply, vp);
-				if (!copy) return -1;
+		for (vp = fr_cursor_init(&section_cursor, &section->options);
+		     vp != NULL;
+		     vp = fr_cursor_next(&section_cursor)) {
+			VALUE_PAIR *copy;
 
-				fr_cursor_append(&reply_cursor, copy);
-				(void) fr_cursor_tail(&reply_cursor);
+			if (fr_pair_find_by_da(info->merged, vp->da, TAG_ANY)) continue;
 
-				next = fr_cursor_next_peek(&option_cursor);
-				if (!next) break;
-				if (next->da != vp->da) break;
+			copy = fr_pair_copy(info, vp);
+			if (!copy) return -1;
 
-				vp = fr_cursor_next(&option_cursor);
-			}
+			fr_cursor_append(&cursor, copy);
 		}
 
 		/*
-		 *	We applied some options.
+		 *	Only add the options after we've checked the
+		 *	whole section, so that repeated options in one
+		 *	section are all kept.
 		 */
-		rcode = 1;
+		*tail = head;
+		while (*tail) tail = &(*tail)->next;
 	}
 
-	return rcode;
+	return 0;
+}
+
+static int merge_host_options(UNUSED void *ctx, void *data)
+{
+	isc_host_ether_t *ether = data;
+
+	return merge_options(ether->host);
+}
+
+static int merge_subnet_options(UNUSED void *ctx, UNUSED uint8_t const *key, UNUSED size_t keylen, void *data)
+{
+	return merge_options(data);
 }
 
 #define isc_not_done	ISC_NOOP, NULL, NULL
@@ -2046,7 +2022,7 @@ static const rlm_isc_dhcp_cmd_t commands[] = {
 	{ "server-id-check BOOL", 		isc_not_done, 1}, // boolean can be true, false or ignore
 	{ "server-identifier IPADDR", 		ISC_NOOP, parse_server_identifier, NULL, 1}, // ipaddr or host name
 	{ "server-name STRING", 		ISC_NOOP, parse_server_name, NULL, 1}, // text string
-	{ "shared-network STRING SECTION",	isc_not_done, 1},
+	{ "shared-network STRING SECTION",	ISC_SHARED_NETWORK, NULL, NULL, 1},
 	{ "site-option-space STRING", 		isc_invalid,  1}, // vendor option declaration statement
 	{ "stash-agent-options BOOL", 		isc_not_done, 1}, // boolean can be true, false or ignore
 	{ "subnet IPADDR netmask IPADDR SECTION", ISC_SUBNET, parse_subnet, NULL, 2},
@@ -2206,6 +2182,20 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->head = info = talloc_zero(inst, rlm_isc_dhcp_info_t);
 	info->last = &(info->child);
 
+	/*
+	 *	These have to exist before we read the file, as
+	 *	"host" and "subnet" insert themselves as they're
+	 *	parsed.
+	 */
+	inst->hosts_by_ether = fr_hash_table_create(inst, host_ether_hash, host_ether_cmp, NULL);
+	if (!inst->hosts_by_ether) return -1;
+
+	inst->hosts_by_uid = fr_hash_table_create(inst, host_uid_hash, host_uid_cmp, NULL);
+	if (!inst->hosts_by_uid) return -1;
+
+	inst->subnets = fr_trie_alloc(inst);
+	if (!inst->subnets) return -1;
+
 	rcode = read_file(inst, info, inst->filename);
 	if (rcode < 0) {
 		cf_log_err(conf, "%s", fr_strerror());
@@ -2217,12 +2207,15 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return 0;
 	}
 
-	inst->hosts_by_ether = fr_hash_table_create(inst, host_ether_hash, host_ether_cmp, NULL);
-	if (!inst->hosts_by_ether) return -1;
-
-	inst->hosts_by_uid = fr_hash_table_create(inst, host_uid_hash, host_uid_cmp, NULL);
-	if (!inst->hosts_by_uid) return -1;
-
+	/*
+	 *	Now that all of the sections have their options,
+	 *	pre-merge the options for each host and subnet.
+	 */
+	if ((fr_hash_table_walk(inst->hosts_by_ether, merge_host_options, NULL) < 0) ||
+	    (fr_trie_walk(inst->subnets, NULL, merge_subnet_options) < 0)) {
+		cf_log_err(conf, "Failed merging options: %s", fr_strerror());
+		return -1;
+	}
 
 	return 0;
 }
@@ -2246,7 +2239,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(module_ctx_t const *mctx, REQU
 	rlm_isc_dhcp_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_isc_dhcp_t);
 	int			rcode;
 
-	rcode = apply(inst, request, inst->head);
+	rcode = apply(inst, request);
 	if (rcode < 0) return RLM_MODULE_FAIL;
 	if (rcode == 0) return RLM_MODULE_NOOP;
 
@@ -74,12 +74,19 @@ static int json_xlat_instantiate(void *xlat_inst, UNUSED xlat_exp_t const *exp,
 typedef struct rlm_json_jpath_cache rlm_json_jpath_cache_t;
 struct rlm_json_jpath_cache {
 	fr_jpath_node_t		*jpath;		//!< First node in jpath expression.
+	int			batch_idx;	//!< Where the results for this jpath are written
+						///< by #fr_jpath_batch_evaluate, or -1 if the jpath
+						///< is evaluated separately.
+	fr_jpath_batch_t	*batch;		//!< All the literal jpaths in the map compiled
+						///< together.  Only set in the first cache entry.
 	rlm_json_jpath_cache_t	*next;		//!< Next jpath cache entry.
 };
 
 typedef struct {
 	fr_jpath_node_t const	*jpath;
 	json_object		*root;
+	fr_value_box_t		*values;	//!< Values already produced by a batch evaluation.
+	bool			evaluated;	//!< Whether values is the result for this jpath.
 } rlm_json_jpath_to_eval_t;
 
 /** Ensure contents are quoted correctly for a JSON document
@@ -368,6 +375,24 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 			continue;
 		}
 
+		/*
+		 *	Compile the jpath into the batch, so all of
+		 *	the literal jpaths are evaluated in one pass
+		 *	over the document.  We need to know the type
+		 *	of the attribute to do this.
+		 */
+		cache->batch_idx = -1;
+		if (tmpl_is_attr(map->lhs)) {
+			if (!cache_inst->batch) MEM(cache_inst->batch = fr_jpath_batch_alloc(cache_inst));
+
+			cache->batch_idx = fr_jpath_batch_add(cache_inst->batch, cache->jpath,
+							      tmpl_da(map->lhs)->type, tmpl_da(map->lhs));
+			if (cache->batch_idx < 0) {
+				cf_log_perr(cp, "Failed compiling jpath");
+				return -1;
+			}
+		}
+
 		/*
 		 *	Slightly weird... This is here because our first
 		 *	list member was pre-allocated and passed to the
@@ -404,13 +429,18 @@ static int _json_map_proc_get_value(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *
 
 	*out = NULL;
 
-	ret = fr_jpath_evaluate_leaf(request, &head, tmpl_da(map->lhs)->type, tmpl_da(map->lhs),
-			     	     to_eval->root, to_eval->jpath);
-	if (ret < 0) {
-		RPEDEBUG("Failed evaluating jpath");
-		return -1;
+	if (to_eval->evaluated) {
+		head = to_eval->values;
+		if (!head) return 0;
+	} else {
+		ret = fr_jpath_evaluate_leaf(request, &head, tmpl_da(map->lhs)->type, tmpl_da(map->lhs),
+					     to_eval->root, to_eval->jpath);
+		if (ret < 0) {
+			RPEDEBUG("Failed evaluating jpath");
+			return -1;
+		}
+		if (ret == 0) return 0;
 	}
-	if (ret == 0) return 0;
 	fr_assert(head);
 
 	for (fr_cursor_init(&cursor, out), value = head;
@@ -450,10 +480,13 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 	rlm_json_jpath_cache_t		*cache = proc_inst;
 	vp_map_t const			*map;
 
-	rlm_json_jpath_to_eval_t	to_eval;
+	rlm_json_jpath_to_eval_t	to_eval = { .evaluated = false };
 
 	char const			*json_str = NULL;
 
+	TALLOC_CTX			*batch_ctx = NULL;
+	fr_value_box_t			**batch_values = NULL;
+
 	if (!*json) {
 		REDEBUG("JSON map input cannot be (null)");
 		return RLM_MODULE_FAIL;
@@ -478,6 +511,22 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 		goto finish;
 	}
 
+	/*
+	 *	Evaluate all the literal jpaths in a single
+	 *	pass, the maps below then pick up their
+	 *	results.
+	 */
+	if (cache->batch) {
+		MEM(batch_ctx = talloc_new(request));
+		MEM(batch_values = talloc_array(batch_ctx, fr_value_box_t *, fr_jpath_batch_count(cache->batch)));
+
+		if (fr_jpath_batch_evaluate(batch_ctx, batch_values, cache->batch, to_eval.root) < 0) {
+			RPEDEBUG("Failed evaluating jpath");
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+	}
+
 	for (map = maps; map; map = map->next) {
 		switch (map->rhs->type) {
 		/*
@@ -486,6 +535,8 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 		case TMPL_TYPE_UNPARSED:
 		case TMPL_TYPE_DATA:
 			to_eval.jpath = cache->jpath;
+			to_eval.evaluated = (cache->batch_idx >= 0);
+			to_eval.values = to_eval.evaluated ? batch_values[cache->batch_idx] : NULL;
 
 			if (map_to_request(request, map, _json_map_proc_get_value, &to_eval) < 0) {
 				rcode = RLM_MODULE_FAIL;
@@ -516,6 +567,7 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 				goto finish;
 			}
 			to_eval.jpath = node;
+			to_eval.evaluated = false;
 
 			if (map_to_request(request, map, _json_map_proc_get_value, &to_eval) < 0) {
 				talloc_free(node);
@@ -531,6 +583,7 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 
 
 finish:
+	talloc_free(batch_ctx);
 	json_object_put(to_eval.root);
 	json_tokener_free(tok);
 
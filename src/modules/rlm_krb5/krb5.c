@@ -44,27 +44,22 @@ static void _krb5_logging_free(void *arg)
 	talloc_free(arg);
 }
 
-char const *rlm_krb5_error(rlm_krb5_t const *inst, krb5_context context, krb5_error_code code)
+/** Write the message for a krb5 error code to a caller supplied buffer
+ *
+ * Does not allocate talloc memory, so may be called from an offload thread.
+ *
+ * @param[out] out	Where to write the message.
+ * @param[in] outlen	Length of out.
+ * @param[in] context	the error occurred in.  May be NULL.
+ * @param[in] code	returned by libkrb5.
+ */
+void rlm_krb5_error_copy(char *out, size_t outlen, krb5_context context, krb5_error_code code)
 {
 	char const *msg;
-	char *buffer;
-
-	if (!fr_cond_assert(inst)) return NULL;
-
-	buffer = krb5_error_buffer;
-	if (!buffer) {
-		buffer = talloc_array(NULL, char, KRB5_STRERROR_BUFSIZE);
-		if (!buffer) {
-			ERROR("Failed allocating memory for krb5 error buffer");
-			return NULL;
-		}
-
-		fr_thread_local_set_destructor(krb5_error_buffer, _krb5_logging_free, buffer);
-	}
 
 	msg = krb5_get_error_message(context, code);
 	if (msg) {
-		strlcpy(buffer, msg, KRB5_STRERROR_BUFSIZE);
+		strlcpy(out, msg, outlen);
 #  ifdef HAVE_KRB5_FREE_ERROR_MESSAGE
 		krb5_free_error_message(context, msg);
 #  elif defined(HAVE_KRB5_FREE_ERROR_STRING)
@@ -78,9 +73,29 @@ char const *rlm_krb5_error(rlm_krb5_t const *inst, krb5_context context, krb5_er
 #    error "No way to free error strings, missing krb5_free_error_message() and krb5_free_error_string()"
 #  endif
 	} else {
-		strlcpy(buffer, "Unknown error", KRB5_STRERROR_BUFSIZE);
+		strlcpy(out, "Unknown error", outlen);
+	}
+}
+
+char const *rlm_krb5_error(rlm_krb5_t const *inst, krb5_context context, krb5_error_code code)
+{
+	char *buffer;
+
+	if (!fr_cond_assert(inst)) return NULL;
+
+	buffer = krb5_error_buffer;
+	if (!buffer) {
+		buffer = talloc_array(NULL, char, KRB5_STRERROR_BUFSIZE);
+		if (!buffer) {
+			ERROR("Failed allocating memory for krb5 error buffer");
+			return NULL;
+		}
+
+		fr_thread_local_set_destructor(krb5_error_buffer, _krb5_logging_free, buffer);
 	}
 
+	rlm_krb5_error_copy(buffer, KRB5_STRERROR_BUFSIZE, context, code);
+
 	return buffer;
 }
 #endif
@@ -93,22 +108,82 @@ char const *rlm_krb5_error(rlm_krb5_t const *inst, krb5_context context, krb5_er
  * @return 0 (always indicates success).
  */
 static int _mod_conn_free(rlm_krb5_handle_t *conn) {
-	krb5_free_context(conn->context);
-
 	if (conn->keytab) krb5_kt_close(conn->context, conn->keytab);
 
 #ifdef HEIMDAL_KRB5
 	if (conn->ccache) krb5_cc_destroy(conn->context, conn->ccache);
 #endif
 
+	krb5_free_context(conn->context);
+
+	return 0;
+}
+
+/** Copy a keytab into a memory keytab owned by the handle
+ *
+ * Avoids libkrb5 re-opening and re-reading the keytab file for
+ * every credential verification.
+ *
+ * @param[in] inst	of rlm_krb5.
+ * @param[in] conn	to replace the keytab of.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int krb5_keytab_cache(rlm_krb5_t const *inst, rlm_krb5_handle_t *conn)
+{
+	krb5_error_code		ret;
+	krb5_keytab		mem;
+	krb5_kt_cursor		cursor;
+	krb5_keytab_entry	entry;
+	char			name[64];
+	unsigned int		count = 0;
+
+	snprintf(name, sizeof(name), "MEMORY:rlm_krb5_%p", conn);
+	ret = krb5_kt_resolve(conn->context, name, &mem);
+	if (ret) {
+		ERROR("Creating memory keytab failed: %s", rlm_krb5_error(inst, conn->context, ret));
+		return -1;
+	}
+
+	ret = krb5_kt_start_seq_get(conn->context, conn->keytab, &cursor);
+	if (ret) {
+		ERROR("Reading keytab failed: %s", rlm_krb5_error(inst, conn->context, ret));
+	error:
+		krb5_kt_close(conn->context, mem);
+		return -1;
+	}
+
+	while ((ret = krb5_kt_next_entry(conn->context, conn->keytab, &entry, &cursor)) == 0) {
+		ret = krb5_kt_add_entry(conn->context, mem, &entry);
+		krb5_kt_free_entry(conn->context, &entry);
+		if (ret) {
+			ERROR("Copying keytab entry failed: %s", rlm_krb5_error(inst, conn->context, ret));
+			krb5_kt_end_seq_get(conn->context, conn->keytab, &cursor);
+			goto error;
+		}
+		count++;
+	}
+	krb5_kt_end_seq_get(conn->context, conn->keytab, &cursor);
+
+	if (ret != KRB5_KT_END) {
+		ERROR("Reading keytab failed: %s", rlm_krb5_error(inst, conn->context, ret));
+		goto error;
+	}
+
+	DEBUG3("Cached %u keytab entries", count);
+
+	krb5_kt_close(conn->context, conn->keytab);
+	conn->keytab = mem;
+
 	return 0;
 }
 
-/** Create and return a new connection
+/** Create and return a new handle
  *
- * libkrb5(s) can talk to the KDC over TCP. Were assuming something sane is implemented
- * by libkrb5 and that it does connection caching associated with contexts, so it's
- * worth using a connection pool to preserve connections when workers die.
+ * Handles are created per worker, and per offload thread, so a
+ * context is never used by more than one thread, and resolving
+ * the keytab is only done once per thread.
  */
 void *krb5_mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta_t timeout)
 {
@@ -134,12 +209,14 @@ void *krb5_mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta
 		goto cleanup;
 	}
 
+	if (inst->cache_keytab && (krb5_keytab_cache(inst, conn) < 0)) goto cleanup;
+
 #ifdef HEIMDAL_KRB5
 	ret = krb5_cc_new_unique(conn->context, "MEMORY", NULL, &conn->ccache);
 	if (ret) {
 		ERROR("Credential cache creation failed: %s", rlm_krb5_error(inst, conn->context, ret));
 
-		return NULL;
+		goto cleanup;
 	}
 
 	krb5_verify_opt_init(&conn->options);
@@ -149,8 +226,6 @@ void *krb5_mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta
 	krb5_verify_opt_set_secure(&conn->options, true);
 
 	if (inst->service) krb5_verify_opt_set_service(&conn->options, inst->service);
-#else
-	krb5_verify_init_creds_opt_set_ap_req_nofail(inst->vic_options, true);
 #endif
 	return conn;
 
@@ -29,13 +29,17 @@ RCSIDH(krb5_h, "$Id$")
 USES_APPLE_DEPRECATED_API
 #include <krb5.h>
 
-#ifdef KRB5_IS_THREAD_SAFE
-#  include <freeradius-devel/server/pool.h>
-#endif
+#include <freeradius-devel/server/offload.h>
+#include <freeradius-devel/util/event.h>
 
+/** A krb5 context, and everything resolved using it
+ *
+ * Handles are never shared, each worker and each offload thread
+ * has its own.
+ */
 typedef struct {
 	krb5_context	context;
-	krb5_keytab	keytab;
+	krb5_keytab	keytab;		//!< The configured keytab, or an in memory copy of it.
 
 #ifdef HEIMDAL_KRB5
 	krb5_ccache	ccache;
@@ -48,10 +52,8 @@ typedef struct {
  * Holds the configuration and preparsed data for a instance of rlm_krb5.
  */
 typedef struct {
-#ifdef KRB5_IS_THREAD_SAFE
-	fr_pool_t	*pool;		//!< Connection pool instance.
-#else
-	rlm_krb5_handle_t	*conn;
+#ifndef KRB5_IS_THREAD_SAFE
+	rlm_krb5_handle_t	*conn;		//!< Handle shared by all workers.
 #endif
 
 	char const		*name;		//!< This module's instance name.
@@ -63,7 +65,12 @@ typedef struct {
 						//!< service_princ, or NULL.
 	char			*service;	//!< The service component of service_princ, or NULL.
 
-	krb5_context		context;	//!< The kerberos context (cloned once per request).
+	bool			cache_keytab;	//!< Copy the keytab into memory when a handle is created.
+
+	fr_offload_conf_t	offload_conf;	//!< Threads talking to the KDC.
+	fr_offload_t		*offload;	//!< Offload pool, NULL if disabled.
+
+	krb5_context		context;	//!< The kerberos context used during instantiation.
 
 #ifndef HEIMDAL_KRB5
 	krb5_get_init_creds_opt		*gic_options;	//!< Options to pass to the get_initial_credentials
@@ -73,9 +80,22 @@ typedef struct {
 
 	krb5_principal server;			//!< A structure representing the parsed
 						//!< service_princ.
+
+	char			*server_name;	//!< server, as a string.
+
+	bool			direct_service_ticket;	//!< Request a ticket for the service principal
+							///< in the AS exchange, instead of a TGT.
 #endif
 } rlm_krb5_t;
 
+/** Per-worker state
+ *
+ */
+typedef struct {
+	rlm_krb5_handle_t	*conn;		//!< Handle used when authenticating inline.
+	fr_offload_thread_t	*offload;	//!< Where completed jobs are returned, NULL if disabled.
+} rlm_krb5_thread_t;
+
 /*
  *	MIT Kerberos uses comm_err, so the macro just expands to a call
  *	to error_message.
@@ -87,9 +107,11 @@ typedef struct {
 #    include <com_err.h>
 #  endif
 #  define rlm_krb5_error(_x, _y, _z) error_message(_z)
+#  define rlm_krb5_error_copy(_out, _outlen, _y, _z) strlcpy(_out, error_message(_z), _outlen)
 #  define KRB5_UNUSED UNUSED
 #else
 char const *rlm_krb5_error(rlm_krb5_t const *inst, krb5_context context, krb5_error_code code);
+void rlm_krb5_error_copy(char *out, size_t outlen, krb5_context context, krb5_error_code code);
 # define KRB5_UNUSED
 #endif
 
@@ -31,12 +31,18 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 #include "krb5.h"
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("keytab", FR_TYPE_STRING, rlm_krb5_t, keytabname) },
 	{ FR_CONF_OFFSET("service_principal", FR_TYPE_STRING, rlm_krb5_t, service_princ) },
+	{ FR_CONF_OFFSET("cache_keytab", FR_TYPE_BOOL, rlm_krb5_t, cache_keytab), .dflt = "yes" },
+#ifndef HEIMDAL_KRB5
+	{ FR_CONF_OFFSET("direct_service_ticket", FR_TYPE_BOOL, rlm_krb5_t, direct_service_ticket), .dflt = "no" },
+#endif
+	{ FR_CONF_OFFSET("offload", FR_TYPE_SUBSECTION, rlm_krb5_t, offload_conf), .subcs = (void const *) fr_offload_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -58,24 +64,55 @@ fr_dict_attr_autoload_t rlm_krb5_dict_attr[] = {
 	{ NULL }
 };
 
+/** An authentication performed by an offload thread
+ *
+ * Everything the offload thread needs is copied into the job, so it
+ * never touches the request, and never allocates or frees talloc memory.
+ */
+typedef struct {
+	fr_offload_job_t	job;		//!< Must be first.
+
+	char			*username;	//!< Copy of the User-Name.
+	char			*password;	//!< Copy of the User-Password.
+
+	bool			parsed;		//!< User-Name was parsed as a principal.
+	char			principal[256];	//!< Client principal, for logging.
+	krb5_error_code		ret;		//!< Result of the last libkrb5 call.
+	char			error[256];	//!< Message for ret.
+} krb5_job_t;
+
+static void krb5_offload_run(void *job, void *thread_ctx, void *uctx);
+
+/** Give each offload thread its own handle
+ *
+ */
+static void *krb5_offload_thread_ctx_alloc(TALLOC_CTX *ctx, void *uctx)
+{
+	return krb5_mod_conn_create(ctx, uctx, 0);
+}
+
 static int mod_detach(void *instance)
 {
 	rlm_krb5_t *inst = instance;
 
+	/*
+	 *	Stop the offload threads before freeing
+	 *	anything they use.
+	 */
+	TALLOC_FREE(inst->offload);
+
 #ifndef HEIMDAL_KRB5
 	talloc_free(inst->vic_options);
 
 	if (inst->gic_options) krb5_get_init_creds_opt_free(inst->context, inst->gic_options);
 	if (inst->server) krb5_free_principal(inst->context, inst->server);
+	if (inst->server_name) krb5_free_unparsed_name(inst->context, inst->server_name);
 #endif
 
 	/* Don't free hostname, it's just a pointer into service_princ */
 	talloc_free(inst->service);
 
 	if (inst->context) krb5_free_context(inst->context);
-#ifdef KRB5_IS_THREAD_SAFE
-	fr_pool_free(inst->pool);
-#endif
 
 	return 0;
 }
@@ -87,7 +124,6 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 #ifndef HEIMDAL_KRB5
 	krb5_keytab keytab;
 	char keytab_name[200];
-	char *princ_name;
 #endif
 
 #ifdef HEIMDAL_KRB5
@@ -127,6 +163,13 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
 
+#ifndef KRB5_IS_THREAD_SAFE
+	if (inst->offload_conf.threads) {
+		WARN("Ignoring offload.threads, libkrb5 is not threadsafe");
+		inst->offload_conf.threads = 0;
+	}
+#endif
+
 	ret = krb5_init_context(&inst->context);
 	if (ret) {
 		ERROR("Context initialisation failed: %s", rlm_krb5_error(inst, NULL, ret));
@@ -171,7 +214,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
-	ret = krb5_unparse_name(inst->context, inst->server, &princ_name);
+	ret = krb5_unparse_name(inst->context, inst->server, &inst->server_name);
 	if (ret) {
 		/* Uh? */
 		ERROR("Failed constructing service principal string: %s", rlm_krb5_error(inst, inst->context, ret));
@@ -182,8 +225,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	/*
 	 *	Not necessarily the same as the config item
 	 */
-	DEBUG("Using service principal \"%s\"", princ_name);
-	krb5_free_unparsed_name(inst->context, princ_name);
+	DEBUG("Using service principal \"%s\"", inst->server_name);
 
 	/*
 	 *	Setup options for getting credentials and verifying them
@@ -220,156 +262,95 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	MEM(inst->vic_options = talloc_zero(inst, krb5_verify_init_creds_opt));
 	krb5_verify_init_creds_opt_init(inst->vic_options);
+	krb5_verify_init_creds_opt_set_ap_req_nofail(inst->vic_options, true);
 #endif
 
-#ifdef KRB5_IS_THREAD_SAFE
 	/*
-	 *	Initialize the socket pool.
+	 *	With a threadsafe libkrb5 every worker creates
+	 *	its own handle in mod_thread_instantiate.
 	 */
-	inst->pool = module_connection_pool_init(conf, inst, krb5_mod_conn_create, NULL, NULL, NULL, NULL);
-	if (!inst->pool) return -1;
-#else
+#ifndef KRB5_IS_THREAD_SAFE
 	inst->conn = krb5_mod_conn_create(inst, inst, 0);
 	if (!inst->conn) return -1;
 #endif
-	return 0;
-}
 
-/** Common function for transforming a User-Name string into a principal.
- *
- * @param[out] client Where to write the client principal.
- * @param[in] inst of rlm_krb5.
- * @param[in] request Current request.
- * @param[in] context Kerberos context.
- */
-static rlm_rcode_t krb5_parse_user(krb5_principal *client, KRB5_UNUSED rlm_krb5_t const *inst, REQUEST *request,
-				   krb5_context context)
-{
-	krb5_error_code ret;
-	char *princ_name;
-	VALUE_PAIR *username;
+	if (!inst->offload_conf.threads) return 0;
 
-	username = fr_pair_find_by_da(request->packet->vps, attr_user_name, TAG_ANY);
+	inst->offload = fr_offload_alloc(inst, conf, &inst->offload_conf,
+					 krb5_offload_run, krb5_offload_thread_ctx_alloc, inst);
+	if (!inst->offload) return -1;
 
-	/*
-	 *	We can only authenticate user requests which HAVE
-	 *	a User-Name attribute.
-	 */
-	if (!username) {
-		REDEBUG("Attribute \"User-Name\" is required for authentication");
-		return RLM_MODULE_INVALID;
-	}
-
-	ret = krb5_parse_name(context, username->vp_strvalue, client);
-	if (ret) {
-		REDEBUG("Failed parsing username as principal: %s", rlm_krb5_error(inst, context, ret));
-
-		return RLM_MODULE_FAIL;
-	}
-
-	krb5_unparse_name(context, *client, &princ_name);
-	RDEBUG2("Using client principal \"%s\"", princ_name);
-#ifdef HEIMDAL_KRB5
-	free(princ_name);
-#else
-	krb5_free_unparsed_name(context, princ_name);
-#endif
-	return RLM_MODULE_OK;
+	return 0;
 }
 
-/** Log error message and return appropriate rcode
+/** Translate kerberos error codes into return codes
  *
- * Translate kerberos error codes into return codes.
- * @param inst of rlm_krb5.
  * @param request Current request.
  * @param ret code from kerberos.
- * @param conn used in the last operation.
+ * @param error message for ret.
  */
-static rlm_rcode_t krb5_process_error(rlm_krb5_t const *inst, REQUEST *request, rlm_krb5_handle_t *conn, int ret)
+static rlm_rcode_t krb5_process_error(REQUEST *request, krb5_error_code ret, char const *error)
 {
 	fr_assert(ret != 0);
 
-	if (!fr_cond_assert(inst)) return RLM_MODULE_FAIL;
-	if (!fr_cond_assert(conn)) return RLM_MODULE_FAIL;	/* Silences warnings */
-
 	switch (ret) {
 	case KRB5_LIBOS_BADPWDMATCH:
 	case KRB5KRB_AP_ERR_BAD_INTEGRITY:
-		REDEBUG("Provided password was incorrect (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Provided password was incorrect (%i): %s", ret, error);
 		return RLM_MODULE_REJECT;
 
 	case KRB5KDC_ERR_KEY_EXP:
 	case KRB5KDC_ERR_CLIENT_REVOKED:
 	case KRB5KDC_ERR_SERVICE_REVOKED:
-		REDEBUG("Account has been locked out (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Account has been locked out (%i): %s", ret, error);
 		return RLM_MODULE_DISALLOW;
 
 	case KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN:
-		RDEBUG2("User not found (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		RDEBUG2("User not found (%i): %s", ret, error);
 		return RLM_MODULE_NOTFOUND;
 
 	default:
-		REDEBUG("Error verifying credentials (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Error verifying credentials (%i): %s", ret, error);
 		return RLM_MODULE_FAIL;
 	}
 }
 
-#ifdef HEIMDAL_KRB5
-
-/*
- *	Validate user/pass (Heimdal)
+/** Convert the User-Name into a principal, and verify the password with the KDC
+ *
+ * Called from an offload thread, or inline by the worker, with a
+ * handle which is only used by the calling thread.  Does not log.
+ *
+ * @param[in] inst	of rlm_krb5.
+ * @param[in] conn	to use for the libkrb5 calls.
+ * @param[in] job	to process.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(module_ctx_t const *mctx, REQUEST *request)
+static void krb5_job_run(rlm_krb5_t const *inst, rlm_krb5_handle_t *conn, krb5_job_t *job)
 {
-	rlm_krb5_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_krb5_t);
-	rlm_rcode_t		rcode;
-	krb5_error_code		ret;
-	rlm_krb5_handle_t	*conn;
-	krb5_principal		client = NULL;
-	VALUE_PAIR		*password;
-
-	password = fr_pair_find_by_da(request->packet->vps, attr_user_password, TAG_ANY);
-
-	if (!password) {
-		REDEBUG("Attribute \"User-Password\" is required for authentication");
-		return RLM_MODULE_INVALID;
-	}
+	krb5_principal		client = NULL;	/* actually a pointer value */
+	char			*princ_name;
+#ifndef HEIMDAL_KRB5
+	krb5_creds		init_creds;
+#endif
 
-	/*
-	 *	Make sure the supplied password isn't empty
-	 */
-	if (password->vp_length == 0) {
-		REDEBUG("User-Password must not be empty");
-		return RLM_MODULE_INVALID;
-	}
+	job->ret = krb5_parse_name(conn->context, job->username, &client);
+	if (job->ret) goto error;
+	job->parsed = true;
 
-	/*
-	 *	Log the password
-	 */
-	if (RDEBUG_ENABLED3) {
-		RDEBUG("Login attempt with password \"%pV\"", &password->data);
-	} else {
-		RDEBUG2("Login attempt with password");
+	if (krb5_unparse_name(conn->context, client, &princ_name) == 0) {
+		strlcpy(job->principal, princ_name, sizeof(job->principal));
+#ifdef HEIMDAL_KRB5
+		free(princ_name);
+#else
+		krb5_free_unparsed_name(conn->context, princ_name);
+#endif
 	}
 
-#  ifdef KRB5_IS_THREAD_SAFE
-	conn = fr_pool_connection_get(inst->pool, request);
-	if (!conn) return RLM_MODULE_FAIL;
-#  else
-	conn = inst->conn;
-#  endif
-
-	rcode = krb5_parse_user(&client, inst, request, conn->context);
-	if (rcode != RLM_MODULE_OK) goto cleanup;
-
+#ifdef HEIMDAL_KRB5
 	/*
 	 *	Verify the user, using the options we set in instantiate
 	 */
-	ret = krb5_verify_user_opt(conn->context, client, password->vp_strvalue, &conn->options);
-	if (ret) {
-		rcode = krb5_process_error(inst, request, conn, ret);
-		goto cleanup;
-	}
+	job->ret = krb5_verify_user_opt(conn->context, client, job->password, &conn->options);
+	if (job->ret) goto error;
 
 	/*
 	 *	krb5_verify_user_opt adds the credentials to the ccache
@@ -384,6 +365,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(module_ctx_t const *mctx, R
 	{
 		krb5_cc_cursor cursor;
 		krb5_creds cred;
+		krb5_error_code ret;
 
 		krb5_cc_start_seq_get(conn->context, conn->ccache, &cursor);
 		for (ret = krb5_cc_next_cred(conn->context, conn->ccache, &cursor, &cred);
@@ -393,35 +375,100 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(module_ctx_t const *mctx, R
 		}
 		krb5_cc_end_seq_get(conn->context, conn->ccache, &cursor);
 	}
+#else
+	/*
+	 *	Zero out local storage
+	 */
+	memset(&init_creds, 0, sizeof(init_creds));
 
-cleanup:
-	if (client) {
-		krb5_free_principal(conn->context, client);
+	/*
+	 * 	Retrieve the TGT from the TGS/KDC and check we can decrypt it.
+	 *
+	 *	If direct_service_ticket is set, we ask for a ticket
+	 *	for the service principal instead.  That's verified
+	 *	against the keytab without another trip to the KDC.
+	 */
+	job->ret = krb5_get_init_creds_password(conn->context, &init_creds, client, job->password,
+						NULL, NULL, 0,
+						inst->direct_service_ticket ? inst->server_name : NULL,
+						inst->gic_options);
+	if (!job->ret) {
+		job->ret = krb5_verify_init_creds(conn->context, &init_creds, inst->server,
+						  conn->keytab, NULL, inst->vic_options);
 	}
+	krb5_free_cred_contents(conn->context, &init_creds);
+#endif
+
+error:
+	if (job->ret) rlm_krb5_error_copy(job->error, sizeof(job->error), conn->context, job->ret);
+	if (client) krb5_free_principal(conn->context, client);
+}
+
+/** Verify credentials in an offload thread, using the thread's own handle
+ *
+ */
+static void krb5_offload_run(void *job, void *thread_ctx, void *uctx)
+{
+	krb5_job_run(uctx, thread_ctx, job);
+}
+
+/** Log the result of a job, and convert it into a module return code
+ *
+ */
+static rlm_rcode_t krb5_job_rcode(REQUEST *request, krb5_job_t const *job)
+{
+	if (!job->parsed) {
+		REDEBUG("Failed parsing username as principal: %s", job->error);
+		return RLM_MODULE_FAIL;
+	}
+
+	RDEBUG2("Using client principal \"%s\"", job->principal);
+
+	if (job->ret) return krb5_process_error(request, job->ret, job->error);
+
+	return RLM_MODULE_OK;
+}
+
+static rlm_rcode_t krb5_offload_resume(UNUSED module_ctx_t const *mctx, REQUEST *request, void *rctx)
+{
+	krb5_job_t	*job = talloc_get_type_abort(rctx, krb5_job_t);
+	rlm_rcode_t	rcode;
+
+	rcode = krb5_job_rcode(request, job);
+	talloc_free(job);
 
-#  ifdef KRB5_IS_THREAD_SAFE
-	fr_pool_connection_release(inst->pool, request, conn);
-#  endif
 	return rcode;
 }
 
-#else  /* HEIMDAL_KRB5 */
+static void krb5_offload_signal(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request, void *rctx,
+				fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	fr_offload_cancel(talloc_get_type_abort(rctx, krb5_job_t));
+}
 
 /*
- *  Validate userid/passwd (MIT)
+ *	Validate user/pass
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(module_ctx_t const *mctx, REQUEST *request)
 {
 	rlm_krb5_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_krb5_t);
+	rlm_krb5_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_krb5_thread_t);
 	rlm_rcode_t		rcode;
-	krb5_error_code		ret;
+	VALUE_PAIR		*username, *password;
+	krb5_job_t		*job;
 
-	rlm_krb5_handle_t	*conn;
+	username = fr_pair_find_by_da(request->packet->vps, attr_user_name, TAG_ANY);
 
-	krb5_principal		client = NULL;	/* actually a pointer value */
-	krb5_creds		init_creds;
-	char			*nonconst_password;		/* compiler warnings */
-	VALUE_PAIR		*password;
+	/*
+	 *	We can only authenticate user requests which HAVE
+	 *	a User-Name attribute.
+	 */
+	if (!username) {
+		REDEBUG("Attribute \"User-Name\" is required for authentication");
+		return RLM_MODULE_INVALID;
+	}
 
 	password = fr_pair_find_by_da(request->packet->vps, attr_user_password, TAG_ANY);
 
@@ -447,52 +494,58 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(module_ctx_t const *mctx, R
 		RDEBUG2("Login attempt with password");
 	}
 
-#  ifdef KRB5_IS_THREAD_SAFE
-	conn = fr_pool_connection_get(inst->pool, request);
-	if (!conn) return RLM_MODULE_FAIL;
-#  else
-	conn = inst->conn;
-#  endif
+	MEM(job = talloc_zero(NULL, krb5_job_t));
+	MEM(job->username = talloc_bstrndup(job, username->vp_strvalue, username->vp_length));
+	MEM(job->password = talloc_bstrndup(job, password->vp_strvalue, password->vp_length));
 
 	/*
-	 *	Zero out local storage
+	 *	If the pool is saturated, talking to the KDC inline
+	 *	is better than delaying the request further.
 	 */
-	memset(&init_creds, 0, sizeof(init_creds));
+	if (t->offload && (fr_offload_submit(t->offload, request, job) == 0)) {
+		return unlang_module_yield(request, krb5_offload_resume, krb5_offload_signal, job);
+	}
 
-	/*
-	 *	Check we have all the required VPs, and convert the username
-	 *	into a principal.
-	 */
-	rcode = krb5_parse_user(&client, inst, request, conn->context);
-	if (rcode != RLM_MODULE_OK) goto cleanup;
+	krb5_job_run(inst, t->conn, job);
+	rcode = krb5_job_rcode(request, job);
+	talloc_free(job);
+
+	return rcode;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_krb5_t		*inst = talloc_get_type_abort(instance, rlm_krb5_t);
+	rlm_krb5_thread_t	*t = talloc_get_type_abort(thread, rlm_krb5_thread_t);
 
 	/*
-	 * 	Retrieve the TGT from the TGS/KDC and check we can decrypt it.
+	 *	Each worker gets its own context and keytab,
+	 *	so no locking is needed to use them.
 	 */
-	memcpy(&nonconst_password, &password->vp_strvalue, sizeof(nonconst_password));
-	RDEBUG2("Retrieving and decrypting TGT");
-	ret = krb5_get_init_creds_password(conn->context, &init_creds, client, nonconst_password,
-					   NULL, NULL, 0, NULL, inst->gic_options);
-	if (ret) {
-		rcode = krb5_process_error(inst, request, conn, ret);
-		goto cleanup;
-	}
+#ifdef KRB5_IS_THREAD_SAFE
+	t->conn = krb5_mod_conn_create(t, inst, 0);
+	if (!t->conn) return -1;
+#else
+	t->conn = inst->conn;
+#endif
 
-	RDEBUG2("Attempting to authenticate against service principal");
-	ret = krb5_verify_init_creds(conn->context, &init_creds, inst->server, conn->keytab, NULL, inst->vic_options);
-	if (ret) rcode = krb5_process_error(inst, request, conn, ret);
+	if (!inst->offload) return 0;
 
-cleanup:
-	if (client) krb5_free_principal(conn->context, client);
-	krb5_free_cred_contents(conn->context, &init_creds);
+	t->offload = fr_offload_thread_alloc(t, inst->offload, el);
+	if (!t->offload) return -1;
 
-#  ifdef KRB5_IS_THREAD_SAFE
-	fr_pool_connection_release(inst->pool, request, conn);
-#  endif
-	return rcode;
+	return 0;
 }
 
-#endif /* MIT_KRB5 */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_krb5_thread_t	*t = talloc_get_type_abort(thread, rlm_krb5_thread_t);
+
+	TALLOC_FREE(t->offload);
+
+	return 0;
+}
 
 extern module_t rlm_krb5;
 module_t rlm_krb5 = {
@@ -505,6 +558,9 @@ module_t rlm_krb5 = {
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_krb5_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate
 	},
@@ -30,6 +30,7 @@ USES_APPLE_DEPRECATED_API
 
 #include <freeradius-devel/util/debug.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #define LOG_PREFIX "rlm_ldap (%s) - "
 #define LOG_PREFIX_ARGS inst->name
@@ -855,3 +856,210 @@ rlm_rcode_t rlm_ldap_check_cached(rlm_ldap_t const *inst, REQUEST *request, VALU
 
 	return RLM_MODULE_NOTFOUND;
 }
+
+/** Results of dynamic membership checks, shared by all threads
+ *
+ */
+struct rlm_ldap_group_cache_s {
+	rbtree_t		*tree;		//!< Results, keyed by user DN and group.
+	fr_dlist_head_t		lru;		//!< Results, most recently used first.
+	pthread_mutex_t		mutex;		//!< Protects the cache.
+};
+
+/** The result of checking whether a user is a member of a group
+ *
+ */
+typedef struct {
+	char const		*user_dn;	//!< The user object.
+	char const		*group;		//!< Group name or DN, as checked.
+	bool			member;		//!< Whether the user was found in the group.
+	fr_time_t		expires;	//!< When the result should be discarded.
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+} rlm_ldap_group_cache_entry_t;
+
+static int group_cache_cmp(void const *one, void const *two)
+{
+	rlm_ldap_group_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcasecmp(a->user_dn, b->user_dn);
+	if (ret == 0) ret = strcmp(a->group, b->group);
+
+	return ret;
+}
+
+static int _group_cache_free(rlm_ldap_group_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Remove a result from the cache
+ *
+ * @note Must be called with the cache mutex held.
+ */
+static void group_cache_remove(rlm_ldap_group_cache_t *cache, rlm_ldap_group_cache_entry_t *e)
+{
+	rbtree_deletebydata(cache->tree, e);
+	fr_dlist_remove(&cache->lru, e);
+	talloc_free(e);
+}
+
+/** Allocate the membership cache, if one was configured
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int rlm_ldap_group_cache_init(rlm_ldap_t *inst)
+{
+	rlm_ldap_group_cache_t *cache;
+
+	if (!inst->group_cache_size) return 0;
+
+	MEM(cache = talloc_zero(inst, rlm_ldap_group_cache_t));
+	cache->tree = rbtree_alloc(cache, group_cache_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!cache->tree) {
+		talloc_free(cache);
+		return -1;
+	}
+	fr_dlist_init(&cache->lru, rlm_ldap_group_cache_entry_t, entry);
+
+	if (pthread_mutex_init(&cache->mutex, NULL) < 0) {
+		ERROR("Failed initialising group cache mutex: %s", fr_syserror(errno));
+		talloc_free(cache);
+		return -1;
+	}
+	talloc_set_destructor(cache, _group_cache_free);
+	inst->group_cache = cache;
+
+	return 0;
+}
+
+/** Look for the result of a previous membership check
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @param[in] user_dn	of the user object.
+ * @param[in] check	vp containing the group value (name or dn).
+ * @return
+ *	- RLM_MODULE_OK if the user is a member of the group.
+ *	- RLM_MODULE_NOTFOUND if the user is not a member of the group.
+ *	- RLM_MODULE_NOOP if there's no valid cached result.
+ */
+rlm_rcode_t rlm_ldap_group_cache_find(rlm_ldap_t const *inst, REQUEST *request,
+				      char const *user_dn, VALUE_PAIR const *check)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	rlm_ldap_group_cache_entry_t	find = { .user_dn = user_dn, .group = check->vp_strvalue }, *e;
+	rlm_rcode_t			rcode = RLM_MODULE_NOOP;
+
+	if (!cache) return RLM_MODULE_NOOP;
+
+	pthread_mutex_lock(&cache->mutex);
+	e = rbtree_finddata(cache->tree, &find);
+	if (e) {
+		if (e->expires <= fr_time()) {
+			group_cache_remove(cache, e);
+		} else {
+			fr_dlist_remove(&cache->lru, e);
+			fr_dlist_insert_head(&cache->lru, e);
+			rcode = e->member ? RLM_MODULE_OK : RLM_MODULE_NOTFOUND;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (rcode != RLM_MODULE_NOOP) {
+		RDEBUG2("User %s a member of \"%pV\" (cached)",
+			(rcode == RLM_MODULE_OK) ? "is" : "is not", &check->data);
+	}
+
+	return rcode;
+}
+
+/** Record the result of a membership check
+ *
+ * If the cache is full, the least recently used result is discarded.
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @param[in] user_dn	of the user object.
+ * @param[in] check	vp containing the group value (name or dn).
+ * @param[in] member	Whether the user is a member of the group.
+ */
+void rlm_ldap_group_cache_add(rlm_ldap_t const *inst, REQUEST *request,
+			      char const *user_dn, VALUE_PAIR const *check, bool member)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	rlm_ldap_group_cache_entry_t	find = { .user_dn = user_dn, .group = check->vp_strvalue }, *e;
+
+	if (!cache) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	e = rbtree_finddata(cache->tree, &find);
+	if (e) {
+		fr_dlist_remove(&cache->lru, e);
+	} else {
+		if (rbtree_num_elements(cache->tree) >= inst->group_cache_size) {
+			group_cache_remove(cache, fr_dlist_tail(&cache->lru));
+		}
+
+		MEM(e = talloc_zero(cache, rlm_ldap_group_cache_entry_t));
+		MEM(e->user_dn = talloc_typed_strdup(e, user_dn));
+		MEM(e->group = talloc_typed_strdup(e, check->vp_strvalue));
+		if (!rbtree_insert(cache->tree, e)) {
+			talloc_free(e);
+			pthread_mutex_unlock(&cache->mutex);
+			return;
+		}
+	}
+	e->member = member;
+	e->expires = fr_time() + inst->group_cache_lifetime;
+	fr_dlist_insert_head(&cache->lru, e);
+	pthread_mutex_unlock(&cache->mutex);
+
+	RDEBUG3("Cached membership result for \"%pV\"", &check->data);
+}
+
+/** Discard cached membership results
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] dn	of a user or group object which has changed.  Results for the user,
+ *			or for the group where it was checked by DN, are discarded.
+ *			If NULL, all results are discarded.
+ * @return The number of results discarded.
+ */
+uint32_t rlm_ldap_group_cache_flush(rlm_ldap_t const *inst, char const *dn)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	rlm_ldap_group_cache_entry_t	*e, *next;
+	uint32_t			count = 0;
+	char				*norm = NULL;
+
+	if (!cache) return 0;
+
+	/*
+	 *	Group DNs are normalised before they're checked,
+	 *	user DNs are as the directory returned them.
+	 */
+	if (dn) {
+		MEM(norm = talloc_typed_strdup(NULL, dn));
+		fr_ldap_util_normalise_dn(norm, dn);
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	for (e = fr_dlist_head(&cache->lru); e; e = next) {
+		next = fr_dlist_next(&cache->lru, e);
+
+		if (dn && (strcasecmp(e->user_dn, dn) != 0) && (strcasecmp(e->group, norm) != 0)) continue;
+
+		group_cache_remove(cache, e);
+		count++;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	talloc_free(norm);
+
+	return count;
+}
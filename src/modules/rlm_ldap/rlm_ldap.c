@@ -36,6 +36,7 @@ USES_APPLE_DEPRECATED_API
 #include "rlm_ldap.h"
 
 #include <freeradius-devel/server/map_proc.h>
+#include <freeradius-devel/unlang/base.h>
 
 static CONF_PARSER sasl_mech_dynamic[] = {
 	{ FR_CONF_OFFSET("mech", FR_TYPE_TMPL | FR_TYPE_NOT_EMPTY, fr_ldap_sasl_t_dynamic_t, mech) },
@@ -96,6 +97,11 @@ static CONF_PARSER user_config[] = {
 	{ FR_CONF_OFFSET("access_attribute", FR_TYPE_STRING, rlm_ldap_t, userobj_access_attr) },
 	{ FR_CONF_OFFSET("access_positive", FR_TYPE_BOOL, rlm_ldap_t, access_positive), .dflt = "yes" },
 
+	{ FR_CONF_OFFSET("replica", FR_TYPE_STRING, rlm_ldap_t, user_replica_name) },
+	{ FR_CONF_OFFSET("replica_key", FR_TYPE_TMPL, rlm_ldap_t, user_replica_key),
+	  .dflt = "%{%{Stripped-User-Name}:-%{User-Name}}", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("replica_max_age", FR_TYPE_TIME_DELTA, rlm_ldap_t, user_replica_max_age), .dflt = "0" },
+
 	/* Should be deprecated */
 	{ FR_CONF_OFFSET("sasl", FR_TYPE_SUBSECTION, rlm_ldap_t, user_sasl), .subcs = (void const *) sasl_mech_dynamic },
 	CONF_PARSER_TERMINATOR
@@ -117,6 +123,8 @@ static CONF_PARSER group_config[] = {
 	{ FR_CONF_OFFSET("cache_attribute", FR_TYPE_STRING, rlm_ldap_t, cache_attribute) },
 	{ FR_CONF_OFFSET("group_attribute", FR_TYPE_STRING, rlm_ldap_t, group_attribute) },
 	{ FR_CONF_OFFSET("allow_dangling_group_ref", FR_TYPE_BOOL, rlm_ldap_t, allow_dangling_group_refs), .dflt = "no" },
+	{ FR_CONF_OFFSET("membership_cache_size", FR_TYPE_UINT32, rlm_ldap_t, group_cache_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("membership_cache_lifetime", FR_TYPE_TIME_DELTA, rlm_ldap_t, group_cache_lifetime), .dflt = "300" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -197,6 +205,9 @@ static const CONF_PARSER module_config[] = {
 
 	{ FR_CONF_OFFSET("valuepair_attribute", FR_TYPE_STRING, rlm_ldap_t, valuepair_attr) },
 
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, rlm_ldap_t, async), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_ldap_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+
 #ifdef LDAP_CONTROL_X_SESSION_TRACKING
 	{ FR_CONF_OFFSET("session_tracking", FR_TYPE_BOOL, rlm_ldap_t, session_tracking), .dflt = "no" },
 #endif
@@ -282,6 +293,31 @@ static ssize_t ldap_unescape_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t out
 	return fr_ldap_unescape_func(request, *out, outlen, fmt, NULL);
 }
 
+/** Discard cached group membership results for a user or group object
+ *
+@verbatim
+%{<inst>_group_flush:[<dn>]}
+@endverbatim
+ *
+ * Intended to be called from a proto_ldap_sync virtual server with the DN
+ * of an object which changed, e.g. %{ldap_group_flush:%{LDAP-Sync-Entry-DN}}.
+ * With no DN, all results are discarded.
+ *
+ * @ingroup xlat_functions
+ */
+static ssize_t ldap_group_flush_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+				     void const *mod_inst, UNUSED void const *xlat_inst,
+				     REQUEST *request, char const *fmt)
+{
+	rlm_ldap_t const	*inst = mod_inst;
+	uint32_t		count;
+
+	count = rlm_ldap_group_cache_flush(inst, *fmt ? fmt : NULL);
+	RDEBUG2("Discarded %u cached group membership result(s)", count);
+
+	return snprintf(*out, outlen, "%u", count);
+}
+
 /** Expand an LDAP URL into a query, and return a string result from that query.
  *
  * @ingroup xlat_functions
@@ -337,7 +373,7 @@ static ssize_t ldap_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 
 	memcpy(&attrs, &ldap_url->lud_attrs, sizeof(attrs));
 
-	if (fr_ldap_parse_url_extensions(&server_ctrls[0], request, conn, ldap_url->lud_exts) < 0) goto free_socket;
+	if (fr_ldap_parse_url_extensions(&server_ctrls[0], request, conn->handle, ldap_url->lud_exts) < 0) goto free_socket;
 
 	status = fr_ldap_search(&result, request, &conn, ldap_url->lud_dn, ldap_url->lud_scope,
 				ldap_url->lud_filter, attrs, server_ctrls, NULL);
@@ -388,6 +424,227 @@ free_urldesc:
 	return len;
 }
 
+/** Wrapper around the module thread struct for the async xlat
+ *
+ */
+typedef struct {
+	rlm_ldap_t const	*inst;		//!< Instance of rlm_ldap.
+	rlm_ldap_thread_t	*t;		//!< rlm_ldap thread instance.
+} ldap_xlat_thread_inst_t;
+
+/** The state of an async xlat search
+ *
+ */
+typedef struct {
+	LDAPURLDesc		*ldap_url;	//!< The parsed URL, the attribute list must outlive the query.
+	LDAPControl		*server_ctrls[2];	//!< Server side sort control, if any.
+	fr_ldap_query_t		*query;		//!< The search, parented by this structure.
+} ldap_xlat_rctx_t;
+
+static int _ldap_xlat_rctx_free(ldap_xlat_rctx_t *rctx)
+{
+	/*
+	 *	Cancel the search before the URL and
+	 *	controls it references go away.
+	 */
+	TALLOC_FREE(rctx->query);
+
+#ifdef HAVE_LDAP_CREATE_SORT_CONTROL
+	if (rctx->server_ctrls[0]) ldap_control_free(rctx->server_ctrls[0]);
+#endif
+	if (rctx->ldap_url) ldap_free_urldesc(rctx->ldap_url);
+
+	return 0;
+}
+
+/** Concatenate the input of the async xlat into a URL, escaping the values of expansions
+ *
+ */
+static char *ldap_xlat_url(TALLOC_CTX *ctx, REQUEST *request, fr_value_box_t *in)
+{
+	char		*url;
+	fr_value_box_t	*vb;
+
+	MEM(url = talloc_strdup(ctx, ""));
+	for (vb = in; vb; vb = vb->next) {
+		fr_value_box_t	str;
+
+		if (fr_value_box_cast(url, &str, FR_TYPE_STRING, NULL, vb) < 0) {
+			RPEDEBUG("Failed converting URL component to string");
+			talloc_free(url);
+			return NULL;
+		}
+
+		if (vb->tainted) {
+			size_t	len = (str.vb_length * 3) + 1;
+			char	*escaped;
+
+			MEM(escaped = talloc_zero_array(url, char, len));
+			fr_ldap_escape_func(request, escaped, len, str.vb_strvalue, NULL);
+			MEM(url = talloc_strdup_append_buffer(url, escaped));
+			talloc_free(escaped);
+		} else {
+			MEM(url = talloc_strndup_append_buffer(url, str.vb_strvalue, str.vb_length));
+		}
+		fr_value_box_clear(&str);
+	}
+
+	return url;
+}
+
+static xlat_action_t ldap_async_xlat_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
+					    REQUEST *request, UNUSED void const *xlat_inst,
+					    UNUSED void *xlat_thread_inst,
+					    UNUSED fr_value_box_t **in, void *uctx)
+{
+	ldap_xlat_rctx_t	*rctx = talloc_get_type_abort(uctx, ldap_xlat_rctx_t);
+	fr_ldap_query_t		*query = rctx->query;
+	LDAPMessage		*entry;
+	struct berval		**values;
+	fr_value_box_t		*vb;
+	xlat_action_t		ret = XLAT_ACTION_DONE;
+
+	/*
+	 *	As with the synchronous xlat, a failed
+	 *	search produces no output.
+	 */
+	if (query->ret != LDAP_PROC_SUCCESS) goto finish;
+
+	/*
+	 *	The result chain isn't tied to the connection it was
+	 *	received on, which may have been freed since, so
+	 *	parse it with the global handle.
+	 */
+	entry = ldap_first_entry(ldap_global_handle, query->result);
+	if (!entry) {
+		REDEBUG("Failed retrieving entry");
+		ret = XLAT_ACTION_FAIL;
+		goto finish;
+	}
+
+	values = ldap_get_values_len(ldap_global_handle, entry, rctx->ldap_url->lud_attrs[0]);
+	if (!values) {
+		RDEBUG2("No \"%s\" attributes found in specified object", rctx->ldap_url->lud_attrs[0]);
+		goto finish;
+	}
+
+	MEM(vb = fr_value_box_alloc_null(ctx));
+	if (fr_value_box_bstrndup(vb, vb, NULL, values[0]->bv_val, values[0]->bv_len, true) < 0) {
+		talloc_free(vb);
+		ret = XLAT_ACTION_FAIL;
+	} else {
+		fr_cursor_append(out, vb);
+	}
+	ldap_value_free_len(values);
+
+finish:
+	talloc_free(rctx);
+
+	return ret;
+}
+
+static void ldap_async_xlat_signal(UNUSED REQUEST *request, UNUSED void *xlat_inst,
+				   UNUSED void *xlat_thread_inst, void *uctx, fr_state_signal_t action)
+{
+	ldap_xlat_rctx_t	*rctx = talloc_get_type_abort(uctx, ldap_xlat_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(rctx);
+}
+
+/** Expand an LDAP URL into a query, sending it over the thread's trunk
+ *
+ * Used instead of #ldap_xlat when `async = yes`.  The request yields
+ * until the result arrives.
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t ldap_async_xlat(UNUSED TALLOC_CTX *ctx, UNUSED fr_cursor_t *out,
+				     REQUEST *request, UNUSED void const *xlat_inst,
+				     void *xlat_thread_inst, fr_value_box_t **in)
+{
+	ldap_xlat_thread_inst_t	*xt = talloc_get_type_abort(xlat_thread_inst, ldap_xlat_thread_inst_t);
+	ldap_xlat_rctx_t	*rctx;
+	char			*url;
+	char const * const	*attrs;
+
+	if (!*in) {
+		REDEBUG("Missing LDAP URL");
+		return XLAT_ACTION_FAIL;
+	}
+
+	MEM(rctx = talloc_zero(request, ldap_xlat_rctx_t));
+	talloc_set_destructor(rctx, _ldap_xlat_rctx_free);
+
+	url = ldap_xlat_url(rctx, request, *in);
+	if (!url) {
+	error:
+		talloc_free(rctx);
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (!ldap_is_ldap_url(url)) {
+		REDEBUG("String passed does not look like an LDAP URL");
+		goto error;
+	}
+
+	if (ldap_url_parse(url, &rctx->ldap_url)){
+		REDEBUG("Parsing LDAP URL failed");
+		goto error;
+	}
+
+	/*
+	 *	Nothing, empty string, "*" string, or got 2 things, die.
+	 */
+	if (!rctx->ldap_url->lud_attrs || !rctx->ldap_url->lud_attrs[0] ||
+	    !*rctx->ldap_url->lud_attrs[0] ||
+	    (strcmp(rctx->ldap_url->lud_attrs[0], "*") == 0) ||
+	    rctx->ldap_url->lud_attrs[1]) {
+		REDEBUG("Bad attributes list in LDAP URL. URL must specify exactly one attribute to retrieve");
+		goto error;
+	}
+
+	if (fr_ldap_parse_url_extensions(&rctx->server_ctrls[0], request, ldap_global_handle,
+					 rctx->ldap_url->lud_exts) < 0) goto error;
+
+	memcpy(&attrs, &rctx->ldap_url->lud_attrs, sizeof(attrs));
+
+	switch (fr_ldap_trunk_search(&rctx->query, rctx, xt->t->trunk, request,
+				     rctx->ldap_url->lud_dn, rctx->ldap_url->lud_scope, rctx->ldap_url->lud_filter,
+				     attrs, rctx->server_ctrls, NULL)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	case FR_TRUNK_ENQUEUE_NO_CAPACITY:
+	case FR_TRUNK_ENQUEUE_DST_UNAVAILABLE:
+		REDEBUG("No connections available");
+		goto error;
+
+	default:
+		REDEBUG("Failed enqueueing search");
+		goto error;
+	}
+
+	return unlang_xlat_yield(request, ldap_async_xlat_resume, ldap_async_xlat_signal, rctx);
+}
+
+/** Resolves and caches the module's thread instance for use by a specific xlat instance
+ *
+ */
+static int ldap_xlat_thread_instantiate(UNUSED void *xlat_inst, void *xlat_thread_inst,
+					UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	rlm_ldap_t const	*inst = uctx;
+	ldap_xlat_thread_inst_t	*xt = xlat_thread_inst;
+
+	xt->inst = inst;
+	xt->t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_ldap_thread_t);
+
+	return 0;
+}
+
 /*
  *	Verify the result of the map.
  */
@@ -475,7 +732,7 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	conn = mod_conn_get(inst, request);
 	if (!conn) goto free_expanded;
 
-	if (fr_ldap_parse_url_extensions(&server_ctrls[0], request, conn, ldap_url->lud_exts) < 0) goto free_socket;
+	if (fr_ldap_parse_url_extensions(&server_ctrls[0], request, conn->handle, ldap_url->lud_exts) < 0) goto free_socket;
 
 	status = fr_ldap_search(&result, request, &conn, ldap_url->lud_dn, ldap_url->lud_scope,
 				ldap_url->lud_filter, expanded.attrs, server_ctrls, NULL);
@@ -598,6 +855,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	bool			found = false;
 	bool			check_is_dn;
+	bool			cache_checked = false;
 
 	fr_ldap_connection_t		*conn = NULL;
 	char const		*user_dn;
@@ -651,6 +909,30 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 		}
 	}
 
+	/*
+	 *	If we already know the user's DN, a cached result
+	 *	means we don't need a connection at all.
+	 */
+	if (inst->group_cache) {
+		VALUE_PAIR *vp;
+
+		vp = fr_pair_find_by_da(request->control, attr_ldap_userdn, TAG_ANY);
+		if (vp) {
+			switch (rlm_ldap_group_cache_find(inst, request, vp->vp_strvalue, check)) {
+			case RLM_MODULE_OK:
+				found = true;
+				goto finish;
+
+			case RLM_MODULE_NOTFOUND:
+				goto finish;
+
+			default:
+				cache_checked = true;
+				break;
+			}
+		}
+	}
+
 	conn = mod_conn_get(inst, request);
 	if (!conn) return 1;
 
@@ -665,6 +947,18 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	fr_assert(conn);
 
+	if (!cache_checked) switch (rlm_ldap_group_cache_find(inst, request, user_dn, check)) {
+	case RLM_MODULE_OK:
+		found = true;
+		goto finish;
+
+	case RLM_MODULE_NOTFOUND:
+		goto finish;
+
+	default:
+		break;
+	}
+
 	/*
 	 *	Check groupobj user membership
 	 */
@@ -675,7 +969,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 		case RLM_MODULE_OK:
 			found = true;
-			FALL_THROUGH;
+			goto cache;
 
 		default:
 			goto finish;
@@ -694,7 +988,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 		case RLM_MODULE_OK:
 			found = true;
-			FALL_THROUGH;
+			goto cache;
 
 		default:
 			goto finish;
@@ -703,6 +997,13 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	fr_assert(conn);
 
+	/*
+	 *	Only definite answers are cached, errors
+	 *	result in another search next time.
+	 */
+cache:
+	rlm_ldap_group_cache_add(inst, request, user_dn, check, found);
+
 finish:
 	if (conn) ldap_mod_conn_release(inst, request, conn);
 
@@ -930,57 +1231,62 @@ free_result:
 	return rcode;
 }
 
-static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQUEST *request)
+/** Add the attributes needed for access checks, group memberships, and profiles to those we retrieve
+ *
+ * @param[out] expanded	Attributes to retrieve from the user object.
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int ldap_authorize_attrs(fr_ldap_map_exp_t *expanded, rlm_ldap_t const *inst, REQUEST *request)
 {
-	rlm_ldap_t const 	*inst = talloc_get_type_abort_const(mctx->instance, rlm_ldap_t);
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
-	int			ldap_errno;
-	int			i;
-	struct berval		**values;
-	fr_ldap_connection_t	*conn;
-	LDAPMessage		*result, *entry;
-	char const 		*dn = NULL;
-	fr_ldap_map_exp_t	expanded; /* faster than allocing every time */
-#ifdef WITH_EDIR
-	fr_ldap_rcode_t		status;
-#endif
+	if (fr_ldap_map_expand(expanded, request, inst->user_map) < 0) return -1;
 
-	/*
-	 *	Don't be tempted to add a check for User-Name or
-	 *	User-Password here.  LDAP authorization can be used
-	 *	for many things besides searching for users.
-	 */
-
-	if (fr_ldap_map_expand(&expanded, request, inst->user_map) < 0) return RLM_MODULE_FAIL;
-
-	conn = mod_conn_get(inst, request);
-	if (!conn) return RLM_MODULE_FAIL;
-
-	/*
-	 *	Add any additional attributes we need for checking access, memberships, and profiles
-	 */
 	if (inst->userobj_access_attr) {
-		expanded.attrs[expanded.count++] = inst->userobj_access_attr;
+		expanded->attrs[expanded->count++] = inst->userobj_access_attr;
 	}
 
 	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
-		expanded.attrs[expanded.count++] = inst->userobj_membership_attr;
+		expanded->attrs[expanded->count++] = inst->userobj_membership_attr;
 	}
 
 	if (inst->profile_attr) {
-		expanded.attrs[expanded.count++] = inst->profile_attr;
+		expanded->attrs[expanded->count++] = inst->profile_attr;
 	}
 
 	if (inst->valuepair_attr) {
-		expanded.attrs[expanded.count++] = inst->valuepair_attr;
+		expanded->attrs[expanded->count++] = inst->valuepair_attr;
 	}
 
-	expanded.attrs[expanded.count] = NULL;
+	expanded->attrs[expanded->count] = NULL;
 
-	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
-	if (!dn) {
-		goto finish;
-	}
+	return 0;
+}
+
+/** Apply access checks, group memberships, profiles and the user map to a user object
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @param[in,out] pconn	to use. May change as this function calls functions which auto re-connect.
+ * @param[in] dn	of the user object.
+ * @param[in] result	of the user object search.
+ * @param[in] expanded	Attributes retrieved from the user object.
+ * @return one of the RLM_MODULE_* values.
+ */
+static rlm_rcode_t ldap_authorize_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_connection_t **pconn,
+				       char const *dn, LDAPMessage *result, fr_ldap_map_exp_t const *expanded)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	int			ldap_errno;
+	int			i;
+	struct berval		**values;
+	fr_ldap_connection_t	*conn = *pconn;
+	LDAPMessage		*entry;
+#ifdef WITH_EDIR
+	fr_ldap_rcode_t		status;
+#endif
 
 	entry = ldap_first_entry(conn->handle, result);
 	if (!entry) {
@@ -1109,7 +1415,7 @@ skip_edir:
 			goto finish;
 		}
 
-		switch (rlm_ldap_map_profile(inst, request, &conn, profile, &expanded)) {
+		switch (rlm_ldap_map_profile(inst, request, &conn, profile, expanded)) {
 		case RLM_MODULE_INVALID:
 			rcode = RLM_MODULE_INVALID;
 			goto finish;
@@ -1137,7 +1443,7 @@ skip_edir:
 				char *value;
 
 				value = fr_ldap_berval_to_string(request, values[i]);
-				ret = rlm_ldap_map_profile(inst, request, &conn, value, &expanded);
+				ret = rlm_ldap_map_profile(inst, request, &conn, value, expanded);
 				talloc_free(value);
 				if (ret == RLM_MODULE_FAIL) {
 					ldap_value_free_len(values);
@@ -1154,12 +1460,179 @@ skip_edir:
 		RDEBUG2("Processing user attributes");
 		RINDENT();
 		if (fr_ldap_map_do(request, conn, inst->valuepair_attr,
-				   &expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
+				   expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
 		REXDENT();
 		rlm_ldap_check_reply(inst, request, conn);
 	}
 
+finish:
+	*pconn = conn;
+
+	return rcode;
+}
+
+/** Process the result of a user object search sent over a trunk
+ *
+ */
+typedef struct {
+	fr_ldap_map_exp_t	expanded;		//!< Attributes being retrieved.
+	fr_ldap_query_t		*query;			//!< User object search.
+} ldap_autz_rctx_t;
+
+static int _ldap_autz_rctx_free(ldap_autz_rctx_t *rctx)
+{
+	talloc_free(rctx->expanded.ctx);
+
+	return 0;
+}
+
+static void mod_authorize_signal(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request,
+				 void *uctx, fr_state_signal_t action)
+{
+	ldap_autz_rctx_t	*rctx = talloc_get_type_abort(uctx, ldap_autz_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(rctx);	/* Cancels the search */
+}
+
+static rlm_rcode_t mod_authorize_resume(module_ctx_t const *mctx, REQUEST *request, void *uctx)
+{
+	rlm_ldap_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_ldap_t);
+	ldap_autz_rctx_t	*rctx = talloc_get_type_abort(uctx, ldap_autz_rctx_t);
+	rlm_rcode_t		rcode = RLM_MODULE_FAIL;
+	fr_ldap_connection_t	*conn;
+	char const		*dn;
+
+	/*
+	 *	The result is parsed, and any group or
+	 *	profile lookups are performed, with a
+	 *	pooled connection.
+	 */
+	conn = mod_conn_get(inst, request);
+	if (!conn) goto finish;
+
+	dn = rlm_ldap_find_user_resume(inst, request, conn, rctx->query, &rcode);
+	if (dn) rcode = ldap_authorize_user(inst, request, &conn, dn, rctx->query->result, &rctx->expanded);
+
+	ldap_mod_conn_release(inst, request, conn);
+
+finish:
+	talloc_free(rctx);
+
+	return rcode;
+}
+
+/** Authorize a user from the replica maintained by an ldap_sync listener
+ *
+ * @param[out] rcode	The result of authorizing the user.
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @return
+ *	- true if the replica was used, and rcode has been set.
+ *	- false if the directory must be searched instead.
+ */
+static bool ldap_authorize_replica(rlm_rcode_t *rcode, rlm_ldap_t const *inst, REQUEST *request)
+{
+	fr_ldap_map_exp_t	expanded;
+	fr_ldap_replica_entry_t	*entry = NULL;
+
+	if (ldap_authorize_attrs(&expanded, inst, request) < 0) {
+		*rcode = RLM_MODULE_FAIL;
+		return true;
+	}
+
+	switch (rlm_ldap_find_user_replica(expanded.ctx, &entry, inst, request)) {
+	case 1:
+		break;
+
+	case 0:
+		talloc_free(expanded.ctx);
+		*rcode = RLM_MODULE_NOTFOUND;
+		return true;
+
+	default:
+		RDEBUG2("Replica \"%s\" is unavailable, searching the directory", inst->user_replica_name);
+		talloc_free(expanded.ctx);
+		return false;
+	}
+
+	*rcode = RLM_MODULE_OK;
+
+	if (inst->userobj_access_attr) {
+		*rcode = rlm_ldap_check_access_replica(inst, request, entry);
+		if (*rcode != RLM_MODULE_OK) goto finish;
+	}
+
+	if (inst->user_map) {
+		RDEBUG2("Processing user attributes");
+		RINDENT();
+		if (fr_ldap_replica_map_do(request, &expanded, entry) > 0) *rcode = RLM_MODULE_UPDATED;
+		REXDENT();
+	}
+
 finish:
+	talloc_free(expanded.ctx);
+
+	return true;
+}
+
+static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQUEST *request)
+{
+	rlm_ldap_t const 	*inst = talloc_get_type_abort_const(mctx->instance, rlm_ldap_t);
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ldap_thread_t);
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	fr_ldap_connection_t	*conn;
+	LDAPMessage		*result;
+	char const 		*dn = NULL;
+	fr_ldap_map_exp_t	expanded; /* faster than allocing every time */
+
+	/*
+	 *	Don't be tempted to add a check for User-Name or
+	 *	User-Password here.  LDAP authorization can be used
+	 *	for many things besides searching for users.
+	 */
+
+	/*
+	 *	Use the local copy of the directory if
+	 *	there is one, and it's current.
+	 */
+	if (inst->user_replica && ldap_authorize_replica(&rcode, inst, request)) return rcode;
+
+	/*
+	 *	Search for the user object without blocking, the
+	 *	request yields until the result arrives.
+	 */
+	if (t->trunk) {
+		ldap_autz_rctx_t	*rctx;
+
+		MEM(rctx = talloc_zero(request, ldap_autz_rctx_t));
+		if (ldap_authorize_attrs(&rctx->expanded, inst, request) < 0) {
+			talloc_free(rctx);
+			return RLM_MODULE_FAIL;
+		}
+		talloc_set_destructor(rctx, _ldap_autz_rctx_free);
+
+		if (rlm_ldap_find_user_async(&rctx->query, rctx, inst, t->trunk, request,
+					     rctx->expanded.attrs, &rcode) < 0) {
+			talloc_free(rctx);
+			return rcode;
+		}
+
+		return unlang_module_yield(request, mod_authorize_resume, mod_authorize_signal, rctx);
+	}
+
+	if (ldap_authorize_attrs(&expanded, inst, request) < 0) return RLM_MODULE_FAIL;
+
+	conn = mod_conn_get(inst, request);
+	if (!conn) {
+		talloc_free(expanded.ctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
+	if (dn) rcode = ldap_authorize_user(inst, request, &conn, dn, result, &expanded);
+
 	talloc_free(expanded.ctx);
 	if (result) ldap_msgfree(result);
 	ldap_mod_conn_release(inst, request, conn);
@@ -1529,7 +2002,23 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		inst->cache_da = inst->group_da;	/* Default to the group_da */
 	}
 
-	xlat_register(inst, inst->name, ldap_xlat, fr_ldap_escape_func, NULL, 0, XLAT_DEFAULT_BUF_LEN, false);
+	if (inst->async) {
+		xlat_t const *xlat;
+
+		xlat = xlat_async_register(inst, inst->name, ldap_async_xlat);
+		xlat_async_thread_instantiate_set(xlat, ldap_xlat_thread_instantiate,
+						  ldap_xlat_thread_inst_t, NULL, inst);
+		xlat_async_yields_set(xlat);
+	} else {
+		xlat_register(inst, inst->name, ldap_xlat, fr_ldap_escape_func, NULL, 0, XLAT_DEFAULT_BUF_LEN, false);
+	}
+	if (inst->group_cache_size) {
+		char *name;
+
+		name = talloc_asprintf(NULL, "%s_group_flush", inst->name);
+		xlat_register(inst, name, ldap_group_flush_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, true);
+		talloc_free(name);
+	}
 	xlat_register(inst, "ldap_escape", ldap_escape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, true);
 	xlat_register(inst, "ldap_unescape", ldap_unescape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, true);
 	map_proc_register(inst, inst->name, mod_map_proc, ldap_map_verify, 0);
@@ -1583,6 +2072,37 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		}
 	}
 
+	/*
+	 *	Entries in the replica are only copies of the
+	 *	user object, anything which needs further searches
+	 *	or the entry as returned by the server can't be
+	 *	satisfied from it.
+	 */
+	if (inst->user_replica_name) {
+		char const *bad = NULL;
+
+		if (inst->valuepair_attr) {
+			bad = "options.valuepair_attribute";
+		} else if (inst->cacheable_group_name || inst->cacheable_group_dn) {
+			bad = "group.cacheable_name and group.cacheable_dn";
+		} else if (inst->edir) {
+			bad = "edir";
+		} else if (inst->default_profile || inst->profile_attr) {
+			bad = "profile";
+		}
+
+		if (bad) {
+			cf_log_err(conf, "Configuration item 'user.replica' cannot be used with %s", bad);
+			goto error;
+		}
+
+		inst->user_replica = fr_ldap_replica_get(inst->user_replica_name, NULL);
+		if (!inst->user_replica) {
+			cf_log_perr(conf, "Failed resolving replica \"%s\"", inst->user_replica_name);
+			goto error;
+		}
+	}
+
 	/*
 	 *	If we have a *pair* as opposed to a *section*
 	 *	then the module is referencing another ldap module's
@@ -1595,6 +2115,18 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		}
 	}
 
+#ifdef LDAP_CONTROL_X_SESSION_TRACKING
+	/*
+	 *	Session tracking controls are added to the
+	 *	connection a search is sent on, which we don't
+	 *	know until the trunk sends it.
+	 */
+	if (inst->async && inst->session_tracking) {
+		cf_log_err(conf, "Configuration item 'session_tracking' is not supported with 'async = yes'");
+		goto error;
+	}
+#endif
+
 #ifndef WITH_SASL
 	if (inst->user_sasl.mech) {
 		cf_log_err(conf, "Configuration item 'user.sasl.mech' not supported.  "
@@ -1995,6 +2527,8 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 						 ldap_mod_conn_create, NULL, NULL, NULL, NULL);
 	if (!inst->pool) goto error;
 
+	if (rlm_ldap_group_cache_init(inst) < 0) goto error;
+
 	fr_ldap_global_config(inst->ldap_debug, inst->tls_random_file);
 
 	return 0;
@@ -2010,6 +2544,27 @@ static int mod_load(void)
 	return 0;
 }
 
+/** Create a trunk for the thread, if the module is async
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_ldap_t		*inst = instance;
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(thread, rlm_ldap_thread_t);
+
+	t->inst = inst;
+
+	if (!inst->async) return 0;
+
+	t->trunk = fr_ldap_trunk_alloc(t, el, &inst->handle_config, &inst->trunk_conf, inst->handle_config.name);
+	if (!t->trunk) {
+		ERROR("Failed creating trunk");
+		return -1;
+	}
+
+	return 0;
+}
+
 static void mod_unload(void)
 {
 	fr_ldap_free();;
@@ -2023,11 +2578,14 @@ module_t rlm_ldap = {
 	.type		= 0,
 	.inst_size	= sizeof(rlm_ldap_t),
 	.config		= module_config,
+	.thread_inst_size	= sizeof(rlm_ldap_thread_t),
+	.thread_inst_type	= "rlm_ldap_thread_t",
 	.onload		= mod_load,
 	.unload		= mod_unload,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
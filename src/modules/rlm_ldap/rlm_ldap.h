@@ -18,6 +18,7 @@
 #include <freeradius-devel/ldap/base.h>
 
 typedef struct ldap_inst_s rlm_ldap_t;
+typedef struct rlm_ldap_group_cache_s rlm_ldap_group_cache_t;
 
 typedef struct {
 	vp_tmpl_t	*mech;				//!< SASL mech(s) to try.
@@ -74,6 +75,13 @@ struct ldap_inst_s {
 	char const	*valuepair_attr;		//!< Generic dynamic mapping attribute, contains a RADIUS
 							//!< attribute and value.
 
+	char const	*user_replica_name;		//!< Name of the replica maintained by an ldap_sync listener.
+	vp_tmpl_t	*user_replica_key;		//!< Value to look up in the replica's index attribute.
+	fr_time_delta_t	user_replica_max_age;		//!< Fall back to searching the directory if the replica
+							//!< hasn't been updated within this period.  0 disables
+							//!< the check.
+	fr_ldap_replica_t	*user_replica;		//!< Resolved replica.
+
 
 	/*
 	 *	Group object attributes and filters
@@ -112,6 +120,11 @@ struct ldap_inst_s {
 	bool		allow_dangling_group_refs;	//!< Don't error if we fail to resolve a group DN referenced
 														///< from a user object.
 
+	uint32_t	group_cache_size;		//!< Maximum number of membership results to cache.
+							//!< 0 disables the cache.
+	fr_time_delta_t	group_cache_lifetime;		//!< How long a cached membership result is valid for.
+	rlm_ldap_group_cache_t	*group_cache;		//!< Membership results, shared by all threads.
+
 	/*
 	 *	Profiles
 	 */
@@ -142,6 +155,10 @@ struct ldap_inst_s {
 	fr_pool_t	*pool;				//!< Connection pool instance.
 	fr_ldap_config_t handle_config;			//!< Connection configuration instance.
 
+	bool		async;				//!< Send user object searches and %{ldap:...}
+							//!< queries over a per-thread connection trunk.
+	fr_trunk_conf_t	trunk_conf;			//!< Trunk configuration, used when async.
+
 	/*
 	 *	Global config
 	 */
@@ -151,6 +168,14 @@ struct ldap_inst_s {
 	uint32_t	ldap_debug;			//!< Debug flag for the SDK.
 };
 
+/** rlm_ldap thread instance
+ *
+ */
+typedef struct {
+	rlm_ldap_t const	*inst;			//!< rlm_ldap instance.
+	fr_trunk_t		*trunk;			//!< Connections to the directory, NULL unless async.
+} rlm_ldap_thread_t;
+
 extern fr_dict_attr_t const *attr_cleartext_password;
 extern fr_dict_attr_t const *attr_crypt_password;
 extern fr_dict_attr_t const *attr_ldap_userdn;
@@ -166,9 +191,21 @@ extern fr_dict_attr_t const *attr_user_name;
 char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_connection_t **pconn,
 			       char const *attrs[], bool force, LDAPMessage **result, rlm_rcode_t *rcode);
 
+int rlm_ldap_find_user_async(fr_ldap_query_t **out, TALLOC_CTX *ctx, rlm_ldap_t const *inst, fr_trunk_t *trunk,
+			     REQUEST *request, char const *attrs[], rlm_rcode_t *rcode);
+
+char const *rlm_ldap_find_user_resume(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_connection_t const *conn,
+				      fr_ldap_query_t *query, rlm_rcode_t *rcode);
+
+int rlm_ldap_find_user_replica(TALLOC_CTX *ctx, fr_ldap_replica_entry_t **out,
+			       rlm_ldap_t const *inst, REQUEST *request);
+
 rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request,
 				  fr_ldap_connection_t const *conn, LDAPMessage *entry);
 
+rlm_rcode_t rlm_ldap_check_access_replica(rlm_ldap_t const *inst, REQUEST *request,
+					  fr_ldap_replica_entry_t const *entry);
+
 void rlm_ldap_check_reply(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_connection_t const *conn);
 
 /*
@@ -187,6 +224,16 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 
 rlm_rcode_t rlm_ldap_check_cached(rlm_ldap_t const *inst, REQUEST *request, VALUE_PAIR *check);
 
+int rlm_ldap_group_cache_init(rlm_ldap_t *inst);
+
+rlm_rcode_t rlm_ldap_group_cache_find(rlm_ldap_t const *inst, REQUEST *request,
+				      char const *user_dn, VALUE_PAIR const *check);
+
+void rlm_ldap_group_cache_add(rlm_ldap_t const *inst, REQUEST *request,
+			      char const *user_dn, VALUE_PAIR const *check, bool member);
+
+uint32_t rlm_ldap_group_cache_flush(rlm_ldap_t const *inst, char const *dn);
+
 /*
  *	conn.c - Connection wrappers.
  */
@@ -36,6 +36,115 @@ USES_APPLE_DEPRECATED_API
 
 #include "rlm_ldap.h"
 
+/** Extract the DN of a user object from the result of a search
+ *
+ * Adds the DN to the control list as LDAP-UserDN.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] handle used to parse the result.
+ * @param[in] result of the user object search.
+ * @param[out] rcode The status of the operation, one of the RLM_MODULE_* codes.
+ * @return The user's DN or NULL on error.
+ */
+static char const *ldap_find_user_dn(rlm_ldap_t const *inst, REQUEST *request, LDAP *handle,
+				     LDAPMessage *result, rlm_rcode_t *rcode)
+{
+	VALUE_PAIR	*vp;
+	LDAPMessage	*entry;
+	int		ldap_errno;
+	int		cnt;
+	char		*dn;
+
+	*rcode = RLM_MODULE_FAIL;
+
+	/*
+	 *	Forbid the use of unsorted search results that
+	 *	contain multiple entries, as it's a potential
+	 *	security issue, and likely non deterministic.
+	 */
+	if (!inst->userobj_sort_ctrl) {
+		cnt = ldap_count_entries(handle, result);
+		if (cnt > 1) {
+			REDEBUG("Ambiguous search result, returned %i unsorted entries (should return 1 or 0).  "
+				"Enable sorting, or specify a more restrictive base_dn, filter or scope", cnt);
+			REDEBUG("The following entries were returned:");
+			RINDENT();
+			for (entry = ldap_first_entry(handle, result);
+			     entry;
+			     entry = ldap_next_entry(handle, entry)) {
+				dn = ldap_get_dn(handle, entry);
+				REDEBUG("%s", dn);
+				ldap_memfree(dn);
+			}
+			REXDENT();
+			*rcode = RLM_MODULE_INVALID;
+			return NULL;
+		}
+	}
+
+	entry = ldap_first_entry(handle, result);
+	if (!entry) {
+		ldap_get_option(handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		REDEBUG("Failed retrieving entry: %s",
+			ldap_err2string(ldap_errno));
+
+		return NULL;
+	}
+
+	dn = ldap_get_dn(handle, entry);
+	if (!dn) {
+		ldap_get_option(handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
+
+		return NULL;
+	}
+	fr_ldap_util_normalise_dn(dn, dn);
+
+	RDEBUG2("User object found at DN \"%s\"", dn);
+
+	MEM(pair_update_control(&vp, attr_ldap_userdn) >= 0);
+	fr_pair_value_strdup(vp, dn);
+	*rcode = RLM_MODULE_OK;
+
+	ldap_memfree(dn);
+
+	return vp->vp_strvalue;
+}
+
+/** Expand the base DN and filter used to find user objects
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with rcode set.
+ */
+static int ldap_find_user_expand(char const **base_dn, char *base_dn_buff, size_t base_dn_len,
+				 char const **filter, char *filter_buff, size_t filter_len,
+				 rlm_ldap_t const *inst, REQUEST *request, rlm_rcode_t *rcode)
+{
+	*filter = NULL;
+
+	if (inst->userobj_filter) {
+		if (tmpl_expand(filter, filter_buff, filter_len, request, inst->userobj_filter,
+				fr_ldap_escape_func, NULL) < 0) {
+			REDEBUG("Unable to create filter");
+			*rcode = RLM_MODULE_INVALID;
+
+			return -1;
+		}
+	}
+
+	if (tmpl_expand(base_dn, base_dn_buff, base_dn_len, request,
+			inst->userobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Unable to create base_dn");
+		*rcode = RLM_MODULE_INVALID;
+
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Retrieve the DN of a user object
  *
  * Retrieves the DN of a user and adds it to the control list as LDAP-UserDN. Will also retrieve any
@@ -61,10 +170,8 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 
 	fr_ldap_rcode_t	status;
 	VALUE_PAIR	*vp = NULL;
-	LDAPMessage	*tmp_msg = NULL, *entry = NULL;
-	int		ldap_errno;
-	int		cnt;
-	char		*dn = NULL;
+	LDAPMessage	*tmp_msg = NULL;
+	char const	*dn = NULL;
 	char const	*filter = NULL;
 	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
 	char const	*base_dn;
@@ -115,23 +222,8 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 		(*pconn)->rebound = false;
 	}
 
-	if (inst->userobj_filter) {
-		if (tmpl_expand(&filter, filter_buff, sizeof(filter_buff), request, inst->userobj_filter,
-				fr_ldap_escape_func, NULL) < 0) {
-			REDEBUG("Unable to create filter");
-			*rcode = RLM_MODULE_INVALID;
-
-			return NULL;
-		}
-	}
-
-	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
-			inst->userobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
-		REDEBUG("Unable to create base_dn");
-		*rcode = RLM_MODULE_INVALID;
-
-		return NULL;
-	}
+	if (ldap_find_user_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff),
+				  &filter, filter_buff, sizeof(filter_buff), inst, request, rcode) < 0) return NULL;
 
 	status = fr_ldap_search(result, request, pconn, base_dn,
 				inst->userobj_scope, filter, attrs, serverctrls, NULL);
@@ -151,83 +243,138 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 
 	fr_assert(*pconn);
 
-	/*
-	 *	Forbid the use of unsorted search results that
-	 *	contain multiple entries, as it's a potential
-	 *	security issue, and likely non deterministic.
-	 */
-	if (!inst->userobj_sort_ctrl) {
-		cnt = ldap_count_entries((*pconn)->handle, *result);
-		if (cnt > 1) {
-			REDEBUG("Ambiguous search result, returned %i unsorted entries (should return 1 or 0).  "
-				"Enable sorting, or specify a more restrictive base_dn, filter or scope", cnt);
-			REDEBUG("The following entries were returned:");
-			RINDENT();
-			for (entry = ldap_first_entry((*pconn)->handle, *result);
-			     entry;
-			     entry = ldap_next_entry((*pconn)->handle, entry)) {
-				dn = ldap_get_dn((*pconn)->handle, entry);
-				REDEBUG("%s", dn);
-				ldap_memfree(dn);
-			}
-			REXDENT();
-			*rcode = RLM_MODULE_INVALID;
-			goto finish;
-		}
+	dn = ldap_find_user_dn(inst, request, (*pconn)->handle, *result, rcode);
+
+	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
+		ldap_msgfree(*result);
+		*result = NULL;
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, *result);
-	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		REDEBUG("Failed retrieving entry: %s",
-			ldap_err2string(ldap_errno));
+	return dn;
+}
+
+/** Start searching for a user object over a trunk
+ *
+ * Asynchronous version of #rlm_ldap_find_user.  The request should yield
+ * if this succeeds, and call #rlm_ldap_find_user_resume when the search
+ * completes.
+ *
+ * @param[out] out Where to write the query.
+ * @param[in] ctx to allocate the query in.
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] trunk to send the search on.
+ * @param[in] request Current request.
+ * @param[in] attrs Additional attributes to retrieve.  Must remain valid until the search completes.
+ * @param[out] rcode The status of the operation, if the search couldn't be started.
+ * @return
+ *	- 0 if the search was enqueued.
+ *	- -1 on failure.
+ */
+int rlm_ldap_find_user_async(fr_ldap_query_t **out, TALLOC_CTX *ctx, rlm_ldap_t const *inst, fr_trunk_t *trunk,
+			     REQUEST *request, char const *attrs[], rlm_rcode_t *rcode)
+{
+	char const	*filter = NULL;
+	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
+	char const	*base_dn;
+	char	    	base_dn_buff[LDAP_MAX_DN_STR_LEN];
+	LDAPControl	*serverctrls[] = { inst->userobj_sort_ctrl, NULL };
+
+	*rcode = RLM_MODULE_FAIL;
+
+	if (ldap_find_user_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff),
+				  &filter, filter_buff, sizeof(filter_buff), inst, request, rcode) < 0) return -1;
+
+	switch (fr_ldap_trunk_search(out, ctx, trunk, request, base_dn, inst->userobj_scope, filter, attrs,
+				     serverctrls, NULL)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		return 0;
 
-		goto finish;
+	default:
+		REDEBUG("Unable to enqueue user object search");
+		return -1;
 	}
+}
 
-	dn = ldap_get_dn((*pconn)->handle, entry);
-	if (!dn) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
+/** Process the result of a user object search sent over a trunk
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] conn used to parse the result.
+ * @param[in] query started by #rlm_ldap_find_user_async.
+ * @param[out] rcode The status of the operation, one of the RLM_MODULE_* codes.
+ * @return The user's DN or NULL on error.
+ */
+char const *rlm_ldap_find_user_resume(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_connection_t const *conn,
+				      fr_ldap_query_t *query, rlm_rcode_t *rcode)
+{
+	switch (query->ret) {
+	case LDAP_PROC_SUCCESS:
+		break;
+
+	case LDAP_PROC_BAD_DN:
+	case LDAP_PROC_NO_RESULT:
+		*rcode = RLM_MODULE_NOTFOUND;
+		return NULL;
 
-		goto finish;
+	default:
+		*rcode = RLM_MODULE_FAIL;
+		return NULL;
 	}
+
+	return ldap_find_user_dn(inst, request, conn->handle, query->result, rcode);
+}
+
+/** Find a user object in the replica maintained by an ldap_sync listener
+ *
+ * On success the user's DN is added to the control list as &control:LDAP-UserDN,
+ * in the same way as #rlm_ldap_find_user.
+ *
+ * @param[in] ctx	to allocate the copy of the user object in.
+ * @param[out] out	Where to write the copy of the user object.
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @return
+ *	- 1 if the user object was found.
+ *	- 0 if there's no such user.
+ *	- -1 if the replica can't be used, and the directory should be searched instead.
+ */
+int rlm_ldap_find_user_replica(TALLOC_CTX *ctx, fr_ldap_replica_entry_t **out,
+			       rlm_ldap_t const *inst, REQUEST *request)
+{
+	char			key_buff[LDAP_MAX_FILTER_STR_LEN];
+	char const		*key;
+	char			*dn;
+	VALUE_PAIR		*vp;
+	int			ret;
+
+	if (tmpl_expand(&key, key_buff, sizeof(key_buff), request, inst->user_replica_key, NULL, NULL) < 0) {
+		REDEBUG("Unable to create replica key");
+		return -1;
+	}
+
+	ret = fr_ldap_replica_find(ctx, out, inst->user_replica, key, inst->user_replica_max_age);
+	if (ret <= 0) return ret;
+
+	dn = talloc_typed_strdup(request, (*out)->dn);
 	fr_ldap_util_normalise_dn(dn, dn);
 
-	RDEBUG2("User object found at DN \"%s\"", dn);
+	RDEBUG2("User object found in replica at DN \"%s\"", dn);
 
 	MEM(pair_update_control(&vp, attr_ldap_userdn) >= 0);
 	fr_pair_value_strdup(vp, dn);
-	*rcode = RLM_MODULE_OK;
-
-	ldap_memfree(dn);
+	talloc_free(dn);
 
-finish:
-	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
-		ldap_msgfree(*result);
-		*result = NULL;
-	}
-
-	return vp ? vp->vp_strvalue : NULL;
+	return 1;
 }
 
-/** Check for presence of access attribute in result
+/** Check the value of the access attribute
  *
- * @param[in] inst rlm_ldap configuration.
- * @param[in] request Current request.
- * @param[in] conn used to retrieve access attributes.
- * @param[in] entry retrieved by rlm_ldap_find_user or fr_ldap_search.
- * @return
- *	- #RLM_MODULE_DISALLOW if the user was denied access.
- *	- #RLM_MODULE_OK otherwise.
  */
-rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request,
-				  fr_ldap_connection_t const *conn, LDAPMessage *entry)
+static rlm_rcode_t ldap_check_access_values(rlm_ldap_t const *inst, REQUEST *request, struct berval **values)
 {
 	rlm_rcode_t rcode = RLM_MODULE_OK;
-	struct berval **values = NULL;
 
-	values = ldap_get_values_len(conn->handle, entry, inst->userobj_access_attr);
 	if (values) {
 		if (inst->access_positive) {
 			if ((values[0]->bv_len >= 5) && (strncasecmp(values[0]->bv_val, "false", 5) == 0)) {
@@ -240,7 +387,6 @@ rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request,
 			REDEBUG("\"%s\" attribute exists - user locked out", inst->userobj_access_attr);
 			rcode = RLM_MODULE_DISALLOW;
 		}
-		ldap_value_free_len(values);
 	} else if (inst->access_positive) {
 		REDEBUG("No \"%s\" attribute - user locked out", inst->userobj_access_attr);
 		rcode = RLM_MODULE_DISALLOW;
@@ -249,6 +395,48 @@ rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request,
 	return rcode;
 }
 
+/** Check for presence of access attribute in result
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] conn used to retrieve access attributes.
+ * @param[in] entry retrieved by rlm_ldap_find_user or fr_ldap_search.
+ * @return
+ *	- #RLM_MODULE_DISALLOW if the user was denied access.
+ *	- #RLM_MODULE_OK otherwise.
+ */
+rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request,
+				  fr_ldap_connection_t const *conn, LDAPMessage *entry)
+{
+	rlm_rcode_t rcode;
+	struct berval **values = NULL;
+
+	values = ldap_get_values_len(conn->handle, entry, inst->userobj_access_attr);
+	rcode = ldap_check_access_values(inst, request, values);
+	if (values) ldap_value_free_len(values);
+
+	return rcode;
+}
+
+/** Check for presence of access attribute in a user object from a replica
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @param[in] entry	retrieved by #rlm_ldap_find_user_replica.
+ * @return
+ *	- #RLM_MODULE_DISALLOW if the user was denied access.
+ *	- #RLM_MODULE_OK otherwise.
+ */
+rlm_rcode_t rlm_ldap_check_access_replica(rlm_ldap_t const *inst, REQUEST *request,
+					  fr_ldap_replica_entry_t const *entry)
+{
+	fr_ldap_replica_attr_t const *attr;
+
+	attr = fr_ldap_replica_attr(entry, inst->userobj_access_attr);
+
+	return ldap_check_access_values(inst, request, attr ? attr->values : NULL);
+}
+
 /** Verify we got a password from the search
  *
  * Checks to see if after the LDAP to RADIUS mapping has been completed that a reference password.
@@ -47,8 +47,13 @@ RCSID("$Id$")
 #  endif
 #endif
 
+#include <pthread.h>
 #include <sys/uio.h>
 
+#define LINELOG_IOV_MAX	64	//!< Maximum lines written by one writev() or sendmmsg().
+
+typedef struct linelog_async_s linelog_async_t;
+
 typedef enum {
 	LINELOG_DST_INVALID = 0,
 	LINELOG_DST_FILE,				//!< Log to a file.
@@ -105,6 +110,7 @@ typedef struct {
 		exfile_t		*ef;			//!< Exclusive file access handle.
 		bool			escape;			//!< Do filename escaping, yes / no.
 		xlat_escape_t		escape_func;		//!< Escape function.
+		bool			append_only;		//!< Don't lock, keep a descriptor open per thread.
 	} file;
 
 	struct {
@@ -115,6 +121,14 @@ typedef struct {
 	linelog_net_t		tcp;			//!< TCP server.
 	linelog_net_t		udp;			//!< UDP server.
 
+	struct {
+		size_t			max_queued;		//!< Bytes which may wait for the writer thread.
+								///< 0 writes synchronously.
+		char const		*overflow;		//!< What to do when the queue is full.
+		bool			block;			//!< Wait for space, rather than dropping lines.
+		linelog_async_t		*queue;			//!< Lines waiting for the writer thread.
+	} async;
+
 	CONF_SECTION		*cs;			//!< #CONF_SECTION to use as the root for #log_ref lookups.
 } rlm_linelog_t;
 
@@ -122,12 +136,48 @@ typedef struct {
 	int			sockfd;			//!< File descriptor associated with socket
 } linelog_conn_t;
 
+/** A line waiting for the writer thread
+ *
+ */
+typedef struct {
+	char			*filename;		//!< Expanded filename, for file destinations.
+	uint8_t			*data;			//!< Line, including the delimiter.
+	size_t			len;			//!< Length of the line.
+	fr_dlist_t		entry;			//!< Entry in the queue.
+} linelog_line_t;
+
+/** Queue of lines, and the thread writing them
+ *
+ * Workers only copy lines into the queue.  The writer thread takes
+ * everything queued since its last pass, and writes it with as few
+ * syscalls as the destination allows.
+ */
+struct linelog_async_s {
+	rlm_linelog_t		*inst;			//!< Instance data.
+	fr_time_delta_t		timeout;		//!< Socket write timeout.
+
+	pthread_t		thread;			//!< Writing lines.
+	pthread_mutex_t		mutex;			//!< Protects everything below.
+	pthread_cond_t		data;			//!< Signalled when lines are added.
+	pthread_cond_t		space;			//!< Signalled when lines have been written.
+
+	fr_dlist_head_t		queue;			//!< Lines waiting to be written.
+	size_t			queued;			//!< Bytes queued, or being written.
+	uint64_t		dropped;		//!< Lines discarded because the queue was full.
+	bool			stop;			//!< Tells the writer thread to exit.
+	bool			running;		//!< Writer thread was started.
+
+	linelog_conn_t		*conn;			//!< Writer's connection.  Only used by the writer.
+	size_t			written;		//!< Bytes written in this pass.  Only used by the writer.
+};
+
 
 static const CONF_PARSER file_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_XLAT, rlm_linelog_t, file.name) },
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_linelog_t, file.permissions), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", FR_TYPE_STRING, rlm_linelog_t, file.group_str) },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, rlm_linelog_t, file.escape), .dflt = "no" },
+	{ FR_CONF_OFFSET("append_only", FR_TYPE_BOOL, rlm_linelog_t, file.append_only), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -156,6 +206,12 @@ static const CONF_PARSER tcp_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER async_config[] = {
+	{ FR_CONF_OFFSET("max_queued", FR_TYPE_SIZE, rlm_linelog_t, async.max_queued), .dflt = "0" },
+	{ FR_CONF_OFFSET("overflow", FR_TYPE_STRING, rlm_linelog_t, async.overflow), .dflt = "drop" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("destination", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_linelog_t, log_dst_str) },
 
@@ -172,6 +228,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("tcp", FR_TYPE_SUBSECTION, rlm_linelog_t, tcp), .subcs= (void const *) tcp_config },
 	{ FR_CONF_OFFSET("udp", FR_TYPE_SUBSECTION, rlm_linelog_t, udp), .subcs = (void const *) udp_config },
 
+	{ FR_CONF_POINTER("async", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) async_config },
+
 	/*
 	 *	Deprecated config items
 	 */
@@ -269,11 +327,282 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t ti
 	return conn;
 }
 
+/** Write queued lines to the log destination
+ *
+ * Runs in the writer thread, which has its own connection for socket
+ * destinations.
+ */
+static void linelog_async_write(linelog_async_t *async, fr_dlist_head_t *todo)
+{
+	rlm_linelog_t const	*inst = async->inst;
+	struct iovec		iov[LINELOG_IOV_MAX];
+	linelog_line_t		*line, *next;
+	int			num, i, tries;
+
+	while ((line = fr_dlist_head(todo))) {
+		/*
+		 *	Gather as many lines as we can, for the same
+		 *	file if we're writing to files.
+		 */
+		for (next = line, num = 0;
+		     next && (num < LINELOG_IOV_MAX) &&
+		     (!line->filename || (strcmp(next->filename, line->filename) == 0));
+		     next = fr_dlist_next(todo, next)) {
+			iov[num].iov_base = next->data;
+			iov[num].iov_len = next->len;
+			num++;
+		}
+
+		switch (inst->log_dst) {
+		case LINELOG_DST_FILE:
+		{
+			int	fd;
+			char	*p;
+
+			p = strrchr(line->filename, '/');
+			if (p) {
+				*p = '\0';
+				if (fr_mkdir(NULL, line->filename, -1, 0700, NULL, NULL) < 0) {
+					ERROR("Failed to create directory %s: %s", line->filename, fr_syserror(errno));
+					*p = '/';
+					break;
+				}
+				*p = '/';
+			}
+
+			fd = exfile_open(inst->file.ef, NULL, line->filename, inst->file.permissions);
+			if (fd < 0) {
+				PERROR("Failed to open %s", line->filename);
+				break;
+			}
+
+			if (inst->file.group_str && (chown(line->filename, -1, inst->file.group) == -1)) {
+				WARN("Unable to change system group of \"%s\": %s", line->filename, fr_syserror(errno));
+			}
+
+			if (fr_writev(fd, iov, num, 0) < 0) {
+				ERROR("Failed writing to \"%s\": %s", line->filename, fr_syserror(errno));
+			}
+			exfile_close(inst->file.ef, NULL, fd);
+		}
+			break;
+
+#ifdef HAVE_SYSLOG_H
+		case LINELOG_DST_SYSLOG:
+			for (i = 0; i < num; i++) {
+				syslog(inst->syslog.priority, "%.*s", (int)iov[i].iov_len, (char *)iov[i].iov_base);
+			}
+			break;
+#endif
+
+		/*
+		 *	Reconnect and try again once, then give up on
+		 *	the lines we have.
+		 */
+		case LINELOG_DST_UDP:
+		case LINELOG_DST_TCP:
+		case LINELOG_DST_UNIX:
+			for (tries = 0; tries < 2; tries++) {
+				ssize_t wrote;
+
+				if (!async->conn) {
+					async->conn = mod_conn_create(NULL, async->inst, async->timeout);
+					if (!async->conn) continue;
+				}
+
+				if (inst->log_dst == LINELOG_DST_UDP) {
+					struct mmsghdr	msgvec[LINELOG_IOV_MAX];
+					int		done = 0;
+
+					/*
+					 *	The socket is connected, so
+					 *	each line is one datagram.
+					 */
+					memset(msgvec, 0, sizeof(msgvec[0]) * num);
+					for (i = 0; i < num; i++) {
+						msgvec[i].msg_hdr.msg_iov = &iov[i];
+						msgvec[i].msg_hdr.msg_iovlen = 1;
+					}
+
+					while (done < num) {
+						int sent;
+
+						sent = sendmmsg(async->conn->sockfd, msgvec + done, num - done, 0);
+						if (sent <= 0) break;
+						done += sent;
+					}
+					wrote = (done == num) ? 0 : -1;
+				} else {
+					char discard[64];
+
+					wrote = fr_writev(async->conn->sockfd, iov, num, async->timeout);
+
+					/* Drain the receive buffer */
+					if (wrote >= 0) while (recv(async->conn->sockfd, discard, sizeof(discard),
+								    MSG_DONTWAIT) > 0);
+				}
+				if (wrote >= 0) break;
+
+				/*
+				 *	Lines which were sent before the
+				 *	error may be sent twice, which is
+				 *	better than not at all.
+				 */
+				WARN("Failed writing to socket: %s.  Will reconnect and try again...",
+				     fr_syserror(errno));
+				TALLOC_FREE(async->conn);
+			}
+			if (tries == 2) ERROR("Failed writing %i lines to socket, discarding them", num);
+			break;
+
+		default:
+			break;
+		}
+
+		for (i = 0; i < num; i++) {
+			line = fr_dlist_head(todo);
+			fr_dlist_remove(todo, line);
+			async->written += line->len;
+			talloc_free(line);
+		}
+	}
+}
+
+/** Write queued lines until told to stop
+ *
+ */
+static void *linelog_async_thread(void *arg)
+{
+	linelog_async_t	*async = arg;
+	fr_dlist_head_t	todo;
+	linelog_line_t	*line;
+
+	fr_dlist_init(&todo, linelog_line_t, entry);
+
+	pthread_mutex_lock(&async->mutex);
+	for (;;) {
+		while (fr_dlist_empty(&async->queue) && !async->stop) {
+			pthread_cond_wait(&async->data, &async->mutex);
+		}
+		if (fr_dlist_empty(&async->queue)) break;
+
+		while ((line = fr_dlist_head(&async->queue))) {
+			fr_dlist_remove(&async->queue, line);
+			fr_dlist_insert_tail(&todo, line);
+		}
+		pthread_mutex_unlock(&async->mutex);
+
+		async->written = 0;
+		linelog_async_write(async, &todo);
+
+		/*
+		 *	Only release space once the lines are written,
+		 *	so memory use is bounded by max_queued.
+		 */
+		pthread_mutex_lock(&async->mutex);
+		async->queued -= async->written;
+		pthread_cond_broadcast(&async->space);
+	}
+	pthread_mutex_unlock(&async->mutex);
+
+	return NULL;
+}
+
+static int _linelog_async_free(linelog_async_t *async)
+{
+	if (async->running) {
+		pthread_mutex_lock(&async->mutex);
+		async->stop = true;
+		pthread_cond_signal(&async->data);
+		pthread_mutex_unlock(&async->mutex);
+
+		pthread_join(async->thread, NULL);
+	}
+
+	if (async->dropped) WARN("Dropped %" PRIu64 " lines because the queue was full", async->dropped);
+
+	talloc_free(async->conn);
+
+	pthread_cond_destroy(&async->space);
+	pthread_cond_destroy(&async->data);
+	pthread_mutex_destroy(&async->mutex);
+
+	return 0;
+}
+
+/** Queue a line for the writer thread
+ *
+ * @param[in] inst	Instance of linelog.
+ * @param[in] request	The current request.
+ * @param[in] filename	Expanded filename, or NULL for other destinations.
+ * @param[in] vector	Line to write.
+ * @param[in] vector_len	Number of elements in vector.
+ * @return
+ *	- #RLM_MODULE_OK if the line was queued.
+ *	- #RLM_MODULE_NOOP if the queue was full, and the line was dropped.
+ */
+static rlm_rcode_t linelog_async_enqueue(rlm_linelog_t const *inst, REQUEST *request, char const *filename,
+					 struct iovec const *vector, size_t vector_len)
+{
+	linelog_async_t	*async = inst->async.queue;
+	linelog_line_t	*line;
+	size_t		i, len = 0;
+	uint8_t		*p;
+
+	for (i = 0; i < vector_len; i++) len += vector[i].iov_len;
+
+	/*
+	 *	Lines are allocated in the NULL ctx, so the writer
+	 *	thread can free them without touching a talloc
+	 *	tree shared with this worker.
+	 */
+	MEM(line = talloc_zero(NULL, linelog_line_t));
+	MEM(line->data = p = talloc_array(line, uint8_t, len));
+	line->len = len;
+	for (i = 0; i < vector_len; i++) {
+		memcpy(p, vector[i].iov_base, vector[i].iov_len);
+		p += vector[i].iov_len;
+	}
+	if (filename) MEM(line->filename = talloc_typed_strdup(line, filename));
+
+	pthread_mutex_lock(&async->mutex);
+	while ((async->queued + len) > inst->async.max_queued) {
+		/*
+		 *	Always allow one line through, so lines
+		 *	larger than the queue aren't blocked forever.
+		 */
+		if (!async->queued) break;
+
+		if (!inst->async.block) {
+			async->dropped++;
+			pthread_mutex_unlock(&async->mutex);
+			talloc_free(line);
+
+			RWDEBUG("Write queue full, dropping line");
+			return RLM_MODULE_NOOP;
+		}
+		pthread_cond_wait(&async->space, &async->mutex);
+	}
+	fr_dlist_insert_tail(&async->queue, line);
+	async->queued += len;
+	pthread_cond_signal(&async->data);
+	pthread_mutex_unlock(&async->mutex);
+
+	RDEBUG2("Queued %zu bytes", len);
+
+	return RLM_MODULE_OK;
+}
+
 static int mod_detach(void *instance)
 {
 	rlm_linelog_t *inst = instance;
 
-	fr_pool_free(inst->pool);
+	/*
+	 *	Write out anything still queued
+	 */
+	TALLOC_FREE(inst->async.queue);
+
+	if (inst->pool) fr_pool_free(inst->pool);
 
 	return 0;
 }
@@ -323,7 +652,8 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 			return -1;
 		}
 
-		inst->file.ef = module_exfile_init(inst, conf, 256, 30, true, NULL, NULL);
+		inst->file.ef = module_exfile_init(inst, conf, 256, 30,
+						   inst->file.append_only ? EXFILE_APPEND : EXFILE_LOCKED, NULL, NULL);
 		if (!inst->file.ef) {
 			cf_log_err(conf, "Failed creating log file context");
 			return -1;
@@ -376,6 +706,8 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		cf_log_err(conf, "Unix sockets are not supported on this sytem");
 		return -1;
 #else
+		if (inst->async.max_queued) break;
+
 		inst->pool = module_connection_pool_init(cf_section_find(conf, "unix", NULL),
 							 inst, mod_conn_create, NULL, prefix, NULL, NULL);
 		if (!inst->pool) return -1;
@@ -383,12 +715,16 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		break;
 
 	case LINELOG_DST_UDP:
+		if (inst->async.max_queued) break;
+
 		inst->pool = module_connection_pool_init(cf_section_find(conf, "udp", NULL),
 							 inst, mod_conn_create, NULL, prefix, NULL, NULL);
 		if (!inst->pool) return -1;
 		break;
 
 	case LINELOG_DST_TCP:
+		if (inst->async.max_queued) break;
+
 		inst->pool = module_connection_pool_init(cf_section_find(conf, "tcp", NULL),
 							 inst, mod_conn_create, NULL, prefix, NULL, NULL);
 		if (!inst->pool) return -1;
@@ -402,6 +738,57 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->delimiter_len = talloc_array_length(inst->delimiter) - 1;
 	inst->cs = conf;
 
+	if (inst->async.max_queued) {
+		linelog_async_t	*async;
+		int		ret;
+
+		if (inst->log_dst == LINELOG_DST_SYSLOG) {
+			cf_log_err(conf, "\"async\" cannot be used with syslog, which is already buffered");
+			return -1;
+		}
+
+		if (strcmp(inst->async.overflow, "block") == 0) {
+			inst->async.block = true;
+		} else if (strcmp(inst->async.overflow, "drop") != 0) {
+			cf_log_err(conf, "Invalid value \"%s\" for \"async.overflow\", expected \"drop\" or \"block\"",
+				   inst->async.overflow);
+			return -1;
+		}
+
+		MEM(async = talloc_zero(inst, linelog_async_t));
+		async->inst = inst;
+		switch (inst->log_dst) {
+		case LINELOG_DST_UNIX:
+			async->timeout = inst->unix_sock.timeout;
+			break;
+
+		case LINELOG_DST_UDP:
+			async->timeout = inst->udp.timeout;
+			break;
+
+		case LINELOG_DST_TCP:
+			async->timeout = inst->tcp.timeout;
+			break;
+
+		default:
+			break;
+		}
+		pthread_mutex_init(&async->mutex, NULL);
+		pthread_cond_init(&async->data, NULL);
+		pthread_cond_init(&async->space, NULL);
+		fr_dlist_init(&async->queue, linelog_line_t, entry);
+		talloc_set_destructor(async, _linelog_async_free);
+
+		ret = pthread_create(&async->thread, NULL, linelog_async_thread, async);
+		if (ret != 0) {
+			cf_log_err(conf, "Failed creating writer thread: %s", fr_syserror(ret));
+			talloc_free(async);
+			return -1;
+		}
+		async->running = true;
+		inst->async.queue = async;
+	}
+
 	return 0;
 }
 
@@ -627,6 +1014,25 @@ build_vector:
 		goto finish;
 	}
 
+	/*
+	 *	Hand the line to the writer thread
+	 */
+	if (inst->async.queue) {
+		char path[2048];
+
+		if (inst->log_dst != LINELOG_DST_FILE) {
+			rcode = linelog_async_enqueue(inst, request, NULL, vector_p, vector_len);
+			goto finish;
+		}
+
+		if (xlat_eval(path, sizeof(path), request, inst->file.name, inst->file.escape_func, NULL) < 0) {
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+		rcode = linelog_async_enqueue(inst, request, path, vector_p, vector_len);
+		goto finish;
+	}
+
 	/*
 	 *	Reserve a handle, write out the data, close the handle
 	 */
@@ -86,7 +86,8 @@ typedef struct {
 	logtee_dst_t		log_dst;		//!< Logging destination.
 	char const		*log_dst_str;		//!< Logging destination string.
 
-	size_t			buffer_depth;		//!< How big our circular buffer should be.
+	size_t			buffer_depth;		//!< How many messages our circular buffer can hold.
+	size_t			buffer_size;		//!< How many bytes our circular buffer can hold.
 
 	struct {
 		char const		*name;			//!< File to write to.
@@ -111,13 +112,29 @@ typedef struct {
 /** Per-thread instance data
  *
  * Contains buffers and connection handles specific to the thread.
+ *
+ * Messages from all the requests being logged are expanded straight into
+ * one byte ring, with their delimiters, and written out with writev().
+ * For stream destinations everything pending goes out in one write, for
+ * UDP each message is one datagram.
  */
 typedef struct {
 	rlm_logtee_t const	*inst;			//!< Instance of logtee.
 	fr_event_list_t		*el;			//!< This thread's event list.
 	fr_connection_t		*conn;			//!< Connection to our log destination.
 
-	fr_fring_t		*fring;			//!< Circular buffer used to batch up messages.
+	uint8_t			*ring;			//!< Circular buffer used to batch up messages.
+	size_t			ring_head;		//!< Offset of the first byte waiting to be written.
+	size_t			ring_used;		//!< Bytes waiting to be written.
+
+	uint32_t		*msg_len;		//!< Length of each buffered message, including
+							//!< the delimiter.
+	size_t			msg_head;		//!< Index of the first message waiting to be written.
+	size_t			msg_count;		//!< Messages waiting to be written.
+	size_t			msg_written;		//!< How much of the first message has been written.
+
+	uint64_t		dropped;		//!< Messages dropped since this was last reported.
+	uint64_t		dropped_total;		//!< Messages dropped because the buffer was full.
 
 	bool			pending;		//!< We have pending messages to write.
 
@@ -158,6 +175,7 @@ static const CONF_PARSER tcp_config[] = {
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("destination", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_logtee_t, log_dst_str) },
 	{ FR_CONF_OFFSET("buffer_depth", FR_TYPE_SIZE, rlm_logtee_t, buffer_depth), .dflt = "10000" },
+	{ FR_CONF_OFFSET("buffer_size", FR_TYPE_SIZE, rlm_logtee_t, buffer_size), .dflt = "1048576" },
 
 	{ FR_CONF_OFFSET("delimiter", FR_TYPE_STRING, rlm_logtee_t, delimiter), .dflt = "\n" },
 	{ FR_CONF_OFFSET("format", FR_TYPE_TMPL, rlm_logtee_t, log_fmt), .dflt = "%n - %s", .quote = T_DOUBLE_QUOTED_STRING },
@@ -257,22 +275,86 @@ static void _logtee_conn_read(UNUSED fr_event_list_t *el, int sock, UNUSED int f
 	}
 }
 
+/** Fill in iovecs for the first len bytes waiting in the ring
+ *
+ * @return the number of iovecs used, 1 or 2 depending on whether the data wraps.
+ */
+static inline int logtee_ring_iov(rlm_logtee_thread_t *t, struct iovec iov[static 2], size_t len)
+{
+	size_t	size = t->inst->buffer_size;
+	size_t	first = size - t->ring_head;
+
+	iov[0].iov_base = t->ring + t->ring_head;
+	if (len <= first) {
+		iov[0].iov_len = len;
+		return 1;
+	}
+
+	iov[0].iov_len = first;
+	iov[1].iov_base = t->ring;
+	iov[1].iov_len = len - first;
+
+	return 2;
+}
+
+/** Release bytes which have been written
+ *
+ */
+static inline void logtee_ring_consume(rlm_logtee_thread_t *t, size_t len)
+{
+	rlm_logtee_t const	*inst = t->inst;
+
+	fr_assert(len <= t->ring_used);
+
+	t->ring_head = (t->ring_head + len) % inst->buffer_size;
+	t->ring_used -= len;
+
+	t->msg_written += len;
+	while (t->msg_count && (t->msg_written >= t->msg_len[t->msg_head])) {
+		t->msg_written -= t->msg_len[t->msg_head];
+		t->msg_head = (t->msg_head + 1) % inst->buffer_depth;
+		t->msg_count--;
+	}
+}
+
+/** Copy data into the ring at the tail, wrapping if needed
+ *
+ * The caller must have checked there's enough space.
+ */
+static inline void logtee_ring_append(rlm_logtee_thread_t *t, size_t offset, void const *in, size_t len)
+{
+	size_t	size = t->inst->buffer_size;
+	size_t	tail = (t->ring_head + t->ring_used + offset) % size;
+	size_t	first = size - tail;
+
+	if (len <= first) {
+		memcpy(t->ring + tail, in, len);
+		return;
+	}
+
+	memcpy(t->ring + tail, in, first);
+	memcpy(t->ring, (uint8_t const *)in + first, len - first);
+}
+
 /** There's space available to write data, so do that...
  *
  */
 static void _logtee_conn_writable(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, void *uctx)
 {
 	rlm_logtee_thread_t	*t = talloc_get_type_abort(uctx, rlm_logtee_thread_t);
-	char			*msg;
 
-	/*
-	 *	Fixme in general...
-	 */
-	while ((msg = fr_fring_next(t->fring))) {
-		ssize_t slen;
+	while (t->ring_used) {
+		struct iovec	iov[2];
+		size_t		len;
+		ssize_t		slen;
 
-		slen = write(sock, msg, talloc_array_length(msg) - 1) ;
-	write_error:
+		/*
+		 *	Stream destinations get everything which
+		 *	is pending, UDP gets one message per datagram.
+		 */
+		len = (t->inst->log_dst == LOGTEE_DST_UDP) ? t->msg_len[t->msg_head] : t->ring_used;
+
+		slen = writev(sock, iov, logtee_ring_iov(t, iov, len));
 		if (slen < 0) {
 			switch (errno) {
 			case EAGAIN:
@@ -283,6 +365,15 @@ static void _logtee_conn_writable(UNUSED fr_event_list_t *el, int sock, UNUSED i
 			case ENOBUFS:
 				return;
 
+			/*
+			 *	Datagram too large, skip it.
+			 */
+			case EMSGSIZE:
+				logtee_ring_consume(t, len);
+				t->dropped++;
+				t->dropped_total++;
+				continue;
+
 			case ECONNRESET:
 			case EDESTADDRREQ:
 			case EIO:
@@ -298,14 +389,20 @@ static void _logtee_conn_writable(UNUSED fr_event_list_t *el, int sock, UNUSED i
 			 */
 			default:
 				fr_assert(0);
+				return;
 			}
 		}
 
-		slen = write(sock, t->inst->delimiter, t->inst->delimiter_len);
-		if (slen < 0) goto write_error;
+		logtee_ring_consume(t, (size_t)slen);
 	}
 
+	t->pending = false;
 	logtee_fd_idle(t);
+
+	if (t->dropped) {
+		WARN("Buffer full, dropped %" PRIu64 " messages (%" PRIu64 " total)", t->dropped, t->dropped_total);
+		t->dropped = 0;
+	}
 }
 
 /** Set the socket to idle
@@ -369,6 +466,12 @@ static fr_connection_state_t _logtee_conn_open(UNUSED fr_event_list_t *el, UNUSE
 
 	DEBUG2("Socket connected");
 
+	/*
+	 *	The rest of a partially written message
+	 *	would be garbage to the new connection.
+	 */
+	if (t->msg_written) logtee_ring_consume(t, t->msg_len[t->msg_head] - t->msg_written);
+
 	/*
 	 *	If we have data pending, add the writable event immediately
 	 */
@@ -457,11 +560,26 @@ static void logtee_it(fr_log_type_t type, fr_log_lvl_t lvl, REQUEST *request,
 {
 	rlm_logtee_thread_t	*t = talloc_get_type_abort(uctx, rlm_logtee_thread_t);
 	rlm_logtee_t const	*inst = t->inst;
-	char			*msg, *exp;
+	char			*msg, *exp = NULL;
+	char const		*out;
+	char			*buff;
+	size_t			space, tail, contig;
+	ssize_t			slen;
 	fr_cursor_t		cursor;
 	VALUE_PAIR		*vp;
 	log_dst_t		*dst;
 
+	/*
+	 *	Drop rather than growing the buffer.  The
+	 *	count is reported once the buffer drains.
+	 */
+	space = inst->buffer_size - t->ring_used;
+	if ((t->msg_count == inst->buffer_depth) || (space <= inst->delimiter_len)) {
+		t->dropped++;
+		t->dropped_total++;
+		return;
+	}
+
 	fr_assert(t->msg->vp_length == 0);	/* Should have been cleared before returning */
 
 	/*
@@ -481,21 +599,56 @@ static void logtee_it(fr_log_type_t type, fr_log_lvl_t lvl, REQUEST *request,
 
 	/*
 	 *	Now expand our fmt string to encapsulate the
-	 *	message and any metadata
+	 *	message and any metadata.
 	 *
-	 *	Fixme: Would be better to call tmpl_expand
-	 *	into a variable length ring buffer.
+	 *	The message is expanded straight into the free
+	 *	space at the tail of the ring.  Expansions which
+	 *	fill the buffer they're given are silently
+	 *	truncated, so if that happens and the free space
+	 *	wraps, the message is expanded again into a
+	 *	temporary buffer, and copied in.
 	 */
+	tail = (t->ring_head + t->ring_used) % inst->buffer_size;
+	contig = inst->buffer_size - tail;
+	if (contig > space) contig = space;
+	buff = (char *)(t->ring + tail);
+
 	dst = request->log.dst;
 	request->log.dst = NULL;
-	if (tmpl_aexpand(t, &exp, request, inst->log_fmt, NULL, NULL) < 0) goto finish;
+	slen = tmpl_expand(&out, buff, contig, request, inst->log_fmt, NULL, NULL);
+	if ((slen >= 0) && (out == buff) && is_truncated((size_t)slen + 1, contig)) {
+		if (contig < space) {
+			slen = tmpl_aexpand(t, &exp, request, inst->log_fmt, NULL, NULL);
+			out = exp;
+		} else {
+			slen = (ssize_t)space;	/* Doesn't fit */
+		}
+	}
 	request->log.dst = dst;
+	if (slen < 0) goto finish;
+
+	if (((size_t)slen + inst->delimiter_len) > space) {
+		t->dropped++;
+		t->dropped_total++;
+		talloc_free(exp);
+		goto finish;
+	}
+	if (out != buff) logtee_ring_append(t, 0, out, (size_t)slen);
+	logtee_ring_append(t, (size_t)slen, inst->delimiter, inst->delimiter_len);
+	talloc_free(exp);
 
-	fr_fring_overwrite(t->fring, exp);	/* Insert it into the buffer */
+	t->ring_used += (size_t)slen + inst->delimiter_len;
+	t->msg_len[(t->msg_head + t->msg_count) % inst->buffer_depth] = (uint32_t)slen + inst->delimiter_len;
+	t->msg_count++;
 
 	if (!t->pending) {
 		t->pending = true;
-		logtee_fd_active(t);		/* Listen for when the fd is writable */
+
+		/*
+		 *	Listen for when the fd is writable.  If we're not
+		 *	connected, this happens when the connection opens.
+		 */
+		if (t->conn->state == FR_CONNECTION_STATE_CONNECTED) logtee_fd_active(t);
 	}
 
 finish:
@@ -558,7 +711,8 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instanc
 	rlm_logtee_t		*inst = talloc_get_type_abort(instance, rlm_logtee_t);
 	rlm_logtee_thread_t	*t = talloc_get_type_abort(thread, rlm_logtee_thread_t);
 
-	MEM(t->fring = fr_fring_alloc(t, inst->buffer_depth, false));
+	MEM(t->ring = talloc_array(t, uint8_t, inst->buffer_size));
+	MEM(t->msg_len = talloc_array(t, uint32_t, inst->buffer_depth));
 
 	t->inst = inst;
 	t->el = el;
@@ -623,6 +777,9 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	FR_SIZE_BOUND_CHECK("buffer_depth", inst->buffer_depth, >=, (size_t)1);
 	FR_SIZE_BOUND_CHECK("buffer_depth", inst->buffer_depth, <=, (size_t)1000000);	/* 1 Million messages */
 
+	FR_SIZE_BOUND_CHECK("buffer_size", inst->buffer_size, >=, (size_t)4096);
+	FR_SIZE_BOUND_CHECK("buffer_size", inst->buffer_size, <=, (size_t)(256 * 1024 * 1024));
+
 	/*
 	 *	Setup the logging destination
 	 */
@@ -869,6 +869,77 @@ static void fr_lua_rcode_register(lua_State *L, char const *name)
 	}
 }
 
+typedef struct {
+	uint8_t		*buff;			//!< Bytecode written so far.
+	size_t		len;			//!< How much of buff is used.
+} fr_lua_bytecode_t;
+
+/** Append a chunk of bytecode to our buffer
+ *
+ * Called by lua_dump.
+ */
+static int _lua_bytecode_write(UNUSED lua_State *L, void const *p, size_t len, void *uctx)
+{
+	fr_lua_bytecode_t	*bc = uctx;
+	size_t			size = talloc_array_length(bc->buff);
+
+	if ((bc->len + len) > size) {
+		while ((bc->len + len) > size) size *= 2;
+		MEM(bc->buff = talloc_realloc(NULL, bc->buff, uint8_t, size));
+	}
+	memcpy(bc->buff + bc->len, p, len);
+	bc->len += len;
+
+	return 0;
+}
+
+/** Compile the script to bytecode
+ *
+ * The bytecode is loaded by every interpreter we create, so each
+ * thread doesn't need to read and parse the script again.
+ *
+ * @param[in] ctx	to allocate the bytecode in.
+ * @param[out] out	Where to write a pointer to the bytecode.
+ * @param[out] out_len	Where to write the length of the bytecode.
+ * @param[in] inst	Current instance of fr_lua.
+ * @return 0 on success else -1.
+ */
+int fr_lua_compile(TALLOC_CTX *ctx, uint8_t **out, size_t *out_len, rlm_lua_t const *inst)
+{
+	lua_State		*L;
+	fr_lua_bytecode_t	bc;
+
+	L = luaL_newstate();
+	if (!L) {
+		ERROR("Failed initialising Lua state");
+		return -1;
+	}
+
+	if (luaL_loadfile(L, inst->module) != 0) {
+		ERROR("Failed loading file: %s", lua_gettop(L) ? lua_tostring(L, -1) : "Unknown error");
+		lua_close(L);
+		return -1;
+	}
+
+	MEM(bc.buff = talloc_array(ctx, uint8_t, 4096));
+	bc.len = 0;
+
+	if (lua_dump(L, _lua_bytecode_write, &bc) != 0) {
+		ERROR("Failed compiling file: %s", inst->module);
+		talloc_free(bc.buff);
+		lua_close(L);
+		return -1;
+	}
+	lua_close(L);
+
+	DEBUG3("Compiled \"%s\" to %zu bytes of bytecode", inst->module, bc.len);
+
+	*out = bc.buff;
+	*out_len = bc.len;
+
+	return 0;
+}
+
 /** Initialise a new Lua/LuaJIT interpreter
  *
  * Creates a new lua_State and verifies all required functions have been loaded correctly.
@@ -883,6 +954,7 @@ int fr_lua_init(lua_State **out, rlm_lua_t const *instance)
 {
 	rlm_lua_t const		*inst = talloc_get_type_abort_const(instance, rlm_lua_t);
 	lua_State		*L;
+	int			ret;
 
 	fr_lua_util_set_inst(inst);
 
@@ -895,9 +967,15 @@ int fr_lua_init(lua_State **out, rlm_lua_t const *instance)
 	luaL_openlibs(L);
 
 	/*
-	 *	Load the Lua file into our environment.
+	 *	Load the Lua file into our environment, using
+	 *	the precompiled bytecode if we have it.
 	 */
-	if (luaL_loadfile(L, inst->module) != 0) {
+	if (inst->bytecode) {
+		ret = luaL_loadbuffer(L, (char const *)inst->bytecode, inst->bytecode_len, inst->module);
+	} else {
+		ret = luaL_loadfile(L, inst->module);
+	}
+	if (ret != 0) {
 		ERROR("Failed loading file: %s", lua_gettop(L) ? lua_tostring(L, -1) : "Unknown error");
 
 	error:
@@ -924,6 +1002,7 @@ int fr_lua_init(lua_State **out, rlm_lua_t const *instance)
 	if (inst->jit) {
 		DEBUG4("Initialised new LuaJIT interpreter %p", L);
 		if (fr_lua_util_jit_log_register(inst, L) < 0) goto error;
+		if (fr_lua_util_jit_pair_register(inst, L) < 0) goto error;
 	} else {
 		DEBUG4("Initialised new Lua interpreter %p", L);
 		if (fr_lua_util_log_register(inst, L) < 0) goto error;
@@ -60,6 +60,10 @@ typedef struct {
 #endif
 	const char	*func_post_auth;	//!< Name of function to run after authentication.
 	const char	*func_xlat;		//!< Name of function to be called for string expansions.
+
+	uint8_t		*bytecode;		//!< Precompiled script, loaded into each interpreter
+						///< instead of re-parsing the file.
+	size_t		bytecode_len;		//!< Length of the precompiled script.
 } rlm_lua_t;
 
 typedef struct {
@@ -67,6 +71,7 @@ typedef struct {
 } rlm_lua_thread_t;
 
 /* lua.c */
+int		fr_lua_compile(TALLOC_CTX *ctx, uint8_t **out, size_t *out_len, rlm_lua_t const *inst);
 int		fr_lua_init(lua_State **out, rlm_lua_t const *instance);
 int		fr_lua_run(module_ctx_t const *mctx, REQUEST *request, char const *funcname);
 bool		fr_lua_isjit(lua_State *L);
@@ -78,7 +83,22 @@ void		fr_lua_util_jit_log_info(char const *msg);
 void		fr_lua_util_jit_log_warn(char const *msg);
 void		fr_lua_util_jit_log_error(char const *msg);
 
+VALUE_PAIR	*fr_lua_util_jit_pair_find(char const *attr, unsigned int index);
+VALUE_PAIR	*fr_lua_util_jit_pair_next(VALUE_PAIR const *vp);
+VALUE_PAIR	*fr_lua_util_jit_pair_add(char const *attr);
+int		fr_lua_util_jit_pair_type(VALUE_PAIR const *vp);
+int		fr_lua_util_jit_pair_get_uint(VALUE_PAIR const *vp, uint64_t *out);
+int		fr_lua_util_jit_pair_get_int(VALUE_PAIR const *vp, int64_t *out);
+int		fr_lua_util_jit_pair_get_float(VALUE_PAIR const *vp, double *out);
+uint8_t const	*fr_lua_util_jit_pair_get_octets(VALUE_PAIR const *vp, size_t *len);
+uint8_t const	*fr_lua_util_jit_pair_get_ipaddr(VALUE_PAIR const *vp, size_t *len, uint8_t *prefix);
+int		fr_lua_util_jit_pair_set_uint(VALUE_PAIR *vp, uint64_t value);
+int		fr_lua_util_jit_pair_set_int(VALUE_PAIR *vp, int64_t value);
+int		fr_lua_util_jit_pair_set_float(VALUE_PAIR *vp, double value);
+int		fr_lua_util_jit_pair_set_octets(VALUE_PAIR *vp, uint8_t const *value, size_t len);
+
 int		fr_lua_util_jit_log_register(rlm_lua_t const *inst, lua_State *L);
+int		fr_lua_util_jit_pair_register(rlm_lua_t const *inst, lua_State *L);
 int		fr_lua_util_log_register(rlm_lua_t const *inst, lua_State *L);
 void		fr_lua_util_set_inst(rlm_lua_t const *inst);
 rlm_lua_t const	*fr_lua_util_get_inst(void);
@@ -141,6 +141,12 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->xlat_name = cf_section_name2(conf);
 	if (!inst->xlat_name) inst->xlat_name = cf_section_name1(conf);
 
+	/*
+	 *	Parse the script once, the interpreters
+	 *	load the bytecode.
+	 */
+	if (fr_lua_compile(inst, &inst->bytecode, &inst->bytecode_len, inst) < 0) return -1;
+
 	/*
 	 *	Get an instance global interpreter to use with various things...
 	 */
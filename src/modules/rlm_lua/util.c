@@ -200,6 +200,295 @@ void fr_lua_util_jit_log_error(char const *msg)
 	ROPTIONAL(RERROR, ERROR, "%s", msg);
 }
 
+/** Find an instance of an attribute in the request list
+ *
+ * @param attr	Name of the attribute.
+ * @param index	Instance of the attribute to return, starting at 0.
+ * @return
+ *	- The matching attribute.
+ *	- NULL if there's no request, the attribute is unknown, or
+ *	  no instance exists at index.
+ */
+VALUE_PAIR *fr_lua_util_jit_pair_find(char const *attr, unsigned int index)
+{
+	REQUEST			*request = fr_lua_request;
+	fr_dict_attr_t const	*da;
+	fr_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+
+	if (!request || !attr) return NULL;
+
+	da = fr_dict_attr_by_name(request->dict, attr);
+	if (!da) {
+		RWDEBUG("Unknown or invalid attribute name \"%s\"", attr);
+		return NULL;
+	}
+
+	for (vp = fr_cursor_iter_by_da_init(&cursor, &request->packet->vps, da);
+	     vp && (index > 0);
+	     vp = fr_cursor_next(&cursor), index--);
+
+	return vp;
+}
+
+/** Return the next instance of the same attribute
+ *
+ */
+VALUE_PAIR *fr_lua_util_jit_pair_next(VALUE_PAIR const *vp)
+{
+	VALUE_PAIR *next;
+
+	for (next = vp->next; next; next = next->next) if (next->da == vp->da) return next;
+
+	return NULL;
+}
+
+/** Add a new instance of an attribute to the request list
+ *
+ * The attribute has no value until one of the setters is called.
+ */
+VALUE_PAIR *fr_lua_util_jit_pair_add(char const *attr)
+{
+	REQUEST			*request = fr_lua_request;
+	fr_dict_attr_t const	*da;
+	VALUE_PAIR		*vp;
+
+	if (!request || !attr) return NULL;
+
+	da = fr_dict_attr_by_name(request->dict, attr);
+	if (!da) {
+		RWDEBUG("Unknown or invalid attribute name \"%s\"", attr);
+		return NULL;
+	}
+
+	MEM(vp = fr_pair_afrom_da(request->packet, da));
+	fr_pair_add(&request->packet->vps, vp);
+
+	return vp;
+}
+
+/** Return the type of an attribute's value
+ *
+ */
+int fr_lua_util_jit_pair_type(VALUE_PAIR const *vp)
+{
+	return vp->vp_type;
+}
+
+/** Get an unsigned integer value
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the attribute isn't an unsigned integer type.
+ */
+int fr_lua_util_jit_pair_get_uint(VALUE_PAIR const *vp, uint64_t *out)
+{
+	switch (vp->vp_type) {
+	case FR_TYPE_BOOL:
+		*out = vp->vp_bool;
+		return 0;
+
+	case FR_TYPE_UINT8:
+		*out = vp->vp_uint8;
+		return 0;
+
+	case FR_TYPE_UINT16:
+		*out = vp->vp_uint16;
+		return 0;
+
+	case FR_TYPE_UINT32:
+		*out = vp->vp_uint32;
+		return 0;
+
+	case FR_TYPE_UINT64:
+		*out = vp->vp_uint64;
+		return 0;
+
+	case FR_TYPE_SIZE:
+		*out = vp->vp_size;
+		return 0;
+
+	case FR_TYPE_DATE:
+		*out = fr_time_to_sec(vp->vp_date);
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+/** Get a signed integer value
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the attribute isn't a signed integer type.
+ */
+int fr_lua_util_jit_pair_get_int(VALUE_PAIR const *vp, int64_t *out)
+{
+	switch (vp->vp_type) {
+	case FR_TYPE_INT8:
+		*out = vp->vp_int8;
+		return 0;
+
+	case FR_TYPE_INT16:
+		*out = vp->vp_int16;
+		return 0;
+
+	case FR_TYPE_INT32:
+		*out = vp->vp_int32;
+		return 0;
+
+	case FR_TYPE_INT64:
+		*out = vp->vp_int64;
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+/** Get a floating point value
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the attribute isn't a floating point type.
+ */
+int fr_lua_util_jit_pair_get_float(VALUE_PAIR const *vp, double *out)
+{
+	switch (vp->vp_type) {
+	case FR_TYPE_FLOAT32:
+		*out = vp->vp_float32;
+		return 0;
+
+	case FR_TYPE_FLOAT64:
+		*out = vp->vp_float64;
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+/** Get a pointer to the raw bytes of the value
+ *
+ * No copy is made, the pointer is only valid until the
+ * attribute is modified or freed.
+ *
+ * @return
+ *	- The value's buffer, with its length written to len.
+ *	- NULL if the attribute isn't string, octets, ethernet or ifid.
+ */
+uint8_t const *fr_lua_util_jit_pair_get_octets(VALUE_PAIR const *vp, size_t *len)
+{
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		*len = vp->vp_length;
+		return (uint8_t const *)vp->vp_strvalue;
+
+	case FR_TYPE_OCTETS:
+		*len = vp->vp_length;
+		return vp->vp_octets;
+
+	case FR_TYPE_ETHERNET:
+		*len = sizeof(vp->vp_ether);
+		return vp->vp_ether;
+
+	case FR_TYPE_IFID:
+		*len = sizeof(vp->vp_ifid);
+		return vp->vp_ifid;
+
+	default:
+		return NULL;
+	}
+}
+
+/** Get a pointer to the address bytes of an IP address or prefix
+ *
+ * No copy is made, the address is in network order.
+ *
+ * @return
+ *	- The address, with its length (4 or 16) written to len,
+ *	  and its prefix length written to prefix.
+ *	- NULL if the attribute isn't an IP address or prefix.
+ */
+uint8_t const *fr_lua_util_jit_pair_get_ipaddr(VALUE_PAIR const *vp, size_t *len, uint8_t *prefix)
+{
+	switch (vp->vp_type) {
+	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IPV4_PREFIX:
+		*len = sizeof(vp->vp_ip.addr.v4);
+		*prefix = vp->vp_ip.prefix;
+		return (uint8_t const *)&vp->vp_ip.addr.v4;
+
+	case FR_TYPE_IPV6_ADDR:
+	case FR_TYPE_IPV6_PREFIX:
+		*len = sizeof(vp->vp_ip.addr.v6);
+		*prefix = vp->vp_ip.prefix;
+		return (uint8_t const *)&vp->vp_ip.addr.v6;
+
+	default:
+		return NULL;
+	}
+}
+
+/** Cast a value box to the type of an attribute, and replace its value
+ *
+ */
+static int fr_lua_util_jit_pair_set(VALUE_PAIR *vp, fr_value_box_t const *in)
+{
+	REQUEST		*request = fr_lua_request;
+	fr_value_box_t	vb;
+
+	if (!request) return -1;
+
+	if (fr_value_box_cast(vp, &vb, vp->da->type, vp->da, in) < 0) {
+		RPEDEBUG("Failed setting value of \"%s\"", vp->da->name);
+		return -1;
+	}
+
+	fr_value_box_clear_value(&vp->data);
+
+	return fr_value_box_steal(vp, &vp->data, &vb);
+}
+
+/** Set the value of an attribute from an unsigned integer
+ *
+ */
+int fr_lua_util_jit_pair_set_uint(VALUE_PAIR *vp, uint64_t value)
+{
+	return fr_lua_util_jit_pair_set(vp, fr_box_uint64(value));
+}
+
+/** Set the value of an attribute from a signed integer
+ *
+ */
+int fr_lua_util_jit_pair_set_int(VALUE_PAIR *vp, int64_t value)
+{
+	return fr_lua_util_jit_pair_set(vp, fr_box_int64(value));
+}
+
+/** Set the value of an attribute from a floating point number
+ *
+ */
+int fr_lua_util_jit_pair_set_float(VALUE_PAIR *vp, double value)
+{
+	return fr_lua_util_jit_pair_set(vp, fr_box_float64(value));
+}
+
+/** Set the value of an attribute from a buffer
+ *
+ * String and octets attributes copy the buffer, other types
+ * parse it as if it were the value in its network format.
+ */
+int fr_lua_util_jit_pair_set_octets(VALUE_PAIR *vp, uint8_t const *value, size_t len)
+{
+	fr_value_box_t vb;
+
+	fr_value_box_memdup_shallow(&vb, NULL, value, len, true);
+
+	return fr_lua_util_jit_pair_set(vp, &vb);
+}
+
 /** Insert cdefs into the lua environment
  *
  * For LuaJIT using the FFI is significantly faster than the Lua interface.
@@ -261,6 +550,121 @@ int fr_lua_util_jit_log_register(rlm_lua_t const *inst, lua_State *L)
 	return 0;
 }
 
+/** Insert cdefs and wrappers for direct attribute access into the lua environment
+ *
+ * Exposes VALUE_PAIRs to LuaJIT as opaque cdata with typed accessors.
+ * Integer values are returned as 64bit cdata, and octets, strings and
+ * IP addresses as pointers into the attribute's value, so nothing is
+ * converted to a string, or copied, unless the script asks for it.
+ *
+ * @param inst Current instance of the fr_lua module.
+ * @param L Lua interpreter.
+ * @return 0 (no arguments).
+ */
+int fr_lua_util_jit_pair_register(rlm_lua_t const *inst, lua_State *L)
+{
+	char const *search_path;
+	char *lua_str;
+	int ret;
+
+	search_path = dl_module_search_path();
+	lua_str = talloc_asprintf(NULL, "\
+		local ffi = require(\"ffi\")\
+		ffi.cdef [[\
+			typedef struct value_pair_s VALUE_PAIR;\
+			VALUE_PAIR *fr_lua_util_jit_pair_find(char const *attr, unsigned int index);\
+			VALUE_PAIR *fr_lua_util_jit_pair_next(VALUE_PAIR const *vp);\
+			VALUE_PAIR *fr_lua_util_jit_pair_add(char const *attr);\
+			int fr_lua_util_jit_pair_type(VALUE_PAIR const *vp);\
+			int fr_lua_util_jit_pair_get_uint(VALUE_PAIR const *vp, uint64_t *out);\
+			int fr_lua_util_jit_pair_get_int(VALUE_PAIR const *vp, int64_t *out);\
+			int fr_lua_util_jit_pair_get_float(VALUE_PAIR const *vp, double *out);\
+			uint8_t const *fr_lua_util_jit_pair_get_octets(VALUE_PAIR const *vp, size_t *len);\
+			uint8_t const *fr_lua_util_jit_pair_get_ipaddr(VALUE_PAIR const *vp, size_t *len, uint8_t *prefix);\
+			int fr_lua_util_jit_pair_set_uint(VALUE_PAIR *vp, uint64_t value);\
+			int fr_lua_util_jit_pair_set_int(VALUE_PAIR *vp, int64_t value);\
+			int fr_lua_util_jit_pair_set_float(VALUE_PAIR *vp, double value);\
+			int fr_lua_util_jit_pair_set_octets(VALUE_PAIR *vp, uint8_t const *value, size_t len);\
+		]]\
+		local lib = ffi.load(\"%s%clibfreeradius-lua%s\")\
+		local u64 = ffi.new(\"uint64_t[1]\")\
+		local i64 = ffi.new(\"int64_t[1]\")\
+		local dbl = ffi.new(\"double[1]\")\
+		local len = ffi.new(\"size_t[1]\")\
+		local prefix = ffi.new(\"uint8_t[1]\")\
+		local function vp_or_nil(vp)\
+			if vp == nil then return nil end\
+			return vp\
+		end\
+		local pair = {}\
+		function pair.type(vp)\
+			return lib.fr_lua_util_jit_pair_type(vp)\
+		end\
+		function pair.next(vp)\
+			return vp_or_nil(lib.fr_lua_util_jit_pair_next(vp))\
+		end\
+		function pair.uint(vp)\
+			if lib.fr_lua_util_jit_pair_get_uint(vp, u64) < 0 then return nil end\
+			return u64[0]\
+		end\
+		function pair.int(vp)\
+			if lib.fr_lua_util_jit_pair_get_int(vp, i64) < 0 then return nil end\
+			return i64[0]\
+		end\
+		function pair.float(vp)\
+			if lib.fr_lua_util_jit_pair_get_float(vp, dbl) < 0 then return nil end\
+			return dbl[0]\
+		end\
+		function pair.octets(vp)\
+			local p = lib.fr_lua_util_jit_pair_get_octets(vp, len)\
+			if p == nil then return nil end\
+			return p, tonumber(len[0])\
+		end\
+		function pair.ipaddr(vp)\
+			local p = lib.fr_lua_util_jit_pair_get_ipaddr(vp, len, prefix)\
+			if p == nil then return nil end\
+			return p, tonumber(len[0]), prefix[0]\
+		end\
+		function pair.string(vp)\
+			local p, l = pair.octets(vp)\
+			if p == nil then return nil end\
+			return ffi.string(p, l)\
+		end\
+		function pair.set_uint(vp, v)\
+			return lib.fr_lua_util_jit_pair_set_uint(vp, v) == 0\
+		end\
+		function pair.set_int(vp, v)\
+			return lib.fr_lua_util_jit_pair_set_int(vp, v) == 0\
+		end\
+		function pair.set_float(vp, v)\
+			return lib.fr_lua_util_jit_pair_set_float(vp, v) == 0\
+		end\
+		function pair.set_octets(vp, v, l)\
+			if type(v) == \"string\" then l = #v end\
+			return lib.fr_lua_util_jit_pair_set_octets(vp, ffi.cast(\"uint8_t const *\", v), l) == 0\
+		end\
+		ffi.metatype(\"struct value_pair_s\", { __index = pair })\
+		fr.pair = {\
+			find = function(attr, index)\
+				return vp_or_nil(lib.fr_lua_util_jit_pair_find(attr, index or 0))\
+			end,\
+			add = function(attr)\
+				return vp_or_nil(lib.fr_lua_util_jit_pair_add(attr))\
+			end\
+		}\
+		", search_path, FR_DIR_SEP, DL_EXTENSION);
+	ret = luaL_dostring(L, lua_str);
+	talloc_free(lua_str);
+	if (ret != 0) {
+		ERROR("Failed setting up FFI pair access: %s",
+		      lua_gettop(L) ? lua_tostring(L, -1) : "Unknown error");
+
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Register utililiary functions in the lua environment
  *
  * @param inst Current instance of the fr_lua module.
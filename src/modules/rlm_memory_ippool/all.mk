@@ -0,0 +1,2 @@
+TARGET		:= rlm_memory_ippool.a
+SOURCES		:= rlm_memory_ippool.c
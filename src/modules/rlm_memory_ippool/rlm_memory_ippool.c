@@ -0,0 +1,1401 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_memory_ippool.c
+ * @brief IPv4 lease allocation from pools held in memory.
+ *
+ * Each pool is a bitmap with one bit per address, split into shards
+ * which each have their own mutex, free count and search hint.
+ * Devices are mapped to a "home" shard by hashing their identifier,
+ * so allocations and renewals for a device normally only ever lock
+ * one shard.  Allocate, renew and release are all O(1).
+ *
+ * Every change to a lease is appended to a journal, which a
+ * background thread writes out, and periodically folds into a
+ * snapshot.  On startup the snapshot and journal are replayed, so
+ * leases survive restarts.
+ *
+ * Creates three files:
+ * - @verbatim <journal> @endverbatim changes since the last snapshot.
+ * - @verbatim <journal>.old @endverbatim changes which are being folded into a snapshot.
+ * - @verbatim <journal>.snapshot @endverbatim all leases bound when the last snapshot was taken.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_memory_ippool (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module.h>
+#include <freeradius-devel/util/debug.h>
+
+#ifdef WITH_DHCP
+#include <freeradius-devel/dhcpv4/dhcpv4.h>
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#define IPPOOL_MAX_DEVICE_LEN	255			//!< Device identifiers are truncated to this.
+
+#define JOURNAL_MAGIC		"FRMIP001"		//!< Start of every journal and snapshot file.
+#define JOURNAL_MAGIC_LEN	(sizeof(JOURNAL_MAGIC) - 1)
+#define JOURNAL_HDR_LEN		(1 + 1 + 4 + 8)		//!< op, device length, address, expiry.
+
+typedef enum {
+	POOL_ACTION_ALLOCATE = 1,
+	POOL_ACTION_UPDATE = 2,
+	POOL_ACTION_RELEASE = 3,
+	POOL_ACTION_BULK_RELEASE = 4,
+} ippool_action_t;
+
+typedef enum {
+	IPPOOL_RCODE_SUCCESS = 0,
+	IPPOOL_RCODE_NOT_FOUND = -1,
+	IPPOOL_RCODE_DEVICE_MISMATCH = -3,
+	IPPOOL_RCODE_POOL_EMPTY = -4,
+} ippool_rcode_t;
+
+typedef enum {
+	JOURNAL_OP_BIND = 1,				//!< Address bound to a device until an expiry time.
+	JOURNAL_OP_CLEAR = 2				//!< Address returned to the pool.
+} journal_op_t;
+
+/** The state of one address in a pool
+ *
+ */
+typedef struct {
+	uint8_t			*device;		//!< Device the address is bound to.  NULL if it's free.
+	uint8_t			device_len;		//!< Length of the device identifier.
+	uint32_t		index;			//!< Offset of the address from the start of the pool.
+	fr_unix_time_t		expires;		//!< When the binding expires.
+} memory_ippool_lease_t;
+
+/** A contiguous range of addresses in a pool, with its own lock
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;			//!< Protects everything below, and the leases.
+	uint64_t		*bitmap;		//!< One bit per address, set if the address is bound.
+	uint32_t		words;			//!< Number of words in the bitmap.
+	uint32_t		first;			//!< Index of the first address in the shard.
+	uint32_t		num;			//!< Number of addresses in the shard.
+	uint32_t		free;			//!< Number of clear bits in the bitmap.
+	uint32_t		hint;			//!< Word to start searching for free addresses.
+	fr_unix_time_t		next_sweep;		//!< Don't look for expired leases again until this time.
+	fr_hash_table_t		*devices;		//!< Bound leases, by device.
+} memory_ippool_shard_t;
+
+typedef struct {
+	char const		*name;			//!< Matched against the expansion of pool_name.
+	uint32_t		start;			//!< First address, in host byte order.
+	uint32_t		num;			//!< Number of addresses.
+	memory_ippool_lease_t	*leases;		//!< One per address.
+	memory_ippool_shard_t	**shards;
+	uint32_t		num_shards;
+	uint32_t		shard_size;		//!< Addresses per shard, always a multiple of 64.
+	atomic_uint_fast32_t	spilled;		//!< Leases bound outside their device's home shard.
+} memory_ippool_pool_t;
+
+typedef struct {
+	fr_ipaddr_t		start;			//!< First address in the pool.
+	fr_ipaddr_t		end;			//!< Last address in the pool.
+} memory_ippool_pool_conf_t;
+
+typedef struct memory_ippool_journal_s memory_ippool_journal_t;
+
+/** rlm_memory_ippool module instance
+ *
+ */
+typedef struct {
+	char const		*name;			//!< Instance name.
+
+	vp_tmpl_t		*pool_name;		//!< Name of the pool we're allocating IP addresses from.
+
+	fr_time_delta_t		offer_time;		//!< How long we should reserve a lease for during
+							//!< the pre-allocation stage (typically responding
+							//!< to DHCP discover).
+	fr_time_delta_t		lease_time;		//!< How long an IP address should be allocated for.
+
+	vp_tmpl_t		*device_id;		//!< Unique device identifier.
+
+	vp_tmpl_t		*requested_address;	//!< Attribute to read the IP for renewal from.
+	vp_tmpl_t		*allocated_address_attr;	//!< IP attribute and destination.
+	vp_tmpl_t		*expiry_attr;		//!< How long the lease lasts for.
+
+	bool			copy_on_update;		//!< Copy the requested address to the
+							//!< allocated_address_attr if updates are successful.
+
+	uint32_t		shards;			//!< Maximum number of shards per pool.
+
+	char const		*journal_file;		//!< Where changes are written, NULL for no persistence.
+	fr_time_delta_t		flush_interval;		//!< How often the journal is written out.
+	fr_time_delta_t		snapshot_interval;	//!< How often the journal is folded into a snapshot.
+
+	memory_ippool_pool_conf_t **pool_conf;		//!< From the "pool" subsections.
+
+	fr_hash_table_t		*pools;			//!< By name.
+	memory_ippool_pool_t	**pools_by_addr;	//!< Sorted by start address.
+	size_t			num_pools;
+
+	memory_ippool_journal_t	*journal;		//!< Writes changes to disk.
+} rlm_memory_ippool_t;
+
+/** Buffers journal records, and writes them out in the background
+ *
+ */
+struct memory_ippool_journal_s {
+	rlm_memory_ippool_t const *inst;		//!< Instance data.
+
+	pthread_t		thread;			//!< Writes the journal, and takes snapshots.
+	pthread_mutex_t		mutex;			//!< Protects buffer, used, and stop.
+	pthread_cond_t		cond;			//!< Signalled on exit.
+	bool			stop;			//!< Tell the journal thread to exit.
+	bool			running;		//!< Journal thread was started.
+
+	uint8_t			*buffer;		//!< Records which haven't been written yet.
+	size_t			used;			//!< How much of the buffer is in use.
+
+	int			fd;			//!< The current journal.
+	char const		*old_file;		//!< The journal being folded into a snapshot.
+	char const		*snapshot_file;		//!< The last snapshot.
+	char const		*tmp_file;		//!< The snapshot being written.
+	fr_time_t		last_snapshot;		//!< When the last snapshot was taken.
+};
+
+static const CONF_PARSER pool_config[] = {
+	{ FR_CONF_OFFSET("start", FR_TYPE_IPV4_ADDR | FR_TYPE_REQUIRED, memory_ippool_pool_conf_t, start) },
+	{ FR_CONF_OFFSET("end", FR_TYPE_IPV4_ADDR | FR_TYPE_REQUIRED, memory_ippool_pool_conf_t, end) },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER journal_config[] = {
+	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT, rlm_memory_ippool_t, journal_file) },
+	{ FR_CONF_OFFSET("flush_interval", FR_TYPE_TIME_DELTA, rlm_memory_ippool_t, flush_interval), .dflt = "1" },
+	{ FR_CONF_OFFSET("snapshot_interval", FR_TYPE_TIME_DELTA, rlm_memory_ippool_t, snapshot_interval), .dflt = "300" },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("pool_name", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_memory_ippool_t, pool_name) },
+
+	{ FR_CONF_OFFSET("device", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_memory_ippool_t, device_id) },
+
+	{ FR_CONF_OFFSET("offer_time", FR_TYPE_TIME_DELTA, rlm_memory_ippool_t, offer_time) },
+	{ FR_CONF_OFFSET("lease_time", FR_TYPE_TIME_DELTA, rlm_memory_ippool_t, lease_time), .dflt = "3600" },
+
+	{ FR_CONF_OFFSET("requested_address", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_memory_ippool_t, requested_address), .dflt = "%{%{DHCP-Requested-IP-Address}:-%{DHCP-Client-IP-Address}}", .quote = T_DOUBLE_QUOTED_STRING },
+
+	{ FR_CONF_OFFSET("allocated_address_attr", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE | FR_TYPE_REQUIRED, rlm_memory_ippool_t, allocated_address_attr), .dflt = "&reply:DHCP-Your-IP-Address", .quote = T_BARE_WORD },
+
+	{ FR_CONF_OFFSET("expiry_attr", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE, rlm_memory_ippool_t, expiry_attr) },
+
+	{ FR_CONF_OFFSET("copy_on_update", FR_TYPE_BOOL, rlm_memory_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
+
+	{ FR_CONF_OFFSET("shards", FR_TYPE_UINT32, rlm_memory_ippool_t, shards), .dflt = "16" },
+
+	{ FR_CONF_SUBSECTION_ALLOC("pool", FR_TYPE_SUBSECTION | FR_TYPE_MULTI | FR_TYPE_REQUIRED, rlm_memory_ippool_t, pool_conf, pool_config) },
+
+	{ FR_CONF_POINTER("journal", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) journal_config },
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_dict_t const *dict_freeradius;
+static fr_dict_t const *dict_radius;
+#ifdef WITH_DHCP
+static fr_dict_t const *dict_dhcpv4;
+#endif
+
+extern fr_dict_autoload_t rlm_memory_ippool_dict[];
+fr_dict_autoload_t rlm_memory_ippool_dict[] = {
+	{ .out = &dict_freeradius, .proto = "freeradius" },
+	{ .out = &dict_radius, .proto = "radius" },
+#ifdef WITH_DHCP
+	{ .out = &dict_dhcpv4, .proto = "dhcpv4" },
+#endif
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_pool_action;
+static fr_dict_attr_t const *attr_acct_status_type;
+#ifdef WITH_DHCP
+static fr_dict_attr_t const *attr_message_type;
+#endif
+
+extern fr_dict_attr_autoload_t rlm_memory_ippool_dict_attr[];
+fr_dict_attr_autoload_t rlm_memory_ippool_dict_attr[] = {
+	{ .out = &attr_pool_action, .name = "Pool-Action", .type = FR_TYPE_UINT32, .dict = &dict_freeradius },
+	{ .out = &attr_acct_status_type, .name = "Acct-Status-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+#ifdef WITH_DHCP
+	{ .out = &attr_message_type, .name = "DHCP-Message-Type", .type = FR_TYPE_UINT8, .dict = &dict_dhcpv4 },
+#endif
+	{ NULL }
+};
+
+static uint32_t pool_name_hash(void const *data)
+{
+	memory_ippool_pool_t const *pool = data;
+
+	return fr_hash_string(pool->name);
+}
+
+static int pool_name_cmp(void const *one, void const *two)
+{
+	memory_ippool_pool_t const *a = one, *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+static uint32_t lease_device_hash(void const *data)
+{
+	memory_ippool_lease_t const *lease = data;
+
+	return fr_hash(lease->device, lease->device_len);
+}
+
+static int lease_device_cmp(void const *one, void const *two)
+{
+	memory_ippool_lease_t const *a = one, *b = two;
+
+	if (a->device_len != b->device_len) return a->device_len - b->device_len;
+
+	return memcmp(a->device, b->device, a->device_len);
+}
+
+static int pool_addr_cmp(void const *one, void const *two)
+{
+	memory_ippool_pool_t const * const *a = one, * const *b = two;
+
+	return ((*a)->start > (*b)->start) - ((*a)->start < (*b)->start);
+}
+
+/** Which shard a device prefers to have its lease in
+ *
+ */
+static inline uint32_t device_home_shard(memory_ippool_pool_t const *pool, uint8_t const *device, size_t device_len)
+{
+	return fr_hash(device, device_len) % pool->num_shards;
+}
+
+static inline memory_ippool_shard_t *lease_shard(memory_ippool_pool_t const *pool, memory_ippool_lease_t const *lease)
+{
+	return pool->shards[lease->index / pool->shard_size];
+}
+
+/** Find the pool containing an address
+ *
+ */
+static memory_ippool_pool_t *pool_by_addr(rlm_memory_ippool_t const *inst, uint32_t addr)
+{
+	size_t low = 0, high = inst->num_pools;
+
+	while (low < high) {
+		size_t mid = low + ((high - low) / 2);
+		memory_ippool_pool_t *pool = inst->pools_by_addr[mid];
+
+		if (addr < pool->start) {
+			high = mid;
+		} else if ((addr - pool->start) >= pool->num) {
+			low = mid + 1;
+		} else {
+			return pool;
+		}
+	}
+
+	return NULL;
+}
+
+/** Add a record to the journal
+ *
+ * Must be called with the lease's shard locked, so that the records
+ * for an address are in the same order as the changes to it.
+ */
+static void journal_add(memory_ippool_journal_t *journal, journal_op_t op, memory_ippool_pool_t const *pool,
+			memory_ippool_lease_t const *lease)
+{
+	uint8_t		*p;
+	size_t		len = JOURNAL_HDR_LEN;
+	uint32_t	addr;
+	uint64_t	expires;
+
+	if (!journal) return;
+
+	if (op == JOURNAL_OP_BIND) len += lease->device_len;
+
+	pthread_mutex_lock(&journal->mutex);
+	if ((journal->used + len) > talloc_array_length(journal->buffer)) {
+		MEM(journal->buffer = talloc_realloc(NULL, journal->buffer, uint8_t,
+						     (talloc_array_length(journal->buffer) * 2) + len));
+	}
+	p = journal->buffer + journal->used;
+
+	*p++ = op;
+	*p++ = (op == JOURNAL_OP_BIND) ? lease->device_len : 0;
+
+	addr = htonl(pool->start + lease->index);
+	memcpy(p, &addr, sizeof(addr));
+	p += sizeof(addr);
+
+	expires = htonll(fr_unix_time_to_sec(lease->expires));
+	memcpy(p, &expires, sizeof(expires));
+	p += sizeof(expires);
+
+	if (op == JOURNAL_OP_BIND) memcpy(p, lease->device, lease->device_len);
+
+	journal->used += len;
+	pthread_mutex_unlock(&journal->mutex);
+}
+
+/** Return an address to its shard
+ *
+ * Must be called with the shard locked.
+ */
+static void lease_clear(memory_ippool_pool_t *pool, memory_ippool_shard_t *shard, memory_ippool_lease_t *lease)
+{
+	uint32_t offset = lease->index - shard->first;
+
+	if (!lease->device) return;
+
+	if (pool->shards[device_home_shard(pool, lease->device, lease->device_len)] != shard) {
+		atomic_fetch_sub_explicit(&pool->spilled, 1, memory_order_relaxed);
+	}
+
+	fr_hash_table_delete(shard->devices, lease);
+	TALLOC_FREE(lease->device);
+	lease->device_len = 0;
+	lease->expires = 0;
+
+	shard->bitmap[offset / 64] &= ~((uint64_t)1 << (offset % 64));
+	shard->free++;
+	if ((offset / 64) < shard->hint) shard->hint = offset / 64;
+}
+
+/** Bind an address to a device
+ *
+ * Must be called with the shard locked.  A device can have only
+ * one lease per shard, so any other lease it has here is cleared.
+ */
+static void lease_bind(memory_ippool_pool_t *pool, memory_ippool_shard_t *shard, memory_ippool_lease_t *lease,
+		       uint8_t const *device, size_t device_len, fr_unix_time_t expires)
+{
+	memory_ippool_lease_t	*old, my_lease;
+	uint32_t		offset = lease->index - shard->first;
+
+	if (lease->device) {
+		if ((lease->device_len == device_len) && (memcmp(lease->device, device, device_len) == 0)) {
+			lease->expires = expires;
+			return;
+		}
+
+		lease_clear(pool, shard, lease);
+	}
+
+	memcpy(&my_lease.device, &device, sizeof(my_lease.device)); /* const issues */
+	my_lease.device_len = device_len;
+
+	old = fr_hash_table_finddata(shard->devices, &my_lease);
+	if (old) lease_clear(pool, shard, old);
+
+	MEM(lease->device = talloc_memdup(shard, device, device_len));
+	lease->device_len = device_len;
+	lease->expires = expires;
+
+	shard->bitmap[offset / 64] |= ((uint64_t)1 << (offset % 64));
+	shard->free--;
+
+	/*
+	 *	This can only fail if we're out of memory, in which
+	 *	case the device just won't get the same address back.
+	 */
+	(void) fr_hash_table_insert(shard->devices, lease);
+
+	if (pool->shards[device_home_shard(pool, device, device_len)] != shard) {
+		atomic_fetch_add_explicit(&pool->spilled, 1, memory_order_relaxed);
+	}
+}
+
+/** Return expired leases in a shard to the free pool
+ *
+ * This is O(N) in the size of the shard, so it's only done when the
+ * shard has no free addresses, and at most once a second.
+ */
+static void shard_sweep(memory_ippool_pool_t *pool, memory_ippool_shard_t *shard, fr_unix_time_t now)
+{
+	uint32_t i;
+
+	if (now < shard->next_sweep) return;
+	shard->next_sweep = now + NSEC;
+
+	for (i = 0; i < shard->num; i++) {
+		memory_ippool_lease_t *lease = &pool->leases[shard->first + i];
+
+		if (lease->device && (lease->expires <= now)) lease_clear(pool, shard, lease);
+	}
+}
+
+/** Find a free address in a shard
+ *
+ * Must be called with the shard locked.
+ */
+static memory_ippool_lease_t *shard_find_free(memory_ippool_pool_t *pool, memory_ippool_shard_t *shard,
+					      fr_unix_time_t now)
+{
+	uint32_t i;
+
+	if (!shard->free) shard_sweep(pool, shard, now);
+	if (!shard->free) return NULL;
+
+	/*
+	 *	Start from the first word which might have a free
+	 *	address.  Clearing a lease moves the hint back, so
+	 *	this is O(1) unless the pool is nearly full.
+	 */
+	for (i = shard->hint; i < shard->words; i++) {
+		uint64_t word = shard->bitmap[i];
+
+		if (word == UINT64_MAX) continue;
+
+		shard->hint = i;
+
+		/*
+		 *	~word & (word + 1) isolates the lowest clear bit.
+		 */
+		return &pool->leases[shard->first + (i * 64) + fr_high_bit_pos(~word & (word + 1)) - 1];
+	}
+
+	return NULL;
+}
+
+/** Find the lease a device already has, if any
+ *
+ * Checks the device's home shard, then the others, but only if any
+ * leases have spilled out of their home shard.  On success, the
+ * returned shard is locked.
+ */
+static memory_ippool_lease_t *pool_find_device(memory_ippool_shard_t **out, memory_ippool_pool_t *pool,
+					       uint8_t const *device, size_t device_len)
+{
+	memory_ippool_lease_t	my_lease, *lease;
+	uint32_t		home, i;
+
+	memcpy(&my_lease.device, &device, sizeof(my_lease.device)); /* const issues */
+	my_lease.device_len = device_len;
+
+	home = device_home_shard(pool, device, device_len);
+
+	for (i = 0; i < pool->num_shards; i++) {
+		memory_ippool_shard_t *shard = pool->shards[(home + i) % pool->num_shards];
+
+		if ((i > 0) && !atomic_load_explicit(&pool->spilled, memory_order_relaxed)) break;
+
+		pthread_mutex_lock(&shard->mutex);
+		lease = fr_hash_table_finddata(shard->devices, &my_lease);
+		if (lease) {
+			*out = shard;
+			return lease;
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	return NULL;
+}
+
+/** Allocate an address, preferring any address the device already has
+ *
+ */
+static ippool_rcode_t pool_allocate(rlm_memory_ippool_t const *inst, memory_ippool_pool_t *pool,
+				    uint32_t *out, uint8_t const *device, size_t device_len,
+				    fr_unix_time_t now, fr_unix_time_t expires)
+{
+	memory_ippool_shard_t	*shard;
+	memory_ippool_lease_t	*lease;
+	uint32_t		home, i;
+
+	lease = pool_find_device(&shard, pool, device, device_len);
+	if (lease) goto bind;
+
+	/*
+	 *	Allocate from the home shard if we can.  Otherwise
+	 *	the lease "spills" into another shard.
+	 */
+	home = device_home_shard(pool, device, device_len);
+	for (i = 0; i < pool->num_shards; i++) {
+		shard = pool->shards[(home + i) % pool->num_shards];
+
+		pthread_mutex_lock(&shard->mutex);
+		lease = shard_find_free(pool, shard, now);
+		if (lease) goto bind;
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	return IPPOOL_RCODE_POOL_EMPTY;
+
+bind:
+	lease_bind(pool, shard, lease, device, device_len, expires);
+	journal_add(inst->journal, JOURNAL_OP_BIND, pool, lease);
+	pthread_mutex_unlock(&shard->mutex);
+
+	*out = pool->start + lease->index;
+
+	return IPPOOL_RCODE_SUCCESS;
+}
+
+/** Extend the lease on an address, or bind it if it's free
+ *
+ */
+static ippool_rcode_t pool_update(rlm_memory_ippool_t const *inst, memory_ippool_pool_t *pool,
+				  uint32_t addr, uint8_t const *device, size_t device_len,
+				  fr_unix_time_t now, fr_unix_time_t expires)
+{
+	memory_ippool_shard_t	*shard;
+	memory_ippool_lease_t	*lease;
+
+	if ((addr < pool->start) || ((addr - pool->start) >= pool->num)) return IPPOOL_RCODE_NOT_FOUND;
+
+	lease = &pool->leases[addr - pool->start];
+	shard = lease_shard(pool, lease);
+
+	pthread_mutex_lock(&shard->mutex);
+	if (lease->device && (lease->expires > now) &&
+	    ((lease->device_len != device_len) || (memcmp(lease->device, device, device_len) != 0))) {
+		pthread_mutex_unlock(&shard->mutex);
+		return IPPOOL_RCODE_DEVICE_MISMATCH;
+	}
+
+	lease_bind(pool, shard, lease, device, device_len, expires);
+	journal_add(inst->journal, JOURNAL_OP_BIND, pool, lease);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return IPPOOL_RCODE_SUCCESS;
+}
+
+/** Return an address to the pool
+ *
+ */
+static ippool_rcode_t pool_release(rlm_memory_ippool_t const *inst, memory_ippool_pool_t *pool,
+				   uint32_t addr, uint8_t const *device, size_t device_len)
+{
+	memory_ippool_shard_t	*shard;
+	memory_ippool_lease_t	*lease;
+
+	if ((addr < pool->start) || ((addr - pool->start) >= pool->num)) return IPPOOL_RCODE_NOT_FOUND;
+
+	lease = &pool->leases[addr - pool->start];
+	shard = lease_shard(pool, lease);
+
+	pthread_mutex_lock(&shard->mutex);
+	if (!lease->device) {
+		pthread_mutex_unlock(&shard->mutex);
+		return IPPOOL_RCODE_SUCCESS;
+	}
+
+	if ((lease->device_len != device_len) || (memcmp(lease->device, device, device_len) != 0)) {
+		pthread_mutex_unlock(&shard->mutex);
+		return IPPOOL_RCODE_DEVICE_MISMATCH;
+	}
+
+	lease_clear(pool, shard, lease);
+	journal_add(inst->journal, JOURNAL_OP_CLEAR, pool, lease);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return IPPOOL_RCODE_SUCCESS;
+}
+
+/** Write a buffer to a file, retrying on short writes
+ *
+ */
+static int journal_write(int fd, uint8_t const *buffer, size_t len)
+{
+	while (len > 0) {
+		ssize_t slen;
+
+		slen = write(fd, buffer, len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		buffer += slen;
+		len -= slen;
+	}
+
+	return 0;
+}
+
+/** Open a journal or snapshot file for writing, and make sure it has a header
+ *
+ */
+static int journal_open(char const *filename, int flags)
+{
+	int		fd;
+	struct stat	st;
+
+	fd = open(filename, O_WRONLY | O_CREAT | flags, 0600);
+	if (fd < 0) return -1;
+
+	if ((fstat(fd, &st) < 0) ||
+	    ((st.st_size == 0) && (journal_write(fd, (uint8_t const *)JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) < 0))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/** Write out any journal records we have buffered
+ *
+ * Only called from the journal thread, or after it has exited.
+ */
+static void journal_flush(memory_ippool_journal_t *journal)
+{
+	rlm_memory_ippool_t const	*inst = journal->inst;
+	uint8_t				*buffer;
+	size_t				used;
+
+	/*
+	 *	Swap the buffer for an empty one, so that requests
+	 *	aren't blocked while we write.
+	 */
+	pthread_mutex_lock(&journal->mutex);
+	buffer = journal->buffer;
+	used = journal->used;
+	MEM(journal->buffer = talloc_array(NULL, uint8_t, talloc_array_length(buffer)));
+	journal->used = 0;
+	pthread_mutex_unlock(&journal->mutex);
+
+	if (used && ((journal_write(journal->fd, buffer, used) < 0) || (fsync(journal->fd) < 0))) {
+		ERROR("Failed writing journal %s: %s", inst->journal_file, fr_syserror(errno));
+	}
+
+	talloc_free(buffer);
+}
+
+/** Fold the journal into a new snapshot
+ *
+ * The journal is rotated first, so that every change made after the
+ * rotation is in the new journal.  Replaying the snapshot, the old
+ * journal, then the new journal always gives the current state, no
+ * matter where we crash.
+ */
+static void journal_snapshot(memory_ippool_journal_t *journal)
+{
+	rlm_memory_ippool_t const	*inst = journal->inst;
+	size_t				i;
+	uint32_t			j, k;
+	int				fd;
+	uint8_t				*buffer = NULL;
+
+	journal_flush(journal);
+
+	if (rename(inst->journal_file, journal->old_file) < 0) {
+		ERROR("Failed rotating journal %s: %s", inst->journal_file, fr_syserror(errno));
+		return;
+	}
+
+	fd = journal_open(inst->journal_file, O_APPEND);
+	if (fd < 0) {
+		ERROR("Failed opening journal %s: %s", inst->journal_file, fr_syserror(errno));
+		(void) rename(journal->old_file, inst->journal_file);
+		return;
+	}
+	close(journal->fd);
+	journal->fd = fd;
+
+	fd = journal_open(journal->tmp_file, O_TRUNC);
+	if (fd < 0) {
+		ERROR("Failed opening snapshot %s: %s", journal->tmp_file, fr_syserror(errno));
+		return;
+	}
+
+	for (i = 0; i < inst->num_pools; i++) {
+		memory_ippool_pool_t *pool = inst->pools_by_addr[i];
+
+		for (j = 0; j < pool->num_shards; j++) {
+			memory_ippool_shard_t	*shard = pool->shards[j];
+			uint8_t			*p;
+
+			/*
+			 *	Copy the leases out with the shard locked,
+			 *	and write them once it's unlocked.
+			 */
+			pthread_mutex_lock(&shard->mutex);
+			MEM(buffer = talloc_array(NULL, uint8_t,
+						  (shard->num - shard->free) * (JOURNAL_HDR_LEN + IPPOOL_MAX_DEVICE_LEN)));
+			p = buffer;
+
+			for (k = 0; k < shard->num; k++) {
+				memory_ippool_lease_t	*lease = &pool->leases[shard->first + k];
+				uint32_t		addr;
+				uint64_t		expires;
+
+				if (!lease->device) continue;
+
+				*p++ = JOURNAL_OP_BIND;
+				*p++ = lease->device_len;
+
+				addr = htonl(pool->start + lease->index);
+				memcpy(p, &addr, sizeof(addr));
+				p += sizeof(addr);
+
+				expires = htonll(fr_unix_time_to_sec(lease->expires));
+				memcpy(p, &expires, sizeof(expires));
+				p += sizeof(expires);
+
+				memcpy(p, lease->device, lease->device_len);
+				p += lease->device_len;
+			}
+			pthread_mutex_unlock(&shard->mutex);
+
+			if (journal_write(fd, buffer, p - buffer) < 0) {
+			error:
+				ERROR("Failed writing snapshot %s: %s", journal->tmp_file, fr_syserror(errno));
+				talloc_free(buffer);
+				close(fd);
+				return;
+			}
+			TALLOC_FREE(buffer);
+		}
+	}
+
+	if (fsync(fd) < 0) goto error;
+	close(fd);
+
+	if (rename(journal->tmp_file, journal->snapshot_file) < 0) {
+		ERROR("Failed replacing snapshot %s: %s", journal->snapshot_file, fr_syserror(errno));
+		return;
+	}
+
+	(void) unlink(journal->old_file);
+}
+
+/** Write the journal every flush_interval, and take snapshots every snapshot_interval
+ *
+ */
+static void *journal_thread(void *arg)
+{
+	memory_ippool_journal_t		*journal = arg;
+	rlm_memory_ippool_t const	*inst = journal->inst;
+
+	pthread_mutex_lock(&journal->mutex);
+	while (!journal->stop) {
+		struct timespec		when;
+
+		clock_gettime(CLOCK_REALTIME, &when);
+		when.tv_sec += inst->flush_interval / NSEC;
+		when.tv_nsec += inst->flush_interval % NSEC;
+		if (when.tv_nsec >= NSEC) {
+			when.tv_sec++;
+			when.tv_nsec -= NSEC;
+		}
+
+		(void) pthread_cond_timedwait(&journal->cond, &journal->mutex, &when);
+		if (journal->stop) break;
+		pthread_mutex_unlock(&journal->mutex);
+
+		if ((fr_time() - journal->last_snapshot) >= inst->snapshot_interval) {
+			journal_snapshot(journal);
+			journal->last_snapshot = fr_time();
+		} else {
+			journal_flush(journal);
+		}
+
+		pthread_mutex_lock(&journal->mutex);
+	}
+	pthread_mutex_unlock(&journal->mutex);
+
+	journal_flush(journal);
+
+	return NULL;
+}
+
+static int _journal_free(memory_ippool_journal_t *journal)
+{
+	if (journal->running) {
+		pthread_mutex_lock(&journal->mutex);
+		journal->stop = true;
+		pthread_cond_signal(&journal->cond);
+		pthread_mutex_unlock(&journal->mutex);
+
+		pthread_join(journal->thread, NULL);
+	}
+
+	if (journal->fd >= 0) close(journal->fd);
+	talloc_free(journal->buffer);
+
+	pthread_cond_destroy(&journal->cond);
+	pthread_mutex_destroy(&journal->mutex);
+
+	return 0;
+}
+
+/** Apply the records in a journal or snapshot file
+ *
+ * @return
+ *	- 0 on success, or if the file doesn't exist.
+ *	- -1 if the file isn't a journal.
+ */
+static int journal_replay(rlm_memory_ippool_t *inst, CONF_SECTION *conf, char const *filename, fr_unix_time_t now)
+{
+	FILE		*fp;
+	uint8_t		hdr[JOURNAL_HDR_LEN], device[IPPOOL_MAX_DEVICE_LEN];
+	char		magic[JOURNAL_MAGIC_LEN];
+	uint64_t	records = 0, unknown = 0;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		if (errno == ENOENT) return 0;
+
+		cf_log_err(conf, "Failed opening %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fread(magic, sizeof(magic), 1, fp) != 1) || (memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) != 0)) {
+		cf_log_err(conf, "%s is not a memory_ippool journal", filename);
+		fclose(fp);
+		return -1;
+	}
+
+	while (fread(hdr, sizeof(hdr), 1, fp) == 1) {
+		memory_ippool_pool_t	*pool;
+		memory_ippool_lease_t	*lease;
+		uint32_t		addr;
+		uint64_t		expires;
+
+		if ((hdr[1] > 0) && (fread(device, hdr[1], 1, fp) != 1)) break;
+
+		memcpy(&addr, hdr + 2, sizeof(addr));
+		addr = ntohl(addr);
+		memcpy(&expires, hdr + 6, sizeof(expires));
+		expires = ntohll(expires);
+
+		records++;
+
+		/*
+		 *	The pools may have changed since the
+		 *	journal was written.
+		 */
+		pool = pool_by_addr(inst, addr);
+		if (!pool) {
+			unknown++;
+			continue;
+		}
+		lease = &pool->leases[addr - pool->start];
+
+		switch (hdr[0]) {
+		case JOURNAL_OP_BIND:
+			if (fr_unix_time_from_sec(expires) > now) {
+				lease_bind(pool, lease_shard(pool, lease), lease, device, hdr[1],
+					   fr_unix_time_from_sec(expires));
+				break;
+			}
+			FALL_THROUGH;
+
+		case JOURNAL_OP_CLEAR:
+			lease_clear(pool, lease_shard(pool, lease), lease);
+			break;
+
+		default:
+			cf_log_err(conf, "Invalid record in %s at record %" PRIu64, filename, records);
+			fclose(fp);
+			return -1;
+		}
+	}
+
+	/*
+	 *	A partial record at the end means we stopped while
+	 *	writing it.  Everything before it is fine.
+	 */
+	if (!feof(fp)) cf_log_warn(conf, "Ignoring partial record at the end of %s", filename);
+	fclose(fp);
+
+	if (unknown) {
+		cf_log_warn(conf, "Ignored %" PRIu64 " records in %s for addresses which are no longer in any pool",
+			    unknown, filename);
+	}
+
+	DEBUG2("Replayed %" PRIu64 " records from %s", records, filename);
+
+	return 0;
+}
+
+static int _shard_free(memory_ippool_shard_t *shard)
+{
+	pthread_mutex_destroy(&shard->mutex);
+
+	return 0;
+}
+
+/** Create a pool from its configuration
+ *
+ */
+static memory_ippool_pool_t *pool_alloc(rlm_memory_ippool_t *inst, CONF_SECTION *cs,
+					memory_ippool_pool_conf_t const *pool_conf)
+{
+	memory_ippool_pool_t	*pool;
+	uint32_t		start, end, i;
+
+	start = ntohl(pool_conf->start.addr.v4.s_addr);
+	end = ntohl(pool_conf->end.addr.v4.s_addr);
+	if (end < start) {
+		cf_log_err(cs, "'end' must not be before 'start'");
+		return NULL;
+	}
+
+	/*
+	 *	Each lease is a few tens of bytes, so a /8 is as
+	 *	large as we're prepared to go.
+	 */
+	if ((end - start) >= (1 << 24)) {
+		cf_log_err(cs, "Pools must contain no more than %u addresses", 1 << 24);
+		return NULL;
+	}
+
+	MEM(pool = talloc_zero(inst, memory_ippool_pool_t));
+	pool->name = cf_section_name2(cs);
+	pool->start = start;
+	pool->num = (end - start) + 1;
+	atomic_init(&pool->spilled, 0);
+
+	pool->leases = talloc_zero_array(pool, memory_ippool_lease_t, pool->num);
+	if (!pool->leases) {
+		cf_log_err(cs, "Failed allocating %u leases", pool->num);
+		talloc_free(pool);
+		return NULL;
+	}
+	for (i = 0; i < pool->num; i++) pool->leases[i].index = i;
+
+	/*
+	 *	Each shard covers a whole number of bitmap words.
+	 */
+	pool->shard_size = ROUND_UP(ROUND_UP_DIV(pool->num, inst->shards), 64);
+	pool->num_shards = ROUND_UP_DIV(pool->num, pool->shard_size);
+
+	MEM(pool->shards = talloc_zero_array(pool, memory_ippool_shard_t *, pool->num_shards));
+	for (i = 0; i < pool->num_shards; i++) {
+		memory_ippool_shard_t *shard;
+
+		MEM(shard = talloc_zero(pool, memory_ippool_shard_t));
+		pthread_mutex_init(&shard->mutex, NULL);
+		talloc_set_destructor(shard, _shard_free);
+
+		shard->first = i * pool->shard_size;
+		shard->num = pool->shard_size;
+		if ((shard->first + shard->num) > pool->num) shard->num = pool->num - shard->first;
+		shard->free = shard->num;
+		shard->words = ROUND_UP_DIV(shard->num, 64);
+
+		MEM(shard->bitmap = talloc_zero_array(shard, uint64_t, shard->words));
+
+		/*
+		 *	Mark the addresses past the end of the pool
+		 *	as used, so we never allocate them.
+		 */
+		if (shard->num % 64) shard->bitmap[shard->words - 1] = ~(((uint64_t)1 << (shard->num % 64)) - 1);
+
+		MEM(shard->devices = fr_hash_table_create(shard, lease_device_hash, lease_device_cmp, NULL));
+		pool->shards[i] = shard;
+	}
+
+	return pool;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_memory_ippool_t		*inst = instance;
+	memory_ippool_journal_t		*journal;
+	CONF_SECTION			*cs;
+	size_t				i;
+	int				ret;
+	fr_unix_time_t			now;
+
+	fr_assert(tmpl_is_attr(inst->allocated_address_attr));
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	/*
+	 *	If we don't have a separate time specifically for offers
+	 *	just use the lease time.
+	 */
+	if (!inst->offer_time) inst->offer_time = inst->lease_time;
+
+	if (!inst->shards) inst->shards = 1;
+
+	inst->num_pools = talloc_array_length(inst->pool_conf);
+	MEM(inst->pools_by_addr = talloc_array(inst, memory_ippool_pool_t *, inst->num_pools));
+	MEM(inst->pools = fr_hash_table_create(inst, pool_name_hash, pool_name_cmp, NULL));
+
+	for (cs = cf_section_find(conf, "pool", NULL), i = 0;
+	     cs;
+	     cs = cf_section_find_next(conf, cs, "pool", NULL), i++) {
+		memory_ippool_pool_t *pool;
+
+		if (!cf_section_name2(cs)) {
+			cf_log_err(cs, "'pool' sections must have a name");
+			return -1;
+		}
+
+		pool = pool_alloc(inst, cs, inst->pool_conf[i]);
+		if (!pool) return -1;
+
+		if (!fr_hash_table_insert(inst->pools, pool)) {
+			cf_log_err(cs, "Duplicate pool '%s'", pool->name);
+			return -1;
+		}
+		inst->pools_by_addr[i] = pool;
+	}
+
+	/*
+	 *	Journal records only hold the address, so each
+	 *	address can only be in one pool.
+	 */
+	qsort(inst->pools_by_addr, inst->num_pools, sizeof(inst->pools_by_addr[0]), pool_addr_cmp);
+	for (i = 1; i < inst->num_pools; i++) {
+		memory_ippool_pool_t *prev = inst->pools_by_addr[i - 1];
+
+		if ((inst->pools_by_addr[i]->start - prev->start) < prev->num) {
+			cf_log_err(conf, "Pools '%s' and '%s' overlap", prev->name, inst->pools_by_addr[i]->name);
+			return -1;
+		}
+	}
+
+	if (!inst->journal_file) return 0;
+
+	if (inst->flush_interval < fr_time_delta_from_msec(10)) {
+		cf_log_err(conf, "'journal.flush_interval' must be at least 10ms");
+		return -1;
+	}
+
+	/*
+	 *	Restore the leases from the last run.
+	 */
+	MEM(journal = talloc_zero(inst, memory_ippool_journal_t));
+	journal->inst = inst;
+	journal->fd = -1;
+	pthread_mutex_init(&journal->mutex, NULL);
+	pthread_cond_init(&journal->cond, NULL);
+	talloc_set_destructor(journal, _journal_free);
+
+	MEM(journal->old_file = talloc_typed_asprintf(journal, "%s.old", inst->journal_file));
+	MEM(journal->snapshot_file = talloc_typed_asprintf(journal, "%s.snapshot", inst->journal_file));
+	MEM(journal->tmp_file = talloc_typed_asprintf(journal, "%s.snapshot.tmp", inst->journal_file));
+	MEM(journal->buffer = talloc_array(NULL, uint8_t, 65536));
+
+	now = fr_time_to_unix_time(fr_time());
+	if ((journal_replay(inst, conf, journal->snapshot_file, now) < 0) ||
+	    (journal_replay(inst, conf, journal->old_file, now) < 0) ||
+	    (journal_replay(inst, conf, inst->journal_file, now) < 0)) return -1;
+
+	journal->fd = journal_open(inst->journal_file, O_APPEND);
+	if (journal->fd < 0) {
+		cf_log_err(conf, "Failed opening journal %s: %s", inst->journal_file, fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	Take a snapshot as soon as the thread starts, so
+	 *	we don't replay the same records next time.
+	 */
+	journal->last_snapshot = fr_time() - inst->snapshot_interval;
+	inst->journal = journal;
+
+	ret = pthread_create(&journal->thread, NULL, journal_thread, journal);
+	if (ret != 0) {
+		cf_log_err(conf, "Failed creating journal thread: %s", fr_syserror(ret));
+		return -1;
+	}
+	journal->running = true;
+
+	return 0;
+}
+
+/** Convert the result of a pool operation into a module rcode
+ *
+ */
+static rlm_rcode_t ippool_action_rcode(rlm_memory_ippool_t const *inst, REQUEST *request,
+				       ippool_action_t action, uint32_t addr, ippool_rcode_t rcode)
+{
+	vp_tmpl_t	rhs;
+	vp_map_t	map = {
+				.lhs = inst->allocated_address_attr,
+				.op = T_OP_SET,
+				.rhs = &rhs
+			};
+	char		ip_str[INET_ADDRSTRLEN];
+	struct in_addr	in = { .s_addr = htonl(addr) };
+
+	inet_ntop(AF_INET, &in, ip_str, sizeof(ip_str));
+
+	switch (rcode) {
+	case IPPOOL_RCODE_SUCCESS:
+		break;
+
+	/*
+	 *	It's useful to be able to identify the 'not found' case
+	 *	as we can relay to a server where the IP address might
+	 *	be found.  This extremely useful for migrations.
+	 */
+	case IPPOOL_RCODE_NOT_FOUND:
+		REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
+		return RLM_MODULE_NOTFOUND;
+
+	case IPPOOL_RCODE_DEVICE_MISMATCH:
+		REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
+		return RLM_MODULE_INVALID;
+
+	case IPPOOL_RCODE_POOL_EMPTY:
+		RWDEBUG("Pool contains no free addresses");
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+		RDEBUG2("IP address \"%s\" allocated", ip_str);
+		break;
+
+	case POOL_ACTION_UPDATE:
+		RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
+		if (!inst->copy_on_update) return RLM_MODULE_UPDATED;
+		break;
+
+	default:
+		RDEBUG2("IP address \"%s\" released", ip_str);
+		return RLM_MODULE_UPDATED;
+	}
+
+	/*
+	 *	Add the address to the request
+	 */
+	tmpl_init(&rhs, TMPL_TYPE_DATA, "", 0, T_BARE_WORD);
+	fr_value_box_init(&rhs.data.literal, FR_TYPE_IPV4_ADDR, NULL, true);
+	rhs.data.literal.vb_ip.af = AF_INET;
+	rhs.data.literal.vb_ip.prefix = 32;
+	rhs.data.literal.vb_ip.addr.v4 = in;
+	if (map_to_request(request, &map, map_to_vp, NULL) < 0) return RLM_MODULE_FAIL;
+
+	if (inst->expiry_attr) {
+		map.lhs = inst->expiry_attr;
+
+		tmpl_init(&rhs, TMPL_TYPE_DATA, "", 0, T_BARE_WORD);
+		fr_value_box_shallow(&rhs.data.literal,
+				     (uint32_t)fr_time_delta_to_sec((action == POOL_ACTION_ALLOCATE) ?
+								    inst->offer_time : inst->lease_time), true);
+		if (map_to_request(request, &map, map_to_vp, NULL) < 0) return RLM_MODULE_FAIL;
+	}
+
+	return RLM_MODULE_UPDATED;
+}
+
+static rlm_rcode_t mod_action(rlm_memory_ippool_t const *inst, REQUEST *request, ippool_action_t action)
+{
+	char			pool_name_buff[256], device_buff[IPPOOL_MAX_DEVICE_LEN + 1];
+	char const		*pool_name, *device;
+	memory_ippool_pool_t	*pool, my_pool;
+	ssize_t			slen;
+	size_t			device_len;
+	fr_unix_time_t		now;
+	fr_ipaddr_t		ip;
+	uint32_t		addr = 0;
+	ippool_rcode_t		rcode;
+
+	slen = tmpl_expand(&pool_name, pool_name_buff, sizeof(pool_name_buff), request, inst->pool_name, NULL, NULL);
+	if (slen < 0) {
+		REDEBUG("Failed expanding pool_name (%s)", inst->pool_name->name);
+		return RLM_MODULE_FAIL;
+	}
+	if (slen == 0) {
+		RDEBUG2("Empty pool name, doing nothing");
+		return RLM_MODULE_NOOP;
+	}
+
+	memcpy(&my_pool.name, &pool_name, sizeof(my_pool.name));
+	pool = fr_hash_table_finddata(inst->pools, &my_pool);
+	if (!pool) {
+		RWDEBUG("No pool named \"%s\"", pool_name);
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	slen = tmpl_expand(&device, device_buff, sizeof(device_buff), request, inst->device_id, NULL, NULL);
+	if (slen < 0) {
+		REDEBUG("Failed expanding device (%s)", inst->device_id->name);
+		return RLM_MODULE_FAIL;
+	}
+	device_len = (size_t)slen;
+	if (device_len > IPPOOL_MAX_DEVICE_LEN) device_len = IPPOOL_MAX_DEVICE_LEN;
+
+	/*
+	 *	Lease expiry is wall clock time, so that the journal
+	 *	means the same thing after a restart.
+	 */
+	now = fr_time_to_unix_time(request->packet->timestamp);
+
+	if (action != POOL_ACTION_ALLOCATE) {
+		char		ip_buff[INET6_ADDRSTRLEN + 4];
+		char const	*ip_str;
+
+		if (action == POOL_ACTION_BULK_RELEASE) {
+			RDEBUG2("Bulk release not yet implemented");
+			return RLM_MODULE_NOOP;
+		}
+
+		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
+			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
+			return RLM_MODULE_FAIL;
+		}
+
+		if (fr_inet_pton(&ip, ip_str, -1, AF_INET, false, true) < 0) {
+			RPEDEBUG("Failed parsing address");
+			return RLM_MODULE_FAIL;
+		}
+		addr = ntohl(ip.addr.v4.s_addr);
+	}
+
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+		RDEBUG2("Allocating lease from pool \"%s\" for device \"%.*s\"",
+			pool->name, (int)device_len, (uint8_t const *)device);
+		rcode = pool_allocate(inst, pool, &addr, (uint8_t const *)device, device_len,
+				      now, now + inst->offer_time);
+		break;
+
+	case POOL_ACTION_UPDATE:
+		RDEBUG2("Updating lease on %pV in pool \"%s\" for device \"%.*s\"",
+			fr_box_ipaddr(ip), pool->name, (int)device_len, device);
+		rcode = pool_update(inst, pool, addr, (uint8_t const *)device, device_len,
+				    now, now + inst->lease_time);
+		break;
+
+	case POOL_ACTION_RELEASE:
+		RDEBUG2("Releasing %pV in pool \"%s\" for device \"%.*s\"",
+			fr_box_ipaddr(ip), pool->name, (int)device_len, device);
+		rcode = pool_release(inst, pool, addr, (uint8_t const *)device, device_len);
+		break;
+
+	default:
+		fr_assert(0);
+		return RLM_MODULE_FAIL;
+	}
+
+	return ippool_action_rcode(inst, request, action, addr, rcode);
+}
+
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQUEST *request)
+{
+	rlm_memory_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_memory_ippool_t);
+	VALUE_PAIR			*vp;
+
+	/*
+	 *	Pool-Action override
+	 */
+	vp = fr_pair_find_by_da(request->control, attr_pool_action, TAG_ANY);
+	if (vp) return mod_action(inst, request, vp->vp_uint32);
+
+	/*
+	 *	Otherwise, guess the action by Acct-Status-Type
+	 */
+	vp = fr_pair_find_by_da(request->packet->vps, attr_acct_status_type, TAG_ANY);
+	if (!vp) {
+		RDEBUG2("Couldn't find &request:Acct-Status-Type or &control:Pool-Action, doing nothing...");
+		return RLM_MODULE_NOOP;
+	}
+
+	switch (vp->vp_uint32) {
+	case FR_STATUS_START:
+	case FR_STATUS_ALIVE:
+		return mod_action(inst, request, POOL_ACTION_UPDATE);
+
+	case FR_STATUS_STOP:
+		return mod_action(inst, request, POOL_ACTION_RELEASE);
+
+	case FR_STATUS_ACCOUNTING_OFF:
+	case FR_STATUS_ACCOUNTING_ON:
+		return mod_action(inst, request, POOL_ACTION_BULK_RELEASE);
+
+	default:
+		return RLM_MODULE_NOOP;
+	}
+}
+
+static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQUEST *request)
+{
+	rlm_memory_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_memory_ippool_t);
+	VALUE_PAIR			*vp;
+
+	/*
+	 *	Unless it's overridden the default action is to allocate
+	 *	when called in Post-Auth.
+	 */
+	vp = fr_pair_find_by_da(request->control, attr_pool_action, TAG_ANY);
+	return mod_action(inst, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
+}
+
+static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(module_ctx_t const *mctx, REQUEST *request)
+{
+	rlm_memory_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_memory_ippool_t);
+	VALUE_PAIR			*vp;
+	ippool_action_t			action = POOL_ACTION_ALLOCATE;
+
+	/*
+	 *	Unless it's overridden the default action is to allocate
+	 *	when called in Post-Auth.
+	 */
+	vp = fr_pair_find_by_da(request->control, attr_pool_action, TAG_ANY);
+	if (vp) {
+		if ((vp->vp_uint32 > 0) && (vp->vp_uint32 <= POOL_ACTION_BULK_RELEASE)) {
+			action = vp->vp_uint32;
+
+		} else {
+			RWDEBUG("Ignoring invalid action %d", vp->vp_uint32);
+			return RLM_MODULE_NOOP;
+		}
+#ifdef WITH_DHCP
+	} else if (request->dict == dict_dhcpv4) {
+		vp = fr_pair_find_by_da(request->packet->vps, attr_message_type, TAG_ANY);
+		if (vp) {
+			if (vp->vp_uint8 == FR_DHCP_REQUEST) action = POOL_ACTION_UPDATE;
+			if (vp->vp_uint8 == FR_DHCP_RELEASE) action = POOL_ACTION_RELEASE;
+		}
+#endif
+	}
+
+	return mod_action(inst, request, action);
+}
+
+extern module_t rlm_memory_ippool;
+module_t rlm_memory_ippool = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "memory_ippool",
+	.type		= RLM_TYPE_THREAD_SAFE,
+	.inst_size	= sizeof(rlm_memory_ippool_t),
+	.config		= module_config,
+	.instantiate	= mod_instantiate,
+	.methods = {
+		[MOD_ACCOUNTING]	= mod_accounting,
+		[MOD_AUTHORIZE]		= mod_authorize,
+		[MOD_POST_AUTH]		= mod_post_auth,
+	},
+};
@@ -32,12 +32,16 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/password.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
 
 #include <freeradius-devel/util/md4.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/rbtree.h>
 #include <freeradius-devel/util/sha1.h>
 
+#include <pthread.h>
 #include <sys/wait.h>
 #include <ctype.h>
 
@@ -89,6 +93,12 @@ static const CONF_PARSER winbind_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_TIME_DELTA, rlm_mschap_t, cache_lifetime), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_mschap_t, cache_max_entries), .dflt = "16384" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_mschap_t, normify), .dflt = "yes" },
 
@@ -113,6 +123,8 @@ static const CONF_PARSER module_config[] = {
 
 	{ FR_CONF_POINTER("winbind", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) winbind_config },
 
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) cache_config },
+
 	/*
 	 *	These are now in a subsection above.
 	 */
@@ -1066,6 +1078,197 @@ ntlm_auth_err:
  *	authentication is in one place, and we can perhaps later replace
  *	it with code to call winbindd, or something similar.
  */
+/** A successful authentication against winbind or ntlm_auth
+ *
+ * Entries are indexed by a keyed hash of everything sent to the domain
+ * controller, and the NT-Hash-Hash is encrypted with a second keyed hash
+ * of the same data.  Neither the challenge/response nor the NT-Hash-Hash
+ * can be recovered from the cache without the original request.
+ */
+typedef struct {
+	uint8_t			index[SHA1_DIGEST_LENGTH];	//!< HMAC-SHA1(secret, 'i' || request data).
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];	//!< Encrypted NT-Hash-Hash.
+	fr_time_t		expires;			//!< When the entry should no longer be used.
+	fr_dlist_t		entry;				//!< Entry in the LRU list.
+} mschap_cache_entry_t;
+
+struct rlm_mschap_cache_s {
+	pthread_mutex_t		mutex;				//!< Protects the tree and list.
+	rbtree_t		*tree;				//!< Entries indexed by index.
+	fr_dlist_head_t		lru;				//!< Entries, most recently inserted first.
+	uint8_t			secret[32];			//!< Random key for the index and encryption.
+};
+
+static int mschap_cache_entry_cmp(void const *one, void const *two)
+{
+	mschap_cache_entry_t const *a = one, *b = two;
+
+	return memcmp(a->index, b->index, sizeof(a->index));
+}
+
+static int _mschap_cache_free(rlm_mschap_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Derive the index and encryption key for an authentication attempt
+ *
+ * The data hashed is whatever is sent to the domain controller, i.e. the
+ * expanded ntlm_auth command line, or the winbind username and domain
+ * along with the challenge and response.
+ *
+ * @param[out] index	Of the cache entry.
+ * @param[out] key	To encrypt/decrypt the NT-Hash-Hash with.
+ * @param[in] inst	Module instance.
+ * @param[in] request	The current request.
+ * @param[in] challenge	Sent to the DC.
+ * @param[in] response	Sent to the DC.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the identity couldn't be expanded.
+ */
+static int mschap_cache_key(uint8_t index[static SHA1_DIGEST_LENGTH], uint8_t key[static SHA1_DIGEST_LENGTH],
+			    rlm_mschap_t const *inst, REQUEST *request,
+			    uint8_t const *challenge, uint8_t const *response)
+{
+	char		*username = NULL, *domain = NULL;
+	uint8_t		*data;
+	size_t		len = 0, ulen, dlen;
+	ssize_t		slen;
+
+	if (inst->method == AUTH_NTLMAUTH_EXEC) {
+		slen = xlat_aeval(request, &username, request, inst->ntlm_auth, NULL, NULL);
+	} else {
+		slen = tmpl_aexpand(request, &username, request, inst->wb_username, NULL, NULL);
+		if ((slen >= 0) && inst->wb_domain) {
+			slen = tmpl_aexpand(request, &domain, request, inst->wb_domain, NULL, NULL);
+		}
+	}
+	if (slen < 0) {
+		talloc_free(username);
+		talloc_free(domain);
+		return -1;
+	}
+
+	/*
+	 *	'i' or 'k' || username || '\0' || domain || '\0' || challenge || response
+	 */
+	ulen = talloc_array_length(username);
+	dlen = domain ? talloc_array_length(domain) : 1;
+	MEM(data = talloc_array(request, uint8_t, 1 + ulen + dlen + 8 + 24));
+
+	data[len++] = 'i';
+	memcpy(data + len, username, ulen);
+	len += ulen;
+	if (domain) {
+		memcpy(data + len, domain, dlen);
+	} else {
+		data[len] = '\0';
+	}
+	len += dlen;
+	memcpy(data + len, challenge, 8);
+	len += 8;
+	memcpy(data + len, response, 24);
+	len += 24;
+
+	fr_hmac_sha1(index, data, len, inst->cache->secret, sizeof(inst->cache->secret));
+	data[0] = 'k';
+	fr_hmac_sha1(key, data, len, inst->cache->secret, sizeof(inst->cache->secret));
+
+	talloc_free(data);
+	talloc_free(username);
+	talloc_free(domain);
+
+	return 0;
+}
+
+/** Find a cached NT-Hash-Hash
+ *
+ * @param[out] nthashhash	Where to write the decrypted NT-Hash-Hash.
+ * @param[in] cache		to search.
+ * @param[in] index		from mschap_cache_key().
+ * @param[in] key		from mschap_cache_key().
+ * @return
+ *	- true if a valid entry was found.
+ *	- false if no entry was found.
+ */
+static bool mschap_cache_find(uint8_t nthashhash[static NT_DIGEST_LENGTH], rlm_mschap_cache_t *cache,
+			      uint8_t const index[static SHA1_DIGEST_LENGTH],
+			      uint8_t const key[static SHA1_DIGEST_LENGTH])
+{
+	mschap_cache_entry_t	find, *entry;
+	bool			found = false;
+	size_t			i;
+
+	memcpy(find.index, index, sizeof(find.index));
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = rbtree_finddata(cache->tree, &find);
+	if (entry) {
+		if (entry->expires > fr_time()) {
+			for (i = 0; i < NT_DIGEST_LENGTH; i++) nthashhash[i] = entry->nthashhash[i] ^ key[i];
+			found = true;
+		} else {
+			rbtree_deletebydata(cache->tree, entry);
+			fr_dlist_remove(&cache->lru, entry);
+			talloc_free(entry);
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return found;
+}
+
+/** Record a successful authentication
+ *
+ * @param[in] inst		Module instance.
+ * @param[in] index		from mschap_cache_key().
+ * @param[in] key		from mschap_cache_key().
+ * @param[in] nthashhash	returned by the DC.
+ */
+static void mschap_cache_insert(rlm_mschap_t const *inst,
+				uint8_t const index[static SHA1_DIGEST_LENGTH],
+				uint8_t const key[static SHA1_DIGEST_LENGTH],
+				uint8_t const nthashhash[static NT_DIGEST_LENGTH])
+{
+	rlm_mschap_cache_t	*cache = inst->cache;
+	mschap_cache_entry_t	*entry, *old;
+	size_t			i;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = talloc_zero(cache, mschap_cache_entry_t);
+	if (!entry) goto done;
+
+	memcpy(entry->index, index, sizeof(entry->index));
+	for (i = 0; i < NT_DIGEST_LENGTH; i++) entry->nthashhash[i] = nthashhash[i] ^ key[i];
+	entry->expires = fr_time() + inst->cache_lifetime;
+
+	old = rbtree_finddata(cache->tree, entry);
+	if (old) {
+		rbtree_deletebydata(cache->tree, old);
+		fr_dlist_remove(&cache->lru, old);
+		talloc_free(old);
+	}
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		talloc_free(entry);
+		goto done;
+	}
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	while (fr_dlist_num_elements(&cache->lru) > inst->cache_max_entries) {
+		old = fr_dlist_tail(&cache->lru);
+		rbtree_deletebydata(cache->tree, old);
+		fr_dlist_remove(&cache->lru, old);
+		talloc_free(old);
+	}
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+}
+
 static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst, REQUEST *request,
 						      VALUE_PAIR *password,
 						      uint8_t const *challenge, uint8_t const *response,
@@ -1073,9 +1276,26 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 						      MSCHAP_AUTH_METHOD method)
 {
 	uint8_t	calculated[24];
+	uint8_t	cache_index[SHA1_DIGEST_LENGTH], cache_key[SHA1_DIGEST_LENGTH];
+	bool	cacheable = false;
 
 	memset(nthashhash, 0, NT_DIGEST_LENGTH);
 
+	/*
+	 *	Don't go back to the domain controller for
+	 *	a challenge and response it's already accepted.
+	 */
+	if (inst->cache && (method != AUTH_INTERNAL)) {
+		if (mschap_cache_key(cache_index, cache_key, inst, request, challenge, response) < 0) {
+			RWDEBUG("Failed creating cache key, not caching authentication result");
+		} else if (mschap_cache_find(nthashhash, inst->cache, cache_index, cache_key)) {
+			RDEBUG2("Found cached authentication result");
+			return 0;
+		} else {
+			cacheable = true;
+		}
+	}
+
 	switch (method) {
 	case AUTH_INTERNAL:
 	/*
@@ -1233,7 +1453,13 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 	/*
 	 *	Process auth via the wbclient library
 	 */
-		return do_auth_wbclient(inst, request, challenge, response, nthashhash);
+		{
+		int	result;
+
+		result = do_auth_wbclient(inst, request, challenge, response, nthashhash);
+		if (result != 0) return result;
+		}
+		break;
 #endif
 	default:
 		/* We should never reach this line */
@@ -1241,6 +1467,8 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 		return -1;
 	}
 
+	if (cacheable) mschap_cache_insert(inst, cache_index, cache_key, nthashhash);
+
 	return 0;
 }
 
@@ -2181,6 +2409,32 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	Only results from the domain controller are
+	 *	cached, local authentication is already fast.
+	 */
+	if (inst->cache_lifetime && inst->cache_max_entries && (inst->method != AUTH_INTERNAL)) {
+#ifdef WITH_AUTH_WINBIND
+		/*
+		 *	A retry rewrites MS-CHAP-User-Name, which is
+		 *	used to calculate MS-CHAP2-Success, so the
+		 *	NT-Hash-Hash alone isn't enough to replay
+		 *	the result.
+		 */
+		if ((inst->method == AUTH_WBCLIENT) && inst->wb_retry_with_normalised_username) {
+			cf_log_err(conf, "'cache' cannot be used with 'retry_with_normalised_username'");
+			return -1;
+		}
+#endif
+		MEM(inst->cache = talloc_zero(inst, rlm_mschap_cache_t));
+		MEM(inst->cache->tree = rbtree_talloc_alloc(inst->cache, mschap_cache_entry_cmp,
+							    mschap_cache_entry_t, NULL, 0));
+		fr_dlist_init(&inst->cache->lru, mschap_cache_entry_t, entry);
+		fr_rand_buffer(inst->cache->secret, sizeof(inst->cache->secret));
+		pthread_mutex_init(&inst->cache->mutex, NULL);
+		talloc_set_destructor(inst->cache, _mschap_cache_free);
+	}
+
 	return 0;
 }
 
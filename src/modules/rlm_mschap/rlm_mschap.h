@@ -49,6 +49,8 @@ extern fr_dict_attr_t const *attr_ms_mppe_send_key;
 extern fr_dict_attr_t const *attr_ms_mppe_encryption_types;
 extern fr_dict_attr_t const *attr_ms_chap2_cpw;
 
+typedef struct rlm_mschap_cache_s rlm_mschap_cache_t;
+
 typedef struct {
 	char const		*name;
 	fr_dict_enum_t		*auth_type;
@@ -76,6 +78,9 @@ typedef struct {
 	fr_pool_t		*wb_pool;
 	bool			wb_retry_with_normalised_username;
 #endif
+	fr_time_delta_t		cache_lifetime;		//!< How long successful authentications are cached for.
+	uint32_t		cache_max_entries;	//!< Maximum number of cached authentications.
+	rlm_mschap_cache_t	*cache;			//!< Successful authentications, NULL if disabled.
 #ifdef __APPLE__
 	bool			open_directory;
 #endif
@@ -29,7 +29,9 @@ USES_APPLE_DEPRECATED_API
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/crypt.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/offload.h>
 #include <freeradius-devel/server/password.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/tls/base.h>
 #include <freeradius-devel/util/base64.h>
@@ -55,12 +57,23 @@ typedef struct {
 	char const		*name;
 	fr_dict_enum_t		*auth_type;
 	bool			normify;
+
+	fr_offload_conf_t	offload_conf;		//!< Threads verifying expensive hashes.
+	fr_offload_t		*offload;		//!< Offload pool, NULL if disabled.
 } rlm_pap_t;
 
-typedef rlm_rcode_t (*pap_auth_func_t)(rlm_pap_t const *, REQUEST *, VALUE_PAIR const *, VALUE_PAIR const *);
+/** Per-worker state
+ *
+ */
+typedef struct {
+	fr_offload_thread_t	*offload;		//!< Where completed jobs are returned, NULL if disabled.
+} rlm_pap_thread_t;
+
+typedef rlm_rcode_t (*pap_auth_func_t)(module_ctx_t const *, REQUEST *, VALUE_PAIR const *, VALUE_PAIR const *);
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_pap_t, normify), .dflt = "yes" },
+	{ FR_CONF_OFFSET("offload", FR_TYPE_SUBSECTION, rlm_pap_t, offload_conf), .subcs = (void const *) fr_offload_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -113,6 +126,195 @@ static size_t pbkdf2_passlib_names_len = NUM_ELEMENTS(pbkdf2_passlib_names);
 
 static fr_dict_attr_t const **pap_allowed_passwords;
 
+#ifdef HAVE_OPENSSL_EVP_H
+/** Decoded PBKDF2 reference hash
+ *
+ */
+typedef struct {
+	EVP_MD const		*evp_md;		//!< Hash function used by the HMAC.
+	size_t			digest_len;		//!< Length of the derived key.
+	uint32_t		iterations;		//!< How many times the HMAC is applied.
+	uint8_t			*salt;			//!< Decoded salt.
+	size_t			salt_len;		//!< Length of the decoded salt.
+	uint8_t			hash[EVP_MAX_MD_SIZE];	//!< Expected derived key.
+} pap_pbkdf2_t;
+#endif
+
+typedef enum {
+	PAP_JOB_CRYPT = 0,					//!< fr_crypt_check().
+	PAP_JOB_PBKDF2						//!< PKCS5_PBKDF2_HMAC().
+} pap_job_type_t;
+
+/** A password verification performed by an offload thread
+ *
+ * Everything the offload thread needs is copied into the job, so it
+ * never touches the request, and never allocates or frees memory.
+ */
+typedef struct {
+	fr_offload_job_t	job;			//!< Must be first.
+
+	pap_job_type_t		type;			//!< What kind of verification to perform.
+
+	char			*password;		//!< Copy of the User-Password.
+	size_t			password_len;		//!< Length of the User-Password.
+
+	char			*crypt;			//!< Copy of the crypt reference string.
+#ifdef HAVE_OPENSSL_EVP_H
+	pap_pbkdf2_t		pbkdf2;			//!< Decoded PBKDF2 reference.
+	uint8_t			digest[EVP_MAX_MD_SIZE];	//!< PBKDF2 derived key.
+#endif
+	int			result;			//!< 0 on match, 1 on mismatch, -1 on error.
+} pap_job_t;
+
+#ifdef HAVE_OPENSSL_EVP_H
+static int pap_pbkdf2_check(uint8_t *digest, pap_pbkdf2_t const *pbkdf2, char const *password, size_t password_len);
+#endif
+
+/** Perform the expensive part of a job
+ *
+ * Called from an offload thread, or inline if the pool is full.
+ */
+static void pap_job_run(void *to_run, UNUSED void *thread_ctx, UNUSED void *uctx)
+{
+	pap_job_t	*job = to_run;
+
+	switch (job->type) {
+#ifdef HAVE_CRYPT
+	case PAP_JOB_CRYPT:
+		job->result = fr_crypt_check(job->password, job->crypt);
+		break;
+#endif
+
+#ifdef HAVE_OPENSSL_EVP_H
+	case PAP_JOB_PBKDF2:
+		job->result = pap_pbkdf2_check(job->digest, &job->pbkdf2, job->password, job->password_len);
+		break;
+#endif
+
+	default:
+		job->result = -1;
+		break;
+	}
+}
+
+/** Convert the result of a job into a module return code
+ *
+ */
+static rlm_rcode_t pap_job_rcode(REQUEST *request, pap_job_t const *job)
+{
+	switch (job->type) {
+	case PAP_JOB_CRYPT:
+		if (job->result != 0) {
+			REDEBUG("Crypt digest does not match \"known good\" digest");
+			return RLM_MODULE_REJECT;
+		}
+		return RLM_MODULE_OK;
+
+#ifdef HAVE_OPENSSL_EVP_H
+	case PAP_JOB_PBKDF2:
+		if (job->result < 0) {
+			REDEBUG("PBKDF2 digest failure");
+			return RLM_MODULE_INVALID;
+		}
+		if (job->result > 0) {
+			REDEBUG("PBKDF2 digest does not match \"known good\" digest");
+			REDEBUG3("Salt       : %pH", fr_box_octets(job->pbkdf2.salt, job->pbkdf2.salt_len));
+			REDEBUG3("Calculated : %pH", fr_box_octets(job->digest, job->pbkdf2.digest_len));
+			REDEBUG3("Expected   : %pH", fr_box_octets(job->pbkdf2.hash, job->pbkdf2.digest_len));
+			return RLM_MODULE_REJECT;
+		}
+		return RLM_MODULE_OK;
+#endif
+
+	default:
+		return RLM_MODULE_FAIL;
+	}
+}
+
+/** Log the final result of authentication
+ *
+ */
+static void pap_auth_log(REQUEST *request, rlm_rcode_t rcode)
+{
+	switch (rcode) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("Password incorrect");
+		break;
+
+	case RLM_MODULE_OK:
+		RDEBUG2("User authenticated successfully");
+		break;
+
+	default:
+		break;
+	}
+}
+
+static rlm_rcode_t pap_offload_resume(UNUSED module_ctx_t const *mctx, REQUEST *request, void *rctx)
+{
+	pap_job_t	*job = talloc_get_type_abort(rctx, pap_job_t);
+	rlm_rcode_t	rcode;
+
+	rcode = pap_job_rcode(request, job);
+	talloc_free(job);
+
+	pap_auth_log(request, rcode);
+
+	return rcode;
+}
+
+static void pap_offload_signal(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request, void *rctx,
+			       fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	fr_offload_cancel(talloc_get_type_abort(rctx, pap_job_t));
+}
+
+/** Verify a password, in an offload thread if possible
+ *
+ * @param[in] mctx	Module calling ctx.
+ * @param[in] request	The current request.
+ * @param[in] job	to process.  Will be freed, or owned by the pool.
+ * @return
+ *	- RLM_MODULE_YIELD if the job was queued.
+ *	- The result of the verification otherwise.
+ */
+static rlm_rcode_t pap_offload(module_ctx_t const *mctx, REQUEST *request, pap_job_t *job)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
+	rlm_rcode_t		rcode;
+
+	if (fr_offload_submit(t->offload, request, job) == 0) {
+		return unlang_module_yield(request, pap_offload_resume, pap_offload_signal, job);
+	}
+
+	/*
+	 *	Pool is saturated, verifying inline is
+	 *	better than delaying the request further.
+	 */
+	pap_job_run(job, NULL, NULL);
+	rcode = pap_job_rcode(request, job);
+	talloc_free(job);
+
+	return rcode;
+}
+
+/** Allocate a job holding a copy of the User-Password
+ *
+ */
+static pap_job_t *pap_job_alloc(pap_job_type_t type, VALUE_PAIR const *password)
+{
+	pap_job_t	*job;
+
+	MEM(job = talloc_zero(NULL, pap_job_t));
+	job->type = type;
+	MEM(job->password = talloc_bstrndup(job, password->vp_strvalue, password->vp_length));
+	job->password_len = password->vp_length;
+
+	return job;
+}
+
 /*
  *	Authorize the user for PAP authentication.
  *
@@ -150,7 +352,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQU
  *	PAP authentication functions
  */
 
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_clear(UNUSED rlm_pap_t const *inst, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_clear(UNUSED module_ctx_t const *mctx, REQUEST *request,
 						   VALUE_PAIR const *known_good, VALUE_PAIR const *password)
 {
 	if ((known_good->vp_length != password->vp_length) ||
@@ -164,9 +366,20 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_clear(UNUSED rlm_pap_t const *inst,
 }
 
 #ifdef HAVE_CRYPT
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_crypt(UNUSED rlm_pap_t const *inst, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_crypt(module_ctx_t const *mctx, REQUEST *request,
 						   VALUE_PAIR const *known_good, VALUE_PAIR const *password)
 {
+	rlm_pap_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_pap_t);
+
+	if (inst->offload) {
+		pap_job_t *job;
+
+		job = pap_job_alloc(PAP_JOB_CRYPT, password);
+		MEM(job->crypt = talloc_bstrndup(job, known_good->vp_strvalue, known_good->vp_length));
+
+		return pap_offload(mctx, request, job);
+	}
+
 	if (fr_crypt_check(password->vp_strvalue, known_good->vp_strvalue) != 0) {
 		REDEBUG("Crypt digest does not match \"known good\" digest");
 		return RLM_MODULE_REJECT;
@@ -175,7 +388,7 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_crypt(UNUSED rlm_pap_t const *inst,
 }
 #endif
 
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_md5(UNUSED rlm_pap_t const *inst, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_md5(UNUSED module_ctx_t const *mctx, REQUEST *request,
 						 VALUE_PAIR const *known_good, VALUE_PAIR const *password)
 {
 	uint8_t digest[MD5_DIGEST_LENGTH];
@@ -199,7 +412,7 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_md5(UNUSED rlm_pap_t const *inst, R
 }
 
 
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_smd5(UNUSED rlm_pap_t const *inst, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_smd5(UNUSED module_ctx_t const *mctx, REQUEST *request,
 						  VALUE_PAIR const *known_good, VALUE_PAIR const *password)
 {
 	fr_md5_ctx_t	*md5_ctx;
@@ -230,7 +443,7 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_smd5(UNUSED rlm_pap_t const *inst,
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_sha1(UNUSED rlm_pap_t const *inst, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_sha1(UNUSED module_ctx_t const *mctx, REQUEST *request,
 						  VALUE_PAIR const *known_good, VALUE_PAIR const *password)
 {
 	fr_sha1_ctx	sha1_context;
@@ -256,7 +469,7 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_sha1(UNUSED rlm_pap_t const *inst,
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_ssha1(UNUSED rlm_pap_t const *inst, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_ssha1(UNUSED module_ctx_t const *mctx, REQUEST *request,
 						   VALUE_PAIR const *known_good, VALUE_PAIR const *password)
 {
 	fr_sha1_ctx	sha1_context;
@@ -287,7 +500,7 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_ssha1(UNUSED rlm_pap_t const *inst,
 }
 
 #ifdef HAVE_OPENSSL_EVP_H
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_evp_md(UNUSED rlm_pap_t const *inst, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_evp_md(UNUSED module_ctx_t const *mctx, REQUEST *request,
 						    VALUE_PAIR const *known_good, VALUE_PAIR const *password,
 						    char const *name, EVP_MD const *md)
 {
@@ -314,7 +527,7 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_evp_md(UNUSED rlm_pap_t const *inst
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_evp_md_salted(UNUSED rlm_pap_t const *inst, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_evp_md_salted(UNUSED module_ctx_t const *mctx, REQUEST *request,
 							   VALUE_PAIR const *known_good, VALUE_PAIR const *password,
 							   char const *name, EVP_MD const *md)
 {
@@ -352,10 +565,10 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_evp_md_salted(UNUSED rlm_pap_t cons
  *
  */
 #define PAP_AUTH_EVP_MD(_func, _new_func, _name, _md) \
-static rlm_rcode_t CC_HINT(nonnull) _new_func(rlm_pap_t const *inst, REQUEST *request,			\
+static rlm_rcode_t CC_HINT(nonnull) _new_func(module_ctx_t const *mctx, REQUEST *request,			\
 					      VALUE_PAIR const *known_good, VALUE_PAIR const *password)	\
 {													\
-	return _func(inst, request, known_good, password, _name, _md);					\
+	return _func(mctx, request, known_good, password, _name, _md);					\
 }
 
 PAP_AUTH_EVP_MD(pap_auth_evp_md, pap_auth_sha2_224, "SHA2-224", EVP_sha224())
@@ -378,20 +591,48 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_384, "SSHA3-384", EVP_sha
 PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha3_512())
 #  endif
 
+/** Derive a key from the password, and compare it with the reference
+ *
+ * Does not log or allocate memory, so may be called from an offload thread.
+ *
+ * @param[out] digest		Where to write the derived key.
+ * @param[in] pbkdf2		Decoded PBKDF2 reference.
+ * @param[in] password		to check.
+ * @param[in] password_len	Length of the password.
+ * @return
+ *	- 0 if the derived key matches.
+ *	- 1 if the derived key does not match.
+ *	- -1 on error.
+ */
+static int pap_pbkdf2_check(uint8_t *digest, pap_pbkdf2_t const *pbkdf2, char const *password, size_t password_len)
+{
+	if (PKCS5_PBKDF2_HMAC(password, (int)password_len,
+			      (unsigned char const *)pbkdf2->salt, (int)pbkdf2->salt_len,
+			      (int)pbkdf2->iterations,
+			      pbkdf2->evp_md,
+			      (int)pbkdf2->digest_len, (unsigned char *)digest) == 0) return -1;
+
+	return (fr_digest_cmp(digest, pbkdf2->hash, pbkdf2->digest_len) != 0);
+}
+
 /** Validates Crypt::PBKDF2 LDAP format strings
  *
+ * @param[in] mctx	Module calling ctx.
  * @param[in] request	The current request.
  * @param[in] str	Raw PBKDF2 string.
  * @param[in] len	Length of string.
  * @return
  *	- RLM_MODULE_REJECT
  *	- RLM_MODULE_OK
+ *	- RLM_MODULE_YIELD if the hash is being calculated by an offload thread.
  */
-static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2_parse(REQUEST *request, const uint8_t *str, size_t len,
+static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2_parse(module_ctx_t const *mctx, REQUEST *request,
+								 const uint8_t *str, size_t len,
 								 fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
 								 char scheme_sep, char iter_sep, char salt_sep,
 								 bool iter_is_base64, VALUE_PAIR const *password)
 {
+	rlm_pap_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_pap_t);
 	rlm_rcode_t		rcode = RLM_MODULE_INVALID;
 
 	uint8_t const		*p, *q, *end;
@@ -408,6 +649,9 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2_parse(REQUEST *reques
 	uint8_t			hash[EVP_MAX_MD_SIZE];
 	uint8_t			digest[EVP_MAX_MD_SIZE];
 
+	pap_pbkdf2_t		pbkdf2;
+	int			ret;
+
 	RDEBUG2("Comparing with \"known-good\" PBKDF2-Password");
 
 	if (len <= 1) {
@@ -573,19 +817,40 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2_parse(REQUEST *reques
 		fr_table_str_by_value(pbkdf2_crypt_names, digest_type, "<UNKNOWN>"),
 		iterations, salt_len, slen);
 
+	pbkdf2 = (pap_pbkdf2_t) {
+		.evp_md = evp_md,
+		.digest_len = digest_len,
+		.iterations = iterations,
+		.salt = salt,
+		.salt_len = salt_len
+	};
+	memcpy(pbkdf2.hash, hash, digest_len);
+
+	/*
+	 *	Thousands of HMAC iterations are too slow
+	 *	to run in a worker if we have a choice.
+	 */
+	if (inst->offload) {
+		pap_job_t *job;
+
+		job = pap_job_alloc(PAP_JOB_PBKDF2, password);
+		job->pbkdf2 = pbkdf2;
+		talloc_steal(job, salt);
+		salt = NULL;
+
+		return pap_offload(mctx, request, job);
+	}
+
 	/*
 	 *	Hash and compare
 	 */
-	if (PKCS5_PBKDF2_HMAC((char const *)password->vp_octets, (int)password->vp_length,
-			      (unsigned char const *)salt, (int)salt_len,
-			      (int)iterations,
-			      evp_md,
-			      (int)digest_len, (unsigned char *)digest) == 0) {
+	ret = pap_pbkdf2_check(digest, &pbkdf2, password->vp_strvalue, password->vp_length);
+	if (ret < 0) {
 		REDEBUG("PBKDF2 digest failure");
 		goto finish;
 	}
 
-	if (fr_digest_cmp(digest, hash, (size_t)digest_len) != 0) {
+	if (ret > 0) {
 		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
 		REDEBUG3("Salt       : %pH", fr_box_octets(salt, salt_len));
 		REDEBUG3("Calculated : %pH", fr_box_octets(digest, digest_len));
@@ -601,7 +866,7 @@ finish:
 	return rcode;
 }
 
-static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2(UNUSED rlm_pap_t const *inst,
+static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2(module_ctx_t const *mctx,
 							   REQUEST *request,
 							   VALUE_PAIR const *known_good, VALUE_PAIR const *password)
 {
@@ -626,7 +891,7 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2(UNUSED rlm_pap_t cons
 			q = memchr(p, '}', end - p);
 			p = q + 1;
 		}
-		return pap_auth_pbkdf2_parse(request, p, end - p,
+		return pap_auth_pbkdf2_parse(mctx, request, p, end - p,
 					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
 					     ':', ':', ':', true, password);
 	}
@@ -638,7 +903,7 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2(UNUSED rlm_pap_t cons
 	 */
 	if ((size_t)(end - p) >= sizeof("$PBKDF2$") && (memcmp(p, "$PBKDF2$", sizeof("$PBKDF2$") - 1) == 0)) {
 		p += sizeof("$PBKDF2$") - 1;
-		return pap_auth_pbkdf2_parse(request, p, end - p,
+		return pap_auth_pbkdf2_parse(mctx, request, p, end - p,
 					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
 					     ':', ':', '$', false, password);
 	}
@@ -652,7 +917,7 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2(UNUSED rlm_pap_t cons
 	 */
 	if ((size_t)(end - p) >= sizeof("$pbkdf2-") && (memcmp(p, "$pbkdf2-", sizeof("$pbkdf2-") - 1) == 0)) {
 		p += sizeof("$pbkdf2-") - 1;
-		return pap_auth_pbkdf2_parse(request, p, end - p,
+		return pap_auth_pbkdf2_parse(mctx, request, p, end - p,
 					     pbkdf2_passlib_names, pbkdf2_passlib_names_len,
 					     '$', '$', '$', false, password);
 	}
@@ -663,7 +928,7 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2(UNUSED rlm_pap_t cons
 }
 #endif
 
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_nt(UNUSED rlm_pap_t const *inst, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_nt(UNUSED module_ctx_t const *mctx, REQUEST *request,
 						VALUE_PAIR const *known_good, VALUE_PAIR const *password)
 {
 	ssize_t len;
@@ -698,7 +963,7 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_nt(UNUSED rlm_pap_t const *inst, RE
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_lm(UNUSED rlm_pap_t const *inst, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_lm(UNUSED module_ctx_t const *mctx, REQUEST *request,
 						VALUE_PAIR const *known_good, UNUSED VALUE_PAIR const *password)
 {
 	uint8_t	digest[MD4_DIGEST_LENGTH];
@@ -726,7 +991,7 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_lm(UNUSED rlm_pap_t const *inst, RE
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_ns_mta_md5(UNUSED rlm_pap_t const *inst, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_ns_mta_md5(UNUSED module_ctx_t const *mctx, REQUEST *request,
 							VALUE_PAIR const *known_good, VALUE_PAIR const *password)
 {
 	uint8_t digest[128];
@@ -788,7 +1053,7 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_ns_mta_md5(UNUSED rlm_pap_t const *
 /** Auth func for password types that should have been normalised away
  *
  */
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_dummy(UNUSED rlm_pap_t const *inst, UNUSED REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_dummy(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request,
 						   UNUSED VALUE_PAIR const *known_good, UNUSED VALUE_PAIR const *password)
 {
 	return RLM_MODULE_FAIL;
@@ -898,20 +1163,15 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(module_ctx_t const *mctx, R
 	/*
 	 *	Authenticate, and return.
 	 */
-	rcode = auth_func(inst, request, known_good, password);
+	rcode = auth_func(mctx, request, known_good, password);
 	if (ephemeral) talloc_list_free(&known_good);
-	switch (rcode) {
-	case RLM_MODULE_REJECT:
-		REDEBUG("Password incorrect");
-		break;
 
-	case RLM_MODULE_OK:
-		RDEBUG2("User authenticated successfully");
-		break;
+	/*
+	 *	Result is logged when the offload thread is done
+	 */
+	if (rcode == RLM_MODULE_YIELD) return rcode;
 
-	default:
-		break;
-	}
+	pap_auth_log(request, rcode);
 
 	return rcode;
 }
@@ -931,7 +1191,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
+static int mod_instantiate(void *instance, CONF_SECTION *cs)
 {
 	rlm_pap_t	*inst = talloc_get_type_abort(instance, rlm_pap_t);
 
@@ -941,6 +1201,34 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
 		     inst->name);
 	}
 
+	if (!inst->offload_conf.threads) return 0;
+
+	inst->offload = fr_offload_alloc(inst, cs, &inst->offload_conf, pap_job_run, NULL, NULL);
+	if (!inst->offload) return -1;
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_pap_t		*inst = talloc_get_type_abort(instance, rlm_pap_t);
+	rlm_pap_thread_t	*t = talloc_get_type_abort(thread, rlm_pap_thread_t);
+
+	if (!inst->offload) return 0;
+
+	t->offload = fr_offload_thread_alloc(t, inst->offload, el);
+	if (!t->offload) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(thread, rlm_pap_thread_t);
+
+	TALLOC_FREE(t->offload);
+
 	return 0;
 }
 
@@ -1019,6 +1307,9 @@ module_t rlm_pap = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_pap_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
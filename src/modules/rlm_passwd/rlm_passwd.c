@@ -28,25 +28,12 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
 
-struct mypasswd {
-	struct mypasswd *next;
-	char *listflag;
-	char *field[1];
-};
-
-struct hashtable {
-	int tablesize;
-	int key_field;
-	int num_fields;
-	int islist;
-	int ignorenis;
-	char * filename;
-	struct mypasswd **table;
-	char buffer[1024];
-	FILE *fp;
-	char delimiter;
-};
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static fr_dict_t const *dict_freeradius;
 
@@ -56,478 +43,714 @@ fr_dict_autoload_t rlm_passwd_dict[] = {
 	{ NULL }
 };
 
-#ifdef TEST
+typedef struct rlm_passwd_index_s rlm_passwd_index_t;
+typedef struct rlm_passwd_reload_s rlm_passwd_reload_t;
 
-void printpw(struct mypasswd *pw, int num_fields){
-	int i;
-	if (pw) {
-		for( i = 0; i < num_fields; i++ ) printf("%s:", pw->field[i]);
-		printf("\n");
+/** Which list a field is added to
+ *
+ */
+typedef enum {
+	PASSWD_LIST_CONTROL = 0,	//!< No prefix.
+	PASSWD_LIST_REPLY,		//!< Prefixed with '='.
+	PASSWD_LIST_REQUEST		//!< Prefixed with '~'.
+} passwd_list_t;
+
+/** One field of the format
+ *
+ */
+typedef struct {
+	char const		*name;		//!< Attribute the field is mapped to.
+	fr_dict_attr_t const	*da;		//!< Attribute looked up in the request, key fields only.
+	passwd_list_t		list;		//!< Where the attribute is added.
+	bool			key;		//!< Prefixed with '*'.
+	bool			listable;	//!< Prefixed with ',', the key is a comma separated list.
+} passwd_field_t;
+
+typedef struct {
+	rlm_passwd_index_t	*index;		//!< The data loaded from the file, if we're not reloading it.
+	rlm_passwd_reload_t	*reload;	//!< Reloads the file, NULL if reload_interval is 0.
+
+	char const		*filename;
+	char const		*format;
+	char const		*delimiter;
+	bool			allow_multiple;
+	bool			ignore_nislike;
+	bool			ignore_empty;
+	uint32_t		hash_size;	//!< Ignored, the index is sized from the file.
+	fr_time_delta_t		reload_interval; //!< How often to check the file for changes.
+
+	passwd_field_t		*fields;	//!< Parsed from format.
+	uint32_t		num_fields;
+	uint32_t		*keys;		//!< Fields marked as keys, in the order they appear in format.
+	uint32_t		num_keys;
+} rlm_passwd_t;
+
+/** A slot in the index of one key field
+ *
+ * Only the hash of the key and the location of the line are
+ * stored, keys are compared against the mapped file to resolve
+ * collisions.
+ */
+typedef struct {
+	uint64_t		offset;		//!< Offset of the line + 1, 0 means the slot is free.
+	uint32_t		hash;		//!< Hash of the key.
+} passwd_slot_t;
+
+/** Everything loaded from one version of the file
+ *
+ * Reloading builds a new index in the background, and swaps it
+ * with the current one.  The old index is freed once the last
+ * lookup using it has completed.
+ */
+struct rlm_passwd_index_s {
+	rlm_passwd_t const	*inst;		//!< Instance the index belongs to.
+
+	uint8_t const		*map;		//!< The mapped file.
+	size_t			map_len;	//!< Length of the mapped file.
+
+	passwd_slot_t		**slots;	//!< One open addressed table per key field.
+	size_t			num_slots;	//!< Always a power of 2.
+
+	dev_t			dev;		//!< Identity of the file we loaded.
+	ino_t			ino;
+	off_t			size;
+	struct timespec		mtime;
+
+	uint32_t		refs;		//!< Lookups using this index, protected by the reload mutex.
+};
+
+struct rlm_passwd_reload_s {
+	rlm_passwd_t const	*inst;		//!< Instance data.
+	pthread_t		thread;		//!< Checks the file, and builds new indexes.
+	pthread_mutex_t		mutex;		//!< Protects current, refs, and stop.
+	pthread_cond_t		cond;		//!< Signalled on exit.
+	rlm_passwd_index_t	*current;	//!< Index lookups should use.
+	bool			stop;		//!< Tell the reload thread to exit.
+	bool			running;	//!< Reload thread was started.
+};
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED, rlm_passwd_t, filename) },
+	{ FR_CONF_OFFSET("format", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_passwd_t, format) },
+	{ FR_CONF_OFFSET("delimiter", FR_TYPE_STRING, rlm_passwd_t, delimiter), .dflt = ":" },
+
+	{ FR_CONF_OFFSET("ignore_nislike", FR_TYPE_BOOL, rlm_passwd_t, ignore_nislike), .dflt = "yes" },
+
+	{ FR_CONF_OFFSET("ignore_empty", FR_TYPE_BOOL, rlm_passwd_t, ignore_empty), .dflt = "yes" },
+
+	{ FR_CONF_OFFSET("allow_multiple_keys", FR_TYPE_BOOL, rlm_passwd_t, allow_multiple), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("hash_size", FR_TYPE_UINT32, rlm_passwd_t, hash_size), .dflt = "100" },
+
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_TIME_DELTA, rlm_passwd_t, reload_interval), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+/*
+ *	Errors are logged against the configuration when
+ *	instantiating, and to the main log when reloading.
+ */
+#define passwd_log_err(_conf, _fmt, ...) \
+do { \
+	if (_conf) { \
+		cf_log_err(_conf, _fmt, ## __VA_ARGS__); \
+	} else { \
+		ERROR(_fmt, ## __VA_ARGS__); \
+	} \
+} while (0)
+
+/** Find field number 'num' of a line
+ *
+ * The last field extends to the end of the line, delimiters and all.
+ *
+ * @return
+ *	- The start of the field.
+ *	- NULL if the line has fewer fields.
+ */
+static uint8_t const *passwd_line_field(rlm_passwd_t const *inst, uint8_t const *p, uint8_t const *end,
+					uint32_t num, size_t *len)
+{
+	uint8_t const	*q;
+	uint32_t	i;
+
+	for (i = 0; i < num; i++) {
+		q = memchr(p, *inst->delimiter, end - p);
+		if (!q) return NULL;
+		p = q + 1;
 	}
-	else printf ("Not found\n");
-	fflush(stdout);
-}
-#endif
 
+	if (num < (inst->num_fields - 1)) {
+		q = memchr(p, *inst->delimiter, end - p);
+		if (q) end = q;
+	}
+
+	*len = end - p;
+	return p;
+}
 
-static struct mypasswd *mypasswd_alloc(char const* buffer, int num_fields, size_t* len)
+/** Find the end of the line starting at offset, minus any trailing CR
+ *
+ */
+static uint8_t const *passwd_line_end(rlm_passwd_index_t const *idx, size_t offset)
 {
-	struct mypasswd *t;
-	/* reserve memory for (struct mypasswd) + listflag (num_fields * sizeof (char*)) +
-	** fields (num_fields * sizeof (char)) + strlen (inst->format) + 1 */
+	uint8_t const *p = idx->map + offset, *end = idx->map + idx->map_len, *eol;
 
-	*len = sizeof(struct mypasswd) + num_fields * sizeof (char*) + num_fields * sizeof (char ) + strlen(buffer) + 1;
-	MEM(t = (struct mypasswd *)talloc_zero_array(NULL, uint8_t, *len));
+	eol = memchr(p, '\n', end - p);
+	if (!eol) eol = end;
+	if ((eol > p) && (eol[-1] == '\r')) eol--;
 
-	return t;
+	return eol;
 }
 
-static int string_to_entry(char const* string, int num_fields, char delimiter,
-			   struct mypasswd *passwd, size_t bufferlen)
+/** Check whether a line has a given key
+ *
+ */
+static bool passwd_line_match(rlm_passwd_index_t const *idx, size_t offset, uint32_t field,
+			      char const *key, size_t key_len)
 {
-	char *str;
-	size_t len, i;
-	int fn=0;
-	char *data_beg;
-
-
-	len = strlen(string);
-	if(!len) return 0;
-	if (string[len-1] == '\n') len--;
-	if(!len) return 0;
-	if (string[len-1] == '\r') len--;
-	if(!len) return 0;
-	if (!passwd ||
-	    bufferlen < (len + num_fields * sizeof (char*) + num_fields * sizeof (char) + sizeof (struct mypasswd) + 1) ) return 0;
-	passwd->next = NULL;
-	data_beg=(char *)passwd + sizeof(struct mypasswd);
-	str = data_beg + num_fields * sizeof (char) + num_fields * sizeof (char*);
-	memcpy (str, string, len);
-	str[len] = 0;
-	passwd->field[fn++] = str;
-	passwd->listflag = data_beg + num_fields * sizeof (char *);
-	for(i=0; i < len; i++){
-		if (str[i] == delimiter) {
-			str[i] = 0;
-			passwd->field[fn++] = str + i + 1;
-			if (fn == num_fields) break;
-		}
+	rlm_passwd_t const	*inst = idx->inst;
+	uint8_t const		*p, *end, *comma;
+	size_t			len;
+
+	p = passwd_line_field(inst, idx->map + offset, passwd_line_end(idx, offset), field, &len);
+	if (!p) return false;
+
+	if (!inst->fields[field].listable) return ((len == key_len) && (memcmp(p, key, len) == 0));
+
+	for (end = p + len; p <= end; p = comma + 1) {
+		comma = memchr(p, ',', end - p);
+		if (!comma) comma = end;
+
+		if (((size_t)(comma - p) == key_len) && (memcmp(p, key, key_len) == 0)) return true;
 	}
-	for (; fn < num_fields; fn++) passwd->field[fn] = NULL;
-	return len + num_fields * sizeof (char) + num_fields * sizeof (char*) + sizeof (struct mypasswd) + 1;
+
+	return false;
 }
 
+/** Add a key to the index of one key field
+ *
+ * Duplicate keys are allowed, they're found in the order they were
+ * inserted.  A line is only added once for each key, even if a list
+ * contains the same element more than once.
+ */
+static void passwd_slot_insert(rlm_passwd_index_t *idx, uint32_t k, uint8_t const *key, size_t key_len,
+			       size_t offset)
+{
+	passwd_slot_t	*slots = idx->slots[k];
+	uint32_t	hash = fr_hash(key, key_len);
+	size_t		i;
+
+	for (i = hash & (idx->num_slots - 1);
+	     slots[i].offset != 0;
+	     i = (i + 1) & (idx->num_slots - 1)) {
+		if ((slots[i].offset == (offset + 1)) && (slots[i].hash == hash)) return;
+	}
+
+	slots[i].offset = offset + 1;
+	slots[i].hash = hash;
+}
 
-static void destroy_password (struct mypasswd * pass)
+/** Find the next line with a key, in the index of one key field
+ *
+ * @param[in] idx	to search.
+ * @param[in] k		which key field to search.
+ * @param[in] key	to find.
+ * @param[in] key_len	length of key.
+ * @param[in] hash	of key.
+ * @param[in,out] pos	slot to start searching from, updated to the one after the match.
+ * @return
+ *	- The offset of the line + 1.
+ *	- 0 if no more lines match.
+ */
+static size_t passwd_slot_next(rlm_passwd_index_t const *idx, uint32_t k, char const *key, size_t key_len,
+			       uint32_t hash, size_t *pos)
 {
-	struct mypasswd *p;
+	passwd_slot_t const	*slots = idx->slots[k];
+	size_t			i;
+
+	for (i = *pos;
+	     slots[i].offset != 0;
+	     i = (i + 1) & (idx->num_slots - 1)) {
+		if (slots[i].hash != hash) continue;
 
-	while ((p = pass) != NULL) {
-		pass = pass->next;
-		talloc_free(p);
+		if (!passwd_line_match(idx, slots[i].offset - 1, idx->inst->keys[k], key, key_len)) continue;
+
+		*pos = (i + 1) & (idx->num_slots - 1);
+		return slots[i].offset;
 	}
-}
 
+	return 0;
+}
 
-static unsigned int hash(char const * username, unsigned int tablesize)
+/** Add one line to the indexes of all key fields
+ *
+ */
+static void passwd_index_line(rlm_passwd_index_t *idx, size_t offset)
 {
-	uint64_t h = 1;
+	rlm_passwd_t const	*inst = idx->inst;
+	uint8_t const		*line = idx->map + offset, *eol, *p, *end, *comma;
+	uint32_t		k;
+	size_t			len;
 
-	while (*username) h = fr_multiply_mod(h, (7907 + *username++), tablesize);
+	eol = passwd_line_end(idx, offset);
+	if (eol == line) return;
 
-	return (unsigned int)h;
-}
+	if (inst->ignore_nislike && ((*line == '+') || (*line == '-'))) return;
+
+	for (k = 0; k < inst->num_keys; k++) {
+		uint32_t field = inst->keys[k];
+
+		p = passwd_line_field(inst, line, eol, field, &len);
+		if (!p || !len) continue;
 
-static void release_hash_table(struct hashtable * ht){
-	int i;
+		if (!inst->fields[field].listable) {
+			passwd_slot_insert(idx, k, p, len, offset);
+			continue;
+		}
+
+		for (end = p + len; p <= end; p = comma + 1) {
+			comma = memchr(p, ',', end - p);
+			if (!comma) comma = end;
 
-	if (!ht) return;
-	for (i = 0; i < ht->tablesize; i++)
-		if (ht->table[i])
-			destroy_password(ht->table[i]);
-	if (ht->fp) {
-		fclose(ht->fp);
-		ht->fp = NULL;
+			passwd_slot_insert(idx, k, p, comma - p, offset);
+		}
 	}
-	ht->tablesize = 0;
 }
 
-static void release_ht(struct hashtable * ht){
-	if (!ht) return;
-	release_hash_table(ht);
-	talloc_free(ht);
+static int _passwd_index_free(rlm_passwd_index_t *idx)
+{
+	void *map;
+
+	if (!idx->map) return 0;
+
+	memcpy(&map, &idx->map, sizeof(map)); /* const issues */
+	munmap(map, idx->map_len);
+
+	return 0;
 }
 
-static struct hashtable * build_hash_table (char const * file, int num_fields,
-					    int key_field, int islist, int tablesize, int ignorenis, char delimiter)
+/** Map the file, and index the lines by each key field
+ *
+ * @param[in] conf	to log errors against, or NULL if we're reloading.
+ * @param[in] inst	Module instance.
+ * @return
+ *	- The new index.
+ *	- NULL on error.
+ */
+static rlm_passwd_index_t *passwd_index_build(CONF_SECTION *conf, rlm_passwd_t const *inst)
 {
-	struct hashtable* ht;
-	size_t len;
-	unsigned int h;
-	struct mypasswd *hashentry, *hashentry1;
-	char *list;
-	char *nextlist=0;
-	int i;
-	char buffer[1024];
-
-	MEM(ht = talloc_zero(NULL, struct hashtable));
-	MEM(ht->filename = talloc_typed_strdup(ht, file));
-
-	ht->tablesize = tablesize;
-	ht->num_fields = num_fields;
-	ht->key_field = key_field;
-	ht->islist = islist;
-	ht->ignorenis = ignorenis;
-
-	if (delimiter) ht->delimiter = delimiter;
-	else ht->delimiter = ':';
-	if(!tablesize) return ht;
-	if(!(ht->fp = fopen(file,"r"))) {
-		talloc_free(ht);
-		return NULL;
+	rlm_passwd_index_t	*idx;
+	int			fd;
+	struct stat		st;
+	void			*map;
+	uint8_t const		*p, *end, *eol;
+	size_t			lines = 0, commas = 0, entries;
+	uint32_t		k;
+
+	/*
+	 *	Not parented, as reload threads allocate
+	 *	these outside of the instance's hierarchy.
+	 */
+	MEM(idx = talloc_zero(NULL, rlm_passwd_index_t));
+	idx->inst = inst;
+	talloc_set_destructor(idx, _passwd_index_free);
+
+	fd = open(inst->filename, O_RDONLY);
+	if (fd < 0) {
+		passwd_log_err(conf, "Error opening filename %s: %s", inst->filename, fr_syserror(errno));
+		goto error;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		passwd_log_err(conf, "Error reading filename %s: %s", inst->filename, fr_syserror(errno));
+		close(fd);
+		goto error;
+	}
+	idx->dev = st.st_dev;
+	idx->ino = st.st_ino;
+	idx->size = st.st_size;
+	idx->mtime = st.st_mtim;
+
+	if (st.st_size == 0) {
+		close(fd);
+		return idx;
 	}
 
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		passwd_log_err(conf, "Error mapping filename %s: %s", inst->filename, fr_syserror(errno));
+		goto error;
+	}
+	idx->map = map;
+	idx->map_len = st.st_size;
+	end = idx->map + idx->map_len;
+
 	/*
-	 *	@todo: This code is SHIT.  It's badly formatted.  It's
-	 *	hard to understand.  It re-implements tons of things
-	 *	which are already in the server core.
+	 *	Size the indexes for a load factor of at most 0.5.
+	 *	Each element of a list is a separate key, so count
+	 *	commas too.
 	 */
-	memset(ht->buffer, 0, 1024);
-	MEM(ht->table = talloc_zero_array(ht, struct mypasswd *, tablesize));
-	while (fgets(buffer, 1024, ht->fp)) {
-		if(*buffer && *buffer!='\n' && (!ignorenis || (*buffer != '+' && *buffer != '-')) ){
-			hashentry = mypasswd_alloc(buffer, num_fields, &len);
-			if (!hashentry){
-				release_hash_table(ht);
-				return ht;
-			}
+	for (p = idx->map; p < end; p++) {
+		if (*p == '\n') {
+			lines++;
+		} else if (*p == ',') {
+			commas++;
+		}
+	}
+	lines++;
 
-			len = string_to_entry(buffer, num_fields, ht->delimiter, hashentry, len);
-			if (!hashentry->field[key_field] || *hashentry->field[key_field] == '\0') {
-				talloc_free(hashentry);
-				continue;
-			}
+	entries = lines;
+	for (k = 0; k < inst->num_keys; k++) {
+		if (inst->fields[inst->keys[k]].listable) {
+			entries += commas;
+			break;
+		}
+	}
 
-			if (islist) {
-				list = hashentry->field[key_field];
-				for (nextlist = list; *nextlist && *nextlist!=','; nextlist++);
-				if (*nextlist) *nextlist++ = 0;
-				else nextlist = 0;
-			}
-			h = hash(hashentry->field[key_field], tablesize);
-			hashentry->next = ht->table[h];
-			ht->table[h] = hashentry;
-			if (islist) {
-				for (list=nextlist; nextlist; list = nextlist){
-					for (nextlist = list; *nextlist && *nextlist!=','; nextlist++);
-					if (*nextlist) *nextlist++ = 0;
-					else nextlist = 0;
-					if(!(hashentry1 = mypasswd_alloc("", num_fields, &len))){
-						release_hash_table(ht);
-						return ht;
-					}
-					for (i=0; i<num_fields; i++) hashentry1->field[i] = hashentry->field[i];
-					hashentry1->field[key_field] = list;
-					h = hash(list, tablesize);
-					hashentry1->next = ht->table[h];
-					ht->table[h] = hashentry1;
-				}
-			}
+	idx->num_slots = 16;
+	while (idx->num_slots < (entries * 2)) idx->num_slots <<= 1;
+
+	MEM(idx->slots = talloc_zero_array(idx, passwd_slot_t *, inst->num_keys));
+	for (k = 0; k < inst->num_keys; k++) {
+		idx->slots[k] = talloc_zero_array(idx->slots, passwd_slot_t, idx->num_slots);
+		if (!idx->slots[k]) {
+			passwd_log_err(conf, "Failed allocating index for %zu lines of %s", lines, inst->filename);
+			goto error;
 		}
 	}
-	fclose(ht->fp);
-	ht->fp = NULL;
-	return ht;
-#undef passwd
+
+	for (p = idx->map; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol) eol = end;
+
+		passwd_index_line(idx, p - idx->map);
+	}
+
+	/*
+	 *	From here on, lookups are random.
+	 */
+	(void)madvise(map, idx->map_len, MADV_RANDOM);
+
+	return idx;
+
+error:
+	talloc_free(idx);
+	return NULL;
 }
 
-static struct mypasswd * get_next(char *name, struct hashtable *ht,
-				  struct mypasswd **last_found)
+/** Get the index lookups should use, and stop it being freed
+ *
+ */
+static rlm_passwd_index_t *passwd_index_acquire(rlm_passwd_t const *inst)
 {
-	struct mypasswd * passwd;
-	struct mypasswd * hashentry;
-	char buffer[1024];
-	char *list, *nextlist;
-
-	if (ht->tablesize > 0) {
-		/* get saved address of next item to check from buffer */
-		hashentry = *last_found;
-		for (; hashentry; hashentry = hashentry->next) {
-			if (!strcmp(hashentry->field[ht->key_field], name)) {
-				/* save new address */
-				*last_found = hashentry->next;
-				return hashentry;
-			}
+	rlm_passwd_index_t *idx;
+
+	if (!inst->reload) return inst->index;
+
+	pthread_mutex_lock(&inst->reload->mutex);
+	idx = inst->reload->current;
+	idx->refs++;
+	pthread_mutex_unlock(&inst->reload->mutex);
+
+	return idx;
+}
+
+/** Release an index, freeing it if it's been replaced and this was the last lookup using it
+ *
+ */
+static void passwd_index_release(rlm_passwd_t const *inst, rlm_passwd_index_t *idx)
+{
+	bool unused;
+
+	if (!inst->reload) return;
+
+	pthread_mutex_lock(&inst->reload->mutex);
+	unused = ((--idx->refs == 0) && (idx != inst->reload->current));
+	pthread_mutex_unlock(&inst->reload->mutex);
+
+	if (unused) talloc_free(idx);
+}
+
+/** Rebuild the index whenever the file changes, and swap it with the current one
+ *
+ */
+static void *passwd_reload_thread(void *arg)
+{
+	rlm_passwd_reload_t	*reload = arg;
+	rlm_passwd_t const	*inst = reload->inst;
+
+	pthread_mutex_lock(&reload->mutex);
+	while (!reload->stop) {
+		struct timespec		when;
+		struct stat		st;
+		rlm_passwd_index_t	*idx, *old;
+		bool			unused;
+
+		clock_gettime(CLOCK_REALTIME, &when);
+		when.tv_sec += inst->reload_interval / NSEC;
+		when.tv_nsec += inst->reload_interval % NSEC;
+		if (when.tv_nsec >= NSEC) {
+			when.tv_sec++;
+			when.tv_nsec -= NSEC;
 		}
-		return NULL;
-	}
-	/*	printf("try to find in file\n"); */
-	if (!ht->fp) return NULL;
 
-	passwd = (struct mypasswd *) ht->buffer;
+		(void)pthread_cond_timedwait(&reload->cond, &reload->mutex, &when);
+		if (reload->stop) break;
 
-	while (fgets(buffer, 1024,ht->fp)) {
-		if(*buffer && *buffer!='\n' && string_to_entry(buffer, ht->num_fields, ht->delimiter, passwd, sizeof(ht->buffer)-1) &&
-		   (!ht->ignorenis || (*buffer !='-' && *buffer != '+') ) ){
-			if(!ht->islist) {
-				if(!strcmp(passwd->field[ht->key_field], name))
-					return passwd;
-			}
-			else {
-				for (list = passwd->field[ht->key_field], nextlist = list; nextlist; list = nextlist) {
-					for(nextlist = list; *nextlist && *nextlist!=','; nextlist++);
-					if(!*nextlist) {
-						nextlist = 0;
-					} else {
-						*nextlist++ = 0;
-					}
-					if (!strcmp(list, name)) {
-						return passwd;
-					}
-				}
-			}
+		/*
+		 *	Only this thread changes current, so it's
+		 *	safe to look at it without the mutex.
+		 */
+		old = reload->current;
+		pthread_mutex_unlock(&reload->mutex);
+
+		if ((stat(inst->filename, &st) < 0) ||
+		    ((st.st_dev == old->dev) && (st.st_ino == old->ino) && (st.st_size == old->size) &&
+		     (st.st_mtim.tv_sec == old->mtime.tv_sec) && (st.st_mtim.tv_nsec == old->mtime.tv_nsec))) {
+			pthread_mutex_lock(&reload->mutex);
+			continue;
+		}
+
+		INFO("File %s has changed, reloading", inst->filename);
 
+		idx = passwd_index_build(NULL, inst);
+
+		pthread_mutex_lock(&reload->mutex);
+		if (!idx) {
+			ERROR("Failed reloading %s, continuing to use the previous version", inst->filename);
+			continue;
 		}
+
+		reload->current = idx;
+		unused = (old->refs == 0);
+		pthread_mutex_unlock(&reload->mutex);
+
+		/*
+		 *	Otherwise the last lookup using it frees it.
+		 */
+		if (unused) talloc_free(old);
+
+		pthread_mutex_lock(&reload->mutex);
 	}
-	fclose(ht->fp);
-	ht->fp = NULL;
+	pthread_mutex_unlock(&reload->mutex);
+
 	return NULL;
 }
 
-static struct mypasswd * get_pw_nam(char * name, struct hashtable* ht,
-				    struct mypasswd **last_found)
+static int _passwd_reload_free(rlm_passwd_reload_t *reload)
 {
-	int h;
-	struct mypasswd * hashentry;
-
-	if (!ht || !name || *name == '\0') return NULL;
-	*last_found = NULL;
-	if (ht->tablesize > 0) {
-		h = hash (name, ht->tablesize);
-		for (hashentry = ht->table[h]; hashentry; hashentry = hashentry->next) {
-			if (!strcmp(hashentry->field[ht->key_field], name)){
-				/* save address of next item to check into buffer */
-				*last_found=hashentry->next;
-				return hashentry;
-			}
-		}
+	if (reload->running) {
+		pthread_mutex_lock(&reload->mutex);
+		reload->stop = true;
+		pthread_cond_signal(&reload->cond);
+		pthread_mutex_unlock(&reload->mutex);
 
-		return NULL;
-	}
-	if (ht->fp) {
-		fclose(ht->fp);
-		ht->fp = NULL;
+		pthread_join(reload->thread, NULL);
 	}
-	if (!(ht->fp=fopen(ht->filename, "r"))) return NULL;
-	return get_next(name, ht, last_found);
+
+	/*
+	 *	Nothing can be using the index now.
+	 */
+	talloc_free(reload->current);
+
+	pthread_cond_destroy(&reload->cond);
+	pthread_mutex_destroy(&reload->mutex);
+
+	return 0;
 }
 
-#ifdef TEST
+/** Parse the format into fields
+ *
+ * Each field is an attribute name, optionally prefixed by any of:
+ *
+ *  - '*' the field is a key.
+ *  - ',' the key is a comma separated list.
+ *  - '=' the attribute goes into the reply list.
+ *  - '~' the attribute goes into the request list.
+ */
+static int passwd_format_parse(rlm_passwd_t *inst, CONF_SECTION *conf)
+{
+	char const	*p, *q;
+	uint32_t	i, k;
+
+	inst->num_fields = 1;
+	for (p = inst->format; *p; p++) if (*p == ':') inst->num_fields++;
 
-#define MALLOC_CHECK_ 1
+	MEM(inst->fields = talloc_zero_array(inst, passwd_field_t, inst->num_fields));
 
-int main(void){
-	struct hashtable *ht;
-	char *buffer;
-	struct mypasswd* pw, *last_found;
-	int i;
+	for (i = 0, p = inst->format; i < inst->num_fields; i++, p = q + 1) {
+		passwd_field_t *field = &inst->fields[i];
 
-	ht = build_hash_table("/etc/group", 4, 3, 1, 100, 0, ":");
-	if(!ht) {
-		printf("Hash table not built\n");
-		return -1;
-	}
-	for (i = 0; i < ht->tablesize; i++) {
-		if (ht->table[i]) {
-			printf("%d:\n", i);
-			for (pw = ht->table[i]; pw; pw = pw->next) {
-				printpw(pw, 4);
+		for (;;) {
+			switch (*p) {
+			case '*':
+				field->key = true;
+				p++;
+				continue;
+
+			case ',':
+				field->listable = true;
+				p++;
+				continue;
+
+			case '=':
+				field->list = PASSWD_LIST_REPLY;
+				p++;
+				continue;
+
+			case '~':
+				field->list = PASSWD_LIST_REQUEST;
+				p++;
+				continue;
+
+			default:
+				break;
 			}
+			break;
 		}
+
+		q = strchr(p, ':');
+		if (!q) q = p + strlen(p);
+
+		MEM(field->name = talloc_bstrndup(inst->fields, p, q - p));
+		if (field->key) inst->num_keys++;
 	}
 
-	while(fgets(buffer, 1024, stdin)){
-		buffer[strlen(buffer)-1] = 0;
-		pw = get_pw_nam(buffer, ht, &last_found);
-		printpw(pw,4);
-		while ((pw = get_next(buffer, ht, &last_found))) printpw(pw,4);
+	if (!inst->num_keys) {
+		cf_log_err(conf, "no field marked as key in format: %s", inst->format);
+		return -1;
 	}
-	release_ht(ht);
-}
 
-#else  /* TEST */
-typedef struct {
-	struct hashtable	*ht;
-	struct mypasswd		*pwd_fmt;
-	char const		*filename;
-	char const		*format;
-	char const		*delimiter;
-	bool			allow_multiple;
-	bool			ignore_nislike;
-	uint32_t		hash_size;
-	uint32_t		num_fields;
-	uint32_t		key_field;
-	uint32_t		listable;
-	fr_dict_attr_t const		*keyattr;
-	bool			ignore_empty;
-} rlm_passwd_t;
+	MEM(inst->keys = talloc_array(inst, uint32_t, inst->num_keys));
+	for (i = 0, k = 0; i < inst->num_fields; i++) {
+		passwd_field_t *field = &inst->fields[i];
 
-static const CONF_PARSER module_config[] = {
-	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED, rlm_passwd_t, filename) },
-	{ FR_CONF_OFFSET("format", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_passwd_t, format) },
-	{ FR_CONF_OFFSET("delimiter", FR_TYPE_STRING, rlm_passwd_t, delimiter), .dflt = ":" },
+		if (!field->key) continue;
 
-	{ FR_CONF_OFFSET("ignore_nislike", FR_TYPE_BOOL, rlm_passwd_t, ignore_nislike), .dflt = "yes" },
+		if (!*field->name) {
+			cf_log_err(conf, "key field is empty");
+			return -1;
+		}
 
-	{ FR_CONF_OFFSET("ignore_empty", FR_TYPE_BOOL, rlm_passwd_t, ignore_empty), .dflt = "yes" },
+		if (fr_dict_attr_by_qualified_name(&field->da, dict_freeradius,
+						   field->name, true) != FR_DICT_ATTR_OK) {
+			cf_log_perr(conf, "Unable to resolve attribute");
+			return -1;
+		}
 
-	{ FR_CONF_OFFSET("allow_multiple_keys", FR_TYPE_BOOL, rlm_passwd_t, allow_multiple), .dflt = "no" },
+		DEBUG3("key field %u(%s) listable: %s", i, field->name, field->listable ? "yes" : "no");
 
-	{ FR_CONF_OFFSET("hash_size", FR_TYPE_UINT32, rlm_passwd_t, hash_size), .dflt = "100" },
-	CONF_PARSER_TERMINATOR
-};
+		inst->keys[k++] = i;
+	}
+
+	return 0;
+}
 
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
-	int			num_fields = 0, key_field = -1, listable = 0;
-	char const		*s;
-	char			*lf = NULL; /* destination list flags temporary */
-	size_t			len;
-	int			i;
-	fr_dict_attr_t const	*da;
 	rlm_passwd_t		*inst = instance;
+	rlm_passwd_reload_t	*reload;
+	int			ret;
 
 	fr_assert(inst->filename && *inst->filename);
 	fr_assert(inst->format && *inst->format);
 
-	if (inst->hash_size == 0) {
-		cf_log_err(conf, "Invalid value '0' for hash_size");
+	if (!inst->delimiter || (strlen(inst->delimiter) != 1) || (*inst->delimiter == '\n')) {
+		cf_log_err(conf, "Invalid delimiter '%s', it must be a single character other than newline",
+			   inst->delimiter ? inst->delimiter : "");
 		return -1;
 	}
 
-	lf = talloc_typed_strdup(inst, inst->format);
-	if (!lf) {
-		ERROR("Memory allocation failed for lf");
+	if (inst->reload_interval && (inst->reload_interval < NSEC)) {
+		cf_log_err(conf, "reload_interval must be at least 1 second");
 		return -1;
 	}
-	memset(lf, 0, strlen(inst->format));
-
-	s = inst->format - 1;
-	do {
-		if(s == inst->format - 1 || *s == ':'){
-			if(*(s+1) == '*'){
-				key_field = num_fields;
-				s++;
-			}
-			if(*(s+1) == ','){
-				listable = 1;
-				s++;
-			}
-			if(*(s+1) == '='){
-				lf[num_fields]=1;
-				s++;
-			}
-			if(*(s+1) == '~'){
-				lf[num_fields]=2;
-				s++;
-			}
-			num_fields++;
-		}
-		s++;
-	} while(*s);
 
-	if(key_field < 0) {
-		cf_log_err(conf, "no field marked as key in format: %s",
-			      inst->format);
-		return -1;
-	}
+	if (passwd_format_parse(inst, conf) < 0) return -1;
 
-	inst->ht = build_hash_table(inst->filename, num_fields, key_field, listable,
-				    inst->hash_size, inst->ignore_nislike, *inst->delimiter);
-	if (!inst->ht){
-		ERROR("Can't build hashtable from passwd file");
-		return -1;
-	}
+	DEBUG3("num_fields: %u num_keys: %u", inst->num_fields, inst->num_keys);
 
-	inst->pwd_fmt = mypasswd_alloc(inst->format, num_fields, &len);
-	if (!inst->pwd_fmt){
-		ERROR("Memory allocation failed");
-		release_ht(inst->ht);
-		inst->ht = NULL;
-		return -1;
-	}
-	if (!string_to_entry(inst->format, num_fields, ':', inst->pwd_fmt , len)) {
-		ERROR("Unable to convert format entry");
-		release_ht(inst->ht);
-		inst->ht = NULL;
-		return -1;
+	if (!inst->reload_interval) {
+		inst->index = passwd_index_build(conf, inst);
+		if (!inst->index) return -1;
+
+		talloc_steal(inst, inst->index);
+		return 0;
 	}
 
-	memcpy(inst->pwd_fmt->listflag, lf, num_fields);
+	MEM(reload = talloc_zero(inst, rlm_passwd_reload_t));
+	reload->inst = inst;
+	pthread_mutex_init(&reload->mutex, NULL);
+	pthread_cond_init(&reload->cond, NULL);
+	talloc_set_destructor(reload, _passwd_reload_free);
+	inst->reload = reload;
 
-	talloc_free(lf);
-	for (i=0; i<num_fields; i++) {
-		if (*inst->pwd_fmt->field[i] == '*') inst->pwd_fmt->field[i]++;
-		if (*inst->pwd_fmt->field[i] == ',') inst->pwd_fmt->field[i]++;
-		if (*inst->pwd_fmt->field[i] == '=') inst->pwd_fmt->field[i]++;
-		if (*inst->pwd_fmt->field[i] == '~') inst->pwd_fmt->field[i]++;
-	}
-	if (!*inst->pwd_fmt->field[key_field]) {
-		cf_log_err(conf, "key field is empty");
-		release_ht(inst->ht);
-		inst->ht = NULL;
-		return -1;
-	}
+	reload->current = passwd_index_build(conf, inst);
+	if (!reload->current) return -1;
 
-	if (fr_dict_attr_by_qualified_name(&da, dict_freeradius,
-					   inst->pwd_fmt->field[key_field], true) != FR_DICT_ATTR_OK) {
-		PERROR("Unable to resolve attribute");
-		release_ht(inst->ht);
-		inst->ht = NULL;
+	ret = pthread_create(&reload->thread, NULL, passwd_reload_thread, reload);
+	if (ret != 0) {
+		cf_log_err(conf, "Failed creating reload thread: %s", fr_syserror(ret));
 		return -1;
 	}
+	reload->running = true;
 
-	inst->keyattr = da;
-	inst->num_fields = num_fields;
-	inst->key_field = key_field;
-	inst->listable = listable;
+	return 0;
+}
 
-	DEBUG3("num_fields: %d key_field %d(%s) listable: %s", num_fields, key_field,
-	       inst->pwd_fmt->field[key_field], listable ? "yes" : "no");
+/** Split a matching line into its fields
+ *
+ * @param[in] idx	the line is in.
+ * @param[in] offset	of the line.
+ * @param[in,out] buffer	to copy the line into, grown if required.
+ * @param[in,out] bufsize	size of buffer.
+ * @param[out] field	one entry per field, NULL for fields the line doesn't have.
+ */
+static void passwd_line_split(TALLOC_CTX *ctx, rlm_passwd_index_t const *idx, size_t offset,
+			      char **buffer, size_t *bufsize, char **field)
+{
+	rlm_passwd_t const	*inst = idx->inst;
+	uint8_t const		*line = idx->map + offset;
+	size_t			len = passwd_line_end(idx, offset) - line;
+	char			*p, *q;
+	uint32_t		i;
+
+	if (len >= *bufsize) {
+		*bufsize = len + 1;
+		MEM(*buffer = talloc_realloc(ctx, *buffer, char, *bufsize));
+	}
+	memcpy(*buffer, line, len);
+	(*buffer)[len] = '\0';
 
-	return 0;
+	for (i = 0, p = *buffer; i < inst->num_fields; i++) {
+		field[i] = p;
+		if (!p) continue;
 
-#undef inst
-}
+		if (i == (inst->num_fields - 1)) break;
 
-static int mod_detach (void *instance) {
-#define inst ((rlm_passwd_t *)instance)
-	if(inst->ht) {
-		release_ht(inst->ht);
-		inst->ht = NULL;
+		q = strchr(p, *inst->delimiter);
+		if (q) *q++ = '\0';
+		p = q;
 	}
-	talloc_free(inst->pwd_fmt);
-	return 0;
-#undef inst
 }
 
 static void result_add(TALLOC_CTX *ctx, rlm_passwd_t const *inst, REQUEST *request,
-		       VALUE_PAIR **vps, struct mypasswd * pw, char when, char const *listname)
+		       VALUE_PAIR **vps, char **field, passwd_list_t when, char const *listname)
 {
 	uint32_t i;
 	VALUE_PAIR *vp;
 
 	for (i = 0; i < inst->num_fields; i++) {
-		if (inst->pwd_fmt->field[i] && *inst->pwd_fmt->field[i] && pw->field[i] &&
-		    (i != inst->key_field) && inst->pwd_fmt->listflag[i] == when) {
-			if (!inst->ignore_empty || pw->field[i][0] != 0 ) { /* if value in key/value pair is not empty */
+		if (*inst->fields[i].name && field[i] && !inst->fields[i].key && (inst->fields[i].list == when)) {
+			if (!inst->ignore_empty || field[i][0] != 0 ) { /* if value in key/value pair is not empty */
 				vp = fr_pair_make(ctx, request->dict,
-						  vps, inst->pwd_fmt->field[i], pw->field[i], T_OP_EQ);
+						  vps, inst->fields[i].name, field[i], T_OP_EQ);
 				if (vp) {
-					RDEBUG2("Added %s: '%s' to %s ", inst->pwd_fmt->field[i], pw->field[i], listname);
+					RDEBUG2("Added %s: '%s' to %s ", inst->fields[i].name, field[i], listname);
 				}
 			} else
-				RDEBUG2("NOOP %s: '%s' to %s ", inst->pwd_fmt->field[i], pw->field[i], listname);
+				RDEBUG2("NOOP %s: '%s' to %s ", inst->fields[i].name, field[i], listname);
 		}
 	}
 }
@@ -535,37 +758,74 @@ static void result_add(TALLOC_CTX *ctx, rlm_passwd_t const *inst, REQUEST *reque
 static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(module_ctx_t const *mctx, REQUEST *request)
 {
 	rlm_passwd_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_passwd_t);
+	rlm_passwd_index_t	*idx;
 
 	char			buffer[1024];
+	char			*line = NULL;
+	size_t			linesize = 0;
+	char			**field;
 	VALUE_PAIR		*key, *i;
-	struct mypasswd		*pw, *last_found;
 	fr_cursor_t		cursor;
+	uint32_t		k;
 	int			found = 0;
 
-	key = fr_pair_find_by_da(request->packet->vps, inst->keyattr, TAG_ANY);
-	if (!key) return RLM_MODULE_NOTFOUND;
+	idx = passwd_index_acquire(inst);
+	if (!idx->num_slots) {
+		passwd_index_release(inst, idx);
+		return RLM_MODULE_NOTFOUND;
+	}
 
-	for (i = fr_cursor_iter_by_da_init(&cursor, &key, inst->keyattr);
-	     i;
-	     i = fr_cursor_next(&cursor)) {
-		/*
-		 *	Ensure we have the string form of the attribute
-		 */
-		fr_pair_value_snprint(buffer, sizeof(buffer), i, 0);
-		pw = get_pw_nam(buffer, inst->ht, &last_found);
-		if (!pw) continue;
+	MEM(field = talloc_array(request, char *, inst->num_fields));
+
+	/*
+	 *	Use the first key field which has an attribute in the
+	 *	request, in the order they're listed in the format.
+	 */
+	for (k = 0; (k < inst->num_keys) && !found; k++) {
+		fr_dict_attr_t const *da = inst->fields[inst->keys[k]].da;
 
-		do {
-			result_add(request, inst, request, &request->control, pw, 0, "config");
-			result_add(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
-			result_add(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
-		} while ((pw = get_next(buffer, inst->ht, &last_found)));
+		key = fr_pair_find_by_da(request->packet->vps, da, TAG_ANY);
+		if (!key) continue;
 
-		found++;
+		for (i = fr_cursor_iter_by_da_init(&cursor, &key, da);
+		     i;
+		     i = fr_cursor_next(&cursor)) {
+			size_t		len, pos, offset;
+			uint32_t	hash;
 
-		if (!inst->allow_multiple) break;
+			/*
+			 *	Ensure we have the string form of the attribute
+			 */
+			len = fr_pair_value_snprint(buffer, sizeof(buffer), i, 0);
+			if (is_truncated(len, sizeof(buffer)) || !len) continue;
+
+			hash = fr_hash(buffer, len);
+			pos = hash & (idx->num_slots - 1);
+
+			offset = passwd_slot_next(idx, k, buffer, len, hash, &pos);
+			if (!offset) continue;
+
+			do {
+				passwd_line_split(request, idx, offset - 1, &line, &linesize, field);
+
+				result_add(request, inst, request, &request->control, field,
+					   PASSWD_LIST_CONTROL, "config");
+				result_add(request->reply, inst, request, &request->reply->vps, field,
+					   PASSWD_LIST_REPLY, "reply_items");
+				result_add(request->packet, inst, request, &request->packet->vps, field,
+					   PASSWD_LIST_REQUEST, "request_items");
+			} while ((offset = passwd_slot_next(idx, k, buffer, len, hash, &pos)));
+
+			found++;
+
+			if (!inst->allow_multiple) break;
+		}
 	}
 
+	passwd_index_release(inst, idx);
+	talloc_free(line);
+	talloc_free(field);
+
 	if (!found) return RLM_MODULE_NOTFOUND;
 
 	return RLM_MODULE_OK;
@@ -578,7 +838,6 @@ module_t rlm_passwd = {
 	.inst_size	= sizeof(rlm_passwd_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
-	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_passwd_map,
 		[MOD_ACCOUNTING]	= mod_passwd_map,
@@ -591,4 +850,3 @@ module_t rlm_passwd = {
 #endif
 	},
 };
-#endif /* TEST */
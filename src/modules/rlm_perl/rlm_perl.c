@@ -72,7 +72,6 @@ typedef struct {
 	char const	*perl_flags;
 	PerlInterpreter	*perl;
 	bool		perl_parsed;
-	pthread_key_t	*thread_key;
 
 #ifdef USE_ITHREADS
 	pthread_mutex_t	clone_mutex;
@@ -82,6 +81,36 @@ typedef struct {
 
 } rlm_perl_t;
 
+/** Per-thread interpreter
+ *
+ */
+typedef struct {
+	PerlInterpreter	*perl;		//!< Clone of the parent interpreter, created
+					///< when the thread is instantiated.
+} rlm_perl_thread_t;
+
+/** State for one of the %RAD_* hashes while a perl function is running
+ *
+ * The hashes are tied to this structure, so attributes are only
+ * converted to Perl values when the script reads them, and only
+ * the attributes the script modified are converted back.
+ */
+typedef struct {
+	REQUEST		*request;	//!< The current request.
+	TALLOC_CTX	*ctx;		//!< To allocate new pairs in.
+	VALUE_PAIR	**vps;		//!< The list the hash represents.
+	char const	*hash_name;	//!< Name of the Perl hash, for debug messages.
+	char const	*list_name;	//!< Name of the list, for debug messages.
+
+	HV		*values;	//!< Values materialised or assigned so far.
+	HV		*dirty;		//!< Keys assigned or deleted by the script.
+	SV		*obj;		//!< The object the hash is tied to.
+	bool		cleared;	//!< The script cleared, or assigned to, the whole hash.
+	bool		complete;	//!< Every attribute in the list has been materialised.
+} rlm_perl_list_t;
+
+#define RLM_PERL_PAIRLIST "radiusd::pairlist"
+
 static void *perl_dlhandle;		//!< To allow us to load perl's symbols into the global symbol table.
 
 /*
@@ -244,24 +273,13 @@ static void rlm_destroy_perl(PerlInterpreter *perl)
 	rlm_perl_destruct(perl);
 }
 
-/* Create Key */
-static void rlm_perl_make_key(pthread_key_t *key)
+static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl)
 {
-	pthread_key_create(key, (void (*)(void *))rlm_destroy_perl);
-}
-
-static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key)
-{
-	int ret;
-
 	PerlInterpreter *interp;
 	UV clone_flags = 0;
 
 	PERL_SET_CONTEXT(perl);
 
-	interp = pthread_getspecific(*key);
-	if (interp) return interp;
-
 	interp = perl_clone(perl, clone_flags);
 	{
 		dTHXa(interp);
@@ -275,14 +293,6 @@ static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key
 	PERL_SET_CONTEXT(aTHX);
 	rlm_perl_clear_handles(aTHX);
 
-	ret = pthread_setspecific(*key, interp);
-	if (ret != 0) {
-		DEBUG("Failed associating interpretor with thread %s", fr_syserror(ret));
-
-		rlm_perl_destruct(interp);
-		return NULL;
-	}
-
 	return interp;
 }
 #endif
@@ -345,6 +355,464 @@ static XS(XS_radiusd_xlat)
 	XSRETURN(1);
 }
 
+/*
+ *
+ *     Verify that a Perl SV is a string and save it in FreeRadius
+ *     Value Pair Format
+ *
+ */
+static int pairadd_sv(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, char *key, SV *sv, fr_token_t op,
+		      const char *hash_name, const char *list_name)
+{
+	char		*val;
+	VALUE_PAIR      *vp;
+	STRLEN		len;
+
+	if (!SvOK(sv)) return -1;
+
+	val = SvPV(sv, len);
+	vp = fr_pair_make(ctx, request->dict, vps, key, NULL, op);
+	if (!vp) {
+	fail:
+		REDEBUG("Failed to create pair %s:%s %s %s", list_name, key,
+			fr_table_str_by_value(fr_tokens_table, op, "<INVALID>"), val);
+		return -1;
+	}
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		fr_pair_value_bstrndup(vp, val, len, true);
+		break;
+
+	case FR_TYPE_OCTETS:
+		fr_pair_value_memdup(vp, (uint8_t const *)val, len, true);
+		break;
+
+	default:
+		if (fr_pair_value_from_str(vp, val, len, '\0', false) < 0) goto fail;
+	}
+
+	VP_VERIFY(vp);
+
+	RDEBUG2("&%s:%s %s $%s{'%s'} -> '%s'", list_name, key, fr_table_str_by_value(fr_tokens_table, op, "<INVALID>"),
+	        hash_name, key, val);
+	return 0;
+}
+
+/** Get the hash key an attribute is stored under
+ *
+ * Tagged attributes are stored under <attribute>:<tag>, others just
+ * use the normal attribute name.
+ */
+static char const *perl_vp_key(char *buff, size_t bufflen, VALUE_PAIR const *vp)
+{
+	if (vp->da->flags.has_tag && (vp->tag != TAG_ANY)) {
+		snprintf(buff, bufflen, "%s:%d", vp->da->name, vp->tag);
+		return buff;
+	}
+
+	return vp->da->name;
+}
+
+/** Convert a single attribute to a Perl scalar
+ *
+ * @param[in] list	the attribute is in.
+ * @param[in] vp	to convert.
+ * @param[in] key	the attribute is stored under.
+ * @param[in] i		index of the attribute in an array, or -1 if it's
+ *			the only attribute stored under this key.
+ */
+static SV *perl_vp_to_sv(rlm_perl_list_t *list, VALUE_PAIR const *vp, char const *key, int i)
+{
+	REQUEST	*request = list->request;
+	SV	*sv;
+	char	idx[16] = "";
+
+	if (i >= 0) snprintf(idx, sizeof(idx), "[%i]", i);
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		RDEBUG2("$%s{'%s'}%s = &%s:%s -> '%pV'", list->hash_name, key, idx,
+			list->list_name, vp->da->name, &vp->data);
+		sv = newSVpvn(vp->vp_strvalue, vp->vp_length);
+		break;
+
+	case FR_TYPE_OCTETS:
+		RDEBUG2("$%s{'%s'}%s = &%s:%s -> %pV", list->hash_name, key, idx,
+			list->list_name, vp->da->name, &vp->data);
+		sv = newSVpvn((char const *)vp->vp_octets, vp->vp_length);
+		break;
+
+	default:
+	{
+		char	buffer[1024];
+		size_t	len;
+
+		len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, '\0');
+		RDEBUG2("$%s{'%s'}%s = &%s:%s -> '%s'", list->hash_name, key, idx,
+			list->list_name, vp->da->name, buffer);
+		sv = newSVpvn(buffer, truncate_len(len, sizeof(buffer)));
+	}
+		break;
+	}
+
+	if (i >= 0) SvTAINT(sv);
+
+	return sv;
+}
+
+/** Convert all the attributes stored under a key to a Perl value
+ *
+ * If one key has multiple attributes they're added as an array_ref.
+ * Example for this is Cisco-AVPair that holds multiple values.
+ * Which will be available as array_ref in $RAD_REQUEST{'Cisco-AVPair'}
+ *
+ * @return
+ *	- The value, owned by list->values.
+ *	- NULL if there are no attributes stored under this key.
+ */
+static SV *perl_list_materialise(rlm_perl_list_t *list, char const *key)
+{
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp, *first = NULL;
+	AV		*av = NULL;
+	SV		*sv;
+	int		i = 0;
+	char		buff[256];
+
+	for (vp = fr_cursor_init(&cursor, list->vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		if (strcmp(perl_vp_key(buff, sizeof(buff), vp), key) != 0) continue;
+
+		if (!first) {
+			first = vp;
+			continue;
+		}
+
+		if (!av) {
+			av = newAV();
+			av_push(av, perl_vp_to_sv(list, first, key, i++));
+		}
+		av_push(av, perl_vp_to_sv(list, vp, key, i++));
+	}
+	if (!first) return NULL;
+
+	if (av) {
+		sv = newRV_noinc((SV *)av);
+	} else {
+		sv = perl_vp_to_sv(list, first, key, -1);
+	}
+	(void)hv_store(list->values, key, strlen(key), sv, 0);
+
+	return sv;
+}
+
+/** Find the value stored under a key, materialising it if needed
+ *
+ */
+static SV *perl_list_fetch(rlm_perl_list_t *list, char const *key)
+{
+	SV **svp;
+
+	svp = hv_fetch(list->values, key, strlen(key), 0);
+	if (svp) return *svp;
+
+	/*
+	 *	Deleted, or there's nothing left to materialise.
+	 */
+	if (list->cleared || list->complete || hv_exists(list->dirty, key, strlen(key))) return NULL;
+
+	return perl_list_materialise(list, key);
+}
+
+/** Materialise every attribute in the list, so the hash can be iterated over
+ *
+ */
+static void perl_list_complete(rlm_perl_list_t *list)
+{
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	char const	*key;
+	char		buff[256];
+
+	if (list->cleared || list->complete) return;
+
+	for (vp = fr_cursor_init(&cursor, list->vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		key = perl_vp_key(buff, sizeof(buff), vp);
+		if (hv_exists(list->values, key, strlen(key)) || hv_exists(list->dirty, key, strlen(key))) continue;
+
+		(void) perl_list_materialise(list, key);
+	}
+
+	list->complete = true;
+}
+
+/** Remove all attributes stored under a key from the list
+ *
+ */
+static void perl_list_remove(rlm_perl_list_t *list, char const *key)
+{
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	char		buff[256];
+
+	for (vp = fr_cursor_init(&cursor, list->vps);
+	     vp;
+	     vp = fr_cursor_current(&cursor)) {
+		if (strcmp(perl_vp_key(buff, sizeof(buff), vp), key) == 0) {
+			talloc_free(fr_cursor_remove(&cursor));
+			continue;
+		}
+		vp = fr_cursor_next(&cursor);
+	}
+}
+
+/** Write the attributes the script modified back to the list
+ *
+ * Array references are always written back, as the script may
+ * have modified the array in place.
+ */
+static void perl_list_write_back(rlm_perl_list_t *list)
+{
+	REQUEST	*request = list->request;
+	HE	*he;
+	SV	*sv, **av_sv;
+	AV	*av;
+	char	*key;
+	I32	key_len, len, j;
+	bool	is_array;
+
+	if (list->cleared) {
+		fr_pair_list_free(list->vps);
+	} else {
+		/*
+		 *	Attributes the script deleted.
+		 */
+		hv_iterinit(list->dirty);
+		while ((he = hv_iternext(list->dirty))) {
+			key = hv_iterkey(he, &key_len);
+			if (hv_exists(list->values, key, key_len)) continue;
+
+			RDEBUG2("&%s:%s removed by delete $%s{'%s'}", list->list_name, key, list->hash_name, key);
+			perl_list_remove(list, key);
+		}
+	}
+
+	hv_iterinit(list->values);
+	while ((he = hv_iternext(list->values))) {
+		key = hv_iterkey(he, &key_len);
+		sv = hv_iterval(list->values, he);
+		is_array = SvROK(sv) && (SvTYPE(SvRV(sv)) == SVt_PVAV);
+
+		if (!list->cleared) {
+			if (!is_array && !hv_exists(list->dirty, key, key_len)) continue;
+
+			perl_list_remove(list, key);
+		}
+
+		if (!is_array) {
+			(void) pairadd_sv(list->ctx, request, list->vps, key, sv, T_OP_EQ,
+					  list->hash_name, list->list_name);
+			continue;
+		}
+
+		av = (AV *)SvRV(sv);
+		len = av_len(av);
+		for (j = 0; j <= len; j++) {
+			av_sv = av_fetch(av, j, 0);
+			if (!av_sv) continue;
+
+			(void) pairadd_sv(list->ctx, request, list->vps, key, *av_sv, T_OP_ADD,
+					  list->hash_name, list->list_name);
+		}
+	}
+
+	if (*list->vps) LIST_VERIFY(*list->vps);
+}
+
+/** Tie one of the %RAD_* hashes to a list for the duration of a call
+ *
+ */
+static void perl_list_tie(HV *hv, rlm_perl_list_t *list, REQUEST *request, TALLOC_CTX *ctx, VALUE_PAIR **vps,
+			  char const *hash_name, char const *list_name)
+{
+	SV *ref;
+
+	*list = (rlm_perl_list_t) {
+		.request = request,
+		.ctx = ctx,
+		.vps = vps,
+		.hash_name = hash_name,
+		.list_name = list_name,
+		.values = newHV(),
+		.dirty = newHV()
+	};
+
+	list->obj = newSViv(PTR2IV(list));
+	ref = newRV_noinc(list->obj);
+	sv_bless(ref, gv_stashpv(RLM_PERL_PAIRLIST, GV_ADD));
+
+	sv_unmagic((SV *)hv, PERL_MAGIC_tied);
+	hv_clear(hv);
+	sv_magic((SV *)hv, ref, PERL_MAGIC_tied, NULL, 0);
+	SvREFCNT_dec(ref);	/* The magic holds its own reference */
+}
+
+/** Write back any modifications, and untie the hash
+ *
+ * The object is invalidated, in case the script kept a reference to it.
+ */
+static void perl_list_untie(HV *hv, rlm_perl_list_t *list)
+{
+	perl_list_write_back(list);
+
+	sv_setiv(list->obj, 0);
+	sv_unmagic((SV *)hv, PERL_MAGIC_tied);
+
+	SvREFCNT_dec((SV *)list->values);
+	SvREFCNT_dec((SV *)list->dirty);
+}
+
+static rlm_perl_list_t *perl_list_from_sv(SV *obj)
+{
+	rlm_perl_list_t *list;
+
+	if (!SvROK(obj) || !sv_derived_from(obj, RLM_PERL_PAIRLIST)) croak("Not a " RLM_PERL_PAIRLIST " object");
+
+	list = INT2PTR(rlm_perl_list_t *, SvIV(SvRV(obj)));
+	if (!list) croak("Attribute lists are only available while the request is being processed");
+
+	return list;
+}
+
+static XS(XS_pairlist_FETCH)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+	SV		*sv;
+
+	if (items != 2) croak("Usage: " RLM_PERL_PAIRLIST "::FETCH(self, key)");
+
+	list = perl_list_from_sv(ST(0));
+	sv = perl_list_fetch(list, SvPV_nolen(ST(1)));
+	if (!sv) XSRETURN_UNDEF;
+
+	ST(0) = sv_mortalcopy(sv);
+	XSRETURN(1);
+}
+
+static XS(XS_pairlist_STORE)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+	char const	*key;
+	STRLEN		key_len;
+
+	if (items != 3) croak("Usage: " RLM_PERL_PAIRLIST "::STORE(self, key, value)");
+
+	list = perl_list_from_sv(ST(0));
+	key = SvPV(ST(1), key_len);
+
+	(void)hv_store(list->values, key, key_len, newSVsv(ST(2)), 0);
+	(void)hv_store(list->dirty, key, key_len, newSViv(1), 0);
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_pairlist_DELETE)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+	char const	*key;
+	STRLEN		key_len;
+	SV		*sv;
+
+	if (items != 2) croak("Usage: " RLM_PERL_PAIRLIST "::DELETE(self, key)");
+
+	list = perl_list_from_sv(ST(0));
+	key = SvPV(ST(1), key_len);
+
+	sv = perl_list_fetch(list, key);
+	if (sv) sv = sv_mortalcopy(sv);
+
+	(void)hv_delete(list->values, key, key_len, G_DISCARD);
+	(void)hv_store(list->dirty, key, key_len, newSViv(1), 0);
+
+	if (!sv) XSRETURN_UNDEF;
+
+	ST(0) = sv;
+	XSRETURN(1);
+}
+
+static XS(XS_pairlist_CLEAR)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+
+	if (items != 1) croak("Usage: " RLM_PERL_PAIRLIST "::CLEAR(self)");
+
+	list = perl_list_from_sv(ST(0));
+
+	hv_clear(list->values);
+	hv_clear(list->dirty);
+	list->cleared = true;
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_pairlist_EXISTS)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+
+	if (items != 2) croak("Usage: " RLM_PERL_PAIRLIST "::EXISTS(self, key)");
+
+	list = perl_list_from_sv(ST(0));
+	if (!perl_list_fetch(list, SvPV_nolen(ST(1)))) XSRETURN_NO;
+
+	XSRETURN_YES;
+}
+
+static XS(XS_pairlist_NEXTKEY)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+	HE		*he;
+
+	if (items < 1) croak("Usage: " RLM_PERL_PAIRLIST "::NEXTKEY(self, lastkey)");
+
+	list = perl_list_from_sv(ST(0));
+
+	he = hv_iternext(list->values);
+	if (!he) XSRETURN_UNDEF;
+
+	ST(0) = hv_iterkeysv(he);
+	XSRETURN(1);
+}
+
+static XS(XS_pairlist_FIRSTKEY)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+	HE		*he;
+
+	if (items != 1) croak("Usage: " RLM_PERL_PAIRLIST "::FIRSTKEY(self)");
+
+	list = perl_list_from_sv(ST(0));
+
+	perl_list_complete(list);
+
+	hv_iterinit(list->values);
+	he = hv_iternext(list->values);
+	if (!he) XSRETURN_UNDEF;
+
+	ST(0) = hv_iterkeysv(he);
+	XSRETURN(1);
+}
+
 static void xs_init(pTHX)
 {
 	char const *file = __FILE__;
@@ -354,6 +822,14 @@ static void xs_init(pTHX)
 
 	newXS("radiusd::log",XS_radiusd_log, "rlm_perl");
 	newXS("radiusd::xlat",XS_radiusd_xlat, "rlm_perl");
+
+	newXS(RLM_PERL_PAIRLIST "::FETCH", XS_pairlist_FETCH, "rlm_perl");
+	newXS(RLM_PERL_PAIRLIST "::STORE", XS_pairlist_STORE, "rlm_perl");
+	newXS(RLM_PERL_PAIRLIST "::DELETE", XS_pairlist_DELETE, "rlm_perl");
+	newXS(RLM_PERL_PAIRLIST "::CLEAR", XS_pairlist_CLEAR, "rlm_perl");
+	newXS(RLM_PERL_PAIRLIST "::EXISTS", XS_pairlist_EXISTS, "rlm_perl");
+	newXS(RLM_PERL_PAIRLIST "::FIRSTKEY", XS_pairlist_FIRSTKEY, "rlm_perl");
+	newXS(RLM_PERL_PAIRLIST "::NEXTKEY", XS_pairlist_NEXTKEY, "rlm_perl");
 }
 
 /** Call perl code using an xlat
@@ -365,28 +841,18 @@ static ssize_t perl_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 			 REQUEST *request, char const *fmt)
 {
 
-	rlm_perl_t	*inst;
-	char		*tmp;
-	char const	*p, *q;
-	int		count;
-	size_t		ret = 0;
-	STRLEN		n_a;
+	rlm_perl_t		*inst;
+	rlm_perl_thread_t	*t;
+	char			*tmp;
+	char const		*p, *q;
+	int			count;
+	size_t			ret = 0;
+	STRLEN			n_a;
 
 	memcpy(&inst, &mod_inst, sizeof(inst));
 
-#ifdef USE_ITHREADS
-	PerlInterpreter *interp;
-
-	pthread_mutex_lock(&inst->clone_mutex);
-	interp = rlm_perl_clone(inst->perl, inst->thread_key);
-	{
-		dTHXa(interp);
-		PERL_SET_CONTEXT(interp);
-	}
-	pthread_mutex_unlock(&inst->clone_mutex);
-#else
-	PERL_SET_CONTEXT(inst->perl);
-#endif
+	t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_perl_thread_t);
+	PERL_SET_CONTEXT(t->perl);
 	{
 		dSP;
 		ENTER;SAVETMPS;
@@ -552,12 +1018,9 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 #ifdef USE_ITHREADS
 	/*
-	 *	Create pthread key. This key will be stored in instance
+	 *	Serialises cloning the interpreter in each thread
 	 */
 	pthread_mutex_init(&inst->clone_mutex, NULL);
-
-	MEM(inst->thread_key = talloc_zero(inst, pthread_key_t));
-	rlm_perl_make_key(inst->thread_key);
 #endif
 
 	/*
@@ -633,218 +1096,13 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
-static void perl_vp_to_svpvn_element(REQUEST *request, AV *av, VALUE_PAIR const *vp,
-				     int *i, const char *hash_name, const char *list_name)
-{
-
-	SV *sv;
-
-	switch (vp->vp_type) {
-	case FR_TYPE_STRING:
-		RDEBUG2("$%s{'%s'}[%i] = &%s:%s -> '%s'", hash_name, vp->da->name, *i,
-		        list_name, vp->da->name, vp->vp_strvalue);
-		sv = newSVpvn(vp->vp_strvalue, vp->vp_length);
-		break;
-
-	case FR_TYPE_OCTETS:
-		RDEBUG2("$%s{'%s'}[%i] = &%s:%s -> 0x%pH", hash_name, vp->da->name, *i,
-		        list_name, vp->da->name, &vp->data);
-		sv = newSVpvn((char const *)vp->vp_octets, vp->vp_length);
-		break;
-
-	default:
-	{
-		char	buffer[1024];
-		size_t	len;
-
-		len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, '\0');
-		RDEBUG2("$%s{'%s'}[%i] = &%s:%s -> '%s'", hash_name, vp->da->name, *i,
-		        list_name, vp->da->name, buffer);
-		sv = newSVpvn(buffer, truncate_len(len, sizeof(buffer)));
-	}
-		break;
-	}
-
-	if (!sv) return;
-	SvTAINT(sv);
-	av_push(av, sv);
-	(*i)++;
-}
-
-/*
- *  	get the vps and put them in perl hash
- *  	If one VP have multiple values it is added as array_ref
- *  	Example for this is Cisco-AVPair that holds multiple values.
- *  	Which will be available as array_ref in $RAD_REQUEST{'Cisco-AVPair'}
- */
-static void perl_store_vps(UNUSED TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, HV *rad_hv,
-			   const char *hash_name, const char *list_name)
-{
-	VALUE_PAIR *vp;
-
-	hv_undef(rad_hv);
-
-	fr_cursor_t cursor;
-
-	RINDENT();
-	fr_pair_list_sort(vps, fr_pair_cmp_by_da_tag);
-	for (vp = fr_cursor_init(&cursor, vps);
-	     vp;
-	     vp = fr_cursor_next(&cursor)) {
-		VALUE_PAIR *next;
-
-		char const *name;
-		char namebuf[256];
-
-		/*
-		 *	Tagged attributes are added to the hash with name
-		 *	<attribute>:<tag>, others just use the normal attribute
-		 *	name as the key.
-		 */
-		if (vp->da->flags.has_tag && (vp->tag != TAG_ANY)) {
-			snprintf(namebuf, sizeof(namebuf), "%s:%d", vp->da->name, vp->tag);
-			name = namebuf;
-		} else {
-			name = vp->da->name;
-		}
-
-		/*
-		 *	We've sorted by type, then tag, so attributes of the
-		 *	same type/tag should follow on from each other.
-		 */
-		if ((next = fr_cursor_next_peek(&cursor)) && ATTRIBUTE_EQ(vp, next)) {
-			int i = 0;
-			AV *av;
-
-			av = newAV();
-			perl_vp_to_svpvn_element(request, av, vp, &i, hash_name, list_name);
-			do {
-				perl_vp_to_svpvn_element(request, av, next, &i, hash_name, list_name);
-				fr_cursor_next(&cursor);
-			} while ((next = fr_cursor_next_peek(&cursor)) && ATTRIBUTE_EQ(vp, next));
-			(void)hv_store(rad_hv, name, strlen(name), newRV_noinc((SV *)av), 0);
-
-			continue;
-		}
-
-		/*
-		 *	It's a normal single valued attribute
-		 */
-		switch (vp->vp_type) {
-		case FR_TYPE_STRING:
-			RDEBUG2("$%s{'%s'} = &%s:%s -> '%pV'", hash_name, vp->da->name, list_name,
-			       vp->da->name, &vp->data);
-			(void)hv_store(rad_hv, name, strlen(name), newSVpvn(vp->vp_strvalue, vp->vp_length), 0);
-			break;
-
-		case FR_TYPE_OCTETS:
-			RDEBUG2("$%s{'%s'} = &%s:%s -> %pV", hash_name, vp->da->name, list_name,
-			       vp->da->name, &vp->data);
-			(void)hv_store(rad_hv, name, strlen(name),
-				       newSVpvn((char const *)vp->vp_octets, vp->vp_length), 0);
-			break;
-
-		default:
-		{
-			char buffer[1024];
-			size_t len;
-
-			len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, '\0');
-			RDEBUG2("$%s{'%s'} = &%s:%s -> '%s'", hash_name, vp->da->name,
-			       list_name, vp->da->name, buffer);
-			(void)hv_store(rad_hv, name, strlen(name),
-				       newSVpvn(buffer, truncate_len(len, sizeof(buffer))), 0);
-		}
-			break;
-		}
-	}
-	REXDENT();
-}
-
-/*
- *
- *     Verify that a Perl SV is a string and save it in FreeRadius
- *     Value Pair Format
- *
- */
-static int pairadd_sv(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, char *key, SV *sv, fr_token_t op,
-		      const char *hash_name, const char *list_name)
-{
-	char		*val;
-	VALUE_PAIR      *vp;
-	STRLEN		len;
-
-	if (!SvOK(sv)) return -1;
-
-	val = SvPV(sv, len);
-	vp = fr_pair_make(ctx, request->dict, vps, key, NULL, op);
-	if (!vp) {
-	fail:
-		REDEBUG("Failed to create pair %s:%s %s %s", list_name, key,
-			fr_table_str_by_value(fr_tokens_table, op, "<INVALID>"), val);
-		return -1;
-	}
-
-	switch (vp->vp_type) {
-	case FR_TYPE_STRING:
-		fr_pair_value_bstrndup(vp, val, len, true);
-		break;
-
-	case FR_TYPE_OCTETS:
-		fr_pair_value_memdup(vp, (uint8_t const *)val, len, true);
-		break;
-
-	default:
-		if (fr_pair_value_from_str(vp, val, len, '\0', false) < 0) goto fail;
-	}
-
-	VP_VERIFY(vp);
-
-	RDEBUG2("&%s:%s %s $%s{'%s'} -> '%s'", list_name, key, fr_table_str_by_value(fr_tokens_table, op, "<INVALID>"),
-	        hash_name, key, val);
-	return 0;
-}
-
-/*
- *     Gets the content from hashes
- */
-static int get_hv_content(TALLOC_CTX *ctx, REQUEST *request, HV *my_hv, VALUE_PAIR **vps,
-			  const char *hash_name, const char *list_name)
-{
-	SV		*res_sv, **av_sv;
-	AV		*av;
-	char		*key;
-	I32		key_len, len, i, j;
-	int		ret = 0;
-
-	*vps = NULL;
-	for (i = hv_iterinit(my_hv); i > 0; i--) {
-		res_sv = hv_iternextsv(my_hv,&key,&key_len);
-		if (SvROK(res_sv) && (SvTYPE(SvRV(res_sv)) == SVt_PVAV)) {
-			av = (AV*)SvRV(res_sv);
-			len = av_len(av);
-			for (j = 0; j <= len; j++) {
-				av_sv = av_fetch(av, j, 0);
-				ret = pairadd_sv(ctx, request, vps, key, *av_sv, T_OP_ADD, hash_name, list_name) + ret;
-			}
-		} else ret = pairadd_sv(ctx, request, vps, key, res_sv, T_OP_EQ, hash_name, list_name) + ret;
-	}
-
-	if (*vps) LIST_VERIFY(*vps);
-
-	return ret;
-}
-
 /*
  * 	Call the function_name inside the module
  * 	Store all vps in hashes %RAD_CONFIG %RAD_REPLY %RAD_REQUEST
  *
  */
-static int do_perl(void *instance, REQUEST *request, char const *function_name)
+static int do_perl(rlm_perl_t const *inst, rlm_perl_thread_t *t, REQUEST *request, char const *function_name)
 {
-
-	rlm_perl_t		*inst = instance;
-	VALUE_PAIR		*vp;
 	int			exitstatus=0, count;
 	STRLEN			n_a;
 
@@ -853,27 +1111,15 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 	HV			*rad_request_hv;
 	HV			*rad_state_hv;
 
+	rlm_perl_list_t		request_list, reply_list, control_list, state_list;
+
 	/*
 	 *	Radius has told us to call this function, but none
 	 *	is defined.
 	 */
 	if (!function_name) return RLM_MODULE_FAIL;
 
-#ifdef USE_ITHREADS
-	pthread_mutex_lock(&inst->clone_mutex);
-
-	PerlInterpreter *interp;
-
-	interp = rlm_perl_clone(inst->perl,inst->thread_key);
-	{
-		dTHXa(interp);
-		PERL_SET_CONTEXT(interp);
-	}
-
-	pthread_mutex_unlock(&inst->clone_mutex);
-#else
-	PERL_SET_CONTEXT(inst->perl);
-#endif
+	PERL_SET_CONTEXT(t->perl);
 
 	{
 		dSP;
@@ -886,10 +1132,18 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		rad_request_hv = get_hv("RAD_REQUEST", 1);
 		rad_state_hv = get_hv("RAD_STATE", 1);
 
-		perl_store_vps(request->packet, request, &request->packet->vps, rad_request_hv, "RAD_REQUEST", "request");
-		perl_store_vps(request->reply, request, &request->reply->vps, rad_reply_hv, "RAD_REPLY", "reply");
-		perl_store_vps(request, request, &request->control, rad_config_hv, "RAD_CONFIG", "control");
-		perl_store_vps(request->state_ctx, request, &request->state, rad_state_hv, "RAD_STATE", "session-state");
+		/*
+		 *	Attributes are only converted when the script
+		 *	reads them.
+		 */
+		perl_list_tie(rad_request_hv, &request_list, request, request->packet, &request->packet->vps,
+			      "RAD_REQUEST", "request");
+		perl_list_tie(rad_reply_hv, &reply_list, request, request->reply, &request->reply->vps,
+			      "RAD_REPLY", "reply");
+		perl_list_tie(rad_config_hv, &control_list, request, request, &request->control,
+			      "RAD_CONFIG", "control");
+		perl_list_tie(rad_state_hv, &state_list, request, request->state_ctx, &request->state,
+			      "RAD_STATE", "session-state");
 
 		/*
 		 * Store pointer to request structure globally so radiusd::xlat works
@@ -922,34 +1176,18 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		}
 
 
+		/*
+		 *	Only the attributes the script modified
+		 *	are converted back.
+		 */
+		perl_list_untie(rad_request_hv, &request_list);
+		perl_list_untie(rad_reply_hv, &reply_list);
+		perl_list_untie(rad_config_hv, &control_list);
+		perl_list_untie(rad_state_hv, &state_list);
+
 		PUTBACK;
 		FREETMPS;
 		LEAVE;
-
-		vp = NULL;
-		if ((get_hv_content(request->packet, request, rad_request_hv, &vp, "RAD_REQUEST", "request")) == 0) {
-			fr_pair_list_free(&request->packet->vps);
-			request->packet->vps = vp;
-			vp = NULL;
-		}
-
-		if ((get_hv_content(request->reply, request, rad_reply_hv, &vp, "RAD_REPLY", "reply")) == 0) {
-			fr_pair_list_free(&request->reply->vps);
-			request->reply->vps = vp;
-			vp = NULL;
-		}
-
-		if ((get_hv_content(request, request, rad_config_hv, &vp, "RAD_CONFIG", "control")) == 0) {
-			fr_pair_list_free(&request->control);
-			request->control = vp;
-			vp = NULL;
-		}
-
-		if ((get_hv_content(request->state_ctx, request, rad_state_hv, &vp, "RAD_STATE", "session-state")) == 0) {
-			fr_pair_list_free(&request->state);
-			request->state = vp;
-			vp = NULL;
-		}
 	}
 	return exitstatus;
 }
@@ -958,7 +1196,8 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 static rlm_rcode_t CC_HINT(nonnull) mod_##_x(module_ctx_t const *mctx, REQUEST *request) \
 { \
 	rlm_perl_t *inst = talloc_get_type_abort(mctx->instance, rlm_perl_t); \
-	return do_perl(inst, request, inst->func_##_x); \
+	rlm_perl_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_perl_thread_t); \
+	return do_perl(inst, t, request, inst->func_##_x); \
 }
 
 RLM_PERL_FUNC(authorize)
@@ -978,6 +1217,7 @@ RLM_PERL_FUNC(preacct)
 static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQUEST *request)
 {
 	rlm_perl_t	 	*inst = talloc_get_type_abort(mctx->instance, rlm_perl_t);
+	rlm_perl_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_perl_thread_t);
 	VALUE_PAIR		*pair;
 	int 			acct_status_type = 0;
 
@@ -992,23 +1232,62 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQ
 	switch (acct_status_type) {
 	case FR_STATUS_START:
 		if (inst->func_start_accounting) {
-			return do_perl(inst, request, inst->func_start_accounting);
+			return do_perl(inst, t, request, inst->func_start_accounting);
 		} else {
-			return do_perl(inst, request, inst->func_accounting);
+			return do_perl(inst, t, request, inst->func_accounting);
 		}
 
 	case FR_STATUS_STOP:
 		if (inst->func_stop_accounting) {
-			return do_perl(inst, request, inst->func_stop_accounting);
+			return do_perl(inst, t, request, inst->func_stop_accounting);
 		} else {
-			return do_perl(inst, request, inst->func_accounting);
+			return do_perl(inst, t, request, inst->func_accounting);
 		}
 
 	default:
-		return do_perl(inst, request, inst->func_accounting);
+		return do_perl(inst, t, request, inst->func_accounting);
+	}
+}
+
+
+/** Create the interpreter for this thread
+ *
+ * Cloning is done here, instead of on first use, so that the cost
+ * of cloning isn't paid by the first request the thread processes.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_perl_t		*inst = talloc_get_type_abort(instance, rlm_perl_t);
+	rlm_perl_thread_t	*t = talloc_get_type_abort(thread, rlm_perl_thread_t);
+
+#ifdef USE_ITHREADS
+	pthread_mutex_lock(&inst->clone_mutex);
+	t->perl = rlm_perl_clone(inst->perl);
+	pthread_mutex_unlock(&inst->clone_mutex);
+
+	if (!t->perl) {
+		ERROR("Failed cloning perl interpreter");
+		return -1;
 	}
+#else
+	t->perl = inst->perl;
+#endif
+
+	return 0;
 }
 
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_perl_thread_t	*t = talloc_get_type_abort(thread, rlm_perl_thread_t);
+
+#ifdef USE_ITHREADS
+	if (t->perl) rlm_destroy_perl(t->perl);
+#endif
+	t->perl = NULL;
+
+	return 0;
+}
 
 /*
  * Detach a instance give a chance to a module to make some internal setup ...
@@ -1109,6 +1388,11 @@ module_t rlm_perl = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+
+	.thread_inst_size	= sizeof(rlm_perl_thread_t),
+	.thread_inst_type	= "rlm_perl_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
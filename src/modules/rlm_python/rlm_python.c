@@ -41,6 +41,15 @@ RCSID("$Id$")
 #include <libgen.h>
 #include <dlfcn.h>
 
+/*
+ *	From Python 3.12 sub-interpreters can be created with their
+ *	own GIL, so each worker thread can get its own interpreter
+ *	and run Python code in parallel with the other workers.
+ */
+#if PY_VERSION_HEX >= 0x030C0000
+#  define PYTHON_PER_INTERPRETER_GIL 1
+#endif
+
 /** Specifies the module.function to load for processing a section
  *
  */
@@ -68,6 +77,12 @@ typedef struct {
 #if PY_MAJOR_VERSION == 2
 	bool		single_interpreter_mode;//!< Whether or not to create interpreters per module
 						//!< instance.
+#else
+	PyTypeObject	*pair_list_type;	//!< radiusd.PairList type in the instance's interpreter.
+#endif
+
+#ifdef PYTHON_PER_INTERPRETER_GIL
+	bool		per_thread_interpreter;	//!< Give each worker thread its own interpreter and GIL.
 #endif
 
 	python_func_def_t
@@ -93,18 +108,42 @@ typedef struct {
  *
  * Multiple instances of python create multiple interpreters and each
  * thread must have a PyThreadState per interpreter, to track execution.
+ *
+ * If the thread has its own interpreter, the functions are loaded into
+ * that interpreter, otherwise they're copies of the instance's functions.
  */
 typedef struct {
+	rlm_python_t const	*inst;		//!< Module instance this thread state belongs to.
 	PyThreadState	*state;			//!< Module instance/thread specific state.
-} rlm_python_thread_t;
 
-static void		*python_dlhandle;
-static PyThreadState	*global_interpreter;	//!< Our first interpreter.
+#ifdef PYTHON_PER_INTERPRETER_GIL
+	bool		own_interpreter;	//!< state is the main thread state of our own interpreter.
+	PyObject	*module;		//!< radiusd module in our interpreter.
+	PyObject	*pythonconf_dict;	//!< radiusd.config in our interpreter.
+#endif
 
 #if PY_MAJOR_VERSION == 3
-static rlm_python_t	*current_inst;		//!< Used for communication with inittab functions.
-static CONF_SECTION	*current_conf;		//!< Used for communication with inittab functions.
+	PyTypeObject	*pair_list_type;	//!< radiusd.PairList type in the interpreter we use.
+#endif
+
+	python_func_def_t
+	instantiate,
+	authorize,
+	authenticate,
+	preacct,
+	accounting,
+	pre_proxy,
+	post_proxy,
+	post_auth,
+#ifdef WITH_COA
+	recv_coa,
+	send_coa,
 #endif
+	detach;
+} rlm_python_thread_t;
+
+static void		*python_dlhandle;
+static PyThreadState	*global_interpreter;	//!< Our first interpreter.
 
 static char		*default_path;		//!< The default python path.
 
@@ -175,6 +214,10 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("cext_compat", FR_TYPE_BOOL, rlm_python_t, single_interpreter_mode), .dflt = "no" },
 #endif
 
+#ifdef PYTHON_PER_INTERPRETER_GIL
+	{ FR_CONF_OFFSET("per_thread_interpreter", FR_TYPE_BOOL, rlm_python_t, per_thread_interpreter), .dflt = "yes" },
+#endif
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -393,23 +436,26 @@ static void mod_vptuple(TALLOC_CTX *ctx, rlm_python_t const *inst, REQUEST *requ
 }
 
 
-/*
- *	This is the core Python function that the others wrap around.
- *	Pass the value-pair print strings in a tuple.
+/** Convert the name of an attribute to a Python string
+ *
  */
-static int mod_populate_vptuple(rlm_python_t const *inst, REQUEST *request, PyObject *pp, VALUE_PAIR *vp)
+static PyObject *python_vp_name(VALUE_PAIR const *vp)
 {
-	PyObject *attribute = NULL;
-	PyObject *value = NULL;
-
 	/* Look at the fr_pair_fprint_name? */
-	if (vp->da->flags.has_tag) {
-		attribute = PyUnicode_FromFormat("%s:%d", vp->da->name, vp->tag);
-	} else {
-		attribute = PyUnicode_FromString(vp->da->name);
-	}
+	if (vp->da->flags.has_tag) return PyUnicode_FromFormat("%s:%d", vp->da->name, vp->tag);
 
-	if (!attribute) return -1;
+	return PyUnicode_FromString(vp->da->name);
+}
+
+/** Convert the value of an attribute to a Python object
+ *
+ * @return
+ *	- A new reference to the value.
+ *	- NULL on error, in which case the error will already have been logged.
+ */
+static PyObject *python_vp_value(rlm_python_t const *inst, REQUEST *request, VALUE_PAIR const *vp)
+{
+	PyObject *value = NULL;
 
 	switch (vp->vp_type) {
 	case FR_TYPE_STRING:
@@ -488,13 +534,33 @@ static int mod_populate_vptuple(rlm_python_t const *inst, REQUEST *request, PyOb
 
 	case FR_TYPE_NON_VALUES:
 		fr_assert(0);
-		return -1;
+		return NULL;
 	}
 
 	if (value == NULL) {
 		ROPTIONAL(REDEBUG, ERROR, "Failed marshalling %pP to Python value", vp);
 		python_error_log(inst, request);
-		Py_XDECREF(attribute);
+		return NULL;
+	}
+
+	return value;
+}
+
+/*
+ *	This is the core Python function that the others wrap around.
+ *	Pass the value-pair print strings in a tuple.
+ */
+static int mod_populate_vptuple(rlm_python_t const *inst, REQUEST *request, PyObject *pp, VALUE_PAIR *vp)
+{
+	PyObject *attribute = NULL;
+	PyObject *value = NULL;
+
+	attribute = python_vp_name(vp);
+	if (!attribute) return -1;
+
+	value = python_vp_value(inst, request, vp);
+	if (!value) {
+		Py_DECREF(attribute);
 		return -1;
 	}
 
@@ -504,15 +570,315 @@ static int mod_populate_vptuple(rlm_python_t const *inst, REQUEST *request, PyOb
 	return 0;
 }
 
-static rlm_rcode_t do_python_single(rlm_python_t const *inst, REQUEST *request, PyObject *p_func, char const *funcname)
+#if PY_MAJOR_VERSION == 3
+/** A read-only view of the request's attributes
+ *
+ * This is what's passed to the Python functions in place of the
+ * tuple of (name, value) tuples we used to build for every call.
+ * Nothing is converted until the script asks for it.
+ *
+ * For compatibility with existing scripts, it can still be indexed
+ * by position and iterated over as (name, value) tuples.  It can also
+ * be indexed by attribute name, which returns the value of the first
+ * matching attribute.
+ *
+ * The view is only valid for the duration of the call, afterwards
+ * all operations on it raise RuntimeError.
+ */
+typedef struct {
+	PyObject_HEAD
+	rlm_python_t const	*inst;		//!< Module instance, used for logging.
+	REQUEST			*request;	//!< Request the attributes belong to, NULL once
+						///< the call has completed.
+	VALUE_PAIR		**vps;		//!< The list we're a view of.
+} python_pair_list_t;
+
+static int python_pair_list_check(python_pair_list_t *pl)
+{
+	if (pl->request) return 0;
+
+	PyErr_SetString(PyExc_RuntimeError, "Attribute list is no longer valid");
+	return -1;
+}
+
+/** Find the first attribute matching a name in the format produced by python_vp_name
+ *
+ */
+static VALUE_PAIR *python_pair_list_find(python_pair_list_t *pl, char const *name)
 {
 	fr_cursor_t	cursor;
 	VALUE_PAIR	*vp;
+
+	for (vp = fr_cursor_init(&cursor, pl->vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		char buffer[256];
+
+		if (!vp->da->flags.has_tag) {
+			if (strcmp(vp->da->name, name) == 0) return vp;
+			continue;
+		}
+
+		snprintf(buffer, sizeof(buffer), "%s:%d", vp->da->name, vp->tag);
+		if (strcmp(buffer, name) == 0) return vp;
+	}
+
+	return NULL;
+}
+
+/** Build a (name, value) tuple, as would have been found in the old request tuple
+ *
+ */
+static PyObject *python_pair_list_item(python_pair_list_t *pl, VALUE_PAIR *vp)
+{
+	PyObject *pp;
+
+	pp = PyTuple_New(2);
+	if (!pp) return NULL;
+
+	if (mod_populate_vptuple(pl->inst, pl->request, pp, vp) < 0) {
+		Py_DECREF(pp);
+		PyErr_Format(PyExc_ValueError, "Failed converting %s to a Python value", vp->da->name);
+		return NULL;
+	}
+
+	return pp;
+}
+
+static Py_ssize_t python_pair_list_length(PyObject *self)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+	fr_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+	Py_ssize_t		len = 0;
+
+	if (python_pair_list_check(pl) < 0) return -1;
+
+	for (vp = fr_cursor_init(&cursor, pl->vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) len++;
+
+	return len;
+}
+
+/** Look up an attribute by name, or a (name, value) tuple by position
+ *
+ */
+static PyObject *python_pair_list_subscript(PyObject *self, PyObject *key)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+	VALUE_PAIR		*vp;
+	char const		*name;
+	PyObject		*value;
+
+	if (python_pair_list_check(pl) < 0) return NULL;
+
+	if (PyIndex_Check(key)) {
+		fr_cursor_t	cursor;
+		Py_ssize_t	i;
+
+		i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+		if ((i == -1) && PyErr_Occurred()) return NULL;
+
+		if (i < 0) {
+			Py_ssize_t len;
+
+			len = python_pair_list_length(self);
+			if (len < 0) return NULL;
+			i += len;
+		}
+
+		for (vp = fr_cursor_init(&cursor, pl->vps);
+		     vp && (i > 0);
+		     vp = fr_cursor_next(&cursor), i--);
+
+		if (!vp || (i < 0)) {
+			PyErr_SetString(PyExc_IndexError, "Attribute index out of range");
+			return NULL;
+		}
+
+		return python_pair_list_item(pl, vp);
+	}
+
+	if (!PyUnicode_Check(key)) {
+		PyErr_SetString(PyExc_TypeError, "Attributes must be indexed by name or position");
+		return NULL;
+	}
+
+	name = PyUnicode_AsUTF8(key);
+	if (!name) return NULL;
+
+	vp = python_pair_list_find(pl, name);
+	if (!vp) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	value = python_vp_value(pl->inst, pl->request, vp);
+	if (!value) PyErr_Format(PyExc_ValueError, "Failed converting %s to a Python value", vp->da->name);
+
+	return value;
+}
+
+static int python_pair_list_contains(PyObject *self, PyObject *key)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+	char const		*name;
+
+	if (python_pair_list_check(pl) < 0) return -1;
+
+	if (!PyUnicode_Check(key)) return 0;
+
+	name = PyUnicode_AsUTF8(key);
+	if (!name) return -1;
+
+	return (python_pair_list_find(pl, name) != NULL);
+}
+
+/** Iterate over (name, value) tuples
+ *
+ * If we're being iterated over the script wants everything, so
+ * build a tuple of the lot and return an iterator for that.
+ */
+static PyObject *python_pair_list_iter(PyObject *self)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+	fr_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+	Py_ssize_t		len, i = 0;
+	PyObject		*tuple, *iter;
+
+	len = python_pair_list_length(self);
+	if (len < 0) return NULL;
+
+	tuple = PyTuple_New(len);
+	if (!tuple) return NULL;
+
+	for (vp = fr_cursor_init(&cursor, pl->vps);
+	     vp && (i < len);
+	     vp = fr_cursor_next(&cursor), i++) {
+		PyObject *pp;
+
+		pp = python_pair_list_item(pl, vp);
+		if (!pp) {
+			PyErr_Clear();
+			Py_INCREF(Py_None);
+			pp = Py_None;
+		}
+		PyTuple_SET_ITEM(tuple, i, pp);
+	}
+
+	iter = PyObject_GetIter(tuple);
+	Py_DECREF(tuple);
+
+	return iter;
+}
+
+static PyObject *python_pair_list_get(PyObject *self, PyObject *args)
+{
+	PyObject *key, *dflt = Py_None, *value;
+
+	if (!PyArg_ParseTuple(args, "O|O", &key, &dflt)) return NULL;
+
+	value = python_pair_list_subscript(self, key);
+	if (value || !PyErr_ExceptionMatches(PyExc_KeyError)) return value;
+
+	PyErr_Clear();
+	Py_INCREF(dflt);
+
+	return dflt;
+}
+
+static void python_pair_list_dealloc(PyObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+
+	type->tp_free(self);
+	Py_DECREF(type);	/* Instances of heap types hold a reference to their type */
+}
+
+static PyMethodDef python_pair_list_methods[] = {
+	{ "get", &python_pair_list_get, METH_VARARGS,
+	  "get(name[, default])\n\n" \
+	  "Return the value of the first attribute matching name, or default\n"
+	},
+	{ NULL, NULL, 0, NULL },
+};
+
+static PyType_Slot python_pair_list_slots[] = {
+	{ Py_tp_dealloc, (void *)python_pair_list_dealloc },
+	{ Py_tp_iter, (void *)python_pair_list_iter },
+	{ Py_tp_methods, (void *)python_pair_list_methods },
+	{ Py_mp_length, (void *)python_pair_list_length },
+	{ Py_mp_subscript, (void *)python_pair_list_subscript },
+	{ Py_sq_length, (void *)python_pair_list_length },
+	{ Py_sq_contains, (void *)python_pair_list_contains },
+	{ Py_tp_doc, (void *)"Attributes in a FreeRADIUS request" },
+	{ 0, NULL }
+};
+
+/*
+ *	This has to be a heap type, as static types are shared
+ *	between interpreters, which isn't safe if they don't
+ *	share a GIL.
+ */
+static PyType_Spec python_pair_list_spec = {
+	.name = "radiusd.PairList",
+	.basicsize = sizeof(python_pair_list_t),
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+	.flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+#else
+	.flags = Py_TPFLAGS_DEFAULT,
+#endif
+	.slots = python_pair_list_slots
+};
+
+static PyObject *python_pair_list_alloc(PyTypeObject *type, rlm_python_t const *inst,
+					REQUEST *request, VALUE_PAIR **vps)
+{
+	python_pair_list_t *pl;
+
+	pl = (python_pair_list_t *)type->tp_alloc(type, 0);
+	if (!pl) return NULL;
+
+	pl->inst = inst;
+	pl->request = request;
+	pl->vps = vps;
+
+	return (PyObject *)pl;
+}
+#endif
+
+static rlm_rcode_t do_python_single(rlm_python_t const *inst, PyTypeObject *pair_list_type,
+				    REQUEST *request, PyObject *p_func, char const *funcname)
+{
 	PyObject	*p_ret = NULL;
 	PyObject	*p_arg = NULL;
-	int		tuple_len;
 	rlm_rcode_t	rcode = RLM_MODULE_OK;
 
+#if PY_MAJOR_VERSION == 3
+	/*
+	 *	We pass a view of the request list, which only
+	 *	converts attributes when they're accessed.  If
+	 *	there's no request, or the list is empty, pass None.
+	 */
+	if (!request || !request->packet->vps || !pair_list_type) {
+		Py_INCREF(Py_None);
+		p_arg = Py_None;
+	} else {
+		p_arg = python_pair_list_alloc(pair_list_type, inst, request, &request->packet->vps);
+		if (!p_arg) {
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+	}
+#else
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	int		tuple_len;
+
+	(void)pair_list_type;
+
 	/*
 	 *	We will pass a tuple containing (name, value) tuples
 	 *	We can safely use the Python function to build up a
@@ -559,6 +925,7 @@ static rlm_rcode_t do_python_single(rlm_python_t const *inst, REQUEST *request,
 			}
 		}
 	}
+#endif
 
 	/* Call Python function. */
 	p_ret = PyObject_CallFunctionObjArgs(p_func, p_arg, NULL);
@@ -627,6 +994,14 @@ static rlm_rcode_t do_python_single(rlm_python_t const *inst, REQUEST *request,
 
 finish:
 	if (rcode == RLM_MODULE_FAIL) python_error_log(inst, request);
+#if PY_MAJOR_VERSION == 3
+	/*
+	 *	The script may have kept a reference to the
+	 *	view, make sure it can't get at the list once
+	 *	we've returned.
+	 */
+	if (p_arg && (p_arg != Py_None)) ((python_pair_list_t *)p_arg)->request = NULL;
+#endif
 	Py_XDECREF(p_arg);
 	Py_XDECREF(p_ret);
 
@@ -641,6 +1016,7 @@ static rlm_rcode_t do_python(rlm_python_t const *inst, rlm_python_thread_t *this
 			     REQUEST *request, PyObject *p_func, char const *funcname)
 {
 	rlm_rcode_t		rcode;
+	PyTypeObject		*pair_list_type = NULL;
 
 	/*
 	 *	It's a NOOP if the function wasn't defined
@@ -649,8 +1025,12 @@ static rlm_rcode_t do_python(rlm_python_t const *inst, rlm_python_thread_t *this
 
 	RDEBUG3("Using thread state %p/%p", inst, this_thread->state);
 
+#if PY_MAJOR_VERSION == 3
+	pair_list_type = this_thread->pair_list_type;
+#endif
+
 	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
-	rcode = do_python_single(inst, request, p_func, funcname);
+	rcode = do_python_single(inst, pair_list_type, request, p_func, funcname);
 	(void)fr_cond_assert(PyEval_SaveThread() == this_thread->state);
 
 	return rcode;
@@ -661,7 +1041,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_##x(module_ctx_t const *mctx, REQUEST *r
 { \
 	rlm_python_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_python_t); \
 	rlm_python_thread_t *thread = talloc_get_type_abort(mctx->thread, rlm_python_thread_t); \
-	return do_python(inst, thread, request, inst->x.function, #x);\
+	return do_python(inst, thread, request, thread->x.function, #x);\
 }
 
 MOD_FUNC(authenticate)
@@ -812,7 +1192,7 @@ static int python_parse_config(rlm_python_t *inst, CONF_SECTION *cs, int lvl, Py
 /** Make the current instance's config available within the module we're initialising
  *
  */
-static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, PyObject *module)
+static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, PyObject *module, PyObject **dict)
 {
 	CONF_SECTION *cs;
 
@@ -820,12 +1200,12 @@ static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, P
 	 *	Convert a FreeRADIUS config structure into a python
 	 *	dictionary.
 	 */
-	inst->pythonconf_dict = PyDict_New();
-	if (!inst->pythonconf_dict) {
+	*dict = PyDict_New();
+	if (!*dict) {
 		ERROR("Unable to create python dict for config");
 	error:
-		Py_XDECREF(inst->pythonconf_dict);
-		inst->pythonconf_dict = NULL;
+		Py_XDECREF(*dict);
+		*dict = NULL;
 		python_error_log(inst, NULL);
 		return -1;
 	}
@@ -833,13 +1213,13 @@ static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, P
 	cs = cf_section_find(conf, "config", NULL);
 	if (cs) {
 		DEBUG("Inserting \"config\" section into python environment as radiusd.config");
-		if (python_parse_config(inst, cs, 0, inst->pythonconf_dict) < 0) goto error;
+		if (python_parse_config(inst, cs, 0, *dict) < 0) goto error;
 	}
 
 	/*
 	 *	Add module configuration as a dict
 	 */
-	if (PyModule_AddObject(module, "config", inst->pythonconf_dict) < 0) goto error;
+	if (PyModule_AddObject(module, "config", *dict) < 0) goto error;
 
 	return 0;
 }
@@ -871,13 +1251,15 @@ static char *python_path_build(TALLOC_CTX *ctx, rlm_python_t *inst, CONF_SECTION
 		MEM(path = talloc_asprintf_append_buffer(path, "%s:", inst->python_path));
 	}
 	if (inst->python_path_include_conf_dir) {
-		char const *imutable;
-		char *mutable;
-
-		imutable = cf_filename(conf);
-		memcpy(&mutable, &imutable, sizeof(mutable));
+		char *filename;
 
-		MEM(path = talloc_asprintf_append_buffer(path, "%s:", dirname(mutable)));
+		/*
+		 *	dirname() may modify its argument, and worker
+		 *	threads build paths concurrently, so work on a copy.
+		 */
+		MEM(filename = talloc_strdup(path, cf_filename(conf)));
+		MEM(path = talloc_asprintf_append_buffer(path, "%s:", dirname(filename)));
+		talloc_free(filename);
 	}
 	if (inst->python_path_include_default) {
 		MEM(path = talloc_asprintf_append_buffer(path, "%s:", default_path));
@@ -893,62 +1275,66 @@ static char *python_path_build(TALLOC_CTX *ctx, rlm_python_t *inst, CONF_SECTION
  *	Python 3 interpreter initialisation and destruction
  */
 #if PY_MAJOR_VERSION == 3
-static PyObject *python_module_init(void)
+/** Add the types we provide to a new instance of the radiusd module
+ *
+ * Called once in each interpreter which imports the module.
+ */
+static int python_module_exec(PyObject *module)
 {
-	rlm_python_t	*inst = current_inst;
-	CONF_SECTION	*conf = current_conf;
-	PyObject	*module;
+	PyObject *type;
+
+	type = PyType_FromSpec(&python_pair_list_spec);
+	if (!type) return -1;
+
+	if (PyModule_AddObject(module, "PairList", type) < 0) {
+		Py_DECREF(type);
+		return -1;
+	}
+
+	return 0;
+}
 
+static PyModuleDef_Slot python_module_slots[] = {
+	{ Py_mod_exec, (void *)python_module_exec },
+#ifdef PYTHON_PER_INTERPRETER_GIL
+	{ Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+	{ 0, NULL }
+};
+
+/*
+ *	Uses multi-phase initialisation so that each interpreter
+ *	gets its own, independent, copy of the module.
+ */
+static PyObject *python_module_init(void)
+{
 	static struct PyModuleDef py_module_def = {
 		PyModuleDef_HEAD_INIT,
 		"radiusd",			/* m_name */
 		"FreeRADIUS python module",	/* m_doc */
-		-1,				/* m_size */
+		0,				/* m_size */
 		module_methods,			/* m_methods */
-		NULL,				/* m_reload */
+		python_module_slots,		/* m_slots */
 		NULL,				/* m_traverse */
 		NULL,				/* m_clear */
 		NULL,				/* m_free */
 	};
 
-	fr_assert(inst && conf);
-
-	module = PyModule_Create(&py_module_def);
-	if (!module) {
-		python_error_log(inst, NULL);
-		Py_RETURN_NONE;
-	}
-
-	return module;
+	return PyModuleDef_Init(&py_module_def);
 }
 
-static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
+/** Set the path and import the radiusd module into the current interpreter
+ *
+ * Must be called with the interpreter's thread state swapped in.
+ */
+static int python_interpreter_setup(rlm_python_t *inst, CONF_SECTION *conf,
+				    PyObject **module_out, PyObject **dict_out, PyTypeObject **pair_list_type_out)
 {
 	char		*path;
-	PyObject	*module;
+	PyObject	*module, *type;
 	wchar_t	        *wide_path;
 
-	/*
-	 *	python_module_init takes no args, so we need
-	 *	to set these globals so that when it's
-	 *	called during interpreter initialisation
-	 *	it can get at the current instance config.
-	 */
-	current_inst = inst;
-	current_conf = conf;
-
-	PyEval_RestoreThread(global_interpreter);
-	LSAN_DISABLE(inst->interpreter = Py_NewInterpreter());
-	if (!inst->interpreter) {
-		ERROR("Failed creating new interpreter");
-		return -1;
-	}
-	DEBUG3("Created new interpreter %p", inst->interpreter);
-	PyEval_SaveThread();		/* Unlock GIL */
-
-	PyEval_RestoreThread(inst->interpreter);
-
-	path = python_path_build(inst, inst, conf);
+	path = python_path_build(NULL, inst, conf);
 	DEBUG3("Setting python path to \"%s\"", path);
 	wide_path = Py_DecodeLocale(path, NULL);
 	talloc_free(path);
@@ -961,23 +1347,55 @@ static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
 	 *	own copy which it can mutate as much as
 	 *      it wants.
 	 */
- 	module = PyImport_ImportModule("radiusd");
- 	if (!module) {
- 		ERROR("Failed importing \"radiusd\" module into interpreter %p", inst->interpreter);
- 		return -1;
- 	}
-	if ((python_module_import_config(inst, conf, module) < 0) ||
+	module = PyImport_ImportModule("radiusd");
+	if (!module) {
+		ERROR("Failed importing \"radiusd\" module into interpreter %p", PyThreadState_Get());
+		python_error_log(inst, NULL);
+		return -1;
+	}
+	if ((python_module_import_config(inst, conf, module, dict_out) < 0) ||
 	    (python_module_import_constants(inst, module) < 0)) {
 		Py_DECREF(module);
 		return -1;
 	}
-	inst->module = module;
+
+	type = PyObject_GetAttrString(module, "PairList");
+	if (!type || !PyType_Check(type)) {
+		ERROR("Failed finding \"radiusd.PairList\" type");
+		python_error_log(inst, NULL);
+		Py_XDECREF(type);
+		Py_DECREF(module);
+		return -1;
+	}
+
+	*module_out = module;
+	*pair_list_type_out = (PyTypeObject *)type;
+
+	return 0;
+}
+
+static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
+{
+	PyEval_RestoreThread(global_interpreter);
+	LSAN_DISABLE(inst->interpreter = Py_NewInterpreter());
+	if (!inst->interpreter) {
+		ERROR("Failed creating new interpreter");
+		return -1;
+	}
+	DEBUG3("Created new interpreter %p", inst->interpreter);
+	PyEval_SaveThread();		/* Unlock GIL */
+
+	PyEval_RestoreThread(inst->interpreter);
+	if (python_interpreter_setup(inst, conf, &inst->module, &inst->pythonconf_dict, &inst->pair_list_type) < 0) {
+		PyEval_SaveThread();
+		return -1;
+	}
 	PyEval_SaveThread();
 
 	return 0;
 }
 
-static void python_interpreter_free(UNUSED rlm_python_t *inst, PyThreadState *interp)
+static void python_interpreter_free(rlm_python_t *inst, PyThreadState *interp)
 {
 	/*
 	 *	We incremented the reference count earlier
@@ -986,6 +1404,7 @@ static void python_interpreter_free(UNUSED rlm_python_t *inst, PyThreadState *in
 	Py_XDECREF(inst->module);
 
 	PyEval_RestoreThread(interp);	/* Switches thread state and locks GIL */
+	Py_XDECREF(inst->pair_list_type);
 	Py_EndInterpreter(interp);	/* Destroys interpreter (GIL still locked) - sets thread state to NULL */
 	PyThreadState_Swap(global_interpreter);	/* Get a none-null thread state */
 	PyEval_SaveThread();		/* Unlock GIL */
@@ -1045,7 +1464,7 @@ static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
 		 */
 		Py_INCREF(module);
 
-		if ((python_module_import_config(inst, conf, module) < 0) ||
+		if ((python_module_import_config(inst, conf, module, &inst->pythonconf_dict) < 0) ||
 		    (python_module_import_constants(inst, module) < 0)) goto error;
 
 		if (inst->single_interpreter_mode) global_module = module;
@@ -1137,7 +1556,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	if (inst->instantiate.function) {
 		rlm_rcode_t rcode;
 
-		rcode = do_python_single(inst, NULL, inst->instantiate.function, "instantiate");
+		rcode = do_python_single(inst, NULL, NULL, inst->instantiate.function, "instantiate");
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 		case RLM_MODULE_REJECT:
@@ -1179,7 +1598,7 @@ static int mod_detach(void *instance)
 	/*
 	 *	We don't care if this fails.
 	 */
-	if (inst->detach.function) (void)do_python_single(inst, NULL, inst->detach.function, "detach");
+	if (inst->detach.function) (void)do_python_single(inst, NULL, NULL, inst->detach.function, "detach");
 
 #define PYTHON_FUNC_DESTROY(_x) python_function_destroy(&inst->_x)
 	PYTHON_FUNC_DESTROY(instantiate);
@@ -1207,13 +1626,177 @@ static int mod_detach(void *instance)
 	return 0;
 }
 
-static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+#ifdef PYTHON_PER_INTERPRETER_GIL
+/** Release everything loaded into a thread's interpreter
+ *
+ * Must be called with the thread's interpreter swapped in.
+ */
+static void python_thread_interpreter_clear(rlm_python_thread_t *this_thread)
+{
+#define PYTHON_THREAD_FUNC_DESTROY(_x) python_function_destroy(&this_thread->_x)
+	PYTHON_THREAD_FUNC_DESTROY(instantiate);
+	PYTHON_THREAD_FUNC_DESTROY(authorize);
+	PYTHON_THREAD_FUNC_DESTROY(authenticate);
+	PYTHON_THREAD_FUNC_DESTROY(preacct);
+	PYTHON_THREAD_FUNC_DESTROY(accounting);
+	PYTHON_THREAD_FUNC_DESTROY(pre_proxy);
+	PYTHON_THREAD_FUNC_DESTROY(post_proxy);
+	PYTHON_THREAD_FUNC_DESTROY(post_auth);
+#ifdef WITH_COA
+	PYTHON_THREAD_FUNC_DESTROY(recv_coa);
+	PYTHON_THREAD_FUNC_DESTROY(send_coa);
+#endif
+	PYTHON_THREAD_FUNC_DESTROY(detach);
+
+	Py_XDECREF(this_thread->pair_list_type);
+	this_thread->pair_list_type = NULL;
+	Py_XDECREF(this_thread->module);
+	this_thread->module = NULL;
+}
+
+/** Give a worker thread its own interpreter, with its own GIL
+ *
+ * The user's modules are imported into the new interpreter, and the
+ * instantiate function is called there, so that any state it sets
+ * up is available to that thread's calls.
+ */
+static int python_thread_interpreter_init(rlm_python_t *inst, rlm_python_thread_t *this_thread, CONF_SECTION *conf)
+{
+	PyThreadState		*main_state, *state = NULL;
+	PyStatus		status;
+	PyInterpreterConfig	config = {
+		.use_main_obmalloc = 0,
+		.allow_fork = 0,
+		.allow_exec = 0,
+		.allow_threads = 1,
+		.allow_daemon_threads = 0,
+		.check_multi_interp_extensions = 1,
+		.gil = PyInterpreterConfig_OWN_GIL,
+	};
+	int			ret = -1;
+
+	/*
+	 *	Creating an interpreter requires a current thread
+	 *	state, and this thread doesn't have one yet.
+	 */
+	main_state = PyThreadState_New(global_interpreter->interp);
+	if (!main_state) {
+		ERROR("Failed initialising local PyThreadState");
+		return -1;
+	}
+	PyEval_RestoreThread(main_state);
+
+	/*
+	 *	Releases the main interpreter's GIL, and leaves us
+	 *	holding the new interpreter's GIL.
+	 */
+	LSAN_DISABLE(status = Py_NewInterpreterFromConfig(&state, &config));
+	if (PyStatus_Exception(status) || !state) {
+		ERROR("Failed creating new interpreter for thread: %s",
+		      status.err_msg ? status.err_msg : "unknown error");
+		goto done;
+	}
+	DEBUG3("Created new thread interpreter %p", state);
+
+	this_thread->state = state;
+	this_thread->own_interpreter = true;
+
+	if (python_interpreter_setup(inst, conf, &this_thread->module, &this_thread->pythonconf_dict,
+				     &this_thread->pair_list_type) < 0) {
+	error:
+		python_thread_interpreter_clear(this_thread);
+		Py_EndInterpreter(state);
+		this_thread->state = NULL;
+		PyEval_RestoreThread(main_state);
+		goto done;
+	}
+
+#define PYTHON_THREAD_FUNC_LOAD(_x) \
+	do { \
+		this_thread->_x.module_name = inst->_x.module_name; \
+		this_thread->_x.function_name = inst->_x.function_name; \
+		if (python_function_load(inst, &this_thread->_x) < 0) goto error; \
+	} while (0)
+	PYTHON_THREAD_FUNC_LOAD(instantiate);
+	PYTHON_THREAD_FUNC_LOAD(authenticate);
+	PYTHON_THREAD_FUNC_LOAD(authorize);
+	PYTHON_THREAD_FUNC_LOAD(preacct);
+	PYTHON_THREAD_FUNC_LOAD(accounting);
+	PYTHON_THREAD_FUNC_LOAD(pre_proxy);
+	PYTHON_THREAD_FUNC_LOAD(post_proxy);
+	PYTHON_THREAD_FUNC_LOAD(post_auth);
+#ifdef WITH_COA
+	PYTHON_THREAD_FUNC_LOAD(recv_coa);
+	PYTHON_THREAD_FUNC_LOAD(send_coa);
+#endif
+	PYTHON_THREAD_FUNC_LOAD(detach);
+
+	if (this_thread->instantiate.function) {
+		switch (do_python_single(inst, NULL, NULL, this_thread->instantiate.function, "instantiate")) {
+		case RLM_MODULE_FAIL:
+		case RLM_MODULE_REJECT:
+		case RLM_MODULE_YIELD:	/* Yield not valid in instantiate */
+			goto error;
+
+		default:
+			break;
+		}
+	}
+
+	PyEval_SaveThread();
+	PyEval_RestoreThread(main_state);
+	ret = 0;
+
+done:
+	/*
+	 *	Get rid of the temporary main interpreter thread state
+	 */
+	PyThreadState_Clear(main_state);
+	PyThreadState_DeleteCurrent();
+
+	return ret;
+}
+
+static void python_thread_interpreter_free(rlm_python_thread_t *this_thread)
+{
+	rlm_python_t const *inst = this_thread->inst;
+
+	PyEval_RestoreThread(this_thread->state);
+
+	/*
+	 *	We don't care if this fails.
+	 */
+	if (this_thread->detach.function) {
+		(void)do_python_single(inst, NULL, NULL, this_thread->detach.function, "detach");
+	}
+	python_thread_interpreter_clear(this_thread);
+
+	Py_EndInterpreter(this_thread->state);	/* Destroys the interpreter and its GIL */
+	this_thread->state = NULL;
+}
+#endif
+
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance,
 				  UNUSED fr_event_list_t *el, void *thread)
 {
 	PyThreadState		*state;
 	rlm_python_t		*inst = instance;
 	rlm_python_thread_t	*this_thread = thread;
 
+	this_thread->inst = inst;
+
+#ifdef PYTHON_PER_INTERPRETER_GIL
+	if (inst->per_thread_interpreter) {
+		CONF_SECTION *our_conf;
+
+		memcpy(&our_conf, &conf, sizeof(our_conf));
+
+		return python_thread_interpreter_init(inst, this_thread, our_conf);
+	}
+#else
+	(void)conf;
+#endif
+
 	state = PyThreadState_New(inst->interpreter->interp);
 	if (!state) {
 		ERROR("Failed initialising local PyThreadState");
@@ -1223,6 +1806,28 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instanc
 	DEBUG3("Initialised new thread state %p", state);
 	this_thread->state = state;
 
+	/*
+	 *	We share the instance's interpreter, so we
+	 *	use the functions loaded into it.
+	 */
+#if PY_MAJOR_VERSION == 3
+	this_thread->pair_list_type = inst->pair_list_type;
+#endif
+#define PYTHON_FUNC_SHARE(_x) this_thread->_x = inst->_x
+	PYTHON_FUNC_SHARE(instantiate);
+	PYTHON_FUNC_SHARE(authenticate);
+	PYTHON_FUNC_SHARE(authorize);
+	PYTHON_FUNC_SHARE(preacct);
+	PYTHON_FUNC_SHARE(accounting);
+	PYTHON_FUNC_SHARE(pre_proxy);
+	PYTHON_FUNC_SHARE(post_proxy);
+	PYTHON_FUNC_SHARE(post_auth);
+#ifdef WITH_COA
+	PYTHON_FUNC_SHARE(recv_coa);
+	PYTHON_FUNC_SHARE(send_coa);
+#endif
+	PYTHON_FUNC_SHARE(detach);
+
 	return 0;
 }
 
@@ -1230,6 +1835,15 @@ static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 {
 	rlm_python_thread_t	*this_thread = thread;
 
+	if (!this_thread->state) return 0;
+
+#ifdef PYTHON_PER_INTERPRETER_GIL
+	if (this_thread->own_interpreter) {
+		python_thread_interpreter_free(this_thread);
+		return 0;
+	}
+#endif
+
 	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
 	PyThreadState_Clear(this_thread->state);
 	PyEval_SaveThread();
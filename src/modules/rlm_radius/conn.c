@@ -0,0 +1,1481 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_radius/conn.c
+ * @brief Connection and request handling shared by the rlm_radius transports
+ *
+ * Everything here works on the common fields at the start of the
+ * transport's instance, thread and connection handle structures.  The
+ * transports keep the socket I/O, and the retransmission policy.
+ *
+ * @copyright 2017 Network RADIUS SARL
+ * @copyright 2020 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/pair.h>
+#include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "conn.h"
+
+/** If we get a reply, the request must come from one of a small
+ * number of packet types.
+ */
+static FR_CODE allowed_replies[FR_RADIUS_MAX_PACKET_CODE] = {
+	[FR_CODE_ACCESS_ACCEPT]		= FR_CODE_ACCESS_REQUEST,
+	[FR_CODE_ACCESS_CHALLENGE]	= FR_CODE_ACCESS_REQUEST,
+	[FR_CODE_ACCESS_REJECT]		= FR_CODE_ACCESS_REQUEST,
+
+	[FR_CODE_ACCOUNTING_RESPONSE]	= FR_CODE_ACCOUNTING_REQUEST,
+
+	[FR_CODE_COA_ACK]		= FR_CODE_COA_REQUEST,
+	[FR_CODE_COA_NAK]		= FR_CODE_COA_REQUEST,
+
+	[FR_CODE_DISCONNECT_ACK]	= FR_CODE_DISCONNECT_REQUEST,
+	[FR_CODE_DISCONNECT_NAK]	= FR_CODE_DISCONNECT_REQUEST,
+
+	[FR_CODE_PROTOCOL_ERROR]	= FR_CODE_PROTOCOL_ERROR,	/* Any */
+};
+
+/** Turn a reply code into a module rcode;
+ *
+ */
+static rlm_rcode_t radius_code_to_rcode[FR_RADIUS_MAX_PACKET_CODE] = {
+	[FR_CODE_ACCESS_ACCEPT]		= RLM_MODULE_OK,
+	[FR_CODE_ACCESS_CHALLENGE]	= RLM_MODULE_UPDATED,
+	[FR_CODE_ACCESS_REJECT]		= RLM_MODULE_REJECT,
+
+	[FR_CODE_ACCOUNTING_RESPONSE]	= RLM_MODULE_OK,
+
+	[FR_CODE_COA_ACK]		= RLM_MODULE_OK,
+	[FR_CODE_COA_NAK]		= RLM_MODULE_REJECT,
+
+	[FR_CODE_DISCONNECT_ACK]	= RLM_MODULE_OK,
+	[FR_CODE_DISCONNECT_NAK]	= RLM_MODULE_REJECT,
+
+	[FR_CODE_PROTOCOL_ERROR]	= RLM_MODULE_HANDLED,
+};
+
+#ifndef NDEBUG
+/** Log additional information about a tracking entry
+ *
+ * @param[in] te	Tracking entry we're logging information for.
+ * @param[in] log	destination.
+ * @param[in] log_type	Type of log message.
+ * @param[in] file	the logging request was made in.
+ * @param[in] line 	logging request was made on.
+ */
+void radius_conn_tracking_entry_log(fr_log_t const *log, fr_log_type_t log_type, char const *file, int line,
+				    radius_track_entry_t *te)
+{
+	REQUEST			*request;
+
+	if (!te->request) return;	/* Free entry */
+
+	request = talloc_get_type_abort(te->request, REQUEST);
+
+	fr_log(log, log_type, file, line, "request %s, allocated %s:%u", request->name,
+	       request->alloc_file, request->alloc_line);
+
+	fr_trunk_request_state_log(log, log_type, file, line, talloc_get_type_abort(te->uctx, fr_trunk_request_t));
+}
+#endif
+
+/** Clear out any connection specific resources from a request
+ *
+ */
+void radius_conn_request_reset(radius_conn_request_t *u)
+{
+	TALLOC_FREE(u->packet);
+	u->extra = NULL;	/* Freed with packet */
+
+	/*
+	 *	Can have packet put no u->rr
+	 *	if this is part of a pre-trunk status check.
+	 */
+	if (u->rr) radius_track_entry_release(&u->rr);
+	u->sock = NULL;
+	u->can_retransmit = false;
+}
+
+/** Reset a status_check packet, ready to re-use
+ *
+ */
+void radius_conn_status_check_reset(radius_conn_handle_t *h, radius_conn_request_t *u)
+{
+	fr_assert(u->status_check == true);
+
+	h->status_checking = false;
+	u->num_replies = 0;	/* Reset */
+	u->retry.start = 0;
+
+	if (u->ev) (void) fr_event_timer_delete(&u->ev);
+
+	radius_conn_request_reset(u);
+}
+
+/*
+ *	Status-Server checks.  Manually build the packet, and
+ *	all of its associated glue.
+ */
+void radius_conn_status_check_alloc(fr_event_list_t *el, radius_conn_handle_t *h)
+{
+	radius_conn_request_t	*u;
+	REQUEST			*request;
+	radius_conn_inst_t const *inst = h->inst;
+	vp_map_t		*map;
+
+	fr_assert(!h->status_u && !h->status_r && !h->status_request);
+
+	u = talloc_zero(h, radius_conn_request_t);
+
+	/*
+	 *	Status checks are prioritized over any other packet
+	 */
+	u->priority = ~(uint32_t) 0;
+	u->status_check = true;
+
+	/*
+	 *	Allocate outside of the free list.
+	 *	There appears to be an issue where
+	 *	the thread destructor runs too
+	 *	early, and frees the freelist's
+	 *	head before the module destructor
+	 *      runs.
+	 */
+	request = request_local_alloc(u);
+	request->async = talloc_zero(request, fr_async_t);
+	talloc_const_free(request->name);
+	request->name = talloc_strdup(request, h->module_name);
+
+	request->el = el;
+	request->packet = fr_radius_alloc(request, false);
+	request->reply = fr_radius_alloc(request, false);
+
+	/*
+	 *	Create the VPs, and ignore any errors
+	 *	creating them.
+	 */
+	for (map = inst->parent->status_check_map; map != NULL; map = map->next) {
+		/*
+		 *	Skip things which aren't attributes.
+		 */
+		if (!tmpl_is_attr(map->lhs)) continue;
+
+		/*
+		 *	Ignore internal attributes.
+		 */
+		if (tmpl_da(map->lhs)->flags.internal) continue;
+
+		/*
+		 *	Ignore signalling attributes.  They shouldn't exist.
+		 */
+		if ((tmpl_da(map->lhs) == attr_proxy_state) ||
+		    (tmpl_da(map->lhs) == attr_message_authenticator)) continue;
+
+		/*
+		 *	Allow passwords only in Access-Request packets.
+		 */
+		if ((inst->parent->status_check != FR_CODE_ACCESS_REQUEST) &&
+		    (tmpl_da(map->lhs) == attr_user_password)) continue;
+
+		(void) map_to_request(request, map, map_to_vp, NULL);
+	}
+
+	/*
+	 *	Ensure that there's a NAS-Identifier, if one wasn't
+	 *	already added.
+	 */
+	if (!fr_pair_find_by_da(request->packet->vps, attr_nas_identifier, TAG_ANY)) {
+		VALUE_PAIR *vp;
+
+		MEM(pair_add_request(&vp, attr_nas_identifier) >= 0);
+		fr_pair_value_strdup(vp, "status check - are you alive?");
+	}
+
+	/*
+	 *	Always add an Event-Timestamp, which will be the time
+	 *	at which the first packet is sent.  Or for
+	 *	Status-Server, the time of the current packet.
+	 */
+	if (!fr_pair_find_by_da(request->packet->vps, attr_event_timestamp, TAG_ANY)) {
+		MEM(pair_add_request(NULL, attr_event_timestamp) >= 0);
+	}
+
+	/*
+	 *	Initialize the request IO ctx.  Note that we don't set
+	 *	destructors.
+	 */
+	u->code = inst->parent->status_check;
+	request->packet->code = u->code;
+
+	DEBUG3("%s - Status check packet type will be %s", h->module_name, fr_packet_codes[u->code]);
+	log_request_pair_list(L_DBG_LVL_3, request, request->packet->vps, NULL);
+
+	MEM(h->status_r = talloc_zero(request, radius_conn_result_t));
+	h->status_u = u;
+	h->status_request = request;
+}
+
+/** Shutdown/close a connection with a single ID space
+ *
+ */
+void radius_conn_close(UNUSED fr_event_list_t *el, void *handle, UNUSED void *uctx)
+{
+	radius_conn_handle_t *h = handle;
+
+	/*
+	 *	There's tracking entries still allocated
+	 *	this is bad, they should have all been
+	 *	released.
+	 */
+	if (h->tt && (h->tt->num_requests != 0)) {
+#ifndef NDEBUG
+		radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__, h->tt, radius_conn_tracking_entry_log);
+#endif
+		fr_assert_fail("%u tracking entries still allocated at conn close", h->tt->num_requests);
+	}
+
+	DEBUG4("Freeing %s handle %p", talloc_get_name(handle), handle);
+
+	talloc_free(h);
+}
+
+/** Connection failed
+ *
+ * @param[in] handle   	of connection that failed.
+ * @param[in] state	the connection was in when it failed.
+ * @param[in] uctx	The thread data of the transport.
+ */
+fr_connection_state_t radius_conn_failed(void *handle, fr_connection_state_t state, void *uctx)
+{
+	radius_conn_thread_t	*thread = uctx;
+
+	radius_health_failed(thread->inst->parent->health);
+
+	switch (state) {
+	/*
+	 *	If the connection was connected when it failed,
+	 *	we need to handle any outstanding packets and
+	 *	timer events before reconnecting.
+	 */
+	case FR_CONNECTION_STATE_CONNECTED:
+	{
+		radius_conn_handle_t	*h = handle; /* h only available if connected */
+
+		/*
+		 *	Reset the Status-Server checks.
+		 */
+		if (h->status_u && h->status_u->ev) (void) fr_event_timer_delete(&h->status_u->ev);
+	}
+		break;
+
+	default:
+		break;
+	}
+
+	return FR_CONNECTION_STATE_INIT;
+}
+
+/*
+ *  Return negative numbers to put 'a' at the top of the heap.
+ *  Return positive numbers to put 'b' at the top of the heap.
+ *
+ *  We want the value with the lowest timestamp to be prioritized at
+ *  the top of the heap.
+ */
+int8_t radius_conn_request_prioritise(void const *one, void const *two)
+{
+	radius_conn_request_t const *a = one;
+	radius_conn_request_t const *b = two;
+	int8_t rcode;
+
+	// @todo - prioritize packets if there's a state?
+
+	/*
+	 *	Prioritise status check packets
+	 */
+	rcode = (b->status_check - a->status_check);
+	if (rcode != 0) return rcode;
+
+	/*
+	 *	Larger priority is more important.
+	 */
+	rcode = (a->priority < b->priority) - (a->priority > b->priority);
+	if (rcode != 0) return rcode;
+
+	/*
+	 *	Smaller timestamp (i.e. earlier) is more important.
+	 */
+	return (a->recv_time > b->recv_time) - (a->recv_time < b->recv_time);
+}
+
+/** Decode response packet data, extracting relevant information and validating the packet
+ *
+ * @param[in] ctx			to allocate pairs in.
+ * @param[out] reply			Pointer to head of pair list to add reply attributes to.
+ * @param[out] response_code		The type of response packet.
+ * @param[in] h				connection handle.
+ * @param[in] request			the request.
+ * @param[in] u				the request as sent by the transport.
+ * @param[in] request_authenticator	from the original request.
+ * @param[in] rtt			Round trip time estimates to update, by packet code.
+ *					NULL if the transport never retransmits, in which
+ *					case every reply gives a usable RTT.
+ * @param[in] data			to decode.
+ * @param[in] data_len			Length of input data.
+ * @return
+ *	- DECODE_FAIL_NONE on success.
+ *	- DECODE_FAIL_* on failure.
+ */
+decode_fail_t radius_conn_decode(TALLOC_CTX *ctx, VALUE_PAIR **reply, uint8_t *response_code,
+				 radius_conn_handle_t *h, REQUEST *request, radius_conn_request_t *u,
+				 uint8_t const request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH],
+				 fr_retry_rtt_t *rtt, uint8_t *data, size_t data_len)
+{
+	radius_conn_inst_t const *inst = h->inst;
+	size_t			packet_len;
+	decode_fail_t		reason;
+	uint8_t			code;
+	uint8_t			original[RADIUS_HEADER_LENGTH];
+
+	*response_code = 0;	/* Initialise to keep the rest of the code happy */
+
+	packet_len = data_len;
+	if (!fr_radius_ok(data, &packet_len, inst->parent->max_attributes, false, &reason)) {
+		RWARN("Ignoring malformed packet");
+		return reason;
+	}
+
+	RHEXDUMP3(data, packet_len, "Read packet");
+
+	original[0] = u->code;
+	original[1] = 0;			/* not looked at by fr_radius_verify() */
+	original[2] = 0;
+	original[3] = RADIUS_HEADER_LENGTH;	/* for debugging */
+	memcpy(original + RADIUS_AUTH_VECTOR_OFFSET, request_authenticator, RADIUS_AUTH_VECTOR_LENGTH);
+
+	if (fr_radius_verify(data, original,
+			     (uint8_t const *) inst->secret, talloc_array_length(inst->secret) - 1) < 0) {
+		RPWDEBUG("Ignoring response with invalid signature");
+		return DECODE_FAIL_MA_INVALID;
+	}
+
+	code = data[0];
+	if (!code || (code >= FR_RADIUS_MAX_PACKET_CODE)) {
+		REDEBUG("Unknown reply code %d", code);
+		return DECODE_FAIL_UNKNOWN_PACKET_CODE;
+	}
+
+	if (!allowed_replies[code]) {
+		REDEBUG("%s packet received invalid reply code %s",
+			fr_packet_codes[u->code], fr_packet_codes[code]);
+		return DECODE_FAIL_UNKNOWN_PACKET_CODE;
+	}
+
+	/*
+	 *	Protocol error is allowed as a response to any
+	 *	packet code.
+	 *
+	 *	Status checks accept any response code.
+	 */
+	if (!u->status_check && (code != FR_CODE_PROTOCOL_ERROR)) {
+		if (allowed_replies[code] != (FR_CODE) u->code) {
+			REDEBUG("%s packet received invalid reply code %s",
+				fr_packet_codes[u->code], fr_packet_codes[code]);
+			return DECODE_FAIL_UNKNOWN_PACKET_CODE;
+		}
+	}
+
+	/*
+	 *	Decode the attributes, in the context of the reply.
+	 *	This only fails if the packet is strangely malformed,
+	 *	or if we run out of memory.
+	 */
+	if (fr_radius_decode(ctx, data, packet_len, original,
+			     inst->secret, talloc_array_length(inst->secret) - 1, reply) < 0) {
+		REDEBUG("Failed decoding attributes for packet");
+		fr_pair_list_free(reply);
+		return DECODE_FAIL_UNKNOWN;
+	}
+
+	RDEBUG("Received %s ID %d length %ld reply packet on connection %s",
+	       fr_packet_codes[code], data[1], packet_len, h->name);
+	log_request_pair_list(L_DBG_LVL_2, request, *reply, NULL);
+
+	*response_code = code;
+
+	/*
+	 *	Record the fact we've seen a response
+	 */
+	u->num_replies++;
+
+	/*
+	 *	Fixup retry times
+	 */
+	if (u->retry.start > h->mrs_time) h->mrs_time = u->retry.start;
+
+	/*
+	 *	Only packets which were sent once give a usable RTT,
+	 *	otherwise we don't know which one the reply is for.
+	 */
+	if (u->retry.start && (!rtt || (u->retry.count == 1))) {
+		fr_time_delta_t	sample = fr_time() - u->retry.start;
+
+		if (rtt) {
+			fr_retry_rtt_update(&rtt[u->code], sample);
+
+			RDEBUG3("Round trip time %pVs, smoothed %pVs, variation %pVs, timeout %pVs",
+				fr_box_time_delta(sample), fr_box_time_delta(rtt[u->code].srtt),
+				fr_box_time_delta(rtt[u->code].rttvar), fr_box_time_delta(rtt[u->code].rto));
+		}
+		radius_health_reply(inst->parent->health, sample);
+	} else {
+		radius_health_reply(inst->parent->health, 0);
+	}
+
+	return DECODE_FAIL_NONE;
+}
+
+/** Encode a request, ready to be signed
+ *
+ * The packet must be signed with #radius_conn_sign, or as part of a
+ * batch with #fr_radius_sign_multi, before it's written to the network.
+ *
+ * @param[in] inst	of the transport.
+ * @param[in] request	to encode.
+ * @param[in] u		the request as sent by the transport.
+ * @param[in] id	to give the packet.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int radius_conn_encode(radius_conn_inst_t const *inst, REQUEST *request, radius_conn_request_t *u, uint8_t id)
+{
+	ssize_t			packet_len;
+	uint8_t			*msg = NULL;
+	int			message_authenticator = u->require_ma * (RADIUS_MESSAGE_AUTHENTICATOR_LENGTH + 2);
+	int			proxy_state = 6;
+
+	fr_assert(inst->parent->allowed[u->code]);
+	fr_assert(!u->packet);
+
+	/*
+	 *	Try to retransmit, unless there are special
+	 *	circumstances.
+	 */
+	u->can_retransmit = true;
+
+	/*
+	 *	This is essentially free, as this memory was
+	 *	pre-allocated as part of the treq.
+	 */
+	u->packet_len = inst->max_packet_size;
+	MEM(u->packet = talloc_array(u, uint8_t, u->packet_len));
+
+	/*
+	 *	All proxied Access-Request packets MUST have a
+	 *	Message-Authenticator, otherwise they're insecure.
+	 *	Same goes for Status-Server.
+	 *
+	 *	And we set the authentication vector to a random
+	 *	number...
+	 */
+	switch (u->code) {
+	case FR_CODE_ACCESS_REQUEST:
+	case FR_CODE_STATUS_SERVER:
+	{
+		size_t i;
+		uint32_t hash, base;
+
+		message_authenticator = RADIUS_MESSAGE_AUTHENTICATOR_LENGTH + 2;
+
+		base = fr_rand();
+		for (i = 0; i < RADIUS_AUTH_VECTOR_LENGTH; i += sizeof(uint32_t)) {
+			hash = fr_rand() ^ base;
+			memcpy(u->packet + RADIUS_AUTH_VECTOR_OFFSET + i, &hash, sizeof(hash));
+		}
+	}
+		FALL_THROUGH;
+
+	default:
+		break;
+	}
+
+
+	/*
+	 *	If we're sending a status check packet, update any
+	 *	necessary timestamps.  Also, don't add Proxy-State, as
+	 *	we're originating the packet.
+	 */
+	if (u->status_check) {
+		VALUE_PAIR *vp;
+
+		proxy_state = 0;
+		vp = fr_pair_find_by_da(request->packet->vps, attr_event_timestamp, TAG_ANY);
+		if (vp) vp->vp_date = fr_time_to_unix_time(u->retry.updated);
+
+		if (u->code == FR_CODE_STATUS_SERVER) u->can_retransmit = false;
+
+	} else if (inst->parent->originate) {
+		/*
+		 *	We're originating packets instead of proxying
+		 *	them.  We don't add a Proxy-State attribute.
+		 */
+		proxy_state = 0;
+	}
+
+	/*
+	 *	We should have at mininum 64-byte packets, so don't
+	 *	bother doing run-time checks here.
+	 */
+	fr_assert(u->packet_len >= (size_t) (RADIUS_HEADER_LENGTH + proxy_state + message_authenticator));
+
+	/*
+	 *	Encode it, leaving room for Proxy-State and
+	 *	Message-Authenticator if necessary.
+	 */
+	packet_len = fr_radius_encode(u->packet, u->packet_len - (proxy_state + message_authenticator), NULL,
+				      inst->secret, talloc_array_length(inst->secret) - 1,
+				      u->code, id, request->packet->vps);
+	if (fr_pair_encode_is_error(packet_len)) {
+		RPERROR("Failed encoding packet");
+
+	error:
+		TALLOC_FREE(u->packet);
+		return -1;
+	}
+
+	if (packet_len < 0) {
+		size_t have;
+		size_t need;
+
+		have = u->packet_len - (proxy_state + message_authenticator);
+		need = have - packet_len;
+
+		if (need > RADIUS_MAX_PACKET_SIZE) {
+			RERROR("Failed encoding packet.  Have %zu bytes of buffer, need %zu bytes",
+			       have, need);
+		} else {
+			RERROR("Failed encoding packet.  Have %zu bytes of buffer, need %zu bytes.  "
+			       "Increase 'max_packet_size'", have, need);
+		}
+
+		goto error;
+	}
+	/*
+	 *	The encoded packet should NOT over-run the input buffer.
+	 */
+	fr_assert((size_t) (packet_len + proxy_state + message_authenticator) <= u->packet_len);
+
+	/*
+	 *	Add Proxy-State to the tail end of the packet.
+	 *
+	 *	We need to add it here, and NOT in
+	 *	request->packet->vps, because multiple modules
+	 *	may be sending the packets at the same time.
+	 */
+	if (proxy_state) {
+		uint8_t		*attr = u->packet + packet_len;
+		VALUE_PAIR	*vp;
+		fr_cursor_t	cursor;
+		int		count = 0;
+
+		/*
+		 *	Count how many Proxy-State attributes have
+		 *	*our* magic number.  Note that we also add a
+		 *	counter to each Proxy-State, so we're double
+		 *	sure that it's a loop.
+		 */
+		if (DEBUG_ENABLED) {
+			for (vp = fr_cursor_iter_by_da_init(&cursor, &request->packet->vps, attr_proxy_state);
+			     vp;
+			     vp = fr_cursor_next(&cursor)) {
+				if ((vp->vp_length == 5) && (memcmp(vp->vp_octets, &inst->parent->proxy_state, 4) == 0)) {
+					count++;
+				}
+			}
+
+			/*
+			 *	Some configurations may proxy to
+			 *	ourselves for tests / simplicity.  But
+			 *	warn if there are a large number of
+			 *	identical Proxy-State attributes.
+			 */
+			if (count >= 4) RWARN("Potential proxy loop detected!  Please recheck your configuration.");
+		}
+
+		attr[0] = (uint8_t)attr_proxy_state->attr;
+		attr[1] = 7;
+		memcpy(attr + 2, &inst->parent->proxy_state, 4);
+		attr[6] = count & 0xff;
+		packet_len += 7;
+
+		MEM(vp = fr_pair_afrom_da(u->packet, attr_proxy_state));
+		fr_pair_value_memdup(vp, attr + 2, 5, true);
+		fr_pair_add(&u->extra, vp);
+	}
+
+	/*
+	 *	Add Message-Authenticator manually.
+	 *
+	 *	Note that the length check will always pass, due to
+	 *	the buflen manipulation done above.
+	 */
+	if (message_authenticator) {
+		msg = u->packet + packet_len;
+
+		msg[0] = (uint8_t) attr_message_authenticator->attr;
+		msg[1] = RADIUS_MESSAGE_AUTHENTICATOR_LENGTH + 2;
+		memset(msg + 2, 0,  RADIUS_MESSAGE_AUTHENTICATOR_LENGTH);
+
+		packet_len += msg[1];
+	}
+
+	/*
+	 *	Update the packet header based on the new attributes.
+	 */
+	u->packet[2] = (packet_len >> 8) & 0xff;
+	u->packet[3] = packet_len & 0xff;
+	u->packet_len = packet_len;
+
+	/*
+	 *	Ensure that we update the Acct-Delay-Time based on the
+	 *	time difference between now, and when we originally
+	 *	received the request.
+	 */
+	if ((u->code == FR_CODE_ACCOUNTING_REQUEST) &&
+	    (fr_pair_find_by_da(request->packet->vps, attr_acct_delay_time, TAG_ANY) != NULL)) {
+		uint8_t *attr, *end;
+		uint32_t delay;
+		fr_time_t now;
+
+		/*
+		 *	Change Acct-Delay-Time in the packet, but not
+		 *	in the debug output.  Oh well.  We don't want
+		 *	to edit the incoming VPs, and we want to
+		 *	update the encoded version of Acct-Delay-Time.
+		 *	So we just walk through the packet to find it.
+		 */
+		end = u->packet + packet_len;
+
+		for (attr = u->packet + RADIUS_HEADER_LENGTH;
+		     attr < end;
+		     attr += attr[1]) {
+			if (attr[0] != attr_acct_delay_time->attr) continue;
+			if (attr[1] != 6) continue;
+
+			now = u->retry.updated;
+
+			/*
+			 *	Add in the time between when
+			 *	we received the packet, and
+			 *	when we're sending the packet.
+			 */
+			memcpy(&delay, attr + 2, 4);
+			delay = ntohl(delay);
+			delay += fr_time_delta_to_sec(now - u->recv_time);
+			delay = htonl(delay);
+			memcpy(attr + 2, &delay, 4);
+			break;
+		}
+
+		u->can_retransmit = false;
+	}
+
+	return 0;
+}
+
+/** Sign a packet encoded by #radius_conn_encode
+ *
+ * @param[in] inst	of the transport.
+ * @param[in] request	the packet belongs to.
+ * @param[in] u		the request as sent by the transport.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, u->packet is freed.
+ */
+int radius_conn_sign(radius_conn_inst_t const *inst, REQUEST *request, radius_conn_request_t *u)
+{
+	if (fr_radius_sign(u->packet, NULL, (uint8_t const *) inst->secret,
+			   talloc_array_length(inst->secret) - 1) < 0) {
+		RPERROR("Failed signing packet");
+		TALLOC_FREE(u->packet);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Revive a connection after "revive_interval"
+ *
+ */
+static void revive_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	radius_conn_handle_t 	*h = tconn->conn->h;
+
+	INFO("%s - Shutting down and reviving connection %s", h->module_name, h->name);
+	fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+}
+
+/** See if the connection is zombied.
+ *
+ *	We check for zombie when major events happen:
+ *
+ *	1) request hits its final timeout
+ *	2) request timer hits, and it needs to be retransmitted
+ *	3) a DUP packet comes in, and the request needs to be retransmitted
+ *	4) we're sending a packet.
+ *
+ *  There MIGHT not be retries configured, so we MUST check for zombie
+ *  when any new packet comes in.  Similarly, there MIGHT not be new
+ *  packets, but retries are configured, so we have to check there,
+ *  too.
+ *
+ *  Also, the socket might not be writable for a while.  There MIGHT
+ *  be a long time between getting the timer / DUP signal, and the
+ *  request finally being written to the socket.  So we need to check
+ *  for zombie at BOTH the timeout and the mux / write function.
+ *
+ *  Connections which are only used for replicating packets never get
+ *  replies, and must not be checked.
+ *
+ * @return
+ *	- true if a connection state change was triggered.
+ *	  The connection is likely now a zombie or was reconnected.
+ *	- false if the connection did not change state.  It may
+ *	  still be a zombie, but it was a zombie when this
+ */
+bool radius_conn_check_for_zombie(fr_event_list_t *el, fr_trunk_connection_t *tconn, fr_time_t now)
+{
+	radius_conn_handle_t	*h = tconn->conn->h;
+
+	/*
+	 *	If there's already a zombie check started, don't do
+	 *	another one.
+	 *
+	 *	Or if we never sent a packet, we don't know (or care)
+	 *	if the home server is up.
+	 *
+	 *	Or if we had sent packets, and then went idle.
+	 *
+	 *	Or we had replies, and then went idle.
+	 *
+	 *	We do checks for both sent && replied, because we
+	 *	could have sent packets without getting replies (and
+	 *	then mark it zombie), or we could have gotten some
+	 *	replies which then stopped coming back (and then mark
+	 *	it zombie).
+	 */
+	if (h->status_checking || h->zombie_ev || !h->last_sent || (h->last_sent <= h->last_idle) ||
+	    (h->last_reply && (h->last_reply <= h->last_idle))) {
+		return false;
+	}
+
+	if (now == 0) now = fr_time();
+
+	/*
+	 *	We've sent a packet since we last went idle, and/or
+	 *	we've received replies since we last went idle.
+	 *
+	 *	If we have a reply, then set the zombie timeout from
+	 *	when we received the last reply.
+	 *
+	 *	If we haven't seen a reply, then set the zombie
+	 *	timeout from when we first started sending packets.
+	 */
+	if (h->last_reply) {
+		if ((h->last_reply + h->inst->parent->zombie_period) >= now) return false;
+		DEBUG2("%s - We have passed 'zombie_period' time since the last reply on connection %s",
+		       h->module_name, h->name);
+	} else {
+		if ((h->first_sent + h->inst->parent->zombie_period) >= now) return false;
+		DEBUG2("%s - We have passed 'zombie_period' time since we first sent a packet, and "
+		       "there have been no replies on connection %s", h->module_name, h->name);
+	}
+
+	/*
+	 *	No status checks: this connection is dead.
+	 *
+	 *	We will requeue this packet on another
+	 *	connection.
+	 */
+	if (!h->inst->parent->status_check) {
+		fr_time_t when;
+
+		WARN("%s - Connection failed.  Reviving it in %pVs", h->module_name,
+		     fr_box_time_delta(h->inst->parent->revive_interval));
+		radius_health_failed(h->inst->parent->health);
+		fr_trunk_connection_signal_inactive(tconn);
+		(void) fr_trunk_connection_requests_requeue(tconn, FR_TRUNK_REQUEST_STATE_ALL, 0, false);
+
+		when = now + h->inst->parent->revive_interval;
+		if (fr_event_timer_at(h, el, &h->zombie_ev, when, revive_timer, tconn) < 0) {
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return true;
+		}
+
+		return true;
+	}
+
+	/*
+	 *	Mark the connection as inactive, but keep sending
+	 *	packets on it.
+	 */
+	WARN("%s - Entering Zombie state - connection %s", h->module_name, h->name);
+	h->status_checking = true;
+	radius_health_failed(h->inst->parent->health);
+
+	/*
+	 *	Move ALL requests to other connections!
+	 */
+	fr_trunk_connection_signal_inactive(tconn);
+	(void) fr_trunk_connection_requests_requeue(tconn, FR_TRUNK_REQUEST_STATE_ALL, 0, false);
+
+	/*
+	 *	Queue up the status check packet.  It will be sent
+	 *	when the connection is writable.
+	 */
+	h->status_u->retry.start = 0;
+	h->status_r->treq = NULL;
+
+	if (fr_trunk_request_enqueue_on_conn(&h->status_r->treq, tconn, h->status_request,
+					     h->status_u, h->status_r, true) != FR_TRUNK_ENQUEUE_OK) {
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+
+	return true;
+}
+
+/** Deal with Protocol-Error replies, and possible negotiation
+ *
+ * If the home server needs more room for its replies, h->max_packet_size
+ * is increased.  The transport grows its receive buffer to match before
+ * the next read, as the reply being processed may still be in it.
+ */
+void radius_conn_protocol_error_reply(radius_conn_request_t *u, radius_conn_result_t *r,
+				      radius_conn_handle_t *h, uint8_t const *data)
+{
+	bool	  	error_601 = false;
+	uint32_t  	response_length = 0;
+	uint8_t const	*attr, *end;
+
+	end = data + ((data[2] << 8) | data[3]);
+
+	for (attr = data + RADIUS_HEADER_LENGTH;
+	     attr < end;
+	     attr += attr[1]) {
+		/*
+		 *	Error-Cause = Response-Too-Big
+		 */
+		if ((attr[0] == attr_error_cause->attr) && (attr[1] == 6)) {
+			uint32_t error;
+
+			memcpy(&error, attr + 2, 4);
+			error = ntohl(error);
+			if (error == 601) error_601 = true;
+			continue;
+		}
+
+		/*
+		 *	The other end wants us to increase our Response-Length
+		 */
+		if ((attr[0] == attr_response_length->attr) && (attr[1] == 6)) {
+			memcpy(&response_length, attr + 2, 4);
+			response_length = ntohl(response_length);
+			continue;
+		}
+
+		/*
+		 *	Protocol-Error packets MUST contain an
+		 *	Original-Packet-Code attribute.
+		 *
+		 *	The attribute containing the
+		 *	Original-Packet-Code is an extended
+		 *	attribute.
+		 */
+		if (attr[0] != attr_extended_attribute_1->attr) continue;
+
+		/*
+		 *	ATTR + LEN + EXT-Attr + uint32
+		 */
+		if (attr[1] != 7) continue;
+
+		/*
+		 *	See if there's an Original-Packet-Code.
+		 */
+		if (attr[2] != (uint8_t)attr_original_packet_code->attr) continue;
+
+		/*
+		 *	Has to be an 8-bit number.
+		 */
+		if ((attr[3] != 0) ||
+		    (attr[4] != 0) ||
+		    (attr[5] != 0)) {
+			if (r) r->rcode = RLM_MODULE_FAIL;
+			return;
+		}
+
+		/*
+		 *	The value has to match.  We don't
+		 *	currently multiplex different codes
+		 *	with the same IDs on connections.  So
+		 *	this check is just for RFC compliance,
+		 *	and for sanity.
+		 */
+		if (attr[6] != u->code) {
+			if (r) r->rcode = RLM_MODULE_FAIL;
+			return;
+		}
+	}
+
+	/*
+	 *	Error-Cause = Response-Too-Big
+	 *
+	 *	The other end says it needs more room to send it's response
+	 *
+	 *	Limit it to reasonable values.
+	 */
+	if (error_601 && response_length && (response_length > h->max_packet_size)) {
+		if (response_length < 4096) response_length = 4096;
+		if (response_length > 65535) response_length = 65535;
+
+		DEBUG("%s - Increasing buffer size to %u for connection %s", h->module_name, response_length, h->name);
+
+		h->max_packet_size = response_length;
+	}
+
+	/*
+	 *	fail - something went wrong internally, or with the connection.
+	 *	invalid - wrong response to packet
+	 *	handled - best remaining alternative :(
+	 *
+	 *	i.e. if the response is NOT accept, reject, whatever,
+	 *	then we shouldn't allow the caller to do any more
+	 *	processing of this packet.  There was a protocol
+	 *	error, and the response is valid, but not useful for
+	 *	anything.
+	 */
+	if (r) r->rcode = RLM_MODULE_HANDLED;
+}
+
+/** Handle retries for a status check
+ *
+ */
+static void status_check_next(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	radius_conn_handle_t	*h = tconn->conn->h;
+
+	if (fr_trunk_request_enqueue_on_conn(&h->status_r->treq, tconn, h->status_request,
+					     h->status_u, h->status_r, true) != FR_TRUNK_ENQUEUE_OK) {
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Deal with replies replies to status checks and possible negotiation
+ *
+ */
+static void status_check_reply(fr_trunk_request_t *treq, fr_time_t now, uint8_t const *data)
+{
+	fr_connection_t		*conn = treq->tconn->conn;
+	radius_conn_handle_t	*h = conn->h;
+	rlm_radius_t const 	*inst = h->inst->parent;
+	radius_conn_request_t	*u = talloc_get_type_abort(treq->preq, radius_conn_request_t);
+	radius_conn_result_t	*r = talloc_get_type_abort(treq->rctx, radius_conn_result_t);
+
+	fr_assert(treq->preq == h->status_u);
+	fr_assert(treq->rctx == h->status_r);
+
+	r->treq = NULL;
+
+	/*
+	 *	@todo - do other negotiation and signaling.
+	 */
+	if (data[0] == FR_CODE_PROTOCOL_ERROR) radius_conn_protocol_error_reply(u, NULL, h, data);
+
+	if (u->num_replies < inst->num_answers_to_alive) {
+		DEBUG("Received %d / %u replies for status check, on connection - %s",
+		      u->num_replies, inst->num_answers_to_alive, h->name);
+		DEBUG("Next status check packet will be in %pVs", fr_box_time_delta(u->retry.next - now));
+
+		/*
+		 *	If we're retransmitting, leave the ID,
+		 *	packet and associated resources alone.
+		 *
+		 *	Otherwise free resources.
+		 */
+		if (!u->can_retransmit) radius_conn_request_reset(u);
+
+		/*
+		 *	Set the timer for the next retransmit.
+		 */
+		if (fr_event_timer_at(h, conn->el, &u->ev, u->retry.next, status_check_next, treq->tconn) < 0) {
+			fr_trunk_connection_signal_reconnect(treq->tconn, FR_CONNECTION_FAILED);
+		}
+		return;
+	}
+
+	DEBUG("Received enough replies to status check, marking connection as active - %s", h->name);
+
+	/*
+	 *	Set the "last idle" time to now, so that we don't
+	 *	restart zombie_period until sufficient time has
+	 *	passed.
+	 */
+	h->last_idle = fr_time();
+
+	/*
+	 *	Reset retry interval and retransmission counters
+	 *	also frees u->ev.
+	 */
+	radius_conn_status_check_reset(h, u);
+	radius_health_alive(inst->health);
+	fr_trunk_connection_signal_active(treq->tconn);
+}
+
+/** Process one reply packet
+ *
+ * @param[in] h		connection handle the packet was read from.
+ * @param[in] tt	ID tracking for the socket the packet was read from.
+ * @param[in] rtt	Round trip time estimates to update, see #radius_conn_decode.
+ * @param[in] data	the packet.
+ * @param[in] data_len	length of the packet.
+ */
+void radius_conn_packet_demux(radius_conn_handle_t *h, radius_track_t *tt, fr_retry_rtt_t *rtt,
+			      uint8_t *data, size_t data_len)
+{
+	fr_trunk_request_t	*treq;
+	REQUEST			*request;
+	radius_conn_request_t	*u;
+	radius_conn_result_t	*r;
+	radius_track_entry_t	*rr;
+	decode_fail_t		reason;
+	uint8_t			code = 0;
+	VALUE_PAIR		*reply = NULL;
+	fr_time_t		now;
+
+	/*
+	 *	Note that we don't care about packet codes.  All
+	 *	packet codes share the same ID space.
+	 */
+	rr = radius_track_entry_find(tt, data[1], NULL);
+	if (!rr) {
+		WARN("%s - Ignoring reply with ID %i that arrived too late",
+		     h->module_name, data[1]);
+		return;
+	}
+
+	treq = talloc_get_type_abort(rr->uctx, fr_trunk_request_t);
+	request = treq->request;
+	fr_assert(request != NULL);
+	u = talloc_get_type_abort(treq->preq, radius_conn_request_t);
+	r = talloc_get_type_abort(treq->rctx, radius_conn_result_t);
+
+	/*
+	 *	Validate and decode the incoming packet
+	 */
+	reason = radius_conn_decode(request->reply, &reply, &code, h, request, u, rr->vector, rtt, data, data_len);
+	if (reason != DECODE_FAIL_NONE) {
+		RWDEBUG("Ignoring invalid response");
+		return;
+	}
+
+	/*
+	 *	Only valid packets are processed
+	 *	Otherwise an attacker could perform
+	 *	a DoS attack against the proxying servers
+	 *	by sending fake responses for upstream
+	 *	servers.
+	 */
+	h->last_reply = now = fr_time();
+
+	/*
+	 *	Status-Server can have any reply code, we don't care
+	 *	what it is.  So long as it's signed properly, we
+	 *	accept it.  This flexibility is because we don't
+	 *	expose Status-Server to the admins.  It's only used by
+	 *	this module for internal signalling.
+	 */
+	if (u == h->status_u) {
+		fr_pair_list_free(&reply);	/* Probably want to pass this to status_check_reply? */
+		status_check_reply(treq, now, data);
+		fr_trunk_request_signal_complete(treq);
+		return;
+	}
+
+	/*
+	 *	Handle any state changes, etc. needed by receiving a
+	 *	Protocol-Error reply packet.
+	 *
+	 *	Protocol-Error is permitted as a reply to any
+	 *	packet.
+	 */
+	if (code == FR_CODE_PROTOCOL_ERROR) radius_conn_protocol_error_reply(u, r, h, data);
+
+	/*
+	 *	Mark up the request as being an Access-Challenge, if
+	 *	required.
+	 *
+	 *	We don't do this for other packet types, because the
+	 *	ok/fail nature of the module return code will
+	 *	automatically result in it the parent request
+	 *	returning an ok/fail packet code.
+	 */
+	if ((u->code == FR_CODE_ACCESS_REQUEST) && (code == FR_CODE_ACCESS_CHALLENGE)) {
+		VALUE_PAIR	*vp;
+
+		vp = fr_pair_find_by_da(request->reply->vps, attr_packet_type, TAG_ANY);
+		if (!vp) {
+			MEM(vp = fr_pair_afrom_da(request->reply, attr_packet_type));
+			vp->vp_uint32 = FR_CODE_ACCESS_CHALLENGE;
+			fr_pair_add(&request->reply->vps, vp);
+		}
+	}
+
+	/*
+	 *	Delete Proxy-State attributes from the reply.
+	 */
+	fr_pair_delete_by_da(&reply, attr_proxy_state);
+
+	/*
+	 *	If the reply has Message-Authenticator, delete
+	 *	it from the proxy reply so that it isn't
+	 *	copied over to our reply.  But also create a
+	 *	reply:Message-Authenticator attribute, so that
+	 *	it ends up in our reply.
+	 */
+	if (fr_pair_find_by_da(reply, attr_message_authenticator, TAG_ANY)) {
+		VALUE_PAIR *vp;
+
+		fr_pair_delete_by_da(&reply, attr_message_authenticator);
+
+		MEM(vp = fr_pair_afrom_da(request->reply, attr_message_authenticator));
+		(void) fr_pair_value_memdup(vp, (uint8_t const *) "", 1, false);
+		fr_pair_add(&request->reply->vps, vp);
+	}
+
+	treq->request->reply->code = code;
+	r->rcode = radius_code_to_rcode[code];
+	fr_pair_add(&request->reply->vps, reply);
+	fr_trunk_request_signal_complete(treq);
+}
+
+/** Remove the request from any tracking structures
+ *
+ * Frees encoded packets if the request is being moved to a new connection
+ */
+void radius_conn_request_cancel(UNUSED fr_connection_t *conn, void *preq_to_reset,
+				fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
+{
+	radius_conn_request_t	*u = talloc_get_type_abort(preq_to_reset, radius_conn_request_t);
+
+	/*
+	 *	Request has been requeued on the same
+	 *	connection due to timeout or DUP signal.  We
+	 *	keep the same packet to avoid re-encoding it.
+	 */
+	if (reason == FR_TRUNK_CANCEL_REASON_REQUEUE) {
+		/*
+		 *	Delete the request_timeout
+		 *
+		 *	Note: There might not be a request timeout
+		 *	set in the case where the request was
+		 *	queued for sending but never actually
+		 *	sent.
+		 */
+		if (u->ev) (void) fr_event_timer_delete(&u->ev);
+		if (!u->can_retransmit) radius_conn_request_reset(u);
+	}
+
+	/*
+	 *      Other cancellations are dealt with by
+	 *      request_conn_release as the request is removed
+	 *	from the trunk.
+	 */
+}
+
+/** Clear out anything associated with a connection with a single ID space from the request
+ *
+ */
+void radius_conn_request_conn_release(fr_connection_t *conn, void *preq_to_reset, UNUSED void *uctx)
+{
+	radius_conn_request_t	*u = talloc_get_type_abort(preq_to_reset, radius_conn_request_t);
+	radius_conn_handle_t	*h = conn->h;
+
+	if (u->ev) (void)fr_event_timer_delete(&u->ev);
+	if (u->packet) radius_conn_request_reset(u);
+
+	u->num_replies = 0;
+
+	/*
+	 *	If there are no outstanding tracking entries
+	 *	allocated then the connection is "idle".
+	 */
+	if (!h->tt || (h->tt->num_requests == 0)) h->last_idle = fr_time();
+}
+
+/** Write out a canned failure
+ *
+ */
+void radius_conn_request_fail(REQUEST *request, void *preq, void *rctx,
+			      NDEBUG_UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	radius_conn_result_t	*r = talloc_get_type_abort(rctx, radius_conn_result_t);
+	radius_conn_request_t	*u = talloc_get_type_abort(preq, radius_conn_request_t);
+
+	fr_assert(!u->rr && !u->packet && !u->extra && !u->ev);	/* Dealt with by request_conn_release */
+
+	fr_assert(state != FR_TRUNK_REQUEST_STATE_INIT);
+
+	if (u->status_check) return;
+
+	r->rcode = RLM_MODULE_FAIL;
+	r->treq = NULL;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Response has already been written to the rctx at this point
+ *
+ */
+void radius_conn_request_complete(REQUEST *request, void *preq, void *rctx, UNUSED void *uctx)
+{
+	radius_conn_result_t	*r = talloc_get_type_abort(rctx, radius_conn_result_t);
+	radius_conn_request_t	*u = talloc_get_type_abort(preq, radius_conn_request_t);
+
+	fr_assert(!u->rr && !u->packet && !u->extra && !u->ev);	/* Dealt with by request_conn_release */
+
+	if (u->status_check) return;
+
+	r->treq = NULL;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Explicitly free resources associated with the protocol request
+ *
+ */
+void radius_conn_request_free(UNUSED REQUEST *request, void *preq_to_free, UNUSED void *uctx)
+{
+	radius_conn_request_t	*u = talloc_get_type_abort(preq_to_free, radius_conn_request_t);
+
+	fr_assert(!u->rr && !u->packet && !u->extra && !u->ev);	/* Dealt with by request_conn_release */
+
+	/*
+	 *	Don't free status check requests.
+	 */
+	if (u->status_check) return;
+
+	talloc_free(u);
+}
+
+/** Free a radius_conn_request_t
+ */
+static int _radius_conn_request_free(radius_conn_request_t *u)
+{
+	if (u->ev) (void) fr_event_timer_delete(&u->ev);
+
+	fr_assert(u->rr == NULL);
+
+	return 0;
+}
+
+/** Duplicate a slow request, so it can be sent on another connection
+ *
+ * Only Access-Requests which don't continue a multi-round exchange are
+ * duplicated.  Anything else would either be counted twice by the home
+ * server, or would confuse its session state.
+ */
+void *radius_conn_request_hedge(fr_trunk_request_t *treq, REQUEST *request, void const *preq, UNUSED void *uctx)
+{
+	radius_conn_request_t const	*u = talloc_get_type_abort_const(preq, radius_conn_request_t);
+	radius_conn_request_t		*hedge;
+
+	if (u->status_check || (u->code != FR_CODE_ACCESS_REQUEST)) return NULL;
+
+	if (fr_pair_find_by_da(request->packet->vps, attr_state, TAG_ANY)) return NULL;
+
+	MEM(hedge = talloc(treq, radius_conn_request_t));
+	*hedge = (radius_conn_request_t){
+		.code = u->code,
+		.synchronous = u->synchronous,
+		.priority = u->priority,
+		.recv_time = u->recv_time,
+		.require_ma = u->require_ma
+	};
+	talloc_set_destructor(hedge, _radius_conn_request_free);
+
+	return hedge;
+}
+
+/** Resume execution of the request, returning the rcode set during trunk execution
+ *
+ */
+rlm_rcode_t radius_conn_resume(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request, void *rctx)
+{
+	radius_conn_result_t	*r = talloc_get_type_abort(rctx, radius_conn_result_t);
+	rlm_rcode_t		rcode = r->rcode;
+
+	talloc_free(rctx);
+
+	return rcode;
+}
+
+/** Enqueue a request with the trunk of the transport
+ *
+ */
+rlm_rcode_t radius_conn_enqueue(void **rctx_out, void *instance, void *thread, REQUEST *request)
+{
+	radius_conn_inst_t const	*inst = instance;
+	radius_conn_thread_t		*t = thread;
+	radius_conn_result_t		*r;
+	radius_conn_request_t		*u;
+	fr_trunk_request_t		*treq;
+
+	fr_assert(request->packet->code > 0);
+	fr_assert(request->packet->code < FR_RADIUS_MAX_PACKET_CODE);
+
+	if (request->packet->code == FR_CODE_STATUS_SERVER) {
+		RWDEBUG("Status-Server is reserved for internal use, and cannot be sent manually.");
+		return RLM_MODULE_NOOP;
+	}
+
+	treq = fr_trunk_request_alloc(t->trunk, request);
+	if (!treq) return RLM_MODULE_FAIL;
+
+	MEM(r = talloc_zero(request, radius_conn_result_t));
+	MEM(u = talloc(treq, radius_conn_request_t));
+
+	*u = (radius_conn_request_t){
+		.code = request->packet->code,
+		.synchronous = inst->parent->synchronous,
+		.priority = request->async->priority,
+		.recv_time = request->async->recv_time
+	};
+
+	r->rcode = RLM_MODULE_FAIL;
+
+	/*
+	 *	Make sure that we print out the actual encoded value
+	 *	of the Message-Authenticator attribute.  If the caller
+	 *	asked for one, delete theirs (which has a bad value),
+	 *	and remember to add one manually when we encode the
+	 *	packet.  This is the only editing we do on the input
+	 *	request.
+	 *
+	 *	@todo - don't edit the input packet!
+	 */
+	if (fr_pair_find_by_da(request->packet->vps, attr_message_authenticator, TAG_ANY)) {
+		u->require_ma = true;
+		pair_delete_request(attr_message_authenticator);
+	}
+
+	if (fr_trunk_request_enqueue(&treq, t->trunk, request, u, r) < 0) {
+		fr_assert(!u->rr && !u->packet);	/* Should not have been fed to the muxer */
+		fr_trunk_request_free(&treq);		/* Return to the free list */
+		talloc_free(r);
+		return RLM_MODULE_FAIL;
+	}
+
+	r->treq = treq;	/* Remember for signalling purposes */
+	talloc_set_destructor(u, _radius_conn_request_free);
+
+	*rctx_out = r;
+
+	return RLM_MODULE_YIELD;
+}
+
+/** Check the configuration common to all transports
+ *
+ * @param[in] inst	data for the transport.
+ * @param[in] conf	configuration section of the transport.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int radius_conn_instantiate(radius_conn_inst_t *inst, CONF_SECTION *conf)
+{
+	rlm_radius_t		*parent = talloc_get_type_abort(dl_module_parent_data_by_child_data(inst),
+								rlm_radius_t);
+
+	if (!parent) {
+		ERROR("IO module cannot be instantiated directly");
+		return -1;
+	}
+
+	inst->parent = parent;
+
+	/*
+	 *	Ensure that we have a destination address.
+	 */
+	if (inst->dst_ipaddr.af == AF_UNSPEC) {
+		cf_log_err(conf, "A value must be given for 'ipaddr'");
+		return -1;
+	}
+
+	/*
+	 *	If src_ipaddr isn't set, make sure it's INADDR_ANY, of
+	 *	the same address family as dst_ipaddr.
+	 */
+	if (inst->src_ipaddr.af == AF_UNSPEC) {
+		memset(&inst->src_ipaddr, 0, sizeof(inst->src_ipaddr));
+
+		inst->src_ipaddr.af = inst->dst_ipaddr.af;
+
+		if (inst->src_ipaddr.af == AF_INET) {
+			inst->src_ipaddr.prefix = 32;
+		} else {
+			inst->src_ipaddr.prefix = 128;
+		}
+	}
+
+	else if (inst->src_ipaddr.af != inst->dst_ipaddr.af) {
+		cf_log_err(conf, "The 'ipaddr' and 'src_ipaddr' configuration items must "
+			   "be both of the same address family");
+		return -1;
+	}
+
+	if (!inst->dst_port) {
+		cf_log_err(conf, "A value must be given for 'port'");
+		return -1;
+	}
+
+	/*
+	 *	Clamp max_packet_size first before checking recv_buff and send_buff
+	 */
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 64);
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65535);
+
+	if (inst->recv_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, >=, inst->max_packet_size);
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, <=, (1 << 30));
+	}
+
+	if (inst->send_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, >=, inst->max_packet_size);
+		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, <=, (1 << 30));
+	}
+
+	return 0;
+}
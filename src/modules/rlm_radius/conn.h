@@ -0,0 +1,209 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file conn.h
+ * @brief Connection and request handling shared by the rlm_radius transports
+ *
+ * @copyright 2017 Network RADIUS SARL
+ * @copyright 2020 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
+ */
+
+#include <freeradius-devel/server/connection.h>
+
+#include "rlm_radius.h"
+#include "track.h"
+
+/** Configuration common to all transports
+ *
+ * Must be at the start of the instance data of the transport.
+ */
+#define RADIUS_CONN_INST_COMMON \
+	struct { \
+		rlm_radius_t		*parent;		/* rlm_radius instance. */ \
+		CONF_SECTION		*config; \
+		fr_ipaddr_t		dst_ipaddr;		/* IP of the home server. */ \
+		fr_ipaddr_t		src_ipaddr;		/* IP we open our socket on. */ \
+		uint16_t		dst_port;		/* Port of the home server. */ \
+		char const		*secret;		/* Shared secret. */ \
+		uint32_t		recv_buff;		/* How big the kernel's receive buffer should be. */ \
+		uint32_t		send_buff;		/* How big the kernel's send buffer should be. */ \
+		uint32_t		max_packet_size;	/* Maximum packet size. */ \
+		uint16_t		max_send_coalesce;	/* Maximum number of packets to send in one call. */ \
+		bool			recv_buff_is_set;	/* Whether we were provided with a recv_buf */ \
+		bool			send_buff_is_set;	/* Whether we were provided with a send_buf */ \
+		fr_trunk_conf_t		*trunk_conf;		/* trunk configuration */ \
+	}
+
+typedef struct {
+	RADIUS_CONN_INST_COMMON;
+} radius_conn_inst_t;
+
+/** Thread data common to all transports
+ *
+ * Must be at the start of the thread data of the transport.
+ */
+#define RADIUS_CONN_THREAD_COMMON \
+	struct { \
+		fr_event_list_t		*el;			/* Event list. */ \
+		radius_conn_inst_t const *inst;			/* our instance */ \
+		fr_trunk_t		*trunk;			/* trunk handler */ \
+	}
+
+typedef struct {
+	RADIUS_CONN_THREAD_COMMON;
+} radius_conn_thread_t;
+
+typedef struct {
+	fr_trunk_request_t	*treq;
+	rlm_rcode_t		rcode;			//!< from the transport
+} radius_conn_result_t;
+
+typedef struct radius_conn_request_s radius_conn_request_t;
+
+/** Connection handle fields common to all transports
+ *
+ * Must be at the start of the connection handle of the transport.
+ */
+#define RADIUS_CONN_HANDLE_COMMON \
+	struct { \
+		char const		*name;			/* From IP PORT to IP PORT. */ \
+		char const		*module_name;		/* the module that opened the connection */ \
+		int			fd;			/* File descriptor. */ \
+		radius_conn_inst_t const *inst;			/* Our module instance. */ \
+		uint32_t		max_packet_size;	/* Our max packet size. may be different from the parent. */ \
+		fr_ipaddr_t		src_ipaddr;		/* Source IP address. */ \
+		uint16_t		src_port;		/* Source port. */ \
+		radius_track_t		*tt;			/* RADIUS ID tracking structure. */ \
+		fr_time_t		mrs_time;		/* Most recent sent time which had a reply. */ \
+		fr_time_t		last_reply;		/* When we last received a reply. */ \
+		fr_time_t		first_sent;		/* first time we sent a packet since going idle */ \
+		fr_time_t		last_sent;		/* last time we sent a packet. */ \
+		fr_time_t		last_idle;		/* last time we had nothing to do */ \
+		fr_event_timer_t const	*zombie_ev;		/* Zombie timeout. */ \
+		bool			status_checking;	/* whether we're doing status checks */ \
+		radius_conn_request_t	*status_u;		/* for sending status check packets */ \
+		radius_conn_result_t	*status_r;		/* for faking out status checks as real packets */ \
+		REQUEST			*status_request; \
+	}
+
+typedef struct {
+	RADIUS_CONN_HANDLE_COMMON;
+} radius_conn_handle_t;
+
+/** Connect REQUEST to local tracking structure
+ *
+ */
+struct radius_conn_request_s {
+	uint32_t		priority;		//!< copied from request->async->priority
+	fr_time_t		recv_time;		//!< copied from request->async->recv_time
+
+	uint32_t		num_replies;		//!< number of reply packets, sent is in retry.count
+
+	bool			synchronous;		//!< cached from inst->parent->synchronous
+	bool			require_ma;		//!< saved from the original packet.
+	bool			can_retransmit;		//!< can we send this packet again, as-is?
+	bool			status_check;		//!< is this packet a status check?
+
+	VALUE_PAIR		*extra;			//!< VPs for debugging, like Proxy-State.
+
+	uint8_t			code;			//!< Packet code.
+	uint8_t			id;			//!< Last ID assigned to this packet.
+	uint8_t			*packet;		//!< Packet we write to the network.
+	size_t			packet_len;		//!< Length of the packet.
+
+	radius_track_entry_t	*rr;			//!< ID tracking, resend count, etc.
+	void			*sock;			//!< Transport specific socket the ID was allocated from.
+	fr_event_timer_t const	*ev;			//!< timer for retransmissions
+	fr_retry_t		retry;			//!< retransmission timers
+};
+
+/*
+ *	Defined by each transport, and loaded by its own
+ *	dictionary autoload list.
+ */
+extern fr_dict_attr_t const *attr_acct_delay_time;
+extern fr_dict_attr_t const *attr_error_cause;
+extern fr_dict_attr_t const *attr_event_timestamp;
+extern fr_dict_attr_t const *attr_extended_attribute_1;
+extern fr_dict_attr_t const *attr_message_authenticator;
+extern fr_dict_attr_t const *attr_nas_identifier;
+extern fr_dict_attr_t const *attr_original_packet_code;
+extern fr_dict_attr_t const *attr_proxy_state;
+extern fr_dict_attr_t const *attr_response_length;
+extern fr_dict_attr_t const *attr_state;
+extern fr_dict_attr_t const *attr_user_password;
+extern fr_dict_attr_t const *attr_packet_type;
+
+#ifndef NDEBUG
+void			radius_conn_tracking_entry_log(fr_log_t const *log, fr_log_type_t log_type,
+						       char const *file, int line, radius_track_entry_t *te);
+#endif
+
+void			radius_conn_request_reset(radius_conn_request_t *u) CC_HINT(nonnull);
+
+void			radius_conn_status_check_alloc(fr_event_list_t *el, radius_conn_handle_t *h) CC_HINT(nonnull);
+
+void			radius_conn_status_check_reset(radius_conn_handle_t *h, radius_conn_request_t *u) CC_HINT(nonnull);
+
+void			radius_conn_close(fr_event_list_t *el, void *handle, void *uctx);
+
+fr_connection_state_t	radius_conn_failed(void *handle, fr_connection_state_t state, void *uctx);
+
+int8_t			radius_conn_request_prioritise(void const *one, void const *two);
+
+decode_fail_t		radius_conn_decode(TALLOC_CTX *ctx, VALUE_PAIR **reply, uint8_t *response_code,
+					   radius_conn_handle_t *h, REQUEST *request, radius_conn_request_t *u,
+					   uint8_t const request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH],
+					   fr_retry_rtt_t *rtt, uint8_t *data, size_t data_len);
+
+int			radius_conn_encode(radius_conn_inst_t const *inst, REQUEST *request,
+					   radius_conn_request_t *u, uint8_t id);
+
+int			radius_conn_sign(radius_conn_inst_t const *inst, REQUEST *request,
+					 radius_conn_request_t *u);
+
+bool			radius_conn_check_for_zombie(fr_event_list_t *el, fr_trunk_connection_t *tconn, fr_time_t now);
+
+void			radius_conn_protocol_error_reply(radius_conn_request_t *u, radius_conn_result_t *r,
+							 radius_conn_handle_t *h, uint8_t const *data);
+
+void			radius_conn_packet_demux(radius_conn_handle_t *h, radius_track_t *tt, fr_retry_rtt_t *rtt,
+						 uint8_t *data, size_t data_len);
+
+void			radius_conn_request_cancel(fr_connection_t *conn, void *preq_to_reset,
+						   fr_trunk_cancel_reason_t reason, void *uctx);
+
+void			radius_conn_request_conn_release(fr_connection_t *conn, void *preq_to_reset, void *uctx);
+
+void			radius_conn_request_fail(REQUEST *request, void *preq, void *rctx,
+						 fr_trunk_request_state_t state, void *uctx);
+
+void			radius_conn_request_complete(REQUEST *request, void *preq, void *rctx, void *uctx);
+
+void			radius_conn_request_free(REQUEST *request, void *preq_to_free, void *uctx);
+
+void			*radius_conn_request_hedge(fr_trunk_request_t *treq, REQUEST *request,
+						   void const *preq, void *uctx);
+
+rlm_rcode_t		radius_conn_resume(module_ctx_t const *mctx, REQUEST *request, void *rctx);
+
+rlm_rcode_t		radius_conn_enqueue(void **rctx_out, void *instance, void *thread, REQUEST *request);
+
+int			radius_conn_instantiate(radius_conn_inst_t *inst, CONF_SECTION *conf);
@@ -121,6 +121,8 @@ static CONF_PARSER const module_config[] = {
 
 	{ FR_CONF_OFFSET("revive_interval", FR_TYPE_TIME_DELTA, rlm_radius_t, revive_interval) },
 
+	{ FR_CONF_OFFSET("slow_start", FR_TYPE_TIME_DELTA, rlm_radius_t, slow_start), .dflt = STRINGIFY(10) },
+
 	{ FR_CONF_OFFSET("pool", FR_TYPE_SUBSECTION, rlm_radius_t, trunk_conf), .subcs = (void const *) fr_trunk_config, },
 
 	CONF_PARSER_TERMINATOR
@@ -375,6 +377,8 @@ static void mod_radius_signal(module_ctx_t const *mctx, REQUEST *request, void *
 	 */
 	if ((action == FR_SIGNAL_DUP) && !inst->synchronous) return;
 
+	if (action == FR_SIGNAL_CANCEL) atomic_fetch_sub_explicit(&inst->health->outstanding, 1, memory_order_relaxed);
+
 	if (!inst->io->signal) return;
 
 	inst->io->signal(&(module_ctx_t){.instance = inst->io_instance, .thread = t->io_thread }, request, rctx, action);
@@ -389,6 +393,8 @@ static rlm_rcode_t mod_radius_resume(module_ctx_t const *mctx, REQUEST *request,
 	rlm_radius_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_radius_t);
 	rlm_radius_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_radius_thread_t);
 
+	atomic_fetch_sub_explicit(&inst->health->outstanding, 1, memory_order_relaxed);
+
 	return inst->io->resume(&(module_ctx_t){.instance = inst->io_instance, .thread = t->io_thread }, request, ctx);
 }
 
@@ -489,9 +495,46 @@ static rlm_rcode_t CC_HINT(nonnull) mod_process(module_ctx_t const *mctx, REQUES
 		return rcode;
 	}
 
+	atomic_fetch_add_explicit(&inst->health->outstanding, 1, memory_order_relaxed);
+
 	return unlang_module_yield(request, mod_radius_resume, mod_radius_signal, rctx);
 }
 
+/** Report the health of the home server to load-balance sections
+ *
+ * A home server which has a failed or zombie connection, and which
+ * hasn't had one come back since, gets no traffic.  Once a connection
+ * comes back, its share of traffic ramps up over slow_start.
+ */
+static int mod_health(void const *instance, module_health_t *health)
+{
+	rlm_radius_t const	*inst = talloc_get_type_abort_const(instance, rlm_radius_t);
+	fr_time_t		failed, recovered, now;
+
+	if (inst->replicate || !inst->health) return -1;
+
+	health->latency = atomic_load_explicit(&inst->health->latency, memory_order_relaxed);
+	health->loss = atomic_load_explicit(&inst->health->loss, memory_order_relaxed);
+	health->outstanding = atomic_load_explicit(&inst->health->outstanding, memory_order_relaxed);
+	health->weight = RADIUS_HEALTH_SCALE;
+
+	failed = atomic_load_explicit(&inst->health->failed, memory_order_relaxed);
+	recovered = atomic_load_explicit(&inst->health->recovered, memory_order_relaxed);
+
+	if (failed > recovered) {
+		health->weight = 0;
+		return 0;
+	}
+
+	now = fr_time();
+	if (recovered && inst->slow_start && ((now - recovered) < inst->slow_start)) {
+		health->weight = ((now - recovered) * RADIUS_HEALTH_SCALE) / inst->slow_start;
+		if (!health->weight) health->weight = 1;
+	}
+
+	return 0;
+}
+
 /** Destroy thread data for the submodule.
  *
  */
@@ -556,10 +599,27 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
  *	- 0 on success.
  *	- -1 on failure.
  */
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_radius_t *inst = talloc_get_type_abort(instance, rlm_radius_t);
 
+	MEM(inst->health = talloc_zero(inst, rlm_radius_health_t));
+	atomic_init(&inst->health->latency, 0);
+	atomic_init(&inst->health->loss, 0);
+	atomic_init(&inst->health->outstanding, 0);
+	atomic_init(&inst->health->failed, 0);
+	atomic_init(&inst->health->recovered, 0);
+
+	if (fr_trunk_budget_alloc(inst, &inst->trunk_conf, inst->name) < 0) {
+		cf_log_perr(conf, "Failed allocating connection budget");
+		return -1;
+	}
+
+	if (fr_trunk_breaker_alloc(inst, &inst->trunk_conf, inst->name, "modules.radius.trunk") < 0) {
+		cf_log_perr(conf, "Failed allocating circuit breaker");
+		return -1;
+	}
+
 	if (inst->io->instantiate && inst->io->instantiate(inst->io_instance, inst->io_conf) < 0) return -1;
 
 	return 0;
@@ -584,15 +644,20 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	if (!inst->name) inst->name = cf_section_name1(conf);
 
 	/*
-	 *	These limits are specific to RADIUS, and cannot be over-ridden
+	 *	These limits are specific to RADIUS, and cannot be over-ridden.
+	 *
+	 *	The transport checks the upper limit again, as it
+	 *	depends on how many source ports each connection has.
 	 */
 	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, >=, 2);
-	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, <=, 255);
+	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, <=, 65535);
 	FR_INTEGER_BOUND_CHECK("trunk.per_connection_target", inst->trunk_conf.target_req_per_conn, <=, inst->trunk_conf.max_req_per_conn / 2);
 
 	FR_TIME_DELTA_BOUND_CHECK("zombie_period", inst->zombie_period, >=, fr_time_delta_from_sec(1));
 	FR_TIME_DELTA_BOUND_CHECK("zombie_period", inst->zombie_period, <=, fr_time_delta_from_sec(120));
 
+	FR_TIME_DELTA_BOUND_CHECK("slow_start", inst->slow_start, <=, fr_time_delta_from_sec(600));
+
 	if (!inst->status_check) {
 		FR_TIME_DELTA_BOUND_CHECK("revive_interval", inst->revive_interval, >=, fr_time_delta_from_sec(10));
 		FR_TIME_DELTA_BOUND_CHECK("revive_interval", inst->revive_interval, <=, fr_time_delta_from_sec(3600));
@@ -800,6 +865,7 @@ module_t rlm_radius = {
 	.thread_inst_type = "rlm_radius_thread_t",
 	.thread_instantiate = mod_thread_instantiate,
 	.thread_detach	= mod_thread_detach,
+	.health		= mod_health,
 	.methods = {
 		[MOD_PREACCT]		= mod_process,
 		[MOD_ACCOUNTING]	= mod_process,
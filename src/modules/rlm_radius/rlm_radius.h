@@ -44,6 +44,29 @@ typedef struct {
 	void			*io_thread;		//!< thread context for the IO submodule
 } rlm_radius_thread_t;
 
+/** How quickly the health averages follow new samples, as a power of two
+ *
+ */
+#define RADIUS_HEALTH_SHIFT	(3)
+
+/** Scale of the loss rate moving average
+ */
+#define RADIUS_HEALTH_SCALE	(1024)
+
+/** Health of the home server, shared by all threads
+ *
+ * Updated by the IO submodule, and reported to load-balance sections.
+ * Racing updates may lose a sample, which doesn't matter for an
+ * average.
+ */
+typedef struct {
+	atomic_uint_fast64_t	latency;		//!< Moving average of the response time, in nanoseconds.
+	atomic_uint_fast32_t	loss;			//!< Moving average of the loss rate, 0 to 1024.
+	atomic_uint_fast32_t	outstanding;		//!< Requests currently being proxied.
+	atomic_int_fast64_t	failed;			//!< When a connection last failed or went zombie.
+	atomic_int_fast64_t	recovered;		//!< When a connection came back after a failure.
+} rlm_radius_health_t;
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -77,8 +100,66 @@ struct rlm_radius_s {
 	fr_retry_config_t      	retry[FR_RADIUS_MAX_PACKET_CODE];
 
 	fr_trunk_conf_t		trunk_conf;		//!< trunk configuration
+
+	fr_time_delta_t		slow_start;		//!< How long to ramp up traffic after recovering.
+	rlm_radius_health_t	*health;		//!< Shared health of the home server.
 };
 
+/** Record a reply from the home server
+ *
+ * @param[in] health	of the home server.
+ * @param[in] rtt	of the packet, or 0 if it was retransmitted.
+ */
+static inline void radius_health_reply(rlm_radius_health_t *health, fr_time_delta_t rtt)
+{
+	uint_fast64_t	latency;
+	uint_fast32_t	loss;
+
+	if (rtt > 0) {
+		latency = atomic_load_explicit(&health->latency, memory_order_relaxed);
+		latency = latency + (((int64_t) rtt - (int64_t) latency) / (1 << RADIUS_HEALTH_SHIFT));
+		atomic_store_explicit(&health->latency, latency, memory_order_relaxed);
+	}
+
+	loss = atomic_load_explicit(&health->loss, memory_order_relaxed);
+	atomic_store_explicit(&health->loss, loss - (loss >> RADIUS_HEALTH_SHIFT), memory_order_relaxed);
+}
+
+/** Record a packet which got no reply in time
+ *
+ */
+static inline void radius_health_loss(rlm_radius_health_t *health)
+{
+	uint_fast32_t	loss;
+
+	loss = atomic_load_explicit(&health->loss, memory_order_relaxed);
+	loss += (RADIUS_HEALTH_SCALE - loss) >> RADIUS_HEALTH_SHIFT;
+	atomic_store_explicit(&health->loss, loss, memory_order_relaxed);
+}
+
+/** Record that a connection to the home server failed, or went zombie
+ *
+ */
+static inline void radius_health_failed(rlm_radius_health_t *health)
+{
+	atomic_store_explicit(&health->failed, fr_time(), memory_order_relaxed);
+}
+
+/** Record that a connection to the home server is usable
+ *
+ * Only the first connection to come back after a failure starts the
+ * slow-start ramp.
+ */
+static inline void radius_health_alive(rlm_radius_health_t *health)
+{
+	fr_time_t	now = fr_time();
+
+	if (atomic_load_explicit(&health->failed, memory_order_relaxed) <=
+	    atomic_load_explicit(&health->recovered, memory_order_relaxed)) return;
+
+	atomic_store_explicit(&health->recovered, now, memory_order_relaxed);
+}
+
 /** Enqueue a REQUEST to an IO submodule
  *
  */
@@ -0,0 +1,986 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_radius_tcp.c
+ * @brief RADIUS TCP transport
+ *
+ * Requests are pipelined over a single stream.  Many packets are
+ * written with one writev() call, and many replies are read with one
+ * read() call into a per-connection receive buffer, which is then
+ * split into packets using the RADIUS length field.
+ *
+ * Each connection has its own 256 entry ID space.  When that is
+ * exhausted the trunk opens another connection, as limited by
+ * `per_connection_max`.
+ *
+ * @copyright 2017 Network RADIUS SARL
+ * @copyright 2020 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/pair.h>
+#include <freeradius-devel/missing.h>
+#include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/heap.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "conn.h"
+
+/** How many maximum sized packets the receive buffer holds
+ *
+ */
+#define TCP_RECV_PACKETS	16
+
+/** Static configuration for the module.
+ *
+ */
+typedef struct {
+	RADIUS_CONN_INST_COMMON;			//!< Common fields for all transports.
+} rlm_radius_tcp_t;
+
+typedef struct {
+	RADIUS_CONN_THREAD_COMMON;			//!< Common fields for all transports.
+} tcp_thread_t;
+
+/** Track the handle, which is tightly correlated with the FD
+ *
+ */
+typedef struct {
+	RADIUS_CONN_HANDLE_COMMON;			//!< Common fields for all transports.
+
+	tcp_thread_t		*thread;
+
+	fr_trunk_connection_t	*tconn;			//!< For the I/O callbacks.
+	fr_trunk_connection_event_t notify_on;		//!< Events the trunk last asked us for.
+
+	struct iovec		*iov;			//!< Outbound packets for writev.
+	fr_trunk_request_t	**coalesced;		//!< Requests matching the entries in iov.
+
+	uint8_t			*recv_buffer;		//!< Receive buffer, holds several packets.
+	size_t			recv_size;		//!< Size of the receive buffer.
+	size_t			recv_start;		//!< Start of data which hasn't been processed yet.
+	size_t			recv_end;		//!< End of the data we've read.
+
+	uint8_t			*send_buffer;		//!< Unwritten part of a partially written packet.
+	size_t			send_start;		//!< Start of the data still to write.
+	size_t			send_end;		//!< End of the data still to write.
+} tcp_handle_t;
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_tcp_t, dst_ipaddr), },
+	{ FR_CONF_OFFSET("ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_tcp_t, dst_ipaddr) },
+	{ FR_CONF_OFFSET("ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_tcp_t, dst_ipaddr) },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, rlm_radius_tcp_t, dst_port) },
+
+	{ FR_CONF_OFFSET("secret", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_radius_tcp_t, secret) },
+
+	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, rlm_radius_tcp_t, recv_buff) },
+	{ FR_CONF_OFFSET_IS_SET("send_buff", FR_TYPE_UINT32, rlm_radius_tcp_t, send_buff) },
+
+	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, rlm_radius_tcp_t, max_packet_size), .dflt = "4096" },
+	{ FR_CONF_OFFSET("max_send_coalesce", FR_TYPE_UINT16, rlm_radius_tcp_t, max_send_coalesce), .dflt = "64" },
+
+	{ FR_CONF_OFFSET("src_ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_dict_t const *dict_radius;
+
+extern fr_dict_autoload_t rlm_radius_tcp_dict[];
+fr_dict_autoload_t rlm_radius_tcp_dict[] = {
+	{ .out = &dict_radius, .proto = "radius" },
+	{ NULL }
+};
+
+fr_dict_attr_t const *attr_acct_delay_time;
+fr_dict_attr_t const *attr_error_cause;
+fr_dict_attr_t const *attr_event_timestamp;
+fr_dict_attr_t const *attr_extended_attribute_1;
+fr_dict_attr_t const *attr_message_authenticator;
+fr_dict_attr_t const *attr_nas_identifier;
+fr_dict_attr_t const *attr_original_packet_code;
+fr_dict_attr_t const *attr_proxy_state;
+fr_dict_attr_t const *attr_response_length;
+fr_dict_attr_t const *attr_state;
+fr_dict_attr_t const *attr_user_password;
+fr_dict_attr_t const *attr_packet_type;
+
+extern fr_dict_attr_autoload_t rlm_radius_tcp_dict_attr[];
+fr_dict_attr_autoload_t rlm_radius_tcp_dict_attr[] = {
+	{ .out = &attr_acct_delay_time, .name = "Acct-Delay-Time", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_error_cause, .name = "Error-Cause", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_event_timestamp, .name = "Event-Timestamp", .type = FR_TYPE_DATE, .dict = &dict_radius},
+	{ .out = &attr_extended_attribute_1, .name = "Extended-Attribute-1", .type = FR_TYPE_EXTENDED, .dict = &dict_radius},
+	{ .out = &attr_message_authenticator, .name = "Message-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_nas_identifier, .name = "NAS-Identifier", .type = FR_TYPE_STRING, .dict = &dict_radius},
+	{ .out = &attr_original_packet_code, .name = "Original-Packet-Code", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_proxy_state, .name = "Proxy-State", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_response_length, .name = "Response-Length", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_state, .name = "State", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_user_password, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius},
+	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ NULL }
+};
+
+/** Free a connection handle, closing associated resources
+ *
+ */
+static int _tcp_handle_free(tcp_handle_t *h)
+{
+	fr_assert(h->fd >= 0);
+
+	if (h->status_u) fr_event_timer_delete(&h->status_u->ev);
+
+	fr_event_fd_delete(h->thread->el, h->fd, FR_EVENT_FILTER_IO);
+
+	if (shutdown(h->fd, SHUT_RDWR) < 0) {
+		DEBUG3("%s - Failed shutting down connection %s: %s",
+		       h->module_name, h->name, fr_syserror(errno));
+	}
+
+	if (close(h->fd) < 0) {
+		DEBUG3("%s - Failed closing connection %s: %s",
+		       h->module_name, h->name, fr_syserror(errno));
+	}
+
+	h->fd = -1;
+
+	DEBUG("%s - Connection closed - %s", h->module_name, h->name);
+
+	return 0;
+}
+
+/** Initialise a new outbound connection
+ *
+ * @param[out] h_out	Where to write the new file descriptor.
+ * @param[in] conn	to initialise.
+ * @param[in] uctx	A #tcp_thread_t
+ */
+static fr_connection_state_t conn_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	int			fd;
+	tcp_handle_t		*h;
+	tcp_thread_t		*thread = talloc_get_type_abort(uctx, tcp_thread_t);
+	struct sockaddr_storage	salocal;
+	socklen_t		salen = sizeof(salocal);
+
+	MEM(h = talloc_zero(conn, tcp_handle_t));
+	h->thread = thread;
+	h->inst = thread->inst;
+	h->module_name = h->inst->parent->name;
+	h->src_ipaddr = h->inst->src_ipaddr;
+	h->src_port = 0;
+	h->max_packet_size = h->inst->max_packet_size;
+	h->last_idle = fr_time();
+
+	MEM(h->iov = talloc_zero_array(h, struct iovec, h->inst->max_send_coalesce));
+	MEM(h->coalesced = talloc_zero_array(h, fr_trunk_request_t *, h->inst->max_send_coalesce));
+
+	/*
+	 *	Big enough for many replies, so that a busy
+	 *	connection can be drained with very few reads.
+	 */
+	h->recv_size = h->max_packet_size * TCP_RECV_PACKETS;
+	MEM(h->recv_buffer = talloc_array(h, uint8_t, h->recv_size));
+	MEM(h->send_buffer = talloc_array(h, uint8_t, h->max_packet_size));
+
+	MEM(h->tt = radius_track_alloc(h));
+
+	/*
+	 *	Open the outgoing socket.  This doesn't wait for the
+	 *	connection to complete.
+	 */
+	fd = fr_socket_client_tcp(&h->src_ipaddr, &h->inst->dst_ipaddr, h->inst->dst_port, true);
+	if (fd < 0) {
+		PERROR("%s - Failed opening socket", h->module_name);
+		talloc_free(h);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+	h->fd = fd;
+
+	talloc_set_destructor(h, _tcp_handle_free);
+
+	/*
+	 *	The source port is allocated by connect(), even
+	 *	when it hasn't completed yet.
+	 */
+	if (getsockname(fd, (struct sockaddr *) &salocal, &salen) == 0) {
+		(void) fr_ipaddr_from_sockaddr(&salocal, salen, &h->src_ipaddr, &h->src_port);
+	}
+
+	/*
+	 *	Set the connection name.
+	 */
+	h->name = fr_asprintf(h, "proto tcp local %pV port %u remote %pV port %u",
+			      fr_box_ipaddr(h->src_ipaddr), h->src_port,
+			      fr_box_ipaddr(h->inst->dst_ipaddr), h->inst->dst_port);
+
+	/*
+	 *	We do our own batching of packets into writev() calls,
+	 *	so there's no reason for the kernel to wait for more
+	 *	data before sending.
+	 */
+	{
+		int opt = 1;
+
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) < 0) {
+			WARN("%s - Failed setting 'TCP_NODELAY': %s", h->module_name, fr_syserror(errno));
+		}
+	}
+
+#ifdef SO_RCVBUF
+	if (h->inst->recv_buff_is_set) {
+		int opt;
+
+		opt = h->inst->recv_buff;
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(int)) < 0) {
+			WARN("%s - Failed setting 'SO_RCVBUF': %s", h->module_name, fr_syserror(errno));
+		}
+	}
+#endif
+
+#ifdef SO_SNDBUF
+	if (h->inst->send_buff_is_set) {
+		int opt;
+
+		opt = h->inst->send_buff;
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(int)) < 0) {
+			WARN("%s - Failed setting 'SO_SNDBUF', write performance may be sub-optimal: %s",
+			     h->module_name, fr_syserror(errno));
+		}
+	}
+#endif
+
+	/*
+	 *	Status checks are only used to detect zombie
+	 *	connections.  Completing the TCP handshake is enough
+	 *	to show that the home server is alive, so we signal
+	 *	the connection as open as soon as it becomes writable.
+	 */
+	if (h->inst->parent->status_check) radius_conn_status_check_alloc(conn->el, (radius_conn_handle_t *)h);
+
+	radius_health_alive(h->inst->parent->health);
+	fr_connection_signal_on_fd(conn, fd);
+
+	*h_out = h;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+static fr_connection_t *thread_conn_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+					  fr_connection_conf_t const *conf,
+					  char const *log_prefix, void *uctx)
+{
+	fr_connection_t		*conn;
+	tcp_thread_t		*thread = talloc_get_type_abort(uctx, tcp_thread_t);
+
+	conn = fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = conn_init,
+					.close = radius_conn_close,
+					.failed = radius_conn_failed
+				   },
+				   conf,
+				   log_prefix,
+				   thread);
+	if (!conn) {
+		PERROR("%s - Failed allocating state handler for new connection", thread->inst->parent->name);
+		return NULL;
+	}
+
+	return conn;
+}
+
+static int tcp_events_update(tcp_handle_t *h);
+
+/** Write out the rest of a partially written packet
+ *
+ * @return
+ *	- 0 if all, some, or none of the data was written.
+ *	- -1 if the connection has been signalled to reconnect.
+ */
+static int tcp_flush(tcp_handle_t *h)
+{
+	ssize_t		slen;
+
+	if (h->send_start == h->send_end) return 0;
+
+	slen = write(h->fd, h->send_buffer + h->send_start, h->send_end - h->send_start);
+	if (slen < 0) {
+		switch (errno) {
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+		case EWOULDBLOCK:
+#endif
+		case EAGAIN:
+		case EINTR:
+		case ENOBUFS:
+			return 0;
+
+		default:
+			break;
+		}
+
+		ERROR("%s - Failed sending data over connection %s: %s",
+		      h->module_name, h->name, fr_syserror(errno));
+		fr_trunk_connection_signal_reconnect(h->tconn, FR_CONNECTION_FAILED);
+		return -1;
+	}
+
+	h->send_start += slen;
+	if (h->send_start < h->send_end) return 0;
+
+	h->send_start = h->send_end = 0;
+
+	/*
+	 *	Stop watching for writes, if the trunk doesn't need
+	 *	them.
+	 */
+	return tcp_events_update(h);
+}
+
+/** Standard I/O read function
+ *
+ * Underlying FD in now readable, so call the trunk to read any pending requests
+ * from this connection.
+ *
+ * Replies are always read, even if the trunk doesn't expect any.  Late
+ * replies still take up space in the stream, and have to be consumed
+ * for us to find the start of the next packet.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that's now readable.
+ * @param[in] flags	describing the read event.
+ * @param[in] uctx	The #tcp_handle_t which is readable.
+ */
+static void conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(uctx, tcp_handle_t);
+
+	fr_trunk_connection_signal_readable(h->tconn);
+}
+
+/** Standard I/O write function
+ *
+ * Underlying FD is now writable, so finish writing any partial packet,
+ * and then call the trunk to write any pending requests to this connection.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that's now writable.
+ * @param[in] flags	describing the write event.
+ * @param[in] uctx	The #tcp_handle_t which is writable.
+ */
+static void conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(uctx, tcp_handle_t);
+	fr_trunk_connection_t	*tconn = h->tconn;
+
+	if (tcp_flush(h) < 0) return;
+	if (h->send_start != h->send_end) return;
+
+	fr_trunk_connection_signal_writable(tconn);
+}
+
+/** Connection errored
+ *
+ * We were signalled by the event loop that a fatal error occurred on this connection.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that errored.
+ * @param[in] flags	El flags.
+ * @param[in] fd_errno	The nature of the error.
+ * @param[in] uctx	The #tcp_handle_t which errored.
+ */
+static void conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(uctx, tcp_handle_t);
+
+	ERROR("%s - Connection %s failed: %s", h->module_name, h->name, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(h->tconn->conn, FR_CONNECTION_FAILED);
+}
+
+/** Install the I/O handlers for the connection
+ *
+ * We watch for writes when the trunk asks us to, or when there's
+ * part of a packet still to write.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the connection has been signalled to reconnect.
+ */
+static int tcp_events_update(tcp_handle_t *h)
+{
+	fr_event_fd_cb_t	write_fn = NULL;
+
+	switch (h->notify_on) {
+	case FR_TRUNK_CONN_EVENT_WRITE:
+	case FR_TRUNK_CONN_EVENT_BOTH:
+		write_fn = conn_writable;
+		break;
+
+	default:
+		break;
+	}
+
+	if (h->send_start != h->send_end) write_fn = conn_writable;
+
+	if (fr_event_fd_insert(h, h->thread->el, h->fd, conn_readable, write_fn, conn_error, h) < 0) {
+		PERROR("%s - Failed inserting FD event", h->module_name);
+
+		/*
+		 *	May free the connection!
+		 */
+		fr_trunk_connection_signal_reconnect(h->tconn, FR_CONNECTION_FAILED);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void thread_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+			       UNUSED fr_event_list_t *el,
+			       fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	h->tconn = tconn;
+	h->notify_on = notify_on;
+
+	(void) tcp_events_update(h);
+}
+
+/** Handle timeouts for a REQUEST
+ *
+ * RFC 6613 Section 2.6.1 says that packets MUST NOT be retransmitted
+ * over the same connection.  The retransmission timers are therefore
+ * only used to decide when to give up on a request.
+ */
+static void request_timeout(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_trunk_request_t	*treq = talloc_get_type_abort(uctx, fr_trunk_request_t);
+	tcp_handle_t		*h;
+	radius_conn_request_t	*u = talloc_get_type_abort(treq->preq, radius_conn_request_t);
+	radius_conn_result_t	*r = talloc_get_type_abort(treq->rctx, radius_conn_result_t);
+	REQUEST			*request = treq->request;
+	fr_trunk_connection_t	*tconn = treq->tconn;
+
+	fr_assert(treq->state == FR_TRUNK_REQUEST_STATE_SENT);		/* No other states should be timing out */
+	fr_assert(treq->preq);						/* Must still have a protocol request */
+	fr_assert(u->rr);
+	fr_assert(tconn);
+
+	h = talloc_get_type_abort(treq->tconn->conn->h, tcp_handle_t);
+
+	radius_health_loss(h->inst->parent->health);
+
+	if (!u->status_check) {
+		/*
+		 *	If the connection just became a zombie
+		 *	the request that just timedout will
+		 *	have moved back into the trunk backlog,
+		 *	been assigned to another connection
+		 *	or freed.
+		 */
+		if (radius_conn_check_for_zombie(el, tconn, now)) return;
+
+	} else {
+		/*
+		 *	Reset replies to 0 as we only count
+		 *	contiguous, good, replies.
+		 */
+		u->num_replies = 0;
+	}
+
+	switch (fr_retry_next(&u->retry, now)) {
+	/*
+	 *	Keep waiting for the reply.
+	 */
+	case FR_RETRY_CONTINUE:
+		if (fr_event_timer_at(u, el, &u->ev, u->retry.next, request_timeout, treq) < 0) {
+			RERROR("Failed inserting response timeout for connection");
+			break;
+		}
+		return;
+
+	case FR_RETRY_MRD:
+		RDEBUG("Reached maximum_retransmit_duration, failing request");
+		break;
+
+	case FR_RETRY_MRC:
+		RDEBUG("Reached maximum_retransmit_count, failing request");
+		break;
+	}
+
+	r->rcode = RLM_MODULE_FAIL;
+	fr_trunk_request_signal_complete(treq);
+
+	if (!u->status_check) return;
+
+	WARN("%s - No response to status check, marking connection as dead - %s", h->module_name, h->name);
+
+	h->status_checking = false;
+	fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+}
+
+static void request_mux(fr_event_list_t *el,
+			fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	radius_conn_inst_t const *inst = h->inst;
+	ssize_t			slen;
+	size_t			written;
+	uint16_t		i, queued;
+
+	/*
+	 *	If the connection just became a zombie
+	 *	don't try and enqueue things on it!
+	 */
+	if (radius_conn_check_for_zombie(el, tconn, 0)) return;
+
+	/*
+	 *	Nothing else can be written until the rest of the
+	 *	previous packet is in the stream.
+	 */
+	if (tcp_flush(h) < 0) return;
+	if (h->send_start != h->send_end) return;
+
+	/*
+	 *	Encode multiple packets in preparation
+	 *	for transmission with writev.
+	 */
+	for (queued = 0; queued < inst->max_send_coalesce; ) {
+		fr_trunk_request_t	*treq;
+		radius_conn_request_t	*u;
+		REQUEST			*request;
+
+ 		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+
+		/*
+		 *	No more requests to send
+		 */
+		if (!treq) break;
+
+		fr_assert(treq->state == FR_TRUNK_REQUEST_STATE_PENDING);
+
+		request = treq->request;
+		u = talloc_get_type_abort(treq->preq, radius_conn_request_t);
+
+		if (!u->retry.start) {
+			(void) fr_retry_init(&u->retry, fr_time(), &h->inst->parent->retry[u->code]);
+			fr_assert(u->retry.rt > 0);
+			fr_assert(u->retry.next > 0);
+		}
+
+		/*
+		 *	The packet may already be encoded if the previous
+		 *	write didn't get as far as this request.
+		 */
+		if (!u->packet) {
+			fr_assert(!u->rr);
+
+			if (unlikely(radius_track_entry_reserve(&u->rr, treq, h->tt, request, u->code, treq) < 0)) {
+#ifndef NDEBUG
+				radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__,
+						       h->tt, radius_conn_tracking_entry_log);
+#endif
+				fr_assert_fail("Tracking entry allocation failed: %s", fr_strerror());
+				fr_trunk_request_signal_fail(treq);
+				continue;
+			}
+			u->id = u->rr->id;
+
+			if ((radius_conn_encode(h->inst, request, u, u->id) < 0) ||
+			    (radius_conn_sign(h->inst, request, u) < 0)) {
+				/*
+				 *	Need to do this because request_conn_release
+				 *	may not be called.
+				 */
+				radius_conn_request_reset(u);
+				if (u->ev) (void) fr_event_timer_delete(&u->ev);
+				fr_trunk_request_signal_fail(treq);
+				continue;
+			}
+			RHEXDUMP3(u->packet, u->packet_len, "Encoded packet");
+
+			/*
+			 *	Remember the authentication vector, which now has the
+			 *	packet signature.
+			 */
+			(void) radius_track_entry_update(u->rr, u->packet + RADIUS_AUTH_VECTOR_OFFSET);
+		}
+
+		RDEBUG("Sending %s ID %d length %ld over connection %s",
+		       fr_packet_codes[u->code], u->id, u->packet_len, h->name);
+		log_request_pair_list(L_DBG_LVL_2, request, request->packet->vps, NULL);
+		if (u->extra) log_request_pair_list(L_DBG_LVL_2, request, u->extra, NULL);
+
+		h->coalesced[queued] = treq;
+		h->iov[queued].iov_base = u->packet;
+		h->iov[queued].iov_len = u->packet_len;
+
+		/*
+		 *	Tell the trunk API that this request is now in
+		 *	the "sent" state, so that we can get at the next
+		 *	entry in the heap.  Anything which isn't written
+		 *	is requeued below.
+		 */
+		fr_trunk_request_signal_sent(treq);
+		queued++;
+	}
+	if (queued == 0) return;	/* No work */
+
+	/*
+	 *	Verify nothing accidentally freed the connection handle
+	 */
+	(void)talloc_get_type_abort(h, tcp_handle_t);
+
+	slen = writev(h->fd, h->iov, queued);
+	if (slen < 0) {
+		switch (errno) {
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+		case EWOULDBLOCK:
+#endif
+		case EAGAIN:		/* Socket buffer is full */
+		case EINTR:		/* Interrupted by signal */
+		case ENOBUFS:		/* No outbound packet buffers, maybe? */
+		case ENOMEM:		/* malloc failure in kernel? */
+			slen = 0;
+			break;
+
+		/*
+		 *	Will re-queue any 'sent' requests, so we don't
+		 *	have to do any cleanup.
+		 */
+		default:
+			ERROR("%s - Failed sending data over connection %s: %s",
+			      h->module_name, h->name, fr_syserror(errno));
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+	}
+
+	written = (size_t) slen;
+	for (i = 0; i < queued; i++) {
+		fr_trunk_request_t	*treq = h->coalesced[i];
+		radius_conn_request_t	*u;
+		REQUEST			*request;
+
+		/*
+		 *	None of this packet made it into the stream.
+		 *	The cancel logic runs as per-normal, and keeps
+		 *	the encoded packet, ready for sending again.
+		 */
+		if (written == 0) {
+			fr_trunk_request_requeue(treq);
+			continue;
+		}
+
+		request = treq->request;
+		u = talloc_get_type_abort(treq->preq, radius_conn_request_t);
+
+		/*
+		 *	RFC 6613 Section 2.6.1 says that packets in the
+		 *	stream MUST NOT be sent again, even in part.
+		 */
+		u->can_retransmit = false;
+
+		/*
+		 *	Part of the packet is in the stream, so the rest
+		 *	MUST follow before anything else.  Copy it to the
+		 *	handle, as the request may be freed before the
+		 *	socket is writable again.
+		 */
+		if (written < h->iov[i].iov_len) {
+			h->send_start = 0;
+			h->send_end = h->iov[i].iov_len - written;
+			memcpy(h->send_buffer, (uint8_t *) h->iov[i].iov_base + written, h->send_end);
+			written = 0;
+		} else {
+			written -= h->iov[i].iov_len;
+		}
+
+		h->last_sent = u->retry.start;
+		if (h->first_sent <= h->last_idle) h->first_sent = h->last_sent;
+
+		if (!inst->parent->synchronous) {
+			RDEBUG("%s request.  Expecting response within %pVs",
+			       inst->parent->originate ? "Originated" : "Proxied",
+			       fr_box_time_delta(u->retry.rt));
+
+			if (fr_event_timer_at(u, el, &u->ev, u->retry.next, request_timeout, treq) < 0) {
+				RERROR("Failed inserting response timeout for connection");
+				fr_trunk_request_signal_fail(treq);
+				continue;
+			}
+		} else {
+			RDEBUG("%s request.  Relying on NAS to perform more retransmissions",
+			       inst->parent->originate ? "Originated" : "Proxied");
+		}
+	}
+
+	/*
+	 *	Make sure we're woken up to write the rest of the
+	 *	partial packet.
+	 */
+	if (h->send_start != h->send_end) (void) tcp_events_update(h);
+}
+
+static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	DEBUG3("%s - Reading data for connection %s", h->module_name, h->name);
+
+	while (true) {
+		ssize_t		slen;
+		size_t		room;
+
+		/*
+		 *	Move any partial packet to the start of the
+		 *	buffer, so that we always have room for at
+		 *	least one full packet.
+		 */
+		if (h->recv_start > 0) {
+			memmove(h->recv_buffer, h->recv_buffer + h->recv_start, h->recv_end - h->recv_start);
+			h->recv_end -= h->recv_start;
+			h->recv_start = 0;
+		}
+
+		/*
+		 *	The home server may have asked for a bigger
+		 *	buffer in a Protocol-Error reply.
+		 */
+		if (h->recv_size < (h->max_packet_size * TCP_RECV_PACKETS)) {
+			h->recv_size = h->max_packet_size * TCP_RECV_PACKETS;
+			MEM(h->recv_buffer = talloc_realloc(h, h->recv_buffer, uint8_t, h->recv_size));
+		}
+
+		room = h->recv_size - h->recv_end;
+		slen = read(h->fd, h->recv_buffer + h->recv_end, room);
+		if (slen == 0) {
+			ERROR("%s - Connection %s closed by home server", h->module_name, h->name);
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		if (slen < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+			if (errno == EINTR) continue;
+
+			ERROR("%s - Failed reading response from socket: %s",
+			      h->module_name, fr_syserror(errno));
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		h->recv_end += slen;
+
+		/*
+		 *	Process every complete packet in the buffer.
+		 */
+		while ((h->recv_end - h->recv_start) >= RADIUS_HEADER_LENGTH) {
+			uint8_t		*data = h->recv_buffer + h->recv_start;
+			size_t		packet_len = (data[2] << 8) | data[3];
+
+			/*
+			 *	We can't find the start of the next
+			 *	packet, so the stream is unusable.
+			 */
+			if ((packet_len < RADIUS_HEADER_LENGTH) || (packet_len > h->max_packet_size)) {
+				ERROR("%s - Received packet with invalid length %zu on connection %s",
+				      h->module_name, packet_len, h->name);
+				fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+				return;
+			}
+
+			if ((h->recv_end - h->recv_start) < packet_len) break;
+
+			h->recv_start += packet_len;
+			radius_conn_packet_demux((radius_conn_handle_t *)h, h->tt, NULL, data, packet_len);
+		}
+
+		/*
+		 *	A short read means the socket has been drained.
+		 */
+		if ((size_t) slen < room) return;
+	}
+}
+
+static void mod_signal(module_ctx_t const *mctx, UNUSED REQUEST *request,
+		       void *rctx, fr_state_signal_t action)
+{
+	tcp_thread_t		*t = talloc_get_type_abort(mctx->thread, tcp_thread_t);
+	radius_conn_result_t	*r = talloc_get_type_abort(rctx, radius_conn_result_t);
+
+	/*
+	 *	See rlm_radius_udp.c for why r->treq may be NULL.
+	 */
+	if (!r->treq) {
+		talloc_free(rctx);
+		return;
+	}
+
+	switch (action) {
+	/*
+	 *	The request is being cancelled, tell the
+	 *	trunk so it can clean up the treq.
+	 */
+	case FR_SIGNAL_CANCEL:
+		fr_trunk_request_signal_cancel(r->treq);
+		talloc_free(rctx);	/* Should be freed soon anyway, but better to be explicit */
+		return;
+
+	/*
+	 *	Packets are never retransmitted over TCP, the
+	 *	stream takes care of that.  But a DUP is a good
+	 *	time to check whether the connection is still
+	 *	alive.
+	 */
+	case FR_SIGNAL_DUP:
+		if (r->treq->tconn) (void) radius_conn_check_for_zombie(t->el, r->treq->tconn, 0);
+		return;
+
+	default:
+		return;
+	}
+}
+
+/** Instantiate thread data for the submodule.
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *tctx)
+{
+	rlm_radius_tcp_t		*inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+	tcp_thread_t			*thread = talloc_get_type_abort(tctx, tcp_thread_t);
+
+	static fr_trunk_io_funcs_t	io_funcs = {
+						.connection_alloc = thread_conn_alloc,
+						.connection_notify = thread_conn_notify,
+						.request_prioritise = radius_conn_request_prioritise,
+						.request_mux = request_mux,
+						.request_demux = request_demux,
+						.request_conn_release = radius_conn_request_conn_release,
+						.request_complete = radius_conn_request_complete,
+						.request_fail = radius_conn_request_fail,
+						.request_cancel = radius_conn_request_cancel,
+						.request_free = radius_conn_request_free,
+						.request_hedge = radius_conn_request_hedge
+					};
+
+	inst->trunk_conf = &inst->parent->trunk_conf;
+
+	inst->trunk_conf->req_pool_headers = 4;	/* One for the request, one for the buffer, one for the tracking binding, one for Proxy-State VP */
+	inst->trunk_conf->req_pool_size = sizeof(radius_conn_request_t) + inst->max_packet_size + sizeof(radius_track_entry_t ***) + sizeof(VALUE_PAIR) + 20;
+
+	thread->el = el;
+	thread->inst = (radius_conn_inst_t const *)inst;
+	thread->trunk = fr_trunk_alloc(thread, el, &io_funcs,
+				       inst->trunk_conf, inst->parent->name, thread, false);
+	if (!thread->trunk) return -1;
+
+	return 0;
+}
+
+/** Instantiate the module
+ *
+ * @param[in] instance	data for this module
+ * @param[in] conf	our configuration section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_radius_tcp_t	*inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+
+	if (radius_conn_instantiate((radius_conn_inst_t *)inst, conf) < 0) return -1;
+
+	/*
+	 *	A TCP home server replies to everything we send it,
+	 *	so there's no benefit over UDP.
+	 */
+	if (inst->parent->replicate) {
+		cf_log_err(conf, "Replication is not supported over TCP, use 'transport = udp'");
+		return -1;
+	}
+
+	/*
+	 *	One connection has 256 IDs, and we need one spare
+	 *	for Status-Server.  The trunk opens more connections
+	 *	when the ID space of the existing ones is used up.
+	 */
+	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->parent->trunk_conf.max_req_per_conn, <=, 255);
+
+	/*
+	 *	Always need at least one iovec, and writev() won't
+	 *	take more than IOV_MAX.
+	 */
+	FR_INTEGER_BOUND_CHECK("max_send_coalesce", inst->max_send_coalesce, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_send_coalesce", inst->max_send_coalesce, <=, 1024);
+
+	return 0;
+}
+
+/** Bootstrap the module
+ *
+ * @param[in] instance	Ctx data for this module
+ * @param[in] conf    our configuration section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+{
+	rlm_radius_tcp_t *inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+
+	(void) talloc_set_type(inst, rlm_radius_tcp_t);
+	inst->config = conf;
+
+	return 0;
+}
+
+extern rlm_radius_io_t rlm_radius_tcp;
+rlm_radius_io_t rlm_radius_tcp = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "radius_tcp",
+	.inst_size		= sizeof(rlm_radius_tcp_t),
+
+	.thread_inst_size	= sizeof(tcp_thread_t),
+	.thread_inst_type	= "tcp_thread_t",
+
+	.config			= module_config,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate 	= mod_thread_instantiate,
+
+	.enqueue		= radius_conn_enqueue,
+	.signal			= mod_signal,
+	.resume			= radius_conn_resume,
+};
@@ -0,0 +1,5 @@
+TARGET		:= rlm_radius_tcp.a
+
+SOURCES		:= rlm_radius_tcp.c conn.c track.c
+
+TGT_PREREQS	:= libfreeradius-radius.a libfreeradius-util.a
@@ -1,5 +1,5 @@
 TARGET		:= rlm_radius_udp.a
 
-SOURCES		:= rlm_radius_udp.c track.c
+SOURCES		:= rlm_radius_udp.c conn.c track.c
 
 TGT_PREREQS	:= libfreeradius-radius.a libfreeradius-util.a
@@ -54,6 +54,9 @@ typedef struct {
 	bool		check_nas;
 	uint32_t	permission;
 	bool		caller_id_ok;
+	uint32_t	index_size;
+
+	fr_radutmp_index_t	*index;		//!< NULL if the index is disabled.
 } rlm_radutmp_t;
 
 static const CONF_PARSER module_config[] = {
@@ -62,6 +65,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("check_with_nas", FR_TYPE_BOOL, rlm_radutmp_t, check_nas), .dflt = "yes" },
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_radutmp_t, permission), .dflt = "0644" },
 	{ FR_CONF_OFFSET("caller_id", FR_TYPE_BOOL, rlm_radutmp_t, caller_id_ok), .dflt = "no" },
+	{ FR_CONF_OFFSET("index_size", FR_TYPE_UINT32, rlm_radutmp_t, index_size), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -105,10 +109,12 @@ fr_dict_attr_autoload_t rlm_radutmp_dict_attr[] = {
 /*
  *	Zap all users on a NAS from the radutmp file.
  */
-static rlm_rcode_t radutmp_zap(REQUEST *request, char const *filename, uint32_t nasaddr, time_t t)
+static rlm_rcode_t radutmp_zap(REQUEST *request, fr_radutmp_index_t *index,
+			       char const *filename, uint32_t nasaddr, time_t t)
 {
 	struct radutmp	u;
 	int		fd;
+	off_t		offset;
 
 	if (t == 0) time(&t);
 
@@ -137,9 +143,12 @@ static rlm_rcode_t radutmp_zap(REQUEST *request, char const *filename, uint32_t
 		/*
 		 *	Match. Zap it.
 		 */
-		if (lseek(fd, -(off_t)sizeof(u), SEEK_CUR) < 0) {
+		offset = lseek(fd, -(off_t)sizeof(u), SEEK_CUR);
+		if (offset < 0) {
 			REDEBUG("radutmp_zap: negative lseek!");
 			lseek(fd, (off_t)0, SEEK_SET);
+		} else if (index) {
+			fr_radutmp_index_user_del(index, u.login, offset);
 		}
 		u.type = P_IDLE;
 		u.time = t;
@@ -191,7 +200,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQ
 	int			off;
 	char			ip_name[INET_ADDRSTRLEN]; /* 255.255.255.255 */
 	char const		*nas;
-	NAS_PORT		*cache;
+	NAS_PORT		*cache = NULL;
+	off_t			found = -1;
 	int			r;
 
 	char			*filename = NULL;
@@ -337,14 +347,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQ
 	 */
 	if (status == FR_STATUS_ACCOUNTING_ON && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s restarted (Accounting-On packet seen)", nas);
-		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		rcode = radutmp_zap(request, inst->index, filename, ut.nas_address, ut.time);
 
 		goto finish;
 	}
 
 	if (status == FR_STATUS_ACCOUNTING_OFF && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s rebooted (Accounting-Off packet seen)", nas);
-		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		rcode = radutmp_zap(request, inst->index, filename, ut.nas_address, ut.time);
 
 		goto finish;
 	}
@@ -415,15 +425,38 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQ
 	/*
 	 *	Find the entry for this NAS / portno combination.
 	 */
-	if ((cache = nas_port_find(inst->nas_port_list, ut.nas_address, ut.nas_port)) != NULL) {
+	r = 0;
+	off = 0;
+	if (inst->index) {
+		found = fr_radutmp_index_port_find(inst->index, ut.nas_address, ut.nas_port);
+		if (found >= 0) {
+			if (lseek(fd, found, SEEK_SET) < 0) {
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
+			}
+			off = found;
+
+		/*
+		 *	The index has every port in the file, so
+		 *	this is a new one.  Append it.
+		 */
+		} else {
+			off_t end;
+
+			end = lseek(fd, 0, SEEK_END);
+			if (end < 0) {
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
+			}
+			off = end;
+		}
+	} else if ((cache = nas_port_find(inst->nas_port_list, ut.nas_address, ut.nas_port)) != NULL) {
 		if (lseek(fd, (off_t)cache->offset, SEEK_SET) < 0) {
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
 		}
 	}
 
-	r = 0;
-	off = 0;
 	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
 		off += sizeof(u);
 		if ((u.nas_address != ut.nas_address) || (u.nas_port != ut.nas_port)) {
@@ -497,7 +530,23 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQ
 		 *	Remember where the entry was, because it's
 		 *	easier than searching through the entire file.
 		 */
-		if (!cache) {
+		if (inst->index) {
+			if ((found != off) && (fr_radutmp_index_port_add(inst->index, ut.nas_address,
+									 ut.nas_port, off) < 0)) {
+				RWDEBUG("Session index is full, increase index_size");
+			}
+
+			/*
+			 *	The port was reused without a Stop.
+			 */
+			if ((r > 0) && (u.type == P_LOGIN) && (strncmp(u.login, ut.login, RUT_NAMESIZE) != 0)) {
+				fr_radutmp_index_user_del(inst->index, u.login, off);
+			}
+
+			if (fr_radutmp_index_user_add(inst->index, ut.login, off) < 0) {
+				RWDEBUG("Session index is full, increase index_size");
+			}
+		} else if (!cache) {
 			cache = talloc_zero(NULL, NAS_PORT);
 			if (cache) {
 				cache->nasaddr = ut.nas_address;
@@ -523,6 +572,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQ
 	 */
 	if (status == FR_STATUS_STOP) {
 		if (r > 0) {
+			if (inst->index && (u.type == P_LOGIN)) fr_radutmp_index_user_del(inst->index, u.login, off);
+
 			u.type = P_IDLE;
 			u.time = ut.time;
 			u.delay = ut.delay;
@@ -549,6 +600,44 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQ
 }
 #endif
 
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_radutmp_t	*inst = instance;
+	int		fd;
+
+	if (!inst->index_size) return 0;
+
+	/*
+	 *	The index belongs to one radutmp file, so it
+	 *	can't be used if the filename is expanded.
+	 */
+	if (strchr(inst->filename, '%')) {
+		cf_log_warn(conf, "Ignoring \"index_size\", as \"filename\" is dynamically expanded");
+		return 0;
+	}
+
+	fd = open(inst->filename, O_RDWR | O_CREAT, inst->permission);
+	if (fd < 0) {
+		cf_log_err(conf, "Error accessing file %s: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (rad_lockfd(fd, LOCK_LEN) < 0) {
+		cf_log_err(conf, "Error acquiring lock on %s: %s", inst->filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	inst->index = fr_radutmp_index_rebuild(inst, inst->filename, fd, inst->index_size, inst->permission);
+	close(fd);	/* and implicitely release the locks */
+	if (!inst->index) {
+		cf_log_perr(conf, "Failed building session index");
+		return -1;
+	}
+
+	return 0;
+}
+
 /* globally exported name */
 extern module_t rlm_radutmp;
 module_t rlm_radutmp = {
@@ -557,6 +646,7 @@ module_t rlm_radutmp = {
 	.type		= RLM_TYPE_THREAD_UNSAFE,
 	.inst_size	= sizeof(rlm_radutmp_t),
 	.config		= module_config,
+	.instantiate	= mod_instantiate,
 	.methods = {
 #ifdef WITH_ACCOUNTING
 		[MOD_ACCOUNTING]	= mod_accounting,
@@ -31,15 +31,14 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/modpriv.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
 
-static CONF_PARSER module_config[] = {
-	REDIS_COMMON_CONFIG,
-	CONF_PARSER_TERMINATOR
-};
+#include <ctype.h>
 
 /** rlm_redis module instance
  *
@@ -51,8 +50,48 @@ typedef struct {
 	char const		*name;		//!< Instance name.
 
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
+
+	bool			pipelined;	//!< Send commands asynchronously, pipelining
+						//!< commands from different requests onto
+						//!< shared connections.
+	fr_trunk_conf_t		trunk_conf;	//!< Trunk configuration, used when pipelined.
+	fr_redis_io_conf_t	io_conf;	//!< How the trunk connects to the server.
 } rlm_redis_t;
 
+/** rlm_redis thread instance
+ *
+ */
+typedef struct {
+	rlm_redis_t const		*inst;		//!< Instance of rlm_redis.
+	fr_redis_cluster_thread_t	*cluster;	//!< Thread local cluster state.
+	fr_redis_trunk_t		*trunk;		//!< Trunk for the server.
+} rlm_redis_thread_t;
+
+/** Wrapper around the module thread struct for individual xlats
+ *
+ */
+typedef struct {
+	rlm_redis_t const	*inst;		//!< Instance of rlm_redis.
+	rlm_redis_thread_t	*t;		//!< rlm_redis thread instance.
+} redis_xlat_thread_inst_t;
+
+/** The state of a pipelined command
+ *
+ */
+typedef struct {
+	fr_redis_command_set_t	*cmds;		//!< Commands sent.  NULL once they've completed.
+	bool			read_only;	//!< Command is wrapped in READONLY/READWRITE.
+	bool			failed;		//!< The command set couldn't be executed.
+	fr_value_box_t		*result;	//!< Result of the command.
+} redis_xlat_rctx_t;
+
+static CONF_PARSER module_config[] = {
+	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("pipelined", FR_TYPE_BOOL, rlm_redis_t, pipelined), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_redis_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+	CONF_PARSER_TERMINATOR
+};
+
 /** Change the state of a connection to READONLY execute a command and switch to READWRITE
  *
  * @param[out] status_out Where to write the status from the command.
@@ -207,6 +246,61 @@ static xlat_action_t redis_remap_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 	return XLAT_ACTION_DONE;
 }
 
+/** Return one of the cluster's redirect or remap counters
+ *
+@verbatim
+%{redis_stats:(moved|ask|remaps|remaps_failed|remaps_skipped)}
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t redis_stats_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
+				      REQUEST *request, void const *xlat_inst,
+				      UNUSED void *xlat_thread_inst,
+				      fr_value_box_t **in)
+{
+	rlm_redis_t const		*inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst),
+									    rlm_redis_t);
+	fr_redis_cluster_stats_t	stats;
+	char const			*name;
+	uint64_t			value;
+	fr_value_box_t			*vb;
+
+	if (!in) {
+		REDEBUG("Missing counter name");
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
+		RPEDEBUG("Failed concatenating input");
+		return XLAT_ACTION_FAIL;
+	}
+	name = (*in)->vb_strvalue;
+
+	fr_redis_cluster_stats(&stats, inst->cluster);
+
+	if (strcmp(name, "moved") == 0) {
+		value = stats.moved;
+	} else if (strcmp(name, "ask") == 0) {
+		value = stats.ask;
+	} else if (strcmp(name, "remaps") == 0) {
+		value = stats.remaps;
+	} else if (strcmp(name, "remaps_failed") == 0) {
+		value = stats.remaps_failed;
+	} else if (strcmp(name, "remaps_skipped") == 0) {
+		value = stats.remaps_skipped;
+	} else {
+		REDEBUG("Unknown counter \"%s\"", name);
+		return XLAT_ACTION_FAIL;
+	}
+
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT64, NULL, false));
+	vb->vb_uint64 = value;
+	fr_cursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
+}
+
 /** Return the node that is currently servicing a particular key
  *
  * @ingroup xlat_functions
@@ -490,6 +584,313 @@ finish:
 	return ret;
 }
 
+/** Process the replies to a pipelined command
+ *
+ * The command set is freed once this returns, so the result has to
+ * be copied out of the redis reply here.
+ */
+static void redis_xlat_complete(REQUEST *request, fr_dlist_head_t *completed, void *uctx)
+{
+	redis_xlat_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_xlat_rctx_t);
+	fr_redis_command_t	*cmd;
+	redisReply		*reply;
+
+	rctx->cmds = NULL;
+
+	cmd = fr_dlist_head(completed);
+	if (rctx->read_only) {
+		reply = cmd ? fr_redis_command_get_result(cmd) : NULL;
+		if (!reply || (reply->type == REDIS_REPLY_ERROR)) {
+			REDEBUG("Setting READONLY failed");
+			rctx->failed = true;
+			goto finish;
+		}
+		cmd = fr_dlist_next(completed, cmd);
+	}
+
+	reply = cmd ? fr_redis_command_get_result(cmd) : NULL;
+	if (!reply) {
+		REDEBUG("Missing reply");
+		rctx->failed = true;
+		goto finish;
+	}
+
+	switch (reply->type) {
+	case REDIS_REPLY_INTEGER:
+	case REDIS_REPLY_STATUS:
+	case REDIS_REPLY_STRING:
+		MEM(rctx->result = fr_value_box_alloc_null(rctx));
+		if (fr_redis_reply_to_value_box(rctx->result, rctx->result, reply, FR_TYPE_STRING, NULL) < 0) {
+			RPEDEBUG("Failed converting reply");
+			rctx->failed = true;
+		}
+		break;
+
+	case REDIS_REPLY_NIL:
+		break;
+
+	case REDIS_REPLY_ERROR:
+		if ((strncmp(reply->str, "MOVED", 5) == 0) || (strncmp(reply->str, "ASK", 3) == 0)) {
+			REDEBUG("Key served by a different node (%.*s).  Pipelined mode does not "
+				"support Redis cluster", (int)reply->len, reply->str);
+		} else {
+			REDEBUG("Command failed: %.*s", (int)reply->len, reply->str);
+		}
+		rctx->failed = true;
+		break;
+
+	default:
+		REDEBUG("Server returned non-value type \"%s\"",
+			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		rctx->failed = true;
+		break;
+	}
+
+finish:
+	unlang_interpret_resumable(request);
+}
+
+/** Record that a pipelined command couldn't be executed
+ *
+ */
+static void redis_xlat_fail(REQUEST *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	redis_xlat_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_xlat_rctx_t);
+
+	rctx->cmds = NULL;
+	rctx->failed = true;
+
+	unlang_interpret_resumable(request);
+}
+
+static xlat_action_t redis_pipelined_xlat_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
+						 REQUEST *request, UNUSED void const *xlat_inst,
+						 UNUSED void *xlat_thread_inst,
+						 UNUSED fr_value_box_t **in, void *uctx)
+{
+	redis_xlat_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_xlat_rctx_t);
+	fr_value_box_t		*vb;
+
+	if (rctx->failed) {
+		REDEBUG("Command failed");
+		talloc_free(rctx);
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (rctx->result) {
+		MEM(vb = fr_value_box_alloc_null(ctx));
+		if (fr_value_box_copy(vb, vb, rctx->result) < 0) {
+			RPEDEBUG("Failed copying result");
+			talloc_free(vb);
+			talloc_free(rctx);
+			return XLAT_ACTION_FAIL;
+		}
+		fr_cursor_append(out, vb);
+	}
+	talloc_free(rctx);
+
+	return XLAT_ACTION_DONE;
+}
+
+static void redis_pipelined_xlat_signal(UNUSED REQUEST *request, UNUSED void *xlat_inst,
+					UNUSED void *xlat_thread_inst, void *uctx, fr_state_signal_t action)
+{
+	redis_xlat_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_xlat_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (rctx->cmds) fr_redis_command_set_signal_cancel(rctx->cmds);
+	talloc_free(rctx);
+}
+
+/** Split the input of the pipelined xlat into redis command arguments
+ *
+ * Literal text is split on whitespace.  The values of expansions are not,
+ * so they may contain spaces, as with the synchronous xlat.
+ *
+ * @return
+ *	- The number of arguments.
+ *	- -1 on error.
+ */
+static int redis_xlat_argv(fr_redis_command_set_t *cmds, char const ***argv_out, size_t **argv_len_out,
+			   REQUEST *request, fr_value_box_t *in)
+{
+	char const	**argv;
+	size_t		*argv_len;
+	char		*arg = NULL;
+	int		argc = 0;
+	fr_value_box_t	*vb;
+
+	MEM(argv = talloc_zero_array(cmds, char const *, MAX_REDIS_ARGS));
+	MEM(argv_len = talloc_zero_array(cmds, size_t, MAX_REDIS_ARGS));
+
+	for (vb = in; vb; vb = vb->next) {
+		fr_value_box_t	str;
+		char const	*p, *end;
+
+		if (fr_value_box_cast(cmds, &str, FR_TYPE_STRING, NULL, vb) < 0) {
+			RPEDEBUG("Failed converting argument to string");
+			return -1;
+		}
+		p = str.vb_strvalue;
+		end = p + str.vb_length;
+
+		while (p < end) {
+			char const *q;
+
+			if (!vb->tainted && isspace((uint8_t)*p)) {
+				if (arg) {
+					if (argc >= (MAX_REDIS_ARGS - 1)) {
+					too_many:
+						REDEBUG("Too many parameters; increase MAX_REDIS_ARGS and recompile");
+						return -1;
+					}
+					argv_len[argc] = talloc_array_length(arg) - 1;
+					argv[argc++] = arg;
+					arg = NULL;
+				}
+				p++;
+				continue;
+			}
+
+			q = p;
+			if (!vb->tainted) {
+				while ((q < end) && !isspace((uint8_t)*q)) q++;
+			} else {
+				q = end;
+			}
+
+			if (!arg) {
+				MEM(arg = talloc_bstrndup(cmds, p, q - p));
+			} else {
+				MEM(arg = talloc_bstr_append(cmds, arg, p, q - p));
+			}
+			p = q;
+		}
+		fr_value_box_clear(&str);
+	}
+
+	if (arg) {
+		if (argc >= (MAX_REDIS_ARGS - 1)) goto too_many;
+		argv_len[argc] = talloc_array_length(arg) - 1;
+		argv[argc++] = arg;
+	}
+
+	*argv_out = argv;
+	*argv_len_out = argv_len;
+
+	return argc;
+}
+
+/** Xlat to make calls to redis, pipelining commands from concurrent requests
+ *
+@verbatim
+%{redis:[-]<redis command>}
+@endverbatim
+ *
+ * Used instead of #redis_xlat when `pipelined = yes`.  Commands are sent
+ * over the thread's trunk to the first server, and the request yields
+ * until the reply arrives.
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t redis_pipelined_xlat(UNUSED TALLOC_CTX *ctx, UNUSED fr_cursor_t *out,
+					  REQUEST *request, UNUSED void const *xlat_inst,
+					  void *xlat_thread_inst, fr_value_box_t **in)
+{
+	redis_xlat_thread_inst_t	*xt = talloc_get_type_abort(xlat_thread_inst, redis_xlat_thread_inst_t);
+	redis_xlat_rctx_t		*rctx;
+	fr_redis_command_set_t		*cmds;
+	char const			**argv;
+	size_t				*argv_len;
+	int				argc;
+
+	if (!*in) {
+		REDEBUG("Missing command");
+		return XLAT_ACTION_FAIL;
+	}
+
+	MEM(rctx = talloc_zero(request, redis_xlat_rctx_t));
+	cmds = fr_redis_command_set_alloc(NULL, request, redis_xlat_complete, redis_xlat_fail, rctx);
+
+	argc = redis_xlat_argv(cmds, &argv, &argv_len, request, *in);
+	if (argc <= 0) {
+		if (argc == 0) REDEBUG("Missing command");
+	error:
+		talloc_free(cmds);
+		talloc_free(rctx);
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (argv[0][0] == '@') {
+		REDEBUG("Node selection is not supported with \"pipelined = yes\"");
+		goto error;
+	}
+
+	/*
+	 *	A leading '-' marks the command as safe to
+	 *	run against a replica.
+	 */
+	if (argv[0][0] == '-') {
+		rctx->read_only = true;
+		argv[0]++;
+		argv_len[0]--;
+		if (!argv_len[0]) {
+			REDEBUG("Missing command");
+			goto error;
+		}
+		if (fr_redis_command_preformatted_add(cmds, "READONLY", sizeof("READONLY") - 1) != FR_REDIS_PIPELINE_OK) {
+			goto error;
+		}
+	}
+
+	RDEBUG2("Executing command: %s", argv[0]);
+	if (argc > 1) {
+		RDEBUG2("With arguments");
+		RINDENT();
+		for (int i = 1; i < argc; i++) RDEBUG2("[%i] %pV", i, fr_box_strvalue_len(argv[i], argv_len[i]));
+		REXDENT();
+	}
+
+	if (fr_redis_command_argv_add(cmds, argc, argv, argv_len) != FR_REDIS_PIPELINE_OK) goto error;
+
+	if (rctx->read_only &&
+	    (fr_redis_command_preformatted_add(cmds, "READWRITE", sizeof("READWRITE") - 1) != FR_REDIS_PIPELINE_OK)) {
+		goto error;
+	}
+
+	switch (redis_command_set_enqueue(xt->t->trunk, cmds)) {
+	case FR_REDIS_PIPELINE_OK:
+		break;
+
+	case FR_REDIS_PIPELINE_DST_UNAVAILABLE:
+		REDEBUG("No connections available");
+		goto error;
+
+	default:
+		REDEBUG("Failed enqueueing command");
+		goto error;
+	}
+	rctx->cmds = cmds;
+
+	return unlang_xlat_yield(request, redis_pipelined_xlat_resume, redis_pipelined_xlat_signal, rctx);
+}
+
+/** Resolves and caches the module's thread instance for use by a specific xlat instance
+ *
+ */
+static int redis_xlat_thread_instantiate(UNUSED void *xlat_inst, void *xlat_thread_inst,
+					 UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	rlm_redis_t			*inst = talloc_get_type_abort(uctx, rlm_redis_t);
+	redis_xlat_thread_inst_t	*xt = xlat_thread_inst;
+
+	xt->inst = inst;
+	xt->t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_redis_thread_t);
+
+	return 0;
+}
+
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
 	rlm_redis_t	*inst = instance;
@@ -499,7 +900,14 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
 
-	xlat_register(inst, inst->name, redis_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, false);
+	if (!inst->pipelined) {
+		xlat_register(inst, inst->name, redis_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, false);
+	} else {
+		xlat = xlat_async_register(inst, inst->name, redis_pipelined_xlat);
+		xlat_async_thread_instantiate_set(xlat, redis_xlat_thread_instantiate,
+						  redis_xlat_thread_inst_t, NULL, inst);
+		xlat_async_yields_set(xlat);
+	}
 
 	/*
 	 *	%{redis_node:<key>[ idx]}
@@ -514,6 +922,14 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	xlat_async_instantiate_set(xlat, redis_xlat_instantiate, rlm_redis_t *, NULL, inst);
 	talloc_free(name);
 
+	/*
+	 *	%{redis_stats:<counter>}
+	 */
+	name = talloc_asprintf(NULL, "%s_stats", inst->name);
+	xlat = xlat_async_register(inst, name, redis_stats_xlat);
+	xlat_async_instantiate_set(xlat, redis_xlat_instantiate, rlm_redis_t *, NULL, inst);
+	talloc_free(name);
+
 	return 0;
 }
 
@@ -524,6 +940,50 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->cluster = fr_redis_cluster_alloc(inst, conf, &inst->conf, true, NULL, NULL, NULL);
 	if (!inst->cluster) return -1;
 
+	if (inst->pipelined) {
+		fr_socket_addr_t	node_addr;
+		char			buffer[FR_IPADDR_STRLEN];
+
+		if (talloc_array_length(inst->conf.hostname) > 1) {
+			cf_log_err(conf, "\"pipelined = yes\" requires a single server");
+			return -1;
+		}
+
+		if (fr_inet_pton_port(&node_addr.ipaddr, &node_addr.port, inst->conf.hostname[0], -1,
+				      AF_UNSPEC, true, true) < 0) {
+			cf_log_perr(conf, "Failed parsing server address");
+			return -1;
+		}
+
+		inst->io_conf = (fr_redis_io_conf_t) {
+			.port = node_addr.port ? node_addr.port : inst->conf.port,
+			.database = inst->conf.database,
+			.password = inst->conf.password,
+			.log_prefix = inst->name
+		};
+		fr_inet_ntop(buffer, sizeof(buffer), &node_addr.ipaddr);
+		MEM(inst->io_conf.hostname = talloc_typed_strdup(inst, buffer));
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_redis_t		*inst = talloc_get_type_abort(instance, rlm_redis_t);
+	rlm_redis_thread_t	*t = talloc_get_type_abort(thread, rlm_redis_thread_t);
+
+	t->inst = inst;
+
+	if (!inst->pipelined) return 0;
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, el, &inst->trunk_conf, inst->name);
+	t->trunk = fr_redis_trunk_alloc(t->cluster, &inst->io_conf);
+	if (!t->trunk) {
+		ERROR("Failed creating trunk");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -544,4 +1004,7 @@ module_t rlm_redis = {
 	.onload		= mod_load,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_redis_thread_t),
+	.thread_inst_type	= "rlm_redis_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
 };
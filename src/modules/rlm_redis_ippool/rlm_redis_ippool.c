@@ -44,10 +44,12 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/modpriv.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
 #include "redis_ippool.h"
 
 #ifdef WITH_DHCP
@@ -98,10 +100,54 @@ typedef struct {
 						//!< allocated_address_attr if updates are successful.
 
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
+
+	bool			pipelined;	//!< Run the scripts asynchronously, pipelining
+						//!< scripts from different requests onto
+						//!< shared connections.
+	fr_trunk_conf_t		trunk_conf;	//!< Trunk configuration, used when pipelined.
+	fr_redis_io_conf_t	io_conf;	//!< How the trunk connects to the server.
 } rlm_redis_ippool_t;
 
+/** rlm_redis_ippool thread instance
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster;	//!< Thread local cluster state.
+	fr_redis_trunk_t		*trunk;		//!< Trunk for the server.
+} rlm_redis_ippool_thread_t;
+
+#define IPPOOL_MAX_ARGS		9		//!< EVALSHA, digest, numkeys, key, and up to 5 ARGVs.
+
+/** The state of a pipelined script
+ *
+ * Everything the commands reference is copied here, as the commands
+ * may not be written to the connection until after the module returns.
+ */
+typedef struct {
+	rlm_redis_ippool_t const *inst;		//!< This instance of rlm_redis_ippool.
+	ippool_action_t		action;		//!< What the script does.
+	char const		*ip_str;	//!< Address being updated or released.
+	uint32_t		expires;	//!< Lease time passed to the script.
+
+	char const		*argv[IPPOOL_MAX_ARGS];		//!< EVALSHA command.
+	size_t			argv_len[IPPOOL_MAX_ARGS];	//!< Lengths of the EVALSHA arguments.
+	int			argc;				//!< Number of EVALSHA arguments.
+
+	char const		*load_argv[3];	//!< SCRIPT LOAD command.
+	size_t			load_argv_len[3];
+	char const		*wait_argv[3];	//!< WAIT command.
+	size_t			wait_argv_len[3];
+
+	fr_redis_command_set_t	*cmds;		//!< Commands sent.  NULL once they've completed.
+	bool			load_script;	//!< Commands load the script before running it.
+	bool			no_script;	//!< The server didn't have the script cached.
+	ippool_rcode_t		rcode;		//!< Returned by the script.
+} ippool_pipelined_rctx_t;
+
 static CONF_PARSER redis_config[] = {
 	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("pipelined", FR_TYPE_BOOL, rlm_redis_ippool_t, pipelined), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_redis_ippool_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -599,47 +645,14 @@ finish:
 	return s_ret;
 }
 
-/** Allocate a new IP address from a pool
+/** Process the reply from the allocation script
  *
+ * Adds the allocated address, range and expiry time to the request.
  */
-static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, REQUEST *request,
-					    uint8_t const *key_prefix, size_t key_prefix_len,
-					    uint8_t const *device_id, size_t device_id_len,
-					    uint8_t const *gateway_id, size_t gateway_id_len,
-					    uint32_t expires)
+static ippool_rcode_t ippool_allocate_reply(rlm_redis_ippool_t const *inst, REQUEST *request, redisReply *reply)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
 	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
-	fr_assert(key_prefix);
-	fr_assert(device_id);
-
-	now = fr_time_to_timeval(fr_time());
-
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!gateway_id) gateway_id = (uint8_t const *)"";
-
-	status = ippool_script(&reply, request, inst->cluster,
-			       key_prefix, key_prefix_len,
-			       inst->wait_num, inst->wait_timeout,
-			       lua_alloc_digest, lua_alloc_cmd,
-	 		       "EVALSHA %s 1 %b %u %u %b %b",
-	 		       lua_alloc_digest,
-			       key_prefix, key_prefix_len,
-			       (unsigned int)now.tv_sec, expires,
-			       device_id, device_id_len,
-			       gateway_id, gateway_id_len);
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	fr_assert(reply);
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
@@ -786,24 +799,16 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, REQU
 		}
 	}
 finish:
-	fr_redis_reply_free(&reply);
 	return ret;
 }
 
-/** Update an existing IP address in a pool
+/** Process the reply from the update script
  *
+ * Adds the range and expiry time to the request.
  */
-static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUEST *request,
-					  uint8_t const *key_prefix, size_t key_prefix_len,
-					  fr_ipaddr_t *ip,
-					  uint8_t const *device_id, size_t device_id_len,
-					  uint8_t const *gateway_id, size_t gateway_id_len,
+static ippool_rcode_t ippool_update_reply(rlm_redis_ippool_t const *inst, REQUEST *request, redisReply *reply,
 					  uint32_t expires)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
 	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
 	vp_tmpl_t		range_rhs;
@@ -811,47 +816,6 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 
 	tmpl_init(&range_rhs, TMPL_TYPE_DATA, "", 0, T_DOUBLE_QUOTED_STRING);
 
-	now = fr_time_to_timeval(fr_time());
-
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!device_id) device_id = (uint8_t const *)"";
-	if (!gateway_id) gateway_id = (uint8_t const *)"";
-
-	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %u %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       htonl(ip->addr.v4.s_addr),
-				       device_id, device_id_len,
-				       gateway_id, gateway_id_len);
-	} else {
-		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %s %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       ip_buff,
-				       device_id, device_id_len,
-				       gateway_id, gateway_id_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
@@ -926,6 +890,152 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 		}
 	}
 
+finish:
+	return ret;
+}
+
+/** Process the reply from the release script
+ *
+ */
+static ippool_rcode_t ippool_release_reply(REQUEST *request, redisReply *reply)
+{
+	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+
+	if (reply->type != REDIS_REPLY_ARRAY) {
+		REDEBUG("Expected result to be array got \"%s\"",
+			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	if (reply->elements == 0) {
+		REDEBUG("Got empty result array");
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	/*
+	 *	Process return code
+	 */
+	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
+		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
+			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+	ret = reply->element[0]->integer;
+	if (ret < 0) goto finish;
+
+finish:
+	return ret;
+}
+
+/** Allocate a new IP address from a pool
+ *
+ */
+static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, REQUEST *request,
+					    uint8_t const *key_prefix, size_t key_prefix_len,
+					    uint8_t const *device_id, size_t device_id_len,
+					    uint8_t const *gateway_id, size_t gateway_id_len,
+					    uint32_t expires)
+{
+	struct			timeval now;
+	redisReply		*reply = NULL;
+
+	fr_redis_rcode_t	status;
+	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+
+	fr_assert(key_prefix);
+	fr_assert(device_id);
+
+	now = fr_time_to_timeval(fr_time());
+
+	/*
+	 *	hiredis doesn't deal well with NULL string pointers
+	 */
+	if (!gateway_id) gateway_id = (uint8_t const *)"";
+
+	status = ippool_script(&reply, request, inst->cluster,
+			       key_prefix, key_prefix_len,
+			       inst->wait_num, inst->wait_timeout,
+			       lua_alloc_digest, lua_alloc_cmd,
+	 		       "EVALSHA %s 1 %b %u %u %b %b",
+	 		       lua_alloc_digest,
+			       key_prefix, key_prefix_len,
+			       (unsigned int)now.tv_sec, expires,
+			       device_id, device_id_len,
+			       gateway_id, gateway_id_len);
+	if (status != REDIS_RCODE_SUCCESS) {
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	ret = ippool_allocate_reply(inst, request, reply);
+
+finish:
+	fr_redis_reply_free(&reply);
+	return ret;
+}
+
+/** Update an existing IP address in a pool
+ *
+ */
+static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUEST *request,
+					  uint8_t const *key_prefix, size_t key_prefix_len,
+					  fr_ipaddr_t *ip,
+					  uint8_t const *device_id, size_t device_id_len,
+					  uint8_t const *gateway_id, size_t gateway_id_len,
+					  uint32_t expires)
+{
+	struct			timeval now;
+	redisReply		*reply = NULL;
+
+	fr_redis_rcode_t	status;
+	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+
+	now = fr_time_to_timeval(fr_time());
+
+	/*
+	 *	hiredis doesn't deal well with NULL string pointers
+	 */
+	if (!device_id) device_id = (uint8_t const *)"";
+	if (!gateway_id) gateway_id = (uint8_t const *)"";
+
+	if ((ip->af == AF_INET) && inst->ipv4_integer) {
+		status = ippool_script(&reply, request, inst->cluster,
+				       key_prefix, key_prefix_len,
+				       inst->wait_num, inst->wait_timeout,
+				       lua_update_digest, lua_update_cmd,
+				       "EVALSHA %s 1 %b %u %u %u %b %b",
+				       lua_update_digest,
+				       key_prefix, key_prefix_len,
+				       (unsigned int)now.tv_sec, expires,
+				       htonl(ip->addr.v4.s_addr),
+				       device_id, device_id_len,
+				       gateway_id, gateway_id_len);
+	} else {
+		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
+
+		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
+		status = ippool_script(&reply, request, inst->cluster,
+				       key_prefix, key_prefix_len,
+				       inst->wait_num, inst->wait_timeout,
+				       lua_update_digest, lua_update_cmd,
+				       "EVALSHA %s 1 %b %u %u %s %b %b",
+				       lua_update_digest,
+				       key_prefix, key_prefix_len,
+				       (unsigned int)now.tv_sec, expires,
+				       ip_buff,
+				       device_id, device_id_len,
+				       gateway_id, gateway_id_len);
+	}
+	if (status != REDIS_RCODE_SUCCESS) {
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	ret = ippool_update_reply(inst, request, reply, expires);
+
 finish:
 	fr_redis_reply_free(&reply);
 
@@ -984,33 +1094,10 @@ static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, REQUE
 		goto finish;
 	}
 
-	if (reply->type != REDIS_REPLY_ARRAY) {
-		REDEBUG("Expected result to be array got \"%s\"",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
+	ret = ippool_release_reply(request, reply);
 
-	if (reply->elements == 0) {
-		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	/*
-	 *	Process return code
-	 */
-	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
-		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
-
-finish:
-	fr_redis_reply_free(&reply);
+finish:
+	fr_redis_reply_free(&reply);
 
 	return ret;
 }
@@ -1054,7 +1141,415 @@ static inline ssize_t ippool_pool_name(uint8_t const **out, uint8_t buff[], size
 	return slen;
 }
 
-static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request, ippool_action_t action)
+/** Convert the result of one of the Lua scripts into a module rcode
+ *
+ * @param[in] inst	This instance of the rlm_redis_ippool module.
+ * @param[in] request	The current request.
+ * @param[in] action	The script was performing.
+ * @param[in] ip_str	The address being updated or released.  NULL for allocations.
+ * @param[in] rcode	Returned by the script.
+ * @return the module rcode for the action.
+ */
+static rlm_rcode_t ippool_action_rcode(rlm_redis_ippool_t const *inst, REQUEST *request,
+				       ippool_action_t action, char const *ip_str, ippool_rcode_t rcode)
+{
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+		switch (rcode) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("IP address lease allocated");
+			return RLM_MODULE_UPDATED;
+
+		case IPPOOL_RCODE_POOL_EMPTY:
+			RWDEBUG("Pool contains no free addresses");
+			return RLM_MODULE_NOTFOUND;
+
+		default:
+			return RLM_MODULE_FAIL;
+		}
+
+	case POOL_ACTION_UPDATE:
+		switch (rcode) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
+
+			/*
+			 *	Copy over the input IP address to the reply attribute
+			 */
+			if (inst->copy_on_update) {
+				vp_tmpl_t ip_rhs = {
+					.name = "",
+					.type = TMPL_TYPE_DATA,
+					.quote = T_BARE_WORD,
+				};
+				vp_map_t ip_map = {
+					.lhs = inst->allocated_address_attr,
+					.op = T_OP_SET,
+					.rhs = &ip_rhs
+				};
+
+				fr_value_box_strdup_shallow(&ip_rhs.data.literal, NULL, ip_str, false);
+
+				if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) return RLM_MODULE_FAIL;
+			}
+			return RLM_MODULE_UPDATED;
+
+		/*
+		 *	It's useful to be able to identify the 'not found' case
+		 *	as we can relay to a server where the IP address might
+		 *	be found.  This extremely useful for migrations.
+		 */
+		case IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
+			return RLM_MODULE_NOTFOUND;
+
+		case IPPOOL_RCODE_EXPIRED:
+			REDEBUG("Requested IP address' \"%s\" lease already expired at time of renewal", ip_str);
+			return RLM_MODULE_INVALID;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
+			return RLM_MODULE_INVALID;
+
+		default:
+			return RLM_MODULE_FAIL;
+		}
+
+	case POOL_ACTION_RELEASE:
+		switch (rcode) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("IP address \"%s\" released", ip_str);
+			return RLM_MODULE_UPDATED;
+
+		/*
+		 *	It's useful to be able to identify the 'not found' case
+		 *	as we can relay to a server where the IP address might
+		 *	be found.  This extremely useful for migrations.
+		 */
+		case IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
+			return RLM_MODULE_NOTFOUND;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
+			return RLM_MODULE_INVALID;
+
+		default:
+			return RLM_MODULE_FAIL;
+		}
+
+	default:
+		fr_assert(0);
+		return RLM_MODULE_FAIL;
+	}
+}
+
+/** Add an argument to a pipelined script, copying it into the rctx
+ *
+ */
+static inline void ippool_pipelined_arg(ippool_pipelined_rctx_t *rctx, void const *arg, size_t arg_len)
+{
+	fr_assert(rctx->argc < IPPOOL_MAX_ARGS);
+
+	/*
+	 *	hiredis doesn't deal well with NULL string pointers
+	 */
+	if (!arg) {
+		arg = "";
+		arg_len = 0;
+	}
+
+	MEM(rctx->argv[rctx->argc] = talloc_bstrndup(rctx, arg, arg_len));
+	rctx->argv_len[rctx->argc++] = arg_len;
+}
+
+/** Process the replies to a pipelined script
+ *
+ * The command set is freed once this returns, so the reply is processed
+ * here, adding the lease information to the request.
+ */
+static void ippool_pipelined_complete(REQUEST *request, fr_dlist_head_t *completed, void *uctx)
+{
+	ippool_pipelined_rctx_t		*rctx = talloc_get_type_abort(uctx, ippool_pipelined_rctx_t);
+	rlm_redis_ippool_t const	*inst = rctx->inst;
+	fr_redis_command_t		*cmd;
+	redisReply			*reply, *result;
+
+	rctx->cmds = NULL;
+	rctx->rcode = IPPOOL_RCODE_FAIL;
+
+	cmd = fr_dlist_head(completed);
+
+	/*
+	 *	MULTI, SCRIPT LOAD and EVALSHA only return
+	 *	QUEUED, the results are in the EXEC reply.
+	 */
+	if (rctx->load_script) {
+		int i;
+
+		for (i = 0; cmd && (i < 3); i++) cmd = fr_dlist_next(completed, cmd);
+
+		reply = cmd ? fr_redis_command_get_result(cmd) : NULL;
+		if (!reply || (reply->type != REDIS_REPLY_ARRAY) || (reply->elements != 2)) {
+			REDEBUG("Bad response to EXEC");
+			goto finish;
+		}
+		if ((reply->element[0]->type != REDIS_REPLY_STRING) ||
+		    (strcmp(reply->element[0]->str, rctx->argv[1]) != 0)) {
+			REDEBUG("Bad response to SCRIPT LOAD");
+			goto finish;
+		}
+		result = reply->element[1];
+	} else {
+		result = cmd ? fr_redis_command_get_result(cmd) : NULL;
+		if (!result) {
+			REDEBUG("Missing reply");
+			goto finish;
+		}
+
+		/*
+		 *	The script will be loaded and run again
+		 *	when the request resumes.
+		 */
+		if ((result->type == REDIS_REPLY_ERROR) && (strncmp(result->str, "NOSCRIPT", 8) == 0)) {
+			rctx->no_script = true;
+			goto finish;
+		}
+	}
+
+	if (result->type == REDIS_REPLY_ERROR) {
+		REDEBUG("Script failed: %.*s", (int)result->len, result->str);
+		goto finish;
+	}
+
+	if (inst->wait_num) {
+		cmd = fr_dlist_next(completed, cmd);
+		reply = cmd ? fr_redis_command_get_result(cmd) : NULL;
+		if (!reply) {
+			REDEBUG("Missing WAIT reply");
+			goto finish;
+		}
+		if (ippool_wait_check(request, inst->wait_num, reply) < 0) goto finish;
+	}
+
+	switch (rctx->action) {
+	case POOL_ACTION_ALLOCATE:
+		rctx->rcode = ippool_allocate_reply(inst, request, result);
+		break;
+
+	case POOL_ACTION_UPDATE:
+		rctx->rcode = ippool_update_reply(inst, request, result, rctx->expires);
+		break;
+
+	case POOL_ACTION_RELEASE:
+		rctx->rcode = ippool_release_reply(request, result);
+		break;
+
+	default:
+		fr_assert(0);
+		break;
+	}
+
+finish:
+	unlang_interpret_resumable(request);
+}
+
+/** Record that a pipelined script couldn't be executed
+ *
+ */
+static void ippool_pipelined_fail(REQUEST *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	ippool_pipelined_rctx_t	*rctx = talloc_get_type_abort(uctx, ippool_pipelined_rctx_t);
+
+	rctx->cmds = NULL;
+	rctx->rcode = IPPOOL_RCODE_FAIL;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Enqueue the script, loading it first if the server didn't have it cached
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int ippool_pipelined_send(rlm_redis_ippool_thread_t *t, REQUEST *request, ippool_pipelined_rctx_t *rctx)
+{
+	rlm_redis_ippool_t const	*inst = rctx->inst;
+	fr_redis_command_set_t		*cmds;
+
+	cmds = fr_redis_command_set_alloc(NULL, request, ippool_pipelined_complete, ippool_pipelined_fail, rctx);
+
+	if (rctx->load_script) {
+		RDEBUG3("Loading script 0x%s", rctx->argv[1]);
+		if ((fr_redis_command_preformatted_add(cmds, "MULTI", sizeof("MULTI") - 1) != FR_REDIS_PIPELINE_OK) ||
+		    (fr_redis_command_argv_add(cmds, NUM_ELEMENTS(rctx->load_argv),
+		    			       rctx->load_argv, rctx->load_argv_len) != FR_REDIS_PIPELINE_OK)) {
+		error:
+			REDEBUG("Failed building commands");
+			talloc_free(cmds);
+			return -1;
+		}
+	}
+
+	RDEBUG3("Calling script 0x%s", rctx->argv[1]);
+	if (fr_redis_command_argv_add(cmds, rctx->argc, rctx->argv, rctx->argv_len) != FR_REDIS_PIPELINE_OK) goto error;
+
+	if (rctx->load_script &&
+	    (fr_redis_command_preformatted_add(cmds, "EXEC", sizeof("EXEC") - 1) != FR_REDIS_PIPELINE_OK)) goto error;
+
+	if (inst->wait_num &&
+	    (fr_redis_command_argv_add(cmds, NUM_ELEMENTS(rctx->wait_argv),
+	    			       rctx->wait_argv, rctx->wait_argv_len) != FR_REDIS_PIPELINE_OK)) goto error;
+
+	switch (redis_command_set_enqueue(t->trunk, cmds)) {
+	case FR_REDIS_PIPELINE_OK:
+		break;
+
+	case FR_REDIS_PIPELINE_DST_UNAVAILABLE:
+		REDEBUG("No connections available");
+		talloc_free(cmds);
+		return -1;
+
+	default:
+		REDEBUG("Failed enqueueing commands");
+		talloc_free(cmds);
+		return -1;
+	}
+	rctx->cmds = cmds;
+
+	return 0;
+}
+
+static void mod_pipelined_signal(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request,
+				 void *uctx, fr_state_signal_t action)
+{
+	ippool_pipelined_rctx_t	*rctx = talloc_get_type_abort(uctx, ippool_pipelined_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (rctx->cmds) fr_redis_command_set_signal_cancel(rctx->cmds);
+	talloc_free(rctx);
+}
+
+static rlm_rcode_t mod_pipelined_resume(module_ctx_t const *mctx, REQUEST *request, void *uctx)
+{
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+	ippool_pipelined_rctx_t		*rctx = talloc_get_type_abort(uctx, ippool_pipelined_rctx_t);
+	rlm_rcode_t			rcode;
+
+	if (rctx->no_script) {
+		rctx->no_script = false;
+		rctx->load_script = true;
+
+		if (ippool_pipelined_send(t, request, rctx) < 0) {
+			talloc_free(rctx);
+			return RLM_MODULE_FAIL;
+		}
+
+		return unlang_module_yield(request, mod_pipelined_resume, mod_pipelined_signal, rctx);
+	}
+
+	rcode = ippool_action_rcode(rctx->inst, request, rctx->action, rctx->ip_str, rctx->rcode);
+	talloc_free(rctx);
+
+	return rcode;
+}
+
+/** Run one of the Lua scripts over the thread's trunk
+ *
+ * Used instead of the synchronous functions when `pipelined = yes`.  The
+ * request yields until the script's reply arrives.
+ */
+static rlm_rcode_t ippool_pipelined(rlm_redis_ippool_t const *inst, rlm_redis_ippool_thread_t *t,
+				    REQUEST *request, ippool_action_t action,
+				    uint8_t const *key_prefix, size_t key_prefix_len,
+				    fr_ipaddr_t *ip, char const *ip_str,
+				    uint8_t const *device_id, size_t device_id_len,
+				    uint8_t const *gateway_id, size_t gateway_id_len,
+				    uint32_t expires)
+{
+	ippool_pipelined_rctx_t	*rctx;
+	char const		*digest = NULL, *script = NULL;
+	char			buff[FR_IPADDR_PREFIX_STRLEN];
+
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+		digest = lua_alloc_digest;
+		script = lua_alloc_cmd;
+		break;
+
+	case POOL_ACTION_UPDATE:
+		digest = lua_update_digest;
+		script = lua_update_cmd;
+		break;
+
+	case POOL_ACTION_RELEASE:
+		digest = lua_release_digest;
+		script = lua_release_cmd;
+		break;
+
+	default:
+		fr_assert(0);
+		return RLM_MODULE_FAIL;
+	}
+
+	MEM(rctx = talloc_zero(request, ippool_pipelined_rctx_t));
+	rctx->inst = inst;
+	rctx->action = action;
+	rctx->expires = expires;
+	if (ip_str) MEM(rctx->ip_str = talloc_typed_strdup(rctx, ip_str));
+
+	ippool_pipelined_arg(rctx, "EVALSHA", sizeof("EVALSHA") - 1);
+	ippool_pipelined_arg(rctx, digest, strlen(digest));
+	ippool_pipelined_arg(rctx, "1", 1);
+	ippool_pipelined_arg(rctx, key_prefix, key_prefix_len);
+	snprintf(buff, sizeof(buff), "%u", (unsigned int)fr_time_to_timeval(fr_time()).tv_sec);
+	ippool_pipelined_arg(rctx, buff, strlen(buff));
+
+	if (action != POOL_ACTION_RELEASE) {
+		snprintf(buff, sizeof(buff), "%u", expires);
+		ippool_pipelined_arg(rctx, buff, strlen(buff));
+	}
+
+	if (action != POOL_ACTION_ALLOCATE) {
+		if ((ip->af == AF_INET) && inst->ipv4_integer) {
+			snprintf(buff, sizeof(buff), "%u", htonl(ip->addr.v4.s_addr));
+		} else {
+			IPPOOL_SPRINT_IP(buff, ip, ip->prefix);
+		}
+		ippool_pipelined_arg(rctx, buff, strlen(buff));
+	}
+
+	ippool_pipelined_arg(rctx, device_id, device_id_len);
+	if (action != POOL_ACTION_RELEASE) ippool_pipelined_arg(rctx, gateway_id, gateway_id_len);
+
+	rctx->load_argv[0] = "SCRIPT";
+	rctx->load_argv_len[0] = sizeof("SCRIPT") - 1;
+	rctx->load_argv[1] = "LOAD";
+	rctx->load_argv_len[1] = sizeof("LOAD") - 1;
+	rctx->load_argv[2] = script;
+	rctx->load_argv_len[2] = strlen(script);
+
+	if (inst->wait_num) {
+		rctx->wait_argv[0] = "WAIT";
+		rctx->wait_argv_len[0] = sizeof("WAIT") - 1;
+		MEM(rctx->wait_argv[1] = talloc_asprintf(rctx, "%u", inst->wait_num));
+		rctx->wait_argv_len[1] = talloc_array_length(rctx->wait_argv[1]) - 1;
+		MEM(rctx->wait_argv[2] = talloc_asprintf(rctx, "%" PRIu64, fr_time_delta_to_msec(inst->wait_timeout)));
+		rctx->wait_argv_len[2] = talloc_array_length(rctx->wait_argv[2]) - 1;
+	}
+
+	if (ippool_pipelined_send(t, request, rctx) < 0) {
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_pipelined_resume, mod_pipelined_signal, rctx);
+}
+
+static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, rlm_redis_ippool_thread_t *t,
+			      REQUEST *request, ippool_action_t action)
 {
 	uint8_t		key_prefix_buff[IPPOOL_MAX_KEY_PREFIX_SIZE], device_id_buff[256], gateway_id_buff[256];
 	uint8_t const	*key_prefix, *device_id = NULL, *gateway_id = NULL;
@@ -1066,7 +1561,7 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 	unsigned long	expires = 0;
 	char		*q;
 
-	slen = ippool_pool_name(&key_prefix, (uint8_t *)&key_prefix_buff, sizeof(key_prefix_len), inst, request);
+	slen = ippool_pool_name(&key_prefix, (uint8_t *)&key_prefix_buff, sizeof(key_prefix_buff), inst, request);
 	if (slen < 0) return RLM_MODULE_FAIL;
 	if (slen == 0) return RLM_MODULE_NOOP;
 
@@ -1110,20 +1605,15 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len, NULL,
 				    device_id, device_id_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
-					      device_id, device_id_len,
-					      gateway_id, gateway_id_len, (uint32_t)expires)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("IP address lease allocated");
-			return RLM_MODULE_UPDATED;
-
-		case IPPOOL_RCODE_POOL_EMPTY:
-			RWDEBUG("Pool contains no free addresses");
-			return RLM_MODULE_NOTFOUND;
-
-		default:
-			return RLM_MODULE_FAIL;
+		if (inst->pipelined) {
+			return ippool_pipelined(inst, t, request, action, key_prefix, key_prefix_len, NULL, NULL,
+						device_id, device_id_len, gateway_id, gateway_id_len,
+						(uint32_t)expires);
 		}
+		return ippool_action_rcode(inst, request, action, NULL,
+					   redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
+								 device_id, device_id_len,
+								 gateway_id, gateway_id_len, (uint32_t)expires));
 
 	case POOL_ACTION_UPDATE:
 	{
@@ -1154,53 +1644,15 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, device_id, device_id_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_update(inst, request, key_prefix, key_prefix_len,
-					    &ip, device_id, device_id_len,
-					    gateway_id, gateway_id_len, (uint32_t)expires)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
-
-			/*
-			 *	Copy over the input IP address to the reply attribute
-			 */
-			if (inst->copy_on_update) {
-				vp_tmpl_t ip_rhs = {
-					.name = "",
-					.type = TMPL_TYPE_DATA,
-					.quote = T_BARE_WORD,
-				};
-				vp_map_t ip_map = {
-					.lhs = inst->allocated_address_attr,
-					.op = T_OP_SET,
-					.rhs = &ip_rhs
-				};
-
-				fr_value_box_strdup_shallow(&ip_rhs.data.literal, NULL, ip_str, false);
-
-				if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) return RLM_MODULE_FAIL;
-			}
-			return RLM_MODULE_UPDATED;
-
-		/*
-		 *	It's useful to be able to identify the 'not found' case
-		 *	as we can relay to a server where the IP address might
-		 *	be found.  This extremely useful for migrations.
-		 */
-		case IPPOOL_RCODE_NOT_FOUND:
-			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
-			return RLM_MODULE_NOTFOUND;
-
-		case IPPOOL_RCODE_EXPIRED:
-			REDEBUG("Requested IP address' \"%s\" lease already expired at time of renewal", ip_str);
-			return RLM_MODULE_INVALID;
-
-		case IPPOOL_RCODE_DEVICE_MISMATCH:
-			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
-			return RLM_MODULE_INVALID;
-
-		default:
-			return RLM_MODULE_FAIL;
+		if (inst->pipelined) {
+			return ippool_pipelined(inst, t, request, action, key_prefix, key_prefix_len, &ip, ip_str,
+						device_id, device_id_len, gateway_id, gateway_id_len,
+						(uint32_t)expires);
 		}
+		return ippool_action_rcode(inst, request, action, ip_str,
+					   redis_ippool_update(inst, request, key_prefix, key_prefix_len,
+							       &ip, device_id, device_id_len,
+							       gateway_id, gateway_id_len, (uint32_t)expires));
 	}
 
 	case POOL_ACTION_RELEASE:
@@ -1220,28 +1672,13 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, device_id, device_id_len, gateway_id, gateway_id_len, 0);
-		switch (redis_ippool_release(inst, request, key_prefix, key_prefix_len,
-					     &ip, device_id, device_id_len)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("IP address \"%s\" released", ip_str);
-			return RLM_MODULE_UPDATED;
-
-		/*
-		 *	It's useful to be able to identify the 'not found' case
-		 *	as we can relay to a server where the IP address might
-		 *	be found.  This extremely useful for migrations.
-		 */
-		case IPPOOL_RCODE_NOT_FOUND:
-			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
-			return RLM_MODULE_NOTFOUND;
-
-		case IPPOOL_RCODE_DEVICE_MISMATCH:
-			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
-			return RLM_MODULE_INVALID;
-
-		default:
-			return RLM_MODULE_FAIL;
+		if (inst->pipelined) {
+			return ippool_pipelined(inst, t, request, action, key_prefix, key_prefix_len, &ip, ip_str,
+						device_id, device_id_len, NULL, 0, 0);
 		}
+		return ippool_action_rcode(inst, request, action, ip_str,
+					   redis_ippool_release(inst, request, key_prefix, key_prefix_len,
+								&ip, device_id, device_id_len));
 	}
 
 	case POOL_ACTION_BULK_RELEASE:
@@ -1257,13 +1694,14 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQUEST *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
 	VALUE_PAIR			*vp;
 
 	/*
 	 *	Pool-Action override
 	 */
 	vp = fr_pair_find_by_da(request->control, attr_pool_action, TAG_ANY);
-	if (vp) return mod_action(inst, request, vp->vp_uint32);
+	if (vp) return mod_action(inst, t, request, vp->vp_uint32);
 
 	/*
 	 *	Otherwise, guess the action by Acct-Status-Type
@@ -1277,14 +1715,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQ
 	switch (vp->vp_uint32) {
 	case FR_STATUS_START:
 	case FR_STATUS_ALIVE:
-		return mod_action(inst, request, POOL_ACTION_UPDATE);
+		return mod_action(inst, t, request, POOL_ACTION_UPDATE);
 
 	case FR_STATUS_STOP:
-		return mod_action(inst, request, POOL_ACTION_RELEASE);
+		return mod_action(inst, t, request, POOL_ACTION_RELEASE);
 
 	case FR_STATUS_ACCOUNTING_OFF:
 	case FR_STATUS_ACCOUNTING_ON:
-		return mod_action(inst, request, POOL_ACTION_BULK_RELEASE);
+		return mod_action(inst, t, request, POOL_ACTION_BULK_RELEASE);
 
 	default:
 		return RLM_MODULE_NOOP;
@@ -1294,6 +1732,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQ
 static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQUEST *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
 	VALUE_PAIR			*vp;
 
 	/*
@@ -1301,12 +1740,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQU
 	 *	when called in Post-Auth.
 	 */
 	vp = fr_pair_find_by_da(request->control, attr_pool_action, TAG_ANY);
-	return mod_action(inst, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
+	return mod_action(inst, t, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
 }
 
 static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(module_ctx_t const *mctx, REQUEST *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
 	VALUE_PAIR			*vp;
 	ippool_action_t			action = POOL_ACTION_ALLOCATE;
 
@@ -1333,7 +1773,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(module_ctx_t const *mctx, REQU
 	}
 
 run:
-	return mod_action(inst, request, action);
+	return mod_action(inst, t, request, action);
 }
 
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
@@ -1346,6 +1786,9 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	fr_assert(tmpl_is_attr(inst->allocated_address_attr));
 	fr_assert(subcs);
 
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
 	inst->cluster = fr_redis_cluster_alloc(inst, subcs, &inst->conf, true, NULL, NULL, NULL);
 	if (!inst->cluster) return -1;
 
@@ -1383,6 +1826,48 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	 */
 	if (!inst->offer_time) inst->offer_time = inst->lease_time;
 
+	if (inst->pipelined) {
+		fr_socket_addr_t	node_addr;
+		char			buffer[FR_IPADDR_STRLEN];
+
+		if (talloc_array_length(inst->conf.hostname) > 1) {
+			cf_log_err(subcs, "\"pipelined = yes\" requires a single server");
+			return -1;
+		}
+
+		if (fr_inet_pton_port(&node_addr.ipaddr, &node_addr.port, inst->conf.hostname[0], -1,
+				      AF_UNSPEC, true, true) < 0) {
+			cf_log_perr(subcs, "Failed parsing server address");
+			return -1;
+		}
+
+		inst->io_conf = (fr_redis_io_conf_t) {
+			.port = node_addr.port ? node_addr.port : inst->conf.port,
+			.database = inst->conf.database,
+			.password = inst->conf.password,
+			.log_prefix = inst->name
+		};
+		fr_inet_ntop(buffer, sizeof(buffer), &node_addr.ipaddr);
+		MEM(inst->io_conf.hostname = talloc_typed_strdup(inst, buffer));
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_redis_ippool_t		*inst = talloc_get_type_abort(instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(thread, rlm_redis_ippool_thread_t);
+
+	if (!inst->pipelined) return 0;
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, el, &inst->trunk_conf, inst->name);
+	t->trunk = fr_redis_trunk_alloc(t->cluster, &inst->io_conf);
+	if (!t->trunk) {
+		ERROR("Failed creating trunk");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -1402,6 +1887,9 @@ module_t rlm_redis_ippool = {
 	.config		= module_config,
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_redis_ippool_thread_t),
+	.thread_inst_type	= "rlm_redis_ippool_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_AUTHORIZE]		= mod_authorize,
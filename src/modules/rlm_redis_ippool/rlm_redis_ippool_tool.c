@@ -33,7 +33,9 @@ RCSID("$Id$")
 #include "cluster.h"
 #include "redis_ippool.h"
 
-#define MAX_PIPELINED 100000
+#include <pthread.h>
+
+#define MAX_PIPELINED 10000		//!< Maximum number of addresses in a block of pipelined commands.
 
 /** Pool management actions
  *
@@ -44,7 +46,8 @@ typedef enum ippool_tool_action {
 	IPPOOL_TOOL_REMOVE,			//!< Remove one or more IP addresses.
 	IPPOOL_TOOL_RELEASE,			//!< Release one or more IP addresses.
 	IPPOOL_TOOL_SHOW,			//!< Show one or more IP addresses.
-	IPPOOL_TOOL_MODIFY			//!< Modify attributes of one or more IP addresses.
+	IPPOOL_TOOL_MODIFY,			//!< Modify attributes of one or more IP addresses.
+	IPPOOL_TOOL_IMPORT			//!< Add the IP addresses listed in a file.
 } ippool_tool_action_t;
 
 /** A single pool operation
@@ -108,6 +111,27 @@ typedef int (*redis_ippool_queue_t)(redis_driver_conf_t *inst, fr_redis_conn_t *
 
 typedef int (*redis_ippool_process_t)(void *out, fr_ipaddr_t const *ipaddr, redisReply const *reply);
 
+/** Work shared between the threads performing an operation
+ *
+ * Each thread takes a block of addresses at a time, and pipelines the
+ * commands for the whole block on its own connection.
+ */
+typedef struct {
+	redis_driver_conf_t		*inst;		//!< Driver instance.
+	ippool_tool_operation_t const	*op;		//!< Operation being performed.
+	redis_ippool_queue_t		enqueue;	//!< Adds the commands for an address.
+	redis_ippool_process_t		process;	//!< Processes the replies for an address.
+	void				*out;		//!< Passed to process.
+
+	pthread_mutex_t			mutex;		//!< Protects the fields below, and out.
+	fr_ipaddr_t			next;		//!< First address of the next block.
+	bool				done;		//!< All the blocks have been handed out.
+	bool				failed;		//!< A block couldn't be processed.
+	uint64_t			processed;	//!< Addresses processed so far.
+	fr_time_t			started;	//!< When the operation started.
+	fr_time_t			last_progress;	//!< When progress was last reported.
+} ippool_tool_work_t;
+
 #define IPPOOL_BUILD_IP_KEY_FROM_STR(_buff, _p, _key, _key_len, _ip_str) \
 do { \
 	ssize_t _slen; \
@@ -126,6 +150,8 @@ do { \
 #define EOL "\n"
 
 static char const *name;
+static unsigned int num_threads = 1;		//!< How many connections to use in parallel.
+static bool show_progress = false;		//!< Report progress and throughput.
 /** Lua script for releasing a lease
  *
  * - KEYS[1] The pool name.
@@ -198,7 +224,7 @@ static char lua_remove_cmd[] =
 	"return 1" EOL;									/* 12 */
 
 static void NEVER_RETURNS usage(int ret) {
-	INFO("Usage: %s -adrsm range... [-p prefix_len]... [-x]... [-oShf] server[:port] [pool] [range id]", name);
+	INFO("Usage: %s -adrsmi range... [-p prefix_len]... [-x]... [-oShfP] [-t threads] server[:port] [pool] [range id]", name);
 	INFO("Pool management:");
 	INFO("  -a range               Add address(es)/prefix(es) to the pool.");
 	INFO("  -d range               Delete address(es)/prefix(es) in this range.");
@@ -212,9 +238,11 @@ static void NEVER_RETURNS usage(int ret) {
 	INFO("                         instance of an -adrsm argument, only.");
 	INFO("  -m range               Change the range id to the one specified for addresses");
 	INFO("                         in this range.");
+	INFO("  -i file                Add the address(es)/prefix(es) listed in file, or stdin if");
+	INFO("                         file is '-'.  Each line contains a range, and optionally");
+	INFO("                         a range id.  Lines are processed as they're read.");
 	INFO("  -l                     List available pools.");
 //	INFO("  -L                     List available ranges in pool [NYI]");
-//	INFO("  -i file                Import entries from ISC lease file [NYI]");
 	INFO(" ");	/* -Werror=format-zero-length */
 //	INFO("Pool status:");
 //	INFO("  -I                     Output active entries in ISC lease file format [NYI]");
@@ -223,6 +251,8 @@ static void NEVER_RETURNS usage(int ret) {
 	INFO("Configuration:");
 	INFO("  -h                     Print this help message and exit");
 	INFO("  -x                     Increase the verbosity level");
+	INFO("  -t threads             Number of connections to use in parallel (defaults to 1)");
+	INFO("  -P                     Print progress and throughput");
 //	INFO("  -o attr=value          Set option, these are specific to the backends [NYI]");
 	INFO("  -f file                Load connection options from a FreeRADIUS format config file");
 	INFO("                         This file should contain a pool { ... } section and one or more");
@@ -301,88 +331,215 @@ static bool ipaddr_next(fr_ipaddr_t *ipaddr, fr_ipaddr_t const *end, uint8_t pre
 	}
 }
 
-/** Add a net to the pool
+/** Hand out the next block of addresses to a thread
  *
- * @return the number of new addresses added.
+ * @param[out] start	First address in the block.
+ * @param[out] num	Number of addresses in the block.
+ * @param[in] work	Shared between the threads.
+ * @return
+ *	- true if there was a block to hand out.
+ *	- false if all the blocks have been handed out.
  */
-static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t const *op,
-			   redis_ippool_queue_t enqueue, redis_ippool_process_t process)
+static bool driver_next_block(fr_ipaddr_t *start, unsigned int *num, ippool_tool_work_t *work)
 {
-	redis_driver_conf_t		*inst = talloc_get_type_abort(instance, redis_driver_conf_t);
+	pthread_mutex_lock(&work->mutex);
+	if (work->done) {
+		pthread_mutex_unlock(&work->mutex);
+		return false;
+	}
+
+	*start = work->next;
+	for (*num = 1; ; (*num)++) {
+		if (!ipaddr_next(&work->next, &work->op->end, work->op->prefix)) {
+			work->done = true;
+			break;
+		}
+		if (*num == MAX_PIPELINED) break;
+	}
+	pthread_mutex_unlock(&work->mutex);
 
-	int				i;
-	bool				more = true;
+	return true;
+}
+
+/** Print how many addresses have been processed, and how quickly
+ *
+ * @note Must be called with the work mutex held.
+ */
+static void driver_progress(ippool_tool_work_t *work, fr_time_t now)
+{
+	fr_time_delta_t	elapsed = now - work->started;
+
+	work->last_progress = now;
+	INFO("Processed %" PRIu64 " address(es)/prefix(es) in %.2fs (%.0f/s)", work->processed,
+	     (double)elapsed / NSEC, elapsed ? ((double)work->processed * NSEC) / elapsed : 0);
+}
+
+/** Send the commands for a block of addresses, and process the replies
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int driver_do_block(ippool_tool_work_t *work, REQUEST *request, fr_ipaddr_t const *start, unsigned int num)
+{
+	redis_driver_conf_t		*inst = work->inst;
+	ippool_tool_operation_t const	*op = work->op;
+
+	unsigned int			i;
 	fr_redis_conn_t			*conn;
 
 	fr_redis_cluster_state_t	state;
 	fr_redis_rcode_t		status;
 
-	fr_ipaddr_t			ipaddr = op->start;
+	fr_ipaddr_t			ipaddr;
 	fr_redis_rcode_t		s_ret = REDIS_RCODE_SUCCESS;
-	REQUEST				*request;
 	redisReply			**replies = NULL;
+	size_t				reply_cnt = 0;
 
 	unsigned int			pipelined = 0;
 
-	request = request_alloc(inst);
-	while (more) {
-		fr_ipaddr_t	acked = ipaddr; 	/* Record our progress */
-		size_t		reply_cnt = 0;
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request,
+						 op->pool, op->pool_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &replies[0])) {
+		status = REDIS_RCODE_SUCCESS;
 
-		for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request,
-							 op->pool, op->pool_len, false);
-		     s_ret == REDIS_RCODE_TRY_AGAIN;
-		     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &replies[0])) {
-		     	more = true;	/* Reset to true, may have errored last loop */
-			status = REDIS_RCODE_SUCCESS;
+		/*
+		 *	If we got a redirect, start back at the beginning of the block.
+		 */
+		ipaddr = *start;
 
-			/*
-			 *	If we got a redirect, start back at the beginning of the block.
-			 */
-			ipaddr = acked;
+		for (i = 0; i < num; i++) {
+			int enqueued;
 
-			for (i = 0; (i < MAX_PIPELINED) && more; i++, more = ipaddr_next(&ipaddr, &op->end,
-											 op->prefix)) {
-				int enqueued;
+			if (i > 0) ipaddr_next(&ipaddr, &op->end, op->prefix);
 
-				enqueued = enqueue(inst, conn, op->pool, op->pool_len,
-						   op->range, op->range_len, &ipaddr, op->prefix);
-				if (enqueued < 0) break;
-				pipelined += enqueued;
-			}
+			enqueued = work->enqueue(inst, conn, op->pool, op->pool_len,
+						 op->range, op->range_len, &ipaddr, op->prefix);
+			if (enqueued < 0) break;
+			pipelined += enqueued;
+		}
 
-			if (!replies) replies = talloc_zero_array(inst, redisReply *, pipelined);
-			if (!replies) return 0;
+		if (!replies) replies = talloc_zero_array(request, redisReply *, pipelined);
+		if (!replies) return -1;
 
-			reply_cnt = fr_redis_pipeline_result(&pipelined, &status, replies,
-							     talloc_array_length(replies), conn);
-			for (i = 0; (size_t)i < reply_cnt; i++) fr_redis_reply_print(L_DBG_LVL_3,
-										     replies[i], request, i);
-		}
-		if (s_ret != REDIS_RCODE_SUCCESS) {
-			fr_redis_pipeline_free(replies, reply_cnt);
-			talloc_free(replies);
-			talloc_free(request);
-			return -1;
+		reply_cnt = fr_redis_pipeline_result(&pipelined, &status, replies,
+						     talloc_array_length(replies), conn);
+		for (i = 0; (size_t)i < reply_cnt; i++) fr_redis_reply_print(L_DBG_LVL_3,
+									     replies[i], request, i);
+	}
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+		fr_redis_pipeline_free(replies, reply_cnt);
+		talloc_free(replies);
+		return -1;
+	}
+
+	pthread_mutex_lock(&work->mutex);
+	if (work->process) {
+		fr_ipaddr_t to_process = *start;
+
+		for (i = 0; (size_t)i < reply_cnt; i++) {
+			int ret;
+
+			ret = work->process(work->out, &to_process, replies[i]);
+			if (ret < 0) continue;
+			ipaddr_next(&to_process, &op->end, op->prefix);
 		}
+	}
+	work->processed += num;
+	if (show_progress) {
+		fr_time_t now = fr_time();
 
-		if (process) {
-			fr_ipaddr_t to_process = acked;
+		if ((now - work->last_progress) >= NSEC) driver_progress(work, now);
+	}
+	pthread_mutex_unlock(&work->mutex);
 
-			for (i = 0; (size_t)i < reply_cnt; i++) {
-				int ret;
+	fr_redis_pipeline_free(replies, reply_cnt);
+	talloc_free(replies);
 
-				ret = process(out, &to_process, replies[i]);
-				if (ret < 0) continue;
-				ipaddr_next(&to_process, &op->end, op->prefix);
-			}
+	return 0;
+}
+
+/** Process blocks of addresses until there are none left
+ *
+ */
+static void *driver_do_lease_thread(void *uctx)
+{
+	ippool_tool_work_t	*work = uctx;
+	REQUEST			*request;
+	fr_ipaddr_t		start;
+	unsigned int		num;
+
+	/*
+	 *	Not parented by the instance, talloc
+	 *	isn't thread safe.
+	 */
+	request = request_alloc(NULL);
+	while (driver_next_block(&start, &num, work)) {
+		if (driver_do_block(work, request, &start, num) < 0) {
+			pthread_mutex_lock(&work->mutex);
+			work->failed = true;
+			work->done = true;
+			pthread_mutex_unlock(&work->mutex);
+			break;
 		}
-		fr_redis_pipeline_free(replies, reply_cnt);
-		TALLOC_FREE(replies);
 	}
 	talloc_free(request);
 
-	return 0;
+	return NULL;
+}
+
+/** Perform an operation on every address in a range
+ *
+ * The range is split into blocks, which are processed by num_threads
+ * threads, each using its own connection.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t const *op,
+			   redis_ippool_queue_t enqueue, redis_ippool_process_t process)
+{
+	ippool_tool_work_t	work = {
+					.inst = talloc_get_type_abort(instance, redis_driver_conf_t),
+					.op = op,
+					.enqueue = enqueue,
+					.process = process,
+					.out = out,
+					.next = op->start
+				};
+	pthread_t		*threads;
+	unsigned int		i, started = 0;
+
+	pthread_mutex_init(&work.mutex, NULL);
+	work.started = work.last_progress = fr_time();
+
+	if (num_threads <= 1) {
+		driver_do_lease_thread(&work);
+	} else {
+		MEM(threads = talloc_array(NULL, pthread_t, num_threads));
+		for (i = 0; i < num_threads; i++) {
+			if (pthread_create(&threads[i], NULL, driver_do_lease_thread, &work) != 0) {
+				ERROR("Failed creating thread: %s", fr_syserror(errno));
+				break;
+			}
+			started++;
+		}
+
+		/*
+		 *	Work is handed out on demand, so the
+		 *	threads we did start will finish the job.
+		 */
+		if (!started) work.failed = true;
+		for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+		talloc_free(threads);
+	}
+
+	if (show_progress) driver_progress(&work, fr_time());
+	pthread_mutex_destroy(&work.mutex);
+
+	return work.failed ? -1 : 0;
 }
 
 /** Enqueue commands to retrieve lease information
@@ -1203,6 +1360,101 @@ static int parse_ip_range(fr_ipaddr_t *start_out, fr_ipaddr_t *end_out, char con
 	return 0;
 }
 
+/** Add the ranges listed in a file to a pool
+ *
+ * Each line contains a range, in any format accepted by -a, optionally
+ * followed by whitespace and a range id.  Blank lines, and lines starting
+ * with '#' are ignored.
+ *
+ * Lines are processed as they're read, so the file may be arbitrarily
+ * large, and may be streamed from stdin.
+ *
+ * @param[out] out	Where to write the number of addresses added.
+ * @param[in] conf	Tool configuration.
+ * @param[in] file	to read, or "-" for stdin.
+ * @param[in] pool	to add the addresses to.
+ * @param[in] prefix	of the addresses (or 0 for hosts).
+ * @param[in] range	to use if a line doesn't specify one.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int driver_import_file(uint64_t *out, ippool_tool_t *conf, char const *file,
+			      uint8_t const *pool, uint8_t prefix, uint8_t const *range)
+{
+	FILE	*fp;
+	char	buff[1024];
+	int	lineno = 0;
+	int	ret = 0;
+
+	if (strcmp(file, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen(file, "r");
+		if (!fp) {
+			ERROR("Failed opening \"%s\": %s", file, fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	while (fgets(buff, sizeof(buff), fp)) {
+		ippool_tool_operation_t	op = {
+						.name = buff,
+						.action = IPPOOL_TOOL_IMPORT,
+						.pool = pool,
+						.pool_len = talloc_array_length(pool),
+						.range = range,
+						.range_len = talloc_array_length(range)
+					};
+		char			*p, *q;
+		uint64_t		count = 0;
+
+		lineno++;
+
+		p = buff;
+		fr_skip_whitespace(p);
+		if ((*p == '\0') || (*p == '#')) continue;
+		op.name = p;
+
+		/*
+		 *	Split off the optional range id
+		 */
+		q = p;
+		while (*q && !isspace((uint8_t)*q)) q++;
+		if (*q) {
+			*q++ = '\0';
+			fr_skip_whitespace(q);
+			p = q + strlen(q);
+			while ((p > q) && isspace((uint8_t)p[-1])) *--p = '\0';
+			if (*q) {
+				op.range = (uint8_t const *)q;
+				op.range_len = p - q;
+			}
+		}
+
+		if (parse_ip_range(&op.start, &op.end, op.name, prefix) < 0) {
+			ERROR("%s[%d]: Invalid range", file, lineno);
+			ret = -1;
+			break;
+		}
+		op.prefix = prefix ? prefix : IPADDR_LEN(op.start.af);
+
+		if (driver_add_lease(&count, conf->driver, &op) < 0) {
+			ret = -1;
+			break;
+		}
+		*out += count;
+	}
+	if (ferror(fp)) {
+		ERROR("Failed reading \"%s\": %s", file, fr_syserror(errno));
+		ret = -1;
+	}
+
+	if (fp != stdin) fclose(fp);
+
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	static ippool_tool_operation_t	ops[128];
@@ -1215,6 +1467,8 @@ int main(int argc, char *argv[])
 	bool				do_export = false, print_stats = false, list_pools = false;
 	bool				need_pool = false;
 	char				*do_import = NULL;
+	uint8_t				import_prefix = 0;
+	bool				import_prefix_next = false;
 	char const			*filename = NULL;
 
 	CONF_SECTION			*pool_cs;
@@ -1238,9 +1492,10 @@ do { \
 	p->name = optarg; \
 	p++; \
 	need_pool = true; \
+	import_prefix_next = false; \
 } while (0);
 
-	while ((c = getopt(argc, argv, "a:d:r:s:Sm:p:ilLhxo:f:")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "a:d:r:s:Sm:p:i:lLhxo:f:t:P")) != -1) switch (c) {
 		case 'a':
 			ADD_ACTION(IPPOOL_TOOL_ADD);
 			break;
@@ -1266,7 +1521,7 @@ do { \
 			unsigned long tmp;
 			char *q;
 
-			if (p == ops) {
+			if ((p == ops) && !do_import) {
 				ERROR("Prefix may only be specified after a pool management action");
 				usage(64);
 			}
@@ -1277,12 +1532,40 @@ do { \
 
 			}
 
-			(p - 1)->prefix = (uint8_t)tmp & 0xff;
+			/*
+			 *	Applies to whichever of -i or the
+			 *	other actions came last.
+			 */
+			if (import_prefix_next) {
+				import_prefix = (uint8_t)tmp & 0xff;
+			} else {
+				(p - 1)->prefix = (uint8_t)tmp & 0xff;
+			}
 		}
 			break;
 
 		case 'i':
 			do_import = optarg;
+			need_pool = true;
+			import_prefix_next = true;
+			break;
+
+		case 't':
+		{
+			unsigned long tmp;
+			char *q;
+
+			tmp = strtoul(optarg, &q, 10);
+			if ((q != (optarg + strlen(optarg))) || (tmp < 1) || (tmp > 1024)) {
+				ERROR("Threads must be an integer value between 1 and 1024");
+				usage(64);
+			}
+			num_threads = (unsigned int)tmp;
+		}
+			break;
+
+		case 'P':
+			show_progress = true;
 			break;
 
 		case 'I':
@@ -1400,13 +1683,30 @@ do { \
 		cf_pair_add(pool_cs, cp);
 	}
 
+	/*
+	 *	Each thread needs its own connection
+	 */
+	cp = cf_pair_find(pool_cs, "max");
+	if (!cp) {
+		char buff[11];
+
+		snprintf(buff, sizeof(buff), "%u", num_threads);
+		cp = cf_pair_alloc(pool_cs, "max", buff, T_OP_EQ, T_BARE_WORD, T_BARE_WORD);
+		cf_pair_add(pool_cs, cp);
+	}
+
 	if (driver_init(conf, conf->cs, &conf->driver) < 0) {
 		ERROR("Driver initialisation failed");
 		fr_exit_now(EXIT_FAILURE);
 	}
 
 	if (do_import) {
-		ERROR("NOT YET IMPLEMENTED");
+		uint64_t count = 0;
+
+		if (driver_import_file(&count, conf, do_import, pool_arg, import_prefix, range_arg) < 0) {
+			fr_exit_now(EXIT_FAILURE);
+		}
+		INFO("Imported %" PRIu64 " address(es)/prefix(es)", count);
 	}
 
 	if (do_export) {
@@ -1610,6 +1910,7 @@ do { \
 	}
 		continue;
 
+	case IPPOOL_TOOL_IMPORT:	/* Handled above */
 	case IPPOOL_TOOL_NOOP:
 		break;
 	}
@@ -31,10 +31,12 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/modpriv.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
 
 typedef struct {
 	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
@@ -51,8 +53,41 @@ typedef struct {
 	char const		*insert;	//!< Command for inserting session data
 	char const		*trim;		//!< Command for trimming the session list.
 	char const		*expire;	//!< Command for expiring entries.
+
+	bool			pipelined;	//!< Send all of a packet's commands at once, pipelining
+						//!< commands from different requests onto
+						//!< shared connections.
+	fr_trunk_conf_t		trunk_conf;	//!< Trunk configuration, used when pipelined.
+	fr_redis_io_conf_t	io_conf;	//!< How the trunk connects to the server.
 } rlm_rediswho_t;
 
+/** rlm_rediswho thread instance
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster;	//!< Thread local cluster state.
+	fr_redis_trunk_t		*trunk;		//!< Trunk for the server.
+} rlm_rediswho_thread_t;
+
+#define REDISWHO_MAX_COMMANDS	3		//!< insert, trim and expire.
+
+/** The state of a packet's pipelined commands
+ *
+ * The expanded commands are kept here, as they may not be written to
+ * the connection until after the module returns.
+ */
+typedef struct {
+	char const		*argv[REDISWHO_MAX_COMMANDS][MAX_REDIS_ARGS];
+	size_t			argv_len[REDISWHO_MAX_COMMANDS][MAX_REDIS_ARGS];
+	int			argc[REDISWHO_MAX_COMMANDS];
+	char			argv_buf[REDISWHO_MAX_COMMANDS][MAX_REDIS_COMMAND_LEN];
+	int			num_cmds;	//!< How many commands were expanded.
+	bool			has_insert;	//!< The first command is the insert.
+
+	fr_redis_command_set_t	*cmds;		//!< Commands sent.  NULL once they've completed.
+	rlm_rcode_t		rcode;		//!< What to return when the request resumes.
+} rediswho_rctx_t;
+
 static CONF_PARSER section_config[] = {
 	{ FR_CONF_OFFSET("insert", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_rediswho_t, insert) },
 	{ FR_CONF_OFFSET("trim", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_rediswho_t, trim) }, /* required only if trim_count > 0 */
@@ -62,6 +97,8 @@ static CONF_PARSER section_config[] = {
 
 static CONF_PARSER module_config[] = {
 	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("pipelined", FR_TYPE_BOOL, rlm_rediswho_t, pipelined), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_rediswho_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 
 	{ FR_CONF_OFFSET("trim_count", FR_TYPE_INT32, rlm_rediswho_t, trim_count), .dflt = "-1" },
 
@@ -196,9 +233,182 @@ static rlm_rcode_t mod_accounting_all(rlm_rediswho_t const *inst, REQUEST *reque
 	return RLM_MODULE_OK;
 }
 
+/** Expand one of a packet's commands into the rctx
+ *
+ * @return
+ *	- 0 on success, or if there's no command.
+ *	- -1 on failure.
+ */
+static int rediswho_pipelined_expand(rediswho_rctx_t *rctx, REQUEST *request, char const *fmt)
+{
+	int	i, n = rctx->num_cmds;
+	int	argc;
+
+	if (!fmt || !*fmt) return 0;
+
+	fr_assert(n < REDISWHO_MAX_COMMANDS);
+
+	argc = rad_expand_xlat(request, fmt, MAX_REDIS_ARGS, rctx->argv[n], false,
+			       sizeof(rctx->argv_buf[n]), rctx->argv_buf[n]);
+	if (argc < 0) {
+		RPEDEBUG("Invalid command: %s", fmt);
+		return -1;
+	}
+
+	for (i = 0; i < argc; i++) rctx->argv_len[n][i] = strlen(rctx->argv[n][i]);
+	rctx->argc[n] = argc;
+	rctx->num_cmds++;
+
+	return 0;
+}
+
+/** Check the replies to a packet's commands
+ *
+ * The first reply is to the insert, and must be an integer, as it is
+ * on the synchronous path.  The trim and expire only fail if the
+ * server returned an error.
+ */
+static void rediswho_pipelined_complete(REQUEST *request, fr_dlist_head_t *completed, void *uctx)
+{
+	rediswho_rctx_t		*rctx = talloc_get_type_abort(uctx, rediswho_rctx_t);
+	fr_redis_command_t	*cmd;
+	redisReply		*reply;
+	int			i;
+
+	rctx->cmds = NULL;
+	rctx->rcode = RLM_MODULE_FAIL;
+
+	for (cmd = fr_dlist_head(completed), i = 0;
+	     i < rctx->num_cmds;
+	     cmd = fr_dlist_next(completed, cmd), i++) {
+		reply = cmd ? fr_redis_command_get_result(cmd) : NULL;
+		if (!reply) {
+			REDEBUG("Missing reply");
+			goto finish;
+		}
+
+		/*
+		 *	Write the response to the debug log
+		 */
+		fr_redis_reply_print(L_DBG_LVL_2, reply, request, 0);
+
+		if (reply->type == REDIS_REPLY_ERROR) {
+			REDEBUG("Command failed: %.*s", (int)reply->len, reply->str);
+			goto finish;
+		}
+
+		if ((i == 0) && rctx->has_insert && ((reply->type != REDIS_REPLY_INTEGER) || (reply->integer <= 0))) {
+			REDEBUG("Expected type \"integer\" got type \"%s\"",
+				fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+			goto finish;
+		}
+	}
+	rctx->rcode = RLM_MODULE_OK;
+
+finish:
+	unlang_interpret_resumable(request);
+}
+
+/** Record that a packet's commands couldn't be executed
+ *
+ */
+static void rediswho_pipelined_fail(REQUEST *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	rediswho_rctx_t	*rctx = talloc_get_type_abort(uctx, rediswho_rctx_t);
+
+	rctx->cmds = NULL;
+	rctx->rcode = RLM_MODULE_FAIL;
+
+	unlang_interpret_resumable(request);
+}
+
+static void mod_pipelined_signal(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request,
+				 void *uctx, fr_state_signal_t action)
+{
+	rediswho_rctx_t	*rctx = talloc_get_type_abort(uctx, rediswho_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (rctx->cmds) fr_redis_command_set_signal_cancel(rctx->cmds);
+	talloc_free(rctx);
+}
+
+static rlm_rcode_t mod_pipelined_resume(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request, void *uctx)
+{
+	rediswho_rctx_t	*rctx = talloc_get_type_abort(uctx, rediswho_rctx_t);
+	rlm_rcode_t	rcode = rctx->rcode;
+
+	talloc_free(rctx);
+
+	return rcode;
+}
+
+/** Send all of a packet's commands as one command set over the thread's trunk
+ *
+ * Used instead of #mod_accounting_all when `pipelined = yes`.  The
+ * insert's result isn't known until the replies arrive, so when
+ * trim_count is set, the trim command is always sent.
+ */
+static rlm_rcode_t mod_accounting_pipelined(rlm_rediswho_t const *inst, rlm_rediswho_thread_t *t,
+					    REQUEST *request,
+					    char const *insert,
+					    char const *trim,
+					    char const *expire)
+{
+	rediswho_rctx_t		*rctx;
+	fr_redis_command_set_t	*cmds;
+	int			i;
+
+	MEM(rctx = talloc_zero(request, rediswho_rctx_t));
+
+	if (rediswho_pipelined_expand(rctx, request, insert) < 0) {
+	error:
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
+	}
+	rctx->has_insert = (rctx->num_cmds > 0);
+
+	if ((rctx->has_insert && (inst->trim_count >= 0) && (rediswho_pipelined_expand(rctx, request, trim) < 0)) ||
+	    (rediswho_pipelined_expand(rctx, request, expire) < 0)) goto error;
+
+	if (!rctx->num_cmds) {
+		talloc_free(rctx);
+		return RLM_MODULE_OK;
+	}
+
+	cmds = fr_redis_command_set_alloc(NULL, request, rediswho_pipelined_complete, rediswho_pipelined_fail, rctx);
+	for (i = 0; i < rctx->num_cmds; i++) {
+		if (fr_redis_command_argv_add(cmds, rctx->argc[i], rctx->argv[i],
+					      rctx->argv_len[i]) != FR_REDIS_PIPELINE_OK) {
+			REDEBUG("Failed building commands");
+			talloc_free(cmds);
+			goto error;
+		}
+	}
+
+	switch (redis_command_set_enqueue(t->trunk, cmds)) {
+	case FR_REDIS_PIPELINE_OK:
+		break;
+
+	case FR_REDIS_PIPELINE_DST_UNAVAILABLE:
+		REDEBUG("No connections available");
+		talloc_free(cmds);
+		goto error;
+
+	default:
+		REDEBUG("Failed enqueueing commands");
+		talloc_free(cmds);
+		goto error;
+	}
+	rctx->cmds = cmds;
+
+	return unlang_module_yield(request, mod_pipelined_resume, mod_pipelined_signal, rctx);
+}
+
 static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQUEST *request)
 {
 	rlm_rediswho_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_rediswho_t);
+	rlm_rediswho_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_rediswho_thread_t);
 	rlm_rcode_t		rcode;
 	VALUE_PAIR		*vp;
 	fr_dict_enum_t		*dv;
@@ -227,6 +437,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQ
 	trim = cf_pair_value(cf_pair_find(cs, "trim"));
 	expire = cf_pair_value(cf_pair_find(cs, "expire"));
 
+	if (inst->pipelined) return mod_accounting_pipelined(inst, t, request, insert, trim, expire);
+
 	rcode = mod_accounting_all(inst, request, insert, trim, expire);
 
 	return rcode;
@@ -250,6 +462,48 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->cluster = fr_redis_cluster_alloc(inst, conf, &inst->conf, true, NULL, NULL, NULL);
 	if (!inst->cluster) return -1;
 
+	if (inst->pipelined) {
+		fr_socket_addr_t	node_addr;
+		char			buffer[FR_IPADDR_STRLEN];
+
+		if (talloc_array_length(inst->conf.hostname) > 1) {
+			cf_log_err(conf, "\"pipelined = yes\" requires a single server");
+			return -1;
+		}
+
+		if (fr_inet_pton_port(&node_addr.ipaddr, &node_addr.port, inst->conf.hostname[0], -1,
+				      AF_UNSPEC, true, true) < 0) {
+			cf_log_perr(conf, "Failed parsing server address");
+			return -1;
+		}
+
+		inst->io_conf = (fr_redis_io_conf_t) {
+			.port = node_addr.port ? node_addr.port : inst->conf.port,
+			.database = inst->conf.database,
+			.password = inst->conf.password,
+			.log_prefix = inst->name
+		};
+		fr_inet_ntop(buffer, sizeof(buffer), &node_addr.ipaddr);
+		MEM(inst->io_conf.hostname = talloc_typed_strdup(inst, buffer));
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_rediswho_t		*inst = talloc_get_type_abort(instance, rlm_rediswho_t);
+	rlm_rediswho_thread_t	*t = talloc_get_type_abort(thread, rlm_rediswho_thread_t);
+
+	if (!inst->pipelined) return 0;
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, el, &inst->trunk_conf, inst->name);
+	t->trunk = fr_redis_trunk_alloc(t->cluster, &inst->io_conf);
+	if (!t->trunk) {
+		ERROR("Failed creating trunk");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -270,6 +524,9 @@ module_t rlm_rediswho = {
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
 	.bootstrap	= mod_bootstrap,
+	.thread_inst_size	= sizeof(rlm_rediswho_thread_t),
+	.thread_inst_type	= "rlm_rediswho_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting
 	},
@@ -935,6 +935,49 @@ static VALUE_PAIR *json_pair_alloc_leaf(UNUSED rlm_rest_t const *instance, UNUSE
 	return vp;
 }
 
+/** Resolve a JSON member name to an attribute, and the list it should be inserted into
+ *
+ * @param[out] out	Where to write the attribute reference.
+ * @param[out] current	Request containing the list.
+ * @param[out] vps	List the attribute should be inserted into.
+ * @param[out] ctx	to allocate new VALUE_PAIRs in.
+ * @param[in] request	Current request.
+ * @param[in] name	of the JSON member.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the member should be skipped.
+ */
+static int json_pair_dst(vp_tmpl_t **out, REQUEST **current, VALUE_PAIR ***vps, TALLOC_CTX **ctx,
+			 REQUEST *request, char const *name)
+{
+	RDEBUG2("Parsing attribute \"%s\"", name);
+
+	if (tmpl_afrom_attr_str(request, NULL, out, name,
+				&(vp_tmpl_rules_t){
+					.prefix = VP_ATTR_REF_PREFIX_NO,
+					.dict_def = request->dict,
+					.list_def = PAIR_LIST_REPLY
+				}) <= 0) {
+		RPWDEBUG("Failed parsing attribute (skipping)");
+		return -1;
+	}
+
+	*current = request;
+	if (radius_request(current, tmpl_request(*out)) < 0) {
+		RWDEBUG("Attribute name refers to outer request but not in a tunnel (skipping)");
+		return -1;
+	}
+
+	*vps = radius_list(*current, tmpl_list(*out));
+	if (!*vps) {
+		RWDEBUG("List not valid in this context (skipping)");
+		return -1;
+	}
+	*ctx = radius_list_ctx(*current, tmpl_list(*out));
+
+	return 0;
+}
+
 /** Processes JSON response and converts it into multiple VALUE_PAIRs
  *
  * Processes JSON attribute declarations in the format below. Will recurse when
@@ -1019,7 +1062,7 @@ static int json_pair_alloc(rlm_rest_t const *instance, rlm_rest_section_t const
 			.is_json = 0
 		};
 
-		REQUEST		*current = request;
+		REQUEST		*current;
 		VALUE_PAIR	**vps, *vp = NULL;
 
 		TALLOC_FREE(dst);
@@ -1027,32 +1070,10 @@ static int json_pair_alloc(rlm_rest_t const *instance, rlm_rest_section_t const
 		/*
 		 *  Resolve attribute name to a dictionary entry and pairlist.
 		 */
-		RDEBUG2("Parsing attribute \"%s\"", name);
-
-		if (tmpl_afrom_attr_str(request, NULL, &dst, name,
-					&(vp_tmpl_rules_t){
-						.prefix = VP_ATTR_REF_PREFIX_NO,
-						.dict_def = request->dict,
-						.list_def = PAIR_LIST_REPLY
-					}) <= 0) {
-			RPWDEBUG("Failed parsing attribute (skipping)");
-			continue;
-		}
+		if (json_pair_dst(&dst, &current, &vps, &ctx, request, name) < 0) continue;
 
 		flags.tag = tmpl_tag(dst);
 
-		if (radius_request(&current, tmpl_request(dst)) < 0) {
-			RWDEBUG("Attribute name refers to outer request but not in a tunnel (skipping)");
-			continue;
-		}
-
-		vps = radius_list(current, tmpl_list(dst));
-		if (!vps) {
-			RWDEBUG("List not valid in this context (skipping)");
-			continue;
-		}
-		ctx = radius_list_ctx(current, tmpl_list(dst));
-
 		/*
 		 *  Alternative JSON structure which allows operator,
 		 *  and other flags to be specified.
@@ -1224,6 +1245,977 @@ static int rest_decode_json(rlm_rest_t const *instance, rlm_rest_section_t const
 
 	return ret;
 }
+
+/*
+ *	Streaming JSON decoder
+ *
+ *	Parses the response body as libcurl delivers it, without buffering the
+ *	body or building a json-c object tree.  The result is a flat list of
+ *	members, converted to VALUE_PAIRs by rest_decode_json_stream once the
+ *	response code is known.
+ *
+ *	Only the formats accepted by json_pair_alloc are understood, object
+ *	values nested deeper than that are kept as JSON text.
+ */
+#define JSON_STREAM_MAX_DEPTH	32
+
+/** Types of value found in a JSON response
+ *
+ */
+typedef enum {
+	JSON_STREAM_VALUE_STRING = 0,				//!< Decoded string.
+	JSON_STREAM_VALUE_INT,					//!< Number without a fraction or exponent.
+	JSON_STREAM_VALUE_DOUBLE,				//!< Any other number.
+	JSON_STREAM_VALUE_BOOL,					//!< true or false.
+	JSON_STREAM_VALUE_NULL,					//!< null.
+	JSON_STREAM_VALUE_ARRAY,				//!< Array, as JSON text.
+	JSON_STREAM_VALUE_OBJECT				//!< Object, as JSON text.
+} json_stream_type_t;
+
+typedef struct json_stream_value_s json_stream_value_t;
+struct json_stream_value_s {
+	json_stream_type_t	type;				//!< Type of value.
+	char			*value;				//!< Decoded string, or the text of the value.
+	size_t			len;				//!< Length of value.
+	json_stream_value_t	*next;				//!< Next element of an array.
+};
+
+typedef struct json_stream_member_s json_stream_member_t;
+struct json_stream_member_s {
+	char			*name;				//!< Member name, i.e. the attribute.
+	json_flags_t		flags;				//!< From the expanded syntax.
+	char			*bad_op;			//!< Operator which couldn't be parsed.
+
+	bool			expanded;			//!< Uses the {"op":<op>,"value":<value>} syntax.
+	bool			has_value;			//!< Expanded syntax included a "value".
+	bool			is_array;			//!< Value was an array.
+
+	json_stream_value_t	*values;			//!< Scalar value, or the elements of the array.
+	json_stream_value_t	**tail;				//!< Where to insert the next element.
+	json_stream_value_t	*raw;				//!< Array or object value, as JSON text.
+
+	json_stream_member_t	*next;				//!< Next member of the root object.
+};
+
+/** Parser states
+ *
+ */
+typedef enum {
+	JSON_STREAM_ROOT = 0,					//!< Expecting the root object.
+	JSON_STREAM_KEY_FIRST,					//!< Expecting a member name, or '}'.
+	JSON_STREAM_KEY,					//!< Expecting a member name.
+	JSON_STREAM_COLON,					//!< Expecting ':' after a member name.
+	JSON_STREAM_VALUE,					//!< Expecting a member value.
+	JSON_STREAM_NEXT,					//!< Expecting ',' or '}' after a member.
+	JSON_STREAM_FLAG_KEY_FIRST,				//!< Expecting a key in expanded syntax, or '}'.
+	JSON_STREAM_FLAG_KEY,					//!< Expecting a key in expanded syntax.
+	JSON_STREAM_FLAG_COLON,					//!< Expecting ':' after a key.
+	JSON_STREAM_FLAG_VALUE,					//!< Expecting a value for a key.
+	JSON_STREAM_FLAG_NEXT,					//!< Expecting ',' or '}' after a key's value.
+	JSON_STREAM_ELEMENT_FIRST,				//!< Expecting an array element, or ']'.
+	JSON_STREAM_ELEMENT,					//!< Expecting an array element.
+	JSON_STREAM_ELEMENT_NEXT,				//!< Expecting ',' or ']' after an element.
+	JSON_STREAM_DONE,					//!< Root object complete.
+	JSON_STREAM_ERROR					//!< Malformed data.
+} json_stream_state_t;
+
+/** Token being read
+ *
+ */
+typedef enum {
+	JSON_STREAM_TOKEN_NONE = 0,				//!< Between tokens.
+	JSON_STREAM_TOKEN_STRING,				//!< String.
+	JSON_STREAM_TOKEN_NUMBER,				//!< Number.
+	JSON_STREAM_TOKEN_LITERAL,				//!< true, false or null.
+	JSON_STREAM_TOKEN_TEXT					//!< Array or object kept, or skipped, as text.
+} json_stream_token_t;
+
+/** Keys in the expanded syntax
+ *
+ */
+typedef enum {
+	JSON_STREAM_FLAG_OTHER = 0,				//!< Unknown, value is ignored.
+	JSON_STREAM_FLAG_OP,					//!< "op".
+	JSON_STREAM_FLAG_DO_XLAT,				//!< "do_xlat".
+	JSON_STREAM_FLAG_IS_JSON,				//!< "is_json".
+	JSON_STREAM_FLAG_VALUE_KEY				//!< "value".
+} json_stream_flag_t;
+
+/** Streaming JSON decoder state
+ *
+ */
+typedef struct {
+	json_stream_state_t	state;				//!< Where we are in the response.
+	char const		*error;				//!< Why the response is malformed.
+
+	json_stream_token_t	token;				//!< Token being read.
+	char			*buff;				//!< Decoded token.
+	size_t			len;				//!< Length of the decoded token.
+
+	int			escape;				//!< Position in a string escape sequence.
+	uint32_t		codepoint;			//!< \u escape being decoded.
+	uint32_t		high;				//!< High surrogate preceding the current \u escape.
+
+	int			depth;				//!< Nesting within a value read as text.
+	uint64_t		objects;			//!< Bit set for each level which is an object.
+	bool			in_string;			//!< Inside a string within a value read as text.
+	bool			text_escape;			//!< Previous char was a backslash within a string.
+	json_stream_value_t	*text;				//!< Value being read as text, NULL if skipping.
+
+	bool			in_value_array;			//!< Copying an expanded "value" array to raw.
+	json_stream_flag_t	flag;				//!< Key in expanded syntax being processed.
+
+	json_stream_member_t	*members;			//!< Members of the root object.
+	json_stream_member_t	**tail;				//!< Where to insert the next member.
+	json_stream_member_t	*member;			//!< Member being parsed.
+} json_stream_t;
+
+/** Append a char to a talloced buffer, keeping it \0 terminated
+ *
+ */
+static inline void json_stream_putc(TALLOC_CTX *ctx, char **buff, size_t *len, char c)
+{
+	size_t alloc = talloc_array_length(*buff);
+
+	if ((*len + 2) > alloc) {
+		alloc = alloc ? (alloc * 2) : 64;
+		MEM(*buff = talloc_realloc(ctx, *buff, char, alloc));
+	}
+	(*buff)[(*len)++] = c;
+	(*buff)[*len] = '\0';
+}
+
+/** Append a unicode codepoint to the token in UTF-8
+ *
+ */
+static void json_stream_put_utf8(json_stream_t *s, uint32_t cp)
+{
+	if (cp < 0x80) {
+		json_stream_putc(s, &s->buff, &s->len, cp);
+	} else if (cp < 0x800) {
+		json_stream_putc(s, &s->buff, &s->len, 0xc0 | (cp >> 6));
+		json_stream_putc(s, &s->buff, &s->len, 0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000) {
+		json_stream_putc(s, &s->buff, &s->len, 0xe0 | (cp >> 12));
+		json_stream_putc(s, &s->buff, &s->len, 0x80 | ((cp >> 6) & 0x3f));
+		json_stream_putc(s, &s->buff, &s->len, 0x80 | (cp & 0x3f));
+	} else {
+		json_stream_putc(s, &s->buff, &s->len, 0xf0 | (cp >> 18));
+		json_stream_putc(s, &s->buff, &s->len, 0x80 | ((cp >> 12) & 0x3f));
+		json_stream_putc(s, &s->buff, &s->len, 0x80 | ((cp >> 6) & 0x3f));
+		json_stream_putc(s, &s->buff, &s->len, 0x80 | (cp & 0x3f));
+	}
+}
+
+static inline void json_stream_error(json_stream_t *s, char const *error)
+{
+	s->state = JSON_STREAM_ERROR;
+	s->error = error;
+}
+
+/** Allocate a value in the current member
+ *
+ */
+static json_stream_value_t *json_stream_value_alloc(json_stream_t *s, json_stream_type_t type,
+						    char const *value, size_t len)
+{
+	json_stream_value_t *v;
+
+	MEM(v = talloc_zero(s->member, json_stream_value_t));
+	v->type = type;
+	if (value) {
+		MEM(v->value = talloc_bstrndup(v, value, len));
+		v->len = len;
+	}
+
+	return v;
+}
+
+/** Discard any previous value of the current member
+ *
+ */
+static void json_stream_value_reset(json_stream_member_t *m)
+{
+	m->values = NULL;
+	m->tail = &m->values;
+	m->raw = NULL;
+	m->is_array = false;
+}
+
+static inline void json_stream_value_add(json_stream_member_t *m, json_stream_value_t *v)
+{
+	*m->tail = v;
+	m->tail = &v->next;
+}
+
+/** Process a string, number or literal once it has been read
+ *
+ */
+static void json_stream_scalar(json_stream_t *s, json_stream_type_t type)
+{
+	json_stream_member_t *m = s->member;
+
+	switch (s->state) {
+	case JSON_STREAM_KEY_FIRST:
+	case JSON_STREAM_KEY:
+		if (type != JSON_STREAM_VALUE_STRING) {
+			json_stream_error(s, "Expected member name");
+			return;
+		}
+
+		MEM(m = talloc_zero(s, json_stream_member_t));
+		MEM(m->name = talloc_bstrndup(m, s->buff, s->len));
+		m->flags = (json_flags_t){
+			.op = T_OP_SET,
+			.do_xlat = 1,
+			.is_json = 0
+		};
+		json_stream_value_reset(m);
+
+		*s->tail = m;
+		s->tail = &m->next;
+		s->member = m;
+		s->state = JSON_STREAM_COLON;
+		return;
+
+	case JSON_STREAM_VALUE:
+		json_stream_value_add(m, json_stream_value_alloc(s, type, s->buff, s->len));
+		s->state = JSON_STREAM_NEXT;
+		return;
+
+	case JSON_STREAM_FLAG_KEY_FIRST:
+	case JSON_STREAM_FLAG_KEY:
+		if (type != JSON_STREAM_VALUE_STRING) {
+			json_stream_error(s, "Expected key");
+			return;
+		}
+
+		if (strcmp(s->buff, "op") == 0) {
+			s->flag = JSON_STREAM_FLAG_OP;
+		} else if (strcmp(s->buff, "do_xlat") == 0) {
+			s->flag = JSON_STREAM_FLAG_DO_XLAT;
+		} else if (strcmp(s->buff, "is_json") == 0) {
+			s->flag = JSON_STREAM_FLAG_IS_JSON;
+		} else if (strcmp(s->buff, "value") == 0) {
+			s->flag = JSON_STREAM_FLAG_VALUE_KEY;
+		} else {
+			s->flag = JSON_STREAM_FLAG_OTHER;
+		}
+		s->state = JSON_STREAM_FLAG_COLON;
+		return;
+
+	case JSON_STREAM_FLAG_VALUE:
+		switch (s->flag) {
+		case JSON_STREAM_FLAG_OP:
+			m->flags.op = fr_table_value_by_str(fr_tokens_table, s->buff, 0);
+			if (!m->flags.op) MEM(m->bad_op = talloc_bstrndup(m, s->buff, s->len));
+			break;
+
+		/*
+		 *	Same truthiness as json_object_get_boolean()
+		 */
+		case JSON_STREAM_FLAG_DO_XLAT:
+		case JSON_STREAM_FLAG_IS_JSON:
+		{
+			int value;
+
+			switch (type) {
+			case JSON_STREAM_VALUE_BOOL:
+				value = (strcmp(s->buff, "true") == 0);
+				break;
+
+			case JSON_STREAM_VALUE_INT:
+			case JSON_STREAM_VALUE_DOUBLE:
+				value = (strtod(s->buff, NULL) != 0);
+				break;
+
+			case JSON_STREAM_VALUE_STRING:
+				value = (s->len > 0);
+				break;
+
+			default:
+				value = 0;
+				break;
+			}
+
+			if (s->flag == JSON_STREAM_FLAG_DO_XLAT) {
+				m->flags.do_xlat = value;
+			} else {
+				m->flags.is_json = value;
+			}
+		}
+			break;
+
+		case JSON_STREAM_FLAG_VALUE_KEY:
+			json_stream_value_reset(m);
+			json_stream_value_add(m, json_stream_value_alloc(s, type, s->buff, s->len));
+			m->has_value = true;
+			break;
+
+		case JSON_STREAM_FLAG_OTHER:
+			break;
+		}
+		s->state = JSON_STREAM_FLAG_NEXT;
+		return;
+
+	case JSON_STREAM_ELEMENT_FIRST:
+	case JSON_STREAM_ELEMENT:
+		json_stream_value_add(m, json_stream_value_alloc(s, type, s->buff, s->len));
+		s->state = JSON_STREAM_ELEMENT_NEXT;
+		return;
+
+	default:
+		json_stream_error(s, "Unexpected value");
+		return;
+	}
+}
+
+/** Process an array or object read as text
+ *
+ */
+static void json_stream_text(json_stream_t *s)
+{
+	json_stream_member_t	*m = s->member;
+	json_stream_value_t	*v = s->text;
+
+	s->text = NULL;
+
+	switch (s->state) {
+	case JSON_STREAM_FLAG_VALUE:
+		if (v) {
+			json_stream_value_reset(m);
+			m->raw = v;
+			m->has_value = true;
+		}
+		s->state = JSON_STREAM_FLAG_NEXT;
+		return;
+
+	case JSON_STREAM_ELEMENT_FIRST:
+	case JSON_STREAM_ELEMENT:
+		json_stream_value_add(m, v);
+		s->state = JSON_STREAM_ELEMENT_NEXT;
+		return;
+
+	default:
+		json_stream_error(s, "Unexpected value");
+		return;
+	}
+}
+
+/** Start reading an array or object as text
+ *
+ * @param[in] s		Decoder state.
+ * @param[in] c		Opening '{' or '['.
+ * @param[in] keep	Whether the text should be kept, or skipped.
+ */
+static void json_stream_text_start(json_stream_t *s, char c, bool keep)
+{
+	s->token = JSON_STREAM_TOKEN_TEXT;
+	s->depth = 1;
+	s->objects = (c == '{');
+	s->in_string = false;
+	s->text_escape = false;
+	s->text = NULL;
+
+	if (!keep) return;
+
+	s->text = json_stream_value_alloc(s, (c == '{') ? JSON_STREAM_VALUE_OBJECT : JSON_STREAM_VALUE_ARRAY,
+					  NULL, 0);
+	json_stream_putc(s->text, &s->text->value, &s->text->len, c);
+}
+
+/** Start reading a token, or process a structural char
+ *
+ */
+static void json_stream_structural(json_stream_t *s, char c)
+{
+	json_stream_member_t *m = s->member;
+
+	if (isspace((uint8_t) c)) return;
+
+	switch (s->state) {
+	case JSON_STREAM_ROOT:
+		if (c != '{') {
+			json_stream_error(s, "Expected JSON object");
+			return;
+		}
+		s->state = JSON_STREAM_KEY_FIRST;
+		return;
+
+	case JSON_STREAM_KEY_FIRST:
+	case JSON_STREAM_FLAG_KEY_FIRST:
+		if (c == '}') {
+			s->state = (s->state == JSON_STREAM_KEY_FIRST) ? JSON_STREAM_DONE : JSON_STREAM_NEXT;
+			return;
+		}
+		FALL_THROUGH;
+
+	case JSON_STREAM_KEY:
+	case JSON_STREAM_FLAG_KEY:
+		if (c != '"') {
+			json_stream_error(s, "Expected member name");
+			return;
+		}
+		break;
+
+	case JSON_STREAM_COLON:
+	case JSON_STREAM_FLAG_COLON:
+		if (c != ':') {
+			json_stream_error(s, "Expected ':'");
+			return;
+		}
+		s->state = (s->state == JSON_STREAM_COLON) ? JSON_STREAM_VALUE : JSON_STREAM_FLAG_VALUE;
+		return;
+
+	case JSON_STREAM_NEXT:
+		if (c == ',') {
+			s->state = JSON_STREAM_KEY;
+		} else if (c == '}') {
+			s->state = JSON_STREAM_DONE;
+		} else {
+			json_stream_error(s, "Expected ',' or '}'");
+		}
+		return;
+
+	case JSON_STREAM_FLAG_NEXT:
+		if (c == ',') {
+			s->state = JSON_STREAM_FLAG_KEY;
+		} else if (c == '}') {
+			s->state = JSON_STREAM_NEXT;
+		} else {
+			json_stream_error(s, "Expected ',' or '}'");
+		}
+		return;
+
+	case JSON_STREAM_ELEMENT_NEXT:
+		if (c == ',') {
+			s->state = JSON_STREAM_ELEMENT;
+			return;
+		}
+		FALL_THROUGH;
+
+	case JSON_STREAM_ELEMENT_FIRST:
+		if (c == ']') {
+			if (s->in_value_array) {
+				s->in_value_array = false;
+				m->has_value = true;
+				s->state = JSON_STREAM_FLAG_NEXT;
+			} else {
+				s->state = JSON_STREAM_NEXT;
+			}
+			return;
+		}
+
+		if (s->state == JSON_STREAM_ELEMENT_NEXT) {
+			json_stream_error(s, "Expected ',' or ']'");
+			return;
+		}
+		FALL_THROUGH;
+
+	case JSON_STREAM_ELEMENT:
+		if ((c == '{') || (c == '[')) {
+			json_stream_text_start(s, c, true);
+			return;
+		}
+		break;
+
+	case JSON_STREAM_VALUE:
+		if (c == '{') {
+			m->expanded = true;
+			s->state = JSON_STREAM_FLAG_KEY_FIRST;
+			return;
+		}
+		if (c == '[') {
+			m->is_array = true;
+			s->state = JSON_STREAM_ELEMENT_FIRST;
+			return;
+		}
+		break;
+
+	case JSON_STREAM_FLAG_VALUE:
+		if ((c == '[') && (s->flag == JSON_STREAM_FLAG_VALUE_KEY)) {
+			json_stream_value_reset(m);
+			m->is_array = true;
+			m->raw = json_stream_value_alloc(s, JSON_STREAM_VALUE_ARRAY, NULL, 0);
+			json_stream_putc(m->raw, &m->raw->value, &m->raw->len, c);
+			s->in_value_array = true;
+			s->state = JSON_STREAM_ELEMENT_FIRST;
+			return;
+		}
+		if ((c == '{') || (c == '[')) {
+			json_stream_text_start(s, c, (s->flag == JSON_STREAM_FLAG_VALUE_KEY));
+			return;
+		}
+		break;
+
+	case JSON_STREAM_DONE:
+		json_stream_error(s, "Trailing data after JSON object");
+		return;
+
+	case JSON_STREAM_ERROR:
+		return;
+	}
+
+	/*
+	 *	Start of a scalar
+	 */
+	if (!s->buff) MEM(s->buff = talloc_array(s, char, 64));
+	s->len = 0;
+	s->buff[0] = '\0';
+
+	if (c == '"') {
+		s->token = JSON_STREAM_TOKEN_STRING;
+		s->escape = 0;
+		s->high = 0;
+	} else if ((c == '-') || isdigit((uint8_t) c)) {
+		s->token = JSON_STREAM_TOKEN_NUMBER;
+		json_stream_putc(s, &s->buff, &s->len, c);
+	} else if (isalpha((uint8_t) c)) {
+		s->token = JSON_STREAM_TOKEN_LITERAL;
+		json_stream_putc(s, &s->buff, &s->len, c);
+	} else {
+		json_stream_error(s, "Unexpected character");
+	}
+
+	return;
+}
+
+/** Process a char within a string token
+ *
+ */
+static void json_stream_string(json_stream_t *s, char c)
+{
+	switch (s->escape) {
+	case 0:
+		if (c == '\\') {
+			s->escape = 1;
+			return;
+		}
+
+		if (c == '"') {
+			if (s->high) json_stream_put_utf8(s, 0xfffd);
+			s->token = JSON_STREAM_TOKEN_NONE;
+			json_stream_scalar(s, JSON_STREAM_VALUE_STRING);
+			return;
+		}
+
+		if (s->high) {
+			json_stream_put_utf8(s, 0xfffd);
+			s->high = 0;
+		}
+		json_stream_putc(s, &s->buff, &s->len, c);
+		return;
+
+	case 1:
+		s->escape = 0;
+		if (c == 'u') {
+			s->escape = 2;
+			s->codepoint = 0;
+			return;
+		}
+
+		if (s->high) {
+			json_stream_put_utf8(s, 0xfffd);
+			s->high = 0;
+		}
+
+		switch (c) {
+		case '"':
+		case '\\':
+		case '/':
+			break;
+
+		case 'b':
+			c = '\b';
+			break;
+
+		case 'f':
+			c = '\f';
+			break;
+
+		case 'n':
+			c = '\n';
+			break;
+
+		case 'r':
+			c = '\r';
+			break;
+
+		case 't':
+			c = '\t';
+			break;
+
+		default:
+			json_stream_error(s, "Invalid escape sequence");
+			return;
+		}
+		json_stream_putc(s, &s->buff, &s->len, c);
+		return;
+
+	/*
+	 *	\uXXXX
+	 */
+	default:
+		if (!isxdigit((uint8_t) c)) {
+			json_stream_error(s, "Invalid unicode escape sequence");
+			return;
+		}
+
+		s->codepoint <<= 4;
+		if (isdigit((uint8_t) c)) {
+			s->codepoint |= c - '0';
+		} else {
+			s->codepoint |= tolower((uint8_t) c) - 'a' + 10;
+		}
+		if (s->escape++ < 5) return;
+		s->escape = 0;
+
+		if ((s->codepoint >= 0xd800) && (s->codepoint < 0xdc00)) {
+			if (s->high) json_stream_put_utf8(s, 0xfffd);
+			s->high = s->codepoint;
+			return;
+		}
+
+		if ((s->codepoint >= 0xdc00) && (s->codepoint < 0xe000)) {
+			if (!s->high) {
+				json_stream_put_utf8(s, 0xfffd);
+				return;
+			}
+			json_stream_put_utf8(s, 0x10000 + ((s->high - 0xd800) << 10) + (s->codepoint - 0xdc00));
+			s->high = 0;
+			return;
+		}
+
+		if (s->high) {
+			json_stream_put_utf8(s, 0xfffd);
+			s->high = 0;
+		}
+		json_stream_put_utf8(s, s->codepoint);
+		return;
+	}
+}
+
+/** Process a char within an array or object being read as text
+ *
+ */
+static void json_stream_text_char(json_stream_t *s, char c)
+{
+	if (!s->in_string && isspace((uint8_t) c)) return;
+
+	if (s->text) json_stream_putc(s->text, &s->text->value, &s->text->len, c);
+
+	if (s->in_string) {
+		if (s->text_escape) {
+			s->text_escape = false;
+		} else if (c == '\\') {
+			s->text_escape = true;
+		} else if (c == '"') {
+			s->in_string = false;
+		}
+		return;
+	}
+
+	switch (c) {
+	case '"':
+		s->in_string = true;
+		return;
+
+	case '{':
+	case '[':
+		if (s->depth >= JSON_STREAM_MAX_DEPTH) {
+			json_stream_error(s, "Maximum nesting depth exceeded");
+			return;
+		}
+		if (c == '{') {
+			s->objects |= ((uint64_t) 1 << s->depth);
+		} else {
+			s->objects &= ~((uint64_t) 1 << s->depth);
+		}
+		s->depth++;
+		return;
+
+	case '}':
+	case ']':
+		s->depth--;
+		if ((bool)((s->objects >> s->depth) & 0x01) != (c == '}')) {
+			json_stream_error(s, "Mismatched brackets");
+			return;
+		}
+		if (s->depth > 0) return;
+
+		s->token = JSON_STREAM_TOKEN_NONE;
+		json_stream_text(s);
+		return;
+
+	default:
+		return;
+	}
+}
+
+/** Feed response data into the streaming JSON decoder
+ *
+ * @param[in] s		Decoder state.
+ * @param[in] p		Start of data.
+ * @param[in] end	End of data.
+ */
+static void json_stream_feed(json_stream_t *s, char const *p, char const *end)
+{
+	while ((p < end) && (s->state != JSON_STREAM_ERROR)) {
+		char	c = *p;
+		bool	in_string = (s->token == JSON_STREAM_TOKEN_STRING) ||
+				    ((s->token == JSON_STREAM_TOKEN_TEXT) && s->in_string);
+		bool	copy = s->in_value_array;
+
+		switch (s->token) {
+		case JSON_STREAM_TOKEN_STRING:
+			json_stream_string(s, c);
+			break;
+
+		/*
+		 *	Numbers and literals end at the first char
+		 *	which can't be part of them, which is then
+		 *	processed as normal.
+		 */
+		case JSON_STREAM_TOKEN_NUMBER:
+			if (isdigit((uint8_t) c) || (c == '-') || (c == '+') || (c == '.') || (c == 'e') || (c == 'E')) {
+				json_stream_putc(s, &s->buff, &s->len, c);
+				break;
+			}
+			s->token = JSON_STREAM_TOKEN_NONE;
+			json_stream_scalar(s, strpbrk(s->buff, ".eE") ? JSON_STREAM_VALUE_DOUBLE : JSON_STREAM_VALUE_INT);
+			continue;
+
+		case JSON_STREAM_TOKEN_LITERAL:
+			if (isalpha((uint8_t) c)) {
+				json_stream_putc(s, &s->buff, &s->len, c);
+				break;
+			}
+			s->token = JSON_STREAM_TOKEN_NONE;
+			if ((strcmp(s->buff, "true") == 0) || (strcmp(s->buff, "false") == 0)) {
+				json_stream_scalar(s, JSON_STREAM_VALUE_BOOL);
+			} else if (strcmp(s->buff, "null") == 0) {
+				json_stream_scalar(s, JSON_STREAM_VALUE_NULL);
+			} else {
+				json_stream_error(s, "Invalid literal");
+			}
+			continue;
+
+		case JSON_STREAM_TOKEN_TEXT:
+			json_stream_text_char(s, c);
+			break;
+
+		case JSON_STREAM_TOKEN_NONE:
+			json_stream_structural(s, c);
+			break;
+		}
+
+		/*
+		 *	Expanded "value" arrays are also kept as
+		 *	text, in case "is_json" is set.
+		 */
+		if (copy && s->member && s->member->raw && (in_string || !isspace((uint8_t) c))) {
+			json_stream_putc(s->member->raw, &s->member->raw->value, &s->member->raw->len, c);
+		}
+		p++;
+	}
+}
+
+/** Allocate a streaming JSON decoder
+ *
+ */
+static json_stream_t *json_stream_alloc(TALLOC_CTX *ctx)
+{
+	json_stream_t *s;
+
+	MEM(s = talloc_zero(ctx, json_stream_t));
+	s->tail = &s->members;
+
+	return s;
+}
+
+/** Converts a value from the streaming decoder into a VALUE_PAIR
+ *
+ * The equivalent of #json_pair_alloc_leaf.
+ *
+ * @param[in] ctx	to allocate new VALUE_PAIRs in.
+ * @param[in] request	Current request.
+ * @param[in] da	Attribute to create.
+ * @param[in] flags	containing the operator other flags controlling value
+ *			expansion.
+ * @param[in] leaf	containing the VALUE_PAIR value.
+ * @return
+ *	- #VALUE_PAIR just created.
+ *	- NULL on error.
+ */
+static VALUE_PAIR *json_stream_pair_alloc_leaf(TALLOC_CTX *ctx, REQUEST *request,
+					       fr_dict_attr_t const *da, json_flags_t *flags,
+					       json_stream_value_t const *leaf)
+{
+	char			*expanded = NULL;
+	int 			ret;
+
+	VALUE_PAIR		*vp;
+
+	fr_value_box_t		src;
+
+	if (leaf->type == JSON_STREAM_VALUE_NULL) {
+		RDEBUG3("Got null value for attribute \"%s\" (skipping)", da->name);
+		return NULL;
+	}
+
+	MEM(vp = fr_pair_afrom_da(ctx, da));
+
+	memset(&src, 0, sizeof(src));
+
+	switch (leaf->type) {
+	case JSON_STREAM_VALUE_INT:
+		if (flags->do_xlat) RWDEBUG("Ignoring do_xlat on 'int', attribute \"%s\"", da->name);
+		fr_value_box_shallow(&src, (int64_t)strtoll(leaf->value, NULL, 10), true);
+		break;
+
+	case JSON_STREAM_VALUE_DOUBLE:
+		if (flags->do_xlat) RWDEBUG("Ignoring do_xlat on 'double', attribute \"%s\"", da->name);
+		fr_value_box_shallow(&src, strtod(leaf->value, NULL), true);
+		break;
+
+	case JSON_STREAM_VALUE_STRING:
+		if (flags->do_xlat && memchr(leaf->value, '%', leaf->len)) {
+			if (xlat_aeval(request, &expanded, request, leaf->value, NULL, NULL) < 0) {
+				talloc_free(vp);
+				return NULL;
+			}
+			fr_value_box_bstrndup_shallow(&src, NULL, expanded,
+						      talloc_array_length(expanded) - 1, true);
+		} else {
+			fr_value_box_bstrndup_shallow(&src, NULL, leaf->value, leaf->len, true);
+		}
+		break;
+
+	/*
+	 *	Booleans, and nested JSON structures
+	 *	are converted from their JSON text.
+	 */
+	default:
+		if (flags->do_xlat) RWDEBUG("Ignoring do_xlat on 'object', attribute \"%s\"", da->name);
+		fr_value_box_bstrndup_shallow(&src, NULL, leaf->value, leaf->len, true);
+		break;
+	}
+
+	ret = fr_value_box_cast(vp, &vp->data, da->type, da, &src);
+	talloc_free(expanded);
+	if (ret < 0) {
+		RWDEBUG("Failed parsing value for attribute \"%s\" (skipping)", da->name);
+		talloc_free(vp);
+		return NULL;
+	}
+
+	vp->op = flags->op;
+	vp->tag = flags->tag;
+
+	return vp;
+}
+
+/** Converts the members found by the streaming JSON decoder into VALUE_PAIRs
+ *
+ * The equivalent of #rest_decode_json, and follows the same rules as
+ * #json_pair_alloc.
+ *
+ * @param[in] request	Current request.
+ * @param[in] s		Decoder state, after the whole response body has been fed in.
+ * @param[in] max	Maximum number of VALUE_PAIRs to create.
+ * @return
+ *	- The number of #VALUE_PAIR processed.
+ *	- -1 on unrecoverable error.
+ */
+static int rest_decode_json_stream(REQUEST *request, json_stream_t *s, int max)
+{
+	int			max_attrs = max;
+	vp_tmpl_t		*dst = NULL;
+	json_stream_member_t	*m;
+
+	switch (s->state) {
+	case JSON_STREAM_ROOT:		/* Only whitespace */
+		return 0;
+
+	case JSON_STREAM_DONE:
+		break;
+
+	case JSON_STREAM_ERROR:
+		REDEBUG("Malformed JSON data: %s", s->error);
+		return -1;
+
+	default:
+		REDEBUG("Malformed JSON data: Response ended before the end of the object");
+		return -1;
+	}
+
+	for (m = s->members; m; m = m->next) {
+		int			i = 0;
+		json_stream_value_t	*element;
+		json_flags_t		flags = m->flags;
+		TALLOC_CTX		*ctx;
+		REQUEST			*current;
+		VALUE_PAIR		**vps, *vp;
+
+		TALLOC_FREE(dst);
+
+		if (json_pair_dst(&dst, &current, &vps, &ctx, request, m->name) < 0) continue;
+
+		flags.tag = tmpl_tag(dst);
+
+		if (m->bad_op) {
+			RWDEBUG("Invalid operator value \"%s\" (skipping)", m->bad_op);
+			continue;
+		}
+
+		if (m->expanded && !m->has_value) {
+			RWDEBUG("Value key missing (skipping)");
+			continue;
+		}
+
+		if (m->raw && (flags.is_json || !m->is_array)) {
+			element = m->raw;
+		} else {
+			element = m->values;
+			if (!element) {
+				RWDEBUG("Zero length value array (skipping)");
+				continue;
+			}
+		}
+
+		for (; element; element = element->next, i++) {
+			if (max_attrs-- <= 0) {
+				RWDEBUG("At maximum attribute limit");
+				talloc_free(dst);
+				return max;
+			}
+
+			/*
+			 *  Automagically switch the op for multivalued attributes.
+			 */
+			if (((flags.op == T_OP_SET) || (flags.op == T_OP_EQ)) && (i >= 1)) {
+				flags.op = T_OP_ADD;
+			}
+
+			if ((element->type == JSON_STREAM_VALUE_OBJECT) && !flags.is_json) {
+				RWDEBUG("Found nested VP, these are not yet supported (skipping)");
+				continue;
+			}
+
+			vp = json_stream_pair_alloc_leaf(ctx, request, tmpl_da(dst), &flags, element);
+			if (!vp) continue;
+
+			RINDENT();
+			RDEBUG2("&%s:%pP", fr_table_str_by_value(pair_list_table, tmpl_list(dst), ""), vp);
+			REXDENT();
+			radius_pairmove(current, vps, vp, false);
+		}
+	}
+
+	talloc_free(dst);
+
+	return max - max_attrs;
+}
 #endif
 
 /** Processes incoming HTTP header data from libcurl.
@@ -1503,6 +2495,40 @@ static size_t rest_response_body(void *in, size_t size, size_t nmemb, void *user
 	{
 		char *out_p;
 
+#ifdef HAVE_JSON
+		/*
+		 *  Decode JSON as it arrives, if the response
+		 *  will be decoded at all.  Other responses are
+		 *  buffered so they can be printed.
+		 */
+		if ((ctx->type == REST_HTTP_BODY_JSON) && ctx->section->stream_json &&
+		    (((ctx->code >= 200) && (ctx->code < 300)) || (ctx->code == 401))) {
+			if ((ctx->section->max_body_in > 0) && ((ctx->streamed + (end - p)) > ctx->section->max_body_in)) {
+				REDEBUG("Incoming data (%zu bytes) exceeds max_body_in (%zu bytes).  "
+					"Forcing body to type 'invalid'", ctx->streamed + (end - p),
+					ctx->section->max_body_in);
+				ctx->type = REST_HTTP_BODY_INVALID;
+				TALLOC_FREE(ctx->decoder);
+				break;
+			}
+
+			if (RDEBUG_ENABLED3) {
+				char const *r = p;
+
+				while ((q = memchr(r, '\n', (end - r)))) {
+					RDEBUG3("%pV", fr_box_strvalue_len(r, q - r));
+					r = q + 1;
+				}
+				if (r != end) RDEBUG3("%pV", fr_box_strvalue_len(r, end - r));
+			}
+
+			if (!ctx->decoder) ctx->decoder = json_stream_alloc(NULL);
+			json_stream_feed(ctx->decoder, p, end);
+			ctx->streamed += (end - p);
+			break;
+		}
+#endif
+
 		if ((ctx->section->max_body_in > 0) && ((ctx->used + (end - p)) > ctx->section->max_body_in)) {
 			REDEBUG("Incoming data (%zu bytes) exceeds max_body_in (%zu bytes).  "
 				"Forcing body to type 'invalid'", ctx->used + (end - p), ctx->section->max_body_in);
@@ -1602,7 +2628,9 @@ static void rest_response_init(rlm_rest_section_t const *section,
 	ctx->state = WRITE_STATE_INIT;
 	ctx->alloc = 0;
 	ctx->used = 0;
+	ctx->streamed = 0;
 	TALLOC_FREE(ctx->buffer);
+	TALLOC_FREE(ctx->decoder);
 }
 
 /** Extracts pointer to buffer containing response data
@@ -2065,6 +3093,12 @@ int rest_response_decode(rlm_rest_t const *instance, rlm_rest_section_t const *s
 
 	int ret = -1;	/* -Wsometimes-uninitialized */
 
+#ifdef HAVE_JSON
+	if ((ctx->response.type == REST_HTTP_BODY_JSON) && ctx->response.decoder) {
+		return rest_decode_json_stream(request, ctx->response.decoder, REST_BODY_MAX_ATTRS);
+	}
+#endif
+
 	if (!ctx->response.buffer) {
 		RDEBUG2("Skipping attribute processing, no valid body data received");
 		return 0;
@@ -138,6 +138,8 @@ typedef struct {
 	fr_time_delta_t		timeout;	//!< Timeout timeval.
 	uint32_t		chunk;		//!< Max chunk-size (mainly for testing the encoders)
 	size_t			max_body_in;	//!< Maximum size of incoming data.
+	bool			stream_json;	//!< Decode JSON responses as they arrive, instead
+						//!< of buffering the whole body.
 
 	fr_curl_tls_t		tls;
 } rlm_rest_section_t;
@@ -153,8 +155,8 @@ typedef struct {
 	int			http_negotiation; //!< What HTTP version to negotiate, and how to
 						///< negotiate it.  One or the CURL_HTTP_VERSION_ macros.
 
-	bool			multiplex;	//!< Whether to perform multiple requests using a single
-						///< connection.
+	fr_curl_conn_config_t	conn_config;	//!< Whether to perform multiple requests using a single
+						///< connection, and how many connections to open.
 
 	fr_pool_t		*pool;		//!< Pointer to the connection pool.
 
@@ -239,6 +241,7 @@ typedef struct {
 	char 			*buffer;	//!< Raw incoming HTTP data.
 	size_t		 	alloc;		//!< Space allocated for buffer.
 	size_t		 	used;		//!< Space used in buffer.
+	size_t			streamed;	//!< Amount of data passed to the streaming decoder.
 
 	int		 	code;		//!< HTTP Status Code.
 	http_body_type_t	type;		//!< HTTP Content Type.
@@ -78,6 +78,9 @@ static const CONF_PARSER section_config[] = {
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_rest_section_t, timeout), .dflt = "4.0" },
 	{ FR_CONF_OFFSET("chunk", FR_TYPE_UINT32, rlm_rest_section_t, chunk), .dflt = "0" },
 	{ FR_CONF_OFFSET("max_body_in", FR_TYPE_SIZE, rlm_rest_section_t, max_body_in), .dflt = "16k" },
+#ifdef HAVE_JSON
+	{ FR_CONF_OFFSET("stream_json", FR_TYPE_BOOL, rlm_rest_section_t, stream_json), .dflt = "no" },
+#endif
 
 	/* TLS Parameters */
 	{ FR_CONF_OFFSET("tls", FR_TYPE_SUBSECTION, rlm_rest_section_t, tls), .subcs = (void const *) fr_curl_tls_config },
@@ -110,8 +113,13 @@ static const CONF_PARSER module_config[] = {
 	  .func = cf_table_parse_int, .uctx = &(cf_table_parse_ctx_t){ .table = http_negotiation_table, .len = &http_negotiation_table_len }, .dflt = "default" },
 
 #ifdef CURLPIPE_MULTIPLEX
-	{ FR_CONF_OFFSET("multiplex", FR_TYPE_BOOL, rlm_rest_t, multiplex), .dflt = "yes" },
+	{ FR_CONF_OFFSET("multiplex", FR_TYPE_BOOL, rlm_rest_t, conn_config.multiplex), .dflt = "yes" },
 #endif
+#if CURL_AT_LEAST_VERSION(7,67,0)
+	{ FR_CONF_OFFSET("max_concurrent_streams", FR_TYPE_UINT32, rlm_rest_t, conn_config.max_concurrent_streams), .dflt = "0" },
+#endif
+	{ FR_CONF_OFFSET("max_host_connections", FR_TYPE_UINT32, rlm_rest_t, conn_config.max_host_connections), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_total_connections", FR_TYPE_UINT32, rlm_rest_t, conn_config.max_total_connections), .dflt = "0" },
 
 #ifndef NDEBUG
 	{ FR_CONF_OFFSET("fail_header_decode", FR_TYPE_BOOL, rlm_rest_t, fail_header_decode), .dflt = "no" },
@@ -424,6 +432,56 @@ static xlat_action_t rest_xlat(TALLOC_CTX *ctx, UNUSED fr_cursor_t *out,
 	return unlang_xlat_yield(request, rest_xlat_resume, rest_io_xlat_signal, rctx);
 }
 
+/** Return one of this thread's connection counters
+ *
+ * Example:
+@verbatim
+%{rest_stats:(requests|connects|reused|tls_handshakes)}
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t rest_stats_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
+				     REQUEST *request, UNUSED void const *xlat_inst, void *xlat_thread_inst,
+				     fr_value_box_t **in)
+{
+	rest_xlat_thread_inst_t		*xti = talloc_get_type_abort(xlat_thread_inst, rest_xlat_thread_inst_t);
+	fr_curl_io_stats_t const	*stats = &xti->t->mhandle->stats;
+	char const			*name;
+	uint64_t			value;
+	fr_value_box_t			*vb;
+
+	if (!*in) {
+		REDEBUG("Missing counter name");
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
+		RPEDEBUG("Failed concatenating input");
+		return XLAT_ACTION_FAIL;
+	}
+	name = (*in)->vb_strvalue;
+
+	if (strcmp(name, "requests") == 0) {
+		value = stats->requests;
+	} else if (strcmp(name, "connects") == 0) {
+		value = stats->connects;
+	} else if (strcmp(name, "reused") == 0) {
+		value = stats->reused;
+	} else if (strcmp(name, "tls_handshakes") == 0) {
+		value = stats->tls_handshakes;
+	} else {
+		REDEBUG("Unknown counter \"%s\"", name);
+		return XLAT_ACTION_FAIL;
+	}
+
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT64, NULL, false));
+	vb->vb_uint64 = value;
+	fr_cursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
+}
+
 static rlm_rcode_t mod_authorize_result(module_ctx_t const *mctx, REQUEST *request, void *rctx)
 {
 	rlm_rest_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_rest_t);
@@ -1042,7 +1100,7 @@ static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_e
 		return -1;
 	}
 
-	mhandle = fr_curl_io_init(t, el, inst->multiplex);
+	mhandle = fr_curl_io_init(t, el, &inst->conn_config);
 	if (!mhandle) return -1;
 
 	t->mhandle = mhandle;
@@ -1110,14 +1168,24 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
-	rlm_rest_t *inst = instance;
-	xlat_t const *xlat;
+	rlm_rest_t	*inst = instance;
+	xlat_t const	*xlat;
+	char		*name;
 
 	inst->xlat_name = cf_section_name2(conf);
 	if (!inst->xlat_name) inst->xlat_name = cf_section_name1(conf);
 
 	xlat = xlat_async_register(inst, inst->xlat_name, rest_xlat);
 	xlat_async_thread_instantiate_set(xlat, mod_xlat_thread_instantiate, rest_xlat_thread_inst_t, NULL, inst);
+	xlat_async_yields_set(xlat);
+
+	/*
+	 *	%{rest_stats:<counter>}
+	 */
+	name = talloc_asprintf(NULL, "%s_stats", inst->xlat_name);
+	xlat = xlat_async_register(inst, name, rest_stats_xlat);
+	xlat_async_thread_instantiate_set(xlat, mod_xlat_thread_instantiate, rest_xlat_thread_inst_t, NULL, inst);
+	talloc_free(name);
 
 	return 0;
 }
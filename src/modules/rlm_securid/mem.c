@@ -24,10 +24,35 @@
 #include <stdio.h>
 #include "rlm_securid.h"
 
-static void securid_sessionlist_clean_expired(rlm_securid_t *inst, REQUEST *request, time_t timestamp);
+static void securid_sessionlist_clean_expired(rlm_securid_t *inst, securid_shard_t *shard,
+					      REQUEST *request, time_t timestamp);
 
-static SECURID_SESSION* securid_sessionlist_delete(rlm_securid_t *inst,
-						   SECURID_SESSION *session);
+static SECURID_SESSION* securid_sessionlist_delete(securid_shard_t *shard, SECURID_SESSION *session);
+
+/* comparison function to find session in the tree */
+static int securid_session_cmp(void const *a, void const *b)
+{
+	int rcode;
+	SECURID_SESSION const *one = a;
+	SECURID_SESSION const *two = b;
+
+	fr_assert(one != NULL);
+	fr_assert(two != NULL);
+
+	rcode = fr_ipaddr_cmp(&one->src_ipaddr, &two->src_ipaddr);
+	if (rcode != 0) return rcode;
+
+	return memcmp(one->state, two->state, sizeof(one->state));
+}
+
+/*
+ *	Sessions are assigned to shards by their State, which is
+ *	all we have when the next packet in the conversation arrives.
+ */
+static inline securid_shard_t *securid_shard(rlm_securid_t *inst, char const state[SECURID_STATE_LEN])
+{
+	return &inst->shards[fr_hash(state, SECURID_STATE_LEN) & (SECURID_SESSION_SHARDS - 1)];
+}
 
 SECURID_SESSION* securid_session_alloc(void)
 {
@@ -44,8 +69,8 @@ void securid_session_free(UNUSED rlm_securid_t *inst,REQUEST *request,
 {
 	if (!session) return;
 
-	RDEBUG2("Freeing session id=%d identity='%s' state='%s'", session->session_id,
-		SAFE_STR(session->identity), session->state);
+	ROPTIONAL(RDEBUG2, DEBUG2, "Freeing session id=%d identity='%s' state='%s'", session->session_id,
+		  SAFE_STR(session->identity), session->state);
 
 	if (session->sdiHandle != SDI_HANDLE_NONE) {
 		SD_Close(session->sdiHandle);
@@ -55,21 +80,61 @@ void securid_session_free(UNUSED rlm_securid_t *inst,REQUEST *request,
 	talloc_free(session);
 }
 
+/*
+ *	Create the shards.  The per-shard session limit is
+ *	max_sessions divided between them, rounded up.
+ */
+int securid_sessionlist_init(rlm_securid_t *inst)
+{
+	int i;
+
+	for (i = 0; i < SECURID_SESSION_SHARDS; i++) {
+		securid_shard_t *shard = &inst->shards[i];
+
+		/*
+		 *	Lookup sessions in the tree.  We don't free them in
+		 *	the tree, as that's taken care of elsewhere...
+		 */
+		shard->tree = rbtree_talloc_alloc(NULL, securid_session_cmp, SECURID_SESSION, NULL, 0);
+		if (!shard->tree) {
+			while (--i >= 0) {
+				TALLOC_FREE(inst->shards[i].tree);
+				pthread_mutex_destroy(&inst->shards[i].mutex);
+			}
+			return -1;
+		}
+		shard->head = shard->tail = NULL;
+		shard->max_sessions = (inst->max_sessions + SECURID_SESSION_SHARDS - 1) / SECURID_SESSION_SHARDS;
+
+		pthread_mutex_init(&shard->mutex, NULL);
+	}
 
-void securid_sessionlist_free(rlm_securid_t *inst,REQUEST *request)
+	return 0;
+}
+
+void securid_sessionlist_free(rlm_securid_t *inst, REQUEST *request)
 {
 	SECURID_SESSION *node, *next;
+	int i;
 
-	pthread_mutex_lock(&(inst->session_mutex));
+	for (i = 0; i < SECURID_SESSION_SHARDS; i++) {
+		securid_shard_t *shard = &inst->shards[i];
 
-	for (node = inst->session_head; node != NULL; node = next) {
-		next = node->next;
-		securid_session_free(inst,request,node);
-	}
+		if (!shard->tree) continue;
 
-	inst->session_head = inst->session_tail = NULL;
+		pthread_mutex_lock(&shard->mutex);
 
-	pthread_mutex_unlock(&(inst->session_mutex));
+		for (node = shard->head; node != NULL; node = next) {
+			next = node->next;
+			securid_session_free(inst,request,node);
+		}
+
+		shard->head = shard->tail = NULL;
+		TALLOC_FREE(shard->tree);
+
+		pthread_mutex_unlock(&shard->mutex);
+		pthread_mutex_destroy(&shard->mutex);
+	}
 }
 
 
@@ -84,6 +149,7 @@ int securid_sessionlist_add(rlm_securid_t *inst,REQUEST *request, SECURID_SESSIO
 {
 	int		status = 0;
 	VALUE_PAIR	*state;
+	securid_shard_t	*shard;
 
 	/*
 	 *	The time at which this request was made was the time
@@ -93,29 +159,31 @@ int securid_sessionlist_add(rlm_securid_t *inst,REQUEST *request, SECURID_SESSIO
 
 	session->src_ipaddr = request->packet->src_ipaddr;
 
+	if (session->session_id == 0) {
+		/* this is a NEW session (we are not inserting an updated session) */
+		session->session_id = atomic_fetch_add_explicit(&inst->last_session_id, 1, memory_order_relaxed) + 1;
+		RDEBUG2("Creating a new session with id=%d\n",session->session_id);
+	}
+
+	memset(session->state, 0, sizeof(session->state));
+	snprintf(session->state,sizeof(session->state)-1,"FRR-CH %d|%d",session->session_id,session->trips+1);
+
+	shard = securid_shard(inst, session->state);
+
 	/*
 	 *	Playing with a data structure shared among threads
 	 *	means that we need a lock, to avoid conflict.
 	 */
-	pthread_mutex_lock(&(inst->session_mutex));
+	pthread_mutex_lock(&shard->mutex);
 
 	/*
 	 *	If we have a DoS attack, discard new sessions.
 	 */
-	if (rbtree_num_elements(inst->session_tree) >= inst->max_sessions) {
-		securid_sessionlist_clean_expired(inst, request, session->timestamp);
+	if (rbtree_num_elements(shard->tree) >= shard->max_sessions) {
+		securid_sessionlist_clean_expired(inst, shard, request, session->timestamp);
 		goto done;
 	}
 
-	if (session->session_id == 0) {
-		/* this is a NEW session (we are not inserting an updated session) */
-		inst->last_session_id++;
-		session->session_id = inst->last_session_id;
-		RDEBUG2("Creating a new session with id=%d\n",session->session_id);
-	}
-
-	memset(session->state, 0, sizeof(session->state));
-	snprintf(session->state,sizeof(session->state)-1,"FRR-CH %d|%d",session->session_id,session->trips+1);
 	RDEBUG2("Inserting session id=%d identity='%s' state='%s' to the session list",
 		session->session_id,SAFE_STR(session->identity),session->state);
 
@@ -125,24 +193,24 @@ int securid_sessionlist_add(rlm_securid_t *inst,REQUEST *request, SECURID_SESSIO
 	 *	the list.
 	 */
 	MEM(pair_update_reply(&state, attr_state) >= 0);
-	fr_pair_value_memdup(state, session->state, sizeof(session->state), true);
+	fr_pair_value_memdup(state, (uint8_t const *) session->state, sizeof(session->state), true);
 
-	status = rbtree_insert(inst->session_tree, session);
+	status = rbtree_insert(shard->tree, session);
 	if (status) {
 		/* tree insert SUCCESS */
 		/* insert the session to the linked list of sessions */
 		SECURID_SESSION *prev;
 
-		prev = inst->session_tail;
+		prev = shard->tail;
 		if (prev) {
 			/* insert to the tail of the list */
 			prev->next = session;
 			session->prev = prev;
 			session->next = NULL;
-			inst->session_tail = session;
+			shard->tail = session;
 		} else {
 			/* 1st time */
-			inst->session_head = inst->session_tail = session;
+			shard->head = shard->tail = session;
 			session->next = session->prev = NULL;
 		}
 	}
@@ -152,10 +220,10 @@ int securid_sessionlist_add(rlm_securid_t *inst,REQUEST *request, SECURID_SESSIO
 	 *	unlock it.
 	 */
  done:
-	pthread_mutex_unlock(&(inst->session_mutex));
+	pthread_mutex_unlock(&shard->mutex);
 
 	if (!status) {
-		fr_pair_list_free(&state);
+		pair_delete_reply(attr_state);
 		ERROR("Failed to store session");
 		return -1;
 	}
@@ -174,11 +242,7 @@ SECURID_SESSION *securid_sessionlist_find(rlm_securid_t *inst, REQUEST *request)
 	VALUE_PAIR	*state;
 	SECURID_SESSION* session;
 	SECURID_SESSION mySession;
-
-	/* clean expired sessions if any */
-	pthread_mutex_lock(&(inst->session_mutex));
-	securid_sessionlist_clean_expired(inst, request, fr_time_to_sec(request->packet->timestamp));
-	pthread_mutex_unlock(&(inst->session_mutex));
+	securid_shard_t	*shard;
 
 	/*
 	 *	We key the sessions off of the 'state' attribute
@@ -195,15 +259,21 @@ SECURID_SESSION *securid_sessionlist_find(rlm_securid_t *inst, REQUEST *request)
 
 	memset(&mySession,0,sizeof(mySession));
 	mySession.src_ipaddr = request->packet->src_ipaddr;
-	memcpy(mySession.state, state->vp_strvalue, sizeof(mySession.state));
+	memcpy(mySession.state, state->vp_octets, sizeof(mySession.state));
+
+	shard = securid_shard(inst, mySession.state);
 
 	/*
 	 *	Playing with a data structure shared among threads
 	 *	means that we need a lock, to avoid conflict.
+	 *
+	 *	Expired sessions are cleaned from this shard only,
+	 *	the others are cleaned as they're used.
 	 */
-	pthread_mutex_lock(&(inst->session_mutex));
-	session = securid_sessionlist_delete(inst, &mySession);
-	pthread_mutex_unlock(&(inst->session_mutex));
+	pthread_mutex_lock(&shard->mutex);
+	securid_sessionlist_clean_expired(inst, shard, request, fr_time_to_sec(request->packet->timestamp));
+	session = securid_sessionlist_delete(shard, &mySession);
+	pthread_mutex_unlock(&shard->mutex);
 
 	/*
 	 *	Might not have been there.
@@ -227,19 +297,19 @@ SECURID_SESSION *securid_sessionlist_find(rlm_securid_t *inst, REQUEST *request)
 
 
 /************ private functions *************/
-static SECURID_SESSION *securid_sessionlist_delete(rlm_securid_t *inst, SECURID_SESSION *session)
+static SECURID_SESSION *securid_sessionlist_delete(securid_shard_t *shard, SECURID_SESSION *session)
 {
 	rbnode_t *node;
 
-	node = rbtree_find(inst->session_tree, session);
+	node = rbtree_find(shard->tree, session);
 	if (!node) return NULL;
 
-	session = rbtree_node2data(inst->session_tree, node);
+	session = rbtree_node2data(shard->tree, node);
 
 	/*
 	 *	Delete old session from the tree.
 	 */
-	rbtree_delete(inst->session_tree, node);
+	rbtree_delete(shard->tree, node);
 
 	/*
 	 *	And unsplice it from the linked list.
@@ -247,12 +317,12 @@ static SECURID_SESSION *securid_sessionlist_delete(rlm_securid_t *inst, SECURID_
 	if (session->prev) {
 		session->prev->next = session->next;
 	} else {
-		inst->session_head = session->next;
+		shard->head = session->next;
 	}
 	if (session->next) {
 		session->next->prev = session->prev;
 	} else {
-		inst->session_tail = session->prev;
+		shard->tail = session->prev;
 	}
 	session->prev = session->next = NULL;
 
@@ -260,34 +330,35 @@ static SECURID_SESSION *securid_sessionlist_delete(rlm_securid_t *inst, SECURID_
 }
 
 
-static void securid_sessionlist_clean_expired(rlm_securid_t *inst, REQUEST *request, time_t timestamp)
+static void securid_sessionlist_clean_expired(rlm_securid_t *inst, securid_shard_t *shard,
+					      REQUEST *request, time_t timestamp)
 {
 	int num_sessions;
 	SECURID_SESSION *session;
 
-	num_sessions = rbtree_num_elements(inst->session_tree);
-	RDEBUG2("There are %d sessions in the tree\n",num_sessions);
+	num_sessions = rbtree_num_elements(shard->tree);
+	RDEBUG2("There are %d sessions in the shard\n",num_sessions);
 
 	/*
 	 *	Delete old sessions from the list
 	 *
 	 */
-	while((session = inst->session_head)) {
+	while((session = shard->head)) {
 		if ((timestamp - session->timestamp) > inst->timer_limit) {
 			rbnode_t *node;
-			node = rbtree_find(inst->session_tree, session);
+			node = rbtree_find(shard->tree, session);
 			fr_assert(node != NULL);
-			rbtree_delete(inst->session_tree, node);
+			rbtree_delete(shard->tree, node);
 
 			/*
-			 *	session == inst->session_head
+			 *	session == shard->head
 			 */
-			inst->session_head = session->next;
+			shard->head = session->next;
 			if (session->next) {
 				session->next->prev = NULL;
 			} else {
-				inst->session_head = NULL;
-				inst->session_tail = NULL;
+				shard->head = NULL;
+				shard->tail = NULL;
 			}
 
 			RDEBUG2("Cleaning expired session: identity='%s' state='%s'\n",
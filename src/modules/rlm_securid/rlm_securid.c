@@ -24,10 +24,12 @@
  * @copyright 2012 The FreeRADIUS server project
  * @copyright 2012 Alan DeKok (aland@networkradius.com)
  */
-#define "rlm_securid - "
+#define LOG_PREFIX "rlm_securid - "
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/offload.h>
+#include <freeradius-devel/unlang/base.h>
 #include <ctype.h>
 
 #include "rlm_securid.h"
@@ -40,12 +42,43 @@ typedef enum {
 	RC_SECURID_AUTH_CHALLENGE = -17
 } SECURID_AUTH_RC;
 
+/** Per-worker state
+ *
+ */
+typedef struct {
+	fr_offload_thread_t	*offload;		//!< Where completed jobs are returned, NULL if disabled.
+} rlm_securid_thread_t;
+
+/** One round of a SecurID conversation, performed by an offload thread
+ *
+ * The offload thread only makes ACE calls, and updates the plain
+ * fields of the session.  It never touches the request, the session
+ * store, or talloc.
+ */
+typedef struct {
+	fr_offload_job_t	job;			//!< Must be first.
+
+	rlm_securid_t		*inst;			//!< Instance data.
+
+	SECURID_SESSION		*session;		//!< Session being continued, or a new one.
+	bool			found;			//!< Session was found in the session store.
+
+	char			*username;		//!< Copy of the User-Name.
+	char			*passcode;		//!< Copy of the User-Password.
+
+	char			new_pin[10];		//!< System generated PIN.
+	char const		*save_pin;		//!< PIN to store in the session, if any.
+
+	SECURID_AUTH_RC		rc;			//!< Result of the ACE calls.
+	char			reply[FR_MAX_STRING_LEN];	//!< Reply-Message to send.
+} securid_job_t;
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("timer_expire", FR_TYPE_UINT32, rlm_securid_t, timer_limit), .dflt = "600" },
 	{ FR_CONF_OFFSET("max_sessions", FR_TYPE_UINT32, rlm_securid_t, max_sessions), .dflt = "2048" },
 	{ FR_CONF_OFFSET("max_trips_per_session", FR_TYPE_UINT32, rlm_securid_t, max_trips_per_session) },
 	{ FR_CONF_OFFSET("max_round_trips", FR_TYPE_UINT32, rlm_securid_t, max_trips_per_session), .dflt = "6" },
+	{ FR_CONF_OFFSET("offload", FR_TYPE_SUBSECTION, rlm_securid_t, offload_conf), .subcs = (void const *) fr_offload_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -75,97 +108,74 @@ fr_dict_attr_autoload_t mem_dict_attr[] = {
 
 static SD_CHAR empty_pin[] = "";
 
-/* comparison function to find session in the tree */
-static int securid_session_cmp(void const *a, void const *b)
-{
-	int rcode;
-	SECURID_SESSION const *one = a;
-	SECURID_SESSION const *two = b;
-
-	fr_assert(one != NULL);
-	fr_assert(two != NULL);
-
-	rcode = fr_ipaddr_cmp(&one->src_ipaddr, &two->src_ipaddr);
-	if (rcode != 0) return rcode;
-
-	return memcmp(one->state, two->state, sizeof(one->state));
-}
-
-
-static SECURID_AUTH_RC securidAuth(void *instance, REQUEST *request,
-				   char const *username,
-				   char const *passcode,
-				   char *replyMsgBuffer, size_t replyMsgBufferSize)
+/** Make the ACE calls for one round of a SecurID conversation
+ *
+ * Called from an offload thread, or inline if offloading is disabled
+ * or the pool is full.  Does not log against the request, or
+ * allocate memory.
+ */
+static void securid_job_run(void *to_run, UNUSED void *thread_ctx, UNUSED void *uctx)
 {
-	rlm_securid_t *inst = (rlm_securid_t *) instance;
+	securid_job_t *job = to_run;
+	char const *username = job->username;
+	char const *passcode = job->passcode;
+	char *replyMsgBuffer = job->reply;
+	size_t replyMsgBufferSize = sizeof(job->reply);
+	SECURID_SESSION *securid_session = job->session;
 	int acm_ret;
 	SD_PIN pin_params;
-	char new_pin[10];
 	char format[30];
-	SECURID_SESSION *securid_session = NULL;
-	int rc = -1;
 
 	SD_CHAR *securid_user, *securid_pass;
 
-	if (!username) {
-		ERROR("SecurID username is NULL");
-		return RC_SECURID_AUTH_FAILURE;
-	}
-
-	if (!passcode) {
-		ERROR("SecurID passcode is NULL for %s user", username);
-		return RC_SECURID_AUTH_FAILURE;
-	}
-
 	memcpy(&securid_user, &username, sizeof(securid_user));
 	memcpy(&securid_pass, &passcode, sizeof(securid_pass));
 
 	*replyMsgBuffer = '\0';
+	job->rc = RC_SECURID_AUTH_FAILURE;
 
-	securid_session = securid_sessionlist_find(inst, request);
-	if (!securid_session) {
+	if (!job->found) {
 		/* securid session not found */
 		SDI_HANDLE sdiHandle = SDI_HANDLE_NONE;
 
 		acm_ret = SD_Init(&sdiHandle);
 		if (acm_ret != ACM_OK) {
-			RERROR("Cannot communicate with the ACE/Server");
-			return -1;
+			ERROR("Cannot communicate with the ACE/Server");
+			job->rc = -1;
+			goto finish;
 		}
+		securid_session->sdiHandle = sdiHandle; /* save ACE handle for future use */
 
 		acm_ret = SD_Lock(sdiHandle, securid_user);
 		if (acm_ret != ACM_OK) {
-			REDEBUG("SecurID: Access denied. Name [%s] lock failed", username);
-			return -2;
+			DEBUG("SecurID: Access denied. Name [%s] lock failed", username);
+			job->rc = -2;
+			goto finish;
 		}
 
 		acm_ret = SD_Check(sdiHandle, securid_pass, securid_user);
 		switch (acm_ret) {
 		case ACM_OK:
 			/* we are in now */
-			RDEBUG2("SecurID authentication successful for %s", username);
-			SD_Close(sdiHandle);
-
-			return RC_SECURID_AUTH_SUCCESS;
+			DEBUG2("SecurID authentication successful for %s", username);
+			job->rc = RC_SECURID_AUTH_SUCCESS;
+			break;
 
 		case ACM_ACCESS_DENIED:
 			/* not this time */
-			RDEBUG2("SecurID Access denied for %s", username);
-			SD_Close(sdiHandle);
-			return RC_SECURID_AUTH_ACCESS_DENIED_FAILURE;
+			DEBUG2("SecurID Access denied for %s", username);
+			job->rc = RC_SECURID_AUTH_ACCESS_DENIED_FAILURE;
+			break;
 
 		case ACM_INVALID_SERVER:
-			RERROR("SecurID: Invalid ACE server");
-			return RC_SECURID_AUTH_INVALID_SERVER_FAILURE;
+			ERROR("SecurID: Invalid ACE server");
+			job->rc = RC_SECURID_AUTH_INVALID_SERVER_FAILURE;
+			break;
 
 		case ACM_NEW_PIN_REQUIRED:
-			RDEBUG2("SecurID new pin required for %s", username);
+			DEBUG2("SecurID new pin required for %s", username);
 
-			/* create a new session */
-			securid_session = securid_session_alloc();
-			securid_session->sdiHandle = sdiHandle; /* save ACE handle for future use */
 			securid_session->securidSessionState = NEW_PIN_REQUIRED_STATE;
-			securid_session->identity = talloc_typed_strdup(securid_session, username);
 
 			/* Get PIN requirements */
 			acm_ret = AceGetPinParams(sdiHandle, &pin_params);
@@ -193,285 +203,298 @@ static SECURID_AUTH_RC securidAuth(void *instance, REQUEST *request,
 					 pin_params.Min, pin_params.Max, format);
 			}
 
-			/* insert new session in the session list */
-			securid_sessionlist_add(inst, request, securid_session);
-
-			return RC_SECURID_AUTH_CHALLENGE;
+			job->rc = RC_SECURID_AUTH_CHALLENGE;
+			break;
 
 		case ACM_NEXT_CODE_REQUIRED:
-			RDEBUG2("Next securid token code required for %s",
-				username);
+			DEBUG2("Next securid token code required for %s",
+			       username);
 
-			/* create a new session */
-			securid_session = securid_session_alloc();
-			securid_session->sdiHandle = sdiHandle;
 			securid_session->securidSessionState = NEXT_CODE_REQUIRED_STATE;
-			securid_session->identity = talloc_typed_strdup(securid_session, username);
-
-			/* insert new session in the session list */
-			securid_sessionlist_add(inst, request, securid_session);
 
 			strlcpy(replyMsgBuffer, "\r\nPlease Enter the Next Code from Your Token:", replyMsgBufferSize);
-			return RC_SECURID_AUTH_CHALLENGE;
+			job->rc = RC_SECURID_AUTH_CHALLENGE;
+			break;
 
 		default:
 			ERROR("SecurID: Unexpected error from ACE/Agent API acm_ret=%d", acm_ret);
-			securid_session_free(inst, request, securid_session);
-			return RC_SECURID_AUTH_FAILURE;
-
-
+			job->rc = RC_SECURID_AUTH_FAILURE;
+			break;
 		}
-	} else {
-		/* existing session found */
-		RDEBUG2("Continuing previous session found for user [%s]", username);
-
-		/* continue previous session */
-		switch (securid_session->securidSessionState) {
-		case NEXT_CODE_REQUIRED_STATE:
-			DEBUG2("Securid NEXT_CODE_REQUIRED_STATE: User [%s]", username);
-			/* next token code mode */
-
-			acm_ret = SD_Next(securid_session->sdiHandle, securid_pass);
-			if (acm_ret == ACM_OK) {
-				INFO("Next SecurID token accepted for [%s].", securid_session->identity);
-				rc = RC_SECURID_AUTH_SUCCESS;
-
-			} else {
-				INFO("SecurID: Next token rejected for [%s].", securid_session->identity);
-				rc = RC_SECURID_AUTH_FAILURE;
-			}
-
-			/* deallocate session */
-			securid_session_free(inst, request, securid_session);
-			return rc;
-
-		case NEW_PIN_REQUIRED_STATE:
-			RDEBUG2("SecurID NEW_PIN_REQUIRED_STATE for %s",
-				username);
+		goto finish;
+	}
 
-			/* save the previous pin */
-			if (securid_session->pin) TALLOC_FREE(securid_session->pin);
-			securid_session->pin = talloc_typed_strdup(securid_session, passcode);
+	/* existing session found */
+	DEBUG2("Continuing previous session found for user [%s]", username);
 
-			strlcpy(replyMsgBuffer, "\r\n		 Please re-enter new PIN:", replyMsgBufferSize);
+	/* continue previous session */
+	switch (securid_session->securidSessionState) {
+	case NEXT_CODE_REQUIRED_STATE:
+		DEBUG2("Securid NEXT_CODE_REQUIRED_STATE: User [%s]", username);
+		/* next token code mode */
 
-			/* set next state */
-			securid_session->securidSessionState = NEW_PIN_USER_CONFIRM_STATE;
+		acm_ret = SD_Next(securid_session->sdiHandle, securid_pass);
+		if (acm_ret == ACM_OK) {
+			INFO("Next SecurID token accepted for [%s].", securid_session->identity);
+			job->rc = RC_SECURID_AUTH_SUCCESS;
 
-			/* insert the updated session in the session list */
-			securid_sessionlist_add(inst, request, securid_session);
-			return RC_SECURID_AUTH_CHALLENGE;
+		} else {
+			INFO("SecurID: Next token rejected for [%s].", securid_session->identity);
+			job->rc = RC_SECURID_AUTH_FAILURE;
+		}
+		break;
 
-		case NEW_PIN_USER_CONFIRM_STATE:
-			RDEBUG2("SecurID NEW_PIN_USER_CONFIRM_STATE: User [%s]", username);
-			/* compare previous pin and current pin */
-			if (!securid_session->pin || strcmp(securid_session->pin, passcode)) {
-				RDEBUG2("Pin confirmation failed. Pins do not match [%s] and [%s]",
-				       SAFE_STR(securid_session->pin), securid_pass);
-				/* pins do not match */
+	case NEW_PIN_REQUIRED_STATE:
+		DEBUG2("SecurID NEW_PIN_REQUIRED_STATE for %s",
+		       username);
 
-				/* challenge the user again */
-				AceGetPinParams(securid_session->sdiHandle, &pin_params);
-				if (pin_params.Alphanumeric) {
-					strcpy(format, "alphanumeric characters");
-				} else {
-					strcpy(format, "digits");
-				}
-				snprintf(replyMsgBuffer, replyMsgBufferSize,
-					 " \r\n   Pins do not match--Please try again.\r\n   Enter your new PIN of %d to %d %s, \r\n		or\r\n   <Ctrl-D> to cancel the New PIN procedure:",
-					 pin_params.Min, pin_params.Max, format);
+		/* save the previous pin */
+		job->save_pin = passcode;
 
-				securid_session->securidSessionState = NEW_PIN_REQUIRED_STATE;
+		strlcpy(replyMsgBuffer, "\r\n		 Please re-enter new PIN:", replyMsgBufferSize);
 
-				/* insert the updated session in the session list */
-				securid_sessionlist_add(inst, request, securid_session);
-				rc = RC_SECURID_AUTH_CHALLENGE;
+		/* set next state */
+		securid_session->securidSessionState = NEW_PIN_USER_CONFIRM_STATE;
+		job->rc = RC_SECURID_AUTH_CHALLENGE;
+		break;
 
+	case NEW_PIN_USER_CONFIRM_STATE:
+		DEBUG2("SecurID NEW_PIN_USER_CONFIRM_STATE: User [%s]", username);
+		/* compare previous pin and current pin */
+		if (!securid_session->pin || strcmp(securid_session->pin, passcode)) {
+			DEBUG2("Pin confirmation failed. Pins do not match [%s] and [%s]",
+			       SAFE_STR(securid_session->pin), securid_pass);
+			/* pins do not match */
+
+			/* challenge the user again */
+			AceGetPinParams(securid_session->sdiHandle, &pin_params);
+			if (pin_params.Alphanumeric) {
+				strcpy(format, "alphanumeric characters");
 			} else {
-				/* pins match */
-				RDEBUG2("Pin confirmation succeeded. Pins match");
-				acm_ret = SD_Pin(securid_session->sdiHandle, securid_pass);
-				if (acm_ret == ACM_NEW_PIN_ACCEPTED) {
-					RDEBUG2("New SecurID pin accepted for %s.", securid_session->identity);
-
-					securid_session->securidSessionState = NEW_PIN_AUTH_VALIDATE_STATE;
+				strcpy(format, "digits");
+			}
+			snprintf(replyMsgBuffer, replyMsgBufferSize,
+				 " \r\n   Pins do not match--Please try again.\r\n   Enter your new PIN of %d to %d %s, \r\n		or\r\n   <Ctrl-D> to cancel the New PIN procedure:",
+				 pin_params.Min, pin_params.Max, format);
 
-					/* insert the updated session in the session list */
-					securid_sessionlist_add(inst, request, securid_session);
+			securid_session->securidSessionState = NEW_PIN_REQUIRED_STATE;
+			job->rc = RC_SECURID_AUTH_CHALLENGE;
 
-					rc = RC_SECURID_AUTH_CHALLENGE;
-					strlcpy(replyMsgBuffer, " \r\n\r\nWait for the code on your card to change, then enter new PIN and TokenCode\r\n\r\nEnter PASSCODE:", replyMsgBufferSize);
-				} else {
-					RDEBUG2("SecurID: New SecurID pin rejected for %s.", securid_session->identity);
-					SD_Pin(securid_session->sdiHandle, &empty_pin[0]);  /* cancel PIN */
+		} else {
+			/* pins match */
+			DEBUG2("Pin confirmation succeeded. Pins match");
+			acm_ret = SD_Pin(securid_session->sdiHandle, securid_pass);
+			if (acm_ret == ACM_NEW_PIN_ACCEPTED) {
+				DEBUG2("New SecurID pin accepted for %s.", securid_session->identity);
 
+				securid_session->securidSessionState = NEW_PIN_AUTH_VALIDATE_STATE;
 
-					rc = RC_SECURID_AUTH_FAILURE;
+				job->rc = RC_SECURID_AUTH_CHALLENGE;
+				strlcpy(replyMsgBuffer, " \r\n\r\nWait for the code on your card to change, then enter new PIN and TokenCode\r\n\r\nEnter PASSCODE:", replyMsgBufferSize);
+			} else {
+				DEBUG2("SecurID: New SecurID pin rejected for %s.", securid_session->identity);
+				SD_Pin(securid_session->sdiHandle, &empty_pin[0]);  /* cancel PIN */
 
-					/* deallocate session */
-					securid_session_free(inst, request, securid_session);
-				}
+				job->rc = RC_SECURID_AUTH_FAILURE;
 			}
-			return rc;
-		case NEW_PIN_AUTH_VALIDATE_STATE:
-			acm_ret = SD_Check(securid_session->sdiHandle, securid_pass, securid_user);
-			if (acm_ret == ACM_OK) {
-				RDEBUG2("New SecurID passcode accepted for %s", securid_session->identity);
-				rc = RC_SECURID_AUTH_SUCCESS;
+		}
+		break;
 
-			} else {
-				INFO("SecurID: New passcode rejected for [%s]", securid_session->identity);
-				rc = RC_SECURID_AUTH_FAILURE;
-			}
+	case NEW_PIN_AUTH_VALIDATE_STATE:
+		acm_ret = SD_Check(securid_session->sdiHandle, securid_pass, securid_user);
+		if (acm_ret == ACM_OK) {
+			DEBUG2("New SecurID passcode accepted for %s", securid_session->identity);
+			job->rc = RC_SECURID_AUTH_SUCCESS;
 
-			/* deallocate session */
-			securid_session_free(inst, request, securid_session);
+		} else {
+			INFO("SecurID: New passcode rejected for [%s]", securid_session->identity);
+			job->rc = RC_SECURID_AUTH_FAILURE;
+		}
+		break;
 
-			return rc;
-		case NEW_PIN_SYSTEM_ACCEPT_STATE:
-			if (!strcmp(passcode, "y")) {
-				AceGetSystemPin(securid_session->sdiHandle, new_pin);
+	case NEW_PIN_SYSTEM_ACCEPT_STATE:
+		if (!strcmp(passcode, "y")) {
+			AceGetSystemPin(securid_session->sdiHandle, job->new_pin);
 
-				/* Save the PIN for the next session
-				 * continuation */
-				if (securid_session->pin) TALLOC_FREE(securid_session->pin);
-				securid_session->pin = talloc_typed_strdup(securid_session, new_pin);
+			/* Save the PIN for the next session
+			 * continuation */
+			job->save_pin = job->new_pin;
 
-				snprintf(replyMsgBuffer, replyMsgBufferSize,
-					 "\r\nYour new PIN is: %s\r\nDo you accept this [y/n]?",
-					 new_pin);
-				securid_session->securidSessionState = NEW_PIN_SYSTEM_CONFIRM_STATE;
+			snprintf(replyMsgBuffer, replyMsgBufferSize,
+				 "\r\nYour new PIN is: %s\r\nDo you accept this [y/n]?",
+				 job->new_pin);
+			securid_session->securidSessionState = NEW_PIN_SYSTEM_CONFIRM_STATE;
+			job->rc = RC_SECURID_AUTH_CHALLENGE;
 
-				/* insert the updated session in the
-				 * session list */
-				securid_sessionlist_add(inst, request, securid_session);
+		} else {
+			SD_Pin(securid_session->sdiHandle, &empty_pin[0]); //Cancel new PIN
+			job->rc = RC_SECURID_AUTH_FAILURE;
+		}
+		break;
 
-				rc = RC_SECURID_AUTH_CHALLENGE;
+	case NEW_PIN_SYSTEM_CONFIRM_STATE:
+		acm_ret = SD_Pin(securid_session->sdiHandle, (SD_CHAR*)securid_session->pin);
+		if (acm_ret == ACM_NEW_PIN_ACCEPTED) {
+			strlcpy(replyMsgBuffer, " \r\n\r\nPin Accepted. Wait for the code on your card to change, then enter new PIN and TokenCode\r\n\r\nEnter PASSCODE:", replyMsgBufferSize);
+			securid_session->securidSessionState = NEW_PIN_AUTH_VALIDATE_STATE;
+			job->rc = RC_SECURID_AUTH_CHALLENGE;
+
+		} else {
+			SD_Pin(securid_session->sdiHandle, &empty_pin[0]); //Cancel new PIN
+			strlcpy(replyMsgBuffer, " \r\n\r\nPin Rejected. Wait for the code on your card to change, then try again.\r\n\r\nEnter PASSCODE:", replyMsgBufferSize);
+			job->rc = RC_SECURID_AUTH_FAILURE;
+		}
+		break;
 
+		/* USER_SELECTABLE state should be implemented to preserve compatibility with AM 6.x servers, which can return this state */
+	case NEW_PIN_USER_SELECT_STATE:
+		if (!strcmp(passcode, "y")) {
+			/* User has opted for a system-generated PIN */
+			AceGetSystemPin(securid_session->sdiHandle, job->new_pin);
+			snprintf(replyMsgBuffer, replyMsgBufferSize,
+				 "\r\nYour new PIN is: %s\r\nDo you accept this [y/n]?",
+				 job->new_pin);
+			securid_session->securidSessionState = NEW_PIN_SYSTEM_CONFIRM_STATE;
+			job->rc = RC_SECURID_AUTH_CHALLENGE;
+
+		} else {
+			/* User has opted for a user-defined PIN */
+			AceGetPinParams(securid_session->sdiHandle,
+					&pin_params);
+			if (pin_params.Alphanumeric) {
+				strcpy(format, "alphanumeric characters");
 			} else {
-				SD_Pin(securid_session->sdiHandle, &empty_pin[0]); //Cancel new PIN
-
-				/* deallocate session */
-				securid_session_free(inst, request, securid_session);
-				rc = RC_SECURID_AUTH_FAILURE;
+				strcpy(format, "digits");
 			}
 
-			return rc;
+			snprintf(replyMsgBuffer, replyMsgBufferSize,
+				 " \r\n   Enter your new PIN of %d to %d %s, \r\n		or\r\n   <Ctrl-D> to cancel the New PIN procedure:",
+				 pin_params.Min, pin_params.Max, format);
+			securid_session->securidSessionState = NEW_PIN_REQUIRED_STATE;
+			job->rc = RC_SECURID_AUTH_CHALLENGE;
+		}
+		break;
 
-		case NEW_PIN_SYSTEM_CONFIRM_STATE:
-			acm_ret = SD_Pin(securid_session->sdiHandle, (SD_CHAR*)securid_session->pin);
-			if (acm_ret == ACM_NEW_PIN_ACCEPTED) {
-				strlcpy(replyMsgBuffer, " \r\n\r\nPin Accepted. Wait for the code on your card to change, then enter new PIN and TokenCode\r\n\r\nEnter PASSCODE:", replyMsgBufferSize);
-				securid_session->securidSessionState = NEW_PIN_AUTH_VALIDATE_STATE;
-				/* insert the updated session in the session list */
-				securid_sessionlist_add(inst, request, securid_session);
-				rc = RC_SECURID_AUTH_CHALLENGE;
+	default:
+		ERROR("Invalid session state %d for user \"%s\"", securid_session->securidSessionState,
+		       username);
+		job->rc = RC_SECURID_AUTH_FAILURE;
+		break;
+	}
 
-			} else {
-				SD_Pin(securid_session->sdiHandle, &empty_pin[0]); //Cancel new PIN
-				strlcpy(replyMsgBuffer, " \r\n\r\nPin Rejected. Wait for the code on your card to change, then try again.\r\n\r\nEnter PASSCODE:", replyMsgBufferSize);
-				/* deallocate session */
-				securid_session_free(inst, request, securid_session);
-				rc = RC_SECURID_AUTH_FAILURE;
-			}
+finish:
+	/*
+	 *	The conversation is over, so release the ACE handle
+	 *	here rather than in the worker.
+	 */
+	if ((job->rc != RC_SECURID_AUTH_CHALLENGE) && (securid_session->sdiHandle != SDI_HANDLE_NONE)) {
+		SD_Close(securid_session->sdiHandle);
+		securid_session->sdiHandle = SDI_HANDLE_NONE;
+	}
+}
 
-			return rc;
+/** Store or free the session, and build the reply
+ *
+ * Called in the worker once the ACE calls are complete.
+ */
+static rlm_rcode_t securid_job_finish(REQUEST *request, securid_job_t *job)
+{
+	SECURID_SESSION	*session = job->session;
+	rlm_rcode_t	rcode;
+	VALUE_PAIR	*vp;
 
-			/* USER_SELECTABLE state should be implemented to preserve compatibility with AM 6.x servers, which can return this state */
-		case NEW_PIN_USER_SELECT_STATE:
-			if (!strcmp(passcode, "y")) {
-				/* User has opted for a system-generated PIN */
-				AceGetSystemPin(securid_session->sdiHandle, new_pin);
-				snprintf(replyMsgBuffer, replyMsgBufferSize,
-					 "\r\nYour new PIN is: %s\r\nDo you accept this [y/n]?",
-					 new_pin);
-				securid_session->securidSessionState = NEW_PIN_SYSTEM_CONFIRM_STATE;
+	job->session = NULL;
 
-				/* insert the updated session in the session list */
-				securid_sessionlist_add(inst, request,
-							securid_session);
-				rc = RC_SECURID_AUTH_CHALLENGE;
+	if (job->rc == RC_SECURID_AUTH_CHALLENGE) {
+		if (job->save_pin) {
+			TALLOC_FREE(session->pin);
+			session->pin = talloc_typed_strdup(session, job->save_pin);
+		}
 
-			} else {
-				/* User has opted for a user-defined PIN */
-				AceGetPinParams(securid_session->sdiHandle,
-						&pin_params);
-				if (pin_params.Alphanumeric) {
-					strcpy(format, "alphanumeric characters");
-				} else {
-					strcpy(format, "digits");
-				}
+		/* insert the new or updated session in the session list */
+		if (securid_sessionlist_add(job->inst, request, session) < 0) {
+			securid_session_free(job->inst, request, session);
+			job->rc = RC_SECURID_AUTH_FAILURE;
+		}
+	} else {
+		/* deallocate session */
+		securid_session_free(job->inst, request, session);
+	}
 
-				snprintf(replyMsgBuffer, replyMsgBufferSize,
-					 " \r\n   Enter your new PIN of %d to %d %s, \r\n		or\r\n   <Ctrl-D> to cancel the New PIN procedure:",
-					 pin_params.Min, pin_params.Max, format);
-				securid_session->securidSessionState = NEW_PIN_REQUIRED_STATE;
+	switch (job->rc) {
+	case RC_SECURID_AUTH_SUCCESS:
+		rcode = RLM_MODULE_OK;
+		break;
 
-				/* insert the updated session in the session list */
-				securid_sessionlist_add(inst, request,
-							securid_session);
-				rc = RC_SECURID_AUTH_CHALLENGE;
-			}
+	case RC_SECURID_AUTH_CHALLENGE:
+		/* reply with Access-challenge message code (11) */
 
-			return rc;
+		/* Generate Prompt attribute */
+		MEM(pair_update_reply(&vp, attr_prompt) >= 0);
+		vp->vp_uint32 = 0; /* no echo */
 
-		default:
-			ERROR("Invalid session state %d for user \"%s\"", securid_session->securidSessionState,
-			       username);
-			break;
-		}
+		/* Mark the packet as a Acceess-Challenge Packet */
+		request->reply->code = FR_CODE_ACCESS_CHALLENGE;
+		RDEBUG2("Sending Access-Challenge");
+		rcode = RLM_MODULE_HANDLED;
+		break;
+
+	case RC_SECURID_AUTH_FAILURE:
+	case RC_SECURID_AUTH_ACCESS_DENIED_FAILURE:
+	case RC_SECURID_AUTH_INVALID_SERVER_FAILURE:
+	default:
+		rcode = RLM_MODULE_REJECT;
+		break;
 	}
 
-	return 0;
+	if (*job->reply) {
+		MEM(pair_update_reply(&vp, attr_reply_message) >= 0);
+		fr_pair_value_strdup(vp, job->reply);
+	}
 
+	return rcode;
 }
 
-/******************************************/
-static int mod_detach(void *instance)
+/*
+ *	Jobs which are freed without being finished (because the
+ *	request was cancelled) still own their session.
+ */
+static int _securid_job_free(securid_job_t *job)
 {
-	rlm_securid_t *inst = (rlm_securid_t *) instance;
-
-	/* delete session tree */
-	if (inst->session_tree) {
-		talloc_free(inst->session_tree);
-		inst->session_tree = NULL;
-	}
-
-	pthread_mutex_destroy(&(inst->session_mutex));
+	if (job->session) securid_session_free(job->inst, NULL, job->session);
 
 	return 0;
 }
 
-
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+static rlm_rcode_t securid_offload_resume(UNUSED module_ctx_t const *mctx, REQUEST *request, void *rctx)
 {
-	rlm_securid_t *inst = instance;
+	securid_job_t	*job = talloc_get_type_abort(rctx, securid_job_t);
+	rlm_rcode_t	rcode;
 
-	/*
-	 *	Lookup sessions in the tree.  We don't free them in
-	 *	the tree, as that's taken care of elsewhere...
-	 */
-	inst->session_tree = rbtree_talloc_alloc(NULL, securid_session_cmp, SECURID_SESSION NULL, 0);
-	if (!inst->session_tree) {
-		ERROR("Cannot initialize session tree");
-		return -1;
-	}
+	rcode = securid_job_finish(request, job);
+	talloc_free(job);
 
-	pthread_mutex_init(&(inst->session_mutex), NULL);
-	return 0;
+	return rcode;
 }
 
+static void securid_offload_signal(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request, void *rctx,
+				   fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	fr_offload_cancel(talloc_get_type_abort(rctx, securid_job_t));
+}
 
 /*
  *	Authenticate the user via one of any well-known password.
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(module_ctx_t const *mctx, REQUEST *request)
 {
-	int			rcode;
-	rlm_securid_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_securid_t);
-	char		 	buffer[FR_MAX_STRING_LEN]="";
+	rlm_securid_t		*inst = talloc_get_type_abort(mctx->instance, rlm_securid_t);
+	rlm_securid_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_securid_thread_t);
 	VALUE_PAIR		*username, *password;
-	VALUE_PAIR		*vp;
+	securid_job_t		*job;
+	rlm_rcode_t		rcode;
 
 	username = fr_pair_find_by_da(request->packet->vps, attr_user_name, TAG_ANY);
 	password = fr_pair_find_by_da(request->packet->vps, attr_user_password, TAG_ANY);
@@ -504,40 +527,92 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(module_ctx_t const *mctx, R
 		RDEBUG2("Login attempt with password");
 	}
 
-	rcode = securidAuth(inst, request, username->vp_strvalue, password->vp_strvalue,
-			    buffer, sizeof(buffer));
+	MEM(job = talloc_zero(NULL, securid_job_t));
+	talloc_set_destructor(job, _securid_job_free);
+	job->inst = inst;
+	MEM(job->username = talloc_bstrndup(job, username->vp_strvalue, username->vp_length));
+	MEM(job->passcode = talloc_bstrndup(job, password->vp_strvalue, password->vp_length));
 
-	switch (rcode) {
-	case RC_SECURID_AUTH_SUCCESS:
-		rcode = RLM_MODULE_OK;
-		break;
+	/*
+	 *	Continue an existing session, or start a new one,
+	 *	which is only stored if the user is challenged.
+	 */
+	job->session = securid_sessionlist_find(inst, request);
+	if (job->session) {
+		job->found = true;
+	} else {
+		job->session = securid_session_alloc();
+		job->session->identity = talloc_typed_strdup(job->session, job->username);
+	}
 
-	case RC_SECURID_AUTH_CHALLENGE:
-		/* reply with Access-challenge message code (11) */
+	if (t->offload && (fr_offload_submit(t->offload, request, job) == 0)) {
+		return unlang_module_yield(request, securid_offload_resume, securid_offload_signal, job);
+	}
 
-		/* Generate Prompt attribute */
-		MEM(pair_update_reply(&vp, attr_prompt) >= 0);
-		vp->vp_uint32 = 0; /* no echo */
+	securid_job_run(job, NULL, NULL);
+	rcode = securid_job_finish(request, job);
+	talloc_free(job);
 
-		/* Mark the packet as a Acceess-Challenge Packet */
-		request->reply->code = FR_CODE_ACCESS_CHALLENGE;
-		RDEBUG2("Sending Access-Challenge");
-		rcode = RLM_MODULE_HANDLED;
-		break;
+	return rcode;
+}
 
-	case RC_SECURID_AUTH_FAILURE:
-	case RC_SECURID_AUTH_ACCESS_DENIED_FAILURE:
-	case RC_SECURID_AUTH_INVALID_SERVER_FAILURE:
-	default:
-		rcode = RLM_MODULE_REJECT;
-		break;
-	}
+/******************************************/
+static int mod_detach(void *instance)
+{
+	rlm_securid_t *inst = (rlm_securid_t *) instance;
 
-	if (*buffer) {
-		MEM(pair_update_reply(&vp, attr_reply_message) >= 0);
-		fr_pair_value_strdup(vp, buffer);
+	/*
+	 *	Stop the offload threads before freeing any
+	 *	sessions they might be using.
+	 */
+	TALLOC_FREE(inst->offload);
+
+	/* delete session shards */
+	securid_sessionlist_free(inst, NULL);
+
+	return 0;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_securid_t		*inst = instance;
+
+	FR_INTEGER_BOUND_CHECK("max_sessions", inst->max_sessions, >=, SECURID_SESSION_SHARDS);
+
+	if (securid_sessionlist_init(inst) < 0) {
+		ERROR("Cannot initialize session tree");
+		return -1;
 	}
-	return rcode;
+
+	if (!inst->offload_conf.threads) return 0;
+
+	inst->offload = fr_offload_alloc(inst, conf, &inst->offload_conf, securid_job_run, NULL, NULL);
+	if (!inst->offload) return -1;
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_securid_t		*inst = talloc_get_type_abort(instance, rlm_securid_t);
+	rlm_securid_thread_t	*t = talloc_get_type_abort(thread, rlm_securid_thread_t);
+
+	if (!inst->offload) return 0;
+
+	t->offload = fr_offload_thread_alloc(t, inst->offload, el);
+	if (!t->offload) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_securid_thread_t	*t = talloc_get_type_abort(thread, rlm_securid_thread_t);
+
+	TALLOC_FREE(t->offload);
+
+	return 0;
 }
 
 
@@ -552,12 +627,15 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(module_ctx_t const *mctx, R
  */
 extern module_t rlm_securid;
 module_t rlm_securid = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "securid",
-	.inst_size	= sizeof(rlm_securid_t),
-	.config		= module_config,
-	.instantiate	= mod_instantiate,
-	.detach		= mod_detach,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "securid",
+	.inst_size		= sizeof(rlm_securid_t),
+	.thread_inst_size	= sizeof(rlm_securid_thread_t),
+	.config			= module_config,
+	.instantiate		= mod_instantiate,
+	.detach			= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate
 	},
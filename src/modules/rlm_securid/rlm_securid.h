@@ -1,8 +1,17 @@
 #pragma once
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/offload.h>
 #include <freeradius-devel/util/debug.h>
 
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #include "acexport.h"
 
 #define SAFE_STR(s) s==NULL?"EMPTY":s
@@ -34,7 +43,7 @@ typedef enum {
  */
 
 #define SECURID_STATE_LEN 32
-typedef struct {
+typedef struct _securid_session_t {
 	struct _securid_session_t *prev, *next;
 	SDI_HANDLE		  sdiHandle;
 	SECURID_SESSION_STATE	  securidSessionState;
@@ -52,21 +61,37 @@ typedef struct {
 } SECURID_SESSION;
 
 
+/*
+ *	Sessions are spread over this many shards, each with its own
+ *	lock, so workers continuing different sessions don't contend.
+ *	Must be a power of 2.
+ */
+#define SECURID_SESSION_SHARDS 16
+
+/** One shard of the session store
+ *
+ */
+typedef struct {
+	pthread_mutex_t	mutex;				//!< Protects this shard.
+	rbtree_t	*tree;				//!< Sessions, keyed on State and client address.
+	SECURID_SESSION	*head, *tail;			//!< Sessions, oldest first.
+	uint32_t	max_sessions;			//!< Maximum sessions in this shard.
+} securid_shard_t;
+
 /*
  *      Define a structure for our module configuration.
  *
  *      These variables do not need to be in a structure, but it's
  *      a lot cleaner to do so, and a pointer to the structure can
  *      be used as the instance handle.
- *      sessions = remembered sessions, in a tree for speed.
- *      mutex = ensure only one thread is updating the sessions list
+ *      shards = remembered sessions, sharded by State.
  */
 typedef struct {
-	pthread_mutex_t	session_mutex;
-	rbtree_t*	session_tree;
-	SECURID_SESSION	*session_head, *session_tail;
+	securid_shard_t	shards[SECURID_SESSION_SHARDS];
+
+	atomic_uint	last_session_id;
 
-	unsigned int	 last_session_id;
+	fr_offload_t	*offload;			//!< Pool of threads making ACE calls, NULL if disabled.
 
 	/*
 	 *	Configuration items.
@@ -74,6 +99,8 @@ typedef struct {
 	uint32_t	timer_limit;
 	uint32_t	max_sessions;
 	uint32_t	max_trips_per_session;
+
+	fr_offload_conf_t offload_conf;			//!< Threads making ACE calls.
 } rlm_securid_t;
 
 extern fr_dict_attr_t const *attr_prompt;
@@ -84,9 +111,11 @@ extern fr_dict_attr_t const *attr_user_password;
 /* Memory Management */
 SECURID_SESSION*     securid_session_alloc(void);
 void		     securid_session_free(rlm_securid_t *inst, REQUEST *request,SECURID_SESSION *session)
-		     CC_HINT(nonnull);
+		     CC_HINT(nonnull(1,3));
+
+int		     securid_sessionlist_init(rlm_securid_t *inst) CC_HINT(nonnull);
 
-void		     securid_sessionlist_free(rlm_securid_t *inst,REQUEST *request) CC_HINT(nonnull);
+void		     securid_sessionlist_free(rlm_securid_t *inst, REQUEST *request) CC_HINT(nonnull(1));
 
 int		     securid_sessionlist_add(rlm_securid_t *inst, REQUEST *request, SECURID_SESSION *session)
 		     CC_HINT(nonnull);
@@ -0,0 +1,257 @@
+/*
+ * @copyright (c) 2026, The FreeRADIUS server project
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the FreeRADIUS server project nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * $Id$
+ * @file rlm_sigtran/cache.c
+ * @brief Keep spare authentication vectors, so re-authentications don't go to the HLR.
+ *
+ * Vectors must only ever be used once, so they're removed from the cache
+ * as they're handed out.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+#define LOG_PREFIX "rlm_sigtran - "
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+
+#include <pthread.h>
+
+#include "sigtran.h"
+
+/** Spare vectors for a single IMSI
+ *
+ */
+typedef struct {
+	uint8_t			*imsi;			//!< TBCD encoded IMSI.
+	uint8_t			version;		//!< MAP version the vectors were retrieved with.
+
+	sigtran_vector_t	*head;			//!< Oldest vector.
+	sigtran_vector_t	**tail;			//!< Where to append new vectors.
+	unsigned int		count;			//!< How many vectors we have.
+
+	fr_time_t		expires;		//!< When the oldest vectors should no longer be used.
+
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+} sigtran_vector_cache_entry_t;
+
+struct sigtran_vector_cache_s {
+	pthread_mutex_t		mutex;			//!< Workers all share the same cache.
+
+	rbtree_t		*tree;			//!< Entries, keyed on IMSI and version.
+	fr_dlist_head_t		lru;			//!< Most recently added to at the head.
+
+	uint32_t		max_entries;		//!< Maximum number of entries.
+	fr_time_delta_t		lifetime;		//!< How long vectors may be kept for.
+};
+
+static int sigtran_vector_cache_cmp(void const *one, void const *two)
+{
+	sigtran_vector_cache_entry_t const	*a = one, *b = two;
+	size_t					a_len = talloc_array_length(a->imsi);
+	size_t					b_len = talloc_array_length(b->imsi);
+	int					ret;
+
+	ret = (a->version > b->version) - (a->version < b->version);
+	if (ret != 0) return ret;
+
+	ret = (a_len > b_len) - (a_len < b_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->imsi, b->imsi, a_len);
+}
+
+static int _sigtran_vector_cache_free(sigtran_vector_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a new vector cache
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Maximum number of IMSIs to keep vectors for.
+ * @param[in] lifetime		How long vectors may be kept for.
+ * @return
+ *	- A new cache on success.
+ *	- NULL on failure.
+ */
+sigtran_vector_cache_t *sigtran_vector_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, fr_time_delta_t lifetime)
+{
+	sigtran_vector_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, sigtran_vector_cache_t));
+	cache->tree = rbtree_talloc_alloc(cache, sigtran_vector_cache_cmp, sigtran_vector_cache_entry_t, NULL, 0);
+	if (!cache->tree) {
+		talloc_free(cache);
+		return NULL;
+	}
+	fr_dlist_talloc_init(&cache->lru, sigtran_vector_cache_entry_t, entry);
+
+	cache->max_entries = max_entries;
+	cache->lifetime = lifetime;
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _sigtran_vector_cache_free);
+
+	return cache;
+}
+
+static void sigtran_vector_cache_entry_free(sigtran_vector_cache_t *cache, sigtran_vector_cache_entry_t *entry)
+{
+	rbtree_deletebydata(cache->tree, entry);
+	fr_dlist_remove(&cache->lru, entry);
+	talloc_free(entry);
+}
+
+/** Add spare vectors to the cache
+ *
+ * @param[in] cache	to add vectors to.
+ * @param[in] imsi	TBCD encoded IMSI the vectors were retrieved for.
+ * @param[in] version	MAP version the vectors were retrieved with.
+ * @param[in] vector	List of vectors.  The cache takes ownership of them.
+ * @param[in] now	The current time.
+ */
+void sigtran_vector_cache_add(sigtran_vector_cache_t *cache, uint8_t const *imsi, uint8_t version,
+			      sigtran_vector_t *vector, fr_time_t now)
+{
+	sigtran_vector_cache_entry_t	find, *entry;
+	sigtran_vector_t		*next;
+
+	if (!vector) return;
+
+	memcpy(&find.imsi, &imsi, sizeof(find.imsi));	/* Only used for the comparison */
+	find.version = version;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = rbtree_finddata(cache->tree, &find);
+	if (entry && (entry->expires <= now)) {
+		sigtran_vector_cache_entry_free(cache, entry);
+		entry = NULL;
+	}
+
+	if (!entry) {
+		/*
+		 *	Make room by evicting whichever entry was
+		 *	added to least recently.
+		 */
+		if (rbtree_num_elements(cache->tree) >= cache->max_entries) {
+			sigtran_vector_cache_entry_t *oldest = fr_dlist_tail(&cache->lru);
+
+			if (oldest) sigtran_vector_cache_entry_free(cache, oldest);
+		}
+
+		MEM(entry = talloc_zero(cache, sigtran_vector_cache_entry_t));
+		MEM(entry->imsi = talloc_memdup(entry, imsi, talloc_array_length(imsi)));
+		talloc_set_type(entry->imsi, uint8_t);
+		entry->version = version;
+		entry->tail = &entry->head;
+		entry->expires = now + cache->lifetime;
+
+		if (!rbtree_insert(cache->tree, entry)) {
+			pthread_mutex_unlock(&cache->mutex);
+			talloc_free(entry);
+			talloc_free(vector);
+			return;
+		}
+	} else {
+		fr_dlist_remove(&cache->lru, entry);
+	}
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	for (; vector; vector = next) {
+		next = vector->next;
+
+		talloc_steal(entry, vector);
+		vector->next = NULL;
+		*entry->tail = vector;
+		entry->tail = &vector->next;
+		entry->count++;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Remove vectors from the cache
+ *
+ * Vectors are only returned if there are enough of them for an
+ * authentication, otherwise they're left for the next time we
+ * get a response from the HLR.
+ *
+ * @param[in] ctx	to move the vectors into.
+ * @param[in] cache	to remove vectors from.
+ * @param[in] imsi	TBCD encoded IMSI to retrieve vectors for.
+ * @param[in] version	MAP version the vectors must have been retrieved with.
+ * @param[in] num	How many vectors are needed.
+ * @param[in] now	The current time.
+ * @return
+ *	- A list of num vectors.
+ *	- NULL if there weren't enough cached vectors.
+ */
+sigtran_vector_t *sigtran_vector_cache_get(TALLOC_CTX *ctx, sigtran_vector_cache_t *cache,
+					   uint8_t const *imsi, uint8_t version, unsigned int num, fr_time_t now)
+{
+	sigtran_vector_cache_entry_t	find, *entry;
+	sigtran_vector_t		*head, *vector, **last;
+	unsigned int			i;
+
+	memcpy(&find.imsi, &imsi, sizeof(find.imsi));	/* Only used for the comparison */
+	find.version = version;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = rbtree_finddata(cache->tree, &find);
+	if (!entry) {
+	miss:
+		pthread_mutex_unlock(&cache->mutex);
+		return NULL;
+	}
+
+	if (entry->expires <= now) {
+		sigtran_vector_cache_entry_free(cache, entry);
+		goto miss;
+	}
+
+	if (entry->count < num) goto miss;
+
+	head = entry->head;
+	last = &head;
+	for (i = 0; i < num; i++) {
+		vector = *last;
+		talloc_steal(ctx, vector);
+		last = &vector->next;
+	}
+	entry->head = *last;
+	entry->count -= num;
+	*last = NULL;
+
+	if (entry->count == 0) sigtran_vector_cache_entry_free(cache, entry);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return head;
+}
@@ -130,7 +130,10 @@ static void _sigtran_pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int fl
 	 *	Check talloc header is still OK
 	 */
 	txn = talloc_get_type_abort(ptr, sigtran_transaction_t);
-	if (txn->ctx.defunct) return;		/* Request was stopped */
+	if (txn->ctx.defunct) {			/* Request was stopped */
+		talloc_free(txn);
+		return;
+	}
 
 	fr_assert(txn->ctx.request);
 	unlang_interpret_resumable(txn->ctx.request);	/* Continue processing */
@@ -284,8 +287,100 @@ static void sigtran_client_signal(UNUSED module_ctx_t const *mctx, UNUSED REQUES
 	txn->ctx.request = NULL;	/* remove the link to the (now dead) request */
 }
 
-static rlm_rcode_t sigtran_client_map_resume(UNUSED module_ctx_t const *mctx, REQUEST *request, void *rctx)
+/** Add vectors to the control list
+ *
+ * @param[in] request	to add vectors to.
+ * @param[in] vector	list of vectors.  The vector components are freed as they're copied.
+ */
+static void sigtran_client_vector_to_pairs(REQUEST *request, sigtran_vector_t *vector)
+{
+	unsigned int		i = 0;
+	fr_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+	sigtran_vector_t	*vec;
+
+	fr_cursor_init(&cursor, &request->control);
+
+	for (vec = vector; vec; vec = vec->next) {
+		switch (vec->type) {
+		case SIGTRAN_VECTOR_TYPE_SIM_TRIPLETS:
+			fr_assert(vec->sim.rand);
+			fr_assert(vec->sim.sres);
+			fr_assert(vec->sim.kc);
+
+			RDEBUG2("SIM auth vector %i", i);
+			RINDENT();
+			MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_rand));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->sim.rand, true) == 0);
+			TALLOC_FREE(vec->sim.rand);
+			RDEBUG2("&control:%pP", vp);
+			fr_cursor_append(&cursor, vp);
+
+			MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_sres));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->sim.sres, true) == 0);
+			TALLOC_FREE(vec->sim.sres);
+			RDEBUG2("&control:%pP", vp);
+			fr_cursor_append(&cursor, vp);
+
+			MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_kc));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->sim.kc, true) == 0);
+			TALLOC_FREE(vec->sim.kc);
+			RDEBUG2("&control:%pP", vp);
+			fr_cursor_append(&cursor, vp);
+			REXDENT();
+
+			i++;
+			break;
+
+		case SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS:
+			fr_assert(vec->umts.rand);
+			fr_assert(vec->umts.xres);
+			fr_assert(vec->umts.ck);
+			fr_assert(vec->umts.ik);
+			fr_assert(vec->umts.authn);
+
+			RDEBUG2("UMTS auth vector %i", i);
+			RINDENT();
+			MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_rand));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->umts.rand, true) == 0);
+			TALLOC_FREE(vec->umts.rand);
+			RDEBUG2("&control:%pP", vp);
+			fr_cursor_append(&cursor, vp);
+
+			MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_xres));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->umts.xres, true) == 0);
+			TALLOC_FREE(vec->umts.xres);
+			RDEBUG2("&control:%pP", vp);
+			fr_cursor_append(&cursor, vp);
+
+			MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_ck));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->umts.ck, true) == 0);
+			TALLOC_FREE(vec->umts.ck);
+			RDEBUG2("&control:%pP", vp);
+			fr_cursor_append(&cursor, vp);
+
+			MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_ik));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->umts.ik, true) == 0);
+			TALLOC_FREE(vec->umts.ik);
+			RDEBUG2("&control:%pP", vp);
+			fr_cursor_append(&cursor, vp);
+
+			MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_autn));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->umts.authn, true) == 0);
+			TALLOC_FREE(vec->umts.authn);
+			RDEBUG2("&control:%pP", vp);
+			fr_cursor_append(&cursor, vp);
+			REXDENT();
+
+			i++;
+			break;
+		}
+	}
+}
+
+static rlm_rcode_t sigtran_client_map_resume(module_ctx_t const *mctx, REQUEST *request, void *rctx)
 {
+	rlm_sigtran_t const			*inst = talloc_get_type_abort_const(mctx->instance, rlm_sigtran_t);
 	sigtran_transaction_t			*txn = talloc_get_type_abort(rctx, sigtran_transaction_t);
 	rlm_rcode_t				rcode;
 	fr_assert(request == txn->ctx.request);
@@ -296,89 +391,29 @@ static rlm_rcode_t sigtran_client_map_resume(UNUSED module_ctx_t const *mctx, RE
 	switch (txn->response.type) {
 	case SIGTRAN_RESPONSE_OK:
 	{
-		unsigned int		i = 0;
-		fr_cursor_t		cursor;
-		VALUE_PAIR		*vp;
-		sigtran_vector_t	*vec;
+		sigtran_map_send_auth_info_req_t *req = talloc_get_type_abort(txn->request.data,
+									      sigtran_map_send_auth_info_req_t);
 		sigtran_map_send_auth_info_res_t *res = talloc_get_type_abort(txn->response.data,
 									      sigtran_map_send_auth_info_res_t);
-		fr_cursor_init(&cursor, &request->control);
-
-		for (vec = res->vector; vec; vec = vec->next) {
-			switch (vec->type) {
-			case SIGTRAN_VECTOR_TYPE_SIM_TRIPLETS:
-				fr_assert(vec->sim.rand);
-				fr_assert(vec->sim.sres);
-				fr_assert(vec->sim.kc);
-
-				RDEBUG2("SIM auth vector %i", i);
-				RINDENT();
-				MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_rand));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->sim.rand, true) == 0);
-				TALLOC_FREE(vec->sim.rand);
-				RDEBUG2("&control:%pP", vp);
-				fr_cursor_append(&cursor, vp);
-
-				MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_sres));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->sim.sres, true) == 0);
-				TALLOC_FREE(vec->sim.sres);
-				RDEBUG2("&control:%pP", vp);
-				fr_cursor_append(&cursor, vp);
-
-				MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_kc));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->sim.kc, true) == 0);
-				TALLOC_FREE(vec->sim.kc);
-				RDEBUG2("&control:%pP", vp);
-				fr_cursor_append(&cursor, vp);
-				REXDENT();
-
-				i++;
-				break;
-
-			case SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS:
-				fr_assert(vec->umts.rand);
-				fr_assert(vec->umts.xres);
-				fr_assert(vec->umts.ck);
-				fr_assert(vec->umts.ik);
-				fr_assert(vec->umts.authn);
-
-				RDEBUG2("UMTS auth vector %i", i);
-				RINDENT();
-				MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_rand));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->umts.rand, true) == 0);
-				TALLOC_FREE(vec->umts.rand);
-				RDEBUG2("&control:%pP", vp);
-				fr_cursor_append(&cursor, vp);
-
-				MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_xres));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->umts.xres, true) == 0);
-				TALLOC_FREE(vec->umts.xres);
-				RDEBUG2("&control:%pP", vp);
-				fr_cursor_append(&cursor, vp);
-
-				MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_ck));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->umts.ck, true) == 0);
-				TALLOC_FREE(vec->umts.ck);
-				RDEBUG2("&control:%pP", vp);
-				fr_cursor_append(&cursor, vp);
-
-				MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_ik));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->umts.ik, true) == 0);
-				TALLOC_FREE(vec->umts.ik);
-				RDEBUG2("&control:%pP", vp);
-				fr_cursor_append(&cursor, vp);
-
-				MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_autn));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->umts.authn, true) == 0);
-				TALLOC_FREE(vec->umts.authn);
-				RDEBUG2("&control:%pP", vp);
-				fr_cursor_append(&cursor, vp);
-				REXDENT();
-
-				i++;
-				break;
+
+		/*
+		 *	Keep what this authentication needs, and
+		 *	save the rest for the next one.
+		 */
+		if (inst->cache) {
+			sigtran_vector_t	**last = &res->vector;
+			unsigned int		i;
+
+			for (i = 0; (i < SIGTRAN_VECTORS_PER_AUTH(req->version)) && *last; i++) last = &(*last)->next;
+
+			if (*last) {
+				RDEBUG2("Caching spare vectors");
+				sigtran_vector_cache_add(inst->cache, req->imsi, req->version, *last, fr_time());
+				*last = NULL;
 			}
 		}
+
+		sigtran_client_vector_to_pairs(request, res->vector);
 		rcode = RLM_MODULE_OK;
 	}
 		break;
@@ -429,6 +464,7 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t const *inst, REQUEST
 
 	req = talloc(txn, sigtran_map_send_auth_info_req_t);
 	req->conn = conn;
+	req->num_vectors = inst->conn_conf.map_num_vectors;
 
 	if (tmpl_aexpand(request, &req->version, request, inst->conn_conf.map_version, NULL, NULL) < 0) {
 		ERROR("Failed retrieving version");
@@ -466,6 +502,23 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t const *inst, REQUEST
 		goto error;
 	}
 
+	/*
+	 *	Use vectors left over from a previous
+	 *	response if we have any.
+	 */
+	if (inst->cache) {
+		sigtran_vector_t	*vector;
+
+		vector = sigtran_vector_cache_get(txn, inst->cache, req->imsi, req->version,
+						  SIGTRAN_VECTORS_PER_AUTH(req->version), fr_time());
+		if (vector) {
+			RDEBUG2("Using cached vectors for IMSI \"%pV\"", fr_box_strvalue_buffer(imsi));
+			sigtran_client_vector_to_pairs(request, vector);
+			talloc_free(txn);
+			return RLM_MODULE_OK;
+		}
+	}
+
 	if (RDEBUG_ENABLED2) {
 		RDEBUG2("Sending MAPv%u request with IMSI \"%pV\"", req->version, fr_box_strvalue_buffer(imsi));
 	} else if (RDEBUG_ENABLED3){
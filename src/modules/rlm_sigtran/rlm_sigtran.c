@@ -140,6 +140,15 @@ static const CONF_PARSER sccp_config[] = {
 
 static const CONF_PARSER map_config[] = {
 	{ FR_CONF_OFFSET("version", FR_TYPE_TMPL, rlm_sigtran_t, conn_conf.map_version), .dflt = "2", .quote = T_BARE_WORD},
+	{ FR_CONF_OFFSET("num_vectors", FR_TYPE_UINT32, rlm_sigtran_t, conn_conf.map_num_vectors), .dflt = "1" },
+	{ FR_CONF_OFFSET("max_dialogues", FR_TYPE_UINT32, rlm_sigtran_t, conn_conf.map_max_dialogues), .dflt = "1024" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER vector_cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_sigtran_t, cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_TIME_DELTA, rlm_sigtran_t, cache_lifetime), .dflt = "30" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -150,6 +159,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_POINTER("mtp3", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) mtp3_config },
 	{ FR_CONF_POINTER("sccp", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) sccp_config },
 	{ FR_CONF_POINTER("map", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) map_config },
+	{ FR_CONF_POINTER("vector_cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) vector_cache_config },
 
 	{ FR_CONF_OFFSET("imsi", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_sigtran_t, imsi) },
 
@@ -202,7 +212,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQU
 {
 	rlm_sigtran_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_sigtran_t);
 
-	return sigtran_client_map_send_auth_info(inst, request, inst->conn, *(int *)thread);
+	return sigtran_client_map_send_auth_info(inst, request, inst->conn, *(int *)mctx->thread);
 }
 
 /** Convert our sccp address config structure into sockaddr_sccp
@@ -360,6 +370,23 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	MTP3_PC_CHECK(dpc);
 	MTP3_PC_CHECK(opc);
 
+	/*
+	 *	MAPv3 allows up to five vectors to be requested at once.
+	 */
+	FR_INTEGER_BOUND_CHECK("num_vectors", inst->conn_conf.map_num_vectors, >=, 1);
+	FR_INTEGER_BOUND_CHECK("num_vectors", inst->conn_conf.map_num_vectors, <=, 5);
+	FR_INTEGER_BOUND_CHECK("max_dialogues", inst->conn_conf.map_max_dialogues, >=, 1);
+
+	if (inst->cache_max_entries > 0) {
+		FR_TIME_DELTA_BOUND_CHECK("lifetime", inst->cache_lifetime, >=, fr_time_delta_from_sec(1));
+
+		inst->cache = sigtran_vector_cache_alloc(inst, inst->cache_max_entries, inst->cache_lifetime);
+		if (!inst->cache) {
+			cf_log_err(conf, "Failed allocating vector cache");
+			return -1;
+		}
+	}
+
 	if (sigtran_sccp_sockaddr_from_conf(inst, inst, &inst->conn_conf.sccp_called_sockaddr,
 					    &inst->conn_conf.sccp_called, conf) < 0) return -1;
 	if (sigtran_sccp_sockaddr_from_conf(inst, inst, &inst->conn_conf.sccp_calling_sockaddr,
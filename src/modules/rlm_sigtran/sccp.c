@@ -40,6 +40,7 @@
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/net.h>
 #include <osmocom/core/msgb.h>
 #include <osmocom/core/utils.h>
 
@@ -101,27 +102,27 @@ static void sigtran_tcap_timeout(void *data)
 int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transaction_t *txn, UNUSED struct osmo_fd *ofd)
 {
 	static uint8_t tcap_map_raw_v2[] = {
-		0x62, 0x43, 0x48, 0x01, 0x01, 0x6b, 0x80, 0x28, /* 0x00 */
-		0x80, 0x06, 0x07, 0x00, 0x11, 0x86, 0x05, 0x01, /* 0x08 */
-		0x01, 0x01, 0xa0, 0x80, 0x60, 0x80, 0x80, 0x02, /* 0x10 */
-		0x07, 0x80, 0xa1, 0x80, 0x06, 0x07, 0x04, 0x00, /* 0x18 */
-		0x00, 0x01, 0x00, 0x0e, 0x02, 0x00, 0x00, 0x00, /* 0x20 (0x24 is version)*/
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x6c, /* 0x30 (0x35 is invoke ID) */
-		0x14, 0xa1, 0x80, 0x02, 0x01, 0x03, 0x02, 0x01, /* 0x38 (0x3c is IMSI len, 0x3d-0x44 IMSI) */
-		0x38, 0x04, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0x40 */
-		0xff, 0xff, 0xff, 0x00, 0x00 };			/* 0x48 */
+		0x62, 0x46, 0x48, 0x04, 0x00, 0x00, 0x00, 0x00, /* 0x00 (0x04-0x07 is OTID) */
+		0x6b, 0x80, 0x28, 0x80, 0x06, 0x07, 0x00, 0x11, /* 0x08 */
+		0x86, 0x05, 0x01, 0x01, 0x01, 0xa0, 0x80, 0x60, /* 0x10 */
+		0x80, 0x80, 0x02, 0x07, 0x80, 0xa1, 0x80, 0x06, /* 0x18 */
+		0x07, 0x04, 0x00, 0x00, 0x01, 0x00, 0x0e, 0x02, /* 0x20 (0x27 is version) */
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* 0x28 */
+		0x00, 0x00, 0x6c, 0x14, 0xa1, 0x80, 0x02, 0x01, /* 0x30 */
+		0x03, 0x02, 0x01, 0x38, 0x04, 0xff, 0xff, 0xff, /* 0x38 (0x38 is invoke ID, 0x3d is IMSI len, 0x3e-0x45 IMSI) */
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00 };	/* 0x40 */
 
 	static uint8_t tcap_map_raw_v3[] = {
-		0x62, 0x48, 0x48, 0x01, 0x01, 0x6b, 0x80, 0x28,	/* 0x00 */
-		0x80, 0x06, 0x07, 0x00, 0x11, 0x86, 0x05, 0x01, /* 0x08 */
-		0x01, 0x01, 0xa0, 0x80, 0x60, 0x80, 0x80, 0x02, /* 0x10 */
-		0x07, 0x80, 0xa1, 0x80, 0x06, 0x07, 0x04, 0x00, /* 0x18 */
-		0x00, 0x01, 0x00, 0x0e, 0x03, 0x00, 0x00, 0x00, /* 0x20 (0x24 is version)*/
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x6c, /* 0x28 */
-		0x19, 0xa1, 0x80, 0x02, 0x01, 0x01, 0x02, 0x01, /* 0x30 (0x35 is invoke ID) */
-		0x38, 0x30, 0x0d, 0x80, 0x00, 0x00, 0x00, 0x00, /* 0x38 (0x3c is IMSI len, 0x3d-0x44 IMSI) */
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x01, 0x01, /* 0x40 */
-		0x00, 0x00 };					/* 0x48 */
+		0x62, 0x4b, 0x48, 0x04, 0x00, 0x00, 0x00, 0x00, /* 0x00 (0x04-0x07 is OTID) */
+		0x6b, 0x80, 0x28, 0x80, 0x06, 0x07, 0x00, 0x11, /* 0x08 */
+		0x86, 0x05, 0x01, 0x01, 0x01, 0xa0, 0x80, 0x60, /* 0x10 */
+		0x80, 0x80, 0x02, 0x07, 0x80, 0xa1, 0x80, 0x06, /* 0x18 */
+		0x07, 0x04, 0x00, 0x00, 0x01, 0x00, 0x0e, 0x03, /* 0x20 (0x27 is version) */
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* 0x28 */
+		0x00, 0x00, 0x6c, 0x19, 0xa1, 0x80, 0x02, 0x01, /* 0x30 */
+		0x01, 0x02, 0x01, 0x38, 0x30, 0x0d, 0x80, 0x00, /* 0x38 (0x38 is invoke ID, 0x3f is IMSI len, 0x40-0x47 IMSI) */
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* 0x40 */
+		0x02, 0x01, 0x01, 0x00, 0x00 };			/* 0x48 (0x4a is number of requested vectors) */
 
 	sigtran_map_send_auth_info_req_t *req =
 		talloc_get_type_abort(txn->request.data, sigtran_map_send_auth_info_req_t);
@@ -140,8 +141,8 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 		return -1;
 	}
 
-	if (rbtree_num_elements(txn_tree) > UINT8_MAX) {
-		ERROR("Too many outstanding requests, dropping the request");
+	if (rbtree_num_elements(txn_tree) >= conn->conf->map_max_dialogues) {
+		ERROR("Too many outstanding dialogues (%u), dropping the request", conn->conf->map_max_dialogues);
 
 		return -1;
 	}
@@ -153,8 +154,8 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 		msg->l3h = msgb_put(msg, sizeof(tcap_map_raw_v2));
 		memcpy(msg->l3h, tcap_map_raw_v2, sizeof(tcap_map_raw_v2));
 
-		*(msg->l3h + 0x3a) = talloc_array_length(req->imsi);
-		memcpy(msg->l3h + 0x3b, req->imsi, talloc_array_length(req->imsi));
+		*(msg->l3h + 0x3d) = talloc_array_length(req->imsi);
+		memcpy(msg->l3h + 0x3e, req->imsi, talloc_array_length(req->imsi));
 //		RHEXDUMP(0, msg->l3h, sizeof(tcap_map_raw_v2), "MAPv2 Request");
 
 		break;
@@ -165,8 +166,9 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 		msg->l3h = msgb_put(msg, sizeof(tcap_map_raw_v3));
 		memcpy(msg->l3h, tcap_map_raw_v3, sizeof(tcap_map_raw_v3));
 
-		*(msg->l3h + 0x3c) = talloc_array_length(req->imsi);
-		memcpy(msg->l3h + 0x3d, req->imsi, talloc_array_length(req->imsi));
+		*(msg->l3h + 0x3f) = talloc_array_length(req->imsi);
+		memcpy(msg->l3h + 0x40, req->imsi, talloc_array_length(req->imsi));
+		*(msg->l3h + 0x4a) = req->num_vectors;
 //		RHEXDUMP(0, msg->l3h, sizeof(tcap_map_raw_v3), "MAPv3 Request");
 
 		break;
@@ -176,13 +178,17 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 		return -1;
 	}
 
-	/*
-	 *	Set the transaction ID
-	 */
-	txn->ctx.otid = (last_txn_id++) & UINT8_MAX;			/* 8 bit for now */
-
 	txn->ctx.invoke_id++;						/* Needs to be two operations */
 	txn->ctx.invoke_id &= 0x7f;					/* Invoke ID is 7bits */
+
+	/*
+	 *	Set the transaction ID.  The OTID is 32bits, so
+	 *	wrapping around onto a dialogue which is still
+	 *	outstanding is unlikely, but not impossible.
+	 */
+	do {
+		txn->ctx.otid = last_txn_id++;
+	} while (rbtree_finddata(txn_tree, txn));
 	DEBUG2("Sending request with OTID %u Invoke ID %u", txn->ctx.otid, txn->ctx.invoke_id);
 
 	if (!rbtree_insert(txn_tree, txn)) {
@@ -195,8 +201,8 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 	/*
 	 *	Set OTID and Invoke ID in the packet
 	 */
-	*(msg->l3h + 0x04) = txn->ctx.otid;
-	*(msg->l3h + 0x35) = txn->ctx.invoke_id;
+	fr_net_from_uint32(msg->l3h + 0x04, txn->ctx.otid);
+	*(msg->l3h + 0x38) = txn->ctx.invoke_id;
 
 	sccp_write(msg, &conn->conf->sccp_calling_sockaddr, &conn->conf->sccp_called_sockaddr,
 		   SCCP_PROTOCOL_RETURN_MESSAGE << 4 | SCCP_PROTOCOL_CLASS_0, ctx);	/* Class is connectionless (ish) */
@@ -230,6 +236,7 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 
 	struct osmo_fd		*ofd;
 	sigtran_vector_t	**last;
+	size_t			dtid_len, i;
 
 	memset(&find, 0, sizeof(find));
 
@@ -238,7 +245,21 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 	DEBUG3("Got %zu bytes of L4 data", (size_t)msgb_l3len(msg));
 //	log_request_hex(L_DBG, L_DBG_LVL_3, request, msg->l3h, (size_t)msgb_l3len(msg));
 
-	find.ctx.otid = *(msg->l3h + 0x5);
+	/*
+	 *	The DTID is the OTID we sent, and may be between
+	 *	1 and 4 bytes long.  Everything after it is shifted
+	 *	by however many extra bytes it uses.
+	 */
+	if ((len < 0x05) || (tcap[0x03] != 0x49)) {
+		ERROR("Response too short, or missing DTID");
+		return -1;
+	}
+	dtid_len = tcap[0x04];
+	if ((dtid_len < 1) || (dtid_len > sizeof(find.ctx.otid)) || (len < (0x05 + dtid_len))) {
+		ERROR("Invalid DTID length %zu", dtid_len);
+		return -1;
+	}
+	for (i = 0; i < dtid_len; i++) find.ctx.otid = (find.ctx.otid << 8) | tcap[0x05 + i];
 
 	// find.ctx.invoke_id = *(msg->l3h + 0x34);
 	find.ctx.invoke_id = 1;				/* Always 1 for now... */
@@ -292,8 +313,8 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 	 *	Umm.. fixme?
 	 */
 	if (req->version == 2) {
-		p = tcap + 0x40;
-		while (p < end) {
+		p = tcap + 0x40 + (dtid_len - 1);
+		while ((p + 2) < end) {
 			if ((p[0] != 0x30) || (p[1] != 0x22)) {
 				DEBUG4("Breaking out of parsing loop at %x", (uint32_t)(p - tcap));
 				break;
@@ -311,17 +332,31 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 			last = &(vec->next);
 		}
 	} else if (req->version == 3) {
-		p = tcap + 0x40; /* fixed offset for now */
+		p = tcap + 0x40 + (dtid_len - 1); /* fixed offset for now */
 
-		MEM(vec = talloc_zero(res, sigtran_vector_t));
-		vec->type = SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS;
-		sigtran_memdup(umts.rand);
-		sigtran_memdup(umts.xres);
-		sigtran_memdup(umts.ck);
-		sigtran_memdup(umts.ik);
-		sigtran_memdup(umts.authn);
+		/*
+		 *	The first quintuplet is at a fixed offset, if
+		 *	more than one was requested, the others follow
+		 *	it, each in its own SEQUENCE.
+		 */
+		for (;;) {
+			MEM(vec = talloc_zero(res, sigtran_vector_t));
+			vec->type = SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS;
+			sigtran_memdup(umts.rand);
+			sigtran_memdup(umts.xres);
+			sigtran_memdup(umts.ck);
+			sigtran_memdup(umts.ik);
+			sigtran_memdup(umts.authn);
+
+			*last = vec;
+			last = &(vec->next);
 
-		*last = vec;
+			if (((p + 2) >= end) || (p[0] != 0x30) || (p[1] & 0x80)) {
+				DEBUG4("Breaking out of parsing loop at %x", (uint32_t)(p - tcap));
+				break;
+			}
+			p += 2;
+		}
 	}
 
 	if (sigtran_event_submit(ofd, txn) < 0) {
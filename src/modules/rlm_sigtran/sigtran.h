@@ -169,6 +169,10 @@ typedef struct sigtran_conn_conf {
 	struct sockaddr_sccp		sccp_called_sockaddr;		//!< Parsed version of the above
 
 	vp_tmpl_t			*map_version;			//!< Application context version.
+	uint32_t			map_num_vectors;		//!< How many quintuplets to request in
+									///< each MAPv3 SendAuthInfo.
+	uint32_t			map_max_dialogues;		//!< Maximum number of TCAP dialogues we
+									///< allow to be outstanding at once.
 } sigtran_conn_conf_t;
 
 /** Represents a connection to a remote SS7 entity
@@ -195,6 +199,14 @@ typedef struct sigtran_map_send_auth_info_req {
 
 typedef struct sigtran_vector sigtran_vector_t;
 
+typedef struct sigtran_vector_cache_s sigtran_vector_cache_t;
+
+/** How many vectors a single EAP-SIM or EAP-AKA authentication consumes
+ *
+ * EAP-SIM uses three triplets, EAP-AKA uses one quintuplet.
+ */
+#define SIGTRAN_VECTORS_PER_AUTH(_version) (((_version) == 2) ? 3 : 1)
+
 /** Authentication vector returned by HLR
  *
  */
@@ -234,12 +246,28 @@ typedef struct rlm_sigtran {
 	sigtran_conn_conf_t	conn_conf;				//!< Connection configuration
 
 	vp_tmpl_t		*imsi;					//!< Subscriber identifier.
+
+	uint32_t		cache_max_entries;			//!< Maximum number of IMSIs to cache
+									///< vectors for.  0 disables the cache.
+	fr_time_delta_t		cache_lifetime;				//!< How long vectors may be cached for.
+	sigtran_vector_cache_t	*cache;					//!< Spare vectors, shared by all workers.
 } rlm_sigtran_t;
 
 extern int ctrl_pipe[2];
 extern uint8_t const ascii_to_tbcd[];
 extern uint8_t const is_char_tbcd[];
 
+/*
+ *	cache.c
+ */
+sigtran_vector_cache_t	*sigtran_vector_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, fr_time_delta_t lifetime);
+
+void	sigtran_vector_cache_add(sigtran_vector_cache_t *cache, uint8_t const *imsi, uint8_t version,
+				 sigtran_vector_t *vector, fr_time_t now);
+
+sigtran_vector_t *sigtran_vector_cache_get(TALLOC_CTX *ctx, sigtran_vector_cache_t *cache,
+					   uint8_t const *imsi, uint8_t version, unsigned int num, fr_time_t now);
+
 /*
  *	client.c
  */
@@ -38,10 +38,40 @@
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/util/debug.h>
 
+#include <freeradius-devel/util/hash.h>
+
 #include <cassandra.h>
 
 #include "rlm_sql.h"
 
+/** Most prepared statements to cache
+ *
+ * Queries are only prepared when prepared_statements is enabled, in which case
+ * there's one per configured query, so this is only reached if they're generated
+ * dynamically.
+ */
+#define CASS_MAX_PREPARED	(1024)
+
+/** Wakes the worker when the future for a query is set
+ *
+ * The driver's IO threads write to this, so it's allocated with malloc,
+ * and freed when the connection and the callbacks of any futures still
+ * outstanding have all released it.
+ */
+typedef struct {
+	int			fd[2];				//!< Written by future callbacks, read by the worker.
+	atomic_uint_fast32_t	refs;				//!< One for the connection, plus one per future
+								///< with a callback pending.
+} rlm_sql_cassandra_notify_t;
+
+/** A statement prepared from a parameterised query
+ *
+ */
+typedef struct {
+	char const		*query;				//!< Query as expanded by rlm_sql, with $1, $2, etc.
+	CassPrepared const	*prepared;			//!< The query, prepared with '?' markers.
+} rlm_sql_cassandra_prepared_t;
+
 /** Cassandra cluster connection
  *
  */
@@ -49,6 +79,10 @@ typedef struct {
 	CassResult const	*result;			//!< Result from executing a query.
 	CassIterator		*iterator;			//!< Row set iterator.
 
+	CassFuture		*future;			//!< Query which has been submitted, but whose
+								///< result hasn't been retrieved.
+	rlm_sql_cassandra_notify_t *notify;			//!< Signalled when future is set.
+
 	TALLOC_CTX		*log_ctx;			//!< Prevent unneeded memory allocation by keeping a
 								//!< permanent pool, to store log entries.
 	sql_log_entry_t		last_error;
@@ -66,6 +100,10 @@ typedef struct {
 	pthread_mutex_t		connect_mutex;			//!< Mutex to prevent multiple connections attempting
 								//!< to connect a keyspace concurrently.
 
+	fr_hash_table_t		*prepared;			//!< Prepared statements, shared by all connections
+								///< as they belong to the session.
+	pthread_mutex_t		prepared_mutex;			//!< Protects prepared.
+
 	/*
 	 *	Configuration options
 	 */
@@ -365,6 +403,32 @@ static void sql_set_last_error_printf(rlm_sql_cassandra_conn_t *conn, char const
 	conn->last_error.type = L_ERR;
 }
 
+static void sql_notify_release(rlm_sql_cassandra_notify_t *notify)
+{
+	if (atomic_fetch_sub(&notify->refs, 1) != 1) return;
+
+	close(notify->fd[0]);
+	close(notify->fd[1]);
+	free(notify);
+}
+
+/** Called by one of the driver's IO threads when a future is set
+ *
+ */
+static void _sql_future_ready(UNUSED CassFuture *future, void *uctx)
+{
+	rlm_sql_cassandra_notify_t	*notify = uctx;
+	uint8_t				c = 0;
+
+	/*
+	 *	If the pipe is full the worker already has
+	 *	something to read, which is all we need.
+	 */
+	while ((write(notify->fd[1], &c, sizeof(c)) < 0) && (errno == EINTR));
+
+	sql_notify_release(notify);
+}
+
 static int _sql_socket_destructor(rlm_sql_cassandra_conn_t *conn)
 {
 	DEBUG2("Socket destructor called, closing socket");
@@ -372,6 +436,13 @@ static int _sql_socket_destructor(rlm_sql_cassandra_conn_t *conn)
 	if (conn->iterator) cass_iterator_free(conn->iterator);
 	if (conn->result) cass_result_free(conn->result);
 
+	/*
+	 *	Any callback still pending holds its own
+	 *	reference to notify.
+	 */
+	if (conn->future) cass_future_free(conn->future);
+	if (conn->notify) sql_notify_release(conn->notify);
+
 	return 0;
 }
 
@@ -421,23 +492,357 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *c
 	}
 	conn->log_ctx = talloc_pool(conn, 1024);	/* Pre-allocate some memory for log messages */
 
+	conn->notify = malloc(sizeof(*conn->notify));
+	if (!conn->notify) {
+		ERROR("Out of memory");
+		return RLM_SQL_ERROR;
+	}
+	if (pipe(conn->notify->fd) < 0) {
+		ERROR("Failed creating notification pipe: %s", fr_syserror(errno));
+		free(conn->notify);
+		conn->notify = NULL;
+		return RLM_SQL_ERROR;
+	}
+	atomic_init(&conn->notify->refs, 1);
+
+	if ((fr_nonblock(conn->notify->fd[0]) < 0) || (fr_nonblock(conn->notify->fd[1]) < 0)) {
+		ERROR("Failed setting notification pipe to non-blocking: %s", fr_syserror(errno));
+		return RLM_SQL_ERROR;
+	}
+
 	return RLM_SQL_OK;
 }
 
-static sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
+static uint32_t sql_prepared_hash(void const *data)
 {
-	rlm_sql_cassandra_conn_t	*conn = handle->conn;
-	rlm_sql_cassandra_t	*conf = config->driver;
-	CassStatement			*statement;
+	rlm_sql_cassandra_prepared_t const *a = data;
+
+	return fr_hash_string(a->query);
+}
+
+static int sql_prepared_cmp(void const *one, void const *two)
+{
+	rlm_sql_cassandra_prepared_t const *a = one, *b = two;
+
+	return strcmp(a->query, b->query);
+}
+
+static void _sql_prepared_free(void *data)
+{
+	rlm_sql_cassandra_prepared_t *stmt = data;
+
+	cass_prepared_free(stmt->prepared);
+	talloc_free(stmt);
+}
+
+/** Find or prepare the statement for a parameterised query
+ *
+ * Preparing waits for the cluster, but only happens the first time each
+ * query is seen.
+ *
+ * @param[out] out		The prepared statement.
+ * @param[out] cached		Whether out belongs to the cache.  If not, the
+ *				caller must free it with cass_prepared_free.
+ * @param[in] conn		to record errors in.
+ * @param[in] inst		Driver instance.
+ * @param[in] query		with $1, $2 etc. markers, as produced by #sql_query_expand.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR if the query couldn't be prepared.
+ */
+static sql_rcode_t sql_prepared_find(CassPrepared const **out, bool *cached, rlm_sql_cassandra_conn_t *conn,
+				     rlm_sql_cassandra_t *inst, char const *query)
+{
+	rlm_sql_cassandra_prepared_t	*stmt, *found;
 	CassFuture			*future;
 	CassError			ret;
+	char				*cql, *q;
+	char const			*p;
+
+	pthread_mutex_lock(&inst->prepared_mutex);
+	stmt = fr_hash_table_finddata(inst->prepared, &(rlm_sql_cassandra_prepared_t){ .query = query });
+	pthread_mutex_unlock(&inst->prepared_mutex);
+	if (stmt) {
+		*out = stmt->prepared;
+		*cached = true;
+		return RLM_SQL_OK;
+	}
+
+	/*
+	 *	CQL uses '?' for positional markers.  The
+	 *	parameters are numbered in the order they
+	 *	appear, so they're bound by position.
+	 */
+	MEM(cql = q = talloc_array(conn, char, strlen(query) + 1));
+	for (p = query; *p; p++) {
+		if ((p[0] == '$') && isdigit((uint8_t) p[1])) {
+			*q++ = '?';
+			while (isdigit((uint8_t) p[1])) p++;
+			continue;
+		}
+		*q++ = *p;
+	}
+	*q = '\0';
+
+	DEBUG3("Preparing statement: %s", cql);
+	future = cass_session_prepare(inst->session, cql);
+	talloc_free(cql);
+
+	ret = cass_future_error_code(future);
+	if (ret != CASS_OK) {
+		char const	*error;
+		size_t		len;
+
+		cass_future_error_message(future, &error, &len);
+		sql_set_last_error(conn, error, len);
+		cass_future_free(future);
+
+		return (ret == CASS_ERROR_SERVER_SYNTAX_ERROR) || (ret == CASS_ERROR_SERVER_INVALID_QUERY) ?
+			RLM_SQL_QUERY_INVALID : RLM_SQL_ERROR;
+	}
+	*out = cass_future_get_prepared(future);
+	cass_future_free(future);
+
+	pthread_mutex_lock(&inst->prepared_mutex);
+	found = fr_hash_table_finddata(inst->prepared, &(rlm_sql_cassandra_prepared_t){ .query = query });
+	if (found) {
+		/*
+		 *	Another thread prepared it first.
+		 */
+		cass_prepared_free(*out);
+		*out = found->prepared;
+		*cached = true;
+	} else if (fr_hash_table_num_elements(inst->prepared) < CASS_MAX_PREPARED) {
+		MEM(stmt = talloc_zero(inst->prepared, rlm_sql_cassandra_prepared_t));
+		MEM(stmt->query = talloc_typed_strdup(stmt, query));
+		stmt->prepared = *out;
+		*cached = (fr_hash_table_insert(inst->prepared, stmt) == 1);
+		if (!*cached) talloc_free(stmt);
+	} else {
+		*cached = false;
+	}
+	pthread_mutex_unlock(&inst->prepared_mutex);
+
+	return RLM_SQL_OK;
+}
+
+/** Bind the string value of a parameter as the type the statement expects
+ *
+ */
+static int sql_param_bind(rlm_sql_cassandra_conn_t *conn, CassStatement *statement, CassPrepared const *prepared,
+			  size_t i, char const *value)
+{
+	CassDataType const	*data_type;
+	CassValueType		type = CASS_VALUE_TYPE_UNKNOWN;
+	CassError		ret;
+	char			*end;
+
+	data_type = cass_prepared_parameter_data_type(prepared, i);
+	if (data_type) type = cass_data_type_type(data_type);
+
+	switch (type) {
+	case CASS_VALUE_TYPE_BOOLEAN:
+		ret = cass_statement_bind_bool(statement, i,
+					       ((strcmp(value, "1") == 0) || (strcasecmp(value, "true") == 0) ||
+						(strcasecmp(value, "yes") == 0)) ? cass_true : cass_false);
+		break;
+
+	case CASS_VALUE_TYPE_INT:
+	{
+		long v = strtol(value, &end, 10);
+
+		if ((end == value) || *end || (v < INT32_MIN) || (v > INT32_MAX)) goto invalid;
+		ret = cass_statement_bind_int32(statement, i, (cass_int32_t) v);
+	}
+		break;
+
+	case CASS_VALUE_TYPE_BIGINT:
+	case CASS_VALUE_TYPE_COUNTER:
+	case CASS_VALUE_TYPE_TIMESTAMP:
+	{
+		long long v = strtoll(value, &end, 10);
+
+		if ((end == value) || *end) goto invalid;
+		ret = cass_statement_bind_int64(statement, i, (cass_int64_t) v);
+	}
+		break;
+
+	case CASS_VALUE_TYPE_DOUBLE:
+	case CASS_VALUE_TYPE_FLOAT:
+	{
+		double v = strtod(value, &end);
+
+		if ((end == value) || *end) goto invalid;
+		ret = (type == CASS_VALUE_TYPE_DOUBLE) ?
+			cass_statement_bind_double(statement, i, (cass_double_t) v) :
+			cass_statement_bind_float(statement, i, (cass_float_t) v);
+	}
+		break;
+
+	case CASS_VALUE_TYPE_INET:
+	{
+		CassInet inet;
+
+		if (cass_inet_from_string(value, &inet) != CASS_OK) goto invalid;
+		ret = cass_statement_bind_inet(statement, i, inet);
+	}
+		break;
+
+	case CASS_VALUE_TYPE_UUID:
+	case CASS_VALUE_TYPE_TIMEUUID:
+	{
+		CassUuid uuid;
+
+		if (cass_uuid_from_string(value, &uuid) != CASS_OK) goto invalid;
+		ret = cass_statement_bind_uuid(statement, i, uuid);
+	}
+		break;
+
+	case CASS_VALUE_TYPE_BLOB:
+		ret = cass_statement_bind_bytes(statement, i, (cass_byte_t const *) value, strlen(value));
+		break;
+
+	/*
+	 *	Text, and anything we don't know how to convert.
+	 *	The cluster will complain if the latter is wrong.
+	 */
+	default:
+		ret = cass_statement_bind_string(statement, i, value);
+		break;
+	}
+
+	if (ret != CASS_OK) {
+		sql_set_last_error_printf(conn, "Failed binding parameter %zu: %s", i + 1, cass_error_desc(ret));
+		return -1;
+	}
+
+	return 0;
+
+invalid:
+	sql_set_last_error_printf(conn, "Parameter %zu \"%s\" is not valid for its column", i + 1, value);
+	return -1;
+}
+
+/** Build the statement for a query
+ *
+ * Parameterised queries use a prepared statement, which also lets
+ * token aware routing send them straight to a replica owning the
+ * partition.
+ */
+static sql_rcode_t sql_statement_alloc(CassStatement **out, rlm_sql_handle_t *handle, rlm_sql_cassandra_t *inst,
+				       char const *query)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	rlm_sql_params_t const		*params = handle->params;
+	CassStatement			*statement;
+	CassPrepared const		*prepared;
+	bool				cached;
+	sql_rcode_t			rcode;
+	int				i;
+
+	if (!params) {
+		statement = cass_statement_new_n(query, strlen(query), 0);
+		goto done;
+	}
+
+	rcode = sql_prepared_find(&prepared, &cached, conn, inst, params->query);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	statement = cass_prepared_bind(prepared);
+	for (i = 0; i < params->num; i++) {
+		if (sql_param_bind(conn, statement, prepared, i, params->values[i]) < 0) {
+			cass_statement_free(statement);
+			if (!cached) cass_prepared_free(prepared);
+			return RLM_SQL_QUERY_INVALID;
+		}
+	}
 
-	statement = cass_statement_new_n(query, talloc_array_length(query) - 1, 0);
-	if (conf->consistency_str) cass_statement_set_consistency(statement, conf->consistency);
+	/*
+	 *	The statement holds its own reference to
+	 *	the prepared query.
+	 */
+	if (!cached) cass_prepared_free(prepared);
+
+done:
+	if (inst->consistency_str) cass_statement_set_consistency(statement, inst->consistency);
+	*out = statement;
+
+	return RLM_SQL_OK;
+}
 
-	future = cass_session_execute(conf->session, statement);
+/** Send a query, without waiting for the result
+ *
+ * The future's callback writes to a pipe, which the worker waits on
+ * with its event loop, so the worker isn't blocked while the query is
+ * in flight.
+ */
+static sql_rcode_t sql_query_submit(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	rlm_sql_cassandra_t		*inst = config->driver;
+	CassStatement			*statement;
+	sql_rcode_t			rcode;
+
+	fr_assert(!conn->future);
+
+	rcode = sql_statement_alloc(&statement, handle, inst, query);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	conn->future = cass_session_execute(inst->session, statement);
 	cass_statement_free(statement);
 
+	atomic_fetch_add(&conn->notify->refs, 1);
+	if (cass_future_set_callback(conn->future, _sql_future_ready, conn->notify) != CASS_OK) {
+		uint8_t c = 0;
+
+		/*
+		 *	Shouldn't happen, but if it does, wait here
+		 *	and tell the worker the result is ready.
+		 */
+		sql_notify_release(conn->notify);
+		cass_future_wait(conn->future);
+		while ((write(conn->notify->fd[1], &c, sizeof(c)) < 0) && (errno == EINTR));
+	}
+
+	return RLM_SQL_OK;
+}
+
+static int sql_query_socket(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_cassandra_conn_t *conn = handle->conn;
+
+	return conn->notify->fd[0];
+}
+
+static int sql_query_busy(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	uint8_t				buffer[16];
+
+	/*
+	 *	A late write from the previous query's callback
+	 *	may have woken us early, so check the future.
+	 */
+	while (read(conn->notify->fd[0], buffer, sizeof(buffer)) > 0);
+
+	if (!conn->future) return -1;
+
+	return (cass_future_ready(conn->future) == cass_true) ? 0 : 1;
+}
+
+/** Process the result of a query sent with sql_query_submit
+ *
+ * Blocks if the future isn't set yet.
+ */
+static sql_rcode_t sql_query_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	CassFuture			*future = conn->future;
+	CassError			ret;
+
+	if (!future) return RLM_SQL_ERROR;
+	conn->future = NULL;
+
 	ret = cass_future_error_code(future);
 	if (ret != CASS_OK) {
 		char const	*error;
@@ -463,6 +868,16 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
 	return RLM_SQL_OK;
 }
 
+static sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
+{
+	sql_rcode_t rcode;
+
+	rcode = sql_query_submit(handle, config, query);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	return sql_query_result(handle, config);
+}
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_cassandra_conn_t *conn = handle->conn;
@@ -702,11 +1117,19 @@ static int mod_detach(void *instance)
 {
 	rlm_sql_cassandra_t *inst = instance;
 
+	/*
+	 *	Prepared statements belong to the session,
+	 *	so must be freed first.
+	 */
+	fr_hash_table_free(inst->prepared);
+	inst->prepared = NULL;
+
 	if (inst->ssl) cass_ssl_free(inst->ssl);
 	if (inst->session) cass_session_free(inst->session);	/* also synchronously closes the session */
 	if (inst->cluster) cass_cluster_free(inst->cluster);
 
 	pthread_mutex_destroy(&inst->connect_mutex);
+	pthread_mutex_destroy(&inst->prepared_mutex);
 
 	return 0;
 }
@@ -734,6 +1157,12 @@ do {\
 		return -1;
 	}
 
+	if (pthread_mutex_init(&inst->prepared_mutex, NULL) < 0) {
+		ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+	MEM(inst->prepared = fr_hash_table_create(inst, sql_prepared_hash, sql_prepared_cmp, _sql_prepared_free));
+
 	/*
 	 *	This has to be done before we call cf_section_parse
 	 *	as it sets default values, and creates the section.
@@ -950,6 +1379,7 @@ extern rlm_sql_driver_t rlm_sql_cassandra;
 rlm_sql_driver_t rlm_sql_cassandra = {
 	.name				= "rlm_sql_cassandra",
 	.magic				= RLM_MODULE_INIT,
+	.flags				= RLM_SQL_FLAGS_PARAMS,
 	.inst_size			= sizeof(rlm_sql_cassandra_t),
 	.onload				= mod_load,
 	.unload				= mod_unload,
@@ -967,5 +1397,9 @@ rlm_sql_driver_t rlm_sql_cassandra = {
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_query
+	.sql_finish_select_query	= sql_finish_query,
+	.sql_query_submit		= sql_query_submit,
+	.sql_query_socket		= sql_query_socket,
+	.sql_query_busy			= sql_query_busy,
+	.sql_query_result		= sql_query_result
 };
@@ -32,6 +32,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 
 #include <sys/stat.h>
+#include <poll.h>
 
 #include "config.h"
 
@@ -69,6 +70,15 @@ DIAG_ON(strict-prototypes)
 #define HAVE_TLS_VERIFY_OPTIONS 0
 #endif
 
+/*
+ *	The non-blocking API is only provided by the MariaDB client libraries.
+ */
+#ifdef MYSQL_WAIT_READ
+#define HAVE_NONBLOCK_API	1
+#else
+#define HAVE_NONBLOCK_API	0
+#endif
+
 #include "rlm_sql.h"
 
 typedef enum {
@@ -88,6 +98,11 @@ typedef struct {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
+#if HAVE_NONBLOCK_API
+	int		async_status;		//!< What the non-blocking API is waiting for.
+						///< 0 if there's no query in progress.
+	int		async_ret;		//!< Result of the last non-blocking query.
+#endif
 } rlm_sql_mysql_conn_t;
 
 typedef struct {
@@ -273,6 +288,14 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *c
 
 	mysql_options(&(conn->db), MYSQL_READ_DEFAULT_GROUP, "freeradius");
 
+#if HAVE_NONBLOCK_API
+	/*
+	 *	Doesn't stop the blocking API from working,
+	 *	just lets us use the non-blocking one too.
+	 */
+	mysql_options(&(conn->db), MYSQL_OPT_NONBLOCK, 0);
+#endif
+
 	/*
 	 *	We need to know about connection errors, and are capable
 	 *	of reconnecting automatically.
@@ -441,6 +464,91 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return RLM_SQL_OK;
 }
 
+#if HAVE_NONBLOCK_API
+/** Finish writing a query which didn't fit into the socket buffer
+ *
+ * We only wait for the socket to become readable when running non-blocking
+ * queries, so if the client library needs to write more, do it here.
+ * This only blocks if the server isn't reading from the socket.
+ */
+static sql_rcode_t sql_query_write_wait(rlm_sql_mysql_conn_t *conn, rlm_sql_config_t *config)
+{
+	while (conn->async_status & MYSQL_WAIT_WRITE) {
+		struct pollfd	pfd = { .fd = mysql_get_socket(conn->sock), .events = POLLOUT };
+		int		r;
+
+		r = poll(&pfd, 1, config->query_timeout ? (int)config->query_timeout * 1000 : -1);
+		if (r == 0) {
+			ERROR("Socket write timeout after %d seconds", config->query_timeout);
+			return RLM_SQL_RECONNECT;
+		}
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			ERROR("Failed in poll: %s", fr_syserror(errno));
+			return RLM_SQL_RECONNECT;
+		}
+
+		conn->async_status = mysql_real_query_cont(&conn->async_ret, conn->sock, MYSQL_WAIT_WRITE);
+	}
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_query_submit(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	conn->async_status = mysql_real_query_start(&conn->async_ret, conn->sock, query, strlen(query));
+
+	return sql_query_write_wait(conn, config);
+}
+
+static int sql_query_socket(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	return mysql_get_socket(conn->sock);
+}
+
+static int sql_query_busy(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	if (!conn->async_status) return 0;
+
+	conn->async_status = mysql_real_query_cont(&conn->async_ret, conn->sock, MYSQL_WAIT_READ);
+	if (sql_query_write_wait(conn, config) != RLM_SQL_OK) return -1;
+
+	return (conn->async_status != 0);
+}
+
+static sql_rcode_t sql_query_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+	sql_rcode_t rcode;
+	char const *info;
+
+	if (conn->async_status) {
+		ERROR("Query result is incomplete");
+		return RLM_SQL_RECONNECT;
+	}
+
+	rcode = sql_check_error(conn->sock, 0);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	/* Only returns non-null string for INSERTS */
+	info = mysql_info(conn->sock);
+	if (info) DEBUG2("%s", info);
+
+	return RLM_SQL_OK;
+}
+#endif
+
 static sql_rcode_t sql_store_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
@@ -864,5 +972,11 @@ rlm_sql_driver_t rlm_sql_mysql = {
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
 	.sql_finish_select_query	= sql_finish_query,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+#if HAVE_NONBLOCK_API
+	.sql_query_submit		= sql_query_submit,
+	.sql_query_socket		= sql_query_socket,
+	.sql_query_busy			= sql_query_busy,
+	.sql_query_result		= sql_query_result
+#endif
 };
@@ -56,6 +56,12 @@ RCSID("$Id$")
 #  define NAMEDATALEN 64
 #endif
 
+/** Most statements prepared on a connection
+ *
+ * Queries beyond this are still run with parameters, but not prepared.
+ */
+#define PG_MAX_STATEMENTS	256
+
 /** PostgreSQL configuration
  *
  */
@@ -72,8 +78,19 @@ typedef struct {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+
+	fr_hash_table_t	*statements;		//!< Statements prepared on this connection.
+	uint32_t	next_statement;		//!< Used to name the next statement.
 } rlm_sql_postgres_conn_t;
 
+/** A statement prepared on a connection
+ *
+ */
+typedef struct {
+	char const	*query;			//!< Text of the statement.
+	char		name[16];		//!< Name it was prepared with.
+} rlm_sql_postgres_stmt_t;
+
 static CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("send_application_name", FR_TYPE_BOOL, rlm_sql_postgres_t, send_application_name), .dflt = "yes" },
 	CONF_PARSER_TERMINATOR
@@ -213,6 +230,20 @@ static sql_rcode_t sql_classify_error(UNUSED PGresult const *result)
 }
 #endif
 
+static uint32_t sql_stmt_hash(void const *data)
+{
+	rlm_sql_postgres_stmt_t const *stmt = data;
+
+	return fr_hash_string(stmt->query);
+}
+
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	rlm_sql_postgres_stmt_t const *a = one, *b = two;
+
+	return strcmp(a->query, b->query);
+}
+
 static int _sql_socket_destructor(rlm_sql_postgres_conn_t *conn)
 {
 	DEBUG2("Socket destructor called, closing socket");
@@ -233,6 +264,7 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 
 	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_postgres_conn_t));
 	talloc_set_destructor(conn, _sql_socket_destructor);
+	MEM(conn->statements = fr_hash_table_create(conn, sql_stmt_hash, sql_stmt_cmp, NULL));
 
 	DEBUG2("Connecting using parameters: %s", inst->db_string);
 	conn->db = PQconnectdb(inst->db_string);
@@ -254,67 +286,107 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
-static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
-					      char const *query)
+/** Send a query with parameters, preparing it on first use
+ *
+ */
+static int sql_send_params(rlm_sql_postgres_conn_t *conn, rlm_sql_params_t const *params)
+{
+	rlm_sql_postgres_stmt_t	*stmt;
+	PGresult		*result;
+
+	stmt = fr_hash_table_finddata(conn->statements, &(rlm_sql_postgres_stmt_t){ .query = params->query });
+	if (stmt) goto send;
+
+	if (fr_hash_table_num_elements(conn->statements) >= PG_MAX_STATEMENTS) {
+		return PQsendQueryParams(conn->db, params->query, params->num, NULL, params->values, NULL, NULL, 0);
+	}
+
+	MEM(stmt = talloc_zero(conn, rlm_sql_postgres_stmt_t));
+	snprintf(stmt->name, sizeof(stmt->name), "fr_%" PRIu32, conn->next_statement++);
+
+	DEBUG3("Preparing statement %s", stmt->name);
+	result = PQprepare(conn->db, stmt->name, params->query, params->num, NULL);
+	if (!result) {
+		talloc_free(stmt);
+		return 0;
+	}
+
+	/*
+	 *	Let the unprepared query report what's wrong with it.
+	 */
+	if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+		PQclear(result);
+		talloc_free(stmt);
+		return PQsendQueryParams(conn->db, params->query, params->num, NULL, params->values, NULL, NULL, 0);
+	}
+	PQclear(result);
+
+	MEM(stmt->query = talloc_typed_strdup(stmt, params->query));
+	if (!fr_hash_table_insert(conn->statements, stmt)) {
+		talloc_free(stmt);
+		return PQsendQueryParams(conn->db, params->query, params->num, NULL, params->values, NULL, NULL, 0);
+	}
+
+send:
+	return PQsendQueryPrepared(conn->db, stmt->name, params->num, params->values, NULL, NULL, 0);
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_submit(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						     char const *query)
 {
 	rlm_sql_postgres_conn_t	*conn = handle->conn;
-	rlm_sql_postgres_t	*inst = config->driver;
-	fr_time_delta_t		timeout = fr_time_delta_from_sec(config->query_timeout);
-	fr_time_t		start;
-	int			sockfd;
-	PGresult		*tmp_result;
-	int			numfields = 0;
-	ExecStatusType		status;
 
 	if (!conn->db) {
 		ERROR("Socket not connected");
 		return RLM_SQL_RECONNECT;
 	}
 
-	sockfd = PQsocket(conn->db);
-	if (sockfd < 0) {
+	if (PQsocket(conn->db) < 0) {
 		ERROR("Unable to obtain socket: %s", PQerrorMessage(conn->db));
 		return RLM_SQL_RECONNECT;
 	}
 
-	if (!PQsendQuery(conn->db, query)) {
+	if (!(handle->params ? sql_send_params(conn, handle->params) : PQsendQuery(conn->db, query))) {
 		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
 		return RLM_SQL_RECONNECT;
 	}
 
-	/*
-	 *  We try to avoid blocking by waiting until the driver indicates that
-	 *  the result is ready or our timeout expires
-	 */
-	start = fr_time();
-	while (PQisBusy(conn->db)) {
-		int		r;
-		fd_set		read_fd;
-		fr_time_delta_t	elapsed = 0;
+	return RLM_SQL_OK;
+}
 
-		FD_ZERO(&read_fd);
-		FD_SET(sockfd, &read_fd);
+static int sql_query_socket(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
 
-		if (config->query_timeout) {
-			elapsed = fr_time() - start;
-			if (elapsed >= timeout) goto too_long;
-		}
+	return PQsocket(conn->db);
+}
 
-		r = select(sockfd + 1, &read_fd, NULL, NULL, config->query_timeout ? &fr_time_delta_to_timeval(timeout - elapsed) : NULL);
-		if (r == 0) {
-		too_long:
-			ERROR("Socket read timeout after %d seconds", config->query_timeout);
-			return RLM_SQL_RECONNECT;
-		}
-		if (r < 0) {
-			if (errno == EINTR) continue;
-			ERROR("Failed in select: %s", fr_syserror(errno));
-			return RLM_SQL_RECONNECT;
-		}
-		if (!PQconsumeInput(conn->db)) {
-			ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
-			return RLM_SQL_RECONNECT;
-		}
+static int sql_query_busy(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!PQconsumeInput(conn->db)) {
+		ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
+		return -1;
+	}
+
+	return PQisBusy(conn->db);
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_result(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	rlm_sql_postgres_t	*inst = config->driver;
+	PGresult		*tmp_result;
+	int			numfields = 0;
+	ExecStatusType		status;
+
+	/*
+	 *  PQgetResult() would block
+	 */
+	if (PQisBusy(conn->db)) {
+		ERROR("Query result is incomplete");
+		return RLM_SQL_RECONNECT;
 	}
 
 	/*
@@ -385,7 +457,59 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 		break;
 	}
 
-	return sql_classify_error(inst, status, conn->result);;
+	return sql_classify_error(inst, status, conn->result);
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					      char const *query)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	fr_time_delta_t		timeout = fr_time_delta_from_sec(config->query_timeout);
+	fr_time_t		start;
+	int			sockfd;
+	sql_rcode_t		rcode;
+
+	rcode = sql_query_submit(handle, config, query);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	sockfd = PQsocket(conn->db);
+
+	/*
+	 *  We try to avoid blocking by waiting until the driver indicates that
+	 *  the result is ready or our timeout expires
+	 */
+	start = fr_time();
+	while (PQisBusy(conn->db)) {
+		int		r;
+		fd_set		read_fd;
+		fr_time_delta_t	elapsed = 0;
+
+		FD_ZERO(&read_fd);
+		FD_SET(sockfd, &read_fd);
+
+		if (config->query_timeout) {
+			elapsed = fr_time() - start;
+			if (elapsed >= timeout) goto too_long;
+		}
+
+		r = select(sockfd + 1, &read_fd, NULL, NULL, config->query_timeout ? &fr_time_delta_to_timeval(timeout - elapsed) : NULL);
+		if (r == 0) {
+		too_long:
+			ERROR("Socket read timeout after %d seconds", config->query_timeout);
+			return RLM_SQL_RECONNECT;
+		}
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			ERROR("Failed in select: %s", fr_syserror(errno));
+			return RLM_SQL_RECONNECT;
+		}
+		if (!PQconsumeInput(conn->db)) {
+			ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
+			return RLM_SQL_RECONNECT;
+		}
+	}
+
+	return sql_query_result(handle, config);
 }
 
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t *config, char const *query)
@@ -657,7 +781,7 @@ extern rlm_sql_driver_t rlm_sql_postgresql;
 rlm_sql_driver_t rlm_sql_postgresql = {
 	.name				= "rlm_sql_postgresql",
 	.magic				= RLM_MODULE_INIT,
-	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,
+	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY | RLM_SQL_FLAGS_PARAMS,
 	.inst_size			= sizeof(rlm_sql_postgres_t),
 	.onload				= mod_load,
 	.config				= driver_config,
@@ -672,5 +796,9 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
 	.sql_affected_rows		= sql_affected_rows,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_query_submit		= sql_query_submit,
+	.sql_query_socket		= sql_query_socket,
+	.sql_query_busy			= sql_query_busy,
+	.sql_query_result		= sql_query_result
 };
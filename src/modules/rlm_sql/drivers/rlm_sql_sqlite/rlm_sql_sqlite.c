@@ -31,6 +31,8 @@ RCSID("$Id$")
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <freeradius-devel/util/hash.h>
+
 #include <sqlite3.h>
 
 #include "rlm_sql.h"
@@ -49,20 +51,39 @@ RCSID("$Id$")
 typedef sqlite_int64 sqlite3_int64;
 #endif
 
+/** A statement kept for reuse
+ *
+ */
+typedef struct {
+	char const	*query;		//!< Parameterised query the statement was prepared from.
+	sqlite3_stmt	*statement;
+} rlm_sql_sqlite_stmt_t;
+
 typedef struct {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
+	bool cached;			//!< statement belongs to statements, so is reset, not finalized.
 	int col_count;
+	fr_value_box_t *values;		//!< Current row, for sql_fetch_values.
+	fr_hash_table_t *statements;	//!< Prepared statements for parameterised queries.
 } rlm_sql_sqlite_conn_t;
 
 typedef struct {
 	char const	*filename;
 	uint32_t	busy_timeout;
+	char const	*journal_mode;
+	char const	*synchronous;
+	uint64_t	mmap_size;
+	uint32_t	statement_cache;
 } rlm_sql_sqlite_t;
 
 static const CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED, rlm_sql_sqlite_t, filename) },
 	{ FR_CONF_OFFSET("busy_timeout", FR_TYPE_UINT32, rlm_sql_sqlite_t, busy_timeout), .dflt = "200" },
+	{ FR_CONF_OFFSET("journal_mode", FR_TYPE_STRING | FR_TYPE_NOT_EMPTY, rlm_sql_sqlite_t, journal_mode) },
+	{ FR_CONF_OFFSET("synchronous", FR_TYPE_STRING | FR_TYPE_NOT_EMPTY, rlm_sql_sqlite_t, synchronous) },
+	{ FR_CONF_OFFSET("mmap_size", FR_TYPE_SIZE, rlm_sql_sqlite_t, mmap_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("statement_cache", FR_TYPE_UINT32, rlm_sql_sqlite_t, statement_cache), .dflt = "64" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -384,6 +405,13 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 
 	DEBUG2("Socket destructor called, closing socket");
 
+	/*
+	 *	Statements must be finalized before the
+	 *	database can be closed.
+	 */
+	if (conn->statement && !conn->cached) (void) sqlite3_finalize(conn->statement);
+	fr_hash_table_free(conn->statements);
+
 	if (conn->db) {
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) WARN("Got SQLite error when closing socket: %s",
@@ -393,6 +421,45 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 	return 0;
 }
 
+static uint32_t sql_stmt_hash(void const *data)
+{
+	rlm_sql_sqlite_stmt_t const *a = data;
+
+	return fr_hash_string(a->query);
+}
+
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	rlm_sql_sqlite_stmt_t const *a = one, *b = two;
+
+	return strcmp(a->query, b->query);
+}
+
+static void _sql_stmt_free(void *data)
+{
+	rlm_sql_sqlite_stmt_t *stmt = data;
+
+	(void) sqlite3_finalize(stmt->statement);
+	talloc_free(stmt);
+}
+
+/** Run a PRAGMA, ignoring any row it returns
+ *
+ */
+static int sql_pragma(sqlite3 *db, char const *pragma, char const *value)
+{
+	char	*query;
+	int	status;
+
+	query = sqlite3_mprintf("PRAGMA %s = %s", pragma, value);
+	if (!query) return SQLITE_NOMEM;
+
+	status = sqlite3_exec(db, query, NULL, NULL, NULL);
+	sqlite3_free(query);
+
+	return status;
+}
+
 static void _sql_greatest(sqlite3_context *ctx, int num_values, sqlite3_value **values)
 {
 	int i;
@@ -459,41 +526,124 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 		return RLM_SQL_ERROR;
 	}
 
+	/*
+	 *	journal_mode is stored in the database, so this
+	 *	only changes anything for the first connection.
+	 */
+	if (inst->journal_mode) {
+		status = sql_pragma(conn->db, "journal_mode", inst->journal_mode);
+		if (sql_check_error(conn->db, status) != RLM_SQL_OK) {
+			sql_print_error(conn->db, status, "Failed setting journal_mode");
+			return RLM_SQL_ERROR;
+		}
+	}
+
+	if (inst->synchronous) {
+		status = sql_pragma(conn->db, "synchronous", inst->synchronous);
+		if (sql_check_error(conn->db, status) != RLM_SQL_OK) {
+			sql_print_error(conn->db, status, "Failed setting synchronous");
+			return RLM_SQL_ERROR;
+		}
+	}
+
+	if (inst->mmap_size) {
+		char buffer[32];
+
+		snprintf(buffer, sizeof(buffer), "%" PRIu64, inst->mmap_size);
+		status = sql_pragma(conn->db, "mmap_size", buffer);
+		if (sql_check_error(conn->db, status) != RLM_SQL_OK) {
+			sql_print_error(conn->db, status, "Failed setting mmap_size");
+			return RLM_SQL_ERROR;
+		}
+	}
+
+	if (inst->statement_cache) {
+		MEM(conn->statements = fr_hash_table_create(conn, sql_stmt_hash, sql_stmt_cmp, _sql_stmt_free));
+	}
+
 	return RLM_SQL_OK;
 }
 
-static sql_rcode_t sql_select_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, char const *query)
+/** Prepare a query, or reuse the statement from an earlier one
+ *
+ * Parameterised queries (see prepared_statements in rlm_sql) have the
+ * same text every time, so their statements are cached, and the values
+ * are bound to the $1, $2 etc. markers.
+ */
+static sql_rcode_t sql_prepare(rlm_sql_handle_t *handle, rlm_sql_sqlite_t *inst, char const *query)
 {
 	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	rlm_sql_params_t const	*params = handle->params;
+	rlm_sql_sqlite_stmt_t	*stmt = NULL;
 	char const		*z_tail;
-	int			status;
+	sql_rcode_t		rcode;
+	int			status, i;
+
+	conn->col_count = 0;
+	conn->cached = false;
+
+	if (params && conn->statements) {
+		stmt = fr_hash_table_finddata(conn->statements, &(rlm_sql_sqlite_stmt_t){ .query = params->query });
+		if (stmt) {
+			conn->statement = stmt->statement;
+			conn->cached = true;
+			goto bind;
+		}
+	}
 
 #ifdef HAVE_SQLITE3_PREPARE_V2
 	status = sqlite3_prepare_v2(conn->db, query, strlen(query), &conn->statement, &z_tail);
 #else
 	status = sqlite3_prepare(conn->db, query, strlen(query), &conn->statement, &z_tail);
 #endif
+	rcode = sql_check_error(conn->db, status);
+	if (rcode != RLM_SQL_OK) return rcode;
 
-	conn->col_count = 0;
+	if (!params) return RLM_SQL_OK;
 
-	return sql_check_error(conn->db, status);
+	if (conn->statements && (fr_hash_table_num_elements(conn->statements) < (int) inst->statement_cache)) {
+		MEM(stmt = talloc_zero(conn->statements, rlm_sql_sqlite_stmt_t));
+		MEM(stmt->query = talloc_typed_strdup(stmt, params->query));
+		stmt->statement = conn->statement;
+
+		if (fr_hash_table_insert(conn->statements, stmt) == 1) {
+			conn->cached = true;
+		} else {
+			talloc_free(stmt);
+		}
+	}
+
+bind:
+	for (i = 0; i < params->num; i++) {
+		char	name[16];
+		int	idx;
+
+		snprintf(name, sizeof(name), "$%i", i + 1);
+		idx = sqlite3_bind_parameter_index(conn->statement, name);
+		if (idx == 0) continue;
+
+		status = sqlite3_bind_text(conn->statement, idx, params->values[i], -1, SQLITE_TRANSIENT);
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+	}
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_select_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
+{
+	return sql_prepare(handle, config->driver, query);
 }
 
 
-static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, char const *query)
+static sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
 {
 
 	sql_rcode_t		rcode;
 	rlm_sql_sqlite_conn_t	*conn = handle->conn;
-	char const		*z_tail;
 	int			status;
 
-#ifdef HAVE_SQLITE3_PREPARE_V2
-	status = sqlite3_prepare_v2(conn->db, query, strlen(query), &conn->statement, &z_tail);
-#else
-	status = sqlite3_prepare(conn->db, query, strlen(query), &conn->statement, &z_tail);
-#endif
-	rcode = sql_check_error(conn->db, status);
+	rcode = sql_prepare(handle, config->driver, query);
 	if (rcode != RLM_SQL_OK) return rcode;
 
 	status = sqlite3_step(conn->statement);
@@ -613,14 +763,94 @@ static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, r
 	return RLM_SQL_OK;
 }
 
+/** Fetch the next row, as boxes pointing at SQLite's copy of the values
+ *
+ * The pointers returned by sqlite3_column_text/blob remain valid until
+ * the statement is stepped again, which is all sql_fetch_values promises.
+ */
+static sql_rcode_t sql_fetch_values(fr_value_box_t const **out, rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	int status;
+	rlm_sql_sqlite_conn_t *conn = handle->conn;
+
+	int i;
+
+	*out = NULL;
+
+	status = sqlite3_step(conn->statement);
+	if (sql_check_error(conn->db, status) != RLM_SQL_OK) return RLM_SQL_ERROR;
+	if (status == SQLITE_DONE) return RLM_SQL_NO_MORE_ROWS;
+
+	if (conn->col_count == 0) {
+		conn->col_count = sql_num_fields(handle, config);
+		if (conn->col_count == 0) return RLM_SQL_ERROR;
+	}
+
+	if (!conn->values) MEM(conn->values = talloc_array(conn, fr_value_box_t, conn->col_count));
+
+	for (i = 0; i < conn->col_count; i++) {
+		fr_value_box_t *box = &conn->values[i];
+
+		switch (sqlite3_column_type(conn->statement, i)) {
+		case SQLITE_INTEGER:
+			fr_value_box_init(box, FR_TYPE_INT64, NULL, true);
+			box->vb_int64 = sqlite3_column_int64(conn->statement, i);
+			break;
+
+		case SQLITE_FLOAT:
+			fr_value_box_init(box, FR_TYPE_FLOAT64, NULL, true);
+			box->vb_float64 = sqlite3_column_double(conn->statement, i);
+			break;
+
+		case SQLITE_TEXT:
+		{
+			char const *p;
+
+			p = (char const *) sqlite3_column_text(conn->statement, i);
+			if (!p) goto null;
+
+			fr_value_box_bstrndup_shallow(box, NULL, p, sqlite3_column_bytes(conn->statement, i), true);
+		}
+			break;
+
+		case SQLITE_BLOB:
+		{
+			uint8_t const *p;
+
+			p = sqlite3_column_blob(conn->statement, i);
+			if (!p) goto null;
+
+			fr_value_box_memdup_shallow(box, NULL, p, sqlite3_column_bytes(conn->statement, i), true);
+		}
+			break;
+
+		default:
+		null:
+			fr_value_box_init_null(box);
+			break;
+		}
+	}
+
+	*out = conn->values;
+
+	return RLM_SQL_OK;
+}
+
 static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
 
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
+		TALLOC_FREE(conn->values);
 
-		(void) sqlite3_finalize(conn->statement);
+		if (conn->cached) {
+			(void) sqlite3_reset(conn->statement);
+			(void) sqlite3_clear_bindings(conn->statement);
+			conn->cached = false;
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
 		conn->col_count = 0;
 	}
@@ -805,7 +1035,7 @@ extern rlm_sql_driver_t rlm_sql_sqlite;
 rlm_sql_driver_t rlm_sql_sqlite = {
 	.name				= "rlm_sql_sqlite",
 	.magic				= RLM_MODULE_INIT,
-	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,
+	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY | RLM_SQL_FLAGS_PARAMS,
 	.inst_size			= sizeof(rlm_sql_sqlite_t),
 	.config				= driver_config,
 	.onload				= mod_load,
@@ -818,6 +1048,7 @@ rlm_sql_driver_t rlm_sql_sqlite = {
 	.sql_fetch_row			= sql_fetch_row,
 	.sql_fields			= sql_fields,
 	.sql_free_result		= sql_free_result,
+	.sql_fetch_values		= sql_fetch_values,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
 	.sql_finish_select_query	= sql_finish_query
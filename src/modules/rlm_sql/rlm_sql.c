@@ -36,6 +36,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/map_proc.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/pairmove.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/table.h>
 
@@ -69,6 +70,8 @@ static const CONF_PARSER type_config[] = {
 static const CONF_PARSER acct_config[] = {
 	{ FR_CONF_OFFSET("reference", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, accounting.reference), .dflt = ".query" },
 	{ FR_CONF_OFFSET("logfile", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, accounting.logfile) },
+	{ FR_CONF_OFFSET("batch_size", FR_TYPE_UINT32, rlm_sql_config_t, accounting.batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("batch_timeout", FR_TYPE_TIME_DELTA, rlm_sql_config_t, accounting.batch_timeout), .dflt = "0" },
 
 	{ FR_CONF_POINTER("type", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) type_config },
 	CONF_PARSER_TERMINATOR
@@ -82,6 +85,18 @@ static const CONF_PARSER postauth_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER replica_config[] = {
+	{ FR_CONF_OFFSET("server", FR_TYPE_STRING, rlm_sql_config_t, replica.server), .dflt = "" },
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT32, rlm_sql_config_t, replica.port), .dflt = "0" },
+	{ FR_CONF_OFFSET("login", FR_TYPE_STRING, rlm_sql_config_t, replica.login) },
+	{ FR_CONF_OFFSET("password", FR_TYPE_STRING | FR_TYPE_SECRET, rlm_sql_config_t, replica.password) },
+	{ FR_CONF_OFFSET("lag_query", FR_TYPE_STRING | FR_TYPE_NOT_EMPTY, rlm_sql_config_t, replica.lag_query) },
+	{ FR_CONF_OFFSET("max_lag", FR_TYPE_UINT32, rlm_sql_config_t, replica.max_lag), .dflt = "30" },
+	{ FR_CONF_OFFSET("lag_interval", FR_TYPE_TIME_DELTA, rlm_sql_config_t, replica.lag_interval), .dflt = "10" },
+	{ FR_CONF_OFFSET("xlat", FR_TYPE_BOOL, rlm_sql_config_t, replica.xlat), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", FR_TYPE_STRING, rlm_sql_config_t, sql_driver_name), .dflt = "rlm_sql_null" },
 	{ FR_CONF_OFFSET("server", FR_TYPE_STRING, rlm_sql_config_t, sql_server), .dflt = "" },	/* Must be zero length so drivers can determine if it was set */
@@ -91,6 +106,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("radius_db", FR_TYPE_STRING, rlm_sql_config_t, sql_db), .dflt = "radius" },
 	{ FR_CONF_OFFSET("read_groups", FR_TYPE_BOOL, rlm_sql_config_t, read_groups), .dflt = "yes" },
 	{ FR_CONF_OFFSET("read_profiles", FR_TYPE_BOOL, rlm_sql_config_t, read_profiles), .dflt = "yes" },
+	{ FR_CONF_OFFSET("read_clients", FR_TYPE_BOOL, rlm_sql_config_t, read_clients), .dflt = "no" },
+	{ FR_CONF_OFFSET("client_query", FR_TYPE_STRING, rlm_sql_config_t, client_query), .dflt = "SELECT id, nasname, shortname, type, secret, server FROM nas" },
 	{ FR_CONF_OFFSET("sql_user_name", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, query_user), .dflt = "" },
 	{ FR_CONF_OFFSET("group_attribute", FR_TYPE_STRING, rlm_sql_config_t, group_attribute) },
 	{ FR_CONF_OFFSET("logfile", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, logfile) },
@@ -109,10 +126,13 @@ static const CONF_PARSER module_config[] = {
 	 *	This only works for a few drivers.
 	 */
 	{ FR_CONF_OFFSET("query_timeout", FR_TYPE_UINT32, rlm_sql_config_t, query_timeout) },
+	{ FR_CONF_OFFSET("prepared_statements", FR_TYPE_BOOL, rlm_sql_config_t, prepared_statements), .dflt = "no" },
 
 	{ FR_CONF_POINTER("accounting", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) acct_config },
 
 	{ FR_CONF_POINTER("post-auth", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) postauth_config },
+
+	{ FR_CONF_POINTER("read_replica", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) replica_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -181,7 +201,15 @@ static ssize_t sql_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t outlen
 	ssize_t			ret = 0;
 	char const		*p;
 
-	handle = fr_pool_connection_get(inst->pool, request);	/* connection pool should produce error */
+	/*
+	 *	SELECTs only go to the replica if the admin has said
+	 *	they don't need to see the results of earlier writes.
+	 */
+	if (inst->config->replica.xlat && sql_query_is_read(fmt)) {
+		handle = sql_read_handle_get(inst, request);
+	} else {
+		handle = fr_pool_connection_get(inst->pool, request);	/* connection pool should produce error */
+	}
 	if (!handle) return 0;
 
 	rlm_sql_query_log(inst, request, NULL, fmt);
@@ -259,7 +287,7 @@ static ssize_t sql_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t outlen
 	(inst->driver->sql_finish_select_query)(handle, inst->config);
 
 finish:
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 
 	return ret;
 }
@@ -302,6 +330,63 @@ static int _sql_map_proc_get_value(TALLOC_CTX *ctx, VALUE_PAIR **out,
 	return 0;
 }
 
+/** Converts a value returned by the driver's sql_fetch_values into a #VALUE_PAIR
+ *
+ * @param[in,out] ctx to allocate #VALUE_PAIR (s).
+ * @param[out] out where to write the resulting #VALUE_PAIR.
+ * @param[in] request The current request.
+ * @param[in] map to process.
+ * @param[in] uctx The #fr_value_box_t to convert.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int _sql_map_proc_get_box(TALLOC_CTX *ctx, VALUE_PAIR **out,
+				 REQUEST *request, vp_map_t const *map, void *uctx)
+{
+	VALUE_PAIR		*vp;
+	fr_value_box_t const	*value = uctx;
+	int			ret;
+
+	vp = fr_pair_afrom_da(ctx, tmpl_da(map->lhs));
+	if (!vp) return -1;
+
+	/*
+	 *	Strings are parsed as before, so enumeration
+	 *	names still work.  Everything else is converted
+	 *	directly from the database's type.
+	 */
+	if (value->type == FR_TYPE_STRING) {
+		ret = fr_pair_value_from_str(vp, value->vb_strvalue, value->vb_length, '\0', true);
+	} else {
+		ret = fr_value_box_cast(vp, &vp->data, vp->da->type, vp->da, value);
+
+		/*
+		 *	Not all casts are supported, but the string
+		 *	form of the value may still parse, as it
+		 *	would have done with sql_fetch_row.
+		 */
+		if (ret < 0) {
+			char buffer[128];
+
+			if (fr_value_box_snprint(buffer, sizeof(buffer), value, '\0') < sizeof(buffer)) {
+				ret = fr_pair_value_from_str(vp, buffer, -1, '\0', true);
+			}
+		}
+	}
+	if (ret < 0) {
+		RPEDEBUG("Failed converting value \"%pV\" for attribute %s", value, tmpl_da(map->lhs)->name);
+		talloc_free(vp);
+
+		return -1;
+	}
+
+	vp->op = map->op;
+	*out = vp;
+
+	return 0;
+}
+
 /*
  *	Verify the result of the map.
  */
@@ -378,7 +463,7 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	 */
 	sql_set_user(inst, request, NULL);
 
-	handle = fr_pool_connection_get(inst->pool, request);		/* connection pool should produce error */
+	handle = sql_read_handle_get(inst, request);		/* connection pool should produce error */
 	if (!handle) {
 		rcode = RLM_MODULE_FAIL;
 		goto finish;
@@ -469,13 +554,33 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	 *	Note: Not all SQL client libraries provide a row count,
 	 *	so we have to do the count here.
 	 */
-	while (((ret = rlm_sql_fetch_row(&row, inst, request, &handle)) == RLM_SQL_OK)) {
-		rows++;
-		for (map = maps, j = 0;
-		     map && (j < MAX_SQL_FIELD_INDEX);
-		     map = map->next, j++) {
-			if (field_index[j] < 0) continue;	/* We didn't find the map RHS in the field set */
-			if (map_to_request(request, map, _sql_map_proc_get_value, row[field_index[j]]) < 0) goto error;
+	if (inst->driver->sql_fetch_values) {
+		fr_value_box_t const	*values, *box;
+		void			*value;
+
+		while (((ret = rlm_sql_fetch_values(&values, inst, request, &handle)) == RLM_SQL_OK)) {
+			rows++;
+			for (map = maps, j = 0;
+			     map && (j < MAX_SQL_FIELD_INDEX);
+			     map = map->next, j++) {
+				if (field_index[j] < 0) continue;	/* We didn't find the map RHS in the field set */
+
+				box = &values[field_index[j]];
+				if (box->type == FR_TYPE_INVALID) continue;	/* NULL */
+
+				memcpy(&value, &box, sizeof(value));		/* map_to_request's uctx isn't const */
+				if (map_to_request(request, map, _sql_map_proc_get_box, value) < 0) goto error;
+			}
+		}
+	} else {
+		while (((ret = rlm_sql_fetch_row(&row, inst, request, &handle)) == RLM_SQL_OK)) {
+			rows++;
+			for (map = maps, j = 0;
+			     map && (j < MAX_SQL_FIELD_INDEX);
+			     map = map->next, j++) {
+				if (field_index[j] < 0) continue;	/* We didn't find the map RHS in the field set */
+				if (map_to_request(request, map, _sql_map_proc_get_value, row[field_index[j]]) < 0) goto error;
+			}
 		}
 	}
 
@@ -490,7 +595,7 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 
 finish:
 	talloc_free(fields);
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 
 	return rcode;
 }
@@ -688,8 +793,8 @@ static int sql_get_grouplist(rlm_sql_t const *inst, rlm_sql_handle_t **handle, R
 	entry = *phead = NULL;
 
 	if (!inst->config->groupmemb_query || !*inst->config->groupmemb_query) return 0;
-	if (xlat_aeval(request, &expanded, request, inst->config->groupmemb_query,
-			 inst->sql_escape_func, *handle) < 0) return -1;
+	if (sql_query_expand(request, &expanded, inst, request, *handle,
+			 inst->config->groupmemb_query) < 0) return -1;
 
 	ret = rlm_sql_select_query(inst, request, handle, expanded);
 	talloc_free(expanded);
@@ -764,7 +869,7 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	/*
 	 *	Get a socket for this lookup
 	 */
-	handle = fr_pool_connection_get(inst->pool, request);
+	handle = sql_read_handle_get(inst, request);
 	if (!handle) {
 		return 1;
 	}
@@ -774,7 +879,7 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	 */
 	if (sql_get_grouplist(inst, &handle, request, &head) < 0) {
 		REDEBUG("Error getting group membership");
-		fr_pool_connection_release(inst->pool, request, handle);
+		sql_handle_release(inst, request, handle);
 		return 1;
 	}
 
@@ -783,14 +888,14 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 			RDEBUG2("sql_groupcmp finished: User is a member of group %s",
 			       check->vp_strvalue);
 			talloc_free(head);
-			fr_pool_connection_release(inst->pool, request, handle);
+			sql_handle_release(inst, request, handle);
 			return 0;
 		}
 	}
 
 	/* Free the grouplist */
 	talloc_free(head);
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 
 	RDEBUG2("sql_groupcmp finished: User is NOT a member of group %pV", &check->data);
 
@@ -858,8 +963,8 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, REQUEST *reques
 			/*
 			 *	Expand the group query
 			 */
-			if (xlat_aeval(request, &expanded, request, inst->config->authorize_group_check_query,
-					 inst->sql_escape_func, *handle) < 0) {
+			if (sql_query_expand(request, &expanded, inst, request, *handle,
+					 inst->config->authorize_group_check_query) < 0) {
 				REDEBUG("Error generating query");
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
@@ -910,8 +1015,8 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, REQUEST *reques
 			/*
 			 *	Now get the reply pairs since the paircmp matched
 			 */
-			if (xlat_aeval(request, &expanded, request, inst->config->authorize_group_reply_query,
-					 inst->sql_escape_func, *handle) < 0) {
+			if (sql_query_expand(request, &expanded, inst, request, *handle,
+					 inst->config->authorize_group_reply_query) < 0) {
 				REDEBUG("Error generating query");
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
@@ -965,6 +1070,7 @@ static int mod_detach(void *instance)
 	rlm_sql_t	*inst = talloc_get_type_abort(instance, rlm_sql_t);
 
 	if (inst->pool) fr_pool_free(inst->pool);
+	if (inst->replica && inst->replica->pool) fr_pool_free(inst->replica->pool);
 
 	/*
 	 *	We need to explicitly free all children, so if the driver
@@ -1090,6 +1196,123 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 }
 
 
+/** Load clients from the database into the global client list
+ *
+ * The rows are turned straight into RADCLIENTs, and added to the
+ * client tries as they're fetched.  There's no CONF_SECTION per
+ * client, which is what made loading large NAS tables slow.
+ *
+ * The query returns the columns id, nasname, shortname, type, secret,
+ * and optionally server.
+ */
+static int sql_clients_load(rlm_sql_t *inst)
+{
+	rlm_sql_handle_t	*handle;
+	rlm_sql_row_t		row;
+	int			ret = 0, num_fields;
+	size_t			loaded = 0;
+	fr_time_t		start = fr_time();
+
+	DEBUG("Loading clients with query: %s", inst->config->client_query);
+
+	handle = sql_read_handle_get(inst, NULL);
+	if (!handle) return -1;
+
+	if (rlm_sql_select_query(inst, NULL, &handle, inst->config->client_query) != RLM_SQL_OK) {
+		ret = -1;
+		goto finish;
+	}
+
+	num_fields = (inst->driver->sql_num_fields)(handle, inst->config);
+	if (num_fields < 5) {
+		ERROR("client_query must return at least 5 columns, got %d", num_fields);
+		ret = -1;
+		goto done;
+	}
+
+	while (rlm_sql_fetch_row(&row, inst, NULL, &handle) == RLM_SQL_OK) {
+		RADCLIENT	*c;
+		char const	*server = NULL;
+
+		/*
+		 *	The id, nasname and secret columns are
+		 *	mandatory.
+		 */
+		if (!row[0] || !row[1] || !row[4]) {
+			WARN("Skipping client from row with empty id, nasname or secret");
+			continue;
+		}
+
+		if ((num_fields > 5) && row[5] && *row[5]) server = row[5];
+
+		c = client_afrom_query(NULL, row[1], row[4], row[2], row[3], server, false);
+		if (!c) {
+			PERROR("Failed creating client from row id %s", row[0]);
+			ret = -1;
+			break;
+		}
+
+		if (!client_add(NULL, c)) {
+			ERROR("Failed adding client from row id %s, possible duplicate?", row[0]);
+			ret = -1;
+			break;
+		}
+
+		DEBUG3("Client \"%s\" (id %s) added", c->shortname, row[0]);
+		loaded++;
+	}
+
+done:
+	(inst->driver->sql_finish_select_query)(handle, inst->config);
+
+finish:
+	sql_handle_release(inst, NULL, handle);
+
+	if (ret == 0) INFO("Loaded %zu clients in %pVs", loaded, fr_box_time_delta(fr_time() - start));
+
+	return ret;
+}
+
+/** Open the pool of connections to the read replica
+ *
+ */
+static int sql_replica_init(rlm_sql_t *inst, CONF_SECTION *conf)
+{
+	CONF_SECTION	*cs = cf_section_find(conf, "read_replica", NULL);
+	sql_replica_t	*replica;
+	char		log_prefix[128];
+
+	MEM(replica = talloc_zero(inst, sql_replica_t));
+
+	/*
+	 *	The driver's instance data is shared with the primary.
+	 *	Only the server and credentials differ.
+	 */
+	replica->config = *inst->config;
+	replica->config.sql_server = inst->config->replica.server;
+	replica->config.sql_port = inst->config->replica.port;
+	if (inst->config->replica.login) replica->config.sql_login = inst->config->replica.login;
+	if (inst->config->replica.password) replica->config.sql_password = inst->config->replica.password;
+
+	atomic_init(&replica->next_check, 0);
+	atomic_init(&replica->lagging, false);
+
+	inst->replica = replica;
+
+	INFO("Attempting to connect to read replica \"%s\"", inst->config->replica.server);
+
+	snprintf(log_prefix, sizeof(log_prefix), "rlm_sql (%s) read_replica", inst->name);
+	replica->pool = module_connection_pool_init(cs, inst, sql_mod_replica_conn_create, NULL,
+						    log_prefix, "modules.sql.read_replica.pool", NULL);
+	if (!replica->pool) {
+		inst->replica = NULL;
+		talloc_free(replica);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_sql_t *inst = instance;
@@ -1159,7 +1382,12 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 				inst->driver->sql_escape_func :
 				sql_escape_func;
 
-	inst->ef = module_exfile_init(inst, conf, 256, 30, true, NULL, NULL);
+	if (inst->config->accounting.batch_size && !inst->driver->sql_query_submit) {
+		cf_log_err(conf, "'accounting.batch_size' requires a driver which supports non-blocking queries");
+		return -1;
+	}
+
+	inst->ef = module_exfile_init(inst, conf, 256, 30, EXFILE_LOCKED, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
 		return -1;
@@ -1173,6 +1401,13 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->pool = module_connection_pool_init(inst->cs, inst, sql_mod_conn_create, NULL, NULL, NULL, NULL);
 	if (!inst->pool) return -1;
 
+	if (inst->config->replica.server[0] && (sql_replica_init(inst, conf) < 0)) return -1;
+
+	if (inst->config->read_clients && (sql_clients_load(inst) < 0)) {
+		cf_log_err(conf, "Failed loading clients");
+		return -1;
+	}
+
 	return RLM_MODULE_OK;
 }
 
@@ -1216,7 +1451,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQU
 	 *	After this point use goto error or goto release to cleanup socket temporary pairlists and
 	 *	temporary attributes.
 	 */
-	handle = fr_pool_connection_get(inst->pool, request);
+	handle = sql_read_handle_get(inst, request);
 	if (!handle) {
 		sql_unset_user(inst, request);
 		return RLM_MODULE_FAIL;
@@ -1229,8 +1464,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQU
 		fr_cursor_t	cursor;
 		VALUE_PAIR	*vp;
 
-		if (xlat_aeval(request, &expanded, request, inst->config->authorize_check_query,
-				 inst->sql_escape_func, handle) < 0) {
+		if (sql_query_expand(request, &expanded, inst, request, handle,
+				 inst->config->authorize_check_query) < 0) {
 			REDEBUG("Failed generating query");
 			rcode = RLM_MODULE_FAIL;
 
@@ -1239,7 +1474,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQU
 			fr_pair_list_free(&reply_tmp);
 			sql_unset_user(inst, request);
 
-			fr_pool_connection_release(inst->pool, request, handle);
+			sql_handle_release(inst, request, handle);
 
 			return rcode;
 		}
@@ -1284,8 +1519,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQU
 		/*
 		 *	Now get the reply pairs since the paircmp matched
 		 */
-		if (xlat_aeval(request, &expanded, request, inst->config->authorize_reply_query,
-				 inst->sql_escape_func, handle) < 0) {
+		if (sql_query_expand(request, &expanded, inst, request, handle,
+				 inst->config->authorize_reply_query) < 0) {
 			REDEBUG("Error generating query");
 			rcode = RLM_MODULE_FAIL;
 			goto error;
@@ -1414,47 +1649,34 @@ skip_reply:
 release:
 	if (!user_found) rcode = RLM_MODULE_NOTFOUND;
 
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 	sql_unset_user(inst, request);
 
 	return rcode;
 }
 
-/*
- *	Generic function for failing between a bunch of queries.
- *
- *	Uses the same principle as rlm_linelog, expanding the 'reference' config
- *	item using xlat to figure out what query it should execute.
- *
- *	If the reference matches multiple config items, and a query fails or
- *	doesn't update any rows, the next matching config item is used.
+/** Find the query to run for an accounting or post-auth section
  *
+ * @param[out] out	The first of the redundant set of queries to try.
+ * @param[in] request	The current request.
+ * @param[in] section	to find the query in.
+ * @return
+ *	- RLM_MODULE_OK if a query was found.
+ *	- RLM_MODULE_NOOP if no query is configured.
+ *	- RLM_MODULE_FAIL on error.
  */
-static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section)
+static rlm_rcode_t acct_query_find(CONF_PAIR **out, REQUEST *request, sql_acct_section_t *section)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
-
-	rlm_sql_handle_t	*handle = NULL;
-	int			sql_ret;
-	int			numaffected = 0;
-
 	CONF_ITEM		*item;
-	CONF_PAIR 		*pair;
-	char const		*attr = NULL;
-	char const		*value;
-
 	char			path[FR_MAX_STRING_LEN];
 	char			*p = path;
-	char			*expanded = NULL;
 
 	fr_assert(section);
 
 	if (section->reference[0] != '.') *p++ = '.';
 
 	if (xlat_eval(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
+		return RLM_MODULE_FAIL;
 	}
 
 	/*
@@ -1464,21 +1686,48 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 	item = cf_reference_item(NULL, section->cs, path);
 	if (!item) {
 		RWDEBUG("No such configuration item %s", path);
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 	if (cf_item_is_section(item)){
 		RWDEBUG("Sections are not supported as references");
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 
-	pair = cf_item_to_pair(item);
-	attr = cf_pair_attr(pair);
+	*out = cf_item_to_pair(item);
+
+	RDEBUG2("Using query template '%s'", cf_pair_attr(*out));
+
+	return RLM_MODULE_OK;
+}
+
+/*
+ *	Generic function for failing between a bunch of queries.
+ *
+ *	Uses the same principle as rlm_linelog, expanding the 'reference' config
+ *	item using xlat to figure out what query it should execute.
+ *
+ *	If the reference matches multiple config items, and a query fails or
+ *	doesn't update any rows, the next matching config item is used.
+ *
+ */
+static rlm_rcode_t acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	rlm_sql_handle_t	*handle = NULL;
+	int			sql_ret;
+	int			numaffected = 0;
+
+	CONF_PAIR 		*pair;
+	char const		*attr = NULL;
+	char const		*value;
+
+	char			*expanded = NULL;
 
-	RDEBUG2("Using query template '%s'", attr);
+	rcode = acct_query_find(&pair, request, section);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	attr = cf_pair_attr(pair);
 
 	handle = fr_pool_connection_get(inst->pool, request);
 	if (!handle) {
@@ -1498,7 +1747,7 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 			goto finish;
 		}
 
-		if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
+		if (sql_query_expand(request, &expanded, inst, request, handle, value) < 0) {
 			rcode = RLM_MODULE_FAIL;
 
 			goto finish;
@@ -1588,42 +1837,873 @@ finish:
 	return rcode;
 }
 
-#ifdef WITH_ACCOUNTING
+/** State of a non-blocking accounting or post-auth query
+ *
+ */
+typedef struct {
+	sql_acct_section_t	*section;		//!< Section the queries come from.
+	CONF_PAIR		*pair;			//!< Query currently being run.
+	char const		*attr;			//!< Name shared by the redundant set of queries.
+	rlm_sql_handle_t	*handle;		//!< Connection the query was submitted on.
+	int			fd;			//!< Socket we're waiting on for the result.
+	bool			timed_out;		//!< The query didn't complete within query_timeout.
+	bool			ready;			//!< The request has been marked as resumable.
+} sql_acct_ctx_t;
+
+static rlm_rcode_t acct_async_submit(rlm_sql_t const *inst, REQUEST *request, sql_acct_ctx_t *actx);
+
+/** Release the connection and free the query state
+ *
+ */
+static rlm_rcode_t acct_async_done(rlm_sql_t const *inst, REQUEST *request, sql_acct_ctx_t *actx, rlm_rcode_t rcode)
+{
+	if (actx->handle) fr_pool_connection_release(inst->pool, request, actx->handle);
+	sql_unset_user(inst, request);
+	talloc_free(actx);
 
-/*
- *	Accounting: Insert or update session data in our sql table
+	return rcode;
+}
+
+/** Stop watching the connection's socket
+ *
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQUEST *request)
+static void acct_async_events_delete(REQUEST *request, sql_acct_ctx_t *actx)
 {
-	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	(void) unlang_module_fd_delete(request, actx, actx->fd);
+	(void) unlang_module_timeout_delete(request, actx);
+}
 
-	if (inst->config->accounting.reference_cp) {
-		return acct_redundant(inst, request, &inst->config->accounting);
-	}
+/** Read whatever part of the result is available, resuming the request once it's complete
+ *
+ */
+static void acct_async_readable(module_ctx_t const *mctx, REQUEST *request, void *rctx, UNUSED int fd)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	sql_acct_ctx_t		*actx = talloc_get_type_abort(rctx, sql_acct_ctx_t);
 
-	return RLM_MODULE_NOOP;
+	if (actx->ready) return;
+
+	if ((inst->driver->sql_query_busy)(actx->handle, inst->config) > 0) return;
+
+	actx->ready = true;
+	unlang_interpret_resumable(request);
 }
 
-#endif
+/** The socket errored, the driver will report the error when we ask for the result
+ *
+ */
+static void acct_async_error(UNUSED module_ctx_t const *mctx, REQUEST *request, void *rctx, UNUSED int fd)
+{
+	sql_acct_ctx_t		*actx = talloc_get_type_abort(rctx, sql_acct_ctx_t);
 
-/*
- *	Postauth: Write a record of the authentication attempt
+	if (actx->ready) return;
+
+	actx->ready = true;
+	unlang_interpret_resumable(request);
+}
+
+static void acct_async_timeout(UNUSED module_ctx_t const *mctx, REQUEST *request, void *rctx, UNUSED fr_time_t fired)
+{
+	sql_acct_ctx_t		*actx = talloc_get_type_abort(rctx, sql_acct_ctx_t);
+
+	if (actx->ready) return;
+
+	actx->timed_out = true;
+	actx->ready = true;
+	unlang_interpret_resumable(request);
+}
+
+/** The request was cancelled while the query was in progress
+ *
+ * The connection is closed, as there's no portable way of discarding
+ * the result of the query.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(module_ctx_t const *mctx, REQUEST *request)
+static void acct_async_signal(module_ctx_t const *mctx, REQUEST *request, void *rctx, fr_state_signal_t action)
 {
-	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	sql_acct_ctx_t		*actx = talloc_get_type_abort(rctx, sql_acct_ctx_t);
 
-	if (inst->config->postauth.reference_cp) {
-		return acct_redundant(inst, request, &inst->config->postauth);
-	}
+	if (action != FR_SIGNAL_CANCEL) return;
 
-	return RLM_MODULE_NOOP;
+	acct_async_events_delete(request, actx);
+
+	fr_pool_connection_close(inst->pool, request, actx->handle);
+	actx->handle = NULL;
+
+	(void) acct_async_done(inst, request, actx, RLM_MODULE_FAIL);
 }
 
-/*
- *	Execute postauth_query after authentication
+/** Process the result of a query, trying the next query in the set if it failed or didn't update anything
+ *
  */
+static rlm_rcode_t acct_async_resume(module_ctx_t const *mctx, REQUEST *request, void *rctx)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	sql_acct_ctx_t		*actx = talloc_get_type_abort(rctx, sql_acct_ctx_t);
+	sql_rcode_t		sql_ret;
+	int			numaffected;
+
+	acct_async_events_delete(request, actx);
+
+	if (actx->timed_out) {
+		REDEBUG("Query timed out after %u seconds", inst->config->query_timeout);
+		fr_pool_connection_close(inst->pool, request, actx->handle);
+		actx->handle = NULL;
+		return acct_async_done(inst, request, actx, RLM_MODULE_FAIL);
+	}
 
+	sql_ret = rlm_sql_query_result(inst, request, &actx->handle);
+	RDEBUG2("SQL query returned: %s", fr_table_str_by_value(sql_rcode_description_table, sql_ret, "<INVALID>"));
+
+	switch (sql_ret) {
+	case RLM_SQL_OK:
+		break;
+
+	case RLM_SQL_QUERY_INVALID:
+		return acct_async_done(inst, request, actx, RLM_MODULE_INVALID);
+
+	case RLM_SQL_ALT_QUERY:
+		goto next;
+
+	default:
+		return acct_async_done(inst, request, actx, RLM_MODULE_FAIL);
+	}
+
+	numaffected = (inst->driver->sql_affected_rows)(actx->handle, inst->config);
+	(inst->driver->sql_finish_query)(actx->handle, inst->config);
+	RDEBUG2("%i record(s) updated", numaffected);
+
+	if (numaffected > 0) return acct_async_done(inst, request, actx, RLM_MODULE_OK);
+
+next:
+	actx->pair = cf_pair_find_next(actx->section->cs, actx->pair, actx->attr);
+	if (!actx->pair) {
+		RDEBUG2("No additional queries configured");
+		return acct_async_done(inst, request, actx, RLM_MODULE_NOOP);
+	}
+
+	RDEBUG2("Trying next query...");
+
+	return acct_async_submit(inst, request, actx);
+}
+
+/** Expand and submit the current query, then yield until the result is available
+ *
+ */
+static rlm_rcode_t acct_async_submit(rlm_sql_t const *inst, REQUEST *request, sql_acct_ctx_t *actx)
+{
+	char const		*value;
+	char			*expanded = NULL;
+	sql_rcode_t		sql_ret;
+
+	for (;;) {
+		value = cf_pair_value(actx->pair);
+		if (!value) {
+			RDEBUG2("Ignoring null query");
+			return acct_async_done(inst, request, actx, RLM_MODULE_NOOP);
+		}
+
+		if (sql_query_expand(request, &expanded, inst, request, actx->handle, value) < 0) {
+			return acct_async_done(inst, request, actx, RLM_MODULE_FAIL);
+		}
+
+		if (!*expanded) {
+			RDEBUG2("Ignoring null query");
+			talloc_free(expanded);
+			return acct_async_done(inst, request, actx, RLM_MODULE_NOOP);
+		}
+
+		rlm_sql_query_log(inst, request, actx->section, expanded);
+
+		sql_ret = rlm_sql_query_submit(inst, request, &actx->handle, expanded);
+		TALLOC_FREE(expanded);
+
+		switch (sql_ret) {
+		case RLM_SQL_OK:
+			break;
+
+		case RLM_SQL_QUERY_INVALID:
+			return acct_async_done(inst, request, actx, RLM_MODULE_INVALID);
+
+		case RLM_SQL_ALT_QUERY:
+			actx->pair = cf_pair_find_next(actx->section->cs, actx->pair, actx->attr);
+			if (!actx->pair) {
+				RDEBUG2("No additional queries configured");
+				return acct_async_done(inst, request, actx, RLM_MODULE_NOOP);
+			}
+			RDEBUG2("Trying next query...");
+			continue;
+
+		default:
+			return acct_async_done(inst, request, actx, RLM_MODULE_FAIL);
+		}
+
+		break;
+	}
+
+	actx->fd = (inst->driver->sql_query_socket)(actx->handle, inst->config);
+	if (actx->fd < 0) {
+		REDEBUG("Failed getting socket for query result");
+	error:
+		fr_pool_connection_close(inst->pool, request, actx->handle);
+		actx->handle = NULL;
+		return acct_async_done(inst, request, actx, RLM_MODULE_FAIL);
+	}
+
+	actx->ready = false;
+	actx->timed_out = false;
+
+	if (unlang_module_fd_add(request, acct_async_readable, NULL, acct_async_error, actx, actx->fd) < 0) {
+		RPEDEBUG("Failed watching socket for query result");
+		goto error;
+	}
+
+	if (inst->config->query_timeout &&
+	    (unlang_module_timeout_add(request, acct_async_timeout, actx,
+				       fr_time() + fr_time_delta_from_sec(inst->config->query_timeout)) < 0)) {
+		RPEDEBUG("Failed adding query timeout");
+		acct_async_events_delete(request, actx);
+		goto error;
+	}
+
+	return unlang_module_yield(request, acct_async_resume, acct_async_signal, actx);
+}
+
+/** Non-blocking version of #acct_redundant
+ *
+ * Used if the driver supports non-blocking queries.  The connection is held until
+ * the last query in the set completes, but the worker thread is free to process
+ * other requests whilst we're waiting for the database.
+ */
+static rlm_rcode_t acct_redundant_async(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section)
+{
+	sql_acct_ctx_t		*actx;
+	CONF_PAIR		*pair;
+	rlm_rcode_t		rcode;
+
+	rcode = acct_query_find(&pair, request, section);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	MEM(actx = talloc_zero(request, sql_acct_ctx_t));
+	actx->section = section;
+	actx->pair = pair;
+	actx->attr = cf_pair_attr(pair);
+	actx->fd = -1;
+
+	actx->handle = fr_pool_connection_get(inst->pool, request);
+	if (!actx->handle) {
+		talloc_free(actx);
+		return RLM_MODULE_FAIL;
+	}
+
+	sql_set_user(inst, request, NULL);
+
+	return acct_async_submit(inst, request, actx);
+}
+
+/** What's in progress on a thread's batch connection
+ *
+ */
+typedef enum {
+	SQL_BATCH_IDLE = 0,				//!< Nothing.
+	SQL_BATCH_BEGIN,				//!< Opening a transaction.
+	SQL_BATCH_SAVEPOINT,				//!< Marking where a request's queries start.
+	SQL_BATCH_QUERY,				//!< Running one of a request's queries.
+	SQL_BATCH_ROLLBACK,				//!< Undoing a failed query.
+	SQL_BATCH_COMMIT				//!< Committing the transaction.
+} sql_batch_op_t;
+
+/** A request whose queries are run in a thread's shared transaction
+ *
+ */
+typedef struct {
+	REQUEST			*request;
+	sql_acct_section_t	*section;		//!< Section the queries come from.
+	CONF_PAIR		*pair;			//!< Query currently being run.
+	char const		*attr;			//!< Name shared by the redundant set of queries.
+	rlm_rcode_t		rcode;			//!< What to return once the request is done.
+	bool			stop;			//!< Finish once the failed query is rolled back.
+	bool			done;			//!< The request has its result.
+	fr_dlist_head_t		*list;			//!< The list we're in, if any.
+	fr_dlist_t		entry;			//!< Entry in the queued or written list.
+} sql_batch_ctx_t;
+
+/** Per-thread state for batched accounting queries
+ *
+ * Requests are written one after another inside a single transaction,
+ * which is committed once batch_size requests have been written, or
+ * batch_timeout after the first one.  Each request is only resumed when
+ * the commit succeeds, so every write shares the commit's cost.
+ */
+typedef struct {
+	rlm_sql_t const		*inst;			//!< Instance this thread's data belongs to.
+	fr_event_list_t		*el;			//!< Event list for this thread.
+
+	rlm_sql_handle_t	*handle;		//!< Connection the transaction is open on.
+	int			fd;			//!< Socket we're waiting on for a result.
+	sql_batch_op_t		op;			//!< What's in progress on the connection.
+	bool			open;			//!< A transaction is open.
+	bool			commit_due;		//!< batch_timeout has passed.
+	uint32_t		count;			//!< Requests written in this transaction.
+
+	sql_batch_ctx_t		*current;		//!< Request whose queries are being run.
+	fr_dlist_head_t		queued;			//!< Requests waiting to run their queries.
+	fr_dlist_head_t		written;		//!< Requests waiting for the transaction to commit.
+
+	fr_event_timer_t const	*commit_ev;		//!< When to commit the transaction.
+	fr_event_timer_t const	*timeout_ev;		//!< When to give up on the current operation.
+} rlm_sql_thread_t;
+
+static void sql_batch_run(rlm_sql_thread_t *t);
+
+/** Give a request its result, and resume it
+ *
+ */
+static void sql_batch_finish(sql_batch_ctx_t *bctx, rlm_rcode_t rcode)
+{
+	if (bctx->list) {
+		fr_dlist_remove(bctx->list, bctx);
+		bctx->list = NULL;
+	}
+
+	bctx->rcode = rcode;
+	bctx->done = true;
+	unlang_interpret_resumable(bctx->request);
+}
+
+/** Stop waiting for the result of the current operation
+ *
+ */
+static void sql_batch_events_delete(rlm_sql_thread_t *t)
+{
+	if (t->fd >= 0) {
+		(void) fr_event_fd_delete(t->el, t->fd, FR_EVENT_FILTER_IO);
+		t->fd = -1;
+	}
+	(void) fr_event_timer_delete(&t->timeout_ev);
+}
+
+/** Close the connection, failing every request whose writes were in the transaction
+ *
+ */
+static void sql_batch_abort(rlm_sql_thread_t *t)
+{
+	sql_batch_ctx_t *bctx;
+
+	sql_batch_events_delete(t);
+	(void) fr_event_timer_delete(&t->commit_ev);
+
+	if (t->handle) {
+		fr_pool_connection_close(t->inst->pool, NULL, t->handle);
+		t->handle = NULL;
+	}
+
+	t->op = SQL_BATCH_IDLE;
+	t->open = false;
+	t->commit_due = false;
+	t->count = 0;
+
+	if (t->current) {
+		sql_batch_finish(t->current, RLM_MODULE_FAIL);
+		t->current = NULL;
+	}
+
+	while ((bctx = fr_dlist_head(&t->written))) sql_batch_finish(bctx, RLM_MODULE_FAIL);
+}
+
+static void _sql_batch_readable(fr_event_list_t *el, int fd, int flags, void *uctx);
+static void _sql_batch_error(fr_event_list_t *el, int fd, int flags, int fd_errno, void *uctx);
+static void _sql_batch_timeout(fr_event_list_t *el, fr_time_t now, void *uctx);
+static void _sql_batch_commit_timer(fr_event_list_t *el, fr_time_t now, void *uctx);
+
+/** Send a statement on the batch connection, and wait for its result
+ *
+ */
+static int sql_batch_submit(rlm_sql_thread_t *t, REQUEST *request, sql_batch_op_t op, char const *query)
+{
+	rlm_sql_t const *inst = t->inst;
+
+	if (rlm_sql_query_send(inst, request, t->handle, query) != RLM_SQL_OK) return -1;
+
+	t->fd = (inst->driver->sql_query_socket)(t->handle, inst->config);
+	if (t->fd < 0) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed getting socket for query result");
+		return -1;
+	}
+
+	if (fr_event_fd_insert(t, t->el, t->fd, _sql_batch_readable, NULL, _sql_batch_error, t) < 0) {
+		ROPTIONAL(RPEDEBUG, PERROR, "Failed watching socket for query result");
+		t->fd = -1;
+		return -1;
+	}
+
+	if (inst->config->query_timeout &&
+	    (fr_event_timer_in(t, t->el, &t->timeout_ev, fr_time_delta_from_sec(inst->config->query_timeout),
+			       _sql_batch_timeout, t) < 0)) {
+		ROPTIONAL(RPEDEBUG, PERROR, "Failed adding query timeout");
+		sql_batch_events_delete(t);
+		return -1;
+	}
+
+	t->op = op;
+
+	return 0;
+}
+
+/** Expand and send the current request's query
+ *
+ */
+static void sql_batch_query(rlm_sql_thread_t *t)
+{
+	rlm_sql_t const		*inst = t->inst;
+	sql_batch_ctx_t		*bctx = t->current;
+	REQUEST			*request = bctx->request;
+	char const		*value;
+	char			*expanded = NULL;
+	int			ret;
+
+	value = cf_pair_value(bctx->pair);
+	if (!value) {
+		RDEBUG2("Ignoring null query");
+	noop:
+		t->current = NULL;
+		sql_batch_finish(bctx, RLM_MODULE_NOOP);
+		return;
+	}
+
+	if (sql_query_expand(request, &expanded, inst, request, t->handle, value) < 0) {
+		t->current = NULL;
+		sql_batch_finish(bctx, RLM_MODULE_FAIL);
+		return;
+	}
+
+	if (!*expanded) {
+		RDEBUG2("Ignoring null query");
+		talloc_free(expanded);
+		goto noop;
+	}
+
+	rlm_sql_query_log(inst, request, bctx->section, expanded);
+
+	ret = sql_batch_submit(t, request, SQL_BATCH_QUERY, expanded);
+	talloc_free(expanded);
+	if (ret < 0) sql_batch_abort(t);
+}
+
+/** Move on to the current request's next query, if it has one
+ *
+ */
+static void sql_batch_query_next(rlm_sql_thread_t *t)
+{
+	sql_batch_ctx_t		*bctx = t->current;
+	REQUEST			*request = bctx->request;
+
+	bctx->pair = cf_pair_find_next(bctx->section->cs, bctx->pair, bctx->attr);
+	if (!bctx->pair) {
+		RDEBUG2("No additional queries configured");
+		t->current = NULL;
+		sql_batch_finish(bctx, RLM_MODULE_NOOP);
+		return;
+	}
+
+	RDEBUG2("Trying next query...");
+	sql_batch_query(t);
+}
+
+/** Process the result of the operation in progress
+ *
+ */
+static void sql_batch_result(rlm_sql_thread_t *t)
+{
+	rlm_sql_t const			*inst = t->inst;
+	sql_acct_section_t const	*section = &inst->config->accounting;
+	sql_batch_ctx_t			*bctx = t->current;
+	REQUEST				*request = bctx ? bctx->request : NULL;
+	sql_batch_op_t			op = t->op;
+	sql_rcode_t			ret;
+	int				numaffected = 0;
+
+	sql_batch_events_delete(t);
+	t->op = SQL_BATCH_IDLE;
+
+	ret = rlm_sql_query_result(inst, request, &t->handle);
+	if (!t->handle) {	/* Connection was closed */
+		sql_batch_abort(t);
+		return;
+	}
+
+	if (ret == RLM_SQL_OK) {
+		if (op == SQL_BATCH_QUERY) numaffected = (inst->driver->sql_affected_rows)(t->handle, inst->config);
+		(inst->driver->sql_finish_query)(t->handle, inst->config);
+	}
+
+	switch (op) {
+	case SQL_BATCH_IDLE:
+		break;
+
+	case SQL_BATCH_BEGIN:
+		if (ret != RLM_SQL_OK) {
+			/*
+			 *	Fail the first request, so that one
+			 *	which can never succeed doesn't hold
+			 *	up the rest forever.
+			 */
+			ERROR("Failed starting transaction for batched queries");
+			bctx = fr_dlist_head(&t->queued);
+			sql_batch_abort(t);
+			if (bctx) sql_batch_finish(bctx, RLM_MODULE_FAIL);
+			return;
+		}
+		t->open = true;
+		break;
+
+	case SQL_BATCH_SAVEPOINT:
+		if (ret != RLM_SQL_OK) {
+			sql_batch_abort(t);
+			return;
+		}
+		if (bctx) sql_batch_query(t);
+		break;
+
+	case SQL_BATCH_QUERY:
+		RDEBUG2("SQL query returned: %s", fr_table_str_by_value(sql_rcode_description_table, ret, "<INVALID>"));
+
+		switch (ret) {
+		case RLM_SQL_OK:
+			if (!bctx) break;
+			RDEBUG2("%i record(s) updated", numaffected);
+			if (numaffected == 0) {
+				sql_batch_query_next(t);
+				break;
+			}
+
+			/*
+			 *	Written.  Wait for the commit.
+			 */
+			t->current = NULL;
+			bctx->rcode = RLM_MODULE_OK;
+			bctx->list = &t->written;
+			fr_dlist_insert_tail(&t->written, bctx);
+
+			if ((t->count++ == 0) && section->batch_timeout &&
+			    (fr_event_timer_in(t, t->el, &t->commit_ev, section->batch_timeout,
+					       _sql_batch_commit_timer, t) < 0)) {
+				t->commit_due = true;
+			}
+			break;
+
+		/*
+		 *	Undo the failed query, so the rest of the
+		 *	transaction can continue.
+		 */
+		default:
+			if (bctx) {
+				bctx->stop = (ret != RLM_SQL_ALT_QUERY);
+				bctx->rcode = (ret == RLM_SQL_QUERY_INVALID) ? RLM_MODULE_INVALID : RLM_MODULE_FAIL;
+			}
+			if (sql_batch_submit(t, request, SQL_BATCH_ROLLBACK, "ROLLBACK TO SAVEPOINT fr_batch") < 0) {
+				sql_batch_abort(t);
+			}
+			break;
+		}
+		break;
+
+	case SQL_BATCH_ROLLBACK:
+		if (ret != RLM_SQL_OK) {
+			sql_batch_abort(t);
+			return;
+		}
+		if (!bctx) break;
+
+		if (bctx->stop) {
+			t->current = NULL;
+			sql_batch_finish(bctx, bctx->rcode);
+			break;
+		}
+		sql_batch_query_next(t);
+		break;
+
+	case SQL_BATCH_COMMIT:
+		t->open = false;
+		t->count = 0;
+
+		if (ret != RLM_SQL_OK) {
+			ERROR("Failed committing batched queries");
+			sql_batch_abort(t);
+			return;
+		}
+
+		while ((bctx = fr_dlist_head(&t->written))) sql_batch_finish(bctx, bctx->rcode);
+
+		/*
+		 *	Let other threads use the connection until
+		 *	there's more to write.
+		 */
+		if (fr_dlist_num_elements(&t->queued) == 0) {
+			fr_pool_connection_release(inst->pool, NULL, t->handle);
+			t->handle = NULL;
+		}
+		break;
+	}
+}
+
+static void _sql_batch_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+	rlm_sql_t const		*inst = t->inst;
+	int			ret;
+
+	ret = (inst->driver->sql_query_busy)(t->handle, inst->config);
+	if (ret > 0) return;
+
+	if (ret < 0) {
+		sql_batch_abort(t);
+	} else {
+		sql_batch_result(t);
+	}
+
+	sql_batch_run(t);
+}
+
+static void _sql_batch_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+	rlm_sql_t const		*inst = t->inst;
+
+	ERROR("Connection failed: %s", fr_syserror(fd_errno));
+
+	sql_batch_abort(t);
+	sql_batch_run(t);
+}
+
+/** The operation in progress took too long
+ *
+ */
+static void _sql_batch_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+	rlm_sql_t const		*inst = t->inst;
+
+	ERROR("Query timed out after %u seconds", inst->config->query_timeout);
+
+	sql_batch_abort(t);
+	sql_batch_run(t);
+}
+
+/** batch_timeout has passed since the first write in the transaction
+ *
+ */
+static void _sql_batch_commit_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+
+	t->commit_due = true;
+	sql_batch_run(t);
+}
+
+/** Start whatever should happen next on the batch connection
+ *
+ */
+static void sql_batch_run(rlm_sql_thread_t *t)
+{
+	rlm_sql_t const			*inst = t->inst;
+	sql_acct_section_t const	*section = &inst->config->accounting;
+	sql_batch_ctx_t			*bctx;
+
+	while ((t->op == SQL_BATCH_IDLE) && !t->current) {
+		bool idle = (fr_dlist_num_elements(&t->queued) == 0);
+
+		if (t->open &&
+		    (t->commit_due || (t->count >= section->batch_size) ||
+		     (idle && (!t->count || !section->batch_timeout)))) {
+			(void) fr_event_timer_delete(&t->commit_ev);
+			t->commit_due = false;
+
+			DEBUG2("Committing %u batched request(s)", t->count);
+			if (sql_batch_submit(t, NULL, SQL_BATCH_COMMIT, "COMMIT") < 0) {
+				sql_batch_abort(t);
+				continue;
+			}
+			return;
+		}
+
+		bctx = fr_dlist_head(&t->queued);
+		if (!bctx) return;
+
+		if (!t->handle) {
+			t->handle = fr_pool_connection_get(inst->pool, bctx->request);
+			if (!t->handle) {
+				while ((bctx = fr_dlist_head(&t->queued))) sql_batch_finish(bctx, RLM_MODULE_FAIL);
+				return;
+			}
+		}
+
+		if (!t->open) {
+			if (sql_batch_submit(t, NULL, SQL_BATCH_BEGIN, "BEGIN") < 0) {
+				sql_batch_abort(t);
+				sql_batch_finish(bctx, RLM_MODULE_FAIL);
+				continue;
+			}
+			return;
+		}
+
+		fr_dlist_remove(&t->queued, bctx);
+		bctx->list = NULL;
+		t->current = bctx;
+
+		if (sql_batch_submit(t, bctx->request, SQL_BATCH_SAVEPOINT, "SAVEPOINT fr_batch") < 0) {
+			sql_batch_abort(t);
+			continue;
+		}
+		return;
+	}
+}
+
+/** Return the result of a batched request
+ *
+ */
+static rlm_rcode_t acct_batch_done(rlm_sql_t const *inst, REQUEST *request, sql_batch_ctx_t *bctx)
+{
+	rlm_rcode_t rcode = bctx->rcode;
+
+	sql_unset_user(inst, request);
+	talloc_free(bctx);
+
+	return rcode;
+}
+
+static rlm_rcode_t acct_batch_resume(module_ctx_t const *mctx, REQUEST *request, void *rctx)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	sql_batch_ctx_t		*bctx = talloc_get_type_abort(rctx, sql_batch_ctx_t);
+
+	return acct_batch_done(inst, request, bctx);
+}
+
+/** The request was cancelled before its writes were committed
+ *
+ * Any writes already made are left in the transaction.
+ */
+static void acct_batch_signal(module_ctx_t const *mctx, REQUEST *request, void *rctx, fr_state_signal_t action)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
+	sql_batch_ctx_t		*bctx = talloc_get_type_abort(rctx, sql_batch_ctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (t->current == bctx) t->current = NULL;
+	if (bctx->list) fr_dlist_remove(bctx->list, bctx);
+
+	(void) acct_batch_done(inst, request, bctx);
+}
+
+/** Batched version of #acct_redundant_async
+ *
+ * The request's queries are run in a transaction shared with other
+ * requests processed by this thread, and the request is resumed once
+ * that transaction commits.
+ */
+static rlm_rcode_t acct_redundant_batch(rlm_sql_t const *inst, rlm_sql_thread_t *t, REQUEST *request,
+					sql_acct_section_t *section)
+{
+	sql_batch_ctx_t		*bctx;
+	CONF_PAIR		*pair;
+	rlm_rcode_t		rcode;
+
+	rcode = acct_query_find(&pair, request, section);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	MEM(bctx = talloc_zero(request, sql_batch_ctx_t));
+	bctx->request = request;
+	bctx->section = section;
+	bctx->pair = pair;
+	bctx->attr = cf_pair_attr(pair);
+	bctx->rcode = RLM_MODULE_NOOP;
+
+	sql_set_user(inst, request, NULL);
+
+	bctx->list = &t->queued;
+	fr_dlist_insert_tail(&t->queued, bctx);
+	sql_batch_run(t);
+
+	/*
+	 *	Failed before we could yield.
+	 */
+	if (bctx->done) return acct_batch_done(inst, request, bctx);
+
+	return unlang_module_yield(request, acct_batch_resume, acct_batch_signal, bctx);
+}
+
+#ifdef WITH_ACCOUNTING
+
+/*
+ *	Accounting: Insert or update session data in our sql table
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQUEST *request)
+{
+	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+
+	if (inst->config->accounting.reference_cp) {
+		if (inst->config->accounting.batch_size) {
+			return acct_redundant_batch(inst, talloc_get_type_abort(mctx->thread, rlm_sql_thread_t),
+						    request, &inst->config->accounting);
+		}
+		if (inst->driver->sql_query_submit) return acct_redundant_async(inst, request, &inst->config->accounting);
+		return acct_redundant(inst, request, &inst->config->accounting);
+	}
+
+	return RLM_MODULE_NOOP;
+}
+
+#endif
+
+/*
+ *	Postauth: Write a record of the authentication attempt
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(module_ctx_t const *mctx, REQUEST *request)
+{
+	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+
+	if (inst->config->postauth.reference_cp) {
+		if (inst->driver->sql_query_submit) return acct_redundant_async(inst, request, &inst->config->postauth);
+		return acct_redundant(inst, request, &inst->config->postauth);
+	}
+
+	return RLM_MODULE_NOOP;
+}
+
+/*
+ *	Execute postauth_query after authentication
+ */
+
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_sql_thread_t	*t = thread;
+
+	(void) talloc_set_type(t, rlm_sql_thread_t);
+	t->inst = talloc_get_type_abort(instance, rlm_sql_t);
+	t->el = el;
+	t->fd = -1;
+	fr_dlist_init(&t->queued, sql_batch_ctx_t, entry);
+	fr_dlist_init(&t->written, sql_batch_ctx_t, entry);
+
+	return 0;
+}
+
+/** Close the batch connection, discarding any uncommitted writes
+ *
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(thread, rlm_sql_thread_t);
+
+	sql_batch_events_delete(t);
+	if (t->handle) fr_pool_connection_close(t->inst->pool, NULL, t->handle);
+
+	return 0;
+}
 
 /* globally exported name */
 module_t rlm_sql = {
@@ -1631,10 +2711,13 @@ module_t rlm_sql = {
 	.name		= "sql",
 	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_sql_t),
+	.thread_inst_size	= sizeof(rlm_sql_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 #ifdef WITH_ACCOUNTING
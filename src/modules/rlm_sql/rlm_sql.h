@@ -32,6 +32,12 @@ RCSIDH(rlm_sql_h, "$Id$")
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/exfile.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #define FR_ITEM_CHECK 0
 #define FR_ITEM_REPLY 1
 
@@ -82,9 +88,32 @@ typedef struct {
 
 	char const		*logfile;
 
+	uint32_t		batch_size;			//!< Most requests written per transaction.
+								///< 0 disables batching.
+	fr_time_delta_t		batch_timeout;			//!< Longest a transaction waits for more writes.
+
 	char const		**query;			/* for xlat parsing */
 } sql_acct_section_t;
 
+/** Where queries which only read may be sent
+ *
+ */
+typedef struct {
+	char const		*server;			//!< Replica to connect to.  Empty disables
+								///< replica routing.
+	uint32_t		port;				//!< Port to connect to.
+	char const		*login;				//!< Login credentials, if different from the primary's.
+	char const		*password;			//!< Login password, if different from the primary's.
+
+	char const		*lag_query;			//!< Returns how far, in seconds, the replica is
+								///< behind the primary.
+	uint32_t		max_lag;			//!< Send reads to the primary if the replica is
+								///< further behind than this.
+	fr_time_delta_t		lag_interval;			//!< How often lag_query is run.
+
+	bool			xlat;				//!< Send SELECTs from %{sql:...} to the replica.
+} sql_replica_config_t;
+
 typedef struct {
 	char const 		*sql_driver_name;		//!< SQL driver module name e.g. rlm_sql_sqlite.
 	char const 		*sql_server;			//!< Server to connect to.
@@ -115,12 +144,16 @@ typedef struct {
 								//!< If false, Fall-Through = yes is required
 								//!< in the previous reply list to process
 								//!< profiles.
+	bool			read_clients;			//!< Load clients from the database at startup.
+	char const		*client_query;			//!< Query used to get client definitions.
 	char const		*logfile;			//!< Keep a log of all SQL queries executed
 								//!< Useful for batch insertion with the
 								//!< NULL drivers.
 
 	char const		*allowed_chars;			//!< Chars which done need escaping..
 	uint32_t		query_timeout;			//!< How long to allow queries to run for.
+	bool			prepared_statements;		//!< Pass expansions to the driver as bind
+								//!< parameters, instead of escaping them.
 
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
@@ -138,14 +171,31 @@ typedef struct {
 	 */
 	sql_acct_section_t	postauth;
 	sql_acct_section_t	accounting;
+
+	sql_replica_config_t	replica;
 } rlm_sql_config_t;
 
 typedef struct sql_inst rlm_sql_t;
 
+/** Values bound to the parameters of a query
+ *
+ * Produced by #sql_query_expand.  The query text refers to the values
+ * as $1, $2 etc.
+ */
+typedef struct {
+	char const		*query;				//!< The query the values belong to.
+	char const		**values;			//!< Value of each parameter, $1 first.
+	int			num;				//!< Number of parameters.
+} rlm_sql_params_t;
+
 typedef struct {
 	void			*conn;				//!< Database specific connection handle.
+	rlm_sql_params_t const	*params;			//!< Values for the query being run, or NULL.
+								///< Only set during calls to a driver with
+								///< #RLM_SQL_FLAGS_PARAMS.
 	rlm_sql_row_t		row;				//!< Row data from the last query.
 	rlm_sql_t const		*inst;				//!< The rlm_sql instance this connection belongs to.
+	bool			replica;			//!< Connection is to the read replica.
 	TALLOC_CTX		*log_ctx;			//!< Talloc pool used to avoid allocing memory
 								//!< when log strings need to be copied.
 } rlm_sql_handle_t;
@@ -160,6 +210,8 @@ extern size_t sql_rcode_table_len;
  */
 #define RLM_SQL_RCODE_FLAGS_ALT_QUERY	1			//!< Can distinguish between other errors and those
 								//!< resulting from a unique key violation.
+#define RLM_SQL_FLAGS_PARAMS		2			//!< Runs queries with bind parameters, when
+								//!< rlm_sql_handle_t.params is set.
 
 /** Retrieve errors from the last query operation
  *
@@ -211,11 +263,62 @@ typedef struct {
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
 	xlat_escape_t	sql_escape_func;
+
+	/** @name Non-blocking queries
+	 *
+	 * Optional.  If sql_query_submit is set, the others must be too.
+	 * Used so that queries which don't return rows can be run without
+	 * blocking the worker thread.
+	 *
+	 * @{
+	 */
+	sql_rcode_t (*sql_query_submit)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					char const *query);	//!< Send a query, without waiting for the result.
+	int (*sql_query_socket)(rlm_sql_handle_t *handle,
+				rlm_sql_config_t *config);	//!< Return the socket to wait on for the result.
+	int (*sql_query_busy)(rlm_sql_handle_t *handle,
+			      rlm_sql_config_t *config);	//!< Called when the socket is readable.  Reads any
+								///< available data, returning 1 if the result isn't
+								///< complete, 0 if it is, and -1 on error.
+	sql_rcode_t (*sql_query_result)(rlm_sql_handle_t *handle,
+					rlm_sql_config_t *config);	//!< Process the result, returning the same codes
+									///< as sql_query.
+	/** @} */
+
+	/** @name Typed results
+	 *
+	 * Optional.  Used instead of sql_fetch_row where the caller can use
+	 * values in their native form, so they aren't printed to strings
+	 * by the driver, then parsed again.
+	 *
+	 * @{
+	 */
+	sql_rcode_t (*sql_fetch_values)(fr_value_box_t const **out, rlm_sql_handle_t *handle,
+					rlm_sql_config_t *config);	//!< Fetch the next row, writing a pointer to an
+									///< array of sql_num_fields boxes to out.
+									///< Strings and octets point into the driver's
+									///< result buffers, and are only valid until the
+									///< next row is fetched.  NULL columns are
+									///< #FR_TYPE_INVALID.
+	/** @} */
 } rlm_sql_driver_t;
 
+/** Connections to a read replica
+ *
+ */
+typedef struct {
+	fr_pool_t		*pool;				//!< Connections to the replica.
+	rlm_sql_config_t	config;				//!< Copy of the module's config, with the replica's
+								///< server and credentials, passed to sql_socket_init.
+
+	atomic_int_fast64_t	next_check;			//!< When lag_query should next be run.
+	atomic_bool		lagging;			//!< Replica was too far behind when last checked.
+} sql_replica_t;
+
 struct sql_inst {
 	rlm_sql_config_t	myconfig; /* HACK */
 	fr_pool_t		*pool;
+	sql_replica_t		*replica;		//!< Read replica, or NULL if reads go to the primary.
 	rlm_sql_config_t	*config;
 	CONF_SECTION		*cs;
 
@@ -243,14 +346,26 @@ struct rlm_sql_grouplist_s {
 };
 
 void		*sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
+void		*sql_mod_replica_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
+fr_pool_t	*sql_handle_pool(rlm_sql_t const *inst, rlm_sql_handle_t const *handle) CC_HINT(nonnull);
+void		sql_handle_release(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle) CC_HINT(nonnull(1));
+bool		sql_query_is_read(char const *query) CC_HINT(nonnull);
+rlm_sql_handle_t *sql_read_handle_get(rlm_sql_t const *inst, REQUEST *request) CC_HINT(nonnull(1));
 int		sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **first_pair, rlm_sql_row_t row);
 int		sql_read_realms(rlm_sql_handle_t *handle);
+ssize_t		sql_query_expand(TALLOC_CTX *ctx, char **out, rlm_sql_t const *inst, REQUEST *request,
+				 rlm_sql_handle_t *handle, char const *fmt) CC_HINT(nonnull);
 int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair, char const *query);
 int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section, char const *query) CC_HINT(nonnull (1, 2, 4));
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_query_submit(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull);
+sql_rcode_t	rlm_sql_query_send(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_query_result(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle) CC_HINT(nonnull (1, 3));
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle);
+sql_rcode_t	rlm_sql_fetch_values(fr_value_box_t const **out, rlm_sql_t const *inst, REQUEST *request,
+				     rlm_sql_handle_t **handle) CC_HINT(nonnull (1, 2, 4));
 void		rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username);
 
@@ -63,10 +63,10 @@ fr_table_num_sorted_t const sql_rcode_table[] = {
 };
 size_t sql_rcode_table_len = NUM_ELEMENTS(sql_rcode_table);
 
-void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout)
+static void *sql_conn_create(TALLOC_CTX *ctx, rlm_sql_t *inst, rlm_sql_config_t *config, bool replica,
+			     fr_time_delta_t timeout)
 {
 	int rcode;
-	rlm_sql_t *inst = instance;
 	rlm_sql_handle_t *handle;
 
 	/*
@@ -87,8 +87,9 @@ void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeo
 	 *	destructor has access to the module configuration.
 	 */
 	handle->inst = inst;
+	handle->replica = replica;
 
-	rcode = (inst->driver->sql_socket_init)(handle, inst->config, timeout);
+	rcode = (inst->driver->sql_socket_init)(handle, config, timeout);
 	if (rcode != 0) {
 	fail:
 		/*
@@ -106,6 +107,169 @@ void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeo
 	return handle;
 }
 
+void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout)
+{
+	rlm_sql_t *inst = instance;
+
+	return sql_conn_create(ctx, inst, inst->config, false, timeout);
+}
+
+/** Open a connection to the read replica
+ *
+ * The driver is given a copy of the module's config, with the replica's
+ * server and credentials, so drivers don't need to know about replicas.
+ */
+void *sql_mod_replica_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout)
+{
+	rlm_sql_t *inst = instance;
+
+	return sql_conn_create(ctx, inst, &inst->replica->config, true, timeout);
+}
+
+/** Return the pool a connection was taken from
+ *
+ */
+fr_pool_t *sql_handle_pool(rlm_sql_t const *inst, rlm_sql_handle_t const *handle)
+{
+	return handle->replica ? inst->replica->pool : inst->pool;
+}
+
+/** Release a connection back to the pool it was taken from
+ *
+ * @param inst		#rlm_sql_t instance data.
+ * @param request	Current request.  May be NULL.
+ * @param handle	to release.  May be NULL, if reconnecting failed.
+ */
+void sql_handle_release(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle)
+{
+	if (!handle) return;
+
+	fr_pool_connection_release(sql_handle_pool(inst, handle), request, handle);
+}
+
+/** Whether a query only reads, and so may be sent to a replica
+ *
+ * Only plain SELECTs qualify.  SELECT ... FOR UPDATE/FOR SHARE takes locks,
+ * and SELECT ... INTO creates tables, so both go to the primary, as does
+ * anything we don't recognise.
+ */
+bool sql_query_is_read(char const *query)
+{
+	char const *p = query;
+
+	fr_skip_whitespace(p);
+	while (*p == '(') {
+		p++;
+		fr_skip_whitespace(p);
+	}
+
+	if ((strncasecmp(p, "select", 6) != 0) || isalnum((uint8_t) p[6]) || (p[6] == '_')) return false;
+
+	for (p += 6; *p; p++) {
+		char const *q;
+
+		if (!isspace((uint8_t) p[-1])) continue;
+
+		if ((strncasecmp(p, "into", 4) == 0) && !isalnum((uint8_t) p[4])) return false;
+		if ((strncasecmp(p, "for", 3) != 0) || !isspace((uint8_t) p[3])) continue;
+
+		q = p + 3;
+		fr_skip_whitespace(q);
+		if ((strncasecmp(q, "update", 6) == 0) || (strncasecmp(q, "share", 5) == 0)) return false;
+	}
+
+	return true;
+}
+
+/** Run the lag_query on a replica connection, and record whether it's too far behind
+ *
+ * @return
+ *	- 0 if the replica may be used.
+ *	- -1 if it's lagging, or the lag couldn't be determined.
+ *	  If the connection failed, *handle is set to NULL.
+ */
+static int sql_replica_lag_check(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle)
+{
+	sql_replica_t		*replica = inst->replica;
+	rlm_sql_row_t		row;
+	char			*end;
+	unsigned long		lag = 0;
+	bool			lagging = true;
+
+	if (rlm_sql_select_query(inst, request, handle, inst->config->replica.lag_query) != RLM_SQL_OK) goto done;
+
+	if (rlm_sql_fetch_row(&row, inst, request, handle) == RLM_SQL_OK) {
+		/*
+		 *	NULL is what MySQL returns when replication has stopped.
+		 */
+		if (row[0]) {
+			lag = strtoul(row[0], &end, 10);
+			lagging = ((end == row[0]) || (lag > inst->config->replica.max_lag));
+		}
+	}
+	if (*handle) (inst->driver->sql_finish_select_query)(*handle, inst->config);
+
+done:
+	if (lagging != atomic_exchange(&replica->lagging, lagging)) {
+		if (lagging) {
+			ROPTIONAL(RWARN, WARN, "Read replica is lagging (%lu seconds), sending reads to the primary",
+				  lag);
+		} else {
+			ROPTIONAL(RINFO, INFO, "Read replica has caught up (%lu seconds), sending reads to it", lag);
+		}
+	}
+
+	return lagging ? -1 : 0;
+}
+
+/** Get a connection for a query which only reads
+ *
+ * Uses the read replica if one is configured and isn't lagging, otherwise
+ * the primary.  The connection should be released to #sql_handle_pool.
+ *
+ * @param inst		#rlm_sql_t instance data.
+ * @param request	Current request.  May be NULL.
+ * @return a connection, or NULL if neither the replica nor the primary had one.
+ */
+rlm_sql_handle_t *sql_read_handle_get(rlm_sql_t const *inst, REQUEST *request)
+{
+	sql_replica_t		*replica = inst->replica;
+	rlm_sql_handle_t	*handle;
+	bool			check = false;
+
+	if (!replica) goto primary;
+
+	/*
+	 *	Only one thread runs the lag_query at a time.
+	 *	Everyone else uses the result of the last check.
+	 */
+	if (inst->config->replica.lag_query) {
+		fr_time_t	now = fr_time();
+		int_fast64_t	next = atomic_load(&replica->next_check);
+
+		check = (now >= next) &&
+			atomic_compare_exchange_strong(&replica->next_check, &next,
+						       now + inst->config->replica.lag_interval);
+	}
+	if (!check && atomic_load(&replica->lagging)) goto primary;
+
+	handle = fr_pool_connection_get(replica->pool, request);
+	if (!handle) {
+		ROPTIONAL(RWDEBUG, WARN, "No connections to read replica available, using the primary");
+		goto primary;
+	}
+
+	if (check && (sql_replica_lag_check(inst, request, &handle) < 0)) {
+		if (handle) fr_pool_connection_release(replica->pool, request, handle);
+		goto primary;
+	}
+
+	return handle;
+
+primary:
+	return fr_pool_connection_get(inst->pool, request);
+}
+
 /*************************************************************************
  *
  *	Function: sql_fr_pair_list_afrom_str
@@ -266,6 +430,45 @@ sql_rcode_t rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST
 	}
 }
 
+/** Call the driver's sql_fetch_values function
+ *
+ * Like #rlm_sql_fetch_row, but the row is returned as boxes in the
+ * type the database returned them, without being copied.
+ *
+ * @param out Where to write a pointer to the row's values.  There are
+ *	sql_num_fields values, valid until the next row is fetched.
+ * @param inst Instance of #rlm_sql_t.
+ * @param request The Current request, may be NULL.
+ * @param handle Handle to retrieve errors for.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- other #sql_rcode_t constants on error.
+ */
+sql_rcode_t rlm_sql_fetch_values(fr_value_box_t const **out, rlm_sql_t const *inst, REQUEST *request,
+				 rlm_sql_handle_t **handle)
+{
+	sql_rcode_t ret;
+
+	fr_assert(inst->driver->sql_fetch_values);
+
+	if (!*handle || !(*handle)->conn) return RLM_SQL_ERROR;
+
+	ret = (inst->driver->sql_fetch_values)(out, *handle, inst->config);
+	switch (ret) {
+	case RLM_SQL_OK:
+		fr_assert(*out != NULL);
+		return ret;
+
+	case RLM_SQL_NO_MORE_ROWS:
+		return ret;
+
+	default:
+		ROPTIONAL(RERROR, ERROR, "Error fetching row");
+		rlm_sql_print_error(inst, request, *handle, false);
+		return ret;
+	}
+}
+
 /** Retrieve any errors from the SQL driver
  *
  * Retrieves errors from the driver from the last operation and writes them to
@@ -317,6 +520,217 @@ void rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle
 	talloc_free_children(handle->log_ctx);
 }
 
+/** Print any errors from a failed query, and rewrite the rcode if needed
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.  May be NULL.
+ * @param handle the query was run on.
+ * @param ret returned by the driver.
+ * @return the rcode to return to the caller.
+ */
+static sql_rcode_t sql_query_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, sql_rcode_t ret)
+{
+	switch (ret) {
+	/*
+	 *	These are bad and should make rlm_sql return invalid
+	 */
+	case RLM_SQL_QUERY_INVALID:
+		rlm_sql_print_error(inst, request, handle, false);
+		(inst->driver->sql_finish_query)(handle, inst->config);
+		break;
+
+	/*
+	 *	Server or client errors.
+	 *
+	 *	If the driver claims to be able to distinguish between
+	 *	duplicate row errors and other errors, and we hit a
+	 *	general error treat it as a failure.
+	 *
+	 *	Otherwise rewrite it to RLM_SQL_ALT_QUERY.
+	 */
+	case RLM_SQL_ERROR:
+		if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
+			rlm_sql_print_error(inst, request, handle, false);
+			(inst->driver->sql_finish_query)(handle, inst->config);
+			break;
+		}
+		ret = RLM_SQL_ALT_QUERY;
+		FALL_THROUGH;
+
+	/*
+	 *	Driver suggested using an alternative query
+	 */
+	case RLM_SQL_ALT_QUERY:
+		rlm_sql_print_error(inst, request, handle, true);
+		(inst->driver->sql_finish_query)(handle, inst->config);
+		break;
+
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+/** Stands in for an expansion in the query text, until we know how it'll be passed
+ *
+ */
+#define SQL_PARAM_MARKER	'\001'
+
+typedef struct {
+	rlm_sql_params_t	*params;	//!< Values recorded so far.
+	char const		*last;		//!< The last marker we wrote.
+} sql_param_escape_t;
+
+/** Record the value of an expansion, writing a marker in its place
+ *
+ * Alternations escape the output of the expansion they chose a second
+ * time, so our own marker is passed through unchanged.
+ */
+static size_t sql_param_escape(UNUSED REQUEST *request, char *out, size_t outlen, char const *in, void *arg)
+{
+	sql_param_escape_t	*pe = arg;
+	rlm_sql_params_t	*params = pe->params;
+
+	if (outlen < 2) return 0;
+
+	if ((in != pe->last) || (in[0] != SQL_PARAM_MARKER) || (in[1] != '\0')) {
+		MEM(params->values = talloc_realloc(params, params->values, char const *, params->num + 1));
+		MEM(params->values[params->num++] = talloc_typed_strdup(params, in));
+	}
+
+	out[0] = SQL_PARAM_MARKER;
+	out[1] = '\0';
+	pe->last = out;
+
+	return 1;
+}
+
+/** Whether a character next to a marker stops it being passed as a parameter
+ *
+ */
+static inline bool sql_param_adjacent(char c)
+{
+	return isalnum((uint8_t)c) || (c == '_') || (c == '$') || (c == '"') || (c == '\'') ||
+	       (c == SQL_PARAM_MARKER);
+}
+
+/** Find the values bound to a query by #sql_query_expand
+ *
+ * The values are freed with the request.
+ */
+static rlm_sql_params_t *sql_params_find(rlm_sql_t const *inst, REQUEST *request, char const *query)
+{
+	rlm_sql_params_t *params;
+
+	if (!request || !(inst->driver->flags & RLM_SQL_FLAGS_PARAMS)) return NULL;
+
+	params = request_data_get(request, inst, 0);
+	if (!params) return NULL;
+
+	if (strcmp(params->query, query) != 0) {
+		talloc_free(params);
+		return NULL;
+	}
+
+	return params;
+}
+
+/** Expand a query, escaping the values of any expansions
+ *
+ * If prepared_statements is enabled, and the driver supports it, each
+ * expansion which is a complete value, i.e. '%{User-Name}' or a bare
+ * %{Acct-Session-Time}, is replaced by a parameter.  The query text is
+ * then the same for every request, so the driver can prepare it once
+ * per connection, and the values don't need escaping.
+ *
+ * Queries where an expansion is only part of a value, or of an
+ * identifier, fall back to escaping the values into the text.
+ *
+ * @param[in] ctx	to allocate the expanded query in.
+ * @param[out] out	Where to write the expanded query.
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in] request	Current request.
+ * @param[in] handle	the query will be run on.  Passed to the escape function.
+ * @param[in] fmt	of the query.
+ * @return
+ *	- Length of the expanded query.
+ *	- <0 on error.
+ */
+ssize_t sql_query_expand(TALLOC_CTX *ctx, char **out, rlm_sql_t const *inst, REQUEST *request,
+			 rlm_sql_handle_t *handle, char const *fmt)
+{
+	sql_param_escape_t	pe = { 0 };
+	rlm_sql_params_t	*params;
+	char			*skel, *p, *q, *query;
+	int			i;
+	bool			use_params = true;
+
+	if (!inst->config->prepared_statements || !(inst->driver->flags & RLM_SQL_FLAGS_PARAMS)) {
+		return xlat_aeval(ctx, out, request, fmt, inst->sql_escape_func, handle);
+	}
+
+	MEM(params = pe.params = talloc_zero(request, rlm_sql_params_t));
+	if (xlat_aeval(params, &skel, request, fmt, sql_param_escape, &pe) < 0) {
+		talloc_free(params);
+		return -1;
+	}
+
+	/*
+	 *	Every marker must have a value, and each must be a
+	 *	complete value to be passed as a parameter.
+	 */
+	for (p = skel, i = 0; (p = strchr(p, SQL_PARAM_MARKER)); p++, i++) {
+		bool quoted = (p > skel) && (p[-1] == '\'') && (p[1] == '\'');
+
+		if (!quoted && (((p > skel) && sql_param_adjacent(p[-1])) || sql_param_adjacent(p[1]))) {
+			use_params = false;
+		}
+	}
+	if (i != params->num) {
+		RDEBUG3("Query expansions couldn't be separated, escaping them instead");
+		talloc_free(params);
+		return xlat_aeval(ctx, out, request, fmt, inst->sql_escape_func, handle);
+	}
+
+	MEM(query = talloc_strdup(ctx, ""));
+	for (p = skel, i = 0; (q = strchr(p, SQL_PARAM_MARKER)); p = q + 1, i++) {
+		if (use_params) {
+			bool quoted = (q > skel) && (q[-1] == '\'');
+
+			MEM(query = talloc_strndup_append_buffer(query, p, (q - p) - quoted));
+			MEM(query = talloc_asprintf_append_buffer(query, "$%i", i + 1));
+			if (quoted) q++;
+		} else {
+			size_t	len = (strlen(params->values[i]) * 3) + 1;
+			char	*escaped;
+
+			MEM(escaped = talloc_zero_array(params, char, len));
+			inst->sql_escape_func(request, escaped, len, params->values[i], handle);
+
+			MEM(query = talloc_strndup_append_buffer(query, p, q - p));
+			MEM(query = talloc_strdup_append_buffer(query, escaped));
+		}
+	}
+	MEM(query = talloc_strdup_append_buffer(query, p));
+	*out = query;
+
+	if (!use_params || !params->num) {
+		talloc_free(params);
+		return talloc_array_length(query) - 1;
+	}
+
+	talloc_free(skel);
+	MEM(params->query = talloc_typed_strdup(params, query));
+	if (request_data_talloc_add(request, inst, 0, rlm_sql_params_t, params, true, true, false) < 0) {
+		talloc_free(params);
+		TALLOC_FREE(*out);
+		return -1;
+	}
+
+	return talloc_array_length(query) - 1;
+}
+
 /** Call the driver's sql_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
@@ -337,6 +751,8 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
+	rlm_sql_params_t *params;
+	fr_pool_t *pool;
 
 	/* Caller should check they have a valid handle */
 	fr_assert(*handle);
@@ -348,9 +764,12 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 	}
 
 	/*
-	 *  inst->pool may be NULL is this function is called by sql_mod_conn_create.
+	 *  The pool may be NULL is this function is called by sql_mod_conn_create.
 	 */
-	count = inst->pool ? fr_pool_state(inst->pool)->num : 0;
+	params = sql_params_find(inst, request, query);
+
+	pool = sql_handle_pool(inst, *handle);
+	count = pool ? fr_pool_state(pool)->num : 0;
 
 	/*
 	 *  Here we try with each of the existing connections, then try to create
@@ -359,7 +778,9 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 	for (i = 0; i < (count + 1); i++) {
 		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query);
 
+		(*handle)->params = params;
 		ret = (inst->driver->sql_query)(*handle, inst->config, query);
+		(*handle)->params = NULL;
 		switch (ret) {
 		case RLM_SQL_OK:
 			break;
@@ -369,56 +790,150 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
 		case RLM_SQL_RECONNECT:
-			*handle = fr_pool_connection_reconnect(inst->pool, request, *handle);
+			*handle = fr_pool_connection_reconnect(pool, request, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
 			continue;
 
-		/*
-		 *	These are bad and should make rlm_sql return invalid
-		 */
-		case RLM_SQL_QUERY_INVALID:
-			rlm_sql_print_error(inst, request, *handle, false);
-			(inst->driver->sql_finish_query)(*handle, inst->config);
+		default:
+			ret = sql_query_error(inst, request, *handle, ret);
 			break;
+		}
 
-		/*
-		 *	Server or client errors.
-		 *
-		 *	If the driver claims to be able to distinguish between
-		 *	duplicate row errors and other errors, and we hit a
-		 *	general error treat it as a failure.
-		 *
-		 *	Otherwise rewrite it to RLM_SQL_ALT_QUERY.
-		 */
-		case RLM_SQL_ERROR:
-			if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
-				rlm_sql_print_error(inst, request, *handle, false);
-				(inst->driver->sql_finish_query)(*handle, inst->config);
-				break;
-			}
-			ret = RLM_SQL_ALT_QUERY;
-			FALL_THROUGH;
+		return ret;
+	}
 
-		/*
-		 *	Driver suggested using an alternative query
-		 */
-		case RLM_SQL_ALT_QUERY:
-			rlm_sql_print_error(inst, request, *handle, true);
-			(inst->driver->sql_finish_query)(*handle, inst->config);
+	ROPTIONAL(RERROR, ERROR, "Hit reconnection limit");
+
+	return RLM_SQL_ERROR;
+}
+
+/** Call the driver's sql_query_submit method, reconnecting if necessary.
+ *
+ * The result should be retrieved with #rlm_sql_query_result once the driver's
+ * sql_query_busy method indicates it's available.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param query to execute. Should not be zero length.
+ * @return
+ *	- #RLM_SQL_OK if the query was sent.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation.
+ */
+sql_rcode_t rlm_sql_query_submit(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query)
+{
+	int ret = RLM_SQL_ERROR;
+	int i, count;
+	rlm_sql_params_t *params;
+	fr_pool_t *pool;
+
+	fr_assert(*handle);
+	fr_assert(inst->driver->sql_query_submit);
+
+	if (query[0] == '\0') {
+		REDEBUG("Zero length query");
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	params = sql_params_find(inst, request, query);
+
+	pool = sql_handle_pool(inst, *handle);
+	count = fr_pool_state(pool)->num;
+
+	for (i = 0; i < (count + 1); i++) {
+		RDEBUG2("Submitting query: %s", query);
+
+		(*handle)->params = params;
+		ret = (inst->driver->sql_query_submit)(*handle, inst->config, query);
+		(*handle)->params = NULL;
+		switch (ret) {
+		case RLM_SQL_OK:
 			break;
 
+		case RLM_SQL_RECONNECT:
+			*handle = fr_pool_connection_reconnect(pool, request, *handle);
+			if (!*handle) return RLM_SQL_RECONNECT;
+			continue;
+
+		default:
+			ret = sql_query_error(inst, request, *handle, ret);
+			break;
 		}
 
 		return ret;
 	}
 
-	ROPTIONAL(RERROR, ERROR, "Hit reconnection limit");
+	RERROR("Hit reconnection limit");
 
 	return RLM_SQL_ERROR;
 }
 
+/** Call the driver's sql_query_submit method, without reconnecting
+ *
+ * Used where the connection can't be replaced, e.g. because it has a
+ * transaction open.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.  May be NULL.
+ * @param handle to send the query on.
+ * @param query to execute.
+ * @return the rcode returned by the driver.
+ */
+sql_rcode_t rlm_sql_query_send(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, char const *query)
+{
+	sql_rcode_t ret;
+
+	fr_assert(inst->driver->sql_query_submit);
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Submitting query: %s", query);
+
+	handle->params = sql_params_find(inst, request, query);
+	ret = (inst->driver->sql_query_submit)(handle, inst->config, query);
+	handle->params = NULL;
+
+	return ret;
+}
+
+/** Call the driver's sql_query_result method, for a query sent with #rlm_sql_query_submit
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.  May be NULL.
+ * @param handle the query was submitted on.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if the connection failed.  The handle is closed, and *handle is set to NULL.
+ *	  The query isn't retried, as it may already have been run.
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation.
+ */
+sql_rcode_t rlm_sql_query_result(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle)
+{
+	sql_rcode_t ret;
+
+	ret = (inst->driver->sql_query_result)(*handle, inst->config);
+	switch (ret) {
+	case RLM_SQL_OK:
+		return ret;
+
+	case RLM_SQL_RECONNECT:
+		rlm_sql_print_error(inst, request, *handle, false);
+		fr_pool_connection_close(sql_handle_pool(inst, *handle), request, *handle);
+		*handle = NULL;
+		return ret;
+
+	default:
+		return sql_query_error(inst, request, *handle, ret);
+	}
+}
+
 /** Call the driver's sql_select_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->driver->sql_finish_select_query)(handle, inst->config);``
@@ -438,6 +953,8 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
+	rlm_sql_params_t *params;
+	fr_pool_t *pool;
 
 	/* Caller should check they have a valid handle */
 	fr_assert(*handle);
@@ -450,9 +967,12 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 	}
 
 	/*
-	 *  inst->pool may be NULL is this function is called by sql_mod_conn_create.
+	 *  The pool may be NULL is this function is called by sql_mod_conn_create.
 	 */
-	count = inst->pool ? fr_pool_state(inst->pool)->num : 0;
+	params = sql_params_find(inst, request, query);
+
+	pool = sql_handle_pool(inst, *handle);
+	count = pool ? fr_pool_state(pool)->num : 0;
 
 	/*
 	 *  For sanity, for when no connections are viable, and we can't make a new one
@@ -460,7 +980,9 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 	for (i = 0; i < (count + 1); i++) {
 		ROPTIONAL(RDEBUG2, DEBUG2, "Executing select query: %s", query);
 
+		(*handle)->params = params;
 		ret = (inst->driver->sql_select_query)(*handle, inst->config, query);
+		(*handle)->params = NULL;
 		switch (ret) {
 		case RLM_SQL_OK:
 			break;
@@ -470,7 +992,7 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
 		case RLM_SQL_RECONNECT:
-			*handle = fr_pool_connection_reconnect(inst->pool, request, *handle);
+			*handle = fr_pool_connection_reconnect(pool, request, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
@@ -493,6 +1015,74 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 }
 
 
+/** Build pairs from rows returned by the driver's sql_fetch_values
+ *
+ * The check and reply columns are text, so rows are passed to
+ * #sql_fr_pair_list_afrom_str pointing straight at the driver's buffers,
+ * instead of at copies of them.
+ */
+static int sql_getvpdata_values(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request,
+				rlm_sql_handle_t **handle, VALUE_PAIR **pair)
+{
+	fr_value_box_t const	*values;
+	char			*row[5];
+	char			buffer[5][64];
+	int			rows = 0, num, i;
+	TALLOC_CTX		*tmp_ctx;
+
+	num = (inst->driver->sql_num_fields)(*handle, inst->config);
+	if (num > (int) NUM_ELEMENTS(row)) num = NUM_ELEMENTS(row);
+
+	MEM(tmp_ctx = talloc_new(request));
+
+	while (rlm_sql_fetch_values(&values, inst, request, handle) == RLM_SQL_OK) {
+		memset(row, 0, sizeof(row));
+
+		for (i = 0; i < num; i++) {
+			switch (values[i].type) {
+			case FR_TYPE_INVALID:
+				break;
+
+			/*
+			 *	Drivers NUL terminate their text buffers.
+			 */
+			case FR_TYPE_STRING:
+				memcpy(&row[i], &values[i].vb_strvalue, sizeof(row[i]));
+				break;
+
+			/*
+			 *	Binary columns are rare, so copying them
+			 *	as sql_fetch_row would have done is fine.
+			 */
+			case FR_TYPE_OCTETS:
+				MEM(row[i] = talloc_bstrndup(tmp_ctx, (char const *) values[i].vb_octets,
+							     values[i].vb_length));
+				break;
+
+			default:
+				if (fr_value_box_snprint(buffer[i], sizeof(buffer[i]), &values[i], '\0') >= sizeof(buffer[i])) {
+					REDEBUG("Column %i is too long", i);
+					talloc_free(tmp_ctx);
+					return -1;
+				}
+				row[i] = buffer[i];
+				break;
+			}
+		}
+
+		if (sql_fr_pair_list_afrom_str(ctx, request, pair, row) != 0) {
+			REDEBUG("Error parsing user data from database result");
+			talloc_free(tmp_ctx);
+			return -1;
+		}
+		talloc_free_children(tmp_ctx);
+		rows++;
+	}
+	talloc_free(tmp_ctx);
+
+	return rows;
+}
+
 /*************************************************************************
  *
  *	Function: sql_getvpdata
@@ -512,6 +1102,13 @@ int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_
 	rcode = rlm_sql_select_query(inst, request, handle, query);
 	if (rcode != RLM_SQL_OK) return -1; /* error handled by rlm_sql_select_query */
 
+	if (inst->driver->sql_fetch_values && inst->driver->sql_num_fields) {
+		rows = sql_getvpdata_values(ctx, inst, request, handle, pair);
+		(inst->driver->sql_finish_select_query)(*handle, inst->config);
+
+		return rows;
+	}
+
 	while (rlm_sql_fetch_row(&row, inst, request, handle) == RLM_SQL_OK) {
 		if (sql_fr_pair_list_afrom_str(ctx, request, pair, row) != 0) {
 			REDEBUG("Error parsing user data from database result");
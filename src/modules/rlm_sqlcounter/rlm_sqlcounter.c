@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 
 #include <ctype.h>
+#include <pthread.h>
 
 #define MAX_QUERY_LEN 1024
 
@@ -69,10 +70,30 @@ typedef struct {
 	char const	*query;		//!< SQL query to retrieve current session time.
 	char const	*reset;  	//!< Daily, weekly, monthly, never or user defined.
 
+	vp_tmpl_t	*increment;	//!< How much an accounting packet adds to the counter.
+
+	uint32_t	cache_size;	//!< Maximum number of counters to keep in memory.
+	fr_time_delta_t	cache_lifetime;	//!< How long before a cached counter is re-read from SQL.
+
 	fr_time_t	reset_time;
 	fr_time_t	last_reset;
+
+	fr_hash_table_t	*cache;		//!< Counters, indexed by key.
+	fr_dlist_head_t	lru;		//!< Counters, most recently used first.
+	pthread_mutex_t	mutex;		//!< Protects the cache.
 } rlm_sqlcounter_t;
 
+/** A counter held in memory
+ *
+ */
+typedef struct {
+	char const	*key;		//!< The counter is for.
+	uint64_t	counter;	//!< Value read from SQL, plus any accounting since.
+	fr_time_t	reconciled;	//!< When the value was read from SQL.
+	fr_time_t	last_reset;	//!< The period the value belongs to.
+	fr_dlist_t	entry;		//!< Entry in the LRU list.
+} sqlcounter_entry_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("sql_module_instance", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_sqlcounter_t, sqlmod_inst) },
 
@@ -88,6 +109,10 @@ static const CONF_PARSER module_config[] = {
 
 	/* Attribute to write remaining session to */
 	{ FR_CONF_OFFSET("reply_name", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE, rlm_sqlcounter_t, reply_attr) },
+
+	{ FR_CONF_OFFSET("increment", FR_TYPE_TMPL, rlm_sqlcounter_t, increment) },
+	{ FR_CONF_OFFSET("cache_size", FR_TYPE_UINT32, rlm_sqlcounter_t, cache_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("cache_lifetime", FR_TYPE_TIME_DELTA, rlm_sqlcounter_t, cache_lifetime), .dflt = "300" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -337,15 +362,14 @@ static ssize_t sqlcounter_expand(char *out, int outlen, rlm_sqlcounter_t const *
 }
 
 
-/*
- *	See if the counter matches.
+/** Read the current value of the counter from SQL
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
-		       UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+static int sqlcounter_query(rlm_sqlcounter_t const *inst, REQUEST *request, uint64_t *counter)
 {
-	rlm_sqlcounter_t const *inst = talloc_get_type_abort_const(instance, rlm_sqlcounter_t);
-	uint64_t counter;
-
 	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
 	char *expanded = NULL;
 	size_t len;
@@ -353,28 +377,152 @@ static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	/* First, expand %k, %b and %e in query */
 	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
 		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Then combine that with the name of the module were using to do the query */
 	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= sizeof(query) - 1) {
+	if (len >= (sizeof(query) - 1)) {
 		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Finally, xlat resulting SQL query */
-	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
-	}
+	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) return -1;
 
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in string \"%s\"", expanded);
+	if (sscanf(expanded, "%" PRIu64, counter) != 1) {
+		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
+			expanded);
+		*counter = 0;
 	}
 	talloc_free(expanded);
 
+	return 0;
+}
+
+static uint32_t sqlcounter_entry_hash(void const *data)
+{
+	sqlcounter_entry_t const *e = data;
+
+	return fr_hash_string(e->key);
+}
+
+static int sqlcounter_entry_cmp(void const *one, void const *two)
+{
+	sqlcounter_entry_t const *a = one, *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+/** Find the cached counter for a key, moving it to the head of the LRU list
+ *
+ * Counters from a previous period are removed.
+ *
+ * @note Must be called with the mutex held.
+ */
+static sqlcounter_entry_t *sqlcounter_cache_find(rlm_sqlcounter_t *inst, char const *key)
+{
+	sqlcounter_entry_t *e;
+
+	e = fr_hash_table_finddata(inst->cache, &(sqlcounter_entry_t){ .key = key });
+	if (!e) return NULL;
+
+	fr_dlist_remove(&inst->lru, e);
+
+	if (e->last_reset != inst->last_reset) {
+		fr_hash_table_delete(inst->cache, e);
+		talloc_free(e);
+		return NULL;
+	}
+
+	fr_dlist_insert_head(&inst->lru, e);
+
+	return e;
+}
+
+/** Get the current value of the counter
+ *
+ * If caching is enabled, the counter is read from SQL the first time
+ * the key is seen, and again once it's older than cache_lifetime.
+ * In between, the value is kept up to date by mod_accounting.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sqlcounter_get(rlm_sqlcounter_t *inst, REQUEST *request, uint64_t *counter)
+{
+	sqlcounter_entry_t	*e;
+	char			*key;
+
+	if (!inst->cache) return sqlcounter_query(inst, request, counter);
+
+	if (tmpl_aexpand(request, &key, request, inst->key, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding key");
+		return -1;
+	}
+
+	pthread_mutex_lock(&inst->mutex);
+	e = sqlcounter_cache_find(inst, key);
+	if (e && ((request->packet->timestamp - e->reconciled) < inst->cache_lifetime)) {
+		*counter = e->counter;
+		pthread_mutex_unlock(&inst->mutex);
+
+		RDEBUG2("Using cached counter value (%" PRIu64 ") for \"%s\"", *counter, key);
+		talloc_free(key);
+		return 0;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	/*
+	 *	Don't hold the mutex while we're waiting on SQL.
+	 */
+	if (sqlcounter_query(inst, request, counter) < 0) {
+		talloc_free(key);
+		return -1;
+	}
+
+	pthread_mutex_lock(&inst->mutex);
+	e = sqlcounter_cache_find(inst, key);
+	if (!e) {
+		if (fr_hash_table_num_elements(inst->cache) >= (int)inst->cache_size) {
+			sqlcounter_entry_t *old = fr_dlist_tail(&inst->lru);
+
+			fr_dlist_remove(&inst->lru, old);
+			fr_hash_table_delete(inst->cache, old);
+			talloc_free(old);
+		}
+
+		MEM(e = talloc_zero(inst->cache, sqlcounter_entry_t));
+		e->key = talloc_steal(e, key);
+		e->last_reset = inst->last_reset;
+		if (!fr_hash_table_insert(inst->cache, e)) {
+			pthread_mutex_unlock(&inst->mutex);
+			talloc_free(e);
+			return 0;
+		}
+		fr_dlist_insert_head(&inst->lru, e);
+	} else {
+		talloc_free(key);
+	}
+	e->counter = *counter;
+	e->reconciled = request->packet->timestamp;
+	pthread_mutex_unlock(&inst->mutex);
+
+	return 0;
+}
+
+/*
+ *	See if the counter matches.
+ */
+static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
+		       UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+{
+	rlm_sqlcounter_t *inst = talloc_get_type_abort(instance, rlm_sqlcounter_t);
+	uint64_t counter;
+
+	if (sqlcounter_get(inst, request, &counter) < 0) return RLM_MODULE_FAIL;
+
 	if (counter < check->vp_uint64) return -1;
 	if (counter > check->vp_uint64) return 1;
 	return 0;
@@ -395,11 +543,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQU
 	char			msg[128];
 	int			ret;
 
-	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
-	char *expanded = NULL;
-
-	size_t len;
-
 	/*
 	 *	Before doing anything else, see if we have to reset
 	 *	the counters.
@@ -417,32 +560,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQU
 		return RLM_MODULE_NOOP;
 	}
 
-	/* First, expand %k, %b and %e in query */
-	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
-		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/* Then combine that with the name of the module were using to do the query */
-	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= (sizeof(query) - 1)) {
-		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/* Finally, xlat resulting SQL query */
-	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
-	}
-	talloc_free(expanded);
-
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
-			expanded);
-		counter = 0;
-	}
+	if (sqlcounter_get(inst, request, &counter) < 0) return RLM_MODULE_FAIL;
 
 	/*
 	 *	Check if check item > counter
@@ -522,6 +640,47 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(module_ctx_t const *mctx, REQU
 	return RLM_MODULE_OK;
 }
 
+/** Add the usage in an accounting packet to the cached counter
+ *
+ * Nothing is written to SQL, that's still the job of the sql module.
+ * If the key isn't cached, the next authorization reads the counter
+ * from SQL, which already includes this packet.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(module_ctx_t const *mctx, REQUEST *request)
+{
+	rlm_sqlcounter_t	*inst = talloc_get_type_abort(mctx->instance, rlm_sqlcounter_t);
+	sqlcounter_entry_t	*e;
+	uint64_t		increment;
+	char			*key;
+
+	if (!inst->cache || !inst->increment) return RLM_MODULE_NOOP;
+
+	if (tmpl_aexpand(request, &increment, request, inst->increment, NULL, NULL) < 0) {
+		RPWDEBUG2("Failed expanding increment, doing nothing...");
+		return RLM_MODULE_NOOP;
+	}
+
+	if (tmpl_aexpand(request, &key, request, inst->key, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding key");
+		return RLM_MODULE_FAIL;
+	}
+
+	pthread_mutex_lock(&inst->mutex);
+	e = sqlcounter_cache_find(inst, key);
+	if (!e) {
+		pthread_mutex_unlock(&inst->mutex);
+		talloc_free(key);
+		return RLM_MODULE_NOOP;
+	}
+	e->counter += increment;
+	pthread_mutex_unlock(&inst->mutex);
+
+	RDEBUG2("Added %" PRIu64 " to cached counter for \"%s\"", increment, key);
+	talloc_free(key);
+
+	return RLM_MODULE_UPDATED;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -557,6 +716,34 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->cache_size) {
+		if (!inst->cache_lifetime) {
+			cf_log_err(conf, "'cache_lifetime' must be non-zero");
+			return -1;
+		}
+
+		inst->cache = fr_hash_table_create(inst, sqlcounter_entry_hash, sqlcounter_entry_cmp, NULL);
+		if (!inst->cache) {
+			cf_log_err(conf, "Failed creating counter cache");
+			return -1;
+		}
+		fr_dlist_init(&inst->lru, sqlcounter_entry_t, entry);
+
+		if (pthread_mutex_init(&inst->mutex, NULL) < 0) {
+			cf_log_err(conf, "Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_sqlcounter_t *inst = talloc_get_type_abort(instance, rlm_sqlcounter_t);
+
+	if (inst->cache) pthread_mutex_destroy(&inst->mutex);
+
 	return 0;
 }
 
@@ -619,8 +806,10 @@ module_t rlm_sqlcounter = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
-		[MOD_AUTHORIZE]		= mod_authorize
+		[MOD_AUTHORIZE]		= mod_authorize,
+		[MOD_ACCOUNTING]	= mod_accounting
 	},
 };
 
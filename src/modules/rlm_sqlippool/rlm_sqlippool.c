@@ -452,6 +452,20 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	With no allocate_begin and no allocate_update,
+	 *	allocate_find claims the address itself, in a single
+	 *	statement or stored procedure.  There's no transaction
+	 *	to commit, so don't spend another round trip on it.
+	 */
+	if ((!inst->allocate_begin || !*inst->allocate_begin) &&
+	    (!inst->allocate_update || !*inst->allocate_update)) {
+		if (inst->allocate_commit && *inst->allocate_commit) {
+			cf_log_warn(conf, "Ignoring \"allocate_commit\", \"allocate_find\" is run without a transaction");
+		}
+		inst->allocate_commit = NULL;
+	}
+
 	return 0;
 }
 
@@ -40,27 +40,38 @@ RCSID("$Id$")
 
 #include <pthread.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/*
+ *	Each thread only ever increments its own counters.  They're
+ *	atomic so that they can be read by other threads without
+ *	locking, and are only summed when the statistics are queried.
+ */
 typedef struct {
-	pthread_mutex_t		mutex;
+	pthread_mutex_t		mutex;				//!< Protects the list, and the stats of
+								///< threads which have exited.
 	fr_dict_attr_t const	*type_da;			//!< FreeRADIUS-Stats4-Type
 	fr_dict_attr_t const	*ipv4_da;			//!< FreeRADIUS-Stats4-IPv4-Address
 	fr_dict_attr_t const	*ipv6_da;			//!< FreeRADIUS-Stats4-IPv6-Address
 	fr_dlist_head_t		list;				//!< for threads to know about each other
 
-	uint64_t		stats[FR_RADIUS_MAX_PACKET_CODE];
+	uint64_t		stats[FR_RADIUS_MAX_PACKET_CODE];	//!< from threads which have exited
 } rlm_stats_t;
 
 typedef struct {
 	fr_ipaddr_t		ipaddr;				//!< IP address of this thing
 	fr_time_t		created;			//!< when it was created
 	fr_time_t		last_packet;			//!< when we last saw a packet
-	uint64_t		stats[FR_RADIUS_MAX_PACKET_CODE];	//!< actual statistic
+	atomic_uint_fast64_t	stats[FR_RADIUS_MAX_PACKET_CODE];	//!< actual statistic
 } rlm_stats_data_t;
 
 typedef struct {
 	rlm_stats_t		*inst;
 
-	fr_time_t		last_global_update;
 	fr_dlist_t		entry;				//!< for threads to know about each other
 
 	fr_time_t		last_manage;			//!< when we deleted old things
@@ -68,7 +79,7 @@ typedef struct {
 	rbtree_t		*src;				//!< stats by source
 	rbtree_t		*dst;				//!< stats by destination
 
-	uint64_t		stats[FR_RADIUS_MAX_PACKET_CODE];
+	atomic_uint_fast64_t	stats[FR_RADIUS_MAX_PACKET_CODE];
 } rlm_stats_thread_t;
 
 static const CONF_PARSER module_config[] = {
@@ -95,49 +106,64 @@ fr_dict_attr_autoload_t rlm_stats_dict_attr[] = {
 	{ NULL }
 };
 
+static inline void stats_add(uint64_t final_stats[FR_RADIUS_MAX_PACKET_CODE],
+			     atomic_uint_fast64_t const stats[FR_RADIUS_MAX_PACKET_CODE])
+{
+	int i;
+
+	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
+		final_stats[i] += atomic_load_explicit(&stats[i], memory_order_relaxed);
+	}
+}
+
+static inline void stats_inc(atomic_uint_fast64_t stats[FR_RADIUS_MAX_PACKET_CODE], int code)
+{
+	atomic_fetch_add_explicit(&stats[code], 1, memory_order_relaxed);
+}
+
+/** Sum the global statistics of all threads
+ *
+ */
+static void coalesce_global(uint64_t final_stats[FR_RADIUS_MAX_PACKET_CODE], rlm_stats_t *inst)
+{
+	rlm_stats_thread_t *other;
+
+	pthread_mutex_lock(&inst->mutex);
+	memcpy(final_stats, inst->stats, sizeof(inst->stats));
+
+	for (other = fr_dlist_head(&inst->list);
+	     other != NULL;
+	     other = fr_dlist_next(&inst->list, other)) {
+		stats_add(final_stats, other->stats);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+}
+
 static void coalesce(uint64_t final_stats[FR_RADIUS_MAX_PACKET_CODE], rlm_stats_thread_t *t,
 		     size_t tree_offset, rlm_stats_data_t *mydata)
 {
 	rlm_stats_data_t *stats;
 	rlm_stats_thread_t *other;
 	rbtree_t **tree;
-	uint64_t local_stats[FR_RADIUS_MAX_PACKET_CODE];
 
-	tree = (rbtree_t **) (((uint8_t *) t) + tree_offset);
+	memset(final_stats, 0, sizeof(uint64_t) * FR_RADIUS_MAX_PACKET_CODE);
 
 	/*
-	 *	Bootstrap with my statistics, where we don't need a
-	 *	lock.
-	 */
-	stats = rbtree_finddata(*tree, mydata);
-	if (!stats) {
-		memset(final_stats, 0, sizeof(uint64_t) * FR_RADIUS_MAX_PACKET_CODE);
-	} else {
-		memcpy(final_stats, stats->stats, sizeof(stats->stats));
-	}
-
-	/*
-	 *	Loop over all of the other thread instances, locking
-	 *	them, and adding their statistics in.
+	 *	Loop over all of the thread instances, adding their
+	 *	statistics in.  The trees lock themselves, and the
+	 *	counters are atomic.
 	 */
+	pthread_mutex_lock(&t->inst->mutex);
 	for (other = fr_dlist_head(&t->inst->list);
 	     other != NULL;
 	     other = fr_dlist_next(&t->inst->list, other)) {
-		int i;
-
-		if (other == t) continue;
-
 		tree = (rbtree_t **) (((uint8_t *) other) + tree_offset);
 		stats = rbtree_finddata(*tree, mydata);
-		if (!stats) {
-			continue;
-		}
-		memcpy(&local_stats, stats->stats, sizeof(stats->stats));
+		if (!stats) continue;
 
-		for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-			final_stats[i] += local_stats[i];
-		}
+		stats_add(final_stats, stats->stats);
 	}
+	pthread_mutex_unlock(&t->inst->mutex);
 }
 
 
@@ -172,8 +198,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(module_ctx_t const *mctx, REQUEST
 		dst_code = request->reply->code;
 		if (dst_code >= FR_RADIUS_MAX_PACKET_CODE) dst_code = 0;
 
-		t->stats[src_code]++;
-		t->stats[dst_code]++;
+		stats_inc(t->stats, src_code);
+		stats_inc(t->stats, dst_code);
 
 		/*
 		 *	Update source statistics
@@ -190,8 +216,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(module_ctx_t const *mctx, REQUEST
 		}
 
 		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
+		stats_inc(stats->stats, src_code);
+		stats_inc(stats->stats, dst_code);
 
 		/*
 		 *	Update destination statistics
@@ -208,26 +234,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(module_ctx_t const *mctx, REQUEST
 		}
 
 		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
+		stats_inc(stats->stats, src_code);
+		stats_inc(stats->stats, dst_code);
 
 		/*
 		 *	@todo - periodically clean up old entries.
 		 */
 
-		if ((t->last_global_update + NSEC) > request->async->recv_time) {
-			return RLM_MODULE_UPDATED;
-		}
-
-		t->last_global_update = request->async->recv_time;
-
-		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
-		}
-		pthread_mutex_unlock(&inst->mutex);
-
 		return RLM_MODULE_UPDATED;
 	}
 
@@ -256,19 +269,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(module_ctx_t const *mctx, REQUEST
 
 	switch (stats_type) {
 	case FR_FREERADIUS_STATS4_TYPE_VALUE_GLOBAL:			/* global */
-		/*
-		 *	Merge our stats with the global stats, and then copy
-		 *	the global stats to a thread-local variable.
-		 *
-		 *	The copy helps minimize mutex contention.
-		 */
-		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
-		}
-		memcpy(&local_stats, inst->stats, sizeof(inst->stats));
-		pthread_mutex_unlock(&inst->mutex);
+		coalesce_global(local_stats, inst);
 		vp = NULL;
 		break;
 
@@ -367,7 +368,7 @@ static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 
 	pthread_mutex_lock(&inst->mutex);
 	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-		inst->stats[i] += t->stats[i];
+		inst->stats[i] += atomic_load_explicit(&t->stats[i], memory_order_relaxed);
 	}
 	fr_dlist_remove(&inst->list, t);
 	pthread_mutex_unlock(&inst->mutex);
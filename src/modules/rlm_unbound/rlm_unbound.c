@@ -29,43 +29,228 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/log.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
 #include <fcntl.h>
 
 #include "io.h"
 #include "log.h"
 
+/** A cached answer, or the absence of one
+ *
+ */
+typedef struct {
+	int			rrtype;		//!< Type of record that was looked up.
+	char const		*owner;		//!< Owner name that was looked up.
+	char const		*answer;	//!< Stringified answer, NULL if this is a negative entry.
+	fr_time_t		expires;	//!< When the entry must no longer be used.
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+} unbound_cache_entry_t;
+
 typedef struct {
-	struct ub_ctx	*ub;   /* This must come first.  Do not move */
+	char const		*name;
+	char const		*xlat_a_name;
+	char const		*xlat_aaaa_name;
+	char const		*xlat_ptr_name;
 
-	char const	*name;
-	char const	*xlat_a_name;
-	char const	*xlat_aaaa_name;
-	char const	*xlat_ptr_name;
+	uint32_t		timeout;
 
-	uint32_t	timeout;
+	char const		*filename;
 
-	char const	*filename;
+	uint32_t		cache_size;		//!< Maximum number of cached answers.  0 disables the cache.
+	uint32_t		cache_negative_ttl;	//!< Maximum time we remember NXDOMAIN or empty answers for.
 
-	unbound_log_t	*u_log;
+	rbtree_t		*cache;			//!< Answers indexed by rrtype and owner name.
+	fr_dlist_head_t		lru;			//!< Cache entries, most recently used at the head.
+	pthread_mutex_t		mutex;			//!< The cache is shared between all workers.
 } rlm_unbound_t;
 
+/** Per-thread libunbound context
+ *
+ */
+typedef struct {
+	rlm_unbound_t		*inst;		//!< Instance of rlm_unbound.
+	struct ub_ctx		*ub;		//!< libunbound context, only used by this thread.
+	unbound_log_t		*u_log;		//!< Unbound logging context.
+	fr_event_list_t		*el;		//!< Event list the ub_fd() is inserted into.
+	int			fd;		//!< libunbound's result pipe.
+} rlm_unbound_thread_t;
+
+/** Per-thread xlat data
+ *
+ */
+typedef struct {
+	rlm_unbound_t		*inst;		//!< Instance of rlm_unbound.
+	rlm_unbound_thread_t	*t;		//!< Thread the xlat is running in.
+} unbound_xlat_thread_inst_t;
+
+/** State of an outstanding lookup
+ *
+ */
+typedef struct {
+	REQUEST			*request;	//!< The request that's waiting for the answer.
+	rlm_unbound_thread_t	*t;		//!< Thread the query was submitted in.
+	char const		*xlat_name;	//!< Name of the xlat, for log messages.
+	char const		*owner;		//!< Owner name we're looking up.
+	int			rrtype;		//!< Type of record we're looking up.
+	int			async_id;	//!< libunbound identifier for the query.
+
+	bool			outstanding;	//!< libunbound still owns the query.
+	bool			yielded;	//!< The request has yielded, and must be
+						///< marked resumable when an answer arrives.
+	bool			timedout;	//!< No answer arrived before the timeout.
+
+	struct ub_result	*result;	//!< The answer, NULL on error.
+} unbound_request_t;
+
 /*
  *	A mapping of configuration file names to internal variables.
  */
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED, rlm_unbound_t, filename), .dflt = "${modconfdir}/unbound/default.conf" },
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, rlm_unbound_t, timeout), .dflt = "3000" },
+	{ FR_CONF_OFFSET("cache_size", FR_TYPE_UINT32, rlm_unbound_t, cache_size), .dflt = "1024" },
+	{ FR_CONF_OFFSET("cache_negative_ttl", FR_TYPE_UINT32, rlm_unbound_t, cache_negative_ttl), .dflt = "60" },
 	CONF_PARSER_TERMINATOR
 };
 
+/** Compare two cache entries by rrtype and owner name
+ *
+ * DNS names are case insensitive, so the comparison is too.
+ */
+static int unbound_cache_cmp(void const *one, void const *two)
+{
+	unbound_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->rrtype > b->rrtype) - (a->rrtype < b->rrtype);
+	if (ret != 0) return ret;
+
+	return strcasecmp(a->owner, b->owner);
+}
+
+/** Remove an entry from the cache and free it
+ *
+ * @note Must be called with the cache mutex held.
+ */
+static void unbound_cache_entry_remove(rlm_unbound_t *inst, unbound_cache_entry_t *c)
+{
+	fr_dlist_remove(&inst->lru, c);
+	rbtree_deletebydata(inst->cache, c);
+	talloc_free(c);
+}
+
+/** Look for a cached answer
+ *
+ * @param[in] ctx	to allocate the copy of the answer in.
+ * @param[out] answer	A copy of the cached answer.  NULL for negative entries.
+ * @param[in] inst	of rlm_unbound.
+ * @param[in] rrtype	to look for.
+ * @param[in] owner	to look for.
+ * @return
+ *	- 1 if a positive entry was found.
+ *	- 0 if a negative entry was found.
+ *	- -1 if there was no (unexpired) entry.
+ */
+static int unbound_cache_find(TALLOC_CTX *ctx, char **answer, rlm_unbound_t *inst, int rrtype, char const *owner)
+{
+	unbound_cache_entry_t	*c;
+	int			ret = -1;
+
+	*answer = NULL;
+
+	if (!inst->cache) return -1;
+
+	pthread_mutex_lock(&inst->mutex);
+	c = rbtree_finddata(inst->cache, &(unbound_cache_entry_t){ .rrtype = rrtype, .owner = owner });
+	if (!c) goto done;
+
+	if (c->expires <= fr_time()) {
+		unbound_cache_entry_remove(inst, c);
+		goto done;
+	}
+
+	/*
+	 *	Move it to the head of the LRU list.
+	 */
+	fr_dlist_remove(&inst->lru, c);
+	fr_dlist_insert_head(&inst->lru, c);
+
+	if (c->answer) {
+		MEM(*answer = talloc_typed_strdup(ctx, c->answer));
+		ret = 1;
+	} else {
+		ret = 0;
+	}
+
+done:
+	pthread_mutex_unlock(&inst->mutex);
+
+	return ret;
+}
+
+/** Add a positive or negative answer to the cache
+ *
+ * Any existing entry for the same rrtype and owner is replaced.  If the
+ * cache is full, the least recently used entry is evicted.
+ *
+ * @param[in] inst	of rlm_unbound.
+ * @param[in] rrtype	that was looked up.
+ * @param[in] owner	that was looked up.
+ * @param[in] answer	The stringified answer, or NULL for a negative entry.
+ * @param[in] ttl	How long the entry may be used for, in seconds.
+ */
+static void unbound_cache_insert(rlm_unbound_t *inst, int rrtype, char const *owner, char const *answer, uint32_t ttl)
+{
+	unbound_cache_entry_t	*c;
+
+	if (!inst->cache || (ttl == 0)) return;
+
+	pthread_mutex_lock(&inst->mutex);
+	c = rbtree_finddata(inst->cache, &(unbound_cache_entry_t){ .rrtype = rrtype, .owner = owner });
+	if (c) unbound_cache_entry_remove(inst, c);
+
+	while (rbtree_num_elements(inst->cache) >= inst->cache_size) {
+		c = fr_dlist_tail(&inst->lru);
+		if (!c) break;
+
+		unbound_cache_entry_remove(inst, c);
+	}
+
+	/*
+	 *	Allocated in the instance ctx, which is why
+	 *	we need to hold the mutex.
+	 */
+	MEM(c = talloc_zero(inst, unbound_cache_entry_t));
+	c->rrtype = rrtype;
+	MEM(c->owner = talloc_typed_strdup(c, owner));
+	if (answer) MEM(c->answer = talloc_typed_strdup(c, answer));
+	c->expires = fr_time() + fr_time_delta_from_sec(ttl);
+
+	if (!rbtree_insert(inst->cache, c)) {
+		talloc_free(c);
+		goto done;
+	}
+	fr_dlist_insert_head(&inst->lru, c);
+
+done:
+	pthread_mutex_unlock(&inst->mutex);
+}
+
 /*
- *	Callback sent to libunbound for xlat functions.  Simply links the
- *	new ub_result via a pointer that has been allocated from the heap.
- *	This pointer has been pre-initialized to a magic value.
+ *	Callback sent to libunbound for xlat functions.  Records the
+ *	ub_result in the state of the lookup, and marks the request
+ *	as resumable.
+ *
+ *	This is only ever called from ub_process(), in the thread
+ *	which owns the ub_ctx.
  */
 static void link_ubres(void *my_arg, int err, struct ub_result *result)
 {
-	struct ub_result **ubres = (struct ub_result **)my_arg;
+	unbound_request_t	*ur = talloc_get_type_abort(my_arg, unbound_request_t);
+	REQUEST			*request = ur->request;
+
+	ur->outstanding = false;
 
 	/*
 	 *	Note that while result will be NULL on error, we are explicit
@@ -73,11 +258,13 @@ static void link_ubres(void *my_arg, int err, struct ub_result *result)
 	 *	and only documented in the examples.  It could change.
 	 */
 	if (err) {
-		ERROR("%s", ub_strerror(err));
-		*ubres = NULL;
+		REDEBUG("%s - %s", ur->xlat_name, ub_strerror(err));
+		ur->result = NULL;
 	} else {
-		*ubres = result;
+		ur->result = result;
 	}
+
+	if (ur->yielded) unlang_interpret_resumable(request);
 }
 
 /*
@@ -146,48 +333,6 @@ static int rrlabels_tostr(char *out, char *rr, size_t left)
 	return offset;
 }
 
-static int ub_common_wait(rlm_unbound_t const *inst, REQUEST *request,
-			  char const *name, struct ub_result **ub, int async_id)
-{
-	useconds_t iv, waited;
-
-	iv = inst->timeout > 64 ? 64000 : inst->timeout * 1000;
-	ub_process(inst->ub);
-
-	for (waited = 0; (void const *)*ub == (void const *)inst; waited += iv, iv *= 2) {
-
-		if (waited + iv > (useconds_t)inst->timeout * 1000) {
-			usleep(inst->timeout * 1000 - waited);
-			ub_process(inst->ub);
-			break;
-		}
-
-		usleep(iv);
-
-		/* Check if already handled by event loop */
-		if ((void const *)*ub != (void const *)inst) {
-			break;
-		}
-
-		/* In case we are running single threaded */
-		ub_process(inst->ub);
-	}
-
-	if ((void const *)*ub == (void const *)inst) {
-		int res;
-
-		REDEBUG2("%s - DNS took too long", name);
-
-		res = ub_cancel(inst->ub, async_id);
-		if (res) {
-			REDEBUG("%s - ub_cancel: %s", name, ub_strerror(res));
-		}
-		return -1;
-	}
-
-	return 0;
-}
-
 static int ub_common_fail(REQUEST *request, char const *name, struct ub_result *ub)
 {
 	if (ub->bogus) {
@@ -208,197 +353,317 @@ static int ub_common_fail(REQUEST *request, char const *name, struct ub_result *
 	return 0;
 }
 
-/** Perform a DNS lookup for an A record
+/** Add an answer to the output cursor
  *
- * @ingroup xlat_functions
  */
-static ssize_t xlat_a(TALLOC_CTX *ctx, char **out, size_t outlen,
-		      void const *mod_inst, UNUSED void const *xlat_inst,
-		      REQUEST *request, char const *fmt)
+static xlat_action_t unbound_answer_push(TALLOC_CTX *ctx, fr_cursor_t *out, REQUEST *request, char const *answer)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
+	fr_value_box_t	*vb;
 
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
-
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+	MEM(vb = fr_value_box_alloc_null(ctx));
+	if (fr_value_box_strdup(vb, vb, NULL, answer, false) < 0) {
+		RPEDEBUG("Failed copying answer");
+		talloc_free(vb);
+		return XLAT_ACTION_FAIL;
+	}
+	fr_cursor_insert(out, vb);
 
-	fmt2 = talloc_typed_strdup(ctx, fmt);
-	ub_resolve_async(inst->ub, fmt2, 1, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
+	return XLAT_ACTION_DONE;
+}
 
-	if (ub_common_wait(inst, request, inst->xlat_a_name, ubres, async_id)) {
-		goto error0;
+/** Convert the first record of a result to a string, cache it, and add it to the output
+ *
+ * Negative answers are cached for the TTL libunbound gives us, limited
+ * by cache_negative_ttl.  Bogus answers aren't cached at all.
+ */
+static xlat_action_t unbound_result_process(TALLOC_CTX *ctx, fr_cursor_t *out, REQUEST *request,
+					    unbound_request_t *ur)
+{
+	rlm_unbound_t		*inst = ur->t->inst;
+	struct ub_result	*ub = ur->result;
+	char			buff[256];
+
+	if (ub_common_fail(request, ur->xlat_name, ub) < 0) {
+		if (!ub->bogus) {
+			unbound_cache_insert(inst, ur->rrtype, ur->owner, NULL,
+					     ((ub->ttl > 0) && ((uint32_t)ub->ttl < inst->cache_negative_ttl)) ?
+					     (uint32_t)ub->ttl : inst->cache_negative_ttl);
+		}
+		return XLAT_ACTION_FAIL;
 	}
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_a_name, *ubres)) {
-			goto error1;
-		}
+	switch (ur->rrtype) {
+	case 1:		/* A */
+		if ((ub->len[0] < 4) || !inet_ntop(AF_INET, ub->data[0], buff, sizeof(buff))) return XLAT_ACTION_FAIL;
+		break;
+
+	case 28:	/* AAAA */
+		if ((ub->len[0] < 16) || !inet_ntop(AF_INET6, ub->data[0], buff, sizeof(buff))) return XLAT_ACTION_FAIL;
+		break;
 
-		if (!inet_ntop(AF_INET, (*ubres)->data[0], *out, outlen)) {
-			goto error1;
-		};
+	case 12:	/* PTR */
+		if (rrlabels_tostr(buff, ub->data[0], sizeof(buff)) < 0) return XLAT_ACTION_FAIL;
+		break;
 
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
+	default:
+		fr_assert(0);
+		return XLAT_ACTION_FAIL;
 	}
 
-	RWDEBUG("%s - No result", inst->xlat_a_name);
+	if (ub->ttl > 0) unbound_cache_insert(inst, ur->rrtype, ur->owner, buff, (uint32_t)ub->ttl);
 
- error1:
-	ub_resolve_free(*ubres); /* Handles NULL gracefully */
+	return unbound_answer_push(ctx, out, request, buff);
+}
 
- error0:
-	talloc_free(ubres);
-	return -1;
+/** Cancel the query if the request goes away before libunbound answers
+ *
+ */
+static int _unbound_request_free(unbound_request_t *ur)
+{
+	if (ur->outstanding) {
+		ub_cancel(ur->t->ub, ur->async_id);
+		ur->outstanding = false;
+	}
+
+	ub_resolve_free(ur->result);	/* Handles NULL gracefully */
+
+	return 0;
 }
 
-/** Perform a DNS lookup for an AAAA record
+/** Give up waiting for libunbound
  *
- * @ingroup xlat_functions
  */
-static ssize_t xlat_aaaa(TALLOC_CTX *ctx, char **out, size_t outlen,
-			 void const *mod_inst, UNUSED void const *xlat_inst,
-			 REQUEST *request, char const *fmt)
+static void xlat_unbound_timeout(REQUEST *request, UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst,
+				 void *rctx, UNUSED fr_time_t fired)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
+	unbound_request_t	*ur = talloc_get_type_abort(rctx, unbound_request_t);
+	int			ret;
+
+	REDEBUG2("%s - DNS took too long", ur->xlat_name);
 
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
+	ret = ub_cancel(ur->t->ub, ur->async_id);
+	if (ret) REDEBUG("%s - ub_cancel: %s", ur->xlat_name, ub_strerror(ret));
 
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+	ur->outstanding = false;
+	ur->timedout = true;
+
+	unlang_interpret_resumable(request);
+}
+
+static void xlat_unbound_signal(REQUEST *request, UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst,
+				void *rctx, fr_state_signal_t action)
+{
+	unbound_request_t	*ur = talloc_get_type_abort(rctx, unbound_request_t);
 
-	fmt2 = talloc_typed_strdup(ctx, fmt);
-	ub_resolve_async(inst->ub, fmt2, 28, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
+	if (action != FR_SIGNAL_CANCEL) return;
 
-	if (ub_common_wait(inst, request, inst->xlat_aaaa_name, ubres, async_id)) {
-		goto error0;
+	RDEBUG2("%s - Cancelling DNS lookup", ur->xlat_name);
+
+	if (ur->outstanding) {
+		ub_cancel(ur->t->ub, ur->async_id);
+		ur->outstanding = false;
 	}
+}
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_aaaa_name, *ubres)) {
-			goto error1;
-		}
-		if (!inet_ntop(AF_INET6, (*ubres)->data[0], *out, outlen)) {
-			goto error1;
-		};
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
+static xlat_action_t xlat_unbound_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
+					 REQUEST *request, UNUSED void const *xlat_inst, UNUSED void *xlat_thread_inst,
+					 UNUSED fr_value_box_t **in, void *rctx)
+{
+	unbound_request_t	*ur = talloc_get_type_abort(rctx, unbound_request_t);
+	xlat_action_t		ret;
+
+	if (ur->timedout) {
+		talloc_free(ur);
+		return XLAT_ACTION_FAIL;
 	}
 
-	RWDEBUG("%s - No result", inst->xlat_aaaa_name);
+	if (!ur->result) {
+		RWDEBUG("%s - No result", ur->xlat_name);
+		talloc_free(ur);
+		return XLAT_ACTION_FAIL;
+	}
 
-error1:
-	ub_resolve_free(*ubres); /* Handles NULL gracefully */
+	ret = unbound_result_process(ctx, out, request, ur);
+	talloc_free(ur);
 
-error0:
-	talloc_free(ubres);
-	return -1;
+	return ret;
 }
 
-typedef struct {
-	struct ub_result	*result;	//!< The result from the previous operation.
-} dns_resume_ctx_t;
-
-/*
-static xlat_action_t xlat_ptr(TALLOC_CTX *ctx, fr_cursor_t *out,
-			      REQUEST *request, void const *xlat_inst, void *xlat_thread_inst,
-			      fr_value_box_t **in)
+/** Look up an owner name, from the cache if possible, otherwise asynchronously via libunbound
+ *
+ */
+static xlat_action_t xlat_unbound_common(TALLOC_CTX *ctx, fr_cursor_t *out,
+					 REQUEST *request, unbound_xlat_thread_inst_t *xt,
+					 fr_value_box_t **in, char const *xlat_name, int rrtype)
 {
-	if (!*in) return XLAT_ACTION_DONE;
+	rlm_unbound_t		*inst = xt->inst;
+	unbound_request_t	*ur;
+	char			*answer;
+	char			*owner;		/* For const warnings.  Keep till new libunbound ships. */
+	xlat_action_t		xa;
+	int			ret;
+
+	if (!*in) {
+		REDEBUG("%s - Missing owner name", xlat_name);
+		return XLAT_ACTION_FAIL;
+	}
 
 	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
-		RPEDEBUG("Failed concatenating input string for attribute reference");
+		RPEDEBUG("Failed concatenating input");
 		return XLAT_ACTION_FAIL;
 	}
 
-	yield_to
+	switch (unbound_cache_find(ctx, &answer, inst, rrtype, (*in)->vb_strvalue)) {
+	case 1:
+		RDEBUG2("%s - Found cached answer \"%s\"", xlat_name, answer);
+		xa = unbound_answer_push(ctx, out, request, answer);
+		talloc_free(answer);
+		return xa;
+
+	case 0:
+		RDEBUG2("%s - Found cached negative answer", xlat_name);
+		return XLAT_ACTION_FAIL;
+
+	default:
+		break;
+	}
 
+	MEM(ur = talloc_zero(request, unbound_request_t));
+	ur->request = request;
+	ur->t = xt->t;
+	ur->xlat_name = xlat_name;
+	ur->rrtype = rrtype;
+	MEM(ur->owner = owner = talloc_typed_strdup(ur, (*in)->vb_strvalue));
+	talloc_set_destructor(ur, _unbound_request_free);
+
+	ret = ub_resolve_async(xt->t->ub, owner, rrtype, 1, ur, link_ubres, &ur->async_id);
+	if (ret) {
+		REDEBUG("%s - %s", xlat_name, ub_strerror(ret));
+		talloc_free(ur);
+		return XLAT_ACTION_FAIL;
+	}
+	ur->outstanding = true;
+
+	/*
+	 *	The query is answered in the background by libunbound,
+	 *	and the answer is picked up by the read handler on
+	 *	ub_fd(), so just check for anything that's already
+	 *	complete, then yield.
+	 */
+	ub_process(xt->t->ub);
+	if (!ur->outstanding) return xlat_unbound_resume(ctx, out, request, NULL, NULL, in, ur);
+
+	if (inst->timeout && (unlang_xlat_event_timeout_add(request, xlat_unbound_timeout, ur,
+							    fr_time() + fr_time_delta_from_msec(inst->timeout)) < 0)) {
+		RPEDEBUG("Adding timeout failed");
+		talloc_free(ur);
+		return XLAT_ACTION_FAIL;
+	}
+
+	ur->yielded = true;
+
+	return unlang_xlat_yield(request, xlat_unbound_resume, xlat_unbound_signal, ur);
 }
-*/
 
-/** Perform a DNS lookup for a PTR record
+/** Perform a DNS lookup for an A record
  *
  * @ingroup xlat_functions
  */
-static ssize_t xlat_ptr(TALLOC_CTX *ctx, char **out, size_t outlen,
-			void const *mod_inst, UNUSED void const *xlat_inst,
-			REQUEST *request, char const *fmt)
+static xlat_action_t xlat_a(TALLOC_CTX *ctx, fr_cursor_t *out,
+			    REQUEST *request, UNUSED void const *xlat_inst, void *xlat_thread_inst,
+			    fr_value_box_t **in)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
+	unbound_xlat_thread_inst_t *xt = talloc_get_type_abort(xlat_thread_inst, unbound_xlat_thread_inst_t);
 
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
+	return xlat_unbound_common(ctx, out, request, xt, in, xt->inst->xlat_a_name, 1);
+}
 
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+/** Perform a DNS lookup for an AAAA record
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t xlat_aaaa(TALLOC_CTX *ctx, fr_cursor_t *out,
+			       REQUEST *request, UNUSED void const *xlat_inst, void *xlat_thread_inst,
+			       fr_value_box_t **in)
+{
+	unbound_xlat_thread_inst_t *xt = talloc_get_type_abort(xlat_thread_inst, unbound_xlat_thread_inst_t);
 
-	fmt2 = talloc_typed_strdup(ctx, fmt);
-	ub_resolve_async(inst->ub, fmt2, 12, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
+	return xlat_unbound_common(ctx, out, request, xt, in, xt->inst->xlat_aaaa_name, 28);
+}
 
-	if (ub_common_wait(inst, request, inst->xlat_ptr_name,
-			   ubres, async_id)) {
-		goto error0;
-	}
+/** Perform a DNS lookup for a PTR record
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t xlat_ptr(TALLOC_CTX *ctx, fr_cursor_t *out,
+			      REQUEST *request, UNUSED void const *xlat_inst, void *xlat_thread_inst,
+			      fr_value_box_t **in)
+{
+	unbound_xlat_thread_inst_t *xt = talloc_get_type_abort(xlat_thread_inst, unbound_xlat_thread_inst_t);
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_ptr_name, *ubres)) {
-			goto error1;
-		}
-		if (rrlabels_tostr(*out, (*ubres)->data[0], outlen) < 0) {
-			goto error1;
-		}
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
-	}
+	return xlat_unbound_common(ctx, out, request, xt, in, xt->inst->xlat_ptr_name, 12);
+}
 
-	RWDEBUG("%s - No result", inst->xlat_ptr_name);
+/** Resolves and caches the module's thread instance for use by a specific xlat instance
+ *
+ */
+static int mod_xlat_thread_instantiate(UNUSED void *xlat_inst, void *xlat_thread_inst,
+				       UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	rlm_unbound_t			*inst = talloc_get_type_abort(uctx, rlm_unbound_t);
+	unbound_xlat_thread_inst_t	*xt = xlat_thread_inst;
 
-error1:
-	ub_resolve_free(*ubres);  /* Handles NULL gracefully */
+	xt->inst = inst;
+	xt->t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_unbound_thread_t);
 
-error0:
-	talloc_free(ubres);
-	return -1;
+	return 0;
 }
 
-static int mod_instantiate(void *instance, CONF_SECTION *conf)
+/** Pass any completed queries back to link_ubres
+ *
+ */
+static void _unbound_fd_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
 {
-	rlm_unbound_t	*inst = instance;
-	int		res;
-	char		k[64]; /* To silence const warns until newer unbound in distros */
+	rlm_unbound_thread_t	*t = talloc_get_type_abort(uctx, rlm_unbound_thread_t);
+	int			ret;
 
-	/*
-	 *	@todo - move this to the thread-instantiate function
-	 */
-	inst->ub = ub_ctx_create();
-	if (!inst->ub) {
+	ret = ub_process(t->ub);
+	if (ret) ERROR("ub_process failed: %s", ub_strerror(ret));
+}
+
+static void _unbound_fd_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+			      int fd_errno, UNUSED void *uctx)
+{
+	ERROR("libunbound result pipe failed: %s", fr_syserror(fd_errno));
+}
+
+/** Create a libunbound context for this thread
+ *
+ * Each worker has its own ub_ctx, so that answers are always delivered
+ * (via ub_process()) in the thread which submitted the query.
+ */
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_unbound_t		*inst = talloc_get_type_abort(instance, rlm_unbound_t);
+	rlm_unbound_thread_t	*t = talloc_get_type_abort(thread, rlm_unbound_thread_t);
+	int			res;
+	char			k[64]; /* To silence const warns until newer unbound in distros */
+
+	t->inst = inst;
+	t->el = el;
+	t->fd = -1;
+
+	t->ub = ub_ctx_create();
+	if (!t->ub) {
 		cf_log_err(conf, "ub_ctx_create failed");
 		return -1;
 	}
 
 	/*
-	 *	Note unbound threads WILL happen with -s option, if it matters.
-	 *	We cannot tell from here whether that option is in effect.
+	 *	Resolve in a libunbound thread, and have it
+	 *	signal us via ub_fd() when answers are ready.
 	 */
-	res = ub_ctx_async(inst->ub, 1);
+	res = ub_ctx_async(t->ub, 1);
 	if (res) goto error;
 
 	/* Now load the config file, which can override gleaned settings. */
@@ -406,11 +671,11 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		char *file;
 
 		memcpy(&file, &inst->filename, sizeof(file));
-		res = ub_ctx_config(inst->ub, file);
+		res = ub_ctx_config(t->ub, file);
 		if (res) goto error;
 	}
 
-	if (unbound_log_init(inst, &inst->u_log, inst->ub) < 0) goto error;
+	if (unbound_log_init(t, &t->u_log, t->ub) < 0) return -1;
 
 	/*
 	 *  Now we need to finalize the context.
@@ -421,7 +686,20 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	 *  data did not exist.
 	 */
 	strcpy(k, "notar33lsite.foo123.nottld A 127.0.0.1");
-	ub_ctx_data_remove(inst->ub, k);
+	ub_ctx_data_remove(t->ub, k);
+
+	t->fd = ub_fd(t->ub);
+	if (t->fd < 0) {
+		cf_log_err(conf, "Failed retrieving libunbound file descriptor");
+		return -1;
+	}
+
+	if (fr_event_fd_insert(t, el, t->fd, _unbound_fd_read, NULL, _unbound_fd_error, t) < 0) {
+		cf_log_err(conf, "Failed inserting libunbound file descriptor into event loop: %s", fr_strerror());
+		t->fd = -1;
+		return -1;
+	}
+
 	return 0;
 
  error:
@@ -430,9 +708,58 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return -1;
 }
 
+static int mod_thread_detach(fr_event_list_t *el, void *thread)
+{
+	rlm_unbound_thread_t	*t = talloc_get_type_abort(thread, rlm_unbound_thread_t);
+
+	if (t->fd >= 0) fr_event_fd_delete(el, t->fd, FR_EVENT_FILTER_IO);
+
+	if (!t->ub) return 0;
+
+	ub_process(t->ub);
+
+	/*
+	 *	This can hang/leave zombies currently
+	 *	see upstream bug #519
+	 *	...so expect valgrind to complain with -m
+	 */
+	talloc_free(t->u_log);	/* Free logging first */
+
+	ub_ctx_delete(t->ub);
+
+	return 0;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_unbound_t	*inst = instance;
+
+	if (!inst->cache_size) return 0;
+
+	fr_dlist_talloc_init(&inst->lru, unbound_cache_entry_t, entry);
+
+	/*
+	 *	Entries are children of the instance, so
+	 *	don't need to be freed explicitly.
+	 */
+	inst->cache = rbtree_talloc_alloc(inst, unbound_cache_cmp, unbound_cache_entry_t, NULL, 0);
+	if (!inst->cache) {
+		cf_log_err(conf, "Failed creating cache");
+		return -1;
+	}
+
+	if (pthread_mutex_init(&inst->mutex, NULL) < 0) {
+		cf_log_err(conf, "Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
-	rlm_unbound_t *inst = instance;
+	rlm_unbound_t	*inst = instance;
+	xlat_t const	*xlat;
 
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
@@ -442,34 +769,39 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	FR_INTEGER_BOUND_CHECK("cache_negative_ttl", inst->cache_negative_ttl, <=, 86400);
+
 	MEM(inst->xlat_a_name = talloc_typed_asprintf(inst, "%s-a", inst->name));
 	MEM(inst->xlat_aaaa_name = talloc_typed_asprintf(inst, "%s-aaaa", inst->name));
 	MEM(inst->xlat_ptr_name = talloc_typed_asprintf(inst, "%s-ptr", inst->name));
 
-	if (xlat_register(inst, inst->xlat_a_name, xlat_a, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, false) ||
-	    xlat_register(inst, inst->xlat_aaaa_name, xlat_aaaa, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, false) ||
-	    xlat_register(inst, inst->xlat_ptr_name, xlat_ptr, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, false)) {
-		cf_log_err(conf, "Failed registering xlats");
-		return -1;
-	}
+	xlat = xlat_async_register(inst, inst->xlat_a_name, xlat_a);
+	if (!xlat) goto error;
+	xlat_async_thread_instantiate_set(xlat, mod_xlat_thread_instantiate, unbound_xlat_thread_inst_t, NULL, inst);
+	xlat_async_yields_set(xlat);
+
+	xlat = xlat_async_register(inst, inst->xlat_aaaa_name, xlat_aaaa);
+	if (!xlat) goto error;
+	xlat_async_thread_instantiate_set(xlat, mod_xlat_thread_instantiate, unbound_xlat_thread_inst_t, NULL, inst);
+	xlat_async_yields_set(xlat);
+
+	xlat = xlat_async_register(inst, inst->xlat_ptr_name, xlat_ptr);
+	if (!xlat) goto error;
+	xlat_async_thread_instantiate_set(xlat, mod_xlat_thread_instantiate, unbound_xlat_thread_inst_t, NULL, inst);
+	xlat_async_yields_set(xlat);
 
 	return 0;
+
+error:
+	cf_log_err(conf, "Failed registering xlats");
+	return -1;
 }
 
 static int mod_detach(void *instance)
 {
 	rlm_unbound_t *inst = instance;
 
-	ub_process(inst->ub);
-
-	/*
-	 *	This can hang/leave zombies currently
-	 *	see upstream bug #519
-	 *	...so expect valgrind to complain with -m
-	 */
-	talloc_free(inst->u_log);	/* Free logging first */
-
-	ub_ctx_delete(inst->ub);
+	if (inst->cache) pthread_mutex_destroy(&inst->mutex);
 
 	return 0;
 }
@@ -480,8 +812,11 @@ module_t rlm_unbound = {
 	.name			= "unbound",
 	.type			= RLM_TYPE_THREAD_SAFE,
 	.inst_size		= sizeof(rlm_unbound_t),
+	.thread_inst_size	= sizeof(rlm_unbound_thread_t),
 	.config			= module_config,
 	.bootstrap		= mod_bootstrap,
 	.instantiate		= mod_instantiate,
-	.detach			= mod_detach
+	.detach			= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach
 };
@@ -10,12 +10,162 @@
 #include "rlm_yubikey.h"
 
 #ifdef HAVE_YUBIKEY
+#include <freeradius-devel/util/hash.h>
+
 extern fr_dict_attr_t const *attr_yubikey_key;
 extern fr_dict_attr_t const *attr_yubikey_private_id;
 extern fr_dict_attr_t const *attr_yubikey_timestamp;
 extern fr_dict_attr_t const *attr_yubikey_random;
 extern fr_dict_attr_t const *attr_yubikey_counter;
 
+/** The last counter value seen for a token
+ *
+ */
+typedef struct {
+	uint8_t			*public_id;		//!< Public ID the token was presented with.
+	size_t			public_id_len;		//!< Length of the public ID.
+	uint8_t			uid[YUBIKEY_UID_SIZE];	//!< Private ID from the decrypted token.
+	uint32_t		counter;		//!< Highest counter value accepted.
+	fr_dlist_t		entry;			//!< Entry in the shard's LRU list.
+} yubikey_replay_entry_t;
+
+static int yubikey_replay_cmp(void const *one, void const *two)
+{
+	yubikey_replay_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = memcmp(a->uid, b->uid, sizeof(a->uid));
+	if (ret != 0) return ret;
+
+	if (a->public_id_len != b->public_id_len) return (a->public_id_len < b->public_id_len) ? -1 : 1;
+
+	return memcmp(a->public_id, b->public_id, a->public_id_len);
+}
+
+static int _yubikey_replay_free(yubikey_replay_shard_t *replay)
+{
+	size_t i;
+
+	for (i = 0; i < YUBIKEY_REPLAY_SHARDS; i++) pthread_mutex_destroy(&replay[i].mutex);
+
+	return 0;
+}
+
+/** Allocate the replay counter cache
+ *
+ * Entries are spread over a fixed number of shards so that workers
+ * authenticating different tokens rarely contend for the same lock.
+ *
+ * @param[in] inst	of rlm_yubikey.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int rlm_yubikey_replay_init(rlm_yubikey_t *inst)
+{
+	yubikey_replay_shard_t	*replay;
+	size_t			i;
+
+	MEM(replay = talloc_zero_array(inst, yubikey_replay_shard_t, YUBIKEY_REPLAY_SHARDS));
+	for (i = 0; i < YUBIKEY_REPLAY_SHARDS; i++) {
+		replay[i].tree = rbtree_talloc_alloc(replay, yubikey_replay_cmp, yubikey_replay_entry_t, NULL, 0);
+		if (!replay[i].tree) {
+			talloc_free(replay);
+			return -1;
+		}
+		fr_dlist_talloc_init(&replay[i].lru, yubikey_replay_entry_t, entry);
+
+		/*
+		 *	Round up, so the total is never less than
+		 *	what was configured.
+		 */
+		replay[i].max_entries = (inst->replay_max_entries + (YUBIKEY_REPLAY_SHARDS - 1)) / YUBIKEY_REPLAY_SHARDS;
+		pthread_mutex_init(&replay[i].mutex, NULL);
+	}
+	talloc_set_destructor(replay, _yubikey_replay_free);
+	inst->replay = replay;
+
+	return 0;
+}
+
+/** Check a counter is higher than the last one seen for the token, and record it
+ *
+ * The check and update are done under the same lock, so the same OTP
+ * presented to two workers at once can only be accepted by one of them.
+ *
+ * @param[in] inst	of rlm_yubikey.
+ * @param[in] passcode	the token was decrypted from, starting with the public ID.
+ * @param[in] uid	Private ID from the decrypted token.
+ * @param[in] counter	from the decrypted token.
+ * @param[out] last	The last counter value accepted, if the token is a replay.
+ * @return
+ *	- true if the counter is new.
+ *	- false if the token is a replay.
+ */
+static bool yubikey_replay_check(rlm_yubikey_t const *inst, char const *passcode,
+				 uint8_t const uid[static YUBIKEY_UID_SIZE], uint32_t counter, uint32_t *last)
+{
+	yubikey_replay_shard_t	*shard;
+	yubikey_replay_entry_t	find, *entry;
+	bool			ok = true;
+
+	memcpy(&find.public_id, &passcode, sizeof(find.public_id));	/* Only used for the comparison */
+	find.public_id_len = inst->id_len;
+	memcpy(find.uid, uid, sizeof(find.uid));
+
+	shard = &inst->replay[fr_hash_update(uid, YUBIKEY_UID_SIZE, fr_hash(passcode, inst->id_len)) &
+			      (YUBIKEY_REPLAY_SHARDS - 1)];
+
+	pthread_mutex_lock(&shard->mutex);
+	entry = rbtree_finddata(shard->tree, &find);
+	if (entry) {
+		if (counter <= entry->counter) {
+			*last = entry->counter;
+			ok = false;
+		} else {
+			entry->counter = counter;
+		}
+		fr_dlist_remove(&shard->lru, entry);
+		fr_dlist_insert_head(&shard->lru, entry);
+		goto done;
+	}
+
+	/*
+	 *	Make room by evicting the token which was
+	 *	used least recently.
+	 */
+	if (rbtree_num_elements(shard->tree) >= shard->max_entries) {
+		yubikey_replay_entry_t *oldest = fr_dlist_tail(&shard->lru);
+
+		if (oldest) {
+			rbtree_deletebydata(shard->tree, oldest);
+			fr_dlist_remove(&shard->lru, oldest);
+			talloc_free(oldest);
+		}
+	}
+
+	/*
+	 *	Entries are parented by the shard's tree, so
+	 *	they're only ever allocated under its lock.
+	 */
+	MEM(entry = talloc_zero(shard->tree, yubikey_replay_entry_t));
+	MEM(entry->public_id = talloc_memdup(entry, passcode, inst->id_len));
+	entry->public_id_len = inst->id_len;
+	memcpy(entry->uid, uid, sizeof(entry->uid));
+	entry->counter = counter;
+
+	if (!rbtree_insert(shard->tree, entry)) {
+		talloc_free(entry);
+		goto done;
+	}
+	fr_dlist_insert_head(&shard->lru, entry);
+
+done:
+	pthread_mutex_unlock(&shard->mutex);
+
+	return ok;
+}
+
 /** Decrypt a Yubikey OTP AES block
  *
  * @param inst Module configuration.
@@ -93,17 +243,24 @@ rlm_rcode_t rlm_yubikey_decrypt(rlm_yubikey_t const *inst, REQUEST *request, cha
 	 *	Now we check for replay attacks
 	 */
 	vp = fr_pair_find_by_da(request->control, attr_yubikey_counter, TAG_ANY);
-	if (!vp) {
-		RWDEBUG("Yubikey-Counter not found in control list, skipping replay attack checks");
-		return RLM_MODULE_OK;
-	}
-
-	if (counter <= vp->vp_uint32) {
+	if (vp && (counter <= vp->vp_uint32)) {
 		REDEBUG("Replay attack detected! Counter value %u, is lt or eq to last known counter value %u",
 			counter, vp->vp_uint32);
 		return RLM_MODULE_REJECT;
 	}
 
+	if (inst->replay) {
+		uint32_t last = 0;
+
+		if (!yubikey_replay_check(inst, passcode, token.uid, counter, &last)) {
+			REDEBUG("Replay attack detected! Counter value %u, is lt or eq to cached counter value %u",
+				counter, last);
+			return RLM_MODULE_REJECT;
+		}
+	} else if (!vp) {
+		RWDEBUG("Yubikey-Counter not found in control list, skipping replay attack checks");
+	}
+
 	return RLM_MODULE_OK;
 }
 #endif
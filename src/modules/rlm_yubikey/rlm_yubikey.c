@@ -27,22 +27,30 @@ RCSID("$Id$")
 
 #include "rlm_yubikey.h"
 
-#ifdef HAVE_YKCLIENT
+#ifdef HAVE_LIBFREERADIUS_CURL
 static const CONF_PARSER validation_config[] = {
 	{ FR_CONF_OFFSET("client_id", FR_TYPE_UINT32, rlm_yubikey_t, client_id), .dflt = 0 },
 	{ FR_CONF_OFFSET("api_key", FR_TYPE_STRING | FR_TYPE_SECRET, rlm_yubikey_t, api_key) },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_yubikey_t, timeout), .dflt = "3.0" },
+	{ FR_CONF_OFFSET("tls", FR_TYPE_SUBSECTION, rlm_yubikey_t, tls), .subcs = (void const *) fr_curl_tls_config },
 	CONF_PARSER_TERMINATOR
 };
 #endif
 
+static const CONF_PARSER replay_cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_yubikey_t, replay_max_entries), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("id_length", FR_TYPE_UINT32, rlm_yubikey_t, id_len), .dflt = "12" },
 	{ FR_CONF_OFFSET("split", FR_TYPE_BOOL, rlm_yubikey_t, split), .dflt = "yes" },
 	{ FR_CONF_OFFSET("decrypt", FR_TYPE_BOOL, rlm_yubikey_t, decrypt), .dflt = "no" },
 	{ FR_CONF_OFFSET("validate", FR_TYPE_BOOL, rlm_yubikey_t, validate), .dflt = "no" },
-#ifdef HAVE_YKCLIENT
+#ifdef HAVE_LIBFREERADIUS_CURL
 	{ FR_CONF_POINTER("validation", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) validation_config },
 #endif
+	{ FR_CONF_POINTER("replay_cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) replay_cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -196,8 +204,17 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		     inst->name);
 	}
 
+#ifdef HAVE_YUBIKEY
+	if (inst->decrypt && inst->replay_max_entries) {
+		if (rlm_yubikey_replay_init(inst) < 0) {
+			cf_log_err(conf, "Failed creating replay counter cache");
+			return -1;
+		}
+	}
+#endif
+
 	if (inst->validate) {
-#ifdef HAVE_YKCLIENT
+#ifdef HAVE_LIBFREERADIUS_CURL
 		CONF_SECTION *cs;
 
 		cs = cf_section_find(conf, "validation", CF_IDENT_ANY);
@@ -206,11 +223,11 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 			return -1;
 		}
 
-		if (rlm_yubikey_ykclient_init(cs, inst) < 0) {
+		if (rlm_yubikey_validate_init(cs, inst) < 0) {
 			return -1;
 		}
 #else
-		cf_log_err(conf, "Requires libykclient for OTP validation against Yubicloud servers");
+		cf_log_err(conf, "Requires libfreeradius-curl for OTP validation against Yubicloud servers");
 		return -1;
 #endif
 	}
@@ -218,10 +235,46 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
-#ifdef HAVE_YKCLIENT
-static int mod_detach(void *instance)
+#ifdef HAVE_LIBFREERADIUS_CURL
+/*
+ *	Initialize global curl instance
+ */
+static int mod_load(void)
+{
+	if (fr_curl_init() < 0) return -1;
+	return 0;
+}
+
+/*
+ *	Close global curl instance
+ */
+static void mod_unload(void)
+{
+	fr_curl_free();
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_yubikey_t const	*inst = talloc_get_type_abort_const(instance, rlm_yubikey_t);
+	rlm_yubikey_thread_t	*t = talloc_get_type_abort(thread, rlm_yubikey_thread_t);
+
+	t->inst = inst;
+
+	if (!inst->validate) return 0;
+
+	t->mhandle = fr_curl_io_init(t, el, NULL);
+	if (!t->mhandle) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 {
-	rlm_yubikey_ykclient_detach((rlm_yubikey_t *) instance);
+	rlm_yubikey_thread_t *t = talloc_get_type_abort(thread, rlm_yubikey_thread_t);
+
+	TALLOC_FREE(t->mhandle);
+
 	return 0;
 }
 #endif
@@ -408,13 +461,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(module_ctx_t const *mctx, R
 		if (rcode != RLM_MODULE_OK) {
 			return rcode;
 		}
-		/* Fall-Through to doing ykclient auth in addition to local auth */
+		/* Fall-Through to doing validation in addition to local auth */
 	}
 #endif
 
-#ifdef HAVE_YKCLIENT
+#ifdef HAVE_LIBFREERADIUS_CURL
 	if (inst->validate) {
-		return rlm_yubikey_validate(inst, request, passcode);
+		return rlm_yubikey_validate(mctx, request, passcode);
 	}
 #endif
 	return rcode;
@@ -438,8 +491,13 @@ module_t rlm_yubikey = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
-#ifdef HAVE_YKCLIENT
-	.detach		= mod_detach,
+#ifdef HAVE_LIBFREERADIUS_CURL
+	.onload		= mod_load,
+	.unload		= mod_unload,
+	.thread_inst_size	= sizeof(rlm_yubikey_thread_t),
+	.thread_inst_type	= "rlm_yubikey_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 #endif
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
@@ -16,12 +16,14 @@
  */
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/util/dlist.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "config.h"
 
-#ifdef HAVE_YKCLIENT
-#include <ykclient.h>
+#ifdef HAVE_LIBFREERADIUS_CURL
+#include <freeradius-devel/curl/base.h>
 #endif
 
 #ifdef HAVE_YUBIKEY
@@ -30,6 +32,22 @@
 
 #define YUBIKEY_TOKEN_LEN 32
 
+/*
+ *	Replay counters are spread over this many shards, each with
+ *	its own lock.  Must be a power of 2.
+ */
+#define YUBIKEY_REPLAY_SHARDS 16
+
+/** One shard of the replay counter cache
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;			//!< Protects this shard.
+	rbtree_t		*tree;			//!< Counters, keyed on public and private ID.
+	fr_dlist_head_t		lru;			//!< Most recently used at the head.
+	uint32_t		max_entries;		//!< Maximum entries in this shard.
+} yubikey_replay_shard_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -43,28 +61,47 @@ typedef struct {
 	unsigned int		id_len;			//!< The length of the Public ID portion of the OTP string.
 	bool			split;			//!< Split password string into components.
 	bool			decrypt;		//!< Decrypt the OTP string using the yubikey library.
-	bool			validate;		//!< Validate the OTP string using the ykclient library.
+	bool			validate;		//!< Validate the OTP string against Yubicloud servers.
 	char const		**uris;			//!< Yubicloud URLs to validate the token against.
+	unsigned int		num_uris;		//!< How many URLs there are.
+
+	uint32_t		replay_max_entries;	//!< Maximum number of tokens to cache counters for.
+	yubikey_replay_shard_t	*replay;		//!< Shards of the replay counter cache.
+							///< NULL if disabled.
 
-#ifdef HAVE_YKCLIENT
+#ifdef HAVE_LIBFREERADIUS_CURL
 	unsigned int		client_id;		//!< Validation API client ID.
 	char const		*api_key;		//!< Validation API signing key.
-	ykclient_t		*ykc;			//!< ykclient configuration.
-	fr_pool_t	*pool;			//!< Connection pool instance.
+	uint8_t			*api_key_bin;		//!< Decoded API key.
+	size_t			api_key_len;		//!< Length of the decoded API key.
+	fr_time_delta_t		timeout;		//!< How long to wait for the validation servers.
+	fr_curl_tls_t		tls;			//!< TLS configuration for the validation servers.
 #endif
 } rlm_yubikey_t;
 
+/** Per-thread instance data
+ *
+ */
+typedef struct {
+	rlm_yubikey_t const	*inst;			//!< Instance of rlm_yubikey.
+#ifdef HAVE_LIBFREERADIUS_CURL
+	fr_curl_handle_t	*mhandle;		//!< Thread specific multi handle for validation requests.
+#endif
+} rlm_yubikey_thread_t;
+
 
 /*
  *	decrypt.c - Decryption functions
  */
 rlm_rcode_t rlm_yubikey_decrypt(rlm_yubikey_t const *inst, REQUEST *request, char const *passcode);
 
+int rlm_yubikey_replay_init(rlm_yubikey_t *inst);
+
 /*
- *	validate.c - Connection pool and validation functions
+ *	validate.c - Validation against Yubicloud servers
  */
-int rlm_yubikey_ykclient_init(CONF_SECTION *conf, rlm_yubikey_t *inst);
+#ifdef HAVE_LIBFREERADIUS_CURL
+int rlm_yubikey_validate_init(CONF_SECTION *conf, rlm_yubikey_t *inst);
 
-int rlm_yubikey_ykclient_detach(rlm_yubikey_t *inst);
-
-rlm_rcode_t rlm_yubikey_validate(rlm_yubikey_t const *inst, REQUEST *request, char const *passcode);
+rlm_rcode_t rlm_yubikey_validate(module_ctx_t const *mctx, REQUEST *request, char const *passcode);
+#endif
@@ -1,7 +1,11 @@
 /**
  * $Id$
  * @file rlm_yubikey/validate.c
- * @brief Authentication for yubikey OTP tokens using the ykclient library.
+ * @brief Authentication for yubikey OTP tokens against Yubicloud validation servers.
+ *
+ * Implements the client side of version 2.0 of the Yubico validation protocol,
+ * using the lib/curl async I/O.  The OTP is sent to all the configured servers
+ * at once, and the first correctly signed OK response wins.
  *
  * @author Arran Cudbard-Bell (a.cudbardb@networkradius.com)
  * @copyright 2013 The FreeRADIUS server project
@@ -12,186 +16,448 @@
 
 #include "rlm_yubikey.h"
 
-#ifdef HAVE_YKCLIENT
-#include <freeradius-devel/server/pool.h>
+#ifdef HAVE_LIBFREERADIUS_CURL
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/base64.h>
+#include <freeradius-devel/util/sha1.h>
+
+#define YUBIKEY_DEFAULT_URI	"https://api.yubico.com/wsapi/2.0/verify"
+
+/*
+ *	ykclient style URL templates have the query string in them,
+ *	we build our own, so it's stripped off.
+ */
+#define YUBIKEY_URI_TEMPLATE	"?id=%d&otp=%s"
+
+#define YUBIKEY_NONCE_LEN	32
+#define YUBIKEY_RESPONSE_MAX	2048
+#define YUBIKEY_RESPONSE_FIELDS	16
+#define YUBIKEY_SIGNATURE_LEN	(FR_BASE64_ENC_LENGTH(SHA1_DIGEST_LENGTH) + 1)
 
-/** Frees a ykclient handle
+typedef struct yubikey_validate_s yubikey_validate_t;
+
+/** A query sent to one validation server
+ *
+ */
+typedef struct {
+	yubikey_validate_t	*validate;		//!< Validation the query is part of.
+	char const		*uri;			//!< Server the query was sent to.
+	char			response[YUBIKEY_RESPONSE_MAX];	//!< Response body.
+	size_t			used;			//!< Length of the response body.
+} yubikey_query_t;
+
+/** Validation of an OTP, by one or more servers
  *
- * @param[in] yandle rlm_yubikey_handle_t to close and free.
- * @return returns 0.
  */
-static int _mod_conn_free(ykclient_handle_t **yandle)
+struct yubikey_validate_s {
+	rlm_yubikey_t const	*inst;			//!< Instance of rlm_yubikey.
+	REQUEST			*request;		//!< The current request.
+	char const		*otp;			//!< OTP being validated.
+	char			nonce[YUBIKEY_NONCE_LEN + 1];	//!< Nonce the servers must echo back.
+	unsigned int		outstanding;		//!< Queries still running.
+	bool			resumable;		//!< The request has been marked as resumable.
+	rlm_rcode_t		rcode;			//!< Most definitive result so far.
+};
+
+/** Sign a request or response
+ *
+ * @param[out] out	Where to write the base64 encoded signature.
+ * @param[in] inst	of rlm_yubikey.
+ * @param[in] msg	to sign.
+ * @param[in] msg_len	Length of msg.
+ */
+static void yubikey_sign(char out[static YUBIKEY_SIGNATURE_LEN], rlm_yubikey_t const *inst,
+			 char const *msg, size_t msg_len)
 {
-	ykclient_handle_done(yandle);
+	uint8_t digest[SHA1_DIGEST_LENGTH];
 
-	return 0;
+	fr_hmac_sha1(digest, (uint8_t const *) msg, msg_len, inst->api_key_bin, inst->api_key_len);
+	fr_base64_encode(out, YUBIKEY_SIGNATURE_LEN, digest, sizeof(digest));
 }
 
-/** Creates a new connection handle for use by the FR connection API.
+/** Order response fields by key, the way the signature is calculated
  *
- * Matches the fr_pool_connection_create_t function prototype, is passed to
- * fr_pool_init, and called when a new connection is required by the
- * connection pool API.
- *
- * @see fr_pool_init
- * @see fr_pool_connection_create_t
- * @see connection.c
  */
-static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta_t timeout)
+static int yubikey_field_cmp(void const *one, void const *two)
 {
-	rlm_yubikey_t const *inst = talloc_get_type_abort_const(instance, rlm_yubikey_t);
-	ykclient_rc status;
-	ykclient_handle_t *yandle, **marker;
-
-	status = ykclient_handle_init(inst->ykc, &yandle);
-	if (status != YKCLIENT_OK) {
-		ERROR("%s", ykclient_strerror(status));
+	char const *a = *((char const * const *) one);
+	char const *b = *((char const * const *) two);
 
-		return NULL;
+	while (*a && (*a != '=') && (*a == *b)) {
+		a++;
+		b++;
 	}
-	marker = talloc(ctx, ykclient_handle_t *);
-	talloc_set_destructor(marker, _mod_conn_free);
-	*marker = yandle;
 
-	return yandle;
+	return (*a == '=' ? 0 : (uint8_t) *a) - (*b == '=' ? 0 : (uint8_t) *b);
 }
 
-int rlm_yubikey_ykclient_init(CONF_SECTION *conf, rlm_yubikey_t *inst)
+/** Find the value of a response field
+ *
+ */
+static char const *yubikey_field_value(char * const fields[], size_t num, char const *key)
 {
-	ykclient_rc status;
-	CONF_SECTION *servers;
+	size_t len = strlen(key);
+	size_t i;
 
-	int count = 0;
+	for (i = 0; i < num; i++) {
+		if ((strncmp(fields[i], key, len) == 0) && (fields[i][len] == '=')) return fields[i] + len + 1;
+	}
 
-	if (!inst->client_id) {
-		ERROR("validation.client_id must be set (to a valid id) when validation is enabled");
+	return NULL;
+}
 
-		return -1;
-	}
+/** Check the response from a validation server, and convert it into a return code
+ *
+ */
+static rlm_rcode_t yubikey_response_process(yubikey_validate_t *v, yubikey_query_t *query)
+{
+	rlm_yubikey_t const	*inst = v->inst;
+	REQUEST			*request = v->request;
+	char			*fields[YUBIKEY_RESPONSE_FIELDS];
+	char			*p, *next, *signed_fields = NULL;
+	char			signature[YUBIKEY_SIGNATURE_LEN];
+	char const		*h, *status, *value;
+	size_t			num = 0, i;
+	bool			valid = false;
 
-	if (!inst->api_key || !*inst->api_key || is_zero(inst->api_key)) {
-		ERROR("validation.api_key must be set (to a valid key) when validation is enabled");
+	/*
+	 *	Response is a series of CRLF separated key=value pairs
+	 */
+	for (p = query->response; *p && (num < NUM_ELEMENTS(fields)); p = next) {
+		next = p + strcspn(p, "\r\n");
+		if (*next) *next++ = '\0';
+		while ((*next == '\r') || (*next == '\n')) next++;
 
-		return -1;
+		if (strchr(p, '=')) fields[num++] = p;
 	}
 
-	DEBUG("Initialising ykclient");
+	status = yubikey_field_value(fields, num, "status");
+	if (!status) {
+		REDEBUG("Response from %s had no status", query->uri);
+		return RLM_MODULE_FAIL;
+	}
 
-	status = ykclient_global_init();
-	if (status != YKCLIENT_OK) {
-yk_error:
-		ERROR("%s", ykclient_strerror(status));
+	/*
+	 *	The signature covers every field other than
+	 *	"h", in order.
+	 */
+	h = yubikey_field_value(fields, num, "h");
+	if (h) {
+		qsort(fields, num, sizeof(fields[0]), yubikey_field_cmp);
 
-		return -1;
-	}
+		for (i = 0; i < num; i++) {
+			if (strncmp(fields[i], "h=", 2) == 0) continue;
 
-	status = ykclient_init(&inst->ykc);
-	if (status != YKCLIENT_OK) goto yk_error;
+			signed_fields = signed_fields ? talloc_asprintf_append_buffer(signed_fields, "&%s", fields[i]) :
+							talloc_typed_strdup(query, fields[i]);
+		}
 
-	servers = cf_section_find(conf, "servers", CF_IDENT_ANY);
-	if (servers) {
-		CONF_PAIR *uri, *first;
-		/*
-		 *	If there were no uris configured we just use the default
-		 *	ykclient uris which point to the yubico servers.
-		 */
-		first = uri = cf_pair_find(servers, "uri");
-		if (!uri) {
-			goto init;
+		if (signed_fields) {
+			yubikey_sign(signature, inst, signed_fields, talloc_array_length(signed_fields) - 1);
+			valid = (strlen(h) == strlen(signature)) &&
+				(fr_digest_cmp((uint8_t const *) h, (uint8_t const *) signature, strlen(signature)) == 0);
+			talloc_free(signed_fields);
 		}
+	}
+
+	RDEBUG2("%s returned status %s", query->uri, status);
 
-		while (uri) {
-			count++;
-			uri = cf_pair_find_next(servers, uri, "uri");
+	if (strcmp(status, "OK") == 0) {
+		if (!valid) {
+			REDEBUG("Response from %s has an invalid signature", query->uri);
+			return RLM_MODULE_FAIL;
 		}
-		inst->uris = talloc_zero_array(inst, char const *, count);
 
-		uri = first;
-		count = 0;
-		while (uri) {
-			inst->uris[count++] = cf_pair_value(uri);
-			uri = cf_pair_find_next(servers, uri, "uri");
+		value = yubikey_field_value(fields, num, "otp");
+		if (!value || (strcmp(value, v->otp) != 0)) {
+			REDEBUG("Response from %s is for a different OTP", query->uri);
+			return RLM_MODULE_FAIL;
 		}
-		if (count) {
-			status = ykclient_set_url_templates(inst->ykc, count, inst->uris);
-			if (status != YKCLIENT_OK) {
-				goto yk_error;
-			}
+
+		value = yubikey_field_value(fields, num, "nonce");
+		if (!value || (strcmp(value, v->nonce) != 0)) {
+			REDEBUG("Response from %s has the wrong nonce", query->uri);
+			return RLM_MODULE_FAIL;
 		}
+
+		return RLM_MODULE_OK;
 	}
 
-init:
-	status = ykclient_set_client_b64(inst->ykc, inst->client_id, inst->api_key);
-	if (status != YKCLIENT_OK) {
-		ERROR("%s", ykclient_strerror(status));
+	/*
+	 *	Negative responses can't make authentication
+	 *	succeed, so they're believed even if they're
+	 *	not signed (NO_SUCH_CLIENT can't be).
+	 */
+	if ((strcmp(status, "BAD_OTP") == 0) || (strcmp(status, "REPLAYED_OTP") == 0)) return RLM_MODULE_REJECT;
 
-		return -1;
+	if (strcmp(status, "NO_SUCH_CLIENT") == 0) return RLM_MODULE_NOTFOUND;
+
+	return RLM_MODULE_FAIL;
+}
+
+/** How definitive a negative result is
+ *
+ * REPLAYED_OTP may just mean another server has already accepted the
+ * OTP, and told this one, so we wait for all servers before rejecting.
+ */
+static inline int yubikey_rcode_rank(rlm_rcode_t rcode)
+{
+	switch (rcode) {
+	case RLM_MODULE_REJECT:
+		return 2;
+
+	case RLM_MODULE_NOTFOUND:
+		return 1;
+
+	default:
+		return 0;
 	}
+}
 
-	inst->pool = module_connection_pool_init(conf, inst, mod_conn_create, NULL, inst->name, NULL, NULL);
-	if (!inst->pool) {
-		ykclient_done(&inst->ykc);
+/** Called by lib/curl when a query completes
+ *
+ * Resumes the request on the first success, or once every server
+ * has responded.
+ */
+static void yubikey_query_done(fr_curl_io_request_t *randle)
+{
+	yubikey_query_t		*query = talloc_get_type_abort(randle->uctx, yubikey_query_t);
+	yubikey_validate_t	*v = query->validate;
+	REQUEST			*request = v->request;
+	rlm_rcode_t		rcode;
+	long			code = 0;
+
+	v->outstanding--;
+	if (v->resumable) return;
+
+	if (randle->result != CURLE_OK) {
+		RWDEBUG("Validation request to %s failed: %s", query->uri, curl_easy_strerror(randle->result));
+		rcode = RLM_MODULE_FAIL;
+	} else if ((curl_easy_getinfo(randle->candle, CURLINFO_RESPONSE_CODE, &code) != CURLE_OK) || (code != 200)) {
+		RWDEBUG("Validation request to %s failed: HTTP status %li", query->uri, code);
+		rcode = RLM_MODULE_FAIL;
+	} else {
+		rcode = yubikey_response_process(v, query);
+	}
 
-		return -1;
+	if (rcode == RLM_MODULE_OK) {
+		v->rcode = RLM_MODULE_OK;
+	} else {
+		if (yubikey_rcode_rank(rcode) > yubikey_rcode_rank(v->rcode)) v->rcode = rcode;
+		if (v->outstanding > 0) return;
 	}
 
-	return 0;
+	v->resumable = true;
+	unlang_interpret_resumable(request);
 }
 
-int rlm_yubikey_ykclient_detach(rlm_yubikey_t *inst)
+static size_t yubikey_query_body(void *in, size_t size, size_t nmemb, void *uctx)
 {
-	fr_pool_free(inst->pool);
-	ykclient_done(&inst->ykc);
-	ykclient_global_done();
+	yubikey_query_t	*query = talloc_get_type_abort(uctx, yubikey_query_t);
+	size_t		len = size * nmemb;
 
-	return 0;
+	/*
+	 *	Short write makes curl fail the transfer
+	 */
+	if (len >= (sizeof(query->response) - query->used)) return 0;
+
+	memcpy(query->response + query->used, in, len);
+	query->used += len;
+	query->response[query->used] = '\0';
+
+	return len;
+}
+
+static rlm_rcode_t yubikey_validate_resume(UNUSED module_ctx_t const *mctx, REQUEST *request, void *rctx)
+{
+	yubikey_validate_t	*v = talloc_get_type_abort(rctx, yubikey_validate_t);
+	rlm_rcode_t		rcode = v->rcode;
+
+	/*
+	 *	Frees any queries which are still running
+	 */
+	talloc_free(v);
+
+	if (rcode == RLM_MODULE_OK) RDEBUG2("OTP validated successfully");
+
+	return rcode;
 }
 
-rlm_rcode_t rlm_yubikey_validate(rlm_yubikey_t const *inst, REQUEST *request, char const *passcode)
+static void yubikey_validate_signal(UNUSED module_ctx_t const *mctx, UNUSED REQUEST *request, void *rctx,
+				    fr_state_signal_t action)
 {
-	rlm_rcode_t rcode = RLM_MODULE_OK;
-	ykclient_rc status;
-	ykclient_handle_t *yandle;
+	yubikey_validate_t *v = talloc_get_type_abort(rctx, yubikey_validate_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(v);
+}
+
+/** Start a query to a single validation server
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int yubikey_query_start(rlm_yubikey_thread_t *t, yubikey_validate_t *v, char const *uri, char const *query_str)
+{
+	rlm_yubikey_t const	*inst = v->inst;
+	REQUEST			*request = v->request;
+	yubikey_query_t		*query;
+	fr_curl_io_request_t	*randle;
+	char			*url;
+
+	MEM(query = talloc_zero(v, yubikey_query_t));
+	query->validate = v;
+	query->uri = uri;
+
+	randle = fr_curl_io_request_alloc(query);
+	if (!randle) {
+	error:
+		talloc_free(query);
+		return -1;
+	}
+	randle->uctx = query;
+	randle->done = yubikey_query_done;
+
+	MEM(url = talloc_typed_asprintf(query, "%s?%s", uri, query_str));
+
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_URL, url);
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_CONNECTTIMEOUT_MS, fr_time_delta_to_msec(inst->timeout));
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_TIMEOUT_MS, fr_time_delta_to_msec(inst->timeout));
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_WRITEFUNCTION, yubikey_query_body);
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_WRITEDATA, query);
 
-	yandle = fr_pool_connection_get(inst->pool, request);
-	if (!yandle) return RLM_MODULE_FAIL;
+	if (fr_curl_easy_tls_init(randle, &inst->tls) != 0) goto error;
+
+	if (fr_curl_io_request_enqueue(t->mhandle, request, randle) < 0) goto error;
+
+	v->outstanding++;
+
+	return 0;
+}
+
+/** Send the OTP to every validation server
+ *
+ */
+rlm_rcode_t rlm_yubikey_validate(module_ctx_t const *mctx, REQUEST *request, char const *passcode)
+{
+	rlm_yubikey_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_yubikey_t);
+	rlm_yubikey_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_yubikey_thread_t);
+	yubikey_validate_t	*v;
+	char			*query_str;
+	char			signature[YUBIKEY_SIGNATURE_LEN];
+	char			*p;
+	size_t			i;
+
+	MEM(v = talloc_zero(request, yubikey_validate_t));
+	v->inst = inst;
+	v->request = request;
+	v->otp = passcode;
+	v->rcode = RLM_MODULE_FAIL;
+
+	for (i = 0; i < YUBIKEY_NONCE_LEN; i += 8) snprintf(v->nonce + i, sizeof(v->nonce) - i, "%08x", fr_rand());
 
 	/*
-	 *	The libcurl multi-handle interface will tear down the TCP sockets for any partially completed
-	 *	requests when their easy handle is removed from the multistack.
-	 *
-	 *	For performance reasons ykclient will stop processing the request immediately after receiving
-	 *	a response from one of the servers. If we then immediately call ykclient_handle_cleanup
-	 *	the connections are destroyed and will need to be re-established the next time the handle
-	 *	is used.
-	 *
-	 *	To try and prevent this from happening, we leave cleanup until the *next* time
-	 *	the handle is used, by which time the requests will of hopefully completed and the connections
-	 *	can be re-used.
-	 *
+	 *	Parameters must be in alphabetical order
+	 *	for the signature.
 	 */
-	ykclient_handle_cleanup(yandle);
-
-	status = ykclient_request_process(inst->ykc, yandle, passcode);
-	if (status != YKCLIENT_OK) {
-		REDEBUG("%s", ykclient_strerror(status));
-		switch (status) {
-		case YKCLIENT_BAD_OTP:
-		case YKCLIENT_REPLAYED_OTP:
-			rcode = RLM_MODULE_REJECT;
+	MEM(query_str = talloc_typed_asprintf(v, "id=%u&nonce=%s&otp=%s", inst->client_id, v->nonce, passcode));
+	yubikey_sign(signature, inst, query_str, talloc_array_length(query_str) - 1);
+
+	MEM(query_str = talloc_strdup_append_buffer(query_str, "&h="));
+	for (p = signature; *p; p++) {
+		switch (*p) {
+		case '+':
+			MEM(query_str = talloc_strdup_append_buffer(query_str, "%2B"));
 			break;
 
-		case YKCLIENT_NO_SUCH_CLIENT:
-			rcode = RLM_MODULE_NOTFOUND;
+		case '/':
+			MEM(query_str = talloc_strdup_append_buffer(query_str, "%2F"));
+			break;
+
+		case '=':
+			MEM(query_str = talloc_strdup_append_buffer(query_str, "%3D"));
 			break;
 
 		default:
-			rcode = RLM_MODULE_FAIL;
+			MEM(query_str = talloc_strndup_append_buffer(query_str, p, 1));
+			break;
+		}
+	}
+
+	for (i = 0; i < inst->num_uris; i++) {
+		if (yubikey_query_start(t, v, inst->uris[i], query_str) < 0) {
+			RWDEBUG("Failed sending validation request to %s", inst->uris[i]);
 		}
 	}
+	talloc_free(query_str);
 
-	fr_pool_connection_release(inst->pool, request, yandle);
+	if (!v->outstanding) {
+		REDEBUG("Failed sending validation request to any server");
+		talloc_free(v);
+		return RLM_MODULE_FAIL;
+	}
 
-	return rcode;
+	return unlang_module_yield(request, yubikey_validate_resume, yubikey_validate_signal, v);
+}
+
+int rlm_yubikey_validate_init(CONF_SECTION *conf, rlm_yubikey_t *inst)
+{
+	CONF_SECTION	*servers;
+	ssize_t		slen;
+	size_t		len;
+
+	if (!inst->client_id) {
+		ERROR("validation.client_id must be set (to a valid id) when validation is enabled");
+
+		return -1;
+	}
+
+	if (!inst->api_key || !*inst->api_key || is_zero(inst->api_key)) {
+		ERROR("validation.api_key must be set (to a valid key) when validation is enabled");
+
+		return -1;
+	}
+
+	len = strlen(inst->api_key);
+	MEM(inst->api_key_bin = talloc_array(inst, uint8_t, FR_BASE64_DEC_LENGTH(len)));
+	slen = fr_base64_decode(inst->api_key_bin, talloc_array_length(inst->api_key_bin), inst->api_key, len);
+	if (slen <= 0) {
+		ERROR("validation.api_key must be base64 encoded");
+
+		return -1;
+	}
+	inst->api_key_len = slen;
+
+	servers = cf_section_find(conf, "servers", CF_IDENT_ANY);
+	if (servers) {
+		CONF_PAIR *uri;
+
+		for (uri = cf_pair_find(servers, "uri"); uri; uri = cf_pair_find_next(servers, uri, "uri")) {
+			char const	*value = cf_pair_value(uri);
+			size_t		value_len = strlen(value);
+			size_t		template_len = strlen(YUBIKEY_URI_TEMPLATE);
+
+			if ((value_len > template_len) &&
+			    (strcmp(value + (value_len - template_len), YUBIKEY_URI_TEMPLATE) == 0)) {
+				value = talloc_strndup(inst, value, value_len - template_len);
+			}
+
+			MEM(inst->uris = talloc_realloc(inst, inst->uris, char const *, inst->num_uris + 1));
+			inst->uris[inst->num_uris++] = value;
+		}
+	}
+
+	/*
+	 *	If there were no uris configured we just use the
+	 *	Yubico servers.
+	 */
+	if (!inst->num_uris) {
+		MEM(inst->uris = talloc_array(inst, char const *, 1));
+		inst->uris[inst->num_uris++] = YUBIKEY_DEFAULT_URI;
+	}
+
+	return 0;
 }
 #endif
@@ -288,6 +288,7 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	uint8_t		*p;
 	fr_cursor_t	cursor;
 	VALUE_PAIR	*vp;
+	VALUE_PAIR	*header[14] = { NULL };
 	uint32_t	lvalue;
 	uint16_t	svalue;
 	size_t		dhcp_size;
@@ -318,7 +319,25 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	}
 #endif
 
-	vp = fr_pair_find_by_da(vps, attr_dhcp_opcode, TAG_ANY);
+	/*
+	 *	Find the header attributes in one pass over the list,
+	 *	instead of searching the list once for each field.
+	 *	They're numbered contiguously, in the order of
+	 *	dhcp_header_attrs.  The first of each one wins.
+	 */
+	for (vp = vps; vp; vp = vp->next) {
+		unsigned int i;
+
+		if (vp->da->attr < attr_dhcp_opcode->attr) continue;
+
+		i = vp->da->attr - attr_dhcp_opcode->attr;
+		if ((i >= NUM_ELEMENTS(header)) || (vp->da != *dhcp_header_attrs[i]) || header[i]) continue;
+
+		header[i] = vp;
+	}
+
+	/* DHCP-Opcode */
+	vp = header[0];
 	if (vp) {
 		*p++ = vp->vp_uint32 & 0xff;
 	} else {
@@ -326,7 +345,7 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	}
 
 	/* DHCP-Hardware-Type */
-	vp = fr_pair_find_by_da(vps, attr_dhcp_hardware_type, TAG_ANY);
+	vp = header[1];
 	if (vp) {
 		*p = vp->vp_uint8;
 
@@ -337,7 +356,7 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	p += 1;
 
 	/* DHCP-Hardware-Address-len */
-	vp = fr_pair_find_by_da(vps, attr_dhcp_hardware_address_length, TAG_ANY);
+	vp = header[2];
 	if (vp) {
 		*p = vp->vp_uint8;
 
@@ -348,7 +367,7 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	p += 1;
 
 	/* DHCP-Hop-Count */
-	vp = fr_pair_find_by_da(vps, attr_dhcp_hop_count, TAG_ANY);
+	vp = header[3];
 	if (vp) {
 		*p = vp->vp_uint8;
 
@@ -364,7 +383,7 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	p += 4;
 
 	/* DHCP-Number-of-Seconds */
-	vp = fr_pair_find_by_da(vps, attr_dhcp_number_of_seconds, TAG_ANY);
+	vp = header[5];
 	if (vp) {
 		svalue = htons(vp->vp_uint16);
 		memcpy(p, &svalue, 2);
@@ -372,7 +391,7 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	p += 2;
 
 	/* DHCP-Flags */
-	vp = fr_pair_find_by_da(vps, attr_dhcp_flags, TAG_ANY);
+	vp = header[6];
 	if (vp) {
 		svalue = htons(vp->vp_uint16);
 		memcpy(p, &svalue, 2);
@@ -380,12 +399,12 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	p += 2;
 
 	/* DHCP-Client-IP-Address */
-	vp = fr_pair_find_by_da(vps, attr_dhcp_client_ip_address, TAG_ANY);
+	vp = header[7];
 	if (vp) memcpy(p, &vp->vp_ipv4addr, 4);
 	p += 4;
 
 	/* DHCP-Your-IP-address */
-	vp = fr_pair_find_by_da(vps, attr_dhcp_your_ip_address, TAG_ANY);
+	vp = header[8];
 	if (vp) {
 		lvalue = vp->vp_ipv4addr;
 	} else {
@@ -395,7 +414,7 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	p += 4;
 
 	/* DHCP-Server-IP-Address */
-	vp = fr_pair_find_by_da(vps, attr_dhcp_server_ip_address, TAG_ANY);
+	vp = header[9];
 	if (vp) {
 		lvalue = vp->vp_ipv4addr;
 	} else {
@@ -407,7 +426,7 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	/*
 	 *	DHCP-Gateway-IP-Address
 	 */
-	vp = fr_pair_find_by_da(vps, attr_dhcp_gateway_ip_address, TAG_ANY);
+	vp = header[10];
 	if (vp) {
 		lvalue = vp->vp_ipv4addr;
 		memcpy(p, &lvalue, 4);
@@ -422,7 +441,7 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	p += 4;
 
 	/* DHCP-Client-Hardware-Address */
-	if ((vp = fr_pair_find_by_da(vps, attr_dhcp_client_hardware_address, TAG_ANY))) {
+	if ((vp = header[11])) {
 		if (vp->vp_type == FR_TYPE_ETHERNET) {
 			/*
 			 *	Ensure that we mark the packet as being Ethernet.
@@ -440,7 +459,7 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	p += DHCP_CHADDR_LEN;
 
 	/* DHCP-Server-Host-Name */
-	if ((vp = fr_pair_find_by_da(vps, attr_dhcp_server_host_name, TAG_ANY))) {
+	if ((vp = header[12])) {
 		if (vp->vp_length > DHCP_SNAME_LEN) {
 			memcpy(p, vp->vp_strvalue, DHCP_SNAME_LEN);
 		} else {
@@ -460,7 +479,7 @@ ssize_t fr_dhcpv4_encode(uint8_t *buffer, size_t buflen, dhcp_packet_t *original
 	 */
 
 	/* DHCP-Boot-Filename */
-	vp = fr_pair_find_by_da(vps, attr_dhcp_boot_filename, TAG_ANY);
+	vp = header[13];
 	if (vp) {
 		if (vp->vp_length > DHCP_FILE_LEN) {
 			memcpy(p, vp->vp_strvalue, DHCP_FILE_LEN);
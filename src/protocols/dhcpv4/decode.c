@@ -37,10 +37,10 @@
 #include "attrs.h"
 
 static ssize_t decode_tlv(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_attr_t const *parent,
-			  uint8_t const *data, size_t data_len);
+			  uint8_t const *data, size_t data_len, fr_dhcpv4_ctx_t *packet_ctx);
 
-static ssize_t decode_value(TALLOC_CTX *ctx, fr_cursor_t *cursor,
-			    fr_dict_attr_t const *parent, uint8_t const *data, size_t data_len);
+static ssize_t decode_value(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_attr_t const *parent,
+			    uint8_t const *data, size_t data_len, fr_dhcpv4_ctx_t *packet_ctx);
 
 /** Returns the number of array members for arrays with fixed element sizes
  *
@@ -88,7 +88,7 @@ static int fr_dhcpv4_array_members(size_t *out, size_t len, fr_dict_attr_t const
  *	Decode ONE value into a VP
  */
 static ssize_t decode_value_internal(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_attr_t const *da,
-				     uint8_t const *data, size_t data_len)
+				     uint8_t const *data, size_t data_len, fr_dhcpv4_ctx_t *packet_ctx)
 {
 	VALUE_PAIR *vp;
 	uint8_t const *p = data;
@@ -106,7 +106,7 @@ static ssize_t decode_value_internal(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_di
 	 *	steal the unknown attribute into the context
 	 *	of the pair.
 	 */
-	if (da->flags.is_unknown) talloc_steal(vp, da);
+	if (da->flags.is_unknown && !da->flags.is_interned) talloc_steal(vp, da);
 
 	if (vp->da->type == FR_TYPE_STRING) {
 		uint8_t const *q, *end;
@@ -167,6 +167,19 @@ static ssize_t decode_value_internal(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_di
 		p += sizeof(vp->vp_ipv6addr) + 1;
 		break;
 
+	/*
+	 *	Point to the data in the packet instead of copying
+	 *	it, if the caller asked for that.
+	 */
+	case FR_TYPE_OCTETS:
+		if (packet_ctx && packet_ctx->shallow_start &&
+		    (p >= packet_ctx->shallow_start) && ((p + data_len) <= packet_ctx->shallow_end)) {
+			fr_value_box_memdup_shallow(&vp->data, vp->da, p, data_len, true);
+			p += data_len;
+			break;
+		}
+		/* FALL-THROUGH */
+
 	default:
 	{
 		ssize_t ret;
@@ -223,9 +236,10 @@ finish:
  * @param[in] parent of sub TLVs.
  * @param[in] data to parse.
  * @param[in] data_len of data parsed.
+ * @param[in] packet_ctx decoder state, may be NULL.
  */
 static ssize_t decode_tlv(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_attr_t const *parent,
-			  uint8_t const *data, size_t data_len)
+			  uint8_t const *data, size_t data_len, fr_dhcpv4_ctx_t *packet_ctx)
 {
 	uint8_t const		*p = data;
 	uint8_t const		*end = data + data_len;
@@ -292,7 +306,7 @@ static ssize_t decode_tlv(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_attr_t c
 			       fr_table_str_by_value(fr_value_box_type_table, parent->type, "<invalid>"), parent->name,
 			       fr_table_str_by_value(fr_value_box_type_table, child->type, "<invalid>"), child->name);
 
-		tlv_len = decode_value(ctx, cursor, child, p + 2, p[1]);
+		tlv_len = decode_value(ctx, cursor, child, p + 2, p[1], packet_ctx);
 		if (tlv_len < 0) {
 			fr_dict_unknown_free(&child);
 			return tlv_len;
@@ -306,8 +320,8 @@ static ssize_t decode_tlv(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_attr_t c
 	return p - data;
 }
 
-static ssize_t decode_value(TALLOC_CTX *ctx, fr_cursor_t *cursor,
-			    fr_dict_attr_t const *parent, uint8_t const *data, size_t data_len)
+static ssize_t decode_value(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_attr_t const *parent,
+			    uint8_t const *data, size_t data_len, fr_dhcpv4_ctx_t *packet_ctx)
 {
 	unsigned int	values, i;		/* How many values we need to decode */
 	uint8_t const	*p = data;
@@ -320,7 +334,7 @@ static ssize_t decode_value(TALLOC_CTX *ctx, fr_cursor_t *cursor,
 	/*
 	 *	TLVs can't be coalesced as they're variable length
 	 */
-	if (parent->type == FR_TYPE_TLV) return decode_tlv(ctx, cursor, parent, data, data_len);
+	if (parent->type == FR_TYPE_TLV) return decode_tlv(ctx, cursor, parent, data, data_len, packet_ctx);
 
 	/*
 	 *	Values with a fixed length may be coalesced into a single option
@@ -341,7 +355,7 @@ static ssize_t decode_value(TALLOC_CTX *ctx, fr_cursor_t *cursor,
 	 *	attribute.
 	 */
 	for (i = 0, p = data; i < values; i++) {
-		len = decode_value_internal(ctx, cursor, parent, p, value_len);
+		len = decode_value_internal(ctx, cursor, parent, p, value_len, packet_ctx);
 		if (len <= 0) return len;
 		if (len != (ssize_t)value_len) {
 			fr_strerror_printf("Failed decoding complete option value");
@@ -360,10 +374,10 @@ static ssize_t decode_value(TALLOC_CTX *ctx, fr_cursor_t *cursor,
  * @param[in] dict		to lookup attributes in.
  * @param[in] data		to parse.
  * @param[in] data_len		of data to parse.
- * @param[in] decoder_ctx	Unused.
+ * @param[in] decoder_ctx	A #fr_dhcpv4_ctx_t, or NULL.
  */
 ssize_t fr_dhcpv4_decode_option(TALLOC_CTX *ctx, fr_cursor_t *cursor,
-			        fr_dict_t const *dict, uint8_t const *data, size_t data_len, UNUSED void *decoder_ctx)
+			        fr_dict_t const *dict, uint8_t const *data, size_t data_len, void *decoder_ctx)
 {
 	ssize_t			ret;
 	uint8_t const		*p = data;
@@ -422,7 +436,7 @@ ssize_t fr_dhcpv4_decode_option(TALLOC_CTX *ctx, fr_cursor_t *cursor,
 		       fr_table_str_by_value(fr_value_box_type_table, parent->type, "<invalid>"), parent->name,
 		       fr_table_str_by_value(fr_value_box_type_table, child->type, "<invalid>"), child->name);
 
-	ret = decode_value(ctx, cursor, child, data + 2, data[1]);
+	ret = decode_value(ctx, cursor, child, data + 2, data[1], decoder_ctx);
 	if (ret < 0) {
 		fr_dict_unknown_free(&child);
 		return ret;
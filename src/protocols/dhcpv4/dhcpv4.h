@@ -136,7 +136,11 @@ extern fr_dict_attr_t const 	*dhcp_option_82;
  *
  */
 typedef struct {
-	fr_dict_attr_t const *root;
+	fr_dict_attr_t const	*root;
+
+	uint8_t const		*shallow_start;		//!< octets values which lie between shallow_start
+	uint8_t const		*shallow_end;		//!< and shallow_end point to the packet, instead
+							///< of being copied.
 } fr_dhcpv4_ctx_t;
 
 RADIUS_PACKET *fr_dhcpv4_udp_packet_recv(int sockfd);
@@ -174,6 +178,9 @@ uint8_t const	*fr_dhcpv4_packet_get_option(dhcp_packet_t const *packet, size_t p
 
 int		fr_dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALUE_PAIR **vps, unsigned int *code);
 
+int		fr_dhcpv4_decode_shallow(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALUE_PAIR **vps,
+					 unsigned int *code);
+
 int		fr_dhcpv4_packet_encode(RADIUS_PACKET *packet);
 
 #ifdef HAVE_LINUX_IF_PACKET_H
@@ -186,6 +193,16 @@ int		fr_dhcpv4_raw_socket_open(struct sockaddr_ll *p_ll, int iface_index);
 int		fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *p_ll, RADIUS_PACKET *packet);
 
 RADIUS_PACKET	*fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *p_ll, RADIUS_PACKET *request);
+
+#include <freeradius-devel/util/tpacket.h>
+#ifdef HAVE_TPACKET_V3
+fr_tpacket_t	*fr_dhcpv4_raw_ring_open(TALLOC_CTX *ctx, char const *interface, uint16_t port,
+					 fr_tpacket_config_t const *conf);
+
+int		fr_dhcpv4_raw_ring_send(fr_tpacket_t *ring, RADIUS_PACKET *packet);
+
+RADIUS_PACKET	*fr_dhcpv4_raw_ring_recv(fr_tpacket_t *ring, RADIUS_PACKET *request);
+#endif
 #endif
 
 /*
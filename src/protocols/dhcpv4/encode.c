@@ -478,3 +478,25 @@ fr_test_point_pair_encode_t dhcpv4_tp_encode_pair = {
 	.test_ctx	= encode_test_ctx,
 	.func		= fr_dhcpv4_encode_option
 };
+
+static ssize_t fr_dhcpv4_encode_proto(UNUSED TALLOC_CTX *ctx, VALUE_PAIR *vps, uint8_t *data, size_t data_len,
+				      UNUSED void *proto_ctx)
+{
+	VALUE_PAIR	*vp;
+	int		code = FR_DHCP_DISCOVER;
+	uint32_t	xid = 0;
+
+	vp = fr_pair_find_by_da(vps, attr_dhcp_message_type, TAG_ANY);
+	if (vp) code = vp->vp_uint8;
+
+	vp = fr_pair_find_by_da(vps, attr_dhcp_transaction_id, TAG_ANY);
+	if (vp) xid = vp->vp_uint32;
+
+	return fr_dhcpv4_encode(data, data_len, NULL, code, xid, vps);
+}
+
+extern fr_test_point_proto_encode_t dhcpv4_tp_encode_proto;
+fr_test_point_proto_encode_t dhcpv4_tp_encode_proto = {
+	.test_ctx	= encode_test_ctx,
+	.func		= fr_dhcpv4_encode_proto
+};
@@ -103,7 +103,8 @@ uint8_t const *fr_dhcpv4_packet_get_option(dhcp_packet_t const *packet, size_t p
 	return NULL;
 }
 
-int fr_dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALUE_PAIR **vps, unsigned int *code)
+static int dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALUE_PAIR **vps,
+			 unsigned int *code, bool shallow)
 {
 	size_t		i;
 	uint8_t const  	*p = data;
@@ -111,6 +112,12 @@ int fr_dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALU
 	fr_cursor_t	cursor;
 	VALUE_PAIR	*head = NULL, *vp;
 	VALUE_PAIR	*maxms, *mtu;
+	fr_dhcpv4_ctx_t	packet_ctx = { .root = fr_dict_root(dict_dhcpv4) };
+
+	if (shallow) {
+		packet_ctx.shallow_start = data;
+		packet_ctx.shallow_end = data + data_len;
+	}
 
 	fr_cursor_init(&cursor, &head);
 
@@ -166,6 +173,10 @@ int fr_dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALU
 		case FR_TYPE_OCTETS:
 			if (data[2] == 0) break;
 
+			if (shallow) {
+				fr_value_box_memdup_shallow(&vp->data, vp->da, p, data[2], true);
+				break;
+			}
 			fr_pair_value_memdup(vp, p, data[2], true);
 			break;
 
@@ -209,7 +220,7 @@ int fr_dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALU
 		 *	Loop over all the options data
 		 */
 		while (p < end) {
-			len = fr_dhcpv4_decode_option(ctx, &cursor, dict_dhcpv4, p, (end - p), NULL);
+			len = fr_dhcpv4_decode_option(ctx, &cursor, dict_dhcpv4, p, (end - p), &packet_ctx);
 			if (len <= 0) {
 				fr_pair_list_free(&head);
 				return len;
@@ -239,7 +250,7 @@ int fr_dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALU
 				end = p + 64;
 				while (p < end) {
 					len = fr_dhcpv4_decode_option(ctx, &cursor, dict_dhcpv4,
-								      p, end - p, NULL);
+								      p, end - p, &packet_ctx);
 					if (len <= 0) {
 						fr_pair_list_free(&head);
 						return len;
@@ -256,7 +267,7 @@ int fr_dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALU
 				end = p + 128;
 				while (p < end) {
 					len = fr_dhcpv4_decode_option(ctx, &cursor, dict_dhcpv4,
-								      p, end - p, NULL);
+								      p, end - p, &packet_ctx);
 					if (len <= 0) {
 						fr_pair_list_free(&head);
 						return len;
@@ -330,6 +341,27 @@ int fr_dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALU
 	return 0;
 }
 
+/** Decode a raw DHCPv4 packet into VPs
+ *
+ */
+int fr_dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALUE_PAIR **vps, unsigned int *code)
+{
+	return dhcpv4_decode(ctx, data, data_len, vps, code, false);
+}
+
+/** Decode a raw DHCPv4 packet into VPs, without copying octets values
+ *
+ *  Attributes of type octets, such as DHCP-Client-Identifier and the
+ *  Relay Agent Information sub-options, point directly into the packet,
+ *  and are only copied if they're changed.  The packet MUST NOT be freed
+ *  or modified until all of the VPs have been freed.
+ */
+int fr_dhcpv4_decode_shallow(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, VALUE_PAIR **vps,
+			     unsigned int *code)
+{
+	return dhcpv4_decode(ctx, data, data_len, vps, code, true);
+}
+
 int fr_dhcpv4_packet_encode(RADIUS_PACKET *packet)
 {
 	ssize_t		len;
@@ -95,28 +95,35 @@ int fr_dhcpv4_raw_socket_open(struct sockaddr_ll *link_layer, int if_index)
 	return fd;
 }
 
-/** Create the requisite L2/L3 headers, and write a DHCPv4 packet to a raw socket
+/** Create the requisite L2/L3 headers for a DHCPv4 packet
  *
- * @param[in] sockfd		to write to.
- * @param[in] link_layer	information, as returned by fr_dhcpv4_raw_socket_open.
- * @param[in] packet		to write.
+ * @param[out] out		Where to write the frame.
+ * @param[in] outlen		Length of the output buffer.
+ * @param[in] packet		to encapsulate.
  * @return
- *	- 0 on success.
- *	- -1 on failure.
+ *	- >0 the length of the frame.
+ *	- -1 if the output buffer is too small.
  */
-int fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *link_layer, RADIUS_PACKET *packet)
+static ssize_t dhcpv4_raw_frame_encode(uint8_t *out, size_t outlen, RADIUS_PACKET *packet)
 {
-	uint8_t			dhcp_packet[1518] = { 0 };
-	ethernet_header_t	*eth_hdr = (ethernet_header_t *)dhcp_packet;
-	ip_header_t		*ip_hdr = (ip_header_t *)(dhcp_packet + ETH_HDR_SIZE);
-	udp_header_t		*udp_hdr = (udp_header_t *) (dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE);
-	dhcp_packet_t		*dhcp = (dhcp_packet_t *)(dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE);
+	ethernet_header_t	*eth_hdr = (ethernet_header_t *)out;
+	ip_header_t		*ip_hdr = (ip_header_t *)(out + ETH_HDR_SIZE);
+	udp_header_t		*udp_hdr = (udp_header_t *) (out + ETH_HDR_SIZE + IP_HDR_SIZE);
+	dhcp_packet_t		*dhcp = (dhcp_packet_t *)(out + ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE);
 
 	uint16_t		l4_len = (UDP_HDR_SIZE + packet->data_len);
+	size_t			frame_len = ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE + packet->data_len;
 	VALUE_PAIR		*vp;
 
 	/* set ethernet source address to our MAC address (DHCP-Client-Hardware-Address). */
 	uint8_t dhmac[ETH_ADDR_LEN] = { 0 };
+
+	if (frame_len > outlen) {
+		fr_strerror_printf("DHCP packet is too large (%zu > %zu)", frame_len, outlen);
+		return -1;
+	}
+	memset(out, 0, ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE);
+
 	if ((vp = fr_pair_find_by_da(packet->vps, attr_dhcp_client_hardware_address, TAG_ANY))) {
 		if (vp->vp_type == FR_TYPE_ETHERNET) memcpy(dhmac, vp->vp_ether, sizeof(vp->vp_ether));
 	}
@@ -157,37 +164,59 @@ int fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *link_layer, RADIUS
 	memcpy(dhcp, packet->data, packet->data_len);
 
 	/* UDP checksum is done here */
-	udp_hdr->checksum = fr_udp_checksum((uint8_t const *)(dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE),
+	udp_hdr->checksum = fr_udp_checksum((uint8_t const *)(out + ETH_HDR_SIZE + IP_HDR_SIZE),
 					    ntohs(udp_hdr->len), udp_hdr->checksum,
 					    packet->src_ipaddr.addr.v4, packet->dst_ipaddr.addr.v4);
 
-	return sendto(sockfd, dhcp_packet, (ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE + packet->data_len),
+	return frame_len;
+}
+
+/** Create the requisite L2/L3 headers, and write a DHCPv4 packet to a raw socket
+ *
+ * @param[in] sockfd		to write to.
+ * @param[in] link_layer	information, as returned by fr_dhcpv4_raw_socket_open.
+ * @param[in] packet		to write.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *link_layer, RADIUS_PACKET *packet)
+{
+	uint8_t			dhcp_packet[1518];
+	ssize_t			frame_len;
+
+	frame_len = dhcpv4_raw_frame_encode(dhcp_packet, sizeof(dhcp_packet), packet);
+	if (frame_len < 0) return -1;
+
+	return sendto(sockfd, dhcp_packet, frame_len,
 		      0, (struct sockaddr *) link_layer, sizeof(struct sockaddr_ll));
 }
 
-/*
- *	For a client, receive a DHCP packet from a raw packet
- *	socket. Make sure it matches the ongoing request.
+/** Check a frame contains a DHCP reply matching the ongoing request, and decode its headers
  *
- *	FIXME: split this into two, recv_raw_packet, and verify(packet, original)
+ * @param[in] raw_packet	Frame, starting with the ethernet header.
+ * @param[in] data_len		Length of the frame.
+ * @param[in] request		The request we're expecting a reply to.
+ * @param[in] sockfd		the frame was read from.
+ * @return
+ *	- A new packet on success.
+ *	- NULL if the frame isn't a reply to the request.
  */
-RADIUS_PACKET *fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *link_layer, RADIUS_PACKET *request)
+static RADIUS_PACKET *dhcpv4_raw_frame_decode(uint8_t const *raw_packet, ssize_t data_len,
+					      RADIUS_PACKET *request, int sockfd)
 {
 	VALUE_PAIR		*vp;
 	RADIUS_PACKET		*packet;
 	uint8_t const		*code;
 	uint32_t		magic, xid;
-	ssize_t			data_len;
 
-	uint8_t			*raw_packet;
-	ethernet_header_t	*eth_hdr;
-	ip_header_t		*ip_hdr;
-	udp_header_t		*udp_hdr;
-	dhcp_packet_t		*dhcp_hdr;
+	ethernet_header_t const	*eth_hdr;
+	ip_header_t const	*ip_hdr;
+	udp_header_t const	*udp_hdr;
+	dhcp_packet_t const	*dhcp_hdr;
 	uint16_t		udp_src_port;
 	uint16_t		udp_dst_port;
 	size_t			dhcp_data_len;
-	socklen_t		sock_len;
 
 	packet = fr_radius_alloc(NULL, false);
 	if (!packet) {
@@ -195,25 +224,14 @@ RADIUS_PACKET *fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *link_lay
 		return NULL;
 	}
 
-	raw_packet = talloc_zero_array(packet, uint8_t, MAX_PACKET_SIZE);
-	if (!raw_packet) {
-		fr_strerror_printf("Out of memory");
-		fr_radius_packet_free(&packet);
-		return NULL;
-	}
-
 	packet->sockfd = sockfd;
 
-	/* a packet was received (but maybe it is not for us) */
-	sock_len = sizeof(struct sockaddr_ll);
-	data_len = recvfrom(sockfd, raw_packet, MAX_PACKET_SIZE, 0, (struct sockaddr *)link_layer, &sock_len);
-
 	uint8_t data_offset = ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE; /* DHCP data datas after Ethernet, IP, UDP */
 
 	if (data_len <= data_offset) DISCARD_RP("Payload (%d) smaller than required for layers 2+3+4", (int)data_len);
 
 	/* map raw packet to packet header of the different layers (Ethernet, IP, UDP) */
-	eth_hdr = (ethernet_header_t *)raw_packet;
+	eth_hdr = (ethernet_header_t const *)raw_packet;
 
 	/*
 	 *	Check Ethernet layer data (L2)
@@ -237,7 +255,7 @@ RADIUS_PACKET *fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *link_lay
 	/*
 	 *	Ethernet is OK.  Now look at IP.
 	 */
-	ip_hdr = (ip_header_t *)(raw_packet + ETH_HDR_SIZE);
+	ip_hdr = (ip_header_t const *)(raw_packet + ETH_HDR_SIZE);
 
 	/*
 	 *	Check IPv4 layer data (L3)
@@ -253,7 +271,7 @@ RADIUS_PACKET *fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *link_lay
 	/*
 	 *	Now check UDP.
 	 */
-	udp_hdr = (udp_header_t *)(raw_packet + ETH_HDR_SIZE + IP_HDR_SIZE);
+	udp_hdr = (udp_header_t const *)(raw_packet + ETH_HDR_SIZE + IP_HDR_SIZE);
 
 	/*
 	 *	Check UDP layer data (L4)
@@ -271,7 +289,7 @@ RADIUS_PACKET *fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *link_lay
 	if (dhcp_data_len > MAX_PACKET_SIZE) DISCARD_RP("DHCP packet is too large (%zu > %i)",
 							dhcp_data_len, MAX_PACKET_SIZE);
 
-	dhcp_hdr = (dhcp_packet_t *)(raw_packet + ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE);
+	dhcp_hdr = (dhcp_packet_t const *)(raw_packet + ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE);
 
 	if (dhcp_hdr->htype != 1) DISCARD_RP("DHCP hardware type (%d) != Ethernet (1)", dhcp_hdr->htype);
 	if (dhcp_hdr->hlen != 6) DISCARD_RP("DHCP hardware address length (%d) != 6", dhcp_hdr->hlen);
@@ -291,7 +309,11 @@ RADIUS_PACKET *fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *link_lay
 	/* all checks ok! this is a DHCP reply we're interested in. */
 	packet->data_len = dhcp_data_len;
 	packet->data = talloc_memdup(packet, raw_packet + data_offset, dhcp_data_len);
-	TALLOC_FREE(raw_packet);
+	if (!packet->data) {
+		fr_strerror_printf("Out of memory");
+		fr_radius_packet_free(&packet);
+		return NULL;
+	}
 	packet->id = xid;
 
 	code = fr_dhcpv4_packet_get_option((dhcp_packet_t const *) packet->data,
@@ -335,4 +357,113 @@ RADIUS_PACKET *fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *link_lay
 
 	return packet;
 }
+/*
+ *	For a client, receive a DHCP packet from a raw packet
+ *	socket. Make sure it matches the ongoing request.
+ */
+RADIUS_PACKET *fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *link_layer, RADIUS_PACKET *request)
+{
+	uint8_t			raw_packet[MAX_PACKET_SIZE];
+	ssize_t			data_len;
+	socklen_t		sock_len;
+
+	/* a packet was received (but maybe it is not for us) */
+	sock_len = sizeof(struct sockaddr_ll);
+	data_len = recvfrom(sockfd, raw_packet, sizeof(raw_packet), 0, (struct sockaddr *)link_layer, &sock_len);
+	if (data_len < 0) {
+		fr_strerror_printf("Failed reading from raw socket: %s", fr_syserror(errno));
+		return NULL;
+	}
+
+	return dhcpv4_raw_frame_decode(raw_packet, data_len, request, sockfd);
+}
+
+#ifdef HAVE_TPACKET_V3
+/** Open a memory mapped raw socket, which only receives DHCP packets for a client
+ *
+ * A kernel BPF filter discards everything other than IPv4 UDP packets
+ * sent to the client port, so unrelated traffic never reaches the ring.
+ *
+ * @param[in] ctx		to allocate the handle in.
+ * @param[in] interface		to bind to.
+ * @param[in] port		DHCP client port, in host byte order.
+ * @param[in] conf		Size of the rings.
+ * @return
+ *	- A new handle on success.
+ *	- NULL on failure.
+ */
+fr_tpacket_t *fr_dhcpv4_raw_ring_open(TALLOC_CTX *ctx, char const *interface, uint16_t port,
+				      fr_tpacket_config_t const *conf)
+{
+	/*
+	 *	ip and udp dst port <port>, and not a fragment
+	 */
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),			/* ether type */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_TYPE_IP, 0, 8),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ETH_HDR_SIZE + 9),	/* IP protocol */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, ETH_HDR_SIZE + 6),	/* IP fragment offset */
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, ETH_HDR_SIZE),		/* IP header length */
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, ETH_HDR_SIZE + 2),	/* UDP destination port */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, UINT16_MAX),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = { .len = NUM_ELEMENTS(code), .filter = code };
+
+	return fr_tpacket_open(ctx, interface, ETH_P_IP, &prog, conf);
+}
+
+/** Queue a DHCPv4 packet in the transmit ring
+ *
+ * The L2/L3 headers are written straight into the ring.  The packet is
+ * sent when fr_tpacket_flush() is called.
+ *
+ * @param[in] ring	to write to.
+ * @param[in] packet	to write.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dhcpv4_raw_ring_send(fr_tpacket_t *ring, RADIUS_PACKET *packet)
+{
+	uint8_t	*frame;
+	size_t	frame_max;
+	ssize_t	frame_len;
+
+	frame = fr_tpacket_send_reserve(ring, &frame_max);
+	if (!frame) return -1;
+
+	frame_len = dhcpv4_raw_frame_encode(frame, frame_max, packet);
+	if (frame_len < 0) return -1;
+
+	return fr_tpacket_send_commit(ring, frame_len);
+}
+
+/** Receive a DHCP packet from the receive ring, which matches the ongoing request
+ *
+ * Frames which aren't replies to the request are skipped.
+ *
+ * @param[in] ring	to read from.
+ * @param[in] request	The request we're expecting a reply to.
+ * @return
+ *	- A new packet on success.
+ *	- NULL if no matching reply is ready.
+ */
+RADIUS_PACKET *fr_dhcpv4_raw_ring_recv(fr_tpacket_t *ring, RADIUS_PACKET *request)
+{
+	uint8_t const	*frame;
+	ssize_t		frame_len;
+	RADIUS_PACKET	*packet = NULL;
+
+	while (!packet && ((frame_len = fr_tpacket_recv(ring, &frame, NULL)) > 0)) {
+		packet = dhcpv4_raw_frame_decode(frame, frame_len, request, fr_tpacket_fd(ring));
+	}
+	fr_tpacket_recv_done(ring);
+
+	return packet;
+}
+#endif
 #endif
@@ -53,13 +53,18 @@ fr_dict_autoload_t libfreeradius_dhcpv6_dict[] = {
 static fr_dict_attr_t const *attr_packet_type;
 static fr_dict_attr_t const *attr_transaction_id;
 static fr_dict_attr_t const *attr_option_request;
-
+static fr_dict_attr_t const *attr_hop_count;
+static fr_dict_attr_t const *attr_relay_link_address;
+static fr_dict_attr_t const *attr_relay_peer_address;
 
 extern fr_dict_attr_autoload_t libfreeradius_dhcpv6_dict_attr[];
 fr_dict_attr_autoload_t libfreeradius_dhcpv6_dict_attr[] = {
 	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_dhcpv6 },
 	{ .out = &attr_transaction_id, .name = "Transaction-Id", .type = FR_TYPE_OCTETS, .dict = &dict_dhcpv6 },
 	{ .out = &attr_option_request, .name = "Option-Request", .type = FR_TYPE_UINT16, .dict = &dict_dhcpv6 },
+	{ .out = &attr_hop_count, .name = "Hop-Count", .type = FR_TYPE_UINT8, .dict = &dict_dhcpv6 },
+	{ .out = &attr_relay_link_address, .name = "Relay-Link-Address", .type = FR_TYPE_IPV6_ADDR, .dict = &dict_dhcpv6 },
+	{ .out = &attr_relay_peer_address, .name = "Relay-Peer-Address", .type = FR_TYPE_IPV6_ADDR, .dict = &dict_dhcpv6 },
 	{ NULL }
 };
 
@@ -159,6 +164,12 @@ size_t fr_dhcpv6_option_len(VALUE_PAIR const *vp)
 
 #define option_len(_x) ((_x[2] << 8) | _x[3])
 
+/*
+ *	Relay-Forward and Relay-Reply have a different header to
+ *	other messages.
+ */
+#define is_relay(_code) (((_code) == FR_PACKET_TYPE_VALUE_RELAY_FORWARD) || ((_code) == FR_PACKET_TYPE_VALUE_RELAY_REPLY))
+
 /** See if the data pointed to by PTR is a valid DHCPv6 packet.
  *
  * @param[in] packet		to check.
@@ -174,16 +185,21 @@ bool fr_dhcpv6_ok(uint8_t const *packet, size_t packet_len,
 	uint8_t const *p;
 	uint8_t const *end;
 	uint32_t attributes;
+	size_t hdr_len = 4;
 
 	/*
 	 *	8 bit code + 24 bits of transaction ID
 	 */
 	if (packet_len < 4) return false;
 
-	if (packet_len == 4) return true;
+	if (is_relay(packet[0])) hdr_len = DHCPV6_RELAY_HDR_LEN;
+
+	if (packet_len < hdr_len) return false;
+
+	if (packet_len == hdr_len) return true;
 
 	attributes = 0;
-	p = packet + 4;
+	p = packet + hdr_len;
 	end = packet + packet_len;
 
 	while (p < end) {
@@ -465,6 +481,68 @@ bool fr_dhcpv6_verify(uint8_t const *packet, size_t packet_len, fr_dhcpv6_decode
       +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 */
 
+/*
+
+       0                   1                   2                   3
+       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+      |    msg-type   |   hop-count   |                               |
+      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+                               |
+      |                                                               |
+      |                         link-address                          |
+      |                                                               |
+      |                               +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+      |                               |                               |
+      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+                               |
+      |                                                               |
+      |                         peer-address                          |
+      |                                                               |
+      |                               +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+      |                               |                               |
+      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+                               |
+      .                                                               .
+      .            options (variable number and length)   ....        .
+      |                                                               |
+      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+*/
+
+/** Decode the header of a Relay-Forward or Relay-Reply message
+ *
+ */
+static int decode_relay_header(TALLOC_CTX *ctx, fr_cursor_t *cursor, uint8_t const *packet)
+{
+	VALUE_PAIR *vp;
+
+	vp = fr_pair_afrom_da(ctx, attr_hop_count);
+	if (!vp) return -1;
+
+	vp->vp_uint8 = packet[1];
+	vp->type = VT_DATA;
+	fr_cursor_append(cursor, vp);
+
+	vp = fr_pair_afrom_da(ctx, attr_relay_link_address);
+	if (!vp) return -1;
+
+	if (fr_value_box_from_network(vp, &vp->data, vp->da->type, vp->da, packet + 2, 16, true) < 0) {
+		talloc_free(vp);
+		return -1;
+	}
+	vp->type = VT_DATA;
+	fr_cursor_append(cursor, vp);
+
+	vp = fr_pair_afrom_da(ctx, attr_relay_peer_address);
+	if (!vp) return -1;
+
+	if (fr_value_box_from_network(vp, &vp->data, vp->da->type, vp->da, packet + 18, 16, true) < 0) {
+		talloc_free(vp);
+		return -1;
+	}
+	vp->type = VT_DATA;
+	fr_cursor_append(cursor, vp);
+
+	return 0;
+}
+
 /** Decode a DHCPv6 packet
  *
  */
@@ -490,11 +568,22 @@ ssize_t	fr_dhcpv6_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_l
 	fr_cursor_append(&cursor, vp);
 
 	/*
-	 *	@todo - skip over hop-count, IPv6 link address and
-	 *	IPv6 peer address for Relay-forward and Relay-reply
-	 *	messages.  There is no transaction ID in those
-	 *	packets.
+	 *	Relay-forward and Relay-reply messages have a
+	 *	hop-count, IPv6 link address and IPv6 peer address.
+	 *	There is no transaction ID in those packets.
+	 *
+	 *	The relayed message is left in the Relay-Message
+	 *	option, and isn't decoded here.
 	 */
+	if (is_relay(packet[0])) {
+		if (decode_relay_header(ctx, &cursor, packet) < 0) {
+			fr_pair_list_free(vps);
+			return -1;
+		}
+
+		p = packet + DHCPV6_RELAY_HDR_LEN;
+		goto options;
+	}
 
 	/*
 	 *	And the transaction ID.
@@ -514,6 +603,8 @@ ssize_t	fr_dhcpv6_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_l
 	fr_cursor_append(&cursor, vp);
 
 	p = packet + 4;
+
+options:
 	end = packet + packet_len;
 
 	packet_ctx.tmp_ctx = talloc_init_const("tmp");
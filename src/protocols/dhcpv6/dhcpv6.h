@@ -36,6 +36,11 @@ extern size_t const fr_dhcpv6_attr_sizes[FR_TYPE_MAX + 1][2];
 
 #define OPT_HDR_LEN	(sizeof(uint16_t) * 2)
 
+/*
+ *	msg-type, hop-count, link-address and peer-address.
+ */
+#define DHCPV6_RELAY_HDR_LEN	(1 + 1 + 16 + 16)
+
 /*
  *	Defined addresses from RFC 8415 Section 7.1
  */
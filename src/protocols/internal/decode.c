@@ -351,6 +351,87 @@ ssize_t fr_internal_decode_pair(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_t
 	return slen;
 }
 
+/** Decode a list of pairs written by fr_internal_encode_list()
+ *
+ * Most stored pairs are top level leaf attributes with one byte type and
+ * length fields.  Those are decoded directly, without going through the
+ * general decoder.
+ *
+ * @param[in] ctx		to allocate the pairs in.
+ * @param[out] out		List to append the decoded pairs to.
+ * @param[in] dict		to resolve attribute numbers in.
+ * @param[in] data		to decode.
+ * @param[in] data_len		Length of data.
+ * @param[in] decoder_ctx	Additional data, passed to the pair decoder.
+ * @return
+ *	- The number of bytes consumed.
+ *	- <0 on error.  Any pairs already decoded are freed, and out is
+ *	  left unmodified.
+ */
+ssize_t fr_internal_decode_list(TALLOC_CTX *ctx, VALUE_PAIR **out, fr_dict_t const *dict,
+				uint8_t const *data, size_t data_len, void *decoder_ctx)
+{
+	fr_dict_attr_t const	*root = fr_dict_root(dict);
+	uint8_t const		*p = data, *end = data + data_len;
+	VALUE_PAIR		*head = NULL, **tail = &head;
+	ssize_t			slen;
+
+	if (data_len < 1) {
+		fr_strerror_printf("%s: Insufficient data", __FUNCTION__);
+		return -1;
+	}
+
+	if (*p != FR_INTERNAL_VERSION) {
+		fr_strerror_printf("%s: Unsupported encoding version %u, expected %u",
+				   __FUNCTION__, *p, FR_INTERNAL_VERSION);
+		return -1;
+	}
+	p++;
+
+	while (p < end) {
+		fr_pair_list_t		tmp;
+		fr_dict_attr_t const	*da;
+
+		memset(&tmp, 0, sizeof(tmp));
+
+		/*
+		 *	Single byte type and length, and no
+		 *	extension byte.
+		 */
+		if (((end - p) >= 3) &&
+		    ((p[0] & (FR_INTERNAL_MASK_TYPE | FR_INTERNAL_MASK_LEN | FR_INTERNAL_FLAG_EXTENDED)) == 0) &&
+		    ((size_t)(end - p) >= ((size_t)p[2] + 3)) &&
+		    (da = fr_dict_attr_child_by_num(root, p[1])) &&
+		    !da->flags.is_unknown) switch (da->type) {
+		case FR_TYPE_VALUE:
+			slen = internal_decode_pair_value(ctx, &tmp, da, p + 3, p + 3 + p[2],
+							  (p[0] & FR_INTERNAL_FLAG_TAINTED) != 0, decoder_ctx);
+			if (slen < 0) goto error;
+			p += p[2] + 3;
+			goto next;
+
+		default:
+			break;
+		}
+
+		slen = internal_decode_pair(ctx, &tmp, root, p, end, decoder_ctx);
+		if (slen <= 0) {
+		error:
+			fr_pair_list_free(&head);
+			return slen < 0 ? slen - (p - data) : -(p - data) - 1;
+		}
+		p += slen;
+
+	next:
+		*tail = tmp.slist;
+		while (*tail) tail = &(*tail)->next;
+	}
+
+	fr_pair_add(out, head);
+
+	return p - data;
+}
+
 /*
  *	Test points
  */
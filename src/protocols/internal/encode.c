@@ -315,6 +315,47 @@ ssize_t fr_internal_encode_pair(uint8_t *out, size_t outlen, fr_cursor_t *cursor
 	return fr_internal_encode_pair_dbuff(&FR_DBUFF_TMP(out, outlen), cursor, encoder_ctx);
 }
 
+/** Encode a list of pairs, for storage outside of the server
+ *
+ * The pairs are preceded by a single byte giving the version of the
+ * encoding, so that stored data written by another version of the
+ * server can be recognised, and rejected.
+ *
+ * @param[out] out		Where to write encoded data.
+ * @param[in] outlen		Length of the out buffer.
+ * @param[in] vps		List of pairs to encode.
+ * @param[in] encoder_ctx	Additional data, passed to the pair encoder.
+ * @return
+ *	- >0 The number of bytes written to out.
+ *	- <0 an error occurred.
+ */
+ssize_t fr_internal_encode_list(uint8_t *out, size_t outlen, VALUE_PAIR *vps, void *encoder_ctx)
+{
+	uint8_t		*p = out, *end = out + outlen;
+	fr_cursor_t	cursor;
+	ssize_t		slen;
+
+	CHECK_FREESPACE(outlen, 1);
+	*p++ = FR_INTERNAL_VERSION;
+
+	fr_cursor_init(&cursor, &vps);
+	while (fr_cursor_current(&cursor)) {
+		slen = fr_internal_encode_pair(p, end - p, &cursor, encoder_ctx);
+		if (slen < 0) return slen - (p - out);
+
+		/*
+		 *	Nothing encoded, don't loop forever.
+		 */
+		if (slen == 0) {
+			fr_cursor_next(&cursor);
+			continue;
+		}
+		p += slen;
+	}
+
+	return p - out;
+}
+
 /*
  *	Test points
  */
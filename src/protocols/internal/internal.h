@@ -33,6 +33,12 @@
  */
 #define FR_INTERNAL_FLAG_INTERNAL	0x80
 
+/*
+ *	First byte of an encoded list.  Incremented whenever
+ *	the encoding changes incompatibly.
+ */
+#define FR_INTERNAL_VERSION		1
+
 /*
  * $Id$
  *
@@ -46,3 +52,8 @@ ssize_t fr_internal_encode_pair(uint8_t *out, size_t outlen, fr_cursor_t *cursor
 
 ssize_t fr_internal_decode_pair(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_t const *dict,
 				uint8_t const *data, size_t data_len, void *decoder_ctx);
+
+ssize_t fr_internal_encode_list(uint8_t *out, size_t outlen, VALUE_PAIR *vps, void *encoder_ctx);
+
+ssize_t fr_internal_decode_list(TALLOC_CTX *ctx, VALUE_PAIR **out, fr_dict_t const *dict,
+				uint8_t const *data, size_t data_len, void *decoder_ctx);
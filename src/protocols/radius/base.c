@@ -343,33 +343,25 @@ invalid:
 	return packet_len;
 }
 
-/** Sign a previously encoded packet
+/** Prepare a previously encoded packet for its Message-Authenticator to be calculated
  *
- * Calculates the request/response authenticator for packets which need it, and fills
- * in the message-authenticator value if the attribute is present in the encoded packet.
+ * Sets the authenticator to the value the HMAC is calculated over, and
+ * zeroes the Message-Authenticator value.
  *
+ * @param[out] msg_p		Where to write a pointer to the Message-Authenticator
+ *				attribute, or NULL if the packet doesn't have one.
  * @param[in,out] packet	(request or response).
  * @param[in] original		request (only if this is a response).
- * @param[in] secret		to sign the packet with.
- * @param[in] secret_len	The length of the secret.
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_sign(uint8_t *packet, uint8_t const *original,
-		   uint8_t const *secret, size_t secret_len)
+static int radius_sign_ma_prepare(uint8_t **msg_p, uint8_t *packet, uint8_t const *original)
 {
 	uint8_t		*msg, *end;
 	size_t		packet_len = (packet[2] << 8) | packet[3];
 
-	/*
-	 *	No real limit on secret length, this is just
-	 *	to catch uninitialised fields.
-	 */
-	if (!fr_cond_assert(secret_len <= UINT16_MAX)) {
-		fr_strerror_printf("Secret is too long.  Expected <= %u, got %zu", UINT16_MAX, secret_len);
-		return -1;
-	}
+	*msg_p = NULL;
 
 	if (packet_len < RADIUS_HEADER_LENGTH) {
 		fr_strerror_printf("Packet must be encoded before calling fr_radius_sign()");
@@ -439,22 +431,23 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 
 		/*
 		 *	Force Message-Authenticator to be zero,
-		 *	calculate the HMAC, and put it into the
-		 *	Message-Authenticator attribute.
+		 *	so the HMAC can be calculated over it.
 		 */
 		memset(msg + 2, 0, RADIUS_AUTH_VECTOR_LENGTH);
-		fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
-		break;
+		*msg_p = msg;
+		return 0;
 	}
 
 	/*
-	 *	Initialize the request authenticator.
+	 *	Check the code here too, so that errors are
+	 *	reported before any hashing is done.
 	 */
 	switch (packet[0]) {
 	case FR_CODE_ACCOUNTING_REQUEST:
 	case FR_CODE_DISCONNECT_REQUEST:
 	case FR_CODE_COA_REQUEST:
-		memset(packet + 4, 0, RADIUS_AUTH_VECTOR_LENGTH);
+	case FR_CODE_ACCESS_REQUEST:
+	case FR_CODE_STATUS_SERVER:
 		break;
 
 	case FR_CODE_ACCESS_ACCEPT:
@@ -471,40 +464,165 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 			fr_strerror_printf("Cannot sign response packet without a request packet");
 			return -1;
 		}
-		memcpy(packet + 4, original + 4, RADIUS_AUTH_VECTOR_LENGTH);
 		break;
 
+	default:
+	bad_packet:
+		fr_strerror_printf("Cannot sign unknown packet code %u", packet[0]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Set the authenticator of a packet to the value its signature is calculated over
+ *
+ * Must be called after the Message-Authenticator has been filled in, and
+ * after #radius_sign_ma_prepare has checked the packet.
+ *
+ * @param[in,out] packet	(request or response).
+ * @param[in] original		request (only if this is a response).
+ * @return
+ *	- true if the authenticator must be set to MD5(packet + secret).
+ *	- false if the packet is already signed.
+ */
+static bool radius_sign_auth_prepare(uint8_t *packet, uint8_t const *original)
+{
+	switch (packet[0]) {
+	case FR_CODE_ACCOUNTING_REQUEST:
+	case FR_CODE_DISCONNECT_REQUEST:
+	case FR_CODE_COA_REQUEST:
+		memset(packet + 4, 0, RADIUS_AUTH_VECTOR_LENGTH);
+		return true;
+
 		/*
 		 *	The Request Authenticator is random numbers.
-		 *	We don't need to sign anything else, so
-		 *	return.
+		 *	We don't need to sign anything else.
 		 */
 	case FR_CODE_ACCESS_REQUEST:
 	case FR_CODE_STATUS_SERVER:
-		return 0;
+		return false;
 
 	default:
-	bad_packet:
-		fr_strerror_printf("Cannot sign unknown packet code %u", packet[0]);
-		return -1;
+		fr_assert(original);
+		memcpy(packet + 4, original + 4, RADIUS_AUTH_VECTOR_LENGTH);
+		return true;
 	}
+}
+
+/** Set the authenticator of a packet to MD5(packet + secret)
+ *
+ */
+static void radius_sign_auth(uint8_t *packet, uint8_t const *secret, size_t secret_len)
+{
+	fr_md5_ctx_t	*md5_ctx;
+
+	md5_ctx = fr_md5_ctx_alloc(true);
+	fr_md5_update(md5_ctx, packet, (packet[2] << 8) | packet[3]);
+	fr_md5_update(md5_ctx, secret, secret_len);
+	fr_md5_final(packet + 4, md5_ctx);
+	fr_md5_ctx_free(&md5_ctx);
+}
+
+/** Sign a previously encoded packet
+ *
+ * Calculates the request/response authenticator for packets which need it, and fills
+ * in the message-authenticator value if the attribute is present in the encoded packet.
+ *
+ * @param[in,out] packet	(request or response).
+ * @param[in] original		request (only if this is a response).
+ * @param[in] secret		to sign the packet with.
+ * @param[in] secret_len	The length of the secret.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_sign(uint8_t *packet, uint8_t const *original,
+		   uint8_t const *secret, size_t secret_len)
+{
+	uint8_t		*msg;
 
 	/*
-	 *	Request / Response Authenticator = MD5(packet + secret)
+	 *	No real limit on secret length, this is just
+	 *	to catch uninitialised fields.
 	 */
-	{
-		fr_md5_ctx_t	*md5_ctx;
-
-		md5_ctx = fr_md5_ctx_alloc(true);
-		fr_md5_update(md5_ctx, packet, packet_len);
-		fr_md5_update(md5_ctx, secret, secret_len);
-		fr_md5_final(packet + 4, md5_ctx);
-		fr_md5_ctx_free(&md5_ctx);
+	if (!fr_cond_assert(secret_len <= UINT16_MAX)) {
+		fr_strerror_printf("Secret is too long.  Expected <= %u, got %zu", UINT16_MAX, secret_len);
+		return -1;
 	}
 
+	if (radius_sign_ma_prepare(&msg, packet, original) < 0) return -1;
+
+	if (msg) fr_hmac_md5(msg + 2, packet, (packet[2] << 8) | packet[3], secret, secret_len);
+
+	if (radius_sign_auth_prepare(packet, original)) radius_sign_auth(packet, secret, secret_len);
+
 	return 0;
 }
 
+/** Sign a batch of previously encoded packets, which all use the same secret
+ *
+ * The same as calling #fr_radius_sign for each packet, but the
+ * Message-Authenticators are calculated together with #fr_hmac_md5_multi,
+ * which is much faster when there are several packets to sign.
+ *
+ * On error, some of the packets may not have been signed.  The caller
+ * should sign each of them with #fr_radius_sign instead, which will
+ * find the bad ones.
+ *
+ * @param[in,out] packets	to sign (requests or responses).
+ * @param[in] originals		requests, one for each packet.  May be NULL
+ *				if all of the packets are requests.
+ * @param[in] num		number of packets.
+ * @param[in] secret		to sign the packets with.
+ * @param[in] secret_len	The length of the secret.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_sign_multi(uint8_t *packets[], uint8_t const *originals[], size_t num,
+			 uint8_t const *secret, size_t secret_len)
+{
+	size_t		i, j, chunk;
+
+	if (!fr_cond_assert(secret_len <= UINT16_MAX)) {
+		fr_strerror_printf("Secret is too long.  Expected <= %u, got %zu", UINT16_MAX, secret_len);
+		return -1;
+	}
+
+	for (i = 0; i < num; i += chunk) {
+		fr_md5_multi_t	msgs[FR_MD5_MULTI_LANES];
+		size_t		num_msgs = 0;
+
+		chunk = ((num - i) < FR_MD5_MULTI_LANES) ? (num - i) : FR_MD5_MULTI_LANES;
+
+		for (j = i; j < (i + chunk); j++) {
+			uint8_t *msg;
+
+			if (radius_sign_ma_prepare(&msg, packets[j], originals ? originals[j] : NULL) < 0) {
+				fr_strerror_printf_push("Failed signing packet %zu", j);
+				return -1;
+			}
+			if (!msg) continue;
+
+			msgs[num_msgs++] = (fr_md5_multi_t){
+				.in = packets[j],
+				.inlen = (packets[j][2] << 8) | packets[j][3],
+				.out = msg + 2
+			};
+		}
+
+		if (num_msgs) fr_hmac_md5_multi(msgs, num_msgs, secret, secret_len);
+
+		for (j = i; j < (i + chunk); j++) {
+			if (radius_sign_auth_prepare(packets[j], originals ? originals[j] : NULL)) {
+				radius_sign_auth(packets[j], secret, secret_len);
+			}
+		}
+	}
+
+	return 0;
+}
 
 /** See if the data pointed to by PTR is a valid RADIUS packet.
  *
@@ -1047,21 +1165,23 @@ ssize_t fr_radius_encode(uint8_t *packet, size_t packet_len, uint8_t const *orig
 	return out_p - packet;
 }
 
-/** Decode a raw RADIUS packet into VPs.
- *
- */
-ssize_t	fr_radius_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len, uint8_t const *original,
-			 char const *secret, UNUSED size_t secret_len, VALUE_PAIR **vps)
+static ssize_t radius_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len, uint8_t const *original,
+			     char const *secret, VALUE_PAIR **vps, bool shallow)
 {
 	ssize_t			slen;
 	fr_cursor_t		cursor;
 	uint8_t const		*attr, *end;
-	fr_radius_ctx_t		packet_ctx;
+	fr_radius_ctx_t		packet_ctx = { 0 };
 
 	packet_ctx.tmp_ctx = talloc_init_const("tmp");
 	packet_ctx.secret = secret;
 	packet_ctx.vector = original ? original + 4 : packet + 4;
 
+	if (shallow) {
+		packet_ctx.shallow_start = packet;
+		packet_ctx.shallow_end = packet + packet_len;
+	}
+
 	fr_cursor_init(&cursor, vps);
 
 	attr = packet + 20;
@@ -1098,6 +1218,28 @@ ssize_t	fr_radius_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_l
 	return packet_len;
 }
 
+/** Decode a raw RADIUS packet into VPs.
+ *
+ */
+ssize_t	fr_radius_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len, uint8_t const *original,
+			 char const *secret, UNUSED size_t secret_len, VALUE_PAIR **vps)
+{
+	return radius_decode(ctx, packet, packet_len, original, secret, vps, false);
+}
+
+/** Decode a raw RADIUS packet into VPs, without copying octets values
+ *
+ *  Attributes of type octets point directly into the packet, and are
+ *  only copied if they're changed.  The packet MUST NOT be freed or
+ *  modified until all of the VPs have been freed.
+ */
+ssize_t	fr_radius_decode_shallow(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len,
+				 uint8_t const *original, char const *secret, UNUSED size_t secret_len,
+				 VALUE_PAIR **vps)
+{
+	return radius_decode(ctx, packet, packet_len, original, secret, vps, true);
+}
+
 int fr_radius_init(void)
 {
 	if (instance_count > 0) {
@@ -1449,6 +1449,16 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dic
 		 *	doesn't.  Therefor it's malformed.
 		 */
 		if (parent->flags.length && (data_len != parent->flags.length)) goto raw;
+
+		/*
+		 *	If the value is in the packet, and not in a
+		 *	temporary buffer, just point to it.
+		 */
+		if (packet_ctx->shallow_start &&
+		    (p >= packet_ctx->shallow_start) && ((p + data_len) <= packet_ctx->shallow_end)) {
+			fr_value_box_memdup_shallow(&vp->data, vp->da, p, data_len, true);
+			break;
+		}
 		FALL_THROUGH;
 
 	case FR_TYPE_STRING:
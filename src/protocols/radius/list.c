@@ -119,12 +119,14 @@ typedef struct {
 
 	int		proto;
 
-	uint8_t		id[32];
+	uint64_t	id[4];		//!< Bitmap of the IDs in use.
 } fr_packet_socket_t;
 
+#define ID_WORD(_id) (((_id) >> 6) & 0x03)
+#define ID_BIT(_id) ((uint64_t)1 << ((_id) & 0x3f))
 
 #define FNV_MAGIC_PRIME (0x01000193)
-#define MAX_SOCKETS (256)
+#define MAX_SOCKETS (1024)
 #define SOCKOFFSET_MASK (MAX_SOCKETS - 1)
 #define SOCK2OFFSET(sockfd) ((sockfd * FNV_MAGIC_PRIME) & SOCKOFFSET_MASK)
 
@@ -138,6 +140,7 @@ struct fr_packet_list_s {
 	int		alloc_id;
 	uint32_t	num_outgoing;
 	int		last_recv;
+	int		last_alloc;	//!< Socket we last allocated an ID from.
 	int		num_sockets;
 
 	fr_packet_socket_t sockets[MAX_SOCKETS];
@@ -433,6 +436,42 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 }
 
 
+/** Allocate a free ID from a socket
+ *
+ * Finds the first free ID in a random word of the bitmap, starting from
+ * a random position, so that IDs are still hard to predict.
+ *
+ * @return
+ *	- The ID.
+ *	- -1 if all IDs are in use.
+ */
+static int fr_packet_socket_id_alloc(fr_packet_socket_t *ps)
+{
+	uint32_t	start = fr_rand();
+	int		i;
+
+	for (i = 0; i < 4; i++) {
+		int		word = (start + i) & 0x03;
+		unsigned int	rot = (start >> 2) & 0x3f;
+		uint64_t	avail = ~ps->id[word];
+		int		bit;
+
+		if (!avail) continue;
+
+		/*
+		 *	Rotate so that the search starts at bit "rot".
+		 */
+		if (rot) avail = (avail >> rot) | (avail << (64 - rot));
+
+		bit = (fr_high_bit_pos(avail & -avail) - 1 + rot) & 0x3f;
+		ps->id[word] |= (uint64_t)1 << bit;
+
+		return (word << 6) | bit;
+	}
+
+	return -1;
+}
+
 /*
  *	1 == ID was allocated & assigned
  *	0 == couldn't allocate ID.
@@ -455,7 +494,7 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 			    RADIUS_PACKET **request_p, void **pctx)
 {
-	int i, j, k, fd, id, start_i, start_j, start_k;
+	int i, fd, id, start_i;
 	int src_any = 0;
 	fr_packet_socket_t *ps= NULL;
 	RADIUS_PACKET *request = *request_p;
@@ -499,19 +538,17 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	 *	Id's only when all responses have been received, OR after
 	 *	a timeout.
 	 *
-	 *	Right now, the random approach is almost OK... it's
-	 *	brute-force over all of the available ID's, BUT using
-	 *	random numbers for everything spreads the load a bit.
-	 *
-	 *	The old method had a hash lookup on allocation AND
-	 *	on free.  The new method has brute-force on allocation,
-	 *	and near-zero cost on free.
+	 *	Sockets are searched starting from the last one we
+	 *	allocated from, which will usually have free IDs,
+	 *	and finding a free ID in a socket is a few bit
+	 *	operations on its bitmap.  Allocation and free are
+	 *	both O(1) until the socket fills up.
 	 */
 
 	id = fd = -1;
 	if (request->id >= 0 && request->id < 256)
 		id = request->id;
-	start_i = fr_rand() & SOCKOFFSET_MASK;
+	start_i = pl->last_alloc;
 
 #define ID_i ((i + start_i) & SOCKOFFSET_MASK)
 	for (i = 0; i < MAX_SOCKETS; i++) {
@@ -597,39 +634,20 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 		 */
 
 		if (id != -1) {
-			if  ((ps->id[(id >> 3) & 0x1f] & (1 << (id & 0x07))) != 0) continue;
+			if ((ps->id[ID_WORD(id)] & ID_BIT(id)) != 0) continue;
 
-			ps->id[(id >> 3) & 0x1f] |= (1 << (id & 0x07));
-			fd = i;
+			ps->id[ID_WORD(id)] |= ID_BIT(id);
+			fd = ID_i;
 			break;
 		}
 
-		/*
-		 *	Look for a free Id, starting from a random number.
-		 */
-		start_j = fr_rand() & 0x1f;
-#define ID_j ((j + start_j) & 0x1f)
-		for (j = 0; j < 32; j++) {
-			if (ps->id[ID_j] == 0xff) continue;
-
-
-			start_k = fr_rand() & 0x07;
-#define ID_k ((k + start_k) & 0x07)
-			for (k = 0; k < 8; k++) {
-				if ((ps->id[ID_j] & (1 << ID_k)) != 0) continue;
-
-				ps->id[ID_j] |= (1 << ID_k);
-				id = (ID_j * 8) + ID_k;
-				fd = i;
-				break;
-			}
-			if (fd >= 0) break;
-		}
-#undef ID_i
-#undef ID_j
-#undef ID_k
+		id = fr_packet_socket_id_alloc(ps);
+		if (id < 0) continue;	/* paranoia, num_outgoing says there's room */
+
+		fd = ID_i;
 		break;
 	}
+#undef ID_i
 
 	/*
 	 *	Ask the caller to allocate a new ID.
@@ -638,6 +656,7 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 		fr_strerror_printf("Failed finding socket, caller must allocate a new one");
 		return false;
 	}
+	pl->last_alloc = fd;
 
 	/*
 	 *	Set the ID, source IP, and source port.
@@ -662,7 +681,7 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	 *	Mark the ID as free.  This is the one line from
 	 *	id_free() that we care about here.
 	 */
-	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	ps->id[ID_WORD(request->id)] &= ~ID_BIT(request->id);
 
 	request->id = -1;
 	request->sockfd = -1;
@@ -688,7 +707,7 @@ bool fr_packet_list_id_free(fr_packet_list_t *pl,
 	ps = fr_socket_find(pl, request->sockfd);
 	if (!ps) return false;
 
-	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	ps->id[ID_WORD(request->id)] &= ~ID_BIT(request->id);
 
 	ps->num_outgoing--;
 	pl->num_outgoing--;
@@ -96,11 +96,15 @@ size_t		fr_radius_attr_len(VALUE_PAIR const *vp);
 
 int		fr_radius_sign(uint8_t *packet, uint8_t const *original,
 			       uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
+int		fr_radius_sign_multi(uint8_t *packets[], uint8_t const *originals[], size_t num,
+				     uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,4));
 int		fr_radius_verify(uint8_t *packet, uint8_t const *original,
 				 uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
 bool		fr_radius_ok(uint8_t const *packet, size_t *packet_len_p,
 			     uint32_t max_attributes, bool require_ma, decode_fail_t *reason) CC_HINT(nonnull (1,2));
 
+ssize_t		fr_radius_tcp_packet_len(uint8_t const *data, size_t data_len) CC_HINT(nonnull);
+
 ssize_t		fr_radius_ascend_secret(uint8_t *out, size_t outlen, uint8_t const *in, size_t inlen,
 					char const *secret, uint8_t const *vector);
 
@@ -112,6 +116,10 @@ ssize_t		fr_radius_encode(uint8_t *packet, size_t packet_len, uint8_t const *ori
 ssize_t		fr_radius_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len, uint8_t const *original,
 				 char const *secret, UNUSED size_t secret_len, VALUE_PAIR **vps) CC_HINT(nonnull(1,2,5,7));
 
+ssize_t		fr_radius_decode_shallow(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len,
+					 uint8_t const *original, char const *secret, size_t secret_len,
+					 VALUE_PAIR **vps) CC_HINT(nonnull(1,2,5,7));
+
 int		fr_radius_init(void);
 
 void		fr_radius_free(void);
@@ -147,6 +155,10 @@ typedef struct {
 	fr_fast_rand_t		rand_ctx;		//!< for tunnel passwords
 	int			salt_offset;		//!< for tunnel passwords
 	bool 			tunnel_password_zeros;
+
+	uint8_t const		*shallow_start;		//!< octets values which lie between shallow_start
+	uint8_t const		*shallow_end;		//!< and shallow_end point to the packet, instead
+							///< of being copied.
 } fr_radius_ctx_t;
 
 /*
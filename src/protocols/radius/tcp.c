@@ -28,6 +28,50 @@ RCSID("$Id$")
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/server/tcp.h>
 
+/** Find the length of the first RADIUS packet in a stream buffer
+ *
+ *  This lets stream readers frame packets in place, and return all
+ *  of the complete packets from one read.
+ *
+ * @param[in] data	the start of the buffer.  It MUST start with a
+ *			RADIUS packet.
+ * @param[in] data_len	how much data is in the buffer.
+ * @return
+ *	- <0 if the data isn't RADIUS.
+ *	- 0 if there isn't a complete packet in the buffer.
+ *	- >0 the length of the first packet.
+ */
+ssize_t fr_radius_tcp_packet_len(uint8_t const *data, size_t data_len)
+{
+	size_t packet_len;
+
+	if (data_len == 0) return 0;
+
+	if ((data[0] == 0) || (data[0] >= FR_RADIUS_MAX_PACKET_CODE)) {
+		fr_strerror_printf("Invalid packet code %d", data[0]);
+		return -1;
+	}
+
+	if (data_len < 4) return 0;
+
+	packet_len = (data[2] << 8) | data[3];
+	if (packet_len < RADIUS_HEADER_LENGTH) {
+		fr_strerror_printf("Packet length %zu is smaller than RFC minimum of %d bytes",
+				   packet_len, RADIUS_HEADER_LENGTH);
+		return -1;
+	}
+
+	if (packet_len > RADIUS_MAX_PACKET_SIZE) {
+		fr_strerror_printf("Packet length %zu is larger than RFC maximum of %d bytes",
+				   packet_len, RADIUS_MAX_PACKET_SIZE);
+		return -1;
+	}
+
+	if (data_len < packet_len) return 0;
+
+	return packet_len;
+}
+
 RADIUS_PACKET *fr_tcp_recv(int sockfd, int flags)
 {
 	RADIUS_PACKET *packet = fr_radius_alloc(NULL, false);
@@ -23,6 +23,7 @@
  * @copyright 2017 The FreeRADIUS server project
  * @copyright 2017 Network RADIUS SARL (legal@networkradius.com)
  */
+#include <freeradius-devel/io/test_point.h>
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/util/net.h>
 #include <freeradius-devel/server/base.h>
@@ -122,6 +123,21 @@ uint32_t tacacs_session_id(RADIUS_PACKET const * const packet)
 	return vp->vp_uint32;
 }
 
+/** Whether the client wants to send multiple sessions over one connection
+ *
+ * Sessions sent in single-connection mode may be interleaved, and the
+ * replies to them may be sent in any order.  They are told apart by
+ * their session_id.
+ */
+bool tacacs_single_connect(RADIUS_PACKET const * const packet)
+{
+	fr_tacacs_packet_t const *pkt = (fr_tacacs_packet_t const *)packet->data;
+
+	if (!pkt || (packet->data_len < sizeof(fr_tacacs_packet_hdr_t))) return false;
+
+	return (pkt->hdr.flags & TAC_PLUS_SINGLE_CONNECT_FLAG) != 0;
+}
+
 static bool tacacs_packet_verify(RADIUS_PACKET const * const packet, bool from_client)
 {
 	fr_tacacs_packet_t *pkt = (fr_tacacs_packet_t *)packet->data;
@@ -458,6 +474,7 @@ int fr_tacacs_packet_send(RADIUS_PACKET * const packet, RADIUS_PACKET const * co
 	tacacs_type_t		type;
 	uint8_t			seq_no;
 	VALUE_PAIR 		*vp;
+	size_t			written;
 
 	vp = fr_pair_find_by_da(original->vps, attr_tacacs_version_minor, TAG_ANY);
 	if (!vp) {
@@ -506,15 +523,43 @@ int fr_tacacs_packet_send(RADIUS_PACKET * const packet, RADIUS_PACKET const * co
 
 	fr_assert(tacacs_packet_verify(packet, false) == true);
 
+	/*
+	 *	We can always handle multiple sessions on one
+	 *	connection, as each session is a separate request.  So
+	 *	if the client asks for single-connection mode, agree to
+	 *	it.  The client then keeps the connection open for
+	 *	later sessions, instead of opening a new one each time.
+	 */
+	if (tacacs_single_connect(original)) {
+		((fr_tacacs_packet_t *)packet->data)->hdr.flags |= TAC_PLUS_SINGLE_CONNECT_FLAG;
+	}
+
 	if (tacacs_xor(packet, secret, secret_len) < 0) {
 		fr_strerror_printf("Failed encryption of TACACS reply: %s", fr_syserror(errno));
 		return -1;
 	}
 
 	/*
-	 *	@fixme: EINTR and retry
+	 *	Replies to sessions on the same connection may be sent
+	 *	in any order, but each one MUST be written whole, or
+	 *	the client will lose track of where the next one
+	 *	starts.
 	 */
-	return write(packet->sockfd, packet->data, packet->data_len);
+	written = 0;
+	while (written < packet->data_len) {
+		ssize_t len;
+
+		len = write(packet->sockfd, packet->data + written, packet->data_len - written);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+
+			fr_strerror_printf("Failed writing TACACS reply: %s", fr_syserror(errno));
+			return -1;
+		}
+		written += len;
+	}
+
+	return written;
 }
 
 int fr_tacacs_init(void)
@@ -529,3 +574,107 @@ void fr_tacacs_free(void)
 {
 	fr_dict_autofree(libfreeradius_tacacs_dict);
 }
+
+static int _test_ctx_free(UNUSED void *ctx)
+{
+	fr_tacacs_free();
+
+	return 0;
+}
+
+static int test_ctx(void **out, TALLOC_CTX *ctx)
+{
+	void *test_ctx;
+
+	if (fr_tacacs_init() < 0) return -1;
+
+	test_ctx = talloc_zero(ctx, uint8_t);
+	if (!test_ctx) return -1;
+
+	talloc_set_destructor(test_ctx, _test_ctx_free);
+
+	*out = test_ctx;
+
+	return 0;
+}
+
+/*
+ *	Test points for protocol encode / decode
+ *
+ *	There's no shared secret, so only unencrypted packets can
+ *	be decoded, and packets are encoded without encryption.
+ */
+static ssize_t fr_tacacs_decode_proto(TALLOC_CTX *ctx, VALUE_PAIR **vps, uint8_t const *data, size_t data_len,
+				      UNUSED void *proto_ctx)
+{
+	RADIUS_PACKET	*packet;
+
+	if ((data_len < sizeof(fr_tacacs_packet_hdr_t)) ||
+	    ((fr_net_to_uint32(data + offsetof(fr_tacacs_packet_hdr_t, length)) +
+	      sizeof(fr_tacacs_packet_hdr_t)) != data_len)) {
+		fr_strerror_printf("Packet length doesn't match header");
+		return -1;
+	}
+
+	packet = fr_radius_alloc(NULL, false);
+	if (!packet) return -1;
+
+	packet->data = talloc_memdup(packet, data, data_len);
+	if (!packet->data) {
+	error:
+		talloc_free(packet);
+		return -1;
+	}
+	packet->data_len = data_len;
+
+	if ((tacacs_xor(packet, NULL, 0) < 0) || !tacacs_packet_verify(packet, true) ||
+	    (fr_tacacs_packet_decode(packet) < 0)) goto error;
+
+	if (fr_pair_list_copy(ctx, vps, packet->vps) < 0) goto error;
+	talloc_free(packet);
+
+	return data_len;
+}
+
+extern fr_test_point_proto_decode_t tacacs_tp_decode_proto;
+fr_test_point_proto_decode_t tacacs_tp_decode_proto = {
+	.test_ctx	= test_ctx,
+	.func		= fr_tacacs_decode_proto
+};
+
+static ssize_t fr_tacacs_encode_proto(UNUSED TALLOC_CTX *ctx, VALUE_PAIR *vps, uint8_t *data, size_t data_len,
+				      UNUSED void *proto_ctx)
+{
+	RADIUS_PACKET	*packet;
+	ssize_t		slen;
+
+	packet = fr_radius_alloc(NULL, false);
+	if (!packet) return -1;
+
+	packet->vps = vps;
+	if (fr_tacacs_packet_encode(packet, NULL, 0) < 0) {
+	error:
+		packet->vps = NULL;
+		talloc_free(packet);
+		return -1;
+	}
+
+	if (packet->data_len > data_len) {
+		fr_strerror_printf("Output buffer too small, need %zu bytes", packet->data_len);
+		goto error;
+	}
+
+	memcpy(data, packet->data, packet->data_len);
+	slen = packet->data_len;
+
+	packet->vps = NULL;
+	talloc_free(packet);
+
+	return slen;
+}
+
+extern fr_test_point_proto_encode_t tacacs_tp_encode_proto;
+fr_test_point_proto_encode_t tacacs_tp_encode_proto = {
+	.test_ctx	= test_ctx,
+	.func		= fr_tacacs_encode_proto
+};
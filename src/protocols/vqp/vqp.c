@@ -25,6 +25,7 @@
 
 RCSID("$Id$")
 
+#include <freeradius-devel/io/test_point.h>
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/util/udp.h>
 #include <freeradius-devel/protocol/vmps/vmps.h>
@@ -314,7 +315,7 @@ ssize_t fr_vqp_encode(uint8_t *buffer, size_t buflen, uint8_t const *original,
 		/*
 		 *	Skip non-VMPS attributes/
 		 */
-		if (!((vp->da->attr >= 0x2c01) && (vp->da->attr <= 0x2c08))) goto next;
+		if (!((vp->da->attr >= 0x0c01) && (vp->da->attr <= 0x0c08))) goto next;
 
 		if (attr >= (buffer + buflen)) break;
 
@@ -538,3 +539,79 @@ void fr_vqp_print_hex(FILE *fp, uint8_t const *packet, size_t packet_len)
 		print_hex_data(attr + 5, length, 3);
 	}
 }
+
+static int _test_ctx_free(UNUSED void *ctx)
+{
+	fr_vqp_free();
+
+	return 0;
+}
+
+static int test_ctx(void **out, TALLOC_CTX *ctx)
+{
+	void *test_ctx;
+
+	if (fr_vqp_init() < 0) return -1;
+
+	test_ctx = talloc_zero(ctx, uint8_t);
+	if (!test_ctx) return -1;
+
+	talloc_set_destructor(test_ctx, _test_ctx_free);
+
+	*out = test_ctx;
+
+	return 0;
+}
+
+/*
+ *	Test points for protocol encode / decode
+ *
+ *	VQP attributes are flat, so we don't have test points for
+ *	pair encode / decode.
+ */
+static ssize_t fr_vqp_decode_proto(TALLOC_CTX *ctx, VALUE_PAIR **vps, uint8_t const *data, size_t data_len,
+				   UNUSED void *proto_ctx)
+{
+	size_t packet_len = data_len;
+
+	if (!fr_vqp_ok(data, &packet_len)) return -1;
+
+	if (fr_vqp_decode(ctx, data, packet_len, vps, NULL) < 0) return -1;
+
+	return packet_len;
+}
+
+extern fr_test_point_proto_decode_t vqp_tp_decode_proto;
+fr_test_point_proto_decode_t vqp_tp_decode_proto = {
+	.test_ctx	= test_ctx,
+	.func		= fr_vqp_decode_proto
+};
+
+/*
+ *	Responses copy the sequence number from the request, so
+ *	we make up a request with the sequence number we were given.
+ */
+static ssize_t fr_vqp_encode_proto(UNUSED TALLOC_CTX *ctx, VALUE_PAIR *vps, uint8_t *data, size_t data_len,
+				   UNUSED void *proto_ctx)
+{
+	VALUE_PAIR	*vp;
+	uint8_t		original[FR_VQP_HDR_LEN] = { 0 };
+	int		code = 1;
+	uint32_t	id = 0;
+
+	vp = fr_pair_find_by_da(vps, attr_packet_type, TAG_ANY);
+	if (vp) code = vp->vp_uint32;
+
+	vp = fr_pair_find_by_da(vps, attr_sequence_number, TAG_ANY);
+	if (vp) id = vp->vp_uint32;
+
+	fr_net_from_uint32(original + 4, id);
+
+	return fr_vqp_encode(data, data_len, original, code, id, vps);
+}
+
+extern fr_test_point_proto_encode_t vqp_tp_encode_proto;
+fr_test_point_proto_encode_t vqp_tp_encode_proto = {
+	.test_ctx	= test_ctx,
+	.func		= fr_vqp_encode_proto
+};
@@ -50,6 +50,7 @@ test: \
 		test.dict	\
 		test.misc	\
 		test.unit	\
+		test.fuzzer	\
 		test.keywords	\
 		test.xlat	\
 		test.map	\
@@ -0,0 +1,50 @@
+#
+#  Benchmarks for the protocol encoders and decoders.
+#
+#  These aren't run by "make test".  "make test.bench" runs every
+#  benchmark, and writes one line per benchmark to
+#  $(BUILD_DIR)/tests/bench/results.txt, which can be compared between
+#  builds.
+#
+
+#
+#  Test name
+#
+TEST := test.bench
+
+#
+#  Get all .txt files
+#
+FILES  := $(call FIND_FILES_SUFFIX,$(DIR),*.txt)
+
+#
+#  Remove our directory prefix, which is needed by the bootstrap function.
+#
+FILES := $(subst $(DIR)/,,$(FILES))
+
+#
+#  Bootstrap the test framework.
+#
+$(eval $(call TEST_BOOTSTRAP))
+
+#
+#  Run each set of benchmarks, saving the results.
+#
+$(OUTPUT)/%: $(DIR)/% $(TEST_BIN_DIR)/unit_test_attribute
+	$(eval DIR:=${top_srcdir}/src/tests/bench)
+	@echo "BENCH $(basename $(notdir $@))"
+	${Q}if ! $(TEST_BIN)/unit_test_attribute -D $(top_srcdir)/share/dictionary -d $(DIR) -r "$@" $< > "$@.out"; then \
+		cat "$@.out"; \
+		echo "$(TEST_BIN)/unit_test_attribute -D $(top_srcdir)/share/dictionary -d $(DIR) -r \"$@\" $<"; \
+		rm -f $(BUILD_DIR)/tests/test.bench; \
+		exit 1; \
+	fi
+
+#
+#  Collect the results, and remove the receipts so that the
+#  benchmarks are run again next time.
+#
+$(TEST):
+	${Q}cat $(addsuffix .out,$(FILES.$(TEST))) > $(OUTPUT.$(TEST))/results.txt
+	${Q}cat $(OUTPUT.$(TEST))/results.txt
+	${Q}rm -f $(FILES.$(TEST)) $(BUILD_DIR)/tests/$@
@@ -0,0 +1,49 @@
+#
+#  Check the cost of decoding the "slow corpus".
+#
+#  Each directory holds inputs for one protocol which were found to be
+#  expensive to decode, e.g. deeply nested TLVs, many fragments, or
+#  long concatenated attributes.  They are decoded with fuzzer_replay,
+#  which fails if any input leaves more than FUZZER_MAX_ALLOCS
+#  allocations, or takes more than FUZZER_MAX_USEC to decode.
+#
+#  The allocation counts are repeatable, and are the real check.  The
+#  time limit is only there to catch gross regressions, and is
+#  generous so that it does not fail on slow or busy machines.
+#
+
+#
+#  Test name
+#
+TEST := test.fuzzer
+
+#
+#  One "file" per protocol.
+#
+FILES := $(subst $(DIR)/,,$(patsubst %/,%,$(dir $(wildcard $(DIR)/*/*))))
+FILES := $(sort $(FILES))
+
+$(eval $(call TEST_BOOTSTRAP))
+
+#
+#  Per-protocol limits, which can be overridden on the command line.
+#
+FUZZER_MAX_ALLOCS.radius	?= 2000
+FUZZER_MAX_ALLOCS.dhcpv4	?= 2000
+FUZZER_MAX_ALLOCS.dhcpv6	?= 2000
+FUZZER_MAX_USEC			?= 50000
+
+#
+#  Decode all of the inputs for one protocol.
+#
+$(OUTPUT)/%: $(DIR)/% $(TEST_BIN_DIR)/fuzzer_replay $(BUILD_DIR)/lib/libfreeradius-%.la
+	$(eval DIR:=${top_srcdir}/src/tests/fuzzer)
+	@echo "FUZZER-COST $(notdir $@)"
+	${Q}if ! $(TEST_BIN)/fuzzer_replay -D $(top_srcdir)/share/dictionary -p $(notdir $@) \
+		-a $(FUZZER_MAX_ALLOCS.$(notdir $@)) -t $(FUZZER_MAX_USEC) $< > $@.log 2>&1; then \
+		cat $@.log; \
+		echo "$(TEST_BIN)/fuzzer_replay -v -D $(top_srcdir)/share/dictionary -p $(notdir $@) -a $(FUZZER_MAX_ALLOCS.$(notdir $@)) -t $(FUZZER_MAX_USEC) $<"; \
+		rm -f $(BUILD_DIR)/tests/test.fuzzer; \
+		exit 1; \
+	fi
+	${Q}touch $@
@@ -0,0 +1 @@
+cache_hash.test:
@@ -0,0 +1,70 @@
+#
+#  Performance tests against a running radiusd.
+#
+#  These aren't run by "make test".  "make test.performance" starts
+#  radiusd for each scenario (*.txt), drives it with "radclient -T"
+#  at a fixed rate, and writes one line of JSON per scenario to
+#  $(BUILD_DIR)/tests/performance/results.json, with throughput,
+#  latency percentiles, CPU time per request, and peak RSS.
+#
+#  If src/tests/performance/baseline.json exists, the results are
+#  compared against it, and the target fails if any scenario has
+#  regressed by more than PERF_TOLERANCE percent.
+#  "make test.performance.baseline" saves the last results as the
+#  new baseline.
+#
+#  The load can be changed with PERF_RATE, PERF_COUNT and
+#  PERF_THREADS, e.g.
+#
+#	make PERF_RATE=20000 PERF_COUNT=200000 test.performance
+#
+
+#
+#  Test name
+#
+TEST := test.performance
+
+#
+#  The scenarios.  The packets/ directory holds the packets they send.
+#
+FILES := $(subst $(DIR)/,,$(wildcard $(DIR)/*.txt))
+
+$(eval $(call TEST_BOOTSTRAP))
+
+PERF_RATE	?= 5000
+PERF_COUNT	?= 50000
+PERF_THREADS	?= 2
+PERF_TOLERANCE	?= 10
+PERF_BASELINE	:= $(DIR)/baseline.json
+
+#
+#  Run one scenario.  The result is a line of JSON.
+#
+$(OUTPUT)/%: $(DIR)/% $(DIR)/bench $(TEST_BIN_DIR)/radiusd $(TEST_BIN_DIR)/radclient
+	$(eval DIR:=${top_srcdir}/src/tests/performance)
+	@echo "PERFORMANCE $(basename $(notdir $@))"
+	${Q}if ! RADIUSD="$(TEST_BIN)/radiusd" RADCLIENT="$(TEST_BIN)/radclient" \
+		PORT=$(PORT) HOME_PORT=$$(($(PORT) + 1)) \
+		PERF_RATE=$(PERF_RATE) PERF_COUNT=$(PERF_COUNT) PERF_THREADS=$(PERF_THREADS) \
+		$(DIR)/bench $< $@; then \
+		echo "PERFORMANCE FAILED $@"; \
+		rm -f $@ $(BUILD_DIR)/tests/test.performance; \
+		exit 1; \
+	fi
+
+#
+#  Collect the results, and compare them against the baseline.  The
+#  receipts are removed so that the scenarios are run again next time.
+#
+$(TEST):
+	${Q}cat $(FILES.$@) > $(OUTPUT.$@)/results.json
+	${Q}cat $(OUTPUT.$@)/results.json
+	${Q}rm -f $(FILES.$@) $(BUILD_DIR)/tests/$@
+	${Q}if [ -e "$(PERF_BASELINE)" ]; then \
+		$(top_srcdir)/src/tests/performance/compare $(PERF_BASELINE) $(OUTPUT.$@)/results.json $(PERF_TOLERANCE); \
+	fi
+
+.PHONY: $(TEST).baseline
+$(TEST).baseline:
+	${Q}cp $(BUILD_DIR)/tests/performance/results.json $(PERF_BASELINE)
+	@echo "Saved $(PERF_BASELINE)"
@@ -27,6 +27,8 @@ RCSID("$Id$")
 #include <string.h>
 #include <sys/time.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/time.h>
+#include <pthread.h>
 
 #ifdef HAVE_GETOPT_H
 #	include <getopt.h>
@@ -36,6 +38,13 @@ RCSID("$Id$")
 
 static int		debug_lvl = 0;
 
+/*
+ *	For the contention benchmark.
+ */
+static fr_atomic_queue_t *bench_aq;
+static int		bench_batch = 1;
+static int		bench_count = 1000000;
+
 
 /**********************************************************************/
 typedef struct fr_request_s REQUEST;
@@ -66,16 +75,101 @@ int talloc_const_free(void const *ptr)
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: atomic_queue_test [OPTS]\n");
+	fprintf(stderr, "  -b batch               push / pop this many entries at a time in the benchmark.\n");
+	fprintf(stderr, "  -c count               number of entries each producer pushes in the benchmark.\n");
 	fprintf(stderr, "  -s size                set queue size.\n");
+	fprintf(stderr, "  -t threads             run a benchmark with this many producers (and consumers).\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
 	fr_exit_now(EXIT_SUCCESS);
 }
 
+static void *bench_producer(UNUSED void *arg)
+{
+	void	*data[256];
+	int	i, sent = 0;
+
+	for (i = 0; i < bench_batch; i++) data[i] = (void *) (intptr_t) (i + OFFSET);
+
+	while (sent < bench_count) {
+		size_t num = bench_batch;
+
+		if ((bench_count - sent) < bench_batch) num = bench_count - sent;
+
+		if (bench_batch == 1) {
+			if (fr_atomic_queue_push(bench_aq, data[0])) sent++;
+			continue;
+		}
+
+		sent += fr_atomic_queue_push_n(bench_aq, data, num);
+	}
+
+	return NULL;
+}
+
+static void *bench_consumer(UNUSED void *arg)
+{
+	void	*data[256];
+	int	received = 0;
+
+	while (received < bench_count) {
+		size_t num = bench_batch;
+
+		if ((bench_count - received) < bench_batch) num = bench_count - received;
+
+		if (bench_batch == 1) {
+			if (fr_atomic_queue_pop(bench_aq, &data[0])) received++;
+			continue;
+		}
+
+		received += fr_atomic_queue_pop_n(bench_aq, data, num);
+	}
+
+	return NULL;
+}
+
+/** Push and pop through one queue from many threads, and print the throughput
+ *
+ */
+static void bench(TALLOC_CTX *ctx, int size, int threads)
+{
+	int		i;
+	pthread_t	*producers, *consumers;
+	fr_time_t	start, end;
+
+	bench_aq = fr_atomic_queue_alloc(ctx, size);
+	producers = talloc_array(ctx, pthread_t, threads);
+	consumers = talloc_array(ctx, pthread_t, threads);
+
+	start = fr_time();
+
+	for (i = 0; i < threads; i++) {
+		if ((pthread_create(&consumers[i], NULL, bench_consumer, NULL) != 0) ||
+		    (pthread_create(&producers[i], NULL, bench_producer, NULL) != 0)) {
+			fprintf(stderr, "Failed creating thread\n");
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(producers[i], NULL);
+		pthread_join(consumers[i], NULL);
+	}
+
+	end = fr_time();
+
+	printf("%d producer(s), %d consumer(s), batch %d: %d entries in %.3fs, %.0f entries/s\n",
+	       threads, threads, bench_batch, threads * bench_count,
+	       (double) (end - start) / NSEC,
+	       ((double) threads * bench_count * NSEC) / (double) (end - start));
+}
+
 int main(int argc, char *argv[])
 {
 	int			c, i, rcode = 0;
-	int			size;
+	int			size, threads = 0;
+	size_t			num;
+	void			*batch[4];
 	intptr_t		val;
 	void			*data;
 	fr_atomic_queue_t	*aq;
@@ -83,11 +177,24 @@ int main(int argc, char *argv[])
 
 	size = 4;
 
-	while ((c = getopt(argc, argv, "hs:tx")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "b:c:hs:t:x")) != -1) switch (c) {
+		case 'b':
+			bench_batch = atoi(optarg);
+			if ((bench_batch < 1) || (bench_batch > 256)) usage();
+			break;
+
+		case 'c':
+			bench_count = atoi(optarg);
+			break;
+
 		case 's':
 			size = atoi(optarg);
 			break;
 
+		case 't':
+			threads = atoi(optarg);
+			break;
+
 		case 'x':
 			debug_lvl++;
 			break;
@@ -101,6 +208,11 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
+	if (threads > 0) {
+		bench(autofree, size, threads);
+		return 0;
+	}
+
 	aq = fr_atomic_queue_alloc(autofree, size);
 
 #ifndef NDEBUG
@@ -190,6 +302,51 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+	/*
+	 *	Push and pop in batches.  The pushes should stop
+	 *	when the queue is full.
+	 */
+	for (i = 0; i < size; i += num) {
+		int j;
+
+		for (j = 0; j < 4; j++) batch[j] = (void *) (intptr_t) (i + j + OFFSET);
+
+		num = fr_atomic_queue_push_n(aq, batch, 4);
+		if (!num || (num > 4) || (((size - i) >= 4) && (num != 4))) {
+			fprintf(stderr, "Failed batch pushing at %d, pushed %zu\n", i, num);
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	if (fr_atomic_queue_push_n(aq, batch, 4) != 0) {
+		fprintf(stderr, "Batch pushed an entry past the end of the queue.");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < size; i += num) {
+		int j;
+
+		num = fr_atomic_queue_pop_n(aq, batch, 4);
+		if (!num) {
+			fprintf(stderr, "Failed batch popping at %d\n", i);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		for (j = 0; j < (int) num; j++) {
+			val = (intptr_t) batch[j];
+			if (val != (i + j + OFFSET)) {
+				fprintf(stderr, "Batch pop expected %d, got %d\n",
+					i + j + OFFSET, (int) val);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (fr_atomic_queue_pop_n(aq, batch, 4) != 0) {
+		fprintf(stderr, "Batch popped an entry past the end of the queue.");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
 	return rcode;
 }
 
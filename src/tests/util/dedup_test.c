@@ -0,0 +1,303 @@
+/*
+ * dedup_test.c	Tests and benchmarks for the packet dedup table
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/io/dedup.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/rbtree.h>
+#include <freeradius-devel/util/time.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+/*
+ *	Roughly what master.c tracks for an unconnected RADIUS socket.
+ */
+typedef struct {
+	uint32_t	src_ipaddr;
+	uint16_t	src_port;
+	uint8_t		header[20];	//!< code, ID, length, authenticator
+	uint32_t	hash;
+} dedup_thing;
+
+/**********************************************************************/
+typedef struct fr_request_s REQUEST;
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx);
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request);
+int talloc_const_free(void const *ptr);
+
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx)
+{
+	return NULL;
+}
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request)
+{
+}
+
+int talloc_const_free(void const *ptr)
+{
+	void *tmp;
+	if (!ptr) return 0;
+
+	memcpy(&tmp, &ptr, sizeof(tmp));
+	return talloc_free(tmp);
+}
+/**********************************************************************/
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: dedup_test [OPTS]\n");
+	fprintf(stderr, "  -b                     Benchmark against an rbtree.\n");
+	fprintf(stderr, "  -l lookups             number of packets in the benchmark.\n");
+	fprintf(stderr, "  -n num                 number of tracked packets.\n");
+	fprintf(stderr, "  -r percent             percentage of packets which are retransmits.\n");
+	fprintf(stderr, "  -s sources             number of NAS source addresses.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+/*
+ *	Same order as track_cmp() and proto_radius_udp's mod_compare().
+ */
+static int thing_cmp(void const *one, void const *two)
+{
+	dedup_thing const *a = one, *b = two;
+	int rcode;
+
+	rcode = (a->src_ipaddr < b->src_ipaddr) - (a->src_ipaddr > b->src_ipaddr);
+	if (rcode != 0) return rcode;
+
+	rcode = (a->src_port < b->src_port) - (a->src_port > b->src_port);
+	if (rcode != 0) return rcode;
+
+	rcode = memcmp(a->header + 4, b->header + 4, 16);
+	if (rcode != 0) return rcode;
+
+	rcode = (a->header[1] < b->header[1]) - (a->header[1] > b->header[1]);
+	if (rcode != 0) return rcode;
+
+	return (a->header[0] < b->header[0]) - (a->header[0] > b->header[0]);
+}
+
+static uint32_t thing_hash(dedup_thing const *a)
+{
+	uint32_t hash;
+
+	hash = fr_hash(a->header, 2);
+	hash = fr_hash_update(&a->src_port, sizeof(a->src_port), hash);
+	return fr_hash_update(&a->src_ipaddr, sizeof(a->src_ipaddr), hash);
+}
+
+static void thing_init(dedup_thing *thing, int sources)
+{
+	size_t i;
+
+	thing->src_ipaddr = 0x0a000000 + (fr_rand() % sources);
+	thing->src_port = 1024 + (fr_rand() % 8);
+	thing->header[0] = 1;
+	thing->header[1] = fr_rand() & 0xff;
+	for (i = 4; i < sizeof(thing->header); i++) thing->header[i] = fr_rand() & 0xff;
+	thing->hash = thing_hash(thing);
+}
+
+/*
+ *	Insert, find, and delete, and check the table agrees with
+ *	what we put into it.
+ */
+static void check(TALLOC_CTX *ctx, int num, int sources)
+{
+	fr_dedup_t	*dd;
+	dedup_thing	*array;
+	int		i;
+
+	dd = fr_dedup_alloc(ctx, thing_cmp);
+	array = talloc_zero_array(ctx, dedup_thing, num);
+
+	for (i = 0; i < num; i++) {
+		thing_init(&array[i], sources);
+		if (fr_dedup_find(dd, array[i].hash, &array[i])) {
+			array[i].hash = 0;	/* A real duplicate, don't insert it */
+			continue;
+		}
+
+		if (fr_dedup_insert(dd, array[i].hash, &array[i]) < 0) {
+			fprintf(stderr, "Failed inserting entry %d: %s\n", i, fr_strerror());
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < num; i += 2) {
+		if (!array[i].hash) continue;
+
+		if (!fr_dedup_delete(dd, array[i].hash, &array[i])) {
+			fprintf(stderr, "Failed deleting entry %d\n", i);
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		void *found;
+
+		if (!array[i].hash) continue;
+
+		found = fr_dedup_find(dd, array[i].hash, &array[i]);
+		if ((i & 1) && (found != &array[i])) {
+			fprintf(stderr, "Failed finding entry %d\n", i);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		if (!(i & 1) && found) {
+			fprintf(stderr, "Found deleted entry %d\n", i);
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	talloc_free(dd);
+	talloc_free(array);
+}
+
+/*
+ *	Keep "num" packets tracked.  Each new packet is looked up, and
+ *	most are misses, so they're inserted and the oldest entry is
+ *	deleted.  The rest are retransmits of a tracked packet.
+ */
+static void bench(TALLOC_CTX *ctx, int num, int lookups, int retransmit, int sources)
+{
+	fr_dedup_t	*dd;
+	rbtree_t	*tree;
+	dedup_thing	*initial, *array, *packets;
+	int		i, hits;
+	fr_time_t	start, tree_time, dedup_time;
+
+	initial = talloc_zero_array(ctx, dedup_thing, num);
+	array = talloc_zero_array(ctx, dedup_thing, num);
+	packets = talloc_zero_array(ctx, dedup_thing, lookups);
+
+	for (i = 0; i < num; i++) thing_init(&initial[i], sources);
+
+	for (i = 0; i < lookups; i++) {
+		if ((int) (fr_rand() % 100) < retransmit) {
+			packets[i] = initial[fr_rand() % num];
+		} else {
+			thing_init(&packets[i], sources);
+		}
+	}
+
+	memcpy(array, initial, sizeof(*array) * num);
+	tree = rbtree_alloc(ctx, thing_cmp, NULL, RBTREE_FLAG_NONE);
+	for (i = 0; i < num; i++) rbtree_insert(tree, &array[i]);
+
+	hits = 0;
+	start = fr_time();
+	for (i = 0; i < lookups; i++) {
+		dedup_thing *old;
+
+		if (rbtree_finddata(tree, &packets[i])) {
+			hits++;
+			continue;
+		}
+
+		old = &array[i % num];
+		(void) rbtree_deletebydata(tree, old);
+		*old = packets[i];
+		rbtree_insert(tree, old);
+	}
+	tree_time = fr_time() - start;
+	printf("rbtree: %d packets, %d hits in %.3fs, %.0f packets/s\n", lookups, hits,
+	       (double) tree_time / NSEC, ((double) lookups * NSEC) / (double) tree_time);
+	talloc_free(tree);
+
+	/*
+	 *	Start again with the same packets.
+	 */
+	memcpy(array, initial, sizeof(*array) * num);
+	dd = fr_dedup_alloc(ctx, thing_cmp);
+	for (i = 0; i < num; i++) (void) fr_dedup_insert(dd, array[i].hash, &array[i]);
+
+	hits = 0;
+	start = fr_time();
+	for (i = 0; i < lookups; i++) {
+		dedup_thing *old;
+
+		if (fr_dedup_find(dd, packets[i].hash, &packets[i])) {
+			hits++;
+			continue;
+		}
+
+		old = &array[i % num];
+		(void) fr_dedup_delete(dd, old->hash, old);
+		*old = packets[i];
+		(void) fr_dedup_insert(dd, old->hash, old);
+	}
+	dedup_time = fr_time() - start;
+	printf("dedup:  %d packets, %d hits in %.3fs, %.0f packets/s (%.2fx)\n", lookups, hits,
+	       (double) dedup_time / NSEC, ((double) lookups * NSEC) / (double) dedup_time,
+	       (double) tree_time / (double) dedup_time);
+	talloc_free(dd);
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	int			num = 200000, lookups = 2000000, retransmit = 10, sources = 1000;
+	bool			do_bench = false;
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+
+	while ((c = getopt(argc, argv, "bhl:n:r:s:")) != -1) switch (c) {
+		case 'b':
+			do_bench = true;
+			break;
+
+		case 'l':
+			lookups = atoi(optarg);
+			break;
+
+		case 'n':
+			num = atoi(optarg);
+			break;
+
+		case 'r':
+			retransmit = atoi(optarg);
+			break;
+
+		case 's':
+			sources = atoi(optarg);
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if ((num < 1) || (lookups < 1) || (sources < 1) || (retransmit < 0) || (retransmit > 100)) usage();
+
+	check(autofree, num, sources);
+
+	if (do_bench) bench(autofree, num, lookups, retransmit, sources);
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := dedup_test
+
+SOURCES		:= dedup_test.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io.a libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
@@ -60,6 +60,7 @@ static int		max_messages = 10;
 static int		max_control_plane = 0;
 static int		max_outstanding = 1;
 static bool		touch_memory = false;
+static bool		send_duplicates = false;
 static int		num_workers = 1;
 static bool		quiet = false;
 static fr_schedule_worker_t workers[MAX_WORKERS];
@@ -90,6 +91,7 @@ static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: worker_test [OPTS]\n");
 	fprintf(stderr, "  -c <control-plane>     Size of the control plane queue.\n");
+	fprintf(stderr, "  -d                     Send a duplicate of every message.\n");
 	fprintf(stderr, "  -m <messages>	  Send number of messages.\n");
 	fprintf(stderr, "  -o <outstanding>       Keep number of messages outstanding.\n");
 	fprintf(stderr, "  -q                     quiet - suppresses worker stats.\n");
@@ -154,6 +156,15 @@ static fr_app_io_t app_io = {
 	.decode = test_decode
 };
 
+static void entry_point_set(UNUSED void const *instance, REQUEST *request)
+{
+	request->async->process = test_process;
+}
+
+static fr_app_t test_app = {
+	.entry_point_set = entry_point_set,
+};
+
 static void *worker_thread(void *arg)
 {
 	TALLOC_CTX *ctx;
@@ -204,7 +215,7 @@ static void master_process(void)
 	fr_channel_event_t	ce;
 	pthread_attr_t		attr;
 	fr_schedule_worker_t	*sw;
-	fr_listen_t		listen = { .app_io = &app_io };
+	fr_listen_t		listen = { .app_io = &app_io, .app = &test_app };
 	struct kevent		events[MAX_KEVENTS];
 
 	MEM(ctx = talloc_init_const("master"));
@@ -255,6 +266,14 @@ static void master_process(void)
 
 	MPRINT1("Master created all channels.\n");
 
+	/*
+	 *	The worker discards duplicates without running them,
+	 *	but it still has to tell us that it's done with them.
+	 *	Otherwise num_outstanding never gets back to zero, and
+	 *	we never close the channels.
+	 */
+	listen.track_duplicates = send_duplicates;
+
 	/*
 	 *	Bootstrap the queue with messages.
 	 */
@@ -265,7 +284,7 @@ static void master_process(void)
 	signaled_close = false;
 
 	while (running) {
-		fr_time_t now;
+		fr_time_t now, recv_time;
 		int num_to_send;
 		fr_channel_data_t *cd, *reply;
 
@@ -307,11 +326,53 @@ static void master_process(void)
 
 			memcpy(cd->m.data, &num_messages, sizeof(num_messages));
 
+			cd->request.recv_time = recv_time = cd->m.when;
+			cd->packet_ctx = (void *) (uintptr_t) num_messages;
+
 			MPRINT1("Master sent message %d to worker %d\n", num_messages, which_worker);
 			rcode = fr_channel_send_request(workers[which_worker].ch, cd, &reply);
 			if (rcode < 0) {
 				fprintf(stderr, "Failed sending request: %s\n", fr_syserror(errno));
 			}
+
+			/*
+			 *	Send an identical copy of the message.
+			 *	Depending on timing, the worker sees it
+			 *	either while the original is still
+			 *	active, or after it has replied.  Either
+			 *	way, the copy is discarded.
+			 */
+			if (send_duplicates) {
+				fr_channel_data_t *dup, *dup_reply;
+
+				dup = (fr_channel_data_t *) fr_message_alloc(ms, NULL, 100);
+				fr_assert(dup != NULL);
+
+				num_outstanding++;
+
+				dup->m.when = fr_time();
+				dup->priority = 0;
+				dup->listen = &listen;
+				dup->request.recv_time = recv_time;
+				dup->request.is_dup = true;
+				dup->packet_ctx = (void *) (uintptr_t) num_messages;
+				memcpy(dup->m.data, &num_messages, sizeof(num_messages));
+
+				MPRINT1("Master sent duplicate of message %d to worker %d\n", num_messages, which_worker);
+				if (fr_channel_send_request(workers[which_worker].ch, dup, &dup_reply) < 0) {
+					fprintf(stderr, "Failed sending request: %s\n", fr_syserror(errno));
+					fr_exit_now(EXIT_FAILURE);
+				}
+
+				if (dup_reply) {
+					num_replies++;
+					num_outstanding--;
+					MPRINT1("Master got reply %d, outstanding=%d, %d/%d sent.\n",
+						num_replies, num_outstanding, num_messages, max_messages);
+					fr_message_done(&dup_reply->m);
+				}
+			}
+
 			which_worker++;
 			if (which_worker >= num_workers) which_worker = 0;
 
@@ -492,7 +553,7 @@ int main(int argc, char *argv[])
 
 	fr_log_init(&default_log, false);
 
-	while ((c = getopt(argc, argv, "c:hm:o:qtw:x")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "c:dhm:o:qtw:x")) != -1) switch (c) {
 		case 'x':
 			debug_lvl++;
 			break;
@@ -501,6 +562,10 @@ int main(int argc, char *argv[])
 			max_control_plane = atoi(optarg);
 			break;
 
+		case 'd':
+			send_duplicates = true;
+			break;
+
 		case 'm':
 			max_messages = atoi(optarg);
 			break;